@@ -25,6 +25,13 @@ LOCAL_CFLAGS    := -W -g -DHAVE_CONFIG_H \
 	-I$(LOCAL_PATH) \
 	-I$(LOCAL_PATH)/fwknop \
 	-I$(LOCAL_PATH)/libfwknop
+
+# Let libfko use the ARMv8 crypto extensions (AES, SHA-256) on 64-bit ARM.
+# It still checks that the CPU has them before using them.
+ifeq ($(TARGET_ARCH_ABI),arm64-v8a)
+LOCAL_CFLAGS    += -march=armv8-a+crypto
+endif
+
 LOCAL_SRC_FILES := $(shell cd $(LOCAL_PATH); \
 		find ./fwknop/ -type f -name '*.c'; \
 		find ./libfwknop/ -type f -name '*.c'; \
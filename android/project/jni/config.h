@@ -44,6 +44,13 @@
 /* Path to gpg executable */
 #define GPG_EXE "/usr/bin/gpg"
 
+/* Define if the compiler supports the ARMv8 crypto extensions (AES and
+   SHA-256 instructions), as it does when building for arm64 with them
+   enabled.  libfko still checks the CPU at run time. */
+#if defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES))
+#define HAVE_ARM_CRYPTO 1
+#endif
+
 /* Define to 1 if you have the <arpa/inet.h> header file. */
 #define HAVE_ARPA_INET_H 1
 
@@ -37,6 +37,58 @@ fko_errmsg(char *msg, int res) {
     return(err_msg);
 }
 
+/* HMAC key state kept for the app session, so that knocking again with
+ * the same HMAC key does not process the key again.
+*/
+static fko_hmac_state_t session_hmac_state = NULL;
+static char session_hmac_key[MAX_HMAC_KEY_LEN];
+static int session_hmac_key_len = 0;
+
+static void
+session_clear(void)
+{
+    fko_hmac_state_destroy(session_hmac_state);
+    session_hmac_state = NULL;
+
+    memset(session_hmac_key, 0, sizeof(session_hmac_key));
+    session_hmac_key_len = 0;
+}
+
+/* The session's state for hmac_key, set up now if the key changed.
+ * Returns NULL if it cannot be set up, in which case fko processes the
+ * key itself.
+*/
+static fko_hmac_state_t
+session_hmac_state_get(const char *hmac_key, const int hmac_key_len)
+{
+    if(session_hmac_state != NULL && hmac_key_len == session_hmac_key_len
+            && memcmp(hmac_key, session_hmac_key, hmac_key_len) == 0)
+        return(session_hmac_state);
+
+    session_clear();
+
+    if(hmac_key_len > MAX_HMAC_KEY_LEN
+            || fko_hmac_state_new(&session_hmac_state, hmac_key,
+                hmac_key_len, FKO_DEFAULT_HMAC_MODE) != FKO_SUCCESS)
+    {
+        session_hmac_state = NULL;
+        return(NULL);
+    }
+
+    memcpy(session_hmac_key, hmac_key, hmac_key_len);
+    session_hmac_key_len = hmac_key_len;
+
+    return(session_hmac_state);
+}
+
+/* JNI interface: wipe the session state when the app goes away
+*/
+void Java_com_max2idea_android_fwknop_Fwknop_clearSession(JNIEnv* env,
+        jobject thiz)
+{
+    session_clear();
+}
+
 /* JNI interface: constructs arguments and calls main function
 */
 jstring Java_com_max2idea_android_fwknop_Fwknop_sendSPAPacket(JNIEnv* env,
@@ -156,6 +208,9 @@ jstring Java_com_max2idea_android_fwknop_Fwknop_sendSPAPacket(JNIEnv* env,
             strcpy(res_msg, fko_errmsg("Error setting SPA HMAC type", res));
             goto cleanup;
         }
+
+        fko_set_spa_hmac_state(ctx,
+                session_hmac_state_get(hmac_str, hmac_str_len));
     }
 
     /* Finalize the context data (Encrypt and encode).
@@ -42,6 +42,10 @@
 #define MAX_SERVER_STR_LEN  50
 #define MSG_BUFSIZE         255
 
+/* Longest HMAC key kept in the session cache (fko's MAX_DIGEST_BLOCK_LEN)
+*/
+#define MAX_HMAC_KEY_LEN    128
+
 typedef struct fwknop_options
 {
     char           *spa_server_str;
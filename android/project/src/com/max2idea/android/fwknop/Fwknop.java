@@ -421,6 +421,7 @@ public class Fwknop extends Activity {
     }
 
     public native String sendSPAPacket();
+    public native void clearSession();
 
     @Override
     public void onStop() {
@@ -429,6 +430,7 @@ public class Fwknop extends Activity {
 
     @Override
     public void onDestroy() {
+        clearSession();
         super.onDestroy();
     }
 
@@ -69,6 +69,16 @@ enum {
     SDP_ID,
     SERVICE_IDS,
     DISABLE_SDP_CTRL_CLIENT,
+    FLOOD_FILE,
+    FLOOD_COUNT,
+    FLOOD_RATE,
+    AGENT_SOCK,
+    AGENT_POOL,
+    GATEWAYS,
+    RESOLVE_CACHE_TTL,
+    WAIT_OPEN,
+    WAIT_PORT,
+    TRACE_FILE,
 
     /* Put GPG-related items below the following line */
     GPG_ENCRYPTION      = 0x200,
@@ -93,6 +103,8 @@ static struct option cmd_opts[] =
 {
     {"allow-ip",            1, NULL, 'a'},
     {"access",              1, NULL, 'A'},
+    {"agent",               1, NULL, AGENT_SOCK },
+    {"agent-pool",          1, NULL, AGENT_POOL },
     {"save-packet-append",  0, NULL, 'b'},
     {"save-packet",         1, NULL, 'B'},
     {"save-rc-stanza",      0, NULL, SAVE_RC_STANZA},
@@ -109,6 +121,10 @@ static struct option cmd_opts[] =
     {"fd",                  1, NULL, FD_SET_ALT},
     {"fw-timeout",          1, NULL, 'f'},
     {"fault-injection-tag", 1, NULL, FAULT_INJECTION_TAG },
+    {"flood",               1, NULL, FLOOD_FILE },
+    {"flood-count",         1, NULL, FLOOD_COUNT },
+    {"flood-rate",          1, NULL, FLOOD_RATE },
+    {"gateways",            1, NULL, GATEWAYS },
     {"gpg-encryption",      0, NULL, 'g'},
     {"gpg-recipient-key",   1, NULL, GPG_RECIP_KEY },
     {"gpg-signer-key",      1, NULL, GPG_SIGNER_KEY },
@@ -147,6 +163,7 @@ static struct option cmd_opts[] =
     {"resolve-ip-https",    0, NULL, 'R'}, /* synonym, default is HTTPS */
     {"resolve-http-only",   0, NULL, RESOLVE_HTTP_ONLY},
     {"resolve-url",         1, NULL, RESOLVE_URL},
+    {"resolve-cache-ttl",   1, NULL, RESOLVE_CACHE_TTL},
     {"sdp-id",              1, NULL, SDP_ID},
     {"services",            1, NULL, SERVICE_IDS},
     {"server-resolve-ipv4", 0, NULL, SERVER_RESOLVE_IPV4},
@@ -161,6 +178,9 @@ static struct option cmd_opts[] =
     {"use-hmac",            0, NULL, USE_HMAC},
     {"use-wget-user-agent", 0, NULL, USE_WGET_USER_AGENT},
     {"spoof-user",          1, NULL, 'U'},
+    {"wait-open",           1, NULL, WAIT_OPEN},
+    {"wait-port",           1, NULL, WAIT_PORT},
+    {"trace-file",          1, NULL, TRACE_FILE},
     {"verbose",             0, NULL, 'v'},
     {"version",             0, NULL, 'V'},
     {"wget-cmd",            1, NULL, 'w'},
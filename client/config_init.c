@@ -52,6 +52,12 @@
 #define POSITION_TO_BITMASK(x)      ((uint32_t)(1) << ((x) % 32))       /*!< Macro do get a bitmask from a position */
 #define BITMASK_ARRAY_SIZE          2                                   /*!< Number of 32bits integer used to handle bitmask in the fko_var_bitmask_t structure */
 #define LF_CHAR                     0x0A                                /*!< Hexadecimal value associated to the LF char */
+#define VAR_HASH_SIZE               512                                 /*!< Slots in the variable name hash table (a power of 2) */
+#define RC_CACHE_SUFFIX             ".cache"                            /*!< Appended to the rc file name to name its compiled cache */
+#define RC_CACHE_MAGIC              "FKRC"                              /*!< First bytes of an rc cache file */
+#define RC_CACHE_VERSION            1                                   /*!< Bumped whenever the cache layout or fko_var_array changes */
+#define RC_CACHE_MIN_SIZE           16384                               /*!< Smaller rc files are always parsed as text */
+#define RC_CACHE_MAX_SIZE           (64*1024*1024)                      /*!< Larger cache files are ignored */
 
 #ifdef HAVE_C_UNIT_TESTS
   #include "cunit_common.h"
@@ -79,6 +85,27 @@ typedef struct rc_file_param
     char val[MAX_LINE_LEN];     /*!< Variable value */
 } rc_file_param_t;
 
+/**
+ * Header of a compiled rc file cache (see rc_cache_build()).  It is
+ * followed by the section names, each as a 16 bit length and the bytes,
+ * then by the entries: 32 bit line number, 16 bit section index, 16 bit
+ * name length, 16 bit value length, the name and the value.  Numbers are
+ * in host byte order, since the cache never leaves the machine that
+ * wrote it.
+ */
+typedef struct rc_cache_hdr
+{
+    char        magic[4];       /*!< RC_CACHE_MAGIC */
+    uint32_t    version;        /*!< RC_CACHE_VERSION */
+    uint64_t    rc_mtime;       /*!< mtime of the rc file the cache was built from */
+    uint64_t    rc_size;        /*!< Size of that rc file */
+    uint64_t    rc_ino;         /*!< Inode of that rc file */
+    uint32_t    n_sections;     /*!< Number of section names */
+    uint32_t    n_entries;      /*!< Number of variable entries */
+    uint64_t    payload_len;    /*!< Bytes following the header */
+    uint64_t    payload_hash;   /*!< FNV-1a hash of those bytes */
+} rc_cache_hdr_t;
+
 /**
  * Structure to identify a configuration variable (name and position)
  */
@@ -140,6 +167,8 @@ enum
     FWKNOP_CLI_ARG_SERVICE_IDS,
     FWKNOP_CLI_ARG_DISABLE_SDP_CTRL_CLIENT,
     FWKNOP_CLI_ARG_SDP_CTRL_CLIENT_CONF,
+    FWKNOP_CLI_ARG_GATEWAYS,
+    FWKNOP_CLI_ARG_RESOLVE_CACHE_TTL,
     FWKNOP_CLI_LAST_ARG
 } fwknop_cli_arg_t;
 
@@ -193,7 +222,9 @@ static fko_var_t fko_var_array[FWKNOP_CLI_LAST_ARG] =
     { "SDP_ID",            FWKNOP_CLI_ARG_SDP_ID         },
     { "SERVICE_IDS",            FWKNOP_CLI_ARG_SERVICE_IDS           },
     { "DISABLE_CTRL_CLIENT",   FWKNOP_CLI_ARG_DISABLE_SDP_CTRL_CLIENT},
-    { "SDP_CTRL_CLIENT_CONF",  FWKNOP_CLI_ARG_SDP_CTRL_CLIENT_CONF  }
+    { "SDP_CTRL_CLIENT_CONF",  FWKNOP_CLI_ARG_SDP_CTRL_CLIENT_CONF  },
+    { "GATEWAYS",              FWKNOP_CLI_ARG_GATEWAYS              },
+    { "RESOLVE_CACHE_TTL",     FWKNOP_CLI_ARG_RESOLVE_CACHE_TTL     }
 
 };
 
@@ -403,11 +434,63 @@ ask_overwrite_var(const char *var, const char *stanza)
     return overwrite;
 }
 
+static short     var_hash_slot[VAR_HASH_SIZE];  /*!< fko_var_array index per slot, or -1 */
+static uint32_t  var_hash_seed  = 0;
+static int       var_hash_ready = 0;
+
+static uint32_t
+var_name_hash(const char *name, uint32_t seed)
+{
+    uint32_t    h = 2166136261U ^ seed;
+
+    while (*name != '\0')
+    {
+        h ^= (unsigned char)*name++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/**
+ * @brief Build a perfect hash of the variable names
+ *
+ * Seeds are tried until every name in fko_var_array lands in a slot of
+ * its own, which takes a handful of attempts at this table size.
+ */
+static void
+build_var_hash(void)
+{
+    short       ndx;
+    uint32_t    slot;
+
+    for (var_hash_seed = 0 ; ; var_hash_seed++)
+    {
+        memset(var_hash_slot, 0xff, sizeof(var_hash_slot));
+
+        for (ndx=0 ; ndx<ARRAY_SIZE(fko_var_array) ; ndx++)
+        {
+            if (fko_var_array[ndx].name[0] == '\0')
+                continue;
+
+            slot = var_name_hash(fko_var_array[ndx].name, var_hash_seed)
+                        & (VAR_HASH_SIZE-1);
+            if (var_hash_slot[slot] >= 0)
+                break;
+            var_hash_slot[slot] = ndx;
+        }
+
+        if (ndx == ARRAY_SIZE(fko_var_array))
+            break;
+    }
+
+    var_hash_ready = 1;
+}
+
 /**
  * @brief Lookup a variable in the variable array according to its name
  *
- * This function parses the fko_var_array table and try to find a match
- * for the user string, which indicates we have found a configuration variable.
+ * The name is hashed into the perfect hash table built by
+ * build_var_hash(), so only one candidate has to be compared.
  *
  * @param str       String to compare against every fwknop conf variables
  *
@@ -417,19 +500,16 @@ static fko_var_t *
 lookup_var_by_name(const char *var_name)
 {
     short       ndx;            /* Index on the the fko_var_array table */
-    fko_var_t  *var = NULL;
 
-    /* Check str against each variable available in fko_var_array */
-    for (ndx=0 ; ndx<ARRAY_SIZE(fko_var_array) ; ndx++)
-    {
-        if (CONF_VAR_IS(var_name, fko_var_array[ndx].name))
-        {
-            var = &(fko_var_array[ndx]);
-            break;
-        }
-    }
+    if (! var_hash_ready)
+        build_var_hash();
 
-    return var;
+    ndx = var_hash_slot[var_name_hash(var_name, var_hash_seed) & (VAR_HASH_SIZE-1)];
+
+    if (ndx >= 0 && CONF_VAR_IS(var_name, fko_var_array[ndx].name))
+        return &(fko_var_array[ndx]);
+
+    return NULL;
 }
 
 /**
@@ -1029,7 +1109,12 @@ parse_rc_param(fko_cli_options_t *options, const char *var_name, char * val)
     {
         tmpint = enc_mode_strtoint(val);
         if(tmpint < 0)
+        {
+            if(enc_mode_is_unsupported(val))
+                log_msg(LOG_VERBOSITY_ERROR,
+                    "ENCRYPTION_MODE %s is not supported by this build of fwknop", val);
             parse_error = -1;
+        }
         else
             options->encryption_mode = tmpint;
     }
@@ -1311,6 +1396,16 @@ parse_rc_param(fko_cli_options_t *options, const char *var_name, char * val)
             options->resolve_http_only = 1;
         else;
     }
+    /* Seconds a resolved external IP is reused for */
+    else if (var->pos == FWKNOP_CLI_ARG_RESOLVE_CACHE_TTL)
+    {
+        tmpint = strtol_wrapper(val, 0, RESOLVE_CACHE_MAX_TTL,
+                NO_EXIT_UPON_ERR, &is_err);
+        if(is_err == FKO_SUCCESS)
+            options->resolve_cache_ttl = tmpint;
+        else
+            parse_error = -1;
+    }
     /* avoid saving .fwknop.run by default */
     else if (var->pos == FWKNOP_CLI_ARG_NO_SAVE_ARGS)
     {
@@ -1348,6 +1443,12 @@ parse_rc_param(fko_cli_options_t *options, const char *var_name, char * val)
         strlcpy(options->sdp_ctrl_client_config_file,
                 val, sizeof(options->sdp_ctrl_client_config_file));
     }
+    /* Gateways to knock together */
+    else if (var->pos == FWKNOP_CLI_ARG_GATEWAYS)
+    {
+        strlcpy(options->gateways_str,
+                val, sizeof(options->gateways_str));
+    }
     /* Disable SDP Ctrl Client */
     else if (var->pos == FWKNOP_CLI_ARG_DISABLE_SDP_CTRL_CLIENT)
     {
@@ -1540,6 +1641,12 @@ add_single_var_to_rc(FILE* fhandle, short var_pos, fko_cli_options_t *options)
         case FWKNOP_CLI_ARG_SDP_CTRL_CLIENT_CONF:
             strlcpy(val, options->sdp_ctrl_client_config_file, sizeof(val));
             break;
+        case FWKNOP_CLI_ARG_RESOLVE_CACHE_TTL:
+            snprintf(val, sizeof(val)-1, "%d", options->resolve_cache_ttl);
+            break;
+        case FWKNOP_CLI_ARG_GATEWAYS:
+            strlcpy(val, options->gateways_str, sizeof(val));
+            break;
         default:
             log_msg(LOG_VERBOSITY_WARNING,
                     "Warning from add_single_var_to_rc() : Bad variable position %u",
@@ -1578,6 +1685,304 @@ add_multiple_vars_to_rc(FILE* rc, fko_cli_options_t *options, fko_var_bitmask_t
     }
 }
 
+static uint64_t
+rc_cache_hash(const unsigned char *buf, size_t len)
+{
+    uint64_t    h = 14695981039346656037ULL;
+
+    while (len-- > 0)
+    {
+        h ^= *buf++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static void
+rc_cache_file(const char *rcfile, char *cachefile)
+{
+    strlcpy(cachefile, rcfile, MAX_PATH_LEN);
+    strlcat(cachefile, RC_CACHE_SUFFIX, MAX_PATH_LEN);
+}
+
+static int
+rc_cache_put(unsigned char **buf, size_t *len, size_t *size,
+        const void *data, size_t data_len)
+{
+    unsigned char  *tmp;
+
+    if (*len + data_len > *size)
+    {
+        *size = (*size + data_len) * 2;
+        if ((tmp = realloc(*buf, *size)) == NULL)
+            return -1;
+        *buf = tmp;
+    }
+    memcpy(*buf + *len, data, data_len);
+    *len += data_len;
+    return 0;
+}
+
+/**
+ * @brief Compile the rc file into a cache that rc_cache_apply() can load
+ *
+ * Every section name and every variable line of the rc file is stored,
+ * so that the default and the named stanza can both be served from one
+ * read of the cache.  Rc files with malformed lines are not cached, so
+ * the text parser keeps reporting them.
+ *
+ * @param rcfile    Path to the rc file
+ */
+static void
+rc_cache_build(const char *rcfile)
+{
+    FILE           *rc;
+    struct stat     st;
+    rc_cache_hdr_t  hdr;
+    rc_file_param_t param;
+    char            line[MAX_LINE_LEN] = {0};
+    char            curr_stanza[MAX_LINE_LEN] = {0};
+    char            cachefile[MAX_PATH_LEN] = {0};
+    char            tmpfile[MAX_PATH_LEN] = {0};
+    unsigned char  *sections = NULL, *entries = NULL;
+    size_t          sections_len = 0, sections_size = 0;
+    size_t          entries_len = 0, entries_size = 0;
+    uint32_t        line_num = 0;
+    uint16_t        section = 0, name_len, val_len;
+    int             fd, ok = 1;
+
+    if ((rc = fopen(rcfile, "r")) == NULL)
+        return;
+
+    if (fstat(fileno(rc), &st) != 0 || st.st_size < RC_CACHE_MIN_SIZE)
+    {
+        fclose(rc);
+        return;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, RC_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version  = RC_CACHE_VERSION;
+    hdr.rc_mtime = (uint64_t)st.st_mtime;
+    hdr.rc_size  = (uint64_t)st.st_size;
+    hdr.rc_ino   = (uint64_t)st.st_ino;
+
+    while (ok && (fgets(line, MAX_LINE_LEN, rc)) != NULL)
+    {
+        line_num++;
+        line[MAX_LINE_LEN-1] = '\0';
+
+        if(IS_EMPTY_LINE(line[0]))
+            continue;
+
+        if (is_rc_section(line, strlen(line), curr_stanza, sizeof(curr_stanza)))
+        {
+            name_len = strlen(curr_stanza);
+            section  = hdr.n_sections++;
+            if (rc_cache_put(&sections, &sections_len, &sections_size,
+                        &name_len, sizeof(name_len)) != 0
+                    || rc_cache_put(&sections, &sections_len, &sections_size,
+                        curr_stanza, name_len) != 0)
+                ok = 0;
+            continue;
+        }
+
+        /* Variables ahead of the first section header are ignored by the
+         * text parser as well
+        */
+        if (hdr.n_sections == 0)
+            continue;
+
+        if (is_rc_param(line, &param) == 0)
+        {
+            ok = 0;
+            break;
+        }
+
+        name_len = strlen(param.name);
+        val_len  = strlen(param.val);
+        if (rc_cache_put(&entries, &entries_len, &entries_size,
+                    &line_num, sizeof(line_num)) != 0
+                || rc_cache_put(&entries, &entries_len, &entries_size,
+                    &section, sizeof(section)) != 0
+                || rc_cache_put(&entries, &entries_len, &entries_size,
+                    &name_len, sizeof(name_len)) != 0
+                || rc_cache_put(&entries, &entries_len, &entries_size,
+                    &val_len, sizeof(val_len)) != 0
+                || rc_cache_put(&entries, &entries_len, &entries_size,
+                    param.name, name_len) != 0
+                || rc_cache_put(&entries, &entries_len, &entries_size,
+                    param.val, val_len) != 0)
+            ok = 0;
+        hdr.n_entries++;
+    }
+    fclose(rc);
+
+    if (ok && rc_cache_put(&sections, &sections_len, &sections_size,
+                entries, entries_len) == 0)
+    {
+        hdr.payload_len  = sections_len;
+        hdr.payload_hash = rc_cache_hash(sections, sections_len);
+
+        /* Write to a temporary file and rename it into place so a reader
+         * never sees a partial cache
+        */
+        rc_cache_file(rcfile, cachefile);
+        snprintf(tmpfile, sizeof(tmpfile), "%s.%ld", cachefile, (long)getpid());
+
+        fd = open(tmpfile, FWKNOPRC_OFLAGS, FWKNOPRC_MODE);
+        if (fd >= 0)
+        {
+            if (write(fd, &hdr, sizeof(hdr)) == sizeof(hdr)
+                    && write(fd, sections, sections_len) == (ssize_t)sections_len
+                    && close(fd) == 0
+                    && rename(tmpfile, cachefile) == 0)
+                log_msg(LOG_VERBOSITY_DEBUG,
+                    "rc_cache_build() : wrote %s (%u sections, %u entries)",
+                    cachefile, hdr.n_sections, hdr.n_entries);
+            else
+                unlink(tmpfile);
+        }
+    }
+
+    if (entries != NULL)
+        free(entries);
+    if (sections != NULL)
+        free(sections);
+}
+
+/**
+ * @brief Apply a section of the rc file from its compiled cache
+ *
+ * The cache is read in one go and used only if it was built from the rc
+ * file as it is now (same mtime, size and inode) and its payload hash
+ * checks out.
+ *
+ * @param rcfile        Path to the rc file
+ * @param section_name  Name of the section to apply
+ * @param options       Fwknop option structure where settings have to
+ *                      be stored.
+ *
+ * @return 0 if the section was applied from the cache, 1 on a parameter
+ *         error, and -1 if the cache cannot be used
+ */
+static int
+rc_cache_apply(const char *rcfile, const char *section_name,
+        fko_cli_options_t *options)
+{
+    struct stat     rc_st, cache_st;
+    rc_cache_hdr_t  hdr;
+    char            cachefile[MAX_PATH_LEN] = {0};
+    char            name[MAX_LINE_LEN], val[MAX_LINE_LEN];
+    unsigned char  *buf = NULL, *ndx, *end;
+    unsigned char  *match = NULL;       /* Bitmap of the sections that match */
+    uint32_t        i, line_num;
+    uint16_t        len, section, name_len, val_len;
+    int             fd, res = -1;
+
+    if (stat(rcfile, &rc_st) != 0 || rc_st.st_size < RC_CACHE_MIN_SIZE)
+        return -1;
+
+    rc_cache_file(rcfile, cachefile);
+    if ((fd = open(cachefile, O_RDONLY)) < 0)
+        return -1;
+
+    if (fstat(fd, &cache_st) != 0
+            || cache_st.st_size < (off_t)sizeof(hdr)
+            || cache_st.st_size > RC_CACHE_MAX_SIZE
+            || cache_st.st_uid != geteuid()
+            || (cache_st.st_mode & (S_IRWXG|S_IRWXO))
+            || (buf = malloc(cache_st.st_size)) == NULL
+            || read(fd, buf, cache_st.st_size) != cache_st.st_size)
+        goto out;
+
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (memcmp(hdr.magic, RC_CACHE_MAGIC, sizeof(hdr.magic)) != 0
+            || hdr.version != RC_CACHE_VERSION
+            || hdr.rc_mtime != (uint64_t)rc_st.st_mtime
+            || hdr.rc_size != (uint64_t)rc_st.st_size
+            || hdr.rc_ino != (uint64_t)rc_st.st_ino
+            || hdr.payload_len != cache_st.st_size - sizeof(hdr)
+            || hdr.payload_hash != rc_cache_hash(buf + sizeof(hdr), hdr.payload_len))
+    {
+        log_msg(LOG_VERBOSITY_DEBUG, "rc_cache_apply() : %s is stale", cachefile);
+        goto out;
+    }
+
+    if ((match = calloc(1, hdr.n_sections + 1)) == NULL)
+        goto out;
+
+    ndx = buf + sizeof(hdr);
+    end = buf + cache_st.st_size;
+
+    for (i=0 ; i<hdr.n_sections ; i++)
+    {
+        if (ndx + sizeof(len) > end)
+            goto out;
+        memcpy(&len, ndx, sizeof(len));
+        ndx += sizeof(len);
+        if (ndx + len > end || len >= sizeof(name))
+            goto out;
+        memcpy(name, ndx, len);
+        name[len] = '\0';
+        ndx += len;
+
+        match[i] = (strcasecmp(name, section_name) == 0);
+        if (strcasecmp(name, options->use_rc_stanza) == 0)
+            options->got_named_stanza = 1;
+    }
+
+    res = 0;
+    for (i=0 ; i<hdr.n_entries ; i++)
+    {
+        if (ndx + sizeof(line_num) + 3*sizeof(uint16_t) > end)
+        {
+            res = -1;
+            break;
+        }
+        memcpy(&line_num, ndx, sizeof(line_num));
+        ndx += sizeof(line_num);
+        memcpy(&section, ndx, sizeof(section));
+        ndx += sizeof(section);
+        memcpy(&name_len, ndx, sizeof(name_len));
+        ndx += sizeof(name_len);
+        memcpy(&val_len, ndx, sizeof(val_len));
+        ndx += sizeof(val_len);
+
+        if (ndx + name_len + val_len > end || section >= hdr.n_sections
+                || name_len >= sizeof(name) || val_len >= sizeof(val))
+        {
+            res = -1;
+            break;
+        }
+
+        if (match[section])
+        {
+            memcpy(name, ndx, name_len);
+            name[name_len] = '\0';
+            memcpy(val, ndx + name_len, val_len);
+            val[val_len] = '\0';
+
+            if(parse_rc_param(options, name, val) < 0)
+            {
+                log_msg(LOG_VERBOSITY_WARNING,
+                    "Parameter error in %s, line %i: var=%s, val=%s",
+                    rcfile, line_num, name, val);
+                res = 1;
+            }
+        }
+        ndx += name_len + val_len;
+    }
+
+out:
+    close(fd);
+    if (match != NULL)
+        free(match);
+    if (buf != NULL)
+        free(buf);
+    return res;
+}
+
 /**
  * @brief Process the fwknoprc file and lookup a section to extract its settings.
  *
@@ -1604,6 +2009,20 @@ process_rc_section(char *section_name, fko_cli_options_t *options)
 
     set_rc_file(rcfile, options);
 
+    /* Large rc files are served from their compiled cache when it is
+     * current.  A cache that cannot be used (partially applied entries
+     * are simply applied again below) falls back to the text parser.
+    */
+    switch (rc_cache_apply(rcfile, section_name, options))
+    {
+        case 0:
+            return 0;
+        case 1:
+            exit(EXIT_FAILURE);
+        default:
+            break;
+    }
+
     /* Open the rc file for reading, if it does not exist, then create
      * an initial .fwknoprc file with defaults and go on.
     */
@@ -1675,6 +2094,8 @@ process_rc_section(char *section_name, fko_cli_options_t *options)
     if (do_exit)
         exit(EXIT_FAILURE);
 
+    rc_cache_build(rcfile);
+
     return 0;
 }
 
@@ -1904,7 +2325,8 @@ validate_options(fko_cli_options_t *options)
         && !options->show_last_command
         && !options->run_last_command)
     {
-        if (options->spa_server_str[0] == 0x0)
+        if (options->spa_server_str[0] == 0x0
+                && options->gateways_str[0] == 0x0)
         {
             log_msg(LOG_VERBOSITY_ERROR,
                 "Must use --destination unless --test mode is used");
@@ -1934,7 +2356,8 @@ validate_options(fko_cli_options_t *options)
          */
         if(!options->disable_sdp_mode)
         {
-            if(options->sdp_id == FKO_DEFAULT_SDP_ID)
+            if(options->sdp_id == FKO_DEFAULT_SDP_ID
+                    && options->flood_file[0] == 0x0)
             {
                 log_msg(LOG_VERBOSITY_ERROR,
                     "SDP_ID must be specified when SDP mode is enabled");
@@ -1943,6 +2366,86 @@ validate_options(fko_cli_options_t *options)
         }
     }
 
+    /* The --flood identities carry their own SDP IDs and keys, and
+     * packets go out in batches over a single UDP or raw socket.
+    */
+    if(options->flood_file[0] != 0x0)
+    {
+        if(options->spa_proto != FKO_PROTO_UDP
+                && options->spa_proto != FKO_PROTO_UDP_RAW
+                && options->spa_proto != FKO_PROTO_TCP_RAW
+                && options->spa_proto != FKO_PROTO_ICMP)
+        {
+            log_msg(LOG_VERBOSITY_ERROR,
+                "--flood only supports '-P <udp|udpraw|tcpraw|icmp>'");
+            exit(EXIT_FAILURE);
+        }
+        if(options->use_gpg)
+        {
+            log_msg(LOG_VERBOSITY_ERROR,
+                "--flood does not support GPG encryption");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(options->agent_sock[0] != 0x0)
+    {
+        if(options->flood_file[0] != 0x0)
+        {
+            log_msg(LOG_VERBOSITY_ERROR,
+                "--agent and --flood are mutually exclusive");
+            exit(EXIT_FAILURE);
+        }
+        if(options->server_command[0] != 0x0)
+        {
+            log_msg(LOG_VERBOSITY_ERROR,
+                "--agent does not support --server-cmd");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(options->gateways_str[0] != 0x0)
+    {
+        if(options->flood_file[0] != 0x0 || options->agent_sock[0] != 0x0)
+        {
+            log_msg(LOG_VERBOSITY_ERROR,
+                "--gateways cannot be combined with --flood or --agent");
+            exit(EXIT_FAILURE);
+        }
+        if(options->rand_port)
+        {
+            log_msg(LOG_VERBOSITY_ERROR,
+                "--gateways does not support --rand-port");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(options->wait_open > 0)
+    {
+        if(options->nat_access_str[0] != 0x0 || options->nat_local)
+        {
+            log_msg(LOG_VERBOSITY_ERROR,
+                "--wait-open cannot probe NAT'd access, use it without -N");
+            exit(EXIT_FAILURE);
+        }
+        if(options->flood_file[0] != 0x0 || options->agent_sock[0] != 0x0
+                || options->gateways_str[0] != 0x0)
+        {
+            log_msg(LOG_VERBOSITY_ERROR,
+                "--wait-open cannot be combined with --flood, --agent or --gateways");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(options->trace_file[0] != 0x0
+            && (options->flood_file[0] != 0x0 || options->agent_sock[0] != 0x0
+                || options->gateways_str[0] != 0x0))
+    {
+        log_msg(LOG_VERBOSITY_ERROR,
+            "--trace-file cannot be combined with --flood, --agent or --gateways");
+        exit(EXIT_FAILURE);
+    }
+
     /* Make sure -a overrides IP resolution
     */
     if(options->allow_ip_str[0] != 0x0
@@ -2048,6 +2551,13 @@ set_defaults(fko_cli_options_t *options)
     options->disable_sdp_mode = FKO_DEFAULT_DISABLE_SDP_MODE;
     options->sdp_id    = FKO_DEFAULT_SDP_ID;
 
+    options->flood_count    = FLOOD_DEF_COUNT;
+    options->flood_rate     = FLOOD_DEF_RATE;
+
+    options->resolve_cache_ttl = RESOLVE_CACHE_DEF_TTL;
+
+    options->agent_pool     = AGENT_POOL_DEF;
+
     return;
 }
 
@@ -2180,6 +2690,69 @@ config_init(fko_cli_options_t *options, int argc, char **argv)
                 exit(EXIT_FAILURE);
 #endif
                 break;
+            case AGENT_SOCK:
+                strlcpy(options->agent_sock, optarg, sizeof(options->agent_sock));
+                break;
+            case AGENT_POOL:
+                options->agent_pool = strtol_wrapper(optarg, 0,
+                        AGENT_POOL_MAX, NO_EXIT_UPON_ERR, &is_err);
+                if(is_err != FKO_SUCCESS)
+                {
+                    log_msg(LOG_VERBOSITY_ERROR, "--agent-pool must be within [%d-%d]",
+                            0, AGENT_POOL_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case GATEWAYS:
+                strlcpy(options->gateways_str, optarg, sizeof(options->gateways_str));
+                add_var_to_bitmask(FWKNOP_CLI_ARG_GATEWAYS, &var_bitmask);
+                break;
+            case FLOOD_FILE:
+                strlcpy(options->flood_file, optarg, sizeof(options->flood_file));
+                break;
+            case FLOOD_COUNT:
+                options->flood_count = strtol_wrapper(optarg, 1,
+                        FLOOD_MAX_COUNT, NO_EXIT_UPON_ERR, &is_err);
+                if(is_err != FKO_SUCCESS)
+                {
+                    log_msg(LOG_VERBOSITY_ERROR, "--flood-count must be within [%d-%d]",
+                            1, FLOOD_MAX_COUNT);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case FLOOD_RATE:
+                options->flood_rate = strtol_wrapper(optarg, 0,
+                        FLOOD_MAX_RATE, NO_EXIT_UPON_ERR, &is_err);
+                if(is_err != FKO_SUCCESS)
+                {
+                    log_msg(LOG_VERBOSITY_ERROR, "--flood-rate must be within [%d-%d]",
+                            0, FLOOD_MAX_RATE);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case WAIT_OPEN:
+                options->wait_open = strtol_wrapper(optarg, 1,
+                        WAIT_OPEN_MAX, NO_EXIT_UPON_ERR, &is_err);
+                if(is_err != FKO_SUCCESS)
+                {
+                    log_msg(LOG_VERBOSITY_ERROR, "--wait-open must be within [%d-%d]",
+                            1, WAIT_OPEN_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case WAIT_PORT:
+                options->wait_port = strtol_wrapper(optarg, 1,
+                        MAX_PORT, NO_EXIT_UPON_ERR, &is_err);
+                if(is_err != FKO_SUCCESS)
+                {
+                    log_msg(LOG_VERBOSITY_ERROR, "--wait-port must be within [%d-%d]",
+                            1, MAX_PORT);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case TRACE_FILE:
+                strlcpy(options->trace_file, optarg, sizeof(options->trace_file));
+                break;
             case 'g':
             case GPG_ENCRYPTION:
                 options->use_gpg = 1;
@@ -2320,9 +2893,14 @@ config_init(fko_cli_options_t *options, int argc, char **argv)
             case ENCRYPTION_MODE:
                 if((options->encryption_mode = enc_mode_strtoint(optarg)) < 0)
                 {
-                    log_msg(LOG_VERBOSITY_ERROR,
-                        "* Invalid encryption mode: %s, use {CBC,CTR,legacy,Asymmetric}",
-                    optarg);
+                    if(enc_mode_is_unsupported(optarg))
+                        log_msg(LOG_VERBOSITY_ERROR,
+                            "* Encryption mode %s is not supported by this build of fwknop",
+                            optarg);
+                    else
+                        log_msg(LOG_VERBOSITY_ERROR,
+                            "* Invalid encryption mode: %s, use {CBC,CTR,GCM,GCM_BINARY,legacy,Asymmetric}",
+                            optarg);
                     exit(EXIT_FAILURE);
                 }
                 add_var_to_bitmask(FWKNOP_CLI_ARG_ENCRYPTION_MODE, &var_bitmask);
@@ -2373,6 +2951,17 @@ config_init(fko_cli_options_t *options, int argc, char **argv)
                 add_var_to_bitmask(FWKNOP_CLI_ARG_RESOLVE_HTTP_ONLY, &var_bitmask);
                 add_var_to_bitmask(FWKNOP_CLI_ARG_RESOLVE_IP_HTTPS, &var_bitmask);
                 break;
+            case RESOLVE_CACHE_TTL:
+                options->resolve_cache_ttl = strtol_wrapper(optarg, 0,
+                        RESOLVE_CACHE_MAX_TTL, NO_EXIT_UPON_ERR, &is_err);
+                if(is_err != FKO_SUCCESS)
+                {
+                    log_msg(LOG_VERBOSITY_ERROR, "--resolve-cache-ttl must be within [%d-%d]",
+                            0, RESOLVE_CACHE_MAX_TTL);
+                    exit(EXIT_FAILURE);
+                }
+                add_var_to_bitmask(FWKNOP_CLI_ARG_RESOLVE_CACHE_TTL, &var_bitmask);
+                break;
             case RESOLVE_URL:
                 if(options->resolve_url != NULL)
                     free(options->resolve_url);
@@ -2598,6 +3187,15 @@ usage(void)
       "                             packet (e.g. '123.2.3.4').  If \n"
       " -D, --destination           Specify the hostname or IP address of the\n"
       "                             fwknop server.\n"
+      "     --gateways              Knock a comma separated list of gateways\n"
+      "                             (host[:port]) in parallel instead of -D.\n"
+      "     --wait-open             After the knock, wait up to this many seconds\n"
+      "                             for the service to accept TCP connections.\n"
+      "     --wait-port             Port for --wait-open (default: the first\n"
+      "                             tcp/<port> in -A).\n"
+      "     --trace-file            Append when the packet was built, sent and\n"
+      "                             (with --wait-open) found open to this file\n"
+      "                             ('-' for stdout), for fwknopd's SPA_TRACE.\n"
       " --use-hmac                  Add an HMAC to the outbound SPA packet for\n"
       "                             authenticated encryption.\n"
       " -h, --help                  Print this usage message and exit.\n"
@@ -2636,7 +3234,11 @@ usage(void)
       "                             HTTP connection is altered en-route by a third\n"
       "                             party.\n"
       "     --resolve-url           Override the default URL used for resolving\n"
-      "                             the source IP address.\n"
+      "                             the source IP address.  Up to 4 comma\n"
+      "                             separated URLs are queried in parallel.\n"
+      "     --resolve-cache-ttl     Reuse the resolved external IP for this many\n"
+      "                             seconds unless the local network changes\n"
+      "                             (default: 0, no caching).\n"
       " -u, --user-agent            Set the HTTP User-Agent for resolving the\n"
       "                             external IP via -R, or for sending SPA\n"
       "                             packets over HTTP. The default is\n"
@@ -2692,6 +3294,22 @@ usage(void)
       "                             before 2.5.\n"
       " -f, --fw-timeout            Specify SPA server firewall timeout from the\n"
       "                             client side.\n"
+      "     --agent                 Stay resident and send SPA packets on request\n"
+      "                             from the given unix socket ('knock [<access>]'\n"
+      "                             per line), keeping keys, the resolved server\n"
+      "                             and any SDP control client session in memory.\n"
+      "     --agent-pool            SPA packets the agent keeps built ahead of\n"
+      "                             time for each access list it is asked for\n"
+      "                             (default is 2, 0 builds each on request).\n"
+      "     --flood                 Load generator mode: send SPA packets for the\n"
+      "                             identities listed in the given file, one\n"
+      "                             '<sdp_id> <key_b64> [<hmac_key_b64>]' per line,\n"
+      "                             and report the achieved rate (udp, udpraw,\n"
+      "                             tcpraw or icmp).\n"
+      "     --flood-count           Number of packets to send in --flood mode\n"
+      "                             (default is 10000).\n"
+      "     --flood-rate            Target packets per second in --flood mode\n"
+      "                             (default is 0, as fast as possible).\n"
       "     --hmac-digest-type      Set the HMAC digest algorithm (default is\n"
       "                             sha256). Options are md5, sha1, sha256,\n"
       "                             sha384, or sha512.\n"
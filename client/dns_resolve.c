@@ -0,0 +1,260 @@
+/*
+ *****************************************************************************
+ *
+ * File:    dns_resolve.c
+ *
+ * Purpose: Start the lookup of the SPA server (or HTTP proxy) as soon as
+ *          the options are known, with getaddrinfo_a(), so it runs while
+ *          the keys are read and the packet is encrypted.  The send path
+ *          then picks the finished answer up through dns_getaddrinfo(),
+ *          which is a drop-in replacement for getaddrinfo().  Without
+ *          getaddrinfo_a() every lookup is a plain getaddrinfo().
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "dns_resolve.h"
+#include "utils.h"
+
+#if HAVE_GETADDRINFO_A
+  #include <signal.h>
+  #include <arpa/inet.h>
+
+/* A lookup started by dns_prefetch().  The result carries no port; the
+ * one asked for is filled in when the result is handed out.
+*/
+typedef struct dns_pending
+{
+    int             in_use;
+    char            host[MAX_URL_HOST_LEN+1];
+    struct addrinfo hints;
+    struct gaicb    req;
+} dns_pending_t;
+
+static dns_pending_t pending[DNS_MAX_PENDING];
+
+static dns_pending_t *
+find_pending(const char *host, const struct addrinfo *hints)
+{
+    int i;
+
+    for(i=0; i < DNS_MAX_PENDING; i++)
+        if(pending[i].in_use
+                && pending[i].hints.ai_family == hints->ai_family
+                && pending[i].hints.ai_socktype == hints->ai_socktype
+                && pending[i].hints.ai_protocol == hints->ai_protocol
+                && strcmp(pending[i].host, host) == 0)
+            return &pending[i];
+    return NULL;
+}
+
+static void
+set_port(struct addrinfo *res, const char *port)
+{
+    struct addrinfo *rp;
+    int              is_err;
+    unsigned short   nport = 0;
+
+    if(port != NULL)
+        nport = htons(strtol_wrapper(port, 0, MAX_PORT, NO_EXIT_UPON_ERR, &is_err));
+
+    for(rp = res; rp != NULL; rp = rp->ai_next)
+    {
+        if(rp->ai_family == AF_INET)
+            ((struct sockaddr_in *)rp->ai_addr)->sin_port = nport;
+        else if(rp->ai_family == AF_INET6)
+            ((struct sockaddr_in6 *)rp->ai_addr)->sin6_port = nport;
+    }
+}
+
+static int
+take_result(dns_pending_t *p, const char *port, struct addrinfo **res)
+{
+    int error = gai_error(&p->req);
+
+    if(error == 0)
+    {
+        *res = p->req.ar_result;
+        set_port(*res, port);
+    }
+    else if(p->req.ar_result != NULL)
+        freeaddrinfo(p->req.ar_result);
+
+    p->in_use = 0;
+    return error;
+}
+#endif
+
+/* Start resolving host in the background.  Numeric addresses and hosts
+ * that are already being resolved are left alone.
+*/
+void
+dns_prefetch(const char *host, const struct addrinfo *hints)
+{
+#if HAVE_GETADDRINFO_A
+    struct gaicb   *list[1];
+    struct sigevent sev;
+    unsigned char   buf[sizeof(struct in6_addr)];
+    int             i;
+
+    if(host == NULL || host[0] == 0x0 || strlen(host) > MAX_URL_HOST_LEN
+            || inet_pton(AF_INET, host, buf) == 1
+            || inet_pton(AF_INET6, host, buf) == 1
+            || find_pending(host, hints) != NULL)
+        return;
+
+    for(i=0; i < DNS_MAX_PENDING && pending[i].in_use; i++);
+    if(i == DNS_MAX_PENDING)
+        return;
+
+    memset(&pending[i], 0x0, sizeof(dns_pending_t));
+    strlcpy(pending[i].host, host, sizeof(pending[i].host));
+    pending[i].hints.ai_family   = hints->ai_family;
+    pending[i].hints.ai_socktype = hints->ai_socktype;
+    pending[i].hints.ai_protocol = hints->ai_protocol;
+    pending[i].hints.ai_flags    = hints->ai_flags;
+    pending[i].req.ar_name       = pending[i].host;
+    pending[i].req.ar_request    = &pending[i].hints;
+
+    memset(&sev, 0x0, sizeof(sev));
+    sev.sigev_notify = SIGEV_NONE;
+    list[0] = &pending[i].req;
+
+    if(getaddrinfo_a(GAI_NOWAIT, list, 1, &sev) == 0)
+    {
+        pending[i].in_use = 1;
+        log_msg(LOG_VERBOSITY_DEBUG, "dns_prefetch: resolving %s", host);
+    }
+#endif
+    return;
+}
+
+/* getaddrinfo(), but picking up a lookup dns_prefetch() started for the
+ * same host and hints if there is one.
+*/
+int
+dns_getaddrinfo(const char *host, const char *port,
+        const struct addrinfo *hints, struct addrinfo **res)
+{
+#if HAVE_GETADDRINFO_A
+    dns_pending_t          *p = find_pending(host, hints);
+    const struct gaicb     *list[1];
+    struct timespec         timeout;
+
+    if(p != NULL)
+    {
+        list[0] = &p->req;
+        timeout.tv_sec  = DNS_TIMEOUT;
+        timeout.tv_nsec = 0;
+
+        while(gai_error(&p->req) == EAI_INPROGRESS)
+        {
+            if(gai_suspend(list, 1, &timeout) == EAI_AGAIN)
+            {
+                gai_cancel(&p->req);
+                break;
+            }
+        }
+
+        if(gai_error(&p->req) != EAI_INPROGRESS)
+            return take_result(p, port, res);
+
+        /* Could not be cancelled, so the slot stays busy until the lookup
+         * finishes on its own.  Fall through to a fresh lookup.
+        */
+    }
+#endif
+    return getaddrinfo(host, port, hints, res);
+}
+
+/* Like dns_getaddrinfo(), but returns EAI_AGAIN instead of blocking when
+ * a prefetched lookup is still running.
+*/
+int
+dns_getaddrinfo_nowait(const char *host, const char *port,
+        const struct addrinfo *hints, struct addrinfo **res)
+{
+#if HAVE_GETADDRINFO_A
+    dns_pending_t  *p = find_pending(host, hints);
+
+    if(p != NULL && gai_error(&p->req) == EAI_INPROGRESS)
+        return EAI_AGAIN;
+#endif
+    return dns_getaddrinfo(host, port, hints, res);
+}
+
+/* The hints send_spa_packet() will resolve the SPA server with
+*/
+void
+spa_dns_hints(const fko_cli_options_t *options, struct addrinfo *hints)
+{
+    memset(hints, 0x0, sizeof(struct addrinfo));
+
+    if(options->spa_proto == FKO_PROTO_UDP)
+    {
+        hints->ai_family   = AF_UNSPEC;
+        hints->ai_socktype = SOCK_DGRAM;
+        hints->ai_protocol = IPPROTO_UDP;
+    }
+    else if(options->spa_proto == FKO_PROTO_TCP
+            || options->spa_proto == FKO_PROTO_HTTP)
+    {
+        hints->ai_family   = AF_UNSPEC;
+        hints->ai_socktype = SOCK_STREAM;
+        hints->ai_protocol = IPPROTO_TCP;
+    }
+    else
+        hints->ai_family   = AF_INET;   /* raw modes, see resolve_dst_addr() */
+}
+
+/* Kick off the lookup of whatever host the SPA packet will be sent to:
+ * the HTTP proxy if there is one, otherwise the SPA server.
+*/
+void
+spa_dns_prefetch(const fko_cli_options_t *options)
+{
+    struct addrinfo hints;
+    char            host[MAX_URL_HOST_LEN+1] = {0};
+    char           *ndx;
+
+    if(options->test)
+        return;
+
+    spa_dns_hints(options, &hints);
+
+    if(options->spa_proto == FKO_PROTO_HTTP && options->http_proxy[0] != 0x0)
+    {
+        ndx = (char *)options->http_proxy;
+        if(strncasecmp(ndx, "http://", 7) == 0)
+            ndx += 7;
+        strlcpy(host, ndx, sizeof(host));
+        if((ndx = strchr(host, ':')) != NULL)
+            *ndx = 0x0;
+    }
+    else
+        strlcpy(host, options->spa_server_str, sizeof(host));
+
+    dns_prefetch(host, &hints);
+}
+
+/***EOF***/
@@ -0,0 +1,59 @@
+/*
+ *****************************************************************************
+ *
+ * File:    dns_resolve.h
+ *
+ * Purpose: Header file for dns_resolve.c - asynchronous hostname lookups
+ *          for the SPA server and HTTP proxy.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef DNS_RESOLVE_H
+#define DNS_RESOLVE_H
+
+#include "fwknop_common.h"
+
+#ifdef WIN32
+  #include <ws2tcpip.h>
+#else
+  #include <netdb.h>
+#endif
+
+/* Lookups that may be in flight at once, and how long a send may wait
+ * on one before giving up.
+*/
+#define DNS_MAX_PENDING     4
+#define DNS_TIMEOUT         10
+
+/* Function Prototypes
+*/
+void dns_prefetch(const char *host, const struct addrinfo *hints);
+int  dns_getaddrinfo(const char *host, const char *port,
+        const struct addrinfo *hints, struct addrinfo **res);
+int  dns_getaddrinfo_nowait(const char *host, const char *port,
+        const struct addrinfo *hints, struct addrinfo **res);
+void spa_dns_prefetch(const fko_cli_options_t *options);
+void spa_dns_hints(const fko_cli_options_t *options, struct addrinfo *hints);
+
+#endif  /* DNS_RESOLVE_H */
@@ -28,6 +28,13 @@
 #include "fwknop.h"
 #include "config_init.h"
 #include "spa_comm.h"
+#include "spa_flood.h"
+#include "spa_agent.h"
+#include "spa_fanout.h"
+#include "dns_resolve.h"
+#include "spa_wait.h"
+#include "spa_trace.h"
+#include "key_store.h"
 #include "utils.h"
 #include "getpasswd.h"
 #include "sdp_ctrl_client.h"
@@ -56,7 +63,11 @@ static int set_access_buf(fko_ctx_t ctx, fko_cli_options_t *options,
 static int get_rand_port(fko_ctx_t ctx);
 int resolve_ip_https(fko_cli_options_t *options);
 int resolve_ip_http(fko_cli_options_t *options);
-static pid_t run_sdp_ctrl_client(fko_cli_options_t *options);
+int resolve_ip_cache_get(fko_cli_options_t *options);
+void resolve_ip_cache_put(fko_cli_options_t *options);
+static pid_t run_sdp_ctrl_client(fko_ctx_t ctx, fko_cli_options_t *options,
+    const char *key, const int key_len, const char *hmac_key,
+    const int hmac_key_len, const int knocked);
 static void clean_exit(fko_ctx_t ctx, fko_cli_options_t *opts,
     char *key, int *key_len, char *hmac_key, int *hmac_key_len,
     unsigned int exit_status);
@@ -162,20 +173,27 @@ main(int argc, char **argv)
     int                 res;
     char               *spa_data=NULL, *version=NULL;
     char                access_buf[MAX_LINE_LEN] = {0};
-    char                key[MAX_KEY_LEN+1]       = {0};
-    char                hmac_key[MAX_KEY_LEN+1]  = {0};
+    char               *key = NULL, *hmac_key = NULL;
     int                 key_len = 0, orig_key_len = 0, hmac_key_len = 0, enc_mode;
     int                 tmp_port = 0;
     char                dump_buf[CTX_DUMP_BUFSIZE];
+    char                wait_host[MAX_SERVER_STR_LEN] = {0};
+    spa_trace_t         trace;
     uint32_t            sdp_id = 0;
 
     fko_cli_options_t   options;
 
     memset(&options, 0x0, sizeof(fko_cli_options_t));
+    memset(&trace, 0x0, sizeof(trace));
 
     /* Initialize the log module */
     log_new();
 
+    /* The keys are read straight into locked memory
+    */
+    key      = key_store_get()->key;
+    hmac_key = key_store_get()->hmac_key;
+
     /* Handle command line
     */
     config_init(&options, argc, argv);
@@ -282,7 +300,8 @@ main(int argc, char **argv)
         /* Resolve the client's public facing IP address if requestesd.
          * if this fails, consider it fatal.
         */
-        if (options.resolve_ip_http_https)
+        if (options.resolve_ip_http_https
+                && resolve_ip_cache_get(&options) != 1)
         {
             if(options.resolve_http_only)
             {
@@ -301,6 +320,7 @@ main(int argc, char **argv)
                         hmac_key, &hmac_key_len, EXIT_FAILURE);
                 }
             }
+            resolve_ip_cache_put(&options);
         }
 
        /* Set a message string by combining the allow IP and either
@@ -485,6 +505,20 @@ main(int argc, char **argv)
         }
     }
 
+    /* In --flood mode the keys come from the identity file
+    */
+    if(options.flood_file[0] != 0x0)
+    {
+        res = flood_spa_packets(ctx, &options);
+        clean_exit(ctx, &options, key, &key_len, hmac_key, &hmac_key_len,
+                res == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    /* Start resolving the SPA server (or HTTP proxy) now so the lookup
+     * overlaps with reading the keys and encrypting the packet
+    */
+    spa_dns_prefetch(&options);
+
     /* Acquire the necessary encryption/hmac keys
     */
     if(get_keys(ctx, &options, key, &key_len, hmac_key, &hmac_key_len) != 1)
@@ -493,6 +527,13 @@ main(int argc, char **argv)
 
     orig_key_len = key_len;
 
+    /* The key store holds the only copy from here on
+    */
+    zero_buf_wrapper(options.key, MAX_KEY_LEN+1);
+    zero_buf_wrapper(options.key_base64, MAX_B64_KEY_LEN+1);
+    zero_buf_wrapper(options.hmac_key, MAX_KEY_LEN+1);
+    zero_buf_wrapper(options.hmac_key_base64, MAX_B64_KEY_LEN+1);
+
     if(options.encryption_mode == FKO_ENC_MODE_CBC_LEGACY_IV
             && key_len > 16)
     {
@@ -505,10 +546,61 @@ main(int argc, char **argv)
         key_len = 16;
     }
 
+    /* In --agent mode everything above is kept and packets are only
+     * built on request.  The control client, which needs an initial
+     * knock to reach the controller, is not restarted on a reload.
+    */
+    if(options.agent_sock[0] != 0x0)
+    {
+        res = agent_start(&options, key, key_len, hmac_key, hmac_key_len);
+        if(res < 0)
+            clean_exit(ctx, &options, key, &orig_key_len,
+                    hmac_key, &hmac_key_len, EXIT_FAILURE);
+
+        if(res == 1 && !options.disable_sdp_ctrl_client
+                && options.sdp_ctrl_client_config_file[0] != '\0')
+        {
+            res = agent_knock(ctx, &options, NULL);
+            if(res < 0)
+                log_msg(LOG_VERBOSITY_ERROR, "agent: initial knock not sent.");
+
+            if(run_sdp_ctrl_client(ctx, &options, key, key_len,
+                        hmac_key, hmac_key_len, res >= 0) == 0)
+                clean_exit(ctx, &options, key, &orig_key_len,
+                        hmac_key, &hmac_key_len, EXIT_SUCCESS);
+        }
+
+        res = agent_run(ctx, &options, argv);
+        clean_exit(ctx, &options, key, &orig_key_len, hmac_key, &hmac_key_len,
+                res == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    /* With --gateways one packet per gateway is built and sent here
+    */
+    if(options.gateways_str[0] != 0x0)
+    {
+        res = fanout_spa_packets(ctx, &options, key, key_len,
+                hmac_key, hmac_key_len);
+
+        if(res >= 0 && !options.disable_sdp_ctrl_client
+                && options.sdp_ctrl_client_config_file[0] != '\0')
+        {
+            if(run_sdp_ctrl_client(ctx, &options, key, key_len,
+                        hmac_key, hmac_key_len, 0) == 0)
+                clean_exit(ctx, &options, key, &orig_key_len,
+                        hmac_key, &hmac_key_len, EXIT_SUCCESS);
+        }
+
+        clean_exit(ctx, &options, key, &orig_key_len, hmac_key, &hmac_key_len,
+                res == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
     /* Finalize the context data (encrypt and encode the SPA data)
     */
     log_msg(LOG_VERBOSITY_DEBUG, "fwknop main() : calling fko_spa_data_final...");
+    trace.start_ns = spa_trace_now();
     res = fko_spa_data_final(ctx, key, key_len, hmac_key, hmac_key_len);
+    trace.built_ns = spa_trace_now();
     if(res != FKO_SUCCESS)
     {
         errmsg("fko_spa_data_final", res);
@@ -564,7 +656,14 @@ main(int argc, char **argv)
         options.spa_src_port = tmp_port;
     }
 
+    /* HTTP mode replaces the server string with the proxy, so remember
+     * which host --wait-open should probe (and --trace-file name)
+    */
+    if (options.wait_open > 0 || options.trace_file[0] != 0x0)
+        strlcpy(wait_host, options.spa_server_str, sizeof(wait_host));
+
     res = send_spa_packet(ctx, &options);
+    trace.sent_ns = spa_trace_now();
 
     // before checking result of the packet send, start the SDP control
     // client if configured to do so
@@ -572,7 +671,8 @@ main(int argc, char **argv)
             //&& options.sdp_ctrl_client_config_file != NULL
             && options.sdp_ctrl_client_config_file[0] != '\0')
     {
-        if(run_sdp_ctrl_client(&options) == 0)
+        if(run_sdp_ctrl_client(ctx, &options, key, key_len,
+                    hmac_key, hmac_key_len, res >= 0) == 0)
         {
             // this is the child process, stop here
             clean_exit(ctx, &options, key, &orig_key_len,
@@ -591,6 +691,19 @@ main(int argc, char **argv)
         log_msg(LOG_VERBOSITY_INFO, "send_spa_packet: bytes sent: %i", res);
     }
 
+    /* Knock-and-wait: block until the service accepts connections
+    */
+    if (options.wait_open > 0 && !options.test)
+    {
+        if(wait_for_access(&options, wait_host) != 0)
+            clean_exit(ctx, &options, key, &orig_key_len,
+                    hmac_key, &hmac_key_len, EXIT_FAILURE);
+        trace.open_ns = spa_trace_now();
+    }
+
+    if (options.trace_file[0] != 0x0 && !options.test)
+        spa_trace_write(&options, ctx, wait_host, &trace);
+
     /* Run through a decode cycle in test mode (--DSS XXX: This test/decode
      * portion should be moved elsewhere).
     */
@@ -1276,6 +1389,7 @@ get_keys(fko_ctx_t ctx, fko_cli_options_t *options,
                     return 0;
                 }
                 strlcpy(key, key_tmp, MAX_KEY_LEN+1);
+                zero_buf_wrapper(key_tmp, strlen(key_tmp));
 #endif
                 *key_len = strlen(key);
             }
@@ -1292,6 +1406,7 @@ get_keys(fko_ctx_t ctx, fko_cli_options_t *options,
                 return 0;
             }
             strlcpy(key, key_tmp, MAX_KEY_LEN+1);
+            zero_buf_wrapper(key_tmp, strlen(key_tmp));
 #endif
             *key_len = strlen(key);
         }
@@ -1342,6 +1457,7 @@ get_keys(fko_ctx_t ctx, fko_cli_options_t *options,
                 return 0;
             }
             strlcpy(hmac_key, hmac_key_tmp, MAX_KEY_LEN+1);
+            zero_buf_wrapper(hmac_key_tmp, strlen(hmac_key_tmp));
 #endif
             *hmac_key_len = strlen(hmac_key);
             use_hmac = 1;
@@ -1429,12 +1545,103 @@ enable_fault_injections(fko_cli_options_t * const opts)
 }
 #endif
 
+/* What the control client needs to knock the controller from within this
+ * process (see ctrl_send_spa()) rather than by running fwknop again
+*/
+static struct {
+    fko_ctx_t           ctx;
+    fko_cli_options_t  *options;
+    const char         *key;
+    int                 key_len;
+    const char         *hmac_key;
+    int                 hmac_key_len;
+    time_t              rc_mtime;
+    int                 knocked;        /* The main knock just went out */
+    struct timespec     knocked_at;
+    int               (*fallback)(sdp_com_t com);
+} ctrl_knock;
+
+static time_t
+rc_mtime(const char *rc_file)
+{
+    struct stat st;
+
+    if(rc_file[0] == 0x0 || stat(rc_file, &st) != 0)
+        return 0;
+    return st.st_mtime;
+}
+
+/* SPA callback for the control client.  The first connection attempt
+ * follows the knock this process just sent for the same stanza, so it
+ * only waits out what is left of the post-SPA delay.  Later attempts
+ * rebuild the packet from the context already set up (new random value
+ * and timestamp) and send it directly.  Once the rc file has changed,
+ * e.g. after a credential update, the stanza is stale and the control
+ * client's own fwknop exec takes over.
+*/
+static int
+ctrl_send_spa(sdp_com_t com)
+{
+    fko_cli_options_t  *options = ctrl_knock.options;
+    struct timespec     now, left;
+    long long           ns;
+    int                 res;
+
+    if(ctrl_knock.knocked)
+    {
+        ctrl_knock.knocked = 0;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ns = (long long)(com->post_spa_delay.tv_sec
+                - (now.tv_sec - ctrl_knock.knocked_at.tv_sec)) * 1000000000LL
+            + com->post_spa_delay.tv_nsec
+            - (now.tv_nsec - ctrl_knock.knocked_at.tv_nsec);
+        if(ns > 0)
+        {
+            left.tv_sec  = ns / 1000000000LL;
+            left.tv_nsec = ns % 1000000000LL;
+            nanosleep(&left, NULL);
+        }
+        return SDP_SUCCESS;
+    }
+
+    if(rc_mtime(options->rc_file) != ctrl_knock.rc_mtime)
+        return ctrl_knock.fallback(com);
+
+    res = fko_set_rand_value(ctrl_knock.ctx, NULL);
+    if(res == FKO_SUCCESS)
+        res = fko_set_timestamp(ctrl_knock.ctx, options->time_offset_plus > 0
+                ? options->time_offset_plus : -options->time_offset_minus);
+    if(res == FKO_SUCCESS)
+        res = fko_spa_data_final(ctrl_knock.ctx, ctrl_knock.key,
+                ctrl_knock.key_len, ctrl_knock.hmac_key, ctrl_knock.hmac_key_len);
+    if(res != FKO_SUCCESS)
+    {
+        errmsg("ctrl_send_spa", res);
+        return SDP_ERROR_SPA;
+    }
+
+    if(send_spa_packet(ctrl_knock.ctx, options) < 0)
+        return SDP_ERROR_SPA;
+
+    nanosleep(&(com->post_spa_delay), NULL);
+
+    return SDP_SUCCESS;
+}
+
 /* Run the SDP Control Client
+ *
+ * A one-shot client (REMAIN_CONNECTED no) runs in this process instead
+ * of a forked daemon, and a resident one is not started again when one
+ * already holds the PID file.  When the control client knocks with the
+ * same rc file and stanza as this run, it does so through ctrl_send_spa().
+ * knocked says whether the packet for that stanza has just been sent.
  */
 static pid_t
-run_sdp_ctrl_client(fko_cli_options_t *options)
+run_sdp_ctrl_client(fko_ctx_t ctx, fko_cli_options_t *options,
+    const char *key, const int key_len, const char *hmac_key,
+    const int hmac_key_len, const int knocked)
 {
-    pid_t child_pid = -1;
+    pid_t child_pid = -1, running_pid = 0;
     sdp_ctrl_client_t client = NULL;
 
     int rv = sdp_ctrl_client_new(options->sdp_ctrl_client_config_file,
@@ -1448,6 +1655,36 @@ run_sdp_ctrl_client(fko_cli_options_t *options)
 
     sdp_ctrl_client_describe(client);
 
+    if(!client->remain_connected)
+        client->foreground = 1;
+    else if(!client->foreground && sdp_ctrl_client_running(client, &running_pid))
+    {
+        log_msg(LOG_VERBOSITY_INFO,
+            "SDP ctrl client already running (PID=%d), not starting another",
+            (int)running_pid);
+        sdp_ctrl_client_destroy(client);
+        return running_pid;
+    }
+
+    if(!options->test && options->spa_proto != FKO_PROTO_HTTP
+            && client->com->ctrl_stanza != NULL
+            && client->com->fwknoprc_file != NULL
+            && strcmp(client->com->ctrl_stanza, options->use_rc_stanza) == 0
+            && strcmp(client->com->fwknoprc_file, options->rc_file) == 0)
+    {
+        ctrl_knock.ctx          = ctx;
+        ctrl_knock.options      = options;
+        ctrl_knock.key          = key;
+        ctrl_knock.key_len      = key_len;
+        ctrl_knock.hmac_key     = hmac_key;
+        ctrl_knock.hmac_key_len = hmac_key_len;
+        ctrl_knock.rc_mtime     = rc_mtime(options->rc_file);
+        ctrl_knock.knocked      = knocked;
+        clock_gettime(CLOCK_MONOTONIC, &ctrl_knock.knocked_at);
+        ctrl_knock.fallback     = client->com->func_ptr_send_spa;
+        client->com->func_ptr_send_spa = ctrl_send_spa;
+    }
+
     rv = sdp_ctrl_client_start(client, &child_pid);
 
     if(client->foreground)
@@ -1515,6 +1752,7 @@ clean_exit(fko_ctx_t ctx, fko_cli_options_t *opts,
     zero_buf_wrapper(hmac_key, *hmac_key_len);
     *key_len = 0;
     *hmac_key_len = 0;
+    key_store_destroy();
     log_msg(LOG_VERBOSITY_DEBUG, "fwknop clean_exit() : Supposedly exiting successfully, code is: %d", exit_status);
     exit(exit_status);
 }
@@ -70,6 +70,32 @@
 #define MAX_URL_HOST_LEN            256
 #define MAX_URL_PATH_LEN            1024
 
+/* Several comma separated --resolve-url values are queried at once, and
+ * the answer can be cached for --resolve-cache-ttl seconds (0 disables
+ * the cache).
+*/
+#define RESOLVE_MAX_URLS            4
+#define RESOLVE_TIMEOUT             10
+#define RESOLVE_CACHE_FILE          ".fwknop.ip"
+#define RESOLVE_CACHE_DEF_TTL       0
+#define RESOLVE_CACHE_MAX_TTL       86400
+
+/* For --flood load generation (--flood-rate 0 sends as fast as possible)
+*/
+#define FLOOD_DEF_COUNT             10000
+#define FLOOD_DEF_RATE              0
+#define FLOOD_MAX_COUNT             100000000
+#define FLOOD_MAX_RATE              10000000
+
+/* SPA packets kept ready per access list in --agent mode (--agent-pool)
+*/
+#define AGENT_POOL_DEF              2
+#define AGENT_POOL_MAX              16
+
+/* Longest --wait-open, in seconds
+*/
+#define WAIT_OPEN_MAX               3600
+
 /* fwknop client configuration parameters and values
 */
 typedef struct fko_cli_options
@@ -129,6 +155,7 @@ typedef struct fko_cli_options
     int  resolve_ip_http_https;
     int  resolve_http_only;
     char *resolve_url;
+    int  resolve_cache_ttl;
     char http_user_agent[HTTP_MAX_USER_AGENT_LEN];
     unsigned char use_wget_user_agent;
     char *wget_bin;
@@ -173,6 +200,30 @@ typedef struct fko_cli_options
     uint16_t        disable_sdp_mode;
     uint16_t        disable_sdp_ctrl_client;
 
+    /* Load generator mode (--flood)
+    */
+    char            flood_file[MAX_PATH_LEN];
+    int             flood_count;
+    int             flood_rate;
+
+    /* Agent mode (--agent)
+    */
+    char            agent_sock[MAX_PATH_LEN];
+    int             agent_pool;
+
+    /* Gateways knocked together (--gateways)
+    */
+    char            gateways_str[MAX_LINE_LEN];
+
+    /* Knock-and-wait (--wait-open, --wait-port)
+    */
+    int             wait_open;
+    int             wait_port;
+
+    /* Knock timestamps for SPA_TRACE on the server (--trace-file)
+    */
+    char            trace_file[MAX_PATH_LEN];
+
     //char            config_file[MAX_PATH_LEN];
 
 } fko_cli_options_t;
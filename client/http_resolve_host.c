@@ -43,6 +43,11 @@
   #endif
   #include <netdb.h>
   #include <sys/wait.h>
+  #include <poll.h>
+  #include <signal.h>
+  #include <fcntl.h>
+  #include <ifaddrs.h>
+  #include <net/if.h>
 #endif
 
 #if AFL_FUZZING
@@ -321,38 +326,72 @@ parse_url(char *res_url, struct url* url)
     return(0);
 }
 
-int
-resolve_ip_https(fko_cli_options_t *options)
+/* Pull a dotted quad off the front of a resolver response.  Returns 1
+ * and fills ip_str when the response holds a valid IPv4 address.
+*/
+static int
+resp_to_ipv4(char *resp, char *ip_str, const size_t ip_bufsize)
 {
-    int     o1, o2, o3, o4, got_resp=0, i=0;
-    char   *ndx, resp[MAX_IPV4_STR_LEN+1] = {0};
-    struct  url url; /* for validation only */
-    char    wget_ssl_cmd[MAX_URL_PATH_LEN] = {0};  /* for verbose logging only */
+    int     o1, o2, o3, o4, i;
 
-#if HAVE_EXECVPE
-    char   *wget_argv[MAX_CMDLINE_ARGS]; /* for execvpe() */
-    int     wget_argc=0;
-    int     pipe_fd[2];
-    pid_t   pid=0;
-    FILE   *output;
-    int     status;
-#else
-    FILE *wget;
-#endif
+    for(i=0; i<MAX_IPV4_STR_LEN; i++) {
+        if(! isdigit(*(resp+i)) && *(resp+i) != '.')
+            break;
+    }
+    *(resp+i) = '\0';
+
+    if((sscanf(resp, "%u.%u.%u.%u", &o1, &o2, &o3, &o4)) == 4
+            && o1 >= 0 && o1 <= 255
+            && o2 >= 0 && o2 <= 255
+            && o3 >= 0 && o3 <= 255
+            && o4 >= 0 && o4 <= 255)
+    {
+        strlcpy(ip_str, resp, ip_bufsize);
+        return 1;
+    }
+    return 0;
+}
+
+/* Split a comma separated --resolve-url value into at most
+ * RESOLVE_MAX_URLS entries, or use def_url when none was given.
+*/
+static int
+split_resolve_urls(const fko_cli_options_t *options,
+        char urls[][MAX_URL_PATH_LEN], const char *def_url)
+{
+    char    buf[MAX_URL_PATH_LEN], *tok, *save = NULL;
+    int     n = 0;
+
+    if(options->resolve_url == NULL)
+    {
+        strlcpy(urls[n++], def_url, MAX_URL_PATH_LEN);
+        return n;
+    }
+
+    strlcpy(buf, options->resolve_url, sizeof(buf));
+    for(tok = strtok_r(buf, ", ", &save); tok != NULL && n < RESOLVE_MAX_URLS;
+            tok = strtok_r(NULL, ", ", &save))
+        strlcpy(urls[n++], tok, MAX_URL_PATH_LEN);
+
+    return n;
+}
+
+static int
+build_wget_cmd(const fko_cli_options_t *options, char *url_str,
+        char *wget_ssl_cmd, const size_t cmd_size)
+{
+    struct  url url; /* for validation only */
 
-#if HAVE_EXECVPE
-    memset(wget_argv, 0x0, sizeof(wget_argv));
-#endif
     memset(&url, 0x0, sizeof(url));
 
     if(options->wget_bin != NULL)
     {
-        strlcpy(wget_ssl_cmd, options->wget_bin, sizeof(wget_ssl_cmd));
+        strlcpy(wget_ssl_cmd, options->wget_bin, cmd_size);
     }
     else
     {
 #ifdef WGET_EXE
-        strlcpy(wget_ssl_cmd, WGET_EXE, sizeof(wget_ssl_cmd));
+        strlcpy(wget_ssl_cmd, WGET_EXE, cmd_size);
 #else
         log_msg(LOG_VERBOSITY_ERROR,
                 "[*] Use --wget-cmd <path> to specify path to the wget command.");
@@ -364,40 +403,69 @@ resolve_ip_https(fko_cli_options_t *options)
     */
     if(! options->use_wget_user_agent)
     {
-        strlcat(wget_ssl_cmd, " -U ", sizeof(wget_ssl_cmd));
-        strlcat(wget_ssl_cmd, options->http_user_agent, sizeof(wget_ssl_cmd));
+        strlcat(wget_ssl_cmd, " -U ", cmd_size);
+        strlcat(wget_ssl_cmd, options->http_user_agent, cmd_size);
     }
 
     /* We collect the IP from wget's stdout
     */
     strlcat(wget_ssl_cmd,
-            " --secure-protocol=auto --quiet -O - ", sizeof(wget_ssl_cmd));
+            " --secure-protocol=auto --quiet -O - ", cmd_size);
 
     if(options->resolve_url != NULL)
     {
-        if(strncasecmp(options->resolve_url, "https", 5) != 0)
+        if(strncasecmp(url_str, "https", 5) != 0)
         {
             log_msg(LOG_VERBOSITY_ERROR,
                     "[-] Warning: IP resolution URL '%s' should begin with 'https://' in -R mode.",
-                    options->resolve_url);
+                    url_str);
         }
 
-        if(parse_url(options->resolve_url, &url) < 0)
+        if(parse_url(url_str, &url) < 0)
         {
             log_msg(LOG_VERBOSITY_ERROR, "Error parsing resolve-url");
             return(-1);
         }
-        /* tack on the original URL to the wget command
-        */
-        strlcat(wget_ssl_cmd, options->resolve_url, sizeof(wget_ssl_cmd));
-    }
-    else
-    {
-        /* tack on the default URL to the wget command
-        */
-        strlcat(wget_ssl_cmd, WGET_RESOLVE_URL_SSL, sizeof(wget_ssl_cmd));
     }
 
+    /* tack on the URL to the wget command
+    */
+    strlcat(wget_ssl_cmd, url_str, cmd_size);
+
+    return 1;
+}
+
+int
+resolve_ip_https(fko_cli_options_t *options)
+{
+    char    urls[RESOLVE_MAX_URLS][MAX_URL_PATH_LEN];
+    char    wget_ssl_cmd[RESOLVE_MAX_URLS][MAX_URL_PATH_LEN];
+    int     n_urls, i;
+
+#if HAVE_EXECVPE
+    char   *wget_argv[MAX_CMDLINE_ARGS]; /* for execvpe() */
+    int     wget_argc=0;
+    int     pipe_fd[2];
+    pid_t   pids[RESOLVE_MAX_URLS];
+    struct  pollfd pfds[RESOLVE_MAX_URLS];
+    char    resp[RESOLVE_MAX_URLS][MAX_IPV4_STR_LEN+1];
+    size_t  resp_len[RESOLVE_MAX_URLS];
+    int     running = 0, winner = -1, status;
+    ssize_t n;
+    time_t  deadline;
+#else
+    char    resp[MAX_IPV4_STR_LEN+1] = {0};
+    FILE   *wget;
+#endif
+
+    memset(wget_ssl_cmd, 0x0, sizeof(wget_ssl_cmd));
+
+    n_urls = split_resolve_urls(options, urls, WGET_RESOLVE_URL_SSL);
+    for(i=0; i < n_urls; i++)
+        if(build_wget_cmd(options, urls[i], wget_ssl_cmd[i],
+                    sizeof(wget_ssl_cmd[i])) != 1)
+            return(-1);
+
 #if AFL_FUZZING
     /* Make sure to not generate any resolution requests when compiled
      * for AFL fuzzing cycles
@@ -412,134 +480,178 @@ resolve_ip_https(fko_cli_options_t *options)
 #endif
 
 #if HAVE_EXECVPE
-    if(strtoargv(wget_ssl_cmd, wget_argv, &wget_argc, options) != 1)
-    {
-        log_msg(LOG_VERBOSITY_ERROR, "Error converting wget cmd str to argv");
-        return(-1);
-    }
-
     /* We drive wget to resolve the external IP via SSL. This may not
      * work on all platforms, but is a better strategy for now than
-     * requiring that fwknop link against an SSL library.
+     * requiring that fwknop link against an SSL library.  With several
+     * resolver URLs they are all queried at once and the first valid
+     * answer wins.
     */
-    if(pipe(pipe_fd) < 0)
+    memset(resp, 0x0, sizeof(resp));
+    for(i=0; i < n_urls; i++)
     {
-        log_msg(LOG_VERBOSITY_ERROR, "[*] pipe() error");
-        free_argv(wget_argv, &wget_argc);
-        return -1;
-    }
+        pids[i]       = -1;
+        pfds[i].fd     = -1;
+        pfds[i].events = POLLIN;
+        resp_len[i]   = 0;
+
+        memset(wget_argv, 0x0, sizeof(wget_argv));
+        wget_argc = 0;
+        if(strtoargv(wget_ssl_cmd[i], wget_argv, &wget_argc, options) != 1)
+        {
+            log_msg(LOG_VERBOSITY_ERROR, "Error converting wget cmd str to argv");
+            continue;
+        }
 
-    pid = fork();
-    if (pid == 0)
-    {
-        close(pipe_fd[0]);
-        dup2(pipe_fd[1], STDOUT_FILENO);
-        dup2(pipe_fd[1], STDERR_FILENO);
-        execvpe(wget_argv[0], wget_argv, (char * const *)NULL); /* don't use env */
-    }
-    else if(pid == -1)
-    {
-        log_msg(LOG_VERBOSITY_INFO, "[*] Could not fork() for wget.");
+        if(pipe(pipe_fd) < 0)
+        {
+            log_msg(LOG_VERBOSITY_ERROR, "[*] pipe() error");
+            free_argv(wget_argv, &wget_argc);
+            continue;
+        }
+
+        pids[i] = fork();
+        if (pids[i] == 0)
+        {
+            close(pipe_fd[0]);
+            dup2(pipe_fd[1], STDOUT_FILENO);
+            dup2(pipe_fd[1], STDERR_FILENO);
+            execvpe(wget_argv[0], wget_argv, (char * const *)NULL); /* don't use env */
+            _exit(EXIT_FAILURE);
+        }
+        else if(pids[i] == -1)
+        {
+            log_msg(LOG_VERBOSITY_INFO, "[*] Could not fork() for wget.");
+            close(pipe_fd[0]);
+        }
+        else
+        {
+            pfds[i].fd = pipe_fd[0];
+            running++;
+        }
+        close(pipe_fd[1]);
         free_argv(wget_argv, &wget_argc);
-        return -1;
     }
 
-    /* Only the parent process makes it here
+    /* Only the parent process makes it here.  Each wget is expected to
+     * print one line that contains the resolved IP.
     */
-    close(pipe_fd[1]);
-    if ((output = fdopen(pipe_fd[0], "r")) != NULL)
+    deadline = time(NULL) + RESOLVE_TIMEOUT;
+    while(running > 0 && winner < 0 && time(NULL) < deadline)
     {
-        if(fgets(resp, sizeof(resp), output) != NULL)
+        if(poll(pfds, n_urls, 100) < 0 && errno != EINTR)
+            break;
+
+        for(i=0; i < n_urls && winner < 0; i++)
         {
-            got_resp = 1;
+            if(pfds[i].fd < 0 || pfds[i].revents == 0)
+                continue;
+
+            n = read(pfds[i].fd, resp[i] + resp_len[i],
+                    MAX_IPV4_STR_LEN - resp_len[i]);
+            if(n > 0)
+                resp_len[i] += n;
+
+            if(n <= 0 || resp_len[i] == MAX_IPV4_STR_LEN
+                    || memchr(resp[i], '\n', resp_len[i]) != NULL)
+            {
+                if(resp_len[i] > 0 && resp_to_ipv4(resp[i],
+                            options->allow_ip_str, sizeof(options->allow_ip_str)))
+                    winner = i;
+                close(pfds[i].fd);
+                pfds[i].fd = -1;
+                running--;
+            }
         }
-        fclose(output);
     }
-    else
-    {
-        log_msg(LOG_VERBOSITY_INFO,
-                "[*] Could not fdopen() pipe output file descriptor.");
-        free_argv(wget_argv, &wget_argc);
-        return -1;
-    }
-
-    waitpid(pid, &status, 0);
 
-    free_argv(wget_argv, &wget_argc);
-
-#else /* fall back to popen() */
-    wget = popen(wget_ssl_cmd, "r");
-    if(wget == NULL)
+    for(i=0; i < n_urls; i++)
     {
-        log_msg(LOG_VERBOSITY_ERROR, "[*] Could not run cmd: %s",
-                wget_ssl_cmd);
-        return -1;
+        if(pfds[i].fd >= 0)
+            close(pfds[i].fd);
+        if(pids[i] > 0)
+        {
+            if(i != winner)
+                kill(pids[i], SIGTERM);
+            waitpid(pids[i], &status, 0);
+        }
     }
-    /* Expecting one line of wget output that contains the resolved IP.
-     * */
-    if ((fgets(resp, sizeof(resp), wget)) != NULL)
+
+    if(winner >= 0)
     {
-        got_resp = 1;
+        log_msg(LOG_VERBOSITY_INFO,
+                    "\n[+] Resolved external IP (via '%s') as: %s",
+                    wget_ssl_cmd[winner], options->allow_ip_str);
+        return 1;
     }
-    pclose(wget);
-#endif
 
-    if(got_resp)
+#else /* fall back to popen(), one URL at a time */
+    for(i=0; i < n_urls; i++)
     {
-        ndx = resp;
-        for(i=0; i<MAX_IPV4_STR_LEN; i++) {
-            if(! isdigit(*(ndx+i)) && *(ndx+i) != '.')
-                break;
+        wget = popen(wget_ssl_cmd[i], "r");
+        if(wget == NULL)
+        {
+            log_msg(LOG_VERBOSITY_ERROR, "[*] Could not run cmd: %s",
+                    wget_ssl_cmd[i]);
+            continue;
         }
-        *(ndx+i) = '\0';
-
-        if((sscanf(ndx, "%u.%u.%u.%u", &o1, &o2, &o3, &o4)) == 4
-                && o1 >= 0 && o1 <= 255
-                && o2 >= 0 && o2 <= 255
-                && o3 >= 0 && o3 <= 255
-                && o4 >= 0 && o4 <= 255)
+        /* Expecting one line of wget output that contains the resolved IP.
+         * */
+        memset(resp, 0x0, sizeof(resp));
+        if ((fgets(resp, sizeof(resp), wget)) != NULL
+                && resp_to_ipv4(resp, options->allow_ip_str,
+                    sizeof(options->allow_ip_str)))
         {
-            strlcpy(options->allow_ip_str, ndx, sizeof(options->allow_ip_str));
-
+            pclose(wget);
             log_msg(LOG_VERBOSITY_INFO,
                         "\n[+] Resolved external IP (via '%s') as: %s",
-                        wget_ssl_cmd, options->allow_ip_str);
+                        wget_ssl_cmd[i], options->allow_ip_str);
             return 1;
         }
+        pclose(wget);
     }
-    log_msg(LOG_VERBOSITY_ERROR,
-        "[-] Could not resolve IP via: '%s'", wget_ssl_cmd);
+#endif
+
+    for(i=0; i < n_urls; i++)
+        log_msg(LOG_VERBOSITY_ERROR,
+            "[-] Could not resolve IP via: '%s'", wget_ssl_cmd[i]);
     return -1;
 }
 
 int
 resolve_ip_http(fko_cli_options_t *options)
 {
-    int     res;
+    int     res, n_urls, i;
     struct  url url;
+    char    urls[RESOLVE_MAX_URLS][MAX_URL_PATH_LEN];
 
     memset(&url, 0, sizeof(url));
 
     if(options->resolve_url != NULL)
     {
         /* we only enter this function when the user forces non-HTTPS
-         * IP resolution
+         * IP resolution.  Several URLs are tried in turn.
         */
-        if(strncasecmp(options->resolve_url, "https", 5) == 0)
+        n_urls = split_resolve_urls(options, urls, "");
+        res = -1;
+        for(i=0; i < n_urls && res != 1; i++)
         {
-            log_msg(LOG_VERBOSITY_ERROR,
-                    "[*] https is not supported for --resolve-http-only.");
-            return(-1);
-        }
+            if(strncasecmp(urls[i], "https", 5) == 0)
+            {
+                log_msg(LOG_VERBOSITY_ERROR,
+                        "[*] https is not supported for --resolve-http-only.");
+                return(-1);
+            }
+
+            memset(&url, 0, sizeof(url));
+            if(parse_url(urls[i], &url) < 0)
+            {
+                log_msg(LOG_VERBOSITY_ERROR, "Error parsing resolve-url");
+                return(-1);
+            }
 
-        if(parse_url(options->resolve_url, &url) < 0)
-        {
-            log_msg(LOG_VERBOSITY_ERROR, "Error parsing resolve-url");
-            return(-1);
+            res = try_url(&url, options);
         }
 
-        res = try_url(&url, options);
-
     } else {
         strlcpy(url.port, "80", sizeof(url.port));
         strlcpy(url.host, HTTP_RESOLVE_HOST, sizeof(url.host));
@@ -561,4 +673,164 @@ resolve_ip_http(fko_cli_options_t *options)
     return(res);
 }
 
+/* A signature of the local network attachment: the addresses of the
+ * interfaces that are up, plus the default route on Linux.  When it
+ * changes (new Wi-Fi network, VPN up or down, ...) a cached external IP
+ * is no longer trusted.
+*/
+static unsigned long
+net_signature(void)
+{
+    unsigned long   h = 2166136261UL;
+#ifndef WIN32
+    struct ifaddrs *ifa_list = NULL, *ifa;
+    const unsigned char *p;
+    size_t          len, i;
+    char            line[MAX_LINE_LEN];
+    FILE           *route;
+
+    if(getifaddrs(&ifa_list) == 0)
+    {
+        for(ifa = ifa_list; ifa != NULL; ifa = ifa->ifa_next)
+        {
+            if(ifa->ifa_addr == NULL || !(ifa->ifa_flags & IFF_UP)
+                    || (ifa->ifa_flags & IFF_LOOPBACK))
+                continue;
+
+            if(ifa->ifa_addr->sa_family == AF_INET)
+            {
+                p   = (const unsigned char *)&((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+                len = sizeof(struct in_addr);
+            }
+            else if(ifa->ifa_addr->sa_family == AF_INET6)
+            {
+                p   = (const unsigned char *)&((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr;
+                len = sizeof(struct in6_addr);
+            }
+            else
+                continue;
+
+            for(i=0; i < len; i++)
+                h = (h ^ p[i]) * 16777619UL;
+            for(p = (const unsigned char *)ifa->ifa_name; *p != 0x0; p++)
+                h = (h ^ *p) * 16777619UL;
+        }
+        freeifaddrs(ifa_list);
+    }
+
+    if((route = fopen("/proc/net/route", "r")) != NULL)
+    {
+        while(fgets(line, sizeof(line), route) != NULL)
+        {
+            /* Iface  Destination  Gateway ... - only the default route
+            */
+            if(strstr(line, "\t00000000\t") == NULL)
+                continue;
+            for(p = (const unsigned char *)line; *p != 0x0; p++)
+                h = (h ^ *p) * 16777619UL;
+        }
+        fclose(route);
+    }
+#endif
+    return h & 0xffffffffUL;
+}
+
+static int
+get_cache_file(char *cache_file)
+{
+    char *homedir = NULL;
+
+#ifdef WIN32
+    homedir = getenv("USERPROFILE");
+#else
+    homedir = getenv("HOME");
+#endif
+    if (homedir == NULL)
+        return 0;
+
+    snprintf(cache_file, MAX_PATH_LEN, "%s%c%s",
+        homedir, PATH_SEP, RESOLVE_CACHE_FILE);
+    return 1;
+}
+
+/* Use the external IP from the last successful resolution if it is
+ * younger than --resolve-cache-ttl and the network has not changed
+ * since.  The cache file holds one line: "<ip> <time> <net signature>".
+*/
+int
+resolve_ip_cache_get(fko_cli_options_t *options)
+{
+    char            cache_file[MAX_PATH_LEN] = {0};
+    char            line[MAX_LINE_LEN] = {0};
+    char            ip[MAX_IPV4_STR_LEN+1] = {0};
+    unsigned long   cached_sig;
+    long long       cached_time;
+    time_t          now = time(NULL);
+    FILE           *fp;
+
+    if(options->resolve_cache_ttl <= 0 || get_cache_file(cache_file) != 1)
+        return 0;
+
+    if(verify_file_perms_ownership(cache_file) != 1)
+        return 0;
+
+    if((fp = fopen(cache_file, "r")) == NULL)
+        return 0;
+    if(fgets(line, sizeof(line), fp) == NULL)
+        line[0] = 0x0;
+    fclose(fp);
+
+    if(sscanf(line, "%15s %lld %lx", ip, &cached_time, &cached_sig) != 3)
+        return 0;
+
+    if(cached_time > now || now - cached_time > options->resolve_cache_ttl)
+    {
+        log_msg(LOG_VERBOSITY_DEBUG, "Cached external IP %s has expired", ip);
+        return 0;
+    }
+
+    if(cached_sig != net_signature())
+    {
+        log_msg(LOG_VERBOSITY_DEBUG,
+            "Network changed since external IP %s was cached", ip);
+        return 0;
+    }
+
+    if(resp_to_ipv4(ip, options->allow_ip_str,
+                sizeof(options->allow_ip_str)) != 1)
+        return 0;
+
+    log_msg(LOG_VERBOSITY_INFO,
+        "\n[+] Using cached external IP (%lld seconds old): %s",
+        (long long)(now - cached_time), options->allow_ip_str);
+    return 1;
+}
+
+void
+resolve_ip_cache_put(fko_cli_options_t *options)
+{
+    char    cache_file[MAX_PATH_LEN] = {0};
+    char    line[MAX_LINE_LEN] = {0};
+    int     fd;
+
+    if(options->resolve_cache_ttl <= 0 || get_cache_file(cache_file) != 1)
+        return;
+
+    snprintf(line, sizeof(line), "%s %lld %lx\n", options->allow_ip_str,
+        (long long)time(NULL), net_signature());
+
+    fd = open(cache_file, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+    if(fd < 0)
+    {
+        log_msg(LOG_VERBOSITY_WARNING,
+            "[-] Could not write external IP cache %s: %s", cache_file,
+            strerror(errno));
+        return;
+    }
+    if(write(fd, line, strlen(line)) != (ssize_t)strlen(line))
+        log_msg(LOG_VERBOSITY_WARNING,
+            "[-] Could not write external IP cache %s", cache_file);
+    close(fd);
+}
+
 /***EOF***/
@@ -0,0 +1,121 @@
+/*
+ *****************************************************************************
+ *
+ * File:    key_store.c
+ *
+ * Purpose: Key material lives in its own mapping, locked into RAM so it is
+ *          never written to swap, left out of core dumps, and fenced by
+ *          inaccessible guard pages so an overrun elsewhere faults instead
+ *          of reading or scribbling over the keys.  This matters most in
+ *          --agent mode, where the keys stay in memory for days.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "key_store.h"
+#include "utils.h"
+
+#include <sys/mman.h>
+
+static key_store_t *store       = NULL;
+static char        *arena       = NULL;
+static size_t       arena_len   = 0;
+static size_t       page_len    = 0;
+
+/* Used if the mapping cannot be made at all, so the client still works
+ * (without the extra protection).
+*/
+static key_store_t  fallback_store;
+
+/* Map guard page + key pages + guard page, lock the key pages and keep
+ * them out of core dumps.  Failing to lock (e.g. RLIMIT_MEMLOCK) is only
+ * worth a warning.
+*/
+static key_store_t *
+key_store_new(void)
+{
+    size_t  data_len;
+    long    pg;
+
+    pg = sysconf(_SC_PAGESIZE);
+    page_len  = pg > 0 ? (size_t)pg : 4096;
+    data_len  = (sizeof(key_store_t) + page_len - 1) & ~(page_len - 1);
+    arena_len = data_len + 2 * page_len;
+
+    arena = mmap(NULL, arena_len, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(arena == MAP_FAILED)
+    {
+        log_msg(LOG_VERBOSITY_WARNING,
+            "[#] key_store: mmap failed: %s, keys are not locked", strerror(errno));
+        arena = NULL;
+        return &fallback_store;
+    }
+
+    if(mprotect(arena, page_len, PROT_NONE) != 0
+            || mprotect(arena + page_len + data_len, page_len, PROT_NONE) != 0)
+        log_msg(LOG_VERBOSITY_DEBUG,
+            "key_store: guard pages not set: %s", strerror(errno));
+
+    if(mlock(arena + page_len, data_len) != 0)
+        log_msg(LOG_VERBOSITY_WARNING,
+            "[#] key_store: mlock failed: %s, keys may be swapped out",
+            strerror(errno));
+
+#ifdef MADV_DONTDUMP
+    madvise(arena + page_len, data_len, MADV_DONTDUMP);
+#endif
+
+    return (key_store_t *)(arena + page_len);
+}
+
+key_store_t *
+key_store_get(void)
+{
+    if(store == NULL)
+        store = key_store_new();
+    return store;
+}
+
+/* Zero and unmap the keys
+*/
+void
+key_store_destroy(void)
+{
+    if(store == NULL)
+        return;
+
+    if(zero_buf((char *)store, sizeof(key_store_t)) == FKO_ERROR_ZERO_OUT_DATA)
+        log_msg(LOG_VERBOSITY_ERROR,
+                "[*] Could not zero out sensitive data buffer.");
+
+    if(arena != NULL)
+    {
+        munlock(arena + page_len, arena_len - 2 * page_len);
+        munmap(arena, arena_len);
+        arena = NULL;
+    }
+    store = NULL;
+}
+
+/***EOF***/
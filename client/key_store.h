@@ -0,0 +1,52 @@
+/*
+ *****************************************************************************
+ *
+ * File:    key_store.h
+ *
+ * Purpose: Header file for key_store.c - locked memory for the client's
+ *          encryption and HMAC keys.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef KEY_STORE_H
+#define KEY_STORE_H
+
+#include "fwknop_common.h"
+
+/* The decoded keys, held once for the life of the process.  fko contexts,
+ * the agent and --gateways/--flood are handed pointers into it rather
+ * than copies.
+*/
+typedef struct key_store
+{
+    char    key[MAX_KEY_LEN+1];
+    char    hmac_key[MAX_KEY_LEN+1];
+} key_store_t;
+
+/* Function Prototypes
+*/
+key_store_t *key_store_get(void);
+void key_store_destroy(void);
+
+#endif  /* KEY_STORE_H */
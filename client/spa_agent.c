@@ -0,0 +1,816 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_agent.c
+ *
+ * Purpose: Resident client mode (--agent).  The access stanza, decoded
+ *          keys, the resolved server address and any SDP control client
+ *          session are set up once, then each knock request read from a
+ *          local unix socket only costs one fko_spa_data_final() and one
+ *          send() on an already connected UDP socket (or, in the raw
+ *          modes, on a raw socket with a prebuilt header template).
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "spa_agent.h"
+#include "spa_comm.h"
+#include "dns_resolve.h"
+#include "netinet_common.h"
+#include "utils.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <poll.h>
+
+/* Packets built ahead of time for one access list ("" for the -A/
+ * --service-ids default), oldest first.
+*/
+typedef struct agent_pool
+{
+    char    access[MAX_LINE_LEN];
+    int     in_use;
+    time_t  last_used;
+    int     count;
+    char   *spa_data[AGENT_POOL_MAX];
+    time_t  built[AGENT_POOL_MAX];
+} agent_pool_t;
+
+/* State kept for the life of the agent
+*/
+static int      listen_sock = -1;
+static int      spa_sock    = -1;
+static int      raw_sock    = -1;
+static spa_raw_tmpl_t raw_tmpl;
+static const char *agent_key;       /* In the key store, see key_store.c */
+static int      agent_key_len;
+static const char *agent_hmac_key;
+static int      agent_hmac_key_len;
+static char     default_msg[MAX_LINE_LEN];
+static time_t   rc_mtime;
+static time_t   spa_resolved_at;
+static int      dns_refreshing;
+
+static agent_pool_t pools[AGENT_POOL_LISTS];
+static struct sockaddr_storage pool_local_addr;
+
+static volatile sig_atomic_t got_sigterm = 0;
+static volatile sig_atomic_t got_sighup  = 0;
+
+static void
+agent_sig_handler(int sig)
+{
+    if(sig == SIGHUP)
+        got_sighup = 1;
+    else
+        got_sigterm = 1;
+}
+
+static time_t
+rc_file_mtime(const fko_cli_options_t *options)
+{
+    struct stat st;
+
+    if(options->rc_file[0] == 0x0 || stat(options->rc_file, &st) != 0)
+        return 0;
+    return st.st_mtime;
+}
+
+/* Descriptor passed in the environment by the agent we were re-executed
+ * from, or -1.
+*/
+static int
+inherited_fd(const char *name)
+{
+    char   *val = getenv(name);
+    int     is_err, fd;
+
+    if(val == NULL)
+        return -1;
+
+    fd = strtol_wrapper(val, 0, INT_MAX, NO_EXIT_UPON_ERR, &is_err);
+    unsetenv(name);
+    if(is_err != FKO_SUCCESS)
+        return -1;
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+static int
+agent_listen(const char *path)
+{
+    struct sockaddr_un  addr;
+    struct stat         st;
+    int                 sock;
+
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        log_msg(LOG_VERBOSITY_ERROR,
+            "[*] Agent socket path '%s' is too long", path);
+        return -1;
+    }
+
+    /* Clear a socket left behind by an agent that did not exit cleanly,
+     * but never anything that is not a socket.
+    */
+    if(lstat(path, &st) == 0)
+    {
+        if(! S_ISSOCK(st.st_mode))
+        {
+            log_msg(LOG_VERBOSITY_ERROR,
+                "[*] Agent socket path '%s' exists and is not a socket", path);
+            return -1;
+        }
+        unlink(path);
+    }
+
+    sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if(sock < 0)
+    {
+        log_msg(LOG_VERBOSITY_ERROR,
+            "agent_listen: Could not create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+
+    if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0
+            || chmod(path, S_IRUSR|S_IWUSR) != 0
+            || listen(sock, AGENT_LISTEN_BACKLOG) != 0)
+    {
+        log_msg(LOG_VERBOSITY_ERROR,
+            "agent_listen: Could not listen on '%s': %s", path, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/* The server is resolved and the UDP socket connected once, and again
+ * every AGENT_DNS_REFRESH seconds.  Anything that needs a fresh socket
+ * per packet (random ports, TCP, HTTP) goes through send_spa_packet()
+ * instead.
+*/
+static int
+agent_spa_socket(const fko_cli_options_t *options, const int nowait)
+{
+    int     sock = -1, error;
+    struct  addrinfo *result=NULL, *rp, hints;
+    char    port_str[MAX_PORT_STR_LEN+1] = {0};
+
+    spa_dns_hints(options, &hints);
+    snprintf(port_str, MAX_PORT_STR_LEN+1, "%d", options->spa_dst_port);
+
+    if(nowait)
+        error = dns_getaddrinfo_nowait(options->spa_server_str, port_str,
+                &hints, &result);
+    else
+        error = dns_getaddrinfo(options->spa_server_str, port_str,
+                &hints, &result);
+    if(error == EAI_AGAIN && nowait)
+        return -2;
+    if (error != 0)
+    {
+        log_msg(LOG_VERBOSITY_WARNING, "error in getaddrinfo: %s", gai_strerror(error));
+        return -1;
+    }
+
+    for (rp = result; rp != NULL; rp = rp->ai_next)
+    {
+        if(options->spa_server_resolve_ipv4 && rp->ai_family != AF_INET)
+            continue;
+
+        sock = socket(rp->ai_family, rp->ai_socktype|SOCK_CLOEXEC, rp->ai_protocol);
+        if (sock < 0)
+            continue;
+
+        if (connect(sock, rp->ai_addr, rp->ai_addrlen) != -1)
+            break;
+
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(result);
+
+    spa_resolved_at = time(NULL);
+    return sock;
+}
+
+/* Same for the raw modes: the header template is rebuilt around the
+ * server's (IPv4) address.  Returns -2 while the lookup is pending.
+*/
+static int
+agent_raw_template(fko_cli_options_t *options, const int nowait)
+{
+    struct addrinfo    *result = NULL, hints;
+    struct in_addr      dst;
+    int                 error;
+
+    spa_dns_hints(options, &hints);
+    if(nowait)
+        error = dns_getaddrinfo_nowait(options->spa_server_str, NULL,
+                &hints, &result);
+    else
+        error = dns_getaddrinfo(options->spa_server_str, NULL,
+                &hints, &result);
+    if(error == EAI_AGAIN && nowait)
+        return -2;
+    if (error != 0)
+    {
+        log_msg(LOG_VERBOSITY_WARNING, "error in getaddrinfo: %s", gai_strerror(error));
+        return -1;
+    }
+
+    dst = ((struct sockaddr_in *)result->ai_addr)->sin_addr;
+    freeaddrinfo(result);
+
+    spa_resolved_at = time(NULL);
+    return spa_raw_template(&raw_tmpl, options, &dst);
+}
+
+/* getaddrinfo() does not report record TTLs, so the server is looked up
+ * again at a fixed interval.  The lookup is started on one knock and
+ * picked up on a later one, so no knock waits on DNS; the old socket
+ * stays in use until the new answer is in.
+*/
+static void
+agent_dns_refresh(fko_cli_options_t *options)
+{
+    struct addrinfo hints;
+    int             sock;
+
+    if((spa_sock < 0 && raw_sock < 0) || time(NULL) - spa_resolved_at < AGENT_DNS_REFRESH)
+        return;
+
+    if(! dns_refreshing)
+    {
+        spa_dns_hints(options, &hints);
+        dns_prefetch(options->spa_server_str, &hints);
+        dns_refreshing = 1;
+        return;
+    }
+
+    if(raw_sock >= 0)
+    {
+        /* On failure the old template stays in place
+        */
+        if(agent_raw_template(options, 1) == -2)
+            return;
+        dns_refreshing = 0;
+        spa_resolved_at = time(NULL);
+        return;
+    }
+
+    sock = agent_spa_socket(options, 1);
+    if(sock == -2)
+        return;
+
+    dns_refreshing = 0;
+    spa_resolved_at = time(NULL);
+    if(sock >= 0)
+    {
+        close(spa_sock);
+        spa_sock = sock;
+    }
+}
+
+/* Returns 1 for a fresh agent, 0 when picking up from a reload and -1
+ * on error.
+*/
+int
+agent_start(fko_cli_options_t *options, const char *key,
+        const int key_len, const char *hmac_key, const int hmac_key_len)
+{
+    int     res;
+
+    agent_key = key;
+    agent_key_len = key_len;
+    agent_hmac_key = hmac_key;
+    agent_hmac_key_len = hmac_key_len;
+    rc_mtime = rc_file_mtime(options);
+
+    listen_sock = inherited_fd(AGENT_ENV_LISTEN_FD);
+    res = (listen_sock < 0);
+    if(listen_sock < 0)
+        listen_sock = agent_listen(options->agent_sock);
+    if(listen_sock < 0)
+        return -1;
+
+    if(options->spa_proto == FKO_PROTO_UDP && !options->rand_port
+            && !options->spa_src_port && !options->test)
+        spa_sock = agent_spa_socket(options, 0);
+
+    /* The raw modes keep one raw socket open (which needs root) and
+     * only fill in each packet's lengths, IDs and checksums
+    */
+    if((options->spa_proto == FKO_PROTO_TCP_RAW
+                || options->spa_proto == FKO_PROTO_UDP_RAW
+                || options->spa_proto == FKO_PROTO_ICMP)
+            && !options->rand_port && !options->test
+            && (raw_sock = spa_raw_socket()) >= 0)
+    {
+        fcntl(raw_sock, F_SETFD, FD_CLOEXEC);
+        if(agent_raw_template(options, 0) != 0)
+        {
+            close(raw_sock);
+            raw_sock = -1;
+        }
+    }
+
+    return res;
+}
+
+static int
+valid_access_str(const char *access)
+{
+    const char *c;
+
+    if(*access == 0x0)
+        return 0;
+
+    for(c = access; *c != 0x0; c++)
+        if(! isalnum((int)(unsigned char)*c)
+                && *c != '/' && *c != ',' && *c != '-')
+            return 0;
+    return 1;
+}
+
+/* Build one SPA packet in ctx.  With an access string (e.g.
+ * "tcp/22,udp/53") it replaces the -A/--service-ids part of the message
+ * for this packet only.
+*/
+static int
+agent_build(fko_ctx_t ctx, fko_cli_options_t *options, const char *access)
+{
+    char   *msg = NULL;
+    char    access_buf[MAX_LINE_LEN] = {0};
+    int     res;
+
+    if(default_msg[0] == 0x0)
+    {
+        res = fko_get_spa_message(ctx, &msg);
+        if(res != FKO_SUCCESS || msg == NULL)
+            return -1;
+        strlcpy(default_msg, msg, sizeof(default_msg));
+    }
+
+    if(access != NULL)
+    {
+        if(! valid_access_str(access))
+            return -1;
+        snprintf(access_buf, MAX_LINE_LEN, "%s%s%s",
+                options->allow_ip_str, ",", access);
+        res = fko_set_spa_message(ctx, access_buf);
+    }
+    else
+        res = fko_set_spa_message(ctx, default_msg);
+
+    if(res == FKO_SUCCESS)
+        res = fko_set_rand_value(ctx, NULL);
+    if(res == FKO_SUCCESS)
+        res = fko_set_timestamp(ctx, options->time_offset_plus > 0
+                ? options->time_offset_plus : -options->time_offset_minus);
+    if(res == FKO_SUCCESS)
+        res = fko_spa_data_final(ctx, agent_key, agent_key_len,
+                agent_hmac_key, agent_hmac_key_len);
+    if(res != FKO_SUCCESS)
+    {
+        log_msg(LOG_VERBOSITY_ERROR, "agent_knock: %s", fko_errstr(res));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Send a finished packet over the persistent socket.
+*/
+static int
+agent_send(fko_cli_options_t *options, char *spa_data)
+{
+    int     res;
+
+    agent_dns_refresh(options);
+
+    if(raw_sock >= 0)
+    {
+        res = spa_raw_send(raw_sock, &raw_tmpl, &spa_data, 1);
+        if(res < 0)
+            log_msg(LOG_VERBOSITY_WARNING,
+                "agent_knock: send error: %s", strerror(errno));
+        return res <= 0 ? -1 : raw_tmpl.hdrlen + (int)strlen(spa_data);
+    }
+
+    res = send(spa_sock, spa_data, strlen(spa_data), 0);
+    if(res < 0)
+        log_msg(LOG_VERBOSITY_WARNING,
+            "agent_knock: send error: %s", strerror(errno));
+    return res;
+}
+
+static int
+agent_pool_enabled(const fko_cli_options_t *options)
+{
+    return options->agent_pool > 0 && (spa_sock >= 0 || raw_sock >= 0);
+}
+
+static void
+agent_pool_drop(agent_pool_t *pool, const int n)
+{
+    int     i;
+
+    for(i=0; i < n; i++)
+    {
+        memset(pool->spa_data[i], 0x0, strlen(pool->spa_data[i]));
+        free(pool->spa_data[i]);
+    }
+    pool->count -= n;
+    memmove(pool->spa_data, pool->spa_data + n, pool->count * sizeof(char *));
+    memmove(pool->built, pool->built + n, pool->count * sizeof(time_t));
+}
+
+static void
+agent_pool_flush(void)
+{
+    int     i;
+
+    for(i=0; i < AGENT_POOL_LISTS; i++)
+        agent_pool_drop(&(pools[i]), pools[i].count);
+}
+
+/* The pool for an access list, set up (in place of the least recently
+ * used one) if create is set.
+*/
+static agent_pool_t *
+agent_pool_get(const char *access, const int create)
+{
+    agent_pool_t   *lru = &(pools[0]);
+    int             i;
+
+    if(access == NULL)
+        access = "";
+
+    for(i=0; i < AGENT_POOL_LISTS; i++)
+    {
+        if(pools[i].in_use && strcmp(pools[i].access, access) == 0)
+            return &(pools[i]);
+        if(! pools[i].in_use
+                || (lru->in_use && pools[i].last_used < lru->last_used))
+            lru = &(pools[i]);
+    }
+
+    if(! create)
+        return NULL;
+
+    agent_pool_drop(lru, lru->count);
+    strlcpy(lru->access, access, sizeof(lru->access));
+    lru->in_use = 1;
+    return lru;
+}
+
+/* Packets carry the source address only through -a/-R, which are fixed
+ * for the life of the agent, but a new local address (e.g. a roaming
+ * laptop) is still taken as a sign that anything built earlier may be
+ * stale.
+*/
+static void
+agent_pool_check_addr(void)
+{
+    struct sockaddr_storage addr;
+    socklen_t               len = sizeof(addr);
+
+    if(spa_sock < 0)
+        return;
+
+    memset(&addr, 0x0, sizeof(addr));
+    if(getsockname(spa_sock, (struct sockaddr *)&addr, &len) != 0)
+        return;
+
+    if(memcmp(&addr, &pool_local_addr, sizeof(addr)) != 0)
+    {
+        agent_pool_flush();
+        pool_local_addr = addr;
+    }
+}
+
+/* Drop packets that are getting old and build new ones until every pool
+ * is full again.
+*/
+static void
+agent_pool_fill(fko_ctx_t ctx, fko_cli_options_t *options)
+{
+    char           *spa_data = NULL;
+    agent_pool_t   *pool;
+    time_t          now = time(NULL);
+    int             i, n;
+
+    if(! agent_pool_enabled(options))
+        return;
+
+    agent_pool_check_addr();
+
+    for(i=0; i < AGENT_POOL_LISTS; i++)
+    {
+        pool = &(pools[i]);
+        if(! pool->in_use)
+            continue;
+
+        for(n=0; n < pool->count && now - pool->built[n] >= AGENT_POOL_MAX_AGE; n++)
+            ;
+        agent_pool_drop(pool, n);
+
+        while(pool->count < options->agent_pool)
+        {
+            if(agent_build(ctx, options,
+                        pool->access[0] != 0x0 ? pool->access : NULL) != 0
+                    || fko_get_spa_data(ctx, &spa_data) != FKO_SUCCESS
+                    || (pool->spa_data[pool->count] = strdup(spa_data)) == NULL)
+            {
+                /* Nothing built for a bad access list will ever work
+                */
+                agent_pool_drop(pool, pool->count);
+                pool->in_use = 0;
+                break;
+            }
+            pool->built[pool->count++] = now;
+        }
+    }
+}
+
+/* Send one SPA packet, taken from the pool if one is ready and built on
+ * the spot otherwise.  Returns the number of bytes sent or -1.
+*/
+int
+agent_knock(fko_ctx_t ctx, fko_cli_options_t *options, const char *access)
+{
+    char           *spa_data = NULL;
+    agent_pool_t   *pool = NULL;
+    int             res;
+
+    if(access != NULL && ! valid_access_str(access))
+        return -1;
+
+    if(agent_pool_enabled(options))
+    {
+        pool = agent_pool_get(access, 1);
+        pool->last_used = time(NULL);
+
+        /* Skip anything that aged out since the last top up
+        */
+        for(res=0; res < pool->count
+                && pool->last_used - pool->built[res] >= AGENT_POOL_MAX_AGE; res++)
+            ;
+        agent_pool_drop(pool, res);
+
+        if(pool->count > 0)
+        {
+            res = agent_send(options, pool->spa_data[0]);
+            agent_pool_drop(pool, 1);
+            return res;
+        }
+    }
+
+    if(agent_build(ctx, options, access) != 0)
+        return -1;
+
+    if(spa_sock < 0 && raw_sock < 0)
+        return send_spa_packet(ctx, options);
+
+    res = fko_get_spa_data(ctx, &spa_data);
+    if(res != FKO_SUCCESS)
+        return -1;
+
+    return agent_send(options, spa_data);
+}
+
+/* Re-execute with the same arguments so a changed rc file (new keys from
+ * the SDP control client, edited stanza) takes effect.  The listening
+ * socket and the client being served survive the exec.
+*/
+static void
+agent_reload(char **argv, const int client)
+{
+    char    fd_str[16], exe[MAX_PATH_LEN] = {0};
+
+    log_msg(LOG_VERBOSITY_NORMAL, "Agent reloading configuration");
+
+    /* Resolve our own binary rather than exec'ing /proc/self/exe, which
+     * would leave the process named "exe".
+    */
+    if(readlink("/proc/self/exe", exe, sizeof(exe) - 1) <= 0)
+        strlcpy(exe, argv[0], sizeof(exe));
+
+    fcntl(listen_sock, F_SETFD, 0);
+    snprintf(fd_str, sizeof(fd_str), "%d", listen_sock);
+    setenv(AGENT_ENV_LISTEN_FD, fd_str, 1);
+
+    if(client >= 0)
+    {
+        fcntl(client, F_SETFD, 0);
+        snprintf(fd_str, sizeof(fd_str), "%d", client);
+        setenv(AGENT_ENV_CLIENT_FD, fd_str, 1);
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    execv(exe, argv);
+
+    log_msg(LOG_VERBOSITY_ERROR,
+        "agent_reload: exec failed: %s, keeping the old configuration",
+        strerror(errno));
+    unsetenv(AGENT_ENV_LISTEN_FD);
+    unsetenv(AGENT_ENV_CLIENT_FD);
+    fcntl(listen_sock, F_SETFD, FD_CLOEXEC);
+    if(client >= 0)
+        fcntl(client, F_SETFD, FD_CLOEXEC);
+    rc_mtime = 0;
+}
+
+/* Serve requests from one client until it disconnects:
+ *
+ *   knock [<access>]   ->  OK <bytes sent> | ERR <reason>
+ *   ping               ->  OK 0
+*/
+static void
+agent_serve(fko_ctx_t ctx, fko_cli_options_t *options, const int client)
+{
+    char    buf[AGENT_MAX_REQ_LEN], reply[64], *line, *nl, *arg;
+    size_t  len = 0;
+    ssize_t n;
+    int     res;
+
+    while(! got_sigterm)
+    {
+        n = recv(client, buf + len, sizeof(buf) - 1 - len, 0);
+        if(n <= 0)
+            return;
+        len += n;
+        buf[len] = 0x0;
+
+        line = buf;
+        while((nl = strchr(line, '\n')) != NULL)
+        {
+            *nl = 0x0;
+            if(nl > line && *(nl-1) == '\r')
+                *(nl-1) = 0x0;
+
+            arg = NULL;
+            if(strncmp(line, "knock", 5) == 0
+                    && (line[5] == 0x0 || line[5] == ' '))
+            {
+                if(line[5] == ' ' && line[6] != 0x0)
+                    arg = line + 6;
+                res = agent_knock(ctx, options, arg);
+                if(res < 0)
+                    snprintf(reply, sizeof(reply), "ERR knock failed\n");
+                else
+                    snprintf(reply, sizeof(reply), "OK %d\n", res);
+            }
+            else if(strcmp(line, "ping") == 0)
+                snprintf(reply, sizeof(reply), "OK 0\n");
+            else
+                snprintf(reply, sizeof(reply), "ERR unknown request\n");
+
+            if(send(client, reply, strlen(reply), MSG_NOSIGNAL) < 0)
+                return;
+            line = nl + 1;
+        }
+
+        len -= line - buf;
+        memmove(buf, line, len);
+        if(len == sizeof(buf) - 1)
+            return;
+
+        /* Every reply is out, so replace the packets just used now
+         * rather than when they are next asked for.
+        */
+        agent_pool_fill(ctx, options);
+    }
+}
+
+int
+agent_run(fko_ctx_t ctx, fko_cli_options_t *options, char **argv)
+{
+    struct sigaction    act;
+    struct timeval      tv;
+    struct pollfd       pfd;
+    int                 client, res;
+
+    memset(&act, 0x0, sizeof(act));
+    act.sa_handler = agent_sig_handler;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGTERM, &act, NULL);
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGHUP, &act, NULL);
+
+    log_msg(LOG_VERBOSITY_NORMAL, "Agent listening on %s%s",
+        options->agent_sock, spa_sock >= 0 ? " (persistent UDP socket)"
+        : raw_sock >= 0 ? " (persistent raw socket)" : "");
+
+    client = inherited_fd(AGENT_ENV_CLIENT_FD);
+
+    /* Have packets for the default access list ready for the first knock
+    */
+    if(agent_pool_enabled(options))
+        agent_pool_get(NULL, 1);
+
+    while(! got_sigterm)
+    {
+        if(client < 0)
+        {
+            if(got_sighup)
+            {
+                got_sighup = 0;
+                agent_reload(argv, -1);
+            }
+
+            /* Top up the pools whenever no client has shown up for a
+             * while.
+            */
+            if(agent_pool_enabled(options))
+            {
+                agent_pool_fill(ctx, options);
+
+                pfd.fd      = listen_sock;
+                pfd.events  = POLLIN;
+                pfd.revents = 0;
+                res = poll(&pfd, 1, AGENT_POOL_TICK_MS);
+                if(res == 0 || (res < 0 && errno == EINTR))
+                    continue;
+            }
+
+            client = accept4(listen_sock, NULL, NULL, SOCK_CLOEXEC);
+            if(client < 0)
+            {
+                if(errno == EINTR || errno == ECONNABORTED)
+                {
+                    if(got_sighup)
+                    {
+                        got_sighup = 0;
+                        agent_reload(argv, -1);
+                    }
+                    continue;
+                }
+                log_msg(LOG_VERBOSITY_ERROR,
+                    "agent_run: accept error: %s", strerror(errno));
+                break;
+            }
+        }
+
+        if(got_sighup || (rc_mtime != 0 && rc_file_mtime(options) != rc_mtime))
+        {
+            got_sighup = 0;
+            agent_reload(argv, client);
+        }
+
+        tv.tv_sec  = AGENT_CLIENT_TIMEOUT;
+        tv.tv_usec = 0;
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        agent_serve(ctx, options, client);
+        close(client);
+        client = -1;
+    }
+
+    if(client >= 0)
+        close(client);
+    agent_pool_flush();
+    close(listen_sock);
+    unlink(options->agent_sock);
+    if(spa_sock >= 0)
+        close(spa_sock);
+    if(raw_sock >= 0)
+        close(raw_sock);
+
+    return got_sigterm ? 0 : -1;
+}
+
+/***EOF***/
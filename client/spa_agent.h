@@ -0,0 +1,72 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_agent.h
+ *
+ * Purpose: Header file for spa_agent.c - the resident --agent mode.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef SPA_AGENT_H
+#define SPA_AGENT_H
+
+#include "fwknop_common.h"
+
+/* Knock requests are one line each, and a client gets this many seconds
+ * to send one before it is dropped.
+*/
+#define AGENT_MAX_REQ_LEN       MAX_LINE_LEN
+#define AGENT_CLIENT_TIMEOUT    2
+#define AGENT_LISTEN_BACKLOG    16
+
+/* Seconds between lookups of the SPA server by a running agent
+*/
+#define AGENT_DNS_REFRESH       300
+
+/* With a persistent socket, --agent-pool packets are built ahead of time
+ * for each of the last AGENT_POOL_LISTS access lists knocked for, and
+ * topped up whenever the agent is idle for AGENT_POOL_TICK_MS and after
+ * every knock.  A packet is thrown away once it is AGENT_POOL_MAX_AGE
+ * seconds old, well inside the server's default MAX_SPA_PACKET_AGE of
+ * 120 seconds.
+*/
+#define AGENT_POOL_LISTS        8
+#define AGENT_POOL_TICK_MS      1000
+#define AGENT_POOL_MAX_AGE      30
+
+/* Descriptors handed across a reload (the agent re-executes itself when
+ * its rc file changes, e.g. after the SDP control client rotated keys).
+*/
+#define AGENT_ENV_LISTEN_FD     "FWKNOP_AGENT_LISTEN_FD"
+#define AGENT_ENV_CLIENT_FD     "FWKNOP_AGENT_CLIENT_FD"
+
+/* Function Prototypes
+*/
+int agent_start(fko_cli_options_t *options, const char *key,
+        const int key_len, const char *hmac_key, const int hmac_key_len);
+int agent_knock(fko_ctx_t ctx, fko_cli_options_t *options,
+        const char *access);
+int agent_run(fko_ctx_t ctx, fko_cli_options_t *options, char **argv);
+
+#endif  /* SPA_AGENT_H */
@@ -30,6 +30,7 @@
 */
 #include "spa_comm.h"
 #include "utils.h"
+#include "dns_resolve.h"
 
 static void
 dump_transmit_options(const fko_cli_options_t *options)
@@ -52,34 +53,6 @@ dump_transmit_options(const fko_cli_options_t *options)
     return;
 }
 
-/* Function to generate a header checksum.
-*/
-static unsigned short
-chksum(unsigned short *buf, int nbytes)
-{
-    unsigned int   sum;
-    unsigned short oddbyte;
-
-    sum = 0;
-    while (nbytes > 1)
-    {
-        sum += *buf++;
-        nbytes -= 2;
-    }
-
-    if (nbytes == 1)
-    {
-        oddbyte = 0;
-        *((unsigned short *) &oddbyte) = *(unsigned short *) buf;
-        sum += oddbyte;
-    }
-
-    sum = (sum >> 16) + (sum & 0xffff);
-    sum += (sum >> 16);
-
-    return (unsigned short) ~sum;
-}
-
 /* Send the SPA data via UDP packet.
 */
 static int
@@ -127,7 +100,7 @@ send_spa_packet_tcp_or_udp(const char *spa_data, const int sd_len,
     return res;
 #endif
 
-    error = getaddrinfo(options->spa_server_str, port_str, &hints, &result);
+    error = dns_getaddrinfo(options->spa_server_str, port_str, &hints, &result);
 
     if (error != 0)
     {
@@ -199,241 +172,376 @@ send_spa_packet_tcp_or_udp(const char *spa_data, const int sd_len,
     return(res);
 }
 
-/* Send the SPA data via raw TCP packet.
+#ifndef WIN32
+/* Internet checksum helpers.  The sum is accumulated a 32-bit word at a
+ * time into 64 bits and only folded down to 16 bits at the end, which
+ * gives the same result as the RFC 1071 loop over 16-bit words in half
+ * the iterations (or fewer, as the compiler is free to unroll it).
 */
-static int
-send_spa_packet_tcp_raw(const char *spa_data, const int sd_len,
-    const struct sockaddr_in *saddr, const struct sockaddr_in *daddr,
-    const fko_cli_options_t *options)
+static uint64_t
+csum_partial(const void *buf, size_t len, uint64_t sum)
 {
-#ifdef WIN32
-    log_msg(LOG_VERBOSITY_ERROR,
-        "send_spa_packet_tcp_raw: raw packets are not yet supported.");
-    return(-1);
-#else
-    int  sock, res = 0;
-    char pkt_data[2048] = {0}; /* Should be enough for our purposes */
+    const unsigned char *p = buf;
+    uint32_t             w;
+    uint16_t             h;
+
+    while(len >= 4)
+    {
+        memcpy(&w, p, 4);
+        sum += w;
+        p   += 4;
+        len -= 4;
+    }
+    if(len >= 2)
+    {
+        memcpy(&h, p, 2);
+        sum += h;
+        p   += 2;
+        len -= 2;
+    }
+    if(len == 1)
+    {
+        h = 0;
+        memcpy(&h, p, 1);
+        sum += h;
+    }
+    return sum;
+}
 
-    struct iphdr  *iph  = (struct iphdr *) pkt_data;
-    struct tcphdr *tcph = (struct tcphdr *) (pkt_data + sizeof (struct iphdr));
+static unsigned short
+csum_fold(uint64_t sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
 
-    int hdrlen = sizeof(struct iphdr) + sizeof(struct tcphdr);
+    return (unsigned short) ~sum;
+}
 
-    /* Values for setsockopt.
+/* The source address the kernel would pick for dst.  The raw headers
+ * need it up front since it is part of the TCP checksum.
+*/
+static in_addr_t
+raw_src_addr(const struct sockaddr_in *dst)
+{
+    struct sockaddr_in  src;
+    socklen_t           len = sizeof(src);
+    int                 sock;
+
+    memset(&src, 0x0, sizeof(src));
+    if((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+        return INADDR_ANY;
+
+    if(connect(sock, (const struct sockaddr *)dst, sizeof(*dst)) != 0
+            || getsockname(sock, (struct sockaddr *)&src, &len) != 0)
+        src.sin_addr.s_addr = INADDR_ANY;
+
+    close(sock);
+    return src.sin_addr.s_addr;
+}
+
+/* Build the header template for the tcpraw, udpraw or icmp modes.  With
+ * dst set, that address is used instead of resolving options->spa_server_str
+ * (the agent refreshes it from an asynchronous lookup).  Everything that
+ * does not depend on the payload is filled in here, along with the partial
+ * checksums over it, so each packet only costs a copy of the header and a
+ * checksum pass over its payload.
+*/
+int
+spa_raw_template(spa_raw_tmpl_t *tmpl, fko_cli_options_t *options,
+        const struct in_addr *dst)
+{
+    struct iphdr       *iph = (struct iphdr *) tmpl->hdr;
+    struct tcphdr      *tcph;
+    struct udphdr      *udph;
+    struct icmphdr     *icmph;
+    struct addrinfo     hints;
+    struct sockaddr_in  saddr;
+    char                ip_str[INET_ADDRSTRLEN] = {0};
+    uint16_t            pseudo = 0;
+
+    memset(tmpl, 0x0, sizeof(spa_raw_tmpl_t));
+    memset(&saddr, 0x0, sizeof(saddr));
+    tmpl->proto = options->spa_proto;
+
+    /* Set source address and port
     */
-    int         one     = 1;
-    const int  *so_val  = &one;
+    if (options->spa_src_port)
+        saddr.sin_port = htons(options->spa_src_port);
+    else
+        saddr.sin_port = INADDR_ANY;
 
-    if (options->test)
+    if (options->spoof_ip_src_str[0] != 0x00) {
+        saddr.sin_addr.s_addr = inet_addr(options->spoof_ip_src_str);
+    } else
+        saddr.sin_addr.s_addr = INADDR_ANY;  /* default */
+
+    if (saddr.sin_addr.s_addr == -1)
     {
-        log_msg(LOG_VERBOSITY_NORMAL,
-            "test mode enabled, SPA packet not actually sent.");
-        return res;
+        log_msg(LOG_VERBOSITY_ERROR, "Could not set source IP.");
+        return -1;
     }
 
-    sock = socket (PF_INET, SOCK_RAW, IPPROTO_RAW);
-    if (sock < 0)
+    /* Set destination address and port. We use the default protocol to
+     * resolve the ip address
+    */
+    tmpl->daddr.sin_family = AF_INET;
+    tmpl->daddr.sin_port   = htons(options->spa_dst_port);
+
+    if (dst != NULL)
+        tmpl->daddr.sin_addr = *dst;
+    else
     {
-        log_msg(LOG_VERBOSITY_ERROR, "send_spa_packet_tcp_raw: create socket: ", strerror(errno));
-        return(sock);
+        memset(&hints, 0x0, sizeof(hints));
+        hints.ai_family = AF_INET;
+
+        if (resolve_dst_addr(options->spa_server_str,
+                    &hints, ip_str, sizeof(ip_str), options) != 0)
+        {
+            log_msg(LOG_VERBOSITY_ERROR, "[*] Unable to resolve %s as an ip address",
+                    options->spa_server_str);
+            return -1;
+        }
+        tmpl->daddr.sin_addr.s_addr = inet_addr(ip_str);
     }
 
-    /* Put the spa data in place.
-    */
-    memcpy((pkt_data + hdrlen), spa_data, sd_len);
+    if (saddr.sin_addr.s_addr == INADDR_ANY)
+        saddr.sin_addr.s_addr = raw_src_addr(&tmpl->daddr);
 
-    /* Construct our own header by filling in the ip/tcp header values,
-     * starting with the IP header values.
+    /* The IP header, leaving out the total length, ID and checksum
     */
     iph->ihl        = 5;
     iph->version    = 4;
     iph->tos        = 0;
-    /* Total size is header plus payload */
-    iph->tot_len    = hdrlen + sd_len;
-    /* The value here does not matter */
-    iph->id         = random() & 0xffff;
     iph->frag_off   = 0;
     iph->ttl        = RAW_SPA_TTL;
-    iph->protocol   = IPPROTO_TCP;
-    iph->check      = 0;
-    iph->saddr      = saddr->sin_addr.s_addr;
-    iph->daddr      = daddr->sin_addr.s_addr;
-
-    /* Now the TCP header values.
-    */
-    tcph->source    = saddr->sin_port;
-    tcph->dest      = daddr->sin_port;
-    tcph->seq       = htonl(1);
-    tcph->ack_seq   = 0;
-    tcph->doff      = 5;
-    tcph->res1      = 0;
-    /* TCP flags */
-    tcph->fin       = 0;
-    tcph->syn       = 1;
-    tcph->rst       = 0;
-    tcph->psh       = 0;
-    tcph->ack       = 0;
-    tcph->urg       = 0;
-
-    tcph->res2      = 0;
-    tcph->window    = htons(32767);
-    tcph->check     = 0;
-    tcph->urg_ptr   = 0;
-
-    /* Now we can compute our checksum.
-    */
-    iph->check = chksum((unsigned short *)pkt_data, iph->tot_len);
+    iph->saddr      = saddr.sin_addr.s_addr;
+    iph->daddr      = tmpl->daddr.sin_addr.s_addr;
 
-    /* Make sure the kernel knows the header is included in the data so it
-     * doesn't try to insert its own header into the packet.
-    */
-    if (setsockopt (sock, IPPROTO_IP, IP_HDRINCL, so_val, sizeof(one)) < 0)
-        log_msg(LOG_VERBOSITY_ERROR, "send_spa_packet_tcp_raw: setsockopt HDRINCL: ", strerror(errno));
+    if (tmpl->proto == FKO_PROTO_TCP_RAW)
+    {
+        iph->protocol   = IPPROTO_TCP;
+        tmpl->hdrlen    = sizeof(struct iphdr) + sizeof(struct tcphdr);
 
-    res = sendto (sock, pkt_data, iph->tot_len, 0,
-        (struct sockaddr *)daddr, sizeof(*daddr));
+        tcph = (struct tcphdr *) (tmpl->hdr + sizeof(struct iphdr));
+        tcph->source    = saddr.sin_port;
+        tcph->dest      = tmpl->daddr.sin_port;
+        tcph->seq       = htonl(1);
+        tcph->ack_seq   = 0;
+        tcph->doff      = 5;
+        tcph->syn       = 1;
+        tcph->window    = htons(32767);
 
-    if(res < 0)
-    {
-        log_msg(LOG_VERBOSITY_ERROR, "send_spa_packet_tcp_raw: sendto error: ", strerror(errno));
+        /* Pseudo header (less the TCP length) plus the TCP header
+        */
+        memcpy(((unsigned char *)&pseudo) + 1, &iph->protocol, 1);
+        tmpl->l4_sum = csum_partial(&iph->saddr, 8, 0);
+        tmpl->l4_sum = csum_partial(&pseudo, 2, tmpl->l4_sum);
+        tmpl->l4_sum = csum_partial(tcph, sizeof(struct tcphdr), tmpl->l4_sum);
     }
-    else if(res != sd_len + hdrlen) /* account for the header ?*/
+    else if (tmpl->proto == FKO_PROTO_UDP_RAW)
     {
-        log_msg(LOG_VERBOSITY_WARNING,
-            "[#] Warning: bytes sent (%i) not spa data length (%i).",
-            res, sd_len
-        );
+        iph->protocol   = IPPROTO_UDP;
+        tmpl->hdrlen    = sizeof(struct iphdr) + sizeof(struct udphdr);
+
+        /* The UDP checksum is optional over IPv4 and left at zero
+        */
+        udph = (struct udphdr *) (tmpl->hdr + sizeof(struct iphdr));
+        udph->source    = saddr.sin_port;
+        udph->dest      = tmpl->daddr.sin_port;
     }
+    else
+    {
+        iph->protocol   = IPPROTO_ICMP;
+        tmpl->hdrlen    = sizeof(struct iphdr) + sizeof(struct icmphdr);
 
-    close(sock);
+        icmph = (struct icmphdr *) (tmpl->hdr + sizeof(struct iphdr));
+        icmph->type     = options->spa_icmp_type;
+        icmph->code     = options->spa_icmp_code;
 
-    return(res);
+        if(icmph->type == ICMP_ECHO && icmph->code == 0)
+            icmph->un.echo.sequence = htons(1);
 
-#endif /* !WIN32 */
+        tmpl->l4_sum = csum_partial(icmph, sizeof(struct icmphdr), 0);
+    }
+
+    tmpl->ip_sum = csum_partial(iph, sizeof(struct iphdr), 0);
+
+    return 0;
 }
 
-/* Send the SPA data via raw UDP packet.
+/* Fill in the per-packet fields of one header from the template.
 */
-static int
-send_spa_packet_udp_raw(const char *spa_data, const int sd_len,
-    const struct sockaddr_in *saddr, const struct sockaddr_in *daddr,
-    const fko_cli_options_t *options)
+static void
+raw_header(const spa_raw_tmpl_t *tmpl, unsigned char *hdr,
+        const char *spa_data, const int sd_len)
 {
-#ifdef WIN32
-    log_msg(LOG_VERBOSITY_ERROR,
-        "send_spa_packet_udp_raw: raw packets are not yet supported.");
-    return(-1);
-#else
-    int  sock, res = 0;
-    char pkt_data[2048] = {0}; /* Should be enough for our purposes */
+    struct iphdr   *iph = (struct iphdr *) hdr;
+    struct tcphdr  *tcph;
+    struct udphdr  *udph;
+    struct icmphdr *icmph;
+    uint16_t        l4_len;
+    uint64_t        sum;
 
-    struct iphdr  *iph  = (struct iphdr *) pkt_data;
-    struct udphdr *udph = (struct udphdr *) (pkt_data + sizeof (struct iphdr));
+    memcpy(hdr, tmpl->hdr, tmpl->hdrlen);
 
-    int hdrlen = sizeof(struct iphdr) + sizeof(struct udphdr);
+    /* Total size is header plus payload, and the ID does not matter
+    */
+    iph->tot_len    = tmpl->hdrlen + sd_len;
+    iph->id         = random() & 0xffff;
+    sum = tmpl->ip_sum + iph->tot_len + iph->id;
+    iph->check      = csum_fold(sum);
+
+    if (tmpl->proto == FKO_PROTO_TCP_RAW)
+    {
+        tcph   = (struct tcphdr *) (hdr + sizeof(struct iphdr));
+        l4_len = htons(sizeof(struct tcphdr) + sd_len);
+        sum    = csum_partial(spa_data, sd_len, tmpl->l4_sum + l4_len);
+        tcph->check = csum_fold(sum);
+    }
+    else if (tmpl->proto == FKO_PROTO_UDP_RAW)
+    {
+        udph = (struct udphdr *) (hdr + sizeof(struct iphdr));
+        udph->len = htons(sd_len + sizeof(struct udphdr));
+    }
+    else
+    {
+        icmph = (struct icmphdr *) (hdr + sizeof(struct iphdr));
+        sum   = tmpl->l4_sum;
+        if(icmph->type == ICMP_ECHO && icmph->code == 0)
+        {
+            icmph->un.echo.id = htons(random() & 0xffff);
+            sum += icmph->un.echo.id;
+        }
+        icmph->checksum = csum_fold(csum_partial(spa_data, sd_len, sum));
+    }
+}
+
+/* Raw socket for spa_raw_send(), kept open across packets by the agent
+ * and --flood.
+*/
+int
+spa_raw_socket(void)
+{
+    int         sock;
 
     /* Values for setsockopt.
     */
     int         one     = 1;
     const int  *so_val  = &one;
 
-    if (options->test)
-    {
-        log_msg(LOG_VERBOSITY_NORMAL,
-            "test mode enabled, SPA packet not actually sent.");
-        return res;
-    }
-
     sock = socket (PF_INET, SOCK_RAW, IPPROTO_RAW);
     if (sock < 0)
     {
-        log_msg(LOG_VERBOSITY_ERROR, "send_spa_packet_udp_raw: create socket: ", strerror(errno));
+        log_msg(LOG_VERBOSITY_ERROR, "spa_raw_socket: create socket: %s", strerror(errno));
         return(sock);
     }
 
-    /* Put the spa data in place.
-    */
-    memcpy((pkt_data + hdrlen), spa_data, sd_len);
-
-    /* Construct our own header by filling in the ip/udp header values,
-     * starting with the IP header values.
-    */
-    iph->ihl        = 5;
-    iph->version    = 4;
-    iph->tos        = 0;
-    /* Total size is header plus payload */
-    iph->tot_len    = hdrlen + sd_len;
-    /* The value here does not matter */
-    iph->id         = random() & 0xffff;
-    iph->frag_off   = 0;
-    iph->ttl        = RAW_SPA_TTL;
-    iph->protocol   = IPPROTO_UDP;
-    iph->check      = 0;
-    iph->saddr      = saddr->sin_addr.s_addr;
-    iph->daddr      = daddr->sin_addr.s_addr;
-
-    /* Now the UDP header values.
-    */
-    udph->source    = saddr->sin_port;
-    udph->dest      = daddr->sin_port;
-    udph->check     = 0;
-    udph->len       = htons(sd_len + sizeof(struct udphdr));
-
-    /* Now we can compute our checksum.
-    */
-    iph->check = chksum((unsigned short *)pkt_data, iph->tot_len);
-
     /* Make sure the kernel knows the header is included in the data so it
      * doesn't try to insert its own header into the packet.
     */
     if (setsockopt (sock, IPPROTO_IP, IP_HDRINCL, so_val, sizeof(one)) < 0)
-        log_msg(LOG_VERBOSITY_ERROR, "send_spa_packet_udp_raw: setsockopt HDRINCL: ", strerror(errno));
+        log_msg(LOG_VERBOSITY_ERROR, "spa_raw_socket: setsockopt HDRINCL: %s", strerror(errno));
 
-    res = sendto (sock, pkt_data, iph->tot_len, 0,
-        (struct sockaddr *)daddr, sizeof(*daddr));
+    return sock;
+}
 
-    if(res < 0)
-    {
-        log_msg(LOG_VERBOSITY_ERROR, "send_spa_packet_udp_raw: sendto error: ", strerror(errno));
-    }
-    else if(res != sd_len + hdrlen) /* account for the header ?*/
+/* Send count SPA packets with the template's headers, SPA_RAW_BATCH_LEN
+ * at a time per sendmmsg() call.  The payload is not copied: each message
+ * is the header followed by the SPA data as a second iovec.  Returns how
+ * many packets were sent, or -1 (with errno set) on an error other than a
+ * full socket buffer.
+*/
+int
+spa_raw_send(const int sock, const spa_raw_tmpl_t *tmpl,
+        char **spa_data, const int count)
+{
+    unsigned char   hdrs[SPA_RAW_BATCH_LEN][SPA_RAW_HDR_MAX];
+    struct iovec    iovs[SPA_RAW_BATCH_LEN][2];
+    struct msghdr   hdr;
+#if HAVE_SENDMMSG
+    struct mmsghdr  msgs[SPA_RAW_BATCH_LEN];
+    int             off;
+#endif
+    int             i, n, res, done = 0, sent = 0, sd_len;
+
+    while(done < count)
     {
-        log_msg(LOG_VERBOSITY_WARNING,
-            "[#] Warning: bytes sent (%i) not spa data length (%i).",
-            res, sd_len
-        );
-    }
+        n = count - done;
+        if(n > SPA_RAW_BATCH_LEN)
+            n = SPA_RAW_BATCH_LEN;
 
-    close(sock);
+        memset(&hdr, 0x0, sizeof(hdr));
+        hdr.msg_name    = (void *)&tmpl->daddr;
+        hdr.msg_namelen = sizeof(tmpl->daddr);
+        hdr.msg_iovlen  = 2;
 
-    return(res);
+        for(i=0; i < n; i++)
+        {
+            sd_len = strlen(spa_data[done+i]);
+            raw_header(tmpl, hdrs[i], spa_data[done+i], sd_len);
+            iovs[i][0].iov_base = hdrs[i];
+            iovs[i][0].iov_len  = tmpl->hdrlen;
+            iovs[i][1].iov_base = spa_data[done+i];
+            iovs[i][1].iov_len  = sd_len;
+#if HAVE_SENDMMSG
+            msgs[i].msg_hdr         = hdr;
+            msgs[i].msg_hdr.msg_iov = iovs[i];
+            msgs[i].msg_len         = 0;
+#endif
+        }
 
-#endif /* !WIN32 */
+#if HAVE_SENDMMSG
+        off = 0;
+        while(off < n)
+        {
+            res = sendmmsg(sock, msgs + off, n - off, 0);
+            if(res < 0)
+            {
+                if(errno == EINTR)
+                    continue;
+                if(errno != ENOBUFS && errno != EAGAIN)
+                    return -1;
+                off++;  /* step over the packet that failed */
+                continue;
+            }
+            off  += res;
+            sent += res;
+        }
+#else
+        for(i=0; i < n; i++)
+        {
+            hdr.msg_iov = iovs[i];
+            res = sendmsg(sock, &hdr, 0);
+            if(res < 0)
+            {
+                if(errno != ENOBUFS && errno != EAGAIN)
+                    return -1;
+                continue;
+            }
+            sent++;
+        }
+#endif
+        done += n;
+    }
+
+    return sent;
 }
 
-/* Send the SPA data via ICMP packet.
+/* Send the SPA data via raw TCP packet, raw UDP packet or ICMP packet.
 */
 static int
-send_spa_packet_icmp(const char *spa_data, const int sd_len,
-    const struct sockaddr_in *saddr, const struct sockaddr_in *daddr,
-    const fko_cli_options_t *options)
+send_spa_packet_raw(const char *spa_data, const int sd_len,
+    fko_cli_options_t *options)
 {
-#ifdef WIN32
-    log_msg(LOG_VERBOSITY_ERROR, "send_spa_packet_icmp: raw packets are not yet supported.");
-    return(-1);
-#else
-    int res = 0, sock;
-    char pkt_data[2048] = {0};
-
-    struct iphdr  *iph    = (struct iphdr *) pkt_data;
-    struct icmphdr *icmph = (struct icmphdr *) (pkt_data + sizeof (struct iphdr));
+    spa_raw_tmpl_t  tmpl;
+    char           *pkt = (char *)spa_data;
+    int             sock, res = 0;
 
-    int hdrlen = sizeof(struct iphdr) + sizeof(struct icmphdr);
-
-    /* Values for setsockopt.
-    */
-    int         one     = 1;
-    const int  *so_val  = &one;
+    if (spa_raw_template(&tmpl, options, NULL) != 0)
+        return -1;
 
     if (options->test)
     {
@@ -442,77 +550,22 @@ send_spa_packet_icmp(const char *spa_data, const int sd_len,
         return res;
     }
 
-    sock = socket (PF_INET, SOCK_RAW, IPPROTO_RAW);
-
-    if (sock < 0)
-    {
-        log_msg(LOG_VERBOSITY_ERROR, "send_spa_packet_icmp: create socket: ", strerror(errno));
+    if ((sock = spa_raw_socket()) < 0)
         return(sock);
-    }
-
-    /* Put the spa data in place.
-    */
-    memcpy((pkt_data + hdrlen), spa_data, sd_len);
-
-    /* Construct our own header by filling in the ip/icmp header values,
-     * starting with the IP header values.
-    */
-    iph->ihl        = 5;
-    iph->version    = 4;
-    iph->tos        = 0;
-    /* Total size is header plus payload */
-    iph->tot_len    = hdrlen + sd_len;
-    /* The value here does not matter */
-    iph->id         = random() & 0xffff;
-    iph->frag_off   = 0;
-    iph->ttl        = RAW_SPA_TTL;
-    iph->protocol   = IPPROTO_ICMP;
-    iph->check      = 0;
-    iph->saddr      = saddr->sin_addr.s_addr;
-    iph->daddr      = daddr->sin_addr.s_addr;
-
-    /* Now the ICMP header values.
-    */
-    icmph->type     = options->spa_icmp_type;
-    icmph->code     = options->spa_icmp_code;
-    icmph->checksum = 0;
-
-    if(icmph->type == ICMP_ECHO && icmph->code == 0)
-    {
-        icmph->un.echo.id       = htons(random() & 0xffff);
-        icmph->un.echo.sequence = htons(1);
-    }
-
-    /* Now we can compute our checksum.
-    */
-    iph->check = chksum((unsigned short *)pkt_data, iph->tot_len);
-    icmph->checksum = chksum((unsigned short *)icmph, sizeof(struct icmphdr) + sd_len);
-
-    /* Make sure the kernel knows the header is included in the data so it
-     * doesn't try to insert its own header into the packet.
-    */
-    if (setsockopt (sock, IPPROTO_IP, IP_HDRINCL, so_val, sizeof(one)) < 0)
-        log_msg(LOG_VERBOSITY_ERROR, "send_spa_packet_icmp: setsockopt HDRINCL: ", strerror(errno));
-
-    res = sendto (sock, pkt_data, iph->tot_len, 0,
-        (struct sockaddr *)daddr, sizeof(*daddr));
 
+    res = spa_raw_send(sock, &tmpl, &pkt, 1);
     if(res < 0)
-    {
-        log_msg(LOG_VERBOSITY_ERROR, "send_spa_packet_icmp: sendto error: ", strerror(errno));
-    }
-    else if(res != sd_len + hdrlen) /* account for icmp header */
-    {
-        log_msg(LOG_VERBOSITY_WARNING, "[#] Warning: bytes sent (%i) not spa data length (%i).",
-            res, sd_len);
-    }
+        log_msg(LOG_VERBOSITY_ERROR, "send_spa_packet_raw: sendto error: %s", strerror(errno));
+    else if(res == 0)
+        log_msg(LOG_VERBOSITY_WARNING, "[#] Warning: SPA packet was not sent.");
+    else
+        res = tmpl.hdrlen + sd_len;
 
     close(sock);
 
     return(res);
-
-#endif /* !WIN32 */
 }
+#endif /* !WIN32 */
 
 /* Send the SPA data packet via an HTTP request
 */
@@ -622,16 +675,10 @@ send_spa_packet(fko_ctx_t ctx, fko_cli_options_t *options)
 {
     int                 res, sd_len;
     char               *spa_data;
-    struct sockaddr_in  saddr, daddr;
-    char                ip_str[INET_ADDRSTRLEN] = {0};  /* String used to contain the ip addres of an hostname */
-    struct addrinfo     hints;                          /* Structure used to set hints to resolve hostname */
 #ifdef WIN32
     WSADATA wsa_data;
 #endif
 
-    /* Initialize the hint buffer */
-    memset(&hints, 0 , sizeof(hints));
-
     /* Get our spa data here.
     */
     res = fko_get_spa_data(ctx, &spa_data);
@@ -674,38 +721,6 @@ send_spa_packet(fko_ctx_t ctx, fko_cli_options_t *options)
             || options->spa_proto == FKO_PROTO_UDP_RAW
             || options->spa_proto == FKO_PROTO_ICMP)
     {
-        memset(&saddr, 0, sizeof(saddr));
-        memset(&daddr, 0, sizeof(daddr));
-
-        saddr.sin_family = AF_INET;
-        daddr.sin_family = AF_INET;
-
-        /* Set source address and port
-        */
-        if (options->spa_src_port)
-            saddr.sin_port = htons(options->spa_src_port);
-        else
-            saddr.sin_port = INADDR_ANY;
-
-        if (options->spoof_ip_src_str[0] != 0x00) {
-            saddr.sin_addr.s_addr = inet_addr(options->spoof_ip_src_str);
-        } else
-            saddr.sin_addr.s_addr = INADDR_ANY;  /* default */
-
-        if (saddr.sin_addr.s_addr == -1)
-        {
-            log_msg(LOG_VERBOSITY_ERROR, "Could not set source IP.");
-            return -1;
-        }
-
-        /* Set destination port
-        */
-        daddr.sin_port = htons(options->spa_dst_port);
-
-        /* Set destination address. We use the default protocol to resolve
-         * the ip address */
-        hints.ai_family = AF_INET;
-
 #if AFL_FUZZING
         /* Make sure to never send SPA packets under AFL fuzzing cycles
         */
@@ -714,29 +729,13 @@ send_spa_packet(fko_ctx_t ctx, fko_cli_options_t *options)
         return res;
 #endif
 
-        if (resolve_dst_addr(options->spa_server_str,
-                    &hints, ip_str, sizeof(ip_str), options) != 0)
-        {
-            log_msg(LOG_VERBOSITY_ERROR, "[*] Unable to resolve %s as an ip address",
-                    options->spa_server_str);
-            return -1;
-        }
-        else;
-
-        daddr.sin_addr.s_addr = inet_addr(ip_str);
-
-        if (options->spa_proto == FKO_PROTO_TCP_RAW)
-        {
-            res = send_spa_packet_tcp_raw(spa_data, sd_len, &saddr, &daddr, options);
-        }
-        else if (options->spa_proto == FKO_PROTO_UDP_RAW)
-        {
-            res = send_spa_packet_udp_raw(spa_data, sd_len, &saddr, &daddr, options);
-        }
-        else
-        {
-            res = send_spa_packet_icmp(spa_data, sd_len, &saddr, &daddr, options);
-        }
+#ifdef WIN32
+        log_msg(LOG_VERBOSITY_ERROR,
+            "send_spa_packet: raw packets are not yet supported.");
+        res = -1;
+#else
+        res = send_spa_packet_raw(spa_data, sd_len, options);
+#endif
     }
     else
     {
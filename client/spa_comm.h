@@ -34,9 +34,36 @@
 #include "fwknop_common.h"
 #include "netinet_common.h"
 
+#ifndef WIN32
+/* Raw mode (tcpraw, udpraw, icmp) packets go out this many to a
+ * sendmmsg() call.
+*/
+#define SPA_RAW_BATCH_LEN   64
+#define SPA_RAW_HDR_MAX     (sizeof(struct iphdr) + sizeof(struct tcphdr))
+
+/* Prebuilt headers for the raw modes, see spa_raw_template()
+*/
+typedef struct spa_raw_tmpl
+{
+    int                 proto;
+    struct sockaddr_in  daddr;
+    unsigned char       hdr[SPA_RAW_HDR_MAX];
+    int                 hdrlen;
+    uint64_t            ip_sum;     /* Partial checksums of the fixed */
+    uint64_t            l4_sum;     /* header fields */
+} spa_raw_tmpl_t;
+#endif
+
 /* Function Prototypes
 */
 int send_spa_packet(fko_ctx_t ctx, fko_cli_options_t *options);
 int write_spa_packet_data(fko_ctx_t ctx, const fko_cli_options_t *options);
+#ifndef WIN32
+int spa_raw_template(spa_raw_tmpl_t *tmpl, fko_cli_options_t *options,
+        const struct in_addr *dst);
+int spa_raw_socket(void);
+int spa_raw_send(const int sock, const spa_raw_tmpl_t *tmpl,
+        char **spa_data, const int count);
+#endif
 
 #endif  /* SPA_COMM_H */
@@ -0,0 +1,426 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_fanout.c
+ *
+ * Purpose: Send SPA packets to a list of gateways (--gateways) from one
+ *          invocation.  The packets are built together, then UDP ones go
+ *          out with a single sendmmsg() and TCP ones over non-blocking
+ *          sockets that connect in parallel, so knocking N replicas of a
+ *          service costs about as much as knocking one.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "spa_fanout.h"
+#include "spa_comm.h"
+#include "dns_resolve.h"
+#include "netinet_common.h"
+#include "utils.h"
+
+#include <sys/socket.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+
+typedef struct fanout_gw
+{
+    char                    host[MAX_SERVER_STR_LEN];
+    unsigned int            port;
+    struct sockaddr_storage addr;
+    socklen_t               addr_len;
+    int                     sock;
+    int                     sent;       /* bytes sent, or -1 */
+} fanout_gw_t;
+
+/* Split "host[:port],host[:port],..." into gws.  A host with more than
+ * one ':' is taken to be a bare IPv6 address.
+*/
+static int
+parse_gateways(const fko_cli_options_t *options, fanout_gw_t *gws)
+{
+    char    buf[MAX_LINE_LEN], *tok, *save = NULL, *colon;
+    int     count = 0, is_err;
+
+    strlcpy(buf, options->gateways_str, sizeof(buf));
+
+    for(tok = strtok_r(buf, ", ", &save); tok != NULL;
+            tok = strtok_r(NULL, ", ", &save))
+    {
+        if(count == FANOUT_MAX_GATEWAYS)
+        {
+            log_msg(LOG_VERBOSITY_ERROR,
+                "[*] --gateways lists more than %d gateways", FANOUT_MAX_GATEWAYS);
+            return -1;
+        }
+
+        memset(&gws[count], 0x0, sizeof(fanout_gw_t));
+        gws[count].port = options->spa_dst_port;
+        gws[count].sock = -1;
+        gws[count].sent = -1;
+
+        colon = strchr(tok, ':');
+        if(colon != NULL && strchr(colon+1, ':') == NULL)
+        {
+            *colon = 0x0;
+            gws[count].port = strtol_wrapper(colon+1, 1, MAX_PORT,
+                    NO_EXIT_UPON_ERR, &is_err);
+            if(is_err != FKO_SUCCESS)
+            {
+                log_msg(LOG_VERBOSITY_ERROR,
+                    "[*] Invalid port for gateway '%s'", tok);
+                return -1;
+            }
+        }
+        strlcpy(gws[count].host, tok, sizeof(gws[count].host));
+        count++;
+    }
+
+    return count;
+}
+
+static void
+gateway_hints(const fko_cli_options_t *options, struct addrinfo *hints)
+{
+    memset(hints, 0, sizeof(struct addrinfo));
+    hints->ai_family   = options->spa_server_resolve_ipv4 ? AF_INET : AF_UNSPEC;
+    hints->ai_socktype = options->spa_proto == FKO_PROTO_TCP ? SOCK_STREAM : SOCK_DGRAM;
+}
+
+static int
+resolve_gateway(const fko_cli_options_t *options, fanout_gw_t *gw)
+{
+    struct  addrinfo *result=NULL, *rp, hints;
+    char    port_str[MAX_PORT_STR_LEN+1] = {0};
+    int     error;
+
+    gateway_hints(options, &hints);
+
+    snprintf(port_str, MAX_PORT_STR_LEN+1, "%u", gw->port);
+
+    error = dns_getaddrinfo(gw->host, port_str, &hints, &result);
+    if (error != 0)
+    {
+        log_msg(LOG_VERBOSITY_ERROR, "[*] Gateway %s: %s", gw->host,
+            gai_strerror(error));
+        return -1;
+    }
+
+    rp = result;
+    memcpy(&gw->addr, rp->ai_addr, rp->ai_addrlen);
+    gw->addr_len = rp->ai_addrlen;
+    freeaddrinfo(result);
+
+    return 0;
+}
+
+/* One packet per gateway, built with the batch API where it applies.
+*/
+static int
+build_packets(fko_ctx_t ctx, const fko_cli_options_t *options,
+        const char *key, const int key_len,
+        const char *hmac_key, const int hmac_key_len,
+        const int count, char **spa_data)
+{
+    char   *tmp = NULL;
+    int     i, res;
+
+    if(! options->use_gpg)
+    {
+        res = fko_spa_data_final_batch(ctx, key, key_len,
+                hmac_key, hmac_key_len, count, spa_data);
+        if(res == FKO_SUCCESS)
+            return 0;
+
+        log_msg(LOG_VERBOSITY_ERROR, "fko_spa_data_final_batch: %s",
+            fko_errstr(res));
+        for(i=0; i < count && spa_data[i] != NULL; i++)
+            free(spa_data[i]);
+        return -1;
+    }
+
+    for(i=0; i < count; i++)
+    {
+        if(i > 0 && (res = fko_set_rand_value(ctx, NULL)) != FKO_SUCCESS)
+            break;
+        if((res = fko_spa_data_final(ctx, key, key_len,
+                hmac_key, hmac_key_len)) != FKO_SUCCESS)
+            break;
+        if((res = fko_get_spa_data(ctx, &tmp)) != FKO_SUCCESS)
+            break;
+        if((spa_data[i] = strdup(tmp)) == NULL)
+        {
+            res = FKO_ERROR_MEMORY_ALLOCATION;
+            break;
+        }
+    }
+
+    if(i < count)
+    {
+        log_msg(LOG_VERBOSITY_ERROR, "fko_spa_data_final: %s", fko_errstr(res));
+        while(i-- > 0)
+            free(spa_data[i]);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+send_udp(fanout_gw_t *gws, char **spa_data, const int count)
+{
+    int             sock4 = -1, sock6 = -1, i;
+#if HAVE_SENDMMSG
+    struct mmsghdr  msgs[FANOUT_MAX_GATEWAYS];
+    struct iovec    iovs[FANOUT_MAX_GATEWAYS];
+    int             idx[FANOUT_MAX_GATEWAYS];
+    int             n = 0, j, res, off;
+#endif
+
+    for(i=0; i < count; i++)
+    {
+        if(gws[i].addr_len == 0)
+            continue;
+        if(gws[i].addr.ss_family == AF_INET6 && sock6 < 0)
+            sock6 = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+        else if(gws[i].addr.ss_family == AF_INET && sock4 < 0)
+            sock4 = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    }
+
+#if HAVE_SENDMMSG
+    /* One sendmmsg() per address family
+    */
+    for(j=0; j < 2; j++)
+    {
+        int sock = j == 0 ? sock4 : sock6;
+
+        if(sock < 0)
+            continue;
+
+        n = 0;
+        for(i=0; i < count; i++)
+        {
+            if(gws[i].addr_len == 0
+                    || gws[i].addr.ss_family != (j == 0 ? AF_INET : AF_INET6))
+                continue;
+            memset(&msgs[n], 0x0, sizeof(struct mmsghdr));
+            iovs[n].iov_base = spa_data[i];
+            iovs[n].iov_len  = strlen(spa_data[i]);
+            msgs[n].msg_hdr.msg_name    = &gws[i].addr;
+            msgs[n].msg_hdr.msg_namelen = gws[i].addr_len;
+            msgs[n].msg_hdr.msg_iov     = &iovs[n];
+            msgs[n].msg_hdr.msg_iovlen  = 1;
+            idx[n++] = i;
+        }
+
+        for(off = 0; off < n; )
+        {
+            res = sendmmsg(sock, msgs + off, n - off, 0);
+            if(res < 0)
+            {
+                /* Step over the packet that failed
+                */
+                off++;
+                continue;
+            }
+            for(i=off; i < off + res; i++)
+                gws[idx[i]].sent = msgs[i].msg_len;
+            off += res;
+        }
+    }
+#else
+    for(i=0; i < count; i++)
+    {
+        int sock = gws[i].addr.ss_family == AF_INET6 ? sock6 : sock4;
+
+        if(gws[i].addr_len == 0 || sock < 0)
+            continue;
+        gws[i].sent = sendto(sock, spa_data[i], strlen(spa_data[i]), 0,
+                (struct sockaddr *)&gws[i].addr, gws[i].addr_len);
+    }
+#endif
+
+    if(sock4 >= 0)
+        close(sock4);
+    if(sock6 >= 0)
+        close(sock6);
+}
+
+/* Connect to every gateway at once and write each packet as soon as its
+ * connection is up.  Gateways that do not answer within
+ * FANOUT_TCP_TIMEOUT seconds are given up on.
+*/
+static void
+send_tcp(fanout_gw_t *gws, char **spa_data, const int count)
+{
+    struct pollfd   pfds[FANOUT_MAX_GATEWAYS];
+    int             i, pending = 0, err;
+    socklen_t       err_len;
+    time_t          deadline = time(NULL) + FANOUT_TCP_TIMEOUT;
+
+    for(i=0; i < count; i++)
+    {
+        pfds[i].fd     = -1;
+        pfds[i].events = POLLOUT;
+
+        if(gws[i].addr_len == 0)
+            continue;
+
+        gws[i].sock = socket(gws[i].addr.ss_family,
+                SOCK_STREAM|SOCK_NONBLOCK, IPPROTO_TCP);
+        if(gws[i].sock < 0)
+            continue;
+
+        if(connect(gws[i].sock, (struct sockaddr *)&gws[i].addr,
+                    gws[i].addr_len) != 0 && errno != EINPROGRESS)
+        {
+            close(gws[i].sock);
+            gws[i].sock = -1;
+            continue;
+        }
+        pfds[i].fd = gws[i].sock;
+        pending++;
+    }
+
+    while(pending > 0 && time(NULL) < deadline)
+    {
+        if(poll(pfds, count, 100) < 0 && errno != EINTR)
+            break;
+
+        for(i=0; i < count; i++)
+        {
+            if(pfds[i].fd < 0 || pfds[i].revents == 0)
+                continue;
+
+            err = 0;
+            err_len = sizeof(err);
+            getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+            if(err == 0)
+                gws[i].sent = send(pfds[i].fd, spa_data[i],
+                        strlen(spa_data[i]), MSG_NOSIGNAL);
+            pfds[i].fd = -1;
+            pending--;
+        }
+    }
+
+    for(i=0; i < count; i++)
+        if(gws[i].sock >= 0)
+            close(gws[i].sock);
+}
+
+/* Returns the number of gateways the packet could not be sent to, or -1
+ * if nothing was attempted.
+*/
+int
+fanout_spa_packets(fko_ctx_t ctx, fko_cli_options_t *options,
+        const char *key, const int key_len,
+        const char *hmac_key, const int hmac_key_len)
+{
+    fanout_gw_t     gws[FANOUT_MAX_GATEWAYS];
+    char           *spa_data[FANOUT_MAX_GATEWAYS];
+    char            orig_server[MAX_SERVER_STR_LEN];
+    unsigned int    orig_port;
+    int             count, i, failed = 0;
+
+    struct addrinfo hints;
+
+    count = parse_gateways(options, gws);
+    if(count <= 0)
+        return -1;
+
+    /* Let the lookups run while the packets are built
+    */
+    if(! options->test && (options->spa_proto == FKO_PROTO_UDP
+                || options->spa_proto == FKO_PROTO_TCP))
+    {
+        gateway_hints(options, &hints);
+        for(i=0; i < count; i++)
+            dns_prefetch(gws[i].host, &hints);
+    }
+
+    if(build_packets(ctx, options, key, key_len, hmac_key, hmac_key_len,
+                count, spa_data) != 0)
+        return -1;
+
+    if(options->test)
+    {
+        log_msg(LOG_VERBOSITY_NORMAL,
+            "test mode enabled, SPA packets for %d gateways not actually sent.",
+            count);
+        for(i=0; i < count; i++)
+            free(spa_data[i]);
+        return 0;
+    }
+
+    if(options->spa_proto == FKO_PROTO_UDP || options->spa_proto == FKO_PROTO_TCP)
+    {
+        for(i=0; i < count; i++)
+            if(resolve_gateway(options, &gws[i]) != 0)
+                gws[i].addr_len = 0;
+
+        if(options->spa_proto == FKO_PROTO_UDP)
+            send_udp(gws, spa_data, count);
+        else
+            send_tcp(gws, spa_data, count);
+    }
+    else
+    {
+        /* HTTP and the raw modes build their own packets on the wire, so
+         * these go out one gateway at a time through the regular path.
+        */
+        strlcpy(orig_server, options->spa_server_str, sizeof(orig_server));
+        orig_port = options->spa_dst_port;
+
+        for(i=0; i < count; i++)
+        {
+            strlcpy(options->spa_server_str, gws[i].host,
+                    sizeof(options->spa_server_str));
+            options->spa_dst_port = gws[i].port;
+            if(fko_set_rand_value(ctx, NULL) == FKO_SUCCESS
+                    && fko_spa_data_final(ctx, key, key_len,
+                        hmac_key, hmac_key_len) == FKO_SUCCESS)
+                gws[i].sent = send_spa_packet(ctx, options);
+        }
+
+        strlcpy(options->spa_server_str, orig_server,
+                sizeof(options->spa_server_str));
+        options->spa_dst_port = orig_port;
+    }
+
+    for(i=0; i < count; i++)
+    {
+        if(gws[i].sent > 0)
+            log_msg(LOG_VERBOSITY_INFO, "send_spa_packet: %s:%u: bytes sent: %d",
+                gws[i].host, gws[i].port, gws[i].sent);
+        else
+        {
+            log_msg(LOG_VERBOSITY_ERROR, "[*] %s:%u: packet not sent.",
+                gws[i].host, gws[i].port);
+            failed++;
+        }
+        free(spa_data[i]);
+    }
+
+    return failed;
+}
+
+/***EOF***/
@@ -0,0 +1,49 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_fanout.h
+ *
+ * Purpose: Header file for spa_fanout.c - knocking several gateways at
+ *          once (--gateways).
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef SPA_FANOUT_H
+#define SPA_FANOUT_H
+
+#include "fwknop_common.h"
+
+/* Most gateways one --gateways list may name, and how long the TCP
+ * connects to all of them may take together.
+*/
+#define FANOUT_MAX_GATEWAYS     64
+#define FANOUT_TCP_TIMEOUT      3
+
+/* Function Prototypes
+*/
+int fanout_spa_packets(fko_ctx_t ctx, fko_cli_options_t *options,
+        const char *key, const int key_len,
+        const char *hmac_key, const int hmac_key_len);
+
+#endif  /* SPA_FANOUT_H */
@@ -0,0 +1,436 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_flood.c
+ *
+ * Purpose: High-rate SPA load generator (--flood).  SPA packets for a list
+ *          of SDP identities are built in batches and sent over one
+ *          connected UDP socket (or one raw socket in the tcpraw, udpraw
+ *          and icmp modes), either as fast as possible or paced to
+ *          a target rate, to exercise fwknopd and the gateway at
+ *          realistic volumes.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "spa_flood.h"
+#include "spa_comm.h"
+#include "netinet_common.h"
+#include "utils.h"
+
+#include <sys/socket.h>
+#include <netdb.h>
+
+static void
+flood_errmsg(const char *msg, const int err)
+{
+    log_msg(LOG_VERBOSITY_ERROR, "%s: %s: Error %i - %s",
+        MY_NAME, msg, err, fko_errstr(err));
+}
+
+/* One line of the --flood identity file:
+ *
+ *   <sdp_id> <key_base64> [<hmac_key_base64>]
+*/
+typedef struct flood_id
+{
+    uint32_t    sdp_id;
+    char        key[MAX_KEY_LEN+1];
+    int         key_len;
+    char        hmac_key[MAX_KEY_LEN+1];
+    int         hmac_key_len;
+} flood_id_t;
+
+static unsigned long long
+elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+    return (unsigned long long)(end->tv_sec - start->tv_sec) * 1000000000ULL
+        + end->tv_nsec - start->tv_nsec;
+}
+
+static int
+decode_key(const char *b64, char *key, const int lnum, const char *what)
+{
+    unsigned char   tmp[MAX_B64_KEY_LEN+1] = {0};
+    int             len;
+
+    if(strlen(b64) > MAX_B64_KEY_LEN
+            || ! is_base64((unsigned char *)b64, strlen(b64)))
+    {
+        log_msg(LOG_VERBOSITY_ERROR,
+            "[*] Invalid base64 %s on line %d of flood file", what, lnum);
+        return -1;
+    }
+
+    len = fko_base64_decode(b64, tmp);
+    if(len <= 0 || len > MAX_KEY_LEN)
+    {
+        log_msg(LOG_VERBOSITY_ERROR,
+            "[*] Bad %s length on line %d of flood file", what, lnum);
+        return -1;
+    }
+    memcpy(key, tmp, len);
+    return len;
+}
+
+/* Read the identity file, returning the number of identities or -1.
+*/
+static int
+load_flood_ids(const char *file, flood_id_t **ids_out)
+{
+    FILE           *fp;
+    flood_id_t     *ids = NULL, *tmp;
+    char            line[MAX_LINE_LEN] = {0};
+    char            key_b64[MAX_LINE_LEN], hmac_b64[MAX_LINE_LEN];
+    char           *ndx;
+    unsigned long   sdp_id;
+    int             nids = 0, ids_len = 0, lnum = 0, fields;
+
+    if((fp = fopen(file, "r")) == NULL)
+    {
+        log_msg(LOG_VERBOSITY_ERROR, "[*] Could not open flood file '%s': %s",
+            file, strerror(errno));
+        return -1;
+    }
+
+    while(fgets(line, sizeof(line), fp) != NULL)
+    {
+        lnum++;
+
+        ndx = line;
+        while(isspace((int)(unsigned char)*ndx))
+            ndx++;
+        if(*ndx == '#' || *ndx == '\0')
+            continue;
+
+        hmac_b64[0] = '\0';
+        fields = sscanf(ndx, "%lu %s %s", &sdp_id, key_b64, hmac_b64);
+        if(fields < 2 || sdp_id == 0 || sdp_id > UINT32_MAX)
+        {
+            log_msg(LOG_VERBOSITY_ERROR,
+                "[*] Expected '<sdp_id> <key_base64> [<hmac_key_base64>]' on line %d of flood file",
+                lnum);
+            goto fail;
+        }
+
+        if(nids == ids_len)
+        {
+            ids_len = ids_len ? ids_len * 2 : 64;
+            if((tmp = realloc(ids, ids_len * sizeof(flood_id_t))) == NULL)
+            {
+                log_msg(LOG_VERBOSITY_ERROR,
+                    "[*] Memory allocation error reading flood file");
+                goto fail;
+            }
+            ids = tmp;
+        }
+
+        memset(&ids[nids], 0x0, sizeof(flood_id_t));
+        ids[nids].sdp_id = (uint32_t)sdp_id;
+
+        if((ids[nids].key_len = decode_key(key_b64,
+                ids[nids].key, lnum, "key")) < 0)
+            goto fail;
+
+        if(fields == 3 && (ids[nids].hmac_key_len = decode_key(hmac_b64,
+                ids[nids].hmac_key, lnum, "HMAC key")) < 0)
+            goto fail;
+
+        nids++;
+    }
+    fclose(fp);
+
+    if(nids == 0)
+    {
+        log_msg(LOG_VERBOSITY_ERROR, "[*] No identities found in flood file '%s'",
+            file);
+        free(ids);
+        return -1;
+    }
+
+    *ids_out = ids;
+    return nids;
+
+fail:
+    fclose(fp);
+    if(ids != NULL)
+    {
+        memset(ids, 0x0, nids * sizeof(flood_id_t));
+        free(ids);
+    }
+    return -1;
+}
+
+/* Connected UDP socket to the SPA server, as in send_spa_packet_tcp_or_udp()
+*/
+static int
+flood_socket(const fko_cli_options_t *options)
+{
+    int     sock = -1, error;
+    struct  addrinfo *result=NULL, *rp, hints;
+    char    port_str[MAX_PORT_STR_LEN+1] = {0};
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+
+    snprintf(port_str, MAX_PORT_STR_LEN+1, "%d", options->spa_dst_port);
+
+    error = getaddrinfo(options->spa_server_str, port_str, &hints, &result);
+    if (error != 0)
+    {
+        log_msg(LOG_VERBOSITY_ERROR, "error in getaddrinfo: %s", gai_strerror(error));
+        return -1;
+    }
+
+    for (rp = result; rp != NULL; rp = rp->ai_next)
+    {
+        if(options->spa_server_resolve_ipv4 && rp->ai_family != AF_INET)
+            continue;
+
+        sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (sock < 0)
+            continue;
+
+        if (connect(sock, rp->ai_addr, rp->ai_addrlen) != -1)
+            break;
+
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(result);
+
+    if (sock < 0)
+        log_msg(LOG_VERBOSITY_ERROR,
+            "flood_socket: Could not create socket: %s", strerror(errno));
+
+    return sock;
+}
+
+/* Send one batch, returning how many packets made it out.  A full socket
+ * buffer counts as a send error rather than stalling the generator.
+*/
+static int
+flood_send(const int sock, char **spa_data, const int count)
+{
+    int             sent = 0;
+#if HAVE_SENDMMSG
+    struct mmsghdr  msgs[FLOOD_BATCH_LEN];
+    struct iovec    iovs[FLOOD_BATCH_LEN];
+    int             i, res, off = 0;
+
+    memset(msgs, 0x0, count * sizeof(struct mmsghdr));
+    for(i=0; i < count; i++)
+    {
+        iovs[i].iov_base = spa_data[i];
+        iovs[i].iov_len  = strlen(spa_data[i]);
+        msgs[i].msg_hdr.msg_iov    = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while(off < count)
+    {
+        res = sendmmsg(sock, msgs + off, count - off, 0);
+        if(res < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno != ENOBUFS && errno != EAGAIN && errno != ECONNREFUSED)
+                return -1;
+            off++;  /* step over the packet that failed */
+            continue;
+        }
+        off  += res;
+        sent += res;
+    }
+#else
+    int             i;
+
+    for(i=0; i < count; i++)
+    {
+        if(send(sock, spa_data[i], strlen(spa_data[i]), 0) < 0)
+        {
+            if(errno != ENOBUFS && errno != EAGAIN && errno != ECONNREFUSED)
+                return -1;
+            continue;
+        }
+        sent++;
+    }
+#endif
+    return sent;
+}
+
+int
+flood_spa_packets(fko_ctx_t ctx, fko_cli_options_t *options)
+{
+    flood_id_t         *ids = NULL, *id;
+    char               *spa_data[FLOOD_BATCH_LEN];
+    struct timespec     start, end, t0, t1, next;
+    unsigned long long  gen_ns = 0, send_ns = 0, total_ns, due_ns;
+    int                 nids, sock = -1, batch, n, i, res, ret = -1;
+    int                 built = 0, sent = 0, errors = 0, idx = 0;
+    int                 hmac_type, raw;
+    double              secs;
+    spa_raw_tmpl_t      tmpl;
+    char                target[32];
+
+    if((nids = load_flood_ids(options->flood_file, &ids)) < 0)
+        return -1;
+
+    raw = options->spa_proto != FKO_PROTO_UDP;
+    if(raw && spa_raw_template(&tmpl, options, NULL) != 0)
+        goto done;
+
+    if(! options->test
+            && (sock = raw ? spa_raw_socket() : flood_socket(options)) < 0)
+        goto done;
+
+    hmac_type = options->hmac_type == FKO_HMAC_UNKNOWN
+        ? FKO_DEFAULT_HMAC_MODE : options->hmac_type;
+
+    /* At a target rate, keep bursts to about 1/FLOOD_BURSTS_PER_SEC
+     * of a second's worth of packets.
+    */
+    batch = FLOOD_BATCH_LEN;
+    if(options->flood_rate > 0)
+    {
+        batch = options->flood_rate / FLOOD_BURSTS_PER_SEC;
+        if(batch < 1)
+            batch = 1;
+        else if(batch > FLOOD_BATCH_LEN)
+            batch = FLOOD_BATCH_LEN;
+    }
+
+    log_msg(LOG_VERBOSITY_NORMAL,
+        "[+] Flooding %s with %d SPA packets for %d identities%s...",
+        options->test ? "(test mode)" : options->spa_server_str,
+        options->flood_count, nids,
+        options->flood_rate > 0 ? "" : " as fast as possible");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while(built < options->flood_count)
+    {
+        n = options->flood_count - built;
+        if(n > batch)
+            n = batch;
+
+        id = &ids[idx++ % nids];
+
+        if(! options->disable_sdp_mode
+                && (res = fko_set_sdp_id(ctx, id->sdp_id)) != FKO_SUCCESS)
+        {
+            flood_errmsg("fko_set_sdp_id", res);
+            goto done;
+        }
+
+        if(id->hmac_key_len > 0
+                && (res = fko_set_spa_hmac_type(ctx, hmac_type)) != FKO_SUCCESS)
+        {
+            flood_errmsg("fko_set_spa_hmac_type", res);
+            goto done;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        res = fko_spa_data_final_batch(ctx, id->key, id->key_len,
+                id->hmac_key, id->hmac_key_len, n, spa_data);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        gen_ns += elapsed_ns(&t0, &t1);
+
+        if(res != FKO_SUCCESS)
+        {
+            flood_errmsg("fko_spa_data_final_batch", res);
+            for(i=0; i < n && spa_data[i] != NULL; i++)
+                free(spa_data[i]);
+            goto done;
+        }
+        built += n;
+
+        if(sock >= 0)
+        {
+            res = raw ? spa_raw_send(sock, &tmpl, spa_data, n)
+                : flood_send(sock, spa_data, n);
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            send_ns += elapsed_ns(&t1, &t0);
+            if(res < 0)
+            {
+                log_msg(LOG_VERBOSITY_ERROR,
+                    "[*] flood: send failed: %s", strerror(errno));
+                res = 0;
+            }
+            sent   += res;
+            errors += n - res;
+        }
+
+        for(i=0; i < n; i++)
+            free(spa_data[i]);
+
+        /* Sleep until the next burst is due
+        */
+        if(options->flood_rate > 0 && built < options->flood_count)
+        {
+            due_ns = (unsigned long long)built * 1000000000ULL
+                / options->flood_rate;
+            next.tv_sec  = start.tv_sec + due_ns / 1000000000ULL;
+            next.tv_nsec = start.tv_nsec + due_ns % 1000000000ULL;
+            if(next.tv_nsec >= 1000000000L)
+            {
+                next.tv_sec++;
+                next.tv_nsec -= 1000000000L;
+            }
+            while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                    &next, NULL) == EINTR)
+                ;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    total_ns = elapsed_ns(&start, &end);
+    secs     = total_ns / 1e9;
+
+    if(options->flood_rate > 0)
+        snprintf(target, sizeof(target), "%d", options->flood_rate);
+    else
+        strlcpy(target, "unlimited", sizeof(target));
+
+    log_msg(LOG_VERBOSITY_NORMAL,
+        "[+] Built %d SPA packets in %.3f sec: %.0f packets/sec achieved (target: %s)",
+        built, secs, secs > 0 ? built / secs : 0.0, target);
+    log_msg(LOG_VERBOSITY_NORMAL,
+        "    generation: %.0f packets/sec, send: %.0f packets/sec, %d sent, %d send errors",
+        gen_ns ? built * 1e9 / gen_ns : 0.0,
+        send_ns ? sent * 1e9 / send_ns : 0.0,
+        sent, errors);
+
+    ret = 0;
+
+done:
+    if(sock >= 0)
+        close(sock);
+    memset(ids, 0x0, nids * sizeof(flood_id_t));
+    free(ids);
+    return ret;
+}
+
+/***EOF***/
@@ -0,0 +1,50 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_flood.h
+ *
+ * Purpose: Header file for spa_flood.c - the --flood SPA load generator.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef SPA_FLOOD_H
+#define SPA_FLOOD_H
+
+#include "fwknop_common.h"
+
+/* Packets built with one fko_spa_data_final_batch() call and handed to
+ * one sendmmsg() call.
+*/
+#define FLOOD_BATCH_LEN     64
+
+/* With --flood-rate, the batch is shrunk so that the pacing stays
+ * smooth at about this many bursts per second.
+*/
+#define FLOOD_BURSTS_PER_SEC 100
+
+/* Function Prototypes
+*/
+int flood_spa_packets(fko_ctx_t ctx, fko_cli_options_t *options);
+
+#endif  /* SPA_FLOOD_H */
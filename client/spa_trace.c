@@ -0,0 +1,103 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_trace.c
+ *
+ * Purpose: The client side of a traced knock (--trace-file).  When the
+ *          SPA packet was built, sent and (with --wait-open) found open
+ *          is appended to a file, tagged with the packet's random value,
+ *          which fwknopd with SPA_TRACE uses as the ID of its own stage
+ *          timings.  extras/spa-trace/spa-trace.pl joins the two.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "spa_trace.h"
+#include "utils.h"
+#include "log_msg.h"
+
+#include <time.h>
+
+/* Wall clock time in nanoseconds, so that it can be lined up with the
+ * server's (which is only meaningful if the clocks are in sync).
+*/
+uint64_t
+spa_trace_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return((uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec);
+}
+
+/* Append one line for this knock to the --trace-file ("-" is stdout).
+ * Returns 0 on success.
+*/
+int
+spa_trace_write(const fko_cli_options_t *options, fko_ctx_t ctx,
+        const char *host, const spa_trace_t *trace)
+{
+    FILE       *fp;
+    char       *rand_val = NULL;
+    int         res;
+
+    res = fko_get_rand_value(ctx, &rand_val);
+    if(res != FKO_SUCCESS || rand_val == NULL)
+    {
+        log_msg(LOG_VERBOSITY_ERROR, "spa_trace_write: no random value: %s",
+                fko_errstr(res));
+        return -1;
+    }
+
+    if(strcmp(options->trace_file, "-") == 0)
+        fp = stdout;
+    else if((fp = fopen(options->trace_file, "a")) == NULL)
+    {
+        log_msg(LOG_VERBOSITY_ERROR, "Unable to open trace file '%s': %s",
+                options->trace_file, strerror(errno));
+        return -1;
+    }
+
+    /* fwknopd prints the ID as a number, so this does too (a random
+     * value can start with a zero).
+    */
+    fprintf(fp, "trace_id=%llu server=%s dst_port=%i start_ns=%llu built_ns=%llu sent_ns=%llu",
+            strtoull(rand_val, NULL, 10), host, options->spa_dst_port,
+            (unsigned long long)trace->start_ns,
+            (unsigned long long)trace->built_ns,
+            (unsigned long long)trace->sent_ns);
+
+    if(trace->open_ns != 0)
+        fprintf(fp, " open_ns=%llu", (unsigned long long)trace->open_ns);
+
+    fprintf(fp, "\n");
+
+    if(fp == stdout)
+        fflush(fp);
+    else
+        fclose(fp);
+
+    return 0;
+}
+
+/***EOF***/
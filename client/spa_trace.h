@@ -0,0 +1,53 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_trace.h
+ *
+ * Purpose: Header file for spa_trace.c.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef SPA_TRACE_H
+#define SPA_TRACE_H
+
+#include "fwknop_common.h"
+
+/* When each step of a knock finished, in wall clock nanoseconds.  open_ns
+ * is 0 without --wait-open.
+*/
+typedef struct spa_trace
+{
+    uint64_t    start_ns;
+    uint64_t    built_ns;
+    uint64_t    sent_ns;
+    uint64_t    open_ns;
+} spa_trace_t;
+
+/* Function Prototypes
+*/
+uint64_t spa_trace_now(void);
+int spa_trace_write(const fko_cli_options_t *options, fko_ctx_t ctx,
+        const char *host, const spa_trace_t *trace);
+
+#endif  /* SPA_TRACE_H */
@@ -0,0 +1,188 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_wait.c
+ *
+ * Purpose: Knock-and-wait (--wait-open).  After the SPA packet is sent the
+ *          client keeps trying non-blocking TCP connects to the service,
+ *          on an exponential schedule starting in the microseconds, and
+ *          returns as soon as one completes, i.e. as soon as fwknopd has
+ *          opened the firewall.  Scripts can then connect right away
+ *          instead of sleeping and hoping.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "spa_wait.h"
+#include "utils.h"
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <fcntl.h>
+
+/* The port to probe: --wait-port, or else the first tcp/<port> in the
+ * -A access list.
+*/
+static int
+wait_port(const fko_cli_options_t *options)
+{
+    char    buf[MAX_PATH_LEN], *tok, *save = NULL;
+    int     port, is_err;
+
+    if(options->wait_port > 0)
+        return options->wait_port;
+
+    strlcpy(buf, options->access_str, sizeof(buf));
+    for(tok = strtok_r(buf, ",", &save); tok != NULL;
+            tok = strtok_r(NULL, ",", &save))
+    {
+        if(strncasecmp(tok, "tcp/", 4) != 0)
+            continue;
+        port = strtol_wrapper(tok+4, 1, MAX_PORT, NO_EXIT_UPON_ERR, &is_err);
+        if(is_err == FKO_SUCCESS)
+            return port;
+    }
+    return -1;
+}
+
+static unsigned long long
+now_us(void)
+{
+    struct timeval  tv;
+
+    gettimeofday(&tv, NULL);
+    return (unsigned long long)tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+/* One connect attempt, given timeout_us to complete.  Returns 1 when
+ * connected, 0 otherwise.
+*/
+static int
+probe(const struct addrinfo *ai, const unsigned long timeout_us)
+{
+    struct timeval  tv;
+    fd_set          wfds;
+    int             sock, err = 0, res = 0;
+    socklen_t       err_len = sizeof(err);
+
+    sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if(sock < 0)
+        return 0;
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+    if(connect(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+        res = 1;
+    else if(errno == EINPROGRESS)
+    {
+        FD_ZERO(&wfds);
+        FD_SET(sock, &wfds);
+        tv.tv_sec  = timeout_us / 1000000;
+        tv.tv_usec = timeout_us % 1000000;
+
+        if(select(sock+1, NULL, &wfds, NULL, &tv) == 1
+                && getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &err_len) == 0)
+            res = (err == 0);
+        else
+            err = 0;
+    }
+    else
+        err = errno;
+
+    if(err != 0)
+    {
+        /* Refused or unreachable: wait out the rest of the interval
+         * so a closed port does not turn into a busy loop
+        */
+        tv.tv_sec  = timeout_us / 1000000;
+        tv.tv_usec = timeout_us % 1000000;
+        select(0, NULL, NULL, NULL, &tv);
+    }
+
+    close(sock);
+    return res;
+}
+
+/* Returns 0 once a connection to the service succeeds, or -1 if that
+ * did not happen within --wait-open seconds.
+*/
+int
+wait_for_access(const fko_cli_options_t *options, const char *host)
+{
+    struct addrinfo    *result = NULL, hints;
+    char                port_str[MAX_PORT_STR_LEN+1] = {0};
+    unsigned long long  start, deadline, now;
+    unsigned long       interval = WAIT_PROBE_MIN_US;
+    int                 port, error, probes = 0;
+
+    port = wait_port(options);
+    if(port < 1 || port > MAX_PORT)
+    {
+        log_msg(LOG_VERBOSITY_ERROR,
+            "[*] --wait-open needs a tcp/<port> in -A or --wait-port");
+        return -1;
+    }
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family   = options->spa_server_resolve_ipv4 ? AF_INET : AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    if(snprintf(port_str, sizeof(port_str), "%d", port) >= (int)sizeof(port_str))
+        return -1;
+
+    error = getaddrinfo(host, port_str, &hints, &result);
+    if(error != 0)
+    {
+        log_msg(LOG_VERBOSITY_ERROR, "error in getaddrinfo: %s", gai_strerror(error));
+        return -1;
+    }
+
+    start    = now_us();
+    deadline = start + (unsigned long long)options->wait_open * 1000000ULL;
+
+    while((now = now_us()) < deadline)
+    {
+        probes++;
+        if(deadline - now < interval)
+            interval = deadline - now;
+        if(probe(result, interval))
+        {
+            freeaddrinfo(result);
+            log_msg(LOG_VERBOSITY_NORMAL,
+                "[+] %s port %d is open after %.3f ms (%d probes)",
+                host, port, (now_us() - start) / 1000.0, probes);
+            return 0;
+        }
+        if(interval < WAIT_PROBE_MAX_US)
+            interval *= 2;
+    }
+
+    freeaddrinfo(result);
+    log_msg(LOG_VERBOSITY_ERROR,
+        "[-] %s port %d did not open within %d seconds (%d probes)",
+        host, port, options->wait_open, probes);
+    return -1;
+}
+
+/***EOF***/
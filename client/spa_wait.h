@@ -0,0 +1,48 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_wait.h
+ *
+ * Purpose: Header file for spa_wait.c - waiting for access to open after
+ *          an SPA packet was sent (--wait-open).
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef SPA_WAIT_H
+#define SPA_WAIT_H
+
+#include "fwknop_common.h"
+
+/* Probe intervals in microseconds: the first connect attempt is given
+ * WAIT_PROBE_MIN_US to complete, and each later one twice as long as the
+ * one before, up to WAIT_PROBE_MAX_US.
+*/
+#define WAIT_PROBE_MIN_US       200
+#define WAIT_PROBE_MAX_US       100000
+
+/* Function Prototypes
+*/
+int wait_for_access(const fko_cli_options_t *options, const char *host);
+
+#endif  /* SPA_WAIT_H */
@@ -31,6 +31,7 @@
 #include "common.h"
 #include "fwknop_common.h"
 #include "utils.h"
+#include "dns_resolve.h"
 #ifndef WIN32
 #include <arpa/inet.h>
 #endif
@@ -176,7 +177,7 @@ resolve_dst_addr(const char *dns_str, struct addrinfo *hints,
 #endif
 
     /* Try to resolve the host name */
-    error = getaddrinfo(dns_str, NULL, hints, &result);
+    error = dns_getaddrinfo(dns_str, NULL, hints, &result);
     if (error != 0)
         fprintf(stderr, "resolve_dst_addr() : %s\n", gai_strerror(error));
 
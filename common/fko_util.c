@@ -41,6 +41,10 @@
   #include <arpa/inet.h>
 #endif
 
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
+
 /* Check for a FKO error returned by a function an return the error code */
 #define RETURN_ON_FKO_ERROR(e, f)   do { if (((e)=(f)) != FKO_SUCCESS) { return (e); } } while(0);
 
@@ -72,7 +76,14 @@ static fko_enc_mode_str_t fko_enc_mode_strs[] =
     { "OFB",            FKO_ENC_MODE_OFB,           FKO_ENC_MODE_SUPPORTED      },
     { "CTR",            FKO_ENC_MODE_CTR,           FKO_ENC_MODE_SUPPORTED      },
     { "Asymmetric",     FKO_ENC_MODE_ASYMMETRIC,    FKO_ENC_MODE_SUPPORTED      },
-    { "legacy",         FKO_ENC_MODE_CBC_LEGACY_IV, FKO_ENC_MODE_SUPPORTED      }
+    { "legacy",         FKO_ENC_MODE_CBC_LEGACY_IV, FKO_ENC_MODE_SUPPORTED      },
+#if HAVE_OPENSSL_AES
+    { "GCM",            FKO_ENC_MODE_GCM,           FKO_ENC_MODE_SUPPORTED      },
+    { "GCM_BINARY",     FKO_ENC_MODE_GCM_BINARY,    FKO_ENC_MODE_SUPPORTED      }
+#else
+    { "GCM",            FKO_ENC_MODE_GCM,           FKO_ENC_MODE_NOT_SUPPORTED  },
+    { "GCM_BINARY",     FKO_ENC_MODE_GCM_BINARY,    FKO_ENC_MODE_NOT_SUPPORTED  }
+#endif
 };
 
 /* Compare all bytes with constant run time regardless of
@@ -80,25 +91,27 @@ static fko_enc_mode_str_t fko_enc_mode_strs[] =
  * is found before comparing all bytes).  This code was adapted
  * from YaSSL which is GPLv2 after a timing bug was reported by
  * Ryman through github (#85)
+ *
+ * The differences are accumulated a machine word at a time (memcpy()
+ * keeps the loads legal for unaligned buffers), and the tail a byte at
+ * a time.  Returns 0 on a match and -1 otherwise.
 */
 int
 constant_runtime_cmp(const char *a, const char *b, int len)
 {
-    int good = 0;
-    int bad  = 0;
-    int i;
+    unsigned long   wa, wb, diff = 0;
+    int             i = 0;
 
-    for(i=0; i < len; i++) {
-        if (a[i] == b[i])
-            good++;
-        else
-            bad++;
+    for(; i + (int)sizeof(diff) <= len; i += sizeof(diff)) {
+        memcpy(&wa, a + i, sizeof(wa));
+        memcpy(&wb, b + i, sizeof(wb));
+        diff |= wa ^ wb;
     }
 
-    if (good == len)
-        return 0;
-    else
-        return 0 - bad;
+    for(; i < len; i++)
+        diff |= (unsigned char)(a[i] ^ b[i]);
+
+    return(0 - (diff != 0));
 }
 
 /* Validate encoded sdp client id length
@@ -395,6 +408,29 @@ enc_mode_strtoint(const char *enc_mode_str)
     return enc_mode_int;
 }
 
+/**
+ * @brief Tell whether an encryption mode string is a known mode that this
+ *        build does not support (GCM without OpenSSL AES for example).
+ *
+ * @param enc_mode_str Encryption mode string (CBC,GCM...)
+ *
+ * @return 1 if the mode is known but not supported, 0 otherwise
+ */
+int
+enc_mode_is_unsupported(const char *enc_mode_str)
+{
+    unsigned char           ndx_enc_mode;
+
+    for (ndx_enc_mode = 0 ; ndx_enc_mode < ARRAY_SIZE(fko_enc_mode_strs) ; ndx_enc_mode++)
+    {
+        if (   (strcasecmp(enc_mode_str, fko_enc_mode_strs[ndx_enc_mode].str) == 0)
+            && (fko_enc_mode_strs[ndx_enc_mode].supported == FKO_ENC_MODE_NOT_SUPPORTED) )
+            return 1;
+    }
+
+    return 0;
+}
+
 /**
  * @brief Return an encryption mode string according to an enc_mode integer value
  *
@@ -738,25 +774,136 @@ append_msg_to_buf(char *buf, size_t buf_size, const char* msg, ...)
     return bytes_written;
 }
 
+/* Characters allowed by is_base64(): the base64 alphabet plus the
+ * '=' padding character.  A lookup table is used instead of isalnum()
+ * so the check is a single load per byte and does not depend on the
+ * current locale.
+*/
+static const unsigned char b64_charset[256] =
+{
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 0, 0,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+#if defined(__SSE2__)
+/* SSE2 is part of the x86-64 baseline, so unlike the SSSE3 base64 code in
+ * lib/base64.c this needs no run time check.
+ *
+ * Returns a mask with bit n set if byte n of v is in the base64 alphabet.
+*/
+static inline int
+b64_class_sse2(const __m128i v)
+{
+    const __m128i   upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                                          _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+    const __m128i   lower = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('a' - 1)),
+                                          _mm_cmplt_epi8(v, _mm_set1_epi8('z' + 1)));
+    const __m128i   digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                          _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+    const __m128i   other = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('+')),
+                                         _mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+
+    return _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(upper, lower),
+                _mm_or_si128(digit, other)));
+}
+
+/* Returns a mask with bit n set if byte n of v is whitespace in the C
+ * locale (space, or \t through \r).
+*/
+static inline int
+ws_class_sse2(const __m128i v)
+{
+    return _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('\t' - 1)),
+                              _mm_cmplt_epi8(v, _mm_set1_epi8('\r' + 1)))));
+}
+#endif
+
 /* Determine if a buffer contains only characters from the base64
  * encoding set
 */
 int
 is_base64(const unsigned char * const buf, const unsigned short int len)
 {
-    unsigned short int  i;
-    int                 rv = 1;
+    unsigned short int  i = 0;
+
+#if defined(__SSE2__)
+    for(; i + 16 <= len; i += 16)
+        if(b64_class_sse2(_mm_loadu_si128((const __m128i *)(buf + i))) != 0xffff)
+            return 0;
+#endif
+
+    for(; i<len; i++)
+        if(! b64_charset[buf[i]])
+            return 0;
+
+    return 1;
+}
+
+/* Scan URL-safe base64 data (as the fwknop client sends it in an HTTP
+ * request) up to the first whitespace, converting '-' to '+' and '_' to
+ * '/' in place and checking the alphabet in the same pass.  Returns the
+ * number of characters before the whitespace (or len), and sets
+ * *r_valid to whether they are all base64 after the conversion.
+*/
+int
+b64_url_scan(unsigned char * const buf, const int len, int * const r_valid)
+{
+    int     i = 0, valid = 1;
 
-    for(i=0; i<len; i++)
+#if defined(__SSE2__)
+    const __m128i   dash  = _mm_set1_epi8('-');
+    const __m128i   under = _mm_set1_epi8('_');
+    __m128i         v;
+
+    for(; i + 16 <= len; i += 16)
     {
-        if(!(isalnum(buf[i]) || buf[i] == '/' || buf[i] == '+' || buf[i] == '='))
-        {
-            rv = 0;
+        v = _mm_loadu_si128((const __m128i *)(buf + i));
+
+        // leave the block holding the end to the byte loop
+        if(ws_class_sse2(v) != 0)
             break;
-        }
+
+        v = _mm_add_epi8(v, _mm_and_si128(_mm_cmpeq_epi8(v, dash),
+                _mm_set1_epi8('+' - '-')));
+        v = _mm_add_epi8(v, _mm_and_si128(_mm_cmpeq_epi8(v, under),
+                _mm_set1_epi8('/' - '_')));
+        _mm_storeu_si128((__m128i *)(buf + i), v);
+
+        if(b64_class_sse2(v) != 0xffff)
+            valid = 0;
+    }
+#endif
+
+    for(; i<len; i++)
+    {
+        if(isspace(buf[i]))
+            break;
+        else if(buf[i] == '-')
+            buf[i] = '+';
+        else if(buf[i] == '_')
+            buf[i] = '/';
+
+        if(! b64_charset[buf[i]])
+            valid = 0;
     }
 
-    return rv;
+    *r_valid = valid;
+    return i;
 }
 
 /**
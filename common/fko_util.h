@@ -40,7 +40,9 @@ int     is_valid_encoded_msg_len(const int len);
 int     is_valid_pt_msg_len(const int len);
 int     is_valid_ipv4_addr(const char * const ip_str);
 int     is_base64(const unsigned char * const buf, const unsigned short int len);
+int     b64_url_scan(unsigned char * const buf, const int len, int * const r_valid);
 int     enc_mode_strtoint(const char *enc_mode_str);
+int     enc_mode_is_unsupported(const char *enc_mode_str);
 short   enc_mode_inttostr(int enc_mode, char* enc_mode_str, size_t enc_mode_size);
 int     strtol_wrapper(const char * const str, const int min,
             const int max, const int exit_upon_err, int *is_err);
@@ -0,0 +1,86 @@
+/*
+ *****************************************************************************
+ *
+ * File:    fwknop_probes.h
+ *
+ * Purpose: USDT static probe points for tracing fwknopd in production with
+ *          bpftrace, SystemTap or perf, e.g.:
+ *
+ *            bpftrace -e 'usdt:/usr/sbin/fwknopd:fwknop:spa_exit
+ *                { @[arg1] = count(); }'
+ *
+ *          Each probe is a single nop (plus a note in the ELF file) until
+ *          a tracer attaches, and compiles away entirely without
+ *          HAVE_USDT (see --disable-usdt).  Probe arguments should be
+ *          values that are already at hand, since they are computed
+ *          either way.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef FWKNOP_PROBES_H
+#define FWKNOP_PROBES_H
+
+/* Probes (provider "fwknop") and their arguments:
+ *
+ *   pkt_receive(spa_pkt, len)          SPA payload received (pcap, UDP
+ *                                      or TCP server)
+ *   spa_entry(spa_pkt, len)            incoming_spa() processing starts
+ *   spa_exit(spa_pkt, verdict)         processing done, verdict is one of
+ *                                      FWKNOP_VERDICT_*
+ *   replay_hit(spa_pkt)                packet digest already seen
+ *   stanza_match(src_ip, sdp_id, n)    access stanza n accepted the packet
+ *   rule_add(count, deadline)          firewall rule(s) added; deadline
+ *                                      is 0 when the kernel expires them
+ *   rule_expire(deadline)              a rule's deadline has passed
+ *   extcmd_spawn(pid, path)            external command started
+ *   extcmd_exit(pid, status)           external command reaped
+ *   ctrl_msg_out(len)                  frame sent to the controller
+ *   ctrl_msg_in(len)                   frame received from the controller
+ *   conntrack_update(count)            conntrack pass done, count is the
+ *                                      number of tracked connections
+*/
+#define FWKNOP_VERDICT_DROPPED  0   /* Failed the precheck */
+#define FWKNOP_VERDICT_REPLAY   1
+#define FWKNOP_VERDICT_DENIED   2   /* No stanza granted access */
+#define FWKNOP_VERDICT_GRANTED  3
+#define FWKNOP_VERDICT_QUEUED   4   /* Handed to a SPA worker (never a
+                                       spa_exit value) */
+
+#if HAVE_USDT
+  #include <sys/sdt.h>
+
+  #define FWKNOP_PROBE(name)                STAP_PROBE(fwknop, name)
+  #define FWKNOP_PROBE1(name, a)            STAP_PROBE1(fwknop, name, a)
+  #define FWKNOP_PROBE2(name, a, b)         STAP_PROBE2(fwknop, name, a, b)
+  #define FWKNOP_PROBE3(name, a, b, c)      STAP_PROBE3(fwknop, name, a, b, c)
+#else
+  #define FWKNOP_PROBE(name)                do { } while(0)
+  #define FWKNOP_PROBE1(name, a)            do { } while(0)
+  #define FWKNOP_PROBE2(name, a, b)         do { } while(0)
+  #define FWKNOP_PROBE3(name, a, b, c)      do { } while(0)
+#endif
+
+#endif /* FWKNOP_PROBES_H */
+
+/***EOF***/
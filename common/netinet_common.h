@@ -96,6 +96,18 @@ struct iphdr
     unsigned int daddr;
 };
 
+/* The IPv6 header
+*/
+struct ip6hdr
+{
+    unsigned int   ver_tc_flow;         /* version, traffic class, flow */
+    unsigned short payload_len;
+    unsigned char  nexthdr;
+    unsigned char  hop_limit;
+    unsigned char  saddr[16];
+    unsigned char  daddr[16];
+};
+
 /* The TCP header
 */
 struct tcphdr
@@ -178,4 +190,20 @@ struct icmphdr
 #define ICMP_ADDRESS            17  /* Address Mask Request */
 #define ICMP_ADDRESSREPLY       18  /* Address Mask Reply */
 
+/* IPv6 next header values we walk past (or stop at) when looking for
+ * the transport header.
+*/
+#ifndef IPPROTO_HOPOPTS
+  #define IPPROTO_HOPOPTS       0
+#endif
+#ifndef IPPROTO_ROUTING
+  #define IPPROTO_ROUTING       43
+#endif
+#ifndef IPPROTO_DSTOPTS
+  #define IPPROTO_DSTOPTS       60
+#endif
+#ifndef IPPROTO_ICMPV6
+  #define IPPROTO_ICMPV6        58
+#endif
+
 #endif  /* NETINET_COMMON_H */
@@ -0,0 +1,132 @@
+#!/usr/bin/perl -w
+#
+# File: spa-trace.pl
+#
+# Purpose: To join the client side of traced knocks (fwknop --trace-file)
+#          with the SPA verdicts of fwknopd running with SPA_TRACE (from
+#          /verdicts on the metrics listener or the SIGUSR1 config dump)
+#          and print one knock-to-open timeline per knock: building the
+#          packet, the network, each server stage, the wait for the
+#          firewall to open and the total.  Knocks are matched on the SPA
+#          random value, which both sides log as the trace ID.  The network
+#          and open times compare the client and server clocks, so they are
+#          only meaningful when the two are in sync.
+#
+# License: GPL v2
+#
+
+use Getopt::Long 'GetOptions';
+use strict;
+
+my $client_file = '';
+my $server_file = '';
+my $trace_id    = '';
+my $help = 0;
+
+### the order of bench_stage_t in server/benchmark.h
+my @stages = qw(precheck replay queue access hmac decrypt service
+    firewall cmd_cycle);
+
+my %client = ();
+my %server = ();
+my @order  = ();
+
+Getopt::Long::Configure('no_ignore_case');
+die "[*] See '$0 -h' for usage information" unless (GetOptions(
+    'client=s'  => \$client_file,
+    'server=s'  => \$server_file,
+    'id=s'      => \$trace_id,
+    'help'      => \$help,
+));
+&usage() if $help;
+
+die "[*] Must specify --client and --server, see '$0 -h'"
+    unless $client_file and $server_file;
+
+&read_traces($client_file, \%client, 1);
+&read_traces($server_file, \%server, 0);
+
+my $found = 0;
+for my $id (@order) {
+    next if $trace_id and $id ne $trace_id;
+    &timeline($id, $client{$id}, $server{$id});
+    $found++;
+}
+
+die "[*] No traced knocks found" unless $found;
+
+exit 0;
+
+sub read_traces() {
+    my ($file, $href, $is_client) = @_;
+
+    open F, "< $file" or die "[*] Could not open $file: $!";
+    while (<F>) {
+        my %fields = ();
+        while (/(\w+)=("[^"]*"|\S+)/g) {
+            $fields{$1} = $2;
+        }
+        next unless $fields{'trace_id'} and $fields{'start_ns'};
+        my $id = $fields{'trace_id'};
+        next if defined $href->{$id};  ### newest first from the server
+        $href->{$id} = \%fields;
+        push @order, $id if $is_client;
+    }
+    close F;
+    return;
+}
+
+sub timeline() {
+    my ($id, $c, $s) = @_;
+
+    print "trace_id=$id server=$c->{'server'}:$c->{'dst_port'}\n";
+    &line('build', $c->{'built_ns'} - $c->{'start_ns'});
+
+    my $verdict_ns = 0;
+    if ($s) {
+        &line('network', $s->{'start_ns'} - $c->{'sent_ns'},
+            $s->{'start_ns'} < $c->{'sent_ns'} ? ' (clocks out of sync?)' : '');
+        for my $stage (@stages) {
+            next unless defined $s->{"${stage}_us"};
+            &line("server $stage", $s->{"${stage}_us"} * 1000);
+        }
+        &line("server total", $s->{'latency_us'} * 1000,
+            " (verdict=$s->{'verdict'} reason=$s->{'reason'})");
+        $verdict_ns = $s->{'start_ns'} + $s->{'latency_us'} * 1000;
+    } else {
+        print "    (no server verdict with this trace ID)\n";
+    }
+
+    if ($c->{'open_ns'}) {
+        &line('wait for open', $c->{'open_ns'}
+            - ($verdict_ns ? $verdict_ns : $c->{'sent_ns'}));
+        &line('knock to open', $c->{'open_ns'} - $c->{'start_ns'});
+    } else {
+        &line('knock to sent', $c->{'sent_ns'} - $c->{'start_ns'});
+    }
+    print "\n";
+    return;
+}
+
+sub line() {
+    my ($what, $ns, $note) = @_;
+    $note = '' unless defined $note;
+    printf "    %-20s %12.1f us%s\n", $what, $ns / 1000, $note;
+    return;
+}
+
+sub usage() {
+    print <<_HELP_;
+
+Usage: $0 --client <file> --server <file> [--id <trace_id>]
+
+    --client <file>  - Lines written by fwknop --trace-file.
+    --server <file>  - fwknopd SPA verdicts (SPA_TRACE), e.g. saved from
+                       http://<METRICS_ADDRESS>:<METRICS_PORT>/verdicts?traced=1
+                       or the SIGUSR1 config dump.
+    --id <trace_id>  - Only print the knock with this trace ID.
+    --help           - Print this usage message and exit.
+
+_HELP_
+    exit 0;
+}
@@ -33,32 +33,291 @@
  *
  *****************************************************************************
 */
-#include "base64.h"
 #include "fko_common.h"
+#include "base64.h"
+
+#if HAVE_X86_SSSE3
+  #include <tmmintrin.h>
+  #include <cpuid.h>
+#endif
+
+/* Advanced SIMD (NEON) is part of every AArch64 CPU, so unlike SSSE3 it
+ * needs no run time check.
+*/
+#if defined(__aarch64__)
+  #define B64_NEON 1
+  #include <arm_neon.h>
+#endif
 
 #if !AFL_FUZZING
-static unsigned char map2[] =
+/* Maps each character to its 6-bit base64 value, or to 0xff if the
+ * character is not part of the base64 alphabet.
+*/
+static const unsigned char b64_dec_map[256] =
 {
-    0x3e, 0xff, 0xff, 0xff, 0x3f, 0x34, 0x35, 0x36,
-    0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff,
-    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x01,
-    0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09,
-    0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11,
-    0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19,
-    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x1a, 0x1b,
-    0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23,
-    0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b,
-    0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b,
+    0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06,
+    0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+    0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16,
+    0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20,
+    0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30,
+    0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
 };
 #endif
 
+static const char b64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#if HAVE_X86_SSSE3
+/* Returns 1 if the CPU supports SSSE3.  The answer is cached after the
+ * first call; concurrent first callers all store the same value.
+*/
+static int
+b64_have_ssse3(void)
+{
+    static volatile int have_ssse3 = -1;
+    unsigned int        eax, ebx, ecx, edx;
+    int                 res = have_ssse3;
+
+    if(res < 0)
+    {
+        res = (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSSE3)) ? 1 : 0;
+        have_ssse3 = res;
+    }
+    return res;
+}
+
+#if !AFL_FUZZING
+/* Decode 16 characters at a time into 12 bytes, validating the alphabet
+ * in the same pass.  Each store writes 16 bytes, so blocks are only
+ * decoded while at least 24 characters (18 bytes of output) remain.
+ * Returns the number of characters consumed, or -1 on a character that
+ * is not base64.
+*/
+__attribute__((target("ssse3")))
+static int
+b64_decode_ssse3(const unsigned char *in, const int len, unsigned char *out)
+{
+    const __m128i   pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                         14, 13, 12, -1, -1, -1, -1);
+    __m128i         str, upper, lower, digit, plus, slash, shift;
+    int             done = 0;
+
+    while(len - done >= 24)
+    {
+        str = _mm_loadu_si128((const __m128i *)(in + done));
+
+        /* Classify each character; anything >= 0x80 compares as negative
+         * and so lands in no class at all
+        */
+        upper = _mm_and_si128(_mm_cmpgt_epi8(str, _mm_set1_epi8('A' - 1)),
+                              _mm_cmplt_epi8(str, _mm_set1_epi8('Z' + 1)));
+        lower = _mm_and_si128(_mm_cmpgt_epi8(str, _mm_set1_epi8('a' - 1)),
+                              _mm_cmplt_epi8(str, _mm_set1_epi8('z' + 1)));
+        digit = _mm_and_si128(_mm_cmpgt_epi8(str, _mm_set1_epi8('0' - 1)),
+                              _mm_cmplt_epi8(str, _mm_set1_epi8('9' + 1)));
+        plus  = _mm_cmpeq_epi8(str, _mm_set1_epi8('+'));
+        slash = _mm_cmpeq_epi8(str, _mm_set1_epi8('/'));
+
+        if(_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(upper, lower),
+                _mm_or_si128(digit, _mm_or_si128(plus, slash)))) != 0xffff)
+            return(-1);
+
+        /* Characters to 6-bit values
+        */
+        shift = _mm_or_si128(
+                    _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-65)),
+                                 _mm_and_si128(lower, _mm_set1_epi8(-71))),
+                    _mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(4)),
+                                 _mm_or_si128(_mm_and_si128(plus, _mm_set1_epi8(19)),
+                                              _mm_and_si128(slash, _mm_set1_epi8(16)))));
+        str = _mm_add_epi8(str, shift);
+
+        /* Merge each group of four 6-bit values into 24 bits, then pack
+         * the three bytes of every group together in big endian order
+        */
+        str = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+        str = _mm_madd_epi16(str, _mm_set1_epi32(0x00011000));
+        str = _mm_shuffle_epi8(str, pack);
+
+        _mm_storeu_si128((__m128i *)(out + done / 4 * 3), str);
+        done += 16;
+    }
+
+    return(done);
+}
+#endif
+
+/* Encode 12 bytes at a time into 16 characters.  Each load reads 16
+ * bytes, so blocks are only encoded while at least 16 bytes remain.
+ * Returns the number of input bytes consumed.
+*/
+__attribute__((target("ssse3")))
+static int
+b64_encode_ssse3(const unsigned char *in, const int in_len, char *out)
+{
+    const __m128i   spread = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+                                           7, 6, 8, 7, 10, 9, 11, 10);
+    const __m128i   offsets = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4,
+                                            -4, -4, -4, -4, -19, -16, 0, 0);
+    __m128i         str, hi, lo, ndx;
+    int             done = 0;
+
+    while(in_len - done >= 16)
+    {
+        str = _mm_loadu_si128((const __m128i *)(in + done));
+
+        /* Split every three bytes into four 6-bit values, one per byte
+        */
+        str = _mm_shuffle_epi8(str, spread);
+        hi  = _mm_mulhi_epu16(_mm_and_si128(str, _mm_set1_epi32(0x0fc0fc00)),
+                              _mm_set1_epi32(0x04000040));
+        lo  = _mm_mullo_epi16(_mm_and_si128(str, _mm_set1_epi32(0x003f03f0)),
+                              _mm_set1_epi32(0x01000010));
+        str = _mm_or_si128(hi, lo);
+
+        /* 6-bit values to characters: pick the offset for each value's
+         * range (A-Z, a-z, 0-9, '+', '/') and add it
+        */
+        ndx = _mm_subs_epu8(str, _mm_set1_epi8(51));
+        ndx = _mm_sub_epi8(ndx, _mm_cmpgt_epi8(str, _mm_set1_epi8(25)));
+        str = _mm_add_epi8(str, _mm_shuffle_epi8(offsets, ndx));
+
+        _mm_storeu_si128((__m128i *)(out + done / 3 * 4), str);
+        done += 12;
+    }
+
+    return(done);
+}
+#endif /* HAVE_X86_SSSE3 */
+
+#if B64_NEON
+/* Encode 48 bytes at a time into 64 characters: the loads split every
+ * three bytes across three registers and the stores interleave four, so
+ * each lane of the registers is one group and the 6-bit values map to
+ * characters with a single 64-byte table lookup.  Returns the number of
+ * input bytes consumed.
+*/
+static int
+b64_encode_neon(const unsigned char *in, const int in_len, char *out)
+{
+    const uint8x16_t    mask = vdupq_n_u8(0x3f);
+    uint8x16x4_t        tbl, chars;
+    uint8x16x3_t        str;
+    int                 done = 0;
+
+    tbl.val[0] = vld1q_u8((const uint8_t *)b64);
+    tbl.val[1] = vld1q_u8((const uint8_t *)b64 + 16);
+    tbl.val[2] = vld1q_u8((const uint8_t *)b64 + 32);
+    tbl.val[3] = vld1q_u8((const uint8_t *)b64 + 48);
+
+    while(in_len - done >= 48)
+    {
+        str = vld3q_u8(in + done);
+
+        chars.val[0] = vshrq_n_u8(str.val[0], 2);
+        chars.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(str.val[0], 4),
+                                         vshrq_n_u8(str.val[1], 4)), mask);
+        chars.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(str.val[1], 2),
+                                         vshrq_n_u8(str.val[2], 6)), mask);
+        chars.val[3] = vandq_u8(str.val[2], mask);
+
+        chars.val[0] = vqtbl4q_u8(tbl, chars.val[0]);
+        chars.val[1] = vqtbl4q_u8(tbl, chars.val[1]);
+        chars.val[2] = vqtbl4q_u8(tbl, chars.val[2]);
+        chars.val[3] = vqtbl4q_u8(tbl, chars.val[3]);
+
+        vst4q_u8((uint8_t *)(out + done / 3 * 4), chars);
+        done += 48;
+    }
+
+    return(done);
+}
+#endif /* B64_NEON */
+
+/* The SIMD code in use, one of B64_IMPL_*.  Until fko_impl.c picks one
+ * it is SSSE3 or NEON if the CPU has them and plain C otherwise.
+*/
+static volatile int b64_impl = B64_IMPL_AUTO;
+
+int
+b64_impl_supported(int impl)
+{
+    switch(impl)
+    {
+        case B64_IMPL_SCALAR:
+            return(1);
+#if HAVE_X86_SSSE3
+        case B64_IMPL_SSSE3:
+            return(b64_have_ssse3());
+#endif
+#if B64_NEON
+        case B64_IMPL_NEON:
+            return(1);
+#endif
+    }
+    return(0);
+}
+
+void
+b64_impl_set(int impl)
+{
+    b64_impl = impl;
+}
+
+int
+b64_impl_get(void)
+{
+    int impl = b64_impl;
+
+    if(impl < 0)
+    {
+        if(b64_impl_supported(B64_IMPL_SSSE3))
+            impl = B64_IMPL_SSSE3;
+        else if(b64_impl_supported(B64_IMPL_NEON))
+            impl = B64_IMPL_NEON;
+        else
+            impl = B64_IMPL_SCALAR;
+        b64_impl = impl;
+    }
+    return(impl);
+}
+
 int
 b64_decode(const char *in, unsigned char *out)
 {
-    int i;
     unsigned char *dst = out;
-#if ! AFL_FUZZING
-    int v;
+#if AFL_FUZZING
+    int i;
+#else
+    const unsigned char *src = (const unsigned char *)in;
+    unsigned int a, b, c, d;
+    int len, n;
 #endif
 
 #if AFL_FUZZING
@@ -68,17 +327,54 @@ b64_decode(const char *in, unsigned char *out)
     for (i = 0; in[i]; i++)
         *dst++ = in[i];
 #else
-    v = 0;
-    for (i = 0; in[i] && in[i] != '='; i++) {
-        unsigned int index= in[i]-43;
+    /* Decoding stops at the first padding character or at the end of
+     * the string
+    */
+    len = strcspn(in, "=");
+
+#if HAVE_X86_SSSE3
+    if(len >= 24 && b64_impl_get() == B64_IMPL_SSSE3)
+    {
+        if((n = b64_decode_ssse3(src, len, dst)) < 0)
+            return(-1);
+        src += n;
+        dst += n / 4 * 3;
+        len -= n;
+    }
+#endif
+
+    /* Four characters at a time.  Invalid characters map to 0xff, so a
+     * single test on the high bit covers all four.
+    */
+    for (; len >= 4; len -= 4, src += 4) {
+        a = b64_dec_map[src[0]];
+        b = b64_dec_map[src[1]];
+        c = b64_dec_map[src[2]];
+        d = b64_dec_map[src[3]];
 
-        if (index>=(sizeof(map2)/sizeof(map2[0])) || map2[index] == 0xff)
+        if ((a | b | c | d) & 0x80)
             return(-1);
 
-        v = (v << 6) + map2[index];
+        *dst++ = (a << 2) | (b >> 4);
+        *dst++ = (b << 4) | (c >> 2);
+        *dst++ = (c << 6) | d;
+    }
 
-        if (i & 3)
-            *dst++ = v >> (6 - 2 * (i & 3));
+    /* Up to three trailing characters; a lone trailing character
+     * carries no complete byte but must still be valid.
+    */
+    if (len > 0) {
+        a = b64_dec_map[src[0]];
+        b = len > 1 ? b64_dec_map[src[1]] : 0;
+        c = len > 2 ? b64_dec_map[src[2]] : 0;
+
+        if ((a | b | c) & 0x80)
+            return(-1);
+
+        if (len > 1)
+            *dst++ = (a << 2) | (b >> 4);
+        if (len > 2)
+            *dst++ = (b << 4) | (c >> 2);
     }
 #endif
 
@@ -87,6 +383,43 @@ b64_decode(const char *in, unsigned char *out)
     return(dst - out);
 }
 
+/* Decode the fixed B64_SDP_ID_STR_LEN character SDP ID field at the front
+ * of an SDP mode SPA packet straight into the 4 bytes of the ID.  The field
+ * does not have to be NUL terminated.  Returns 0, or -1 if any character
+ * is not base64.
+*/
+int
+b64_decode_sdp_id(const char *in, uint32_t *sdp_id)
+{
+    unsigned char id[FKO_SDP_ID_SIZE];
+#if AFL_FUZZING
+    /* Same short circuit as b64_decode()
+    */
+    memcpy(id, in, FKO_SDP_ID_SIZE);
+#else
+    const unsigned char *src = (const unsigned char *)in;
+    unsigned int a, b, c, d, e, f;
+
+    a = b64_dec_map[src[0]];
+    b = b64_dec_map[src[1]];
+    c = b64_dec_map[src[2]];
+    d = b64_dec_map[src[3]];
+    e = b64_dec_map[src[4]];
+    f = b64_dec_map[src[5]];
+
+    if ((a | b | c | d | e | f) & 0x80)
+        return(-1);
+
+    id[0] = (a << 2) | (b >> 4);
+    id[1] = (b << 4) | (c >> 2);
+    id[2] = (c << 6) | d;
+    id[3] = (e << 2) | (f >> 4);
+#endif
+
+    memcpy(sdp_id, id, FKO_SDP_ID_SIZE);
+    return(0);
+}
+
 /*****************************************************************************
  * b64_encode: Stolen from VLC's http.c
  * Simplified by michael
@@ -96,14 +429,33 @@ b64_decode(const char *in, unsigned char *out)
 int
 b64_encode(unsigned char *in, char *out, int in_len)
 {
-    static const char b64[] =
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
     unsigned i_bits = 0;
     int i_shift = 0;
     int bytes_remaining = in_len;
 
     char *dst = out;
 
+#if HAVE_X86_SSSE3
+    if(in_len >= 16 && b64_impl_get() == B64_IMPL_SSSE3)
+    {
+        i_shift = b64_encode_ssse3(in, in_len, dst);
+        in += i_shift;
+        dst += i_shift / 3 * 4;
+        bytes_remaining -= i_shift;
+        i_shift = 0;
+    }
+#endif
+#if B64_NEON
+    if(in_len >= 48 && b64_impl_get() == B64_IMPL_NEON)
+    {
+        i_shift = b64_encode_neon(in, in_len, dst);
+        in += i_shift;
+        dst += i_shift / 3 * 4;
+        bytes_remaining -= i_shift;
+        i_shift = 0;
+    }
+#endif
+
     if (in_len > 0) { /* Special edge case, what should we really do here? */
         while (bytes_remaining) {
             i_bits = (i_bits << 8) + *in++;
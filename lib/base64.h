@@ -31,10 +31,23 @@
 #ifndef BASE64_H
 #define BASE64_H 1
 
+/* Which SIMD code b64_encode() and b64_decode() use, see fko_impl.c.
+ * Only the ones the CPU supports may be set.
+*/
+#define B64_IMPL_AUTO       -1
+#define B64_IMPL_SCALAR     0
+#define B64_IMPL_SSSE3      1
+#define B64_IMPL_NEON       2
+#define B64_IMPLS           3
+
 /* Prototypes
 */
+int b64_impl_supported(int impl);
+void b64_impl_set(int impl);
+int b64_impl_get(void);
 int b64_encode(unsigned char *in, char *out, int in_len);
 int b64_decode(const char *in, unsigned char *out);
+int b64_decode_sdp_id(const char *in, uint32_t *sdp_id);
 void strip_b64_eq(char *data);
 
 #endif /* BASE64_H */
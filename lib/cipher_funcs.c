@@ -43,74 +43,72 @@
 #include "cipher_funcs.h"
 #include "digest.h"
 
+#if HAVE_OPENSSL_AES
+  #include <openssl/evp.h>
+#endif
+#include <openssl/rand.h>
+
 #ifndef WIN32
   #ifndef RAND_FILE
     #define RAND_FILE "/dev/urandom"
   #endif
 #endif
 
-/* Get random data.
+/* Get random data.  This comes from OpenSSL's DRBG, which keeps a
+ * generator per thread, seeded from getrandom() (or the platform's
+ * equivalent) and reseeded after a fork, so no file is opened per call.
+ * /dev/urandom is only read if that ever fails.
 */
 void
 get_random_data(unsigned char *data, const size_t len)
 {
-    uint32_t    i;
+    uint32_t        i;
 #ifdef WIN32
-	int				rnum;
 	struct _timeb	tb;
+#else
+    FILE           *rfd;
+    struct timeval  tv;
+    size_t          amt_read;
+#endif
 
-	_ftime_s(&tb);
+    if(RAND_bytes(data, len) == 1)
+        return;
 
+#ifdef WIN32
+	_ftime_s(&tb);
 	srand((uint32_t)(tb.time*1000)+tb.millitm);
 
 	for(i=0; i<len; i++)
-	{
-		rnum = rand();
-        *(data+i) = rnum % 0xff;
-	}
+        *(data+i) = rand() % 0xff;
 #else
-	FILE           *rfd;
-    struct timeval  tv;
-    int             do_time = 0;
-    size_t          amt_read;
-
-    /* Attempt to read seed data from /dev/urandom.  If that does not
-     * work, then fall back to a time-based method (less secure, but
-     * probably more portable).
-    */
-    if((rfd = fopen(RAND_FILE, "r")) == NULL)
+    if((rfd = fopen(RAND_FILE, "r")) != NULL)
     {
-        do_time = 1;
-    }
-    else
-    {
-        /* Read seed from /dev/urandom
-        */
         amt_read = fread(data, len, 1, rfd);
         fclose(rfd);
 
-        if (amt_read != 1)
-            do_time = 1;
+        if (amt_read == 1)
+            return;
     }
 
-    if (do_time)
-    {
-        /* Seed based on time (current usecs).
-        */
-        gettimeofday(&tv, NULL);
-        srand(tv.tv_usec);
-
-        for(i=0; i<len; i++)
-            *(data+i) = rand() % 0xff;
-    }
+    /* Seed based on time (current usecs).
+    */
+    gettimeofday(&tv, NULL);
+    srand(tv.tv_usec);
 
+    for(i=0; i<len; i++)
+        *(data+i) = rand() % 0xff;
 #endif
 
+    return;
 }
 
 
 /*** These are Rijndael-specific functions ***/
 
+/* MD5 rounds needed to fill the key and then the IV.
+*/
+#define KIV_ROUNDS  ((RIJNDAEL_MAX_KEYSIZE + RIJNDAEL_BLOCKSIZE) / MD5_DIGEST_LEN)
+
 /* Rijndael function to generate initial salt and initialization vector
  * (iv).  This is is done to be compatible with the data produced via OpenSSL
 */
@@ -118,15 +116,19 @@ static void
 rij_salt_and_iv(RIJNDAEL_context *ctx, const char *key,
         const int key_len, const unsigned char *data, const int mode_flag)
 {
-    char            pw_buf[RIJNDAEL_MAX_KEYSIZE] = {0};
-    unsigned char   tmp_buf[MD5_DIGEST_LEN+RIJNDAEL_MAX_KEYSIZE+RIJNDAEL_BLOCKSIZE] = {0};
-    unsigned char   kiv_buf[RIJNDAEL_MAX_KEYSIZE+RIJNDAEL_BLOCKSIZE] = {0}; /* Key and IV buffer */
-    unsigned char   md5_buf[MD5_DIGEST_LEN] = {0}; /* Buffer for computed md5 hash */
+    /* Holds the previous MD5 digest followed by the (padded) password and
+     * the salt, so that every round below hashes a contiguous buffer.
+    */
+    unsigned char   tmp_buf[MD5_DIGEST_LEN+RIJNDAEL_MAX_KEYSIZE+SALT_LEN] = {0};
+    unsigned char  *pw_salt = tmp_buf + MD5_DIGEST_LEN;
+    unsigned char  *out;
+
+    int             final_key_len = key_len;
+    int             i;
 
-    int             final_key_len = 0;
-    size_t          kiv_len = 0;
+    memcpy(pw_salt, key, key_len);
 
-    if(mode_flag == FKO_ENC_MODE_CBC_LEGACY_IV)
+    if(mode_flag == FKO_ENC_MODE_CBC_LEGACY_IV && key_len < RIJNDAEL_MIN_KEYSIZE)
     {
         /* Pad the pw with '0' chars up to the minimum Rijndael key size.
          *
@@ -136,26 +138,13 @@ rij_salt_and_iv(RIJNDAEL_context *ctx, const char *key,
          * other problems.  This code will be removed altogether in a future
          * version of fwknop.
         */
-        if(key_len < RIJNDAEL_MIN_KEYSIZE)
-        {
-            memcpy(pw_buf, key, key_len);
-            memset(pw_buf+key_len, '0', RIJNDAEL_MIN_KEYSIZE - key_len);
-            final_key_len = RIJNDAEL_MIN_KEYSIZE;
-        }
-        else
-        {
-            memcpy(pw_buf, key, key_len);
-            final_key_len = key_len;
-        }
-    }
-    else
-    {
-        memcpy(pw_buf, key, key_len);
-        final_key_len = key_len;
+        memset(pw_salt+key_len, '0', RIJNDAEL_MIN_KEYSIZE - key_len);
+        final_key_len = RIJNDAEL_MIN_KEYSIZE;
     }
 
     /* If we are decrypting, data will contain the salt. Otherwise,
-     * for encryption, we generate a random salt.
+     * for encryption, rij_encrypt() has already put a random salt in
+     * the context.
     */
     if(data != NULL)
     {
@@ -163,36 +152,31 @@ rij_salt_and_iv(RIJNDAEL_context *ctx, const char *key,
         */
         memcpy(ctx->salt, (data+SALT_LEN), SALT_LEN);
     }
-    else
-    {
-        /* Generate a random 8-byte salt.
-        */
-        get_random_data(ctx->salt, SALT_LEN);
-    }
 
     /* Now generate the key and initialization vector.
      * (again it is the perl Crypt::CBC way, with a touch of
-     * fwknop).
+     * fwknop).  Each MD5 round is written straight to where it belongs
+     * in the key and then the IV - the first hashes pw+salt, the later
+     * ones the previous digest followed by pw+salt.
     */
-    memcpy(tmp_buf+MD5_DIGEST_LEN, pw_buf, final_key_len);
-    memcpy(tmp_buf+MD5_DIGEST_LEN+final_key_len, ctx->salt, SALT_LEN);
+    memcpy(pw_salt+final_key_len, ctx->salt, SALT_LEN);
 
-    while(kiv_len < sizeof(kiv_buf))
+    for(i=0; i < KIV_ROUNDS; i++)
     {
-        if(kiv_len == 0)
-            md5(md5_buf, tmp_buf+MD5_DIGEST_LEN, final_key_len+SALT_LEN);
+        if(i < KIV_ROUNDS - 1)
+            out = ctx->key + i * MD5_DIGEST_LEN;
         else
-            md5(md5_buf, tmp_buf, MD5_DIGEST_LEN+final_key_len+SALT_LEN);
-
-        memcpy(tmp_buf, md5_buf, MD5_DIGEST_LEN);
+            out = ctx->iv;
 
-        memcpy(kiv_buf + kiv_len, md5_buf, MD5_DIGEST_LEN);
+        if(i == 0)
+            md5(out, pw_salt, final_key_len+SALT_LEN);
+        else
+            md5(out, tmp_buf, MD5_DIGEST_LEN+final_key_len+SALT_LEN);
 
-        kiv_len += MD5_DIGEST_LEN;
+        memcpy(tmp_buf, out, MD5_DIGEST_LEN);
     }
 
-    memcpy(ctx->key, kiv_buf, RIJNDAEL_MAX_KEYSIZE);
-    memcpy(ctx->iv,  kiv_buf+RIJNDAEL_MAX_KEYSIZE, RIJNDAEL_BLOCKSIZE);
+    zero_buf((char *)tmp_buf, sizeof(tmp_buf));
 }
 
 /* Initialization entry point.
@@ -221,27 +205,175 @@ rijndael_init(RIJNDAEL_context *ctx, const char *key,
     else  /* shouldn't get this far */
         ctx->mode = encryption_mode;
 
-    /* Generate the salt and initialization vector.
+    /* Generate the salt and initialization vector.  The key schedule
+     * is set up by rijndael_setup() only if rijndael.c does the work.
     */
     rij_salt_and_iv(ctx, key, key_len, data, encryption_mode);
+}
+
+#if HAVE_OPENSSL_AES
+/* Run CBC mode encryption or decryption through OpenSSL, which uses
+ * AES-NI or ARMv8 crypto instructions when the CPU has them (and has no
+ * key dependent table lookups in that case).  The data is a whole number
+ * of blocks and padding is handled by our callers, so OpenSSL's own
+ * padding is off and the output is the same as block_encrypt() and
+ * block_decrypt() give.  Returns 0 if OpenSSL was not used, in which case
+ * the caller falls back to rijndael.c.
+*/
+static int
+evp_aes_cbc(const RIJNDAEL_context *ctx, const unsigned char *in,
+    const int in_len, unsigned char *out, const int enc)
+{
+    EVP_CIPHER_CTX     *evp;
+    int                 len = 0, final_len = 0, ok = 0;
+
+    if(ctx->mode != MODE_CBC)
+        return 0;
+
+    if((evp = EVP_CIPHER_CTX_new()) == NULL)
+        return 0;
 
-    /* Intialize our Rijndael context.
+    if(EVP_CipherInit_ex(evp, EVP_aes_256_cbc(), NULL,
+                ctx->key, ctx->iv, enc) == 1
+            && EVP_CIPHER_CTX_set_padding(evp, 0) == 1
+            && EVP_CipherUpdate(evp, out, &len, in, in_len) == 1
+            && EVP_CipherFinal_ex(evp, out + len, &final_len) == 1
+            && len + final_len == in_len)
+        ok = 1;
+
+    /* This also wipes the expanded key.
     */
-    rijndael_setup(ctx, RIJNDAEL_MAX_KEYSIZE, ctx->key);
+    EVP_CIPHER_CTX_free(evp);
+
+    return ok;
 }
+#endif
+
+#if HAVE_OPENSSL_AES
+/* AES-256-GCM encryption for FKO_ENC_MODE_GCM.  The key is the SHA-256
+ * digest of the passphrase (so no salted KDF rounds are needed), and the
+ * nonce is random for each message (taken from rand_bytes if that is not
+ * NULL).  The "Salted__" header and the nonce are authenticated along with
+ * the ciphertext, so the tag is all that is needed to know the message is
+ * intact.  Returns the output length, or 0 on error.
+*/
+static size_t
+gcm_encrypt(const unsigned char *in, const size_t in_len,
+    const char *key, const int key_len, unsigned char *out,
+    const unsigned char *rand_bytes)
+{
+    EVP_CIPHER_CTX     *evp;
+    unsigned char       gcm_key[SHA256_DIGEST_LEN];
+    unsigned char      *nonce = out + SALT_LEN;
+    unsigned char      *ct = nonce + GCM_NONCE_LEN;
+    int                 len = 0, final_len = 0;
+    size_t              res = 0;
+
+    if((evp = EVP_CIPHER_CTX_new()) == NULL)
+        return 0;
+
+    sha256(gcm_key, (unsigned char *)key, key_len);
+
+    memcpy(out, "Salted__", SALT_LEN);
+    if(rand_bytes != NULL)
+        memcpy(nonce, rand_bytes, GCM_NONCE_LEN);
+    else
+        get_random_data(nonce, GCM_NONCE_LEN);
+
+    if(EVP_EncryptInit_ex(evp, EVP_aes_256_gcm(), NULL, NULL, NULL) == 1
+            && EVP_CIPHER_CTX_ctrl(evp, EVP_CTRL_GCM_SET_IVLEN,
+                GCM_NONCE_LEN, NULL) == 1
+            && EVP_EncryptInit_ex(evp, NULL, NULL, gcm_key, nonce) == 1
+            && EVP_EncryptUpdate(evp, NULL, &len, out,
+                SALT_LEN + GCM_NONCE_LEN) == 1
+            && EVP_EncryptUpdate(evp, ct, &len, in, in_len) == 1
+            && EVP_EncryptFinal_ex(evp, ct + len, &final_len) == 1
+            && EVP_CIPHER_CTX_ctrl(evp, EVP_CTRL_GCM_GET_TAG,
+                GCM_TAG_LEN, ct + len + final_len) == 1)
+        res = SALT_LEN + GCM_NONCE_LEN + len + final_len + GCM_TAG_LEN;
+
+    EVP_CIPHER_CTX_free(evp);
+    zero_buf((char *)gcm_key, sizeof(gcm_key));
+
+    return(res);
+}
+
+/* Decrypt and authenticate FKO_ENC_MODE_GCM data.  Returns the plaintext
+ * length (NUL terminated in out), or 0 if the data is too short or the
+ * tag does not match - in which case nothing is left in out.
+*/
+static size_t
+gcm_decrypt(const unsigned char *in, const size_t in_len,
+    const char *key, const int key_len, unsigned char *out)
+{
+    EVP_CIPHER_CTX     *evp;
+    unsigned char       gcm_key[SHA256_DIGEST_LEN];
+    const unsigned char *nonce = in + SALT_LEN;
+    const unsigned char *ct = nonce + GCM_NONCE_LEN;
+    int                 ct_len, len = 0, final_len = 0;
+    size_t              res = 0;
+
+    if(in_len <= RIJ_ENCRYPT_OVERHEAD)
+        return 0;
+
+    ct_len = in_len - RIJ_ENCRYPT_OVERHEAD;
+
+    if((evp = EVP_CIPHER_CTX_new()) == NULL)
+        return 0;
+
+    sha256(gcm_key, (unsigned char *)key, key_len);
+
+    if(EVP_DecryptInit_ex(evp, EVP_aes_256_gcm(), NULL, NULL, NULL) == 1
+            && EVP_CIPHER_CTX_ctrl(evp, EVP_CTRL_GCM_SET_IVLEN,
+                GCM_NONCE_LEN, NULL) == 1
+            && EVP_DecryptInit_ex(evp, NULL, NULL, gcm_key, nonce) == 1
+            && EVP_DecryptUpdate(evp, NULL, &len, in,
+                SALT_LEN + GCM_NONCE_LEN) == 1
+            && EVP_DecryptUpdate(evp, out, &len, ct, ct_len) == 1
+            && EVP_CIPHER_CTX_ctrl(evp, EVP_CTRL_GCM_SET_TAG, GCM_TAG_LEN,
+                (void *)(ct + ct_len)) == 1
+            && EVP_DecryptFinal_ex(evp, out + len, &final_len) == 1)
+        res = len + final_len;
+
+    EVP_CIPHER_CTX_free(evp);
+    zero_buf((char *)gcm_key, sizeof(gcm_key));
+
+    if(res == 0)
+        zero_buf((char *)out, ct_len);
+
+    out[res] = '\0';
+
+    return(res);
+}
+#endif
 
 /* Take a chunk of data, encrypt it in the same way OpenSSL would
- * (with a default of AES in CBC mode).
+ * (with a default of AES in CBC mode).  The salt (or GCM nonce) comes
+ * from rand_bytes, which must hold RIJ_ENCRYPT_RAND_LEN bytes, or is
+ * read from the random source if rand_bytes is NULL.
 */
 size_t
 rij_encrypt(unsigned char *in, size_t in_len,
     const char *key, const int key_len,
-    unsigned char *out, int encryption_mode)
+    unsigned char *out, int encryption_mode,
+    const unsigned char *rand_bytes)
 {
     RIJNDAEL_context    ctx;
     int                 i, pad_val;
     unsigned char      *ondx = out;
 
+    if(FKO_ENC_MODE_IS_GCM(encryption_mode))
+#if HAVE_OPENSSL_AES
+        return(gcm_encrypt(in, in_len, key, key_len, out, rand_bytes));
+#else
+        return 0;
+#endif
+
+    if(rand_bytes != NULL)
+        memcpy(ctx.salt, rand_bytes, SALT_LEN);
+    else
+        get_random_data(ctx.salt, SALT_LEN);
+
     rijndael_init(&ctx, key, key_len, NULL, encryption_mode);
 
     /* Prepend the salt to the ciphertext...
@@ -258,7 +390,13 @@ rij_encrypt(unsigned char *in, size_t in_len,
     for (i = (int)in_len; i < ((int)in_len+pad_val); i++)
         in[i] = pad_val;
 
-    block_encrypt(&ctx, in, in_len+pad_val, ondx, ctx.iv);
+#if HAVE_OPENSSL_AES
+    if(! evp_aes_cbc(&ctx, in, in_len+pad_val, ondx, 1))
+#endif
+    {
+        rijndael_setup(&ctx, RIJNDAEL_MAX_KEYSIZE, ctx.key);
+        block_encrypt(&ctx, in, in_len+pad_val, ondx, ctx.iv);
+    }
 
     ondx += in_len+pad_val;
 
@@ -284,6 +422,13 @@ rij_decrypt(unsigned char *in, size_t in_len,
     if(in == NULL || key == NULL || out == NULL)
         return 0;
 
+    if(FKO_ENC_MODE_IS_GCM(encryption_mode))
+#if HAVE_OPENSSL_AES
+        return(gcm_decrypt(in, in_len, key, key_len, out));
+#else
+        return 0;
+#endif
+
     rijndael_init(&ctx, key, key_len, in, encryption_mode);
 
     /* Remove the first block since it contains the salt (it was consumed
@@ -292,7 +437,13 @@ rij_decrypt(unsigned char *in, size_t in_len,
     in_len -= RIJNDAEL_BLOCKSIZE;
     memmove(in, in+RIJNDAEL_BLOCKSIZE, in_len);
 
-    block_decrypt(&ctx, in, in_len, out, ctx.iv);
+#if HAVE_OPENSSL_AES
+    if(! evp_aes_cbc(&ctx, in, in_len, out, 0))
+#endif
+    {
+        rijndael_setup(&ctx, RIJNDAEL_MAX_KEYSIZE, ctx.key);
+        block_decrypt(&ctx, in, in_len, out, ctx.iv);
+    }
 
     ondx += in_len;
 
@@ -346,12 +497,23 @@ add_salted_str(fko_ctx_t ctx)
     if(constant_runtime_cmp(ctx->encrypted_msg,
             B64_RIJNDAEL_SALT, B64_RIJNDAEL_SALT_STR_LEN) != 0)
     {
-        /* We need to realloc space for the salt.
+        /* We need to realloc space for the salt (unless the buffer
+         * already has room for it).
         */
-        tbuf = realloc(ctx->encrypted_msg, ctx->encrypted_msg_len
-                    + B64_RIJNDAEL_SALT_STR_LEN+1);
-        if(tbuf == NULL)
-            return(FKO_ERROR_MEMORY_ALLOCATION);
+        if(ctx->encrypted_msg_size >= ctx->encrypted_msg_len
+                    + B64_RIJNDAEL_SALT_STR_LEN+1)
+        {
+            tbuf = ctx->encrypted_msg;
+        }
+        else
+        {
+            tbuf = realloc(ctx->encrypted_msg, ctx->encrypted_msg_len
+                        + B64_RIJNDAEL_SALT_STR_LEN+1);
+            if(tbuf == NULL)
+                return(FKO_ERROR_MEMORY_ALLOCATION);
+            ctx->encrypted_msg_size = ctx->encrypted_msg_len
+                        + B64_RIJNDAEL_SALT_STR_LEN+1;
+        }
 
         memmove(tbuf+B64_RIJNDAEL_SALT_STR_LEN, tbuf, ctx->encrypted_msg_len);
 
@@ -389,12 +551,23 @@ add_gpg_prefix(fko_ctx_t ctx)
     if(constant_runtime_cmp(ctx->encrypted_msg,
             B64_GPG_PREFIX, B64_GPG_PREFIX_STR_LEN) != 0)
     {
-        /* We need to realloc space for the prefix.
+        /* We need to realloc space for the prefix (unless the buffer
+         * already has room for it).
         */
-        tbuf = realloc(ctx->encrypted_msg, ctx->encrypted_msg_len
-                    + B64_GPG_PREFIX_STR_LEN+1);
-        if(tbuf == NULL)
-            return(FKO_ERROR_MEMORY_ALLOCATION);
+        if(ctx->encrypted_msg_size >= ctx->encrypted_msg_len
+                    + B64_GPG_PREFIX_STR_LEN+1)
+        {
+            tbuf = ctx->encrypted_msg;
+        }
+        else
+        {
+            tbuf = realloc(ctx->encrypted_msg, ctx->encrypted_msg_len
+                        + B64_GPG_PREFIX_STR_LEN+1);
+            if(tbuf == NULL)
+                return(FKO_ERROR_MEMORY_ALLOCATION);
+            ctx->encrypted_msg_size = ctx->encrypted_msg_len
+                        + B64_GPG_PREFIX_STR_LEN+1;
+        }
 
         memmove(tbuf+B64_GPG_PREFIX_STR_LEN, tbuf, ctx->encrypted_msg_len);
 
@@ -40,10 +40,28 @@
 */
 #define PREDICT_ENCSIZE(x) (1+(x>>4)+(x&0xf?1:0))<<4
 
+/* AES-GCM mode (FKO_ENC_MODE_GCM) layout: the "Salted__" string, a random
+ * nonce, the ciphertext and then the authentication tag.
+*/
+#define GCM_NONCE_LEN   12
+#define GCM_TAG_LEN     16
+
+/* Room to leave beyond the plaintext for the output of rij_encrypt() -
+ * the "Salted__" header plus either the salt and CBC padding or the GCM
+ * nonce and tag.
+*/
+#define RIJ_ENCRYPT_OVERHEAD    (SALT_LEN + GCM_NONCE_LEN + GCM_TAG_LEN)
+
+/* Random bytes used by rij_encrypt() for each message - the CBC salt or
+ * the GCM nonce, whichever is longer.
+*/
+#define RIJ_ENCRYPT_RAND_LEN    GCM_NONCE_LEN
+
 void get_random_data(unsigned char *data, const size_t len);
 size_t rij_encrypt(unsigned char *in, size_t len,
     const char *key, const int key_len,
-    unsigned char *out, int encryption_mode);
+    unsigned char *out, int encryption_mode,
+    const unsigned char *rand_bytes);
 size_t rij_decrypt(unsigned char *in, size_t len,
     const char *key, const int key_len,
     unsigned char *out, int encryption_mode);
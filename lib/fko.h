@@ -120,9 +120,20 @@ typedef enum {
     FKO_ENC_MODE_CTR,
     FKO_ENC_MODE_ASYMMETRIC,  /* placeholder when GPG is used */
     FKO_ENC_MODE_CBC_LEGACY_IV,  /* for the old zero-padding strategy */
+    FKO_ENC_MODE_GCM,  /* AES-256-GCM authenticated encryption */
+    FKO_ENC_MODE_GCM_BINARY,  /* AES-256-GCM with the binary inner message */
     FKO_LAST_ENC_MODE /* Always leave this as the last one */
 } fko_encryption_mode_t;
 
+/* Kernels libfko has more than one implementation of (fko_impl_get())
+*/
+typedef enum {
+    FKO_IMPL_SHA256 = 0,
+    FKO_IMPL_AES,
+    FKO_IMPL_BASE64,
+    FKO_LAST_IMPL /* Always leave this as the last one */
+} fko_impl_kernel_t;
+
 /* FKO ERROR_CODES
  *
  * Note: If you change this list in any way, please be sure to make the
@@ -312,6 +323,10 @@ typedef enum {
 #define B64_GPG_PREFIX "hQ"
 #define B64_GPG_PREFIX_STR_LEN 2
 
+/* Long enough for any fko_impl_get_spec() string
+*/
+#define FKO_IMPL_SPEC_LEN 64
+
 /* Specify whether libfko is allowed to call exit()
 */
 #define EXIT_UPON_ERR 1
@@ -324,6 +339,12 @@ typedef enum {
 struct fko_context;
 typedef struct fko_context *fko_ctx_t;
 
+/* Precomputed HMAC key state (see fko_hmac_state_new()).  This is also
+ * an opaque pointer.
+*/
+struct fko_hmac_state;
+typedef struct fko_hmac_state *fko_hmac_state_t;
+
 /* Function pointer for SPA packet field parsing
  */
 typedef int (*field_parser_ptr_t)(char *tbuf, char **ndx, int *t_size, fko_ctx_t ctx);
@@ -353,9 +374,21 @@ DLL_API int fko_new_with_data(fko_ctx_t *ctx, const char * const enc_msg,
     const char * const dec_key, const int dec_key_len, int encryption_mode,
     const char * const hmac_key, const int hmac_key_len, const int hmac_type,
     const uint32_t sdp_id);
+DLL_API int fko_new_with_data_len(fko_ctx_t *ctx, const char * const enc_msg,
+    const int enc_msg_len, const char * const dec_key, const int dec_key_len,
+    int encryption_mode, const char * const hmac_key, const int hmac_key_len,
+    const int hmac_type, const uint32_t sdp_id);
+DLL_API int fko_reset(fko_ctx_t ctx);
+DLL_API int fko_reset_with_data_len(fko_ctx_t ctx, const char * const enc_msg,
+    const int enc_msg_len, const char * const dec_key, const int dec_key_len,
+    int encryption_mode, const char * const hmac_key, const int hmac_key_len,
+    const int hmac_type, const uint32_t sdp_id);
 DLL_API int fko_destroy(fko_ctx_t ctx);
 DLL_API int fko_spa_data_final(fko_ctx_t ctx, const char * const enc_key,
     const int enc_key_len, const char * const hmac_key, const int hmac_key_len);
+DLL_API int fko_spa_data_final_batch(fko_ctx_t ctx, const char * const enc_key,
+    const int enc_key_len, const char * const hmac_key, const int hmac_key_len,
+    const int count, char **spa_data);
 
 /* Set context data functions
 */
@@ -388,11 +421,23 @@ DLL_API int fko_set_spa_hmac_type(fko_ctx_t ctx, const short hmac_type);
 */
 DLL_API const char* fko_errstr(const int err_code);
 DLL_API int fko_encryption_type(const char * const enc_data);
+DLL_API int fko_encryption_type_len(const char * const enc_data,
+        const int enc_data_len);
 DLL_API int fko_key_gen(char * const key_base64, const int key_len,
         char * const hmac_key_base64, const int hmac_ken_len,
         const int hmac_type);
 DLL_API int fko_base64_encode(unsigned char * const in, char * const out, int in_len);
 DLL_API int fko_base64_decode(const char * const in, unsigned char *out);
+DLL_API int fko_decode_sdp_id(const char * const in, uint32_t *sdp_id);
+
+/* Crypto implementations - libfko has SIMD or hardware versions of
+ * some kernels and picks one per kernel (see fko_impl.c)
+*/
+DLL_API int fko_impl_calibrate(void);
+DLL_API int fko_impl_select(const char * const spec);
+DLL_API int fko_impl_get(const int kernel, const char **kernel_name,
+        const char **impl_name);
+DLL_API int fko_impl_get_spec(char * const buf, const int len);
 
 DLL_API int fko_encode_sdp_spa_data(fko_ctx_t ctx);
 DLL_API int fko_encode_spa_data(fko_ctx_t ctx);
@@ -406,6 +451,12 @@ DLL_API int fko_verify_hmac(fko_ctx_t ctx, const char * const hmac_key,
 DLL_API int fko_set_spa_hmac(fko_ctx_t ctx, const char * const hmac_key,
     const int hmac_key_len);
 DLL_API int fko_get_spa_hmac(fko_ctx_t ctx, char **enc_data);
+DLL_API int fko_hmac_state_new(fko_hmac_state_t *r_state,
+    const char * const hmac_key, const int hmac_key_len, const short hmac_type);
+DLL_API void fko_hmac_state_destroy(fko_hmac_state_t state);
+DLL_API int fko_set_spa_hmac_state(fko_ctx_t ctx, const fko_hmac_state_t state);
+DLL_API int fko_verify_hmac_raw(const fko_hmac_state_t state,
+    const char * const enc_msg, const int enc_msg_len, int *data_len);
 DLL_API int fko_get_encoded_sdp_id(fko_ctx_t ctx, char **encoded_sdp_id);
 DLL_API int fko_get_encoded_data(fko_ctx_t ctx, char **enc_data);
 #if FUZZING_INTERFACES
@@ -428,6 +479,8 @@ DLL_API int fko_get_raw_spa_digest_type(fko_ctx_t ctx, short *raw_spa_digest_typ
 DLL_API int fko_get_spa_hmac_type(fko_ctx_t ctx, short *spa_hmac_type);
 DLL_API int fko_get_spa_digest(fko_ctx_t ctx, char **spa_digest);
 DLL_API int fko_get_raw_spa_digest(fko_ctx_t ctx, char **raw_spa_digest);
+DLL_API int fko_get_raw_spa_digest_from_data(const char * const enc_msg,
+        const int enc_msg_len, const short digest_type, char **raw_spa_digest);
 DLL_API int fko_get_spa_encryption_type(fko_ctx_t ctx, short *spa_enc_type);
 DLL_API int fko_get_spa_encryption_mode(fko_ctx_t ctx, int *spa_enc_mode);
 DLL_API int fko_get_spa_data(fko_ctx_t ctx, char **spa_data);
@@ -474,6 +527,9 @@ DLL_API int fko_gpg_signature_fpr_match(fko_ctx_t ctx, const char * const fpr,
 
 #ifdef HAVE_C_UNIT_TESTS
 int register_ts_fko_decode(void);
+int register_ts_fko_funcs(void);
+int register_ts_fko_hmac(void);
+int register_ts_fko_impl(void);
 #endif
 
 #endif /* FKO_H */
@@ -52,6 +52,22 @@ struct fko_gpg_sig {
 typedef struct fko_gpg_sig *fko_gpg_sig_t;
 #endif /* HAVE_LIBGPGME */
 
+/* Buffers that fko_reset() keeps (wiped) so that the next message decoded
+ * with fko_reset_with_data_len() can reuse them.
+*/
+enum {
+    FKO_BUF_RAND_VAL = 0,
+    FKO_BUF_USERNAME,
+    FKO_BUF_VERSION,
+    FKO_BUF_MESSAGE,
+    FKO_BUF_NAT_ACCESS,
+    FKO_BUF_SERVER_AUTH,
+    FKO_BUF_ENCODED_MSG,
+    FKO_BUF_ENCRYPTED_MSG,
+    FKO_BUF_DIGEST,
+    FKO_NUM_SPARE_BUFS
+};
+
 /* The pieces we need to make an FKO  SPA data packet.
 */
 struct fko_context {
@@ -100,6 +116,35 @@ struct fko_context {
     int             added_salted_str;
     int             added_gpg_prefix;
 
+    /* Allocated sizes of the buffers above that came from ctx_buf_reserve()
+     * (0 if the size is not known).  Anything that frees or replaces one of
+     * these buffers some other way must set its size back to 0.
+    */
+    int             rand_val_size;
+    int             username_size;
+    int             version_size;
+    int             message_size;
+    int             nat_access_size;
+    int             server_auth_size;
+    int             encoded_msg_size;
+    int             encrypted_msg_size;
+    int             digest_size;
+
+    /* Set only while fko_spa_data_final_batch() builds a packet: the
+     * random bytes for the salt (or GCM nonce) and the HMAC key state.
+    */
+    const unsigned char            *batch_rand;
+    const struct fko_hmac_state    *batch_hmac;
+
+    /* Precomputed HMAC key state for this context's key, owned by the
+     * caller (see fko_set_spa_hmac_state()).
+    */
+    const struct fko_hmac_state    *hmac_state;
+
+    /* Wiped buffers kept across fko_reset() */
+    char           *spare_buf[FKO_NUM_SPARE_BUFS];
+    int             spare_size[FKO_NUM_SPARE_BUFS];
+
     /* State info */
     unsigned int    state;
     unsigned char   initval;
@@ -123,9 +168,22 @@ struct fko_context {
     fko_gpg_sig_t   gpg_sigs;
 
     gpgme_error_t   gpg_err;
+
+    /* gpgme context kept across fko_reset(), with the GPG exe and home
+     * dir it was set up for, so the next message can skip the setup.
+    */
+    gpgme_ctx_t     spare_gpg_ctx;
+    char           *spare_gpg_exe;
+    char           *spare_gpg_home_dir;
 #endif /* HAVE_LIBGPGME */
 };
 
+/* Reusable buffer helpers (fko_funcs.c)
+*/
+int ctx_buf_reserve(fko_ctx_t ctx, const int which, char **buf,
+        int *buf_size, const int len);
+int ctx_buf_release(char **buf, int *buf_size);
+
 #endif /* FKO_CONTEXT_H */
 
 /***EOF***/
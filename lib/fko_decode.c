@@ -81,6 +81,23 @@ last_field(char *str)
     return pos_last;
 }
 
+/* Base64-decode the t_size characters of a field in place: the field is
+ * NUL terminated where it sits in the encoded message for the decoder,
+ * and the separator that was there is put back afterwards.
+*/
+static int
+decode_field(char *field, const int t_size, char *out)
+{
+    char    sep = field[t_size];
+    int     res;
+
+    field[t_size] = '\0';
+    res = b64_decode(field, (unsigned char *)out);
+    field[t_size] = sep;
+
+    return(res);
+}
+
 static int
 verify_digest(char *tbuf, int t_size, fko_ctx_t ctx)
 {
@@ -172,17 +189,11 @@ parse_msg(char *tbuf, char **ndx, int *t_size, fko_ctx_t ctx)
     if (*t_size > MAX_SPA_MESSAGE_SIZE)
         return(FKO_ERROR_INVALID_DATA_DECODE_MESSAGE_TOOBIG);
 
-    strlcpy(tbuf, *ndx, *t_size+1);
-
-    if(ctx->message != NULL)
-        free(ctx->message);
-
-    ctx->message = calloc(1, *t_size+1); /* Yes, more than we need */
-
-    if(ctx->message == NULL)
+    if(ctx_buf_reserve(ctx, FKO_BUF_MESSAGE, &ctx->message,
+            &ctx->message_size, *t_size+1) != FKO_SUCCESS)
         return(FKO_ERROR_MEMORY_ALLOCATION);
 
-    if(b64_decode(tbuf, (unsigned char*)ctx->message) < 0)
+    if(decode_field(*ndx, *t_size, ctx->message) < 0)
         return(FKO_ERROR_INVALID_DATA_DECODE_MESSAGE_DECODEFAIL);
 
     if(ctx->message_type == FKO_COMMAND_MSG)
@@ -231,16 +242,11 @@ parse_nat_msg(char *tbuf, char **ndx, int *t_size, fko_ctx_t ctx)
         if (*t_size > MAX_SPA_MESSAGE_SIZE)
             return(FKO_ERROR_INVALID_DATA_DECODE_NATACCESS_TOOBIG);
 
-        strlcpy(tbuf, *ndx, *t_size+1);
-
-        if(ctx->nat_access != NULL)
-            free(ctx->nat_access);
-
-        ctx->nat_access = calloc(1, *t_size+1); /* Yes, more than we need */
-        if(ctx->nat_access == NULL)
+        if(ctx_buf_reserve(ctx, FKO_BUF_NAT_ACCESS, &ctx->nat_access,
+                &ctx->nat_access_size, *t_size+1) != FKO_SUCCESS)
             return(FKO_ERROR_MEMORY_ALLOCATION);
 
-        if(b64_decode(tbuf, (unsigned char*)ctx->nat_access) < 0)
+        if(decode_field(*ndx, *t_size, ctx->nat_access) < 0)
             return(FKO_ERROR_INVALID_DATA_DECODE_NATACCESS_DECODEFAIL);
 
         if(validate_nat_access_msg(ctx->nat_access) != FKO_SUCCESS)
@@ -281,16 +287,11 @@ parse_server_auth(char *tbuf, char **ndx, int *t_size, fko_ctx_t ctx)
             if (*t_size > MAX_SPA_MESSAGE_SIZE)
                 return(FKO_ERROR_INVALID_DATA_DECODE_EXTRA_TOOBIG);
 
-            strlcpy(tbuf, *ndx, *t_size+1);
-
-            if(ctx->server_auth != NULL)
-                free(ctx->server_auth);
-
-            ctx->server_auth = calloc(1, *t_size+1); /* Yes, more than we need */
-            if(ctx->server_auth == NULL)
+            if(ctx_buf_reserve(ctx, FKO_BUF_SERVER_AUTH, &ctx->server_auth,
+                    &ctx->server_auth_size, *t_size+1) != FKO_SUCCESS)
                 return(FKO_ERROR_MEMORY_ALLOCATION);
 
-            if(b64_decode(tbuf, (unsigned char*)ctx->server_auth) < 0)
+            if(decode_field(*ndx, *t_size, ctx->server_auth) < 0)
                 return(FKO_ERROR_INVALID_DATA_DECODE_EXTRA_DECODEFAIL);
 
             *ndx += *t_size + 1;
@@ -298,16 +299,11 @@ parse_server_auth(char *tbuf, char **ndx, int *t_size, fko_ctx_t ctx)
     }
     else
     {
-        strlcpy(tbuf, *ndx, *t_size+1);
-
-        if(ctx->server_auth != NULL)
-            free(ctx->server_auth);
-
-        ctx->server_auth = calloc(1, *t_size+1); /* Yes, more than we need */
-        if(ctx->server_auth == NULL)
+        if(ctx_buf_reserve(ctx, FKO_BUF_SERVER_AUTH, &ctx->server_auth,
+                &ctx->server_auth_size, *t_size+1) != FKO_SUCCESS)
             return(FKO_ERROR_MEMORY_ALLOCATION);
 
-        if(b64_decode(tbuf, (unsigned char*)ctx->server_auth) < 0)
+        if(decode_field(*ndx, *t_size, ctx->server_auth) < 0)
             return(FKO_ERROR_INVALID_DATA_DECODE_SRVAUTH_DECODEFAIL);
     }
 
@@ -412,11 +408,8 @@ parse_version(char *tbuf, char **ndx, int *t_size, fko_ctx_t ctx)
     if (*t_size > MAX_SPA_VERSION_SIZE)
         return(FKO_ERROR_INVALID_DATA_DECODE_VERSION_TOOBIG);
 
-    if(ctx->version != NULL)
-        free(ctx->version);
-
-    ctx->version = calloc(1, *t_size+1);
-    if(ctx->version == NULL)
+    if(ctx_buf_reserve(ctx, FKO_BUF_VERSION, &ctx->version,
+            &ctx->version_size, *t_size+1) != FKO_SUCCESS)
         return(FKO_ERROR_MEMORY_ALLOCATION);
 
     strlcpy(ctx->version, *ndx, *t_size+1);
@@ -457,16 +450,11 @@ parse_username(char *tbuf, char **ndx, int *t_size, fko_ctx_t ctx)
     if (*t_size > MAX_SPA_USERNAME_SIZE)
         return(FKO_ERROR_INVALID_DATA_DECODE_USERNAME_TOOBIG);
 
-    strlcpy(tbuf, *ndx, *t_size+1);
-
-    if(ctx->username != NULL)
-        free(ctx->username);
-
-    ctx->username = calloc(1, *t_size+1); /* Yes, more than we need */
-    if(ctx->username == NULL)
+    if(ctx_buf_reserve(ctx, FKO_BUF_USERNAME, &ctx->username,
+            &ctx->username_size, *t_size+1) != FKO_SUCCESS)
         return(FKO_ERROR_MEMORY_ALLOCATION);
 
-    if(b64_decode(tbuf, (unsigned char*)ctx->username) < 0)
+    if(decode_field(*ndx, *t_size, ctx->username) < 0)
         return(FKO_ERROR_INVALID_DATA_DECODE_USERNAME_DECODEFAIL);
 
     if(validate_username(ctx->username) != FKO_SUCCESS)
@@ -483,11 +471,8 @@ parse_rand_val(char *tbuf, char **ndx, int *t_size, fko_ctx_t ctx)
     if((*t_size = strcspn(*ndx, ":")) < FKO_RAND_VAL_SIZE)
         return(FKO_ERROR_INVALID_DATA_DECODE_RAND_MISSING);
 
-    if(ctx->rand_val != NULL)
-        free(ctx->rand_val);
-
-    ctx->rand_val = calloc(1, FKO_RAND_VAL_SIZE+1);
-    if(ctx->rand_val == NULL)
+    if(ctx_buf_reserve(ctx, FKO_BUF_RAND_VAL, &ctx->rand_val,
+            &ctx->rand_val_size, FKO_RAND_VAL_SIZE+1) != FKO_SUCCESS)
         return(FKO_ERROR_MEMORY_ALLOCATION);
 
     ctx->rand_val = strncpy(ctx->rand_val, *ndx, FKO_RAND_VAL_SIZE);
@@ -498,60 +483,320 @@ parse_rand_val(char *tbuf, char **ndx, int *t_size, fko_ctx_t ctx)
 }
 
 
+/* SPA field parsing functions, in the order the fields appear
+*/
+static const field_parser_ptr_t field_parsers[FIELD_PARSERS] = {
+    parse_rand_val,         /* Extract random value */
+    parse_username,         /* Extract username */
+    parse_timestamp,        /* Client timestamp */
+    parse_version,          /* SPA version */
+    parse_msg_type,         /* SPA msg type */
+    parse_msg,              /* SPA msg string */
+    parse_nat_msg,          /* SPA NAT msg string */
+    parse_server_auth,      /* optional server authentication method */
+    parse_client_timeout    /* client defined timeout */
+};
+
+static const field_parser_ptr_t sdp_field_parsers[SDP_FIELD_PARSERS] = {
+    parse_rand_val,         /* Extract random value */
+    parse_timestamp,        /* Client timestamp */
+    parse_msg_type,         /* SPA msg type */
+    parse_msg,              /* SPA msg string */
+    parse_nat_msg,          /* SPA NAT msg string */
+    parse_server_auth       /* optional server authentication method */
+};
+
+/* Work through the encoded data (the digest already removed) and extract
+ * (and base64-decode where necessary) the SPA data fields into the context.
+*/
+static int
+parse_fields(char *tbuf, fko_ctx_t ctx,
+        const field_parser_ptr_t *field_parser, const int num_field_parsers)
+{
+    char       *ndx = ctx->encoded_msg;
+    int         t_size, i, res;
+
+    for (i=0; i < num_field_parsers; i++)
+    {
+        res = (*field_parser[i])(tbuf, &ndx, &t_size, ctx);
+        if(res != FKO_SUCCESS)
+            return res;
+    }
+
+    /* Call the context initialized.
+    */
+    ctx->initval = FKO_CTX_INITIALIZED;
+    FKO_SET_CTX_INITIALIZED(ctx);
+
+    return(FKO_SUCCESS);
+}
+
+/* Copy a binary string field into a context buffer.
+*/
+static int
+bin_str_field(fko_ctx_t ctx, const int which, char **buf, int *buf_size,
+        const unsigned char *val, const int len)
+{
+    if(memchr(val, '\0', len) != NULL)
+        return(FKO_ERROR_INVALID_DATA);
+
+    if(ctx_buf_reserve(ctx, which, buf, buf_size, len+1) != FKO_SUCCESS)
+        return(FKO_ERROR_MEMORY_ALLOCATION);
+
+    memcpy(*buf, val, len);
+    (*buf)[len] = '\0';
+
+    return(FKO_SUCCESS);
+}
+
+/* Decode the binary inner message of FKO_ENC_MODE_GCM_BINARY (see
+ * fko_message.h).  The fields are located first, then checked in the same
+ * order and against the same rules as the text fields.
+*/
+static int
+decode_bin_spa_data(fko_ctx_t ctx)
+{
+    const unsigned char *buf = (const unsigned char *)ctx->encoded_msg;
+    const unsigned char *val[FKO_BIN_LAST_FIELD+1] = {NULL};
+    int                  len[FKO_BIN_LAST_FIELD+1] = {0};
+    int                  pos, type, flen, i, res;
+    uint64_t             ts = 0;
+    unsigned int         timeout = 0;
+
+    if(ctx->encoded_msg_len < FKO_BIN_HDR_LEN
+            || buf[0] != FKO_BIN_MAGIC || buf[1] != FKO_BIN_VERSION)
+        return(FKO_ERROR_INVALID_DATA_DECODE_MSGLEN_VALIDFAIL);
+
+    for(pos = FKO_BIN_HDR_LEN; pos < ctx->encoded_msg_len; pos += flen)
+    {
+        if(pos + FKO_BIN_FIELD_HDR_LEN > ctx->encoded_msg_len)
+            return(FKO_ERROR_INVALID_DATA_DECODE_WRONG_NUM_FIELDS);
+
+        type = buf[pos];
+        flen = buf[pos+1];
+        pos += FKO_BIN_FIELD_HDR_LEN;
+
+        if(pos + flen > ctx->encoded_msg_len)
+            return(FKO_ERROR_INVALID_DATA_DECODE_WRONG_NUM_FIELDS);
+
+        if(type < 1 || type > FKO_BIN_LAST_FIELD)
+            continue;
+
+        if(val[type] != NULL)
+            return(FKO_ERROR_INVALID_DATA_DECODE_GT_MAX_FIELDS);
+
+        val[type] = buf + pos;
+        len[type] = flen;
+    }
+
+    /* Random value
+    */
+    if(len[FKO_BIN_RAND_VAL] != FKO_BIN_RAND_VAL_LEN)
+        return(FKO_ERROR_INVALID_DATA_DECODE_RAND_MISSING);
+
+    if(ctx_buf_reserve(ctx, FKO_BUF_RAND_VAL, &ctx->rand_val,
+            &ctx->rand_val_size, FKO_RAND_VAL_SIZE+1) != FKO_SUCCESS)
+        return(FKO_ERROR_MEMORY_ALLOCATION);
+
+    for(i=0; i < FKO_BIN_RAND_VAL_LEN; i++)
+    {
+        if((val[FKO_BIN_RAND_VAL][i] >> 4) > 9 || (val[FKO_BIN_RAND_VAL][i] & 0x0f) > 9)
+            return(FKO_ERROR_INVALID_DATA_DECODE_RAND_MISSING);
+        ctx->rand_val[2*i]   = '0' + (val[FKO_BIN_RAND_VAL][i] >> 4);
+        ctx->rand_val[2*i+1] = '0' + (val[FKO_BIN_RAND_VAL][i] & 0x0f);
+    }
+    ctx->rand_val[FKO_RAND_VAL_SIZE] = '\0';
+
+    /* Username
+    */
+    if(val[FKO_BIN_USERNAME] != NULL)
+    {
+        if(len[FKO_BIN_USERNAME] > MAX_SPA_USERNAME_SIZE)
+            return(FKO_ERROR_INVALID_DATA_DECODE_USERNAME_TOOBIG);
+
+        res = bin_str_field(ctx, FKO_BUF_USERNAME, &ctx->username,
+                &ctx->username_size, val[FKO_BIN_USERNAME], len[FKO_BIN_USERNAME]);
+        if(res == FKO_ERROR_INVALID_DATA)
+            return(FKO_ERROR_INVALID_DATA_DECODE_USERNAME_DECODEFAIL);
+        if(res != FKO_SUCCESS)
+            return(res);
+
+        if(validate_username(ctx->username) != FKO_SUCCESS)
+            return(FKO_ERROR_INVALID_DATA_DECODE_USERNAME_VALIDFAIL);
+    }
+    else if(ctx->disable_sdp_mode)
+        return(FKO_ERROR_INVALID_DATA_DECODE_USERNAME_MISSING);
+
+    /* Timestamp
+    */
+    if(len[FKO_BIN_TIMESTAMP] != FKO_BIN_TIMESTAMP_LEN)
+        return(FKO_ERROR_INVALID_DATA_DECODE_TIMESTAMP_MISSING);
+
+    for(i=0; i < FKO_BIN_TIMESTAMP_LEN; i++)
+        ts = (ts << 8) | val[FKO_BIN_TIMESTAMP][i];
+
+    if(ts > 0xffffffff)
+        return(FKO_ERROR_INVALID_DATA_DECODE_TIMESTAMP_DECODEFAIL);
+
+    ctx->timestamp = (unsigned int) ts;
+
+    /* Version
+    */
+    if(val[FKO_BIN_VERSION_STR] != NULL)
+    {
+        if(len[FKO_BIN_VERSION_STR] < 1)
+            return(FKO_ERROR_INVALID_DATA_DECODE_VERSION_MISSING);
+
+        if(len[FKO_BIN_VERSION_STR] > MAX_SPA_VERSION_SIZE)
+            return(FKO_ERROR_INVALID_DATA_DECODE_VERSION_TOOBIG);
+
+        if((res = bin_str_field(ctx, FKO_BUF_VERSION, &ctx->version,
+                &ctx->version_size, val[FKO_BIN_VERSION_STR],
+                len[FKO_BIN_VERSION_STR])) != FKO_SUCCESS)
+            return(res == FKO_ERROR_INVALID_DATA
+                    ? FKO_ERROR_INVALID_DATA_DECODE_VERSION_MISSING : res);
+    }
+    else if(ctx->disable_sdp_mode)
+        return(FKO_ERROR_INVALID_DATA_DECODE_VERSION_MISSING);
+
+    /* Message type
+    */
+    if(len[FKO_BIN_MSG_TYPE] != 1)
+        return(FKO_ERROR_INVALID_DATA_DECODE_MSGTYPE_MISSING);
+
+    if(val[FKO_BIN_MSG_TYPE][0] >= FKO_LAST_MSG_TYPE)
+        return(FKO_ERROR_INVALID_DATA_DECODE_MSGTYPE_DECODEFAIL);
+
+    ctx->message_type = val[FKO_BIN_MSG_TYPE][0];
+
+    /* Message
+    */
+    if(len[FKO_BIN_MESSAGE] < 1)
+        return(FKO_ERROR_INVALID_DATA_DECODE_MESSAGE_MISSING);
+
+    if((res = bin_str_field(ctx, FKO_BUF_MESSAGE, &ctx->message,
+            &ctx->message_size, val[FKO_BIN_MESSAGE],
+            len[FKO_BIN_MESSAGE])) != FKO_SUCCESS)
+        return(res == FKO_ERROR_INVALID_DATA
+                ? FKO_ERROR_INVALID_DATA_DECODE_MESSAGE_DECODEFAIL : res);
+
+    if(ctx->message_type == FKO_COMMAND_MSG)
+    {
+        if(validate_cmd_msg(ctx->message) != FKO_SUCCESS)
+            return(FKO_ERROR_INVALID_DATA_DECODE_MESSAGE_VALIDFAIL);
+    }
+    else if(ctx->message_type == FKO_SERVICE_ACCESS_MSG ||
+            ctx->message_type == FKO_CLIENT_TIMEOUT_SERVICE_ACCESS_MSG)
+    {
+        if(validate_service_access_msg(ctx->message) != FKO_SUCCESS)
+            return(FKO_ERROR_INVALID_DATA_DECODE_ACCESS_VALIDFAIL);
+    }
+    else if(validate_access_msg(ctx->message) != FKO_SUCCESS)
+        return(FKO_ERROR_INVALID_DATA_DECODE_ACCESS_VALIDFAIL);
+
+    /* NAT access
+    */
+    if(  ctx->message_type == FKO_NAT_ACCESS_MSG
+      || ctx->message_type == FKO_LOCAL_NAT_ACCESS_MSG
+      || ctx->message_type == FKO_CLIENT_TIMEOUT_NAT_ACCESS_MSG
+      || ctx->message_type == FKO_CLIENT_TIMEOUT_LOCAL_NAT_ACCESS_MSG)
+    {
+        if(len[FKO_BIN_NAT_ACCESS] < 1)
+            return(FKO_ERROR_INVALID_DATA_DECODE_NATACCESS_MISSING);
+
+        if(len[FKO_BIN_NAT_ACCESS] > MAX_SPA_NAT_ACCESS_SIZE)
+            return(FKO_ERROR_INVALID_DATA_DECODE_NATACCESS_TOOBIG);
+
+        if((res = bin_str_field(ctx, FKO_BUF_NAT_ACCESS, &ctx->nat_access,
+                &ctx->nat_access_size, val[FKO_BIN_NAT_ACCESS],
+                len[FKO_BIN_NAT_ACCESS])) != FKO_SUCCESS)
+            return(res == FKO_ERROR_INVALID_DATA
+                    ? FKO_ERROR_INVALID_DATA_DECODE_NATACCESS_DECODEFAIL : res);
+
+        if(validate_nat_access_msg(ctx->nat_access) != FKO_SUCCESS)
+            return(FKO_ERROR_INVALID_DATA_DECODE_NATACCESS_VALIDFAIL);
+    }
+
+    /* Server auth
+    */
+    if(len[FKO_BIN_SERVER_AUTH] > 0)
+    {
+        if((res = bin_str_field(ctx, FKO_BUF_SERVER_AUTH, &ctx->server_auth,
+                &ctx->server_auth_size, val[FKO_BIN_SERVER_AUTH],
+                len[FKO_BIN_SERVER_AUTH])) != FKO_SUCCESS)
+            return(res == FKO_ERROR_INVALID_DATA
+                    ? FKO_ERROR_INVALID_DATA_DECODE_SRVAUTH_DECODEFAIL : res);
+    }
+
+    /* Client timeout
+    */
+    if(ctx->disable_sdp_mode && (
+         ctx->message_type == FKO_CLIENT_TIMEOUT_ACCESS_MSG
+      || ctx->message_type == FKO_CLIENT_TIMEOUT_NAT_ACCESS_MSG
+      || ctx->message_type == FKO_CLIENT_TIMEOUT_LOCAL_NAT_ACCESS_MSG))
+    {
+        if(len[FKO_BIN_CLIENT_TIMEOUT] != FKO_BIN_TIMEOUT_LEN)
+            return(FKO_ERROR_INVALID_DATA_DECODE_TIMEOUT_MISSING);
+
+        for(i=0; i < FKO_BIN_TIMEOUT_LEN; i++)
+            timeout = (timeout << 8) | val[FKO_BIN_CLIENT_TIMEOUT][i];
+
+        if(timeout > (2 << 15))
+            return(FKO_ERROR_INVALID_DATA_DECODE_TIMEOUT_VALIDFAIL);
+
+        ctx->client_timeout = timeout;
+    }
+
+    /* The GCM tag has authenticated the message, there is no digest.
+    */
+    if(ctx->digest != NULL)
+        ctx->digest[0] = '\0';
+    ctx->digest_len = 0;
+
+    ctx->initval = FKO_CTX_INITIALIZED;
+    FKO_SET_CTX_INITIALIZED(ctx);
+
+    return(FKO_SUCCESS);
+}
+
 /* Decode the encoded SPA data.
+ *
+ * Fields are base64-decoded straight out of the encoded message and into
+ * context buffers from ctx_buf_reserve(), so a context that is reused via
+ * fko_reset_with_data_len() decodes without allocating anything.
 */
 int
 fko_decode_spa_data(fko_ctx_t ctx)
 {
-    char       *tbuf, *ndx;
-    int         t_size, i, res, num_field_parsers=0;
-    field_parser_ptr_t *field_parser = NULL;
+    char        tbuf[FKO_ENCODE_TMP_BUF_SIZE] = {0};
+    char       *ndx;
+    int         t_size, i, res, msg_len, num_field_parsers;
+    const field_parser_ptr_t *field_parser;
 
-    /* Array of function pointers to SPA field parsing functions
-    */
     if(ctx->disable_sdp_mode)
     {
         num_field_parsers = FIELD_PARSERS;
-        field_parser = calloc(num_field_parsers, sizeof(field_parser_ptr_t));
-
-        field_parser[0]    = parse_rand_val;       /* Extract random value */
-        field_parser[1]    = parse_username;       /* Extract username */
-        field_parser[2]    = parse_timestamp;      /* Client timestamp */
-        field_parser[3]    = parse_version;        /* SPA version */
-        field_parser[4]    = parse_msg_type;       /* SPA msg type */
-        field_parser[5]    = parse_msg;            /* SPA msg string */
-        field_parser[6]    = parse_nat_msg;        /* SPA NAT msg string */
-        field_parser[7]    = parse_server_auth;    /* optional server authentication method */
-        field_parser[8]    = parse_client_timeout; /* client defined timeout */
+        field_parser      = field_parsers;
     }
     else
     {
         num_field_parsers = SDP_FIELD_PARSERS;
-        field_parser = calloc(num_field_parsers, sizeof(field_parser_ptr_t));
-
-        field_parser[0]    = parse_rand_val;       /* Extract random value */
-        field_parser[1]    = parse_timestamp;      /* Client timestamp */
-        field_parser[2]    = parse_msg_type;       /* SPA msg type */
-        field_parser[3]    = parse_msg;            /* SPA msg string */
-        field_parser[4]    = parse_nat_msg;        /* SPA NAT msg string */
-        field_parser[5]    = parse_server_auth;    /* optional server authentication method */
-
+        field_parser      = sdp_field_parsers;
     }
+
     if (! is_valid_encoded_msg_len(ctx->encoded_msg_len))
-    {
-        free(field_parser);
         return(FKO_ERROR_INVALID_DATA_DECODE_MSGLEN_VALIDFAIL);
-    }
+
+    if(ctx->encryption_mode == FKO_ENC_MODE_GCM_BINARY)
+        return(decode_bin_spa_data(ctx));
 
     /* Make sure there are no non-ascii printable chars
     */
-    for (i=0; i < (int)strnlen(ctx->encoded_msg, MAX_SPA_ENCODED_MSG_SIZE); i++)
+    msg_len = strnlen(ctx->encoded_msg, MAX_SPA_ENCODED_MSG_SIZE);
+    for (i=0; i < msg_len; i++)
     {
         if(isprint(ctx->encoded_msg[i]) == 0)
-        {
-            free(field_parser);
             return(FKO_ERROR_INVALID_DATA_DECODE_NON_ASCII);
-        }
     }
 
     /* Make sure there are enough fields in the SPA packet
@@ -562,46 +807,49 @@ fko_decode_spa_data(fko_ctx_t ctx)
     if(ctx->disable_sdp_mode)
     {
         if (num_fields(ndx) < MIN_SPA_FIELDS)
-        {
-            free(field_parser);
             return(FKO_ERROR_INVALID_DATA_DECODE_LT_MIN_FIELDS);
-        }
     }
     else
     {
         if (num_fields(ndx) < MIN_SDP_SPA_FIELDS)
-        {
-            free(field_parser);
             return(FKO_ERROR_INVALID_DATA_DECODE_LT_MIN_FIELDS);
-        }
     }
 
     ndx += last_field(ndx);
 
     t_size = strnlen(ndx, SHA512_B64_LEN+1);
 
+    /* GCM messages may come without a digest (the tag already covers
+     * the message), in which case the field is empty.
+    */
+    if(t_size == 0 && FKO_ENC_MODE_IS_GCM(ctx->encryption_mode))
+    {
+        if(ctx->digest != NULL)
+            ctx->digest[0] = '\0';
+        ctx->digest_len = 0;
+
+        *(ndx-1) = '\0';
+        ctx->encoded_msg_len--;
+
+        return(parse_fields(tbuf, ctx, field_parser, num_field_parsers));
+    }
+
     /* Validate digest length
     */
     res = is_valid_digest_len(t_size, ctx);
     if(res != FKO_SUCCESS)
-    {
-        free(field_parser);
         return res;
-    }
-
-    if(ctx->digest != NULL)
-        free(ctx->digest);
 
     /* Copy the digest into the context and terminate the encoded data
      * at that point so the original digest is not part of the
      * encoded string.
     */
-    ctx->digest = strdup(ndx);
-    if(ctx->digest == NULL)
-    {
-        free(field_parser);
+    if(ctx_buf_reserve(ctx, FKO_BUF_DIGEST, &ctx->digest,
+            &ctx->digest_size, t_size+1) != FKO_SUCCESS)
         return(FKO_ERROR_MEMORY_ALLOCATION);
-    }
+
+    memcpy(ctx->digest, ndx, t_size);
+    ctx->digest[t_size] = '\0';
 
     /* Chop the digest off of the encoded_msg bucket...
     */
@@ -609,56 +857,17 @@ fko_decode_spa_data(fko_ctx_t ctx)
 
     ctx->encoded_msg_len -= t_size+1;
 
-    /* Make a tmp bucket for processing base64 encoded data and
-     * other general use.
+    /* Can now verify the digest.  The GCM tag already covers the whole
+     * message, so there is nothing more to check in that mode.
     */
-    tbuf = calloc(1, FKO_ENCODE_TMP_BUF_SIZE);
-    if(tbuf == NULL)
+    if(! FKO_ENC_MODE_IS_GCM(ctx->encryption_mode))
     {
-        free(field_parser);
-        return(FKO_ERROR_MEMORY_ALLOCATION);
-    }
-
-    /* Can now verify the digest.
-    */
-    res = verify_digest(tbuf, t_size, ctx);
-    if(res != FKO_SUCCESS)
-    {
-        free(field_parser);
-        free(tbuf);
-        return(FKO_ERROR_DIGEST_VERIFICATION_FAILED);
-    }
-
-    /* Now we will work through the encoded data and extract (and base64-
-     * decode where necessary), the SPA data fields and populate the context.
-    */
-    ndx = ctx->encoded_msg;
-
-    for (i=0; i < num_field_parsers; i++)
-    {
-        res = (*field_parser[i])(tbuf, &ndx, &t_size, ctx);
+        res = verify_digest(tbuf, t_size, ctx);
         if(res != FKO_SUCCESS)
-        {
-            free(field_parser);
-            free(tbuf);
-            return res;
-        }
+            return(FKO_ERROR_DIGEST_VERIFICATION_FAILED);
     }
 
-    /* Done with the tmp buffer.
-    */
-    free(tbuf);
-
-    /* Done with field_parser
-     */
-    free(field_parser);
-
-    /* Call the context initialized.
-    */
-    ctx->initval = FKO_CTX_INITIALIZED;
-    FKO_SET_CTX_INITIALIZED(ctx);
-
-    return(FKO_SUCCESS);
+    return(parse_fields(tbuf, ctx, field_parser, num_field_parsers));
 }
 
 #ifdef HAVE_C_UNIT_TESTS
@@ -121,12 +121,10 @@ fko_get_raw_spa_digest_type(fko_ctx_t ctx, short *raw_digest_type)
 }
 
 static int
-set_digest(char *data, char **digest, short digest_type, int *digest_len)
+set_digest(const char *data, const int data_len, char **digest,
+        short digest_type, int *digest_len)
 {
     char    *md = NULL;
-    int     data_len;
-
-    data_len = strnlen(data, MAX_SPA_ENCODED_MSG_SIZE);
 
 #if HAVE_LIBFIU
     fiu_return_on("set_digest_toobig",
@@ -228,7 +226,12 @@ fko_set_spa_digest(fko_ctx_t ctx)
     fiu_return_on("fko_set_spa_digest_encoded", FKO_ERROR_MISSING_ENCODED_DATA);
 #endif
 
-    return set_digest(ctx->encoded_msg, &ctx->digest,
+    /* set_digest() replaces the buffer, so its size is no longer known
+    */
+    ctx->digest_size = 0;
+
+    return set_digest(ctx->encoded_msg,
+        strnlen(ctx->encoded_msg, MAX_SPA_ENCODED_MSG_SIZE), &ctx->digest,
         ctx->digest_type, &ctx->digest_len);
 }
 
@@ -252,10 +255,33 @@ fko_set_raw_spa_digest(fko_ctx_t ctx)
     fiu_return_on("fko_set_raw_spa_digest_val", FKO_ERROR_MISSING_ENCODED_DATA);
 #endif
 
-    return set_digest(ctx->encrypted_msg, &ctx->raw_digest,
+    return set_digest(ctx->encrypted_msg,
+        strnlen(ctx->encrypted_msg, MAX_SPA_ENCODED_MSG_SIZE), &ctx->raw_digest,
         ctx->raw_digest_type, &ctx->raw_digest_len);
 }
 
+/* Compute the raw SPA digest of encrypted SPA data without setting up a
+ * context for it.  enc_msg does not have to be NUL terminated.  On success
+ * the caller must free *raw_spa_digest.
+*/
+int
+fko_get_raw_spa_digest_from_data(const char * const enc_msg,
+        const int enc_msg_len, const short digest_type, char **raw_spa_digest)
+{
+    int     digest_len = 0;
+
+    if(enc_msg == NULL || raw_spa_digest == NULL)
+        return(FKO_ERROR_INVALID_DATA);
+
+    if(! is_valid_encoded_msg_len(enc_msg_len))
+        return(FKO_ERROR_INVALID_DATA_FUNCS_NEW_MSGLEN_VALIDFAIL);
+
+    *raw_spa_digest = NULL;
+
+    return set_digest(enc_msg, enc_msg_len, raw_spa_digest,
+        digest_type, &digest_len);
+}
+
 int
 fko_get_spa_digest(fko_ctx_t ctx, char **md)
 {
@@ -36,15 +36,23 @@
 #include "digest.h"
 #include "dbg.h"
 
-/* Take a given string, base64-encode it and append it to the given
- * buffer.
+/* Length of the base64 encoding of len bytes once the trailing '='
+ * characters are stripped.
+*/
+#define B64_STRIPPED_LEN(len)   (((len) * 4 + 2) / 3)
+
+/* b64_encode() writes up to two '=' and a NUL past the stripped length.
+*/
+#define B64_ENCODE_SLACK        3
+
+/* Base64-encode str straight into buf at *pos, without the trailing '='
+ * characters, and advance *pos.  The buffer must have been sized by the
+ * caller, including B64_ENCODE_SLACK.
 */
 static int
-append_b64(char* tbuf, char *str)
+append_b64(char * const buf, int * const pos, const char * const str,
+        const int len)
 {
-    int   len = strnlen(str, MAX_SPA_ENCODED_MSG_SIZE);
-    char *bs;
-
 #if HAVE_LIBFIU
     fiu_return_on("append_b64_toobig",
             FKO_ERROR_INVALID_DATA_ENCODE_MESSAGE_TOOBIG);
@@ -53,24 +61,193 @@ append_b64(char* tbuf, char *str)
     if(len >= MAX_SPA_ENCODED_MSG_SIZE)
         return(FKO_ERROR_INVALID_DATA_ENCODE_MESSAGE_TOOBIG);
 
+    b64_encode((unsigned char*)str, buf + *pos, len);
+
+    /* --DSS XXX: make sure to check here if later decoding
+     *            becomes a problem.
+    */
+    *pos += B64_STRIPPED_LEN(len);
+    buf[*pos] = '\0';
+
+    return(FKO_SUCCESS);
+}
+
+/* Copy len bytes of str into buf at *pos and advance *pos.
+*/
+static void
+append_str(char * const buf, int * const pos, const char * const str,
+        const int len)
+{
+    memcpy(buf + *pos, str, len);
+    *pos += len;
+    buf[*pos] = '\0';
+}
+
+/* Make ctx->encoded_msg a buffer for exactly msg_len characters (plus the
+ * base64 slack), reusing the current or spare buffer when it is big
+ * enough.
+*/
+static int
+reserve_encoded_msg(fko_ctx_t ctx, const int msg_len)
+{
 #if HAVE_LIBFIU
+    fiu_return_on("fko_encode_spa_data_calloc", FKO_ERROR_MEMORY_ALLOCATION);
+    /* The message used to be assembled by append_b64() in temporary
+     * buffers, the tag is kept for the fault injection tests.
+    */
     fiu_return_on("append_b64_calloc", FKO_ERROR_MEMORY_ALLOCATION);
 #endif
 
-    bs = calloc(1, ((len/3)*4)+8);
-    if(bs == NULL)
-        return(FKO_ERROR_MEMORY_ALLOCATION);
+    if(! is_valid_encoded_msg_len(msg_len))
+        return(FKO_ERROR_INVALID_DATA_ENCODE_MSGLEN_VALIDFAIL);
 
-    b64_encode((unsigned char*)str, bs, len);
+    return(ctx_buf_reserve(ctx, FKO_BUF_ENCODED_MSG, &ctx->encoded_msg,
+                &ctx->encoded_msg_size, msg_len + B64_ENCODE_SLACK + 1));
+}
 
-    /* --DSS XXX: make sure to check here if later decoding
-     *            becomes a problem.
-    */
-    strip_b64_eq(bs);
+/* Compute the digest that goes at the end of the plaintext.  The GCM tag
+ * already authenticates the whole message, so in that mode no digest is
+ * computed and the digest field is sent empty.
+*/
+static int
+set_inner_digest(fko_ctx_t ctx)
+{
+    if(ctx->encryption_type == FKO_ENCRYPTION_RIJNDAEL
+            && FKO_ENC_MODE_IS_GCM(ctx->encryption_mode))
+    {
+        if(ctx->digest != NULL)
+            ctx->digest[0] = '\0';
+        ctx->digest_len = 0;
+        return(FKO_SUCCESS);
+    }
 
-    strlcat(tbuf, bs, FKO_ENCODE_TMP_BUF_SIZE);
+    return(fko_set_spa_digest(ctx));
+}
 
-    free(bs);
+/* Append a binary message field (see fko_message.h) at *pos and advance
+ * *pos.
+*/
+static void
+append_bin_field(unsigned char * const buf, int * const pos,
+        const int type, const void * const val, const int len)
+{
+    buf[(*pos)++] = type;
+    buf[(*pos)++] = len;
+    memcpy(buf + *pos, val, len);
+    *pos += len;
+}
+
+/* Put together the binary inner message for FKO_ENC_MODE_GCM_BINARY.  It
+ * carries the same fields as the text message for the same mode, so
+ * username, version and client timeout are only sent with SDP mode
+ * disabled.
+*/
+static int
+encode_bin_spa_data(fko_ctx_t ctx)
+{
+    unsigned char  *buf;
+    unsigned char   rand_bcd[FKO_BIN_RAND_VAL_LEN];
+    unsigned char   ts_bin[FKO_BIN_TIMESTAMP_LEN], timeout_bin[FKO_BIN_TIMEOUT_LEN];
+    unsigned char   type_bin;
+    uint64_t        ts;
+    int             res, i, pos = 0, msg_len;
+    int             user_len = 0, version_len = 0, message_len;
+    int             nat_len = 0, auth_len = 0, send_timeout = 0;
+
+    /* The random value is packed two digits to a byte.
+    */
+    if(ctx->rand_val == NULL
+            || strnlen(ctx->rand_val, FKO_RAND_VAL_SIZE+1) != FKO_RAND_VAL_SIZE)
+        return(FKO_ERROR_INVALID_DATA_RAND_LEN_VALIDFAIL);
+
+    for(i=0; i < FKO_RAND_VAL_SIZE; i++)
+        if(! isdigit((unsigned char)ctx->rand_val[i]))
+            return(FKO_ERROR_INVALID_DATA_RAND_LEN_VALIDFAIL);
+
+    for(i=0; i < FKO_BIN_RAND_VAL_LEN; i++)
+        rand_bcd[i] = ((ctx->rand_val[2*i] - '0') << 4)
+            | (ctx->rand_val[2*i+1] - '0');
+
+    ts = (uint64_t)ctx->timestamp;
+    for(i=FKO_BIN_TIMESTAMP_LEN-1; i >= 0; i--, ts >>= 8)
+        ts_bin[i] = ts & 0xff;
+
+    type_bin = ctx->message_type;
+
+    message_len = strnlen(ctx->message, MAX_SPA_MESSAGE_SIZE+1);
+    msg_len = FKO_BIN_HDR_LEN
+        + FKO_BIN_FIELD_HDR_LEN + FKO_BIN_RAND_VAL_LEN
+        + FKO_BIN_FIELD_HDR_LEN + FKO_BIN_TIMESTAMP_LEN
+        + FKO_BIN_FIELD_HDR_LEN + 1
+        + FKO_BIN_FIELD_HDR_LEN + message_len;
+
+    if(message_len > FKO_BIN_MAX_FIELD_LEN)
+        return(FKO_ERROR_INVALID_DATA_ENCODE_MESSAGE_TOOBIG);
+
+    if(ctx->disable_sdp_mode)
+    {
+        user_len    = strnlen(ctx->username, MAX_SPA_USERNAME_SIZE+1);
+        version_len = strnlen(ctx->version, MAX_SPA_VERSION_SIZE+1);
+        msg_len    += FKO_BIN_FIELD_HDR_LEN + user_len
+            + FKO_BIN_FIELD_HDR_LEN + version_len;
+
+        if(ctx->client_timeout > 0 && ctx->message_type != FKO_COMMAND_MSG)
+        {
+            send_timeout = 1;
+            for(i=0; i < FKO_BIN_TIMEOUT_LEN; i++)
+                timeout_bin[i] = (ctx->client_timeout >> (8 * (FKO_BIN_TIMEOUT_LEN-1-i))) & 0xff;
+            msg_len += FKO_BIN_FIELD_HDR_LEN + FKO_BIN_TIMEOUT_LEN;
+        }
+    }
+
+    if(ctx->nat_access != NULL)
+    {
+        nat_len  = strnlen(ctx->nat_access, FKO_BIN_MAX_FIELD_LEN+1);
+        msg_len += FKO_BIN_FIELD_HDR_LEN + nat_len;
+    }
+
+    if(ctx->server_auth != NULL)
+    {
+        auth_len  = strnlen(ctx->server_auth, FKO_BIN_MAX_FIELD_LEN+1);
+        msg_len  += FKO_BIN_FIELD_HDR_LEN + auth_len;
+    }
+
+    if(user_len > FKO_BIN_MAX_FIELD_LEN || version_len > FKO_BIN_MAX_FIELD_LEN
+            || nat_len > FKO_BIN_MAX_FIELD_LEN || auth_len > FKO_BIN_MAX_FIELD_LEN)
+        return(FKO_ERROR_INVALID_DATA_ENCODE_MESSAGE_TOOBIG);
+
+    if((res = reserve_encoded_msg(ctx, msg_len)) != FKO_SUCCESS)
+        return(res);
+
+    buf = (unsigned char *)ctx->encoded_msg;
+
+    buf[pos++] = FKO_BIN_MAGIC;
+    buf[pos++] = FKO_BIN_VERSION;
+
+    append_bin_field(buf, &pos, FKO_BIN_RAND_VAL, rand_bcd, FKO_BIN_RAND_VAL_LEN);
+    if(ctx->disable_sdp_mode)
+        append_bin_field(buf, &pos, FKO_BIN_USERNAME, ctx->username, user_len);
+    append_bin_field(buf, &pos, FKO_BIN_TIMESTAMP, ts_bin, FKO_BIN_TIMESTAMP_LEN);
+    if(ctx->disable_sdp_mode)
+        append_bin_field(buf, &pos, FKO_BIN_VERSION_STR, ctx->version, version_len);
+    append_bin_field(buf, &pos, FKO_BIN_MSG_TYPE, &type_bin, 1);
+    append_bin_field(buf, &pos, FKO_BIN_MESSAGE, ctx->message, message_len);
+
+    if(ctx->nat_access != NULL)
+        append_bin_field(buf, &pos, FKO_BIN_NAT_ACCESS, ctx->nat_access, nat_len);
+
+    if(ctx->server_auth != NULL)
+        append_bin_field(buf, &pos, FKO_BIN_SERVER_AUTH, ctx->server_auth, auth_len);
+
+    if(send_timeout)
+        append_bin_field(buf, &pos, FKO_BIN_CLIENT_TIMEOUT, timeout_bin, FKO_BIN_TIMEOUT_LEN);
+
+    ctx->encoded_msg_len = pos;
+
+    if((res = set_inner_digest(ctx)) != FKO_SUCCESS)
+        return(res);
+
+    FKO_CLEAR_SPA_DATA_MODIFIED(ctx);
 
     return(FKO_SUCCESS);
 }
@@ -143,9 +320,11 @@ fko_set_encoded_sdp_id(fko_ctx_t ctx, char *encoded_sdp_id)
 int
 fko_encode_sdp_spa_data(fko_ctx_t ctx)
 {
-    int     res, offset = 0;
-    char   *tbuf = NULL;
-    char   *tbuf_sdp_id = NULL;
+    int     res, pos = 0, msg_len;
+    int     rand_len, message_len, nat_len = 0, auth_len = 0;
+    char    sdp_id_b64[B64_SDP_ID_STR_LEN + B64_ENCODE_SLACK + 1];
+    char    ts_str[MAX_SPA_TIMESTAMP_SIZE+4], type_str[16];
+    int     ts_len, type_len;
 
 #if HAVE_LIBFIU
     fiu_return_on("fko_encode_spa_data_init", FKO_ERROR_CTX_NOT_INITIALIZED);
@@ -178,35 +357,15 @@ fko_encode_sdp_spa_data(fko_ctx_t ctx)
             return(FKO_ERROR_INCOMPLETE_SPA_DATA);
     }
 
-#if HAVE_LIBFIU
-    fiu_return_on("fko_encode_spa_data_calloc", FKO_ERROR_MEMORY_ALLOCATION);
-#endif
-
     debug("fko_encode_sdp_spa_data() : done early data checks");
-    /* Allocate our initial tmp buffers.
-    */
-    // the 4 byte client id always gets encoded to 6 bytes + '==' + \0
-    tbuf_sdp_id = calloc(1, B64_SDP_ID_STR_LEN*2);
-    if(tbuf_sdp_id == NULL)
-        return(FKO_ERROR_MEMORY_ALLOCATION);
 
-    tbuf = calloc(1, FKO_ENCODE_TMP_BUF_SIZE);
-    if(tbuf == NULL)
-    {
-        free(tbuf_sdp_id);
-        return(FKO_ERROR_MEMORY_ALLOCATION);
-    }
-
-    /* B64-encode the SDP client ID and strip off the '=='
+    /* B64-encode the SDP client ID (4 bytes always encode to 6
+     * characters plus '==') and strip off the '=='
      */
-    res = b64_encode((unsigned char *)&(ctx->sdp_id), tbuf_sdp_id, FKO_SDP_ID_SIZE);
+    res = b64_encode((unsigned char *)&(ctx->sdp_id), sdp_id_b64, FKO_SDP_ID_SIZE);
     if(res != (B64_SDP_ID_STR_LEN + 2))
-    {
-        free(tbuf_sdp_id);
-        free(tbuf);
         return(FKO_ERROR_INVALID_DATA_ENCODE_SDPCLIENTLEN_VALIDFAIL);
-    }
-    strip_b64_eq(tbuf_sdp_id);
+    strip_b64_eq(sdp_id_b64);
 
     /* If encoded_sdp_id is not null, then we assume it needs to
      * be freed before re-assignment.
@@ -216,58 +375,64 @@ fko_encode_sdp_spa_data(fko_ctx_t ctx)
 
     /* Copy our encoded data into the context.
     */
-    ctx->encoded_sdp_id = strdup(tbuf_sdp_id);
-    free(tbuf_sdp_id);
-
+    ctx->encoded_sdp_id = strdup(sdp_id_b64);
     if(ctx->encoded_sdp_id == NULL)
-    {
-        free(tbuf);
         return(FKO_ERROR_MEMORY_ALLOCATION);
-    }
 
     ctx->encoded_sdp_id_len = strnlen(ctx->encoded_sdp_id, B64_SDP_ID_STR_LEN);
 
     if(! is_valid_encoded_sdp_id_len(ctx->encoded_sdp_id_len))
-    {
-        free(tbuf);
         return(FKO_ERROR_INVALID_DATA_ENCODE_SDPCLIENTLEN_VALIDFAIL);
-    }
 
-    /* Put together all the other spa data one piece at a time, starting with the random value (i.e. nonce).
-    */
-    strlcpy(tbuf, ctx->rand_val, FKO_ENCODE_TMP_BUF_SIZE);
+    if(ctx->encryption_mode == FKO_ENC_MODE_GCM_BINARY)
+        return(encode_bin_spa_data(ctx));
 
-    /* Add the timestamp.
+    /* Work out the exact length of the message first:
+     *
+     *   rand_val:timestamp:message_type:b64(message)[:b64(nat_access)][:b64(server_auth)]
     */
-    offset = strlen(tbuf);
-    snprintf(((char*)tbuf+offset), FKO_ENCODE_TMP_BUF_SIZE - offset,
-            ":%u", (unsigned int) ctx->timestamp);
+    rand_len    = strnlen(ctx->rand_val, MAX_SPA_ENCODED_MSG_SIZE);
+    message_len = strnlen(ctx->message, MAX_SPA_ENCODED_MSG_SIZE);
+    ts_len      = snprintf(ts_str, sizeof(ts_str), ":%u", (unsigned int) ctx->timestamp);
+    type_len    = snprintf(type_str, sizeof(type_str), ":%i:", ctx->message_type);
+
+    msg_len = rand_len + ts_len + type_len + B64_STRIPPED_LEN(message_len);
+
+    if(ctx->nat_access != NULL)
+    {
+        nat_len  = strnlen(ctx->nat_access, MAX_SPA_ENCODED_MSG_SIZE);
+        msg_len += 1 + B64_STRIPPED_LEN(nat_len);
+    }
+
+    if(ctx->server_auth != NULL)
+    {
+        auth_len  = strnlen(ctx->server_auth, MAX_SPA_ENCODED_MSG_SIZE);
+        msg_len  += 1 + B64_STRIPPED_LEN(auth_len);
+    }
 
-    /* Add the message type value.
+    if((res = reserve_encoded_msg(ctx, msg_len)) != FKO_SUCCESS)
+        return(res);
+
+    /* Then encode every field straight into place, starting with the
+     * random value (i.e. nonce), the timestamp and the message type.
     */
-    offset = strlen(tbuf);
-    snprintf(((char*)tbuf+offset), FKO_ENCODE_TMP_BUF_SIZE - offset,
-            ":%i:", ctx->message_type);
+    append_str(ctx->encoded_msg, &pos, ctx->rand_val, rand_len);
+    append_str(ctx->encoded_msg, &pos, ts_str, ts_len);
+    append_str(ctx->encoded_msg, &pos, type_str, type_len);
 
     /* Add the base64-encoded SPA message.
     */
-    if((res = append_b64(tbuf, ctx->message)) != FKO_SUCCESS)
-    {
-        free(tbuf);
+    if((res = append_b64(ctx->encoded_msg, &pos, ctx->message, message_len)) != FKO_SUCCESS)
         return(res);
-    }
 
     /* If a nat_access message was given, add it to the SPA
      * message.
     */
     if(ctx->nat_access != NULL)
     {
-        strlcat(tbuf, ":", FKO_ENCODE_TMP_BUF_SIZE);
-        if((res = append_b64(tbuf, ctx->nat_access)) != FKO_SUCCESS)
-        {
-            free(tbuf);
+        append_str(ctx->encoded_msg, &pos, ":", 1);
+        if((res = append_b64(ctx->encoded_msg, &pos, ctx->nat_access, nat_len)) != FKO_SUCCESS)
             return(res);
-        }
     }
 
     /* If we have a server_auth field set.  Add it here.
@@ -275,33 +440,14 @@ fko_encode_sdp_spa_data(fko_ctx_t ctx)
     */
     if(ctx->server_auth != NULL)
     {
-        strlcat(tbuf, ":", FKO_ENCODE_TMP_BUF_SIZE);
-        if((res = append_b64(tbuf, ctx->server_auth)) != FKO_SUCCESS)
-        {
-            free(tbuf);
+        append_str(ctx->encoded_msg, &pos, ":", 1);
+        if((res = append_b64(ctx->encoded_msg, &pos, ctx->server_auth, auth_len)) != FKO_SUCCESS)
             return(res);
-        }
     }
 
-    /* If encoded_msg is not null, then we assume it needs to
-     * be freed before re-assignment.
-    */
-    if(ctx->encoded_msg != NULL)
-        free(ctx->encoded_msg);
-
-    /* Copy our encoded data into the context.
-    */
-    ctx->encoded_msg = strdup(tbuf);
-    free(tbuf);
-
-    if(ctx->encoded_msg == NULL)
-        return(FKO_ERROR_MEMORY_ALLOCATION);
-
-    ctx->encoded_msg_len = strnlen(ctx->encoded_msg, MAX_SPA_ENCODED_MSG_SIZE);
+    ctx->encoded_msg_len = pos;
 
     debug("fko_encode_sdp_spa_data() : final encoded message len: %d;", ctx->encoded_msg_len);
-    if(! is_valid_encoded_msg_len(ctx->encoded_msg_len))
-        return(FKO_ERROR_INVALID_DATA_ENCODE_MSGLEN_VALIDFAIL);
 
     /* At this point we can compute the digest for this SPA data.
      *
@@ -310,7 +456,7 @@ fko_encode_sdp_spa_data(fko_ctx_t ctx)
      * decrypted data. So the function below behaves the same as in
      * the old mode.
     */
-    if((res = fko_set_spa_digest(ctx)) != FKO_SUCCESS)
+    if((res = set_inner_digest(ctx)) != FKO_SUCCESS)
         return(res);
 
     /* Here we can clear the modified flags on the SPA data fields.
@@ -325,8 +471,11 @@ fko_encode_sdp_spa_data(fko_ctx_t ctx)
 int
 fko_encode_spa_data(fko_ctx_t ctx)
 {
-    int     res, offset = 0;
-    char   *tbuf;
+    int     res, pos = 0, msg_len;
+    int     rand_len, user_len, version_len, message_len;
+    int     nat_len = 0, auth_len = 0;
+    char    ts_str[MAX_SPA_TIMESTAMP_SIZE+4], type_str[16], timeout_str[16];
+    int     ts_len, type_len, timeout_len = 0;
 
 #if HAVE_LIBFIU
     fiu_return_on("fko_encode_spa_data_init", FKO_ERROR_CTX_NOT_INITIALIZED);
@@ -357,74 +506,86 @@ fko_encode_spa_data(fko_ctx_t ctx)
             return(FKO_ERROR_INCOMPLETE_SPA_DATA);
     }
 
-#if HAVE_LIBFIU
-    fiu_return_on("fko_encode_spa_data_calloc", FKO_ERROR_MEMORY_ALLOCATION);
-#endif
-    /* Allocate our initial tmp buffer.
+    /* Before we add the message type value, we will once again
+     * check for whether or not a client_timeout was specified
+     * since the message_type was set.  If this is the case, then
+     * we want to adjust the message_type first.  The easy way
+     * to do this is simply call fko_set_spa_client_timeout and set
+     * it to its current value.  This will force a re-check and
+     * possible reset of the message type.
+     *
     */
-    tbuf = calloc(1, FKO_ENCODE_TMP_BUF_SIZE);
-    if(tbuf == NULL)
-        return(FKO_ERROR_MEMORY_ALLOCATION);
+    fko_set_spa_client_timeout(ctx, ctx->client_timeout);
 
-    /* Put it together a piece at a time, starting with the rand val.
-    */
-    strlcpy(tbuf, ctx->rand_val, FKO_ENCODE_TMP_BUF_SIZE);
+    if(ctx->encryption_mode == FKO_ENC_MODE_GCM_BINARY)
+        return(encode_bin_spa_data(ctx));
 
-    /* Add the base64-encoded username.
+    /* Work out the exact length of the message first:
+     *
+     *   rand_val:b64(username):timestamp:version:message_type:b64(message)
+     *     [:b64(nat_access)][:b64(server_auth)][:client_timeout]
     */
-    strlcat(tbuf, ":", FKO_ENCODE_TMP_BUF_SIZE);
-    if((res = append_b64(tbuf, ctx->username)) != FKO_SUCCESS)
+    rand_len    = strnlen(ctx->rand_val, MAX_SPA_ENCODED_MSG_SIZE);
+    user_len    = strnlen(ctx->username, MAX_SPA_ENCODED_MSG_SIZE);
+    version_len = strnlen(ctx->version, MAX_SPA_ENCODED_MSG_SIZE);
+    message_len = strnlen(ctx->message, MAX_SPA_ENCODED_MSG_SIZE);
+    ts_len      = snprintf(ts_str, sizeof(ts_str), ":%u:", (unsigned int) ctx->timestamp);
+    type_len    = snprintf(type_str, sizeof(type_str), ":%i:", ctx->message_type);
+
+    msg_len = rand_len + 1 + B64_STRIPPED_LEN(user_len) + ts_len
+        + version_len + type_len + B64_STRIPPED_LEN(message_len);
+
+    if(ctx->nat_access != NULL)
     {
-        free(tbuf);
-        return(res);
+        nat_len  = strnlen(ctx->nat_access, MAX_SPA_ENCODED_MSG_SIZE);
+        msg_len += 1 + B64_STRIPPED_LEN(nat_len);
     }
 
-    /* Add the timestamp.
-    */
-    offset = strlen(tbuf);
-    snprintf(((char*)tbuf+offset), FKO_ENCODE_TMP_BUF_SIZE - offset,
-            ":%u:", (unsigned int) ctx->timestamp);
+    if(ctx->server_auth != NULL)
+    {
+        auth_len  = strnlen(ctx->server_auth, MAX_SPA_ENCODED_MSG_SIZE);
+        msg_len  += 1 + B64_STRIPPED_LEN(auth_len);
+    }
 
-    /* Add the version string.
+    /* A client timeout is only sent with access (not command) messages.
     */
-    strlcat(tbuf, ctx->version, FKO_ENCODE_TMP_BUF_SIZE);
+    if(ctx->client_timeout > 0 && ctx->message_type != FKO_COMMAND_MSG)
+    {
+        timeout_len = snprintf(timeout_str, sizeof(timeout_str),
+                ":%i", ctx->client_timeout);
+        msg_len += timeout_len;
+    }
 
-    /* Before we add the message type value, we will once again
-     * check for whether or not a client_timeout was specified
-     * since the message_type was set.  If this is the case, then
-     * we want to adjust the message_type first.  The easy way
-     * to do this is simply call fko_set_spa_client_timeout and set
-     * it to its current value.  This will force a re-check and
-     * possible reset of the message type.
-     *
+    if((res = reserve_encoded_msg(ctx, msg_len)) != FKO_SUCCESS)
+        return(res);
+
+    /* Then encode every field straight into place, starting with the
+     * rand val and the base64-encoded username.
     */
-    fko_set_spa_client_timeout(ctx, ctx->client_timeout);
+    append_str(ctx->encoded_msg, &pos, ctx->rand_val, rand_len);
+    append_str(ctx->encoded_msg, &pos, ":", 1);
+    if((res = append_b64(ctx->encoded_msg, &pos, ctx->username, user_len)) != FKO_SUCCESS)
+        return(res);
 
-    /* Add the message type value.
+    /* Add the timestamp, the version string and the message type value.
     */
-    offset = strlen(tbuf);
-    snprintf(((char*)tbuf+offset), FKO_ENCODE_TMP_BUF_SIZE - offset,
-            ":%i:", ctx->message_type);
+    append_str(ctx->encoded_msg, &pos, ts_str, ts_len);
+    append_str(ctx->encoded_msg, &pos, ctx->version, version_len);
+    append_str(ctx->encoded_msg, &pos, type_str, type_len);
 
     /* Add the base64-encoded SPA message.
     */
-    if((res = append_b64(tbuf, ctx->message)) != FKO_SUCCESS)
-    {
-        free(tbuf);
+    if((res = append_b64(ctx->encoded_msg, &pos, ctx->message, message_len)) != FKO_SUCCESS)
         return(res);
-    }
 
     /* If a nat_access message was given, add it to the SPA
      * message.
     */
     if(ctx->nat_access != NULL)
     {
-        strlcat(tbuf, ":", FKO_ENCODE_TMP_BUF_SIZE);
-        if((res = append_b64(tbuf, ctx->nat_access)) != FKO_SUCCESS)
-        {
-            free(tbuf);
+        append_str(ctx->encoded_msg, &pos, ":", 1);
+        if((res = append_b64(ctx->encoded_msg, &pos, ctx->nat_access, nat_len)) != FKO_SUCCESS)
             return(res);
-        }
     }
 
     /* If we have a server_auth field set.  Add it here.
@@ -432,46 +593,22 @@ fko_encode_spa_data(fko_ctx_t ctx)
     */
     if(ctx->server_auth != NULL)
     {
-        strlcat(tbuf, ":", FKO_ENCODE_TMP_BUF_SIZE);
-        if((res = append_b64(tbuf, ctx->server_auth)) != FKO_SUCCESS)
-        {
-            free(tbuf);
+        append_str(ctx->encoded_msg, &pos, ":", 1);
+        if((res = append_b64(ctx->encoded_msg, &pos, ctx->server_auth, auth_len)) != FKO_SUCCESS)
             return(res);
-        }
     }
 
     /* If a client timeout is specified and we are not dealing with a
      * SPA command message, add the timeout here.
     */
-    if(ctx->client_timeout > 0 && ctx->message_type != FKO_COMMAND_MSG)
-    {
-        offset = strlen(tbuf);
-        snprintf(((char*)tbuf+offset), FKO_ENCODE_TMP_BUF_SIZE - offset,
-                ":%i", ctx->client_timeout);
-    }
+    if(timeout_len > 0)
+        append_str(ctx->encoded_msg, &pos, timeout_str, timeout_len);
 
-    /* If encoded_msg is not null, then we assume it needs to
-     * be freed before re-assignment.
-    */
-    if(ctx->encoded_msg != NULL)
-        free(ctx->encoded_msg);
-
-    /* Copy our encoded data into the context.
-    */
-    ctx->encoded_msg = strdup(tbuf);
-    free(tbuf);
-
-    if(ctx->encoded_msg == NULL)
-        return(FKO_ERROR_MEMORY_ALLOCATION);
-
-    ctx->encoded_msg_len = strnlen(ctx->encoded_msg, MAX_SPA_ENCODED_MSG_SIZE);
-
-    if(! is_valid_encoded_msg_len(ctx->encoded_msg_len))
-        return(FKO_ERROR_INVALID_DATA_ENCODE_MSGLEN_VALIDFAIL);
+    ctx->encoded_msg_len = pos;
 
     /* At this point we can compute the digest for this SPA data.
     */
-    if((res = fko_set_spa_digest(ctx)) != FKO_SUCCESS)
+    if((res = set_inner_digest(ctx)) != FKO_SUCCESS)
         return(res);
 
     /* Here we can clear the modified flags on the SPA data fields.
@@ -520,6 +657,7 @@ fko_set_encoded_data(fko_ctx_t ctx,
         return(FKO_ERROR_INVALID_DATA);
 
     ctx->encoded_msg = strdup(encoded_msg);
+    ctx->encoded_msg_size = 0;
 
     ctx->state |= FKO_DATA_MODIFIED;
 
@@ -555,6 +693,7 @@ fko_set_encoded_data(fko_ctx_t ctx,
             free(ctx->encoded_msg);
 
         ctx->encoded_msg = strdup(tbuf);
+        ctx->encoded_msg_size = 0;
         free(tbuf);
 
         if(ctx->encoded_msg == NULL)
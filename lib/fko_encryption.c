@@ -63,8 +63,14 @@ _rijndael_encrypt(fko_ctx_t ctx, const char *enc_key, const int enc_key_len)
     if (! is_valid_encoded_msg_len(ctx->encoded_msg_len))
         return(FKO_ERROR_INVALID_DATA_ENCRYPT_MSGLEN_VALIDFAIL);
 
+    /* GCM messages carry an empty digest field (see fko_encode.c)
+    */
     switch(ctx->digest_len)
     {
+        case 0:
+            if(! FKO_ENC_MODE_IS_GCM(ctx->encryption_mode))
+                return(FKO_ERROR_INVALID_DATA_ENCRYPT_DIGESTLEN_VALIDFAIL);
+            break;
         case MD5_B64_LEN:
             break;
         case SHA1_B64_LEN:
@@ -89,7 +95,17 @@ _rijndael_encrypt(fko_ctx_t ctx, const char *enc_key, const int enc_key_len)
     if(plaintext == NULL)
         return(FKO_ERROR_MEMORY_ALLOCATION);
 
-    pt_len = snprintf(plaintext, pt_len, "%s:%s", ctx->encoded_msg, ctx->digest);
+    /* The binary inner message is encrypted as is, the text one gets the
+     * digest field appended.
+    */
+    if(ctx->encryption_mode == FKO_ENC_MODE_GCM_BINARY)
+    {
+        memcpy(plaintext, ctx->encoded_msg, ctx->encoded_msg_len);
+        pt_len = ctx->encoded_msg_len;
+    }
+    else
+        pt_len = snprintf(plaintext, pt_len, "%s:%s", ctx->encoded_msg,
+                ctx->digest_len > 0 ? ctx->digest : "");
 
     if(! is_valid_pt_msg_len(pt_len))
     {
@@ -103,7 +119,7 @@ _rijndael_encrypt(fko_ctx_t ctx, const char *enc_key, const int enc_key_len)
 
     /* Make a bucket for the encrypted version and populate it.
     */
-    ciphertext = calloc(1, pt_len + 32); /* Plus padding for salt and Block */
+    ciphertext = calloc(1, pt_len + RIJ_ENCRYPT_OVERHEAD); /* Plus room for salt and Block (or tag) */
     if(ciphertext == NULL)
     {
         if(zero_free(plaintext, pt_len) == FKO_SUCCESS)
@@ -115,15 +131,24 @@ _rijndael_encrypt(fko_ctx_t ctx, const char *enc_key, const int enc_key_len)
     cipher_len = rij_encrypt(
         (unsigned char*)plaintext, pt_len,
         (char*)enc_key, enc_key_len,
-        ciphertext, ctx->encryption_mode
+        ciphertext, ctx->encryption_mode, ctx->batch_rand
     );
 
+    if(cipher_len == 0)
+    {
+        if(zero_free((char *) ciphertext, pt_len+RIJ_ENCRYPT_OVERHEAD) == FKO_SUCCESS
+                && zero_free(plaintext, pt_len) == FKO_SUCCESS)
+            return(FKO_ERROR_UNSUPPORTED_FEATURE);
+        else
+            return(FKO_ERROR_ZERO_OUT_DATA);
+    }
+
     /* Now make a bucket for the base64-encoded version and populate it.
     */
     b64ciphertext = calloc(1, ((cipher_len / 3) * 4) + 8);
     if(b64ciphertext == NULL)
     {
-        if(zero_free((char *) ciphertext, pt_len+32) == FKO_SUCCESS
+        if(zero_free((char *) ciphertext, pt_len+RIJ_ENCRYPT_OVERHEAD) == FKO_SUCCESS
                 && zero_free(plaintext, pt_len) == FKO_SUCCESS)
             return(FKO_ERROR_MEMORY_ALLOCATION);
         else
@@ -140,13 +165,14 @@ _rijndael_encrypt(fko_ctx_t ctx, const char *enc_key, const int enc_key_len)
                 strnlen(ctx->encrypted_msg, MAX_SPA_ENCODED_MSG_SIZE));
 
     ctx->encrypted_msg = strdup(b64ciphertext);
+    ctx->encrypted_msg_size = 0;
 
     /* Clean-up
     */
     if(zero_free(plaintext, pt_len) != FKO_SUCCESS)
         zero_free_rv = FKO_ERROR_ZERO_OUT_DATA;
 
-    if(zero_free((char *) ciphertext, pt_len+32) != FKO_SUCCESS)
+    if(zero_free((char *) ciphertext, pt_len+RIJ_ENCRYPT_OVERHEAD) != FKO_SUCCESS)
         zero_free_rv = FKO_ERROR_ZERO_OUT_DATA;
 
     if(zero_free(b64ciphertext, strnlen(b64ciphertext,
@@ -215,9 +241,10 @@ _rijndael_decrypt(fko_ctx_t ctx,
 #endif
 
     /* Since we're using AES, make sure the incoming data is a multiple of
-     * the blocksize
+     * the blocksize (GCM output is not padded)
     */
-    if((cipher_len % RIJNDAEL_BLOCKSIZE) != 0)
+    if(! FKO_ENC_MODE_IS_GCM(encryption_mode)
+            && (cipher_len % RIJNDAEL_BLOCKSIZE) != 0)
     {
         if(zero_free((char *)cipher, ctx->encrypted_msg_len) == FKO_SUCCESS)
             return(FKO_ERROR_INVALID_DATA_ENCRYPT_CIPHERLEN_VALIDFAIL);
@@ -225,15 +252,11 @@ _rijndael_decrypt(fko_ctx_t ctx,
             return(FKO_ERROR_ZERO_OUT_DATA);
     }
 
-    if(ctx->encoded_msg != NULL)
-        zero_free_rv = zero_free(ctx->encoded_msg,
-                strnlen(ctx->encoded_msg, MAX_SPA_ENCODED_MSG_SIZE));
-
-    /* Create a bucket for the plaintext data and decrypt the message
-     * data into it.
+    /* Create (or reuse) a bucket for the plaintext data and decrypt the
+     * message data into it.
     */
-    ctx->encoded_msg = calloc(1, cipher_len);
-    if(ctx->encoded_msg == NULL)
+    if(ctx_buf_reserve(ctx, FKO_BUF_ENCODED_MSG, &ctx->encoded_msg,
+                &ctx->encoded_msg_size, cipher_len) != FKO_SUCCESS)
     {
         if(zero_free((char *)cipher, ctx->encrypted_msg_len) == FKO_SUCCESS)
             return(FKO_ERROR_MEMORY_ALLOCATION);
@@ -252,10 +275,16 @@ _rijndael_decrypt(fko_ctx_t ctx,
     if(zero_free((char *)cipher, ctx->encrypted_msg_len) != FKO_SUCCESS)
         zero_free_rv = FKO_ERROR_ZERO_OUT_DATA;
 
-    /* The length of the decrypted data should be within 32 bytes of the
-     * length of the encrypted version.
+    /* A GCM message that fails authentication decrypts to nothing.
+     * Otherwise the length of the decrypted data should be within 32 bytes
+     * of the length of the encrypted version.
     */
-    if(pt_len < (cipher_len - 32) || pt_len <= 0)
+    if(FKO_ENC_MODE_IS_GCM(encryption_mode))
+    {
+        if(pt_len <= 0)
+            return(FKO_ERROR_DECRYPTION_FAILURE);
+    }
+    else if(pt_len < (cipher_len - 32) || pt_len <= 0)
         return(FKO_ERROR_DECRYPTION_SIZE);
 
     if(ctx->encoded_msg == NULL)
@@ -271,10 +300,19 @@ _rijndael_decrypt(fko_ctx_t ctx,
 
     /* At this point we can check the data to see if we have a good
      * decryption by ensuring the first field (16-digit random decimal
-     * value) is valid and is followed by a colon.  Additional checks
-     * are made in fko_decode_spa_data().
+     * value) is valid and is followed by a colon, or for the binary
+     * format that the header is there.  Additional checks are made in
+     * fko_decode_spa_data().
     */
     ndx = (unsigned char *)ctx->encoded_msg;
+    if(encryption_mode == FKO_ENC_MODE_GCM_BINARY)
+    {
+        if(ndx[0] != FKO_BIN_MAGIC || ndx[1] != FKO_BIN_VERSION)
+            return(FKO_ERROR_DECRYPTION_FAILURE);
+
+        return(fko_decode_spa_data(ctx));
+    }
+
     for(i=0; i<FKO_RAND_VAL_SIZE; i++)
         if(!isdigit(*(ndx++)))
             err++;
@@ -401,6 +439,7 @@ gpg_encrypt(fko_ctx_t ctx, const char *enc_key)
                 strnlen(ctx->encrypted_msg, MAX_SPA_ENCODED_MSG_SIZE));
 
     ctx->encrypted_msg = strdup(b64cipher);
+    ctx->encrypted_msg_size = 0;
 
     /* Clean-up
     */
@@ -440,6 +479,11 @@ gpg_decrypt(fko_ctx_t ctx, const char *dec_key)
     if(! ctx->added_gpg_prefix)
         add_gpg_prefix(ctx);
 
+    /* gpgme_decrypt() allocates the plaintext buffer itself.
+    */
+    if(ctx_buf_release(&ctx->encoded_msg, &ctx->encoded_msg_size) != FKO_SUCCESS)
+        return(FKO_ERROR_ZERO_OUT_DATA);
+
     /* Create a bucket for the (base64) decoded encrypted data and get the
      * raw cipher data.
     */
@@ -561,6 +605,14 @@ fko_set_spa_encryption_mode(fko_ctx_t ctx, const int encrypt_mode)
     if(encrypt_mode < 0 || encrypt_mode >= FKO_LAST_ENC_MODE)
         return(FKO_ERROR_INVALID_DATA_ENCRYPT_MODE_VALIDFAIL);
 
+#if ! HAVE_OPENSSL_AES
+    /* GCM needs the OpenSSL AES code, don't let it get as far as
+     * rij_encrypt()/rij_decrypt()
+    */
+    if(FKO_ENC_MODE_IS_GCM(encrypt_mode))
+        return(FKO_ERROR_UNSUPPORTED_FEATURE);
+#endif
+
     ctx->encryption_mode = encrypt_mode;
 
     ctx->state |= FKO_ENCRYPT_MODE_MODIFIED;
@@ -606,9 +658,11 @@ fko_encrypt_spa_data(fko_ctx_t ctx, const char * const enc_key,
     }
 
     /* If there is no encoded data or the SPA data has been modified,
-     * go ahead and re-encode here.
+     * go ahead and re-encode here.  A new encryption mode may also mean
+     * the inner digest is now needed (or not).
     */
-    if(ctx->encoded_msg == NULL || FKO_IS_SPA_DATA_MODIFIED(ctx))
+    if(ctx->encoded_msg == NULL || FKO_IS_SPA_DATA_MODIFIED(ctx)
+            || (ctx->state & FKO_ENCRYPT_MODE_MODIFIED))
     {
     	if(ctx->disable_sdp_mode)
     		res = fko_encode_spa_data(ctx);
@@ -695,14 +749,22 @@ fko_decrypt_spa_data(fko_ctx_t ctx, const char * const dec_key, const int key_le
 int
 fko_encryption_type(const char * const enc_data)
 {
-    int enc_data_len;
-
     /* Sanity check the data.
     */
     if(enc_data == NULL)
         return(FKO_ENCRYPTION_INVALID_DATA);
 
-    enc_data_len = strnlen(enc_data, MAX_SPA_ENCODED_MSG_SIZE);
+    return(fko_encryption_type_len(enc_data,
+        strnlen(enc_data, MAX_SPA_ENCODED_MSG_SIZE)));
+}
+
+/* Same as fko_encryption_type() for data that is not NUL terminated.
+*/
+int
+fko_encryption_type_len(const char * const enc_data, const int enc_data_len)
+{
+    if(enc_data == NULL)
+        return(FKO_ENCRYPTION_INVALID_DATA);
 
     if(! is_valid_encoded_msg_len(enc_data_len))
         return(FKO_ENCRYPTION_UNKNOWN);
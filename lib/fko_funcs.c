@@ -34,6 +34,12 @@
 #include "base64.h"
 #include "digest.h"
 #include "dbg.h"
+#include "gpgme_funcs.h"
+#include "hmac.h"
+
+#ifdef HAVE_C_UNIT_TESTS
+DECLARE_TEST_SUITE(fko_funcs, "FKO funcs test suite");
+#endif
 
 /* Initialize an fko context.
 */
@@ -172,9 +178,133 @@ fko_new_with_data(fko_ctx_t *r_ctx, const char * const enc_msg,
     int encryption_mode, const char * const hmac_key,
     const int hmac_key_len, const int hmac_type, const uint32_t sdp_id)
 {
-    fko_ctx_t   ctx = NULL;
+    return(fko_new_with_data_len(r_ctx, enc_msg,
+        enc_msg == NULL ? 0 : strnlen(enc_msg, MAX_SPA_ENCODED_MSG_SIZE),
+        dec_key, dec_key_len, encryption_mode, hmac_key, hmac_key_len,
+        hmac_type, sdp_id));
+}
+
+/* Room left after a copied-in encrypted message for the salt or GPG
+ * prefix that decryption may put back on the front of it.
+*/
+#define ENC_MSG_PREFIX_ROOM     B64_RIJNDAEL_SALT_STR_LEN
+
+/* Wipe a buffer of any size.  zero_buf() refuses lengths over
+ * MAX_SPA_ENCODED_MSG_SIZE, so go a piece at a time.
+*/
+static int
+wipe_buf(char *buf, int len)
+{
+    int res = FKO_SUCCESS, n;
+
+    while(len > 0)
+    {
+        n = len > MAX_SPA_ENCODED_MSG_SIZE ? MAX_SPA_ENCODED_MSG_SIZE : len;
+        if(zero_buf(buf, n) != FKO_SUCCESS)
+            res = FKO_ERROR_ZERO_OUT_DATA;
+        buf += n;
+        len -= n;
+    }
+    return(res);
+}
+
+/* Wipe and free a context buffer, using its allocated size when it is
+ * known.
+*/
+int
+ctx_buf_release(char **buf, int *buf_size)
+{
+    int res = FKO_SUCCESS;
+
+    if(*buf != NULL)
+    {
+        if(*buf_size > 0)
+            res = wipe_buf(*buf, *buf_size);
+        else
+            res = zero_buf(*buf, strnlen(*buf, MAX_SPA_ENCODED_MSG_SIZE));
+        free(*buf);
+    }
+    *buf      = NULL;
+    *buf_size = 0;
+    return(res);
+}
+
+/* Make *buf a zeroed buffer of at least len bytes.  The current buffer is
+ * reused if it is big enough, then the spare kept by fko_reset(), and only
+ * if neither will do is a new one allocated.
+*/
+int
+ctx_buf_reserve(fko_ctx_t ctx, const int which, char **buf,
+        int *buf_size, const int len)
+{
+    if(*buf != NULL)
+    {
+        if(*buf_size >= len)
+            return(wipe_buf(*buf, *buf_size));
+
+        ctx_buf_release(buf, buf_size);
+    }
+
+    if(ctx->spare_buf[which] != NULL)
+    {
+        if(ctx->spare_size[which] >= len)
+        {
+            *buf      = ctx->spare_buf[which];
+            *buf_size = ctx->spare_size[which];
+            ctx->spare_buf[which]  = NULL;
+            ctx->spare_size[which] = 0;
+            return(FKO_SUCCESS);
+        }
+
+        /* Spares are wiped when they are put away.
+        */
+        free(ctx->spare_buf[which]);
+        ctx->spare_buf[which]  = NULL;
+        ctx->spare_size[which] = 0;
+    }
+
+    if((*buf = calloc(1, len)) == NULL)
+        return(FKO_ERROR_MEMORY_ALLOCATION);
+
+    *buf_size = len;
+    return(FKO_SUCCESS);
+}
+
+/* Put a buffer away as a spare for the next message (wiping it first), or
+ * free it if its size is not known.
+*/
+static int
+ctx_buf_park(fko_ctx_t ctx, const int which, char **buf, int *buf_size)
+{
+    int res = FKO_SUCCESS;
+
+    if(*buf == NULL)
+        return(res);
+
+    if(*buf_size > 0 && ctx->spare_buf[which] == NULL)
+    {
+        res = wipe_buf(*buf, *buf_size);
+        ctx->spare_buf[which]  = *buf;
+        ctx->spare_size[which] = *buf_size;
+        *buf      = NULL;
+        *buf_size = 0;
+        return(res);
+    }
+
+    return(ctx_buf_release(buf, buf_size));
+}
+
+/* Load external (encrypted/encoded) data into a context that is either
+ * new or has just been through fko_reset(), check the HMAC, strip the
+ * SDP client ID and decrypt if a key was given.
+*/
+static int
+ctx_load_data(fko_ctx_t ctx, const char * const enc_msg,
+    const int enc_msg_len, const char * const dec_key, const int dec_key_len,
+    int encryption_mode, const char * const hmac_key,
+    const int hmac_key_len, const int hmac_type, const uint32_t sdp_id)
+{
     int         res = FKO_SUCCESS; /* Are we optimistic or what? */
-    int         enc_msg_len;
 
 #if HAVE_LIBFIU
     fiu_return_on("fko_new_with_data_msg",
@@ -192,10 +322,6 @@ fko_new_with_data(fko_ctx_t *r_ctx, const char * const enc_msg,
     if(dec_key_len < 0 || hmac_key_len < 0)
         return(FKO_ERROR_INVALID_KEY_LEN);
 
-    ctx = calloc(1, sizeof *ctx);
-    if(ctx == NULL)
-        return(FKO_ERROR_MEMORY_ALLOCATION);
-
     // if SDP client ID is nonzero, SDP mode is enabled
     ctx->sdp_id = sdp_id;
     if(sdp_id > 0)
@@ -203,57 +329,38 @@ fko_new_with_data(fko_ctx_t *r_ctx, const char * const enc_msg,
     else
     	ctx->disable_sdp_mode = 1;
 
-    enc_msg_len = strnlen(enc_msg, MAX_SPA_ENCODED_MSG_SIZE);
-
     if(! is_valid_encoded_msg_len(enc_msg_len))
-    {
-        free(ctx);
         return(FKO_ERROR_INVALID_DATA_FUNCS_NEW_MSGLEN_VALIDFAIL);
-    }
 
     /* First, add the data to the context.
     */
-    ctx->encrypted_msg     = strdup(enc_msg);
-    ctx->encrypted_msg_len = enc_msg_len;
+    res = ctx_buf_reserve(ctx, FKO_BUF_ENCRYPTED_MSG, &ctx->encrypted_msg,
+            &ctx->encrypted_msg_size, enc_msg_len + ENC_MSG_PREFIX_ROOM + 1);
+    if(res != FKO_SUCCESS)
+        return(res);
 
-    if(ctx->encrypted_msg == NULL)
-    {
-        free(ctx);
-        return(FKO_ERROR_MEMORY_ALLOCATION);
-    }
+    memcpy(ctx->encrypted_msg, enc_msg, enc_msg_len);
+    ctx->encrypted_msg_len = enc_msg_len;
 
     /* Default Encryption Mode (Rijndael in CBC mode)
     */
-    ctx->initval = FKO_CTX_INITIALIZED;
     res = fko_set_spa_encryption_mode(ctx, encryption_mode);
     if(res != FKO_SUCCESS)
-    {
-        fko_destroy(ctx);
-        ctx = NULL;
         return res;
-    }
 
     /* HMAC digest type
     */
     res = fko_set_spa_hmac_type(ctx, hmac_type);
     if(res != FKO_SUCCESS)
-    {
-        fko_destroy(ctx);
-        ctx = NULL;
         return res;
-    }
 
     /* Check HMAC if the access stanza had an HMAC key
     */
     if(hmac_key_len > 0 && hmac_key != NULL)
     {
         res = fko_verify_hmac(ctx, hmac_key, hmac_key_len);
-		if(res != FKO_SUCCESS)
-		{
-			fko_destroy(ctx);
-			ctx = NULL;
-			return res;
-		}
+        if(res != FKO_SUCCESS)
+            return res;
     }
 
 	if(sdp_id > 0)
@@ -267,11 +374,7 @@ fko_new_with_data(fko_ctx_t *r_ctx, const char * const enc_msg,
 		 */
 		res = fko_strip_sdp_id(ctx);
 		if(res != FKO_SUCCESS)
-		{
-			fko_destroy(ctx);
-			ctx = NULL;
 			return res;
-		}
 	}
 
 
@@ -284,14 +387,8 @@ fko_new_with_data(fko_ctx_t *r_ctx, const char * const enc_msg,
     if(dec_key != NULL)
     {
         res = fko_decrypt_spa_data(ctx, dec_key, dec_key_len);
-
         if(res != FKO_SUCCESS)
-        {
-            fko_destroy(ctx);
-            ctx = NULL;
-            *r_ctx = NULL; /* Make sure the caller ctx is null just in case */
             return(res);
-        }
     }
 
 #if HAVE_LIBGPGME
@@ -301,46 +398,82 @@ fko_new_with_data(fko_ctx_t *r_ctx, const char * const enc_msg,
 
 #endif /* HAVE_LIBGPGME */
 
-    *r_ctx = ctx;
-
     return(res);
 }
 
-/* Destroy a context and free its resources
+/* Same as fko_new_with_data(), but enc_msg does not have to be NUL
+ * terminated.  The data is copied into the context, so it can be
+ * borrowed directly from a packet buffer.
 */
 int
-fko_destroy(fko_ctx_t ctx)
+fko_new_with_data_len(fko_ctx_t *r_ctx, const char * const enc_msg,
+    const int enc_msg_len, const char * const dec_key, const int dec_key_len,
+    int encryption_mode, const char * const hmac_key,
+    const int hmac_key_len, const int hmac_type, const uint32_t sdp_id)
 {
-    int zero_free_rv = FKO_SUCCESS;
-
-#if HAVE_LIBGPGME
-    fko_gpg_sig_t   gsig, tgsig;
-#endif
+    fko_ctx_t   ctx = NULL;
+    int         res;
 
-    if(!CTX_INITIALIZED(ctx))
-        return(zero_free_rv);
+    ctx = calloc(1, sizeof *ctx);
+    if(ctx == NULL)
+        return(FKO_ERROR_MEMORY_ALLOCATION);
 
-    if(ctx->rand_val != NULL)
-        free(ctx->rand_val);
+    ctx->initval = FKO_CTX_INITIALIZED;
 
-    if(ctx->username != NULL)
-        free(ctx->username);
+    res = ctx_load_data(ctx, enc_msg, enc_msg_len, dec_key, dec_key_len,
+            encryption_mode, hmac_key, hmac_key_len, hmac_type, sdp_id);
+    if(res != FKO_SUCCESS)
+    {
+        fko_destroy(ctx);
+        *r_ctx = NULL; /* Make sure the caller ctx is null just in case */
+        return(res);
+    }
 
-    if(ctx->version != NULL)
-        free(ctx->version);
+    *r_ctx = ctx;
 
-    if(ctx->message != NULL)
-        free(ctx->message);
+    return(res);
+}
 
-    if(ctx->nat_access != NULL)
-        free(ctx->nat_access);
+/* Free (or, when park_bufs is set, wipe and keep) everything a context
+ * holds, but not the context itself.
+*/
+static int
+ctx_free_data(fko_ctx_t ctx, const int park_bufs)
+{
+    int zero_free_rv = FKO_SUCCESS;
+    int i;
 
-    if(ctx->server_auth != NULL)
-        free(ctx->server_auth);
+#if HAVE_LIBGPGME
+    fko_gpg_sig_t   gsig, tgsig;
+#endif
 
-    if(ctx->digest != NULL)
-        if(zero_free(ctx->digest, ctx->digest_len) != FKO_SUCCESS)
-            zero_free_rv = FKO_ERROR_ZERO_OUT_DATA;
+#define FREE_BUF(which, field) \
+    do { \
+        if((park_bufs ? ctx_buf_park(ctx, which, &ctx->field, &ctx->field##_size) \
+                : ctx_buf_release(&ctx->field, &ctx->field##_size)) != FKO_SUCCESS) \
+            zero_free_rv = FKO_ERROR_ZERO_OUT_DATA; \
+    } while(0)
+
+    FREE_BUF(FKO_BUF_RAND_VAL, rand_val);
+    FREE_BUF(FKO_BUF_USERNAME, username);
+    FREE_BUF(FKO_BUF_VERSION, version);
+    FREE_BUF(FKO_BUF_MESSAGE, message);
+    FREE_BUF(FKO_BUF_NAT_ACCESS, nat_access);
+    FREE_BUF(FKO_BUF_SERVER_AUTH, server_auth);
+    FREE_BUF(FKO_BUF_ENCODED_MSG, encoded_msg);
+    FREE_BUF(FKO_BUF_ENCRYPTED_MSG, encrypted_msg);
+    FREE_BUF(FKO_BUF_DIGEST, digest);
+
+#undef FREE_BUF
+
+    if(! park_bufs)
+    {
+        for(i=0; i < FKO_NUM_SPARE_BUFS; i++)
+        {
+            free(ctx->spare_buf[i]);
+            ctx->spare_buf[i] = NULL;
+        }
+    }
 
     if(ctx->raw_digest != NULL)
         if(zero_free(ctx->raw_digest, ctx->raw_digest_len) != FKO_SUCCESS)
@@ -350,14 +483,6 @@ fko_destroy(fko_ctx_t ctx)
         if(zero_free(ctx->encoded_sdp_id, ctx->encoded_sdp_id_len) != FKO_SUCCESS)
             zero_free_rv = FKO_ERROR_ZERO_OUT_DATA;
 
-    if(ctx->encoded_msg != NULL)
-        if(zero_free(ctx->encoded_msg, ctx->encoded_msg_len) != FKO_SUCCESS)
-            zero_free_rv = FKO_ERROR_ZERO_OUT_DATA;
-
-    if(ctx->encrypted_msg != NULL)
-        if(zero_free(ctx->encrypted_msg, ctx->encrypted_msg_len) != FKO_SUCCESS)
-            zero_free_rv = FKO_ERROR_ZERO_OUT_DATA;
-
     if(ctx->final_msg != NULL)
         if(zero_free(ctx->final_msg, ctx->final_msg_len) != FKO_SUCCESS)
             zero_free_rv = FKO_ERROR_ZERO_OUT_DATA;
@@ -367,6 +492,22 @@ fko_destroy(fko_ctx_t ctx)
             zero_free_rv = FKO_ERROR_ZERO_OUT_DATA;
 
 #if HAVE_LIBGPGME
+    /* When resetting, keep the gpgme context (and the exe and home dir
+     * it was set up with) for the next message.
+    */
+    if(park_bufs && ctx->gpg_ctx != NULL && ctx->spare_gpg_ctx == NULL)
+    {
+        ctx->spare_gpg_ctx      = ctx->gpg_ctx;
+        ctx->spare_gpg_exe      = ctx->gpg_exe;
+        ctx->spare_gpg_home_dir = ctx->gpg_home_dir;
+        ctx->gpg_ctx            = NULL;
+        ctx->gpg_exe            = NULL;
+        ctx->gpg_home_dir       = NULL;
+    }
+
+    if(! park_bufs)
+        release_spare_gpgme(ctx);
+
     if(ctx->gpg_exe != NULL)
         free(ctx->gpg_exe);
 
@@ -402,6 +543,88 @@ fko_destroy(fko_ctx_t ctx)
 
 #endif /* HAVE_LIBGPGME */
 
+    return(zero_free_rv);
+}
+
+/* Wipe all message data from a context so it can be used again with
+ * fko_reset_with_data_len().  The context keeps its larger buffers
+ * (wiped) so that decoding the next message does not have to allocate
+ * them again.
+*/
+int
+fko_reset(fko_ctx_t ctx)
+{
+    char   *spare_buf[FKO_NUM_SPARE_BUFS];
+    int     spare_size[FKO_NUM_SPARE_BUFS];
+    int     zero_free_rv;
+#if HAVE_LIBGPGME
+    gpgme_ctx_t spare_gpg_ctx;
+    char       *spare_gpg_exe, *spare_gpg_home_dir;
+#endif
+
+    if(!CTX_INITIALIZED(ctx))
+        return(FKO_ERROR_CTX_NOT_INITIALIZED);
+
+    zero_free_rv = ctx_free_data(ctx, 1);
+
+    memcpy(spare_buf, ctx->spare_buf, sizeof(spare_buf));
+    memcpy(spare_size, ctx->spare_size, sizeof(spare_size));
+#if HAVE_LIBGPGME
+    spare_gpg_ctx      = ctx->spare_gpg_ctx;
+    spare_gpg_exe      = ctx->spare_gpg_exe;
+    spare_gpg_home_dir = ctx->spare_gpg_home_dir;
+#endif
+
+    memset(ctx, 0x0, sizeof(*ctx));
+
+    memcpy(ctx->spare_buf, spare_buf, sizeof(spare_buf));
+    memcpy(ctx->spare_size, spare_size, sizeof(spare_size));
+#if HAVE_LIBGPGME
+    ctx->spare_gpg_ctx      = spare_gpg_ctx;
+    ctx->spare_gpg_exe      = spare_gpg_exe;
+    ctx->spare_gpg_home_dir = spare_gpg_home_dir;
+#endif
+    ctx->initval = FKO_CTX_INITIALIZED;
+
+    return(zero_free_rv);
+}
+
+/* Same as fko_new_with_data_len(), but loads the data into an existing
+ * context (one from fko_new_with_data*() or an earlier call to this
+ * function) instead of allocating a new one.  The context is reset
+ * first.  On error the context is left reset and may be used again.
+*/
+int
+fko_reset_with_data_len(fko_ctx_t ctx, const char * const enc_msg,
+    const int enc_msg_len, const char * const dec_key, const int dec_key_len,
+    int encryption_mode, const char * const hmac_key,
+    const int hmac_key_len, const int hmac_type, const uint32_t sdp_id)
+{
+    int res;
+
+    if((res = fko_reset(ctx)) != FKO_SUCCESS)
+        return(res);
+
+    res = ctx_load_data(ctx, enc_msg, enc_msg_len, dec_key, dec_key_len,
+            encryption_mode, hmac_key, hmac_key_len, hmac_type, sdp_id);
+    if(res != FKO_SUCCESS)
+        fko_reset(ctx);
+
+    return(res);
+}
+
+/* Destroy a context and free its resources
+*/
+int
+fko_destroy(fko_ctx_t ctx)
+{
+    int zero_free_rv = FKO_SUCCESS;
+
+    if(!CTX_INITIALIZED(ctx))
+        return(zero_free_rv);
+
+    zero_free_rv = ctx_free_data(ctx, 0);
+
     memset(ctx, 0x0, sizeof(*ctx));
 
     free(ctx);
@@ -475,6 +698,23 @@ fko_base64_decode(const char * const in, unsigned char *out)
     return b64_decode(in, out);
 }
 
+int
+fko_decode_sdp_id(const char * const in, uint32_t *sdp_id)
+{
+    if(in == NULL || sdp_id == NULL)
+        return(FKO_ERROR_INVALID_DATA);
+
+    /* A string shorter than the ID field would be read past its end
+    */
+    if(strnlen(in, B64_SDP_ID_STR_LEN) < B64_SDP_ID_STR_LEN)
+        return(FKO_ERROR_INVALID_DATA);
+
+    if(b64_decode_sdp_id(in, sdp_id) != 0)
+        return(FKO_ERROR_INVALID_DATA);
+
+    return(FKO_SUCCESS);
+}
+
 /* Return the fko version
 */
 int
@@ -573,49 +813,31 @@ fko_get_sdp_id(fko_ctx_t ctx, uint32_t *sdp_id)
 int
 fko_strip_sdp_id(fko_ctx_t ctx)
 {
-	char *tbuf = NULL;
-	char *ndx = NULL;
-	int res = 0;
+	int res = 0, len;
 
-	// first store the encoded sdp client id in the context
-	tbuf = calloc(1, B64_SDP_ID_STR_LEN + 1);
-	if(tbuf == NULL)
+	if(ctx->encrypted_msg_len < B64_SDP_ID_STR_LEN)
 	{
-		fko_destroy(ctx);
-		ctx = NULL;
-		return FKO_ERROR_MEMORY_ALLOCATION;
+		return(FKO_ERROR_INVALID_DATA_FUNCS_NEW_MSGLEN_VALIDFAIL);
 	}
 
-	strncpy(tbuf, ctx->encrypted_msg, B64_SDP_ID_STR_LEN);
-	tbuf[B64_SDP_ID_STR_LEN] = '\0';
-	res = fko_set_encoded_sdp_id(ctx, tbuf);
-	free(tbuf);
-	tbuf = NULL;
-
-	if(res != FKO_SUCCESS)
+	// first store the encoded sdp client id in the context, straight
+	// from the front of the message (only B64_SDP_ID_STR_LEN chars are taken)
+	if(ctx->encoded_sdp_id != NULL)
 	{
-		return res;
+		free(ctx->encoded_sdp_id);
+		ctx->encoded_sdp_id = NULL;
 	}
-
-	// the ID is always 6 bytes
-	ndx = ctx->encrypted_msg + B64_SDP_ID_STR_LEN;
-
-	tbuf = strndup(ndx, MAX_SPA_ENCODED_MSG_SIZE);
-	if(tbuf == NULL)
+	res = fko_set_encoded_sdp_id(ctx, ctx->encrypted_msg);
+	if(res != FKO_SUCCESS)
 	{
-		return FKO_ERROR_MEMORY_ALLOCATION;
+		return res;
 	}
 
-	free(ctx->encrypted_msg);
-
-	ctx->encrypted_msg = strndup(tbuf, MAX_SPA_ENCODED_MSG_SIZE);
-
-	free(tbuf);
-
-	if(ctx->encrypted_msg == NULL)
-	{
-		return FKO_ERROR_MEMORY_ALLOCATION;
-	}
+	// the ID is always 6 bytes, shift the rest of the data down over it
+	// (in place, so the buffer can be reused by fko_reset_with_data_len())
+	len = ctx->encrypted_msg_len - B64_SDP_ID_STR_LEN;
+	memmove(ctx->encrypted_msg, ctx->encrypted_msg + B64_SDP_ID_STR_LEN, len);
+	memset(ctx->encrypted_msg + len, 0x0, B64_SDP_ID_STR_LEN);
 
 	ctx->encrypted_msg_len = strnlen(ctx->encrypted_msg, MAX_SPA_ENCODED_MSG_SIZE);
 
@@ -693,6 +915,7 @@ fko_spa_data_final(fko_ctx_t ctx,
         free(ctx->encrypted_msg);
 
         ctx->encrypted_msg = strdup(tbuf);
+        ctx->encrypted_msg_size = 0;
         free(tbuf);
 
         ctx->encrypted_msg_len = strnlen(ctx->encrypted_msg, MAX_SPA_ENCODED_MSG_SIZE);
@@ -733,6 +956,7 @@ fko_spa_data_final(fko_ctx_t ctx,
 
         debug("fko_spa_data_final() : duplicating new message...");
         ctx->encrypted_msg = strdup(tbuf);
+        ctx->encrypted_msg_size = 0;
         free(tbuf);
 
         ctx->encrypted_msg_len = strnlen(ctx->encrypted_msg, MAX_SPA_ENCODED_MSG_SIZE);
@@ -771,6 +995,7 @@ fko_spa_data_final(fko_ctx_t ctx,
             strlcat(tbuf, ctx->msg_hmac, data_with_hmac_len);
 
             ctx->encrypted_msg     = tbuf;
+            ctx->encrypted_msg_size = 0;
             ctx->encrypted_msg_len = data_with_hmac_len;
         }
     }
@@ -779,6 +1004,115 @@ fko_spa_data_final(fko_ctx_t ctx,
     return res;
 }
 
+/* Random bytes needed for each packet by fko_spa_data_final_batch(): a
+ * 64-bit value for the rand_val followed by the salt (or GCM nonce).  The
+ * random source is read once for every FKO_BATCH_CHUNK packets.
+*/
+#define FKO_BATCH_RAND_LEN  (sizeof(uint64_t) + RIJ_ENCRYPT_RAND_LEN)
+#define FKO_BATCH_CHUNK     64
+
+#ifdef HAVE_C_UNIT_TESTS
+/* Batch element to fail on (-1 for none), for the unit tests */
+static int ut_batch_fail_elem = -1;
+#endif
+
+/* Generate count SPA packets from one prepared context.  Each packet
+ * gets a new rand_val, timestamp (keeping the offset the context's
+ * timestamp was set with) and salt, while the HMAC key state is only set
+ * up once.  On success spa_data[0..count-1] hold the packets, which the
+ * caller must free.  On error the packets made before the one that failed
+ * are kept, so spa_data[i] is NULL from the failed element on, and the
+ * caller must free the ones that are set.  The context is left holding the
+ * last packet.
+*/
+int
+fko_spa_data_final_batch(fko_ctx_t ctx,
+    const char * const enc_key, const int enc_key_len,
+    const char * const hmac_key, const int hmac_key_len,
+    const int count, char **spa_data)
+{
+    struct fko_hmac_state   hmac_state;
+    unsigned char           rand_buf[FKO_BATCH_RAND_LEN * FKO_BATCH_CHUNK];
+    unsigned char          *rand_ptr;
+    char                    rand_val[FKO_RAND_VAL_SIZE+1];
+    uint64_t                rand_num;
+    int                     ts_offset, i, res = FKO_SUCCESS;
+
+    if(!CTX_INITIALIZED(ctx))
+        return(FKO_ERROR_CTX_NOT_INITIALIZED);
+
+    if(count <= 0 || spa_data == NULL)
+        return(FKO_ERROR_INVALID_DATA);
+
+    /* The salt only matters to (and the key state can only be shared
+     * by) Rijndael.
+    */
+    if(ctx->encryption_type != FKO_ENCRYPTION_RIJNDAEL)
+        return(FKO_ERROR_UNSUPPORTED_FEATURE);
+
+    if(ctx->hmac_type != FKO_HMAC_UNKNOWN)
+    {
+        if(hmac_key == NULL || hmac_key_len < 0
+                || hmac_key_len > MAX_DIGEST_BLOCK_LEN)
+            return(FKO_ERROR_INVALID_KEY_LEN);
+
+        if(hmac_state_init(&hmac_state, ctx->hmac_type,
+                    hmac_key, hmac_key_len) < 0)
+            return(FKO_ERROR_UNSUPPORTED_HMAC_MODE);
+
+        ctx->batch_hmac = &hmac_state;
+    }
+
+    ts_offset = (int)(ctx->timestamp - time(NULL));
+
+    for(i=0; i < count; i++)
+        spa_data[i] = NULL;
+
+    for(i=0; i < count; i++)
+    {
+        if(i % FKO_BATCH_CHUNK == 0)
+            get_random_data(rand_buf, sizeof(rand_buf));
+
+        rand_ptr = rand_buf + (i % FKO_BATCH_CHUNK) * FKO_BATCH_RAND_LEN;
+
+        memcpy(&rand_num, rand_ptr, sizeof(rand_num));
+        snprintf(rand_val, sizeof(rand_val), "%016"PRIu64,
+                rand_num % UINT64_C(10000000000000000));
+
+        res = fko_set_rand_value(ctx, rand_val);
+        if(res == FKO_SUCCESS)
+            res = fko_set_timestamp(ctx, ts_offset);
+
+        if(res == FKO_SUCCESS)
+        {
+            ctx->batch_rand = rand_ptr + sizeof(rand_num);
+            res = fko_spa_data_final(ctx, enc_key, enc_key_len,
+                    hmac_key, hmac_key_len);
+            ctx->batch_rand = NULL;
+        }
+
+#ifdef HAVE_C_UNIT_TESTS
+        if(i == ut_batch_fail_elem)
+            res = FKO_ERROR_UNKNOWN;
+#endif
+
+        if(res == FKO_SUCCESS
+                && (spa_data[i] = strdup(ctx->encrypted_msg)) == NULL)
+            res = FKO_ERROR_MEMORY_ALLOCATION;
+
+        if(res != FKO_SUCCESS)
+            break;
+    }
+
+    ctx->batch_hmac = NULL;
+
+    zero_buf((char *)&hmac_state, sizeof(hmac_state));
+    zero_buf((char *)rand_buf, sizeof(rand_buf));
+    zero_buf(rand_val, sizeof(rand_val));
+
+    return(res);
+}
+
 /* Return the fko SPA encrypted data.
 */
 int
@@ -841,6 +1175,7 @@ fko_set_spa_data(fko_ctx_t ctx, const char * const enc_msg)
     /* First, add the data to the context.
     */
     ctx->encrypted_msg = strdup(enc_msg);
+    ctx->encrypted_msg_size = 0;
     ctx->encrypted_msg_len = enc_msg_len;
 
     if(ctx->encrypted_msg == NULL)
@@ -873,6 +1208,7 @@ fko_afl_set_spa_data(fko_ctx_t ctx, const char * const enc_msg, const int enc_ms
     /* Copy the raw encrypted data into the context
     */
     ctx->encrypted_msg = calloc(1, enc_msg_len);
+    ctx->encrypted_msg_size = 0;
     if(ctx->encrypted_msg == NULL)
         return(FKO_ERROR_MEMORY_ALLOCATION);
 
@@ -884,4 +1220,462 @@ fko_afl_set_spa_data(fko_ctx_t ctx, const char * const enc_msg, const int enc_ms
 }
 #endif
 
+#ifdef HAVE_C_UNIT_TESTS
+
+#define UT_KEY          "fwknoptest"
+#define UT_HMAC_KEY     "fwknophmactestkey"
+#define UT_SDP_ID       777777
+
+/* Build an SPA packet into buf.  If r_ctx is not NULL the client context
+ * is handed back instead of being destroyed.
+*/
+static int
+ut_spa_packet(char * const buf, const size_t len, const int enc_mode,
+        const short hmac_type, const uint32_t sdp_id,
+        const char * const nat_access, fko_ctx_t *r_ctx)
+{
+    fko_ctx_t   ctx = NULL;
+    char       *spa_data = NULL;
+    int         res;
+
+    if((res = fko_new(&ctx)) != FKO_SUCCESS)
+        return res;
+
+    if(sdp_id > 0)
+        res = fko_set_sdp_id(ctx, sdp_id);
+    else
+        res = fko_set_disable_sdp_mode(ctx, 1);
+
+    if(res == FKO_SUCCESS)
+        res = fko_set_spa_encryption_mode(ctx, enc_mode);
+    if(res == FKO_SUCCESS)
+        res = fko_set_spa_message(ctx, "127.0.0.2,tcp/22");
+    if(res == FKO_SUCCESS && nat_access != NULL)
+        res = fko_set_spa_nat_access(ctx, nat_access);
+    if(res == FKO_SUCCESS && hmac_type != FKO_HMAC_UNKNOWN)
+        res = fko_set_spa_hmac_type(ctx, hmac_type);
+    if(res == FKO_SUCCESS)
+        res = fko_spa_data_final(ctx, UT_KEY, strlen(UT_KEY),
+                UT_HMAC_KEY, strlen(UT_HMAC_KEY));
+    if(res == FKO_SUCCESS)
+        res = fko_get_spa_data(ctx, &spa_data);
+    if(res == FKO_SUCCESS && strlcpy(buf, spa_data, len) >= len)
+        res = FKO_ERROR_INVALID_DATA;
+
+    if(res == FKO_SUCCESS && r_ctx != NULL)
+        *r_ctx = ctx;
+    else
+        fko_destroy(ctx);
+
+    return res;
+}
+
+static int
+ut_load(fko_ctx_t *ctx, const int reuse, const char * const spa_data,
+        const char * const key, const int enc_mode, const short hmac_type,
+        const uint32_t sdp_id)
+{
+    const char *hmac_key = hmac_type == FKO_HMAC_UNKNOWN ? NULL : UT_HMAC_KEY;
+    const int   hmac_key_len = hmac_key == NULL ? 0 : strlen(hmac_key);
+
+    if(reuse)
+        return fko_reset_with_data_len(*ctx, spa_data, strlen(spa_data),
+                key, strlen(key), enc_mode, hmac_key, hmac_key_len,
+                hmac_type, sdp_id);
+
+    return fko_new_with_data(ctx, spa_data, key, strlen(key), enc_mode,
+            hmac_key, hmac_key_len, hmac_type, sdp_id);
+}
+
+static int
+ut_str_eq(const char * const a, const char * const b)
+{
+    if(a == NULL || b == NULL)
+        return a == b;
+    return strcmp(a, b) == 0;
+}
+
+/* Everything a decoded context exposes should be the same in a reused
+ * context as in a fresh one.
+*/
+static void
+ut_ctx_match(const fko_ctx_t a, const fko_ctx_t b)
+{
+    CU_ASSERT(ut_str_eq(a->rand_val, b->rand_val));
+    CU_ASSERT(ut_str_eq(a->username, b->username));
+    CU_ASSERT(ut_str_eq(a->version, b->version));
+    CU_ASSERT(ut_str_eq(a->message, b->message));
+    CU_ASSERT(ut_str_eq(a->nat_access, b->nat_access));
+    CU_ASSERT(ut_str_eq(a->server_auth, b->server_auth));
+    CU_ASSERT(ut_str_eq(a->digest, b->digest));
+    CU_ASSERT(ut_str_eq(a->msg_hmac, b->msg_hmac));
+    CU_ASSERT(ut_str_eq(a->encoded_sdp_id, b->encoded_sdp_id));
+    CU_ASSERT(a->timestamp == b->timestamp);
+    CU_ASSERT(a->message_type == b->message_type);
+    CU_ASSERT(a->client_timeout == b->client_timeout);
+    CU_ASSERT(a->digest_type == b->digest_type);
+    CU_ASSERT(a->digest_len == b->digest_len);
+    CU_ASSERT(a->encryption_type == b->encryption_type);
+    CU_ASSERT(a->encryption_mode == b->encryption_mode);
+    CU_ASSERT(a->hmac_type == b->hmac_type);
+    CU_ASSERT(a->msg_hmac_len == b->msg_hmac_len);
+    CU_ASSERT(a->sdp_id == b->sdp_id);
+    CU_ASSERT(a->disable_sdp_mode == b->disable_sdp_mode);
+    CU_ASSERT(a->encoded_msg_len == b->encoded_msg_len);
+    CU_ASSERT(a->encrypted_msg_len == b->encrypted_msg_len);
+    CU_ASSERT(a->state == b->state);
+}
+
+DECLARE_UTEST(reset_clears_ctx, "fko_reset() clears all message data")
+{
+    char        spa_data[MAX_SPA_ENCODED_MSG_SIZE];
+    fko_ctx_t   ctx = NULL;
+    int         i, j;
+
+    CU_ASSERT_FATAL(ut_spa_packet(spa_data, sizeof(spa_data),
+            FKO_ENC_MODE_CTR, FKO_HMAC_SHA256, UT_SDP_ID,
+            "192.168.10.1,22", NULL) == FKO_SUCCESS);
+    CU_ASSERT_FATAL(ut_load(&ctx, 0, spa_data, UT_KEY, FKO_ENC_MODE_CTR,
+            FKO_HMAC_SHA256, UT_SDP_ID) == FKO_SUCCESS);
+
+    CU_ASSERT(ctx->digest != NULL);
+    CU_ASSERT(ctx->msg_hmac != NULL);
+
+    CU_ASSERT(fko_reset(ctx) == FKO_SUCCESS);
+
+    CU_ASSERT(CTX_INITIALIZED(ctx));
+    CU_ASSERT(ctx->rand_val == NULL);
+    CU_ASSERT(ctx->username == NULL);
+    CU_ASSERT(ctx->message == NULL);
+    CU_ASSERT(ctx->nat_access == NULL);
+    CU_ASSERT(ctx->digest == NULL && ctx->digest_len == 0);
+    CU_ASSERT(ctx->raw_digest == NULL && ctx->raw_digest_len == 0);
+    CU_ASSERT(ctx->msg_hmac == NULL && ctx->msg_hmac_len == 0);
+    CU_ASSERT(ctx->encoded_sdp_id == NULL && ctx->encoded_sdp_id_len == 0);
+    CU_ASSERT(ctx->encoded_msg == NULL && ctx->encoded_msg_len == 0);
+    CU_ASSERT(ctx->encrypted_msg == NULL && ctx->encrypted_msg_len == 0);
+    CU_ASSERT(ctx->encryption_mode == 0);
+    CU_ASSERT(ctx->hmac_type == FKO_HMAC_UNKNOWN);
+    CU_ASSERT(ctx->sdp_id == 0);
+    CU_ASSERT(ctx->state == 0);
+
+    /* The buffers kept for reuse must not hold the old message
+    */
+    for(i=0; i < FKO_NUM_SPARE_BUFS; i++)
+        for(j=0; ctx->spare_buf[i] != NULL && j < ctx->spare_size[i]; j++)
+            CU_ASSERT_FATAL(ctx->spare_buf[i][j] == 0x0);
+
+    fko_destroy(ctx);
+}
+
+DECLARE_UTEST(reset_reuse_modes, "Reused context matches a fresh one across modes")
+{
+    static const struct {
+        int         enc_mode;
+        short       hmac_type;
+        uint32_t    sdp_id;
+        const char *nat_access;
+    } pkts[] = {
+        { FKO_ENC_MODE_CTR,          FKO_HMAC_SHA512,  UT_SDP_ID, "192.168.10.1,22" },
+        { FKO_ENC_MODE_CBC,          FKO_HMAC_UNKNOWN, 0,         NULL },
+        { FKO_ENC_MODE_CBC_LEGACY_IV, FKO_HMAC_SHA1,   UT_SDP_ID, NULL },
+#if HAVE_OPENSSL_AES
+        { FKO_ENC_MODE_GCM,          FKO_HMAC_UNKNOWN, UT_SDP_ID, "192.168.10.2,80" },
+        { FKO_ENC_MODE_GCM_BINARY,   FKO_HMAC_SHA256,  0,         NULL },
+#endif
+        { FKO_ENC_MODE_CFB,          FKO_HMAC_SHA256,  UT_SDP_ID, NULL },
+    };
+    char        spa_data[MAX_SPA_ENCODED_MSG_SIZE];
+    fko_ctx_t   reused = NULL, fresh = NULL;
+    int         i;
+
+    for(i=0; i < (int)ARRAY_SIZE(pkts); i++)
+    {
+        CU_ASSERT_FATAL(ut_spa_packet(spa_data, sizeof(spa_data),
+                pkts[i].enc_mode, pkts[i].hmac_type, pkts[i].sdp_id,
+                pkts[i].nat_access, NULL) == FKO_SUCCESS);
+
+        CU_ASSERT_FATAL(ut_load(&reused, i > 0, spa_data, UT_KEY,
+                pkts[i].enc_mode, pkts[i].hmac_type,
+                pkts[i].sdp_id) == FKO_SUCCESS);
+        CU_ASSERT_FATAL(ut_load(&fresh, 0, spa_data, UT_KEY,
+                pkts[i].enc_mode, pkts[i].hmac_type,
+                pkts[i].sdp_id) == FKO_SUCCESS);
+
+        ut_ctx_match(reused, fresh);
+        fko_destroy(fresh);
+    }
+
+    fko_destroy(reused);
+}
+
+DECLARE_UTEST(reset_encrypt_ctx, "Context used to encrypt can decrypt after a reset")
+{
+    char        spa_data[MAX_SPA_ENCODED_MSG_SIZE];
+    char        other[MAX_SPA_ENCODED_MSG_SIZE];
+    fko_ctx_t   ctx = NULL, fresh = NULL;
+
+    /* Encrypt in one mode, then reuse the same context to decrypt a
+     * packet made in another one.
+    */
+    CU_ASSERT_FATAL(ut_spa_packet(spa_data, sizeof(spa_data),
+            FKO_ENC_MODE_CTR, FKO_HMAC_SHA384, UT_SDP_ID,
+            "192.168.10.1,22", &ctx) == FKO_SUCCESS);
+    CU_ASSERT_FATAL(ut_spa_packet(other, sizeof(other),
+            FKO_ENC_MODE_CBC, FKO_HMAC_UNKNOWN, 0, NULL, NULL) == FKO_SUCCESS);
+
+    CU_ASSERT_FATAL(ut_load(&ctx, 1, other, UT_KEY, FKO_ENC_MODE_CBC,
+            FKO_HMAC_UNKNOWN, 0) == FKO_SUCCESS);
+    CU_ASSERT_FATAL(ut_load(&fresh, 0, other, UT_KEY, FKO_ENC_MODE_CBC,
+            FKO_HMAC_UNKNOWN, 0) == FKO_SUCCESS);
+
+    ut_ctx_match(ctx, fresh);
+    CU_ASSERT(ctx->msg_hmac == NULL);
+    CU_ASSERT(ctx->nat_access == NULL);
+
+    fko_destroy(fresh);
+    fko_destroy(ctx);
+}
+
+DECLARE_UTEST(reset_failed_load, "Failed fko_reset_with_data_len() leaves a reusable context")
+{
+    char        spa_data[MAX_SPA_ENCODED_MSG_SIZE];
+    fko_ctx_t   ctx = NULL, fresh = NULL;
+
+    CU_ASSERT_FATAL(ut_spa_packet(spa_data, sizeof(spa_data),
+            FKO_ENC_MODE_CBC, FKO_HMAC_SHA256, UT_SDP_ID,
+            NULL, NULL) == FKO_SUCCESS);
+    CU_ASSERT_FATAL(ut_load(&ctx, 0, spa_data, UT_KEY, FKO_ENC_MODE_CBC,
+            FKO_HMAC_SHA256, UT_SDP_ID) == FKO_SUCCESS);
+
+    /* Wrong key - nothing of the earlier message may be left behind
+    */
+    CU_ASSERT(ut_load(&ctx, 1, spa_data, "wrongkey", FKO_ENC_MODE_CBC,
+            FKO_HMAC_SHA256, UT_SDP_ID) != FKO_SUCCESS);
+    CU_ASSERT(CTX_INITIALIZED(ctx));
+    CU_ASSERT(ctx->message == NULL);
+    CU_ASSERT(ctx->digest == NULL);
+    CU_ASSERT(ctx->msg_hmac == NULL);
+    CU_ASSERT(ctx->encrypted_msg == NULL);
+    CU_ASSERT(ctx->encryption_mode == 0);
+
+    CU_ASSERT_FATAL(ut_load(&ctx, 1, spa_data, UT_KEY, FKO_ENC_MODE_CBC,
+            FKO_HMAC_SHA256, UT_SDP_ID) == FKO_SUCCESS);
+    CU_ASSERT_FATAL(ut_load(&fresh, 0, spa_data, UT_KEY, FKO_ENC_MODE_CBC,
+            FKO_HMAC_SHA256, UT_SDP_ID) == FKO_SUCCESS);
+    ut_ctx_match(ctx, fresh);
+
+    fko_destroy(fresh);
+    fko_destroy(ctx);
+}
+
+/* Client context ready for fko_spa_data_final() or the batch version
+*/
+static int
+ut_batch_ctx(fko_ctx_t *ctx, const int enc_mode, const short hmac_type)
+{
+    int     res;
+
+    if((res = fko_new(ctx)) != FKO_SUCCESS)
+        return res;
+
+    res = fko_set_sdp_id(*ctx, UT_SDP_ID);
+    if(res == FKO_SUCCESS)
+        res = fko_set_spa_encryption_mode(*ctx, enc_mode);
+    if(res == FKO_SUCCESS)
+        res = fko_set_spa_message(*ctx, "127.0.0.2,tcp/22");
+    if(res == FKO_SUCCESS)
+        res = fko_set_spa_hmac_type(*ctx, hmac_type);
+
+    if(res != FKO_SUCCESS)
+        fko_destroy(*ctx);
+    return res;
+}
+
+DECLARE_UTEST(batch_matches_single, "Each batch packet matches a single fko_spa_data_final()")
+{
+    static const int modes[] = {
+        FKO_ENC_MODE_CBC, FKO_ENC_MODE_CTR,
+#if HAVE_OPENSSL_AES
+        FKO_ENC_MODE_GCM, FKO_ENC_MODE_GCM_BINARY,
+#endif
+    };
+    /* More than one FKO_BATCH_CHUNK of random data */
+    char       *batch[FKO_BATCH_CHUNK + 6];
+    char       *single = NULL;
+    fko_ctx_t   ctx = NULL, one = NULL, dec = NULL, dec_one = NULL;
+    int         m, i, j;
+
+    for(m=0; m < (int)ARRAY_SIZE(modes); m++)
+    {
+        CU_ASSERT_FATAL(ut_batch_ctx(&one, modes[m], FKO_HMAC_SHA256)
+                == FKO_SUCCESS);
+        CU_ASSERT_FATAL(fko_spa_data_final(one, UT_KEY, strlen(UT_KEY),
+                UT_HMAC_KEY, strlen(UT_HMAC_KEY)) == FKO_SUCCESS);
+        CU_ASSERT_FATAL(fko_get_spa_data(one, &single) == FKO_SUCCESS);
+        CU_ASSERT_FATAL(ut_load(&dec_one, 0, single, UT_KEY, modes[m],
+                FKO_HMAC_SHA256, UT_SDP_ID) == FKO_SUCCESS);
+
+        CU_ASSERT_FATAL(ut_batch_ctx(&ctx, modes[m], FKO_HMAC_SHA256)
+                == FKO_SUCCESS);
+        CU_ASSERT_FATAL(fko_spa_data_final_batch(ctx, UT_KEY, strlen(UT_KEY),
+                UT_HMAC_KEY, strlen(UT_HMAC_KEY), ARRAY_SIZE(batch), batch)
+                == FKO_SUCCESS);
+
+        for(i=0; i < (int)ARRAY_SIZE(batch); i++)
+        {
+            CU_ASSERT_FATAL(batch[i] != NULL);
+            CU_ASSERT(strlen(batch[i]) == strlen(single));
+
+            /* Decodes (HMAC included) to the same message, with its own
+             * random value
+            */
+            CU_ASSERT_FATAL(ut_load(&dec, 0, batch[i], UT_KEY, modes[m],
+                    FKO_HMAC_SHA256, UT_SDP_ID) == FKO_SUCCESS);
+            CU_ASSERT(ut_str_eq(dec->message, dec_one->message));
+            CU_ASSERT(ut_str_eq(dec->username, dec_one->username));
+            CU_ASSERT(ut_str_eq(dec->version, dec_one->version));
+            CU_ASSERT(dec->message_type == dec_one->message_type);
+            CU_ASSERT(dec->digest_len == dec_one->digest_len);
+            CU_ASSERT(dec->msg_hmac_len == dec_one->msg_hmac_len);
+            CU_ASSERT(dec->sdp_id == dec_one->sdp_id);
+            CU_ASSERT(dec->timestamp - dec_one->timestamp <= 1);
+            CU_ASSERT(! ut_str_eq(dec->rand_val, dec_one->rand_val));
+            fko_destroy(dec);
+
+            for(j=0; j < i; j++)
+                CU_ASSERT(strcmp(batch[i], batch[j]) != 0);
+        }
+
+        for(i=0; i < (int)ARRAY_SIZE(batch); i++)
+            free(batch[i]);
+        fko_destroy(dec_one);
+        fko_destroy(one);
+        fko_destroy(ctx);
+    }
+}
+
+DECLARE_UTEST(batch_partial_fail, "Batch failure is reported at the failed element")
+{
+    char       *batch[8];
+    fko_ctx_t   ctx = NULL, dec = NULL;
+    int         fail_at, i;
+
+    for(fail_at=0; fail_at < (int)ARRAY_SIZE(batch); fail_at += 3)
+    {
+        CU_ASSERT_FATAL(ut_batch_ctx(&ctx, FKO_ENC_MODE_CBC, FKO_HMAC_SHA256)
+                == FKO_SUCCESS);
+
+        for(i=0; i < (int)ARRAY_SIZE(batch); i++)
+            batch[i] = (char *)ctx;     /* must be overwritten */
+
+        ut_batch_fail_elem = fail_at;
+        CU_ASSERT(fko_spa_data_final_batch(ctx, UT_KEY, strlen(UT_KEY),
+                UT_HMAC_KEY, strlen(UT_HMAC_KEY), ARRAY_SIZE(batch), batch)
+                == FKO_ERROR_UNKNOWN);
+        ut_batch_fail_elem = -1;
+
+        /* The packets before the failed one are good, none after it
+        */
+        for(i=0; i < fail_at; i++)
+        {
+            CU_ASSERT_FATAL(batch[i] != NULL);
+            CU_ASSERT(ut_load(&dec, 0, batch[i], UT_KEY, FKO_ENC_MODE_CBC,
+                    FKO_HMAC_SHA256, UT_SDP_ID) == FKO_SUCCESS);
+            fko_destroy(dec);
+            free(batch[i]);
+        }
+        for(i=fail_at; i < (int)ARRAY_SIZE(batch); i++)
+            CU_ASSERT(batch[i] == NULL);
+
+        fko_destroy(ctx);
+    }
+
+    /* Nothing to put the packets in
+    */
+    CU_ASSERT_FATAL(ut_batch_ctx(&ctx, FKO_ENC_MODE_CBC, FKO_HMAC_SHA256)
+            == FKO_SUCCESS);
+    CU_ASSERT(fko_spa_data_final_batch(ctx, UT_KEY, strlen(UT_KEY),
+            UT_HMAC_KEY, strlen(UT_HMAC_KEY), 0, batch) == FKO_ERROR_INVALID_DATA);
+    CU_ASSERT(fko_spa_data_final_batch(ctx, UT_KEY, strlen(UT_KEY),
+            UT_HMAC_KEY, strlen(UT_HMAC_KEY), 1, NULL) == FKO_ERROR_INVALID_DATA);
+    fko_destroy(ctx);
+}
+
+DECLARE_UTEST(decode_sdp_id, "fko_decode_sdp_id() valid, truncated and malformed IDs")
+{
+    static const uint32_t ids[] = { 1, UT_SDP_ID, 0x80000000, 0xffffffff };
+    static const char bad_chars[] = "!:=.* \n";
+    char        spa_data[MAX_SPA_ENCODED_MSG_SIZE];
+    char        b64[B64_SDP_ID_STR_LEN+3];
+    char       *trunc;
+    uint32_t    id, sdp_id;
+    int         i, j;
+
+    /* Valid IDs, and the real prefix of an SDP mode packet
+    */
+    for(i=0; i < (int)ARRAY_SIZE(ids); i++)
+    {
+        id = ids[i];
+        CU_ASSERT_FATAL(b64_encode((unsigned char *)&id, b64,
+                FKO_SDP_ID_SIZE) == B64_SDP_ID_STR_LEN + 2);
+        strip_b64_eq(b64);
+
+        sdp_id = 0;
+        CU_ASSERT(fko_decode_sdp_id(b64, &sdp_id) == FKO_SUCCESS);
+        CU_ASSERT(sdp_id == ids[i]);
+    }
+
+    CU_ASSERT_FATAL(ut_spa_packet(spa_data, sizeof(spa_data),
+            FKO_ENC_MODE_CBC, FKO_HMAC_SHA256, UT_SDP_ID,
+            NULL, NULL) == FKO_SUCCESS);
+    sdp_id = 0;
+    CU_ASSERT(fko_decode_sdp_id(spa_data, &sdp_id) == FKO_SUCCESS);
+    CU_ASSERT(sdp_id == UT_SDP_ID);
+
+    /* Truncated - each buffer is only as long as the string in it
+    */
+    for(i=0; i < B64_SDP_ID_STR_LEN; i++)
+    {
+        CU_ASSERT_FATAL((trunc = strndup(spa_data, i)) != NULL);
+        sdp_id = 0;
+        CU_ASSERT(fko_decode_sdp_id(trunc, &sdp_id) == FKO_ERROR_INVALID_DATA);
+        CU_ASSERT(sdp_id == 0);
+        free(trunc);
+    }
+
+    /* Malformed - a non-base64 char anywhere in the prefix
+    */
+    for(i=0; i < B64_SDP_ID_STR_LEN; i++)
+    {
+        for(j=0; bad_chars[j] != '\0'; j++)
+        {
+            strlcpy(b64, spa_data, sizeof(b64));
+            b64[i] = bad_chars[j];
+            sdp_id = 0;
+            CU_ASSERT(fko_decode_sdp_id(b64, &sdp_id) == FKO_ERROR_INVALID_DATA);
+            CU_ASSERT(sdp_id == 0);
+        }
+    }
+
+    CU_ASSERT(fko_decode_sdp_id(NULL, &sdp_id) == FKO_ERROR_INVALID_DATA);
+    CU_ASSERT(fko_decode_sdp_id(spa_data, NULL) == FKO_ERROR_INVALID_DATA);
+}
+
+int register_ts_fko_funcs(void)
+{
+    ts_init(&TEST_SUITE(fko_funcs), TEST_SUITE_DESCR(fko_funcs), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(fko_funcs), UTEST_FCT(reset_clears_ctx), UTEST_DESCR(reset_clears_ctx));
+    ts_add_utest(&TEST_SUITE(fko_funcs), UTEST_FCT(reset_reuse_modes), UTEST_DESCR(reset_reuse_modes));
+    ts_add_utest(&TEST_SUITE(fko_funcs), UTEST_FCT(reset_encrypt_ctx), UTEST_DESCR(reset_encrypt_ctx));
+    ts_add_utest(&TEST_SUITE(fko_funcs), UTEST_FCT(reset_failed_load), UTEST_DESCR(reset_failed_load));
+    ts_add_utest(&TEST_SUITE(fko_funcs), UTEST_FCT(batch_matches_single), UTEST_DESCR(batch_matches_single));
+    ts_add_utest(&TEST_SUITE(fko_funcs), UTEST_FCT(batch_partial_fail), UTEST_DESCR(batch_partial_fail));
+    ts_add_utest(&TEST_SUITE(fko_funcs), UTEST_FCT(decode_sdp_id), UTEST_DESCR(decode_sdp_id));
+
+    return register_ts(&TEST_SUITE(fko_funcs));
+}
+
+#endif /* HAVE_C_UNIT_TESTS */
+
 /***EOF***/
@@ -34,14 +34,17 @@
 #include "hmac.h"
 #include "base64.h"
 
+#ifdef HAVE_C_UNIT_TESTS
+DECLARE_TEST_SUITE(fko_hmac, "FKO HMAC test suite");
+#endif
+
 int
 fko_verify_hmac(fko_ctx_t ctx,
     const char * const hmac_key, const int hmac_key_len)
 {
-    char    *hmac_digest_from_data = NULL;
-    char    *tbuf = NULL;
+    char     hmac_digest_from_data[SHA512_B64_LEN+1];
     int      res = FKO_SUCCESS;
-    int      hmac_b64_digest_len = 0, zero_free_rv = FKO_SUCCESS;
+    int      hmac_b64_digest_len = 0, msg_len;
 
     /* Must be initialized
     */
@@ -70,71 +73,23 @@ fko_verify_hmac(fko_ctx_t ctx,
     else
         return(FKO_ERROR_UNSUPPORTED_HMAC_MODE);
 
-    if((ctx->encrypted_msg_len - hmac_b64_digest_len)
-            < MIN_SPA_ENCODED_MSG_SIZE)
+    msg_len = ctx->encrypted_msg_len - hmac_b64_digest_len;
+
+    if(msg_len < MIN_SPA_ENCODED_MSG_SIZE)
         return(FKO_ERROR_INVALID_DATA_HMAC_ENCMSGLEN_VALIDFAIL);
 
     /* Get digest value
     */
-    hmac_digest_from_data = strndup((ctx->encrypted_msg
-            + ctx->encrypted_msg_len - hmac_b64_digest_len),
+    memcpy(hmac_digest_from_data, ctx->encrypted_msg + msg_len,
             hmac_b64_digest_len);
+    hmac_digest_from_data[hmac_b64_digest_len] = '\0';
 
-    if(hmac_digest_from_data == NULL)
-        return(FKO_ERROR_MEMORY_ALLOCATION);
-
-    /* Now we chop the HMAC digest off of the encrypted msg
+    /* Now we chop the HMAC digest off of the encrypted msg.  This is done
+     * in place, so the buffer keeps its size and can still be reused after
+     * fko_reset().
     */
-    tbuf = strndup(ctx->encrypted_msg,
-            ctx->encrypted_msg_len - hmac_b64_digest_len);
-
-    if(tbuf == NULL)
-    {
-        if(zero_free(hmac_digest_from_data, strnlen(hmac_digest_from_data,
-                MAX_SPA_ENCODED_MSG_SIZE)) == FKO_SUCCESS)
-            return(FKO_ERROR_MEMORY_ALLOCATION);
-        else
-            return(FKO_ERROR_ZERO_OUT_DATA);
-    }
-
-    if(zero_free(ctx->encrypted_msg, ctx->encrypted_msg_len) != FKO_SUCCESS)
-        zero_free_rv = FKO_ERROR_ZERO_OUT_DATA;
-
-    ctx->encrypted_msg      = tbuf;
-    ctx->encrypted_msg_len -= hmac_b64_digest_len;
-
-    if(ctx->encryption_mode == FKO_ENC_MODE_ASYMMETRIC)
-    {
-        /* See if we need to add the "hQ" string to the front of the
-         * encrypted data.
-         */
-        if(! ctx->added_gpg_prefix)
-        {
-            //res = add_gpg_prefix(ctx);
-        }
-    }
-    else
-    {
-        /* See if we need to add the "Salted__" string to the front of the
-         * encrypted data.
-         */
-        if(! ctx->added_salted_str)
-        {
-            //res = add_salted_str(ctx);
-        }
-    }
-
-    if (res != FKO_SUCCESS)
-    {
-        if(zero_free(hmac_digest_from_data, strnlen(hmac_digest_from_data,
-                        MAX_SPA_ENCODED_MSG_SIZE)) != FKO_SUCCESS)
-            zero_free_rv = FKO_ERROR_ZERO_OUT_DATA;
-
-        if(zero_free_rv == FKO_SUCCESS)
-            return(res);
-        else
-            return(zero_free_rv);
-    }
+    memset(ctx->encrypted_msg + msg_len, 0x0, hmac_b64_digest_len);
+    ctx->encrypted_msg_len = msg_len;
 
     /* Calculate the HMAC from the encrypted data and then
      * compare
@@ -154,14 +109,11 @@ fko_verify_hmac(fko_ctx_t ctx,
         }
     }
 
-    if(zero_free(hmac_digest_from_data, strnlen(hmac_digest_from_data,
-                    MAX_SPA_ENCODED_MSG_SIZE)) != FKO_SUCCESS)
-        zero_free_rv = FKO_ERROR_ZERO_OUT_DATA;
+    if(zero_buf(hmac_digest_from_data, sizeof(hmac_digest_from_data)) != FKO_SUCCESS
+            && res == FKO_SUCCESS)
+        res = FKO_ERROR_ZERO_OUT_DATA;
 
-    if(res == FKO_SUCCESS)
-        return(zero_free_rv);
-    else
-        return(res);
+    return(res);
 }
 
 /* Return the fko HMAC data
@@ -234,9 +186,10 @@ int fko_set_spa_hmac(fko_ctx_t ctx,
     const char * const hmac_key, const int hmac_key_len)
 {
     unsigned char hmac[SHA512_DIGEST_STR_LEN] = {0};
-    char *hmac_base64 = NULL;
+    char  hmac_base64[MD_HEX_SIZE(SHA512_DIGEST_LEN)+1] = {0};
     int   hmac_digest_str_len = 0;
     int   hmac_digest_len = 0;
+    const struct fko_hmac_state *state;
 
     /* Must be initialized
     */
@@ -249,7 +202,20 @@ int fko_set_spa_hmac(fko_ctx_t ctx,
     if(hmac_key_len < 0 || hmac_key_len > MAX_DIGEST_BLOCK_LEN)
         return(FKO_ERROR_INVALID_HMAC_KEY_LEN);
 
-    if(ctx->hmac_type == FKO_HMAC_MD5)
+    /* fko_spa_data_final_batch() sets up the key state for this key once
+     * for all of its packets, and a caller that sends many packets with
+     * one key may keep the state itself (fko_set_spa_hmac_state()).
+    */
+    if((state = ctx->batch_hmac) == NULL)
+        state = ctx->hmac_state;
+
+    if(state != NULL && state->suite->hmac_type == ctx->hmac_type)
+    {
+        hmac_digest_len     = hmac_state_digest(state,
+                                ctx->encrypted_msg, ctx->encrypted_msg_len, hmac);
+        hmac_digest_str_len = MD_HEX_SIZE(hmac_digest_len) + 1;
+    }
+    else if(ctx->hmac_type == FKO_HMAC_MD5)
     {
         hmac_md5(ctx->encrypted_msg,
             ctx->encrypted_msg_len, hmac, hmac_key, hmac_key_len);
@@ -290,10 +256,6 @@ int fko_set_spa_hmac(fko_ctx_t ctx,
         hmac_digest_str_len = SHA512_DIGEST_STR_LEN;
     }
 
-    hmac_base64 = calloc(1, MD_HEX_SIZE(hmac_digest_len)+1);
-    if (hmac_base64 == NULL)
-        return(FKO_ERROR_MEMORY_ALLOCATION);
-
     b64_encode(hmac, hmac_base64, hmac_digest_len);
     strip_b64_eq(hmac_base64);
 
@@ -302,8 +264,6 @@ int fko_set_spa_hmac(fko_ctx_t ctx,
 
     ctx->msg_hmac = strdup(hmac_base64);
 
-    free(hmac_base64);
-
     if(ctx->msg_hmac == NULL)
         return(FKO_ERROR_MEMORY_ALLOCATION);
 
@@ -328,4 +288,263 @@ int fko_set_spa_hmac(fko_ctx_t ctx,
     return FKO_SUCCESS;
 }
 
+/* Precompute the HMAC state for a key so that messages can be checked
+ * with fko_verify_hmac_raw() without redoing the key setup each time.
+*/
+int
+fko_hmac_state_new(fko_hmac_state_t *r_state,
+    const char * const hmac_key, const int hmac_key_len, const short hmac_type)
+{
+    fko_hmac_state_t    state = NULL;
+
+    if(r_state == NULL || hmac_key == NULL)
+        return(FKO_ERROR_INVALID_DATA);
+
+    if(hmac_key_len < 0 || hmac_key_len > MAX_DIGEST_BLOCK_LEN)
+        return(FKO_ERROR_INVALID_HMAC_KEY_LEN);
+
+    state = calloc(1, sizeof *state);
+    if(state == NULL)
+        return(FKO_ERROR_MEMORY_ALLOCATION);
+
+    if(hmac_state_init(state, hmac_type, hmac_key, hmac_key_len) < 0)
+    {
+        free(state);
+        return(FKO_ERROR_UNSUPPORTED_HMAC_MODE);
+    }
+
+    *r_state = state;
+
+    return(FKO_SUCCESS);
+}
+
+void
+fko_hmac_state_destroy(fko_hmac_state_t state)
+{
+    if(state == NULL)
+        return;
+
+    zero_buf((char *)state, sizeof *state);
+    free(state);
+    return;
+}
+
+/* Use a state from fko_hmac_state_new() for the HMAC of the SPA data this
+ * context builds, so that a client sending several packets with the same
+ * key does not process the key for each one.  The state must be for the
+ * context's HMAC type (otherwise the key passed to fko_spa_data_final()
+ * is used as before) and must outlive the context; NULL stops using it.
+*/
+int
+fko_set_spa_hmac_state(fko_ctx_t ctx, const fko_hmac_state_t state)
+{
+    /* Must be initialized
+    */
+    if(!CTX_INITIALIZED(ctx))
+        return(FKO_ERROR_CTX_NOT_INITIALIZED);
+
+    ctx->hmac_state = state;
+
+    return(FKO_SUCCESS);
+}
+
+/* Check the trailing HMAC of an encoded SPA message directly against a
+ * precomputed key state, without creating a context and without any
+ * memory allocation.  enc_msg does not need to be NUL terminated.  On
+ * success, *data_len (if not NULL) is set to the length of the message
+ * without the HMAC, which is what fko_new_with_data_len() should be given
+ * (with no HMAC key) to decode it.
+*/
+int
+fko_verify_hmac_raw(const fko_hmac_state_t state,
+    const char * const enc_msg, const int enc_msg_len, int *data_len)
+{
+    unsigned char   hmac[SHA512_DIGEST_LEN];
+    char            hmac_b64[MD_HEX_SIZE(SHA512_DIGEST_LEN)+1];
+    int             hmac_b64_digest_len = 0, hmac_len, msg_len;
+    int             res = FKO_SUCCESS;
+
+    if(state == NULL || enc_msg == NULL)
+        return(FKO_ERROR_INVALID_DATA);
+
+    if (! is_valid_encoded_msg_len(enc_msg_len))
+        return(FKO_ERROR_INVALID_DATA_HMAC_MSGLEN_VALIDFAIL);
+
+    hmac_b64_digest_len = state->suite->b64_len;
+    msg_len = enc_msg_len - hmac_b64_digest_len;
+
+    if(msg_len < MIN_SPA_ENCODED_MSG_SIZE)
+        return(FKO_ERROR_INVALID_DATA_HMAC_ENCMSGLEN_VALIDFAIL);
+
+    memset(hmac_b64, 0x0, sizeof(hmac_b64));
+
+    hmac_len = hmac_state_digest(state, enc_msg, msg_len, hmac);
+    b64_encode(hmac, hmac_b64, hmac_len);
+    strip_b64_eq(hmac_b64);
+
+    if(strnlen(hmac_b64, sizeof(hmac_b64)) != hmac_b64_digest_len)
+        res = FKO_ERROR_INVALID_DATA_HMAC_LEN_VALIDFAIL;
+    else if(constant_runtime_cmp(hmac_b64, enc_msg + msg_len,
+                hmac_b64_digest_len) != 0)
+        res = FKO_ERROR_INVALID_DATA_HMAC_COMPAREFAIL;
+
+    zero_buf((char *)hmac, sizeof(hmac));
+    zero_buf(hmac_b64, sizeof(hmac_b64));
+
+    if(res == FKO_SUCCESS && data_len != NULL)
+        *data_len = msg_len;
+
+    return(res);
+}
+
+#ifdef HAVE_C_UNIT_TESTS
+
+static const char ut_hmac_msgs[][128] = {
+    "8lBYzj+A3SsHNJvh0JZ5fJFTcGZnT4mYfp9y2iD6z1QzRw0uKsqAm8eTd3SPYe2Wv"
+        "G0Tn8RjOyhNcv5jZnKxPsuyRlgB5Ie3LhvU0wMxSjlVIqG+6PtAJbOy4Ykc",
+    "ZbbBTKeOyQ5Wa4Cz1IqDmR6u0sHjrSdy9Ll0GfkN2hW8vXcPtJ7AiYoEg3MnUqbzT"
+        "1pFeKsR4xDh5C6VjnLw",
+};
+
+/* Key lengths below and above the SHA-256 block size */
+static const int ut_hmac_key_lens[] = { 16, 100 };
+
+static const char ut_hmac_key[MAX_DIGEST_BLOCK_LEN] =
+    "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ+/"
+    "fedcba9876543210zyxwvutsrqponmlkjihgfedcbaZYXWVUTSRQPONMLKJIH";
+
+/* One-shot HMAC of msg, as fko_spa_data_final() computes it without a
+ * key state.
+*/
+static int
+ut_hmac_oneshot(const char * const msg, const short hmac_type,
+        const char * const key, const int key_len, const fko_hmac_state_t state,
+        char * const out, const size_t out_len)
+{
+    fko_ctx_t   ctx = NULL;
+    int         res;
+
+    if((res = fko_new(&ctx)) != FKO_SUCCESS)
+        return res;
+
+    res = fko_set_spa_hmac_type(ctx, hmac_type);
+    if(res == FKO_SUCCESS)
+        res = fko_set_spa_data(ctx, msg);
+    if(res == FKO_SUCCESS)
+        res = fko_set_spa_hmac_state(ctx, state);
+    if(res == FKO_SUCCESS)
+        res = fko_set_spa_hmac(ctx, key, key_len);
+    if(res == FKO_SUCCESS)
+        strlcpy(out, ctx->msg_hmac, out_len);
+
+    fko_destroy(ctx);
+    return res;
+}
+
+DECLARE_UTEST(hmac_state_oneshot, "Key state HMAC matches fko_set_spa_hmac() for each type")
+{
+    char                one[SHA512_B64_LEN+1], incr[SHA512_B64_LEN+1];
+    char                buf[MAX_SPA_ENCODED_MSG_SIZE];
+    fko_hmac_state_t    state = NULL;
+    int                 t, k, m, data_len;
+
+    for(t=FKO_HMAC_MD5; t < FKO_LAST_HMAC_MODE; t++)
+    {
+        for(k=0; k < (int)ARRAY_SIZE(ut_hmac_key_lens); k++)
+        {
+            CU_ASSERT_FATAL(fko_hmac_state_new(&state, ut_hmac_key,
+                    ut_hmac_key_lens[k], t) == FKO_SUCCESS);
+
+            /* The same state is used for several messages
+            */
+            for(m=0; m < (int)ARRAY_SIZE(ut_hmac_msgs); m++)
+            {
+                CU_ASSERT_FATAL(ut_hmac_oneshot(ut_hmac_msgs[m], t,
+                        ut_hmac_key, ut_hmac_key_lens[k], NULL,
+                        one, sizeof(one)) == FKO_SUCCESS);
+                CU_ASSERT_FATAL(ut_hmac_oneshot(ut_hmac_msgs[m], t,
+                        ut_hmac_key, ut_hmac_key_lens[k], state,
+                        incr, sizeof(incr)) == FKO_SUCCESS);
+                CU_ASSERT(strcmp(one, incr) == 0);
+
+                snprintf(buf, sizeof(buf), "%s%s", ut_hmac_msgs[m], one);
+                data_len = 0;
+                CU_ASSERT(fko_verify_hmac_raw(state, buf, strlen(buf),
+                        &data_len) == FKO_SUCCESS);
+                CU_ASSERT(data_len == (int)strlen(ut_hmac_msgs[m]));
+            }
+
+            fko_hmac_state_destroy(state);
+            state = NULL;
+        }
+    }
+}
+
+DECLARE_UTEST(hmac_state_reject, "Key state HMAC rejects a wrong key, type or message")
+{
+    char                one[SHA512_B64_LEN+1];
+    char                buf[MAX_SPA_ENCODED_MSG_SIZE];
+    fko_hmac_state_t    state = NULL, other = NULL;
+    int                 t, data_len;
+
+    for(t=FKO_HMAC_MD5; t < FKO_LAST_HMAC_MODE; t++)
+    {
+        CU_ASSERT_FATAL(ut_hmac_oneshot(ut_hmac_msgs[0], t, ut_hmac_key,
+                16, NULL, one, sizeof(one)) == FKO_SUCCESS);
+        snprintf(buf, sizeof(buf), "%s%s", ut_hmac_msgs[0], one);
+
+        /* Wrong key
+        */
+        CU_ASSERT_FATAL(fko_hmac_state_new(&state, ut_hmac_key + 1, 16, t)
+                == FKO_SUCCESS);
+        data_len = -1;
+        CU_ASSERT(fko_verify_hmac_raw(state, buf, strlen(buf), &data_len)
+                == FKO_ERROR_INVALID_DATA_HMAC_COMPAREFAIL);
+        CU_ASSERT(data_len == -1);
+        fko_hmac_state_destroy(state);
+
+        /* Right key, altered message
+        */
+        CU_ASSERT_FATAL(fko_hmac_state_new(&state, ut_hmac_key, 16, t)
+                == FKO_SUCCESS);
+        buf[0] = buf[0] == 'A' ? 'B' : 'A';
+        CU_ASSERT(fko_verify_hmac_raw(state, buf, strlen(buf), NULL)
+                != FKO_SUCCESS);
+        buf[0] = ut_hmac_msgs[0][0];
+        CU_ASSERT(fko_verify_hmac_raw(state, buf, strlen(buf), NULL)
+                == FKO_SUCCESS);
+
+        /* A state of another type is not used by fko_set_spa_hmac()
+        */
+        CU_ASSERT_FATAL(fko_hmac_state_new(&other, ut_hmac_key + 1, 16,
+                t == FKO_HMAC_SHA256 ? FKO_HMAC_SHA512 : FKO_HMAC_SHA256)
+                == FKO_SUCCESS);
+        CU_ASSERT(ut_hmac_oneshot(ut_hmac_msgs[0], t, ut_hmac_key, 16,
+                other, buf, sizeof(buf)) == FKO_SUCCESS);
+        CU_ASSERT(strcmp(one, buf) == 0);
+
+        fko_hmac_state_destroy(other);
+        fko_hmac_state_destroy(state);
+    }
+
+    CU_ASSERT(fko_hmac_state_new(&state, ut_hmac_key, 16, FKO_HMAC_UNKNOWN)
+            == FKO_ERROR_UNSUPPORTED_HMAC_MODE);
+    CU_ASSERT(fko_hmac_state_new(&state, ut_hmac_key,
+            MAX_DIGEST_BLOCK_LEN+1, FKO_HMAC_SHA256)
+            == FKO_ERROR_INVALID_HMAC_KEY_LEN);
+    CU_ASSERT(fko_verify_hmac_raw(NULL, ut_hmac_msgs[0],
+            strlen(ut_hmac_msgs[0]), NULL) == FKO_ERROR_INVALID_DATA);
+}
+
+int register_ts_fko_hmac(void)
+{
+    ts_init(&TEST_SUITE(fko_hmac), TEST_SUITE_DESCR(fko_hmac), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(fko_hmac), UTEST_FCT(hmac_state_oneshot), UTEST_DESCR(hmac_state_oneshot));
+    ts_add_utest(&TEST_SUITE(fko_hmac), UTEST_FCT(hmac_state_reject), UTEST_DESCR(hmac_state_reject));
+
+    return register_ts(&TEST_SUITE(fko_hmac));
+}
+
+#endif /* HAVE_C_UNIT_TESTS */
+
 /***EOF***/
@@ -0,0 +1,629 @@
+/*
+ *****************************************************************************
+ *
+ * File:    fko_impl.c
+ *
+ * Purpose: Pick the fastest of the SHA-256, AES and base64 implementations
+ *          the CPU supports by timing each of them for a moment.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fko_common.h"
+#include "fko.h"
+#include "sha2.h"
+#include "rijndael.h"
+#include "base64.h"
+
+#ifndef WIN32
+  #include <time.h>
+#endif
+
+#ifdef HAVE_C_UNIT_TESTS
+DECLARE_TEST_SUITE(fko_impl, "FKO crypto implementations test suite");
+#endif
+
+/* Each implementation gets this long (after one warm-up round), so a
+ * calibration takes a few milliseconds.
+*/
+#define IMPL_BENCH_NS       1000000
+
+/* Bytes hashed, encrypted and decrypted, or encoded and decoded in one
+ * benchmark round.  A multiple of the AES block and of the 3 bytes base64
+ * encodes at a time.
+*/
+#define IMPL_BENCH_LEN      768
+#define IMPL_CHECK_LEN      32
+
+typedef struct impl_kernel
+{
+    const char         *name;
+    const char * const *impls;
+    int                 num_impls;
+    int               (*supported)(int impl);
+    void              (*set)(int impl);
+    int               (*get)(void);
+    int               (*round)(const unsigned char *in, unsigned char *check);
+} impl_kernel_t;
+
+static const char * const sha256_impls[SHA256_IMPLS]  = { "c", "shani", "armv8" };
+static const char * const aes_impls[RIJNDAEL_IMPLS]   = { "table", "armv8" };
+static const char * const b64_impls[B64_IMPLS]        = { "scalar", "ssse3", "neon" };
+
+static RIJNDAEL_context aes_ctx;
+
+/* The calibrated choice for each kernel, or -1 for what the kernel picks
+ * by itself.
+*/
+static int impl_best[FKO_LAST_IMPL] = { -1, -1, -1 };
+
+static void
+check_fold(unsigned char *check, const unsigned char *data, const int len)
+{
+    int i;
+
+    for(i=0; i < len; i++)
+        check[i % IMPL_CHECK_LEN] ^= data[i];
+}
+
+static int
+sha256_round(const unsigned char *in, unsigned char *check)
+{
+    SHA256_CTX      ctx;
+    unsigned char   md[SHA256_DIGEST_LEN];
+
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, in, IMPL_BENCH_LEN);
+    SHA256_Final(md, &ctx);
+
+    check_fold(check, md, sizeof(md));
+    return(0);
+}
+
+static int
+aes_round(const unsigned char *in, unsigned char *check)
+{
+    unsigned char   ct[RIJNDAEL_BLOCKSIZE], pt[RIJNDAEL_BLOCKSIZE];
+    int             i;
+
+    for(i=0; i < IMPL_BENCH_LEN; i += RIJNDAEL_BLOCKSIZE)
+    {
+        rijndael_encrypt(&aes_ctx, in + i, ct);
+        rijndael_decrypt(&aes_ctx, ct, pt);
+
+        if(memcmp(pt, in + i, RIJNDAEL_BLOCKSIZE) != 0)
+            return(-1);
+
+        check_fold(check, ct, sizeof(ct));
+    }
+    return(0);
+}
+
+static int
+b64_round(const unsigned char *in, unsigned char *check)
+{
+    char            enc[IMPL_BENCH_LEN / 3 * 4 + 1];
+    unsigned char   dec[IMPL_BENCH_LEN + 4];
+
+    if(b64_encode((unsigned char *)in, enc, IMPL_BENCH_LEN) != sizeof(enc) - 1)
+        return(-1);
+
+    if(b64_decode(enc, dec) != IMPL_BENCH_LEN
+            || memcmp(dec, in, IMPL_BENCH_LEN) != 0)
+        return(-1);
+
+    check_fold(check, (unsigned char *)enc, sizeof(enc) - 1);
+    return(0);
+}
+
+static const impl_kernel_t impl_kernels[FKO_LAST_IMPL] =
+{
+    { "sha256", sha256_impls, SHA256_IMPLS, sha256_impl_supported,
+      sha256_impl_set, sha256_impl_get, sha256_round },
+    { "aes", aes_impls, RIJNDAEL_IMPLS, rijndael_impl_supported,
+      rijndael_impl_set, rijndael_impl_get, aes_round },
+    { "base64", b64_impls, B64_IMPLS, b64_impl_supported,
+      b64_impl_set, b64_impl_get, b64_round }
+};
+
+#ifndef WIN32
+static int64_t
+impl_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/* Rounds per second of the kernel's current implementation.
+*/
+static double
+impl_rate(const impl_kernel_t *k, const unsigned char *in)
+{
+    unsigned char   check[IMPL_CHECK_LEN];
+    int64_t         start, elapsed;
+    long            rounds = 0;
+
+    k->round(in, check);
+
+    start = impl_now_ns();
+    do {
+        k->round(in, check);
+        rounds++;
+        elapsed = impl_now_ns() - start;
+    } while(elapsed < IMPL_BENCH_NS);
+
+    return((double)rounds * 1e9 / (double)elapsed);
+}
+#endif
+
+/* Time every implementation of every kernel the CPU supports and use the
+ * fastest.  An implementation whose output differs from the portable one
+ * is never picked.  Call this before other threads use libfko, and only
+ * from one thread.  On Windows nothing is timed and the kernels keep
+ * their own choice.
+*/
+int
+fko_impl_calibrate(void)
+{
+#ifndef WIN32
+    const impl_kernel_t    *k;
+    unsigned char           in[IMPL_BENCH_LEN];
+    unsigned char           ref[IMPL_CHECK_LEN], check[IMPL_CHECK_LEN];
+    uint8_t                 key[32];
+    double                  rate, best_rate;
+    int                     i, j, best;
+
+    for(i=0; i < IMPL_BENCH_LEN; i++)
+        in[i] = (unsigned char)(i * 131 + 17);
+    for(i=0; i < (int)sizeof(key); i++)
+        key[i] = (uint8_t)(i * 7 + 3);
+    rijndael_setup(&aes_ctx, RIJNDAEL_MAX_KEYSIZE, key);
+
+    for(i=0; i < FKO_LAST_IMPL; i++)
+    {
+        k = &impl_kernels[i];
+
+        /* The first implementation is the portable one
+        */
+        memset(ref, 0x0, sizeof(ref));
+        k->set(0);
+        if(k->round(in, ref) != 0)
+        {
+            k->set(-1);
+            return(FKO_ERROR_INVALID_DATA);
+        }
+
+        best      = -1;
+        best_rate = 0;
+
+        for(j=0; j < k->num_impls; j++)
+        {
+            if(! k->supported(j))
+                continue;
+
+            k->set(j);
+
+            memset(check, 0x0, sizeof(check));
+            if(k->round(in, check) != 0 || memcmp(check, ref, sizeof(ref)) != 0)
+                continue;
+
+            rate = impl_rate(k, in);
+            if(best < 0 || rate > best_rate)
+            {
+                best      = j;
+                best_rate = rate;
+            }
+        }
+
+        impl_best[i] = best;
+        k->set(best);
+    }
+
+    memset(&aes_ctx, 0x0, sizeof(aes_ctx));
+#endif
+    return(FKO_SUCCESS);
+}
+
+/* Set the implementation of some or all kernels from a spec such as
+ * "sha256=c,base64=ssse3".  "auto", as the whole spec or as the name of
+ * an implementation, is the calibrated choice (or the kernel's own if
+ * fko_impl_calibrate() was not called).  Nothing changes unless the
+ * whole spec is valid and names only implementations the CPU supports.
+*/
+int
+fko_impl_select(const char * const spec)
+{
+    const char *p = spec, *eq, *end;
+    int         choice[FKO_LAST_IMPL];
+    size_t      klen, ilen;
+    int         i, j;
+
+    for(i=0; i < FKO_LAST_IMPL; i++)
+        choice[i] = impl_best[i];
+
+    if(spec != NULL && strcasecmp(spec, "auto") != 0)
+    {
+        while(*p != '\0')
+        {
+            while(*p == ',' || *p == ' ')
+                p++;
+            if(*p == '\0')
+                break;
+
+            end = p + strcspn(p, ", ");
+            eq  = memchr(p, '=', end - p);
+            if(eq == NULL)
+                return(FKO_ERROR_INVALID_DATA);
+
+            klen = eq - p;
+            ilen = end - eq - 1;
+
+            for(i=0; i < FKO_LAST_IMPL; i++)
+                if(strlen(impl_kernels[i].name) == klen
+                        && strncasecmp(impl_kernels[i].name, p, klen) == 0)
+                    break;
+            if(i == FKO_LAST_IMPL)
+                return(FKO_ERROR_INVALID_DATA);
+
+            if(ilen == 4 && strncasecmp(eq + 1, "auto", 4) == 0)
+            {
+                choice[i] = impl_best[i];
+            }
+            else
+            {
+                for(j=0; j < impl_kernels[i].num_impls; j++)
+                    if(strlen(impl_kernels[i].impls[j]) == ilen
+                            && strncasecmp(impl_kernels[i].impls[j], eq + 1, ilen) == 0)
+                        break;
+                if(j == impl_kernels[i].num_impls)
+                    return(FKO_ERROR_INVALID_DATA);
+                if(! impl_kernels[i].supported(j))
+                    return(FKO_ERROR_UNSUPPORTED_FEATURE);
+                choice[i] = j;
+            }
+
+            p = end;
+        }
+    }
+
+    for(i=0; i < FKO_LAST_IMPL; i++)
+        impl_kernels[i].set(choice[i]);
+
+    return(FKO_SUCCESS);
+}
+
+/* The name of a kernel and of the implementation of it in use.
+*/
+int
+fko_impl_get(const int kernel, const char **kernel_name, const char **impl_name)
+{
+    if(kernel < 0 || kernel >= FKO_LAST_IMPL)
+        return(FKO_ERROR_INVALID_DATA);
+
+    if(kernel_name != NULL)
+        *kernel_name = impl_kernels[kernel].name;
+    if(impl_name != NULL)
+        *impl_name = impl_kernels[kernel].impls[impl_kernels[kernel].get()];
+
+    return(FKO_SUCCESS);
+}
+
+/* The implementations in use, in the form fko_impl_select() takes.
+*/
+int
+fko_impl_get_spec(char * const buf, const int len)
+{
+    const char *kname, *iname;
+    int         i, n = 0, res;
+
+    if(buf == NULL || len <= 0)
+        return(FKO_ERROR_INVALID_DATA);
+
+    buf[0] = '\0';
+    for(i=0; i < FKO_LAST_IMPL; i++)
+    {
+        fko_impl_get(i, &kname, &iname);
+
+        res = snprintf(buf + n, len - n, "%s%s=%s", i ? "," : "", kname, iname);
+        if(res < 0 || res >= len - n)
+            return(FKO_ERROR_INVALID_DATA);
+        n += res;
+    }
+    return(FKO_SUCCESS);
+}
+
+#ifdef HAVE_C_UNIT_TESTS
+
+#define UT_IMPL_MAX_LEN     (IMPL_BENCH_LEN + 37)
+
+static void
+ut_impl_fill(unsigned char *buf, const int len, const int seed)
+{
+    int i;
+
+    for(i=0; i < len; i++)
+        buf[i] = (unsigned char)(i * 131 + seed * 29 + (i >> 3));
+}
+
+/* Everything a kernel computes for inputs of each length up to
+ * UT_IMPL_MAX_LEN, folded into one check value.  Returns -1 if the
+ * implementation failed its own round trip.
+*/
+static int
+ut_impl_run(const int kernel, unsigned char *check)
+{
+    unsigned char   in[UT_IMPL_MAX_LEN], out[UT_IMPL_MAX_LEN + 4];
+    unsigned char   md[SHA256_DIGEST_LEN];
+    unsigned char   ct[RIJNDAEL_BLOCKSIZE], pt[RIJNDAEL_BLOCKSIZE];
+    char            enc[UT_IMPL_MAX_LEN / 3 * 4 + 8];
+    SHA256_CTX      sha_ctx;
+    int             len, i, n;
+
+    memset(check, 0x0, IMPL_CHECK_LEN);
+
+    for(len=0; len <= UT_IMPL_MAX_LEN; len += (len < 200 ? 1 : 29))
+    {
+        ut_impl_fill(in, len, len);
+
+        if(kernel == FKO_IMPL_SHA256)
+        {
+            /* In one go and in uneven pieces
+            */
+            SHA256_Init(&sha_ctx);
+            SHA256_Update(&sha_ctx, in, len);
+            SHA256_Final(md, &sha_ctx);
+            check_fold(check, md, sizeof(md));
+
+            SHA256_Init(&sha_ctx);
+            for(i=0; i < len; i += n)
+            {
+                n = (i % 7) * 11 + 1;
+                SHA256_Update(&sha_ctx, in + i, n < len - i ? n : len - i);
+            }
+            SHA256_Final(out, &sha_ctx);
+            if(memcmp(out, md, sizeof(md)) != 0)
+                return(-1);
+        }
+        else if(kernel == FKO_IMPL_AES)
+        {
+            for(i=0; i + RIJNDAEL_BLOCKSIZE <= len; i += RIJNDAEL_BLOCKSIZE)
+            {
+                rijndael_encrypt(&aes_ctx, in + i, ct);
+                rijndael_decrypt(&aes_ctx, ct, pt);
+                if(memcmp(pt, in + i, RIJNDAEL_BLOCKSIZE) != 0)
+                    return(-1);
+                check_fold(check, ct, sizeof(ct));
+            }
+        }
+        else
+        {
+            n = b64_encode(in, enc, len);
+            check_fold(check, (unsigned char *)enc, n);
+            if(b64_decode(enc, out) != len || memcmp(out, in, len) != 0)
+                return(-1);
+        }
+    }
+    return(0);
+}
+
+DECLARE_UTEST(impl_known_answers, "Portable implementations give the known answers")
+{
+    /* FIPS 180-2 "abc", FIPS 197 C.3 and RFC 4648 vectors */
+    static const unsigned char sha_abc[SHA256_DIGEST_LEN] = {
+        0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde,
+        0x5d, 0xae, 0x22, 0x23, 0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c,
+        0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad };
+    static const unsigned char aes_pt[RIJNDAEL_BLOCKSIZE] = {
+        0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+        0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff };
+    static const unsigned char aes_ct[RIJNDAEL_BLOCKSIZE] = {
+        0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf,
+        0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89 };
+    unsigned char   md[SHA256_DIGEST_LEN], ct[RIJNDAEL_BLOCKSIZE];
+    uint8_t         key[32];
+    char            enc[16];
+    SHA256_CTX      sha_ctx;
+    int             i, j;
+
+    for(i=0; i < (int)sizeof(key); i++)
+        key[i] = (uint8_t)i;
+    rijndael_setup(&aes_ctx, RIJNDAEL_MAX_KEYSIZE, key);
+
+    /* Every supported implementation, not just the portable one
+    */
+    for(j=0; j < SHA256_IMPLS; j++)
+    {
+        if(! sha256_impl_supported(j))
+            continue;
+        sha256_impl_set(j);
+        SHA256_Init(&sha_ctx);
+        SHA256_Update(&sha_ctx, (const unsigned char *)"abc", 3);
+        SHA256_Final(md, &sha_ctx);
+        CU_ASSERT(memcmp(md, sha_abc, sizeof(md)) == 0);
+    }
+
+    for(j=0; j < RIJNDAEL_IMPLS; j++)
+    {
+        if(! rijndael_impl_supported(j))
+            continue;
+        rijndael_impl_set(j);
+        rijndael_encrypt(&aes_ctx, aes_pt, ct);
+        CU_ASSERT(memcmp(ct, aes_ct, sizeof(ct)) == 0);
+    }
+
+    for(j=0; j < B64_IMPLS; j++)
+    {
+        if(! b64_impl_supported(j))
+            continue;
+        b64_impl_set(j);
+        CU_ASSERT(b64_encode((unsigned char *)"foobar", enc, 6) == 8);
+        CU_ASSERT(strcmp(enc, "Zm9vYmFy") == 0);
+    }
+
+    fko_impl_select("auto");
+    memset(&aes_ctx, 0x0, sizeof(aes_ctx));
+}
+
+DECLARE_UTEST(impl_equivalence, "Every supported implementation matches the portable one")
+{
+    const impl_kernel_t    *k;
+    unsigned char           ref[IMPL_CHECK_LEN], check[IMPL_CHECK_LEN];
+    uint8_t                 key[32];
+    int                     i, j;
+
+    for(i=0; i < (int)sizeof(key); i++)
+        key[i] = (uint8_t)(i * 7 + 3);
+    rijndael_setup(&aes_ctx, RIJNDAEL_MAX_KEYSIZE, key);
+
+    for(i=0; i < FKO_LAST_IMPL; i++)
+    {
+        k = &impl_kernels[i];
+
+        CU_ASSERT_FATAL(k->supported(0));
+        k->set(0);
+        CU_ASSERT_FATAL(ut_impl_run(i, ref) == 0);
+
+        for(j=1; j < k->num_impls; j++)
+        {
+            if(! k->supported(j))
+                continue;
+
+            k->set(j);
+            CU_ASSERT(k->get() == j);
+            CU_ASSERT(ut_impl_run(i, check) == 0);
+            CU_ASSERT(memcmp(check, ref, sizeof(ref)) == 0);
+        }
+    }
+
+    fko_impl_select("auto");
+    memset(&aes_ctx, 0x0, sizeof(aes_ctx));
+}
+
+DECLARE_UTEST(impl_constant_cmp, "Word-at-a-time constant_runtime_cmp() matches a byte compare")
+{
+    char    a[80], b[80];
+    int     off, len, pos;
+
+    /* Every length and alignment, equal and with one byte different
+    */
+    for(off=0; off < 8; off++)
+    {
+        for(len=0; len + off <= (int)sizeof(a); len++)
+        {
+            ut_impl_fill((unsigned char *)a, sizeof(a), off);
+            memcpy(b, a, sizeof(b));
+            CU_ASSERT(constant_runtime_cmp(a + off, b + off, len) == 0);
+
+            for(pos=0; pos < len; pos++)
+            {
+                b[off + pos] ^= 0x80 >> (pos % 8);
+                CU_ASSERT(constant_runtime_cmp(a + off, b + off, len) == -1);
+                b[off + pos] = a[off + pos];
+            }
+
+            /* Differences outside the compared bytes don't count
+            */
+            if(off > 0)
+                b[off - 1] ^= 0x1;
+            if(off + len < (int)sizeof(b))
+                b[off + len] ^= 0x1;
+            CU_ASSERT(constant_runtime_cmp(a + off, b + off, len) == 0);
+        }
+    }
+}
+
+DECLARE_UTEST(impl_select, "fko_impl_select() picks a given implementation")
+{
+    char        spec[FKO_IMPL_SPEC_LEN], expect[FKO_IMPL_SPEC_LEN];
+    const char *kname, *iname;
+    int         i, j;
+
+    CU_ASSERT(fko_impl_select("sha256=c, aes=table,base64=scalar") == FKO_SUCCESS);
+    CU_ASSERT(fko_impl_get_spec(spec, sizeof(spec)) == FKO_SUCCESS);
+    CU_ASSERT(strcmp(spec, "sha256=c,aes=table,base64=scalar") == 0);
+
+    for(i=0; i < FKO_LAST_IMPL; i++)
+    {
+        for(j=0; j < impl_kernels[i].num_impls; j++)
+        {
+            snprintf(expect, sizeof(expect), "%s=%s",
+                impl_kernels[i].name, impl_kernels[i].impls[j]);
+
+            if(! impl_kernels[i].supported(j))
+            {
+                /* Refused, and nothing changes
+                */
+                CU_ASSERT(fko_impl_select(expect) == FKO_ERROR_UNSUPPORTED_FEATURE);
+                CU_ASSERT(impl_kernels[i].get() == 0);
+                continue;
+            }
+
+            CU_ASSERT(fko_impl_select(expect) == FKO_SUCCESS);
+            CU_ASSERT(fko_impl_get(i, &kname, &iname) == FKO_SUCCESS);
+            CU_ASSERT(strcmp(kname, impl_kernels[i].name) == 0);
+            CU_ASSERT(strcmp(iname, impl_kernels[i].impls[j]) == 0);
+            CU_ASSERT(impl_kernels[i].get() == j);
+
+            CU_ASSERT(fko_impl_select("sha256=c,aes=table,base64=scalar") == FKO_SUCCESS);
+        }
+    }
+
+    /* A spec with anything wrong in it changes nothing
+    */
+    CU_ASSERT(fko_impl_select("sha256=c,bogus=c") == FKO_ERROR_INVALID_DATA);
+    CU_ASSERT(fko_impl_select("sha256=bogus") == FKO_ERROR_INVALID_DATA);
+    CU_ASSERT(fko_impl_select("sha256") == FKO_ERROR_INVALID_DATA);
+    CU_ASSERT(fko_impl_get_spec(spec, sizeof(spec)) == FKO_SUCCESS);
+    CU_ASSERT(strcmp(spec, "sha256=c,aes=table,base64=scalar") == 0);
+
+    CU_ASSERT(fko_impl_get(FKO_LAST_IMPL, &kname, &iname) == FKO_ERROR_INVALID_DATA);
+    CU_ASSERT(fko_impl_get_spec(spec, 8) == FKO_ERROR_INVALID_DATA);
+
+    /* After calibrating, "auto" is a supported choice for each kernel
+    */
+    CU_ASSERT(fko_impl_calibrate() == FKO_SUCCESS);
+    CU_ASSERT(fko_impl_select("sha256=c,aes=table,base64=scalar") == FKO_SUCCESS);
+    CU_ASSERT(fko_impl_select("auto") == FKO_SUCCESS);
+    for(i=0; i < FKO_LAST_IMPL; i++)
+    {
+        CU_ASSERT(impl_kernels[i].get() == impl_best[i]);
+        CU_ASSERT(impl_kernels[i].supported(impl_kernels[i].get()));
+    }
+}
+
+int register_ts_fko_impl(void)
+{
+    ts_init(&TEST_SUITE(fko_impl), TEST_SUITE_DESCR(fko_impl), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(fko_impl), UTEST_FCT(impl_known_answers), UTEST_DESCR(impl_known_answers));
+    ts_add_utest(&TEST_SUITE(fko_impl), UTEST_FCT(impl_equivalence), UTEST_DESCR(impl_equivalence));
+    ts_add_utest(&TEST_SUITE(fko_impl), UTEST_FCT(impl_constant_cmp), UTEST_DESCR(impl_constant_cmp));
+    ts_add_utest(&TEST_SUITE(fko_impl), UTEST_FCT(impl_select), UTEST_DESCR(impl_select));
+
+    return register_ts(&TEST_SUITE(fko_impl));
+}
+
+#endif /* HAVE_C_UNIT_TESTS */
+
+/***EOF***/
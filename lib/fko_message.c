@@ -239,6 +239,7 @@ fko_set_spa_message(fko_ctx_t ctx, const char * const msg)
         free(ctx->message);
 
     ctx->message = strdup(msg);
+    ctx->message_size = 0;
 
     ctx->state |= FKO_DATA_MODIFIED;
 
@@ -40,6 +40,47 @@ int validate_access_msg(const char *msg);
 int validate_nat_access_msg(const char *msg);
 int validate_proto_port_spec(const char *msg);
 
+/* Both GCM modes authenticate the whole message with the GCM tag, and
+ * neither computes an inner digest.
+*/
+#define FKO_ENC_MODE_IS_GCM(mode)   ((mode) == FKO_ENC_MODE_GCM \
+                                        || (mode) == FKO_ENC_MODE_GCM_BINARY)
+
+/* Binary inner message format, used with FKO_ENC_MODE_GCM_BINARY in
+ * place of the ':'-separated list of base64-encoded fields:
+ *
+ *   0   FKO_BIN_MAGIC
+ *   1   FKO_BIN_VERSION
+ *   2   fields, each a type byte, a length byte and then the value
+ *
+ * The random value is sent as 8 bytes of packed BCD, the timestamp (64
+ * bits) and the client timeout (32 bits) in network byte order, the
+ * message type as a single byte and the strings without a terminating
+ * NUL.  Fields of an unknown type are skipped so that new ones can be
+ * added without bumping the version.  There is no digest field, the GCM
+ * tag already covers the message.
+*/
+#define FKO_BIN_MAGIC               0xFB
+#define FKO_BIN_VERSION             1
+#define FKO_BIN_HDR_LEN             2
+#define FKO_BIN_FIELD_HDR_LEN       2
+#define FKO_BIN_MAX_FIELD_LEN       255
+
+#define FKO_BIN_RAND_VAL            1
+#define FKO_BIN_USERNAME            2
+#define FKO_BIN_TIMESTAMP           3
+#define FKO_BIN_VERSION_STR         4
+#define FKO_BIN_MSG_TYPE            5
+#define FKO_BIN_MESSAGE             6
+#define FKO_BIN_NAT_ACCESS          7
+#define FKO_BIN_SERVER_AUTH         8
+#define FKO_BIN_CLIENT_TIMEOUT      9
+#define FKO_BIN_LAST_FIELD          FKO_BIN_CLIENT_TIMEOUT
+
+#define FKO_BIN_RAND_VAL_LEN        (FKO_RAND_VAL_SIZE / 2)
+#define FKO_BIN_TIMESTAMP_LEN       8
+#define FKO_BIN_TIMEOUT_LEN         4
+
 #endif /* FKO_MESSAGE_H */
 
 /***EOF***/
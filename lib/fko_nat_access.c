@@ -76,6 +76,7 @@ fko_set_spa_nat_access(fko_ctx_t ctx, const char * const msg)
         free(ctx->nat_access);
 
     ctx->nat_access = strdup(msg);
+    ctx->nat_access_size = 0;
 
     ctx->state |= FKO_DATA_MODIFIED;
 
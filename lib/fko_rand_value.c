@@ -30,36 +30,41 @@
 */
 #include "fko_common.h"
 #include "fko.h"
+#include "cipher_funcs.h"
 
-#ifdef WIN32
-  #include <sys/timeb.h>
-  #include <time.h>
-#else
-  #ifdef HAVE_SYS_TIME_H
-    #include <sys/time.h>
-    #ifdef TIME_WITH_SYS_TIME
-      #include <time.h>
-    #endif
-  #endif
-
-  #define RAND_FILE "/dev/urandom"
-#endif
+/* Fill buf with len random decimal digits, the first of them non-zero
+ * like the decimal rand() values this used to be built from.  Bytes that
+ * would bias the digits are skipped.
+*/
+static void
+rand_digits(char *buf, const size_t len)
+{
+    unsigned char   rnd[FKO_RAND_VAL_SIZE * 2];
+    size_t          n = 0, i;
+
+    while(n < len)
+    {
+        get_random_data(rnd, sizeof(rnd));
+
+        for(i=0; i < sizeof(rnd) && n < len; i++)
+        {
+            if(n == 0 && rnd[i] < 252)
+                buf[n++] = '1' + rnd[i] % 9;
+            else if(n > 0 && rnd[i] < 250)
+                buf[n++] = '0' + rnd[i] % 10;
+        }
+    }
+    buf[len] = '\0';
+
+    zero_buf((char *)rnd, sizeof(rnd));
+    return;
+}
 
 /* Set/Generate the SPA data random value string.
 */
 int
 fko_set_rand_value(fko_ctx_t ctx, const char * const new_val)
 {
-#ifdef WIN32
-	struct _timeb	tb;
-#else
-    FILE           *rfd;
-    struct timeval  tv;
-    size_t          amt_read;
-#endif
-    unsigned long   seed;
-    char           *tmp_buf;
-
 #if HAVE_LIBFIU
     fiu_return_on("fko_set_rand_value_init", FKO_ERROR_CTX_NOT_INITIALIZED);
 #endif
@@ -87,6 +92,7 @@ fko_set_rand_value(fko_ctx_t ctx, const char * const new_val)
         fiu_return_on("fko_set_rand_value_strdup", FKO_ERROR_MEMORY_ALLOCATION);
 #endif
         ctx->rand_val = strdup(new_val);
+        ctx->rand_val_size = 0;
         if(ctx->rand_val == NULL)
             return(FKO_ERROR_MEMORY_ALLOCATION);
 
@@ -95,39 +101,10 @@ fko_set_rand_value(fko_ctx_t ctx, const char * const new_val)
         return(FKO_SUCCESS);
     }
 
-#ifdef WIN32
-	_ftime_s(&tb);
-	seed = ((tb.time * 1000) + tb.millitm) & 0xFFFFFFFF;
-#else
-    /* Attempt to read seed data from /dev/urandom.  If that does not
-     * work, then fall back to a time-based method (less secure, but
-     * probably more portable).
-    */
-    if((rfd = fopen(RAND_FILE, "r")) != NULL)
-    {
-        /* Read seed from /dev/urandom
-        */
-        amt_read = fread(&seed, 4, 1, rfd);
-        fclose(rfd);
-
 #if HAVE_LIBFIU
-        fiu_return_on("fko_set_rand_value_read", FKO_ERROR_FILESYSTEM_OPERATION);
-#endif
-        if (amt_read != 1)
-            return(FKO_ERROR_FILESYSTEM_OPERATION);
-    }
-    else
-    {
-        /* Seed based on time (current usecs).
-        */
-        gettimeofday(&tv, NULL);
-
-        seed = tv.tv_usec;
-    }
+    fiu_return_on("fko_set_rand_value_read", FKO_ERROR_FILESYSTEM_OPERATION);
 #endif
 
-    srand(seed);
-
     if(ctx->rand_val != NULL)
         free(ctx->rand_val);
 
@@ -135,25 +112,15 @@ fko_set_rand_value(fko_ctx_t ctx, const char * const new_val)
         fiu_return_on("fko_set_rand_value_calloc1", FKO_ERROR_MEMORY_ALLOCATION);
 #endif
     ctx->rand_val = calloc(1, FKO_RAND_VAL_SIZE+1);
+    ctx->rand_val_size = 0;
     if(ctx->rand_val == NULL)
             return(FKO_ERROR_MEMORY_ALLOCATION);
 
 #if HAVE_LIBFIU
         fiu_return_on("fko_set_rand_value_calloc2", FKO_ERROR_MEMORY_ALLOCATION);
 #endif
-    tmp_buf = calloc(1, FKO_RAND_VAL_SIZE+1);
-    if(tmp_buf == NULL)
-            return(FKO_ERROR_MEMORY_ALLOCATION);
-
-    snprintf(ctx->rand_val, FKO_RAND_VAL_SIZE, "%u", rand());
-
-    while(strnlen(ctx->rand_val, FKO_RAND_VAL_SIZE+1) < FKO_RAND_VAL_SIZE)
-    {
-        snprintf(tmp_buf, FKO_RAND_VAL_SIZE, "%u", rand());
-        strlcat(ctx->rand_val, tmp_buf, FKO_RAND_VAL_SIZE+1);
-    }
 
-    free(tmp_buf);
+    rand_digits(ctx->rand_val, FKO_RAND_VAL_SIZE);
 
     ctx->state |= FKO_DATA_MODIFIED;
 
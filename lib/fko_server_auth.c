@@ -76,6 +76,7 @@ fko_set_spa_server_auth(fko_ctx_t ctx, const char * const msg)
         free(ctx->server_auth);
 
     ctx->server_auth = strdup(msg);
+    ctx->server_auth_size = 0;
 
     ctx->state |= FKO_DATA_MODIFIED;
 
@@ -121,6 +121,7 @@ fko_set_username(fko_ctx_t ctx, const char * const spoof_user)
         free(ctx->username);
 
     ctx->username = strdup(username);
+    ctx->username_size = 0;
 
     ctx->state |= FKO_DATA_MODIFIED;
 
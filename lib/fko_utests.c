@@ -11,6 +11,9 @@
 static void register_test_suites(void)
 {
     register_ts_fko_decode();
+    register_ts_fko_funcs();
+    register_ts_fko_hmac();
+    register_ts_fko_impl();
 }
 
 /* The main() function for setting up and running the tests.
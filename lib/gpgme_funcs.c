@@ -35,23 +35,112 @@
 #if HAVE_LIBGPGME
 #include "gpgme_funcs.h"
 
+#ifndef WIN32
+  #include <pthread.h>
+#endif
+
+/* Result of the one-time gpgme setup, see gpgme_engine_init().
+*/
+static gpgme_error_t    gpgme_engine_err = 0;
+#ifndef WIN32
+static pthread_once_t   gpgme_engine_once = PTHREAD_ONCE_INIT;
+#else
+static int              gpgme_engine_done = 0;
+#endif
+
+/* Compare two possibly NULL strings.
+*/
+static int
+same_setting(const char *a, const char *b)
+{
+    if(a == NULL || b == NULL)
+        return(a == b);
+    return(strcmp(a, b) == 0);
+}
+
+/* Release the gpgme context kept by fko_reset() (if any).
+*/
+void
+release_spare_gpgme(fko_ctx_t fko_ctx)
+{
+    if(fko_ctx->spare_gpg_ctx != NULL)
+        gpgme_release(fko_ctx->spare_gpg_ctx);
+
+    free(fko_ctx->spare_gpg_exe);
+    free(fko_ctx->spare_gpg_home_dir);
+
+    fko_ctx->spare_gpg_ctx      = NULL;
+    fko_ctx->spare_gpg_exe      = NULL;
+    fko_ctx->spare_gpg_home_dir = NULL;
+}
+
+/* gpgme library setup and the OpenPGP engine check.  These only need to
+ * be done once per process, and not at all by a process that never sees
+ * a GPG stanza or GPG client option, so they are run on the first
+ * init_gpgme() call.
+*/
+static void
+gpgme_engine_setup(void)
+{
+    /* Because the gpgme manual says you should.
+    */
+    gpgme_check_version(NULL);
+
+    /* Check for OpenPGP support
+    */
+    gpgme_engine_err = gpgme_engine_check_version(GPGME_PROTOCOL_OpenPGP);
+    return;
+}
+
+static gpgme_error_t
+gpgme_engine_init(void)
+{
+#ifndef WIN32
+    pthread_once(&gpgme_engine_once, gpgme_engine_setup);
+#else
+    if(! gpgme_engine_done)
+    {
+        gpgme_engine_setup();
+        gpgme_engine_done = 1;
+    }
+#endif
+    return(gpgme_engine_err);
+}
+
 int
 init_gpgme(fko_ctx_t fko_ctx)
 {
     gpgme_error_t       err;
 
-    /* If we already have a context, we are done.
+    /* If we already have a context, we are done.  (The error paths
+     * below release it without clearing have_gpgme_context.)
     */
-    if(fko_ctx->have_gpgme_context)
+    if(fko_ctx->have_gpgme_context && fko_ctx->gpg_ctx != NULL)
         return(FKO_SUCCESS);
 
-    /* Because the gpgme manual says you should.
+    /* Reuse the context kept by fko_reset() if it was created for the
+     * same GPG exe and home dir.  Creating one is most of the cost of a
+     * GPG decrypt.
     */
-    gpgme_check_version(NULL);
+    if(fko_ctx->spare_gpg_ctx != NULL)
+    {
+        if(same_setting(fko_ctx->spare_gpg_exe, fko_ctx->gpg_exe)
+                && same_setting(fko_ctx->spare_gpg_home_dir, fko_ctx->gpg_home_dir))
+        {
+            fko_ctx->gpg_ctx = fko_ctx->spare_gpg_ctx;
+            fko_ctx->spare_gpg_ctx = NULL;
+            release_spare_gpgme(fko_ctx);
 
-    /* Check for OpenPGP support
-    */
-    err = gpgme_engine_check_version(GPGME_PROTOCOL_OpenPGP);
+            gpgme_signers_clear(fko_ctx->gpg_ctx);
+
+            fko_ctx->have_gpgme_context = 1;
+            return(FKO_SUCCESS);
+        }
+
+        release_spare_gpgme(fko_ctx);
+    }
+
+    err = gpgme_engine_init();
     if(gpg_err_code(err) != GPG_ERR_NO_ERROR)
     {
         /* GPG engine is not available.
@@ -41,6 +41,7 @@ int gpgme_encrypt(fko_ctx_t ctx, unsigned char *in, size_t len, const char *pw,
 int gpgme_decrypt(fko_ctx_t ctx, unsigned char *in, size_t len, const char *pw, unsigned char **out, size_t *out_len);
 #if HAVE_LIBGPGME
   int get_gpg_key(fko_ctx_t fko_ctx, gpgme_key_t *mykey, const int signer);
+  void release_spare_gpgme(fko_ctx_t fko_ctx);
 #endif
 
 #endif /* GPGME_FUNCS_H */
@@ -30,46 +30,7 @@
 */
 
 #include "hmac.h"
-
-typedef struct {
-    MD5Context ctx_inside;
-    MD5Context ctx_outside;
-
-    unsigned char block_inner_pad[MAX_DIGEST_BLOCK_LEN];
-    unsigned char block_outer_pad[MAX_DIGEST_BLOCK_LEN];
-} hmac_md5_ctx;
-
-typedef struct {
-    SHA1_INFO ctx_inside;
-    SHA1_INFO ctx_outside;
-
-    unsigned char block_inner_pad[MAX_DIGEST_BLOCK_LEN];
-    unsigned char block_outer_pad[MAX_DIGEST_BLOCK_LEN];
-} hmac_sha1_ctx;
-
-typedef struct {
-    SHA256_CTX ctx_inside;
-    SHA256_CTX ctx_outside;
-
-    unsigned char block_inner_pad[MAX_DIGEST_BLOCK_LEN];
-    unsigned char block_outer_pad[MAX_DIGEST_BLOCK_LEN];
-} hmac_sha256_ctx;
-
-typedef struct {
-    SHA384_CTX ctx_inside;
-    SHA384_CTX ctx_outside;
-
-    unsigned char block_inner_pad[MAX_DIGEST_BLOCK_LEN];
-    unsigned char block_outer_pad[MAX_DIGEST_BLOCK_LEN];
-} hmac_sha384_ctx;
-
-typedef struct {
-    SHA512_CTX ctx_inside;
-    SHA512_CTX ctx_outside;
-
-    unsigned char block_inner_pad[MAX_DIGEST_BLOCK_LEN];
-    unsigned char block_outer_pad[MAX_DIGEST_BLOCK_LEN];
-} hmac_sha512_ctx;
+#include <stddef.h>
 
 static void
 pad_init(unsigned char *inner_pad, unsigned char *outer_pad,
@@ -430,3 +391,113 @@ hmac_sha512(const char *msg, const unsigned int msg_len,
 
     return;
 }
+
+/* Per type message digest for a precomputed state: feed the message to
+ * the inner digest and finish both.
+*/
+#define HMAC_SUITE_DIGEST(name, ctx_type)                                  \
+static void                                                                \
+hmac_##name##_digest(void *ctx, const char *msg,                           \
+        const unsigned int msg_len, unsigned char *hmac)                   \
+{                                                                          \
+    hmac_##name##_update((ctx_type *)ctx, msg, msg_len);                   \
+    hmac_##name##_final((ctx_type *)ctx, hmac);                            \
+}
+
+HMAC_SUITE_DIGEST(md5, hmac_md5_ctx)
+HMAC_SUITE_DIGEST(sha1, hmac_sha1_ctx)
+HMAC_SUITE_DIGEST(sha256, hmac_sha256_ctx)
+HMAC_SUITE_DIGEST(sha384, hmac_sha384_ctx)
+HMAC_SUITE_DIGEST(sha512, hmac_sha512_ctx)
+
+/* Only the inner and outer digests change per message, the pads that
+ * follow them in each context are cleared and never read again.
+*/
+static const hmac_suite_t hmac_suite_md5 = {
+    FKO_HMAC_MD5, MD5_DIGEST_LEN, MD5_B64_LEN,
+    offsetof(hmac_md5_ctx, block_inner_pad), hmac_md5_digest
+};
+static const hmac_suite_t hmac_suite_sha1 = {
+    FKO_HMAC_SHA1, SHA1_DIGEST_LEN, SHA1_B64_LEN,
+    offsetof(hmac_sha1_ctx, block_inner_pad), hmac_sha1_digest
+};
+static const hmac_suite_t hmac_suite_sha256 = {
+    FKO_HMAC_SHA256, SHA256_DIGEST_LEN, SHA256_B64_LEN,
+    offsetof(hmac_sha256_ctx, block_inner_pad), hmac_sha256_digest
+};
+static const hmac_suite_t hmac_suite_sha384 = {
+    FKO_HMAC_SHA384, SHA384_DIGEST_LEN, SHA384_B64_LEN,
+    offsetof(hmac_sha384_ctx, block_inner_pad), hmac_sha384_digest
+};
+static const hmac_suite_t hmac_suite_sha512 = {
+    FKO_HMAC_SHA512, SHA512_DIGEST_LEN, SHA512_B64_LEN,
+    offsetof(hmac_sha512_ctx, block_inner_pad), hmac_sha512_digest
+};
+
+/* Absorb the key pads for hmac_type into state and pick its suite.  Only
+ * the digest state is needed after that, so the pads (which hold key
+ * material) are cleared.  Returns the digest length, or -1 for an
+ * unsupported type.
+*/
+int
+hmac_state_init(struct fko_hmac_state *state, const short hmac_type,
+        const char *hmac_key, const int hmac_key_len)
+{
+    memset(state, 0, sizeof(*state));
+
+    switch(hmac_type)
+    {
+        case FKO_HMAC_MD5:
+            hmac_md5_init(&state->u.md5, hmac_key, hmac_key_len);
+            memset(state->u.md5.block_inner_pad, 0, MAX_DIGEST_BLOCK_LEN);
+            memset(state->u.md5.block_outer_pad, 0, MAX_DIGEST_BLOCK_LEN);
+            state->suite = &hmac_suite_md5;
+            break;
+        case FKO_HMAC_SHA1:
+            hmac_sha1_init(&state->u.sha1, hmac_key, hmac_key_len);
+            memset(state->u.sha1.block_inner_pad, 0, MAX_DIGEST_BLOCK_LEN);
+            memset(state->u.sha1.block_outer_pad, 0, MAX_DIGEST_BLOCK_LEN);
+            state->suite = &hmac_suite_sha1;
+            break;
+        case FKO_HMAC_SHA256:
+            hmac_sha256_init(&state->u.sha256, hmac_key, hmac_key_len);
+            memset(state->u.sha256.block_inner_pad, 0, MAX_DIGEST_BLOCK_LEN);
+            memset(state->u.sha256.block_outer_pad, 0, MAX_DIGEST_BLOCK_LEN);
+            state->suite = &hmac_suite_sha256;
+            break;
+        case FKO_HMAC_SHA384:
+            hmac_sha384_init(&state->u.sha384, hmac_key, hmac_key_len);
+            memset(state->u.sha384.block_inner_pad, 0, MAX_DIGEST_BLOCK_LEN);
+            memset(state->u.sha384.block_outer_pad, 0, MAX_DIGEST_BLOCK_LEN);
+            state->suite = &hmac_suite_sha384;
+            break;
+        case FKO_HMAC_SHA512:
+            hmac_sha512_init(&state->u.sha512, hmac_key, hmac_key_len);
+            memset(state->u.sha512.block_inner_pad, 0, MAX_DIGEST_BLOCK_LEN);
+            memset(state->u.sha512.block_outer_pad, 0, MAX_DIGEST_BLOCK_LEN);
+            state->suite = &hmac_suite_sha512;
+            break;
+        default:
+            return(-1);
+    }
+
+    return(state->suite->digest_len);
+}
+
+/* Compute the HMAC of msg from a copy of the precomputed state.  The
+ * state itself is not modified, so it can be shared between threads.
+ * Returns the digest length.
+*/
+int
+hmac_state_digest(const struct fko_hmac_state *state, const char *msg,
+        const unsigned int msg_len, unsigned char *hmac)
+{
+    const hmac_suite_t     *suite = state->suite;
+    struct fko_hmac_state   tmp;
+
+    memcpy(&tmp.u, &state->u, suite->ctx_len);
+    suite->digest(&tmp.u, msg, msg_len, hmac);
+    memset(&tmp.u, 0, suite->ctx_len);
+
+    return(suite->digest_len);
+}
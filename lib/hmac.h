@@ -35,6 +35,75 @@
 
 #define MAX_DIGEST_BLOCK_LEN    SHA512_BLOCK_LEN
 
+typedef struct {
+    MD5Context ctx_inside;
+    MD5Context ctx_outside;
+
+    unsigned char block_inner_pad[MAX_DIGEST_BLOCK_LEN];
+    unsigned char block_outer_pad[MAX_DIGEST_BLOCK_LEN];
+} hmac_md5_ctx;
+
+typedef struct {
+    SHA1_INFO ctx_inside;
+    SHA1_INFO ctx_outside;
+
+    unsigned char block_inner_pad[MAX_DIGEST_BLOCK_LEN];
+    unsigned char block_outer_pad[MAX_DIGEST_BLOCK_LEN];
+} hmac_sha1_ctx;
+
+typedef struct {
+    SHA256_CTX ctx_inside;
+    SHA256_CTX ctx_outside;
+
+    unsigned char block_inner_pad[MAX_DIGEST_BLOCK_LEN];
+    unsigned char block_outer_pad[MAX_DIGEST_BLOCK_LEN];
+} hmac_sha256_ctx;
+
+typedef struct {
+    SHA384_CTX ctx_inside;
+    SHA384_CTX ctx_outside;
+
+    unsigned char block_inner_pad[MAX_DIGEST_BLOCK_LEN];
+    unsigned char block_outer_pad[MAX_DIGEST_BLOCK_LEN];
+} hmac_sha384_ctx;
+
+typedef struct {
+    SHA512_CTX ctx_inside;
+    SHA512_CTX ctx_outside;
+
+    unsigned char block_inner_pad[MAX_DIGEST_BLOCK_LEN];
+    unsigned char block_outer_pad[MAX_DIGEST_BLOCK_LEN];
+} hmac_sha512_ctx;
+
+/* The routines and sizes for one HMAC type.  hmac_state_init() picks
+ * the suite once per key, so checking a message calls straight into the
+ * right digest instead of switching on the type again.
+*/
+typedef struct hmac_suite {
+    short       hmac_type;
+    int         digest_len;
+    int         b64_len;    /* base64 digest length, without padding */
+    size_t      ctx_len;    /* bytes of the state that a message updates */
+    void      (*digest)(void *ctx, const char *msg,
+                    const unsigned int msg_len, unsigned char *hmac);
+} hmac_suite_t;
+
+/* HMAC state with the key pads already absorbed into the inner and
+ * outer digests.  This is computed once per key by fko_hmac_state_new()
+ * and copied for each message, so checking a message does not touch the
+ * key again.
+*/
+struct fko_hmac_state {
+    const hmac_suite_t *suite;
+    union {
+        hmac_md5_ctx    md5;
+        hmac_sha1_ctx   sha1;
+        hmac_sha256_ctx sha256;
+        hmac_sha384_ctx sha384;
+        hmac_sha512_ctx sha512;
+    } u;
+};
+
 void hmac_md5(const char *msg, const unsigned int msg_len,
         unsigned char *hmac, const char *hmac_key, const int hmac_key_len);
 void hmac_sha1(const char *msg, const unsigned int msg_len,
@@ -45,6 +114,10 @@ void hmac_sha384(const char *msg, const unsigned int msg_len,
         unsigned char *hmac, const char *hmac_key, const int hmac_key_len);
 void hmac_sha512(const char *msg, const unsigned int msg_len,
         unsigned char *hmac, const char *hmac_key, const int hmac_key_len);
+int hmac_state_init(struct fko_hmac_state *state, const short hmac_type,
+        const char *hmac_key, const int hmac_key_len);
+int hmac_state_digest(const struct fko_hmac_state *state, const char *msg,
+        const unsigned int msg_len, unsigned char *hmac);
 
 #endif /* HMAC_H */
 
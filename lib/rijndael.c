@@ -34,6 +34,17 @@
 #include <string.h>
 #include <stdio.h>
 
+#if HAVE_ARM_CRYPTO && defined(__AARCH64EL__)
+  #define RIJNDAEL_ARMV8 1
+  #include <arm_neon.h>
+  #if defined(__linux__)
+    #include <sys/auxv.h>
+    #ifndef HWCAP_AES
+      #define HWCAP_AES (1 << 3)
+    #endif
+  #endif
+#endif
+
 /* These tables combine both the S-boxes and the mixcolumn transformation, so
    that we can perform a round's encryption or by means of four table lookups
    and four XOR's per column of state.  They were generated by the
@@ -389,6 +400,113 @@ key_addition32to8(const uint32_t *txt, uint32_t *keys, uint8_t *out)
     }
 }
 
+#if RIJNDAEL_ARMV8
+/* Returns 1 if the CPU supports the ARMv8 AES instructions.  Every 64-bit
+ * Apple CPU does; elsewhere the kernel says.  The answer is cached after
+ * the first call; concurrent first callers all store the same value.
+ */
+static int
+rijndael_have_armv8(void)
+{
+    static volatile int have_armv8 = -1;
+    int res = have_armv8;
+
+    if (res < 0) {
+#if defined(__APPLE__)
+        res = 1;
+#elif defined(__linux__)
+        res = (getauxval(AT_HWCAP) & HWCAP_AES) ? 1 : 0;
+#else
+        res = 0;
+#endif
+        have_armv8 = res;
+    }
+    return(res);
+}
+
+/* On a little endian CPU the key schedule words hold the round keys in
+ * the byte order aese/aesd take them.  ikeys is the schedule for the
+ * equivalent inverse cipher (InvMixColumns already applied to the inner
+ * round keys), which is what aesd/aesimc need.
+ */
+static void
+rijndael_encrypt_armv8(RIJNDAEL_context *ctx, const uint8_t *plaintext,
+        uint8_t *ciphertext)
+{
+    uint8x16_t block = vld1q_u8(plaintext);
+    int r;
+
+    for (r=0; r<ctx->nrounds-1; r++)
+        block = vaesmcq_u8(vaeseq_u8(block,
+                    vld1q_u8((const uint8_t *)&(ctx->keys[r*4]))));
+
+    block = vaeseq_u8(block,
+            vld1q_u8((const uint8_t *)&(ctx->keys[(ctx->nrounds-1)*4])));
+    block = veorq_u8(block,
+            vld1q_u8((const uint8_t *)&(ctx->keys[ctx->nrounds*4])));
+
+    vst1q_u8(ciphertext, block);
+}
+
+static void
+rijndael_decrypt_armv8(RIJNDAEL_context *ctx, const uint8_t *ciphertext,
+        uint8_t *plaintext)
+{
+    uint8x16_t block = vld1q_u8(ciphertext);
+    int r;
+
+    for (r=ctx->nrounds; r>1; r--)
+        block = vaesimcq_u8(vaesdq_u8(block,
+                    vld1q_u8((const uint8_t *)&(ctx->ikeys[r*4]))));
+
+    block = vaesdq_u8(block, vld1q_u8((const uint8_t *)&(ctx->ikeys[4])));
+    block = veorq_u8(block, vld1q_u8((const uint8_t *)&(ctx->ikeys[0])));
+
+    vst1q_u8(plaintext, block);
+}
+#endif /* RIJNDAEL_ARMV8 */
+
+/* The AES implementation in use, one of RIJNDAEL_IMPL_*.  Until
+ * fko_impl.c picks one it is the ARMv8 instructions if the CPU has them
+ * and the tables otherwise.
+ */
+static volatile int rijndael_impl = RIJNDAEL_IMPL_AUTO;
+
+int
+rijndael_impl_supported(int impl)
+{
+    switch (impl) {
+    case RIJNDAEL_IMPL_TABLE:
+        return(1);
+#if RIJNDAEL_ARMV8
+    case RIJNDAEL_IMPL_ARMV8:
+        return(rijndael_have_armv8());
+#endif
+    }
+    return(0);
+}
+
+void
+rijndael_impl_set(int impl)
+{
+    rijndael_impl = impl;
+}
+
+int
+rijndael_impl_get(void)
+{
+    int impl = rijndael_impl;
+
+    if (impl < 0) {
+        if (rijndael_impl_supported(RIJNDAEL_IMPL_ARMV8))
+            impl = RIJNDAEL_IMPL_ARMV8;
+        else
+            impl = RIJNDAEL_IMPL_TABLE;
+        rijndael_impl = impl;
+    }
+    return(impl);
+}
+
 static int idx[4][4] = {
     { 0, 1, 2, 3 },
     { 1, 2, 3, 0 },
@@ -404,6 +522,13 @@ rijndael_encrypt(RIJNDAEL_context *ctx,
     uint32_t wtxt[4], t[4];		/* working ciphertext */
     uint32_t e;
 
+#if RIJNDAEL_ARMV8
+    if (rijndael_impl_get() == RIJNDAEL_IMPL_ARMV8) {
+        rijndael_encrypt_armv8(ctx, plaintext, ciphertext);
+        return;
+    }
+#endif
+
     key_addition_8to32(plaintext, &(ctx->keys[0]), wtxt);
     for (r=1; r<ctx->nrounds; r++) {
         for (j=0; j<4; j++) {
@@ -443,6 +568,13 @@ rijndael_decrypt(RIJNDAEL_context *ctx,
     uint32_t wtxt[4], t[4];		/* working ciphertext */
     uint32_t e;
 
+#if RIJNDAEL_ARMV8
+    if (rijndael_impl_get() == RIJNDAEL_IMPL_ARMV8) {
+        rijndael_decrypt_armv8(ctx, ciphertext, plaintext);
+        return;
+    }
+#endif
+
     key_addition_8to32(ciphertext, &(ctx->ikeys[4*ctx->nrounds]), wtxt);
     for (r=ctx->nrounds-1; r> 0;  r--) {
         for (j=0; j<4; j++) {
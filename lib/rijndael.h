@@ -54,6 +54,18 @@
 #define     MODE_OFB        5    /*  Are we ciphering in 128-bit OFB mode? */
 #define     MODE_CTR        6    /*  Are we ciphering in counter mode? */
 
+/* Which AES implementation rijndael_encrypt() and rijndael_decrypt()
+ * use, see fko_impl.c.  Only the ones the CPU supports may be set.
+ */
+#define     RIJNDAEL_IMPL_AUTO      -1
+#define     RIJNDAEL_IMPL_TABLE     0
+#define     RIJNDAEL_IMPL_ARMV8     1
+#define     RIJNDAEL_IMPLS          2
+
+int rijndael_impl_supported(int impl);
+void rijndael_impl_set(int impl);
+int rijndael_impl_get(void);
+
 /* Allow keys of size 128 <= bits <= 256 */
 
 typedef struct {
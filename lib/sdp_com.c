@@ -4,11 +4,15 @@
  *  Created on: Apr 12, 2016
  *      Author: Daniel Bailey
  */
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif
 #include "sdp_ctrl_client.h"
 #include "sdp_com.h"
 #include "sdp_errors.h"
 #include "sdp_message.h"
 #include "sdp_log_msg.h"
+#include "fwknop_probes.h"
 #include <netdb.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -16,6 +20,14 @@
 #include <sys/time.h>
 #include <sys/wait.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <openssl/rand.h>
+#if HAVE_LIBZ
+  #include <zlib.h>
+#endif
 
 
 static void sdp_com_free_argv(char **argv_new, int *argc_new)
@@ -216,13 +228,143 @@ static int sdp_com_get_ssl_error(SSL *ssl, int rv, char *r_ssl_error)
 }
 
 
-static int sdp_com_socket_connect(sdp_com_t com)
+// Keep the session in session_file so a restarted or short-lived client
+// can resume it too. The file holds the session's master secret, so it
+// is written owner-only and swapped into place whole.
+static void sdp_com_save_session(sdp_com_t com)
+{
+    char tmp_file[SDP_COM_MAX_PATH_LEN];
+    FILE *fp = NULL;
+    int fd = -1;
+
+    if(com->session_file == NULL || com->session == NULL)
+        return;
+
+    if(snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", com->session_file) >= sizeof(tmp_file))
+        return;
+
+    if((fd = open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0
+            || (fp = fdopen(fd, "w")) == NULL)
+    {
+        log_msg(LOG_WARNING, "Failed to open TLS session cache file %s", tmp_file);
+        if(fd >= 0)
+            close(fd);
+        return;
+    }
+
+    if(!PEM_write_SSL_SESSION(fp, com->session))
+    {
+        log_msg(LOG_WARNING, "Failed to write TLS session cache file %s", tmp_file);
+        fclose(fp);
+        unlink(tmp_file);
+        return;
+    }
+
+    if(fclose(fp) != 0 || rename(tmp_file, com->session_file) != 0)
+    {
+        log_msg(LOG_WARNING, "Failed to store TLS session cache file %s", com->session_file);
+        unlink(tmp_file);
+        return;
+    }
+
+    log_msg(LOG_DEBUG, "Stored TLS session in %s", com->session_file);
+}
+
+static void sdp_com_load_session(sdp_com_t com)
+{
+    FILE *fp = NULL;
+
+    if(com->session_file == NULL)
+        return;
+
+    if((fp = fopen(com->session_file, "r")) == NULL)
+        return;
+
+    if((com->session = PEM_read_SSL_SESSION(fp, NULL, NULL, NULL)) == NULL)
+        log_msg(LOG_WARNING, "Ignoring unreadable TLS session cache file %s", com->session_file);
+    else
+        log_msg(LOG_DEBUG, "Loaded TLS session from %s", com->session_file);
+
+    fclose(fp);
+}
+
+static void sdp_com_forget_session(sdp_com_t com)
+{
+    if(com->session != NULL)
+    {
+        SSL_SESSION_free(com->session);
+        com->session = NULL;
+    }
+
+    if(com->session_file != NULL)
+        unlink(com->session_file);
+}
+
+// OpenSSL hands over each new session here, including TLS 1.3 tickets
+// that arrive after the handshake. Returning 1 keeps the reference.
+static int sdp_com_new_session_cb(SSL *ssl, SSL_SESSION *session)
+{
+    sdp_com_t com = SSL_get_app_data(ssl);
+
+    // a connection made before the credentials changed still uses the
+    // old identity, its sessions are of no further use
+    if(com == NULL || SSL_get_SSL_CTX(ssl) != com->ssl_ctx)
+        return 0;
+
+    if(com->session != NULL)
+        SSL_SESSION_free(com->session);
+
+    com->session = session;
+    sdp_com_save_session(com);
+    return 1;
+}
+
+
+static int sdp_com_set_socket_options(sdp_com_t com, int sd)
+{
+    int true = 1;
+
+    // set socket option so we'll be able to reuse the port again if necessary
+    if(setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &true, sizeof(int)) < 0)
+    {
+        perror("Socket Reuse Port Option");
+        return SDP_ERROR_SOCKET_OPTION;
+    }
+
+    // set socket options for read timeout, these apply once the socket
+    // is switched back to blocking by sdp_com_socket_connect()
+    if(setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, (char*)&(com->read_timeout), sizeof(com->read_timeout)) < 0)
+    {
+        perror("Socket Read Timeout Option");
+        return SDP_ERROR_SOCKET_OPTION;
+    }
+
+    // set socket options for write timeout
+    if(setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, (char*)&(com->write_timeout), sizeof(com->write_timeout)) < 0)
+    {
+        perror("Socket Read Timeout Option");
+        return SDP_ERROR_SOCKET_OPTION;
+    }
+
+    if(fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK) < 0)
+    {
+        perror("Socket Non-blocking Option");
+        return SDP_ERROR_SOCKET_OPTION;
+    }
+
+    return SDP_SUCCESS;
+}
+
+
+/*
+ * Begin connecting without waiting on the network. On success conn_state
+ * is SDP_COM_CONNECTING and sdp_com_connect_continue() finishes the TCP
+ * connect and TLS handshake as the socket becomes ready.
+ */
+static int sdp_com_connect_start(sdp_com_t com)
 {
     int rv = SDP_SUCCESS;
-    char ssl_error_string[SDP_MAX_LINE_LEN];
-    int ssl_error = 0;
-    int sd, true, conn_success = 0;
-    struct sockaddr_in addr;
+    int sd = -1, conn_started = 0;
     struct addrinfo *server_info=NULL, *rp, hints;
     char   port[SDP_COM_MAX_PORT_STRING_BUFFER_LEN] = {0};
 
@@ -244,7 +386,7 @@ static int sdp_com_socket_connect(sdp_com_t com)
     if(com == NULL || !com->initialized)
         return SDP_ERROR_UNINITIALIZED;
 
-    if(com->conn_state == SDP_COM_CONNECTED)
+    if(com->conn_state != SDP_COM_DISCONNECTED)
         return SDP_SUCCESS;
 
     // cleanup old ssl object if necessary
@@ -278,59 +420,36 @@ static int sdp_com_socket_connect(sdp_com_t com)
         return SDP_ERROR_GETADDRINFO;
     }
 
-
-       if((sd = socket(PF_INET, SOCK_STREAM, 0)) < 1)
-       {
-           perror("Socket Creation");
-           //log_msg(LOG_ERR, "Socket creation failed");
-           return SDP_ERROR_SOCKET;
-       }
-
-       // set socket option so we'll be able to reuse the port again if necessary
-       true = 1;
-       if(setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &true, sizeof(int)) < 0)
-       {
-           perror("Socket Reuse Port Option");
-           return SDP_ERROR_SOCKET_OPTION;
-       }
-
-       // set socket options for read timeout
-       if(setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, (char*)&(com->read_timeout), sizeof(com->read_timeout)) < 0)
-       {
-           perror("Socket Read Timeout Option");
-           return SDP_ERROR_SOCKET_OPTION;
-       }
-
-       // set socket options for write timeout
-       if(setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, (char*)&(com->write_timeout), sizeof(com->write_timeout)) < 0)
-       {
-           perror("Socket Read Timeout Option");
-           return SDP_ERROR_SOCKET_OPTION;
-       }
-
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(com->ctrl_port);
-
     for (rp = server_info; rp != NULL; rp = rp->ai_next)
     {
-        if ( connect(sd, rp->ai_addr, sizeof(addr)) == 0 )
+        if((sd = socket(rp->ai_family, SOCK_STREAM, 0)) < 0)
+            continue;
+
+        if((rv = sdp_com_set_socket_options(com, sd)) != SDP_SUCCESS)
+        {
+            close(sd);
+            freeaddrinfo(server_info);
+            return rv;
+        }
+
+        if(connect(sd, rp->ai_addr, rp->ai_addrlen) == 0 || errno == EINPROGRESS)
         {
-            conn_success = 1;
+            conn_started = 1;
             break;
         }
+
+        close(sd);
     }
 
     freeaddrinfo(server_info);
 
-    if(!conn_success)
+    if(!conn_started)
     {
-        close(sd);
         log_msg(LOG_ERR, "Socket connect failed");
         return SDP_ERROR_CONN_FAIL;
     }
 
-    log_msg(LOG_DEBUG, "Socket connected, creating new SSL object");
+    log_msg(LOG_DEBUG, "Socket connect started, creating new SSL object");
 
     if((com->ssl = SSL_new(com->ssl_ctx)) == NULL)
     {
@@ -343,6 +462,13 @@ static int sdp_com_socket_connect(sdp_com_t com)
     // so set the socket_descriptor field for such situations
     com->socket_descriptor = sd;
 
+    SSL_set_app_data(com->ssl, com);
+
+    // resuming the last session spares the controller a full handshake,
+    // if it no longer knows the session it falls back to one by itself
+    if(com->session != NULL && !SSL_set_session(com->ssl, com->session))
+        log_msg(LOG_WARNING, "Failed to offer cached TLS session");
+
     log_msg(LOG_DEBUG, "Created new SSL object, setting socket descriptor field in the SSL object");
 
     // set the socket descriptor field in the ssl object
@@ -353,28 +479,136 @@ static int sdp_com_socket_connect(sdp_com_t com)
         return SDP_ERROR_SSL;
     }
 
-    log_msg(LOG_DEBUG, "Starting SSL handshake");
+    com->conn_state = SDP_COM_CONNECTING;
+    com->tcp_connected = 0;
+    com->want_write = 1;
+    com->connect_deadline = time(NULL) + SDP_COM_CONNECT_TIMEOUT_SECONDS;
+
+    return SDP_SUCCESS;
+}
+
+
+/*
+ * Take a connection started by sdp_com_connect_start() as far as it can
+ * go without waiting. Returns SDP_SUCCESS while it is still in progress,
+ * with com->want_write telling whether to wait for the socket to turn
+ * writable rather than readable. On failure the connection is torn down.
+ */
+int sdp_com_connect_continue(sdp_com_t com)
+{
+    int rv = SDP_SUCCESS;
+    char ssl_error_string[SDP_MAX_LINE_LEN];
+    int ssl_error = 0;
+    int so_error = 0;
+    socklen_t so_error_len = sizeof(so_error);
+    struct pollfd pfd;
+
+    if(com == NULL || !com->initialized)
+        return SDP_ERROR_UNINITIALIZED;
+
+    if(com->conn_state != SDP_COM_CONNECTING)
+        return SDP_SUCCESS;
+
+    if(time(NULL) > com->connect_deadline)
+    {
+        log_msg(LOG_ERR, "Timed out connecting to controller");
+        sdp_com_disconnect(com);
+        return SDP_ERROR_CONN_FAIL;
+    }
+
+    // the TCP connect is done once the socket turns writable
+    if(!com->tcp_connected)
+    {
+        pfd.fd = com->socket_descriptor;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+
+        if(poll(&pfd, 1, 0) <= 0)
+            return SDP_SUCCESS;
+
+        if(getsockopt(com->socket_descriptor, SOL_SOCKET, SO_ERROR, &so_error, &so_error_len) < 0
+                || so_error != 0)
+        {
+            log_msg(LOG_ERR | LOG_RATE_LIMIT, "Socket connect failed: %s",
+                    strerror(so_error ? so_error : errno));
+            sdp_com_disconnect(com);
+            return SDP_ERROR_CONN_FAIL;
+        }
+
+        com->tcp_connected = 1;
+        log_msg(LOG_DEBUG, "Socket connected, starting SSL handshake");
+    }
 
     // perform SSL handshake
     if((rv = SSL_connect(com->ssl)) != SDP_COM_SSL_CONNECT_SUCCESS )
     {
-        log_msg(LOG_ERR, "SSL handshake failed");
-
         ssl_error = sdp_com_get_ssl_error(com->ssl, rv, ssl_error_string);
 
-        log_msg(LOG_ERR, "Error from SSL_connect: %d - %s", ssl_error, ssl_error_string);
+        if(ssl_error == SSL_ERROR_WANT_READ || ssl_error == SSL_ERROR_WANT_WRITE)
+        {
+            com->want_write = (ssl_error == SSL_ERROR_WANT_WRITE);
+            return SDP_SUCCESS;
+        }
+
+        log_msg(LOG_ERR | LOG_RATE_LIMIT, "SSL handshake failed");
+        log_msg(LOG_ERR | LOG_RATE_LIMIT, "Error from SSL_connect: %d - %s", ssl_error, ssl_error_string);
+
+        // don't let a bad cached session spoil the next attempt as well
+        if(com->session != NULL)
+            sdp_com_forget_session(com);
 
         sdp_com_disconnect(com);
         return SDP_ERROR_SSL_HANDSHAKE;
     }
 
-    log_msg(LOG_NOTICE, "Connected with %s encryption", SSL_get_cipher(com->ssl));
+    log_msg(LOG_NOTICE, "Connected with %s encryption%s", SSL_get_cipher(com->ssl),
+            SSL_session_reused(com->ssl) ? ", TLS session resumed" : "");
     if((rv = sdp_com_show_certs(com)) != SDP_SUCCESS)
     {
         sdp_com_disconnect(com);
         return rv;
     }
 
+    com->conn_state = SDP_COM_CONNECTED;
+    com->want_write = 0;
+    __atomic_add_fetch(&(com->connects), 1, __ATOMIC_RELAXED);
+    return SDP_SUCCESS;
+}
+
+
+// Connect and wait for the handshake to finish, leaving a blocking socket
+// for callers that read and write synchronously
+static int sdp_com_socket_connect(sdp_com_t com)
+{
+    int rv = SDP_SUCCESS;
+    struct pollfd pfd;
+
+    if((rv = sdp_com_connect_start(com)) != SDP_SUCCESS)
+        return rv;
+
+    while(com->conn_state == SDP_COM_CONNECTING)
+    {
+        pfd.fd = com->socket_descriptor;
+        pfd.events = com->want_write ? POLLOUT : POLLIN;
+        pfd.revents = 0;
+
+        if(poll(&pfd, 1, SDP_COM_CONNECT_POLL_MS) < 0 && errno != EINTR)
+        {
+            log_msg(LOG_ERR, "Socket poll failed: %s", strerror(errno));
+            sdp_com_disconnect(com);
+            return SDP_ERROR_CONN_FAIL;
+        }
+
+        if((rv = sdp_com_connect_continue(com)) != SDP_SUCCESS)
+            return rv;
+    }
+
+    if(com->conn_state != SDP_COM_CONNECTED)
+        return SDP_ERROR_CONN_FAIL;
+
+    fcntl(com->socket_descriptor, F_SETFL,
+            fcntl(com->socket_descriptor, F_GETFL) & ~O_NONBLOCK);
+
     return SDP_SUCCESS;
 }
 
@@ -455,6 +689,34 @@ static int sdp_com_load_certs(SSL_CTX* ctx, char *ca_cert_file, char* cert_file,
     return SDP_SUCCESS;
 }
 
+// Build a TLS context for the current certificate and key
+static int sdp_com_ctx_setup(sdp_com_t com, SSL_CTX **r_ctx)
+{
+    SSL_CTX *ctx = NULL;
+    int rv = SDP_SUCCESS;
+
+    if((rv = sdp_com_ssl_ctx_init(&ctx)) != SDP_SUCCESS)
+        return rv;
+
+    if((rv = sdp_com_load_certs(
+            ctx,
+            com->ca_cert_file,
+            com->cert_file,
+            com->key_file
+        )) != SDP_SUCCESS)
+    {
+        SSL_CTX_free(ctx);
+        return rv;
+    }
+
+    // sessions are kept by sdp_com_new_session_cb, not in OpenSSL's cache
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, sdp_com_new_session_cb);
+
+    *r_ctx = ctx;
+    return SDP_SUCCESS;
+}
+
 int sdp_com_init(sdp_com_t com)
 {
     int rv = SDP_SUCCESS;
@@ -501,16 +763,10 @@ int sdp_com_init(sdp_com_t com)
     if(!(com->func_ptr_send_spa))
         com->func_ptr_send_spa = sdp_com_default_send_spa;
 
-    if((rv = sdp_com_ssl_ctx_init(&(com->ssl_ctx))) != SDP_SUCCESS)
+    if((rv = sdp_com_ctx_setup(com, &(com->ssl_ctx))) != SDP_SUCCESS)
         return rv;
 
-    if((rv = sdp_com_load_certs(
-            com->ssl_ctx, 
-            com->ca_cert_file, 
-            com->cert_file, 
-            com->key_file
-        )) != SDP_SUCCESS)
-        return rv;
+    sdp_com_load_session(com);
 
     // disable the SIGPIPE signal and handle dropped connections as needed
     signal(SIGPIPE, SIG_IGN);
@@ -520,6 +776,35 @@ int sdp_com_init(sdp_com_t com)
     return SDP_SUCCESS;
 }
 
+/*
+ * Switch to a newly saved certificate and key without restarting. The
+ * current connection carries on as it is, the next one presents the new
+ * identity. Sessions tied to the old identity are dropped.
+ */
+int sdp_com_reload_certs(sdp_com_t com)
+{
+    SSL_CTX *ctx = NULL;
+    int rv = SDP_SUCCESS;
+
+    if(com == NULL || !com->initialized)
+        return SDP_ERROR_UNINITIALIZED;
+
+    if((rv = sdp_com_ctx_setup(com, &ctx)) != SDP_SUCCESS)
+    {
+        log_msg(LOG_ERR, "Failed to load new credentials, keeping the current ones");
+        return rv;
+    }
+
+    // an SSL object in use holds its own reference to the old context
+    SSL_CTX_free(com->ssl_ctx);
+    com->ssl_ctx = ctx;
+
+    sdp_com_forget_session(com);
+
+    log_msg(LOG_NOTICE, "Loaded new TLS credentials for the next connection");
+    return SDP_SUCCESS;
+}
+
 int sdp_com_new(sdp_com_t *r_com)
 {
     sdp_com_t com = NULL;
@@ -567,6 +852,35 @@ void sdp_com_destroy(sdp_com_t com)
     if(com->ssl != NULL)
         SSL_free(com->ssl);
 
+    if(com->session != NULL)
+        SSL_SESSION_free(com->session);
+
+    if(com->session_file != NULL)
+        free(com->session_file);
+
+    if(com->recv_buffer != NULL)
+        free(com->recv_buffer);
+
+    if(com->send_buffer != NULL)
+        free(com->send_buffer);
+
+    if(com->inflate_buffer != NULL)
+        free(com->inflate_buffer);
+
+#if HAVE_LIBZ
+    if(com->deflate_stream != NULL)
+    {
+        deflateEnd((z_stream *)com->deflate_stream);
+        free(com->deflate_stream);
+    }
+
+    if(com->inflate_stream != NULL)
+    {
+        inflateEnd((z_stream *)com->inflate_stream);
+        free(com->inflate_stream);
+    }
+#endif
+
     if(com->ssl_ctx != NULL)
         SSL_CTX_free(com->ssl_ctx);
 
@@ -603,17 +917,58 @@ int sdp_com_state_get(sdp_com_t com, int *state)
 }
 
 
+/*
+ * A random number from 0 to max, used to spread out timers that would
+ * otherwise fire in step across a whole fleet of gateways and clients
+ */
+unsigned int sdp_com_jitter(unsigned int max)
+{
+    uint32_t r = 0;
+
+    if(max == 0)
+        return 0;
+
+    if(RAND_bytes((unsigned char*)&r, sizeof(r)) != 1)
+        r = (uint32_t)random();
+
+    return r % (max + 1);
+}
+
+
+/*
+ * Decorrelated jitter backoff. The next wait is drawn between the initial
+ * interval and three times the previous wait, so reconnecting peers drift
+ * apart instead of retrying together after a controller outage.
+ */
+static unsigned int sdp_com_next_backoff(sdp_com_t com)
+{
+    unsigned int base = com->initial_conn_attempt_interval ? com->initial_conn_attempt_interval : 1;
+    unsigned int prev = com->conn_retry_interval ? com->conn_retry_interval : base;
+    unsigned int high = prev * 3;
+
+    if(high > SDP_COM_MAX_RETRY_INTERVAL_SECONDS)
+        high = SDP_COM_MAX_RETRY_INTERVAL_SECONDS;
+    if(high < base)
+        high = base;
+
+    return base + sdp_com_jitter(high - base);
+}
+
+
 int sdp_com_connect(sdp_com_t com)
 {
     int rv = SDP_SUCCESS;
     uint32_t interval;
     int attempts_remaining;
     char *plural;
+    time_t now;
 
     if(com == NULL || !com->initialized)
         return SDP_ERROR_UNINITIALIZED;
 
-    interval = com->initial_conn_attempt_interval;
+    // a lost connection is not retried by everyone at the same moment
+    if((now = time(NULL)) < com->next_conn_attempt)
+        sleep(com->next_conn_attempt - now);
 
     while(com->conn_state != SDP_COM_CONNECTED)
     {
@@ -663,19 +1018,18 @@ int sdp_com_connect(sdp_com_t com)
                 }
             }
 
+            com->conn_retry_interval = interval = sdp_com_next_backoff(com);
+
             log_msg(LOG_WARNING,
                     "Waiting %d seconds until retry",
                     interval);
             sleep(interval);
-
-            interval *= 2;
-            if(interval > SDP_COM_MAX_RETRY_INTERVAL_SECONDS)
-                interval = SDP_COM_MAX_RETRY_INTERVAL_SECONDS;
         }
         else
         {
             // have successfully connected
             com->conn_attempts = 0;
+            com->conn_retry_interval = 0;
             com->conn_state = SDP_COM_CONNECTED;
             break;
         }
@@ -685,6 +1039,75 @@ int sdp_com_connect(sdp_com_t com)
 }
 
 
+/*
+ * Event loop counterpart of sdp_com_connect(). Each call moves the
+ * connection along without waiting: a pending handshake is continued,
+ * and when disconnected a new attempt starts once the retry backoff has
+ * passed. Call it whenever the socket is ready and on a periodic tick.
+ * Returns an error only once max_conn_attempts have failed.
+ */
+int sdp_com_connect_step(sdp_com_t com)
+{
+    int rv = SDP_SUCCESS;
+    time_t now = time(NULL);
+
+    if(com == NULL || !com->initialized)
+        return SDP_ERROR_UNINITIALIZED;
+
+    if(com->conn_state == SDP_COM_CONNECTED)
+        return SDP_SUCCESS;
+
+    if(com->conn_state == SDP_COM_DISCONNECTED)
+    {
+        if(now < com->next_conn_attempt)
+            return SDP_SUCCESS;
+
+        com->conn_attempts += 1;
+        log_msg(LOG_NOTICE, "Starting connection attempt %d", com->conn_attempts);
+
+        // if SPA required, send SPA
+        if(com->use_spa && (rv = com->func_ptr_send_spa(com)) != SDP_SUCCESS)
+        {
+            // SPA failure can only be a failure on our side
+            // so it's fatal
+            log_msg(LOG_ERR, "Failed to send SPA, exiting");
+            return rv;
+        }
+
+        rv = sdp_com_connect_start(com);
+    }
+
+    if(rv == SDP_SUCCESS)
+        rv = sdp_com_connect_continue(com);
+
+    if(rv == SDP_SUCCESS)
+    {
+        if(com->conn_state == SDP_COM_CONNECTED)
+        {
+            // have successfully connected
+            com->conn_attempts = 0;
+            com->conn_retry_interval = 0;
+        }
+        return SDP_SUCCESS;
+    }
+
+    if(com->max_conn_attempts != 0 && com->conn_attempts >= com->max_conn_attempts)
+    {
+        log_msg(LOG_ERR, "Too many failed connection attempts. Exiting now");
+        return rv;
+    }
+
+    com->conn_retry_interval = sdp_com_next_backoff(com);
+
+    log_msg(LOG_WARNING, "Connection attempt %d failed, retrying in %d seconds",
+            com->conn_attempts, com->conn_retry_interval);
+
+    com->next_conn_attempt = time(NULL) + com->conn_retry_interval;
+
+    return SDP_SUCCESS;
+}
+
+
 int sdp_com_disconnect(sdp_com_t com)
 {
     if(com == NULL || !com->initialized)
@@ -692,10 +1115,17 @@ int sdp_com_disconnect(sdp_com_t com)
 
     log_msg(LOG_DEBUG, "Entered sdp_com_disconnect");
 
+    // when an established connection drops, likely along with everyone
+    // else's, wait a random part of the initial interval before the first
+    // reconnect attempt
+    if(com->conn_state == SDP_COM_CONNECTED)
+        com->next_conn_attempt = time(NULL) + sdp_com_jitter(com->initial_conn_attempt_interval);
+
     if(com->ssl != NULL)
     {
         log_msg(LOG_DEBUG, "Tearing down SSL object");
-        SSL_shutdown(com->ssl);
+        if(SSL_is_init_finished(com->ssl))
+            SSL_shutdown(com->ssl);
         SSL_free(com->ssl);
         com->ssl = NULL;
     }
@@ -711,6 +1141,20 @@ int sdp_com_disconnect(sdp_com_t com)
         com->socket_descriptor = 0;
     }
 
+    com->tcp_connected = 0;
+    com->want_write = 0;
+
+    // a partial frame from this connection will never be finished
+    com->recv_header_bytes = 0;
+    com->recv_msg_bytes = 0;
+
+    // nor will frames queued for it go out
+    com->send_pending = 0;
+
+    // the next controller connection negotiates its encoding afresh
+    com->peer_msgpack = 0;
+    com->peer_zlib = 0;
+
     com->conn_state = SDP_COM_DISCONNECTED;
 
     log_msg(LOG_DEBUG, "Exiting sdp_com_disconnect");
@@ -751,21 +1195,196 @@ int sdp_com_show_certs(sdp_com_t com)
 }
 
 
-int sdp_com_send_msg(sdp_com_t com, const char *msg)
+// The socket may be non-blocking. A write that finds the socket buffer
+// full waits for room, bounded by the write timeout, and is retried with
+// the same arguments as OpenSSL requires.
+static int sdp_com_write(sdp_com_t com, const void *buf, int len)
+{
+    struct pollfd pfd;
+    int bytes = 0;
+    int ssl_error = 0;
+    int wait_ms = com->write_timeout.tv_sec * 1000 + com->write_timeout.tv_usec / 1000;
+
+    while((bytes = SSL_write(com->ssl, buf, len)) <= 0)
+    {
+        ssl_error = SSL_get_error(com->ssl, bytes);
+        if(ssl_error != SSL_ERROR_WANT_READ && ssl_error != SSL_ERROR_WANT_WRITE)
+            break;
+
+        pfd.fd = com->socket_descriptor;
+        pfd.events = (ssl_error == SSL_ERROR_WANT_WRITE) ? POLLOUT : POLLIN;
+        pfd.revents = 0;
+
+        if(poll(&pfd, 1, wait_ms) <= 0)
+            break;
+    }
+
+    return bytes;
+}
+
+
+// Where the body of the next frame queued goes in the send buffer
+#define SDP_COM_SEND_TAIL(com) ((com)->send_buffer + (com)->send_pending + SDP_COM_HEADER_LEN)
+
+// Make room in the send buffer to queue a frame with a body of len bytes
+static int sdp_com_grow_send_buffer(sdp_com_t com, unsigned int len)
+{
+    unsigned int size = com->send_buffer_size ? com->send_buffer_size : SDP_COM_MAX_MSG_BLOCK_LEN;
+    unsigned int need = com->send_pending + SDP_COM_HEADER_LEN + len;
+    char *buf = NULL;
+
+    if(need <= com->send_buffer_size)
+        return SDP_SUCCESS;
+
+    while(size < need)
+        size *= 2;
+
+    if((buf = realloc(com->send_buffer, size)) == NULL)
+        return SDP_ERROR_MEMORY_ALLOCATION;
+
+    com->send_buffer = buf;
+    com->send_buffer_size = size;
+    return SDP_SUCCESS;
+}
+
+
+/*
+ * Write all queued frames with a single SSL_write, so that small messages
+ * share a TLS record rather than each taking at least one of their own.
+ */
+int sdp_com_flush(sdp_com_t com)
 {
-    uint32_t msg_len = 0;
     int bytes_sent = 0;
+    int len = 0;
     char ssl_error_string[SDP_MAX_LINE_LEN];
-    int ssl_error = 0;
-    //sdp_header header;
-    char header[4];
+
+    if(com == NULL || !com->initialized)
+        return SDP_ERROR_UNINITIALIZED;
+
+    if(com->send_pending == 0)
+        return SDP_SUCCESS;
+
+    if(com->conn_state != SDP_COM_CONNECTED || com->ssl == NULL)
+    {
+        com->send_pending = 0;
+        return SDP_ERROR_CONN_DOWN;
+    }
+
+    len = (int)com->send_pending;
+    com->send_pending = 0;
+
+    // encrypt and send
+    if((bytes_sent = sdp_com_write(com, com->send_buffer, len)) != len)
+    {
+        sdp_com_get_ssl_error(com->ssl, bytes_sent, ssl_error_string);
+
+        log_msg(LOG_ERR, "Error from SSL_write: %s", ssl_error_string);
+
+        // All other cases, tear down and start again
+        sdp_com_disconnect(com);
+        return SDP_ERROR_SOCKET_WRITE;
+    }
+
+    return SDP_SUCCESS;
+}
+
+
+/*
+ * Queue one frame, header and payload, in the send buffer. The payload may
+ * already be in place at SDP_COM_SEND_TAIL(). The queue is written out
+ * right away unless coalescing is on, in which case it goes once it holds
+ * a record's worth or when the caller flushes, typically before it waits
+ * for input. A frame that would take the queue past a record's worth
+ * flushes what is already there first.
+ */
+static int sdp_com_send_frame(sdp_com_t com, const void *payload, uint32_t len, uint32_t flags)
+{
+    int rv = SDP_SUCCESS;
+    uint32_t field = len | flags;
+    char *header = NULL;
+
+    if(sdp_com_grow_send_buffer(com, len) != SDP_SUCCESS)
+        return SDP_ERROR_MEMORY_ALLOCATION;
+
+    if(com->send_pending > 0
+            && com->send_pending + SDP_COM_HEADER_LEN + len > SDP_COM_COALESCE_LEN
+            && (rv = sdp_com_flush(com)) != SDP_SUCCESS)
+        return rv;
+
+    header = com->send_buffer + com->send_pending;
+    if(payload != header + SDP_COM_HEADER_LEN)
+        memmove(header + SDP_COM_HEADER_LEN, payload, len);
+
+    header[0] = (char)( (field >> 24) & 0xFF );
+    header[1] = (char)( (field >> 16) & 0xFF );
+    header[2] = (char)( (field >> 8) & 0xFF );
+    header[3] = (char)(  field & 0xFF );
+
+    com->send_pending += SDP_COM_HEADER_LEN + len;
+
+    __atomic_add_fetch(&(com->msgs_sent), 1, __ATOMIC_RELAXED);
+    FWKNOP_PROBE1(ctrl_msg_out, len);
+
+    if(!com->coalesce || com->send_pending >= SDP_COM_COALESCE_LEN)
+        return sdp_com_flush(com);
+
+    return SDP_SUCCESS;
+}
+
+
+#if HAVE_LIBZ
+// Deflate msg straight into the send buffer, where its frame would be
+// queued, with a stream that is kept and reset between messages. Returns the compressed
+// length, or 0 if the message is better sent as is.
+static uLong sdp_com_deflate(sdp_com_t com, const unsigned char *msg, int len)
+{
+    z_stream *zs = (z_stream *)com->deflate_stream;
+    uLong bound = 0;
+
+    if(zs == NULL)
+    {
+        if((zs = calloc(1, sizeof *zs)) == NULL)
+            return 0;
+        if(deflateInit(zs, Z_DEFAULT_COMPRESSION) != Z_OK)
+        {
+            free(zs);
+            return 0;
+        }
+        com->deflate_stream = zs;
+    }
+    else if(deflateReset(zs) != Z_OK)
+        return 0;
+
+    bound = deflateBound(zs, len);
+    if(sdp_com_grow_send_buffer(com, bound) != SDP_SUCCESS)
+        return 0;
+
+    zs->next_in = (Bytef *)msg;
+    zs->avail_in = len;
+    zs->next_out = (Bytef *)SDP_COM_SEND_TAIL(com);
+    zs->avail_out = bound;
+
+    if(deflate(zs, Z_FINISH) != Z_STREAM_END)
+        return 0;
+
+    if(zs->total_out >= (uLong)len || zs->total_out >= SDP_MSG_MAX_LEN)
+        return 0;
+
+    return zs->total_out;
+}
+#endif
+
+
+int sdp_com_send_msg(sdp_com_t com, const char *msg)
+{
+    uint32_t msg_len = 0;
 
     log_msg(LOG_DEBUG, "Entered sdp_com_send_msg");
 
     if(com == NULL || !com->initialized)
         return SDP_ERROR_UNINITIALIZED;
 
-    if(com->conn_state == SDP_COM_DISCONNECTED || com->ssl == NULL)
+    if(com->conn_state != SDP_COM_CONNECTED || com->ssl == NULL)
     {
         log_msg(LOG_ERR, "Failed to send message. Not connected.");
         return SDP_ERROR_CONN_DOWN;
@@ -789,62 +1408,238 @@ int sdp_com_send_msg(sdp_com_t com, const char *msg)
     log_msg(LOG_DEBUG, "Message to send: ");
     log_msg(LOG_DEBUG, "  %s", msg);
 
-    //header.length = htonl(msg_len);
-    header[0] = (char)( (msg_len >> 24) & 0xFF );
-    header[1] = (char)( (msg_len >> 16) & 0xFF );
-    header[2] = (char)( (msg_len >> 8) & 0xFF );
-    header[3] = (char)(  msg_len & 0xFF );
+    return sdp_com_send_frame(com, msg, msg_len, 0);
+}
+
 
-    if((bytes_sent = SSL_write(com->ssl, header, SDP_COM_HEADER_LEN)) != SDP_COM_HEADER_LEN){
-        ssl_error = sdp_com_get_ssl_error(com->ssl, bytes_sent, ssl_error_string);
+/*
+ * Send a MessagePack encoded message. It is deflated first when the peer
+ * has shown it handles compressed frames and the message is big enough
+ * for that to pay off.
+ */
+int sdp_com_send_binary_msg(sdp_com_t com, const unsigned char *msg, int len)
+{
+#if HAVE_LIBZ
+    uLong zlen = 0;
+#endif
 
-        log_msg(LOG_ERR, "Error from SSL_write: %s", ssl_error_string);
+    log_msg(LOG_DEBUG, "Entered sdp_com_send_binary_msg");
 
-        // All other cases, tear down and start again
-        sdp_com_disconnect(com);
-        return SDP_ERROR_SOCKET_WRITE;
+    if(com == NULL || !com->initialized)
+        return SDP_ERROR_UNINITIALIZED;
+
+    if(com->conn_state != SDP_COM_CONNECTED || com->ssl == NULL)
+    {
+        log_msg(LOG_ERR, "Failed to send message. Not connected.");
+        return SDP_ERROR_CONN_DOWN;
     }
-    
-    // encrypt and send
-    if((bytes_sent = SSL_write(com->ssl, msg, msg_len)) != msg_len)
+
+    if(msg == NULL || len <= 0)
+        return SDP_ERROR_INVALID_MSG;
+
+#if HAVE_LIBZ
+    if(com->peer_zlib && len >= SDP_COM_COMPRESS_MIN_LEN
+            && (zlen = sdp_com_deflate(com, msg, len)) > 0)
     {
-        ssl_error = sdp_com_get_ssl_error(com->ssl, bytes_sent, ssl_error_string);
+        log_msg(LOG_DEBUG, "Sending %d byte binary message deflated to %lu bytes",
+                len, (unsigned long)zlen);
+        return sdp_com_send_frame(com, SDP_COM_SEND_TAIL(com),
+                (uint32_t)zlen, SDP_COM_FRAME_MSGPACK | SDP_COM_FRAME_ZLIB);
+    }
+#endif
 
-        log_msg(LOG_ERR, "Error from SSL_write: %s", ssl_error_string);
+    if(len >= SDP_MSG_MAX_LEN)
+    {
+        log_msg(LOG_ERR, "Failed to send message, too long.");
+        return SDP_ERROR_INVALID_MSG_LONG;
+    }
 
-        if(ssl_error == SSL_ERROR_WANT_READ || ssl_error == SSL_ERROR_WANT_WRITE)
+    log_msg(LOG_DEBUG, "Sending %d byte binary message", len);
+
+    return sdp_com_send_frame(com, msg, (uint32_t)len, SDP_COM_FRAME_MSGPACK);
+}
+
+
+// A read that returned nothing either just found no data waiting or
+// found the connection gone. In the latter case tear it down, so the
+// caller reconnects instead of waiting on a dead socket.
+static int sdp_com_read_lost(sdp_com_t com, int bytes)
+{
+    char ssl_error_string[SDP_MAX_LINE_LEN];
+    int ssl_error = sdp_com_get_ssl_error(com->ssl, bytes, ssl_error_string);
+
+    if(ssl_error == SSL_ERROR_WANT_READ || ssl_error == SSL_ERROR_WANT_WRITE)
+        return 0;
+
+    log_msg(LOG_ERR, "Lost connection to controller: %s", ssl_error_string);
+    sdp_com_disconnect(com);
+    return 1;
+}
+
+
+// Make room for a message body of msg_len bytes plus a terminator
+static int sdp_com_grow_recv_buffer(sdp_com_t com, unsigned int msg_len)
+{
+    unsigned int size = com->recv_buffer_size ? com->recv_buffer_size : SDP_COM_MAX_MSG_BLOCK_LEN;
+    char *buf = NULL;
+
+    if(msg_len < com->recv_buffer_size)
+        return SDP_SUCCESS;
+
+    while(size <= msg_len)
+        size *= 2;
+
+    if((buf = realloc(com->recv_buffer, size)) == NULL)
+        return SDP_ERROR_MEMORY_ALLOCATION;
+
+    com->recv_buffer = buf;
+    com->recv_buffer_size = size;
+    return SDP_SUCCESS;
+}
+
+
+#if HAVE_LIBZ
+// Inflate a compressed frame body into the inflate buffer, refusing
+// anything that expands past SDP_COM_MAX_INFLATED_LEN. The stream and
+// the buffer are kept for the next message.
+static int sdp_com_inflate(sdp_com_t com, const char *in, unsigned int in_len,
+        unsigned int *r_out_len)
+{
+    z_stream *zs = (z_stream *)com->inflate_stream;
+    unsigned char *tmp = NULL;
+    unsigned int size = in_len * 4;
+    int zrv = Z_OK;
+
+    if(size < SDP_COM_MAX_MSG_BLOCK_LEN)
+        size = SDP_COM_MAX_MSG_BLOCK_LEN;
+    if(size < com->inflate_buffer_size)
+        size = com->inflate_buffer_size;
+
+    if(zs == NULL)
+    {
+        if((zs = calloc(1, sizeof *zs)) == NULL)
+            return SDP_ERROR_MEMORY_ALLOCATION;
+        if(inflateInit(zs) != Z_OK)
+        {
+            free(zs);
+            return SDP_ERROR_MEMORY_ALLOCATION;
+        }
+        com->inflate_stream = zs;
+    }
+    else if(inflateReset(zs) != Z_OK)
+        return SDP_ERROR_MEMORY_ALLOCATION;
+
+    zs->next_in = (Bytef *)in;
+    zs->avail_in = in_len;
+    zs->next_out = NULL;
+    zs->avail_out = 0;
+
+    while(zrv == Z_OK)
+    {
+        if(zs->avail_out == 0)
         {
-            // retry one time
-            if((bytes_sent = SSL_write(com->ssl, msg, msg_len)) == msg_len)
+            if(zs->next_out != NULL)
             {
-                log_msg(LOG_ERR, "SSL_write succeeded on second attempt");
-                return SDP_SUCCESS;
+                if(size >= SDP_COM_MAX_INFLATED_LEN)
+                {
+                    log_msg(LOG_ERR, "Compressed message inflates past %d bytes",
+                            SDP_COM_MAX_INFLATED_LEN);
+                    zrv = Z_DATA_ERROR;
+                    break;
+                }
+                size *= 2;
             }
+
+            if(size > com->inflate_buffer_size)
+            {
+                if((tmp = realloc(com->inflate_buffer, size)) == NULL)
+                {
+                    zrv = Z_MEM_ERROR;
+                    break;
+                }
+                com->inflate_buffer = tmp;
+                com->inflate_buffer_size = size;
+            }
+            zs->next_out = com->inflate_buffer + zs->total_out;
+            zs->avail_out = size - zs->total_out;
         }
 
-        // All other cases, tear down and start again
-        sdp_com_disconnect(com);
-        return SDP_ERROR_SOCKET_WRITE;
+        zrv = inflate(zs, Z_NO_FLUSH);
+    }
+
+    if(zrv != Z_STREAM_END)
+    {
+        log_msg(LOG_ERR, "Failed to inflate compressed message");
+        return zrv == Z_MEM_ERROR ? SDP_ERROR_MEMORY_ALLOCATION : SDP_ERROR_INVALID_MSG;
     }
-    // if we got here, all is well
+
+    *r_out_len = zs->total_out;
+    return SDP_SUCCESS;
+}
+#endif
+
+
+// Hand over a complete binary frame body, inflated if need be. It stays
+// in one of com's buffers, valid until the next call to sdp_com_get_msg.
+static int sdp_com_take_binary_msg(sdp_com_t com, char **r_msg, int *r_bytes)
+{
+    char *msg = com->recv_buffer;
+    unsigned int len = com->recv_msg_len;
+#if HAVE_LIBZ
+    int rv = SDP_SUCCESS;
+#endif
+
+    if(com->recv_msg_flags & SDP_COM_FRAME_ZLIB)
+    {
+#if HAVE_LIBZ
+        if((rv = sdp_com_inflate(com, com->recv_buffer, com->recv_msg_len, &len)) != SDP_SUCCESS)
+            return rv;
+        msg = (char *)com->inflate_buffer;
+        com->peer_zlib = 1;
+#else
+        log_msg(LOG_ERR, "Received compressed message, but zlib support is not built in");
+        return SDP_ERROR_INVALID_MSG;
+#endif
+    }
+
+    com->peer_msgpack = 1;
+
+    log_msg(LOG_DEBUG, "Received binary message of %u bytes", len);
+
+    *r_msg = msg;
+    *r_bytes = len;
     return SDP_SUCCESS;
 }
 
 
-int sdp_com_get_msg(sdp_com_t com, char **r_msg, int *r_bytes)
+/*
+ * Messages are framed by a 4 byte length header. A frame may arrive split
+ * across any number of TLS records, so whatever part of it is available
+ * is read and kept in com, and the next call picks up where this one left
+ * off. The body is read in blocks of at most SDP_COM_MAX_MSG_BLOCK_LEN.
+ * Returns a message only once its whole frame is in; otherwise *r_bytes
+ * is 0. *r_binary is set for MessagePack frames, whose body is returned
+ * as is rather than as a string. The message is left in com's receive
+ * buffers rather than copied, so it is only good until the next call and
+ * must not be freed.
+ */
+int sdp_com_get_msg(sdp_com_t com, char **r_msg, int *r_bytes, int *r_binary)
 {
+    int rv = SDP_SUCCESS;
     int bytes = 0;
-    int total_bytes = 0;
+    unsigned int want = 0;
     char *msg = NULL;
-    unsigned int data_length = 0;
-    sdp_header header;
 
     if(com == NULL || !com->initialized)
         return SDP_ERROR_UNINITIALIZED;
 
-    if(com->conn_state == SDP_COM_DISCONNECTED)
+    if(com->conn_state != SDP_COM_CONNECTED)
         return SDP_ERROR_CONN_DOWN;
 
+    *r_msg = NULL;
+    *r_bytes = 0;
+    *r_binary = 0;
+
     /* Always returns 0, even when data is available
     if((bytes = SSL_pending(com->ssl)) == 0)
     {
@@ -855,71 +1650,94 @@ int sdp_com_get_msg(sdp_com_t com, char **r_msg, int *r_bytes)
     }
     */
 
-    if((bytes = SSL_read(com->ssl, &header, SDP_COM_HEADER_LEN)) <= 0) {
-        log_msg(LOG_DEBUG, "No data to read right now");
-        *r_bytes = 0;
-        return SDP_SUCCESS;
-    }
+    while(com->recv_header_bytes < SDP_COM_HEADER_LEN)
+    {
+        if((bytes = SSL_read(com->ssl, com->recv_header + com->recv_header_bytes,
+                        SDP_COM_HEADER_LEN - com->recv_header_bytes)) <= 0)
+        {
+            if(!sdp_com_read_lost(com, bytes))
+                log_msg(LOG_DEBUG, "No data to read right now");
+            return SDP_SUCCESS;
+        }
 
-    if (bytes != SDP_COM_HEADER_LEN) {
-        log_msg(LOG_ERR, "Header found was shorter than minimum message size");
-        return SDP_ERROR_INVALID_MSG_SHORT;
-    }
+        if((com->recv_header_bytes += bytes) < SDP_COM_HEADER_LEN)
+            continue;
 
-    data_length = ntohl(header.length);
+        com->recv_msg_len = ((unsigned int)com->recv_header[0] << 24)
+                          | ((unsigned int)com->recv_header[1] << 16)
+                          | ((unsigned int)com->recv_header[2] << 8)
+                          |  (unsigned int)com->recv_header[3];
+        com->recv_msg_flags = com->recv_msg_len & ~SDP_COM_FRAME_LEN_MASK;
+        com->recv_msg_len &= SDP_COM_FRAME_LEN_MASK;
+        com->recv_msg_bytes = 0;
 
-    if (data_length > SDP_COM_MAX_MSG_BLOCK_LEN) {
-        log_msg(LOG_ERR, "Header length field indicates message sizes longer than the maximum");
-        log_msg(LOG_ERR, "Length field: %u; maximum: %d", data_length, SDP_COM_MAX_MSG_BLOCK_LEN);
-        return SDP_ERROR_INVALID_MSG_LONG;
+        if(com->recv_msg_len >= SDP_MSG_MAX_LEN)
+        {
+            log_msg(LOG_ERR, "Header length field indicates message sizes longer than the maximum");
+            log_msg(LOG_ERR, "Length field: %u; maximum: %d", com->recv_msg_len, SDP_MSG_MAX_LEN - 1);
+            // the stream can't be followed past a bad frame
+            sdp_com_disconnect(com);
+            return SDP_ERROR_INVALID_MSG_LONG;
+        }
+
+        if(com->recv_msg_flags & ~(SDP_COM_FRAME_MSGPACK | SDP_COM_FRAME_ZLIB))
+        {
+            log_msg(LOG_ERR, "Header carries unknown frame flags 0x%08x", com->recv_msg_flags);
+            sdp_com_disconnect(com);
+            return SDP_ERROR_INVALID_MSG;
+        }
+
+        if(!(com->recv_msg_flags & SDP_COM_FRAME_MSGPACK)
+                && com->recv_msg_len < SDP_MSG_MIN_LEN)
+        {
+            log_msg(LOG_ERR, "Header length field indicates message shorter than minimum message size");
+            sdp_com_disconnect(com);
+            return SDP_ERROR_INVALID_MSG_SHORT;
+        }
+
+        if((rv = sdp_com_grow_recv_buffer(com, com->recv_msg_len)) != SDP_SUCCESS)
+        {
+            sdp_com_disconnect(com);
+            return rv;
+        }
     }
 
-    if((bytes = SSL_read(com->ssl, com->recv_buffer, data_length)) <= 0)
+    while(com->recv_msg_bytes < com->recv_msg_len)
     {
-        log_msg(LOG_ERR, "Data found was shorter than minimum message size");
-        return SDP_ERROR_INVALID_MSG_SHORT;
-    }
+        want = com->recv_msg_len - com->recv_msg_bytes;
+        if(want > SDP_COM_MAX_MSG_BLOCK_LEN)
+            want = SDP_COM_MAX_MSG_BLOCK_LEN;
 
-    if (bytes != data_length) {
-        log_msg(LOG_ERR, "Data read was short %d of %d", bytes, data_length);
-        return SDP_ERROR_INVALID_MSG_SHORT;
+        if((bytes = SSL_read(com->ssl, com->recv_buffer + com->recv_msg_bytes, want)) <= 0)
+        {
+            if(!sdp_com_read_lost(com, bytes))
+                log_msg(LOG_DEBUG, "Have %u of %u message bytes, waiting for the rest",
+                        com->recv_msg_bytes, com->recv_msg_len);
+            return SDP_SUCCESS;
+        }
+
+        com->recv_msg_bytes += bytes;
     }
 
-    log_msg(LOG_DEBUG, "Initial socket read returned %d bytes", bytes);
+    // frame complete, the next call starts on a new header
+    com->recv_header_bytes = 0;
+    __atomic_add_fetch(&(com->msgs_received), 1, __ATOMIC_RELAXED);
+    FWKNOP_PROBE1(ctrl_msg_in, com->recv_msg_len);
 
-    if(bytes < SDP_MSG_MIN_LEN)
+    if(com->recv_msg_flags & SDP_COM_FRAME_MSGPACK)
     {
-        log_msg(LOG_ERR, "Data found was shorter than minimum message size");
-        return SDP_ERROR_INVALID_MSG_SHORT;
+        *r_binary = 1;
+        return sdp_com_take_binary_msg(com, r_msg, r_bytes);
     }
 
-    if((msg = strndup(com->recv_buffer, (size_t)bytes)) == NULL)
-        return SDP_ERROR_MEMORY_ALLOCATION;
-
-    total_bytes = bytes;
+    // the buffer always has room past the body for a terminator
+    msg = com->recv_buffer;
+    msg[com->recv_msg_len] = '\0';
 
-    // if necessary, keep reading input from controller
-    while(bytes >= SDP_COM_MAX_MSG_BLOCK_LEN)
-    {
-        log_msg(LOG_DEBUG, "Checking for additional data waiting in stream");
-        if((bytes = SSL_read(com->ssl, com->recv_buffer, SDP_COM_MAX_MSG_BLOCK_LEN)) > 0)
-        {
-            if((msg = strncat(msg, com->recv_buffer, (size_t)bytes)) == NULL)
-                return SDP_ERROR_MEMORY_ALLOCATION;
-
-            if((total_bytes += bytes) > SDP_MSG_MAX_LEN)
-            {
-                log_msg(LOG_ERR,
-                        "Socket read resulted in too much data: %d bytes. Possible attack.",
-                        total_bytes);
-                free(msg);
-                return SDP_ERROR_INVALID_MSG_LONG;
-            }
-        }
-    }
+    log_msg(LOG_DEBUG, "Received message of %u bytes", com->recv_msg_len);
 
     *r_msg = msg;
-    *r_bytes = total_bytes;
+    *r_bytes = com->recv_msg_len;
     return SDP_SUCCESS;
 }
 
@@ -12,6 +12,7 @@
 #include <openssl/ssl.h>
 #include <openssl/crypto.h>
 #include <openssl/err.h>
+#include <openssl/pem.h>
 
 
 
@@ -21,6 +22,14 @@ typedef struct sdp_header {
 
 #define SDP_COM_HEADER_LEN sizeof(sdp_header)
 
+// The top bits of the length field flag frames that are not plain JSON.
+// Lengths never exceed SDP_MSG_MAX_LEN, so older peers reject these frames
+// rather than misread them, and they are only sent to a peer that has
+// sent one itself.
+#define SDP_COM_FRAME_MSGPACK   0x80000000
+#define SDP_COM_FRAME_ZLIB      0x40000000
+#define SDP_COM_FRAME_LEN_MASK  0x00ffffff
+
 enum {
 	SDP_COM_SSL_CONNECT_SUCCESS = 1,
 	SDP_COM_MAX_PORT_STRING_BUFFER_LEN = 6,
@@ -32,13 +41,19 @@ enum {
 	SDP_COM_MAX_MSG_BLOCK_LEN = 16384,
 	SDP_COM_MAX_Q_LEN = 100,
 	SDP_COM_MAX_FWKNOP_ARGS = 6,
-	SDP_COM_MAX_FWKNOP_CMD_LEN = SDP_COM_MAX_PATH_LEN + SDP_COM_MAX_LINE_LEN + 100
+	SDP_COM_MAX_FWKNOP_CMD_LEN = SDP_COM_MAX_PATH_LEN + SDP_COM_MAX_LINE_LEN + 100,
+	SDP_COM_CONNECT_TIMEOUT_SECONDS = 15,
+	SDP_COM_CONNECT_POLL_MS = 1000,
+	SDP_COM_COMPRESS_MIN_LEN = 512,
+	SDP_COM_COALESCE_LEN = 16384,
+	SDP_COM_MAX_INFLATED_LEN = 16 * 65536
 };
 
 
 typedef enum {
 	SDP_COM_DISCONNECTED = 0,
 	SDP_COM_CONNECTED,
+	SDP_COM_CONNECTING,
 } sdp_com_state_t;
 
 
@@ -61,6 +76,10 @@ struct sdp_com{
 	char *ca_cert_file;
 	SSL_CTX *ssl_ctx;
 	SSL *ssl;
+	// last TLS session from the controller, offered for resumption on
+	// the next connect and kept in session_file across restarts
+	SSL_SESSION *session;
+	char *session_file;
 	int socket_descriptor;
 	struct timespec post_spa_delay;
 	struct timeval read_timeout;
@@ -68,7 +87,42 @@ struct sdp_com{
 	unsigned int max_conn_attempts;
 	unsigned int conn_attempts;
 	unsigned int initial_conn_attempt_interval;
-	char recv_buffer[SDP_COM_MAX_MSG_BLOCK_LEN];
+	// non-blocking connect progress, see sdp_com_connect_step()
+	int tcp_connected;
+	int want_write;
+	time_t connect_deadline;
+	time_t next_conn_attempt;
+	unsigned int conn_retry_interval;
+	// frame being received, kept across calls until it is complete
+	unsigned char recv_header[SDP_COM_HEADER_LEN];
+	unsigned int recv_header_bytes;
+	char *recv_buffer;
+	unsigned int recv_buffer_size;
+	unsigned int recv_msg_len;
+	uint32_t recv_msg_flags;
+	unsigned int recv_msg_bytes;
+	// pooled buffers, kept at their high-water mark so steady traffic
+	// does not allocate: outgoing frames are assembled in send_buffer,
+	// compressed bodies inflate into inflate_buffer, and the zlib streams
+	// (z_stream, when built with zlib) are reset rather than rebuilt
+	char *send_buffer;
+	unsigned int send_buffer_size;
+	// frames queued in send_buffer, written together by sdp_com_flush();
+	// with coalesce off each frame is written as soon as it is queued
+	unsigned int send_pending;
+	int coalesce;
+	unsigned char *inflate_buffer;
+	unsigned int inflate_buffer_size;
+	void *deflate_stream;
+	void *inflate_stream;
+	// binary encoding, offered by this end and learned from the peer
+	int offer_msgpack;
+	int peer_msgpack;
+	int peer_zlib;
+	// link statistics, read by other threads for the metrics endpoint
+	unsigned long connects;
+	unsigned long msgs_sent;
+	unsigned long msgs_received;
 	//char **message_queue;
 	//unsigned int message_queue_len;
 };
@@ -80,9 +134,15 @@ int sdp_com_new(sdp_com_t *r_com);
 void sdp_com_destroy(sdp_com_t com);
 int  sdp_com_state_get(sdp_com_t com, int *state);
 int  sdp_com_connect(sdp_com_t com);
+int  sdp_com_connect_step(sdp_com_t com);
+int  sdp_com_connect_continue(sdp_com_t com);
 int  sdp_com_disconnect(sdp_com_t com);
 int  sdp_com_show_certs(sdp_com_t com);
+int  sdp_com_reload_certs(sdp_com_t com);
 int  sdp_com_send_msg(sdp_com_t com, const char *msg);
-int  sdp_com_get_msg(sdp_com_t com, char **r_msg, int *r_bytes);
+int  sdp_com_send_binary_msg(sdp_com_t com, const unsigned char *msg, int len);
+int  sdp_com_flush(sdp_com_t com);
+int  sdp_com_get_msg(sdp_com_t com, char **r_msg, int *r_bytes, int *r_binary);
+unsigned int sdp_com_jitter(unsigned int max);
 
 #endif /* SDP_COM_H_ */
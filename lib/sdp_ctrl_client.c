@@ -5,6 +5,9 @@
  *      Author: Daniel Bailey
  */
 
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif
 #include "sdp_ctrl_client.h"
 #include "sdp_ctrl_client_config.h"
 #include "sdp_log_msg.h"
@@ -94,9 +97,20 @@ static int  sdp_ctrl_client_write_pid_file(sdp_ctrl_client_t client, pid_t *r_ol
 static int  sdp_ctrl_client_get_running_pid(sdp_ctrl_client_t client, pid_t *r_pid);
 static int  sdp_ctrl_client_verify_file_perms(const char *file);
 static int  sdp_ctrl_client_loop(sdp_ctrl_client_t client);
-static void sdp_ctrl_client_clear_state_vars(sdp_ctrl_client_t client);
-static void sdp_ctrl_client_set_request_vars(sdp_ctrl_client_t client, sdp_ctrl_client_state_t new_state);
-//static void sdp_ctrl_client_set_failed_request_vars(sdp_ctrl_client_t client, sdp_ctrl_client_state_t new_state);
+static uint32_t sdp_ctrl_client_req_id(sdp_ctrl_client_t client, sdp_ctrl_client_req_type_t type);
+static void sdp_ctrl_client_req_sent(sdp_ctrl_client_t client, sdp_ctrl_client_req_type_t type, uint32_t id);
+static void sdp_ctrl_client_req_done(sdp_ctrl_client_t client, sdp_ctrl_client_req_type_t type);
+static int  sdp_ctrl_client_req_answered(sdp_ctrl_client_t client, sdp_ctrl_client_req_type_t type,
+        uint32_t request_id);
+static int  sdp_ctrl_client_consider_request(sdp_ctrl_client_t client,
+        sdp_ctrl_client_req_type_t type, time_t last, int interval);
+static void sdp_ctrl_client_connected(sdp_ctrl_client_t client);
+static int  sdp_ctrl_client_accept_data_version(sdp_ctrl_client_t client, int is_access,
+        int64_t version, uint32_t request_id);
+static int  sdp_ctrl_client_send(sdp_ctrl_client_t client, const char *action,
+        json_object *jdata, uint32_t request_id);
+static int  sdp_ctrl_client_send_refresh_request(sdp_ctrl_client_t client, uint32_t request_id,
+        const char *action, int64_t version);
 static int  sdp_ctrl_client_save_credentials(sdp_ctrl_client_t client, sdp_creds_t creds);
 static void sdp_ctrl_client_destroy_internals(sdp_ctrl_client_t client);
 static int  sdp_ctrl_client_restart_myself(sdp_ctrl_client_t client);
@@ -433,9 +447,36 @@ int sdp_ctrl_client_connect(sdp_ctrl_client_t client)
     res = sdp_com_connect(client->com);
 
     if(res == SDP_SUCCESS)
-    {
-        client->initial_conn_time = client->last_contact = time(NULL);
-    }
+        sdp_ctrl_client_connected(client);
+
+    return res;
+}
+
+
+/**
+ * @brief Move a non-blocking connection to the controller along
+ *
+ * For callers driving the client from an event loop. Never waits; see
+ * sdp_com_connect_step().
+ *
+ * @param client - sdp_ctrl_client_t object.
+ *
+ * @return SDP_SUCCESS or an error code once connection attempts run out.
+ */
+int sdp_ctrl_client_connect_step(sdp_ctrl_client_t client)
+{
+    int res = SDP_SUCCESS;
+    int was_connected = 0;
+
+    if(client == NULL || !client->initialized)
+        return SDP_ERROR_UNINITIALIZED;
+
+    was_connected = (client->com->conn_state == SDP_COM_CONNECTED);
+
+    res = sdp_com_connect_step(client->com);
+
+    if(res == SDP_SUCCESS && !was_connected && client->com->conn_state == SDP_COM_CONNECTED)
+        sdp_ctrl_client_connected(client);
 
     return res;
 }
@@ -513,6 +554,42 @@ int sdp_ctrl_client_status(sdp_ctrl_client_t client)
     return SDP_ERROR;
 }
 
+/**
+ * @brief Check for a running (daemonized) ctrl client without side effects
+ *
+ * Unlike sdp_ctrl_client_status(), this never takes the PID file lock, so
+ * a process that only wants to know whether a resident client already
+ * holds the controller session can ask before deciding to fork one.
+ *
+ * @param client - sdp_ctrl_client_t object.
+ * @param r_pid - PID of the lock holder, 0 if there is none.
+ *
+ * @return 1 if another process holds the PID file lock, 0 otherwise.
+ */
+int sdp_ctrl_client_running(sdp_ctrl_client_t client, pid_t *r_pid)
+{
+    struct flock lock;
+    int fd;
+
+    *r_pid = 0;
+
+    if(client == NULL || !client->initialized || client->pid_file == NULL)
+        return 0;
+
+    if((fd = open(client->pid_file, O_RDONLY)) < 0)
+        return 0;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type   = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+
+    if(fcntl(fd, F_GETLK, &lock) == 0 && lock.l_type != F_UNLCK)
+        *r_pid = lock.l_pid;
+
+    close(fd);
+    return *r_pid > 0;
+}
+
 /**
  * @brief Print all sdp ctrl client settings in a human-readable format
  *
@@ -544,7 +621,7 @@ void sdp_ctrl_client_describe(sdp_ctrl_client_t client)
     cp += sdp_append_msg_to_buf(dump_buf+cp, buf_len-cp, "                                 Use SPA: %s\n", YES_OR_NO(client->com->use_spa) );
     cp += sdp_append_msg_to_buf(dump_buf+cp, buf_len-cp, "           Remain connected after update: %s\n", YES_OR_NO(client->remain_connected) );
     cp += sdp_append_msg_to_buf(dump_buf+cp, buf_len-cp, "                       Run in foreground: %s\n", YES_OR_NO(client->foreground) );
-    cp += sdp_append_msg_to_buf(dump_buf+cp, buf_len-cp, "                               Connected: %s\n", YES_OR_NO((int)client->com->conn_state) );
+    cp += sdp_append_msg_to_buf(dump_buf+cp, buf_len-cp, "                               Connected: %s\n", YES_OR_NO((client->com->conn_state == SDP_COM_CONNECTED)) );
     cp += sdp_append_msg_to_buf(dump_buf+cp, buf_len-cp, "                  Last credential update: %s",   ctime( &(client->last_cred_update) ) );
     cp += sdp_append_msg_to_buf(dump_buf+cp, buf_len-cp, "                 Last full access update: %s",   ctime( &(client->last_access_refresh) ) );
     cp += sdp_append_msg_to_buf(dump_buf+cp, buf_len-cp, "              Credential update interval: %d seconds\n", client->cred_update_interval);
@@ -591,17 +668,17 @@ int sdp_ctrl_client_get_addr(sdp_ctrl_client_t client, char **r_addr)
 int sdp_ctrl_client_check_inbox(sdp_ctrl_client_t client, int *r_action, void **r_data)
 {
     int rv = SDP_SUCCESS;
-    int bytes, msg_cnt = 0;
+    int bytes, binary, msg_cnt = 0;
     char *msg = NULL;
     void *data = NULL;
+    int64_t version = 0;
+    uint32_t request_id = 0;
     ctrl_action_t action = INVALID_CTRL_ACTION;
 
+    // each message stays in com's receive buffer until the next is read
     while(msg_cnt < client->message_queue_len)
     {
-        free(msg);
-        msg = NULL;
-
-        if((rv = sdp_com_get_msg(client->com, &msg, &bytes)) != SDP_SUCCESS)
+        if((rv = sdp_com_get_msg(client->com, &msg, &bytes, &binary)) != SDP_SUCCESS)
         {
             log_msg(LOG_ERR, "Error when trying to retrieve message from com.");
             goto cleanup;
@@ -615,7 +692,13 @@ int sdp_ctrl_client_check_inbox(sdp_ctrl_client_t client, int *r_action, void **
 
         msg_cnt++;
 
-        if((rv = sdp_message_process(msg, &action, &data)) != SDP_SUCCESS)
+        if(binary)
+            rv = sdp_message_process_msgpack((unsigned char *)msg, bytes, &action, &data,
+                    &version, &request_id);
+        else
+            rv = sdp_message_process(msg, &action, &data, &version, &request_id);
+
+        if(rv != SDP_SUCCESS)
         {
             log_msg(LOG_ERR, "Message processing failed");
             goto cleanup;
@@ -631,6 +714,8 @@ int sdp_ctrl_client_check_inbox(sdp_ctrl_client_t client, int *r_action, void **
             case CTRL_ACTION_KEEP_ALIVE:
                 log_msg(LOG_INFO, "Keep-alive response received");
                 sdp_ctrl_client_process_keep_alive(client);
+                if(sdp_ctrl_client_req_answered(client, SDP_CTRL_CLIENT_REQ_KEEP_ALIVE, request_id))
+                    sdp_ctrl_client_req_done(client, SDP_CTRL_CLIENT_REQ_KEEP_ALIVE);
                 break;
 
             case CTRL_ACTION_CREDENTIAL_UPDATE:
@@ -643,23 +728,39 @@ int sdp_ctrl_client_check_inbox(sdp_ctrl_client_t client, int *r_action, void **
                     log_msg(LOG_ERR, "Failed to process credential update.");
                     goto cleanup;
                 }
+                if(sdp_ctrl_client_req_answered(client, SDP_CTRL_CLIENT_REQ_CRED_UPDATE, request_id))
+                    sdp_ctrl_client_req_done(client, SDP_CTRL_CLIENT_REQ_CRED_UPDATE);
                 break;
 
             case CTRL_ACTION_SERVICE_REFRESH:
                 log_msg(LOG_NOTICE, "Service data refresh received");
                 client->last_service_refresh = time(NULL);
+                client->service_version = version;
+                sdp_ctrl_client_req_answered(client, SDP_CTRL_CLIENT_REQ_SERVICE_REFRESH, request_id);
                 *r_action = action;
                 *r_data = data;
                 goto cleanup;
 
             case CTRL_ACTION_SERVICE_UPDATE:
                 log_msg(LOG_NOTICE, "Service data update received");
+                if(!sdp_ctrl_client_accept_data_version(client, 0, version, request_id))
+                {
+                    json_object_put((json_object*)data);
+                    data = NULL;
+                    break;
+                }
                 *r_action = action;
                 *r_data = data;
                 goto cleanup;
 
             case CTRL_ACTION_SERVICE_REMOVE:
                 log_msg(LOG_NOTICE, "Service data remove received");
+                if(!sdp_ctrl_client_accept_data_version(client, 0, version, request_id))
+                {
+                    json_object_put((json_object*)data);
+                    data = NULL;
+                    break;
+                }
                 *r_action = action;
                 *r_data = data;
                 goto cleanup;
@@ -667,18 +768,55 @@ int sdp_ctrl_client_check_inbox(sdp_ctrl_client_t client, int *r_action, void **
             case CTRL_ACTION_ACCESS_REFRESH:
                 log_msg(LOG_NOTICE, "Access data refresh received");
                 client->last_access_refresh = time(NULL);
+                client->access_version = version;
+                sdp_ctrl_client_req_answered(client, SDP_CTRL_CLIENT_REQ_ACCESS_REFRESH, request_id);
                 *r_action = action;
                 *r_data = data;
                 goto cleanup;
 
             case CTRL_ACTION_ACCESS_UPDATE:
                 log_msg(LOG_NOTICE, "Access data update received");
+                if(!sdp_ctrl_client_accept_data_version(client, 1, version, request_id))
+                {
+                    json_object_put((json_object*)data);
+                    data = NULL;
+                    break;
+                }
                 *r_action = action;
                 *r_data = data;
                 goto cleanup;
 
             case CTRL_ACTION_ACCESS_REMOVE:
                 log_msg(LOG_NOTICE, "Access data remove received");
+                if(!sdp_ctrl_client_accept_data_version(client, 1, version, request_id))
+                {
+                    json_object_put((json_object*)data);
+                    data = NULL;
+                    break;
+                }
+                *r_action = action;
+                *r_data = data;
+                goto cleanup;
+
+            case CTRL_ACTION_CONN_ACK:
+                log_msg(LOG_DEBUG, "Connection report ack received");
+                *r_action = action;
+                *r_data = data;
+                goto cleanup;
+
+            case CTRL_ACTION_CONN_SNAPSHOT_REQUEST:
+                log_msg(LOG_NOTICE, "Connection snapshot request received");
+                *r_action = action;
+                goto cleanup;
+
+            case CTRL_ACTION_GRANT_SNAPSHOT:
+                log_msg(LOG_NOTICE, "Access grant snapshot received");
+                *r_action = action;
+                *r_data = data;
+                goto cleanup;
+
+            case CTRL_ACTION_CLUSTER_UPDATE:
+                log_msg(LOG_NOTICE, "Cluster update received");
                 *r_action = action;
                 *r_data = data;
                 goto cleanup;
@@ -691,7 +829,99 @@ int sdp_ctrl_client_check_inbox(sdp_ctrl_client_t client, int *r_action, void **
     }  // END while(msg_cnt < q_len)
 
 cleanup:
-    free(msg);
+    return rv;
+}
+
+
+// Decide whether an access or service update/remove message can be applied.
+// A versioned delta must follow directly on the version we hold, otherwise
+// something was missed and a full refresh is requested in its place.
+static int sdp_ctrl_client_accept_data_version(sdp_ctrl_client_t client, int is_access,
+        int64_t version, uint32_t request_id)
+{
+    int64_t *cur_version = is_access ? &(client->access_version) : &(client->service_version);
+    time_t *last_refresh = is_access ? &(client->last_access_refresh) : &(client->last_service_refresh);
+    sdp_ctrl_client_req_type_t refresh = is_access ?
+        SDP_CTRL_CLIENT_REQ_ACCESS_REFRESH : SDP_CTRL_CLIENT_REQ_SERVICE_REFRESH;
+
+    // unversioned data, apply it as is but stop tracking versions
+    if(version == 0)
+    {
+        *cur_version = 0;
+        return 1;
+    }
+
+    if(*cur_version != 0 && version == *cur_version + 1)
+    {
+        *cur_version = version;
+
+        // the controller may answer a versioned refresh request with deltas
+        if(sdp_ctrl_client_req_answered(client, refresh, request_id))
+            *last_refresh = time(NULL);
+
+        return 1;
+    }
+
+    log_msg(LOG_WARNING, "Received %s data version %lld but hold version %lld, "
+            "discarding it and requesting a full refresh", is_access ? "access" : "service",
+            (long long)version, (long long)*cur_version);
+
+    // makes the next consider_*_refresh call send the request
+    *cur_version = 0;
+    *last_refresh = 0;
+    return 0;
+}
+
+
+/*
+ * Make a message and send it off, as MessagePack once the controller has
+ * sent us a binary frame, otherwise as JSON text
+ */
+static int sdp_ctrl_client_send(sdp_ctrl_client_t client, const char *action,
+        json_object *jdata, uint32_t request_id)
+{
+    int rv = SDP_SUCCESS;
+    const char *msg = NULL;
+    const unsigned char *bin_msg = NULL;
+    int bin_len = 0;
+
+    // both are made in the message layer's pooled buffers, nothing to free
+    if(client->com->peer_msgpack)
+    {
+        if((rv = sdp_message_make_msgpack(action, jdata, request_id, &bin_msg, &bin_len)) != SDP_SUCCESS)
+            return rv;
+
+        return sdp_com_send_binary_msg(client->com, bin_msg, bin_len);
+    }
+
+    if((rv = sdp_message_make(action, jdata, request_id, &msg)) != SDP_SUCCESS)
+        return rv;
+
+    return sdp_com_send_msg(client->com, msg);
+}
+
+
+// Send a refresh request. If we hold a versioned table, tell the controller
+// which version so it can answer with just the changes since then.
+static int sdp_ctrl_client_send_refresh_request(sdp_ctrl_client_t client, uint32_t request_id,
+        const char *action, int64_t version)
+{
+    int rv = SDP_SUCCESS;
+    json_object *jdata = NULL;
+
+    if(version > 0)
+    {
+        if((jdata = json_object_new_object()) == NULL)
+            return SDP_ERROR_MEMORY_ALLOCATION;
+
+        json_object_object_add(jdata, sdp_key_version, json_object_new_int64(version));
+    }
+
+    rv = sdp_ctrl_client_send(client, action, jdata, request_id);
+
+    if(jdata != NULL)
+        json_object_put(jdata);
+
     return rv;
 }
 
@@ -700,148 +930,118 @@ int sdp_ctrl_client_request_keep_alive(sdp_ctrl_client_t client)
 {
     //int bytes = 0;
     int rv = SDP_ERROR_KEEP_ALIVE;
+    uint32_t id = 0;
     //ctrl_response_result_t result = BAD_RESULT;
-    char *msg = NULL;
+    json_object *jdata = NULL;
+    json_object *jencodings = NULL;
 
     if(client == NULL || !client->initialized)
         return SDP_ERROR_UNINITIALIZED;
 
-    if(client->com->conn_state == SDP_COM_DISCONNECTED)
+    if(client->com->conn_state != SDP_COM_CONNECTED)
         return SDP_ERROR_CONN_DOWN;
 
-    if(client->client_state != SDP_CTRL_CLIENT_STATE_READY &&
-       client->client_state != SDP_CTRL_CLIENT_STATE_KEEP_ALIVE_UNFULFILLED &&
-       client->client_state != SDP_CTRL_CLIENT_STATE_KEEP_ALIVE_REQUESTING)
+    // Until the controller answers in MessagePack, offer it with each
+    // keep alive. A controller that knows the encoding switches by
+    // replying with a binary frame; one that doesn't ignores the offer.
+    if(client->com->offer_msgpack && !client->com->peer_msgpack)
     {
-        log_msg(LOG_DEBUG, "Control Client not in proper state to request keep alive.");
-        return SDP_ERROR_STATE;
-    }
+        if((jdata = json_object_new_object()) == NULL
+                || (jencodings = json_object_new_array()) == NULL)
+        {
+            rv = SDP_ERROR_MEMORY_ALLOCATION;
+            goto cleanup;
+        }
 
-    // Make the proper message
-    if((rv = sdp_message_make(sdp_action_keep_alive, NULL, &msg)) != SDP_SUCCESS)
-    {
-        log_msg(LOG_ERR, "Failed to make keep alive message.");
-        goto cleanup;
+        json_object_array_add(jencodings, json_object_new_string(sdp_encoding_msgpack));
+#if HAVE_LIBZ
+        json_object_array_add(jencodings, json_object_new_string(sdp_encoding_zlib));
+#endif
+        json_object_object_add(jdata, sdp_key_encodings, jencodings);
     }
 
-    // Send it off
-    if((rv = sdp_com_send_msg(client->com, msg)) != SDP_SUCCESS)
+    // Make the proper message and send it off
+    id = sdp_ctrl_client_req_id(client, SDP_CTRL_CLIENT_REQ_KEEP_ALIVE);
+    if((rv = sdp_ctrl_client_send(client, sdp_action_keep_alive, jdata, id)) != SDP_SUCCESS)
     {
         log_msg(LOG_ERR, "Failed to send keep alive message.");
         goto cleanup;
     }
 
     // Set state accordingly
-    sdp_ctrl_client_set_request_vars(client, SDP_CTRL_CLIENT_STATE_KEEP_ALIVE_REQUESTING);
+    sdp_ctrl_client_req_sent(client, SDP_CTRL_CLIENT_REQ_KEEP_ALIVE, id);
 
 
 cleanup:
-    free(msg);
+    if(jdata != NULL)
+        json_object_put(jdata);
+    else if(jencodings != NULL)
+        json_object_put(jencodings);
     return rv;
 }
 
 void sdp_ctrl_client_process_keep_alive(sdp_ctrl_client_t client)
 {
     client->last_contact = time(NULL);
-
-    if(client->client_state == SDP_CTRL_CLIENT_STATE_KEEP_ALIVE_REQUESTING ||
-       client->client_state == SDP_CTRL_CLIENT_STATE_KEEP_ALIVE_UNFULFILLED)
-        sdp_ctrl_client_clear_state_vars(client);
-
 }
 
 
 int sdp_ctrl_client_request_cred_update(sdp_ctrl_client_t client)
 {
     int rv = SDP_ERROR_CRED_REQ;
-    char *msg = NULL;
+    uint32_t id = 0;
 
     // Is the client context properly initialized
     if(client == NULL || !client->initialized)
         return SDP_ERROR_UNINITIALIZED;
 
     // Is the client currently connected
-    if(client->com->conn_state == SDP_COM_DISCONNECTED)
+    if(client->com->conn_state != SDP_COM_CONNECTED)
         return SDP_ERROR_CONN_DOWN;
 
-    // Is the client in the right state
-    if(client->client_state != SDP_CTRL_CLIENT_STATE_READY &&
-       client->client_state != SDP_CTRL_CLIENT_STATE_CRED_UNFULFILLED &&
-       client->client_state != SDP_CTRL_CLIENT_STATE_CRED_REQUESTING)
-    {
-        log_msg(LOG_DEBUG, "Control Client not in proper state to request credential update.");
-        return SDP_ERROR_STATE;
-    }
-
-    // Make the proper message
-    if((rv = sdp_message_make(sdp_action_cred_update_request, NULL, &msg)) != SDP_SUCCESS)
-    {
-        log_msg(LOG_ERR, "Failed to make credential request message.");
-        goto cleanup;
-    }
-
-    // Send it off
-    if((rv = sdp_com_send_msg(client->com, msg)) != SDP_SUCCESS)
+    // Make the proper message and send it off
+    id = sdp_ctrl_client_req_id(client, SDP_CTRL_CLIENT_REQ_CRED_UPDATE);
+    if((rv = sdp_ctrl_client_send(client, sdp_action_cred_update_request, NULL, id)) != SDP_SUCCESS)
     {
         log_msg(LOG_ERR, "Failed to send credential request message.");
         goto cleanup;
     }
 
     // Set state accordingly
-    sdp_ctrl_client_set_request_vars(client, SDP_CTRL_CLIENT_STATE_CRED_REQUESTING);
+    sdp_ctrl_client_req_sent(client, SDP_CTRL_CLIENT_REQ_CRED_UPDATE, id);
 
 
 cleanup:
-    log_msg(LOG_DEBUG, "Freeing memory before exiting function");
-
-    free(msg);
     return rv;
 }
 
 int sdp_ctrl_client_request_service_refresh(sdp_ctrl_client_t client)
 {
     int rv = SDP_ERROR_CRED_REQ;
-    char *msg = NULL;
+    uint32_t id = 0;
 
     // Is the client context properly initialized
     if(client == NULL || !client->initialized)
         return SDP_ERROR_UNINITIALIZED;
 
     // Is the client currently connected
-    if(client->com->conn_state == SDP_COM_DISCONNECTED)
+    if(client->com->conn_state != SDP_COM_CONNECTED)
         return SDP_ERROR_CONN_DOWN;
 
-    // Is the client in the right state
-    if(client->client_state != SDP_CTRL_CLIENT_STATE_READY &&
-       client->client_state != SDP_CTRL_CLIENT_STATE_SERVICE_REFRESH_REQUESTING &&
-       client->client_state != SDP_CTRL_CLIENT_STATE_SERVICE_REFRESH_UNFULFILLED)
-    {
-        log_msg(LOG_DEBUG, "Control Client not in proper state to request service data refresh.");
-        return SDP_ERROR_STATE;
-    }
-
-    // Make the proper message
-    if((rv = sdp_message_make(sdp_action_service_refresh_request, NULL, &msg)) != SDP_SUCCESS)
-    {
-        log_msg(LOG_ERR, "Failed to make service refresh request message.");
-        goto cleanup;
-    }
-
-    // Send it off
-    if((rv = sdp_com_send_msg(client->com, msg)) != SDP_SUCCESS)
+    // Make the proper message and send it off
+    id = sdp_ctrl_client_req_id(client, SDP_CTRL_CLIENT_REQ_SERVICE_REFRESH);
+    if((rv = sdp_ctrl_client_send_refresh_request(client, id, sdp_action_service_refresh_request,
+                    client->service_version)) != SDP_SUCCESS)
     {
         log_msg(LOG_ERR, "Failed to send service refresh request message.");
         goto cleanup;
     }
 
     // Set state accordingly
-    sdp_ctrl_client_set_request_vars(client, SDP_CTRL_CLIENT_STATE_SERVICE_REFRESH_REQUESTING);
+    sdp_ctrl_client_req_sent(client, SDP_CTRL_CLIENT_REQ_SERVICE_REFRESH, id);
 
 
 cleanup:
-    log_msg(LOG_DEBUG, "Freeing memory before exiting function");
-
-    free(msg);
     return rv;
 }
 
@@ -850,47 +1050,30 @@ cleanup:
 int sdp_ctrl_client_request_access_refresh(sdp_ctrl_client_t client)
 {
     int rv = SDP_ERROR_CRED_REQ;
-    char *msg = NULL;
+    uint32_t id = 0;
 
     // Is the client context properly initialized
     if(client == NULL || !client->initialized)
         return SDP_ERROR_UNINITIALIZED;
 
     // Is the client currently connected
-    if(client->com->conn_state == SDP_COM_DISCONNECTED)
+    if(client->com->conn_state != SDP_COM_CONNECTED)
         return SDP_ERROR_CONN_DOWN;
 
-    // Is the client in the right state
-    if(client->client_state != SDP_CTRL_CLIENT_STATE_READY &&
-       client->client_state != SDP_CTRL_CLIENT_STATE_ACCESS_REFRESH_REQUESTING &&
-       client->client_state != SDP_CTRL_CLIENT_STATE_ACCESS_REFRESH_UNFULFILLED)
-    {
-        log_msg(LOG_DEBUG, "Control Client not in proper state to request access data refresh.");
-        return SDP_ERROR_STATE;
-    }
-
-    // Make the proper message
-    if((rv = sdp_message_make(sdp_action_access_refresh_request, NULL, &msg)) != SDP_SUCCESS)
-    {
-        log_msg(LOG_ERR, "Failed to make access refresh request message.");
-        goto cleanup;
-    }
-
-    // Send it off
-    if((rv = sdp_com_send_msg(client->com, msg)) != SDP_SUCCESS)
+    // Make the proper message and send it off
+    id = sdp_ctrl_client_req_id(client, SDP_CTRL_CLIENT_REQ_ACCESS_REFRESH);
+    if((rv = sdp_ctrl_client_send_refresh_request(client, id, sdp_action_access_refresh_request,
+                    client->access_version)) != SDP_SUCCESS)
     {
         log_msg(LOG_ERR, "Failed to send access refresh request message.");
         goto cleanup;
     }
 
     // Set state accordingly
-    sdp_ctrl_client_set_request_vars(client, SDP_CTRL_CLIENT_STATE_ACCESS_REFRESH_REQUESTING);
+    sdp_ctrl_client_req_sent(client, SDP_CTRL_CLIENT_REQ_ACCESS_REFRESH, id);
 
 
 cleanup:
-    log_msg(LOG_DEBUG, "Freeing memory before exiting function");
-
-    free(msg);
     return rv;
 }
 
@@ -899,7 +1082,6 @@ cleanup:
 int sdp_ctrl_client_process_cred_update(sdp_ctrl_client_t client, void *credentials)
 {
     int rv = SDP_ERROR_CRED_REQ;
-    char *msg = NULL;
 
     // critical section, disable thread cancellation
     // apparently many, many C functions are considered cancellation points
@@ -914,21 +1096,15 @@ int sdp_ctrl_client_process_cred_update(sdp_ctrl_client_t client, void *credenti
         goto cleanup;
     }
 
+    // present the new certificate from the next connection on, no restart
+    if(sdp_com_reload_certs(client->com) != SDP_SUCCESS)
+        log_msg(LOG_ERR, "New credentials saved, but will only be used after a restart.");
+
     client->last_contact = time(NULL);
     client->last_cred_update = client->last_contact;
 
-    if(client->client_state == SDP_CTRL_CLIENT_STATE_CRED_REQUESTING ||
-       client->client_state == SDP_CTRL_CLIENT_STATE_CRED_UNFULFILLED)
-        sdp_ctrl_client_clear_state_vars(client);
-
-    // Make the 'Fulfilled' response message
-    if((rv = sdp_message_make(sdp_action_cred_ack, NULL, &msg)) != SDP_SUCCESS)
-    {
-        log_msg(LOG_ERR, "Failed to make credential request 'ACK' message.");
-        goto cleanup;
-    }
-
-    if((rv = sdp_com_send_msg(client->com, msg)) != SDP_SUCCESS)
+    // Make the 'Fulfilled' response message and send it off
+    if((rv = sdp_ctrl_client_send(client, sdp_action_cred_ack, NULL, 0)) != SDP_SUCCESS)
     {
         log_msg(LOG_ERR, "Failed to send credential request 'ACK' message.");
         goto cleanup;
@@ -939,62 +1115,99 @@ cleanup:
     pthread_testcancel();
 
     sdp_message_destroy_creds(credentials);
-    free(msg);
     return rv;
 }
 
 
-int  sdp_ctrl_client_send_data_ack(sdp_ctrl_client_t client, int action)
+// Called when the data in an access or service message could not be
+// applied. Whatever version we held no longer describes our tables, so
+// drop it and ask for a full refresh at the next opportunity.
+void sdp_ctrl_client_data_resync(sdp_ctrl_client_t client, int action)
 {
-    int rv = SDP_SUCCESS;
-    char *msg = NULL;
-    const char *action_str = NULL;
+    if(client == NULL)
+        return;
 
-    if(action == CTRL_ACTION_ACCESS_ACK)
+    if(action == CTRL_ACTION_ACCESS_REFRESH ||
+       action == CTRL_ACTION_ACCESS_UPDATE ||
+       action == CTRL_ACTION_ACCESS_REMOVE)
     {
-        action_str = sdp_action_access_ack;
-
-        if(client->client_state == SDP_CTRL_CLIENT_STATE_ACCESS_REFRESH_REQUESTING ||
-           client->client_state == SDP_CTRL_CLIENT_STATE_ACCESS_REFRESH_UNFULFILLED ||
-           client->client_state == SDP_CTRL_CLIENT_STATE_ACCESS_UPDATE_REQUESTING ||
-           client->client_state == SDP_CTRL_CLIENT_STATE_ACCESS_UPDATE_UNFULFILLED)
-            sdp_ctrl_client_clear_state_vars(client);
-
+        client->access_version = 0;
+        client->last_access_refresh = 0;
+        sdp_ctrl_client_req_done(client, SDP_CTRL_CLIENT_REQ_ACCESS_REFRESH);
     }
-    else if(action == CTRL_ACTION_SERVICE_ACK)
+    else if(action == CTRL_ACTION_SERVICE_REFRESH ||
+            action == CTRL_ACTION_SERVICE_UPDATE ||
+            action == CTRL_ACTION_SERVICE_REMOVE)
     {
-        action_str = sdp_action_service_ack;
+        client->service_version = 0;
+        client->last_service_refresh = 0;
+        sdp_ctrl_client_req_done(client, SDP_CTRL_CLIENT_REQ_SERVICE_REFRESH);
+    }
+}
 
-        if(client->client_state == SDP_CTRL_CLIENT_STATE_SERVICE_REFRESH_REQUESTING ||
-           client->client_state == SDP_CTRL_CLIENT_STATE_SERVICE_REFRESH_UNFULFILLED ||
-           client->client_state == SDP_CTRL_CLIENT_STATE_SERVICE_UPDATE_REQUESTING ||
-           client->client_state == SDP_CTRL_CLIENT_STATE_SERVICE_UPDATE_UNFULFILLED)
-            sdp_ctrl_client_clear_state_vars(client);
 
-    }
+// Acks are not sent right away but collected, so that a run of access or
+// service messages is acknowledged once by sdp_ctrl_client_flush_acks()
+int  sdp_ctrl_client_send_data_ack(sdp_ctrl_client_t client, int action)
+{
+    if(action == CTRL_ACTION_ACCESS_ACK)
+        client->access_ack_pending = 1;
+    else if(action == CTRL_ACTION_SERVICE_ACK)
+        client->service_ack_pending = 1;
     else
     {
         log_msg(LOG_ERR, "sdp_ctrl_client_send_data_ack() unrecognized ack type requested, not sending ACK");
         return SDP_ERROR_BAD_ARG;
     }
 
-    // Make the ACK response message
-    if((rv = sdp_message_make(action_str, NULL, &msg)) != SDP_SUCCESS)
-    {
-        log_msg(LOG_ERR, "Failed to make access data 'ACK' message.");
-        goto cleanup;
-    }
+    return SDP_SUCCESS;
+}
+
+
+// Send the acks collected since the last flush. An ack that completes a
+// refresh request carries that request's id.
+int  sdp_ctrl_client_flush_acks(sdp_ctrl_client_t client)
+{
+    int rv = SDP_SUCCESS;
+    int *pending = NULL;
+    const char *action_str = NULL;
+    sdp_ctrl_client_req_type_t type;
+    struct sdp_ctrl_client_req *req = NULL;
+    int i;
 
-    if((rv = sdp_com_send_msg(client->com, msg)) != SDP_SUCCESS)
+    for(i = 0; i < 2; i++)
     {
-        log_msg(LOG_ERR, "Failed to send access data 'ACK' message.");
-        goto cleanup;
-    }
+        if(i == 0)
+        {
+            pending = &(client->access_ack_pending);
+            action_str = sdp_action_access_ack;
+            type = SDP_CTRL_CLIENT_REQ_ACCESS_REFRESH;
+        }
+        else
+        {
+            pending = &(client->service_ack_pending);
+            action_str = sdp_action_service_ack;
+            type = SDP_CTRL_CLIENT_REQ_SERVICE_REFRESH;
+        }
 
-cleanup:
-    log_msg(LOG_DEBUG, "Freeing memory before exiting function");
+        if(!*pending)
+            continue;
+
+        req = &(client->requests[type]);
+
+        // Make the ACK response message and send it off
+        if((rv = sdp_ctrl_client_send(client, action_str, NULL,
+                        req->answered ? req->id : 0)) != SDP_SUCCESS)
+        {
+            log_msg(LOG_ERR, "Failed to send data 'ACK' message.");
+            return rv;
+        }
+
+        *pending = 0;
+        if(req->answered)
+            sdp_ctrl_client_req_done(client, type);
+    }
 
-    free(msg);
     return rv;
 }
 
@@ -1002,26 +1215,16 @@ cleanup:
 int  sdp_ctrl_client_send_data_error(sdp_ctrl_client_t client)
 {
     int rv = SDP_SUCCESS;
-    char *msg = NULL;
 
     // Make the Error response message
     // THIS NEEDS TO CHANGE DEPENDING ON HOW WE WANT TO MANAGE STATE ON BOTH SIDES
-    if((rv = sdp_message_make(sdp_action_bad_message, NULL, &msg)) != SDP_SUCCESS)
-    {
-        log_msg(LOG_ERR, "Failed to make data 'ERROR' message.");
-        goto cleanup;
-    }
-
-    if((rv = sdp_com_send_msg(client->com, msg)) != SDP_SUCCESS)
+    if((rv = sdp_ctrl_client_send(client, sdp_action_bad_message, NULL, 0)) != SDP_SUCCESS)
     {
         log_msg(LOG_ERR, "Failed to send data 'ERROR' message.");
         goto cleanup;
     }
 
 cleanup:
-    log_msg(LOG_DEBUG, "Freeing memory before exiting function");
-
-    free(msg);
     return rv;
 }
 
@@ -1029,25 +1232,15 @@ cleanup:
 int  sdp_ctrl_client_send_message(sdp_ctrl_client_t client, char *action, json_object *data)
 {
     int rv = SDP_SUCCESS;
-    char *msg = NULL;
 
-    // Make the message
-    if((rv = sdp_message_make(action, data, &msg)) != SDP_SUCCESS)
-    {
-        log_msg(LOG_ERR, "Failed to make ctrl message.");
-        goto cleanup;
-    }
-
-    if((rv = sdp_com_send_msg(client->com, msg)) != SDP_SUCCESS)
+    // Make the message and send it off
+    if((rv = sdp_ctrl_client_send(client, action, data, 0)) != SDP_SUCCESS)
     {
         log_msg(LOG_ERR, "Failed to send ctrl message.");
         goto cleanup;
     }
 
 cleanup:
-    log_msg(LOG_DEBUG, "Freeing memory before exiting function");
-
-    free(msg);
     return rv;
 }
 
@@ -1566,136 +1759,117 @@ int sdp_ctrl_client_loop(sdp_ctrl_client_t client)
 
 int sdp_ctrl_client_consider_keep_alive(sdp_ctrl_client_t client)
 {
-    time_t ts;
-    int rv = SDP_SUCCESS;
+    if(client == NULL || !client->initialized)
+        return SDP_ERROR_UNINITIALIZED;
 
-    // This should never happen, but just to be safe
+    return sdp_ctrl_client_consider_request(client, SDP_CTRL_CLIENT_REQ_KEEP_ALIVE,
+            client->last_contact, client->keep_alive_interval);
+}
+
+int sdp_ctrl_client_consider_cred_update(sdp_ctrl_client_t client)
+{
     if(client == NULL || !client->initialized)
         return SDP_ERROR_UNINITIALIZED;
 
-    // This is not a failure, but we do halt consideration
-    if(client->com->conn_state == SDP_COM_DISCONNECTED)
-        return SDP_SUCCESS;
+    return sdp_ctrl_client_consider_request(client, SDP_CTRL_CLIENT_REQ_CRED_UPDATE,
+            client->last_cred_update, client->cred_update_interval);
+}
 
-    if(client->client_state == SDP_CTRL_CLIENT_STATE_READY)
-    {
-        if( (ts = time(NULL)) >= (client->last_contact + client->keep_alive_interval) )
-        {
-            rv = sdp_ctrl_client_request_keep_alive(client);
-        }
-        else
-        {
-            //log_msg(LOG_DEBUG, "Not time for keep alive request.");
-            return SDP_SUCCESS;
-        }
-    }
-    else if(client->client_state == SDP_CTRL_CLIENT_STATE_KEEP_ALIVE_REQUESTING ||
-            client->client_state == SDP_CTRL_CLIENT_STATE_KEEP_ALIVE_UNFULFILLED)
-    {
-        if( (ts = time(NULL)) >= (client->last_req_time + client->req_retry_interval) )
-        {
-            if(client->req_attempts >= client->max_req_attempts)
-            {
-                log_msg(LOG_ERR, "Too many failed keep alive requests. Attempting reconnect.");
-                sdp_com_disconnect(client->com);
-                client->req_attempts = 0;
-                return SDP_SUCCESS;
-            }
-            else
-            {
-                client->client_state = SDP_CTRL_CLIENT_STATE_KEEP_ALIVE_UNFULFILLED;
-                client->req_retry_interval *= 2;
-                if(client->req_retry_interval > SDP_COM_MAX_RETRY_INTERVAL_SECONDS)
-                    client->req_retry_interval = SDP_COM_MAX_RETRY_INTERVAL_SECONDS;
-                log_msg(LOG_DEBUG, "It is time to retry an unfulfilled keep alive request.");
-                rv = sdp_ctrl_client_request_keep_alive(client);
-            }
-        }
-        else
-        {
-            //log_msg(LOG_DEBUG, "Not time to retry keep alive request.");
-            return SDP_SUCCESS;
-        }
-    }
-    else
-    {
-        //log_msg(LOG_DEBUG, "Control Client not in proper state to make keep alive request.");
-        return SDP_SUCCESS;
-    }
 
+int sdp_ctrl_client_consider_service_refresh(sdp_ctrl_client_t client)
+{
+    if(client == NULL || !client->initialized)
+        return SDP_ERROR_UNINITIALIZED;
 
-    if(rv == SDP_ERROR_SOCKET_WRITE)
-    {
-        sdp_com_disconnect(client->com);
-    }
+    return sdp_ctrl_client_consider_request(client, SDP_CTRL_CLIENT_REQ_SERVICE_REFRESH,
+            client->last_service_refresh, client->service_refresh_interval);
+}
 
-    if(rv != SDP_ERROR_MEMORY_ALLOCATION)
-    {
-        return SDP_SUCCESS;
-    }
 
-    // Should only get here if there was a memory allocation error
-    return rv;
+int sdp_ctrl_client_consider_access_refresh(sdp_ctrl_client_t client)
+{
+    if(client == NULL || !client->initialized)
+        return SDP_ERROR_UNINITIALIZED;
+
+    return sdp_ctrl_client_consider_request(client, SDP_CTRL_CLIENT_REQ_ACCESS_REFRESH,
+            client->last_access_refresh, client->access_refresh_interval);
 }
 
-int sdp_ctrl_client_consider_cred_update(sdp_ctrl_client_t client)
+
+static const char *sdp_ctrl_client_req_names[SDP_CTRL_CLIENT_REQ_TYPES] = {
+    "keep alive",
+    "credential update",
+    "service data refresh",
+    "access data refresh"
+};
+
+
+// Send a request of the given type once interval has passed since last,
+// or retry it when the reply is overdue. Requests of other types may be
+// outstanding meanwhile. Each due time is pushed out by a random part of
+// the interval so that peers started together do not stay in step.
+int sdp_ctrl_client_consider_request(sdp_ctrl_client_t client,
+        sdp_ctrl_client_req_type_t type, time_t last, int interval)
 {
+    struct sdp_ctrl_client_req *req = &(client->requests[type]);
     time_t ts;
     int rv = SDP_SUCCESS;
 
-    // This should never happen, but just to be safe
-    if(client == NULL || !client->initialized)
-        return SDP_ERROR_UNINITIALIZED;
-
     // This is not a failure, but we do halt consideration
-    if(client->com->conn_state == SDP_COM_DISCONNECTED)
+    if(client->com->conn_state != SDP_COM_CONNECTED)
         return SDP_SUCCESS;
 
-    if(client->client_state == SDP_CTRL_CLIENT_STATE_READY)
+    ts = time(NULL);
+
+    if(req->id == 0)
     {
-        if( (ts = time(NULL)) >= (client->last_cred_update + client->cred_update_interval) )
-        {
-            log_msg(LOG_DEBUG, "It is time for a credential update request.");
-            rv = sdp_ctrl_client_request_cred_update(client);
-        }
-        else
-        {
-            //log_msg(LOG_DEBUG, "Not time for credential update request.");
+        if(req->jitter < 0)
+            req->jitter = sdp_com_jitter(interval / SDP_CTRL_CLIENT_JITTER_DIVISOR);
+
+        if(ts < (last + interval + req->jitter))
             return SDP_SUCCESS;
-        }
+
+        log_msg(LOG_DEBUG, "It is time for a %s request.", sdp_ctrl_client_req_names[type]);
     }
-    else if(client->client_state == SDP_CTRL_CLIENT_STATE_CRED_REQUESTING ||
-            client->client_state == SDP_CTRL_CLIENT_STATE_CRED_UNFULFILLED)
+    else
     {
-        if( (ts = time(NULL)) >= (client->last_req_time + client->req_retry_interval) )
-        {
-            if(client->req_attempts >= client->max_req_attempts)
-            {
-                log_msg(LOG_ERR, "Too many failed credential requests. Attempting reconnect.");
-                sdp_com_disconnect(client->com);
-                client->req_attempts = 0;
-                return SDP_SUCCESS;
-            }
-            else
-            {
-                client->client_state = SDP_CTRL_CLIENT_STATE_CRED_UNFULFILLED;
-                client->req_retry_interval *= 2;
-                if(client->req_retry_interval > SDP_COM_MAX_RETRY_INTERVAL_SECONDS)
-                    client->req_retry_interval = SDP_COM_MAX_RETRY_INTERVAL_SECONDS;
-                log_msg(LOG_DEBUG, "It is time to retry an unfulfilled credential update request.");
-                rv = sdp_ctrl_client_request_cred_update(client);
-            }
-        }
-        else
+        // a refresh that was answered only waits for our ack to go out
+        if(req->answered || ts < (req->last_req_time + req->retry_interval))
+            return SDP_SUCCESS;
+
+        if(req->attempts >= client->max_req_attempts)
         {
-            //log_msg(LOG_DEBUG, "Not time to retry credential update request.");
+            log_msg(LOG_ERR, "Too many failed %s requests. Attempting reconnect.",
+                    sdp_ctrl_client_req_names[type]);
+            sdp_com_disconnect(client->com);
+            req->attempts = 0;
             return SDP_SUCCESS;
         }
+
+        req->unfulfilled = 1;
+        req->retry_interval = req->retry_interval * 2 - sdp_com_jitter(req->retry_interval / 2);
+        if(req->retry_interval > SDP_COM_MAX_RETRY_INTERVAL_SECONDS)
+            req->retry_interval = SDP_COM_MAX_RETRY_INTERVAL_SECONDS;
+        log_msg(LOG_DEBUG, "It is time to retry an unfulfilled %s request.",
+                sdp_ctrl_client_req_names[type]);
     }
-    else
+
+    switch(type)
     {
-        //log_msg(LOG_DEBUG, "Control Client not in proper state to request credential update.");
-        return SDP_SUCCESS;
+        case SDP_CTRL_CLIENT_REQ_KEEP_ALIVE:
+            rv = sdp_ctrl_client_request_keep_alive(client);
+            break;
+        case SDP_CTRL_CLIENT_REQ_CRED_UPDATE:
+            rv = sdp_ctrl_client_request_cred_update(client);
+            break;
+        case SDP_CTRL_CLIENT_REQ_SERVICE_REFRESH:
+            rv = sdp_ctrl_client_request_service_refresh(client);
+            break;
+        case SDP_CTRL_CLIENT_REQ_ACCESS_REFRESH:
+            rv = sdp_ctrl_client_request_access_refresh(client);
+            break;
+        default:
+            return SDP_ERROR_BAD_ARG;
     }
 
     if(rv == SDP_ERROR_SOCKET_WRITE)
@@ -1713,172 +1887,88 @@ int sdp_ctrl_client_consider_cred_update(sdp_ctrl_client_t client)
 }
 
 
-int sdp_ctrl_client_consider_service_refresh(sdp_ctrl_client_t client)
+// A retry goes out under the id of the request it repeats
+uint32_t sdp_ctrl_client_req_id(sdp_ctrl_client_t client, sdp_ctrl_client_req_type_t type)
 {
-    time_t ts;
-    int rv = SDP_SUCCESS;
+    if(client->requests[type].id != 0)
+        return client->requests[type].id;
 
-    // This should never happen, but just to be safe
-    if(client == NULL || !client->initialized)
-        return SDP_ERROR_UNINITIALIZED;
-
-    // This is not a failure, but we do halt consideration
-    if(client->com->conn_state == SDP_COM_DISCONNECTED)
-        return SDP_SUCCESS;
+    // 0 means no id, skip it when the counter wraps
+    if(++(client->last_request_id) == 0)
+        client->last_request_id = 1;
 
-    if(client->client_state == SDP_CTRL_CLIENT_STATE_READY)
-    {
-        if( (ts = time(NULL)) >= (client->last_service_refresh + client->service_refresh_interval) )
-        {
-            log_msg(LOG_DEBUG, "It is time for service data refresh request.");
-            rv = sdp_ctrl_client_request_service_refresh(client);
-        }
-        else
-        {
-            //log_msg(LOG_DEBUG, "Not time for access data refresh request.");
-            return SDP_SUCCESS;
-        }
-    }
-    else if(client->client_state == SDP_CTRL_CLIENT_STATE_SERVICE_REFRESH_REQUESTING ||
-            client->client_state == SDP_CTRL_CLIENT_STATE_SERVICE_REFRESH_UNFULFILLED)
-    {
-        if( (ts = time(NULL)) >= (client->last_req_time + client->req_retry_interval) )
-        {
-            if(client->req_attempts >= client->max_req_attempts)
-            {
-                log_msg(LOG_ERR, "Too many failed service refresh requests. Attempting reconnect.");
-                sdp_com_disconnect(client->com);
-                client->req_attempts = 0;
-                return SDP_SUCCESS;
-            }
-            else
-            {
-                client->client_state = SDP_CTRL_CLIENT_STATE_SERVICE_REFRESH_UNFULFILLED;
-                client->req_retry_interval *= 2;
-                if(client->req_retry_interval > SDP_COM_MAX_RETRY_INTERVAL_SECONDS)
-                    client->req_retry_interval = SDP_COM_MAX_RETRY_INTERVAL_SECONDS;
-                log_msg(LOG_DEBUG, "It is time to retry an unfulfilled service data refresh request.");
-                rv = sdp_ctrl_client_request_service_refresh(client);
-            }
-        }
-        else
-        {
-            //log_msg(LOG_DEBUG, "Not time to retry access data refresh request.");
-            return SDP_SUCCESS;
-        }
-    }
-    else
-    {
-        //log_msg(LOG_DEBUG, "Control Client not in proper state to request service data refresh.");
-        return SDP_SUCCESS;
-    }
+    return client->last_request_id;
+}
 
-    if(rv == SDP_ERROR_SOCKET_WRITE)
-    {
-        sdp_com_disconnect(client->com);
-    }
 
-    if(rv != SDP_ERROR_MEMORY_ALLOCATION)
-    {
-        return SDP_SUCCESS;
-    }
+void sdp_ctrl_client_req_sent(sdp_ctrl_client_t client, sdp_ctrl_client_req_type_t type, uint32_t id)
+{
+    struct sdp_ctrl_client_req *req = &(client->requests[type]);
 
-    // Should only get here if there was a memory allocation error
-    return rv;
+    req->id = id;
+    req->last_req_time = time(NULL);
+    req->attempts++;
 }
 
 
-int sdp_ctrl_client_consider_access_refresh(sdp_ctrl_client_t client)
+void sdp_ctrl_client_req_done(sdp_ctrl_client_t client, sdp_ctrl_client_req_type_t type)
 {
-    time_t ts;
-    int rv = SDP_SUCCESS;
+    struct sdp_ctrl_client_req *req = &(client->requests[type]);
 
-    // This should never happen, but just to be safe
-    if(client == NULL || !client->initialized)
-        return SDP_ERROR_UNINITIALIZED;
+    memset(req, 0, sizeof(*req));
+    req->retry_interval = client->initial_req_retry_interval;
+    req->jitter = -1;
+}
 
-    // This is not a failure, but we do halt consideration
-    if(client->com->conn_state == SDP_COM_DISCONNECTED)
-        return SDP_SUCCESS;
 
-    if(client->client_state == SDP_CTRL_CLIENT_STATE_READY)
-    {
-        if( (ts = time(NULL)) >= (client->last_access_refresh + client->access_refresh_interval) )
-        {
-            log_msg(LOG_DEBUG, "It is time for an access data refresh request.");
-            rv = sdp_ctrl_client_request_access_refresh(client);
-        }
-        else
-        {
-            //log_msg(LOG_DEBUG, "Not time for access data refresh request.");
-            return SDP_SUCCESS;
-        }
-    }
-    else if(client->client_state == SDP_CTRL_CLIENT_STATE_ACCESS_REFRESH_REQUESTING ||
-            client->client_state == SDP_CTRL_CLIENT_STATE_ACCESS_REFRESH_UNFULFILLED)
-    {
-        if( (ts = time(NULL)) >= (client->last_req_time + client->req_retry_interval) )
-        {
-            if(client->req_attempts >= client->max_req_attempts)
-            {
-                log_msg(LOG_ERR, "Too many failed access refresh requests. Attempting reconnect.");
-                sdp_com_disconnect(client->com);
-                client->req_attempts = 0;
-                return SDP_SUCCESS;
-            }
-            else
-            {
-                client->client_state = SDP_CTRL_CLIENT_STATE_ACCESS_REFRESH_UNFULFILLED;
-                client->req_retry_interval *= 2;
-                if(client->req_retry_interval > SDP_COM_MAX_RETRY_INTERVAL_SECONDS)
-                    client->req_retry_interval = SDP_COM_MAX_RETRY_INTERVAL_SECONDS;
-                log_msg(LOG_DEBUG, "It is time to retry an unfulfilled access data refresh request.");
-                rv = sdp_ctrl_client_request_access_refresh(client);
-            }
-        }
-        else
-        {
-            //log_msg(LOG_DEBUG, "Not time to retry access data refresh request.");
-            return SDP_SUCCESS;
-        }
-    }
-    else
-    {
-        //log_msg(LOG_DEBUG, "Control Client not in proper state to request access data refresh.");
-        return SDP_SUCCESS;
-    }
+// On every (re)connection. A table we hold a version of is brought up to
+// date right away with a versioned refresh, which the controller can
+// answer with just the changes, rather than waiting for the next full
+// refresh. The short random delay keeps a fleet that lost the controller
+// together from asking all at once.
+void sdp_ctrl_client_connected(sdp_ctrl_client_t client)
+{
+    time_t now = time(NULL);
+    unsigned int spread = client->com->initial_conn_attempt_interval;
 
-    if(rv == SDP_ERROR_SOCKET_WRITE)
+    client->initial_conn_time = client->last_contact = now;
+
+    if(client->access_version > 0
+            && client->requests[SDP_CTRL_CLIENT_REQ_ACCESS_REFRESH].id == 0)
     {
-        sdp_com_disconnect(client->com);
+        client->last_access_refresh = now - client->access_refresh_interval;
+        client->requests[SDP_CTRL_CLIENT_REQ_ACCESS_REFRESH].jitter = sdp_com_jitter(spread);
     }
 
-    if(rv != SDP_ERROR_MEMORY_ALLOCATION)
+    if(client->service_version > 0
+            && client->requests[SDP_CTRL_CLIENT_REQ_SERVICE_REFRESH].id == 0)
     {
-        return SDP_SUCCESS;
+        client->last_service_refresh = now - client->service_refresh_interval;
+        client->requests[SDP_CTRL_CLIENT_REQ_SERVICE_REFRESH].jitter = sdp_com_jitter(spread);
     }
-
-    // Should only get here if there was a memory allocation error
-    return rv;
 }
 
 
-
-
-void sdp_ctrl_client_clear_state_vars(sdp_ctrl_client_t client)
+// Whether a reply of the given type answers the outstanding request, and
+// if so mark it answered. A reply without an id comes from a controller
+// that does not track them and is taken to answer whatever is outstanding.
+int sdp_ctrl_client_req_answered(sdp_ctrl_client_t client, sdp_ctrl_client_req_type_t type,
+        uint32_t request_id)
 {
-    client->last_req_time = 0;
-    client->req_retry_interval = client->initial_req_retry_interval;
-    client->req_attempts = 0;
-    client->client_state = SDP_CTRL_CLIENT_STATE_READY;
-}
+    struct sdp_ctrl_client_req *req = &(client->requests[type]);
 
+    if(req->id == 0)
+        return 0;
 
-void sdp_ctrl_client_set_request_vars(sdp_ctrl_client_t client, sdp_ctrl_client_state_t new_state)
-{
-    client->client_state = new_state;
-    client->last_req_time = time(NULL);
-    client->req_attempts++;
+    if(request_id != 0 && request_id != req->id)
+    {
+        log_msg(LOG_DEBUG, "Reply to %s request %u arrived while request %u is outstanding",
+                sdp_ctrl_client_req_names[type], request_id, req->id);
+        return 0;
+    }
+
+    req->answered = 1;
+    return 1;
 }
 
 
@@ -87,28 +87,30 @@ enum {
 
 #define YES_OR_NO(I) (I == 0 ? "NO" : "YES")
 
+// Requests that may be outstanding with the controller at the same time,
+// each tracked on its own so a slow reply to one does not hold up the rest
 typedef enum {
-    SDP_CTRL_CLIENT_STATE_READY,
-    SDP_CTRL_CLIENT_STATE_KEEP_ALIVE_REQUESTING,
-    SDP_CTRL_CLIENT_STATE_KEEP_ALIVE_UNFULFILLED,
-    SDP_CTRL_CLIENT_STATE_CRED_REQUESTING,
-    SDP_CTRL_CLIENT_STATE_CRED_FULFILLED,
-    SDP_CTRL_CLIENT_STATE_CRED_UNFULFILLED,
-    SDP_CTRL_CLIENT_STATE_ACCESS_REFRESH_REQUESTING,
-    SDP_CTRL_CLIENT_STATE_ACCESS_REFRESH_FULFILLED,
-    SDP_CTRL_CLIENT_STATE_ACCESS_REFRESH_UNFULFILLED,
-    SDP_CTRL_CLIENT_STATE_ACCESS_UPDATE_REQUESTING,
-    SDP_CTRL_CLIENT_STATE_ACCESS_UPDATE_FULFILLED,
-    SDP_CTRL_CLIENT_STATE_ACCESS_UPDATE_UNFULFILLED,
-    SDP_CTRL_CLIENT_STATE_SERVICE_REFRESH_REQUESTING,
-    SDP_CTRL_CLIENT_STATE_SERVICE_REFRESH_FULFILLED,
-    SDP_CTRL_CLIENT_STATE_SERVICE_REFRESH_UNFULFILLED,
-    SDP_CTRL_CLIENT_STATE_SERVICE_UPDATE_REQUESTING,
-    SDP_CTRL_CLIENT_STATE_SERVICE_UPDATE_FULFILLED,
-    SDP_CTRL_CLIENT_STATE_SERVICE_UPDATE_UNFULFILLED,
-    SDP_CTRL_CLIENT_STATE_NEED_RECONNECT,
-    SDP_CTRL_CLIENT_STATE_TIME_TO_QUIT,
-} sdp_ctrl_client_state_t;
+    SDP_CTRL_CLIENT_REQ_KEEP_ALIVE,
+    SDP_CTRL_CLIENT_REQ_CRED_UPDATE,
+    SDP_CTRL_CLIENT_REQ_SERVICE_REFRESH,
+    SDP_CTRL_CLIENT_REQ_ACCESS_REFRESH,
+    SDP_CTRL_CLIENT_REQ_TYPES
+} sdp_ctrl_client_req_type_t;
+
+// Periodic requests are spread over up to this fraction of their interval
+enum {
+    SDP_CTRL_CLIENT_JITTER_DIVISOR = 10
+};
+
+struct sdp_ctrl_client_req {
+    uint32_t id;            // 0 when no request of this type is outstanding
+    int    unfulfilled;     // retried at least once
+    int    answered;        // reply received, waiting to be acknowledged
+    time_t last_req_time;
+    int    attempts;
+    int    retry_interval;
+    int    jitter;          // seconds added to the next due time, -1 to pick anew
+};
 
 
 struct sdp_ctrl_client{
@@ -121,7 +123,10 @@ struct sdp_ctrl_client{
     int   use_syslog;
     int   verbosity;
 
-    sdp_ctrl_client_state_t client_state;
+    struct sdp_ctrl_client_req requests[SDP_CTRL_CLIENT_REQ_TYPES];
+    uint32_t last_request_id;
+    int   access_ack_pending;
+    int   service_ack_pending;
 
     int keep_alive_interval;
 
@@ -130,15 +135,14 @@ struct sdp_ctrl_client{
     time_t last_cred_update;
     time_t last_service_refresh;
     time_t last_access_refresh;
-    time_t last_req_time;
+    int64_t service_version;
+    int64_t access_version;
     time_t last_failed_req_time;
     int cred_update_interval;
     int service_refresh_interval;
     int access_refresh_interval;
     int max_req_attempts;
-    int req_attempts;
     int initial_req_retry_interval;
-    int req_retry_interval;
     int pid;
     char *pid_file;
     int pid_lock_fd;
@@ -154,10 +158,12 @@ int  sdp_ctrl_client_start(sdp_ctrl_client_t client, pid_t *r_child_pid);
 int  sdp_ctrl_client_stop(sdp_ctrl_client_t client);
 int  sdp_ctrl_client_restart(sdp_ctrl_client_t client);
 int  sdp_ctrl_client_connect(sdp_ctrl_client_t client);
+int  sdp_ctrl_client_connect_step(sdp_ctrl_client_t client);
 int  sdp_ctrl_client_disconnect(sdp_ctrl_client_t client);
 int  sdp_ctrl_client_connection_status(sdp_ctrl_client_t client);
 int  sdp_ctrl_client_controller_status(sdp_ctrl_client_t client);
 int  sdp_ctrl_client_status(sdp_ctrl_client_t client);
+int  sdp_ctrl_client_running(sdp_ctrl_client_t client, pid_t *r_pid);
 void sdp_ctrl_client_describe(sdp_ctrl_client_t client);
 int  sdp_ctrl_client_get_port(sdp_ctrl_client_t client, int *r_port);
 int  sdp_ctrl_client_get_addr(sdp_ctrl_client_t client, char **r_addr);
@@ -173,6 +179,8 @@ int  sdp_ctrl_client_consider_cred_update(sdp_ctrl_client_t client);
 int  sdp_ctrl_client_consider_service_refresh(sdp_ctrl_client_t client);
 int  sdp_ctrl_client_consider_access_refresh(sdp_ctrl_client_t client);
 int  sdp_ctrl_client_send_data_ack(sdp_ctrl_client_t client, int action);
+int  sdp_ctrl_client_flush_acks(sdp_ctrl_client_t client);
+void sdp_ctrl_client_data_resync(sdp_ctrl_client_t client, int action);
 int  sdp_ctrl_client_send_data_error(sdp_ctrl_client_t client);
 int  sdp_ctrl_client_send_message(sdp_ctrl_client_t client, char *action, json_object *data);
 
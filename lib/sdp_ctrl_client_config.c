@@ -46,7 +46,9 @@ const char *sdp_ctrl_client_config_map[SDP_CTRL_CLIENT_CONFIG_ENTRIES] = {
     "KEEP_ALIVE_INTERVAL",
     "MAX_REQUEST_ATTEMPTS",
     "INITIAL_REQUEST_RETRY_INTERVAL",
-    "PID_FILE"
+    "PID_FILE",
+    "MSG_ENCODING",
+    "SESSION_CACHE_FILE"
 };
 
 
@@ -69,8 +71,7 @@ static void set_defaults(sdp_ctrl_client_t client)
 static int finalize_config(sdp_ctrl_client_t client)
 {
     int rv = SDP_SUCCESS;
-
-    client->client_state = SDP_CTRL_CLIENT_STATE_READY;
+    int i;
 
     if(!(client->com->ctrl_port))
     {
@@ -157,8 +158,11 @@ static int finalize_config(sdp_ctrl_client_t client)
     if( !(client->initial_req_retry_interval))
         client->initial_req_retry_interval = DEFAULT_INTERVAL_REQ_RETRY_SECONDS;
 
-    if( !(client->req_retry_interval))
-        client->req_retry_interval = DEFAULT_INTERVAL_REQ_RETRY_SECONDS;
+    for(i = 0; i < SDP_CTRL_CLIENT_REQ_TYPES; i++)
+    {
+        client->requests[i].retry_interval = client->initial_req_retry_interval;
+        client->requests[i].jitter = -1;
+    }
 
     if( !(client->keep_alive_interval))
         client->keep_alive_interval = DEFAULT_INTERVAL_KEEP_ALIVE_SECONDS;
@@ -524,6 +528,25 @@ int sdp_ctrl_client_set_config_entry(sdp_ctrl_client_t client, int var, const ch
             }
             break;
 
+        case SDP_CTRL_CLIENT_CONFIG_MSG_ENCODING:
+            if(strcasecmp(val, "msgpack") == 0)
+                client->com->offer_msgpack = 1;
+            else if(strcasecmp(val, "json") == 0)
+                client->com->offer_msgpack = 0;
+            else
+            {
+                log_msg(LOG_ERR, "MSG_ENCODING must be json or msgpack, got: %s", val);
+                rv = SDP_ERROR_CONFIG;
+            }
+            break;
+
+        case SDP_CTRL_CLIENT_CONFIG_SESSION_CACHE_FILE:
+            if((rv = sdp_make_absolute_path(val, &(client->com->session_file))) != SDP_SUCCESS)
+            {
+                log_msg(LOG_ERR, "Error storing TLS session cache file path");
+            }
+            break;
+
         default:
             // do nothing
             break;
@@ -68,6 +68,8 @@ enum {
 	SDP_CTRL_CLIENT_CONFIG_MAX_REQUEST_ATTEMPTS,
 	SDP_CTRL_CLIENT_CONFIG_INIT_REQUEST_RETRY_INTERVAL,
 	SDP_CTRL_CLIENT_CONFIG_PID_FILE,
+	SDP_CTRL_CLIENT_CONFIG_MSG_ENCODING,
+	SDP_CTRL_CLIENT_CONFIG_SESSION_CACHE_FILE,
 	SDP_CTRL_CLIENT_CONFIG_ENTRIES
 };
 
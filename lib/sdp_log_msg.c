@@ -12,6 +12,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
 
 static int  logging_state = LOGGING_NOT_INITIALIZED;
 
@@ -33,6 +35,67 @@ static char *log_name = "sdp_ctrl_client";
 static int log_verbosity = LOG_DEFAULT_VERBOSITY;
 
 
+/* Per call site rate limiting for LOG_RATE_LIMIT messages.  Each slot
+ * has its own spinlock; it is only held to update the counters.
+*/
+typedef struct log_rate_slot
+{
+    const char     *fmt;
+    time_t          start;
+    unsigned int    count;
+    unsigned long   suppressed;
+    char            lock;
+} log_rate_slot_t;
+
+static log_rate_slot_t log_rate[LOG_RATE_SLOTS];
+
+/* Decide whether a rate limited message may be written.  Returns 1 if it
+ * may, 0 if it is suppressed.  If the slot's last interval ended with
+ * messages suppressed, their number, format and the length of the
+ * interval are returned for a summary line.
+*/
+static int
+log_rate_check(const char *fmt, unsigned long *r_suppressed,
+        const char **r_fmt, int *r_secs)
+{
+    log_rate_slot_t    *slot;
+    uintptr_t           h = (uintptr_t)fmt;
+    time_t              now = time(NULL);
+    int                 allow = 1;
+
+    h ^= h >> 11;
+    slot = &(log_rate[(h >> 2) & (LOG_RATE_SLOTS - 1)]);
+
+    while(__atomic_test_and_set(&(slot->lock), __ATOMIC_ACQUIRE))
+        ;
+
+    *r_suppressed = 0;
+    if(slot->fmt != fmt || now - slot->start >= LOG_RATE_INTERVAL)
+    {
+        if(slot->suppressed > 0)
+        {
+            *r_suppressed = slot->suppressed;
+            *r_fmt        = slot->fmt;
+            *r_secs       = (int)(now - slot->start);
+        }
+        slot->fmt        = fmt;
+        slot->start      = now;
+        slot->count      = 0;
+        slot->suppressed = 0;
+    }
+
+    if(slot->count < LOG_RATE_BURST)
+        slot->count++;
+    else
+    {
+        slot->suppressed++;
+        allow = 0;
+    }
+
+    __atomic_clear(&(slot->lock), __ATOMIC_RELEASE);
+    return allow;
+}
+
 int init_logging(int foreground, int use_syslog, char *log_facility, int new_verbosity) {
 
     static_log_flag = LOG_SYSLOG_ONLY;
@@ -87,11 +150,26 @@ int init_logging(int foreground, int use_syslog, char *log_facility, int new_ver
 void log_msg_final(int level, char* msg, ...)
 {
     va_list ap, apse;
+    unsigned long suppressed;
+    const char *sup_fmt = NULL;
+    int sup_secs = 0;
 
     // Make sure the level is in the right range
     if ((level & LOG_VERBOSITY_MASK) > log_verbosity)
         return;
 
+    // Messages that can be triggered remotely are rate limited
+    if(level & LOG_RATE_LIMIT)
+    {
+        if(! log_rate_check(msg, &suppressed, &sup_fmt, &sup_secs))
+            return;
+
+        if(suppressed > 0)
+            log_msg_final(level & LOG_VERBOSITY_MASK,
+                "Suppressed %lu similar message(s) in the last %d second(s): %s",
+                suppressed, sup_secs, sup_fmt);
+    }
+
     va_start(ap, msg);
 
     level |= static_log_flag;
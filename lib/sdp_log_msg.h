@@ -22,6 +22,18 @@
 #define LOG_STDERR_ONLY         (LOG_STDERR | LOG_WITHOUT_SYSLOG)
 #define LOG_VERBOSITY_MASK      0x0FFF
 
+/* LOG_RATE_LIMIT is or'ed with the level of messages that a remote peer
+ * can trigger at will (a scan, a flood of bad packets).  At most
+ * LOG_RATE_BURST such messages from the same call site are written every
+ * LOG_RATE_INTERVAL seconds, the rest are counted and summarized in one
+ * line once the interval is over.  Call sites are told apart by their
+ * format string, hashed into LOG_RATE_SLOTS slots (a power of two).
+*/
+#define LOG_RATE_LIMIT          0x4000
+#define LOG_RATE_INTERVAL       10
+#define LOG_RATE_BURST          5
+#define LOG_RATE_SLOTS          256
+
 #define LOG_DEFAULT_VERBOSITY   LOG_NOTICE     /*!< Default verbosity to use */
 
 enum {
@@ -8,15 +8,23 @@
 #include "sdp_ctrl_client.h"
 
 #include <unistd.h>
+#include <pthread.h>
 #include <json-c/json.h>
 #include <string.h>
 #include "sdp_message.h"
+#include "sdp_msgpack.h"
 #include "sdp_log_msg.h"
 
 // JSON message strings
 const char *sdp_key_action                    = "action";
 const char *sdp_key_stage                     = "stage";
 const char *sdp_key_data                      = "data";
+const char *sdp_key_version                   = "version";
+const char *sdp_key_encodings                 = "encodings";
+const char *sdp_key_request_id                = "request_id";
+
+const char *sdp_encoding_msgpack              = "msgpack";
+const char *sdp_encoding_zlib                 = "zlib";
 
 const char *sdp_action_credentials_good       = "credentials_good";
 const char *sdp_action_keep_alive             = "keep_alive";
@@ -35,6 +43,11 @@ const char *sdp_action_service_remove          = "service_remove";
 const char *sdp_action_service_ack             = "service_ack";
 const char *sdp_action_bad_message            = "bad_message";
 const char *sdp_action_connection_update      = "connection_update";
+const char *sdp_action_connection_delta       = "connection_delta";
+const char *sdp_action_connection_ack         = "connection_ack";
+const char *sdp_action_connection_snapshot_request = "connection_snapshot_request";
+const char *sdp_action_grant_snapshot          = "grant_snapshot";
+const char *sdp_action_cluster_update          = "cluster_update";
 
 const char *sdp_stage_error                   = "error";
 const char *sdp_stage_fulfilling              = "fulfilling";
@@ -42,6 +55,120 @@ const char *sdp_stage_requesting              = "requesting";
 const char *sdp_stage_fulfilled               = "fulfilled";
 const char *sdp_stage_unfulfilled             = "unfulfilled";
 
+// Keys longer than this are of no interest and left out of a scanned message
+#define SDP_MSG_MAX_KEY_LEN 64
+
+/*
+ * Per thread message state, kept across messages so that steady traffic
+ * such as keep-alives and connection reports does not allocate: a json
+ * tokener reset for each parse, the outgoing message object (json-c keeps
+ * its print buffer between serializations) and the buffer MessagePack
+ * output is encoded into. Each settles at its high-water mark.
+ */
+typedef struct sdp_message_pool {
+    json_tokener *tok;
+    json_object *jout;
+    unsigned char *bin;
+    size_t bin_size;
+} sdp_message_pool_t;
+
+static pthread_once_t sdp_message_pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t  sdp_message_pool_key;
+
+static void sdp_message_pool_destroy(void *arg)
+{
+    sdp_message_pool_t *pool = (sdp_message_pool_t *)arg;
+
+    if(pool == NULL)
+        return;
+
+    if(pool->tok != NULL)
+        json_tokener_free(pool->tok);
+    if(pool->jout != NULL)
+        json_object_put(pool->jout);
+    free(pool->bin);
+    free(pool);
+}
+
+static void sdp_message_pool_key_create(void)
+{
+    pthread_key_create(&sdp_message_pool_key, sdp_message_pool_destroy);
+}
+
+static sdp_message_pool_t *sdp_message_pool(void)
+{
+    sdp_message_pool_t *pool = NULL;
+
+    pthread_once(&sdp_message_pool_once, sdp_message_pool_key_create);
+
+    if((pool = pthread_getspecific(sdp_message_pool_key)) != NULL)
+        return pool;
+
+    if((pool = calloc(1, sizeof *pool)) == NULL)
+        return NULL;
+
+    if((pool->tok = json_tokener_new()) == NULL
+            || (pool->jout = json_object_new_object()) == NULL
+            || pthread_setspecific(sdp_message_pool_key, pool) != 0)
+    {
+        sdp_message_pool_destroy(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+// Fill in the pool's outgoing message object for a new message
+static json_object *sdp_message_out(sdp_message_pool_t *pool, const char *action,
+        const json_object *data, uint32_t request_id)
+{
+    json_object *jout_msg = pool->jout;
+
+    json_object_object_add(jout_msg, sdp_key_action,  json_object_new_string(action));
+
+    if(request_id != 0)
+        json_object_object_add(jout_msg, sdp_key_request_id, json_object_new_int64(request_id));
+    else
+        json_object_object_del(jout_msg, sdp_key_request_id);
+
+    if(data != NULL)
+        json_object_object_add(jout_msg, sdp_key_data, json_object_get((json_object*)data));
+    else
+        json_object_object_del(jout_msg, sdp_key_data);
+
+    return jout_msg;
+}
+
+
+/*
+ * Parse len bytes of JSON text, which need not be NUL terminated, with
+ * the calling thread's tokener.
+ */
+json_object *sdp_message_parse_json(const char *str, int len)
+{
+    sdp_message_pool_t *pool = sdp_message_pool();
+    json_object *jobj = NULL;
+
+    if(pool == NULL)
+        return NULL;
+
+    json_tokener_reset(pool->tok);
+    jobj = json_tokener_parse_ex(pool->tok, str, len);
+
+    // a bare number can't be known to have ended until the input does
+    if(jobj == NULL && json_tokener_get_error(pool->tok) == json_tokener_continue)
+        jobj = json_tokener_parse_ex(pool->tok, "", 1);
+
+    if(json_tokener_get_error(pool->tok) != json_tokener_success)
+    {
+        if(jobj != NULL)
+            json_object_put(jobj);
+        return NULL;
+    }
+
+    return jobj;
+}
+
 
 
 static int sdp_get_required_json_string_field(const char *key, json_object *jdata, char **r_field)
@@ -165,6 +292,19 @@ static int sdp_get_message_action(json_object *jmsg, ctrl_action_t *r_action)
     else if(strncmp(action_str, sdp_action_access_remove, strlen(sdp_action_access_remove)) == 0)
         action = CTRL_ACTION_ACCESS_REMOVE;
 
+    else if(strncmp(action_str, sdp_action_connection_ack, strlen(sdp_action_connection_ack)) == 0)
+        action = CTRL_ACTION_CONN_ACK;
+
+    else if(strncmp(action_str, sdp_action_connection_snapshot_request,
+                    strlen(sdp_action_connection_snapshot_request)) == 0)
+        action = CTRL_ACTION_CONN_SNAPSHOT_REQUEST;
+
+    else if(strncmp(action_str, sdp_action_grant_snapshot, strlen(sdp_action_grant_snapshot)) == 0)
+        action = CTRL_ACTION_GRANT_SNAPSHOT;
+
+    else if(strncmp(action_str, sdp_action_cluster_update, strlen(sdp_action_cluster_update)) == 0)
+        action = CTRL_ACTION_CLUSTER_UPDATE;
+
     else if(strncmp(action_str, sdp_action_bad_message, strlen(sdp_action_bad_message)) == 0)
         action = CTRL_ACTION_BAD_MESSAGE;
 
@@ -178,58 +318,277 @@ static int sdp_get_message_action(json_object *jmsg, ctrl_action_t *r_action)
 }
 
 
-int  sdp_message_make(const char *action, const json_object *data, char **r_out_msg)
+/*
+ * Serialize a message into the calling thread's pooled print buffer. The
+ * text returned belongs to the pool and is good until the thread makes
+ * its next message.
+ */
+int  sdp_message_make(const char *action, const json_object *data,
+        uint32_t request_id, const char **r_out_msg)
 {
-    char *out_msg = NULL;
+    sdp_message_pool_t *pool = NULL;
+    json_object *jout_msg = NULL;
     const char *json_string;
-    json_object *jout_msg = json_object_new_object();
     int msg_len = 0;
 
-    if(jout_msg == NULL)
-        return SDP_ERROR_MEMORY_ALLOCATION;
-
     if(action == NULL)
         return SDP_ERROR_INVALID_MSG;
 
-    json_object_object_add(jout_msg, sdp_key_action,  json_object_new_string(action));
+    if((pool = sdp_message_pool()) == NULL)
+        return SDP_ERROR_MEMORY_ALLOCATION;
 
-    if(data != NULL)
-        json_object_object_add(jout_msg, sdp_key_data, json_object_get((json_object*)data));
+    jout_msg = sdp_message_out(pool, action, data, request_id);
 
     json_string = json_object_to_json_string(jout_msg);
+
+    // let go of the caller's data, the text stays in the print buffer
+    json_object_object_del(jout_msg, sdp_key_data);
+
+    if(json_string == NULL)
+        return SDP_ERROR_MEMORY_ALLOCATION;
+
     if((msg_len = strnlen(json_string, SDP_MSG_MAX_LEN)) >= SDP_MSG_MAX_LEN )
     {
     	log_msg(LOG_ERR, "sdp_message_make() message exceeds max len %d", SDP_MSG_MAX_LEN);
-    	if(jout_msg != NULL && json_object_get_type(jout_msg) != json_type_null) json_object_put(jout_msg);
     	return SDP_ERROR_INVALID_MSG_LONG;
     }
 
-    out_msg = strndup(json_string, msg_len);
+    *r_out_msg = json_string;
+    return SDP_SUCCESS;
+}
 
-    if(jout_msg != NULL && json_object_get_type(jout_msg) != json_type_null) json_object_put(jout_msg);
 
-    if(out_msg == NULL)
+/*
+ * As sdp_message_make(), encoding into the calling thread's pooled
+ * MessagePack buffer.
+ */
+int  sdp_message_make_msgpack(const char *action, const json_object *data,
+        uint32_t request_id, const unsigned char **r_out_msg, int *r_out_len)
+{
+    sdp_message_pool_t *pool = NULL;
+    json_object *jout_msg = NULL;
+    int rv = SDP_SUCCESS;
+
+    if(action == NULL)
+        return SDP_ERROR_INVALID_MSG;
+
+    if((pool = sdp_message_pool()) == NULL)
         return SDP_ERROR_MEMORY_ALLOCATION;
 
-    *r_out_msg = out_msg;
+    jout_msg = sdp_message_out(pool, action, data, request_id);
+
+    rv = sdp_msgpack_encode_into(jout_msg, &(pool->bin), &(pool->bin_size), r_out_len);
+
+    json_object_object_del(jout_msg, sdp_key_data);
+
+    if(rv == SDP_SUCCESS)
+        *r_out_msg = pool->bin;
+    return rv;
+}
+
+
+/*
+ * Minimal JSON scanning, just enough to find where a value ends without
+ * building it. Whether the value is valid JSON is left to json-c when it
+ * is parsed.
+ */
+static const char *sdp_json_skip_ws(const char *p, const char *end)
+{
+    while(p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+        p++;
+    return p;
+}
+
+// p is at the opening quote, returns the position after the closing one
+static const char *sdp_json_skip_string(const char *p, const char *end)
+{
+    for(p++; p < end; p++)
+    {
+        if(*p == '\\')
+            p++;
+        else if(*p == '"')
+            return p + 1;
+    }
+    return NULL;
+}
+
+static const char *sdp_json_skip_value(const char *p, const char *end)
+{
+    int depth = 0;
+
+    p = sdp_json_skip_ws(p, end);
+
+    do
+    {
+        if(p >= end)
+            return NULL;
+
+        if(*p == '"')
+        {
+            if((p = sdp_json_skip_string(p, end)) == NULL)
+                return NULL;
+            continue;
+        }
+
+        if(*p == '{' || *p == '[')
+            depth++;
+        else if(*p == '}' || *p == ']')
+        {
+            if(--depth < 0)
+                return NULL;
+        }
+        else if(depth == 0)
+        {
+            // a number, true, false or null
+            while(p < end && strchr(",}] \t\r\n", *p) == NULL)
+                p++;
+            return p;
+        }
+        p++;
+    } while(depth > 0);
+
+    return p;
+}
+
+/*
+ * Parse the top level of a message, except for the value of the data
+ * field, which is only located. Access data can run to many thousands of
+ * stanzas, and is split up by sdp_message_split_array() rather than
+ * parsed here as one tree.
+ */
+static int sdp_message_scan(const char *msg, json_object **r_jmsg,
+        const char **r_data, const char **r_data_end)
+{
+    const char *end = msg + strlen(msg);
+    const char *p = sdp_json_skip_ws(msg, end);
+    const char *key = NULL;
+    const char *val = NULL;
+    const char *val_end = NULL;
+    char key_str[SDP_MSG_MAX_KEY_LEN];
+    size_t key_len = 0;
+    json_object *jmsg = NULL;
+    int rv = SDP_ERROR_INVALID_MSG;
+
+    *r_data = *r_data_end = NULL;
+
+    if(p >= end || *p != '{')
+        return SDP_ERROR_INVALID_MSG;
+
+    if((jmsg = json_object_new_object()) == NULL)
+        return SDP_ERROR_MEMORY_ALLOCATION;
+
+    p = sdp_json_skip_ws(p + 1, end);
+
+    while(p < end && *p != '}')
+    {
+        key = p;
+        if(*key != '"' || (p = sdp_json_skip_string(key, end)) == NULL)
+            goto error;
+
+        p = sdp_json_skip_ws(p, end);
+        if(p >= end || *p != ':')
+            goto error;
+
+        val = sdp_json_skip_ws(p + 1, end);
+        if((val_end = sdp_json_skip_value(val, end)) == NULL)
+            goto error;
+
+        // keys of interest have no escapes, so the quotes are just dropped
+        key_len = p - key - 2;
+        if(key_len < sizeof(key_str))
+        {
+            memcpy(key_str, key + 1, key_len);
+            key_str[key_len] = '\0';
+
+            if(strcmp(key_str, sdp_key_data) == 0)
+            {
+                *r_data = val;
+                *r_data_end = val_end;
+            }
+            else
+                json_object_object_add(jmsg, key_str,
+                        sdp_message_parse_json(val, val_end - val));
+        }
+
+        p = sdp_json_skip_ws(val_end, end);
+        if(p < end && *p == ',')
+            p = sdp_json_skip_ws(p + 1, end);
+        else if(p >= end || *p != '}')
+            goto error;
+    }
+
+    if(p >= end)
+        goto error;
+
+    *r_jmsg = jmsg;
     return SDP_SUCCESS;
+
+error:
+    json_object_put(jmsg);
+    *r_data = *r_data_end = NULL;
+    return rv;
+}
+
+/*
+ * Turn the text of a JSON array into an array of json strings, each
+ * holding the text of one element. Elements are parsed one at a time by
+ * whoever consumes them, so the whole array never exists as a tree.
+ */
+static json_object *sdp_message_split_array(const char *p, const char *end)
+{
+    json_object *jarray = NULL;
+    const char *elem_end = NULL;
+
+    if(*p != '[' || (jarray = json_object_new_array()) == NULL)
+        return NULL;
+
+    p = sdp_json_skip_ws(p + 1, end);
+    if(p < end && *p == ']')
+        return jarray;
+
+    while(p < end)
+    {
+        if((elem_end = sdp_json_skip_value(p, end)) == NULL)
+            break;
+
+        json_object_array_add(jarray, json_object_new_string_len(p, elem_end - p));
+
+        p = sdp_json_skip_ws(elem_end, end);
+        if(p < end && *p == ']')
+            return jarray;
+        if(p >= end || *p != ',')
+            break;
+        p = sdp_json_skip_ws(p + 1, end);
+    }
+
+    json_object_put(jarray);
+    return NULL;
 }
 
 
-int sdp_message_process(const char *msg, ctrl_action_t *r_action, void **r_data)
+/*
+ * Act on a message whose top level is already parsed into jmsg. The data
+ * member is either still text, between data and data_end, or when data
+ * is NULL already part of jmsg. Takes over jmsg.
+ */
+static int sdp_message_interpret(json_object *jmsg, const char *data, const char *data_end,
+        ctrl_action_t *r_action, void **r_data, int64_t *r_version, uint32_t *r_request_id)
 {
-    json_object *jmsg, *jdata;
+    json_object *jdata = NULL, *jversion, *jrequest_id;
     int rv = SDP_ERROR_INVALID_MSG;
     //ctrl_response_result_t result = BAD_RESULT;
     ctrl_action_t action = INVALID_CTRL_ACTION;
 
-    // parse the msg string into json objects
-    jmsg = json_tokener_parse(msg);
-
     // find and interpret the message action
     if((rv = sdp_get_message_action(jmsg, &action)) != SDP_SUCCESS)
         goto cleanup;
 
+    // a reply names the request it answers, if the controller tracks them
+    *r_request_id = 0;
+    if(json_object_object_get_ex(jmsg, sdp_key_request_id, &jrequest_id)
+            && json_object_get_type(jrequest_id) == json_type_int)
+        *r_request_id = (uint32_t)json_object_get_int64(jrequest_id);
+
     // if it's 'credentials good', nothing else to parse
     if(action == CTRL_ACTION_CREDENTIALS_GOOD)
     {
@@ -242,13 +601,45 @@ int sdp_message_process(const char *msg, ctrl_action_t *r_action, void **r_data)
         goto cleanup;
     }
 
-    // if data field is missing, flunk out
-    if( !json_object_object_get_ex(jmsg, sdp_key_data, &jdata))
+    // same for a request to resend all open connections
+    if(action == CTRL_ACTION_CONN_SNAPSHOT_REQUEST)
     {
+        goto cleanup;
+    }
+
+    // a binary message arrives with its data already decoded
+    if(data == NULL)
+    {
+        // if data field is missing, flunk out
+        if(!json_object_object_get_ex(jmsg, sdp_key_data, &jdata) || jdata == NULL)
+        {
+            rv = SDP_ERROR_INVALID_MSG;
+            goto cleanup;
+        }
+    }
+    // access stanzas are left as text for the receiver to parse one at
+    // a time, anything else is parsed whole
+    else if((action == CTRL_ACTION_ACCESS_REFRESH || action == CTRL_ACTION_ACCESS_UPDATE)
+            && *data == '[')
+    {
+        jdata = sdp_message_split_array(data, data_end);
+    }
+    else
+    {
+        jdata = sdp_message_parse_json(data, data_end - data);
+    }
+
+    if(jdata == NULL)
+    {
+        log_msg(LOG_ERR, "Failed to parse data field of controller's message");
         rv = SDP_ERROR_INVALID_MSG;
         goto cleanup;
     }
 
+    // the message holds the data from here on, as if parsed with it
+    if(data != NULL)
+        json_object_object_add(jmsg, sdp_key_data, jdata);
+
     log_msg(LOG_DEBUG, "Data portion of controller's message:");
     log_msg(LOG_DEBUG, "%s", json_object_to_json_string_ext(jdata, JSON_C_TO_STRING_PRETTY));
 
@@ -279,9 +670,52 @@ int sdp_message_process(const char *msg, ctrl_action_t *r_action, void **r_data)
             goto cleanup;
         }
 
+        // access and service data may carry the version of the controller's
+        // table that results from applying it, 0 means unversioned
+        *r_version = 0;
+        if(json_object_object_get_ex(jmsg, sdp_key_version, &jversion)
+                && json_object_get_type(jversion) == json_type_int)
+            *r_version = json_object_get_int64(jversion);
+
         // increment the reference count to the data portion of the json message
         *r_data = (void*)json_object_get(jdata);
     }
+    else if(action == CTRL_ACTION_CONN_ACK)
+    {
+        // carries the sequence number of the last connection delta received
+        if(json_object_get_type(jdata) != json_type_object)
+        {
+            log_msg(LOG_ERR, "jdata object was not json_type_object as expected");
+            rv = SDP_ERROR_INVALID_MSG;
+            goto cleanup;
+        }
+
+        *r_data = (void*)json_object_get(jdata);
+    }
+    else if(action == CTRL_ACTION_GRANT_SNAPSHOT)
+    {
+        // the access grants the controller currently holds for this gateway
+        if(json_object_get_type(jdata) != json_type_array)
+        {
+            log_msg(LOG_ERR, "jdata object was not json_type_array as expected");
+            rv = SDP_ERROR_INVALID_MSG;
+            goto cleanup;
+        }
+
+        *r_data = (void*)json_object_get(jdata);
+    }
+    else if(action == CTRL_ACTION_CLUSTER_UPDATE)
+    {
+        // the gateways sharing this gateway's SDP clients
+        if(json_object_get_type(jdata) != json_type_object)
+        {
+            log_msg(LOG_ERR, "jdata object was not json_type_object as expected");
+            rv = SDP_ERROR_INVALID_MSG;
+            goto cleanup;
+        }
+
+        *r_data = (void*)json_object_get(jdata);
+    }
     else if(action == CTRL_ACTION_BAD_MESSAGE)
     {
         log_msg(LOG_ERR, "Received notice from controller that it received the following bad message:");
@@ -306,6 +740,44 @@ cleanup:
 }
 
 
+int sdp_message_process(const char *msg, ctrl_action_t *r_action, void **r_data,
+        int64_t *r_version, uint32_t *r_request_id)
+{
+    json_object *jmsg = NULL;
+    const char *data = NULL, *data_end = NULL;
+    int rv = SDP_ERROR_INVALID_MSG;
+
+    // parse the msg string into json objects, all but the data field
+    if((rv = sdp_message_scan(msg, &jmsg, &data, &data_end)) != SDP_SUCCESS)
+    {
+        if(jmsg != NULL) json_object_put(jmsg);
+        return rv;
+    }
+
+    return sdp_message_interpret(jmsg, data, data_end, r_action, r_data, r_version, r_request_id);
+}
+
+
+int sdp_message_process_msgpack(const unsigned char *msg, int len,
+        ctrl_action_t *r_action, void **r_data, int64_t *r_version, uint32_t *r_request_id)
+{
+    json_object *jmsg = NULL;
+    int rv = SDP_ERROR_INVALID_MSG;
+
+    if((rv = sdp_msgpack_decode(msg, len, &jmsg)) != SDP_SUCCESS)
+        return rv;
+
+    if(json_object_get_type(jmsg) != json_type_object)
+    {
+        log_msg(LOG_ERR, "Binary message from controller is not a map");
+        if(jmsg != NULL) json_object_put(jmsg);
+        return SDP_ERROR_INVALID_MSG;
+    }
+
+    return sdp_message_interpret(jmsg, NULL, NULL, r_action, r_data, r_version, r_request_id);
+}
+
+
 int sdp_message_parse_cred_fields(json_object *jdata, void **r_creds)
 {
     sdp_creds_t creds = NULL;
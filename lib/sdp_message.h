@@ -8,6 +8,7 @@
 #ifndef SDP_MESSAGE_H_
 #define SDP_MESSAGE_H_
 
+#include <stdint.h>
 #include <json-c/json.h>
 
 typedef enum {
@@ -23,6 +24,10 @@ typedef enum {
 	CTRL_ACTION_SERVICE_UPDATE,
 	CTRL_ACTION_SERVICE_REMOVE,
 	CTRL_ACTION_SERVICE_ACK,
+    CTRL_ACTION_CONN_ACK,
+    CTRL_ACTION_CONN_SNAPSHOT_REQUEST,
+    CTRL_ACTION_GRANT_SNAPSHOT,
+    CTRL_ACTION_CLUSTER_UPDATE,
     CTRL_ACTION_BAD_MESSAGE
 } ctrl_action_t;
 
@@ -52,6 +57,12 @@ typedef struct sdp_creds *sdp_creds_t;
 extern const char *sdp_key_action;
 extern const char *sdp_key_stage;
 extern const char *sdp_key_data;
+extern const char *sdp_key_version;
+extern const char *sdp_key_encodings;
+extern const char *sdp_key_request_id;
+
+extern const char *sdp_encoding_msgpack;
+extern const char *sdp_encoding_zlib;
 
 extern const char *sdp_action_credentials_good;
 extern const char *sdp_action_keep_alive;
@@ -70,6 +81,11 @@ extern const char *sdp_action_service_remove;
 extern const char *sdp_action_service_ack;
 extern const char *sdp_action_bad_message;
 extern const char *sdp_action_connection_update;
+extern const char *sdp_action_connection_delta;
+extern const char *sdp_action_connection_ack;
+extern const char *sdp_action_connection_snapshot_request;
+extern const char *sdp_action_grant_snapshot;
+extern const char *sdp_action_cluster_update;
 
 extern const char *sdp_stage_error;
 extern const char *sdp_stage_fulfilling;
@@ -84,8 +100,15 @@ extern const char *sdp_msg_cred_unfulfilled;
 
 int  sdp_get_json_string_field(const char *key, json_object *jdata, char **r_field);
 int  sdp_get_json_int_field(const char *key, json_object *jdata, int *r_field);
-int  sdp_message_make(const char *subject, const json_object *data, char **r_out_msg);
-int  sdp_message_process(const char *msg, ctrl_action_t *r_action, void **r_data); //json_object **r_jdata);
+int  sdp_message_make(const char *subject, const json_object *data,
+        uint32_t request_id, const char **r_out_msg);
+int  sdp_message_process(const char *msg, ctrl_action_t *r_action, void **r_data,
+        int64_t *r_version, uint32_t *r_request_id); //json_object **r_jdata);
+int  sdp_message_make_msgpack(const char *subject, const json_object *data,
+        uint32_t request_id, const unsigned char **r_out_msg, int *r_out_len);
+json_object *sdp_message_parse_json(const char *str, int len);
+int  sdp_message_process_msgpack(const unsigned char *msg, int len,
+        ctrl_action_t *r_action, void **r_data, int64_t *r_version, uint32_t *r_request_id);
 int  sdp_message_parse_cred_fields(json_object *jdata, void **r_creds);
 void sdp_message_destroy_creds(sdp_creds_t creds);
 
@@ -0,0 +1,485 @@
+/*
+ * sdp_msgpack.c
+ *
+ *  MessagePack encoding of controller messages. Only what JSON can hold
+ *  is supported: nil, booleans, integers, floats, strings, arrays and
+ *  maps with string keys. Binary data decodes to a string, extension
+ *  types are rejected.
+ */
+
+#include "sdp_ctrl_client.h"
+#include "sdp_msgpack.h"
+#include "sdp_log_msg.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <json-c/json.h>
+
+typedef struct sdp_msgpack_buf {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+} sdp_msgpack_buf_t;
+
+
+static int sdp_msgpack_reserve(sdp_msgpack_buf_t *buf, size_t len)
+{
+    size_t size = buf->size ? buf->size : SDP_MSGPACK_INITIAL_BUF_LEN;
+    unsigned char *data = NULL;
+
+    if(buf->len + len <= buf->size)
+        return SDP_SUCCESS;
+
+    while(size < buf->len + len)
+        size *= 2;
+
+    if((data = realloc(buf->data, size)) == NULL)
+        return SDP_ERROR_MEMORY_ALLOCATION;
+
+    buf->data = data;
+    buf->size = size;
+    return SDP_SUCCESS;
+}
+
+// a type byte followed by a big-endian value of len bytes
+static int sdp_msgpack_put(sdp_msgpack_buf_t *buf, unsigned char type,
+        uint64_t val, int len)
+{
+    int i;
+
+    if(sdp_msgpack_reserve(buf, 1 + len) != SDP_SUCCESS)
+        return SDP_ERROR_MEMORY_ALLOCATION;
+
+    buf->data[buf->len++] = type;
+    for(i = len - 1; i >= 0; i--)
+        buf->data[buf->len++] = (unsigned char)(val >> (8 * i));
+
+    return SDP_SUCCESS;
+}
+
+static int sdp_msgpack_put_int(sdp_msgpack_buf_t *buf, int64_t val)
+{
+    if(val >= 0)
+    {
+        if(val < 128)
+            return sdp_msgpack_put(buf, (unsigned char)val, 0, 0);
+        if(val <= UINT8_MAX)
+            return sdp_msgpack_put(buf, 0xcc, val, 1);
+        if(val <= UINT16_MAX)
+            return sdp_msgpack_put(buf, 0xcd, val, 2);
+        if(val <= UINT32_MAX)
+            return sdp_msgpack_put(buf, 0xce, val, 4);
+        return sdp_msgpack_put(buf, 0xcf, val, 8);
+    }
+
+    if(val >= -32)
+        return sdp_msgpack_put(buf, (unsigned char)val, 0, 0);
+    if(val >= INT8_MIN)
+        return sdp_msgpack_put(buf, 0xd0, (uint8_t)val, 1);
+    if(val >= INT16_MIN)
+        return sdp_msgpack_put(buf, 0xd1, (uint16_t)val, 2);
+    if(val >= INT32_MIN)
+        return sdp_msgpack_put(buf, 0xd2, (uint32_t)val, 4);
+    return sdp_msgpack_put(buf, 0xd3, (uint64_t)val, 8);
+}
+
+static int sdp_msgpack_put_str(sdp_msgpack_buf_t *buf, const char *str, size_t len)
+{
+    int rv = SDP_SUCCESS;
+
+    if(len < 32)
+        rv = sdp_msgpack_put(buf, 0xa0 | (unsigned char)len, 0, 0);
+    else if(len <= UINT8_MAX)
+        rv = sdp_msgpack_put(buf, 0xd9, len, 1);
+    else if(len <= UINT16_MAX)
+        rv = sdp_msgpack_put(buf, 0xda, len, 2);
+    else
+        rv = sdp_msgpack_put(buf, 0xdb, len, 4);
+
+    if(rv != SDP_SUCCESS || sdp_msgpack_reserve(buf, len) != SDP_SUCCESS)
+        return SDP_ERROR_MEMORY_ALLOCATION;
+
+    memcpy(buf->data + buf->len, str, len);
+    buf->len += len;
+    return SDP_SUCCESS;
+}
+
+// fixarray/fixmap below 16 entries, then 16 and 32 bit counts
+static int sdp_msgpack_put_count(sdp_msgpack_buf_t *buf, unsigned char fix,
+        unsigned char type16, size_t count)
+{
+    if(count < 16)
+        return sdp_msgpack_put(buf, fix | (unsigned char)count, 0, 0);
+    if(count <= UINT16_MAX)
+        return sdp_msgpack_put(buf, type16, count, 2);
+    return sdp_msgpack_put(buf, type16 + 1, count, 4);
+}
+
+static int sdp_msgpack_encode_obj(sdp_msgpack_buf_t *buf, json_object *jobj, int depth)
+{
+    struct json_object_iterator it, it_end;
+    const char *key = NULL;
+    union { double d; uint64_t u; } dbl;
+    size_t i, count;
+    int rv = SDP_SUCCESS;
+
+    if(depth > SDP_MSGPACK_MAX_DEPTH)
+        return SDP_ERROR_INVALID_MSG;
+
+    switch(json_object_get_type(jobj))
+    {
+        case json_type_null:
+            return sdp_msgpack_put(buf, 0xc0, 0, 0);
+
+        case json_type_boolean:
+            return sdp_msgpack_put(buf, json_object_get_boolean(jobj) ? 0xc3 : 0xc2, 0, 0);
+
+        case json_type_int:
+            return sdp_msgpack_put_int(buf, json_object_get_int64(jobj));
+
+        case json_type_double:
+            dbl.d = json_object_get_double(jobj);
+            return sdp_msgpack_put(buf, 0xcb, dbl.u, 8);
+
+        case json_type_string:
+            return sdp_msgpack_put_str(buf, json_object_get_string(jobj),
+                    json_object_get_string_len(jobj));
+
+        case json_type_array:
+            count = json_object_array_length(jobj);
+            if((rv = sdp_msgpack_put_count(buf, 0x90, 0xdc, count)) != SDP_SUCCESS)
+                return rv;
+
+            for(i = 0; i < count; i++)
+            {
+                if((rv = sdp_msgpack_encode_obj(buf,
+                        json_object_array_get_idx(jobj, i), depth + 1)) != SDP_SUCCESS)
+                    return rv;
+            }
+            return rv;
+
+        case json_type_object:
+            count = json_object_object_length(jobj);
+            if((rv = sdp_msgpack_put_count(buf, 0x80, 0xde, count)) != SDP_SUCCESS)
+                return rv;
+
+            it = json_object_iter_begin(jobj);
+            it_end = json_object_iter_end(jobj);
+
+            while(!json_object_iter_equal(&it, &it_end))
+            {
+                key = json_object_iter_peek_name(&it);
+
+                if((rv = sdp_msgpack_put_str(buf, key, strlen(key))) != SDP_SUCCESS
+                        || (rv = sdp_msgpack_encode_obj(buf,
+                                json_object_iter_peek_value(&it), depth + 1)) != SDP_SUCCESS)
+                    return rv;
+
+                json_object_iter_next(&it);
+            }
+            return rv;
+    }
+
+    return SDP_ERROR_INVALID_MSG;
+}
+
+
+int sdp_msgpack_encode(json_object *jobj, unsigned char **r_buf, int *r_len)
+{
+    unsigned char *data = NULL;
+    size_t size = 0;
+    int rv = SDP_SUCCESS;
+
+    if((rv = sdp_msgpack_encode_into(jobj, &data, &size, r_len)) != SDP_SUCCESS)
+    {
+        free(data);
+        return rv;
+    }
+
+    *r_buf = data;
+    return SDP_SUCCESS;
+}
+
+
+/*
+ * Encode into a buffer the caller keeps between messages, growing it
+ * only when a message does not fit. The buffer is the caller's to free
+ * whether or not encoding succeeds.
+ */
+int sdp_msgpack_encode_into(json_object *jobj, unsigned char **io_buf,
+        size_t *io_size, int *r_len)
+{
+    sdp_msgpack_buf_t buf;
+    int rv = SDP_SUCCESS;
+
+    buf.data = *io_buf;
+    buf.size = *io_size;
+    buf.len = 0;
+
+    rv = sdp_msgpack_encode_obj(&buf, jobj, 0);
+
+    *io_buf = buf.data;
+    *io_size = buf.size;
+
+    if(rv != SDP_SUCCESS)
+    {
+        log_msg(LOG_ERR, "sdp_msgpack_encode() failed to encode message");
+        return rv;
+    }
+
+    *r_len = (int)buf.len;
+    return SDP_SUCCESS;
+}
+
+
+typedef struct sdp_msgpack_reader {
+    const unsigned char *p;
+    const unsigned char *end;
+} sdp_msgpack_reader_t;
+
+
+static int sdp_msgpack_get(sdp_msgpack_reader_t *rd, int len, uint64_t *r_val)
+{
+    uint64_t val = 0;
+    int i;
+
+    if(rd->end - rd->p < len)
+        return SDP_ERROR_INVALID_MSG_SHORT;
+
+    for(i = 0; i < len; i++)
+        val = (val << 8) | *rd->p++;
+
+    *r_val = val;
+    return SDP_SUCCESS;
+}
+
+static int sdp_msgpack_decode_obj(sdp_msgpack_reader_t *rd, int depth, json_object **r_jobj);
+
+static int sdp_msgpack_decode_str(sdp_msgpack_reader_t *rd, uint64_t len, json_object **r_jobj)
+{
+    if((uint64_t)(rd->end - rd->p) < len)
+        return SDP_ERROR_INVALID_MSG_SHORT;
+
+    if((*r_jobj = json_object_new_string_len((const char *)rd->p, (int)len)) == NULL)
+        return SDP_ERROR_MEMORY_ALLOCATION;
+
+    rd->p += len;
+    return SDP_SUCCESS;
+}
+
+static int sdp_msgpack_decode_array(sdp_msgpack_reader_t *rd, uint64_t count,
+        int depth, json_object **r_jobj)
+{
+    json_object *jarray = NULL;
+    json_object *jval = NULL;
+    int rv = SDP_SUCCESS;
+
+    // every element takes at least a byte
+    if((uint64_t)(rd->end - rd->p) < count)
+        return SDP_ERROR_INVALID_MSG_SHORT;
+
+    if((jarray = json_object_new_array()) == NULL)
+        return SDP_ERROR_MEMORY_ALLOCATION;
+
+    while(count--)
+    {
+        if((rv = sdp_msgpack_decode_obj(rd, depth + 1, &jval)) != SDP_SUCCESS)
+        {
+            json_object_put(jarray);
+            return rv;
+        }
+        json_object_array_add(jarray, jval);
+    }
+
+    *r_jobj = jarray;
+    return SDP_SUCCESS;
+}
+
+static int sdp_msgpack_decode_map(sdp_msgpack_reader_t *rd, uint64_t count,
+        int depth, json_object **r_jobj)
+{
+    json_object *jmap = NULL;
+    json_object *jkey = NULL;
+    json_object *jval = NULL;
+    int rv = SDP_SUCCESS;
+
+    if((uint64_t)(rd->end - rd->p) / 2 < count)
+        return SDP_ERROR_INVALID_MSG_SHORT;
+
+    if((jmap = json_object_new_object()) == NULL)
+        return SDP_ERROR_MEMORY_ALLOCATION;
+
+    while(count--)
+    {
+        if((rv = sdp_msgpack_decode_obj(rd, depth + 1, &jkey)) != SDP_SUCCESS)
+            goto error;
+
+        if(json_object_get_type(jkey) != json_type_string)
+        {
+            json_object_put(jkey);
+            rv = SDP_ERROR_INVALID_MSG;
+            goto error;
+        }
+
+        if((rv = sdp_msgpack_decode_obj(rd, depth + 1, &jval)) != SDP_SUCCESS)
+        {
+            json_object_put(jkey);
+            goto error;
+        }
+
+        json_object_object_add(jmap, json_object_get_string(jkey), jval);
+        json_object_put(jkey);
+    }
+
+    *r_jobj = jmap;
+    return SDP_SUCCESS;
+
+error:
+    json_object_put(jmap);
+    return rv;
+}
+
+static int sdp_msgpack_decode_obj(sdp_msgpack_reader_t *rd, int depth, json_object **r_jobj)
+{
+    union { double d; uint64_t u; } dbl;
+    union { float f; uint32_t u; } flt;
+    uint64_t val = 0;
+    unsigned char type;
+    int rv = SDP_SUCCESS;
+
+    *r_jobj = NULL;
+
+    if(depth > SDP_MSGPACK_MAX_DEPTH)
+        return SDP_ERROR_INVALID_MSG;
+
+    if(rd->p >= rd->end)
+        return SDP_ERROR_INVALID_MSG_SHORT;
+
+    type = *rd->p++;
+
+    if(type < 0x80)
+        *r_jobj = json_object_new_int64(type);
+    else if(type >= 0xe0)
+        *r_jobj = json_object_new_int64((int8_t)type);
+    else if((type & 0xf0) == 0x80)
+        return sdp_msgpack_decode_map(rd, type & 0x0f, depth, r_jobj);
+    else if((type & 0xf0) == 0x90)
+        return sdp_msgpack_decode_array(rd, type & 0x0f, depth, r_jobj);
+    else if((type & 0xe0) == 0xa0)
+        return sdp_msgpack_decode_str(rd, type & 0x1f, r_jobj);
+    else
+    {
+        switch(type)
+        {
+            case 0xc0:
+                // a JSON null is a NULL json_object
+                return SDP_SUCCESS;
+
+            case 0xc2:
+            case 0xc3:
+                *r_jobj = json_object_new_boolean(type == 0xc3);
+                break;
+
+            case 0xcc: case 0xcd: case 0xce: case 0xcf:
+                if((rv = sdp_msgpack_get(rd, 1 << (type - 0xcc), &val)) != SDP_SUCCESS)
+                    return rv;
+                if(val > INT64_MAX)
+                    return SDP_ERROR_INVALID_MSG;
+                *r_jobj = json_object_new_int64((int64_t)val);
+                break;
+
+            case 0xd0:
+                if((rv = sdp_msgpack_get(rd, 1, &val)) != SDP_SUCCESS)
+                    return rv;
+                *r_jobj = json_object_new_int64((int8_t)val);
+                break;
+
+            case 0xd1:
+                if((rv = sdp_msgpack_get(rd, 2, &val)) != SDP_SUCCESS)
+                    return rv;
+                *r_jobj = json_object_new_int64((int16_t)val);
+                break;
+
+            case 0xd2:
+                if((rv = sdp_msgpack_get(rd, 4, &val)) != SDP_SUCCESS)
+                    return rv;
+                *r_jobj = json_object_new_int64((int32_t)val);
+                break;
+
+            case 0xd3:
+                if((rv = sdp_msgpack_get(rd, 8, &val)) != SDP_SUCCESS)
+                    return rv;
+                *r_jobj = json_object_new_int64((int64_t)val);
+                break;
+
+            case 0xca:
+                if((rv = sdp_msgpack_get(rd, 4, &val)) != SDP_SUCCESS)
+                    return rv;
+                flt.u = (uint32_t)val;
+                *r_jobj = json_object_new_double(flt.f);
+                break;
+
+            case 0xcb:
+                if((rv = sdp_msgpack_get(rd, 8, &val)) != SDP_SUCCESS)
+                    return rv;
+                dbl.u = val;
+                *r_jobj = json_object_new_double(dbl.d);
+                break;
+
+            // str and bin
+            case 0xd9: case 0xc4:
+            case 0xda: case 0xc5:
+            case 0xdb: case 0xc6:
+                if((rv = sdp_msgpack_get(rd,
+                        1 << (type >= 0xd9 ? type - 0xd9 : type - 0xc4), &val)) != SDP_SUCCESS)
+                    return rv;
+                return sdp_msgpack_decode_str(rd, val, r_jobj);
+
+            case 0xdc: case 0xdd:
+                if((rv = sdp_msgpack_get(rd, type == 0xdc ? 2 : 4, &val)) != SDP_SUCCESS)
+                    return rv;
+                return sdp_msgpack_decode_array(rd, val, depth, r_jobj);
+
+            case 0xde: case 0xdf:
+                if((rv = sdp_msgpack_get(rd, type == 0xde ? 2 : 4, &val)) != SDP_SUCCESS)
+                    return rv;
+                return sdp_msgpack_decode_map(rd, val, depth, r_jobj);
+
+            default:
+                log_msg(LOG_ERR, "Unsupported MessagePack type 0x%02x", type);
+                return SDP_ERROR_INVALID_MSG;
+        }
+    }
+
+    if(*r_jobj == NULL)
+        return SDP_ERROR_MEMORY_ALLOCATION;
+
+    return SDP_SUCCESS;
+}
+
+
+int sdp_msgpack_decode(const unsigned char *buf, int len, json_object **r_jobj)
+{
+    sdp_msgpack_reader_t rd;
+    json_object *jobj = NULL;
+    int rv = SDP_SUCCESS;
+
+    rd.p = buf;
+    rd.end = buf + len;
+
+    if((rv = sdp_msgpack_decode_obj(&rd, 0, &jobj)) != SDP_SUCCESS)
+    {
+        log_msg(LOG_ERR, "sdp_msgpack_decode() failed to decode message");
+        return rv;
+    }
+
+    if(rd.p != rd.end)
+    {
+        log_msg(LOG_ERR, "sdp_msgpack_decode() found %d trailing bytes", (int)(rd.end - rd.p));
+        json_object_put(jobj);
+        return SDP_ERROR_INVALID_MSG;
+    }
+
+    *r_jobj = jobj;
+    return SDP_SUCCESS;
+}
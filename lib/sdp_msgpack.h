@@ -0,0 +1,22 @@
+/*
+ * sdp_msgpack.h
+ *
+ *  MessagePack encoding of controller messages
+ */
+
+#ifndef SDP_MSGPACK_H_
+#define SDP_MSGPACK_H_
+
+#include <json-c/json.h>
+
+enum {
+    SDP_MSGPACK_MAX_DEPTH = 32,
+    SDP_MSGPACK_INITIAL_BUF_LEN = 256
+};
+
+int  sdp_msgpack_encode(json_object *jobj, unsigned char **r_buf, int *r_len);
+int  sdp_msgpack_encode_into(json_object *jobj, unsigned char **io_buf,
+        size_t *io_size, int *r_len);
+int  sdp_msgpack_decode(const unsigned char *buf, int len, json_object **r_jobj);
+
+#endif /* SDP_MSGPACK_H_ */
@@ -154,40 +154,46 @@ long double sdp_strtold_wrapper(const char * const str, const int min,
 }
 
 
-// Set ownership and permissions for file using info from stat_buf
-static int sdp_set_file_info(const char *file_path, struct stat *stat_buf)
+int sdp_move_file_to_backup(const char *file_path)
 {
-    int rv = 0;
+    struct stat stat_buf;
+    char backup_path[PATH_MAX + 1] = {0};
 
-    if(!stat_buf)
+    if( !file_path )
     {
-        log_msg(LOG_ERR, "File stat info not provided");
+        log_msg(LOG_ERR, "Passed null argument to function");
         return SDP_ERROR_BAD_ARG;
     }
 
-    if((rv = chown(file_path, stat_buf->st_uid, stat_buf->st_gid)) != 0)
+    if( PATH_MAX < strnlen(file_path, PATH_MAX + 1) )
     {
-        log_msg(
-            LOG_ERR, 
-            "Failed to set owner/group to %d:%d for file: %s", 
-            stat_buf->st_uid,
-            stat_buf->st_gid,
-            file_path
-        );
-
-        return SDP_ERROR_FILESYSTEM_OPERATION;
+        log_msg(LOG_ERR, "Path too long");
+        return SDP_ERROR_BAD_ARG;
     }
 
+    strncpy(backup_path, file_path, PATH_MAX);
+    strncat(backup_path, BACKUP_PATH_POSTFIX, POSTFIX_LEN);
 
-    if((rv = chmod(file_path, stat_buf->st_mode)) != 0)
+    if(stat(backup_path, &stat_buf) == 0)
     {
-        log_msg(
-            LOG_ERR, 
-            "Failed to set mode to %d for file: %s", 
-            stat_buf->st_mode,
-            file_path
-        );
+        if(remove(backup_path) != 0)
+        {
+            log_msg(LOG_ERR, "Failed to delete old version of file: %s", backup_path);
+            return SDP_ERROR_FILESYSTEM_OPERATION;
+        }
+    }
+
+    // Does the file exist
+    if(stat(file_path, &stat_buf) != 0)
+    {
+        log_msg(LOG_ERR, "Failed to find file: %s", file_path);
+        return SDP_ERROR_BAD_ARG;
+    }
 
+    // Try to rename it
+    if(rename(file_path, backup_path) != 0)
+    {
+        log_msg(LOG_ERR, "Failed to rename file: %s", file_path);
         return SDP_ERROR_FILESYSTEM_OPERATION;
     }
 
@@ -195,19 +201,14 @@ static int sdp_set_file_info(const char *file_path, struct stat *stat_buf)
 }
 
 
-
-
-int sdp_move_file_to_backup(const char *file_path)
+// Keep the current version of file_path as its backup without moving it
+// out of the way, so the file stays in place until the new version is
+// renamed over it and sdp_restore_file() still has something to restore
+static int sdp_link_file_to_backup(const char *file_path)
 {
     struct stat stat_buf;
     char backup_path[PATH_MAX + 1] = {0};
 
-    if( !file_path )
-    {
-        log_msg(LOG_ERR, "Passed null argument to function");
-        return SDP_ERROR_BAD_ARG;
-    }
-
     if( PATH_MAX < strnlen(file_path, PATH_MAX + 1) )
     {
         log_msg(LOG_ERR, "Path too long");
@@ -226,17 +227,57 @@ int sdp_move_file_to_backup(const char *file_path)
         }
     }
 
-    // Does the file exist
-    if(stat(file_path, &stat_buf) != 0)
+    if(link(file_path, backup_path) != 0)
     {
-        log_msg(LOG_ERR, "Failed to find file: %s", file_path);
+        log_msg(LOG_ERR, "Failed to link file %s to backup: %s",
+                file_path, strerror(errno));
+        return SDP_ERROR_FILESYSTEM_OPERATION;
+    }
+
+    return SDP_SUCCESS;
+}
+
+
+// Create a temporary file next to file_path (same directory, so it can
+// be renamed over it) with the ownership and permissions from stat_buf
+// already set, before anything is written to it
+static int sdp_open_temp_file(const char *file_path, struct stat *stat_buf,
+                              char *tmp_path, FILE **r_fp)
+{
+    int fd = -1;
+
+    if( PATH_MAX < strnlen(file_path, PATH_MAX + 1) + 7 )
+    {
+        log_msg(LOG_ERR, "Path too long");
         return SDP_ERROR_BAD_ARG;
     }
 
-    // Try to rename it
-    if(rename(file_path, backup_path) != 0)
+    snprintf(tmp_path, PATH_MAX + 1, "%s.XXXXXX", file_path);
+
+    if((fd = mkstemp(tmp_path)) < 0)
     {
-        log_msg(LOG_ERR, "Failed to rename file: %s", file_path);
+        log_msg(LOG_ERR, "Failed to create temporary file for %s: %s",
+                file_path, strerror(errno));
+        tmp_path[0] = '\0';
+        return SDP_ERROR_FILESYSTEM_OPERATION;
+    }
+
+    if(fchown(fd, stat_buf->st_uid, stat_buf->st_gid) != 0
+            || fchmod(fd, stat_buf->st_mode & 07777) != 0)
+    {
+        log_msg(LOG_ERR, "Failed to set owner/mode for file: %s", tmp_path);
+        close(fd);
+        unlink(tmp_path);
+        tmp_path[0] = '\0';
+        return SDP_ERROR_FILESYSTEM_OPERATION;
+    }
+
+    if((*r_fp = fdopen(fd, "w")) == NULL)
+    {
+        log_msg(LOG_ERR, "Failed to open file: %s", tmp_path);
+        close(fd);
+        unlink(tmp_path);
+        tmp_path[0] = '\0';
         return SDP_ERROR_FILESYSTEM_OPERATION;
     }
 
@@ -244,13 +285,68 @@ int sdp_move_file_to_backup(const char *file_path)
 }
 
 
+// Flush the temporary file to disk and rename it over file_path, then
+// sync the directory so the rename itself survives a crash. Readers see
+// either the old or the new file, never a partial one. The temporary
+// file is closed (and removed on failure) in every case.
+static int sdp_commit_temp_file(FILE *fp, char *tmp_path, const char *file_path)
+{
+    char dir_path[PATH_MAX + 1] = {0};
+    char *slash = NULL;
+    int dir_fd = -1;
+
+    if(fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+    {
+        log_msg(LOG_ERR, "Failed to write file %s: %s", tmp_path, strerror(errno));
+        fclose(fp);
+        unlink(tmp_path);
+        return SDP_ERROR_FILESYSTEM_OPERATION;
+    }
+
+    if(fclose(fp) != 0)
+    {
+        log_msg(LOG_ERR, "Failed to close file %s: %s", tmp_path, strerror(errno));
+        unlink(tmp_path);
+        return SDP_ERROR_FILESYSTEM_OPERATION;
+    }
+
+    if(rename(tmp_path, file_path) != 0)
+    {
+        log_msg(LOG_ERR, "Failed to rename %s to %s: %s",
+                tmp_path, file_path, strerror(errno));
+        unlink(tmp_path);
+        return SDP_ERROR_FILESYSTEM_OPERATION;
+    }
+
+    strncpy(dir_path, file_path, PATH_MAX);
+    if((slash = strrchr(dir_path, '/')) == NULL)
+        strncpy(dir_path, ".", PATH_MAX);
+    else if(slash == dir_path)
+        slash[1] = '\0';
+    else
+        *slash = '\0';
+
+    // the new contents are already in place, so a failure here is
+    // only worth a warning
+    if((dir_fd = open(dir_path, O_RDONLY)) >= 0)
+    {
+        if(fsync(dir_fd) != 0)
+            log_msg(LOG_WARNING, "Failed to sync directory: %s", dir_path);
+        close(dir_fd);
+    }
+
+    return SDP_SUCCESS;
+}
+
+
 int sdp_save_to_file(const char *file_path, const char *data)
 {
     int rv = SDP_ERROR_FILESYSTEM_OPERATION;
     FILE *fp = NULL;
     int num_bytes = 0;
-    size_t data_len = strnlen(data, SDP_MSG_MAX_LEN);
+    size_t data_len = 0;
     struct stat stat_buf;
+    char tmp_path[PATH_MAX + 1] = {0};
 
     if( !(data && file_path))
     {
@@ -258,34 +354,24 @@ int sdp_save_to_file(const char *file_path, const char *data)
         return SDP_ERROR_BAD_ARG;
     }
 
+    data_len = strnlen(data, SDP_MSG_MAX_LEN);
+
     if((stat(file_path, &stat_buf)) != 0)
     {
         log_msg(LOG_ERR, "File not found: %s", file_path);
         return SDP_ERROR_BAD_ARG;
     }
 
-    if((rv = sdp_move_file_to_backup(file_path)) != SDP_SUCCESS)
+    if((rv = sdp_link_file_to_backup(file_path)) != SDP_SUCCESS)
     {
         log_msg(LOG_ERR, "Backup process failed for %s", file_path);
         return SDP_ERROR_FILESYSTEM_OPERATION;
     }
 
-    // Reset errno (just in case)
-    errno = 0;
-
-    // Reset rv, all following potential error points result in same error code
-    rv = SDP_ERROR_FILESYSTEM_OPERATION;
-
-    // Create/open the new file
-    fp = fopen(file_path, "w");
-
-    if(fp == NULL || errno)
-    {
-        perror("Error trying to open file");
-        log_msg(LOG_ERR, "File path was: %s", file_path);
-        goto cleanup;
-    }
-
+    // The new version is written next to the file and only renamed over
+    // it once complete, the file itself is never missing or partial
+    if((rv = sdp_open_temp_file(file_path, &stat_buf, tmp_path, &fp)) != SDP_SUCCESS)
+        return rv;
 
     // Reset errno (just in case)
     errno = 0;
@@ -306,30 +392,13 @@ int sdp_save_to_file(const char *file_path, const char *data)
         goto cleanup;
     }
 
-    fclose(fp);
-    fp = NULL;
-
-    // copy file ownership/permissions to new file
-    if((rv = sdp_set_file_info(file_path, &stat_buf)) != SDP_SUCCESS)
-        goto cleanup;
-
-    // arriving here means all is well
-    rv = SDP_SUCCESS;
+    rv = sdp_commit_temp_file(fp, tmp_path, file_path);
+    return rv;
 
 cleanup:
-    if(fp)
-        fclose(fp);
-
-    // try to restore backup if things went wrong
-    if(rv != SDP_SUCCESS)
-    {
-        if(sdp_restore_file(file_path) != SDP_SUCCESS)
-            log_msg(LOG_ERR, "Failed to restore file: %s", file_path);
-        else
-            log_msg(LOG_ERR, "Successfully restored file: %s", file_path);
-    }
-
-    return rv;
+    fclose(fp);
+    unlink(tmp_path);
+    return SDP_ERROR_FILESYSTEM_OPERATION;
 }
 
 int  sdp_restore_file(const char *file_path)
@@ -359,16 +428,7 @@ int  sdp_restore_file(const char *file_path)
         return SDP_ERROR_FILESYSTEM_OPERATION;
     }
 
-    // if newer file exists, delete it
-    if(stat(file_path, &stat_buf) == 0)
-    {
-        if(remove(file_path) != 0)
-        {
-            log_msg(LOG_ERR, "While trying to restore old file, failed to remove file: %s", file_path);
-            return SDP_ERROR_FILESYSTEM_OPERATION;
-        }
-    }
-
+    // rename replaces any newer file in one step
     if(rename(backup_path, file_path) != 0)
     {
         log_msg(LOG_ERR, "Failed to restore file: %s", file_path);
@@ -394,7 +454,7 @@ int  sdp_replace_spa_keys(const char *file_path,
     int new_key2_len = 0;
     int count1 = 0;
     int count2 = 0;
-    char backup_path[PATH_MAX + 1] = {0};
+    char tmp_path[PATH_MAX + 1] = {0};
     int rv = SDP_SUCCESS;
     struct stat stat_buf;
 
@@ -415,9 +475,6 @@ int  sdp_replace_spa_keys(const char *file_path,
         return SDP_ERROR_BAD_ARG;
     }
 
-    strncpy(backup_path, file_path, PATH_MAX);
-    strncat(backup_path, BACKUP_PATH_POSTFIX, POSTFIX_LEN);
-
     if((new_key1_len = strnlen(new_key1, SDP_MAX_B64_KEY_LEN + 1)) > SDP_MAX_B64_KEY_LEN)
     {
         log_msg(LOG_ERR, "New key 1 has length %d, exceeds max length %d",
@@ -438,28 +495,27 @@ int  sdp_replace_spa_keys(const char *file_path,
         return SDP_ERROR_BAD_ARG;
     }
 
-    // rename the original file to be the backup
-    if((rv = sdp_move_file_to_backup(file_path)) != SDP_SUCCESS)
+    // keep the original file as the backup, it stays in place until
+    // the new version is renamed over it
+    if((rv = sdp_link_file_to_backup(file_path)) != SDP_SUCCESS)
     {
         log_msg(LOG_ERR, "Backup process failed for %s", file_path);
-        goto cleanup;
+        return rv;
     }
 
-    // open the 'old' file for reading
-    if((old_file = fopen(backup_path, "r")) == NULL)
+    // open the original file for reading
+    if((old_file = fopen(file_path, "r")) == NULL)
     {
-        log_msg(LOG_ERR, "Could not open file for read: %s", backup_path);
+        log_msg(LOG_ERR, "Could not open file for read: %s", file_path);
         perror(NULL);
         rv = SDP_ERROR_FILESYSTEM_OPERATION;
         goto cleanup;
     }
 
     // open the 'new' file for writing
-    if((new_file = fopen(file_path, "w")) == NULL)
+    if((rv = sdp_open_temp_file(file_path, &stat_buf, tmp_path, &new_file)) != SDP_SUCCESS)
     {
         log_msg(LOG_ERR, "Could not open file for writing: %s", file_path);
-        perror(NULL);
-        rv = SDP_ERROR_FILESYSTEM_OPERATION;
         goto cleanup;
     }
 
@@ -552,11 +608,9 @@ int  sdp_replace_spa_keys(const char *file_path,
         log_msg(LOG_DEBUG, "  Key 1 - Required: %d, Matched: %d", min_key1_matches, count1);
         log_msg(LOG_DEBUG, "  Key 2 - Required: %d, Matched: %d", min_key2_matches, count2);
 
-        fclose(new_file);
+        // ownership/permissions were set when the file was created
+        rv = sdp_commit_temp_file(new_file, tmp_path, file_path);
         new_file = NULL;
-
-        // copy file ownership/permissions to new file
-        rv = sdp_set_file_info(file_path, &stat_buf);
     }
 
 
@@ -566,12 +620,12 @@ cleanup:
     if(old_file)
         fclose(old_file);
 
+    // on errors the original file was never touched, drop the new one
     if(new_file)
+    {
         fclose(new_file);
-
-    // if there were errors, restore original file
-    if(rv != SDP_SUCCESS)
-        sdp_restore_file(file_path);
+        unlink(tmp_path);
+    }
 
     return rv;
 }
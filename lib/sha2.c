@@ -45,6 +45,22 @@
   #include <sys/byteorder.h>
 #endif
 
+#if HAVE_X86_SHA_NI
+  #include <immintrin.h>
+  #include <cpuid.h>
+#endif
+
+#if HAVE_ARM_CRYPTO && defined(__AARCH64EL__)
+  #define SHA2_ARMV8 1
+  #include <arm_neon.h>
+  #if defined(__linux__)
+    #include <sys/auxv.h>
+    #ifndef HWCAP_SHA2
+      #define HWCAP_SHA2 (1 << 6)
+    #endif
+  #endif
+#endif
+
 /*
  * ASSERT NOTE:
  * Some sanity checking code is included using assert().  On my FreeBSD
@@ -241,6 +257,7 @@ typedef u_int64_t sha2_word64;	/* Exactly 8 bytes */
  */
 void SHA512_Last(SHA512_CTX*);
 void SHA256_Transform(SHA256_CTX*, const sha2_word32*);
+static void SHA256_Transform_C(SHA256_CTX*, const sha2_word32*);
 void SHA512_Transform(SHA512_CTX*, const sha2_word64*);
 
 
@@ -393,7 +410,7 @@ void SHA256_Init(SHA256_CTX* context) {
 	(h) = T1 + Sigma0_256(a) + Maj((a), (b), (c)); \
 	j++
 
-void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
+static void SHA256_Transform_C(SHA256_CTX* context, const sha2_word32* data) {
 	sha2_word32	a, b, c, d, e, f, g, h, s0, s1;
 	sha2_word32	T1, *W256;
 	int		j;
@@ -451,7 +468,7 @@ void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
 
 #else /* SHA2_UNROLL_TRANSFORM */
 
-void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
+static void SHA256_Transform_C(SHA256_CTX* context, const sha2_word32* data) {
 	sha2_word32	a, b, c, d, e, f, g, h, s0, s1;
 	sha2_word32	T1, T2, *W256;
 	int		j;
@@ -531,6 +548,204 @@ void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
 
 #endif /* SHA2_UNROLL_TRANSFORM */
 
+#if HAVE_X86_SHA_NI
+/*
+ * SHA-256 transform using the x86 SHA extensions.  The state is kept
+ * in the ABEF/CDGH register layout that sha256rnds2 expects, and the
+ * message schedule is built four words at a time with sha256msg1/2.
+ */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void SHA256_Transform_SHANI(SHA256_CTX* context, const sha2_byte* data) {
+	const __m128i	bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i		state0, state1, abef, cdgh, msg, tmp, W[4];
+	int		j;
+
+	/* Load the state and shuffle it into ABEF/CDGH order */
+	tmp    = _mm_loadu_si128((const __m128i*)&context->state[0]);
+	state1 = _mm_loadu_si128((const __m128i*)&context->state[4]);
+	tmp    = _mm_shuffle_epi32(tmp, 0xb1);
+	state1 = _mm_shuffle_epi32(state1, 0x1b);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+	abef = state0;
+	cdgh = state1;
+
+	for (j = 0; j < 16; j++) {
+		if (j < 4) {
+			/* Input words, converted to host byte order */
+			W[j] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + j * 16)), bswap);
+		} else {
+			/* Expand the next four message schedule words */
+			tmp = _mm_sha256msg1_epu32(W[j & 3], W[(j + 1) & 3]);
+			tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(W[(j + 3) & 3], W[(j + 2) & 3], 4));
+			W[j & 3] = _mm_sha256msg2_epu32(tmp, W[(j + 3) & 3]);
+		}
+
+		/* Four rounds, two per sha256rnds2 */
+		msg = _mm_add_epi32(W[j & 3], _mm_loadu_si128((const __m128i*)&K256[j * 4]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+		msg = _mm_shuffle_epi32(msg, 0x0e);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+	}
+
+	state0 = _mm_add_epi32(state0, abef);
+	state1 = _mm_add_epi32(state1, cdgh);
+
+	/* Shuffle back to ABCD/EFGH and store */
+	tmp    = _mm_shuffle_epi32(state0, 0x1b);
+	state1 = _mm_shuffle_epi32(state1, 0xb1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+	_mm_storeu_si128((__m128i*)&context->state[0], state0);
+	_mm_storeu_si128((__m128i*)&context->state[4], state1);
+}
+
+/*
+ * Returns 1 if the CPU supports the SHA extensions (and SSE4.1, which
+ * the transform also uses).  The answer is cached after the first call;
+ * concurrent first callers all compute and store the same value.
+ */
+static int sha256_have_shani(void) {
+	static volatile int	have_shani = -1;
+	unsigned int		eax, ebx, ecx, edx;
+	int			res = have_shani;
+
+	if (res < 0) {
+		res = 0;
+		if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_1)
+				&& __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)
+				&& (ebx & bit_SHA)) {
+			res = 1;
+		}
+		have_shani = res;
+	}
+	return res;
+}
+#endif /* HAVE_X86_SHA_NI */
+
+#if SHA2_ARMV8
+/*
+ * SHA-256 transform using the ARMv8 crypto extensions.  The state is
+ * kept as ABCD/EFGH, which is the layout sha256h/sha256h2 expect, and
+ * the message schedule is built four words at a time with
+ * sha256su0/sha256su1.
+ */
+static void SHA256_Transform_ARMv8(SHA256_CTX* context, const sha2_byte* data) {
+	uint32x4_t	state0, state1, abcd, efgh, wk, tmp, W[4];
+	int		j;
+
+	state0 = vld1q_u32(&context->state[0]);
+	state1 = vld1q_u32(&context->state[4]);
+
+	abcd = state0;
+	efgh = state1;
+
+	for (j = 0; j < 16; j++) {
+		if (j < 4) {
+			/* Input words, converted to host byte order */
+			W[j] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + j * 16)));
+		} else {
+			/* Expand the next four message schedule words */
+			tmp = vsha256su0q_u32(W[j & 3], W[(j + 1) & 3]);
+			W[j & 3] = vsha256su1q_u32(tmp, W[(j + 2) & 3], W[(j + 3) & 3]);
+		}
+
+		/* Four rounds */
+		wk = vaddq_u32(W[j & 3], vld1q_u32(&K256[j * 4]));
+		tmp = state0;
+		state0 = vsha256hq_u32(state0, state1, wk);
+		state1 = vsha256h2q_u32(state1, tmp, wk);
+	}
+
+	vst1q_u32(&context->state[0], vaddq_u32(state0, abcd));
+	vst1q_u32(&context->state[4], vaddq_u32(state1, efgh));
+}
+
+/*
+ * Returns 1 if the CPU supports the ARMv8 SHA-256 instructions.  Every
+ * 64-bit Apple CPU does; elsewhere the kernel says.  The answer is cached
+ * as for sha256_have_shani().
+ */
+static int sha256_have_armv8(void) {
+	static volatile int	have_armv8 = -1;
+	int			res = have_armv8;
+
+	if (res < 0) {
+#if defined(__APPLE__)
+		res = 1;
+#elif defined(__linux__)
+		res = (getauxval(AT_HWCAP) & HWCAP_SHA2) ? 1 : 0;
+#else
+		res = 0;
+#endif
+		have_armv8 = res;
+	}
+	return res;
+}
+#endif /* SHA2_ARMV8 */
+
+/*
+ * The SHA-256 transform in use, one of SHA256_IMPL_*.  Until fko_impl.c
+ * picks one it is the first the CPU supports of SHA-NI, ARMv8 and the
+ * portable C version.
+ */
+static volatile int	sha256_impl = SHA256_IMPL_AUTO;
+
+int sha256_impl_supported(int impl) {
+	switch (impl) {
+	case SHA256_IMPL_C:
+		return 1;
+#if HAVE_X86_SHA_NI
+	case SHA256_IMPL_SHANI:
+		return sha256_have_shani();
+#endif
+#if SHA2_ARMV8
+	case SHA256_IMPL_ARMV8:
+		return sha256_have_armv8();
+#endif
+	}
+	return 0;
+}
+
+void sha256_impl_set(int impl) {
+	sha256_impl = impl;
+}
+
+int sha256_impl_get(void) {
+	int	impl = sha256_impl;
+
+	if (impl < 0) {
+		if (sha256_impl_supported(SHA256_IMPL_SHANI))
+			impl = SHA256_IMPL_SHANI;
+		else if (sha256_impl_supported(SHA256_IMPL_ARMV8))
+			impl = SHA256_IMPL_ARMV8;
+		else
+			impl = SHA256_IMPL_C;
+		sha256_impl = impl;
+	}
+	return impl;
+}
+
+void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
+	switch (sha256_impl_get()) {
+#if HAVE_X86_SHA_NI
+	case SHA256_IMPL_SHANI:
+		SHA256_Transform_SHANI(context, (const sha2_byte*)data);
+		return;
+#endif
+#if SHA2_ARMV8
+	case SHA256_IMPL_ARMV8:
+		SHA256_Transform_ARMv8(context, (const sha2_byte*)data);
+		return;
+#endif
+	default:
+		SHA256_Transform_C(context, data);
+		return;
+	}
+}
+
 void SHA256_Update(SHA256_CTX* context, const sha2_byte *data, size_t len) {
 	unsigned int	freespace, usedspace;
 
@@ -140,6 +140,20 @@ typedef struct _SHA512_CTX {
 typedef SHA512_CTX SHA384_CTX;
 
 
+/*** SHA-256 Transforms ***********************************************/
+/* Which SHA-256 transform SHA256_Update() uses, see fko_impl.c.  Only
+ * the ones the CPU supports may be set.
+ */
+#define SHA256_IMPL_AUTO	-1
+#define SHA256_IMPL_C		0
+#define SHA256_IMPL_SHANI	1
+#define SHA256_IMPL_ARMV8	2
+#define SHA256_IMPLS		3
+
+int sha256_impl_supported(int impl);
+void sha256_impl_set(int impl);
+int sha256_impl_get(void);
+
 /*** SHA-256/384/512 Function Prototypes ******************************/
 #ifndef NOPROTO
 #ifdef SHA2_USE_INTTYPES_H
@@ -66,6 +66,7 @@ our @ENCRYPTION_MODES = qw(
     FKO_ENC_MODE_CTR
     FKO_ENC_MODE_ASYMMETRIC
     FKO_ENC_MODE_CBC_LEGACY_IV
+    FKO_ENC_MODE_GCM
 );
 
 # Error codes tag list.
@@ -264,6 +265,7 @@ use constant {
     FKO_ENC_MODE_CTR           => 6,
     FKO_ENC_MODE_ASYMMETRIC    => 7,
     FKO_ENC_MODE_CBC_LEGACY_IV => 8,
+    FKO_ENC_MODE_GCM           => 9,
 
     # FKO error codes
     FKO_SUCCESS                                                 => 0,
@@ -97,6 +97,7 @@ FKO_ENC_MODE_OFB = 5
 FKO_ENC_MODE_CTR = 6
 FKO_ENC_MODE_ASYMMETRIC = 7
 FKO_ENC_MODE_CBC_LEGACY_IV = 8
+FKO_ENC_MODE_GCM = 9
 
 """FKO error codes
 """
@@ -249,6 +250,34 @@ FKO_ERROR_GPGME_SIGNATURE_VERIFY_DISABLED = 144
 
 ### End FKO Constants ###
 
+def _ctx_data_args(key, hmac_key, enc_mode, hmac_type, sdp_id):
+    """Fill in the defaults for the _fko.init_ctx_with_data* key arguments.
+    """
+    if hmac_type == None:
+        hmac_type = FKO_HMAC_SHA256 if hmac_key else FKO_HMAC_UNKNOWN
+    return (key or '', enc_mode, hmac_key or '', hmac_type, sdp_id)
+
+def decode_batch(spa_list, key, hmac_key=None, enc_mode=FKO_ENC_MODE_CBC,
+                 hmac_type=None, sdp_id=0):
+    """Verify, decrypt and decode a list of SPA data strings.
+
+    The items may be strings or any other buffer objects.  They are all
+    processed in one pass without holding the GIL, so several threads can
+    decode batches at once.  Returns a list of (res, fko) tuples in the
+    same order, where fko is an Fko object when res is FKO_SUCCESS, and
+    None otherwise (see errstr() for the meaning of res).
+    """
+    results = []
+    for res, ctx in _fko.init_ctx_with_data_batch(spa_list,
+            *_ctx_data_args(key, hmac_key, enc_mode, hmac_type, sdp_id)):
+        if res == FKO_SUCCESS:
+            f = Fko.__new__(Fko)
+            f.ctx = ctx
+            results.append((res, f))
+        else:
+            results.append((res, None))
+    return results
+
 class FkoException(Exception):
     """General exception class for fko.
     """
@@ -261,7 +290,8 @@ class Fko:
     Single Packet Authorization (SPA) data.
     """
 
-    def __init__(self, spa_data=None, key=None):
+    def __init__(self, spa_data=None, key=None, hmac_key=None,
+                 enc_mode=FKO_ENC_MODE_CBC, hmac_type=None, sdp_id=0):
         """Constructor for the Fko class.
 
         Creates and intitializes the fko context.
@@ -276,13 +306,17 @@ class Fko:
 
         If spa_data is supplied without the key, then the encrypted data
         is stored in the context and can be decoded later (see libfko docs).
+
+        If hmac_key is given, the HMAC (SHA256 unless hmac_type says
+        otherwise) is verified before the data is decrypted.
         """
 
         # If there is SPA data, attempt to process it. Otherwise, create
         # an empty context.
         #
         if spa_data != None:
-            self.ctx = _fko.init_ctx_with_data(spa_data, key)
+            self.ctx = _fko.init_ctx_with_data(spa_data,
+                *_ctx_data_args(key, hmac_key, enc_mode, hmac_type, sdp_id))
         else:
             self.ctx = _fko.init_ctx()
 
@@ -611,6 +645,19 @@ class Fko:
 
         _fko.spa_data_final(self.ctx, key, hmac_key)
 
+    def spa_data_final_batch(self, key, hmac_key, count):
+        """Generate a list of count SPA data strings.
+
+        Each string gets its own random value, timestamp and salt, but
+        otherwise carries the data set in this object, which is left
+        holding the last one.  Only Rijndael encryption is supported.
+        The work is done without holding the GIL.
+        """
+        if hmac_key and not _fko.get_spa_hmac_type(self.ctx):
+            _fko.set_spa_hmac_type(self.ctx, FKO_HMAC_SHA256)
+
+        return _fko.spa_data_final_batch(self.ctx, key, hmac_key, count)
+
     def gen_spa_data(self, key):
         """Alias for "spa_data_final()".
         """
@@ -989,6 +1036,8 @@ class Fko:
             dts = "ASYMMETRIC"
         elif val == FKO_ENC_MODE_CBC_LEGACY_IV:
             dts = "CBC_LEGACY_IV"
+        elif val == FKO_ENC_MODE_GCM:
+            dts = "GCM"
         else:
             dts = "Invalid encryption mode value"
         return dts
@@ -16,6 +16,17 @@
 
 /* A lot to figure out yet... */
 
+/* The calls that do the crypto and digest work (final, decrypt, decode
+ * and the HMAC functions) run with the GIL released so several Python
+ * threads can use them at once.  A context must still only be used by
+ * one thread at a time.
+ *
+ * The batch functions take a count or a sequence and return a list,
+ * handling every item in a single GIL-free pass.  A batch call takes at
+ * most FKO_PY_BATCH_MAX items.
+*/
+#define FKO_PY_BATCH_MAX    65536
+
 /* This will be our Error object.
 */
 static PyObject *FKOError;
@@ -72,6 +83,8 @@ static PyObject * decrypt_spa_data(PyObject *self, PyObject *args);
 static PyObject * encrypt_spa_data(PyObject *self, PyObject *args);
 static PyObject * decode_spa_data(PyObject *self, PyObject *args);
 static PyObject * encode_spa_data(PyObject *self, PyObject *args);
+static PyObject * spa_data_final_batch(PyObject *self, PyObject *args);
+static PyObject * init_ctx_with_data_batch(PyObject *self, PyObject *args);
 
 static PyObject * encryption_type(PyObject *self, PyObject *args);
 static PyObject * key_gen(PyObject *self, PyObject *args);
@@ -198,6 +211,10 @@ static PyMethodDef FKOMethods[] = {
      "Encode the current context raw data to prepare for encryption"},
 
 //--DSS
+    {"spa_data_final_batch", spa_data_final_batch, METH_VARARGS,
+     "Generate a list of SPA data strings from one prepared context"},
+    {"init_ctx_with_data_batch", init_ctx_with_data_batch, METH_VARARGS,
+     "Decrypt and decode a sequence of SPA data, returning (res, ctx) tuples"},
     {"encryption_type", encryption_type, METH_VARARGS,
      "Return the assumed encryption type based on the encryptped data"},
     {"key_gen", key_gen, METH_VARARGS,
@@ -316,12 +333,14 @@ init_ctx_with_data(PyObject *self, PyObject *args)
     int sdp_id;
     int res;
 
-    if(!PyArg_ParseTuple(args, "ss#is#", &spa_data, &dec_key, &dec_key_len,
+    if(!PyArg_ParseTuple(args, "ss#is#ii", &spa_data, &dec_key, &dec_key_len,
                          &enc_mode, &hmac_key, &hmac_key_len, &hmac_type, &sdp_id))
         return NULL;
 
+    Py_BEGIN_ALLOW_THREADS
     res = fko_new_with_data(&ctx, spa_data, dec_key, dec_key_len, enc_mode,
                             hmac_key, hmac_key_len, hmac_type, (uint32_t)sdp_id);
+    Py_END_ALLOW_THREADS
 
     if(res != FKO_SUCCESS)
     {
@@ -1133,8 +1152,10 @@ spa_data_final(PyObject *self, PyObject *args)
                          &hmac_key, &hmac_key_len))
         return NULL;
 
+    Py_BEGIN_ALLOW_THREADS
     res = fko_spa_data_final(ctx, enc_key, enc_key_len,
                              hmac_key, hmac_key_len);
+    Py_END_ALLOW_THREADS
 
     if(res != FKO_SUCCESS)
     {
@@ -1158,7 +1179,9 @@ decrypt_spa_data(PyObject *self, PyObject *args)
     if(!PyArg_ParseTuple(args, "ks#", &ctx, &key, &key_len))
         return NULL;
 
+    Py_BEGIN_ALLOW_THREADS
     res = fko_decrypt_spa_data(ctx, key, key_len);
+    Py_END_ALLOW_THREADS
 
     if(res != FKO_SUCCESS)
     {
@@ -1182,7 +1205,9 @@ encrypt_spa_data(PyObject *self, PyObject *args)
     if(!PyArg_ParseTuple(args, "ks#", &ctx, &key, &key_len))
         return NULL;
 
+    Py_BEGIN_ALLOW_THREADS
     res = fko_encrypt_spa_data(ctx, key, key_len);
+    Py_END_ALLOW_THREADS
 
     if(res != FKO_SUCCESS)
     {
@@ -1204,7 +1229,9 @@ decode_spa_data(PyObject *self, PyObject *args)
     if(!PyArg_ParseTuple(args, "k", &ctx))
         return NULL;
 
+    Py_BEGIN_ALLOW_THREADS
     res = fko_decode_spa_data(ctx);
+    Py_END_ALLOW_THREADS
 
     if(res != FKO_SUCCESS)
     {
@@ -1237,6 +1264,185 @@ encode_spa_data(PyObject *self, PyObject *args)
     return Py_BuildValue("", NULL);
 }
 
+/* spa_data_final_batch
+*/
+static PyObject *
+spa_data_final_batch(PyObject *self, PyObject *args)
+{
+    fko_ctx_t ctx;
+    char *enc_key;
+    int enc_key_len;
+    char *hmac_key;
+    int hmac_key_len;
+    int count;
+    char **spa_data;
+    PyObject *list;
+    PyObject *item;
+    int i, res;
+
+    if(!PyArg_ParseTuple(args, "ks#s#i", &ctx, &enc_key, &enc_key_len,
+                         &hmac_key, &hmac_key_len, &count))
+        return NULL;
+
+    if(count <= 0 || count > FKO_PY_BATCH_MAX)
+    {
+        PyErr_SetString(PyExc_ValueError, "count out of range");
+        return NULL;
+    }
+
+    spa_data = PyMem_Malloc(count * sizeof(char *));
+    if(spa_data == NULL)
+        return PyErr_NoMemory();
+
+    Py_BEGIN_ALLOW_THREADS
+    res = fko_spa_data_final_batch(ctx, enc_key, enc_key_len,
+                                   hmac_key, hmac_key_len, count, spa_data);
+    Py_END_ALLOW_THREADS
+
+    if(res != FKO_SUCCESS)
+    {
+        for(i=0; i < count && spa_data[i] != NULL; i++)
+            free(spa_data[i]);
+        PyMem_Free(spa_data);
+        PyErr_SetString(FKOError, fko_errstr(res));
+        return NULL;
+    }
+
+    list = PyList_New(count);
+    for(i=0; i < count; i++)
+    {
+        if(list != NULL)
+        {
+            item = PyString_FromString(spa_data[i]);
+            if(item == NULL)
+                Py_CLEAR(list);
+            else
+                PyList_SET_ITEM(list, i, item);
+        }
+        free(spa_data[i]);
+    }
+    PyMem_Free(spa_data);
+
+    return list;
+}
+
+/* init_ctx_with_data_batch
+ *
+ * The SPA data may be any sequence of strings or buffer objects.  They
+ * are copied up front since the sequence could change under us while
+ * the GIL is released.  Failures do not raise, instead the item's tuple
+ * holds the error code and a zero context.
+*/
+static PyObject *
+init_ctx_with_data_batch(PyObject *self, PyObject *args)
+{
+    PyObject *seq_arg;
+    PyObject *seq;
+    PyObject *list = NULL;
+    PyObject *item;
+    char *dec_key;
+    int dec_key_len;
+    int enc_mode;
+    char *hmac_key;
+    int hmac_key_len;
+    int hmac_type;
+    int sdp_id;
+    const char *buf;
+    Py_ssize_t buf_len;
+    Py_ssize_t count, total = 0, i;
+    Py_ssize_t *offsets = NULL;
+    char *data = NULL;
+    fko_ctx_t *ctxs = NULL;
+    int *res = NULL;
+
+    if(!PyArg_ParseTuple(args, "Os#is#ii", &seq_arg, &dec_key, &dec_key_len,
+                         &enc_mode, &hmac_key, &hmac_key_len, &hmac_type, &sdp_id))
+        return NULL;
+
+    seq = PySequence_Fast(seq_arg, "expected a sequence of SPA data");
+    if(seq == NULL)
+        return NULL;
+
+    count = PySequence_Fast_GET_SIZE(seq);
+    if(count > FKO_PY_BATCH_MAX)
+    {
+        PyErr_SetString(PyExc_ValueError, "too many items");
+        goto cleanup;
+    }
+
+    offsets = PyMem_Malloc((count + 1) * sizeof(Py_ssize_t));
+    ctxs = PyMem_Malloc((count + 1) * sizeof(fko_ctx_t));
+    res = PyMem_Malloc((count + 1) * sizeof(int));
+    if(offsets == NULL || ctxs == NULL || res == NULL)
+    {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+
+    for(i=0; i < count; i++)
+    {
+        if(PyObject_AsCharBuffer(PySequence_Fast_GET_ITEM(seq, i),
+                                 &buf, &buf_len) != 0)
+            goto cleanup;
+        offsets[i] = total;
+        total += buf_len;
+    }
+    offsets[count] = total;
+
+    data = PyMem_Malloc(total + 1);
+    if(data == NULL)
+    {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+
+    for(i=0; i < count; i++)
+    {
+        if(PyObject_AsCharBuffer(PySequence_Fast_GET_ITEM(seq, i),
+                                 &buf, &buf_len) != 0)
+            goto cleanup;
+        memcpy(data + offsets[i], buf, buf_len);
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    for(i=0; i < count; i++)
+    {
+        ctxs[i] = NULL;
+        res[i] = fko_new_with_data_len(&ctxs[i], data + offsets[i],
+                    (int)(offsets[i+1] - offsets[i]), dec_key, dec_key_len,
+                    enc_mode, hmac_key, hmac_key_len, hmac_type,
+                    (uint32_t)sdp_id);
+    }
+    Py_END_ALLOW_THREADS
+
+    list = PyList_New(count);
+    for(i=0; i < count; i++)
+    {
+        if(list != NULL)
+        {
+            item = Py_BuildValue("(ik)", res[i],
+                                 res[i] == FKO_SUCCESS ? ctxs[i] : NULL);
+            if(item != NULL)
+            {
+                PyList_SET_ITEM(list, i, item);
+                continue;
+            }
+            Py_CLEAR(list);
+        }
+        if(res[i] == FKO_SUCCESS)
+            fko_destroy(ctxs[i]);
+    }
+
+cleanup:
+    Py_DECREF(seq);
+    PyMem_Free(data);
+    PyMem_Free(res);
+    PyMem_Free(ctxs);
+    PyMem_Free(offsets);
+
+    return list;
+}
+
 static PyObject *
 encryption_type(PyObject *self, PyObject *args)
 {
@@ -1320,7 +1526,9 @@ verify_hmac(PyObject *self, PyObject *args)
     if(!PyArg_ParseTuple(args, "ks#", &ctx, &hmac_key, &hmac_key_len))
         return NULL;
 
+    Py_BEGIN_ALLOW_THREADS
     res = fko_verify_hmac(ctx, hmac_key, hmac_key_len);
+    Py_END_ALLOW_THREADS
 
     if(res != FKO_SUCCESS)
     {
@@ -1342,7 +1550,9 @@ set_spa_hmac(PyObject *self, PyObject *args)
     if(!PyArg_ParseTuple(args, "ks#", &ctx, &hmac_key, &hmac_key_len))
         return NULL;
 
+    Py_BEGIN_ALLOW_THREADS
     res = fko_set_spa_hmac(ctx, hmac_key, hmac_key_len);
+    Py_END_ALLOW_THREADS
 
     if(res != FKO_SUCCESS)
     {
@@ -0,0 +1,263 @@
+/*
+ *****************************************************************************
+ *
+ * File:    acc_expire.c
+ *
+ * Purpose: Keeps the access stanzas that have an ACCESS_EXPIRE time in a
+ *          min-heap ordered by that time.  The server loop timers pop the
+ *          stanzas whose time has come and flag them as expired, so SPA
+ *          packets only test the flag instead of checking the clock for
+ *          every stanza they match.  In SDP mode an expiration also asks
+ *          the control client thread to close the connections of that
+ *          SDP ID.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "acc_expire.h"
+#include "acc_id_map.h"
+#include "rcu.h"
+#include "log_msg.h"
+#include "utils.h"
+
+/* A scheduled expiration.  Legacy mode stanzas live until the next
+ * access.conf reload (which clears the schedule), so they are held by
+ * pointer.  SDP mode stanzas can be replaced or freed by a controller
+ * update at any time, so they are held by SDP ID and looked up again
+ * when the time comes.  An entry whose stanza has since been replaced
+ * with one that has a different expire time is simply dropped.
+*/
+typedef struct acc_expire_ent
+{
+    time_t          when;
+    uint32_t        sdp_id;
+    acc_stanza_t   *acc;
+} acc_expire_ent_t;
+
+static acc_expire_ent_t    *expire_heap = NULL;
+static int                  expire_count = 0;
+static int                  expire_slots = 0;
+static pthread_mutex_t      expire_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Earliest scheduled time, or 0 if nothing is scheduled.  Read without
+ * the mutex so the loop timers can skip the heap until it is due.
+*/
+static volatile time_t      expire_next = 0;
+
+/* Number of SDP mode expirations the control client has not yet acted
+ * on by validating its connections.
+*/
+static volatile int         expire_revoke = 0;
+
+static void
+heap_swap(const int a, const int b)
+{
+    acc_expire_ent_t    tmp = expire_heap[a];
+
+    expire_heap[a] = expire_heap[b];
+    expire_heap[b] = tmp;
+    return;
+}
+
+static void
+heap_push(const acc_expire_ent_t *ent)
+{
+    int     i, parent;
+
+    i = expire_count++;
+    expire_heap[i] = *ent;
+
+    while(i > 0)
+    {
+        parent = (i - 1) / 2;
+        if(expire_heap[parent].when <= expire_heap[i].when)
+            break;
+        heap_swap(i, parent);
+        i = parent;
+    }
+    return;
+}
+
+static void
+heap_pop(void)
+{
+    int     i = 0, child;
+
+    expire_heap[0] = expire_heap[--expire_count];
+
+    while((child = 2 * i + 1) < expire_count)
+    {
+        if(child + 1 < expire_count
+                && expire_heap[child + 1].when < expire_heap[child].when)
+            child++;
+        if(expire_heap[i].when <= expire_heap[child].when)
+            break;
+        heap_swap(i, child);
+        i = child;
+    }
+    return;
+}
+
+/* Flag one stanza as expired.  Returns 1 if it was not already.
+*/
+static int
+expire_stanza(acc_stanza_t *acc)
+{
+    if(acc->expired)
+        return 0;
+
+    return(__sync_lock_test_and_set(&(acc->expired), 1) == 0);
+}
+
+/* Schedule the expiration of a stanza that has an ACCESS_EXPIRE time.  A
+ * stanza whose time has already passed is flagged right away.  In SDP
+ * mode this is called for each new stanza before it is published.
+*/
+void
+acc_expire_add(fko_srv_options_t *opts, acc_stanza_t *acc)
+{
+    acc_expire_ent_t    ent, *new_heap;
+    int                 new_slots;
+
+    if(acc->access_expire_time <= 0)
+        return;
+
+    if(acc->access_expire_time <= time(NULL))
+    {
+        if(expire_stanza(acc) && opts->rt->sdp_mode)
+            __sync_fetch_and_add(&expire_revoke, 1);
+        return;
+    }
+
+    memset(&ent, 0x0, sizeof(ent));
+    ent.when = acc->access_expire_time;
+    if(opts->rt->sdp_mode)
+        ent.sdp_id = acc->sdp_id;
+    else
+        ent.acc = acc;
+
+    pthread_mutex_lock(&expire_mutex);
+
+    if(expire_count == expire_slots)
+    {
+        new_slots = expire_slots ? expire_slots * 2 : ACC_EXPIRE_MIN_SLOTS;
+        if((new_heap = realloc(expire_heap,
+                new_slots * sizeof(acc_expire_ent_t))) == NULL)
+        {
+            pthread_mutex_unlock(&expire_mutex);
+            log_msg(LOG_ERR,
+                "[*] Memory allocation error scheduling access stanza expiration");
+            return;
+        }
+        expire_heap  = new_heap;
+        expire_slots = new_slots;
+    }
+
+    heap_push(&ent);
+    expire_next = expire_heap[0].when;
+
+    pthread_mutex_unlock(&expire_mutex);
+    return;
+}
+
+/* Drop everything that is scheduled.  Called before the stanzas it
+ * refers to are freed or replaced wholesale.
+*/
+void
+acc_expire_clear(void)
+{
+    pthread_mutex_lock(&expire_mutex);
+
+    free(expire_heap);
+    expire_heap  = NULL;
+    expire_count = 0;
+    expire_slots = 0;
+    expire_next  = 0;
+
+    pthread_mutex_unlock(&expire_mutex);
+    return;
+}
+
+/* Flag the stanzas whose expire time has passed.  Called from the server
+ * loop timers.
+*/
+void
+acc_expire_run(fko_srv_options_t *opts)
+{
+    acc_expire_ent_t    ent;
+    acc_stanza_t       *acc;
+    time_t              now, next = expire_next;
+
+    if(next == 0 || (now = clock_cache_now()) < next)
+        return;
+
+    pthread_mutex_lock(&expire_mutex);
+    rcu_read_lock();
+
+    while(expire_count > 0 && expire_heap[0].when <= now)
+    {
+        ent = expire_heap[0];
+        heap_pop();
+
+        if(ent.acc != NULL)
+        {
+            if(expire_stanza(ent.acc))
+                log_msg(LOG_INFO, "Access stanza for SOURCE %s has expired",
+                    ent.acc->cold->source);
+            continue;
+        }
+
+        acc = acc_id_map_get(rcu_dereference(opts->acc_stanza_hash_tbl),
+                ent.sdp_id);
+
+        if(acc != NULL && acc->access_expire_time == ent.when
+                && expire_stanza(acc))
+        {
+            log_msg(LOG_INFO, "Access stanza for SDP ID %"PRIu32" has expired",
+                ent.sdp_id);
+            __sync_fetch_and_add(&expire_revoke, 1);
+        }
+    }
+
+    expire_next = expire_count > 0 ? expire_heap[0].when : 0;
+
+    rcu_read_unlock();
+    pthread_mutex_unlock(&expire_mutex);
+    return;
+}
+
+/* Returns true (and resets the count) if SDP mode stanzas have expired
+ * since the last call, in which case the caller should validate its
+ * connections so that those of the expired SDP IDs are closed.
+*/
+int
+acc_expire_revoke_pending(void)
+{
+    if(expire_revoke == 0)
+        return 0;
+
+    return(__sync_lock_test_and_set(&expire_revoke, 0) != 0);
+}
+
+/***EOF***/
@@ -0,0 +1,46 @@
+/*
+ *****************************************************************************
+ *
+ * File:    acc_expire.h
+ *
+ * Purpose: Header file for acc_expire.c - the access stanza expiration
+ *          schedule.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef ACC_EXPIRE_H
+#define ACC_EXPIRE_H
+
+#define ACC_EXPIRE_MIN_SLOTS    16
+
+/* Prototypes
+*/
+void acc_expire_add(fko_srv_options_t *opts, acc_stanza_t *acc);
+void acc_expire_clear(void);
+void acc_expire_run(fko_srv_options_t *opts);
+int acc_expire_revoke_pending(void);
+
+#endif /* ACC_EXPIRE_H */
+
+/***EOF***/
@@ -0,0 +1,274 @@
+/*
+ *****************************************************************************
+ *
+ * File:    acc_id_map.c
+ *
+ * Purpose: An open addressing (linear probing) map from the 32-bit SDP ID
+ *          to its access stanza.  Looking up a packet's SDP ID hashes the
+ *          integer it already has and compares integers, with nothing to
+ *          allocate.  Deletes shift the following entries back instead of
+ *          leaving tombstones, so probe runs never grow with churn from
+ *          controller updates.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "mem_acct.h"
+#include "acc_id_map.h"
+#include "log_msg.h"
+
+static uint32_t
+acc_id_slot(const acc_id_map_t *map, const uint32_t sdp_id)
+{
+    /* Fibonacci hashing - the top bits of the product are well mixed even
+     * for sequential IDs.
+    */
+    return (uint32_t)(sdp_id * 2654435761U) >> (32 - map->bits);
+}
+
+static int
+acc_id_map_alloc(acc_id_map_t *map, const int bits)
+{
+    map->slots = mem_calloc(MEM_TAG_ACC_INDEX, (size_t)1 << bits,
+            sizeof(acc_id_map_slot_t));
+    if(map->slots == NULL)
+        return -1;
+
+    map->bits  = bits;
+    map->size  = (uint32_t)1 << bits;
+    map->mask  = map->size - 1;
+    map->count = 0;
+    return 0;
+}
+
+static void
+acc_id_map_insert(acc_id_map_t *map, const uint32_t sdp_id, acc_stanza_t *acc)
+{
+    uint32_t    i = acc_id_slot(map, sdp_id);
+
+    while(map->slots[i].acc != NULL)
+        i = (i + 1) & map->mask;
+
+    map->slots[i].sdp_id = sdp_id;
+    map->slots[i].acc    = acc;
+    map->count++;
+    return;
+}
+
+static int
+acc_id_map_grow(acc_id_map_t *map)
+{
+    acc_id_map_slot_t  *old = map->slots;
+    uint32_t            old_size = map->size, i;
+
+    if(acc_id_map_alloc(map, map->bits + 1) != 0)
+    {
+        map->slots = old;
+        return -1;
+    }
+
+    for(i=0; i < old_size; i++)
+        if(old[i].acc != NULL)
+            acc_id_map_insert(map, old[i].sdp_id, old[i].acc);
+
+    mem_free(MEM_TAG_ACC_INDEX, old);
+    return 0;
+}
+
+/* Create a map sized for about len stanzas.  delete_cb is called for each
+ * stanza that is replaced, deleted, or left in the map when it is
+ * destroyed.
+*/
+acc_id_map_t *
+acc_id_map_create(const uint32_t len, acc_id_map_delete_cb delete_cb)
+{
+    acc_id_map_t   *map;
+    int             bits = 4;
+
+    while(bits < 31 && ((uint32_t)1 << bits) < len + len / 3 + 1)
+        bits++;
+
+    if((map = mem_calloc(MEM_TAG_ACC_INDEX, 1, sizeof(acc_id_map_t))) == NULL)
+        return NULL;
+
+    if(acc_id_map_alloc(map, bits) != 0)
+    {
+        mem_free(MEM_TAG_ACC_INDEX, map);
+        return NULL;
+    }
+
+    map->delete_cb = delete_cb;
+
+    return map;
+}
+
+/* Make a copy of map that shares its stanzas, with no delete callback so
+ * that editing the copy never frees a stanza the original may still be
+ * handing out.  Returns NULL if memory could not be allocated.
+*/
+acc_id_map_t *
+acc_id_map_copy(const acc_id_map_t *map)
+{
+    acc_id_map_t   *copy;
+
+    if((copy = mem_calloc(MEM_TAG_ACC_INDEX, 1, sizeof(acc_id_map_t))) == NULL)
+        return NULL;
+
+    if(acc_id_map_alloc(copy, map->bits) != 0)
+    {
+        mem_free(MEM_TAG_ACC_INDEX, copy);
+        return NULL;
+    }
+
+    memcpy(copy->slots, map->slots, map->size * sizeof(acc_id_map_slot_t));
+    copy->count = map->count;
+
+    return copy;
+}
+
+void
+acc_id_map_destroy(acc_id_map_t *map)
+{
+    uint32_t    i;
+
+    if(map == NULL)
+        return;
+
+    for(i=0; i < map->size; i++)
+        if(map->slots[i].acc != NULL && map->delete_cb != NULL)
+            map->delete_cb(map->slots[i].acc);
+
+    mem_free(MEM_TAG_ACC_INDEX, map->slots);
+    mem_free(MEM_TAG_ACC_INDEX, map);
+    return;
+}
+
+/* Add or replace the stanza for sdp_id.  Returns 0 on success and -1 if
+ * the map could not grow.
+*/
+int
+acc_id_map_set(acc_id_map_t *map, const uint32_t sdp_id, acc_stanza_t *acc)
+{
+    acc_stanza_t   *old;
+    uint32_t        i = acc_id_slot(map, sdp_id);
+
+    for(; map->slots[i].acc != NULL; i = (i + 1) & map->mask)
+    {
+        if(map->slots[i].sdp_id == sdp_id)
+        {
+            old = map->slots[i].acc;
+            map->slots[i].acc = acc;
+            if(old != acc && map->delete_cb != NULL)
+                map->delete_cb(old);
+            return 0;
+        }
+    }
+
+    if(map->count + 1 > map->size - map->size / 4
+            && acc_id_map_grow(map) != 0)
+    {
+        log_msg(LOG_ERR, "acc_id_map_set: unable to grow access stanza map");
+        return -1;
+    }
+
+    acc_id_map_insert(map, sdp_id, acc);
+    return 0;
+}
+
+acc_stanza_t *
+acc_id_map_get(const acc_id_map_t *map, const uint32_t sdp_id)
+{
+    uint32_t    i;
+
+    if(map == NULL)
+        return NULL;
+
+    for(i = acc_id_slot(map, sdp_id); map->slots[i].acc != NULL;
+            i = (i + 1) & map->mask)
+        if(map->slots[i].sdp_id == sdp_id)
+            return map->slots[i].acc;
+
+    return NULL;
+}
+
+/* Remove and free the stanza for sdp_id.  Returns 0 if it was found and
+ * -1 otherwise.
+*/
+int
+acc_id_map_delete(acc_id_map_t *map, const uint32_t sdp_id)
+{
+    acc_stanza_t   *acc;
+    uint32_t        i, j, home;
+
+    for(i = acc_id_slot(map, sdp_id); map->slots[i].acc != NULL;
+            i = (i + 1) & map->mask)
+        if(map->slots[i].sdp_id == sdp_id)
+            break;
+
+    if((acc = map->slots[i].acc) == NULL)
+        return -1;
+
+    /* Pull back any entry further along the run that may no longer be
+     * reachable from its home slot once slot i is empty.
+    */
+    for(j = (i + 1) & map->mask; map->slots[j].acc != NULL;
+            j = (j + 1) & map->mask)
+    {
+        home = acc_id_slot(map, map->slots[j].sdp_id);
+        if(((j - home) & map->mask) >= ((j - i) & map->mask))
+        {
+            map->slots[i] = map->slots[j];
+            i = j;
+        }
+    }
+
+    map->slots[i].acc    = NULL;
+    map->slots[i].sdp_id = 0;
+    map->count--;
+
+    if(map->delete_cb != NULL)
+        map->delete_cb(acc);
+
+    return 0;
+}
+
+/* Call traverse_cb for every stanza in the map.  Stops and returns the
+ * callback's value as soon as it is nonzero, else returns 0.
+*/
+int
+acc_id_map_traverse(acc_id_map_t *map, acc_id_map_traverse_cb traverse_cb,
+        void *cb_arg)
+{
+    uint32_t    i;
+    int         rc;
+
+    for(i=0; i < map->size; i++)
+        if(map->slots[i].acc != NULL
+                && (rc = traverse_cb(map->slots[i].acc, cb_arg)) != 0)
+            return rc;
+
+    return 0;
+}
+
+/***EOF***/
@@ -0,0 +1,56 @@
+/*
+ *****************************************************************************
+ *
+ * File:    acc_id_map.h
+ *
+ * Purpose: Header file for acc_id_map.c - the SDP ID to access stanza map
+ *          used in SDP mode.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef ACC_ID_MAP_H
+#define ACC_ID_MAP_H
+
+/* Smallest number of slots in a map.  The table is kept at most 3/4 full
+ * and doubles when it would go over.
+*/
+#define ACC_ID_MAP_MIN_SLOTS    16
+
+typedef void (*acc_id_map_delete_cb)(acc_stanza_t *acc);
+typedef int (*acc_id_map_traverse_cb)(acc_stanza_t *acc, void *cb_arg);
+
+/* Prototypes
+*/
+acc_id_map_t *acc_id_map_create(const uint32_t len, acc_id_map_delete_cb delete_cb);
+acc_id_map_t *acc_id_map_copy(const acc_id_map_t *map);
+void acc_id_map_destroy(acc_id_map_t *map);
+int acc_id_map_set(acc_id_map_t *map, const uint32_t sdp_id, acc_stanza_t *acc);
+acc_stanza_t *acc_id_map_get(const acc_id_map_t *map, const uint32_t sdp_id);
+int acc_id_map_delete(acc_id_map_t *map, const uint32_t sdp_id);
+int acc_id_map_traverse(acc_id_map_t *map, acc_id_map_traverse_cb traverse_cb,
+        void *cb_arg);
+
+#endif /* ACC_ID_MAP_H */
+
+/***EOF***/
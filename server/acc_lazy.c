@@ -0,0 +1,274 @@
+/*
+ *****************************************************************************
+ *
+ * File:    acc_lazy.c
+ *
+ * Purpose: Expands SDP mode access stanzas (their SOURCE, port, service
+ *          and GPG id lists) when a packet first needs them instead of
+ *          when the controller sends them, and drops the expansions of
+ *          the stanzas that have gone unused, so that a gateway with a
+ *          very large access set only holds the expanded form of the
+ *          clients that are actually active.
+ *
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "fwknopd_common.h"
+#include "acc_lazy.h"
+#include "access.h"
+#include "metrics.h"
+#include "rcu.h"
+#include "log_msg.h"
+#include "utils.h"
+
+/* Expanded stanzas are kept on a list (most recently expanded first)
+ * under al_mutex, which also serializes the expansions themselves.
+*/
+static acc_stanza_t        *al_head = NULL;
+static unsigned int         al_count = 0;
+static pthread_mutex_t      al_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static volatile int         al_limit = 0;
+static time_t               al_next_sweep = 0;
+
+typedef struct al_victim
+{
+    time_t          last_used;
+    acc_stanza_t   *acc;
+} al_victim_t;
+
+static void
+al_link(acc_stanza_t *acc)
+{
+    acc->cold->lazy_prev = NULL;
+    acc->cold->lazy_next = al_head;
+    if(al_head != NULL)
+        al_head->cold->lazy_prev = acc;
+    al_head = acc;
+    acc->cold->lazy_linked = 1;
+    al_count++;
+    return;
+}
+
+static void
+al_unlink(acc_stanza_t *acc)
+{
+    if(acc->cold->lazy_prev != NULL)
+        acc->cold->lazy_prev->cold->lazy_next = acc->cold->lazy_next;
+    else
+        al_head = acc->cold->lazy_next;
+
+    if(acc->cold->lazy_next != NULL)
+        acc->cold->lazy_next->cold->lazy_prev = acc->cold->lazy_prev;
+
+    acc->cold->lazy_prev = acc->cold->lazy_next = NULL;
+    acc->cold->lazy_linked = 0;
+    al_count--;
+    return;
+}
+
+int
+acc_lazy_start(fko_srv_options_t *opts)
+{
+    int     is_err, limit;
+
+    limit = strtol_wrapper(opts->config[CONF_ACCESS_EXPAND_LIMIT],
+            0, RCHK_MAX_ACCESS_EXPAND_LIMIT, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid ACCESS_EXPAND_LIMIT value.");
+        return -1;
+    }
+
+    if(strncasecmp(opts->config[CONF_DISABLE_SDP_MODE], "Y", 1) == 0)
+        limit = 0;
+
+    __atomic_store_n(&al_limit, limit, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* True if new SDP mode stanzas should be left unexpanded.
+*/
+int
+acc_lazy_enabled(void)
+{
+    return(__atomic_load_n(&al_limit, __ATOMIC_RELAXED) > 0);
+}
+
+/* The expanded lists of a stanza, built now if the stanza does not have
+ * them.  The caller must be inside rcu_read_lock() and must not use the
+ * result after rcu_read_unlock().  Returns NULL if the stanza cannot be
+ * expanded, in which case it must not be given access to anything.
+*/
+acc_stanza_exp_t *
+acc_stanza_expand(acc_stanza_t *acc)
+{
+    acc_stanza_exp_t   *exp;
+    time_t              now;
+
+    if((exp = rcu_dereference(acc->exp)) != NULL)
+    {
+        if(acc_lazy_enabled())
+        {
+            now = clock_cache_now();
+            if(__atomic_load_n(&(acc->last_used), __ATOMIC_RELAXED) != now)
+                __atomic_store_n(&(acc->last_used), now, __ATOMIC_RELAXED);
+        }
+        return exp;
+    }
+
+    pthread_mutex_lock(&al_mutex);
+
+    if((exp = acc->exp) == NULL && !acc->cold->lazy_failed)
+    {
+        if((exp = acc_stanza_exp_new(acc)) == NULL)
+        {
+            acc->cold->lazy_failed = 1;
+            log_msg(LOG_ERR,
+                "[*] Access stanza for SDP ID %"PRIu32" could not be expanded, denying it",
+                acc->sdp_id);
+        }
+        else
+        {
+            acc->last_used = clock_cache_now();
+            al_link(acc);
+            rcu_assign_pointer(acc->exp, exp);
+            METRIC_INC(METRIC_ACC_EXPANSIONS);
+        }
+    }
+
+    pthread_mutex_unlock(&al_mutex);
+    return exp;
+}
+
+/* Take a stanza that is about to be freed off the list.  No reader may
+ * still hold it.
+*/
+void
+acc_lazy_forget(acc_stanza_t *acc)
+{
+    if(acc->cold == NULL)
+        return;
+
+    pthread_mutex_lock(&al_mutex);
+    if(acc->cold->lazy_linked)
+        al_unlink(acc);
+    pthread_mutex_unlock(&al_mutex);
+    return;
+}
+
+static int
+al_victim_cmp(const void *a, const void *b)
+{
+    const al_victim_t  *va = (const al_victim_t *)a;
+    const al_victim_t  *vb = (const al_victim_t *)b;
+
+    return((va->last_used > vb->last_used) - (va->last_used < vb->last_used));
+}
+
+/* Drop the expansions of the least recently used stanzas beyond
+ * ACCESS_EXPAND_LIMIT and of those that have been idle too long.  The
+ * stanzas stay, the next packet for one of them expands it again.
+ * Called from the server loop timers.
+*/
+void
+acc_lazy_run(void)
+{
+    al_victim_t        *victims;
+    acc_stanza_exp_t  **dropped;
+    acc_stanza_t       *acc;
+    time_t              now = clock_cache_now();
+    unsigned int        i, n, excess, num_dropped = 0;
+    int                 limit = __atomic_load_n(&al_limit, __ATOMIC_RELAXED);
+
+    if(now < al_next_sweep)
+        return;
+    al_next_sweep = now + ACC_LAZY_SWEEP_INTERVAL;
+
+    pthread_mutex_lock(&al_mutex);
+
+    if(al_count == 0)
+    {
+        pthread_mutex_unlock(&al_mutex);
+        return;
+    }
+
+    victims = calloc(al_count, sizeof(al_victim_t));
+    dropped = calloc(al_count, sizeof(acc_stanza_exp_t *));
+    if(victims == NULL || dropped == NULL)
+    {
+        pthread_mutex_unlock(&al_mutex);
+        free(victims);
+        free(dropped);
+        log_msg(LOG_ERR, "[*] Memory allocation error sweeping expanded access stanzas");
+        return;
+    }
+
+    for(n = 0, acc = al_head; acc != NULL; acc = acc->cold->lazy_next, n++)
+    {
+        victims[n].last_used = __atomic_load_n(&(acc->last_used), __ATOMIC_RELAXED);
+        victims[n].acc = acc;
+    }
+    qsort(victims, n, sizeof(al_victim_t), al_victim_cmp);
+
+    /* With ACCESS_EXPAND_LIMIT since turned off by a restart nothing is
+     * over the limit, only idle expansions go.
+    */
+    excess = (limit > 0 && n > (unsigned int)limit) ? n - limit : 0;
+
+    for(i = 0; i < n; i++)
+    {
+        if(i >= excess && victims[i].last_used + ACC_LAZY_IDLE_SECS > now)
+            break;
+
+        acc = victims[i].acc;
+        dropped[num_dropped++] = acc->exp;
+        rcu_assign_pointer(acc->exp, NULL);
+        al_unlink(acc);
+    }
+
+    pthread_mutex_unlock(&al_mutex);
+    free(victims);
+
+    if(num_dropped > 0)
+    {
+        rcu_synchronize();
+        for(i = 0; i < num_dropped; i++)
+            acc_stanza_exp_free(dropped[i]);
+
+        METRIC_ADD(METRIC_ACC_EVICTIONS, num_dropped);
+        log_msg(LOG_DEBUG, "Dropped %u expanded access stanzas, %u left",
+            num_dropped, n - num_dropped);
+    }
+
+    free(dropped);
+    return;
+}
+
+unsigned int
+acc_lazy_count(void)
+{
+    return(__atomic_load_n(&al_count, __ATOMIC_RELAXED));
+}
+
+/***EOF***/
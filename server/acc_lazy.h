@@ -0,0 +1,56 @@
+/*
+ *****************************************************************************
+ *
+ * File:    acc_lazy.h
+ *
+ * Purpose: Header file for acc_lazy.c - on demand expansion of SDP mode
+ *          access stanzas.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef ACC_LAZY_H
+#define ACC_LAZY_H
+
+/* With ACCESS_EXPAND_LIMIT set, a controller supplied stanza is kept as
+ * its strings (plus keys and destinations) until a packet first needs
+ * it, and the server loop timers drop the expansions of all but the
+ * ACCESS_EXPAND_LIMIT most recently used stanzas, and of any stanza
+ * unused for ACC_LAZY_IDLE_SECS, every ACC_LAZY_SWEEP_INTERVAL seconds.
+ * Legacy mode stanzas are always expanded as they are read.
+*/
+#define ACC_LAZY_SWEEP_INTERVAL     10
+#define ACC_LAZY_IDLE_SECS          3600
+
+/* Prototypes
+*/
+int acc_lazy_start(fko_srv_options_t *opts);
+int acc_lazy_enabled(void);
+acc_stanza_exp_t *acc_stanza_expand(acc_stanza_t *acc);
+void acc_lazy_forget(acc_stanza_t *acc);
+void acc_lazy_run(void);
+unsigned int acc_lazy_count(void);
+
+#endif /* ACC_LAZY_H */
+
+/***EOF***/
@@ -0,0 +1,532 @@
+/*
+ *****************************************************************************
+ *
+ * File:    acc_snapshot.c
+ *
+ * Purpose: Save the access and service data received from the SDP
+ *          controller to an encrypted file after every update, and load it
+ *          at startup so that SPA packets can be served right away
+ *          instead of waiting for the controller to connect and send a
+ *          full refresh.  The controller's refresh then replaces the data
+ *          as usual.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "acc_snapshot.h"
+#include "access.h"
+#include "service.h"
+#include "acc_id_map.h"
+#include "hash_table.h"
+#include "rcu.h"
+#include "fwknopd_errors.h"
+#include "log_msg.h"
+#include "utils.h"
+#include "sdp_ctrl_client.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <json-c/json.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+/* Growable buffer the records are collected in before encryption.
+*/
+typedef struct snap_buf
+{
+    unsigned char  *data;
+    size_t          len;
+    size_t          size;
+    int             err;
+} snap_buf_t;
+
+static void
+put_u32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return;
+}
+
+static uint32_t
+get_u32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+        | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void
+put_u64(unsigned char *p, uint64_t v)
+{
+    put_u32(p, v >> 32);
+    put_u32(p + 4, v & 0xffffffff);
+    return;
+}
+
+static uint64_t
+get_u64(const unsigned char *p)
+{
+    return ((uint64_t)get_u32(p) << 32) | get_u32(p + 4);
+}
+
+static void
+snap_buf_add_rec(snap_buf_t *buf, unsigned char type, const char *json_str)
+{
+    size_t          rec_len, size;
+    unsigned char  *tmp;
+
+    if(buf->err)
+        return;
+
+    rec_len = strlen(json_str);
+
+    if(buf->len + ACC_SNAPSHOT_REC_HDR_LEN + rec_len > buf->size)
+    {
+        size = buf->size ? buf->size : 65536;
+        while(buf->len + ACC_SNAPSHOT_REC_HDR_LEN + rec_len > size)
+            size *= 2;
+
+        if((tmp = realloc(buf->data, size)) == NULL)
+        {
+            buf->err = 1;
+            return;
+        }
+        buf->data = tmp;
+        buf->size = size;
+    }
+
+    buf->data[buf->len] = type;
+    put_u32(buf->data + buf->len + 1, rec_len);
+    memcpy(buf->data + buf->len + ACC_SNAPSHOT_REC_HDR_LEN, json_str, rec_len);
+    buf->len += ACC_SNAPSHOT_REC_HDR_LEN + rec_len;
+    return;
+}
+
+/* Rebuild the controller's JSON for one service; the service table keeps
+ * every field the controller sends.
+*/
+static int
+snap_service_cb(hash_table_node_t *node, void *arg)
+{
+    service_data_t *service_data = (service_data_t *)(node->data);
+    json_object    *jservice;
+
+    if((jservice = json_object_new_object()) == NULL)
+    {
+        ((snap_buf_t *)arg)->err = 1;
+        return 0;
+    }
+
+    json_object_object_add(jservice, "service_id",
+            json_object_new_int(service_data->service_id));
+    json_object_object_add(jservice, "proto",
+            json_object_new_string(service_data->proto == PROTO_TCP ? "tcp" : "udp"));
+    json_object_object_add(jservice, "port",
+            json_object_new_int(service_data->port));
+    json_object_object_add(jservice, "nat_ip",
+            json_object_new_string(service_data->nat_ip_str));
+    json_object_object_add(jservice, "nat_port",
+            json_object_new_int(service_data->nat_port));
+
+    snap_buf_add_rec((snap_buf_t *)arg, ACC_SNAPSHOT_REC_SERVICE,
+            json_object_to_json_string(jservice));
+
+    json_object_put(jservice);
+    return 0;
+}
+
+static int
+snap_access_cb(acc_stanza_t *acc, void *arg)
+{
+    if(acc->cold->json_str != NULL)
+        snap_buf_add_rec((snap_buf_t *)arg, ACC_SNAPSHOT_REC_ACCESS, acc->cold->json_str);
+    return 0;
+}
+
+static void
+snap_key(const fko_srv_options_t *opts, unsigned char *key)
+{
+    const char *key_str = opts->config[CONF_ACC_SNAPSHOT_KEY];
+
+    SHA256((const unsigned char *)key_str, strlen(key_str), key);
+    return;
+}
+
+int
+acc_snapshot_enabled(const fko_srv_options_t *opts)
+{
+    return opts->config[CONF_ACC_SNAPSHOT_FILE] != NULL
+        && opts->config[CONF_ACC_SNAPSHOT_KEY] != NULL;
+}
+
+/* Write the current access and service data to ACC_SNAPSHOT_FILE.  The
+ * file is written under a temporary name and renamed into place, so a
+ * crash never leaves a partial snapshot behind.
+ * Returns 0 on success (or when snapshots are not enabled) and -1 on
+ * error.
+*/
+int
+acc_snapshot_save(fko_srv_options_t *opts)
+{
+    snap_buf_t          buf;
+    unsigned char       hdr[ACC_SNAPSHOT_HDR_LEN];
+    unsigned char       key[SHA256_DIGEST_LENGTH];
+    unsigned char       tag[ACC_SNAPSHOT_TAG_LEN];
+    unsigned char      *enc = NULL;
+    char                tmp_file[MAX_PATH_LEN];
+    EVP_CIPHER_CTX     *ctx = NULL;
+    hash_table_t       *service_tbl;
+    acc_id_map_t       *acc_tbl;
+    int                 fd = -1, len = 0, rv = -1, cancel_state;
+    size_t              off;
+    ssize_t             n;
+
+    if(! acc_snapshot_enabled(opts))
+        return 0;
+
+    memset(&buf, 0x0, sizeof(buf));
+
+    // a SIGHUP cancels the control client thread, which must not happen
+    // inside the read-side section or with the file half written
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+
+    rcu_read_lock();
+    if((service_tbl = rcu_dereference(opts->service_hash_tbl)) != NULL)
+        hash_table_traverse(service_tbl, snap_service_cb, &buf);
+    if((acc_tbl = rcu_dereference(opts->acc_stanza_hash_tbl)) != NULL)
+        acc_id_map_traverse(acc_tbl, snap_access_cb, &buf);
+    rcu_read_unlock();
+
+    if(buf.err)
+    {
+        log_msg(LOG_ERR, "acc_snapshot_save: memory allocation error");
+        goto cleanup;
+    }
+
+    memset(hdr, 0x0, sizeof(hdr));
+    memcpy(hdr, ACC_SNAPSHOT_MAGIC, 4);
+    hdr[4] = ACC_SNAPSHOT_VERSION;
+    put_u64(hdr + 8, (uint64_t)time(NULL));
+    if(opts->ctrl_client != NULL)
+    {
+        put_u64(hdr + 16, (uint64_t)opts->ctrl_client->access_version);
+        put_u64(hdr + 24, (uint64_t)opts->ctrl_client->service_version);
+    }
+    put_u32(hdr + 44, buf.len);
+
+    if(RAND_bytes(hdr + 32, ACC_SNAPSHOT_IV_LEN) != 1)
+    {
+        log_msg(LOG_ERR, "acc_snapshot_save: RAND_bytes() failed");
+        goto cleanup;
+    }
+
+    if((enc = malloc(buf.len + 1)) == NULL)
+    {
+        log_msg(LOG_ERR, "acc_snapshot_save: malloc() failed");
+        goto cleanup;
+    }
+
+    snap_key(opts, key);
+
+    if((ctx = EVP_CIPHER_CTX_new()) == NULL
+            || EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL) != 1
+            || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, ACC_SNAPSHOT_IV_LEN, NULL) != 1
+            || EVP_EncryptInit_ex(ctx, NULL, NULL, key, hdr + 32) != 1
+            || EVP_EncryptUpdate(ctx, NULL, &len, hdr, ACC_SNAPSHOT_HDR_LEN) != 1
+            || (buf.len > 0 && EVP_EncryptUpdate(ctx, enc, &len, buf.data, buf.len) != 1)
+            || EVP_EncryptFinal_ex(ctx, enc + len, &len) != 1
+            || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, ACC_SNAPSHOT_TAG_LEN, tag) != 1)
+    {
+        log_msg(LOG_ERR, "acc_snapshot_save: encryption failed");
+        goto cleanup;
+    }
+
+    if(snprintf(tmp_file, sizeof(tmp_file), "%s.tmp",
+                opts->config[CONF_ACC_SNAPSHOT_FILE]) >= (int)sizeof(tmp_file))
+    {
+        log_msg(LOG_ERR, "acc_snapshot_save: ACC_SNAPSHOT_FILE path is too long");
+        goto cleanup;
+    }
+
+    if((fd = open(tmp_file, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR)) < 0)
+    {
+        log_msg(LOG_ERR, "acc_snapshot_save: could not open %s: %s",
+                tmp_file, strerror(errno));
+        goto cleanup;
+    }
+
+    for(off = 0; off < ACC_SNAPSHOT_HDR_LEN + buf.len + ACC_SNAPSHOT_TAG_LEN; off += n)
+    {
+        if(off < ACC_SNAPSHOT_HDR_LEN)
+            n = write(fd, hdr + off, ACC_SNAPSHOT_HDR_LEN - off);
+        else if(off < ACC_SNAPSHOT_HDR_LEN + buf.len)
+            n = write(fd, enc + off - ACC_SNAPSHOT_HDR_LEN,
+                    buf.len - (off - ACC_SNAPSHOT_HDR_LEN));
+        else
+            n = write(fd, tag + off - ACC_SNAPSHOT_HDR_LEN - buf.len,
+                    ACC_SNAPSHOT_TAG_LEN - (off - ACC_SNAPSHOT_HDR_LEN - buf.len));
+
+        if(n < 0 && errno == EINTR)
+            n = 0;
+        else if(n < 0)
+        {
+            log_msg(LOG_ERR, "acc_snapshot_save: write to %s failed: %s",
+                    tmp_file, strerror(errno));
+            goto cleanup;
+        }
+    }
+
+    if(fsync(fd) != 0 || close(fd) != 0)
+    {
+        fd = -1;
+        log_msg(LOG_ERR, "acc_snapshot_save: could not flush %s", tmp_file);
+        goto cleanup;
+    }
+    fd = -1;
+
+    if(rename(tmp_file, opts->config[CONF_ACC_SNAPSHOT_FILE]) != 0)
+    {
+        log_msg(LOG_ERR, "acc_snapshot_save: could not rename %s: %s",
+                tmp_file, strerror(errno));
+        goto cleanup;
+    }
+
+    log_msg(LOG_DEBUG, "Saved access snapshot (%lu bytes of records)",
+            (unsigned long)buf.len);
+    rv = 0;
+
+cleanup:
+    if(fd >= 0)
+    {
+        close(fd);
+        unlink(tmp_file);
+    }
+    if(ctx != NULL)
+        EVP_CIPHER_CTX_free(ctx);
+    if(buf.data != NULL)
+    {
+        memset(buf.data, 0x0, buf.len);
+        free(buf.data);
+    }
+    free(enc);
+    memset(key, 0x0, sizeof(key));
+
+    pthread_setcancelstate(cancel_state, NULL);
+    return rv;
+}
+
+/* Add each record of the decrypted snapshot to the service or access
+ * array.
+*/
+static int
+snap_parse_records(const unsigned char *recs, size_t len,
+        json_object *jservices, json_object *jaccess)
+{
+    size_t          off = 0;
+    uint32_t        rec_len;
+    char           *json_str;
+    json_object    *jobj;
+
+    while(off < len)
+    {
+        if(len - off < ACC_SNAPSHOT_REC_HDR_LEN)
+            return -1;
+
+        rec_len = get_u32(recs + off + 1);
+        if(rec_len > len - off - ACC_SNAPSHOT_REC_HDR_LEN)
+            return -1;
+
+        // access stanzas are kept as text and parsed one at a time as
+        // they are built, like those from the controller
+        if(recs[off] == ACC_SNAPSHOT_REC_ACCESS)
+        {
+            if((jobj = json_object_new_string_len((const char *)recs + off
+                            + ACC_SNAPSHOT_REC_HDR_LEN, rec_len)) == NULL)
+                return -1;
+            json_object_array_add(jaccess, jobj);
+            off += ACC_SNAPSHOT_REC_HDR_LEN + rec_len;
+            continue;
+        }
+
+        if((json_str = strndup((const char *)recs + off + ACC_SNAPSHOT_REC_HDR_LEN,
+                        rec_len)) == NULL)
+            return -1;
+        jobj = json_tokener_parse(json_str);
+        free(json_str);
+
+        if(jobj == NULL)
+            return -1;
+
+        if(recs[off] == ACC_SNAPSHOT_REC_SERVICE)
+            json_object_array_add(jservices, jobj);
+        else
+            json_object_put(jobj);
+
+        off += ACC_SNAPSHOT_REC_HDR_LEN + rec_len;
+    }
+
+    return 0;
+}
+
+/* Install the access and service data from ACC_SNAPSHOT_FILE, provided it
+ * decrypts and is not older than ACC_SNAPSHOT_MAX_AGE.  Must be called
+ * after the SDP control client is created and before it connects.
+ * Returns FWKNOPD_SUCCESS if both tables were installed.
+*/
+int
+acc_snapshot_load(fko_srv_options_t *opts)
+{
+    struct stat         st;
+    const unsigned char *map = MAP_FAILED;
+    unsigned char      *recs = NULL;
+    unsigned char       key[SHA256_DIGEST_LENGTH];
+    EVP_CIPHER_CTX     *ctx = NULL;
+    json_object        *jservices = NULL, *jaccess = NULL;
+    uint32_t            rec_len = 0;
+    time_t              written, now;
+    int                 fd = -1, len = 0, max_age, is_err;
+    int                 rv = FWKNOPD_ERROR_BAD_CONFIG;
+
+    if(! acc_snapshot_enabled(opts))
+        return rv;
+
+    max_age = strtol_wrapper(opts->config[CONF_ACC_SNAPSHOT_MAX_AGE],
+            1, RCHK_MAX_ACC_SNAPSHOT_MAX_AGE, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+        return rv;
+
+    if((fd = open(opts->config[CONF_ACC_SNAPSHOT_FILE], O_RDONLY)) < 0)
+    {
+        log_msg(LOG_INFO, "No access snapshot to load from %s",
+                opts->config[CONF_ACC_SNAPSHOT_FILE]);
+        return rv;
+    }
+
+    if(fstat(fd, &st) != 0
+            || st.st_size < ACC_SNAPSHOT_HDR_LEN + ACC_SNAPSHOT_TAG_LEN
+            || (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    {
+        log_msg(LOG_WARNING, "Could not read access snapshot %s",
+                opts->config[CONF_ACC_SNAPSHOT_FILE]);
+        goto cleanup;
+    }
+
+    rec_len = get_u32(map + 44);
+    if(memcmp(map, ACC_SNAPSHOT_MAGIC, 4) != 0
+            || map[4] != ACC_SNAPSHOT_VERSION
+            || (off_t)rec_len != st.st_size - ACC_SNAPSHOT_HDR_LEN - ACC_SNAPSHOT_TAG_LEN)
+    {
+        log_msg(LOG_WARNING, "Access snapshot %s is not in the expected format, ignoring it",
+                opts->config[CONF_ACC_SNAPSHOT_FILE]);
+        goto cleanup;
+    }
+
+    written = (time_t)get_u64(map + 8);
+    now     = time(NULL);
+    if(written > now || now - written > max_age)
+    {
+        log_msg(LOG_WARNING, "Access snapshot %s is too old, ignoring it",
+                opts->config[CONF_ACC_SNAPSHOT_FILE]);
+        goto cleanup;
+    }
+
+    if((recs = malloc(rec_len + 1)) == NULL)
+    {
+        log_msg(LOG_ERR, "acc_snapshot_load: malloc() failed");
+        goto cleanup;
+    }
+
+    snap_key(opts, key);
+
+    if((ctx = EVP_CIPHER_CTX_new()) == NULL
+            || EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL) != 1
+            || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, ACC_SNAPSHOT_IV_LEN, NULL) != 1
+            || EVP_DecryptInit_ex(ctx, NULL, NULL, key, map + 32) != 1
+            || EVP_DecryptUpdate(ctx, NULL, &len, map, ACC_SNAPSHOT_HDR_LEN) != 1
+            || (rec_len > 0 && EVP_DecryptUpdate(ctx, recs, &len,
+                    map + ACC_SNAPSHOT_HDR_LEN, rec_len) != 1)
+            || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, ACC_SNAPSHOT_TAG_LEN,
+                    (void *)(map + ACC_SNAPSHOT_HDR_LEN + rec_len)) != 1
+            || EVP_DecryptFinal_ex(ctx, recs + len, &len) != 1)
+    {
+        log_msg(LOG_WARNING, "Access snapshot %s failed to decrypt, ignoring it",
+                opts->config[CONF_ACC_SNAPSHOT_FILE]);
+        goto cleanup;
+    }
+
+    if((jservices = json_object_new_array()) == NULL
+            || (jaccess = json_object_new_array()) == NULL
+            || snap_parse_records(recs, rec_len, jservices, jaccess) != 0)
+    {
+        log_msg(LOG_WARNING, "Could not parse access snapshot %s, ignoring it",
+                opts->config[CONF_ACC_SNAPSHOT_FILE]);
+        goto cleanup;
+    }
+
+    if(process_service_msg(opts, CTRL_ACTION_SERVICE_REFRESH, jservices) != FWKNOPD_SUCCESS
+            || (rv = process_access_msg(opts, CTRL_ACTION_ACCESS_REFRESH, jaccess)) != FWKNOPD_SUCCESS)
+    {
+        log_msg(LOG_WARNING, "Could not install data from access snapshot %s",
+                opts->config[CONF_ACC_SNAPSHOT_FILE]);
+        rv = FWKNOPD_ERROR_BAD_CONFIG;
+        goto cleanup;
+    }
+
+    // the controller can bring us up to date with deltas from here
+    if(opts->ctrl_client != NULL)
+    {
+        opts->ctrl_client->access_version  = (int64_t)get_u64(map + 16);
+        opts->ctrl_client->service_version = (int64_t)get_u64(map + 24);
+    }
+
+    log_msg(LOG_INFO, "Loaded %d access stanzas and %d services from snapshot %s",
+            (int)json_object_array_length(jaccess), (int)json_object_array_length(jservices),
+            opts->config[CONF_ACC_SNAPSHOT_FILE]);
+
+cleanup:
+    if(jservices != NULL)
+        json_object_put(jservices);
+    if(jaccess != NULL)
+        json_object_put(jaccess);
+    if(ctx != NULL)
+        EVP_CIPHER_CTX_free(ctx);
+    if(recs != NULL)
+    {
+        memset(recs, 0x0, rec_len);
+        free(recs);
+    }
+    memset(key, 0x0, sizeof(key));
+    if(map != MAP_FAILED)
+        munmap((void *)map, st.st_size);
+    close(fd);
+    return rv;
+}
+
+/***EOF***/
@@ -0,0 +1,76 @@
+/*
+ *****************************************************************************
+ *
+ * File:    acc_snapshot.h
+ *
+ * Purpose: Header file for acc_snapshot.c - the on-disk copy of the
+ *          controller supplied access and service data.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef ACC_SNAPSHOT_H
+#define ACC_SNAPSHOT_H
+
+/* File layout (multi-byte fields in network byte order):
+ *
+ *   0   magic "FKAS"
+ *   4   version
+ *   5   reserved (3 bytes)
+ *   8   time the snapshot was written (64 bits)
+ *   16  controller access data version (64 bits)
+ *   24  controller service data version (64 bits)
+ *   32  AES-GCM IV (ACC_SNAPSHOT_IV_LEN bytes)
+ *   44  length of the encrypted records (32 bits)
+ *   48  encrypted records
+ *   end AES-GCM tag (ACC_SNAPSHOT_TAG_LEN bytes)
+ *
+ * The records are encrypted with AES-256-GCM under the SHA-256 of
+ * ACC_SNAPSHOT_KEY, and the header is authenticated along with them.
+ *
+ * Record layout:
+ *
+ *   0   record type (ACC_SNAPSHOT_REC_*)
+ *   1   length of the data (32 bits)
+ *   5   one service or access stanza as the controller sent it (JSON)
+*/
+#define ACC_SNAPSHOT_MAGIC          "FKAS"
+#define ACC_SNAPSHOT_VERSION        1
+#define ACC_SNAPSHOT_HDR_LEN        48
+#define ACC_SNAPSHOT_IV_LEN         12
+#define ACC_SNAPSHOT_TAG_LEN        16
+#define ACC_SNAPSHOT_REC_HDR_LEN    5
+#define ACC_SNAPSHOT_MIN_KEY_LEN    16
+
+#define ACC_SNAPSHOT_REC_SERVICE    1
+#define ACC_SNAPSHOT_REC_ACCESS     2
+
+/* Prototypes
+*/
+int acc_snapshot_enabled(const fko_srv_options_t *opts);
+int acc_snapshot_save(fko_srv_options_t *opts);
+int acc_snapshot_load(fko_srv_options_t *opts);
+
+#endif /* ACC_SNAPSHOT_H */
+
+/***EOF***/
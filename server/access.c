@@ -38,11 +38,23 @@
 #include <arpa/inet.h>
 #include "pwd.h"
 #include "access.h"
+#include "addr_trie.h"
+#include "acc_id_map.h"
+#include "authz_cache.h"
+#include "acc_snapshot.h"
+#include "acc_expire.h"
+#include "acc_lazy.h"
+#include "rcu.h"
+#include "fw_commit.h"
+#include "cluster.h"
 #include "utils.h"
 #include "log_msg.h"
 #include "cmd_cycle.h"
+#include "pcap_filter.h"
 #include "bstrlib.h"
+#include "mem_acct.h"
 #include <json-c/json.h>
+#include <openssl/sha.h>
 #include "fwknopd_errors.h"
 #include "sdp_ctrl_client.h"
 
@@ -59,13 +71,24 @@
 #endif
 
 
-static fko_srv_options_t *access_opts_g = NULL;
-static int access_counter_g = 0;
 
 // JSON message strings
 const char *sdp_key_data_refresh        = "access_refresh";
 const char *sdp_key_data_update         = "access_update";
 
+/* Stanza strings pulled out of controller messages are allocated by
+ * the SDP library, so they are adopted into the stanza accounting here.
+*/
+static int
+acc_json_string_field(const char *key, json_object *jdata, char **r_field)
+{
+    int rv = sdp_get_json_string_field(key, jdata, r_field);
+
+    if(rv == SDP_SUCCESS)
+        mem_adopt(MEM_TAG_STANZA, *r_field);
+    return rv;
+}
+
 /* Add an access string entry
 */
 static void
@@ -81,9 +104,9 @@ add_acc_string(char **var, const char *val, FILE *file_ptr,
     }
 
     if(*var != NULL)
-        free(*var);
+        mem_free(MEM_TAG_STANZA, *var);
 
-    if((*var = strdup(val)) == NULL)
+    if((*var = mem_strdup(MEM_TAG_STANZA, val)) == NULL)
     {
         log_msg(LOG_ERR,
             "[*] Fatal memory allocation error adding access list entry: %s", *var
@@ -95,6 +118,23 @@ add_acc_string(char **var, const char *val, FILE *file_ptr,
     return;
 }
 
+/* getpwnam() for the stanza parsers, which may run on several threads at
+ * once (see modify_access_table()).  The entry is kept in pw and buf.
+*/
+static struct passwd *
+acc_getpwnam(const char *name, struct passwd *pw, char *buf, const size_t buf_len)
+{
+    struct passwd  *res = NULL;
+    int             err;
+
+    if((err = getpwnam_r(name, pw, buf, buf_len, &res)) != 0)
+        errno = err;
+    else if(res == NULL)
+        errno = 0;
+
+    return res;
+}
+
 /* Add an access user entry
 */
 static void
@@ -149,28 +189,73 @@ add_acc_group(char **group_var, gid_t *gid_var,
     return;
 }
 
-/* Decode base64 encoded string into access entry
-*/
 static void
-add_acc_b64_string(char **var, int *len, const char *val, FILE *file_ptr,
-        fko_srv_options_t *opts)
+zero_buf_wrapper(char *buf, int len)
 {
-    if((*var = strdup(val)) == NULL)
-    {
+
+    if(zero_buf(buf, len) != FKO_SUCCESS)
         log_msg(LOG_ERR,
-            "[*] Fatal memory allocation error adding access list entry: %s", *var
-        );
-        if(file_ptr != NULL)
-            fclose(file_ptr);
-        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
-    }
-    memset(*var, 0x0, strlen(val));
-    *len = fko_base64_decode(val, (unsigned char *) *var);
+                "[*] Could not zero out sensitive data buffer.");
+
+    return;
+}
+
+/* Copy a key into one of the fixed size key buffers of a stanza.  Returns
+ * FWKNOPD_ERROR_BAD_STANZA_DATA if it is longer than MAX_KEY_LEN.
+*/
+static int
+set_acc_key(char *key, int *key_len, const char *val, const int len)
+{
+    if(len < 0 || len > MAX_KEY_LEN)
+        return FWKNOPD_ERROR_BAD_STANZA_DATA;
+
+    memset(key, 0x0, MAX_KEY_LEN+1);
+    memcpy(key, val, len);
+    *key_len = len;
+
+    return FWKNOPD_SUCCESS;
+}
+
+/* Decode a base64 encoded key into one of the fixed size key buffers of a
+ * stanza.
+*/
+static int
+set_acc_b64_key(char *key, int *key_len, const char *val)
+{
+    unsigned char   buf[MAX_B64_KEY_LEN+1];
+    int             res;
+
+    if(strnlen(val, MAX_B64_KEY_LEN + 1) > MAX_B64_KEY_LEN)
+        return FWKNOPD_ERROR_BAD_STANZA_DATA;
+
+    /* The decode function does not watch for buffer overwrite, so the
+     * buffer is sized for the encoded length.
+    */
+    memset(buf, 0x0, sizeof(buf));
+    res = set_acc_key(key, key_len, (char *)buf, fko_base64_decode(val, buf));
+    zero_buf_wrapper((char *)buf, sizeof(buf));
 
-    if (*len < 0)
+    return res;
+}
+
+/* Add an access.conf key entry, which may be base64 encoded
+*/
+static void
+add_acc_key(char *key, int *key_len, const char *val, const int is_b64,
+        const char *var_name, FILE *file_ptr, fko_srv_options_t *opts)
+{
+    int     res;
+
+    if(is_b64)
+        res = set_acc_b64_key(key, key_len, val);
+    else
+        res = set_acc_key(key, key_len, val, strlen(val));
+
+    if(res != FWKNOPD_SUCCESS)
     {
         log_msg(LOG_ERR,
-            "[*] base64 decoding returned error for: %s", *var
+            "[*] %s value could not be decoded or exceeds max length of %d bytes",
+            var_name, MAX_KEY_LEN
         );
         if(file_ptr != NULL)
             fclose(file_ptr);
@@ -254,7 +339,7 @@ add_acc_force_nat(acc_stanza_t *curr_acc, const char *val)
 {
     char      ip_str[MAX_IPV4_STR_LEN] = {0};
 
-    if (sscanf(val, "%15s %5u", ip_str, &curr_acc->force_nat_port) != 2)
+    if (sscanf(val, "%15s %5u", ip_str, &curr_acc->cold->force_nat_port) != 2)
     {
         log_msg(LOG_ERR,
             "[*] Fatal: invalid FORCE_NAT arg '%s', need <IP> <PORT>",
@@ -263,10 +348,10 @@ add_acc_force_nat(acc_stanza_t *curr_acc, const char *val)
         return FWKNOPD_ERROR_BAD_STANZA_DATA;
     }
 
-    if (curr_acc->force_nat_port > MAX_PORT)
+    if (curr_acc->cold->force_nat_port > MAX_PORT)
     {
         log_msg(LOG_ERR,
-            "[*] Fatal: invalid FORCE_NAT port '%d'", curr_acc->force_nat_port);
+            "[*] Fatal: invalid FORCE_NAT port '%d'", curr_acc->cold->force_nat_port);
         return FWKNOPD_ERROR_BAD_STANZA_DATA;
     }
 
@@ -277,12 +362,13 @@ add_acc_force_nat(acc_stanza_t *curr_acc, const char *val)
         return FWKNOPD_ERROR_BAD_STANZA_DATA;
     }
 
-    curr_acc->force_nat = 1;
+    curr_acc->cold->force_nat = 1;
 
-    if(curr_acc->force_nat_ip != NULL)
-        free(curr_acc->force_nat_ip );
+    if(curr_acc->cold->force_nat_ip != NULL)
+        mem_free(MEM_TAG_STANZA, curr_acc->cold->force_nat_ip );
 
-    if((curr_acc->force_nat_ip = strndup(ip_str, MAX_IPV4_STR_LEN)) == NULL)
+    if((curr_acc->cold->force_nat_ip = mem_strndup(MEM_TAG_STANZA,
+                    ip_str, MAX_IPV4_STR_LEN)) == NULL)
         return FKO_ERROR_MEMORY_ALLOCATION;
 
     return FWKNOPD_SUCCESS;
@@ -307,12 +393,13 @@ add_acc_force_snat(acc_stanza_t *curr_acc, const char *val)
         return FWKNOPD_ERROR_BAD_STANZA_DATA;
     }
 
-    curr_acc->force_snat = 1;
+    curr_acc->cold->force_snat = 1;
 
-    if(curr_acc->force_snat_ip != NULL)
-        free(curr_acc->force_snat_ip );
+    if(curr_acc->cold->force_snat_ip != NULL)
+        mem_free(MEM_TAG_STANZA, curr_acc->cold->force_snat_ip );
 
-    if((curr_acc->force_snat_ip = strndup(ip_str, MAX_IPV4_STR_LEN)) == NULL)
+    if((curr_acc->cold->force_snat_ip = mem_strndup(MEM_TAG_STANZA,
+                    ip_str, MAX_IPV4_STR_LEN)) == NULL)
         return FKO_ERROR_MEMORY_ALLOCATION;
 
     return FWKNOPD_SUCCESS;
@@ -337,7 +424,7 @@ add_int_ent(acc_int_list_t **ilist, const char *ip)
 
     acc_int_list_t      *last_sle, *new_sle, *tmp_sle;
 
-    if((new_sle = calloc(1, sizeof(acc_int_list_t))) == NULL)
+    if((new_sle = mem_calloc(MEM_TAG_STANZA, 1, sizeof(acc_int_list_t))) == NULL)
     {
         log_msg(LOG_ERR,
             "[*] Fatal memory allocation error adding stanza source_list entry"
@@ -362,7 +449,7 @@ add_int_ent(acc_int_list_t **ilist, const char *ip)
             if(((ndx-ip)) >= MAX_IPV4_STR_LEN)
             {
                 log_msg(LOG_ERR, "[*] Error parsing string to IP");
-                free(new_sle);
+                mem_free(MEM_TAG_STANZA, new_sle);
                 new_sle = NULL;
                 return 0;
             }
@@ -381,7 +468,7 @@ add_int_ent(acc_int_list_t **ilist, const char *ip)
                         log_msg(LOG_ERR,
                             "[*] Fatal error parsing IP mask to int for: %s", ip_mask_str
                         );
-                        free(new_sle);
+                        mem_free(MEM_TAG_STANZA, new_sle);
                         new_sle = NULL;
                         return 0;
                     }
@@ -391,7 +478,7 @@ add_int_ent(acc_int_list_t **ilist, const char *ip)
                 else
                 {
                     log_msg(LOG_ERR, "[*] Invalid IP mask str '%s'.", ndx+1);
-                    free(new_sle);
+                    mem_free(MEM_TAG_STANZA, new_sle);
                     new_sle = NULL;
                     return 0;
                 }
@@ -406,7 +493,7 @@ add_int_ent(acc_int_list_t **ilist, const char *ip)
                     if(is_err != FKO_SUCCESS)
                     {
                         log_msg(LOG_ERR, "[*] Invalid IP mask str '%s'.", ndx+1);
-                        free(new_sle);
+                        mem_free(MEM_TAG_STANZA, new_sle);
                         new_sle = NULL;
                         return 0;
                     }
@@ -414,7 +501,7 @@ add_int_ent(acc_int_list_t **ilist, const char *ip)
                 else
                 {
                     log_msg(LOG_ERR, "[*] Missing mask value.");
-                    free(new_sle);
+                    mem_free(MEM_TAG_STANZA, new_sle);
                     new_sle = NULL;
                     return 0;
                 }
@@ -428,7 +515,7 @@ add_int_ent(acc_int_list_t **ilist, const char *ip)
             if(strnlen(ip, MAX_IPV4_STR_LEN+1) >= MAX_IPV4_STR_LEN)
             {
                 log_msg(LOG_ERR, "[*] Error parsing string to IP");
-                free(new_sle);
+                mem_free(MEM_TAG_STANZA, new_sle);
                 new_sle = NULL;
                 return 0;
             }
@@ -441,7 +528,7 @@ add_int_ent(acc_int_list_t **ilist, const char *ip)
                 "[*] Fatal error parsing IP to int for: %s", ip_str
             );
 
-            free(new_sle);
+            mem_free(MEM_TAG_STANZA, new_sle);
             new_sle = NULL;
 
             return 0;
@@ -596,7 +683,7 @@ add_port_list_ent(acc_port_list_t **plist, char *port_str)
     if(parse_proto_and_port(port_str, &proto_int, &port) != 0)
         return 0;
 
-    if((new_plist = calloc(1, sizeof(acc_port_list_t))) == NULL)
+    if((new_plist = mem_calloc(MEM_TAG_STANZA, 1, sizeof(acc_port_list_t))) == NULL)
     {
         log_msg(LOG_ERR,
             "[*] Fatal memory allocation error adding stanza port_list entry"
@@ -628,6 +715,73 @@ add_port_list_ent(acc_port_list_t **plist, char *port_str)
     return 1;
 }
 
+static int
+port_map_proto_idx(const int proto)
+{
+    return proto == PROTO_UDP ? 1 : 0;
+}
+
+/* Build the port bitmap for a parsed OPEN_PORTS or RESTRICT_PORTS list.
+*/
+static acc_port_map_t *
+compile_acc_port_map(acc_port_list_t *plist)
+{
+    acc_port_map_t  *pmap;
+    unsigned char  **block;
+
+    if((pmap = mem_calloc(MEM_TAG_STANZA, 1, sizeof(acc_port_map_t))) == NULL)
+    {
+        log_msg(LOG_ERR,
+            "[*] Fatal memory allocation error creating stanza port map"
+        );
+        exit(EXIT_FAILURE);
+    }
+
+    for(; plist != NULL; plist = plist->next)
+    {
+        block = &(pmap->blocks[port_map_proto_idx(plist->proto)][plist->port >> 8]);
+
+        if(*block == NULL
+                && (*block = mem_calloc(MEM_TAG_STANZA, 1, ACC_PORT_MAP_BLOCK_LEN)) == NULL)
+        {
+            log_msg(LOG_ERR,
+                "[*] Fatal memory allocation error creating stanza port map"
+            );
+            exit(EXIT_FAILURE);
+        }
+
+        (*block)[(plist->port & 0xff) >> 3] |= 1 << (plist->port & 7);
+    }
+
+    return pmap;
+}
+
+static int
+acc_port_map_test(const acc_port_map_t *pmap, const int proto, const int port)
+{
+    const unsigned char *block;
+
+    block = pmap->blocks[port_map_proto_idx(proto)][port >> 8];
+
+    return block != NULL && (block[(port & 0xff) >> 3] & (1 << (port & 7)));
+}
+
+static void
+free_acc_port_map(acc_port_map_t *pmap)
+{
+    int     i, j;
+
+    if(pmap == NULL)
+        return;
+
+    for(i=0; i < ACC_PORT_MAP_PROTOS; i++)
+        for(j=0; j < ACC_PORT_MAP_BLOCKS; j++)
+            mem_free(MEM_TAG_STANZA, pmap->blocks[i][j]);
+
+    mem_free(MEM_TAG_STANZA, pmap);
+    return;
+}
+
 /* Add a string list entry to the given acc_string_list.
 */
 static int
@@ -635,7 +789,7 @@ add_string_list_ent(acc_string_list_t **stlist, const char *str_str)
 {
     acc_string_list_t   *last_stlist, *new_stlist, *tmp_stlist;
 
-    if((new_stlist = calloc(1, sizeof(acc_string_list_t))) == NULL)
+    if((new_stlist = mem_calloc(MEM_TAG_STANZA, 1, sizeof(acc_string_list_t))) == NULL)
     {
         log_msg(LOG_ERR,
             "[*] Fatal memory allocation error creating string list entry"
@@ -662,9 +816,9 @@ add_string_list_ent(acc_string_list_t **stlist, const char *str_str)
     }
 
     if(new_stlist->str != NULL)
-        free(new_stlist->str);
+        mem_free(MEM_TAG_STANZA, new_stlist->str);
 
-    new_stlist->str = strdup(str_str);
+    new_stlist->str = mem_strdup(MEM_TAG_STANZA, str_str);
 
     if(new_stlist->str == NULL)
     {
@@ -724,109 +878,126 @@ expand_acc_port_list(acc_port_list_t **plist, char *plist_str)
 }
 
 
+/* Read the next service ID of a comma separated list in place, leaving
+ * *pos after its comma.  Returns 1 with the ID, 0 at the end of the list
+ * and -1 when the next item is not a valid service ID.
+*/
 static int
-add_service_list_ent(acc_service_list_t **slist, char *buf)
+next_service_id(const char **pos, uint32_t *id)
 {
-    int is_err = 0;
-    uint32_t id = 0;
-    acc_service_list_t *new_entry = NULL;
-    acc_service_list_t *last_entry = NULL;
+    const char     *ndx = *pos;
+    char           *end = NULL;
+    unsigned long   val = 0;
 
-    if((id = strtoul_wrapper(buf, 0, UINT32_MAX, NO_EXIT_UPON_ERR, &is_err)) == 0)
-    {
-        log_msg(LOG_ERR,
-                "add_service_list_ent() did not find valid service id number in buf %s",
-                buf);
+    if(ndx == NULL)
         return 0;
-    }
 
-    if((new_entry = calloc(1, sizeof(acc_service_list_t))) == NULL)
-    {
-        log_msg(LOG_ERR,
-            "[*] Fatal memory allocation error adding stanza port_list entry"
-        );
-        exit(EXIT_FAILURE);
-    }
+    while(isspace(*ndx))
+        ndx++;
 
-    new_entry->service_id = id;
+    if(*ndx < '0' || *ndx > '9')
+        return -1;
 
-    if(*slist == NULL)
-    {
-        *slist = new_entry;
-    }
-    else
-    {
-        last_entry = *slist;
-        while(last_entry->next != NULL)
-            last_entry = last_entry->next;
+    errno = 0;
+    val = strtoul(ndx, &end, 10);
 
-        last_entry->next = new_entry;
-    }
+    if(val == 0 || val > UINT32_MAX || errno != 0)
+        return -1;
 
+    while(isspace(*end))
+        end++;
+
+    if(*end == ',')
+        *pos = end + 1;
+    else if(*end == '\0')
+        *pos = NULL;
+    else
+        return -1;
+
+    *id = (uint32_t)val;
     return 1;
 }
 
+static int
+cmp_service_id(const void *a, const void *b)
+{
+    const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
 
-/* Expand a service list string to a list of services.
+/* Compile a SERVICE_LIST string into a sorted set of service IDs, so a
+ * request is authorized with one binary search per requested service.
+ * Returns NULL if the list is not valid.
 */
-int
-expand_acc_service_list(acc_service_list_t **slist_r, char *slist_str)
+acc_service_set_t *
+compile_acc_service_set(const char *slist_str)
 {
-    char           *ndx, *start;
-    char            buf[ACCESS_BUF_LEN] = {0};
-    acc_service_list_t *slist = NULL;
+    acc_service_set_t  *set = NULL;
+    const char         *ndx = slist_str;
+    uint32_t            cnt = 1, i, j, id = 0;
+    int                 res;
 
-    start = slist_str;
-    *slist_r = NULL;
+    for(; *ndx != '\0'; ndx++)
+        if(*ndx == ',')
+            cnt++;
 
-    for(ndx = start; *ndx != '\0'; ndx++)
+    if((set = mem_calloc(MEM_TAG_STANZA, 1,
+                    sizeof(acc_service_set_t) + cnt * sizeof(uint32_t))) == NULL)
     {
-        if(*ndx == ',')
-        {
-            /* Skip over any leading whitespace.
-            */
-            while(isspace(*start))
-                start++;
+        log_msg(LOG_ERR,
+            "[*] Fatal memory allocation error adding stanza service list"
+        );
+        exit(EXIT_FAILURE);
+    }
 
-            if(((ndx-start)+1) >= ACCESS_BUF_LEN)
-            {
-            	free_acc_service_list(slist);
-                return 0;
-            }
+    ndx = slist_str;
+    while((res = next_service_id(&ndx, &id)) == 1)
+        set->ids[set->count++] = id;
 
-            strlcpy(buf, start, (ndx-start)+1);
+    if(res < 0)
+    {
+        log_msg(LOG_ERR,
+                "compile_acc_service_set() did not find valid service id number in %s",
+                slist_str);
+        mem_free(MEM_TAG_STANZA, set);
+        return NULL;
+    }
 
-            if(add_service_list_ent(&slist, buf) == 0)
-            {
-            	free_acc_service_list(slist);
-                return 0;
-            }
+    qsort(set->ids, set->count, sizeof(uint32_t), cmp_service_id);
 
-            start = ndx+1;
-        }
-    }
+    // drop duplicates
+    for(i = j = 0; i < set->count; i++)
+        if(j == 0 || set->ids[i] != set->ids[j-1])
+            set->ids[j++] = set->ids[i];
+    set->count = j;
 
-    /* Skip over any leading whitespace (once again for the last in the list).
-    */
-    while(isspace(*start))
-        start++;
+    return set;
+}
 
-    if(((ndx-start)+1) >= ACCESS_BUF_LEN)
-    {
-    	free_acc_service_list(slist);
-        return 0;
-    }
+int
+acc_service_set_test(const acc_service_set_t *set, const uint32_t id)
+{
+    uint32_t    lo = 0, hi, mid;
 
-    strlcpy(buf, start, (ndx-start)+1);
+    if(set == NULL)
+        return 0;
 
-    if(add_service_list_ent(&slist, buf) == 0)
+    hi = set->count;
+    while(lo < hi)
     {
-    	free_acc_service_list(slist);
-        return 0;
+        mid = lo + (hi - lo) / 2;
+
+        if(set->ids[mid] == id)
+            return 1;
+
+        if(set->ids[mid] < id)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
 
-    *slist_r = slist;
-    return 1;
+    return 0;
 }
 
 /* Expand a comma-separated string into a simple acc_string_list.
@@ -887,23 +1058,7 @@ free_acc_int_list(acc_int_list_t *sle)
         last_sle = sle;
         sle = last_sle->next;
 
-        free(last_sle);
-    }
-}
-
-/* Free a service_list
-*/
-void
-free_acc_service_list(acc_service_list_t *sle)
-{
-    acc_service_list_t    *last_sle;
-
-    while(sle != NULL)
-    {
-        last_sle = sle;
-        sle = last_sle->next;
-
-        free(last_sle);
+        mem_free(MEM_TAG_STANZA, last_sle);
     }
 }
 
@@ -919,7 +1074,7 @@ free_acc_port_list(acc_port_list_t *ple)
         last_ple = ple;
         ple = last_ple->next;
 
-        free(last_ple);
+        mem_free(MEM_TAG_STANZA, last_ple);
     }
 }
 
@@ -935,19 +1090,161 @@ free_acc_string_list(acc_string_list_t *stl)
         last_stl = stl;
         stl = last_stl->next;
 
-        free(last_stl->str);
-        free(last_stl);
+        mem_free(MEM_TAG_STANZA, last_stl->str);
+        mem_free(MEM_TAG_STANZA, last_stl);
+    }
+}
+
+/* Copy str to buf in upper case and without white space.  Returns 0 if
+ * the result is empty or does not fit.
+*/
+static int
+acc_string_norm(char *buf, const char *str, const size_t buf_len)
+{
+    size_t  len = 0;
+
+    for(; *str != '\0'; str++)
+    {
+        if(isspace((unsigned char)*str))
+            continue;
+        if(len+1 >= buf_len)
+            return 0;
+        buf[len++] = toupper((unsigned char)*str);
+    }
+    buf[len] = '\0';
+
+    return len > 0;
+}
+
+static uint32_t
+acc_string_hash(const char *str)
+{
+    uint32_t    h = 0x811c9dc5U;
+
+    for(; *str != '\0'; str++)
+    {
+        h ^= (unsigned char)*str;
+        h *= 0x01000193U;
     }
+    return h;
+}
+
+/* Look up an already normalized string.
+*/
+static int
+acc_string_set_find(const acc_string_set_t *set, const char *str,
+        const uint32_t hash)
+{
+    uint32_t    i;
+
+    for(i = hash & set->mask; set->slots[i].str != NULL; i = (i+1) & set->mask)
+        if(set->slots[i].hash == hash && strcmp(set->slots[i].str, str) == 0)
+            return 1;
+
+    return 0;
 }
 
 static void
-zero_buf_wrapper(char *buf, int len)
+free_acc_string_set(acc_string_set_t *set)
 {
+    uint32_t    i;
 
-    if(zero_buf(buf, len) != FKO_SUCCESS)
-        log_msg(LOG_ERR,
-                "[*] Could not zero out sensitive data buffer.");
+    if(set == NULL)
+        return;
+
+    for(i=0; i <= set->mask; i++)
+        mem_free(MEM_TAG_STANZA, set->slots[i].str);
+    mem_free(MEM_TAG_STANZA, set);
+    return;
+}
+
+/* Compile a comma-separated GPG id or fingerprint list into a string set.
+ * Returns NULL if the list is not valid.
+*/
+static acc_string_set_t *
+compile_acc_string_set(char *stlist_str)
+{
+    acc_string_list_t  *stlist = NULL, *ndx;
+    acc_string_set_t   *set = NULL;
+    char                buf[ACC_STRING_SET_MAX_LEN];
+    uint32_t            cnt = 0, size, hash, i;
+
+    if(expand_acc_string_list(&stlist, stlist_str) != SUCCESS)
+        goto done;
+
+    for(ndx = stlist; ndx != NULL; ndx = ndx->next)
+        cnt++;
+
+    for(size = 2; size < 2*cnt; size <<= 1)
+        ;
+
+    if((set = mem_calloc(MEM_TAG_STANZA, 1, sizeof(acc_string_set_t)
+                    + size * sizeof(acc_string_set_slot_t))) == NULL)
+        goto done;
+    set->mask = size - 1;
+
+    for(ndx = stlist; ndx != NULL; ndx = ndx->next)
+    {
+        if(! acc_string_norm(buf, ndx->str, sizeof(buf)))
+        {
+            free_acc_string_set(set);
+            set = NULL;
+            goto done;
+        }
+
+        hash = acc_string_hash(buf);
+        if(acc_string_set_find(set, buf, hash))
+            continue;
 
+        for(i = hash & set->mask; set->slots[i].str != NULL; i = (i+1) & set->mask)
+            ;
+
+        if((set->slots[i].str = mem_strdup(MEM_TAG_STANZA, buf)) == NULL)
+        {
+            free_acc_string_set(set);
+            set = NULL;
+            goto done;
+        }
+        set->slots[i].hash = hash;
+    }
+
+done:
+    free_acc_string_list(stlist);
+    return set;
+}
+
+/* Is str (a GPG signer id or fingerprint as reported by gpgme) in the
+ * set?  Case and white space are ignored.
+*/
+int
+acc_string_set_test(const acc_string_set_t *set, const char *str)
+{
+    char    buf[ACC_STRING_SET_MAX_LEN];
+
+    if(set == NULL || str == NULL || ! acc_string_norm(buf, str, sizeof(buf)))
+        return 0;
+
+    return acc_string_set_find(set, buf, acc_string_hash(buf));
+}
+
+/* Free the lists and maps expanded from a stanza's strings.
+*/
+void
+acc_stanza_exp_free(acc_stanza_exp_t *exp)
+{
+    if(exp == NULL)
+        return;
+
+    free_acc_int_list(exp->source_list);
+    addr_trie_free(exp->source_trie);
+    mem_free(MEM_TAG_STANZA, exp->service_set);
+    free_acc_port_list(exp->oport_list);
+    free_acc_port_map(exp->oport_map);
+    free_acc_port_list(exp->rport_list);
+    free_acc_port_map(exp->rport_map);
+    free_acc_string_set(exp->gpg_remote_id_set);
+    free_acc_string_set(exp->gpg_remote_fpr_set);
+    mem_free(MEM_TAG_STANZA, exp);
     return;
 }
 
@@ -960,248 +1257,521 @@ zero_buf_wrapper(char *buf, int len)
 static void
 free_acc_stanza_data(acc_stanza_t *acc)
 {
+    zero_buf_wrapper(acc->key, sizeof(acc->key));
+    zero_buf_wrapper(acc->hmac_key, sizeof(acc->hmac_key));
+    fko_hmac_state_destroy(acc->hmac_state);
+    acc->hmac_state = NULL;
 
-    if(acc->source != NULL)
-    {
-        free(acc->source);
-        free_acc_int_list(acc->source_list);
-    }
+    acc_lazy_forget(acc);
+    acc_stanza_exp_free(acc->exp);
+    acc->exp = NULL;
 
-    if(acc->destination != NULL)
-    {
-        free(acc->destination);
-        free_acc_int_list(acc->destination_list);
-    }
+    if(acc->cold == NULL)
+        return;
 
-    if(acc->service_list_str != NULL)
-    {
-    	free(acc->service_list_str);
-    }
+    if(acc->cold->source != NULL)
+        mem_free(MEM_TAG_STANZA, acc->cold->source);
 
-    if(acc->service_list != NULL)
+    if(acc->cold->destination != NULL)
     {
-        free_acc_service_list(acc->service_list);
+        mem_free(MEM_TAG_STANZA, acc->cold->destination);
+        free_acc_int_list(acc->cold->destination_list);
+        addr_trie_free(acc->destination_trie);
     }
 
-    if(acc->open_ports != NULL)
+    if(acc->cold->service_list_str != NULL)
     {
-        free(acc->open_ports);
-        free_acc_port_list(acc->oport_list);
+    	mem_free(MEM_TAG_STANZA, acc->cold->service_list_str);
     }
 
-    if(acc->restrict_ports != NULL)
+    if(acc->cold->json_str != NULL)
     {
-        free(acc->restrict_ports);
-        free_acc_port_list(acc->rport_list);
+        zero_buf_wrapper(acc->cold->json_str, strlen(acc->cold->json_str));
+        mem_free(MEM_TAG_STANZA, acc->cold->json_str);
     }
 
-    if(acc->force_nat_ip != NULL)
-        free(acc->force_nat_ip);
+    if(acc->cold->open_ports != NULL)
+        mem_free(MEM_TAG_STANZA, acc->cold->open_ports);
 
-    if(acc->force_snat_ip != NULL)
-        free(acc->force_snat_ip);
+    if(acc->cold->restrict_ports != NULL)
+        mem_free(MEM_TAG_STANZA, acc->cold->restrict_ports);
 
-    if(acc->key != NULL)
-    {
-        zero_buf_wrapper(acc->key, acc->key_len);
-        free(acc->key);
-    }
+    if(acc->cold->force_nat_ip != NULL)
+        mem_free(MEM_TAG_STANZA, acc->cold->force_nat_ip);
 
-    if(acc->key_base64 != NULL)
-    {
-        zero_buf_wrapper(acc->key_base64, strlen(acc->key_base64));
-        free(acc->key_base64);
-    }
+    if(acc->cold->force_snat_ip != NULL)
+        mem_free(MEM_TAG_STANZA, acc->cold->force_snat_ip);
 
-    if(acc->hmac_key != NULL)
+    if(acc->cold->key_base64 != NULL)
     {
-        zero_buf_wrapper(acc->hmac_key, acc->hmac_key_len);
-        free(acc->hmac_key);
+        zero_buf_wrapper(acc->cold->key_base64, strlen(acc->cold->key_base64));
+        mem_free(MEM_TAG_STANZA, acc->cold->key_base64);
     }
 
-    if(acc->hmac_key_base64 != NULL)
+    if(acc->cold->hmac_key_base64 != NULL)
     {
-        zero_buf_wrapper(acc->hmac_key_base64, strlen(acc->hmac_key_base64));
-        free(acc->hmac_key_base64);
+        zero_buf_wrapper(acc->cold->hmac_key_base64, strlen(acc->cold->hmac_key_base64));
+        mem_free(MEM_TAG_STANZA, acc->cold->hmac_key_base64);
     }
 
-    if(acc->cmd_sudo_exec_user != NULL)
-        free(acc->cmd_sudo_exec_user);
+    if(acc->cold->cmd_sudo_exec_user != NULL)
+        mem_free(MEM_TAG_STANZA, acc->cold->cmd_sudo_exec_user);
 
-    if(acc->cmd_sudo_exec_group != NULL)
-        free(acc->cmd_sudo_exec_group);
+    if(acc->cold->cmd_sudo_exec_group != NULL)
+        mem_free(MEM_TAG_STANZA, acc->cold->cmd_sudo_exec_group);
 
-    if(acc->cmd_exec_user != NULL)
-        free(acc->cmd_exec_user);
+    if(acc->cold->cmd_exec_user != NULL)
+        mem_free(MEM_TAG_STANZA, acc->cold->cmd_exec_user);
 
-    if(acc->cmd_exec_group != NULL)
-        free(acc->cmd_exec_group);
+    if(acc->cold->cmd_exec_group != NULL)
+        mem_free(MEM_TAG_STANZA, acc->cold->cmd_exec_group);
 
-    if(acc->require_username != NULL)
-        free(acc->require_username);
+    if(acc->cold->require_username != NULL)
+        mem_free(MEM_TAG_STANZA, acc->cold->require_username);
 
-    if(acc->cmd_cycle_open != NULL)
-        free(acc->cmd_cycle_open);
+    if(acc->cold->cmd_cycle_open != NULL)
+        mem_free(MEM_TAG_STANZA, acc->cold->cmd_cycle_open);
 
-    if(acc->cmd_cycle_close != NULL)
-        free(acc->cmd_cycle_close);
+    if(acc->cold->cmd_cycle_close != NULL)
+        mem_free(MEM_TAG_STANZA, acc->cold->cmd_cycle_close);
 
-    if(acc->gpg_home_dir != NULL)
-        free(acc->gpg_home_dir);
+    if(acc->cold->gpg_home_dir != NULL)
+        mem_free(MEM_TAG_STANZA, acc->cold->gpg_home_dir);
 
-    if(acc->gpg_exe != NULL)
-        free(acc->gpg_exe);
+    if(acc->cold->gpg_exe != NULL)
+        mem_free(MEM_TAG_STANZA, acc->cold->gpg_exe);
 
-    if(acc->gpg_decrypt_id != NULL)
-        free(acc->gpg_decrypt_id);
+    if(acc->cold->gpg_decrypt_id != NULL)
+        mem_free(MEM_TAG_STANZA, acc->cold->gpg_decrypt_id);
 
-    if(acc->gpg_decrypt_pw != NULL)
-        free(acc->gpg_decrypt_pw);
+    if(acc->cold->gpg_decrypt_pw != NULL)
+        mem_free(MEM_TAG_STANZA, acc->cold->gpg_decrypt_pw);
 
-    if(acc->gpg_remote_id != NULL)
-    {
-        free(acc->gpg_remote_id);
-        free_acc_string_list(acc->gpg_remote_id_list);
-    }
-    if(acc->gpg_remote_fpr != NULL)
-    {
-        free(acc->gpg_remote_fpr);
-        free_acc_string_list(acc->gpg_remote_fpr_list);
-    }
+    if(acc->cold->gpg_remote_id != NULL)
+        mem_free(MEM_TAG_STANZA, acc->cold->gpg_remote_id);
+
+    if(acc->cold->gpg_remote_fpr != NULL)
+        mem_free(MEM_TAG_STANZA, acc->cold->gpg_remote_fpr);
+
+    mem_free(MEM_TAG_STANZA, acc->cold);
+    acc->cold = NULL;
     return;
 }
 
 
-/* Expand one access entry that may be multi-value.
+/* Compile an expanded address list into a trie so that matching a packet
+ * address does not depend on the length of the list.  Masks given in
+ * dotted-quad form need not be contiguous; such a list cannot be put in a
+ * trie, so *trie is left NULL and the list is scanned instead.  Returns 0
+ * only if memory could not be allocated.
 */
 static int
-expand_one_acc_ent_list(acc_stanza_t *acc)
+compile_acc_addr_trie(addr_trie_t **trie, acc_int_list_t *list)
 {
-    /* Expand the source string to 32-bit integer IP + masks for each entry.
-    */
-    if(expand_acc_int_list(&(acc->source_list), acc->source) != SUCCESS)
+    acc_int_list_t *ent;
+    addr_trie_t    *t;
+    uint32_t        inv;
+    int             len;
+
+    *trie = NULL;
+
+    for(ent = list; ent != NULL; ent = ent->next)
     {
-        log_msg(LOG_ERR, "[*] Fatal invalid SOURCE in access stanza");
-        return 0;
+        inv = ~ent->mask;
+        if((inv & (inv + 1)) != 0)
+            return 1;
     }
 
-    if(acc->destination != NULL && strlen(acc->destination))
+    if((t = addr_trie_new()) == NULL)
+        return 0;
+
+    for(ent = list; ent != NULL; ent = ent->next)
     {
-        if(expand_acc_int_list(&(acc->destination_list), acc->destination) != SUCCESS)
+        for(len = 0; len < 32 && (ent->mask & (0x80000000 >> len)); len++)
+            ;
+
+        if(addr_trie_add_v4(t, ent->maddr & ent->mask, len) != 0)
         {
-            log_msg(LOG_ERR, "[*] Fatal invalid DESTINATION in access stanza");
+            addr_trie_free(t);
             return 0;
         }
     }
 
-    if(acc->service_list_str != NULL && strlen(acc->service_list_str))
+    *trie = t;
+    return 1;
+}
+
+/* Expand a stanza's SOURCE, SERVICE_LIST, port and GPG id strings.
+ * Returns NULL (having logged why) if one of them is invalid.
+*/
+acc_stanza_exp_t *
+acc_stanza_exp_new(acc_stanza_t *acc)
+{
+    acc_stanza_exp_t   *exp;
+
+    if((exp = mem_calloc(MEM_TAG_STANZA, 1, sizeof(acc_stanza_exp_t))) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] Fatal memory allocation error expanding access stanza");
+        return NULL;
+    }
+
+    /* Expand the source string to 32-bit integer IP + masks for each entry.
+    */
+    if(expand_acc_int_list(&(exp->source_list), acc->cold->source) != SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Fatal invalid SOURCE in access stanza");
+        goto fail;
+    }
+
+    if(! compile_acc_addr_trie(&(exp->source_trie), exp->source_list))
+    {
+        log_msg(LOG_ERR, "[*] Fatal memory allocation error compiling SOURCE");
+        goto fail;
+    }
+
+    if(acc->cold->service_list_str != NULL && strlen(acc->cold->service_list_str))
     {
-        if(expand_acc_service_list(&(acc->service_list), acc->service_list_str) == 0)
+        if((exp->service_set = compile_acc_service_set(acc->cold->service_list_str)) == NULL)
         {
             log_msg(LOG_ERR, "[*] Fatal invalid SERVICE_LIST in access stanza");
-            return 0;
+            goto fail;
         }
     }
 
     /* Now expand the open_ports string.
     */
-    if(acc->open_ports != NULL && strlen(acc->open_ports))
+    if(acc->cold->open_ports != NULL && strlen(acc->cold->open_ports))
     {
-        if(expand_acc_port_list(&(acc->oport_list), acc->open_ports) != SUCCESS)
+        if(expand_acc_port_list(&(exp->oport_list), acc->cold->open_ports) != SUCCESS)
         {
             log_msg(LOG_ERR, "[*] Fatal invalid OPEN_PORTS in access stanza");
-            return 0;
+            goto fail;
         }
+        exp->oport_map = compile_acc_port_map(exp->oport_list);
     }
 
-    if(acc->restrict_ports != NULL && strlen(acc->restrict_ports))
+    if(acc->cold->restrict_ports != NULL && strlen(acc->cold->restrict_ports))
     {
-        if(expand_acc_port_list(&(acc->rport_list), acc->restrict_ports) != SUCCESS)
+        if(expand_acc_port_list(&(exp->rport_list), acc->cold->restrict_ports) != SUCCESS)
         {
             log_msg(LOG_ERR, "[*] Fatal invalid RESTRICT_PORTS in access stanza");
-            return 0;
+            goto fail;
         }
+        exp->rport_map = compile_acc_port_map(exp->rport_list);
     }
 
     /* Expand the GPG_REMOTE_ID string.
     */
-    if(acc->gpg_remote_id != NULL && strlen(acc->gpg_remote_id))
+    if(acc->cold->gpg_remote_id != NULL && strlen(acc->cold->gpg_remote_id))
     {
-        if(expand_acc_string_list(&(acc->gpg_remote_id_list),
-                    acc->gpg_remote_id) != SUCCESS)
+        if((exp->gpg_remote_id_set =
+                    compile_acc_string_set(acc->cold->gpg_remote_id)) == NULL)
         {
             log_msg(LOG_ERR, "[*] Fatal invalid GPG_REMOTE_ID list in access stanza");
-            return 0;
+            goto fail;
         }
     }
 
     /* Expand the GPG_FINGERPRINT_ID string.
     */
-    if(acc->gpg_remote_fpr != NULL && strlen(acc->gpg_remote_fpr))
+    if(acc->cold->gpg_remote_fpr != NULL && strlen(acc->cold->gpg_remote_fpr))
     {
-        if(expand_acc_string_list(&(acc->gpg_remote_fpr_list),
-                    acc->gpg_remote_fpr) != SUCCESS)
+        if((exp->gpg_remote_fpr_set =
+                    compile_acc_string_set(acc->cold->gpg_remote_fpr)) == NULL)
         {
             log_msg(LOG_ERR, "[*] Fatal invalid GPG_FINGERPRINT_ID list in access stanza");
+            goto fail;
+        }
+    }
+
+    return exp;
+
+fail:
+    acc_stanza_exp_free(exp);
+    return NULL;
+}
+
+/* Expand one access entry that may be multi-value.  The destinations are
+ * always expanded here (the capture filter is built from them); with
+ * lazy set the rest is left to the first acc_stanza_expand().
+*/
+static int
+expand_one_acc_ent_list(acc_stanza_t *acc, const int lazy)
+{
+    if(acc->cold->destination != NULL && strlen(acc->cold->destination))
+    {
+        if(expand_acc_int_list(&(acc->cold->destination_list), acc->cold->destination) != SUCCESS)
+        {
+            log_msg(LOG_ERR, "[*] Fatal invalid DESTINATION in access stanza");
+            return 0;
+        }
+
+        if(! compile_acc_addr_trie(&(acc->destination_trie), acc->cold->destination_list))
+        {
+            log_msg(LOG_ERR, "[*] Fatal memory allocation error compiling DESTINATION");
             return 0;
         }
     }
 
+    if(! lazy && (acc->exp = acc_stanza_exp_new(acc)) == NULL)
+        return 0;
+
     return SUCCESS;
 }
 
 
-static int
-traverse_expand_hash_cb(hash_table_node_t *node, void *arg)
+static void
+free_acc_index(acc_stanza_index_t *idx)
 {
-    int res = SUCCESS;
-    acc_stanza_t *acc = (acc_stanza_t *)(node->data);
-    res = expand_one_acc_ent_list(acc);
-    if(res == SUCCESS)
-        return 0;
-    return 1;
+    int     i;
+
+    if(idx == NULL)
+        return;
+
+    for(i=0; i < idx->num_groups; i++)
+        mem_free(MEM_TAG_ACC_INDEX, idx->groups[i].ents);
+
+    mem_free(MEM_TAG_ACC_INDEX, idx->groups);
+    mem_free(MEM_TAG_ACC_INDEX, idx);
+    return;
 }
 
+static void
+free_acc_stanza_index(fko_srv_options_t *opts)
+{
+    free_acc_index(opts->acc_index);
+    opts->acc_index = NULL;
+    return;
+}
+
+static int
+acc_index_ent_cmp(const void *a, const void *b)
+{
+    const acc_index_ent_t *ea = (const acc_index_ent_t *)a;
+    const acc_index_ent_t *eb = (const acc_index_ent_t *)b;
 
-/* Expand any access entries that may be multi-value.
+    if(ea->net != eb->net)
+        return(ea->net < eb->net ? -1 : 1);
+
+    return(ea->stanza_num - eb->stanza_num);
+}
+
+/* Add one SOURCE entry to the group for its mask, creating the group if
+ * this is the first time we have seen that mask.
 */
 static void
-expand_acc_ent_lists(fko_srv_options_t *opts)
+acc_index_add_ent(fko_srv_options_t *opts, acc_stanza_index_t *idx,
+        const acc_int_list_t *sle, acc_stanza_t *acc, const int stanza_num)
 {
-    if(strncasecmp(opts->config[CONF_DISABLE_SDP_MODE], "Y", 1) == 0)
-    {
-        acc_stanza_t   *acc = opts->acc_stanzas;
+    acc_index_group_t  *grp = NULL, *new_groups;
+    acc_index_ent_t    *new_ents;
+    int                 i;
 
-        /* We need to do this for each stanza.
-        */
-        while(acc)
+    for(i=0; i < idx->num_groups; i++)
+    {
+        if(idx->groups[i].mask == sle->mask)
         {
-            if(expand_one_acc_ent_list(acc) != SUCCESS)
-                clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
-            acc = acc->next;
+            grp = &(idx->groups[i]);
+            break;
         }
     }
-    else
+
+    if(grp == NULL)
     {
-        // hash_table_traverse returns 0 for success, unlike the functions in this file
-        if( hash_table_traverse(opts->acc_stanza_hash_tbl, traverse_expand_hash_cb, NULL)    != 0 )
+        new_groups = mem_realloc(MEM_TAG_ACC_INDEX, idx->groups,
+                (idx->num_groups + 1) * sizeof(acc_index_group_t));
+        if(new_groups == NULL)
+        {
+            log_msg(LOG_ERR,
+                "[*] Fatal memory allocation error building access stanza index"
+            );
             clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+        }
+        idx->groups = new_groups;
+        grp = &(idx->groups[idx->num_groups++]);
+        memset(grp, 0x0, sizeof(acc_index_group_t));
+        grp->mask = sle->mask;
+    }
+
+    new_ents = mem_realloc(MEM_TAG_ACC_INDEX, grp->ents,
+            (grp->num_ents + 1) * sizeof(acc_index_ent_t));
+    if(new_ents == NULL)
+    {
+        log_msg(LOG_ERR,
+            "[*] Fatal memory allocation error building access stanza index"
+        );
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+    }
+    grp->ents = new_ents;
+
+    grp->ents[grp->num_ents].net        = sle->maddr & sle->mask;
+    grp->ents[grp->num_ents].stanza_num = stanza_num;
+    grp->ents[grp->num_ents].acc        = acc;
+    grp->num_ents++;
+
+    return;
+}
+
+/* Build the SOURCE index for the legacy mode stanza list.
+*/
+static void
+build_acc_stanza_index(fko_srv_options_t *opts)
+{
+    acc_stanza_index_t *idx;
+    acc_stanza_t       *acc;
+    acc_int_list_t     *sle;
+    int                 i;
+
+    free_acc_stanza_index(opts);
+
+    if((idx = mem_calloc(MEM_TAG_ACC_INDEX, 1, sizeof(acc_stanza_index_t))) == NULL)
+    {
+        log_msg(LOG_ERR,
+            "[*] Fatal memory allocation error building access stanza index"
+        );
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+    }
+    opts->acc_index = idx;
+
+    for(acc = opts->acc_stanzas; acc != NULL; acc = acc->next)
+    {
+        idx->num_stanzas++;
+        for(sle = acc->exp->source_list; sle != NULL; sle = sle->next)
+            acc_index_add_ent(opts, idx, sle, acc, idx->num_stanzas);
     }
 
+    for(i=0; i < idx->num_groups; i++)
+        qsort(idx->groups[i].ents, idx->groups[i].num_ents,
+            sizeof(acc_index_ent_t), acc_index_ent_cmp);
+
+    log_msg(LOG_DEBUG, "Indexed %d access stanzas by %d SOURCE mask(s).",
+        idx->num_stanzas, idx->num_groups);
+
     return;
 }
 
+/* Negative cache of SDP client IDs that recently had no access stanza, so
+ * packets from scanners spraying random IDs do not each take the hash
+ * table lock.  Each slot holds an ID in the high 32 bits and the table
+ * generation it was looked up in in the low 32 bits.  Bumping the
+ * generation whenever the access table changes invalidates every entry
+ * at once.
+*/
+static volatile uint64_t    sdp_miss_cache[SDP_MISS_CACHE_LEN];
+static volatile uint32_t    sdp_miss_gen = 1;
 
+#define SDP_MISS_SLOT(id)   (((id) * 2654435761U) & (SDP_MISS_CACHE_LEN - 1))
 
+/* Forget all cached misses.  Call this after any change to the SDP mode
+ * access table.
+*/
 void
-free_acc_stanzas(fko_srv_options_t *opts)
+acc_sdp_miss_flush(void)
 {
-    acc_stanza_t    *acc, *last_acc;
+    __sync_fetch_and_add(&sdp_miss_gen, 1);
+    return;
+}
 
-    /* Free any resources first (in case of reconfig). Assume non-NULL
-     * entry needs to be freed.
+/* Find the SDP mode access stanza for sdp_id.  Returns NULL if there is
+ * none.  The caller must be inside rcu_read_lock() and must not use the
+ * stanza after rcu_read_unlock(), since a controller update may free it.
+*/
+acc_stanza_t *
+acc_sdp_id_lookup(fko_srv_options_t *opts, const uint32_t sdp_id)
+{
+    volatile uint64_t  *slot = &(sdp_miss_cache[SDP_MISS_SLOT(sdp_id)]);
+    acc_stanza_t       *acc;
+    uint32_t            gen;
+
+    gen = sdp_miss_gen;
+    if(*slot == (((uint64_t)sdp_id << 32) | gen))
+        return NULL;
+
+    acc = acc_id_map_get(rcu_dereference(opts->acc_stanza_hash_tbl), sdp_id);
+
+    /* The generation was read before the lookup, so a miss that races
+     * with a table update is stored already stale.
     */
-    acc = opts->acc_stanzas;
+    if(acc == NULL)
+        *slot = ((uint64_t)sdp_id << 32) | gen;
+
+    return acc;
+}
+
+/* Find the legacy mode stanzas whose SOURCE list matches addr.  cands
+ * must have room for idx->num_stanzas pointers, and on return cands[n]
+ * is the matching stanza number n+1 or NULL, so walking the array visits
+ * the matches in access.conf order.  Returns the number of matching
+ * stanzas.  A reload may replace opts->acc_index, so the caller loads it
+ * once (inside rcu_read_lock()) and uses that copy throughout.
+*/
+int
+acc_stanza_candidates(const acc_stanza_index_t *idx, const spa_addr_t *addr,
+        acc_stanza_t **cands)
+{
+    acc_index_group_t  *grp;
+    uint32_t            ip = 0, key;
+    int                 i, lo, hi, mid, matches = 0;
+
+    if(idx == NULL)
+        return(0);
+
+    memset(cands, 0x0, idx->num_stanzas * sizeof(acc_stanza_t *));
+
+    if(addr->family != AF_INET6)
+    {
+        memcpy(&ip, addr->addr, sizeof(ip));
+        ip = ntohl(ip);
+    }
+
+    for(i=0; i < idx->num_groups; i++)
+    {
+        grp = &(idx->groups[i]);
+
+        /* Access lists only hold IPv4 networks, so an IPv6 address can
+         * only match an ANY entry.
+        */
+        if(addr->family == AF_INET6 && grp->mask != 0)
+            continue;
+
+        key = ip & grp->mask;
+
+        /* Find the first entry for this network.
+        */
+        lo = 0;
+        hi = grp->num_ents;
+        while(lo < hi)
+        {
+            mid = lo + (hi - lo) / 2;
+            if(grp->ents[mid].net < key)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        for(; lo < grp->num_ents && grp->ents[lo].net == key; lo++)
+        {
+            /* Stanzas flagged by the expiration schedule are no longer
+             * candidates.
+            */
+            if(grp->ents[lo].acc->expired)
+                continue;
+
+            if(cands[grp->ents[lo].stanza_num - 1] == NULL)
+            {
+                cands[grp->ents[lo].stanza_num - 1] = grp->ents[lo].acc;
+                matches++;
+            }
+        }
+    }
+
+    return(matches);
+}
+
+static void
+free_acc_stanza_list(acc_stanza_t *acc)
+{
+    acc_stanza_t    *last_acc;
 
     while(acc != NULL)
     {
@@ -1209,28 +1779,85 @@ free_acc_stanzas(fko_srv_options_t *opts)
         acc = last_acc->next;
 
         free_acc_stanza_data(last_acc);
-        free(last_acc);
+        mem_free(MEM_TAG_STANZA, last_acc);
     }
 
     return;
 }
 
-static void
-destroy_hash_node_cb(hash_table_node_t *node)
+void
+free_acc_stanzas(fko_srv_options_t *opts)
 {
-  if(node->key != NULL) bdestroy((bstring)(node->key));
-  if(node->data != NULL)
-  {
-      free_acc_stanza_data((acc_stanza_t*)(node->data));
-      free(node->data);
-  }
+    free_acc_stanza_index(opts);
+
+    /* Free any resources first (in case of reconfig). Assume non-NULL
+     * entry needs to be freed.  The expiration schedule holds legacy
+     * stanzas by pointer, so it goes with them.
+    */
+    if(opts->acc_stanzas != NULL)
+        acc_expire_clear();
+
+    free_acc_stanza_list(opts->acc_stanzas);
+    opts->acc_stanzas = NULL;
+
+    return;
 }
 
-static int
-traverse_dump_hash_cb(hash_table_node_t *node, void *dest)
+/* Swap in the legacy mode stanzas (and their SOURCE index) that a reload
+ * parsed into new_opts, then free the old ones once nothing can still be
+ * using them.  Packets keep being processed meanwhile, each against
+ * either the old or the new set.
+*/
+void
+replace_acc_stanzas(fko_srv_options_t *opts, fko_srv_options_t *new_opts)
 {
-    acc_stanza_t *acc = (acc_stanza_t *)(node->data);
+    acc_stanza_t       *old_acc = opts->acc_stanzas, *acc;
+    acc_stanza_index_t *old_idx = opts->acc_index;
+
+    rcu_assign_pointer(opts->acc_index, new_opts->acc_index);
+    rcu_assign_pointer(opts->acc_stanzas, new_opts->acc_stanzas);
+    new_opts->acc_index   = NULL;
+    new_opts->acc_stanzas = NULL;
+
+    opts->pcap_filter_refresh = 1;
+
+    log_msg(LOG_INFO, "Reloaded %d access stanza(s) from %s (was %d).",
+        opts->acc_index == NULL ? 0 : opts->acc_index->num_stanzas,
+        opts->config[CONF_ACCESS_FILE],
+        old_idx == NULL ? 0 : old_idx->num_stanzas);
+
+    /* Wait for the packets that found an old stanza, and for the grants
+     * they queued for the firewall commit thread.
+    */
+    rcu_synchronize();
+    fw_commit_drain();
+
+    /* Parsing already scheduled the new stanzas' expirations, alongside
+     * the old ones.  Start over with just the new ones.
+    */
+    acc_expire_clear();
+    for(acc = opts->acc_stanzas; acc != NULL; acc = acc->next)
+        acc_expire_add(opts, acc);
+
+    free_acc_index(old_idx);
+    free_acc_stanza_list(old_acc);
+
+    return;
+}
+
+static void
+destroy_hash_node_cb(acc_stanza_t *acc)
+{
+    free_acc_stanza_data(acc);
+    mem_free(MEM_TAG_STANZA, acc);
+}
 
+/* Print one SDP access stanza for the config dump (also an
+ * acc_id_map_traverse() callback).
+*/
+int
+dump_access_stanza(acc_stanza_t *acc, void *dest)
+{
     fprintf((FILE*)dest,
         "SDP_ID:  %"PRIu32"\n"
         "==============================================================\n"
@@ -1247,6 +1874,8 @@ traverse_dump_hash_cb(hash_table_node_t *node, void *dest)
         "               HMAC_KEY_LEN:  %d\n"
         "           HMAC_DIGEST_TYPE:  %d\n"
         "          FW_ACCESS_TIMEOUT:  %i\n"
+        "          MAX_ACTIVE_GRANTS:  %i\n"
+        "         GRANT_IDLE_TIMEOUT:  %i\n"
         "            ENABLE_CMD_EXEC:  %s\n"
         "       ENABLE_CMD_SUDO_EXEC:  %s\n"
         "         CMD_SUDO_EXEC_USER:  %s\n"
@@ -1275,46 +1904,48 @@ traverse_dump_hash_cb(hash_table_node_t *node, void *dest)
         "              GPG_REMOTE_ID:  %s\n"
         "         GPG_FINGERPRINT_ID:  %s\n",
         acc->sdp_id,
-        acc->source,
-        (acc->destination == NULL) ? "<not set>" : acc->destination,
-        (acc->service_list_str == NULL) ? "<not set>" : acc->service_list_str,
-        (acc->open_ports == NULL) ? "<not set>" : acc->open_ports,
-        (acc->restrict_ports == NULL) ? "<not set>" : acc->restrict_ports,
-        (acc->key == NULL) ? "<not set>" : "<HIDDEN>",
-        (acc->key_base64 == NULL) ? "<not set>" : acc->key_base64, //"<HIDDEN>",
+        acc->cold->source,
+        (acc->cold->destination == NULL) ? "<not set>" : acc->cold->destination,
+        (acc->cold->service_list_str == NULL) ? "<not set>" : acc->cold->service_list_str,
+        (acc->cold->open_ports == NULL) ? "<not set>" : acc->cold->open_ports,
+        (acc->cold->restrict_ports == NULL) ? "<not set>" : acc->cold->restrict_ports,
+        (acc->key_len == 0) ? "<not set>" : "<HIDDEN>",
+        (acc->cold->key_base64 == NULL) ? "<not set>" : acc->cold->key_base64, //"<HIDDEN>",
         acc->key_len ? acc->key_len : 0,
-        (acc->hmac_key == NULL) ? "<not set>" : "<HIDDEN>",
-        (acc->hmac_key_base64 == NULL) ? "<not set>" : acc->hmac_key_base64, //"<HIDDEN>",
+        (acc->hmac_key_len == 0) ? "<not set>" : "<HIDDEN>",
+        (acc->cold->hmac_key_base64 == NULL) ? "<not set>" : acc->cold->hmac_key_base64, //"<HIDDEN>",
         acc->hmac_key_len ? acc->hmac_key_len : 0,
         acc->hmac_type,
         acc->fw_access_timeout,
+        acc->cold->max_active_grants,
+        acc->cold->grant_idle_timeout,
         acc->enable_cmd_exec ? "Yes" : "No",
-        acc->enable_cmd_sudo_exec ? "Yes" : "No",
-        (acc->cmd_sudo_exec_user == NULL) ? "<not set>" : acc->cmd_sudo_exec_user,
-        (acc->cmd_sudo_exec_group == NULL) ? "<not set>" : acc->cmd_sudo_exec_group,
-        (acc->cmd_exec_user == NULL) ? "<not set>" : acc->cmd_exec_user,
-        (acc->cmd_exec_group == NULL) ? "<not set>" : acc->cmd_exec_group,
-        (acc->cmd_cycle_open == NULL) ? "<not set>" : acc->cmd_cycle_open,
-        (acc->cmd_cycle_close == NULL) ? "<not set>" : acc->cmd_cycle_close,
-        acc->cmd_cycle_timer,
-        (acc->require_username == NULL) ? "<not set>" : acc->require_username,
+        acc->cold->enable_cmd_sudo_exec ? "Yes" : "No",
+        (acc->cold->cmd_sudo_exec_user == NULL) ? "<not set>" : acc->cold->cmd_sudo_exec_user,
+        (acc->cold->cmd_sudo_exec_group == NULL) ? "<not set>" : acc->cold->cmd_sudo_exec_group,
+        (acc->cold->cmd_exec_user == NULL) ? "<not set>" : acc->cold->cmd_exec_user,
+        (acc->cold->cmd_exec_group == NULL) ? "<not set>" : acc->cold->cmd_exec_group,
+        (acc->cold->cmd_cycle_open == NULL) ? "<not set>" : acc->cold->cmd_cycle_open,
+        (acc->cold->cmd_cycle_close == NULL) ? "<not set>" : acc->cold->cmd_cycle_close,
+        acc->cold->cmd_cycle_timer,
+        (acc->cold->require_username == NULL) ? "<not set>" : acc->cold->require_username,
         acc->require_source_address ? "Yes" : "No",
-        acc->force_nat ? acc->force_nat_ip : "<not set>",
-        acc->force_nat && acc->force_nat_proto != NULL ? acc->force_nat_proto : "<not set>",
-        acc->force_nat ? acc->force_nat_port : 0,
-        acc->force_snat ? acc->force_snat_ip : "<not set>",
-        acc->force_masquerade ? "Yes" : "No",
-        acc->disable_dnat ? "Yes" : "No",
-        acc->forward_all ? "Yes" : "No",
+        acc->cold->force_nat ? acc->cold->force_nat_ip : "<not set>",
+        acc->cold->force_nat && acc->cold->force_nat_proto != NULL ? acc->cold->force_nat_proto : "<not set>",
+        acc->cold->force_nat ? acc->cold->force_nat_port : 0,
+        acc->cold->force_snat ? acc->cold->force_snat_ip : "<not set>",
+        acc->cold->force_masquerade ? "Yes" : "No",
+        acc->cold->disable_dnat ? "Yes" : "No",
+        acc->cold->forward_all ? "Yes" : "No",
         (acc->access_expire_time > 0) ? asctime(localtime(&acc->access_expire_time)) : "<not set>\n",
-        (acc->gpg_home_dir == NULL) ? "<not set>" : acc->gpg_home_dir,
-        (acc->gpg_exe == NULL) ? "<not set>" : acc->gpg_exe,
-        (acc->gpg_decrypt_id == NULL) ? "<not set>" : acc->gpg_decrypt_id,
-        (acc->gpg_decrypt_pw == NULL) ? "<not set>" : "<see the access.conf file>",
-        acc->gpg_require_sig ? "Yes" : "No",
-        acc->gpg_ignore_sig_error  ? "Yes" : "No",
-        (acc->gpg_remote_id == NULL) ? "<not set>" : acc->gpg_remote_id,
-        (acc->gpg_remote_fpr == NULL) ? "<not set>" : acc->gpg_remote_fpr
+        (acc->cold->gpg_home_dir == NULL) ? "<not set>" : acc->cold->gpg_home_dir,
+        (acc->cold->gpg_exe == NULL) ? "<not set>" : acc->cold->gpg_exe,
+        (acc->cold->gpg_decrypt_id == NULL) ? "<not set>" : acc->cold->gpg_decrypt_id,
+        (acc->cold->gpg_decrypt_pw == NULL) ? "<not set>" : "<see the access.conf file>",
+        acc->cold->gpg_require_sig ? "Yes" : "No",
+        acc->cold->gpg_ignore_sig_error  ? "Yes" : "No",
+        (acc->cold->gpg_remote_id == NULL) ? "<not set>" : acc->cold->gpg_remote_id,
+        (acc->cold->gpg_remote_fpr == NULL) ? "<not set>" : acc->cold->gpg_remote_fpr
     );
 
     fprintf((FILE*)dest, "\n");
@@ -1344,12 +1975,20 @@ static acc_stanza_t*
 acc_stanza_add(fko_srv_options_t *opts, char *val)
 {
     acc_stanza_t    *acc     = opts->acc_stanzas;
-    acc_stanza_t    *new_acc = calloc(1, sizeof(acc_stanza_t));
+    acc_stanza_t    *new_acc = mem_calloc(MEM_TAG_STANZA, 1, sizeof(acc_stanza_t));
     acc_stanza_t    *last_acc;
-    bstring          key     = NULL;
+    uint32_t         sdp_id  = 0;
     int              hash_table_len = 0;
     int              is_err = 0;
 
+    if(new_acc != NULL
+            && (new_acc->cold = mem_calloc(MEM_TAG_STANZA, 1,
+                    sizeof(acc_stanza_cold_t))) == NULL)
+    {
+        mem_free(MEM_TAG_STANZA, new_acc);
+        new_acc = NULL;
+    }
+
     if(new_acc == NULL)
     {
         log_msg(LOG_ERR,
@@ -1397,15 +2036,15 @@ acc_stanza_add(fko_srv_options_t *opts, char *val)
                 clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
             }
 
-            opts->acc_stanza_hash_tbl = hash_table_create(hash_table_len,
-                    NULL, NULL, destroy_hash_node_cb);
+            opts->acc_stanza_hash_tbl = acc_id_map_create(hash_table_len,
+                    destroy_hash_node_cb);
             if(opts->acc_stanza_hash_tbl == NULL)
             {
                 log_msg(LOG_ERR,
                     "[*] Fatal memory allocation error creating access stanza hash table"
                 );
                 free_acc_stanza_data(new_acc);
-                free(new_acc);
+                mem_free(MEM_TAG_STANZA, new_acc);
                 clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
             }
         }
@@ -1416,20 +2055,29 @@ acc_stanza_add(fko_srv_options_t *opts, char *val)
                 "[*] Fatal error - SDP_ID string invalid"
             );
             free_acc_stanza_data(new_acc);
-            free(new_acc);
+            mem_free(MEM_TAG_STANZA, new_acc);
             clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
         }
 
-        key = bfromcstr(val);
+        sdp_id = (uint32_t)strtoul_wrapper(val, 0, UINT32_MAX,
+                NO_EXIT_UPON_ERR, &is_err);
+        if(is_err != FKO_SUCCESS)
+        {
+            log_msg(LOG_ERR,
+                "[*] Fatal error - SDP_ID string invalid"
+            );
+            free_acc_stanza_data(new_acc);
+            mem_free(MEM_TAG_STANZA, new_acc);
+            clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+        }
 
-        if( hash_table_set(opts->acc_stanza_hash_tbl, key, new_acc) != FKO_SUCCESS )
+        if( acc_id_map_set(opts->acc_stanza_hash_tbl, sdp_id, new_acc) != FKO_SUCCESS )
         {
             log_msg(LOG_ERR,
                 "[*] Fatal error creating access stanza hash table node"
             );
-            bdestroy(key);
             free_acc_stanza_data(new_acc);
-            free(new_acc);
+            mem_free(MEM_TAG_STANZA, new_acc);
             clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
         }
     }
@@ -1437,11 +2085,13 @@ acc_stanza_add(fko_srv_options_t *opts, char *val)
     return(new_acc);
 }
 
-static void
-set_one_acc_defaults(acc_stanza_t *acc)
+/* Fill in the defaults for one stanza.  Returns 0 if the stanza cannot
+ * be used.
+*/
+static int
+set_one_acc_defaults(fko_srv_options_t *opts, acc_stanza_t *acc,
+        const int stanza_num)
 {
-    access_counter_g++;
-
     /* set default fw_access_timeout if necessary
     */
     if(acc->fw_access_timeout < 1)
@@ -1449,35 +2099,35 @@ set_one_acc_defaults(acc_stanza_t *acc)
 
     /* set default gpg keyring path if necessary
     */
-    if(acc->gpg_decrypt_pw != NULL)
+    if(acc->cold->gpg_decrypt_pw != NULL)
     {
-        if(acc->gpg_home_dir == NULL)
-            add_acc_string(&(acc->gpg_home_dir),
-                    access_opts_g->config[CONF_GPG_HOME_DIR], NULL, access_opts_g);
+        if(acc->cold->gpg_home_dir == NULL)
+            add_acc_string(&(acc->cold->gpg_home_dir),
+                    opts->config[CONF_GPG_HOME_DIR], NULL, opts);
 
-        if(! acc->gpg_require_sig)
+        if(! acc->cold->gpg_require_sig)
         {
-            if (acc->gpg_disable_sig)
+            if (acc->cold->gpg_disable_sig)
             {
                 log_msg(LOG_INFO,
                     "Warning: GPG_REQUIRE_SIG should really be enabled for stanza source: '%s' (#%d)",
-                    acc->source, access_counter_g
+                    acc->cold->source, stanza_num
                 );
             }
             else
             {
                 /* Make this the default unless explicitly disabled
                 */
-                acc->gpg_require_sig = 1;
+                acc->cold->gpg_require_sig = 1;
             }
         }
         else
         {
-            if (acc->gpg_disable_sig)
+            if (acc->cold->gpg_disable_sig)
             {
                 log_msg(LOG_INFO,
                     "Warning: GPG_REQUIRE_SIG and GPG_DISABLE_SIG are both set, will check sigs (stanza source: '%s' #%d)",
-                    acc->source, access_counter_g
+                    acc->cold->source, stanza_num
                 );
             }
         }
@@ -1485,14 +2135,14 @@ set_one_acc_defaults(acc_stanza_t *acc)
         /* If signature checking is enabled, make sure we either have sig ID's or
          * fingerprint ID's to check
         */
-        if(! acc->gpg_disable_sig
-                && (acc->gpg_remote_id == NULL && acc->gpg_remote_fpr == NULL))
+        if(! acc->cold->gpg_disable_sig
+                && (acc->cold->gpg_remote_id == NULL && acc->cold->gpg_remote_fpr == NULL))
         {
             log_msg(LOG_INFO,
                 "Warning: Must have either sig ID's or fingerprints to check via GPG_REMOTE_ID or GPG_FINGERPRINT_ID (stanza source: '%s' #%d)",
-                acc->source, access_counter_g
+                acc->cold->source, stanza_num
             );
-            clean_exit(access_opts_g, NO_FW_CLEANUP, EXIT_FAILURE);
+            return 0;
         }
     }
 
@@ -1503,49 +2153,131 @@ set_one_acc_defaults(acc_stanza_t *acc)
      * set for HMAC_DIGEST_TYPE, then assume it's SHA256
     */
 
-    if(acc->hmac_type == FKO_HMAC_UNKNOWN
-            && acc->hmac_key_len > 0 && acc->hmac_key != NULL)
+    if(acc->hmac_type == FKO_HMAC_UNKNOWN && acc->hmac_key_len > 0)
     {
         acc->hmac_type = FKO_DEFAULT_HMAC_MODE;
     }
 
-    return;
+#if SDP_FASTPATH
+    /* The packet path of an --enable-sdp-fastpath build only handles
+     * Rijndael in CBC mode with an HMAC-SHA256 key.
+    */
+    if(acc->use_gpg || ! acc->use_rijndael
+            || acc->encryption_mode != FKO_ENC_MODE_CBC
+            || acc->hmac_key_len == 0 || acc->hmac_type != FKO_HMAC_SHA256)
+    {
+        log_msg(LOG_ERR,
+            "[*] Stanza for SDP ID %"PRIu32" (#%d) needs Rijndael (CBC) with an HMAC-SHA256 key in this fwknopd build",
+            acc->sdp_id, stanza_num
+        );
+        return 0;
+    }
+#endif
+
+    /* Set up the HMAC key state once here rather than for every incoming
+     * SPA packet.  If this fails the packets are still checked, just the
+     * slow way.
+    */
+    if(acc->hmac_state == NULL && acc->hmac_key_len > 0
+            && fko_hmac_state_new(&(acc->hmac_state), acc->hmac_key,
+                acc->hmac_key_len, acc->hmac_type) != FKO_SUCCESS)
+    {
+        log_msg(LOG_WARNING,
+            "Could not precompute the HMAC key state for stanza source: '%s' (#%d)",
+            acc->cold->source, stanza_num
+        );
+        acc->hmac_state = NULL;
+    }
+
+    return 1;
 }
 
+
+/* The stanzas being worked on by expand_acc_stanzas().
+*/
+typedef struct acc_expand_job
+{
+    fko_srv_options_t  *opts;
+    acc_stanza_t      **stanzas;
+    int                 count;
+} acc_expand_job_t;
+
 static int
-traverse_set_acc_defaults_cb(hash_table_node_t *node, void *arg)
+collect_acc_stanza_cb(acc_stanza_t *acc, void *arg)
 {
-    acc_stanza_t *acc = (acc_stanza_t *)(node->data);
-    if(acc)
-        set_one_acc_defaults(acc);
+    acc_expand_job_t   *job = (acc_expand_job_t *)arg;
+
+    job->stanzas[job->count++] = acc;
     return 0;
 }
 
+static int
+expand_acc_stanza_cb(void *arg, const int idx)
+{
+    acc_expand_job_t   *job = (acc_expand_job_t *)arg;
+    acc_stanza_t       *acc = job->stanzas[idx];
+
+    if(expand_one_acc_ent_list(acc, 0) != SUCCESS)
+        return 1;
+
+    return(set_one_acc_defaults(job->opts, acc, idx + 1) ? 0 : 1);
+}
 
-/* Scan the access options for entries that have not been set, but need
- * a default value.
+/* Expand any access entries that may be multi-value and set the defaults
+ * where needed.  Each stanza is handled on its own, so the stanzas are
+ * spread over several threads (see run_parallel()).
 */
 static void
-set_acc_defaults(fko_srv_options_t *opts)
+expand_acc_stanzas(fko_srv_options_t *opts)
 {
-    acc_stanza_t    *acc = opts->acc_stanzas;
-    access_counter_g = 0;
-    access_opts_g = opts;
+    acc_expand_job_t    job;
+    acc_stanza_t       *acc;
+    int                 num_stanzas = 0;
+
+    memset(&job, 0x0, sizeof(job));
+    job.opts = opts;
 
     if(strncasecmp(opts->config[CONF_DISABLE_SDP_MODE], "Y", 1) == 0)
     {
-        while(acc)
-        {
-            set_one_acc_defaults(acc);
-            acc = acc->next;
-        }
+        for(acc = opts->acc_stanzas; acc != NULL; acc = acc->next)
+            num_stanzas++;
+    }
+    else if(opts->acc_stanza_hash_tbl != NULL)
+    {
+        num_stanzas = opts->acc_stanza_hash_tbl->count;
+    }
+
+    if(num_stanzas == 0)
+        return;
+
+    if((job.stanzas = mem_calloc(MEM_TAG_STANZA, num_stanzas, sizeof(acc_stanza_t *))) == NULL)
+    {
+        log_msg(LOG_ERR,
+            "[*] Fatal memory allocation error expanding access stanzas"
+        );
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    /* The list keeps access.conf order, so the stanza numbers in any
+     * messages are the same as when this was done one at a time.
+    */
+    if(strncasecmp(opts->config[CONF_DISABLE_SDP_MODE], "Y", 1) == 0)
+    {
+        for(acc = opts->acc_stanzas; acc != NULL; acc = acc->next)
+            job.stanzas[job.count++] = acc;
     }
     else
     {
-        hash_table_traverse(opts->acc_stanza_hash_tbl, traverse_set_acc_defaults_cb, NULL);
+        acc_id_map_traverse(opts->acc_stanza_hash_tbl, collect_acc_stanza_cb, &job);
+    }
+
+    if(run_parallel(job.count, expand_acc_stanza_cb, &job) != 0)
+    {
+        mem_free(MEM_TAG_STANZA, job.stanzas);
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
     }
 
-    access_opts_g = NULL;
+    mem_free(MEM_TAG_STANZA, job.stanzas);
     return;
 }
 
@@ -1563,53 +2295,52 @@ acc_data_is_valid(fko_srv_options_t *opts,
         return(0);
     }
 
-    if(((acc->key == NULL || acc->key_len == 0)
-      && ((acc->gpg_decrypt_pw == NULL || !strlen(acc->gpg_decrypt_pw))
+    if((acc->key_len == 0
+      && ((acc->cold->gpg_decrypt_pw == NULL || !strlen(acc->cold->gpg_decrypt_pw))
           && acc->gpg_allow_no_pw == 0))
       || (acc->use_rijndael == 0 && acc->use_gpg == 0 && acc->gpg_allow_no_pw == 0))
     {
         log_msg(LOG_ERR,
-            "[*] No keys found for access stanza source: '%s'", acc->source
+            "[*] No keys found for access stanza source: '%s'", acc->cold->source
         );
         return(0);
     }
 
-    if(acc->use_rijndael && acc->key != NULL)
+    if(acc->use_rijndael && acc->key_len > 0)
     {
         if((acc->encryption_mode == FKO_ENC_MODE_CBC_LEGACY_IV)
                 && (acc->key_len > 16))
         {
             log_msg(LOG_INFO,
                 "Warning: truncating encryption key in legacy mode to 16 bytes for access stanza source: '%s'",
-                acc->source
+                acc->cold->source
             );
             acc->key_len = 16;
         }
     }
 
-    if((acc->hmac_key_len) != 0 && (acc->hmac_key != NULL))
+    if(acc->hmac_key_len != 0)
     {
-        if((acc->key != NULL) && (acc->key_len != 0)
-                && (acc->key_len == acc->hmac_key_len))
+        if((acc->key_len != 0) && (acc->key_len == acc->hmac_key_len))
         {
             if(memcmp(acc->key, acc->hmac_key, acc->hmac_key_len) == 0)
             {
                 log_msg(LOG_ERR,
                     "[*] The encryption passphrase and HMAC key should not be identical for access stanza source: '%s'",
-                    acc->source
+                    acc->cold->source
                 );
                 return(0);
             }
         }
         else if((acc->gpg_allow_no_pw == 0)
-                && acc->gpg_decrypt_pw != NULL
-                && (strlen(acc->gpg_decrypt_pw) == acc->hmac_key_len))
+                && acc->cold->gpg_decrypt_pw != NULL
+                && (strlen(acc->cold->gpg_decrypt_pw) == acc->hmac_key_len))
         {
-            if(memcmp(acc->gpg_decrypt_pw, acc->hmac_key, acc->hmac_key_len) == 0)
+            if(memcmp(acc->cold->gpg_decrypt_pw, acc->hmac_key, acc->hmac_key_len) == 0)
             {
                 log_msg(LOG_ERR,
                     "[*] The encryption passphrase and HMAC key should not be identical for access stanza source: '%s'",
-                    acc->source
+                    acc->cold->source
                 );
                 return(0);
             }
@@ -1617,10 +2348,10 @@ acc_data_is_valid(fko_srv_options_t *opts,
     }
 
 #if defined(FIREWALL_FIREWALLD) || defined(FIREWALL_IPTABLES)
-    if((acc->force_snat == 1 || acc->force_masquerade == 1)
-            && acc->force_nat == 0)
+    if((acc->cold->force_snat == 1 || acc->cold->force_masquerade == 1)
+            && acc->cold->force_nat == 0)
     {
-        if(acc->forward_all == 1)
+        if(acc->cold->forward_all == 1)
         {
             if(add_acc_force_nat(acc, "0.0.0.0 0") != FWKNOPD_SUCCESS)
                 return(0);
@@ -1629,7 +2360,7 @@ acc_data_is_valid(fko_srv_options_t *opts,
         {
             log_msg(LOG_ERR,
                     "[*] FORCE_SNAT/FORCE_MASQUERADE requires either FORCE_NAT or FORWARD_ALL: '%s'",
-                    acc->source
+                    acc->cold->source
             );
             return(0);
         }
@@ -1640,80 +2371,80 @@ acc_data_is_valid(fko_srv_options_t *opts,
     {
         log_msg(LOG_INFO,
             "Warning: REQUIRE_SOURCE_ADDRESS not enabled for access stanza source: '%s'",
-            acc->source
+            acc->cold->source
         );
     }
 
-    if(user_pw != NULL && acc->cmd_exec_uid != 0 && acc->cmd_exec_gid == 0)
+    if(user_pw != NULL && acc->cold->cmd_exec_uid != 0 && acc->cold->cmd_exec_gid == 0)
     {
         log_msg(LOG_INFO,
             "Setting gid to group associated with CMD_EXEC_USER '%s' for setgid() execution in stanza source: '%s'",
-            acc->cmd_exec_user,
-            acc->source
+            acc->cold->cmd_exec_user,
+            acc->cold->source
         );
-        acc->cmd_exec_gid = user_pw->pw_gid;
+        acc->cold->cmd_exec_gid = user_pw->pw_gid;
     }
 
     if(sudo_user_pw != NULL
-            && acc->cmd_sudo_exec_uid != 0 && acc->cmd_sudo_exec_gid == 0)
+            && acc->cold->cmd_sudo_exec_uid != 0 && acc->cold->cmd_sudo_exec_gid == 0)
     {
         log_msg(LOG_INFO,
             "Setting gid to group associated with CMD_SUDO_EXEC_USER '%s' in stanza source: '%s'",
-            acc->cmd_sudo_exec_user,
-            acc->source
+            acc->cold->cmd_sudo_exec_user,
+            acc->cold->source
         );
-        acc->cmd_sudo_exec_gid = sudo_user_pw->pw_gid;
+        acc->cold->cmd_sudo_exec_gid = sudo_user_pw->pw_gid;
     }
 
-    if(acc->cmd_cycle_open != NULL)
+    if(acc->cold->cmd_cycle_open != NULL)
     {
-        if(acc->cmd_cycle_close == NULL)
+        if(acc->cold->cmd_cycle_close == NULL)
         {
             log_msg(LOG_ERR,
                 "[*] Cannot set CMD_CYCLE_OPEN without also setting CMD_CYCLE_CLOSE: '%s'",
-                acc->source
+                acc->cold->source
             );
             return(0);
         }
 
         /* Allow the string "NONE" to short-circuit close command execution.
         */
-        if(strncmp(acc->cmd_cycle_close, "NONE", 4) == 0)
-            acc->cmd_cycle_do_close = 0;
+        if(strncmp(acc->cold->cmd_cycle_close, "NONE", 4) == 0)
+            acc->cold->cmd_cycle_do_close = 0;
 
-        if(acc->cmd_cycle_timer == 0 && acc->cmd_cycle_do_close)
+        if(acc->cold->cmd_cycle_timer == 0 && acc->cold->cmd_cycle_do_close)
         {
             log_msg(LOG_ERR,
                 "[*] Must set the CMD_CYCLE_TIMER for command cycle functionality: '%s'",
-                acc->source
+                acc->cold->source
             );
             return(0);
         }
-        if(strlen(acc->cmd_cycle_open) >= CMD_CYCLE_BUFSIZE)
+        if(strlen(acc->cold->cmd_cycle_open) >= CMD_CYCLE_BUFSIZE)
         {
             log_msg(LOG_ERR,
                 "[*] CMD_CYCLE_OPEN command is too long: '%s'",
-                acc->source
+                acc->cold->source
             );
             return(0);
         }
     }
 
-    if(acc->cmd_cycle_close != NULL)
+    if(acc->cold->cmd_cycle_close != NULL)
     {
-        if(acc->cmd_cycle_open == NULL)
+        if(acc->cold->cmd_cycle_open == NULL)
         {
             log_msg(LOG_ERR,
                 "[*] Cannot set CMD_CYCLE_CLOSE without also setting CMD_CYCLE_OPEN: '%s'",
-                acc->source
+                acc->cold->source
             );
             return(0);
         }
-        if(strlen(acc->cmd_cycle_close) >= CMD_CYCLE_BUFSIZE)
+        if(strlen(acc->cold->cmd_cycle_close) >= CMD_CYCLE_BUFSIZE)
         {
             log_msg(LOG_ERR,
                 "[*] CMD_CYCLE_CLOSE command is too long: '%s'",
-                acc->source
+                acc->cold->source
             );
             return(0);
         }
@@ -1721,8 +2452,8 @@ acc_data_is_valid(fko_srv_options_t *opts,
 
     /* For any non-command access stanza, we enable global firewall handling
     */
-    if(!acc->enable_cmd_exec && !acc->enable_cmd_sudo_exec &&
-            acc->cmd_cycle_open == NULL)
+    if(!acc->enable_cmd_exec && !acc->cold->enable_cmd_sudo_exec &&
+            acc->cold->cmd_cycle_open == NULL)
         opts->enable_fw = 1;
 
     return(1);
@@ -1733,15 +2464,32 @@ acc_data_is_valid(fko_srv_options_t *opts,
  *
  */
 static int
-make_acc_stanza_from_json(fko_srv_options_t *opts, json_object *jdata, acc_stanza_t **r_stanza)
+make_acc_stanza_from_json(fko_srv_options_t *opts, json_object *jdata,
+        const int stanza_num, acc_stanza_t **r_stanza)
 {
     int rv = FWKNOPD_SUCCESS;
     char *tmp;
     struct passwd  *user_pw = NULL;
     struct passwd  *sudo_user_pw = NULL;
     struct passwd  *tmp_pw = NULL;
+    struct passwd   user_pw_ent, sudo_user_pw_ent, tmp_pw_ent;
+    char            user_pw_buf[ACC_PW_BUF_LEN];
+    char            sudo_user_pw_buf[ACC_PW_BUF_LEN];
+    char            tmp_pw_buf[ACC_PW_BUF_LEN];
     char *service_list = NULL;
-    acc_stanza_t *stanza = calloc(1, sizeof(acc_stanza_t));
+    acc_stanza_t *stanza = mem_calloc(MEM_TAG_STANZA, 1, sizeof(acc_stanza_t));
+
+    if(stanza == NULL)
+    {
+        *r_stanza = NULL;
+        return FKO_ERROR_MEMORY_ALLOCATION;
+    }
+
+    if((stanza->cold = mem_calloc(MEM_TAG_STANZA, 1, sizeof(acc_stanza_cold_t))) == NULL)
+    {
+        rv = FKO_ERROR_MEMORY_ALLOCATION;
+        goto cleanup;
+    }
 
     if((rv = sdp_get_json_int_field("sdp_id", jdata, (int*)&(stanza->sdp_id))) != SDP_SUCCESS)
     {
@@ -1749,22 +2497,22 @@ make_acc_stanza_from_json(fko_srv_options_t *opts, json_object *jdata, acc_stanz
         goto cleanup;
     }
 
-    if(sdp_get_json_string_field("source", jdata, &(stanza->source)) != SDP_SUCCESS)
+    if(acc_json_string_field("source", jdata, &(stanza->cold->source)) != SDP_SUCCESS)
     {
         // log_msg(LOG_WARNING, "Did not find source in access stanza, setting to ANY");
-        if((stanza->source = strndup("ANY", 4)) == NULL)
+        if((stanza->cold->source = mem_strndup(MEM_TAG_STANZA, "ANY", 4)) == NULL)
         {
             rv = FKO_ERROR_MEMORY_ALLOCATION;
             goto cleanup;
         }
     }
 
-    if( sdp_get_json_string_field("service_list", jdata, &service_list) == SDP_SUCCESS)
+    if( acc_json_string_field("service_list", jdata, &service_list) == SDP_SUCCESS)
     {
         // save the string, mainly just for printing
-        stanza->service_list_str = service_list;
+        stanza->cold->service_list_str = service_list;
 
-        //if(expand_acc_service_list(&(stanza->service_list), service_list) == 0)
+        //if((stanza->service_set = compile_acc_service_set(service_list)) == NULL)
         //{
         //    log_msg(LOG_ERR, "Failed to parse service list in access stanza, invalid stanza entry");
         //    rv = FWKNOPD_ERROR_BAD_STANZA_DATA;
@@ -1772,259 +2520,262 @@ make_acc_stanza_from_json(fko_srv_options_t *opts, json_object *jdata, acc_stanz
         //}
     }
 
-    sdp_get_json_string_field("destination", jdata, &(stanza->destination));
-    sdp_get_json_string_field("open_ports", jdata, &(stanza->open_ports));
-    sdp_get_json_string_field("restrict_ports", jdata, &(stanza->restrict_ports));
+    acc_json_string_field("destination", jdata, &(stanza->cold->destination));
+    acc_json_string_field("open_ports", jdata, &(stanza->cold->open_ports));
+    acc_json_string_field("restrict_ports", jdata, &(stanza->cold->restrict_ports));
 
-    if(sdp_get_json_string_field("spa_encryption_key", jdata, &(stanza->key)) == SDP_SUCCESS)
+    if(acc_json_string_field("spa_encryption_key", jdata, &tmp) == SDP_SUCCESS)
     {
-        if((stanza->key_len = strnlen(stanza->key, MAX_KEY_LEN + 1)) > MAX_KEY_LEN)
+        rv = set_acc_key(stanza->key, &(stanza->key_len), tmp,
+                strnlen(tmp, MAX_KEY_LEN + 1));
+        zero_buf_wrapper(tmp, strlen(tmp));
+        mem_free(MEM_TAG_STANZA, tmp);
+
+        if(rv != FWKNOPD_SUCCESS)
         {
             log_msg(LOG_ERR, "Key length exceeds max length of %d bytes", MAX_KEY_LEN);
-            rv = FWKNOPD_ERROR_BAD_STANZA_DATA;
             goto cleanup;
         }
 
         add_acc_bool(&(stanza->use_rijndael), "Y");
     }
 
-    if(sdp_get_json_string_field("spa_encryption_key_base64", jdata, &(stanza->key_base64)) == SDP_SUCCESS)
+    if(acc_json_string_field("spa_encryption_key_base64", jdata, &(stanza->cold->key_base64)) == SDP_SUCCESS)
     {
-        if(strnlen(stanza->key_base64, MAX_B64_KEY_LEN + 1) > MAX_B64_KEY_LEN)
+        if((rv = set_acc_b64_key(stanza->key, &(stanza->key_len),
+                        stanza->cold->key_base64)) != FWKNOPD_SUCCESS)
         {
-            log_msg(LOG_ERR, "B64 key length exceeds max length %d bytes", MAX_B64_KEY_LEN);
-            rv = FWKNOPD_ERROR_BAD_STANZA_DATA;
-            goto cleanup;
-        }
-        // make space for decoded version of the key
-        // decode function does not watch for buffer overwrite, so oversize the buffer
-        if((stanza->key = calloc(1, MAX_B64_KEY_LEN)) == NULL)
-        {
-            rv = SDP_ERROR_MEMORY_ALLOCATION;
-            goto cleanup;
-        }
-        // perform decode and get key len
-        if((stanza->key_len = fko_base64_decode(stanza->key_base64, (unsigned char*)stanza->key)) < 0)
-        {
-            log_msg(LOG_ERR, "Failed to decode base64 key");
-            rv = FWKNOPD_ERROR_BAD_STANZA_DATA;
-            goto cleanup;
-        }
-
-        if(stanza->key_len > MAX_KEY_LEN)
-        {
-            log_msg(LOG_ERR, "Decoded key length is %d bytes, exceeds max length %d bytes", stanza->key_len, MAX_KEY_LEN);
-            rv = FWKNOPD_ERROR_BAD_STANZA_DATA;
+            log_msg(LOG_ERR, "Failed to decode base64 key or decoded key exceeds max length %d bytes",
+                    MAX_KEY_LEN);
             goto cleanup;
         }
 
         add_acc_bool(&(stanza->use_rijndael), "Y");
     }
 
-    if(sdp_get_json_string_field("hmac_type", jdata, &tmp) == SDP_SUCCESS)
+    if(acc_json_string_field("hmac_type", jdata, &tmp) == SDP_SUCCESS)
     {
         if((stanza->hmac_type = hmac_digest_strtoint(tmp)) < 0)
         {
             log_msg(LOG_ERR,
                 "HMAC_DIGEST_TYPE argument '%s' must be one of {md5,sha1,sha256,sha384,sha512}",
                 tmp);
-            free(tmp);
+            mem_free(MEM_TAG_STANZA, tmp);
             goto cleanup;
         }
-        free(tmp);
+        mem_free(MEM_TAG_STANZA, tmp);
     }
 
-    if(sdp_get_json_string_field("spa_hmac_key", jdata, &(stanza->hmac_key)) == SDP_SUCCESS)
+    if(acc_json_string_field("spa_hmac_key", jdata, &tmp) == SDP_SUCCESS)
     {
-        if((stanza->hmac_key_len = strnlen(stanza->key, MAX_KEY_LEN + 1)) > MAX_KEY_LEN)
+        rv = set_acc_key(stanza->hmac_key, &(stanza->hmac_key_len), tmp,
+                strnlen(tmp, MAX_KEY_LEN + 1));
+        zero_buf_wrapper(tmp, strlen(tmp));
+        mem_free(MEM_TAG_STANZA, tmp);
+
+        if(rv != FWKNOPD_SUCCESS)
         {
             log_msg(LOG_ERR, "Key length exceeds max length of %d bytes", MAX_KEY_LEN);
-            rv = FWKNOPD_ERROR_BAD_STANZA_DATA;
             goto cleanup;
         }
     }
 
-    if(sdp_get_json_string_field("spa_hmac_key_base64", jdata, &(stanza->hmac_key_base64)) == SDP_SUCCESS)
+    if(acc_json_string_field("spa_hmac_key_base64", jdata, &(stanza->cold->hmac_key_base64)) == SDP_SUCCESS)
     {
-        if(strnlen(stanza->hmac_key_base64, MAX_B64_KEY_LEN + 1) > MAX_B64_KEY_LEN)
+        if((rv = set_acc_b64_key(stanza->hmac_key, &(stanza->hmac_key_len),
+                        stanza->cold->hmac_key_base64)) != FWKNOPD_SUCCESS)
         {
-            log_msg(LOG_ERR, "B64 key length exceeds max length %d bytes", MAX_B64_KEY_LEN);
-            rv = FWKNOPD_ERROR_BAD_STANZA_DATA;
+            log_msg(LOG_ERR, "Failed to decode base64 key or decoded key exceeds max length %d bytes",
+                    MAX_KEY_LEN);
             goto cleanup;
         }
-        // make space for decoded version of the key
-        // decode function does not watch for buffer overwrite, so oversize the buffer
-        if((stanza->hmac_key = calloc(1, MAX_B64_KEY_LEN)) == NULL)
-        {
-            rv = SDP_ERROR_MEMORY_ALLOCATION;
-            goto cleanup;
-        }
-        // perform decode and get key len
-        if((stanza->hmac_key_len = fko_base64_decode(stanza->hmac_key_base64, (unsigned char*)stanza->hmac_key)) < 0)
+    }
+
+    if(sdp_get_json_int_field("fw_access_timeout", jdata, &(stanza->fw_access_timeout)) == SDP_SUCCESS)
+    {
+        if(stanza->fw_access_timeout < 0 || stanza->fw_access_timeout > RCHK_MAX_FW_TIMEOUT)
         {
-            log_msg(LOG_ERR, "Failed to decode base64 key");
+            log_msg(LOG_ERR,
+                "fw_access_timeout value %d not in range [0 - %d].",
+                stanza->fw_access_timeout, RCHK_MAX_FW_TIMEOUT);
             rv = FWKNOPD_ERROR_BAD_STANZA_DATA;
             goto cleanup;
         }
+    }
 
-        if(stanza->hmac_key_len > MAX_KEY_LEN)
+    if(sdp_get_json_int_field("grant_idle_timeout", jdata, &(stanza->cold->grant_idle_timeout)) == SDP_SUCCESS)
+    {
+        if(stanza->cold->grant_idle_timeout < 0
+                || stanza->cold->grant_idle_timeout > RCHK_MAX_FW_TIMEOUT)
         {
-            log_msg(LOG_ERR, "Decoded key length is %d bytes, exceeds max length %d bytes", stanza->hmac_key_len, MAX_KEY_LEN);
+            log_msg(LOG_ERR,
+                "grant_idle_timeout value %d not in range [0 - %d].",
+                stanza->cold->grant_idle_timeout, RCHK_MAX_FW_TIMEOUT);
             rv = FWKNOPD_ERROR_BAD_STANZA_DATA;
             goto cleanup;
         }
     }
 
-    if(sdp_get_json_int_field("fw_access_timeout", jdata, &(stanza->fw_access_timeout)) == SDP_SUCCESS)
+    if(sdp_get_json_int_field("max_active_grants", jdata, &(stanza->cold->max_active_grants)) == SDP_SUCCESS)
     {
-        if(stanza->fw_access_timeout < 0 || stanza->fw_access_timeout > RCHK_MAX_FW_TIMEOUT)
+        if(stanza->cold->max_active_grants < 0
+                || stanza->cold->max_active_grants > RCHK_MAX_ACTIVE_GRANTS)
         {
             log_msg(LOG_ERR,
-                "fw_access_timeout value %d not in range [0 - %d].",
-                stanza->fw_access_timeout, RCHK_MAX_FW_TIMEOUT);
+                "max_active_grants value %d not in range [0 - %d].",
+                stanza->cold->max_active_grants, RCHK_MAX_ACTIVE_GRANTS);
             rv = FWKNOPD_ERROR_BAD_STANZA_DATA;
             goto cleanup;
         }
     }
 
-    if(sdp_get_json_string_field("encryption_mode", jdata, &tmp) == SDP_SUCCESS)
+    if(acc_json_string_field("encryption_mode", jdata, &tmp) == SDP_SUCCESS)
     {
         if((stanza->encryption_mode = enc_mode_strtoint(tmp)) < 0)
         {
-            log_msg(LOG_ERR,
-                "Unrecognized encryption_mode '%s', use {CBC,CTR,legacy,Asymmetric}",
-                tmp);
-            free(tmp);
+            if(enc_mode_is_unsupported(tmp))
+                log_msg(LOG_ERR,
+                    "encryption_mode '%s' is not supported by this build of fwknopd",
+                    tmp);
+            else
+                log_msg(LOG_ERR,
+                    "Unrecognized encryption_mode '%s', use {CBC,CTR,GCM,GCM_BINARY,legacy,Asymmetric}",
+                    tmp);
+            mem_free(MEM_TAG_STANZA, tmp);
             goto cleanup;
         }
-        free(tmp);
+        mem_free(MEM_TAG_STANZA, tmp);
     }
 
-    if(sdp_get_json_string_field("enable_cmd_exec", jdata, &tmp) == SDP_SUCCESS)
+    if(acc_json_string_field("enable_cmd_exec", jdata, &tmp) == SDP_SUCCESS)
     {
         add_acc_bool(&(stanza->enable_cmd_exec), tmp);
-        free(tmp);
+        mem_free(MEM_TAG_STANZA, tmp);
     }
 
-    if(sdp_get_json_string_field("enable_cmd_sudo_exec", jdata, &tmp) == SDP_SUCCESS)
+    if(acc_json_string_field("enable_cmd_sudo_exec", jdata, &tmp) == SDP_SUCCESS)
     {
-        add_acc_bool(&(stanza->enable_cmd_sudo_exec), tmp);
-        free(tmp);
+        add_acc_bool(&(stanza->cold->enable_cmd_sudo_exec), tmp);
+        mem_free(MEM_TAG_STANZA, tmp);
     }
 
-    if(sdp_get_json_string_field("cmd_sudo_exec_user", jdata, &(stanza->cmd_sudo_exec_user)) == SDP_SUCCESS)
+    if(acc_json_string_field("cmd_sudo_exec_user", jdata, &(stanza->cold->cmd_sudo_exec_user)) == SDP_SUCCESS)
     {
         errno = 0;
-        sudo_user_pw = getpwnam(stanza->cmd_sudo_exec_user);
+        sudo_user_pw = acc_getpwnam(stanza->cold->cmd_sudo_exec_user,
+                &sudo_user_pw_ent, sudo_user_pw_buf, sizeof(sudo_user_pw_buf));
 
         if(sudo_user_pw == NULL)
         {
             log_msg(LOG_ERR, "Unable to determine UID for %s: %s.",
-                    stanza->cmd_sudo_exec_user,
+                    stanza->cold->cmd_sudo_exec_user,
                     errno ? strerror(errno) : "Not a user on this system");
             goto cleanup;
         }
 
-        stanza->cmd_sudo_exec_uid = sudo_user_pw->pw_uid;
+        stanza->cold->cmd_sudo_exec_uid = sudo_user_pw->pw_uid;
     }
 
-    if(sdp_get_json_string_field("cmd_exec_user", jdata, &(stanza->cmd_exec_user)) == SDP_SUCCESS)
+    if(acc_json_string_field("cmd_exec_user", jdata, &(stanza->cold->cmd_exec_user)) == SDP_SUCCESS)
     {
         errno = 0;
-        user_pw = getpwnam(stanza->cmd_exec_user);
+        user_pw = acc_getpwnam(stanza->cold->cmd_exec_user,
+                &user_pw_ent, user_pw_buf, sizeof(user_pw_buf));
 
         if(user_pw == NULL)
         {
             log_msg(LOG_ERR, "Unable to determine UID for %s: %s.",
-                    stanza->cmd_exec_user,
+                    stanza->cold->cmd_exec_user,
                     errno ? strerror(errno) : "Not a user on this system");
             goto cleanup;
         }
 
-        stanza->cmd_exec_uid = user_pw->pw_uid;
+        stanza->cold->cmd_exec_uid = user_pw->pw_uid;
     }
 
-    if(sdp_get_json_string_field("cmd_sudo_exec_group", jdata, &(stanza->cmd_sudo_exec_group)) == SDP_SUCCESS)
+    if(acc_json_string_field("cmd_sudo_exec_group", jdata, &(stanza->cold->cmd_sudo_exec_group)) == SDP_SUCCESS)
     {
         errno = 0;
-        tmp_pw = getpwnam(stanza->cmd_sudo_exec_group);
+        tmp_pw = acc_getpwnam(stanza->cold->cmd_sudo_exec_group,
+                &tmp_pw_ent, tmp_pw_buf, sizeof(tmp_pw_buf));
 
         if(tmp_pw == NULL)
         {
             log_msg(LOG_ERR, "Unable to determine GID for %s: %s.",
-                    stanza->cmd_sudo_exec_group,
+                    stanza->cold->cmd_sudo_exec_group,
                     errno ? strerror(errno) : "Not a group on this system");
             goto cleanup;
         }
 
-        stanza->cmd_sudo_exec_gid = tmp_pw->pw_gid;
+        stanza->cold->cmd_sudo_exec_gid = tmp_pw->pw_gid;
     }
 
-    if(sdp_get_json_string_field("cmd_exec_group", jdata, &(stanza->cmd_exec_group)) == SDP_SUCCESS)
+    if(acc_json_string_field("cmd_exec_group", jdata, &(stanza->cold->cmd_exec_group)) == SDP_SUCCESS)
     {
         errno = 0;
-        tmp_pw = getpwnam(stanza->cmd_exec_group);
+        tmp_pw = acc_getpwnam(stanza->cold->cmd_exec_group,
+                &tmp_pw_ent, tmp_pw_buf, sizeof(tmp_pw_buf));
 
         if(tmp_pw == NULL)
         {
             log_msg(LOG_ERR, "Unable to determine GID for %s: %s.",
-                    stanza->cmd_exec_group,
+                    stanza->cold->cmd_exec_group,
                     errno ? strerror(errno) : "Not a group on this system");
             goto cleanup;
         }
 
-        stanza->cmd_exec_gid = tmp_pw->pw_gid;
+        stanza->cold->cmd_exec_gid = tmp_pw->pw_gid;
     }
 
-    if(sdp_get_json_string_field("cmd_cycle_open", jdata, &(stanza->cmd_cycle_open)) == SDP_SUCCESS)
+    if(acc_json_string_field("cmd_cycle_open", jdata, &(stanza->cold->cmd_cycle_open)) == SDP_SUCCESS)
     {
-        stanza->cmd_cycle_do_close = 1;
+        stanza->cold->cmd_cycle_do_close = 1;
     }
 
-    sdp_get_json_string_field("cmd_cycle_close", jdata, &(stanza->cmd_cycle_close));
-    sdp_get_json_int_field("cmd_cycle_timer", jdata, &(stanza->cmd_cycle_timer));
-    sdp_get_json_string_field("require_username", jdata, &(stanza->require_username));
+    acc_json_string_field("cmd_cycle_close", jdata, &(stanza->cold->cmd_cycle_close));
+    sdp_get_json_int_field("cmd_cycle_timer", jdata, &(stanza->cold->cmd_cycle_timer));
+    acc_json_string_field("require_username", jdata, &(stanza->cold->require_username));
 
-    if(sdp_get_json_string_field("require_source_address", jdata, &tmp) == SDP_SUCCESS)
+    if(acc_json_string_field("require_source_address", jdata, &tmp) == SDP_SUCCESS)
     {
         add_acc_bool(&(stanza->require_source_address), tmp);
-        free(tmp);
+        mem_free(MEM_TAG_STANZA, tmp);
     }
 
-    if(sdp_get_json_string_field("require_source", jdata, &tmp) == SDP_SUCCESS)
+    if(acc_json_string_field("require_source", jdata, &tmp) == SDP_SUCCESS)
     {
         add_acc_bool(&(stanza->require_source_address), tmp);
-        free(tmp);
+        mem_free(MEM_TAG_STANZA, tmp);
     }
 
-    if(sdp_get_json_string_field("gpg_home_dir", jdata, &(stanza->gpg_home_dir)) == SDP_SUCCESS)
+    if(acc_json_string_field("gpg_home_dir", jdata, &(stanza->cold->gpg_home_dir)) == SDP_SUCCESS)
     {
-        if(!is_valid_dir(stanza->gpg_home_dir))
+        if(!is_valid_dir(stanza->cold->gpg_home_dir))
         {
             log_msg(LOG_ERR,
                 "GPG_HOME_DIR directory '%s' stat()/existence problem in stanza source '%s'",
-                stanza->gpg_home_dir, stanza->source);
+                stanza->cold->gpg_home_dir, stanza->cold->source);
             rv = FWKNOPD_ERROR_BAD_STANZA_DATA;
             goto cleanup;
         }
     }
 
-    sdp_get_json_string_field("gpg_exe", jdata, &(stanza->gpg_exe));
-    sdp_get_json_string_field("gpg_decrypt_id", jdata, &(stanza->gpg_decrypt_id));
+    acc_json_string_field("gpg_exe", jdata, &(stanza->cold->gpg_exe));
+    acc_json_string_field("gpg_decrypt_id", jdata, &(stanza->cold->gpg_decrypt_id));
 
-    if((sdp_get_json_string_field("gpg_decrypt_pw", jdata, &(stanza->gpg_decrypt_pw))) == SDP_SUCCESS)
+    if((acc_json_string_field("gpg_decrypt_pw", jdata, &(stanza->cold->gpg_decrypt_pw))) == SDP_SUCCESS)
     {
         add_acc_bool(&(stanza->use_gpg), "Y");
     }
 
-    if(sdp_get_json_string_field("gpg_allow_no_pw", jdata, &tmp) == SDP_SUCCESS)
+    if(acc_json_string_field("gpg_allow_no_pw", jdata, &tmp) == SDP_SUCCESS)
     {
         add_acc_bool(&(stanza->gpg_allow_no_pw), tmp);
-        free(tmp);
+        mem_free(MEM_TAG_STANZA, tmp);
         if(stanza->gpg_allow_no_pw == 1)
         {
             add_acc_bool(&(stanza->use_gpg), "Y");
-            if((stanza->gpg_decrypt_pw = strndup("", 1)) == NULL)
+            if((stanza->cold->gpg_decrypt_pw = mem_strndup(MEM_TAG_STANZA, "", 1)) == NULL)
             {
                 rv = FKO_ERROR_MEMORY_ALLOCATION;
                 goto cleanup;
@@ -2032,48 +2783,48 @@ make_acc_stanza_from_json(fko_srv_options_t *opts, json_object *jdata, acc_stanz
         }
     }
 
-    if(sdp_get_json_string_field("gpg_require_sig", jdata, &tmp) == SDP_SUCCESS)
+    if(acc_json_string_field("gpg_require_sig", jdata, &tmp) == SDP_SUCCESS)
     {
-        add_acc_bool(&(stanza->gpg_require_sig), tmp);
-        free(tmp);
+        add_acc_bool(&(stanza->cold->gpg_require_sig), tmp);
+        mem_free(MEM_TAG_STANZA, tmp);
     }
 
-    if(sdp_get_json_string_field("gpg_disable_sig", jdata, &tmp) == SDP_SUCCESS)
+    if(acc_json_string_field("gpg_disable_sig", jdata, &tmp) == SDP_SUCCESS)
     {
-        add_acc_bool(&(stanza->gpg_disable_sig), tmp);
-        free(tmp);
+        add_acc_bool(&(stanza->cold->gpg_disable_sig), tmp);
+        mem_free(MEM_TAG_STANZA, tmp);
     }
 
-    if(sdp_get_json_string_field("gpg_ignore_sig_error", jdata, &tmp) == SDP_SUCCESS)
+    if(acc_json_string_field("gpg_ignore_sig_error", jdata, &tmp) == SDP_SUCCESS)
     {
-        add_acc_bool(&(stanza->gpg_ignore_sig_error), tmp);
-        free(tmp);
+        add_acc_bool(&(stanza->cold->gpg_ignore_sig_error), tmp);
+        mem_free(MEM_TAG_STANZA, tmp);
     }
 
-    sdp_get_json_string_field("gpg_remote_id", jdata, &(stanza->gpg_remote_id));
-    sdp_get_json_string_field("gpg_remote_fpr", jdata, &(stanza->gpg_remote_fpr));
+    acc_json_string_field("gpg_remote_id", jdata, &(stanza->cold->gpg_remote_id));
+    acc_json_string_field("gpg_remote_fpr", jdata, &(stanza->cold->gpg_remote_fpr));
 
-    if(sdp_get_json_string_field("access_expire_time", jdata, &tmp) == SDP_SUCCESS)
+    if(acc_json_string_field("access_expire_time", jdata, &tmp) == SDP_SUCCESS)
     {
         if((rv = add_acc_expire_time(&(stanza->access_expire_time), tmp)) != FWKNOPD_SUCCESS)
         {
-            free(tmp);
+            mem_free(MEM_TAG_STANZA, tmp);
             goto cleanup;
         }
-        free(tmp);
+        mem_free(MEM_TAG_STANZA, tmp);
     }
 
-    if(sdp_get_json_string_field("access_expire_epoch", jdata, &tmp) == SDP_SUCCESS)
+    if(acc_json_string_field("access_expire_epoch", jdata, &tmp) == SDP_SUCCESS)
     {
         if((rv = add_acc_expire_time_epoch(&(stanza->access_expire_time), tmp)) != FWKNOPD_SUCCESS)
         {
-            free(tmp);
+            mem_free(MEM_TAG_STANZA, tmp);
             goto cleanup;
         }
-        free(tmp);
+        mem_free(MEM_TAG_STANZA, tmp);
     }
 
-    if(sdp_get_json_string_field("force_nat", jdata, &tmp) == SDP_SUCCESS)
+    if(acc_json_string_field("force_nat", jdata, &tmp) == SDP_SUCCESS)
     {
 #if FIREWALL_FIREWALLD
         if(strncasecmp(opts->config[CONF_ENABLE_FIREWD_FORWARDING], "Y", 1) !=0
@@ -2081,13 +2832,13 @@ make_acc_stanza_from_json(fko_srv_options_t *opts, json_object *jdata, acc_stanz
         {
             log_msg(LOG_ERR,
                 "[*] FORCE_NAT requires either ENABLE_FIREWD_FORWARDING or ENABLE_FIREWD_LOCAL_NAT in fwknopd.conf");
-            free(tmp);
+            mem_free(MEM_TAG_STANZA, tmp);
             rv = FWKNOPD_ERROR_BAD_STANZA_DATA;
             goto cleanup;
         }
         if((rv = add_acc_force_nat(stanza, tmp)) != FWKNOPD_SUCCESS)
         {
-            free(tmp);
+            mem_free(MEM_TAG_STANZA, tmp);
             goto cleanup;
         }
 #elif FIREWALL_IPTABLES
@@ -2096,26 +2847,26 @@ make_acc_stanza_from_json(fko_srv_options_t *opts, json_object *jdata, acc_stanz
         {
             log_msg(LOG_ERR,
                 "[*] FORCE_NAT requires ENABLE_IPT_FORWARDING ENABLE_IPT_LOCAL_NAT in fwknopd.conf");
-            free(tmp);
+            mem_free(MEM_TAG_STANZA, tmp);
             rv = FWKNOPD_ERROR_BAD_STANZA_DATA;
             goto cleanup;
         }
         if((rv = add_acc_force_nat(stanza, tmp)) != FWKNOPD_SUCCESS)
         {
-            free(tmp);
+            mem_free(MEM_TAG_STANZA, tmp);
             goto cleanup;
         }
 #else
         log_msg(LOG_ERR,
             "[*] FORCE_NAT not supported.");
-        free(tmp);
+        mem_free(MEM_TAG_STANZA, tmp);
         rv = FWKNOPD_ERROR_BAD_STANZA_DATA;
         goto cleanup;
 #endif
-        free(tmp);
+        mem_free(MEM_TAG_STANZA, tmp);
     }
 
-    if(sdp_get_json_string_field("force_snat", jdata, &tmp) == SDP_SUCCESS)
+    if(acc_json_string_field("force_snat", jdata, &tmp) == SDP_SUCCESS)
     {
 #if FIREWALL_FIREWALLD
         if(strncasecmp(opts->config[CONF_ENABLE_FIREWD_FORWARDING], "Y", 1) !=0
@@ -2123,13 +2874,13 @@ make_acc_stanza_from_json(fko_srv_options_t *opts, json_object *jdata, acc_stanz
         {
             log_msg(LOG_ERR,
                 "[*] FORCE_SNAT requires either ENABLE_FIREWD_FORWARDING or ENABLE_FIREWD_LOCAL_NAT in fwknopd.conf");
-            free(tmp);
+            mem_free(MEM_TAG_STANZA, tmp);
             rv = FWKNOPD_ERROR_BAD_STANZA_DATA;
             goto cleanup;
         }
         if((rv = add_acc_force_snat(stanza, tmp)) != FWKNOPD_SUCCESS)
         {
-            free(tmp);
+            mem_free(MEM_TAG_STANZA, tmp);
             goto cleanup;
         }
 #elif FIREWALL_IPTABLES
@@ -2138,42 +2889,42 @@ make_acc_stanza_from_json(fko_srv_options_t *opts, json_object *jdata, acc_stanz
         {
             log_msg(LOG_ERR,
                 "[*] FORCE_SNAT requires ENABLE_IPT_FORWARDING ENABLE_IPT_LOCAL_NAT in fwknopd.conf");
-            free(tmp);
+            mem_free(MEM_TAG_STANZA, tmp);
             rv = FWKNOPD_ERROR_BAD_STANZA_DATA;
             goto cleanup;
         }
         if((rv = add_acc_force_snat(stanza, tmp)) != FWKNOPD_SUCCESS)
         {
-            free(tmp);
+            mem_free(MEM_TAG_STANZA, tmp);
             goto cleanup;
         }
 #else
         log_msg(LOG_ERR,
             "[*] FORCE_SNAT not supported.");
-        free(tmp);
+        mem_free(MEM_TAG_STANZA, tmp);
         rv = FWKNOPD_ERROR_BAD_STANZA_DATA;
         goto cleanup;
 #endif
-        free(tmp);
+        mem_free(MEM_TAG_STANZA, tmp);
     }
 
-    if(sdp_get_json_string_field("force_masquerade", jdata, &tmp) == SDP_SUCCESS)
+    if(acc_json_string_field("force_masquerade", jdata, &tmp) == SDP_SUCCESS)
     {
-        add_acc_bool(&(stanza->force_masquerade), tmp);
-        add_acc_bool(&(stanza->force_snat), tmp);
-        free(tmp);
+        add_acc_bool(&(stanza->cold->force_masquerade), tmp);
+        add_acc_bool(&(stanza->cold->force_snat), tmp);
+        mem_free(MEM_TAG_STANZA, tmp);
     }
 
-    if(sdp_get_json_string_field("disable_dnat", jdata, &tmp) == SDP_SUCCESS)
+    if(acc_json_string_field("disable_dnat", jdata, &tmp) == SDP_SUCCESS)
     {
-        add_acc_bool(&(stanza->disable_dnat), tmp);
-        free(tmp);
+        add_acc_bool(&(stanza->cold->disable_dnat), tmp);
+        mem_free(MEM_TAG_STANZA, tmp);
     }
 
-    if(sdp_get_json_string_field("forward_all", jdata, &tmp) == SDP_SUCCESS)
+    if(acc_json_string_field("forward_all", jdata, &tmp) == SDP_SUCCESS)
     {
-        add_acc_bool(&(stanza->forward_all), tmp);
-        free(tmp);
+        add_acc_bool(&(stanza->cold->forward_all), tmp);
+        mem_free(MEM_TAG_STANZA, tmp);
     }
 
     // do sanity check on data
@@ -2183,19 +2934,20 @@ make_acc_stanza_from_json(fko_srv_options_t *opts, json_object *jdata, acc_stanz
         rv = FWKNOPD_ERROR_BAD_STANZA_DATA;
     }
 
-    if(expand_one_acc_ent_list(stanza) != SUCCESS)
+    if(expand_one_acc_ent_list(stanza, acc_lazy_enabled()) != SUCCESS)
     {
         log_msg(LOG_ERR, "[*] Access list expansion failed on stanza for SDP ID %d", stanza->sdp_id);
         rv = FWKNOPD_ERROR_BAD_STANZA_DATA;
     }
 
-    set_one_acc_defaults(stanza);
+    if(rv == FWKNOPD_SUCCESS && !set_one_acc_defaults(opts, stanza, stanza_num))
+        rv = FWKNOPD_ERROR_BAD_STANZA_DATA;
 
 cleanup:
     if(rv != FWKNOPD_SUCCESS)
     {
         free_acc_stanza_data(stanza);
-        free(stanza);
+        mem_free(MEM_TAG_STANZA, stanza);
         *r_stanza = NULL;
     }
     else
@@ -2205,18 +2957,64 @@ cleanup:
     return rv;
 }
 
+/* Stanzas that a controller update took out of the access table.  They
+ * are freed only after the new table is published and a grace period has
+ * passed, since SPA threads may still be using them.
+*/
+typedef struct acc_retired
+{
+    acc_stanza_t  **stanzas;
+    int             count;
+    int             size;
+} acc_retired_t;
+
+static int
+acc_retire(acc_retired_t *retired, acc_stanza_t *acc)
+{
+    acc_stanza_t  **tmp;
+    int             size;
+
+    if(retired->count == retired->size)
+    {
+        size = retired->size ? retired->size * 2 : 16;
+        if((tmp = mem_realloc(MEM_TAG_STANZA, retired->stanzas,
+                        size * sizeof(acc_stanza_t *))) == NULL)
+        {
+            log_msg(LOG_ERR, "Fatal memory error retiring access stanza");
+            return FKO_ERROR_MEMORY_ALLOCATION;
+        }
+        retired->stanzas = tmp;
+        retired->size    = size;
+    }
+
+    retired->stanzas[retired->count++] = acc;
+    return FWKNOPD_SUCCESS;
+}
+
+static void
+acc_retired_free(acc_retired_t *retired)
+{
+    int     i;
+
+    for(i=0; i < retired->count; i++)
+        destroy_hash_node_cb(retired->stanzas[i]);
+
+    mem_free(MEM_TAG_STANZA, retired->stanzas);
+    return;
+}
+
 /* Take a json data array from a controller message
  * remove stanzas from the hash table
  */
 static void
-remove_access_stanzas(hash_table_t *acc_table, int access_array_len, json_object *jdata)
+remove_access_stanzas(const fko_srv_options_t *opts, acc_id_map_t *acc_table,
+        acc_retired_t *retired, int access_array_len, json_object *jdata)
 {
+    acc_stanza_t *old_acc = NULL;
     int rv = FKO_SUCCESS;
     int idx;
     int sdp_id = 0;
     json_object *jentry = NULL;
-    bstring key = NULL;
-    char id[SDP_MAX_CLIENT_ID_STR_LEN + 1] = {0};
 
     // walk through the access array
     for(idx = 0; idx < access_array_len; idx++)
@@ -2228,11 +3026,15 @@ remove_access_stanzas(hash_table_t *acc_table, int access_array_len, json_object
             continue;
         }
 
-        // convert the sdp id integer to a bstring
-        snprintf(id, SDP_MAX_CLIENT_ID_STR_LEN, "%d", sdp_id);
-        key = bfromcstr(id);
+        // never loaded here, see SDP_SHARD_COUNT and cluster.c
+        if(! cluster_sdp_id_local(opts, (uint32_t)sdp_id))
+            continue;
 
-        if( hash_table_delete(acc_table, key) != FKO_SUCCESS )
+        if((old_acc = acc_id_map_get(acc_table, (uint32_t)sdp_id)) != NULL
+                && acc_retire(retired, old_acc) != FWKNOPD_SUCCESS)
+            break;
+
+        if( acc_id_map_delete(acc_table, (uint32_t)sdp_id) != FKO_SUCCESS )
         {
             log_msg(LOG_WARNING, "Did not find hash table node with SDP ID %d to remove. Continuing.", sdp_id);
         }
@@ -2240,72 +3042,296 @@ remove_access_stanzas(hash_table_t *acc_table, int access_array_len, json_object
         {
             log_msg(LOG_NOTICE, "Removed access stanza for SDP ID %d from access list.", sdp_id);
         }
+    }
+}
+
+/* Digest of a stanza's JSON as sent by the controller.  The controller
+ * serializes a given stanza the same way each time, so an unchanged digest
+ * means the expanded stanza already in the table can be kept as is.
+*/
+static const char *
+acc_json_digest(json_object *jstanza, unsigned char *digest)
+{
+    const char *json_str = json_object_to_json_string(jstanza);
+
+    SHA256((const unsigned char *)json_str, strlen(json_str), digest);
+    return json_str;
+}
+
+typedef struct acc_json_build
+{
+    fko_srv_options_t  *opts;
+    acc_id_map_t       *prev_table;
+    json_object        *jdata;
+    int                 keep_json;
+    acc_stanza_t      **stanzas;    /* NULL where the stanza was rejected */
+    int                *results;
+    unsigned char      *reused;     /* stanza came from prev_table */
+} acc_json_build_t;
+
+/* Build (or find in the previous table) the stanza for one element of the
+ * access array.  Runs on the run_parallel() threads, so it only writes
+ * its own slot of the result arrays.
+ *
+ * Elements of arrays from controller messages and the snapshot are the
+ * stanza's JSON text (see sdp_message_process()).  Each is parsed here
+ * and its tree freed as soon as the stanza is built, so only one stanza
+ * per thread is ever held as a tree.
+*/
+static int
+build_json_stanza_cb(void *arg, const int idx)
+{
+    acc_json_build_t   *build = (acc_json_build_t *)arg;
+    acc_stanza_t       *new_acc = NULL;
+    acc_stanza_t       *prev_acc = NULL;
+    unsigned char       digest[ACC_JSON_DIGEST_LEN];
+    const char         *json_str = NULL;
+    json_object        *jelem = NULL;
+    json_object        *jstanza = NULL;
+    int                 sdp_id = 0;
+    int                 rv = FWKNOPD_SUCCESS;
+
+    jelem = json_object_array_get_idx(build->jdata, idx);
+
+    if(json_object_get_type(jelem) == json_type_string)
+    {
+        json_str = json_object_get_string(jelem);
+        SHA256((const unsigned char *)json_str, strlen(json_str), digest);
+
+        if((jstanza = sdp_message_parse_json(json_str, strlen(json_str))) == NULL)
+        {
+            log_msg(LOG_ERR, "Failed to parse access stanza %d", idx + 1);
+            build->results[idx] = FWKNOPD_ERROR_BAD_MSG;
+            return 1;
+        }
+    }
+    else
+    {
+        jstanza = json_object_get(jelem);
+        json_str = acc_json_digest(jstanza, digest);
+    }
 
-        bdestroy(key);
+    if(sdp_get_json_int_field("sdp_id", jstanza, &sdp_id) == SDP_SUCCESS)
+    {
+        // left to the instance or gateway that owns it, the slot stays empty with
+        // a success result
+        if(! cluster_sdp_id_local(build->opts, (uint32_t)sdp_id))
+        {
+            json_object_put(jstanza);
+            return 0;
+        }
+        prev_acc = acc_id_map_get(build->prev_table, (uint32_t)sdp_id);
     }
+
+    if(prev_acc != NULL
+            && memcmp(prev_acc->cold->json_digest, digest, ACC_JSON_DIGEST_LEN) == 0)
+    {
+        json_object_put(jstanza);
+        build->stanzas[idx] = prev_acc;
+        build->reused[idx]  = 1;
+        return 0;
+    }
+
+    rv = make_acc_stanza_from_json(build->opts, jstanza, idx + 1, &new_acc);
+
+    // json_str belongs to the array element, which outlives the tree
+    json_object_put(jstanza);
+
+    if(rv != FWKNOPD_SUCCESS)
+    {
+        build->results[idx] = rv;
+        return 1;
+    }
+
+    memcpy(new_acc->cold->json_digest, digest, ACC_JSON_DIGEST_LEN);
+
+    if(build->keep_json
+            && (new_acc->cold->json_str = mem_strdup(MEM_TAG_STANZA, json_str)) == NULL)
+    {
+        free_acc_stanza_data(new_acc);
+        mem_free(MEM_TAG_STANZA, new_acc);
+        build->results[idx] = FKO_ERROR_MEMORY_ALLOCATION;
+        return 1;
+    }
+
+    build->stanzas[idx] = new_acc;
+    return 0;
 }
 
 /* Take a json data array from a controller message
  * add/replace stanzas in the hash table
+ *
+ * Stanzas whose JSON matches the one of the same SDP ID in prev_table are
+ * reused instead of being parsed and expanded again.  For a refresh,
+ * acc_table starts out empty and stanzas from prev_table are retired by
+ * the caller once the table is complete.
+ *
+ * Each stanza is built on its own, so they are all built first, spread
+ * over several threads (see run_parallel()), and then put in the table
+ * in array order.
  */
 static int
-modify_access_table(fko_srv_options_t *opts, int access_array_len, json_object *jdata)
+modify_access_table(fko_srv_options_t *opts, acc_id_map_t *acc_table,
+        acc_id_map_t *prev_table, int refresh, acc_retired_t *retired,
+        int access_array_len, json_object *jdata)
 {
     int rv = FWKNOPD_SUCCESS;
+    acc_json_build_t build;
     acc_stanza_t *new_acc = NULL;
+    acc_stanza_t *old_acc = NULL;
     int idx = 0;
     int nodes = 0;
-    json_object *jstanza = NULL;
-    bstring key = NULL;
-    char id[SDP_MAX_CLIENT_ID_STR_LEN + 1] = {0};
+    int reused = 0;
+    int other_shard = 0;
+
+    memset(&build, 0x0, sizeof(build));
+
+    if(access_array_len <= 0)
+    {
+        log_msg(LOG_WARNING, "Failed to create any hash table nodes from %d json stanzas", access_array_len);
+        return rv;
+    }
+
+    build.opts       = opts;
+    build.prev_table = prev_table;
+    build.jdata      = jdata;
+    build.keep_json  = acc_snapshot_enabled(opts);
+    build.stanzas    = mem_calloc(MEM_TAG_STANZA, access_array_len, sizeof(acc_stanza_t *));
+    build.results    = mem_calloc(MEM_TAG_STANZA, access_array_len, sizeof(int));
+    build.reused     = mem_calloc(MEM_TAG_STANZA, access_array_len, sizeof(unsigned char));
+
+    if(build.stanzas == NULL || build.results == NULL || build.reused == NULL)
+    {
+        log_msg(LOG_ERR, "Memory allocation error while parsing json data, time to die");
+        rv = FKO_ERROR_MEMORY_ALLOCATION;
+        goto cleanup;
+    }
+
+    run_parallel(access_array_len, build_json_stanza_cb, &build);
 
     // walk through the access array
     for(idx = 0; idx < access_array_len; idx++)
     {
-        jstanza = json_object_array_get_idx(jdata, idx);
-        if((rv = make_acc_stanza_from_json(opts, jstanza, &new_acc)) != FWKNOPD_SUCCESS)
+        new_acc = build.stanzas[idx];
+
+        if(new_acc == NULL)
         {
-            if(rv == FKO_ERROR_MEMORY_ALLOCATION)
+            if(build.results[idx] == FWKNOPD_SUCCESS)
+            {
+                other_shard++;
+                continue;
+            }
+
+            if(build.results[idx] == FKO_ERROR_MEMORY_ALLOCATION)
             {
                 log_msg(LOG_ERR, "Memory allocation error while parsing json data, time to die");
-                return FKO_ERROR_MEMORY_ALLOCATION;
+                rv = FKO_ERROR_MEMORY_ALLOCATION;
+                goto cleanup;
             }
 
             log_msg(LOG_ERR, "Failed to parse json stanza, attempting to carry on");
+            rv = build.results[idx];
             continue;
         }
 
-        // convert the sdp id integer to a bstring
-        snprintf(id, SDP_MAX_CLIENT_ID_STR_LEN, "%d", new_acc->sdp_id);
-        key = bfromcstr(id);
+        // from here on the stanza belongs to the table
+        build.stanzas[idx] = NULL;
 
-        if( hash_table_set(opts->acc_stanza_hash_tbl, key, new_acc) != FKO_SUCCESS )
+        if(build.reused[idx])
+            reused++;
+
+        // a refresh starts the expiration schedule over, an update only
+        // adds the new stanzas to it
+        if(refresh || !build.reused[idx])
+            acc_expire_add(opts, new_acc);
+
+        old_acc = acc_id_map_get(acc_table, new_acc->sdp_id);
+
+        if(old_acc == new_acc)
+        {
+            nodes++;
+            continue;
+        }
+
+        if( acc_id_map_set(acc_table, new_acc->sdp_id, new_acc) != FKO_SUCCESS )
         {
             log_msg(LOG_ERR,
                 "Fatal error creating access stanza hash table node"
             );
-            bdestroy(key);
-            free_acc_stanza_data(new_acc);
-            free(new_acc);
-            return FKO_ERROR_MEMORY_ALLOCATION;
+            if(!build.reused[idx])
+            {
+                free_acc_stanza_data(new_acc);
+                mem_free(MEM_TAG_STANZA, new_acc);
+            }
+            rv = FKO_ERROR_MEMORY_ALLOCATION;
+            goto cleanup;
+        }
+
+        // on a refresh, stanzas from the previous table are retired by
+        // the caller whether or not they were replaced here
+        if(old_acc != NULL
+                && !(refresh && old_acc == acc_id_map_get(prev_table, old_acc->sdp_id))
+                && acc_retire(retired, old_acc) != FWKNOPD_SUCCESS)
+        {
+            rv = FKO_ERROR_MEMORY_ALLOCATION;
+            goto cleanup;
         }
 
-        log_msg(LOG_NOTICE, "Added access entry for SDP ID %d", new_acc->sdp_id);
+        if(!build.reused[idx])
+            log_msg(LOG_NOTICE, "Added access entry for SDP ID %d", new_acc->sdp_id);
         nodes++;
     }
 
+    if(other_shard > 0)
+        log_msg(LOG_INFO, "Skipped %d json stanzas for SDP IDs in other shards", other_shard);
+
     if(nodes > 0)
     {
-        log_msg(LOG_INFO, "Created %d hash table nodes from %d json stanzas", nodes, access_array_len);
+        log_msg(LOG_INFO, "Created %d hash table nodes from %d json stanzas, %d unchanged",
+                nodes, access_array_len, reused);
         rv = FWKNOPD_SUCCESS;
     }
-    else
+    else if(other_shard == 0)
         log_msg(LOG_WARNING, "Failed to create any hash table nodes from %d json stanzas", access_array_len);
 
+cleanup:
+    // free whatever was built but never made it into the table
+    for(idx = 0; build.stanzas != NULL && idx < access_array_len; idx++)
+    {
+        if(build.stanzas[idx] != NULL && !build.reused[idx])
+        {
+            free_acc_stanza_data(build.stanzas[idx]);
+            mem_free(MEM_TAG_STANZA, build.stanzas[idx]);
+        }
+    }
+    mem_free(MEM_TAG_STANZA, build.stanzas);
+    mem_free(MEM_TAG_STANZA, build.results);
+    mem_free(MEM_TAG_STANZA, build.reused);
+
     return rv;
 
 }
 
+typedef struct acc_refresh_sweep
+{
+    acc_id_map_t   *new_table;
+    acc_retired_t  *retired;
+} acc_refresh_sweep_t;
+
+/* Retire a stanza of the previous table that a refresh did not carry
+ * over into the new one.
+*/
+static int
+retire_unused_acc_cb(acc_stanza_t *acc, void *arg)
+{
+    acc_refresh_sweep_t *sweep = (acc_refresh_sweep_t *)arg;
+
+    if(acc_id_map_get(sweep->new_table, acc->sdp_id) == acc)
+        return 0;
+
+    return acc_retire(sweep->retired, acc);
+}
+
 /* Take a json data array from a controller message
  * Alter/recreate the hash table based on the action
  */
@@ -2316,6 +3342,12 @@ process_access_msg(fko_srv_options_t *opts, int action, json_object *jdata)
     int hash_table_len = 0;
     int access_array_len = 0;
     int is_err = 0;
+    acc_id_map_t *old_tbl = NULL;
+    acc_id_map_t *new_tbl = NULL;
+    acc_retired_t retired;
+    acc_refresh_sweep_t sweep;
+
+    memset(&retired, 0x0, sizeof(retired));
 
     if(jdata == NULL || json_object_get_type(jdata) == json_type_null)
     {
@@ -2334,45 +3366,28 @@ process_access_msg(fko_srv_options_t *opts, int action, json_object *jdata)
         log_msg(LOG_DEBUG, "jdata contains %d objects", access_array_len);
     }
 
-    // lock the hash table mutex
+    // the mutex only serializes writers, SPA threads never take it
     if(pthread_mutex_lock(&(opts->acc_hash_tbl_mutex)))
     {
         log_msg(LOG_ERR, "Mutex lock error.");
         return FWKNOPD_ERROR_MUTEX;
     }
 
-    if(action == CTRL_ACTION_ACCESS_REMOVE)
-    {
-        if(opts->acc_stanza_hash_tbl == NULL)
-        {
-            //table is not initialized, nothing to do
-            log_msg(LOG_WARNING, "Received access remove message, but access table not "
-                    "initialized. Nothing to do.");
-            pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
-            return FWKNOPD_ERROR_UNTIMELY_MSG;
-        }
-
-        remove_access_stanzas(opts->acc_stanza_hash_tbl, access_array_len, jdata);
-        pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
-
-        return FWKNOPD_SUCCESS;
-    }
+    old_tbl = opts->acc_stanza_hash_tbl;
 
-    // if this is an access data refresh, destroy the hash table
-    if(action == CTRL_ACTION_ACCESS_REFRESH)
+    if(action == CTRL_ACTION_ACCESS_REMOVE && old_tbl == NULL)
     {
-        if(opts->acc_stanza_hash_tbl != NULL)
-        {
-            // destroy the table
-            hash_table_destroy(opts->acc_stanza_hash_tbl);
-            opts->acc_stanza_hash_tbl = NULL;
-        }
+        //table is not initialized, nothing to do
+        log_msg(LOG_WARNING, "Received access remove message, but access table not "
+                "initialized. Nothing to do.");
+        pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
+        return FWKNOPD_ERROR_UNTIMELY_MSG;
     }
 
-    // create the hash table if necessary
-    if(opts->acc_stanza_hash_tbl == NULL)
+    // a refresh starts from an empty table, anything else from a copy
+    // that shares the unchanged stanzas
+    if(action == CTRL_ACTION_ACCESS_REFRESH || old_tbl == NULL)
     {
-        //need to initialize hash table
         hash_table_len = strtol_wrapper(opts->config[CONF_ACC_STANZA_HASH_TABLE_LENGTH],
                                MIN_ACC_STANZA_HASH_TABLE_LENGTH,
                                MAX_ACC_STANZA_HASH_TABLE_LENGTH,
@@ -2395,29 +3410,78 @@ process_access_msg(fko_srv_options_t *opts, int action, json_object *jdata)
             return FWKNOPD_ERROR_BAD_CONFIG;
         }
 
-        opts->acc_stanza_hash_tbl = hash_table_create(hash_table_len,
-                NULL, NULL, destroy_hash_node_cb);
-        if(opts->acc_stanza_hash_tbl == NULL)
+        new_tbl = acc_id_map_create(hash_table_len, NULL);
+    }
+    else
+    {
+        new_tbl = acc_id_map_copy(old_tbl);
+    }
+
+    if(new_tbl == NULL)
+    {
+        pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
+
+        log_msg(LOG_ERR,
+            "[*] Fatal memory allocation error creating access stanza hash table"
+        );
+        return FKO_ERROR_MEMORY_ALLOCATION;
+    }
+
+    if(action == CTRL_ACTION_ACCESS_REMOVE)
+    {
+        remove_access_stanzas(opts, new_tbl, &retired, access_array_len, jdata);
+    }
+    else
+    {
+        // control message is either REFRESH or UPDATE
+        // in either case, use data array to modify the table
+        if(action == CTRL_ACTION_ACCESS_REFRESH)
+            acc_expire_clear();
+
+        if((rv = modify_access_table(opts, new_tbl, old_tbl,
+                        action == CTRL_ACTION_ACCESS_REFRESH, &retired,
+                        access_array_len, jdata)) != FWKNOPD_SUCCESS)
         {
-            pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
+            log_msg(LOG_ERR, "modify_access_table was unsuccessful");
+        }
+    }
 
-            log_msg(LOG_ERR,
-                "[*] Fatal memory allocation error creating access stanza hash table"
-            );
-            return FKO_ERROR_MEMORY_ALLOCATION;
+    // a refresh keeps unchanged stanzas, everything else in the old
+    // table goes once it is no longer visible
+    if(action == CTRL_ACTION_ACCESS_REFRESH && old_tbl != NULL)
+    {
+        sweep.new_table = new_tbl;
+        sweep.retired   = &retired;
+        if(acc_id_map_traverse(old_tbl, retire_unused_acc_cb, &sweep) != 0)
+        {
+            log_msg(LOG_ERR, "[*] Fatal memory error retiring access stanzas");
+            rv = FKO_ERROR_MEMORY_ALLOCATION;
         }
     }
 
-    // control message is either REFRESH or UPDATE
-    // in either case, use data array to modify the table
-    if((rv = modify_access_table(opts, access_array_len, jdata)) != FWKNOPD_SUCCESS)
+    // publish the new table, then wait out any SPA thread still using
+    // the old one before freeing what it alone referenced
+    new_tbl->delete_cb = destroy_hash_node_cb;
+    rcu_assign_pointer(opts->acc_stanza_hash_tbl, new_tbl);
+    acc_sdp_miss_flush();
+    authz_cache_flush();
+
+    rcu_synchronize();
+
+    if(old_tbl != NULL)
     {
-        log_msg(LOG_ERR, "modify_access_table was unsuccessful");
+        old_tbl->delete_cb = NULL;
+        acc_id_map_destroy(old_tbl);
     }
+    acc_retired_free(&retired);
 
     // release lock on the table
     pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
 
+    // the capture loop rebuilds its filter if it depends on this data
+    if(rv == FWKNOPD_SUCCESS && pcap_filter_uses_access_data(opts))
+        opts->pcap_filter_refresh = 1;
+
     return rv;
 }
 
@@ -2561,7 +3625,7 @@ parse_access_file(fko_srv_options_t *opts)
                 continue;
             }
 
-            add_acc_string(&(curr_acc->source), val, file_ptr, opts);
+            add_acc_string(&(curr_acc->cold->source), val, file_ptr, opts);
             got_source++;
         }
         else if(CONF_VAR_IS(var, "SDP_ID"))
@@ -2606,25 +3670,25 @@ parse_access_file(fko_srv_options_t *opts)
             continue;
         }
         else if(CONF_VAR_IS(var, "DESTINATION"))
-            add_acc_string(&(curr_acc->destination), val, file_ptr, opts);
+            add_acc_string(&(curr_acc->cold->destination), val, file_ptr, opts);
         else if(CONF_VAR_IS(var, "SERVICE_LIST"))
-            add_acc_string(&(curr_acc->service_list_str), val, file_ptr, opts);
+            add_acc_string(&(curr_acc->cold->service_list_str), val, file_ptr, opts);
         else if(CONF_VAR_IS(var, "OPEN_PORTS"))
-            add_acc_string(&(curr_acc->open_ports), val, file_ptr, opts);
+            add_acc_string(&(curr_acc->cold->open_ports), val, file_ptr, opts);
         else if(CONF_VAR_IS(var, "RESTRICT_PORTS"))
-            add_acc_string(&(curr_acc->restrict_ports), val, file_ptr, opts);
+            add_acc_string(&(curr_acc->cold->restrict_ports), val, file_ptr, opts);
         else if(CONF_VAR_IS(var, "KEY"))
         {
             if(strcasecmp(val, "__CHANGEME__") == 0)
             {
                 log_msg(LOG_ERR,
                     "[*] KEY value is not properly set in stanza source '%s' in access file: '%s'",
-                    curr_acc->source, opts->config[CONF_ACCESS_FILE]);
+                    curr_acc->cold->source, opts->config[CONF_ACCESS_FILE]);
                 fclose(file_ptr);
                 clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
             }
-            add_acc_string(&(curr_acc->key), val, file_ptr, opts);
-            curr_acc->key_len = strlen(curr_acc->key);
+            add_acc_key(curr_acc->key, &(curr_acc->key_len), val, 0,
+                    "KEY", file_ptr, opts);
             add_acc_bool(&(curr_acc->use_rijndael), "Y");
         }
         else if(CONF_VAR_IS(var, "KEY_BASE64"))
@@ -2633,7 +3697,7 @@ parse_access_file(fko_srv_options_t *opts)
             {
                 log_msg(LOG_ERR,
                     "[*] KEY_BASE64 value is not properly set in stanza source '%s' in access file: '%s'",
-                    curr_acc->source, opts->config[CONF_ACCESS_FILE]);
+                    curr_acc->cold->source, opts->config[CONF_ACCESS_FILE]);
                 fclose(file_ptr);
                 clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
             }
@@ -2645,9 +3709,9 @@ parse_access_file(fko_srv_options_t *opts)
                 fclose(file_ptr);
                 clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
             }
-            add_acc_string(&(curr_acc->key_base64), val, file_ptr, opts);
-            add_acc_b64_string(&(curr_acc->key), &(curr_acc->key_len),
-                    curr_acc->key_base64, file_ptr, opts);
+            add_acc_string(&(curr_acc->cold->key_base64), val, file_ptr, opts);
+            add_acc_key(curr_acc->key, &(curr_acc->key_len), val, 1,
+                    "KEY_BASE64", file_ptr, opts);
             add_acc_bool(&(curr_acc->use_rijndael), "Y");
         }
         /* HMAC digest type */
@@ -2669,43 +3733,67 @@ parse_access_file(fko_srv_options_t *opts)
             {
                 log_msg(LOG_ERR,
                     "[*] HMAC_KEY_BASE64 value is not properly set in stanza source '%s' in access file: '%s'",
-                    curr_acc->source, opts->config[CONF_ACCESS_FILE]);
+                    curr_acc->cold->source, opts->config[CONF_ACCESS_FILE]);
                 fclose(file_ptr);
                 clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
             }
             if (! is_base64((unsigned char *) val, strlen(val)))
             {
                 log_msg(LOG_ERR,
-                    "[*] HMAC_KEY_BASE64 argument '%s' doesn't look like base64-encoded data.",
-                    val);
+                    "[*] HMAC_KEY_BASE64 argument '%s' doesn't look like base64-encoded data.",
+                    val);
+                fclose(file_ptr);
+                clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+            }
+            add_acc_string(&(curr_acc->cold->hmac_key_base64), val, file_ptr, opts);
+            add_acc_key(curr_acc->hmac_key, &(curr_acc->hmac_key_len), val, 1,
+                    "HMAC_KEY_BASE64", file_ptr, opts);
+        }
+        else if(CONF_VAR_IS(var, "HMAC_KEY"))
+        {
+            if(strcasecmp(val, "__CHANGEME__") == 0)
+            {
+                log_msg(LOG_ERR,
+                    "[*] HMAC_KEY value is not properly set in stanza source '%s' in access file: '%s'",
+                    curr_acc->cold->source, opts->config[CONF_ACCESS_FILE]);
+                fclose(file_ptr);
+                clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+            }
+            add_acc_key(curr_acc->hmac_key, &(curr_acc->hmac_key_len), val, 0,
+                    "HMAC_KEY", file_ptr, opts);
+        }
+        else if(CONF_VAR_IS(var, "FW_ACCESS_TIMEOUT"))
+        {
+            curr_acc->fw_access_timeout = strtol_wrapper(val, 0,
+                    RCHK_MAX_FW_TIMEOUT, NO_EXIT_UPON_ERR, &is_err);
+            if(is_err != FKO_SUCCESS)
+            {
+                log_msg(LOG_ERR,
+                    "[*] FW_ACCESS_TIMEOUT value not in range.");
                 fclose(file_ptr);
                 clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
             }
-            add_acc_string(&(curr_acc->hmac_key_base64), val, file_ptr, opts);
-            add_acc_b64_string(&(curr_acc->hmac_key), &(curr_acc->hmac_key_len),
-                    curr_acc->hmac_key_base64, file_ptr, opts);
         }
-        else if(CONF_VAR_IS(var, "HMAC_KEY"))
+        else if(CONF_VAR_IS(var, "GRANT_IDLE_TIMEOUT"))
         {
-            if(strcasecmp(val, "__CHANGEME__") == 0)
+            curr_acc->cold->grant_idle_timeout = strtol_wrapper(val, 0,
+                    RCHK_MAX_FW_TIMEOUT, NO_EXIT_UPON_ERR, &is_err);
+            if(is_err != FKO_SUCCESS)
             {
                 log_msg(LOG_ERR,
-                    "[*] HMAC_KEY value is not properly set in stanza source '%s' in access file: '%s'",
-                    curr_acc->source, opts->config[CONF_ACCESS_FILE]);
+                    "[*] GRANT_IDLE_TIMEOUT value not in range.");
                 fclose(file_ptr);
                 clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
             }
-            add_acc_string(&(curr_acc->hmac_key), val, file_ptr, opts);
-            curr_acc->hmac_key_len = strlen(curr_acc->hmac_key);
         }
-        else if(CONF_VAR_IS(var, "FW_ACCESS_TIMEOUT"))
+        else if(CONF_VAR_IS(var, "MAX_ACTIVE_GRANTS"))
         {
-            curr_acc->fw_access_timeout = strtol_wrapper(val, 0,
-                    RCHK_MAX_FW_TIMEOUT, NO_EXIT_UPON_ERR, &is_err);
+            curr_acc->cold->max_active_grants = strtol_wrapper(val, 0,
+                    RCHK_MAX_ACTIVE_GRANTS, NO_EXIT_UPON_ERR, &is_err);
             if(is_err != FKO_SUCCESS)
             {
                 log_msg(LOG_ERR,
-                    "[*] FW_ACCESS_TIMEOUT value not in range.");
+                    "[*] MAX_ACTIVE_GRANTS value not in range.");
                 fclose(file_ptr);
                 clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
             }
@@ -2714,9 +3802,14 @@ parse_access_file(fko_srv_options_t *opts)
         {
             if((curr_acc->encryption_mode = enc_mode_strtoint(val)) < 0)
             {
-                log_msg(LOG_ERR,
-                    "[*] Unrecognized ENCRYPTION_MODE '%s', use {CBC,CTR,legacy,Asymmetric}",
-                    val);
+                if(enc_mode_is_unsupported(val))
+                    log_msg(LOG_ERR,
+                        "[*] ENCRYPTION_MODE '%s' is not supported by this build of fwknopd",
+                        val);
+                else
+                    log_msg(LOG_ERR,
+                        "[*] Unrecognized ENCRYPTION_MODE '%s', use {CBC,CTR,GCM,GCM_BINARY,legacy,Asymmetric}",
+                        val);
                 fclose(file_ptr);
                 clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
             }
@@ -2727,34 +3820,34 @@ parse_access_file(fko_srv_options_t *opts)
         }
         else if(CONF_VAR_IS(var, "ENABLE_CMD_SUDO_EXEC"))
         {
-            add_acc_bool(&(curr_acc->enable_cmd_sudo_exec), val);
+            add_acc_bool(&(curr_acc->cold->enable_cmd_sudo_exec), val);
         }
         else if(CONF_VAR_IS(var, "CMD_SUDO_EXEC_USER"))
-            add_acc_user(&(curr_acc->cmd_sudo_exec_user),
-                        &(curr_acc->cmd_sudo_exec_uid), &sudo_user_pw,
+            add_acc_user(&(curr_acc->cold->cmd_sudo_exec_user),
+                        &(curr_acc->cold->cmd_sudo_exec_uid), &sudo_user_pw,
                         val, "CMD_SUDO_EXEC_USER", file_ptr, opts);
         else if(CONF_VAR_IS(var, "CMD_SUDO_EXEC_GROUP"))
-            add_acc_group(&(curr_acc->cmd_sudo_exec_group),
-                        &(curr_acc->cmd_sudo_exec_gid), val,
+            add_acc_group(&(curr_acc->cold->cmd_sudo_exec_group),
+                        &(curr_acc->cold->cmd_sudo_exec_gid), val,
                         "CMD_SUDO_EXEC_GROUP", file_ptr, opts);
         else if(CONF_VAR_IS(var, "CMD_EXEC_USER"))
-            add_acc_user(&(curr_acc->cmd_exec_user),
-                        &(curr_acc->cmd_exec_uid), &user_pw,
+            add_acc_user(&(curr_acc->cold->cmd_exec_user),
+                        &(curr_acc->cold->cmd_exec_uid), &user_pw,
                         val, "CMD_EXEC_USER", file_ptr, opts);
         else if(CONF_VAR_IS(var, "CMD_EXEC_GROUP"))
-            add_acc_group(&(curr_acc->cmd_exec_group),
-                        &(curr_acc->cmd_exec_gid), val,
+            add_acc_group(&(curr_acc->cold->cmd_exec_group),
+                        &(curr_acc->cold->cmd_exec_gid), val,
                         "CMD_EXEC_GROUP", file_ptr, opts);
         else if(CONF_VAR_IS(var, "CMD_CYCLE_OPEN"))
         {
-            add_acc_string(&(curr_acc->cmd_cycle_open), val, file_ptr, opts);
-            curr_acc->cmd_cycle_do_close = 1; /* default, will be validated */
+            add_acc_string(&(curr_acc->cold->cmd_cycle_open), val, file_ptr, opts);
+            curr_acc->cold->cmd_cycle_do_close = 1; /* default, will be validated */
         }
         else if(CONF_VAR_IS(var, "CMD_CYCLE_CLOSE"))
-            add_acc_string(&(curr_acc->cmd_cycle_close), val, file_ptr, opts);
+            add_acc_string(&(curr_acc->cold->cmd_cycle_close), val, file_ptr, opts);
         else if(CONF_VAR_IS(var, "CMD_CYCLE_TIMER"))
         {
-            curr_acc->cmd_cycle_timer = strtol_wrapper(val,
+            curr_acc->cold->cmd_cycle_timer = strtol_wrapper(val,
                     RCHK_MIN_CMD_CYCLE_TIMER, RCHK_MAX_CMD_CYCLE_TIMER,
                     NO_EXIT_UPON_ERR, &is_err);
             if(is_err != FKO_SUCCESS)
@@ -2767,7 +3860,7 @@ parse_access_file(fko_srv_options_t *opts)
             }
         }
         else if(CONF_VAR_IS(var, "REQUIRE_USERNAME"))
-            add_acc_string(&(curr_acc->require_username), val, file_ptr, opts);
+            add_acc_string(&(curr_acc->cold->require_username), val, file_ptr, opts);
         else if(CONF_VAR_IS(var, "REQUIRE_SOURCE_ADDRESS"))
             add_acc_bool(&(curr_acc->require_source_address), val);
         else if(CONF_VAR_IS(var, "REQUIRE_SOURCE"))  /* synonym for REQUIRE_SOURCE_ADDRESS */
@@ -2776,32 +3869,32 @@ parse_access_file(fko_srv_options_t *opts)
         {
             if (is_valid_dir(val))
             {
-                add_acc_string(&(curr_acc->gpg_home_dir), val, file_ptr, opts);
+                add_acc_string(&(curr_acc->cold->gpg_home_dir), val, file_ptr, opts);
             }
             else
             {
                 log_msg(LOG_ERR,
                     "[*] GPG_HOME_DIR directory '%s' stat()/existence problem in stanza source '%s' in access file: '%s'",
-                    val, curr_acc->source, opts->config[CONF_ACCESS_FILE]);
+                    val, curr_acc->cold->source, opts->config[CONF_ACCESS_FILE]);
                 fclose(file_ptr);
                 clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
             }
         }
         else if(CONF_VAR_IS(var, "GPG_EXE"))
-            add_acc_string(&(curr_acc->gpg_exe), val, file_ptr, opts);
+            add_acc_string(&(curr_acc->cold->gpg_exe), val, file_ptr, opts);
         else if(CONF_VAR_IS(var, "GPG_DECRYPT_ID"))
-            add_acc_string(&(curr_acc->gpg_decrypt_id), val, file_ptr, opts);
+            add_acc_string(&(curr_acc->cold->gpg_decrypt_id), val, file_ptr, opts);
         else if(CONF_VAR_IS(var, "GPG_DECRYPT_PW"))
         {
             if(strcasecmp(val, "__CHANGEME__") == 0)
             {
                 log_msg(LOG_ERR,
                     "[*] GPG_DECRYPT_PW value is not properly set in stanza source '%s' in access file: '%s'",
-                    curr_acc->source, opts->config[CONF_ACCESS_FILE]);
+                    curr_acc->cold->source, opts->config[CONF_ACCESS_FILE]);
                 fclose(file_ptr);
                 clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
             }
-            add_acc_string(&(curr_acc->gpg_decrypt_pw), val, file_ptr, opts);
+            add_acc_string(&(curr_acc->cold->gpg_decrypt_pw), val, file_ptr, opts);
             add_acc_bool(&(curr_acc->use_gpg), "Y");
         }
         else if(CONF_VAR_IS(var, "GPG_ALLOW_NO_PW"))
@@ -2810,25 +3903,25 @@ parse_access_file(fko_srv_options_t *opts)
             if(curr_acc->gpg_allow_no_pw == 1)
             {
                 add_acc_bool(&(curr_acc->use_gpg), "Y");
-                add_acc_string(&(curr_acc->gpg_decrypt_pw), "", file_ptr, opts);
+                add_acc_string(&(curr_acc->cold->gpg_decrypt_pw), "", file_ptr, opts);
             }
         }
         else if(CONF_VAR_IS(var, "GPG_REQUIRE_SIG"))
         {
-            add_acc_bool(&(curr_acc->gpg_require_sig), val);
+            add_acc_bool(&(curr_acc->cold->gpg_require_sig), val);
         }
         else if(CONF_VAR_IS(var, "GPG_DISABLE_SIG"))
         {
-            add_acc_bool(&(curr_acc->gpg_disable_sig), val);
+            add_acc_bool(&(curr_acc->cold->gpg_disable_sig), val);
         }
         else if(CONF_VAR_IS(var, "GPG_IGNORE_SIG_VERIFY_ERROR"))
         {
-            add_acc_bool(&(curr_acc->gpg_ignore_sig_error), val);
+            add_acc_bool(&(curr_acc->cold->gpg_ignore_sig_error), val);
         }
         else if(CONF_VAR_IS(var, "GPG_REMOTE_ID"))
-            add_acc_string(&(curr_acc->gpg_remote_id), val, file_ptr, opts);
+            add_acc_string(&(curr_acc->cold->gpg_remote_id), val, file_ptr, opts);
         else if(CONF_VAR_IS(var, "GPG_FINGERPRINT_ID"))
-            add_acc_string(&(curr_acc->gpg_remote_fpr), val, file_ptr, opts);
+            add_acc_string(&(curr_acc->cold->gpg_remote_fpr), val, file_ptr, opts);
         else if(CONF_VAR_IS(var, "ACCESS_EXPIRE"))
         {
             if (add_acc_expire_time(&(curr_acc->access_expire_time), val) != FWKNOPD_SUCCESS)
@@ -2921,16 +4014,16 @@ parse_access_file(fko_srv_options_t *opts)
         }
         else if(CONF_VAR_IS(var, "FORCE_MASQUERADE"))
         {
-            add_acc_bool(&(curr_acc->force_masquerade), val);
-            add_acc_bool(&(curr_acc->force_snat), val);
+            add_acc_bool(&(curr_acc->cold->force_masquerade), val);
+            add_acc_bool(&(curr_acc->cold->force_snat), val);
         }
         else if(CONF_VAR_IS(var, "DISABLE_DNAT"))
         {
-            add_acc_bool(&(curr_acc->disable_dnat), val);
+            add_acc_bool(&(curr_acc->cold->disable_dnat), val);
         }
         else if(CONF_VAR_IS(var, "FORWARD_ALL"))
         {
-            add_acc_bool(&(curr_acc->forward_all), val);
+            add_acc_bool(&(curr_acc->cold->forward_all), val);
         }
         else
         {
@@ -2965,13 +4058,21 @@ parse_access_file(fko_srv_options_t *opts)
         clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
     }
 
-    /* Expand our the expandable fields into their respective data buckets.
+    /* Expand our the expandable fields into their respective data buckets
+     * and make sure default values are set where needed.
+    */
+    expand_acc_stanzas(opts);
+
+    /* Index the legacy mode stanzas by SOURCE so incoming SPA packets
+     * only try the keys of stanzas that could match.
     */
-    expand_acc_ent_lists(opts);
+    if(opts->acc_stanzas != NULL)
+        build_acc_stanza_index(opts);
 
-    /* Make sure default values are set where needed.
+    /* Schedule the stanzas that have an ACCESS_EXPIRE time.
     */
-    set_acc_defaults(opts);
+    for(curr_acc = opts->acc_stanzas; curr_acc != NULL; curr_acc = curr_acc->next)
+        acc_expire_add(opts, curr_acc);
 
     return;
 }
@@ -2995,6 +4096,54 @@ compare_addr_list(acc_int_list_t *ip_list, const uint32_t ip)
     return(match);
 }
 
+/* Same as compare_addr_list(), but for a packet address of either family.
+ * Access lists only hold IPv4 networks, so an IPv6 address can only match
+ * an ANY entry (mask of zero) unless it is an IPv4-mapped address.
+*/
+int
+compare_spa_addr_list(acc_int_list_t *ip_list, const spa_addr_t *addr)
+{
+    static const unsigned char v4mapped[12] =
+        { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+    uint32_t    ip;
+
+    if(addr->family != AF_INET6)
+    {
+        memcpy(&ip, addr->addr, sizeof(ip));
+        return(compare_addr_list(ip_list, ntohl(ip)));
+    }
+
+    if(memcmp(addr->addr, v4mapped, sizeof(v4mapped)) == 0)
+    {
+        memcpy(&ip, addr->addr + 12, sizeof(ip));
+        return(compare_addr_list(ip_list, ntohl(ip)));
+    }
+
+    while(ip_list)
+    {
+        if(ip_list->mask == 0)
+            return(1);
+
+        ip_list = ip_list->next;
+    }
+
+    return(0);
+}
+
+/* Match a packet address against a stanza SOURCE or DESTINATION, using
+ * the compiled trie when there is one.
+*/
+int
+compare_acc_addr(acc_int_list_t *ip_list, const addr_trie_t *trie,
+        const spa_addr_t *addr)
+{
+    if(trie != NULL)
+        return(addr_trie_match_spa(trie, addr));
+
+    return(compare_spa_addr_list(ip_list, addr));
+}
+
+#ifdef HAVE_C_UNIT_TESTS
 /* Compare the contents of 2 port lists.  Return true on a match.
  * Match depends on the match_any flag.  if match_any is 1 then any
  * entry in the incoming data need only match one item to return true.
@@ -3028,6 +4177,7 @@ compare_port_list(acc_port_list_t *in, acc_port_list_t *ac, const int match_any)
 
     return(i_cnt == a_cnt);
 }
+#endif
 
 /* Take a service string (or mulitple comma-separated strings) and check
  * them against the list for the given access stanza.
@@ -3037,147 +4187,101 @@ compare_port_list(acc_port_list_t *in, acc_port_list_t *ac, const int match_any)
 int
 acc_check_service_access(acc_stanza_t *acc, char *service_str)
 {
-    int             res = 1, this_res = 0;
+    acc_stanza_exp_t   *exp;
+    const char         *ndx = service_str;
+    uint32_t            id = 0;
+    int                 res, cnt = 0;
+
+    if((exp = acc_stanza_expand(acc)) == NULL)
+        return(0);
 
-    acc_service_list_t *in_service_list  = NULL;
-    acc_service_list_t *this_requested_service = NULL;
-    acc_service_list_t *this_permitted_service = NULL;
+    while((res = next_service_id(&ndx, &id)) == 1)
+    {
+        if(! acc_service_set_test(exp->service_set, id))
+            return(0);
+        cnt++;
+    }
 
-    if((res = expand_acc_service_list(&in_service_list, service_str)) == 0 ||
-        in_service_list == NULL)
+    if(res < 0 || cnt == 0)
     {
         log_msg(LOG_ERR,
-            "[*] Unable to create acc_service_list from incoming data: %s",
+            "[*] Unable to read service list from incoming data: %s",
             service_str
         );
         return(0);
     }
 
-    this_requested_service = in_service_list;
+    return(1);
+}
 
-    while(this_requested_service != NULL)
-    {
-        this_res = 0;
-        this_permitted_service = acc->service_list;
 
-        while(this_permitted_service != NULL)
-        {
-            if(this_permitted_service->service_id == this_requested_service->service_id)
-            {
-                this_res = 1;
-                break;
-            }
-            this_permitted_service = this_permitted_service->next;
-        }
 
-        if(this_res != 1)
-        {
-            res = 0;
-            break;
-        }
+/* Check one requested proto/port against the stanza port maps.  Any
+ * match on RESTRICT_PORTS means not allowed, and when OPEN_PORTS is set
+ * every requested port must be in it.
+*/
+static int
+acc_check_one_port(const acc_stanza_exp_t *exp, char *port_str)
+{
+    int     proto, port;
 
-        this_requested_service = this_requested_service->next;
+    if(parse_proto_and_port(port_str, &proto, &port) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Invalid proto/port string");
+        return(-1);
     }
 
-    free_acc_service_list(in_service_list);
-    return(res);
-}
+    if(exp->rport_map != NULL && acc_port_map_test(exp->rport_map, proto, port))
+        return(0);
 
+    if(exp->oport_map != NULL && ! acc_port_map_test(exp->oport_map, proto, port))
+        return(0);
 
+    return(1);
+}
 
 /* Take a proto/port string (or mulitple comma-separated strings) and check
- * them against the list for the given access stanza.
+ * them against the port maps for the given access stanza.
  *
  * Return 1 if we are allowed
 */
 int
 acc_check_port_access(acc_stanza_t *acc, char *port_str)
 {
-    int             res = 1, ctr = 0;
-
-    char            buf[ACCESS_BUF_LEN] = {0};
-    char           *ndx, *start;
+    acc_stanza_exp_t   *exp;
+    char                buf[ACCESS_BUF_LEN] = {0};
+    char               *ndx, *start;
 
-    acc_port_list_t *o_pl   = acc->oport_list;
-    acc_port_list_t *r_pl   = acc->rport_list;
-
-    acc_port_list_t *in_pl  = NULL;
+    if((exp = acc_stanza_expand(acc)) == NULL)
+        return(0);
 
     start = port_str;
 
-    /* Create our own internal port_list from the incoming SPA data
-     * for comparison.
-    */
-    for(ndx = start; *ndx != '\0'; ndx++)
+    for(ndx = start; ; ndx++)
     {
-        if(*ndx == ',')
-        {
-            if((ctr >= ACCESS_BUF_LEN)
-                    || (((ndx-start)+1) >= ACCESS_BUF_LEN))
-            {
-                log_msg(LOG_ERR,
-                    "[*] Unable to create acc_port_list from incoming data: %s",
-                    port_str
-                );
-                free_acc_port_list(in_pl);
-                return(0);
-            }
-            strlcpy(buf, start, (ndx-start)+1);
-            if(add_port_list_ent(&in_pl, buf) == 0)
-            {
-                log_msg(LOG_ERR, "[*] Invalid proto/port string");
-                free_acc_port_list(in_pl);
-                return(0);
-            }
+        if(*ndx != ',' && *ndx != '\0')
+            continue;
 
-            start = ndx+1;
-            ctr = 0;
+        if(((ndx-start)+1) >= ACCESS_BUF_LEN)
+        {
+            log_msg(LOG_ERR,
+                "[*] Unable to create acc_port_list from incoming data: %s",
+                port_str
+            );
+            return(0);
         }
-        ctr++;
-    }
-    if((ctr >= ACCESS_BUF_LEN)
-            || (((ndx-start)+1) >= ACCESS_BUF_LEN))
-    {
-        log_msg(LOG_ERR,
-            "[*] Unable to create acc_port_list from incoming data: %s",
-            port_str
-        );
-        free_acc_port_list(in_pl);
-        return(0);
-    }
-    strlcpy(buf, start, (ndx-start)+1);
-    if(add_port_list_ent(&in_pl, buf) == 0)
-    {
-        log_msg(LOG_ERR, "[*] Invalid proto/port string");
-        free_acc_port_list(in_pl);
-        return 0;
-    }
+        strlcpy(buf, start, (ndx-start)+1);
 
-    if(in_pl == NULL)
-    {
-        log_msg(LOG_ERR,
-            "[*] Unable to create acc_port_list from incoming data: %s", port_str
-        );
-        return(0);
-    }
+        if(acc_check_one_port(exp, buf) != 1)
+            return(0);
 
-    /* Start with restricted ports (if any).  Any match (even if only one
-     * entry) means not allowed.
-    */
-    if((acc->rport_list != NULL) && (compare_port_list(in_pl, r_pl, 1)))
-    {
-        res = 0;
-        goto cleanup_and_bail;
-    }
+        if(*ndx == '\0')
+            break;
 
-    /* For open port list, all must match.
-    */
-    if((acc->oport_list != NULL) && (!compare_port_list(in_pl, o_pl, 0)))
-            res = 0;
+        start = ndx+1;
+    }
 
-cleanup_and_bail:
-    free_acc_port_list(in_pl);
-    return(res);
+    return(1);
 }
 
 /* Dump the configuration
@@ -3187,7 +4291,7 @@ dump_access_list(fko_srv_options_t *opts)
 {
     int             i = 0;
 
-    acc_stanza_t    *acc = opts->acc_stanzas;
+    acc_stanza_t    *acc = NULL;
 
     int opened = 0;
     FILE *dest = NULL;
@@ -3223,21 +4327,20 @@ dump_access_list(fko_srv_options_t *opts)
             return;
         }
 
-        // lock the hash table mutex
-        if(pthread_mutex_lock(&(opts->acc_hash_tbl_mutex)))
-        {
-            fprintf(dest, "Mutex lock error.");
-            return;
-        }
-
-        hash_table_traverse(opts->acc_stanza_hash_tbl, traverse_dump_hash_cb, dest);
-
-        pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
+        rcu_read_lock();
+        acc_id_map_traverse(rcu_dereference(opts->acc_stanza_hash_tbl),
+                dump_access_stanza, dest);
+        rcu_read_unlock();
     }
     else
     {
+        /* A reload may replace the stanzas while we walk them.
+        */
+        rcu_read_lock();
+        acc = rcu_dereference(opts->acc_stanzas);
         if(!acc)
         {
+            rcu_read_unlock();
             fprintf(dest, "\n    ** No Access Settings Defined **\n\n");
             return;
         }
@@ -3258,6 +4361,8 @@ dump_access_list(fko_srv_options_t *opts)
                 "               HMAC_KEY_LEN:  %d\n"
                 "           HMAC_DIGEST_TYPE:  %d\n"
                 "          FW_ACCESS_TIMEOUT:  %i\n"
+                "          MAX_ACTIVE_GRANTS:  %i\n"
+                "         GRANT_IDLE_TIMEOUT:  %i\n"
                 "            ENABLE_CMD_EXEC:  %s\n"
                 "       ENABLE_CMD_SUDO_EXEC:  %s\n"
                 "         CMD_SUDO_EXEC_USER:  %s\n"
@@ -3286,51 +4391,54 @@ dump_access_list(fko_srv_options_t *opts)
                 "              GPG_REMOTE_ID:  %s\n"
                 "         GPG_FINGERPRINT_ID:  %s\n",
                 ++i,
-                acc->source,
-                (acc->destination == NULL) ? "<not set>" : acc->destination,
-                (acc->open_ports == NULL) ? "<not set>" : acc->open_ports,
-                (acc->restrict_ports == NULL) ? "<not set>" : acc->restrict_ports,
-                (acc->key == NULL) ? "<not set>" : "<see the access.conf file>",
-                (acc->key_base64 == NULL) ? "<not set>" : "<see the access.conf file>",
+                acc->cold->source,
+                (acc->cold->destination == NULL) ? "<not set>" : acc->cold->destination,
+                (acc->cold->open_ports == NULL) ? "<not set>" : acc->cold->open_ports,
+                (acc->cold->restrict_ports == NULL) ? "<not set>" : acc->cold->restrict_ports,
+                (acc->key_len == 0) ? "<not set>" : "<see the access.conf file>",
+                (acc->cold->key_base64 == NULL) ? "<not set>" : "<see the access.conf file>",
                 acc->key_len ? acc->key_len : 0,
-                (acc->hmac_key == NULL) ? "<not set>" : "<see the access.conf file>",
-                (acc->hmac_key_base64 == NULL) ? "<not set>" : "<see the access.conf file>",
+                (acc->hmac_key_len == 0) ? "<not set>" : "<see the access.conf file>",
+                (acc->cold->hmac_key_base64 == NULL) ? "<not set>" : "<see the access.conf file>",
                 acc->hmac_key_len ? acc->hmac_key_len : 0,
                 acc->hmac_type,
                 acc->fw_access_timeout,
+                acc->cold->max_active_grants,
+                acc->cold->grant_idle_timeout,
                 acc->enable_cmd_exec ? "Yes" : "No",
-                acc->enable_cmd_sudo_exec ? "Yes" : "No",
-                (acc->cmd_sudo_exec_user == NULL) ? "<not set>" : acc->cmd_sudo_exec_user,
-                (acc->cmd_sudo_exec_group == NULL) ? "<not set>" : acc->cmd_sudo_exec_group,
-                (acc->cmd_exec_user == NULL) ? "<not set>" : acc->cmd_exec_user,
-                (acc->cmd_exec_group == NULL) ? "<not set>" : acc->cmd_exec_group,
-                (acc->cmd_cycle_open == NULL) ? "<not set>" : acc->cmd_cycle_open,
-                (acc->cmd_cycle_close == NULL) ? "<not set>" : acc->cmd_cycle_close,
-                acc->cmd_cycle_timer,
-                (acc->require_username == NULL) ? "<not set>" : acc->require_username,
+                acc->cold->enable_cmd_sudo_exec ? "Yes" : "No",
+                (acc->cold->cmd_sudo_exec_user == NULL) ? "<not set>" : acc->cold->cmd_sudo_exec_user,
+                (acc->cold->cmd_sudo_exec_group == NULL) ? "<not set>" : acc->cold->cmd_sudo_exec_group,
+                (acc->cold->cmd_exec_user == NULL) ? "<not set>" : acc->cold->cmd_exec_user,
+                (acc->cold->cmd_exec_group == NULL) ? "<not set>" : acc->cold->cmd_exec_group,
+                (acc->cold->cmd_cycle_open == NULL) ? "<not set>" : acc->cold->cmd_cycle_open,
+                (acc->cold->cmd_cycle_close == NULL) ? "<not set>" : acc->cold->cmd_cycle_close,
+                acc->cold->cmd_cycle_timer,
+                (acc->cold->require_username == NULL) ? "<not set>" : acc->cold->require_username,
                 acc->require_source_address ? "Yes" : "No",
-                acc->force_nat ? acc->force_nat_ip : "<not set>",
-                acc->force_nat && acc->force_nat_proto != NULL ? acc->force_nat_proto : "<not set>",
-                acc->force_nat ? acc->force_nat_port : 0,
-                acc->force_snat ? acc->force_snat_ip : "<not set>",
-                acc->force_masquerade ? "Yes" : "No",
-                acc->disable_dnat ? "Yes" : "No",
-                acc->forward_all ? "Yes" : "No",
+                acc->cold->force_nat ? acc->cold->force_nat_ip : "<not set>",
+                acc->cold->force_nat && acc->cold->force_nat_proto != NULL ? acc->cold->force_nat_proto : "<not set>",
+                acc->cold->force_nat ? acc->cold->force_nat_port : 0,
+                acc->cold->force_snat ? acc->cold->force_snat_ip : "<not set>",
+                acc->cold->force_masquerade ? "Yes" : "No",
+                acc->cold->disable_dnat ? "Yes" : "No",
+                acc->cold->forward_all ? "Yes" : "No",
                 (acc->access_expire_time > 0) ? asctime(localtime(&acc->access_expire_time)) : "<not set>\n",
-                (acc->gpg_home_dir == NULL) ? "<not set>" : acc->gpg_home_dir,
-                (acc->gpg_exe == NULL) ? "<not set>" : acc->gpg_exe,
-                (acc->gpg_decrypt_id == NULL) ? "<not set>" : acc->gpg_decrypt_id,
-                (acc->gpg_decrypt_pw == NULL) ? "<not set>" : "<see the access.conf file>",
-                acc->gpg_require_sig ? "Yes" : "No",
-                acc->gpg_ignore_sig_error  ? "Yes" : "No",
-                (acc->gpg_remote_id == NULL) ? "<not set>" : acc->gpg_remote_id,
-                (acc->gpg_remote_fpr == NULL) ? "<not set>" : acc->gpg_remote_fpr
+                (acc->cold->gpg_home_dir == NULL) ? "<not set>" : acc->cold->gpg_home_dir,
+                (acc->cold->gpg_exe == NULL) ? "<not set>" : acc->cold->gpg_exe,
+                (acc->cold->gpg_decrypt_id == NULL) ? "<not set>" : acc->cold->gpg_decrypt_id,
+                (acc->cold->gpg_decrypt_pw == NULL) ? "<not set>" : "<see the access.conf file>",
+                acc->cold->gpg_require_sig ? "Yes" : "No",
+                acc->cold->gpg_ignore_sig_error  ? "Yes" : "No",
+                (acc->cold->gpg_remote_id == NULL) ? "<not set>" : acc->cold->gpg_remote_id,
+                (acc->cold->gpg_remote_fpr == NULL) ? "<not set>" : acc->cold->gpg_remote_fpr
             );
 
             fprintf(dest, "\n");
 
             acc = acc->next;
         }
+        rcu_read_unlock();
     }
 
     fprintf(dest, "\n");
@@ -3365,10 +4473,626 @@ DECLARE_UTEST(compare_port_list, "check compare_port_list function")
     CU_ASSERT(compare_port_list(acc_pl, in2_pl, 0) == 1);    /* All ports must match in2 port list - 2 */
 }
 
+DECLARE_UTEST(acc_stanza_candidates, "check the access stanza SOURCE index")
+{
+    fko_srv_options_t   opts;
+    acc_stanza_t        acc1, acc2, acc3;
+    acc_stanza_exp_t    exp1, exp2, exp3;
+    acc_stanza_t       *cands[3];
+    spa_addr_t          addr;
+    char                src1[] = "10.0.0.0/8, 192.168.1.1";
+    char                src2[] = "ANY";
+    char                src3[] = "10.1.0.0/16";
+
+    memset(&opts, 0x0, sizeof(opts));
+    memset(&acc1, 0x0, sizeof(acc1));
+    memset(&acc2, 0x0, sizeof(acc2));
+    memset(&acc3, 0x0, sizeof(acc3));
+    memset(&exp1, 0x0, sizeof(exp1));
+    memset(&exp2, 0x0, sizeof(exp2));
+    memset(&exp3, 0x0, sizeof(exp3));
+
+    expand_acc_int_list(&(exp1.source_list), src1);
+    expand_acc_int_list(&(exp2.source_list), src2);
+    expand_acc_int_list(&(exp3.source_list), src3);
+    acc1.exp = &exp1;
+    acc2.exp = &exp2;
+    acc3.exp = &exp3;
+    acc1.next = &acc2;
+    acc2.next = &acc3;
+    opts.acc_stanzas = &acc1;
+
+    build_acc_stanza_index(&opts);
+    CU_ASSERT(opts.acc_index->num_stanzas == 3);
+
+    spa_addr_pton("10.1.2.3", &addr);
+    CU_ASSERT(acc_stanza_candidates(opts.acc_index, &addr, cands) == 3);
+    CU_ASSERT(cands[0] == &acc1 && cands[1] == &acc2 && cands[2] == &acc3);
+
+    spa_addr_pton("192.168.1.1", &addr);
+    CU_ASSERT(acc_stanza_candidates(opts.acc_index, &addr, cands) == 2);
+    CU_ASSERT(cands[0] == &acc1 && cands[1] == &acc2 && cands[2] == NULL);
+
+    spa_addr_pton("192.168.1.2", &addr);
+    CU_ASSERT(acc_stanza_candidates(opts.acc_index, &addr, cands) == 1);
+    CU_ASSERT(cands[0] == NULL && cands[1] == &acc2 && cands[2] == NULL);
+
+    spa_addr_pton("2001:db8::1", &addr);
+    CU_ASSERT(acc_stanza_candidates(opts.acc_index, &addr, cands) == 1);
+    CU_ASSERT(cands[1] == &acc2);
+
+    free_acc_stanza_index(&opts);
+    free_acc_int_list(exp1.source_list);
+    free_acc_int_list(exp2.source_list);
+    free_acc_int_list(exp3.source_list);
+}
+
+static uint32_t ut_acc_rand_state = 1;
+
+static uint32_t
+ut_acc_rand(void)
+{
+    ut_acc_rand_state = ut_acc_rand_state * 1103515245U + 12345U;
+    return (ut_acc_rand_state >> 16) | (ut_acc_rand_state << 16);
+}
+
+/* Match ip (host byte order) against the compiled trie and, as plain
+ * IPv4 and as IPv4-mapped IPv6, check that a scan of the list gives the
+ * same answer.  Returns the match, or -1 if the two disagree.
+*/
+static int
+ut_acc_addr_match(acc_int_list_t *list, const addr_trie_t *trie, const uint32_t ip)
+{
+    spa_addr_t  addr;
+    uint32_t    nip = htonl(ip);
+    int         match;
+
+    spa_addr_set_ipv4(&addr, nip);
+    match = compare_spa_addr_list(list, &addr);
+    if(compare_acc_addr(list, trie, &addr) != match)
+        return -1;
+
+    memset(&addr, 0x0, sizeof(addr));
+    addr.family = AF_INET6;
+    addr.addr[10] = addr.addr[11] = 0xff;
+    memcpy(addr.addr + 12, &nip, sizeof(nip));
+    if(compare_acc_addr(list, trie, &addr) != match
+            || compare_spa_addr_list(list, &addr) != match)
+        return -1;
+
+    return match;
+}
+
+static int
+ut_acc_addr_str_match(acc_int_list_t *list, const addr_trie_t *trie, const char *str)
+{
+    spa_addr_t  addr;
+    int         match;
+
+    if(spa_addr_pton(str, &addr) != 1)
+        return -1;
+
+    match = compare_spa_addr_list(list, &addr);
+    if(compare_acc_addr(list, trie, &addr) != match)
+        return -1;
+
+    return match;
+}
+
+/* Unlink the n'th entry of list and free it.
+*/
+static void
+ut_acc_int_list_del(acc_int_list_t **list, int n)
+{
+    acc_int_list_t *ent;
+
+    while(n-- > 0)
+        list = &((*list)->next);
+
+    ent = *list;
+    *list = ent->next;
+    ent->next = NULL;
+    free_acc_int_list(ent);
+}
+
+DECLARE_UTEST(acc_addr_trie, "check the SOURCE/DESTINATION address trie")
+{
+    acc_int_list_t *list = NULL;
+    addr_trie_t    *trie = NULL;
+    acc_int_list_t *ent;
+    unsigned char   key[ADDR_TRIE_KEY_LEN];
+    spa_addr_t      addr;
+    char            buf[MAX_IPV4_STR_LEN + 4];
+    char            src1[] = "10.0.0.0/8, 10.1.0.0/16, 192.168.1.128/25, 192.168.1.0/24,"
+                             " 172.16.0.0/255.240.0.0, 128.0.0.0/1, 1.2.3.4";
+    char            src2[] = "255.255.255.255, 0.0.0.0";
+    char            src3[] = "192.168.1.0/24, 0.0.0.0/0.0.0.0";
+    char            src4[] = "10.0.0.0/255.0.255.0, 192.168.1.0/24";
+    char            src5[] = "10.0.0.0/8, 10.1.2.0/24, 192.168.0.0/16";
+    uint32_t        ip, size;
+    int             i, j, n, len;
+
+    /* Overlapping prefixes added in either order, a dotted-quad mask and
+     * the edges of each network.
+    */
+    CU_ASSERT_FATAL(expand_acc_int_list(&list, src1) == 1);
+    CU_ASSERT_FATAL(compile_acc_addr_trie(&trie, list) == 1);
+    CU_ASSERT_FATAL(trie != NULL);
+
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0x0a000000) == 1);  /* 10.0.0.0 */
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0x0affffff) == 1);  /* 10.255.255.255 */
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0x09ffffff) == 0);  /* 9.255.255.255 */
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0x0b000000) == 0);  /* 11.0.0.0 */
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0xc0a80100) == 1);  /* 192.168.1.0 */
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0xc0a801ff) == 1);  /* 192.168.1.255 */
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0xac100000) == 1);  /* 172.16.0.0 */
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0xac1fffff) == 1);  /* 172.31.255.255 */
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0xffffffff) == 1);  /* 128.0.0.0/1 */
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0x7fffffff) == 0);
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0x01020304) == 1);  /* 1.2.3.4 */
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0x01020305) == 0);
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0x00000000) == 0);
+
+    // only ANY lets a native IPv6 (or v4-compatible) address through
+    CU_ASSERT(ut_acc_addr_str_match(list, trie, "2001:db8::1") == 0);
+    CU_ASSERT(ut_acc_addr_str_match(list, trie, "::10.1.2.3") == 0);
+    CU_ASSERT(ut_acc_addr_str_match(list, trie, "::ffff:10.1.2.3") == 1);
+    CU_ASSERT(ut_acc_addr_str_match(list, trie, "::ffff:11.1.2.3") == 0);
+
+    addr_trie_free(trie);
+    free_acc_int_list(list);
+    list = NULL;
+
+    /* /32 at both ends of the address space.
+    */
+    CU_ASSERT_FATAL(expand_acc_int_list(&list, src2) == 1);
+    CU_ASSERT_FATAL(compile_acc_addr_trie(&trie, list) == 1 && trie != NULL);
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0xffffffff) == 1);
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0xfffffffe) == 0);
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0x00000000) == 1);
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0x00000001) == 0);
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0x80000000) == 0);
+    CU_ASSERT(ut_acc_addr_str_match(list, trie, "::") == 0);
+    addr_trie_free(trie);
+    free_acc_int_list(list);
+    list = NULL;
+
+    /* /0 covers everything, IPv6 included, and whatever came before it.
+    */
+    CU_ASSERT_FATAL(expand_acc_int_list(&list, src3) == 1);
+    CU_ASSERT_FATAL(compile_acc_addr_trie(&trie, list) == 1 && trie != NULL);
+    CU_ASSERT(trie->root != NULL && trie->root->len == 0 && trie->root->terminal);
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0x00000000) == 1);
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0xffffffff) == 1);
+    CU_ASSERT(ut_acc_addr_str_match(list, trie, "2001:db8::1") == 1);
+    addr_trie_free(trie);
+    free_acc_int_list(list);
+    list = NULL;
+
+    /* A non-contiguous mask cannot go in a trie, so the list is scanned.
+    */
+    CU_ASSERT_FATAL(expand_acc_int_list(&list, src4) == 1);
+    CU_ASSERT(compile_acc_addr_trie(&trie, list) == 1);
+    CU_ASSERT(trie == NULL);
+    CU_ASSERT(ut_acc_addr_match(list, NULL, 0x0a070009) == 1);  /* 10.7.0.9 */
+    CU_ASSERT(ut_acc_addr_match(list, NULL, 0x0a070109) == 0);  /* 10.7.1.9 */
+    CU_ASSERT(ut_acc_addr_match(list, NULL, 0xc0a80163) == 1);  /* 192.168.1.99 */
+    CU_ASSERT(ut_acc_addr_str_match(list, NULL, "::ffff:10.9.0.1") == 1);
+    CU_ASSERT(ut_acc_addr_str_match(list, NULL, "2001:db8::1") == 0);
+    free_acc_int_list(list);
+    list = NULL;
+
+    /* Dropping an entry and compiling again (as a reload does) loses only
+     * what nothing else covers.
+    */
+    CU_ASSERT_FATAL(expand_acc_int_list(&list, src5) == 1);
+    CU_ASSERT_FATAL(compile_acc_addr_trie(&trie, list) == 1 && trie != NULL);
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0xc0a80505) == 1);  /* 192.168.5.5 */
+    addr_trie_free(trie);
+
+    ut_acc_int_list_del(&list, 2);
+    CU_ASSERT_FATAL(compile_acc_addr_trie(&trie, list) == 1 && trie != NULL);
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0xc0a80505) == 0);
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0x0a010303) == 1);  /* 10.1.3.3 */
+    addr_trie_free(trie);
+
+    ut_acc_int_list_del(&list, 0);
+    CU_ASSERT_FATAL(compile_acc_addr_trie(&trie, list) == 1 && trie != NULL);
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0x0a010303) == 0);
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0x0a0102ff) == 1);  /* 10.1.2.255 */
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0x0a010300) == 0);
+    addr_trie_free(trie);
+
+    ut_acc_int_list_del(&list, 0);
+    CU_ASSERT(list == NULL);
+    CU_ASSERT_FATAL(compile_acc_addr_trie(&trie, list) == 1 && trie != NULL);
+    CU_ASSERT(ut_acc_addr_match(list, trie, 0x0a010203) == 0);
+    addr_trie_free(trie);
+
+    /* Random lists against a scan, probing inside, at and just past the
+     * edges of every network.
+    */
+    for(i = 0; i < 300; i++)
+    {
+        n = 1 + ut_acc_rand() % 12;
+        for(j = 0; j < n; j++)
+        {
+            ip  = ut_acc_rand();
+            len = 1 + ut_acc_rand() % 32;
+            snprintf(buf, sizeof(buf), "%u.%u.%u.%u/%d", ip >> 24,
+                    (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff, len);
+            CU_ASSERT(add_int_ent(&list, buf) == 1);
+        }
+        CU_ASSERT_FATAL(compile_acc_addr_trie(&trie, list) == 1 && trie != NULL);
+
+        for(ent = list; ent != NULL; ent = ent->next)
+        {
+            size = ~ent->mask;
+            CU_ASSERT(ut_acc_addr_match(list, trie, ent->maddr) == 1);
+            CU_ASSERT(ut_acc_addr_match(list, trie, ent->maddr + size) == 1);
+            CU_ASSERT(ut_acc_addr_match(list, trie, ent->maddr + (ut_acc_rand() & size)) == 1);
+            CU_ASSERT(ut_acc_addr_match(list, trie, ent->maddr - 1) != -1);
+            CU_ASSERT(ut_acc_addr_match(list, trie, ent->maddr + size + 1) != -1);
+        }
+        for(j = 0; j < 50; j++)
+            CU_ASSERT(ut_acc_addr_match(list, trie, ut_acc_rand()) != -1);
+
+        addr_trie_free(trie);
+        free_acc_int_list(list);
+        list = NULL;
+    }
+
+    /* IPv6 keys directly: a /128 at the last bit, and a shorter prefix
+     * added afterwards swallowing longer ones.
+    */
+    CU_ASSERT_FATAL((trie = addr_trie_new()) != NULL);
+    spa_addr_pton("2001:db8:1::1", &addr);
+    CU_ASSERT(addr_trie_add(trie, addr.addr, 128) == 0);
+    spa_addr_pton("2001:db8:1::", &addr);
+    CU_ASSERT(addr_trie_add(trie, addr.addr, 127) == 0);
+    spa_addr_pton("fe80::", &addr);
+    CU_ASSERT(addr_trie_add(trie, addr.addr, 10) == 0);
+    CU_ASSERT(addr_trie_add(trie, addr.addr, 129) == -1);
+
+    spa_addr_pton("2001:db8:1::1", &addr);
+    CU_ASSERT(addr_trie_match_spa(trie, &addr) == 1);
+    spa_addr_pton("2001:db8:1::2", &addr);
+    CU_ASSERT(addr_trie_match_spa(trie, &addr) == 0);
+    spa_addr_pton("febf:ffff::1", &addr);
+    CU_ASSERT(addr_trie_match_spa(trie, &addr) == 1);
+    spa_addr_pton("fec0::1", &addr);
+    CU_ASSERT(addr_trie_match_spa(trie, &addr) == 0);
+
+    spa_addr_pton("2001:db8::", &addr);
+    CU_ASSERT(addr_trie_add(trie, addr.addr, 32) == 0);
+    spa_addr_pton("2001:db8:ffff::2", &addr);
+    CU_ASSERT(addr_trie_match_spa(trie, &addr) == 1);
+    spa_addr_pton("2001:db9::", &addr);
+    CU_ASSERT(addr_trie_match_spa(trie, &addr) == 0);
+
+    // and none of them reach IPv4
+    CU_ASSERT(addr_trie_add_v4(trie, 0x0a000000, 8) == 0);
+    spa_addr_pton("10.0.0.1", &addr);
+    CU_ASSERT(addr_trie_match_spa(trie, &addr) == 1);
+    spa_addr_pton("11.0.0.1", &addr);
+    CU_ASSERT(addr_trie_match_spa(trie, &addr) == 0);
+
+    memset(key, 0xff, sizeof(key));
+    CU_ASSERT(addr_trie_match(trie, key) == 0);
+    CU_ASSERT(addr_trie_add(trie, key, 128) == 0);
+    CU_ASSERT(addr_trie_match(trie, key) == 1);
+    key[15] = 0xfe;
+    CU_ASSERT(addr_trie_match(trie, key) == 0);
+
+    addr_trie_free(trie);
+}
+
+/* Check the compiled port map against a scan of the list it was built
+ * from for one proto/port.  Returns the match, or -1 if they disagree.
+*/
+static int
+ut_acc_port_match(acc_port_list_t *list, const acc_port_map_t *pmap,
+        const int proto, const int port)
+{
+    acc_port_list_t probe;
+    int             match;
+
+    memset(&probe, 0x0, sizeof(probe));
+    probe.proto = proto;
+    probe.port  = port;
+
+    match = compare_port_list(&probe, list, 1);
+    if((acc_port_map_test(pmap, proto, port) != 0) != match)
+        return -1;
+
+    return match;
+}
+
+static int
+ut_acc_port_map_blocks(const acc_port_map_t *pmap)
+{
+    int     i, j, n = 0;
+
+    for(i=0; i < ACC_PORT_MAP_PROTOS; i++)
+        for(j=0; j < ACC_PORT_MAP_BLOCKS; j++)
+            n += pmap->blocks[i][j] != NULL;
+
+    return n;
+}
+
+DECLARE_UTEST(acc_port_map, "check the OPEN_PORTS/RESTRICT_PORTS bitmaps")
+{
+    acc_port_list_t    *list = NULL, *ent;
+    acc_port_map_t     *pmap;
+    acc_stanza_t        acc;
+    acc_stanza_exp_t    exp;
+    char                buf[ACCESS_BUF_LEN];
+    char                ports1[] = "tcp/0, tcp/65535, udp/255, udp/256, tcp/22";
+    char                oports[] = "tcp/22, udp/53, tcp/65535";
+    char                rports[] = "tcp/22, udp/0";
+    char                req1[] = "tcp/22", req2[] = "udp/53", req3[] = "tcp/80";
+    char                req4[] = "tcp/65535", req5[] = "udp/0", req6[] = "tcp/0";
+    char                req7[] = "udp/53,tcp/65535", req8[] = "udp/53,tcp/80";
+    char                req9[] = "tcp/65536", req10[] = "icmp/1";
+    int                 i, j, n, proto, port;
+
+    /* Ports at both ends of the range and on either side of a block
+     * boundary, kept apart by protocol.
+    */
+    CU_ASSERT_FATAL(expand_acc_port_list(&list, ports1) == 1);
+    pmap = compile_acc_port_map(list);
+    CU_ASSERT_FATAL(pmap != NULL);
+    CU_ASSERT(ut_acc_port_map_blocks(pmap) == 4);
+
+    CU_ASSERT(ut_acc_port_match(list, pmap, PROTO_TCP, 0) == 1);
+    CU_ASSERT(ut_acc_port_match(list, pmap, PROTO_TCP, 1) == 0);
+    CU_ASSERT(ut_acc_port_match(list, pmap, PROTO_TCP, 65535) == 1);
+    CU_ASSERT(ut_acc_port_match(list, pmap, PROTO_TCP, 65534) == 0);
+    CU_ASSERT(ut_acc_port_match(list, pmap, PROTO_UDP, 0) == 0);
+    CU_ASSERT(ut_acc_port_match(list, pmap, PROTO_UDP, 65535) == 0);
+    CU_ASSERT(ut_acc_port_match(list, pmap, PROTO_UDP, 254) == 0);
+    CU_ASSERT(ut_acc_port_match(list, pmap, PROTO_UDP, 255) == 1);
+    CU_ASSERT(ut_acc_port_match(list, pmap, PROTO_UDP, 256) == 1);
+    CU_ASSERT(ut_acc_port_match(list, pmap, PROTO_UDP, 257) == 0);
+    CU_ASSERT(ut_acc_port_match(list, pmap, PROTO_TCP, 22) == 1);
+    CU_ASSERT(ut_acc_port_match(list, pmap, PROTO_UDP, 22) == 0);
+    CU_ASSERT(ut_acc_port_match(list, pmap, PROTO_TCP, 255) == 0);
+    CU_ASSERT(ut_acc_port_match(list, pmap, PROTO_TCP, 256) == 0);
+
+    /* Dropping entries and compiling again (as a reload does) loses only
+     * those ports, and a block left empty is not allocated.
+    */
+    for(n = 0; list != NULL; n++)
+    {
+        ent = list;
+        list = list->next;
+        ent->next = NULL;
+
+        free_acc_port_map(pmap);
+        pmap = compile_acc_port_map(list);
+
+        CU_ASSERT(ut_acc_port_match(list, pmap, ent->proto, ent->port) == 0);
+        free_acc_port_list(ent);
+
+        for(port = 0; port <= MAX_PORT; port++)
+        {
+            CU_ASSERT(ut_acc_port_match(list, pmap, PROTO_TCP, port) != -1);
+            CU_ASSERT(ut_acc_port_match(list, pmap, PROTO_UDP, port) != -1);
+        }
+    }
+    CU_ASSERT(n == 5);
+    CU_ASSERT(ut_acc_port_map_blocks(pmap) == 0);
+    free_acc_port_map(pmap);
+
+    /* Random lists against a scan, every port of both protocols.
+    */
+    for(i = 0; i < 20; i++)
+    {
+        n = 1 + ut_acc_rand() % 24;
+        for(j = 0; j < n; j++)
+        {
+            proto = ut_acc_rand() & 1;
+            port  = ut_acc_rand() % 8 == 0 ? (ut_acc_rand() & 1) * MAX_PORT
+                                           : (int)(ut_acc_rand() % (MAX_PORT + 1));
+            snprintf(buf, sizeof(buf), "%s/%d", proto ? "udp" : "tcp", port);
+            CU_ASSERT(add_port_list_ent(&list, buf) == 1);
+        }
+        pmap = compile_acc_port_map(list);
+
+        for(port = 0; port <= MAX_PORT; port++)
+        {
+            CU_ASSERT(ut_acc_port_match(list, pmap, PROTO_TCP, port) != -1);
+            CU_ASSERT(ut_acc_port_match(list, pmap, PROTO_UDP, port) != -1);
+        }
+
+        free_acc_port_map(pmap);
+        free_acc_port_list(list);
+        list = NULL;
+    }
+
+    /* A request against both maps: RESTRICT_PORTS always wins, and with
+     * OPEN_PORTS set every requested port has to be in it.
+    */
+    memset(&acc, 0x0, sizeof(acc));
+    memset(&exp, 0x0, sizeof(exp));
+    acc.exp = &exp;
+
+    CU_ASSERT_FATAL(expand_acc_port_list(&(exp.oport_list), oports) == 1);
+    CU_ASSERT_FATAL(expand_acc_port_list(&(exp.rport_list), rports) == 1);
+    exp.oport_map = compile_acc_port_map(exp.oport_list);
+    exp.rport_map = compile_acc_port_map(exp.rport_list);
+
+    CU_ASSERT(acc_check_one_port(&exp, req1) == 0);
+    CU_ASSERT(acc_check_one_port(&exp, req2) == 1);
+    CU_ASSERT(acc_check_one_port(&exp, req3) == 0);
+    CU_ASSERT(acc_check_one_port(&exp, req4) == 1);
+    CU_ASSERT(acc_check_one_port(&exp, req5) == 0);
+    CU_ASSERT(acc_check_one_port(&exp, req9) == -1);
+    CU_ASSERT(acc_check_one_port(&exp, req10) == -1);
+    CU_ASSERT(acc_check_port_access(&acc, req7) == 1);
+    CU_ASSERT(acc_check_port_access(&acc, req8) == 0);
+
+    // with only RESTRICT_PORTS anything not restricted is allowed
+    free_acc_port_map(exp.oport_map);
+    exp.oport_map = NULL;
+    CU_ASSERT(acc_check_one_port(&exp, req1) == 0);
+    CU_ASSERT(acc_check_one_port(&exp, req3) == 1);
+    CU_ASSERT(acc_check_one_port(&exp, req5) == 0);
+    CU_ASSERT(acc_check_one_port(&exp, req6) == 1);
+    CU_ASSERT(acc_check_port_access(&acc, req8) == 1);
+
+    free_acc_port_map(exp.rport_map);
+    free_acc_port_list(exp.oport_list);
+    free_acc_port_list(exp.rport_list);
+}
+
+#define UT_ACC_IDS  64
+
+static acc_stanza_t *ut_acc_id_ref[UT_ACC_IDS];
+static int ut_acc_id_freed[UT_ACC_IDS];
+static acc_stanza_t *ut_acc_id_stanzas;
+
+/* IDs packed close together (including 0 and the largest ID) so their
+ * runs overlap and wrap around the end of the table.
+*/
+static uint32_t
+ut_acc_id(const int i)
+{
+    return i == UT_ACC_IDS - 1 ? 0xffffffff : (uint32_t)i;
+}
+
+static void
+ut_acc_id_delete_cb(acc_stanza_t *acc)
+{
+    ut_acc_id_freed[(acc - ut_acc_id_stanzas) % UT_ACC_IDS]++;
+}
+
+// the map holds exactly what the reference does
+static int
+ut_acc_id_map_matches(const acc_id_map_t *map)
+{
+    uint32_t    n = 0;
+    int         i;
+
+    for(i = 0; i < UT_ACC_IDS; i++)
+    {
+        if(acc_id_map_get(map, ut_acc_id(i)) != ut_acc_id_ref[i])
+            return 0;
+        n += ut_acc_id_ref[i] != NULL;
+    }
+
+    return map->count == n;
+}
+
+DECLARE_UTEST(acc_id_map, "check the SDP ID access stanza map")
+{
+    acc_id_map_t   *map, *copy;
+    acc_stanza_t   *acc;
+    int             i, k, freed, res, wrapped = 0;
+
+    // two stanzas per ID, so a replacement can be told apart
+    ut_acc_id_stanzas = calloc(2 * UT_ACC_IDS, sizeof(acc_stanza_t));
+    CU_ASSERT_FATAL(ut_acc_id_stanzas != NULL);
+    memset(ut_acc_id_ref, 0x0, sizeof(ut_acc_id_ref));
+    memset(ut_acc_id_freed, 0x0, sizeof(ut_acc_id_freed));
+
+    map = acc_id_map_create(1, ut_acc_id_delete_cb);
+    CU_ASSERT_FATAL(map != NULL);
+    CU_ASSERT(map->size == ACC_ID_MAP_MIN_SLOTS);
+
+    CU_ASSERT(acc_id_map_get(map, 0) == NULL);
+    CU_ASSERT(acc_id_map_get(map, 0xffffffff) == NULL);
+    CU_ASSERT(acc_id_map_delete(map, 0) == -1);
+    CU_ASSERT(acc_id_map_get(NULL, 1) == NULL);
+
+    /* Random sets, replacements and deletes, mostly within the first
+     * few IDs so that the map stays small and crowded.
+    */
+    for(k = 0; k < 20000; k++)
+    {
+        i = ut_acc_rand() % (k < 10000 ? 12 : UT_ACC_IDS);
+        if(ut_acc_rand() % 8 == 0)
+            i = UT_ACC_IDS - 1;
+        freed = ut_acc_id_freed[i];
+
+        if(ut_acc_rand() % 2)
+        {
+            res = acc_id_map_delete(map, ut_acc_id(i));
+            CU_ASSERT(res == (ut_acc_id_ref[i] != NULL ? 0 : -1));
+            CU_ASSERT(ut_acc_id_freed[i] == freed + (res == 0));
+            ut_acc_id_ref[i] = NULL;
+        }
+        else
+        {
+            acc = &(ut_acc_id_stanzas[i + (ut_acc_rand() % 2) * UT_ACC_IDS]);
+            CU_ASSERT(acc_id_map_set(map, ut_acc_id(i), acc) == 0);
+
+            // setting the same stanza again must not free it
+            CU_ASSERT(ut_acc_id_freed[i] == freed
+                    + (ut_acc_id_ref[i] != NULL && ut_acc_id_ref[i] != acc));
+            ut_acc_id_ref[i] = acc;
+        }
+
+        CU_ASSERT(map->count <= map->size - map->size / 4);
+        if(map->slots[map->mask].acc != NULL && map->slots[0].acc != NULL)
+            wrapped++;
+        if(k % 7 == 0)
+            CU_ASSERT(ut_acc_id_map_matches(map));
+    }
+    CU_ASSERT(map->size > ACC_ID_MAP_MIN_SLOTS);
+    CU_ASSERT(wrapped > 0);
+    CU_ASSERT(ut_acc_id_map_matches(map));
+
+    /* A copy shares the stanzas but never frees them, and the two can be
+     * changed independently.
+    */
+    for(i = 0; i < UT_ACC_IDS; i++)
+    {
+        if(ut_acc_id_ref[i] != NULL)
+            continue;
+        ut_acc_id_ref[i] = &(ut_acc_id_stanzas[i]);
+        CU_ASSERT(acc_id_map_set(map, ut_acc_id(i), ut_acc_id_ref[i]) == 0);
+    }
+    CU_ASSERT_FATAL((copy = acc_id_map_copy(map)) != NULL);
+    CU_ASSERT(ut_acc_id_map_matches(copy));
+
+    freed = 0;
+    for(i = 0; i < UT_ACC_IDS; i++)
+        freed += ut_acc_id_freed[i];
+
+    for(i = 0; i < UT_ACC_IDS; i += 2)
+    {
+        CU_ASSERT(acc_id_map_delete(copy, ut_acc_id(i)) == 0);
+        CU_ASSERT(acc_id_map_get(copy, ut_acc_id(i)) == NULL);
+        CU_ASSERT(acc_id_map_get(map, ut_acc_id(i)) == ut_acc_id_ref[i]);
+    }
+    CU_ASSERT(copy->count == UT_ACC_IDS / 2);
+    CU_ASSERT(ut_acc_id_map_matches(map));
+    acc_id_map_destroy(copy);
+
+    k = 0;
+    for(i = 0; i < UT_ACC_IDS; i++)
+        k += ut_acc_id_freed[i];
+    CU_ASSERT(k == freed);
+
+    // destroying the original frees what is left in it
+    acc_id_map_destroy(map);
+    k = 0;
+    for(i = 0; i < UT_ACC_IDS; i++)
+        k += ut_acc_id_freed[i];
+    CU_ASSERT(k == freed + UT_ACC_IDS);
+
+    free(ut_acc_id_stanzas);
+}
+
 int register_ts_access(void)
 {
     ts_init(&TEST_SUITE(access), TEST_SUITE_DESCR(access), NULL, NULL);
     ts_add_utest(&TEST_SUITE(access), UTEST_FCT(compare_port_list), UTEST_DESCR(compare_port_list));
+    ts_add_utest(&TEST_SUITE(access), UTEST_FCT(acc_stanza_candidates), UTEST_DESCR(acc_stanza_candidates));
+    ts_add_utest(&TEST_SUITE(access), UTEST_FCT(acc_addr_trie), UTEST_DESCR(acc_addr_trie));
+    ts_add_utest(&TEST_SUITE(access), UTEST_FCT(acc_port_map), UTEST_DESCR(acc_port_map));
+    ts_add_utest(&TEST_SUITE(access), UTEST_FCT(acc_id_map), UTEST_DESCR(acc_id_map));
 
     return register_ts(&TEST_SUITE(access));
 }
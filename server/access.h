@@ -40,20 +40,42 @@
 */
 #define ACCESS_BUF_LEN  33
 
+/* Number of slots in the negative cache of unknown SDP client IDs (must
+ * be a power of two).
+*/
+#define SDP_MISS_CACHE_LEN  1024
+
+/* Size of the buffer for the strings of a passwd entry looked up while
+ * parsing a stanza.
+*/
+#define ACC_PW_BUF_LEN      1024
+
 
 /* Function Prototypes
 */
 int process_access_msg(fko_srv_options_t *opts, int action, json_object *jdata);
 void parse_access_file(fko_srv_options_t *opts);
 int compare_addr_list(acc_int_list_t *source_list, const uint32_t ip);
+int compare_spa_addr_list(acc_int_list_t *ip_list, const spa_addr_t *addr);
+int compare_acc_addr(acc_int_list_t *ip_list, const struct addr_trie *trie,
+        const spa_addr_t *addr);
+int acc_stanza_candidates(const acc_stanza_index_t *idx, const spa_addr_t *addr,
+        acc_stanza_t **cands);
+acc_stanza_t *acc_sdp_id_lookup(fko_srv_options_t *opts, const uint32_t sdp_id);
+void acc_sdp_miss_flush(void);
 int acc_check_service_access(acc_stanza_t *acc, char *service_str);
 int acc_check_port_access(acc_stanza_t *acc, char *port_str);
 void dump_access_list(fko_srv_options_t *opts);
-int expand_acc_service_list(acc_service_list_t **slist, char *slist_str);
+int dump_access_stanza(acc_stanza_t *acc, void *dest);
+acc_service_set_t *compile_acc_service_set(const char *slist_str);
+int acc_service_set_test(const acc_service_set_t *set, const uint32_t id);
+int acc_string_set_test(const acc_string_set_t *set, const char *str);
 int expand_acc_port_list(acc_port_list_t **plist, char *plist_str);
 void free_acc_stanzas(fko_srv_options_t *opts);
-void free_acc_service_list(acc_service_list_t *slist);
+void replace_acc_stanzas(fko_srv_options_t *opts, fko_srv_options_t *new_opts);
 void free_acc_port_list(acc_port_list_t *plist);
+acc_stanza_exp_t *acc_stanza_exp_new(acc_stanza_t *acc);
+void acc_stanza_exp_free(acc_stanza_exp_t *exp);
 
 #ifdef HAVE_C_UNIT_TESTS
 int register_ts_access(void);
@@ -0,0 +1,272 @@
+/*
+ *****************************************************************************
+ *
+ * File:    addr_trie.c
+ *
+ * Purpose: Path-compressed binary tries of network prefixes.  Each node
+ *          holds the whole prefix it stands for, so a chain of single-child
+ *          nodes collapses into one and a lookup visits at most one node
+ *          per branching bit, no matter how many networks are in the list.
+ *
+ *          Only "is the address inside any of the networks" is ever asked,
+ *          so once a prefix is in the trie anything more specific beneath
+ *          it is dropped.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "mem_acct.h"
+#include "addr_trie.h"
+
+/* Return bit number n (0 is the most significant bit of key[0]).
+*/
+static int
+key_bit(const unsigned char *key, const int n)
+{
+    return (key[n >> 3] >> (7 - (n & 7))) & 1;
+}
+
+/* Number of leading bits (up to max) that a and b have in common.
+*/
+static int
+common_bits(const unsigned char *a, const unsigned char *b, const int max)
+{
+    int             i, n = 0;
+    unsigned char   x;
+
+    for(i=0; n < max; i++)
+    {
+        x = a[i] ^ b[i];
+        if(x == 0)
+        {
+            n += 8;
+            continue;
+        }
+        while(! (x & 0x80))
+        {
+            x <<= 1;
+            n++;
+        }
+        break;
+    }
+
+    return n < max ? n : max;
+}
+
+/* True if the first len bits of key match the node prefix.
+*/
+static int
+prefix_match(const addr_trie_node_t *node, const unsigned char *key)
+{
+    int     bytes = node->len >> 3;
+    int     bits  = node->len & 7;
+
+    if(bytes && memcmp(node->key, key, bytes) != 0)
+        return 0;
+
+    if(bits)
+        return ((node->key[bytes] ^ key[bytes]) & (0xff << (8 - bits))) == 0;
+
+    return 1;
+}
+
+static addr_trie_node_t *
+node_new(const unsigned char *key, const int len, const int terminal)
+{
+    addr_trie_node_t   *node;
+    int                 bytes = len >> 3;
+
+    if((node = mem_calloc(MEM_TAG_ACC_INDEX, 1, sizeof(addr_trie_node_t))) == NULL)
+        return NULL;
+
+    memcpy(node->key, key, bytes);
+    if(len & 7)
+        node->key[bytes] = key[bytes] & (0xff << (8 - (len & 7)));
+
+    node->len      = len;
+    node->terminal = terminal;
+
+    return node;
+}
+
+static void
+node_free(addr_trie_node_t *node)
+{
+    if(node == NULL)
+        return;
+
+    node_free(node->child[0]);
+    node_free(node->child[1]);
+    mem_free(MEM_TAG_ACC_INDEX, node);
+    return;
+}
+
+addr_trie_t *
+addr_trie_new(void)
+{
+    return mem_calloc(MEM_TAG_ACC_INDEX, 1, sizeof(addr_trie_t));
+}
+
+void
+addr_trie_free(addr_trie_t *trie)
+{
+    if(trie == NULL)
+        return;
+
+    node_free(trie->root);
+    mem_free(MEM_TAG_ACC_INDEX, trie);
+    return;
+}
+
+/* Add the network key/len.  Returns 0 on success and -1 if memory could
+ * not be allocated.
+*/
+int
+addr_trie_add(addr_trie_t *trie, const unsigned char *key, const int len)
+{
+    addr_trie_node_t  **pp = &(trie->root);
+    addr_trie_node_t   *node, *mid, *leaf;
+    int                 common;
+
+    if(len < 0 || len > ADDR_TRIE_KEY_BITS)
+        return -1;
+
+    while((node = *pp) != NULL)
+    {
+        common = common_bits(node->key, key,
+                node->len < len ? node->len : len);
+
+        if(common == node->len)
+        {
+            /* Already covered by a shorter (or the same) prefix.
+            */
+            if(node->terminal)
+                return 0;
+
+            if(len == node->len)
+            {
+                node->terminal = 1;
+                node_free(node->child[0]);
+                node_free(node->child[1]);
+                node->child[0] = node->child[1] = NULL;
+                return 0;
+            }
+
+            pp = &(node->child[key_bit(key, node->len)]);
+            continue;
+        }
+
+        /* The new prefix leaves this node's path at bit 'common', so split
+         * the path there.  If the new prefix ends at the split point it
+         * covers the whole existing subtree.
+        */
+        if((mid = node_new(key, common, common == len)) == NULL)
+            return -1;
+
+        if(common == len)
+        {
+            node_free(node);
+        }
+        else
+        {
+            if((leaf = node_new(key, len, 1)) == NULL)
+            {
+                mem_free(MEM_TAG_ACC_INDEX, mid);
+                return -1;
+            }
+            mid->child[key_bit(node->key, common)] = node;
+            mid->child[key_bit(key, common)]       = leaf;
+        }
+
+        *pp = mid;
+        return 0;
+    }
+
+    if((*pp = node_new(key, len, 1)) == NULL)
+        return -1;
+
+    return 0;
+}
+
+/* Add an IPv4 network given in host byte order.
+*/
+int
+addr_trie_add_v4(addr_trie_t *trie, const uint32_t addr, const int len)
+{
+    unsigned char   key[ADDR_TRIE_KEY_LEN];
+    uint32_t        naddr = htonl(addr);
+
+    /* ANY (0.0.0.0/0) has always matched packets of both families.
+    */
+    memset(key, 0x0, sizeof(key));
+    if(len == 0)
+        return addr_trie_add(trie, key, 0);
+
+
+    key[10] = key[11] = 0xff;
+    memcpy(key + 12, &naddr, sizeof(naddr));
+
+    return addr_trie_add(trie, key, ADDR_TRIE_V4_PREFIX + len);
+}
+
+/* True if key lies inside any network in the trie.
+*/
+int
+addr_trie_match(const addr_trie_t *trie, const unsigned char *key)
+{
+    const addr_trie_node_t *node = trie->root;
+
+    while(node != NULL)
+    {
+        if(! prefix_match(node, key))
+            return 0;
+
+        if(node->terminal)
+            return 1;
+
+        if(node->len >= ADDR_TRIE_KEY_BITS)
+            return 0;
+
+        node = node->child[key_bit(key, node->len)];
+    }
+
+    return 0;
+}
+
+int
+addr_trie_match_spa(const addr_trie_t *trie, const spa_addr_t *addr)
+{
+    unsigned char   key[ADDR_TRIE_KEY_LEN];
+
+    if(addr->family == AF_INET6)
+        return addr_trie_match(trie, addr->addr);
+
+    memset(key, 0x0, 10);
+    key[10] = key[11] = 0xff;
+    memcpy(key + 12, addr->addr, 4);
+
+    return addr_trie_match(trie, key);
+}
+
+/***EOF***/
@@ -0,0 +1,68 @@
+/*
+ *****************************************************************************
+ *
+ * File:    addr_trie.h
+ *
+ * Purpose: Header file for addr_trie.c - path-compressed binary tries used
+ *          to match packet addresses against access stanza SOURCE and
+ *          DESTINATION lists.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef ADDR_TRIE_H
+#define ADDR_TRIE_H
+
+/* Keys are 128-bit addresses in network byte order.  IPv4 networks are
+ * stored as IPv4-mapped IPv6 (::ffff:a.b.c.d) so both families share one
+ * trie.
+*/
+#define ADDR_TRIE_KEY_LEN       16
+#define ADDR_TRIE_KEY_BITS      (ADDR_TRIE_KEY_LEN * 8)
+#define ADDR_TRIE_V4_PREFIX     96
+
+typedef struct addr_trie_node
+{
+    unsigned char           key[ADDR_TRIE_KEY_LEN]; /* bits past len are 0 */
+    unsigned char           len;        /* prefix length in bits */
+    unsigned char           terminal;   /* this prefix is in the list */
+    struct addr_trie_node  *child[2];
+} addr_trie_node_t;
+
+typedef struct addr_trie
+{
+    addr_trie_node_t       *root;
+} addr_trie_t;
+
+/* Prototypes
+*/
+addr_trie_t *addr_trie_new(void);
+void addr_trie_free(addr_trie_t *trie);
+int addr_trie_add(addr_trie_t *trie, const unsigned char *key, const int len);
+int addr_trie_add_v4(addr_trie_t *trie, const uint32_t addr, const int len);
+int addr_trie_match(const addr_trie_t *trie, const unsigned char *key);
+int addr_trie_match_spa(const addr_trie_t *trie, const spa_addr_t *addr);
+
+#endif /* ADDR_TRIE_H */
+
+/***EOF***/
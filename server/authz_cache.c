@@ -0,0 +1,371 @@
+/*
+ *****************************************************************************
+ *
+ * File:    authz_cache.c
+ *
+ * Purpose: Cache of SDP service access decisions and the service data
+ *          they resolve to.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "authz_cache.h"
+#include "spa_arena.h"
+#include "mem_acct.h"
+#include "metrics.h"
+#include "log_msg.h"
+#include "utils.h"
+
+#define FNV_OFFSET_BASIS    0x811c9dc5U
+#define FNV_PRIME           0x01000193U
+
+/* Entries are linked by index, both in their hash bucket's chain and in
+ * the LRU list (most recently used first).  -1 ends a list.
+*/
+typedef struct authz_entry
+{
+    uint32_t        hash;
+    uint32_t        gen;
+    uint32_t        sdp_id;
+    unsigned char   used;
+    unsigned char   allowed;
+    unsigned char   num_services;
+    char            request[AUTHZ_CACHE_MAX_REQ_LEN+1];
+    service_data_t  services[AUTHZ_CACHE_MAX_SERVICES];
+    int             bucket_next;
+    int             lru_prev;
+    int             lru_next;
+} authz_entry_t;
+
+static authz_entry_t       *ac_entries = NULL;
+static int                 *ac_buckets = NULL;
+static uint32_t             ac_bucket_mask = 0;
+static int                  ac_lru_head = -1;
+static int                  ac_lru_tail = -1;
+static volatile uint32_t    ac_gen = 1;
+static pthread_mutex_t      ac_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t
+ac_hash(const uint32_t sdp_id, const char *request)
+{
+    uint32_t    h = FNV_OFFSET_BASIS;
+    int         i;
+
+    for(i=0; i < 4; i++)
+    {
+        h ^= (sdp_id >> (i * 8)) & 0xff;
+        h *= FNV_PRIME;
+    }
+    for(; *request != '\0'; request++)
+    {
+        h ^= (unsigned char)*request;
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+/* Only SDP mode service requests short enough to store are cached.
+*/
+static int
+ac_cacheable(const spa_data_t *spadat)
+{
+    return(ac_entries != NULL && spadat->sdp_id != 0
+        && strnlen(spadat->spa_message_remain, AUTHZ_CACHE_MAX_REQ_LEN+1)
+            <= AUTHZ_CACHE_MAX_REQ_LEN);
+}
+
+/* Find the entry for a client and request, whatever its generation.
+ * Called with ac_mutex held.
+*/
+static int
+ac_find(const uint32_t hash, const uint32_t sdp_id, const char *request)
+{
+    int     i;
+
+    for(i = ac_buckets[hash & ac_bucket_mask]; i >= 0;
+            i = ac_entries[i].bucket_next)
+        if(ac_entries[i].hash == hash && ac_entries[i].sdp_id == sdp_id
+                && strcmp(ac_entries[i].request, request) == 0)
+            return i;
+
+    return -1;
+}
+
+static void
+ac_lru_unlink(const int i)
+{
+    authz_entry_t  *e = &(ac_entries[i]);
+
+    if(e->lru_prev >= 0)
+        ac_entries[e->lru_prev].lru_next = e->lru_next;
+    else
+        ac_lru_head = e->lru_next;
+
+    if(e->lru_next >= 0)
+        ac_entries[e->lru_next].lru_prev = e->lru_prev;
+    else
+        ac_lru_tail = e->lru_prev;
+
+    return;
+}
+
+static void
+ac_lru_push(const int i)
+{
+    authz_entry_t  *e = &(ac_entries[i]);
+
+    e->lru_prev = -1;
+    e->lru_next = ac_lru_head;
+    if(ac_lru_head >= 0)
+        ac_entries[ac_lru_head].lru_prev = i;
+    else
+        ac_lru_tail = i;
+    ac_lru_head = i;
+
+    return;
+}
+
+static void
+ac_bucket_unlink(const int i)
+{
+    int    *p;
+
+    for(p = &(ac_buckets[ac_entries[i].hash & ac_bucket_mask]); *p >= 0;
+            p = &(ac_entries[*p].bucket_next))
+    {
+        if(*p == i)
+        {
+            *p = ac_entries[i].bucket_next;
+            break;
+        }
+    }
+    return;
+}
+
+/* Set up the cache with AUTHZ_CACHE_SIZE entries.  A size of 0 leaves it
+ * disabled.  Returns 0 on success and -1 on error.
+*/
+int
+authz_cache_start(fko_srv_options_t *opts)
+{
+    int     i, is_err, size;
+
+    size = strtol_wrapper(opts->config[CONF_AUTHZ_CACHE_SIZE],
+            0, RCHK_MAX_AUTHZ_CACHE_SIZE, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid AUTHZ_CACHE_SIZE value.");
+        return -1;
+    }
+
+    if(size == 0 || strncasecmp(opts->config[CONF_DISABLE_SDP_MODE], "Y", 1) == 0)
+        return 0;
+
+    for(ac_bucket_mask = 1; ac_bucket_mask < (uint32_t)size; ac_bucket_mask <<= 1)
+        ;
+
+    ac_entries = mem_calloc(MEM_TAG_AUTHZ, size, sizeof(authz_entry_t));
+    ac_buckets = mem_calloc(MEM_TAG_AUTHZ, ac_bucket_mask, sizeof(int));
+    if(ac_entries == NULL || ac_buckets == NULL)
+    {
+        log_msg(LOG_ERR, "authz_cache_start: calloc() failed");
+        authz_cache_stop();
+        return -1;
+    }
+    ac_bucket_mask--;
+
+    for(i=0; i <= (int)ac_bucket_mask; i++)
+        ac_buckets[i] = -1;
+
+    /* Every entry starts out unused on the LRU list, so eviction always
+     * has somewhere to take from.
+    */
+    ac_lru_head = ac_lru_tail = -1;
+    for(i=0; i < size; i++)
+    {
+        ac_entries[i].bucket_next = -1;
+        ac_lru_push(i);
+    }
+    return 0;
+}
+
+void
+authz_cache_stop(void)
+{
+    pthread_mutex_lock(&ac_mutex);
+    mem_free(MEM_TAG_AUTHZ, ac_entries);
+    mem_free(MEM_TAG_AUTHZ, ac_buckets);
+    ac_entries = NULL;
+    ac_buckets = NULL;
+    pthread_mutex_unlock(&ac_mutex);
+    return;
+}
+
+/* Retire every cached decision.  Call this after any change to the SDP
+ * mode access or service tables.
+*/
+void
+authz_cache_flush(void)
+{
+    __sync_fetch_and_add(&ac_gen, 1);
+    return;
+}
+
+/* The current generation.  A packet takes this before it looks up its
+ * stanza, so that a decision made from tables that changed meanwhile is
+ * never stored as current.
+*/
+uint32_t
+authz_cache_gen(void)
+{
+    return __atomic_load_n(&ac_gen, __ATOMIC_RELAXED);
+}
+
+/* Look up the decision for spadat's client and request.  On a hit,
+ * returns 1 with allowed set and, for an allowed request, the service
+ * data list built in the packet's arena.  Returns 0 on a miss.
+*/
+int
+authz_cache_get(const spa_data_t *spadat, const uint32_t gen,
+        int *allowed, service_data_list_t **list)
+{
+    service_data_t          services[AUTHZ_CACHE_MAX_SERVICES];
+    service_data_list_t    *node, *last = NULL;
+    uint32_t                hash;
+    int                     i, num_services = 0, found = 0;
+
+    *list = NULL;
+
+    if(! ac_cacheable(spadat))
+        return 0;
+
+    hash = ac_hash(spadat->sdp_id, spadat->spa_message_remain);
+
+    pthread_mutex_lock(&ac_mutex);
+    if(ac_entries != NULL
+            && (i = ac_find(hash, spadat->sdp_id, spadat->spa_message_remain)) >= 0
+            && ac_entries[i].gen == gen)
+    {
+        ac_lru_unlink(i);
+        ac_lru_push(i);
+
+        found        = 1;
+        *allowed     = ac_entries[i].allowed;
+        num_services = ac_entries[i].num_services;
+        memcpy(services, ac_entries[i].services,
+            num_services * sizeof(service_data_t));
+    }
+    pthread_mutex_unlock(&ac_mutex);
+
+    if(! found)
+    {
+        METRIC_INC(METRIC_AUTHZ_CACHE_MISSES);
+        return 0;
+    }
+
+    for(i=0; i < num_services; i++)
+    {
+        if((node = spa_arena_alloc(spadat->arena, sizeof(*node))) == NULL
+                || (node->service_data = spa_arena_alloc(spadat->arena,
+                        sizeof(service_data_t))) == NULL)
+        {
+            *list = NULL;
+            return 0;
+        }
+
+        *(node->service_data) = services[i];
+        node->next = NULL;
+
+        if(last == NULL)
+            *list = node;
+        else
+            last->next = node;
+        last = node;
+    }
+
+    METRIC_INC(METRIC_AUTHZ_CACHE_HITS);
+    return 1;
+}
+
+/* Store the decision for spadat's client and request, made from the
+ * tables of generation gen.
+*/
+void
+authz_cache_put(const spa_data_t *spadat, const uint32_t gen,
+        const int allowed, const service_data_list_t *list)
+{
+    const service_data_list_t  *node;
+    authz_entry_t              *e;
+    uint32_t                    hash;
+    int                         i, n = 0;
+
+    if(! ac_cacheable(spadat) || gen != authz_cache_gen())
+        return;
+
+    for(node = list; node != NULL; node = node->next)
+        if(++n > AUTHZ_CACHE_MAX_SERVICES)
+            return;
+
+    hash = ac_hash(spadat->sdp_id, spadat->spa_message_remain);
+
+    pthread_mutex_lock(&ac_mutex);
+    if(ac_entries == NULL)
+    {
+        pthread_mutex_unlock(&ac_mutex);
+        return;
+    }
+
+    if((i = ac_find(hash, spadat->sdp_id, spadat->spa_message_remain)) < 0)
+    {
+        /* Reuse the least recently used entry
+        */
+        i = ac_lru_tail;
+        if(ac_entries[i].used)
+            ac_bucket_unlink(i);
+
+        e = &(ac_entries[i]);
+        e->used   = 1;
+        e->hash   = hash;
+        e->sdp_id = spadat->sdp_id;
+        strlcpy(e->request, spadat->spa_message_remain, sizeof(e->request));
+
+        e->bucket_next = ac_buckets[hash & ac_bucket_mask];
+        ac_buckets[hash & ac_bucket_mask] = i;
+    }
+    e = &(ac_entries[i]);
+
+    e->gen          = gen;
+    e->allowed      = allowed;
+    e->num_services = n;
+    for(n = 0, node = list; node != NULL; node = node->next)
+        e->services[n++] = *(node->service_data);
+
+    ac_lru_unlink(i);
+    ac_lru_push(i);
+
+    pthread_mutex_unlock(&ac_mutex);
+    return;
+}
+
+/***EOF***/
@@ -0,0 +1,62 @@
+/*
+ *****************************************************************************
+ *
+ * File:    authz_cache.h
+ *
+ * Purpose: Header file for authz_cache.c - cache of SDP service access
+ *          decisions.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef AUTHZ_CACHE_H
+#define AUTHZ_CACHE_H
+
+/* Clients re-knock with the same service request over and over, so the
+ * outcome of checking a request against the client's stanza and the
+ * service data it resolves to are kept per (SDP ID, request string), in
+ * at most AUTHZ_CACHE_SIZE entries with the least recently used going
+ * first.  Requests longer than AUTHZ_CACHE_MAX_REQ_LEN or for more than
+ * AUTHZ_CACHE_MAX_SERVICES services are not cached.
+ *
+ * Every entry records the generation it was made in, and any change to
+ * the access or service tables starts a new generation, which retires
+ * all entries at once.
+*/
+#define AUTHZ_CACHE_MAX_REQ_LEN     128
+#define AUTHZ_CACHE_MAX_SERVICES    8
+
+/* Prototypes
+*/
+int authz_cache_start(fko_srv_options_t *opts);
+void authz_cache_stop(void);
+void authz_cache_flush(void);
+uint32_t authz_cache_gen(void);
+int authz_cache_get(const spa_data_t *spadat, const uint32_t gen,
+        int *allowed, service_data_list_t **list);
+void authz_cache_put(const spa_data_t *spadat, const uint32_t gen,
+        const int allowed, const service_data_list_t *list);
+
+#endif /* AUTHZ_CACHE_H */
+
+/***EOF***/
@@ -0,0 +1,466 @@
+/*
+ *****************************************************************************
+ *
+ * File:    bench_fw.c
+ *
+ * Purpose: Grant, expiry and data plane latency of the compiled firewall
+ *          backend, measured in a network namespace of its own.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "bench_fw.h"
+#include "fw_util.h"
+#include "log_msg.h"
+#include "utils.h"
+#include <json-c/json.h>
+
+#if defined(__linux__)
+  #include <sched.h>
+  #include <errno.h>
+  #include <sys/socket.h>
+  #include <sys/ioctl.h>
+  #include <net/if.h>
+#endif
+
+/* A stanza with nothing set, the plain service grants made here do not
+ * look at any of it.
+*/
+static acc_stanza_cold_t    bench_fw_cold;
+static acc_stanza_t         bench_fw_acc = { .cold = &bench_fw_cold };
+
+static unsigned long long
+bench_fw_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return((unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec);
+}
+
+static int
+parse_bench_fw_sizes(const char *spec, int *sizes)
+{
+    char   *buf, *ndx, *save = NULL;
+    int     count = 0, is_err;
+
+    if((buf = strdup(spec)) == NULL)
+        return(-1);
+
+    for(ndx = strtok_r(buf, ",", &save); ndx != NULL;
+            ndx = strtok_r(NULL, ",", &save))
+    {
+        if(count < BENCH_FW_MAX_SIZES)
+            sizes[count] = strtol_wrapper(ndx, 1, RCHK_MAX_BENCH_FW_GRANTS,
+                    NO_EXIT_UPON_ERR, &is_err);
+        if(count >= BENCH_FW_MAX_SIZES || is_err != FKO_SUCCESS)
+        {
+            log_msg(LOG_ERR, "[*] Invalid --benchmark-fw grant count '%s' (at "
+                "most %d counts of 1 to %d)", ndx, BENCH_FW_MAX_SIZES,
+                RCHK_MAX_BENCH_FW_GRANTS);
+            free(buf);
+            return(-1);
+        }
+        count++;
+    }
+
+    free(buf);
+    return(count);
+}
+
+/* Move into a new network namespace with only the loopback interface
+ * (brought up for the probes), so the benchmark rules never touch the
+ * host's firewall.  Needs CAP_SYS_ADMIN.
+*/
+static int
+bench_fw_netns(void)
+{
+#if defined(__linux__)
+    struct ifreq    ifr;
+    int             sock, rv = 0;
+
+    if(unshare(CLONE_NEWNET) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Unable to create a network namespace: %s",
+            strerror(errno));
+        return(-1);
+    }
+
+    if((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+        return(-1);
+
+    memset(&ifr, 0x0, sizeof(ifr));
+    strlcpy(ifr.ifr_name, "lo", sizeof(ifr.ifr_name));
+    if(ioctl(sock, SIOCGIFFLAGS, &ifr) != 0)
+        rv = -1;
+    else
+    {
+        ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+        if(ioctl(sock, SIOCSIFFLAGS, &ifr) != 0)
+            rv = -1;
+    }
+    if(rv != 0)
+        log_msg(LOG_ERR, "[*] Unable to bring up lo in the benchmark namespace: %s",
+            strerror(errno));
+
+    close(sock);
+    return(rv);
+#else
+    log_msg(LOG_ERR, "[*] --benchmark-fw needs Linux network namespaces.");
+    return(-1);
+#endif
+}
+
+static const char *
+bench_fw_backend(const fko_srv_options_t *opts)
+{
+#if FIREWALL_IPTABLES
+    if(strncasecmp(opts->config[CONF_ENABLE_IPT_IPSET], "Y", 1) == 0)
+        return("iptables+ipset");
+    if(strncasecmp(opts->config[CONF_ENABLE_IPT_RESTORE_BATCH], "Y", 1) == 0)
+        return("iptables-restore");
+    return("iptables");
+#elif FIREWALL_NFTABLES
+    (void)opts;
+    return("nftables");
+#else
+    (void)opts;
+    return(NULL);
+#endif
+}
+
+/* Add the grant for UDP to BENCH_FW_PORT from the given source, expiring
+ * at deadline.  Returns its latency in nanoseconds, or 0 if it failed.
+*/
+static unsigned long long
+bench_fw_grant(fko_srv_options_t *opts, const char *src_ip,
+        const uint32_t sdp_id, const time_t deadline)
+{
+    static service_data_t       svc;
+    static service_data_list_t  svc_list;
+    static spa_data_t           spadat;
+    char                        ip[MAX_IPV4_STR_LEN];
+    unsigned long long          start;
+    time_t                      now = time(NULL);
+    int                         res;
+
+    svc.service_id = 1;
+    svc.proto      = IPPROTO_UDP;
+    svc.port       = BENCH_FW_PORT;
+    svc_list.service_data = &svc;
+    svc_list.next         = NULL;
+
+    memset(&spadat, 0x0, sizeof(spadat));
+    strlcpy(ip, src_ip, sizeof(ip));
+    strlcpy(spadat.spa_message_src_ip, src_ip, sizeof(spadat.spa_message_src_ip));
+    strlcpy(spadat.pkt_source_ip, src_ip, sizeof(spadat.pkt_source_ip));
+    strlcpy(spadat.pkt_destination_ip, "127.0.0.1", sizeof(spadat.pkt_destination_ip));
+    strlcpy(spadat.spa_message_remain, "1", sizeof(spadat.spa_message_remain));
+    spadat.use_src_ip        = ip;
+    spadat.sdp_id            = sdp_id;
+    spadat.message_type      = FKO_CLIENT_TIMEOUT_SERVICE_ACCESS_MSG;
+    spadat.service_data_list = &svc_list;
+    spadat.fw_access_timeout = deadline > now ? deadline - now : 1;
+
+    start = bench_fw_now_ns();
+    res   = process_spa_request(opts, &bench_fw_acc, &spadat);
+    start = bench_fw_now_ns() - start;
+
+    return(res == 0 && start > 0 ? start : 0);
+}
+
+static int
+cmp_ull(const void *a, const void *b)
+{
+    const unsigned long long x = *(const unsigned long long *)a;
+    const unsigned long long y = *(const unsigned long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Mean, percentiles and maximum of count latencies (sorted here), in
+ * microseconds.
+*/
+static json_object *
+bench_fw_latency_json(unsigned long long *ns, const int count)
+{
+    json_object        *jobj = json_object_new_object();
+    unsigned long long  sum = 0;
+    int                 i;
+
+    if(count > 0)
+        qsort(ns, count, sizeof(*ns), cmp_ull);
+    for(i=0; i < count; i++)
+        sum += ns[i];
+
+    json_object_object_add(jobj, "count", json_object_new_int(count));
+    json_object_object_add(jobj, "mean_us",
+        json_object_new_double(count ? sum / 1000.0 / count : 0.0));
+    json_object_object_add(jobj, "p50_us",
+        json_object_new_double(count ? ns[count / 2] / 1000.0 : 0.0));
+    json_object_object_add(jobj, "p90_us",
+        json_object_new_double(count ? ns[(int)(count * 0.9)] / 1000.0 : 0.0));
+    json_object_object_add(jobj, "p99_us",
+        json_object_new_double(count ? ns[(int)(count * 0.99)] / 1000.0 : 0.0));
+    json_object_object_add(jobj, "max_us",
+        json_object_new_double(count ? ns[count - 1] / 1000.0 : 0.0));
+    return(jobj);
+}
+
+/* Time UDP datagrams from and to 127.0.0.1:BENCH_FW_PORT, which pass
+ * through the fwknop chains (or sets) on the way in.
+*/
+static json_object *
+bench_fw_probe(void)
+{
+    struct sockaddr_in  addr;
+    struct timeval      tv;
+    unsigned long long  ns[BENCH_FW_PROBES], start;
+    char                buf[64];
+    int                 sock, i, count = 0, lost = 0;
+    json_object        *jobj;
+
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(BENCH_FW_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    tv.tv_sec  = BENCH_FW_PROBE_TIMEOUT;
+    tv.tv_usec = 0;
+
+    if((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0
+            || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0
+            || setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Unable to set up the data plane probe socket.");
+        if(sock >= 0)
+            close(sock);
+        return(NULL);
+    }
+
+    memset(buf, 'p', sizeof(buf));
+
+    for(i=0; i < BENCH_FW_PROBES; i++)
+    {
+        start = bench_fw_now_ns();
+        if(sendto(sock, buf, sizeof(buf), 0, (struct sockaddr *)&addr,
+                    sizeof(addr)) != sizeof(buf)
+                || recv(sock, buf, sizeof(buf), 0) != sizeof(buf))
+        {
+            lost++;
+            continue;
+        }
+        ns[count++] = bench_fw_now_ns() - start;
+    }
+
+    close(sock);
+
+    jobj = bench_fw_latency_json(ns, count);
+    json_object_object_add(jobj, "lost", json_object_new_int(lost));
+    return(jobj);
+}
+
+static json_object *
+bench_fw_rate_json(const int count, const unsigned long long total_ns)
+{
+    json_object    *jobj = json_object_new_object();
+
+    json_object_object_add(jobj, "seconds",
+        json_object_new_double(total_ns / 1e9));
+    json_object_object_add(jobj, "per_sec",
+        json_object_new_double(total_ns ? count / (total_ns / 1e9) : 0.0));
+    return(jobj);
+}
+
+/* Grant, probe and expire one size.  per_grant_ns is the estimated cost
+ * of a grant, used to pick a deadline that all of them will outlive.
+*/
+static json_object *
+bench_fw_size(fko_srv_options_t *opts, const int grants,
+        const unsigned long long per_grant_ns)
+{
+    unsigned long long *ns, lat, total = 0, start;
+    char                src_ip[MAX_IPV4_STR_LEN];
+    uint32_t            ip;
+    time_t              deadline;
+    int                 i, count = 0, overrun;
+    json_object        *jobj, *jgrant, *jprobe;
+
+    if((ns = calloc(grants, sizeof(*ns))) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] Fatal memory allocation error.");
+        return(NULL);
+    }
+
+    log_msg(LOG_INFO, "Benchmark: adding %d grants.", grants);
+
+    deadline = time(NULL) + BENCH_FW_MIN_LIFETIME
+        + (time_t)(3 * per_grant_ns * grants / 1000000000ULL);
+
+    for(i=0; i < grants; i++)
+    {
+        if(i == grants - 1)
+            strlcpy(src_ip, "127.0.0.1", sizeof(src_ip));
+        else
+        {
+            ip = 0x0a000001 + i;
+            snprintf(src_ip, sizeof(src_ip), "%u.%u.%u.%u",
+                ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff);
+        }
+
+        if((lat = bench_fw_grant(opts, src_ip, i + 1, deadline)) == 0)
+            continue;
+        ns[count++] = lat;
+        total += lat;
+    }
+
+    overrun = (time(NULL) >= deadline);
+    if(overrun)
+        log_msg(LOG_WARNING, "Benchmark: adding the grants took longer than "
+            "expected, some may have expired before the probes.");
+
+    jobj = json_object_new_object();
+    json_object_object_add(jobj, "grants", json_object_new_int(grants));
+    json_object_object_add(jobj, "installed", json_object_new_int(count));
+
+    jgrant = bench_fw_latency_json(ns, count);
+    json_object_object_add(jgrant, "rate", bench_fw_rate_json(count, total));
+    json_object_object_add(jobj, "grant", jgrant);
+
+    if((jprobe = bench_fw_probe()) != NULL)
+        json_object_object_add(jobj, "probe", jprobe);
+
+    /* Wait for the grants to come due and time the pass that removes
+     * them, as the main loop would run it.
+    */
+    log_msg(LOG_INFO, "Benchmark: waiting %ld seconds for the grants to expire.",
+        (long)(deadline - time(NULL) + 1));
+    while(time(NULL) <= deadline)
+        sleep(1);
+
+    start = bench_fw_now_ns();
+    check_firewall_rules(opts, 0);
+    json_object_object_add(jobj, "expiry",
+        bench_fw_rate_json(count, bench_fw_now_ns() - start));
+    json_object_object_add(jobj, "deadline_overrun",
+        json_object_new_boolean(overrun));
+
+    // anything the incremental pass left
+    check_firewall_rules(opts, 1);
+    fw_timer_clear();
+
+    free(ns);
+    return(jobj);
+}
+
+/* Cost of one grant for picking deadlines, from BENCH_FW_CALIBRATE grants
+ * that are removed again.
+*/
+static unsigned long long
+bench_fw_calibrate(fko_srv_options_t *opts)
+{
+    unsigned long long  lat, total = 0;
+    char                src_ip[MAX_IPV4_STR_LEN];
+    int                 i, count = 0;
+
+    for(i=0; i < BENCH_FW_CALIBRATE; i++)
+    {
+        snprintf(src_ip, sizeof(src_ip), "192.0.2.%d", i + 1);
+        if((lat = bench_fw_grant(opts, src_ip, i + 1, time(NULL) + 1)) == 0)
+            continue;
+        total += lat;
+        count++;
+    }
+
+    sleep(2);
+    check_firewall_rules(opts, 1);
+    fw_timer_clear();
+
+    return(count ? total / count : 1000000000ULL);
+}
+
+/* Run the firewall benchmark for each of the grant counts in
+ * --benchmark-fw and print the results to stdout as JSON.
+*/
+int
+bench_fw_run(fko_srv_options_t *opts)
+{
+    int                 sizes[BENCH_FW_MAX_SIZES];
+    int                 count, i, rv = 0;
+    unsigned long long  per_grant_ns;
+    const char         *backend;
+    json_object        *jobj, *jresults, *jsize;
+
+    if((count = parse_bench_fw_sizes(opts->benchmark_fw, sizes)) <= 0)
+        return(-1);
+
+    /* firewalld rules live in the firewalld daemon, outside any
+     * namespace we could create here.
+    */
+    if((backend = bench_fw_backend(opts)) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] --benchmark-fw supports the iptables and nftables backends.");
+        return(-1);
+    }
+
+    if(bench_fw_netns() != 0)
+        return(-1);
+
+    if(fw_initialize(opts) != 1)
+    {
+        log_msg(LOG_ERR, "[*] Firewall initialization failed in the benchmark namespace.");
+        fw_cleanup(opts);
+        return(-1);
+    }
+
+    log_msg(LOG_INFO, "Benchmark: calibrating with %d grants.", BENCH_FW_CALIBRATE);
+    per_grant_ns = bench_fw_calibrate(opts);
+
+    jobj     = json_object_new_object();
+    jresults = json_object_new_array();
+    json_object_object_add(jobj, "backend", json_object_new_string(backend));
+    json_object_object_add(jobj, "probes", json_object_new_int(BENCH_FW_PROBES));
+    json_object_object_add(jobj, "results", jresults);
+
+    for(i=0; i < count; i++)
+    {
+        if((jsize = bench_fw_size(opts, sizes[i], per_grant_ns)) == NULL)
+        {
+            rv = -1;
+            break;
+        }
+        json_object_array_add(jresults, jsize);
+    }
+
+    fw_cleanup(opts);
+
+    fprintf(stdout, "%s\n",
+        json_object_to_json_string_ext(jobj, JSON_C_TO_STRING_PRETTY));
+    fflush(stdout);
+
+    json_object_put(jobj);
+    return(rv);
+}
+
+/***EOF***/
@@ -0,0 +1,58 @@
+/*
+ *****************************************************************************
+ *
+ * File:    bench_fw.h
+ *
+ * Purpose: Header file for bench_fw.c.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef BENCH_FW_H
+#define BENCH_FW_H
+
+/* The most grant counts one run takes.
+*/
+#define BENCH_FW_MAX_SIZES          16
+
+/* Every grant is for UDP to BENCH_FW_PORT.  The last one of each size
+ * is for 127.0.0.1, which the data plane probes are sent from, so the
+ * probes match a grant rule.
+*/
+#define BENCH_FW_PORT               62299
+#define BENCH_FW_PROBES             1000
+#define BENCH_FW_PROBE_TIMEOUT      1       /* seconds */
+
+/* All grants of a size expire together, this long after the time the
+ * first BENCH_FW_CALIBRATE grants suggest installing them all will take.
+*/
+#define BENCH_FW_CALIBRATE          64
+#define BENCH_FW_MIN_LIFETIME       5       /* seconds */
+
+/* Prototypes
+*/
+int bench_fw_run(fko_srv_options_t *opts);
+
+#endif /* BENCH_FW_H */
+
+/***EOF***/
@@ -0,0 +1,403 @@
+/*
+ *****************************************************************************
+ *
+ * File:    bench_synth.c
+ *
+ * Purpose: The --benchmark-synth mode.  For each requested table size
+ *          this builds SDP service and access tables through the same
+ *          JSON paths the controller messages take, fills the firewall
+ *          timer wheel with the requested number of active grants,
+ *          generates valid SPA packets for random clients and feeds
+ *          them to incoming_spa() in test mode (so the firewall is never
+ *          touched), then prints the usual benchmark report.  Comparing
+ *          the reports for growing sizes shows which lookups do not
+ *          scale.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "bench_synth.h"
+#include "benchmark.h"
+#include "incoming_spa.h"
+#include "access.h"
+#include "service.h"
+#include "fw_util.h"
+#include "log_msg.h"
+#include "fwknopd_errors.h"
+#include "utils.h"
+#include "sdp_message.h"
+#include <json-c/json.h>
+
+typedef struct synth_size
+{
+    int     stanzas;
+    int     services;
+    int     grants;
+    int     packets;
+} synth_size_t;
+
+/* A generated packet, the SPA data is not NUL terminated when it is
+ * handed to incoming_spa().
+*/
+typedef struct synth_pkt
+{
+    char           *data;
+    unsigned int    len;
+    unsigned int    src_ip;
+} synth_pkt_t;
+
+/* Parse one "stanzas[:services[:grants[:packets]]]" size.
+*/
+static int
+parse_synth_size(char *str, synth_size_t *size)
+{
+    static const struct { int min; int max; } lims[] = {
+        { 1, RCHK_MAX_SYNTH_STANZAS },
+        { 1, RCHK_MAX_SYNTH_SERVICES },
+        { 0, RCHK_MAX_SYNTH_GRANTS },
+        { 1, RCHK_MAX_SYNTH_PACKETS }
+    };
+    int    *fields[] = { &size->stanzas, &size->services,
+                         &size->grants, &size->packets };
+    char   *ndx, *save = NULL;
+    int     i = 0, is_err;
+
+    size->services = SYNTH_DEF_SERVICES;
+    size->grants   = SYNTH_DEF_GRANTS;
+    size->packets  = SYNTH_DEF_PACKETS;
+
+    for(ndx = strtok_r(str, ":", &save); ndx != NULL;
+            ndx = strtok_r(NULL, ":", &save))
+    {
+        if(i >= 4)
+            return(-1);
+
+        *fields[i] = strtol_wrapper(ndx, lims[i].min, lims[i].max,
+                NO_EXIT_UPON_ERR, &is_err);
+        if(is_err != FKO_SUCCESS)
+            return(-1);
+        i++;
+    }
+
+    return(i > 0 ? 0 : -1);
+}
+
+static int
+parse_synth_sizes(const char *spec, synth_size_t *sizes)
+{
+    char   *buf, *ndx, *save = NULL;
+    int     count = 0;
+
+    if((buf = strdup(spec)) == NULL)
+        return(-1);
+
+    for(ndx = strtok_r(buf, ",", &save); ndx != NULL;
+            ndx = strtok_r(NULL, ",", &save))
+    {
+        if(count >= SYNTH_MAX_SIZES || parse_synth_size(ndx, &(sizes[count])) != 0)
+        {
+            log_msg(LOG_ERR, "[*] Invalid --benchmark-synth size '%s' (at most %d "
+                "sizes of the form stanzas[:services[:grants[:packets]]])",
+                ndx, SYNTH_MAX_SIZES);
+            free(buf);
+            return(-1);
+        }
+        count++;
+    }
+
+    free(buf);
+    return(count);
+}
+
+/* Every synthetic client has its own keys, derived from its SDP ID so
+ * they do not have to be stored.
+*/
+static void
+synth_keys(const uint32_t sdp_id, char *key, const size_t key_size,
+        char *hmac_key, const size_t hmac_key_size)
+{
+    snprintf(key, key_size, "synth-enc-%010u", sdp_id);
+    snprintf(hmac_key, hmac_key_size, "synth-hmac-%010u-%010u", sdp_id, ~sdp_id);
+    return;
+}
+
+/* The i'th service of stanza number stanza (both from 0).
+*/
+static int
+synth_service_id(const int stanza, const int i, const int services)
+{
+    return(1 + (int)(((long)stanza * SYNTH_SERVICES_PER_STANZA + i) % services));
+}
+
+static int
+synth_services_per_stanza(const int services)
+{
+    return(services < SYNTH_SERVICES_PER_STANZA ? services : SYNTH_SERVICES_PER_STANZA);
+}
+
+static int
+synth_service_table(fko_srv_options_t *opts, const int services)
+{
+    json_object    *jarray, *jservice;
+    int             i, rv;
+
+    if((jarray = json_object_new_array()) == NULL)
+        return(FKO_ERROR_MEMORY_ALLOCATION);
+
+    for(i=0; i < services; i++)
+    {
+        if((jservice = json_object_new_object()) == NULL)
+        {
+            json_object_put(jarray);
+            return(FKO_ERROR_MEMORY_ALLOCATION);
+        }
+        json_object_object_add(jservice, "service_id", json_object_new_int(i + 1));
+        json_object_object_add(jservice, "proto", json_object_new_string("tcp"));
+        json_object_object_add(jservice, "port", json_object_new_int(1024 + i % 60000));
+        json_object_object_add(jservice, "nat_ip", json_object_new_string(""));
+        json_object_object_add(jservice, "nat_port", json_object_new_int(0));
+        json_object_array_add(jarray, jservice);
+    }
+
+    rv = process_service_msg(opts, CTRL_ACTION_SERVICE_REFRESH, jarray);
+    json_object_put(jarray);
+    return(rv);
+}
+
+static int
+synth_access_table(fko_srv_options_t *opts, const synth_size_t *size)
+{
+    json_object    *jarray, *jstanza;
+    char            key[MAX_KEY_LEN+1], hmac_key[MAX_KEY_LEN+1];
+    char            service_list[SYNTH_SERVICES_PER_STANZA * 12];
+    int             i, j, rv;
+
+    if((jarray = json_object_new_array()) == NULL)
+        return(FKO_ERROR_MEMORY_ALLOCATION);
+
+    for(i=0; i < size->stanzas; i++)
+    {
+        if((jstanza = json_object_new_object()) == NULL)
+        {
+            json_object_put(jarray);
+            return(FKO_ERROR_MEMORY_ALLOCATION);
+        }
+
+        service_list[0] = '\0';
+        for(j=0; j < synth_services_per_stanza(size->services); j++)
+            snprintf(service_list + strlen(service_list),
+                sizeof(service_list) - strlen(service_list), "%s%d",
+                j ? "," : "", synth_service_id(i, j, size->services));
+
+        synth_keys(i + 1, key, sizeof(key), hmac_key, sizeof(hmac_key));
+
+        json_object_object_add(jstanza, "sdp_id", json_object_new_int(i + 1));
+        json_object_object_add(jstanza, "source", json_object_new_string("ANY"));
+        json_object_object_add(jstanza, "require_source_address", json_object_new_string("Y"));
+        json_object_object_add(jstanza, "service_list", json_object_new_string(service_list));
+        json_object_object_add(jstanza, "spa_encryption_key", json_object_new_string(key));
+        json_object_object_add(jstanza, "spa_hmac_key", json_object_new_string(hmac_key));
+        json_object_object_add(jstanza, "hmac_type", json_object_new_string("sha256"));
+        json_object_array_add(jarray, jstanza);
+    }
+
+    rv = process_access_msg(opts, CTRL_ACTION_ACCESS_REFRESH, jarray);
+    json_object_put(jarray);
+    return(rv);
+}
+
+/* Stand in for the active grants with firewall timer wheel entries that
+ * only come due long after the run.
+*/
+static int
+synth_grants(const int grants)
+{
+    time_t  now = time(NULL);
+    int     i;
+
+    fw_timer_clear();
+
+    for(i=0; i < grants; i++)
+        if(! fw_timer_add_arg(now + SYNTH_GRANT_TIMEOUT + i % 600, NULL))
+            return(FKO_ERROR_MEMORY_ALLOCATION);
+
+    return(FWKNOPD_SUCCESS);
+}
+
+/* Build a service access request from a random client for one of the
+ * services its stanza allows.
+*/
+static int
+synth_packet(const synth_size_t *size, synth_pkt_t *pkt)
+{
+    fko_ctx_t       ctx = NULL;
+    char            key[MAX_KEY_LEN+1], hmac_key[MAX_KEY_LEN+1];
+    char            msg[MAX_IPV4_STR_LEN + 16];
+    char           *spa_data = NULL;
+    int             stanza, service, res;
+
+    stanza  = random() % size->stanzas;
+    service = synth_service_id(stanza,
+            random() % synth_services_per_stanza(size->services), size->services);
+
+    /* 10.0.0.1 - 10.255.255.254
+    */
+    pkt->src_ip = htonl(0x0a000001 + random() % 0xfffffe);
+
+    snprintf(msg, sizeof(msg), "%u.%u.%u.%u,%d",
+        (ntohl(pkt->src_ip) >> 24) & 0xff, (ntohl(pkt->src_ip) >> 16) & 0xff,
+        (ntohl(pkt->src_ip) >> 8) & 0xff, ntohl(pkt->src_ip) & 0xff, service);
+
+    synth_keys(stanza + 1, key, sizeof(key), hmac_key, sizeof(hmac_key));
+
+    if((res = fko_new(&ctx)) != FKO_SUCCESS)
+        return(res);
+
+    if((res = fko_set_disable_sdp_mode(ctx, 0)) == FKO_SUCCESS
+            && (res = fko_set_sdp_id(ctx, stanza + 1)) == FKO_SUCCESS
+            && (res = fko_set_spa_message_type(ctx, FKO_SERVICE_ACCESS_MSG)) == FKO_SUCCESS
+            && (res = fko_set_spa_message(ctx, msg)) == FKO_SUCCESS
+            && (res = fko_set_spa_hmac_type(ctx, FKO_HMAC_SHA256)) == FKO_SUCCESS
+            && (res = fko_spa_data_final(ctx, key, strlen(key),
+                    hmac_key, strlen(hmac_key))) == FKO_SUCCESS
+            && (res = fko_get_spa_data(ctx, &spa_data)) == FKO_SUCCESS)
+    {
+        if((pkt->data = strdup(spa_data)) == NULL)
+            res = FKO_ERROR_MEMORY_ALLOCATION;
+        else
+            pkt->len = strlen(pkt->data);
+    }
+
+    fko_destroy(ctx);
+    return(res);
+}
+
+static void
+free_synth_packets(synth_pkt_t *pkts, const int count)
+{
+    int     i;
+
+    for(i=0; i < count; i++)
+        free(pkts[i].data);
+    free(pkts);
+    return;
+}
+
+static int
+run_synth_size(fko_srv_options_t *opts, const synth_size_t *size)
+{
+    static spa_pkt_info_t   spa_pkt;
+    synth_pkt_t            *pkts;
+    struct timespec         ts;
+    char                    what[128];
+    int                     i, rv;
+
+    log_msg(LOG_INFO, "Benchmark: building %d stanzas, %d services and %d grants.",
+        size->stanzas, size->services, size->grants);
+
+    if((rv = synth_service_table(opts, size->services)) != FWKNOPD_SUCCESS
+            || (rv = synth_access_table(opts, size)) != FWKNOPD_SUCCESS
+            || (rv = synth_grants(size->grants)) != FWKNOPD_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Failed to build the synthetic tables: %d", rv);
+        return(-1);
+    }
+
+    if((pkts = calloc(size->packets, sizeof(synth_pkt_t))) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] Fatal memory allocation error.");
+        return(-1);
+    }
+
+    log_msg(LOG_INFO, "Benchmark: generating %d SPA packets.", size->packets);
+
+    for(i=0; i < size->packets; i++)
+    {
+        if((rv = synth_packet(size, &(pkts[i]))) != FKO_SUCCESS)
+        {
+            log_msg(LOG_ERR, "[*] Failed to generate SPA packet: %s",
+                fko_errstr(rv));
+            free_synth_packets(pkts, size->packets);
+            return(-1);
+        }
+    }
+
+    bench_enable();
+    bench_run_start();
+    clock_cache_update();
+
+    for(i=0; i < size->packets; i++)
+    {
+        spa_pkt.packet_data     = (unsigned char *)pkts[i].data;
+        spa_pkt.packet_data_len = pkts[i].len;
+        spa_pkt.packet_proto    = IPPROTO_UDP;
+        spa_pkt.packet_src_ip   = pkts[i].src_ip;
+        spa_pkt.packet_dst_ip   = htonl(INADDR_LOOPBACK);
+        spa_addr_set_ipv4(&spa_pkt.packet_src_addr, spa_pkt.packet_src_ip);
+        spa_addr_set_ipv4(&spa_pkt.packet_dst_addr, spa_pkt.packet_dst_ip);
+        spa_pkt.packet_src_port = 1024 + i % 60000;
+        spa_pkt.packet_dst_port = FKO_DEFAULT_PORT;
+        spa_pkt.sdp_id          = 0;
+        spa_pkt.arrival_time    = clock_cache_now();
+
+        bench_stage_start(&ts);
+        incoming_spa(opts, &spa_pkt);
+        bench_packet_end(&ts);
+    }
+
+    bench_run_end(size->packets);
+
+    snprintf(what, sizeof(what), "%d stanzas, %d services, %d grants",
+        size->stanzas, size->services, fw_timer_count());
+    bench_report(what, 0);
+
+    free_synth_packets(pkts, size->packets);
+    fw_timer_clear();
+
+    return(0);
+}
+
+/* Run the benchmark for each of the sizes in --benchmark-synth.
+*/
+int
+bench_synth_run(fko_srv_options_t *opts)
+{
+    synth_size_t    sizes[SYNTH_MAX_SIZES];
+    int             count, i;
+
+    if((count = parse_synth_sizes(opts->benchmark_synth, sizes)) <= 0)
+        return(-1);
+
+    /* The same packets for the same sizes on every run.
+    */
+    srandom(SYNTH_RANDOM_SEED);
+
+    for(i=0; i < count; i++)
+        if(run_synth_size(opts, &(sizes[i])) != 0)
+            return(-1);
+
+    return(0);
+}
+
+/***EOF***/
@@ -0,0 +1,56 @@
+/*
+ *****************************************************************************
+ *
+ * File:    bench_synth.h
+ *
+ * Purpose: Header file for bench_synth.c - the --benchmark-synth mode that
+ *          measures SPA processing against synthetic SDP tables.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef BENCH_SYNTH_H
+#define BENCH_SYNTH_H
+
+/* Defaults for the optional fields of a table size, and the most sizes
+ * one run takes.
+*/
+#define SYNTH_DEF_SERVICES          100
+#define SYNTH_DEF_GRANTS            0
+#define SYNTH_DEF_PACKETS           10000
+#define SYNTH_MAX_SIZES             16
+
+/* Each stanza may use up to this many services, and grants expire well
+ * after the run is over.
+*/
+#define SYNTH_SERVICES_PER_STANZA   4
+#define SYNTH_GRANT_TIMEOUT         3600
+#define SYNTH_RANDOM_SEED           0x66776b6e
+
+/* Prototypes
+*/
+int bench_synth_run(fko_srv_options_t *opts);
+
+#endif /* BENCH_SYNTH_H */
+
+/***EOF***/
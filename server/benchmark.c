@@ -0,0 +1,329 @@
+/*
+ *****************************************************************************
+ *
+ * File:    benchmark.c
+ *
+ * Purpose: Collects SPA processing throughput and per-stage latency
+ *          numbers in --benchmark mode and prints the final report.  The
+ *          timing hooks are no-ops unless benchmark mode is enabled.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "benchmark.h"
+#include "metrics.h"
+#include "spa_trace.h"
+
+#if HAVE_SYS_RESOURCE_H
+  #include <sys/resource.h>
+#endif
+
+typedef struct bench_hist
+{
+    unsigned long       count;
+    unsigned long long  sum_ns;
+    unsigned long long  max_ns;
+    unsigned long       buckets[BENCH_HIST_BUCKETS];
+} bench_hist_t;
+
+static const char *bench_stage_names[BENCH_STAGES] = {
+    "precheck",
+    "replay",
+    "queue",
+    "access",
+    "hmac",
+    "decrypt",
+    "service",
+    "firewall",
+    "cmd_cycle"
+};
+
+/* Benchmark mode only processes packets from the main thread, so none of
+ * this needs locking.
+*/
+static int              bench_enabled = 0;
+static bench_hist_t     bench_hists[BENCH_STAGES];
+static bench_hist_t     bench_pkt_hist;
+static struct timespec  bench_run_begin;
+static struct timespec  bench_run_finish;
+static unsigned long    bench_pkts = 0;
+static unsigned long    bench_trial_pkts = 0;
+static unsigned long    bench_trial_sum  = 0;
+static int              bench_trial_max  = 0;
+
+static unsigned long long
+elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+    return((unsigned long long)(end->tv_sec - start->tv_sec) * 1000000000ULL
+            + end->tv_nsec - start->tv_nsec);
+}
+
+/* Map a latency to its histogram bucket.  Values below
+ * BENCH_HIST_SUB_BUCKETS nanoseconds get a bucket each, above that each
+ * power of two is split into BENCH_HIST_SUB_BUCKETS linear buckets.
+*/
+int
+bench_hist_bucket(unsigned long long ns)
+{
+    int     msb = 0;
+
+    if(ns < BENCH_HIST_SUB_BUCKETS)
+        return((int)ns);
+
+    if(ns >= (1ULL << BENCH_HIST_MAX_BITS))
+        return(BENCH_HIST_BUCKETS - 1);
+
+    while((ns >> (msb + 1)) != 0)
+        msb++;
+
+    return((msb - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_SUB_BUCKETS
+            + (int)((ns >> (msb - BENCH_HIST_SUB_BITS)) & (BENCH_HIST_SUB_BUCKETS - 1)));
+}
+
+/* Smallest latency that maps to the given bucket.
+*/
+unsigned long long
+bench_hist_bucket_low(const int bucket)
+{
+    int     range = bucket / BENCH_HIST_SUB_BUCKETS;
+    int     sub   = bucket % BENCH_HIST_SUB_BUCKETS;
+
+    if(range == 0)
+        return(bucket);
+
+    return((unsigned long long)(BENCH_HIST_SUB_BUCKETS + sub)
+            << (range - 1));
+}
+
+static unsigned long long
+hist_percentile(const bench_hist_t *hist, const double pct)
+{
+    unsigned long   rank, seen = 0;
+    int             i;
+
+    if(hist->count == 0)
+        return(0);
+
+    rank = (unsigned long)(pct / 100.0 * hist->count);
+    if(rank >= hist->count)
+        rank = hist->count - 1;
+
+    for(i=0; i < BENCH_HIST_BUCKETS; i++)
+    {
+        seen += hist->buckets[i];
+        if(seen > rank)
+            break;
+    }
+
+    if(i >= BENCH_HIST_BUCKETS || bench_hist_bucket_low(i) > hist->max_ns)
+        return(hist->max_ns);
+
+    return(bench_hist_bucket_low(i));
+}
+
+static long
+peak_rss_kb(void)
+{
+#if HAVE_SYS_RESOURCE_H
+    struct rusage   ru;
+
+    if(getrusage(RUSAGE_SELF, &ru) != 0)
+        return(-1);
+
+  #if defined(__APPLE__)
+    return(ru.ru_maxrss / 1024);    /* bytes on OS X */
+  #else
+    return(ru.ru_maxrss);
+  #endif
+#else
+    return(-1);
+#endif
+}
+
+void
+bench_enable(void)
+{
+    memset(bench_hists, 0x0, sizeof(bench_hists));
+    memset(&bench_pkt_hist, 0x0, sizeof(bench_pkt_hist));
+    bench_pkts       = 0;
+    bench_trial_pkts = 0;
+    bench_trial_sum  = 0;
+    bench_trial_max  = 0;
+    bench_enabled    = 1;
+    return;
+}
+
+static void
+hist_record(bench_hist_t *hist, const unsigned long long ns)
+{
+    hist->count++;
+    hist->sum_ns += ns;
+    if(ns > hist->max_ns)
+        hist->max_ns = ns;
+    hist->buckets[bench_hist_bucket(ns)]++;
+    return;
+}
+
+const char *
+bench_stage_name(const bench_stage_t stage)
+{
+    return(stage < BENCH_STAGES ? bench_stage_names[stage] : "unknown");
+}
+
+/* Stages are timed in benchmark mode and while the metrics endpoint or
+ * the stats page is running.
+*/
+void
+bench_stage_start(struct timespec *start)
+{
+    if(bench_enabled || metrics_running())
+        clock_gettime(CLOCK_MONOTONIC, start);
+    return;
+}
+
+void
+bench_stage_end(const bench_stage_t stage, const struct timespec *start)
+{
+    struct timespec     now;
+    unsigned long long  ns;
+
+    if(stage >= BENCH_STAGES || (! bench_enabled && ! metrics_running()))
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = elapsed_ns(start, &now);
+
+    metrics_observe(stage, ns);
+    spa_trace_stage(stage, ns);
+
+    if(bench_enabled)
+        hist_record(&(bench_hists[stage]), ns);
+
+    return;
+}
+
+/* End to end time for one packet, start is from bench_stage_start().
+*/
+void
+bench_packet_end(const struct timespec *start)
+{
+    struct timespec     now;
+
+    if(! bench_enabled)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    hist_record(&bench_pkt_hist, elapsed_ns(start, &now));
+    return;
+}
+
+/* Record how many stanza keys were tried for one packet.
+*/
+void
+bench_trial_decrypts(const int count)
+{
+    if(! bench_enabled)
+        return;
+
+    bench_trial_pkts++;
+    bench_trial_sum += count;
+    if(count > bench_trial_max)
+        bench_trial_max = count;
+
+    return;
+}
+
+void
+bench_run_start(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &bench_run_begin);
+    return;
+}
+
+void
+bench_run_end(const unsigned long pkts)
+{
+    clock_gettime(CLOCK_MONOTONIC, &bench_run_finish);
+    bench_pkts = pkts;
+    return;
+}
+
+static void
+report_row(const char *name, const bench_hist_t *hist)
+{
+    fprintf(stdout, "  %-10s %10lu %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+        name, hist->count,
+        hist->count ? (double)hist->sum_ns / hist->count / 1000.0 : 0.0,
+        hist_percentile(hist, 50.0) / 1000.0,
+        hist_percentile(hist, 90.0) / 1000.0,
+        hist_percentile(hist, 99.0) / 1000.0,
+        hist->max_ns / 1000.0);
+    return;
+}
+
+/* Print the throughput, per-stage and per-packet latency percentiles (in
+ * microseconds), the number of trial decryptions per packet and peak RSS
+ * to stdout.  The loop count is left out when loops is 0.
+*/
+void
+bench_report(const char *what, const int loops)
+{
+    double              secs;
+    long                rss;
+    int                 i;
+
+    secs = elapsed_ns(&bench_run_begin, &bench_run_finish) / 1e9;
+
+    if(loops > 0)
+        fprintf(stdout, "\nfwknopd benchmark: %s (%d loop%s)\n",
+            what, loops, loops == 1 ? "" : "s");
+    else
+        fprintf(stdout, "\nfwknopd benchmark: %s\n", what);
+    fprintf(stdout, "  packets:    %lu\n", bench_pkts);
+    fprintf(stdout, "  elapsed:    %.3f sec\n", secs);
+    fprintf(stdout, "  throughput: %.0f packets/sec\n",
+        secs > 0 ? bench_pkts / secs : 0.0);
+
+    fprintf(stdout, "\n  %-10s %10s %10s %10s %10s %10s %10s\n",
+        "stage", "count", "mean(us)", "p50(us)", "p90(us)", "p99(us)", "max(us)");
+
+    for(i=0; i < BENCH_STAGES; i++)
+        report_row(bench_stage_names[i], &(bench_hists[i]));
+
+    if(bench_pkt_hist.count > 0)
+        report_row("packet", &bench_pkt_hist);
+
+    fprintf(stdout, "\n  trial decryptions: %.2f per packet (max %d)\n",
+        bench_trial_pkts ? (double)bench_trial_sum / bench_trial_pkts : 0.0,
+        bench_trial_max);
+
+    if((rss = peak_rss_kb()) >= 0)
+        fprintf(stdout, "\n  peak RSS:   %ld KB\n", rss);
+
+    fprintf(stdout, "\n");
+    fflush(stdout);
+    return;
+}
+
+/***EOF***/
@@ -0,0 +1,84 @@
+/*
+ *****************************************************************************
+ *
+ * File:    benchmark.h
+ *
+ * Purpose: Header file for benchmark.c - SPA processing throughput and
+ *          per-stage latency measurements for --benchmark mode.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <time.h>
+
+/* The SPA processing stages that are timed in benchmark mode and while
+ * the metrics endpoint or the stats page is running.  ACCESS is the stanza lookup
+ * (src_check() or sdp_id_check()), SERVICE the port or service
+ * permission check, FIREWALL applying the grant and CMD_CYCLE running
+ * a command cycle's open command.  QUEUE is the time a packet waited
+ * for an SPA worker, so it is only seen with SPA_WORKERS.
+*/
+typedef enum {
+    BENCH_STAGE_PRECHECK = 0,
+    BENCH_STAGE_REPLAY,
+    BENCH_STAGE_QUEUE,
+    BENCH_STAGE_ACCESS,
+    BENCH_STAGE_HMAC,
+    BENCH_STAGE_DECRYPT,
+    BENCH_STAGE_SERVICE,
+    BENCH_STAGE_FIREWALL,
+    BENCH_STAGE_CMD_CYCLE,
+    BENCH_STAGES
+} bench_stage_t;
+
+/* Latencies are kept in log-linear histogram buckets rather than as raw
+ * samples so that memory use (and so the peak RSS we report) does not
+ * grow with the number of packets.  Each power of two is split into
+ * BENCH_HIST_SUB_BUCKETS buckets, which is good to about 3%.
+*/
+#define BENCH_HIST_SUB_BITS         5
+#define BENCH_HIST_SUB_BUCKETS      (1 << BENCH_HIST_SUB_BITS)
+#define BENCH_HIST_MAX_BITS         40  /* ~18 minutes in nanoseconds */
+#define BENCH_HIST_BUCKETS          ((BENCH_HIST_MAX_BITS - BENCH_HIST_SUB_BITS + 1) \
+                                        * BENCH_HIST_SUB_BUCKETS)
+
+/* Prototypes
+*/
+void bench_enable(void);
+const char *bench_stage_name(const bench_stage_t stage);
+int bench_hist_bucket(unsigned long long ns);
+unsigned long long bench_hist_bucket_low(const int bucket);
+void bench_stage_start(struct timespec *start);
+void bench_stage_end(const bench_stage_t stage, const struct timespec *start);
+void bench_packet_end(const struct timespec *start);
+void bench_trial_decrypts(const int count);
+void bench_run_start(void);
+void bench_run_end(const unsigned long pkts);
+void bench_report(const char *what, const int loops);
+
+#endif /* BENCHMARK_H */
+
+/***EOF***/
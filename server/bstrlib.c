@@ -29,6 +29,12 @@
 #include "memdbg.h"
 #endif
 
+/* fwknopd accounts for bstring memory under its own tag (see mem_acct.c) */
+#include "mem_acct.h"
+#define bstr__alloc(x)      mem_malloc (MEM_TAG_BSTRING, (x))
+#define bstr__free(p)       mem_free (MEM_TAG_BSTRING, (p))
+#define bstr__realloc(p,x)  mem_realloc (MEM_TAG_BSTRING, (p), (x))
+
 #ifndef bstr__alloc
 #if defined (BSTRLIB_TEST_CANARY)
 void* bstr__alloc (size_t sz) {
@@ -0,0 +1,1002 @@
+/*
+ *****************************************************************************
+ *
+ * File:    cluster.c
+ *
+ * Purpose: Placement of SDP clients across a pool of gateways.  The
+ *          controller places each SDP ID on one gateway with consistent
+ *          hashing, and a gateway that receives an SPA packet for an SDP
+ *          ID it does not hold forwards the packet to the one that does.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "cluster.h"
+#include "incoming_spa.h"
+#include "service.h"
+#include "fw_util.h"
+#include "spa_arena.h"
+#include "fwknopd_errors.h"
+#include "log_msg.h"
+#include "utils.h"
+#include "rcu.h"
+#include "cpu_affinity.h"
+
+#if HAVE_SYS_SOCKET_H
+  #include <sys/socket.h>
+#endif
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+typedef struct cluster_member
+{
+    char                    id[CLUSTER_MAX_ID_LEN+1];
+    struct sockaddr_storage addr;
+    socklen_t               addr_len;
+} cluster_member_t;
+
+typedef struct cluster_point
+{
+    uint64_t                point;
+    int                     member;
+} cluster_point_t;
+
+/* Published with rcu_assign_pointer() by the control client thread and
+ * read on the packet path.
+*/
+typedef struct cluster_ring
+{
+    int64_t                 version;
+    int                     self;
+    int                     num_members;
+    cluster_member_t       *members;
+    int                     num_points;
+    cluster_point_t        *points;
+} cluster_ring_t;
+
+typedef struct cluster_pending
+{
+    uint64_t                token;
+    time_t                  expires;
+    int                     member;
+} cluster_pending_t;
+
+static cluster_ring_t          *cl_ring = NULL;
+
+static int                      cl_active = 0;
+static volatile int             cl_stop = 0;
+static int                      cl_sock = -1;
+static pthread_t                cl_thread;
+static fko_srv_options_t       *cl_opts = NULL;
+static char                    *cl_key = NULL;
+static int                      cl_key_len = 0;
+
+static cluster_pending_t        cl_pending[CLUSTER_PENDING_SLOTS];
+static pthread_mutex_t          cl_pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Never holds any NAT settings, see cl_handle_grant().
+*/
+static acc_stanza_cold_t        cl_grant_cold;
+static acc_stanza_t             cl_grant_acc;
+
+static void
+cl_put_u16(unsigned char *p, const uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+    return;
+}
+
+static uint16_t
+cl_get_u16(const unsigned char *p)
+{
+    return((p[0] << 8) | p[1]);
+}
+
+static void
+cl_put_u32(unsigned char *p, const uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+    return;
+}
+
+static uint32_t
+cl_get_u32(const unsigned char *p)
+{
+    return(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+            | ((uint32_t)p[2] << 8) | p[3]);
+}
+
+static void
+cl_put_u64(unsigned char *p, uint64_t v)
+{
+    int     i;
+
+    for(i=7; i >= 0; i--)
+    {
+        p[i] = v & 0xff;
+        v >>= 8;
+    }
+    return;
+}
+
+static uint64_t
+cl_get_u64(const unsigned char *p)
+{
+    uint64_t    v = 0;
+    int         i;
+
+    for(i=0; i < 8; i++)
+        v = (v << 8) | p[i];
+    return(v);
+}
+
+/* Ring position of a string: the first 8 bytes of its SHA-256.
+*/
+static uint64_t
+cl_point(const char *str)
+{
+    unsigned char   md[SHA256_DIGEST_LENGTH];
+
+    SHA256((const unsigned char *)str, strlen(str), md);
+    return(cl_get_u64(md));
+}
+
+static int
+cl_point_cmp(const void *a, const void *b)
+{
+    const cluster_point_t  *pa = a, *pb = b;
+
+    if(pa->point != pb->point)
+        return(pa->point < pb->point ? -1 : 1);
+
+    /* Ties are broken the same way everywhere, by member order.
+    */
+    return(pa->member - pb->member);
+}
+
+static int
+cl_mac(const unsigned char *msg, const size_t len, unsigned char *mac)
+{
+    unsigned int    mac_len = 0;
+
+    if(HMAC(EVP_sha256(), cl_key, cl_key_len, msg, len, mac, &mac_len) == NULL
+            || mac_len != CLUSTER_MAC_LEN)
+        return(-1);
+
+    return(0);
+}
+
+/* The address family goes on the wire as the IP version, since the AF_*
+ * values differ between platforms.
+*/
+static unsigned char
+cl_family_to_ver(const unsigned char family)
+{
+    return(family == AF_INET6 ? 6 : 4);
+}
+
+static int
+cl_ver_to_family(const unsigned char ver)
+{
+    if(ver == 4)
+        return(AF_INET);
+    if(ver == 6)
+        return(AF_INET6);
+    return(-1);
+}
+
+static void
+cl_free_ring(cluster_ring_t *ring)
+{
+    if(ring == NULL)
+        return;
+
+    free(ring->members);
+    free(ring->points);
+    free(ring);
+    return;
+}
+
+/* Returns the ring member a message came from, or -1.  Must be called
+ * inside an RCU read-side section.
+*/
+static int
+cl_member_index(const cluster_ring_t *ring, const struct sockaddr_storage *from)
+{
+    const struct sockaddr_storage  *m;
+    int                             i;
+
+    if(ring == NULL)
+        return(-1);
+
+    for(i=0; i < ring->num_members; i++)
+    {
+        m = &(ring->members[i].addr);
+        if(m->ss_family != from->ss_family || i == ring->self)
+            continue;
+
+        if(from->ss_family == AF_INET
+                && ((const struct sockaddr_in *)m)->sin_addr.s_addr
+                    == ((const struct sockaddr_in *)from)->sin_addr.s_addr)
+            return(i);
+
+        if(from->ss_family == AF_INET6
+                && memcmp(&(((const struct sockaddr_in6 *)m)->sin6_addr),
+                    &(((const struct sockaddr_in6 *)from)->sin6_addr),
+                    sizeof(struct in6_addr)) == 0)
+            return(i);
+    }
+    return(-1);
+}
+
+/* Fill in the header and MAC of a message whose body is already in
+ * place, and send it.
+*/
+static int
+cl_send_msg(unsigned char *msg, const size_t body_len, const unsigned char type,
+        const uint64_t token, const cluster_member_t *to)
+{
+    size_t  len = CLUSTER_HDR_LEN + body_len;
+
+    memcpy(msg, CLUSTER_MAGIC, 4);
+    msg[4] = CLUSTER_VERSION;
+    msg[5] = type;
+    msg[6] = 0;
+    msg[7] = 0;
+    cl_put_u64(msg + 8, token);
+
+    if(cl_mac(msg, len, msg + len) != 0)
+        return(-1);
+
+    if(sendto(cl_sock, msg, len + CLUSTER_MAC_LEN, 0,
+            (const struct sockaddr *)&(to->addr), to->addr_len) < 0)
+        return(-1);
+
+    return(0);
+}
+
+/* Check a grant's token against the packets we forwarded, and forget it
+ * so that the same grant cannot be used twice.
+*/
+static int
+cl_pending_take(const uint64_t token, const int member)
+{
+    cluster_pending_t  *p = &(cl_pending[token % CLUSTER_PENDING_SLOTS]);
+    int                 rv = 0;
+
+    pthread_mutex_lock(&cl_pending_mutex);
+    if(p->token == token && p->member == member && p->expires >= time(NULL))
+    {
+        memset(p, 0x0, sizeof(*p));
+        rv = 1;
+    }
+    pthread_mutex_unlock(&cl_pending_mutex);
+
+    return(rv);
+}
+
+/* A packet forwarded by the gateway that received it.  It goes through
+ * the normal SPA processing with its original addresses, and a grant is
+ * sent back instead of changing our own firewall (see take_spa_action()).
+*/
+static void
+cl_handle_forward(const unsigned char *msg, const ssize_t len, const int member)
+{
+    spa_pkt_info_t      spa_pkt;
+    unsigned int        data_len;
+    int                 src_family, dst_family;
+
+    if(len < CLUSTER_HDR_LEN + CLUSTER_FWD_HDR_LEN + CLUSTER_MAC_LEN)
+        return;
+
+    data_len   = cl_get_u16(msg + 56);
+    src_family = cl_ver_to_family(msg[48]);
+    dst_family = cl_ver_to_family(msg[49]);
+
+    if(data_len < MIN_SPA_DATA_SIZE || data_len > MAX_SPA_PACKET_LEN
+            || len != CLUSTER_HDR_LEN + CLUSTER_FWD_HDR_LEN + data_len + CLUSTER_MAC_LEN
+            || src_family < 0 || dst_family < 0)
+        return;
+
+    memset(&spa_pkt, 0x0, sizeof(spa_pkt));
+    spa_pkt.packet_src_addr.family = src_family;
+    memcpy(spa_pkt.packet_src_addr.addr, msg + 16, 16);
+    spa_pkt.packet_dst_addr.family = dst_family;
+    memcpy(spa_pkt.packet_dst_addr.addr, msg + 32, 16);
+    if(src_family == AF_INET)
+        memcpy(&(spa_pkt.packet_src_ip), msg + 16, 4);
+    if(dst_family == AF_INET)
+        memcpy(&(spa_pkt.packet_dst_ip), msg + 32, 4);
+    spa_pkt.packet_proto    = msg[50];
+    spa_pkt.packet_src_port = cl_get_u16(msg + 52);
+    spa_pkt.packet_dst_port = cl_get_u16(msg + 54);
+
+    memcpy(spa_pkt.packet_buf, msg + CLUSTER_HDR_LEN + CLUSTER_FWD_HDR_LEN, data_len);
+    spa_pkt.packet_buf[data_len] = '\0';
+    spa_pkt.packet_data     = spa_pkt.packet_buf;
+    spa_pkt.packet_data_len = data_len;
+
+    spa_pkt.cluster_origin  = member + 1;
+    spa_pkt.cluster_token   = cl_get_u64(msg + 8);
+    spa_pkt.arrival_time    = clock_cache_update();
+
+    incoming_spa(cl_opts, &spa_pkt);
+    return;
+}
+
+/* A grant for a packet we forwarded.  There is no access stanza for the
+ * SDP ID here, so the rules are added with one that has no NAT settings
+ * (the owner does not grant on our behalf for a stanza that has any).
+*/
+static void
+cl_handle_grant(const unsigned char *msg, const ssize_t len, const int member)
+{
+    fw_grant_t      grants[CLUSTER_MAX_SERVICES];
+    spa_arena_t    *arena;
+    char            src_ip[MAX_IPV4_STR_LEN];
+    char            dst_ip[MAX_IPV46_STR_LEN];
+    uint32_t        sdp_id, timeout;
+    int             num_svcs, num_grants = 0, failed = 0, i;
+
+    if(len < CLUSTER_HDR_LEN + CLUSTER_GRANT_HDR_LEN + CLUSTER_MAC_LEN)
+        return;
+
+    num_svcs = cl_get_u16(msg + 24);
+    if(num_svcs < 1 || num_svcs > CLUSTER_MAX_SERVICES
+            || len != CLUSTER_HDR_LEN + CLUSTER_GRANT_HDR_LEN + num_svcs * 4 + CLUSTER_MAC_LEN)
+        return;
+
+    if(! cl_pending_take(cl_get_u64(msg + 8), member))
+    {
+        log_msg(LOG_WARNING | LOG_RATE_LIMIT,
+            "Ignoring a cluster grant that does not answer a forwarded packet");
+        return;
+    }
+
+    sdp_id  = cl_get_u32(msg + 16);
+    timeout = cl_get_u32(msg + 20);
+
+    memcpy(src_ip, msg + 28, sizeof(src_ip));
+    src_ip[sizeof(src_ip)-1] = '\0';
+    memcpy(dst_ip, msg + 44, sizeof(dst_ip));
+    dst_ip[sizeof(dst_ip)-1] = '\0';
+
+    if(! is_valid_ipv4_addr(src_ip) || timeout == 0
+            || timeout > RCHK_MAX_FW_TIMEOUT)
+        return;
+
+    if((arena = spa_arena_get()) == NULL)
+        return;
+
+    // the service data stays put until the grants are installed
+    rcu_read_lock();
+
+    for(i=0; i < num_svcs; i++)
+    {
+        memset(&(grants[num_grants]), 0x0, sizeof(fw_grant_t));
+        if(get_service_data(cl_opts, arena, cl_get_u32(msg + 92 + i * 4),
+                    &(grants[num_grants].service)) != FWKNOPD_SUCCESS)
+            continue;
+
+        grants[num_grants].acc     = &cl_grant_acc;
+        grants[num_grants].sdp_id  = sdp_id;
+        grants[num_grants].timeout = timeout;
+        strlcpy(grants[num_grants].src_ip, src_ip, sizeof(grants[num_grants].src_ip));
+        strlcpy(grants[num_grants].dst_ip, dst_ip, sizeof(grants[num_grants].dst_ip));
+        num_grants++;
+    }
+
+    if(num_grants > 0)
+    {
+        if(pthread_mutex_lock(&(cl_opts->spa_grant_mutex)))
+            log_msg(LOG_ERR, "Mutex lock error.");
+        else
+        {
+            failed = fw_install_grants(cl_opts, grants, num_grants);
+            pthread_mutex_unlock(&(cl_opts->spa_grant_mutex));
+        }
+
+        log_msg(LOG_INFO, "Installed %d of %d services granted to SDP ID %"PRIu32
+                " by cluster member %d", num_grants - failed, num_svcs, sdp_id, member);
+    }
+
+    rcu_read_unlock();
+    spa_arena_reset(arena);
+    return;
+}
+
+static void
+cl_handle_msg(const unsigned char *msg, const ssize_t len,
+        const struct sockaddr_storage *from)
+{
+    unsigned char   mac[CLUSTER_MAC_LEN];
+    int             member;
+
+    if(len < CLUSTER_HDR_LEN + CLUSTER_MAC_LEN
+            || memcmp(msg, CLUSTER_MAGIC, 4) != 0
+            || msg[4] != CLUSTER_VERSION
+            || msg[5] > CLUSTER_MSG_GRANT)
+        return;
+
+    rcu_read_lock();
+    member = cl_member_index(rcu_dereference(cl_ring), from);
+    rcu_read_unlock();
+
+    if(member < 0)
+    {
+        if(cl_opts->verbose)
+            log_msg(LOG_DEBUG, "Ignoring a cluster message from a non-member");
+        return;
+    }
+
+    if(cl_mac(msg, len - CLUSTER_MAC_LEN, mac) != 0
+            || constant_runtime_cmp((char *)mac,
+                (char *)msg + len - CLUSTER_MAC_LEN, CLUSTER_MAC_LEN) != 0)
+    {
+        log_msg(LOG_WARNING, "Cluster message failed authentication");
+        return;
+    }
+
+    if(msg[5] == CLUSTER_MSG_FORWARD)
+        cl_handle_forward(msg, len, member);
+    else
+        cl_handle_grant(msg, len, member);
+
+    return;
+}
+
+static void *
+cl_recv_thread(void *arg)
+{
+    unsigned char           msg[CLUSTER_MAX_MSG_LEN];
+    struct sockaddr_storage from;
+    socklen_t               from_len;
+    sigset_t                mask;
+    ssize_t                 len;
+
+    (void)arg;
+
+    /* Leave signal handling to the main thread.
+    */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    cpu_affinity_set(CPU_ROLE_HOUSEKEEPING);
+
+    while(! cl_stop)
+    {
+        from_len = sizeof(from);
+        len = recvfrom(cl_sock, msg, sizeof(msg), 0,
+                (struct sockaddr *)&from, &from_len);
+        if(len < 0)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                log_msg(LOG_WARNING, "Cluster recvfrom() error: %s",
+                    strerror(errno));
+            continue;
+        }
+        cl_handle_msg(msg, len, &from);
+    }
+    return(NULL);
+}
+
+static void
+cl_free(void)
+{
+    if(cl_sock != -1)
+        close(cl_sock);
+    cl_sock = -1;
+
+    if(cl_key != NULL)
+    {
+        memset(cl_key, 0x0, cl_key_len);
+        free(cl_key);
+    }
+    cl_key     = NULL;
+    cl_key_len = 0;
+
+    pthread_mutex_lock(&cl_pending_mutex);
+    memset(cl_pending, 0x0, sizeof(cl_pending));
+    pthread_mutex_unlock(&cl_pending_mutex);
+    return;
+}
+
+/* Start the cluster socket if CLUSTER_PORT is set.  Returns 0 on success
+ * (including when the cluster is disabled) and -1 on error.
+*/
+int
+cluster_start(fko_srv_options_t *opts)
+{
+    struct sockaddr_storage addr;
+    struct timeval          tv;
+    int                     port, is_err, family, on = 1, off = 0;
+
+    cl_active = 0;
+
+    port = strtol_wrapper(opts->config[CONF_CLUSTER_PORT],
+            0, RCHK_MAX_CLUSTER_PORT, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid CLUSTER_PORT value.");
+        return(-1);
+    }
+
+    if(port == 0)
+        return(0);
+
+    if(! opts->rt->sdp_mode)
+    {
+        log_msg(LOG_ERR, "[*] CLUSTER_PORT requires SDP mode.");
+        return(-1);
+    }
+
+    if(opts->config[CONF_CLUSTER_KEY] == NULL
+            || strlen(opts->config[CONF_CLUSTER_KEY]) < CLUSTER_MIN_KEY_LEN)
+    {
+        log_msg(LOG_ERR, "[*] CLUSTER_KEY must be at least %i characters.",
+            CLUSTER_MIN_KEY_LEN);
+        return(-1);
+    }
+
+    if((cl_key = strdup(opts->config[CONF_CLUSTER_KEY])) == NULL)
+    {
+        log_msg(LOG_ERR, "cluster_start: strdup() failed");
+        return(-1);
+    }
+    cl_key_len = strlen(cl_key);
+
+    memset(&cl_grant_cold, 0x0, sizeof(cl_grant_cold));
+    memset(&cl_grant_acc, 0x0, sizeof(cl_grant_acc));
+    cl_grant_acc.cold = &cl_grant_cold;
+
+    family = opts->enable_ipv6 ? AF_INET6 : AF_INET;
+
+    memset(&addr, 0x0, sizeof(addr));
+    if(family == AF_INET6)
+    {
+        ((struct sockaddr_in6 *)&addr)->sin6_family = AF_INET6;
+        ((struct sockaddr_in6 *)&addr)->sin6_addr   = in6addr_any;
+        ((struct sockaddr_in6 *)&addr)->sin6_port   = htons(port);
+    }
+    else
+    {
+        ((struct sockaddr_in *)&addr)->sin_family      = AF_INET;
+        ((struct sockaddr_in *)&addr)->sin_addr.s_addr = htonl(INADDR_ANY);
+        ((struct sockaddr_in *)&addr)->sin_port        = htons(port);
+    }
+
+    /* Wake up once a second to see if we should stop.
+    */
+    tv.tv_sec  = 1;
+    tv.tv_usec = 0;
+
+    if((cl_sock = socket(family, SOCK_DGRAM, 0)) < 0
+            || setsockopt(cl_sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0
+            || (family == AF_INET6
+                && setsockopt(cl_sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) != 0)
+            || setsockopt(cl_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0
+            || bind(cl_sock, (struct sockaddr *)&addr,
+                family == AF_INET6 ? sizeof(struct sockaddr_in6)
+                    : sizeof(struct sockaddr_in)) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Unable to set up cluster socket on port %i: %s",
+            port, strerror(errno));
+        cl_free();
+        return(-1);
+    }
+
+    cl_opts = opts;
+    cl_stop = 0;
+
+    if(pthread_create(&cl_thread, NULL, cl_recv_thread, NULL) != 0)
+    {
+        log_msg(LOG_ERR, "cluster_start: failed to start receive thread");
+        cl_free();
+        return(-1);
+    }
+
+    cl_active = 1;
+
+    log_msg(LOG_INFO, "Forwarding SPA packets between cluster members on UDP port %i.",
+        port);
+
+    return(0);
+}
+
+/* Stop the receive thread and close the socket.  The ring stays, it
+ * belongs to the control client.
+*/
+void
+cluster_stop(void)
+{
+    if(! cl_active)
+        return;
+
+    cl_active = 0;
+    cl_stop   = 1;
+
+    if(! pthread_equal(cl_thread, pthread_self()))
+        pthread_join(cl_thread, NULL);
+
+    cl_free();
+    return;
+}
+
+/* Free the ring at exit, once nothing can be reading it.
+*/
+void
+cluster_ring_free(void)
+{
+    cluster_ring_t *ring = cl_ring;
+
+    rcu_assign_pointer(cl_ring, NULL);
+    cl_free_ring(ring);
+    return;
+}
+
+/* Resolve one member's address to the family of the cluster socket.
+*/
+static int
+cl_member_addr(const fko_srv_options_t *opts, cluster_member_t *member,
+        const char *address)
+{
+    struct addrinfo     hints, *res = NULL;
+    int                 rv;
+
+    memset(&hints, 0x0, sizeof(hints));
+    hints.ai_family   = opts->enable_ipv6 ? AF_INET6 : AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags    = AI_NUMERICHOST | AI_NUMERICSERV;
+    if(hints.ai_family == AF_INET6)
+        hints.ai_flags |= AI_V4MAPPED;
+
+    if((rv = getaddrinfo(address, opts->config[CONF_CLUSTER_PORT], &hints, &res)) != 0)
+    {
+        log_msg(LOG_ERR, "Invalid address '%s' for cluster member %s: %s",
+            address, member->id, gai_strerror(rv));
+        return(-1);
+    }
+
+    memcpy(&(member->addr), res->ai_addr, res->ai_addrlen);
+    member->addr_len = res->ai_addrlen;
+
+    freeaddrinfo(res);
+    return(0);
+}
+
+/* Build a ring from a controller "cluster_update" message.
+*/
+static int
+cl_build_ring(const fko_srv_options_t *opts, json_object *jdata,
+        cluster_ring_t **r_ring)
+{
+    cluster_ring_t     *ring = NULL;
+    json_object        *jobj = NULL, *jmembers = NULL, *jentry = NULL, *jaddr = NULL;
+    const char         *self = NULL;
+    char                vnode[CLUSTER_MAX_ID_LEN+16];
+    int                 vnodes = CLUSTER_DEF_VNODES;
+    int                 i, v, n;
+
+    if(json_object_get_type(jdata) != json_type_object
+            || !json_object_object_get_ex(jdata, "self", &jobj)
+            || json_object_get_type(jobj) != json_type_string
+            || !json_object_object_get_ex(jdata, "members", &jmembers)
+            || json_object_get_type(jmembers) != json_type_array)
+    {
+        log_msg(LOG_ERR, "Cluster update is missing required fields");
+        return(FWKNOPD_ERROR_BAD_MSG);
+    }
+    self = json_object_get_string(jobj);
+
+    if(json_object_object_get_ex(jdata, "vnodes", &jobj))
+        vnodes = json_object_get_int(jobj);
+
+    n = json_object_array_length(jmembers);
+    if(n < 1 || n > CLUSTER_MAX_MEMBERS || vnodes < 1 || vnodes > CLUSTER_MAX_VNODES)
+    {
+        log_msg(LOG_ERR, "Cluster update has %d members and %d vnodes, "
+                "must be 1-%d and 1-%d", n, vnodes, CLUSTER_MAX_MEMBERS, CLUSTER_MAX_VNODES);
+        return(FWKNOPD_ERROR_BAD_MSG);
+    }
+
+    if((ring = calloc(1, sizeof(cluster_ring_t))) == NULL
+            || (ring->members = calloc(n, sizeof(cluster_member_t))) == NULL
+            || (ring->points = calloc(n * vnodes, sizeof(cluster_point_t))) == NULL)
+    {
+        cl_free_ring(ring);
+        return(FWKNOPD_ERROR_MEMORY_ALLOCATION);
+    }
+
+    ring->self = -1;
+    if(json_object_object_get_ex(jdata, "version", &jobj))
+        ring->version = json_object_get_int64(jobj);
+
+    for(i=0; i < n; i++)
+    {
+        jentry = json_object_array_get_idx(jmembers, i);
+        if(json_object_get_type(jentry) != json_type_object
+                || !json_object_object_get_ex(jentry, "id", &jobj)
+                || json_object_get_type(jobj) != json_type_string
+                || strlen(json_object_get_string(jobj)) > CLUSTER_MAX_ID_LEN
+                || !json_object_object_get_ex(jentry, "address", &jaddr)
+                || json_object_get_type(jaddr) != json_type_string)
+        {
+            log_msg(LOG_ERR, "Cluster update member %d is not valid", i + 1);
+            cl_free_ring(ring);
+            return(FWKNOPD_ERROR_BAD_MSG);
+        }
+
+        strlcpy(ring->members[i].id, json_object_get_string(jobj),
+            sizeof(ring->members[i].id));
+
+        if(cl_member_addr(opts, &(ring->members[i]), json_object_get_string(jaddr)) != 0)
+        {
+            cl_free_ring(ring);
+            return(FWKNOPD_ERROR_BAD_MSG);
+        }
+
+        if(strcmp(ring->members[i].id, self) == 0)
+            ring->self = i;
+
+        for(v=0; v < vnodes; v++)
+        {
+            snprintf(vnode, sizeof(vnode), "%s#%d", ring->members[i].id, v);
+            ring->points[ring->num_points].point  = cl_point(vnode);
+            ring->points[ring->num_points].member = i;
+            ring->num_points++;
+        }
+    }
+    ring->num_members = n;
+
+    if(ring->self < 0)
+    {
+        log_msg(LOG_ERR, "Cluster update does not list this gateway (%s)", self);
+        cl_free_ring(ring);
+        return(FWKNOPD_ERROR_BAD_MSG);
+    }
+
+    qsort(ring->points, ring->num_points, sizeof(cluster_point_t), cl_point_cmp);
+
+    *r_ring = ring;
+    return(FWKNOPD_SUCCESS);
+}
+
+/* Install the ring from a controller "cluster_update" message.  A new
+ * ring changes which access stanzas this gateway holds, so a full access
+ * refresh is requested.
+*/
+int
+cluster_update(fko_srv_options_t *opts, json_object *jdata)
+{
+    cluster_ring_t *ring = NULL, *old = cl_ring;
+    int             rv;
+
+    if(strcmp(opts->config[CONF_CLUSTER_PORT], "0") == 0)
+    {
+        log_msg(LOG_WARNING, "Ignoring cluster update from controller, CLUSTER_PORT is not set");
+        return(FWKNOPD_SUCCESS);
+    }
+
+    if((rv = cl_build_ring(opts, jdata, &ring)) != FWKNOPD_SUCCESS)
+        return(rv);
+
+    if(old != NULL && old->version != 0 && old->version == ring->version)
+    {
+        cl_free_ring(ring);
+        return(FWKNOPD_SUCCESS);
+    }
+
+    rcu_assign_pointer(cl_ring, ring);
+    rcu_synchronize();
+    cl_free_ring(old);
+
+    log_msg(LOG_INFO, "Cluster version %lld: %d members, this gateway is %s",
+        (long long)ring->version, ring->num_members, ring->members[ring->self].id);
+
+    if(opts->ctrl_client != NULL)
+        sdp_ctrl_client_data_resync(opts->ctrl_client, CTRL_ACTION_ACCESS_REFRESH);
+
+    return(FWKNOPD_SUCCESS);
+}
+
+/* Returns the ring member that holds an SDP ID, or -1 if it is this
+ * gateway or there is no cluster.
+*/
+int
+cluster_owner(const uint32_t sdp_id)
+{
+    cluster_ring_t *ring;
+    char            key[16];
+    uint64_t        point;
+    int             lo, hi, mid, owner;
+
+    if(rcu_dereference(cl_ring) == NULL)
+        return(-1);
+
+    snprintf(key, sizeof(key), "%"PRIu32, sdp_id);
+    point = cl_point(key);
+
+    rcu_read_lock();
+
+    if((ring = rcu_dereference(cl_ring)) == NULL)
+    {
+        rcu_read_unlock();
+        return(-1);
+    }
+
+    /* First point at or after the key's, wrapping around.
+    */
+    lo = 0;
+    hi = ring->num_points;
+    while(lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if(ring->points[mid].point < point)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if(lo == ring->num_points)
+        lo = 0;
+
+    owner = ring->points[lo].member;
+    if(owner == ring->self)
+        owner = -1;
+
+    rcu_read_unlock();
+    return(owner);
+}
+
+/* Whether this instance holds the access data for an SDP ID, taking both
+ * SDP_SHARD_COUNT and the cluster ring into account.
+*/
+int
+cluster_sdp_id_local(const fko_srv_options_t *opts, const uint32_t sdp_id)
+{
+    return(SDP_SHARD_OWNS(opts->rt, sdp_id) && cluster_owner(sdp_id) < 0);
+}
+
+/* Hand an SPA packet to the ring member that holds its SDP ID.
+*/
+void
+cluster_forward(const spa_pkt_info_t *spa_pkt, const int owner)
+{
+    unsigned char       msg[CLUSTER_MAX_MSG_LEN];
+    cluster_member_t    to;
+    cluster_ring_t     *ring;
+    cluster_pending_t  *p;
+    uint64_t            token;
+
+    if(! cl_active || spa_pkt->packet_data_len > MAX_SPA_PACKET_LEN)
+        return;
+
+    rcu_read_lock();
+    ring = rcu_dereference(cl_ring);
+    if(ring == NULL || owner >= ring->num_members)
+    {
+        rcu_read_unlock();
+        return;
+    }
+    to = ring->members[owner];
+    rcu_read_unlock();
+
+    if(RAND_bytes((unsigned char *)&token, sizeof(token)) != 1)
+        return;
+
+    memset(msg, 0x0, CLUSTER_HDR_LEN + CLUSTER_FWD_HDR_LEN);
+    memcpy(msg + 16, spa_pkt->packet_src_addr.addr, 16);
+    memcpy(msg + 32, spa_pkt->packet_dst_addr.addr, 16);
+    msg[48] = cl_family_to_ver(spa_pkt->packet_src_addr.family);
+    msg[49] = cl_family_to_ver(spa_pkt->packet_dst_addr.family);
+    msg[50] = spa_pkt->packet_proto;
+    cl_put_u16(msg + 52, spa_pkt->packet_src_port);
+    cl_put_u16(msg + 54, spa_pkt->packet_dst_port);
+    cl_put_u16(msg + 56, spa_pkt->packet_data_len);
+    memcpy(msg + CLUSTER_HDR_LEN + CLUSTER_FWD_HDR_LEN,
+        spa_pkt->packet_data, spa_pkt->packet_data_len);
+
+    pthread_mutex_lock(&cl_pending_mutex);
+    p = &(cl_pending[token % CLUSTER_PENDING_SLOTS]);
+    p->token   = token;
+    p->expires = time(NULL) + CLUSTER_PENDING_TTL;
+    p->member  = owner;
+    pthread_mutex_unlock(&cl_pending_mutex);
+
+    if(cl_send_msg(msg, CLUSTER_FWD_HDR_LEN + spa_pkt->packet_data_len,
+            CLUSTER_MSG_FORWARD, token, &to) != 0)
+        log_msg(LOG_WARNING | LOG_RATE_LIMIT, "Unable to forward SPA packet to cluster member %s: %s",
+            to.id, strerror(errno));
+    else if(cl_opts->verbose)
+        log_msg(LOG_DEBUG, "Forwarded SPA packet for SDP ID %"PRIu32" to cluster member %s",
+            spa_pkt->sdp_id, to.id);
+
+    return;
+}
+
+/* Send the gateway that forwarded a packet the access it was granted.
+ * Returns 0 if the grant was sent.
+*/
+int
+cluster_send_grant(const spa_data_t *spadat)
+{
+    unsigned char               msg[CLUSTER_HDR_LEN + CLUSTER_GRANT_HDR_LEN
+                                    + CLUSTER_MAX_SERVICES * 4 + CLUSTER_MAC_LEN];
+    const service_data_list_t  *svc;
+    cluster_member_t            to;
+    cluster_ring_t             *ring;
+    int                         member = spadat->cluster_origin - 1, n = 0;
+
+    if(! cl_active || spadat->use_src_ip == NULL
+            || strlen(spadat->use_src_ip) >= MAX_IPV4_STR_LEN)
+        return(-1);
+
+    rcu_read_lock();
+    ring = rcu_dereference(cl_ring);
+    if(ring == NULL || member < 0 || member >= ring->num_members)
+    {
+        rcu_read_unlock();
+        return(-1);
+    }
+    to = ring->members[member];
+    rcu_read_unlock();
+
+    memset(msg, 0x0, sizeof(msg));
+    cl_put_u32(msg + 16, spadat->sdp_id);
+    cl_put_u32(msg + 20, spadat->fw_access_timeout);
+    strlcpy((char *)msg + 28, spadat->use_src_ip, MAX_IPV4_STR_LEN);
+    strlcpy((char *)msg + 44, spadat->pkt_destination_ip, 48);
+
+    for(svc = spadat->service_data_list; svc != NULL && n < CLUSTER_MAX_SERVICES; svc = svc->next)
+        cl_put_u32(msg + CLUSTER_HDR_LEN + CLUSTER_GRANT_HDR_LEN + 4 * n++,
+            svc->service_data->service_id);
+
+    if(n == 0)
+        return(-1);
+    cl_put_u16(msg + 24, n);
+
+    if(cl_send_msg(msg, CLUSTER_GRANT_HDR_LEN + 4 * n, CLUSTER_MSG_GRANT,
+            spadat->cluster_token, &to) != 0)
+    {
+        log_msg(LOG_WARNING, "Unable to send grant for SDP ID %"PRIu32" to cluster member %s: %s",
+            spadat->sdp_id, to.id, strerror(errno));
+        return(-1);
+    }
+
+    log_msg(LOG_INFO, "[%s] Sent grant for SDP ID %"PRIu32" to cluster member %s",
+        spadat->pkt_source_ip, spadat->sdp_id, to.id);
+    return(0);
+}
+
+/***EOF***/
@@ -0,0 +1,125 @@
+/*
+ *****************************************************************************
+ *
+ * File:    cluster.h
+ *
+ * Purpose: Header file for cluster.c - placement of SDP clients across a
+ *          pool of gateways.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <json-c/json.h>
+
+/* The controller describes the pool with a "cluster_update" message:
+ *
+ *   {"version": N, "self": "<member id>", "vnodes": N,
+ *    "members": [{"id": "<member id>", "address": "<IP address>"}, ...]}
+ *
+ * Each member is placed on a ring of 64-bit points at "vnodes" points,
+ * the first 8 bytes (big endian) of SHA-256("<member id>#<n>") for n from
+ * 0 to vnodes - 1.  An SDP ID belongs to the member at the first point at
+ * or after SHA-256("<decimal SDP ID>"), wrapping around.  The controller
+ * sends each gateway full access data only for its own SDP IDs.  Packets
+ * for any other SDP ID are forwarded to the owner, which checks them and
+ * sends back a grant for the forwarding gateway to install.
+ *
+ * Message layout (multi-byte fields in network byte order):
+ *
+ *   0   magic "FKCL"
+ *   4   version
+ *   5   message type (CLUSTER_MSG_*)
+ *   6   reserved (2 bytes)
+ *   8   token the forwarding gateway picked for the packet (64 bits)
+ *   16  message body
+ *   end HMAC-SHA256 over everything before it
+ *
+ * Forward body:
+ *
+ *   16  source address (16 bytes)
+ *   32  destination address (16 bytes)
+ *   48  source and destination address versions (4 or 6)
+ *   50  protocol
+ *   51  reserved
+ *   52  source port
+ *   54  destination port
+ *   56  payload length
+ *   58  reserved (2 bytes)
+ *   60  SPA payload
+ *
+ * Grant body:
+ *
+ *   16  SDP ID (32 bits)
+ *   20  firewall access timeout in seconds (32 bits)
+ *   24  number of services
+ *   26  reserved (2 bytes)
+ *   28  address to allow (NUL padded string, MAX_IPV4_STR_LEN bytes)
+ *   44  destination address (NUL padded string, 48 bytes)
+ *   92  service IDs (32 bits each)
+ *
+ * A grant is only installed if its token is one this gateway forwarded in
+ * the last CLUSTER_PENDING_TTL seconds and has not been answered yet.
+*/
+#define CLUSTER_MAGIC               "FKCL"
+#define CLUSTER_VERSION             1
+#define CLUSTER_HDR_LEN             16
+#define CLUSTER_FWD_HDR_LEN         44
+#define CLUSTER_GRANT_HDR_LEN       76
+#define CLUSTER_MAC_LEN             32
+#define CLUSTER_MAX_SERVICES        64
+#define CLUSTER_MAX_MSG_LEN         (CLUSTER_HDR_LEN + CLUSTER_FWD_HDR_LEN \
+                                        + MAX_SPA_PACKET_LEN + CLUSTER_MAC_LEN)
+
+#define CLUSTER_MSG_FORWARD         0
+#define CLUSTER_MSG_GRANT           1
+
+#define CLUSTER_MAX_MEMBERS         256
+#define CLUSTER_MAX_VNODES          1024
+#define CLUSTER_DEF_VNODES          64
+#define CLUSTER_MAX_ID_LEN          64
+#define CLUSTER_MIN_KEY_LEN         16
+
+/* Forwarded packets waiting for a grant.  A slot is reused once its
+ * entry is answered or expires, so at most this many packets can be
+ * waiting at once.
+*/
+#define CLUSTER_PENDING_SLOTS       1024
+#define CLUSTER_PENDING_TTL         5
+
+/* Prototypes
+*/
+int cluster_start(fko_srv_options_t *opts);
+void cluster_stop(void);
+void cluster_ring_free(void);
+int cluster_update(fko_srv_options_t *opts, json_object *jdata);
+int cluster_owner(const uint32_t sdp_id);
+int cluster_sdp_id_local(const fko_srv_options_t *opts, const uint32_t sdp_id);
+void cluster_forward(const spa_pkt_info_t *spa_pkt, const int owner);
+int cluster_send_grant(const spa_data_t *spadat);
+
+#endif /* CLUSTER_H */
+
+/***EOF***/
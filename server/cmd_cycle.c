@@ -32,19 +32,8 @@
 #include "extcmd.h"
 #include "cmd_cycle.h"
 #include "access.h"
-
-static char cmd_buf[CMD_CYCLE_BUFSIZE];
-static char err_buf[CMD_CYCLE_BUFSIZE];
-
-static void
-zero_cmd_buffers(void)
-{
-    memset(cmd_buf, 0x0, CMD_CYCLE_BUFSIZE);
-    memset(err_buf, 0x0, CMD_CYCLE_BUFSIZE);
-    return;
-}
-
-static int pid_status = 0;
+#include "fw_util.h"
+#include "utils.h"
 
 static int
 is_var(const char * const var, const char * const cmd_str)
@@ -58,8 +47,13 @@ is_var(const char * const var, const char * const cmd_str)
     return 1;
 }
 
+/* Build a command into cmd_buf, which must hold CMD_CYCLE_BUFSIZE bytes
+ * and be zeroed by the caller.  Commands are built in the callers'
+ * buffers so that command cycles can be handled from any thread.
+*/
 static int
-build_cmd(spa_data_t *spadat, const char * const cmd_cycle_str, int timer)
+build_cmd(spa_data_t *spadat, const char * const cmd_cycle_str, int timer,
+        char * const cmd_buf)
 {
     char             port_str[MAX_PORT_STR_LEN+1]   = {0};
     char             proto_str[MAX_PROTO_STR_LEN+1] = {0};
@@ -81,8 +75,6 @@ build_cmd(spa_data_t *spadat, const char * const cmd_cycle_str, int timer)
     snprintf(port_str, MAX_PORT_STR_LEN+1, "%d", port_list->port);
     snprintf(proto_str, MAX_PROTO_STR_LEN+1, "%d", port_list->proto);
 
-    zero_cmd_buffers();
-
     /* Look for the following variables for substitution:
      * IP, SRC, PKT_SRC, DST, PORT, and PROTO
     */
@@ -177,10 +169,15 @@ static int
 cmd_open(fko_srv_options_t *opts, acc_stanza_t *acc,
         spa_data_t *spadat, const int stanza_num)
 {
+    char    cmd_buf[CMD_CYCLE_BUFSIZE] = {0};
+    char    err_buf[CMD_CYCLE_BUFSIZE] = {0};
+    int     pid_status = 0;
+
     /* CMD_CYCLE_OPEN: Build the open command by taking care of variable
      * substitutions if necessary.
     */
-    if(build_cmd(spadat, acc->cmd_cycle_open, acc->cmd_cycle_timer))
+    if(build_cmd(spadat, acc->cold->cmd_cycle_open, acc->cold->cmd_cycle_timer,
+                cmd_buf))
     {
         log_msg(LOG_INFO, "[%s] (stanza #%d) Running CMD_CYCLE_OPEN command: %s",
                 spadat->pkt_source_ip, stanza_num, cmd_buf);
@@ -205,14 +202,16 @@ static int
 add_cmd_close(fko_srv_options_t *opts, acc_stanza_t *acc,
         spa_data_t *spadat, const int stanza_num)
 {
-    cmd_cycle_list_t   *last_clist=NULL, *new_clist=NULL, *tmp_clist=NULL;
+    cmd_cycle_list_t   *new_clist=NULL;
     time_t              now;
     int                 cmd_close_len = 0;
+    char                cmd_buf[CMD_CYCLE_BUFSIZE] = {0};
 
     /* CMD_CYCLE_CLOSE: Build the close command, but don't execute it until
      * the expiration timer has passed.
     */
-    if(build_cmd(spadat, acc->cmd_cycle_close, acc->cmd_cycle_timer))
+    if(build_cmd(spadat, acc->cold->cmd_cycle_close, acc->cold->cmd_cycle_timer,
+                cmd_buf))
     {
         /* Now the corresponding close command is now in cmd_buf
          * for later execution when the timer expires.
@@ -221,7 +220,7 @@ add_cmd_close(fko_srv_options_t *opts, acc_stanza_t *acc,
         log_msg(LOG_INFO,
                 "[%s] (stanza #%d) Running CMD_CYCLE_CLOSE command in %d seconds: %s",
                 spadat->pkt_source_ip, stanza_num,
-                (spadat->client_timeout == 0 ? acc->cmd_cycle_timer :
+                (spadat->client_timeout == 0 ? acc->cold->cmd_cycle_timer :
                 spadat->client_timeout), cmd_buf);
     }
     else
@@ -244,20 +243,13 @@ add_cmd_close(fko_srv_options_t *opts, acc_stanza_t *acc,
         clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
     }
 
-    if(opts->cmd_cycle_list == NULL)
-    {
-        opts->cmd_cycle_list = new_clist;
-    }
-    else
-    {
-        tmp_clist = opts->cmd_cycle_list;
-
-        do {
-            last_clist = tmp_clist;
-        } while((tmp_clist = tmp_clist->next));
-
-        last_clist->next = new_clist;
-    }
+    /* The list only owns the pending entries (for free_cmd_cycle_list()),
+     * their order is kept by the timer wheel.
+    */
+    new_clist->next = opts->cmd_cycle_list;
+    if(opts->cmd_cycle_list != NULL)
+        opts->cmd_cycle_list->prev = new_clist;
+    opts->cmd_cycle_list = new_clist;
 
     /* Set the source IP
     */
@@ -266,9 +258,9 @@ add_cmd_close(fko_srv_options_t *opts, acc_stanza_t *acc,
 
     /* Set the expiration timer
     */
-    time(&now);
+    now = clock_cache_now();
     new_clist->expire = now + (spadat->client_timeout == 0 ?
-            acc->cmd_cycle_timer : spadat->client_timeout);
+            acc->cold->cmd_cycle_timer : spadat->client_timeout);
 
     /* Set the close command
     */
@@ -285,6 +277,14 @@ add_cmd_close(fko_srv_options_t *opts, acc_stanza_t *acc,
     */
     new_clist->stanza_num = stanza_num;
 
+    if(! fw_timer_add_arg(new_clist->expire, new_clist))
+    {
+        log_msg(LOG_ERR,
+            "[*] Fatal memory allocation error scheduling command close"
+        );
+        clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+    }
+
     return 1;
 }
 
@@ -297,7 +297,7 @@ cmd_cycle_open(fko_srv_options_t *opts, acc_stanza_t *acc,
     if(! cmd_open(opts, acc, spadat, stanza_num))
         return 0;
 
-    if(acc->cmd_cycle_do_close)
+    if(acc->cold->cmd_cycle_do_close)
         if(! add_cmd_close(opts, acc, spadat, stanza_num))
             return 0;
 
@@ -316,60 +316,75 @@ free_cycle_list_node(cmd_cycle_list_t *list_node)
     return;
 }
 
-/* Run all close commands based on the expiration timer
+static void
+unlink_cycle_list_node(fko_srv_options_t *opts, cmd_cycle_list_t *node)
+{
+    if(node->prev == NULL)
+        opts->cmd_cycle_list = node->next;
+    else
+        node->prev->next = node->next;
+
+    if(node->next != NULL)
+        node->next->prev = node->prev;
+
+    return;
+}
+
+/* Run the close commands whose timers have expired.  The timer wheel hands
+ * back only the due entries, and with the extcmd helper running up to
+ * CMD_CYCLE_CLOSE_BATCH of them are started before any is waited for.
 */
 void
 cmd_cycle_close(fko_srv_options_t *opts)
 {
-    cmd_cycle_list_t   *curr=NULL, *prev=NULL;
-    int                 do_delete=1;
+    cmd_cycle_list_t   *due[CMD_CYCLE_CLOSE_BATCH];
+    int                 handle[CMD_CYCLE_CLOSE_BATCH];
+    cmd_cycle_list_t   *curr=NULL;
+    int                 i, num_due, pid_status = 0;
     time_t              now;
-
-    time(&now);
+    char                err_buf[CMD_CYCLE_BUFSIZE];
 
     if(opts->cmd_cycle_list == NULL)
-    {
         return; /* No active command cycles */
-    }
-    else
-    {
-        while(do_delete)
+
+    now = clock_cache_now();
+
+    do {
+        for(num_due=0; num_due < CMD_CYCLE_CLOSE_BATCH; num_due++)
         {
-            do_delete = 0;
+            if((curr = fw_timer_pop_due(now)) == NULL)
+                break;
 
-            /* Keep going through the command list for as long as
-             * there are commands to be executed (and expired).
-            */
-            for(curr = opts->cmd_cycle_list;
-                    curr != NULL;
-                    prev = curr, curr=curr->next)
+            log_msg(LOG_INFO,
+                    "[%s] (stanza #%d) Timer expired, running CMD_CYCLE_CLOSE command: %s",
+                    curr->src_ip, curr->stanza_num,
+                    curr->close_cmd);
+
+            unlink_cycle_list_node(opts, curr);
+            due[num_due] = curr;
+
+            handle[num_due] = run_extcmd_start(curr->close_cmd,
+                    CMD_CYCLE_BUFSIZE, WANT_STDERR, NO_TIMEOUT);
+
+            if(handle[num_due] < 0)
             {
-                if(curr->expire <= now)
-                {
-                    log_msg(LOG_INFO,
-                            "[%s] (stanza #%d) Timer expired, running CMD_CYCLE_CLOSE command: %s",
-                            curr->src_ip, curr->stanza_num,
-                            curr->close_cmd);
-
-                    zero_cmd_buffers();
-
-                    /* Run the close command
-                    */
-                    run_extcmd(curr->close_cmd, err_buf, CMD_CYCLE_BUFSIZE,
-                            WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
-
-                    if(prev == NULL)
-                        opts->cmd_cycle_list = curr->next;
-                    else
-                        prev->next = curr->next;
-
-                    free_cycle_list_node(curr);
-                    do_delete = 1;
-                    break;
-                }
+                /* Run the close command
+                */
+                run_extcmd(curr->close_cmd, err_buf, CMD_CYCLE_BUFSIZE,
+                        WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
             }
         }
-    }
+
+        for(i=0; i < num_due; i++)
+        {
+            if(handle[i] >= 0)
+            {
+                run_extcmd_finish(handle[i], err_buf, CMD_CYCLE_BUFSIZE,
+                        &pid_status);
+            }
+            free_cycle_list_node(due[i]);
+        }
+    } while(num_due == CMD_CYCLE_CLOSE_BATCH);
 
     return;
 }
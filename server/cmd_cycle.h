@@ -33,6 +33,11 @@
 
 #define CMD_CYCLE_BUFSIZE 256
 
+/* Maximum number of CMD_CYCLE_CLOSE commands run at the same time
+ * (through the extcmd helper).
+*/
+#define CMD_CYCLE_CLOSE_BATCH 32
+
 int cmd_cycle_open(fko_srv_options_t *opts, acc_stanza_t *acc,
         spa_data_t *spadat, const int stanza_num, int *res);
 void cmd_cycle_close(fko_srv_options_t *opts);
@@ -47,24 +47,69 @@ static char *config_map[NUMBER_OF_CONFIG_ENTRIES] = {
     "PCAP_FILTER",
     "PCAP_DISPATCH_COUNT",
     "PCAP_LOOP_SLEEP",
+    "PCAP_ADAPTIVE_POLL",
     "ENABLE_PCAP_ANY_DIRECTION",
+    "ENABLE_PCAP_TPACKET_V3",
+    "PCAP_TPACKET_V3_BLOCKS",
+    "PCAP_CAPTURE_THREADS",
+    "PCAP_FANOUT_MODE",
+    "ENABLE_PCAP_PREFILTER",
+    "ENABLE_PCAP_AUTO_FILTER",
+    "PCAP_AUTO_FILTER_DESTINATIONS",
     "EXIT_AT_INTF_DOWN",
     "MAX_SNIFF_BYTES",
     "ENABLE_SPA_PACKET_AGING",
     "MAX_SPA_PACKET_AGE",
     "ENABLE_DIGEST_PERSISTENCE",
+    "DIGEST_FILE_SYNC_INTERVAL",
     "RULES_CHECK_THRESHOLD",
     "CMD_EXEC_TIMEOUT",
     //"BLACKLIST",
     "ENABLE_SPA_OVER_HTTP",
     "ENABLE_TCP_SERVER",
     "TCPSERV_PORT",
+    "ENABLE_HTTP_SERVER",
+    "HTTPSERV_PORT",
     "ENABLE_UDP_SERVER",
     "UDPSERV_PORT",
     "UDPSERV_SELECT_TIMEOUT",
+    "UDPSERV_RECV_BATCH",
+    "UDPSERV_WORKERS",
+    "ENABLE_NFLOG_CAPTURE",
+    "NFLOG_GROUP",
+    "NFLOG_QTHRESHOLD",
+    "SPA_WORKERS",
+    "SPA_SHED_TARGET_DELAY",
+    "AUTHZ_CACHE_SIZE",
+    "ACCESS_EXPAND_LIMIT",
+    "MAX_ACTIVE_GRANTS",
+    "CAPTURE_CPUS",
+    "SPA_WORKER_CPUS",
+    "HOUSEKEEPING_CPUS",
+    "CRYPTO_IMPL",
+    "ENABLE_FW_COMMIT_THREAD",
+    "ENABLE_EXTCMD_HELPER",
+    "SPA_RATE_LIMIT",
+    "SPA_RATE_BURST",
+    "REPLAY_GOSSIP_PORT",
+    "REPLAY_GOSSIP_PEERS",
+    "REPLAY_GOSSIP_KEY",
+    "METRICS_PORT",
+    "METRICS_ADDRESS",
+    "STATS_INTERVAL",
+    "STATS_FILE",
+    "ENABLE_IPV6",
     "LOCALE",
     "SYSLOG_IDENTITY",
     "SYSLOG_FACILITY",
+    "LOG_FILE",
+    "LOG_FILE_MAX_SIZE",
+    "LOG_FILE_ROTATE_INTERVAL",
+    "LOG_FILE_KEEP",
+    "LOG_FILE_JSON",
+    "FLIGHT_RECORDER_SIZE",
+    "SPA_TRACE",
+    "MEM_LIMIT",
     //"ENABLE_EXTERNAL_CMDS",
     //"EXTERNAL_CMD_OPEN",
     //"EXTERNAL_CMD_CLOSE",
@@ -87,6 +132,7 @@ static char *config_map[NUMBER_OF_CONFIG_ENTRIES] = {
     "FIREWD_SNAT_ACCESS",
     "FIREWD_MASQUERADE_ACCESS",
     "ENABLE_FIREWD_COMMENT_CHECK",
+    "FIREWD_USE_DBUS",
 #elif FIREWALL_IPTABLES
     "ENABLE_IPT_FORWARDING",
     "ENABLE_IPT_LOCAL_NAT",
@@ -102,6 +148,17 @@ static char *config_map[NUMBER_OF_CONFIG_ENTRIES] = {
     "IPT_SNAT_ACCESS",
     "IPT_MASQUERADE_ACCESS",
     "ENABLE_IPT_COMMENT_CHECK",
+    "ENABLE_IPT_IPSET",
+    "IPT_IPSET_NAME",
+    "ENABLE_IPT_RESTORE_BATCH",
+    "IPT_INPUT_SHARD_BITS",
+#elif FIREWALL_NFTABLES
+    "FLUSH_NFT_AT_INIT",
+    "FLUSH_NFT_AT_EXIT",
+    "NFT_FAMILY",
+    "NFT_TABLE",
+    "NFT_INPUT_CHAIN",
+    "NFT_ACCESS_SET",
 #elif FIREWALL_IPFW
     "FLUSH_IPFW_AT_INIT",
     "FLUSH_IPFW_AT_EXIT",
@@ -111,9 +168,12 @@ static char *config_map[NUMBER_OF_CONFIG_ENTRIES] = {
     "IPFW_EXPIRE_SET_NUM",
     "IPFW_EXPIRE_PURGE_INTERVAL",
     "IPFW_ADD_CHECK_STATE",
+    "IPFW_USE_TABLES",
+    "IPFW_TABLE_NAME",
 #elif FIREWALL_PF
     "PF_ANCHOR_NAME",
     "PF_EXPIRE_INTERVAL",
+    "PF_USE_TABLES",
 #elif FIREWALL_IPF
     /* --DSS Place-holder */
 #endif /* FIREWALL type */
@@ -139,11 +199,26 @@ static char *config_map[NUMBER_OF_CONFIG_ENTRIES] = {
 	"ALLOW_LEGACY_ACCESS_REQUESTS",
 	"ACC_STANZA_HASH_TABLE_LENGTH",
 	"SERVICE_HASH_TABLE_LENGTH",
+	"SDP_SHARD_COUNT",
+	"SDP_SHARD_INDEX",
+	"CLUSTER_PORT",
+	"CLUSTER_KEY",
+	"HA_SYNC_PORT",
+	"HA_SYNC_PEER",
+	"HA_SYNC_KEY",
 	"DISABLE_SDP_CTRL_CLIENT",
 	"DISABLE_CONNECTION_TRACKING",
+	"CONNTRACK_USE_NETLINK",
+	"CONNTRACK_BUF_SIZE",
 	"CONN_ID_FILE",
 	"CONN_REPORT_INTERVAL",
+	"CONN_REPORT_DELTAS",
+	"CONN_REPORT_COMPRESS",
+	"CONN_REPORT_COUNTERS",
 	"MAX_WAIT_ACC_DATA",
+	"ACC_SNAPSHOT_FILE",
+	"ACC_SNAPSHOT_KEY",
+	"ACC_SNAPSHOT_MAX_AGE",
 	"SDP_CTRL_CLIENT_CONF",
 	"FWKNOP_CLIENT_CONF",
 	"CONFIG_DUMP_OUTPUT_PATH"
@@ -185,6 +260,15 @@ enum {
 	SDP_CTRL_CLIENT_CONF,
 	FWKNOP_CLIENT_CONF,
 	CONFIG_DUMP_OUTPUT_PATH,
+    BENCHMARK,
+    BENCHMARK_LOOPS,
+    BENCHMARK_SYNTH,
+    BENCHMARK_FW,
+    UPGRADE,
+    DUMP_FORMAT,
+    DUMP_SDP_ID,
+    DUMP_SERVICE_ID,
+    STATS,
     NOOP /* Just to be a marker for the end */
 };
 
@@ -201,6 +285,10 @@ static struct option cmd_opts[] =
 	{"service-hash-tbl-len", 1, NULL, SERVICE_HASH_TABLE_LENGTH },
     {"afl-fuzzing",          0, NULL, 'A'},
     {"afl-pkt-file",         1, NULL, AFL_PKT_FILE },
+    {"benchmark",            0, NULL, BENCHMARK },
+    {"benchmark-loops",      1, NULL, BENCHMARK_LOOPS },
+    {"benchmark-synth",      1, NULL, BENCHMARK_SYNTH },
+    {"benchmark-fw",         1, NULL, BENCHMARK_FW },
     {"config-file",          1, NULL, 'c'},
     {"packet-limit",         1, NULL, 'C'},
     {"digest-file",          1, NULL, 'd'},
@@ -214,6 +302,9 @@ static struct option cmd_opts[] =
 	{"ctrl-client-conf",     1, NULL, SDP_CTRL_CLIENT_CONF},
 	{"fwknop-client-conf",   1, NULL, FWKNOP_CLIENT_CONF},
     {"dump-config",          0, NULL, 'D'},
+    {"dump-format",          1, NULL, DUMP_FORMAT },
+    {"dump-sdp-id",          1, NULL, DUMP_SDP_ID },
+    {"dump-service-id",      1, NULL, DUMP_SERVICE_ID },
     {"dump-serv-err-codes",  0, NULL, DUMP_SERVER_ERR_CODES },
     {"exit-parse-config",    0, NULL, EXIT_AFTER_PARSE_CONFIG },
     {"syslog-enable",        0, NULL, SYSLOG_ENABLE },
@@ -244,9 +335,11 @@ static struct option cmd_opts[] =
     {"run-dir",              1, NULL, 'r'},
     {"restart",              0, NULL, 'R'},
     {"status",               0, NULL, 'S'},
+    {"stats",                0, NULL, STATS },
     {"sudo-exe",             1, NULL, SUDO_EXE_PATH },
     {"test",                 0, NULL, 't'},
     {"udp-server",           0, NULL, 'U'},
+    {"upgrade",              0, NULL, UPGRADE },
     {"verbose",              0, NULL, 'v'},
     {"version",              0, NULL, 'V'},
     {0, 0, 0, 0}
@@ -0,0 +1,687 @@
+/*
+ *****************************************************************************
+ *
+ * File:    config_dump.c
+ *
+ * Purpose: Config, service and access dumps (fwknopd -D, SIGUSR1).  On
+ *          SIGUSR1 the dump is written from its own thread, and the access
+ *          stanzas are formatted a batch at a time from a snapshot of the
+ *          SDP IDs, so neither the SPA path nor controller updates wait on
+ *          a large dump.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "config_dump.h"
+#include "config_init.h"
+#include "access.h"
+#include "acc_id_map.h"
+#include "service.h"
+#include "hash_table.h"
+#include "replay_cache.h"
+#include "mem_acct.h"
+#include "flight_recorder.h"
+#include "cpu_affinity.h"
+#include "log_msg.h"
+#include "utils.h"
+#include "rcu.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <json-c/json.h>
+
+static pthread_mutex_t  cd_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t        cd_thread;
+static int              cd_started = 0;
+static int              cd_busy    = 0;
+
+/* SDP IDs of the stanzas to dump, collected in one pass over the table.
+*/
+typedef struct cd_ids
+{
+    uint32_t   *ids;
+    size_t      count;
+    size_t      size;
+    int         failed;
+} cd_ids_t;
+
+typedef struct cd_svc_arg
+{
+    FILE                       *dest;
+    const config_dump_filter_t *filter;
+    int                         count;
+} cd_svc_arg_t;
+
+/* Parse an SDP or service ID for --dump-sdp-id/--dump-service-id.
+*/
+int
+config_dump_parse_id(const char *str, uint32_t *r_id)
+{
+    unsigned long   val;
+    char           *end = NULL;
+
+    if(str == NULL || ! isdigit((unsigned char)str[0]))
+        return -1;
+
+    errno = 0;
+    val = strtoul(str, &end, 10);
+    if(errno != 0 || *end != '\0' || val == 0 || val > UINT32_MAX)
+        return -1;
+
+    *r_id = (uint32_t)val;
+    return 0;
+}
+
+static FILE *
+cd_open_dest(const fko_srv_options_t *opts, int *opened)
+{
+    FILE   *dest;
+
+    *opened = 0;
+
+    if(opts->config[CONF_CONFIG_DUMP_OUTPUT_PATH] == NULL || opts->foreground)
+        return stdout;
+
+    if((dest = fopen(opts->config[CONF_CONFIG_DUMP_OUTPUT_PATH], "a")) == NULL)
+    {
+        log_msg(LOG_ERR, "Unable to open %s for the config dump: %s",
+            opts->config[CONF_CONFIG_DUMP_OUTPUT_PATH], strerror(errno));
+        return stdout;
+    }
+
+    *opened = 1;
+    return dest;
+}
+
+static void
+cd_put_json(FILE *dest, json_object *jobj)
+{
+    fprintf(dest, "%s\n", json_object_to_json_string_ext(jobj, JSON_C_TO_STRING_PLAIN));
+    json_object_put(jobj);
+    return;
+}
+
+static json_object *
+cd_json_str(const char *str)
+{
+    return(str == NULL ? NULL : json_object_new_string(str));
+}
+
+static void
+cd_config_json(const fko_srv_options_t *opts, FILE *dest)
+{
+    json_object    *jobj = json_object_new_object();
+    json_object    *jconf = json_object_new_object();
+    int             i;
+
+    // a SIGHUP reload may swap the strings meanwhile
+    rcu_read_lock();
+    for(i=0; i < NUMBER_OF_CONFIG_ENTRIES; i++)
+    {
+        if(opts->config[i] == NULL)
+            continue;
+        json_object_object_add(jconf, config_entry_name(i),
+            json_object_new_string(config_entry_is_secret(i) ? "<hidden>" : opts->config[i]));
+    }
+    rcu_read_unlock();
+
+    json_object_object_add(jobj, "type", json_object_new_string("config"));
+    json_object_object_add(jobj, "time", json_object_new_int64(time(NULL)));
+    json_object_object_add(jobj, "config", jconf);
+    cd_put_json(dest, jobj);
+    return;
+}
+
+static json_object *
+cd_service_json(const service_data_t *svc)
+{
+    json_object    *jobj = json_object_new_object();
+
+    json_object_object_add(jobj, "type", json_object_new_string("service"));
+    json_object_object_add(jobj, "service_id", json_object_new_int64(svc->service_id));
+    json_object_object_add(jobj, "proto",
+        json_object_new_string(svc->proto == PROTO_TCP ? "tcp" : "udp"));
+    json_object_object_add(jobj, "port", json_object_new_int(svc->port));
+    json_object_object_add(jobj, "nat_ip",
+        svc->nat_ip_str[0] == '\0' ? NULL : json_object_new_string(svc->nat_ip_str));
+    json_object_object_add(jobj, "nat_port", json_object_new_int(svc->nat_port));
+    return jobj;
+}
+
+/* The stanza's service set.  A stanza that is not expanded (see
+ * acc_lazy.h) has its SERVICE_LIST compiled into *tmp for the dump
+ * rather than expanded, so that dumping does not count as a use.
+*/
+static const acc_service_set_t *
+cd_service_set(const acc_stanza_t *acc, acc_service_set_t **tmp)
+{
+    const acc_stanza_exp_t *exp = __atomic_load_n(&(acc->exp), __ATOMIC_ACQUIRE);
+
+    *tmp = NULL;
+    if(exp != NULL)
+        return exp->service_set;
+
+    if(acc->cold->service_list_str != NULL && strlen(acc->cold->service_list_str))
+        *tmp = compile_acc_service_set(acc->cold->service_list_str);
+    return *tmp;
+}
+
+/* Key material is never included.
+*/
+static json_object *
+cd_stanza_json(const acc_stanza_t *acc)
+{
+    json_object                *jobj = json_object_new_object();
+    json_object                *jsvcs = json_object_new_array();
+    const acc_service_set_t    *set;
+    acc_service_set_t          *tmp;
+    uint32_t                    i;
+
+    if((set = cd_service_set(acc, &tmp)) != NULL)
+        for(i=0; i < set->count; i++)
+            json_object_array_add(jsvcs, json_object_new_int64(set->ids[i]));
+    mem_free(MEM_TAG_STANZA, tmp);
+
+    json_object_object_add(jobj, "type", json_object_new_string("access"));
+    json_object_object_add(jobj, "sdp_id", json_object_new_int64(acc->sdp_id));
+    json_object_object_add(jobj, "source", cd_json_str(acc->cold->source));
+    json_object_object_add(jobj, "destination", cd_json_str(acc->cold->destination));
+    json_object_object_add(jobj, "service_ids", jsvcs);
+    json_object_object_add(jobj, "open_ports", cd_json_str(acc->cold->open_ports));
+    json_object_object_add(jobj, "restrict_ports", cd_json_str(acc->cold->restrict_ports));
+    json_object_object_add(jobj, "use_rijndael", json_object_new_boolean(acc->use_rijndael));
+    json_object_object_add(jobj, "use_gpg", json_object_new_boolean(acc->use_gpg));
+    json_object_object_add(jobj, "key_len", json_object_new_int(acc->key_len));
+    json_object_object_add(jobj, "hmac_key_len", json_object_new_int(acc->hmac_key_len));
+    json_object_object_add(jobj, "hmac_digest_type", json_object_new_int(acc->hmac_type));
+    json_object_object_add(jobj, "fw_access_timeout", json_object_new_int(acc->fw_access_timeout));
+    json_object_object_add(jobj, "max_active_grants", json_object_new_int(acc->cold->max_active_grants));
+    json_object_object_add(jobj, "grant_idle_timeout", json_object_new_int(acc->cold->grant_idle_timeout));
+    json_object_object_add(jobj, "access_expire", json_object_new_int64(acc->access_expire_time));
+    json_object_object_add(jobj, "enable_cmd_exec", json_object_new_boolean(acc->enable_cmd_exec));
+    json_object_object_add(jobj, "cmd_cycle_open", cd_json_str(acc->cold->cmd_cycle_open));
+    json_object_object_add(jobj, "cmd_cycle_close", cd_json_str(acc->cold->cmd_cycle_close));
+    json_object_object_add(jobj, "require_username", cd_json_str(acc->cold->require_username));
+    json_object_object_add(jobj, "require_source_address",
+        json_object_new_boolean(acc->require_source_address));
+    json_object_object_add(jobj, "force_nat_ip",
+        acc->cold->force_nat ? cd_json_str(acc->cold->force_nat_ip) : NULL);
+    json_object_object_add(jobj, "force_nat_port",
+        json_object_new_int(acc->cold->force_nat ? acc->cold->force_nat_port : 0));
+    json_object_object_add(jobj, "force_snat_ip",
+        acc->cold->force_snat ? cd_json_str(acc->cold->force_snat_ip) : NULL);
+    json_object_object_add(jobj, "force_masquerade", json_object_new_boolean(acc->cold->force_masquerade));
+    json_object_object_add(jobj, "disable_dnat", json_object_new_boolean(acc->cold->disable_dnat));
+    json_object_object_add(jobj, "forward_all", json_object_new_boolean(acc->cold->forward_all));
+    return jobj;
+}
+
+static int
+cd_stanza_wanted(const acc_stanza_t *acc, const config_dump_filter_t *filter)
+{
+    acc_service_set_t  *tmp;
+    int                 allowed;
+
+    if(filter->sdp_id != 0 && acc->sdp_id != filter->sdp_id)
+        return 0;
+    if(filter->service_id == 0)
+        return 1;
+
+    allowed = acc_service_set_test(cd_service_set(acc, &tmp), filter->service_id);
+    mem_free(MEM_TAG_STANZA, tmp);
+    return allowed;
+}
+
+static int
+cd_service_cb(hash_table_node_t *node, void *arg)
+{
+    cd_svc_arg_t           *svc_arg = arg;
+    const service_data_t   *svc = node->data;
+
+    if(svc_arg->filter->service_id != 0 && svc->service_id != svc_arg->filter->service_id)
+        return 0;
+
+    if(svc_arg->filter->json)
+        cd_put_json(svc_arg->dest, cd_service_json(svc));
+    else
+        dump_service_data(svc, svc_arg->dest);
+
+    svc_arg->count++;
+    return 0;
+}
+
+/* The service table is small, so it is formatted in one go into memory
+ * and written out afterwards.
+*/
+static int
+cd_services(fko_srv_options_t *opts, const config_dump_filter_t *filter, FILE *dest)
+{
+    cd_svc_arg_t    svc_arg;
+    hash_table_t   *tbl;
+    char           *buf = NULL;
+    size_t          len = 0;
+
+    if((svc_arg.dest = open_memstream(&buf, &len)) == NULL)
+        return -1;
+    svc_arg.filter = filter;
+    svc_arg.count  = 0;
+
+    rcu_read_lock();
+    if((tbl = rcu_dereference(opts->service_hash_tbl)) != NULL)
+        hash_table_traverse(tbl, cd_service_cb, &svc_arg);
+    rcu_read_unlock();
+
+    fclose(svc_arg.dest);
+    fwrite(buf, 1, len, dest);
+    free(buf);
+
+    return svc_arg.count;
+}
+
+static int
+cd_ids_add(cd_ids_t *ids, const uint32_t id)
+{
+    uint32_t   *tmp;
+    size_t      size;
+
+    if(ids->count == ids->size)
+    {
+        size = ids->size ? ids->size * 2 : 1024;
+        if((tmp = realloc(ids->ids, size * sizeof(uint32_t))) == NULL)
+        {
+            ids->failed = 1;
+            return 1;
+        }
+        ids->ids  = tmp;
+        ids->size = size;
+    }
+    ids->ids[ids->count++] = id;
+    return 0;
+}
+
+static int
+cd_collect_cb(acc_stanza_t *acc, void *arg)
+{
+    return cd_ids_add((cd_ids_t *)arg, acc->sdp_id);
+}
+
+static int
+cd_id_cmp(const void *a, const void *b)
+{
+    const uint32_t  x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return((x > y) - (x < y));
+}
+
+/* SDP access stanzas.  Only the IDs are read in one pass; the stanzas
+ * are then looked up and formatted CONFIG_DUMP_BATCH at a time, and each
+ * batch is written out after leaving the read-side section, so a slow
+ * output file never holds up an access update.  Stanzas removed in the
+ * meantime are skipped.
+*/
+static int
+cd_sdp_stanzas(fko_srv_options_t *opts, const config_dump_filter_t *filter, FILE *dest)
+{
+    cd_ids_t        ids;
+    acc_id_map_t   *map;
+    acc_stanza_t   *acc;
+    FILE           *mem;
+    char           *buf = NULL;
+    size_t          len = 0, i, end;
+    int             count = 0;
+
+    memset(&ids, 0x0, sizeof(ids));
+
+    if(filter->sdp_id != 0)
+    {
+        // no need to walk the table for one ID
+        if(cd_ids_add(&ids, filter->sdp_id) != 0)
+            return -1;
+    }
+    else
+    {
+        rcu_read_lock();
+        if((map = rcu_dereference(opts->acc_stanza_hash_tbl)) != NULL)
+            acc_id_map_traverse(map, cd_collect_cb, &ids);
+        rcu_read_unlock();
+
+        if(ids.failed)
+        {
+            free(ids.ids);
+            return -1;
+        }
+        qsort(ids.ids, ids.count, sizeof(uint32_t), cd_id_cmp);
+    }
+
+    for(i=0; i < ids.count; i = end)
+    {
+        end = i + CONFIG_DUMP_BATCH;
+        if(end > ids.count)
+            end = ids.count;
+
+        if((mem = open_memstream(&buf, &len)) == NULL)
+            break;
+
+        rcu_read_lock();
+        if((map = rcu_dereference(opts->acc_stanza_hash_tbl)) != NULL)
+        {
+            for(; i < end; i++)
+            {
+                if((acc = acc_id_map_get(map, ids.ids[i])) == NULL
+                        || ! cd_stanza_wanted(acc, filter))
+                    continue;
+
+                if(filter->json)
+                    cd_put_json(mem, cd_stanza_json(acc));
+                else
+                    dump_access_stanza(acc, mem);
+                count++;
+            }
+        }
+        rcu_read_unlock();
+
+        fclose(mem);
+        fwrite(buf, 1, len, dest);
+        fflush(dest);
+        free(buf);
+        buf = NULL;
+    }
+
+    free(ids.ids);
+    return count;
+}
+
+/* Legacy access.conf stanzas, as JSON.  There are few enough of them to
+ * be formatted in one go.
+*/
+static int
+cd_legacy_stanzas_json(fko_srv_options_t *opts, FILE *dest)
+{
+    acc_stanza_t   *acc;
+    FILE           *mem;
+    char           *buf = NULL;
+    size_t          len = 0;
+    int             count = 0;
+
+    if((mem = open_memstream(&buf, &len)) == NULL)
+        return -1;
+
+    rcu_read_lock();
+    for(acc = rcu_dereference(opts->acc_stanzas); acc != NULL; acc = acc->next)
+    {
+        cd_put_json(mem, cd_stanza_json(acc));
+        count++;
+    }
+    rcu_read_unlock();
+
+    fclose(mem);
+    fwrite(buf, 1, len, dest);
+    free(buf);
+
+    return count;
+}
+
+/* Write a config dump to CONFIG_DUMP_OUTPUT_PATH (or stdout).  A NULL
+ * filter is the full text dump.  Returns 0 on success.
+*/
+int
+config_dump_run(fko_srv_options_t *opts, const config_dump_filter_t *filter)
+{
+    config_dump_filter_t    all;
+    FILE                   *dest;
+    int                     opened, nsvc = 0, nacc = 0;
+
+    if(filter == NULL)
+    {
+        memset(&all, 0x0, sizeof(all));
+        filter = &all;
+    }
+
+    // the text dump of legacy stanzas is unchanged
+    if(! opts->rt->sdp_mode && ! filter->json)
+    {
+        dump_config(opts);
+        dump_service_list(opts);
+        dump_access_list(opts);
+        dump_replay_cache_stats(opts);
+        dump_mem_stats(opts);
+        dump_flight_recorder(opts, 0);
+        return 0;
+    }
+
+    if(! filter->json)
+        dump_config(opts);
+
+    dest = cd_open_dest(opts, &opened);
+
+    if(filter->json)
+        cd_config_json(opts, dest);
+    else
+        fprintf(dest, "Current fwknopd services settings:\n");
+
+    if(opts->rt->sdp_mode)
+    {
+        nsvc = cd_services(opts, filter, dest);
+
+        if(! filter->json)
+            fprintf(dest, "\nCurrent fwknopd access settings:\n");
+
+        nacc = cd_sdp_stanzas(opts, filter, dest);
+    }
+    else
+        nacc = cd_legacy_stanzas_json(opts, dest);
+
+    if(filter->json)
+    {
+        json_object *jobj = json_object_new_object();
+
+        json_object_object_add(jobj, "type", json_object_new_string("end"));
+        json_object_object_add(jobj, "services", json_object_new_int(nsvc));
+        json_object_object_add(jobj, "stanzas", json_object_new_int(nacc));
+        cd_put_json(dest, jobj);
+    }
+    else
+        fprintf(dest, "\n");
+
+    fflush(dest);
+    if(opened)
+        fclose(dest);
+
+    if(nsvc < 0 || nacc < 0)
+    {
+        log_msg(LOG_ERR, "Config dump incomplete, out of memory.");
+        return -1;
+    }
+
+    // stats only go with a full dump
+    if(! filter->json && filter->sdp_id == 0 && filter->service_id == 0)
+    {
+        dump_replay_cache_stats(opts);
+        dump_mem_stats(opts);
+    }
+
+    if(! filter->json && filter->service_id == 0)
+        dump_flight_recorder(opts, filter->sdp_id);
+
+    return 0;
+}
+
+static int
+cd_req_path(const fko_srv_options_t *opts, char *path, const size_t len)
+{
+    if(snprintf(path, len, "%s/%s", opts->config[CONF_FWKNOP_RUN_DIR],
+            CONFIG_DUMP_REQ_NAME) >= (int)len)
+        return -1;
+    return 0;
+}
+
+/* Called by fwknopd -D before it signals the running fwknopd.  Returns 0
+ * on success.
+*/
+int
+config_dump_write_request(const fko_srv_options_t *opts)
+{
+    char    path[MAX_PATH_LEN], line[MAX_LINE_LEN];
+    int     fd, len, rv = 0;
+
+    if(cd_req_path(opts, path, sizeof(path)) != 0)
+        return -1;
+
+    unlink(path);
+
+    if(! opts->dump_json && opts->dump_sdp_id == 0 && opts->dump_service_id == 0)
+        return 0;
+
+    len = snprintf(line, sizeof(line), "format=%s sdp_id=%"PRIu32" service_id=%"PRIu32"\n",
+            opts->dump_json ? "json" : "text", opts->dump_sdp_id, opts->dump_service_id);
+
+    if((fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, S_IRUSR|S_IWUSR)) < 0)
+        return -1;
+
+    if(write(fd, line, len) != len)
+        rv = -1;
+
+    close(fd);
+    return rv;
+}
+
+/* Pick up (and remove) the filter left by fwknopd -D, if any.
+*/
+static void
+cd_read_request(const fko_srv_options_t *opts, config_dump_filter_t *filter)
+{
+    struct stat     st;
+    char            path[MAX_PATH_LEN], buf[MAX_LINE_LEN], *tok, *save = NULL;
+    ssize_t         len;
+    int             fd;
+
+    memset(filter, 0x0, sizeof(*filter));
+
+    if(cd_req_path(opts, path, sizeof(path)) != 0
+            || (fd = open(path, O_RDONLY|O_NOFOLLOW)) < 0)
+        return;
+
+    len = -1;
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == geteuid())
+        len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    unlink(path);
+
+    if(len <= 0)
+        return;
+    buf[len] = '\0';
+
+    for(tok = strtok_r(buf, " \t\n", &save); tok != NULL;
+            tok = strtok_r(NULL, " \t\n", &save))
+    {
+        if(strcmp(tok, "format=json") == 0)
+            filter->json = 1;
+        else if(strncmp(tok, "sdp_id=", 7) == 0 && strcmp(tok + 7, "0") != 0)
+            config_dump_parse_id(tok + 7, &(filter->sdp_id));
+        else if(strncmp(tok, "service_id=", 11) == 0 && strcmp(tok + 11, "0") != 0)
+            config_dump_parse_id(tok + 11, &(filter->service_id));
+    }
+    return;
+}
+
+static void *
+cd_thread_func(void *arg)
+{
+    fko_srv_options_t      *opts = (fko_srv_options_t *)arg;
+    config_dump_filter_t    filter;
+    sigset_t                mask;
+
+    /* Leave signal handling to the main thread.
+    */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    cpu_affinity_set(CPU_ROLE_HOUSEKEEPING);
+
+    cd_read_request(opts, &filter);
+    if(config_dump_run(opts, &filter) == 0)
+        log_msg(LOG_INFO, "Config dump written.");
+
+    pthread_mutex_lock(&cd_mutex);
+    cd_busy = 0;
+    pthread_mutex_unlock(&cd_mutex);
+
+    return NULL;
+}
+
+/* Called from the main thread on SIGUSR1.  A request that arrives while
+ * a dump is being written is dropped.
+*/
+void
+config_dump_request(fko_srv_options_t *opts)
+{
+    pthread_mutex_lock(&cd_mutex);
+
+    if(cd_busy)
+    {
+        pthread_mutex_unlock(&cd_mutex);
+        log_msg(LOG_WARNING, "Got SIGUSR1, but a config dump is still being written.");
+        return;
+    }
+
+    if(cd_started)
+    {
+        pthread_join(cd_thread, NULL);
+        cd_started = 0;
+    }
+
+    log_msg(LOG_INFO, "Got SIGUSR1. Dumping config...");
+
+    cd_busy = 1;
+    if(pthread_create(&cd_thread, NULL, cd_thread_func, opts) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Unable to start the config dump thread.");
+        cd_busy = 0;
+    }
+    else
+        cd_started = 1;
+
+    pthread_mutex_unlock(&cd_mutex);
+    return;
+}
+
+/* Wait for a dump in progress.  The dump reads the config and access
+ * data, so this is called before they are freed.
+*/
+void
+config_dump_stop(void)
+{
+    pthread_mutex_lock(&cd_mutex);
+    if(cd_started)
+    {
+        pthread_join(cd_thread, NULL);
+        cd_started = 0;
+    }
+    pthread_mutex_unlock(&cd_mutex);
+    return;
+}
+
+/***EOF***/
@@ -0,0 +1,64 @@
+/*
+ *****************************************************************************
+ *
+ * File:    config_dump.h
+ *
+ * Purpose: Header file for config_dump.c - config, service and access
+ *          dumps (fwknopd -D, SIGUSR1) written from a separate thread.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef CONFIG_DUMP_H
+#define CONFIG_DUMP_H
+
+/* What to dump.  An ID of 0 means no filter.
+*/
+typedef struct config_dump_filter
+{
+    int         json;
+    uint32_t    sdp_id;
+    uint32_t    service_id;
+} config_dump_filter_t;
+
+/* fwknopd -D with any --dump-* options leaves them in this file in the
+ * run dir before it sends SIGUSR1, as "format=json sdp_id=N service_id=N".
+*/
+#define CONFIG_DUMP_REQ_NAME    "fwknopd.dump_req"
+
+/* Number of access stanzas formatted per RCU read-side section.  The
+ * output is written with no lock held.
+*/
+#define CONFIG_DUMP_BATCH       256
+
+/* Prototypes
+*/
+int config_dump_parse_id(const char *str, uint32_t *r_id);
+int config_dump_run(fko_srv_options_t *opts, const config_dump_filter_t *filter);
+int config_dump_write_request(const fko_srv_options_t *opts);
+void config_dump_request(fko_srv_options_t *opts);
+void config_dump_stop(void);
+
+#endif /* CONFIG_DUMP_H */
+
+/***EOF***/
@@ -33,9 +33,14 @@
 #include "config_init.h"
 #include "service.h"
 #include "access.h"
+#include "acc_id_map.h"
+#include "authz_cache.h"
+#include "acc_snapshot.h"
 #include "cmd_opts.h"
+#include "config_dump.h"
 #include "utils.h"
 #include "log_msg.h"
+#include "rcu.h"
 #include <pthread.h>
 #include <time.h>
 
@@ -43,8 +48,35 @@
   #include "fw_util_firewalld.h"
 #elif FIREWALL_IPTABLES
   #include "fw_util_iptables.h"
+#elif FIREWALL_NFTABLES
+  #include "fw_util_nftables.h"
 #endif
 
+/* Runtime configs replaced by a SIGHUP reload (see config_reload_apply()).
+ * The packet path reads opts->rt without taking any lock, so these are
+ * kept until exit.
+*/
+typedef struct retired_rt {
+    fko_srv_runtime_t  *rt;
+    struct retired_rt  *next;
+} retired_rt_t;
+
+static retired_rt_t *retired_rts = NULL;
+
+/* Config entries a SIGHUP reload applies to the running process.  They
+ * are only read through opts->rt or when access.conf is parsed; a change
+ * to any other entry restarts the main loop instead.
+*/
+static const int hot_reload_entries[] = {
+    CONF_ENABLE_SPA_PACKET_AGING,
+    CONF_MAX_SPA_PACKET_AGE,
+    CONF_ALLOW_LEGACY_ACCESS_REQUESTS,
+    CONF_RULES_CHECK_THRESHOLD,
+    CONF_EXIT_AT_INTF_DOWN,
+    CONF_ACCESS_FILE,
+    CONF_VERBOSE
+};
+
 /* Check to see if an integer variable has a value that is within a
  * specific range
 */
@@ -111,16 +143,79 @@ set_config_entry(fko_srv_options_t *opts, const int var_ndx, const char *value)
     return;
 }
 
+/* Open addressed index from config keyword to config_map[] position,
+ * built once so that each fwknopd.conf line costs a hash and (almost
+ * always) a single strcmp instead of a walk of the whole map.  Slots
+ * hold the index plus one, so zero marks an empty slot.
+*/
+#define CONF_KEYWORD_SLOTS  512     /* Power of two, over twice the map size */
+
+static unsigned short       conf_keyword_slots[CONF_KEYWORD_SLOTS];
+static pthread_once_t       conf_keyword_once = PTHREAD_ONCE_INIT;
+
+static uint32_t
+conf_keyword_hash(const char *var)
+{
+    uint32_t    h = 2166136261U;
+
+    while(*var != '\0')
+        h = (h ^ (unsigned char)*var++) * 16777619U;
+
+    return(h);
+}
+
+static void
+conf_keyword_index_init(void)
+{
+    uint32_t    slot;
+    int         i;
+
+    for(i=0; i<NUMBER_OF_CONFIG_ENTRIES; i++)
+    {
+        if(config_map[i] == NULL)
+            continue;
+
+        slot = conf_keyword_hash(config_map[i]) & (CONF_KEYWORD_SLOTS - 1);
+        while(conf_keyword_slots[slot] != 0)
+            slot = (slot + 1) & (CONF_KEYWORD_SLOTS - 1);
+
+        conf_keyword_slots[slot] = i + 1;
+    }
+
+    return;
+}
+
+/* Given a config keyword, return its config_map[] index or -1 if it is
+ * not a known keyword.
+*/
+static int
+conf_keyword_lookup(const char *var)
+{
+    uint32_t    slot;
+    int         ndx;
+
+    pthread_once(&conf_keyword_once, conf_keyword_index_init);
+
+    slot = conf_keyword_hash(var) & (CONF_KEYWORD_SLOTS - 1);
+    while((ndx = conf_keyword_slots[slot]) != 0)
+    {
+        if(CONF_VAR_IS(config_map[ndx-1], var))
+            return(ndx-1);
+        slot = (slot + 1) & (CONF_KEYWORD_SLOTS - 1);
+    }
+
+    return(-1);
+}
+
 /* Given a config parameter name, return its index or -1 if not found.
 */
 static int
 config_entry_index(const fko_srv_options_t *opts, const char *var)
 {
-    int i;
+    int i = conf_keyword_lookup(var);
 
-    for(i=0; i<NUMBER_OF_CONFIG_ENTRIES; i++)
-        if(opts->config[i] != NULL && CONF_VAR_IS(var, config_map[i]))
-            return(i);
+    if(i >= 0 && opts->config[i] != NULL)
+        return(i);
 
     return(-1);
 }
@@ -145,15 +240,23 @@ free_configs(fko_srv_options_t *opts)
         }
         else
         {
-            hash_table_destroy(opts->acc_stanza_hash_tbl);
+            acc_id_map_destroy(opts->acc_stanza_hash_tbl);
+            acc_sdp_miss_flush();
+            authz_cache_flush();
             pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
             pthread_mutex_destroy(&(opts->acc_hash_tbl_mutex));
         }
     }
 
+    pthread_mutex_destroy(&(opts->replay_cache_mutex));
+    pthread_mutex_destroy(&(opts->spa_grant_mutex));
+
     for(i=0; i<NUMBER_OF_CONFIG_ENTRIES; i++)
         if(opts->config[i] != NULL)
             free(opts->config[i]);
+
+    free((fko_srv_runtime_t *)opts->rt);
+    opts->rt = NULL;
 }
 
 static void
@@ -165,22 +268,81 @@ validate_int_var_ranges(fko_srv_options_t *opts)
 
     range_check(opts, "PCAP_LOOP_SLEEP", opts->config[CONF_PCAP_LOOP_SLEEP],
         1, RCHK_MAX_PCAP_LOOP_SLEEP);
+    range_check(opts, "PCAP_TPACKET_V3_BLOCKS", opts->config[CONF_PCAP_TPACKET_V3_BLOCKS],
+        1, RCHK_MAX_PCAP_TPACKET_V3_BLOCKS);
+    range_check(opts, "PCAP_CAPTURE_THREADS", opts->config[CONF_PCAP_CAPTURE_THREADS],
+        1, RCHK_MAX_PCAP_CAPTURE_THREADS);
     range_check(opts, "MAX_SPA_PACKET_AGE", opts->config[CONF_MAX_SPA_PACKET_AGE],
         1, RCHK_MAX_SPA_PACKET_AGE);
+    range_check(opts, "DIGEST_FILE_SYNC_INTERVAL",
+        opts->config[CONF_DIGEST_FILE_SYNC_INTERVAL],
+        0, RCHK_MAX_DIGEST_FILE_SYNC_INTERVAL);
     range_check(opts, "MAX_SNIFF_BYTES", opts->config[CONF_MAX_SNIFF_BYTES],
         1, RCHK_MAX_SNIFF_BYTES);
     range_check(opts, "RULES_CHECK_THRESHOLD", opts->config[CONF_RULES_CHECK_THRESHOLD],
         0, RCHK_MAX_RULES_CHECK_THRESHOLD);
     range_check(opts, "TCPSERV_PORT", opts->config[CONF_TCPSERV_PORT],
         1, RCHK_MAX_TCPSERV_PORT);
+    range_check(opts, "HTTPSERV_PORT", opts->config[CONF_HTTPSERV_PORT],
+        1, RCHK_MAX_HTTPSERV_PORT);
     range_check(opts, "UDPSERV_PORT", opts->config[CONF_UDPSERV_PORT],
         1, RCHK_MAX_UDPSERV_PORT);
     range_check(opts, "UDPSERV_PORT", opts->config[CONF_UDPSERV_SELECT_TIMEOUT],
         1, RCHK_MAX_UDPSERV_SELECT_TIMEOUT);
+    range_check(opts, "UDPSERV_RECV_BATCH", opts->config[CONF_UDPSERV_RECV_BATCH],
+        1, RCHK_MAX_UDPSERV_RECV_BATCH);
+    range_check(opts, "UDPSERV_WORKERS", opts->config[CONF_UDPSERV_WORKERS],
+        1, RCHK_MAX_UDPSERV_WORKERS);
+    range_check(opts, "NFLOG_GROUP", opts->config[CONF_NFLOG_GROUP],
+        0, RCHK_MAX_NFLOG_GROUP);
+    range_check(opts, "NFLOG_QTHRESHOLD", opts->config[CONF_NFLOG_QTHRESHOLD],
+        1, RCHK_MAX_NFLOG_QTHRESHOLD);
+    range_check(opts, "SPA_WORKERS", opts->config[CONF_SPA_WORKERS],
+        0, RCHK_MAX_SPA_WORKERS);
+    range_check(opts, "SPA_SHED_TARGET_DELAY", opts->config[CONF_SPA_SHED_TARGET_DELAY],
+        0, RCHK_MAX_SPA_SHED_TARGET_DELAY);
+    range_check(opts, "AUTHZ_CACHE_SIZE", opts->config[CONF_AUTHZ_CACHE_SIZE],
+        0, RCHK_MAX_AUTHZ_CACHE_SIZE);
+    range_check(opts, "ACCESS_EXPAND_LIMIT", opts->config[CONF_ACCESS_EXPAND_LIMIT],
+        0, RCHK_MAX_ACCESS_EXPAND_LIMIT);
+    range_check(opts, "MAX_ACTIVE_GRANTS", opts->config[CONF_MAX_ACTIVE_GRANTS],
+        0, RCHK_MAX_ACTIVE_GRANTS);
+    range_check(opts, "SPA_RATE_LIMIT", opts->config[CONF_SPA_RATE_LIMIT],
+        0, RCHK_MAX_SPA_RATE_LIMIT);
+    range_check(opts, "SPA_RATE_BURST", opts->config[CONF_SPA_RATE_BURST],
+        1, RCHK_MAX_SPA_RATE_BURST);
+    range_check(opts, "REPLAY_GOSSIP_PORT", opts->config[CONF_REPLAY_GOSSIP_PORT],
+        0, RCHK_MAX_REPLAY_GOSSIP_PORT);
+    range_check(opts, "METRICS_PORT", opts->config[CONF_METRICS_PORT],
+        0, RCHK_MAX_METRICS_PORT);
+    range_check(opts, "STATS_INTERVAL", opts->config[CONF_STATS_INTERVAL],
+        0, RCHK_MAX_STATS_INTERVAL);
+    range_check(opts, "LOG_FILE_MAX_SIZE", opts->config[CONF_LOG_FILE_MAX_SIZE],
+        0, RCHK_MAX_LOG_FILE_MAX_SIZE);
+    range_check(opts, "LOG_FILE_ROTATE_INTERVAL", opts->config[CONF_LOG_FILE_ROTATE_INTERVAL],
+        0, RCHK_MAX_LOG_FILE_ROTATE_INTERVAL);
+    range_check(opts, "LOG_FILE_KEEP", opts->config[CONF_LOG_FILE_KEEP],
+        0, RCHK_MAX_LOG_FILE_KEEP);
+    range_check(opts, "FLIGHT_RECORDER_SIZE", opts->config[CONF_FLIGHT_RECORDER_SIZE],
+        0, RCHK_MAX_FLIGHT_RECORDER_SIZE);
+    range_check(opts, "MEM_LIMIT", opts->config[CONF_MEM_LIMIT],
+        0, RCHK_MAX_MEM_LIMIT);
+    range_check(opts, "CONNTRACK_BUF_SIZE", opts->config[CONF_CONNTRACK_BUF_SIZE],
+        RCHK_MIN_CONNTRACK_BUF_SIZE, RCHK_MAX_CONNTRACK_BUF_SIZE);
+    range_check(opts, "SDP_SHARD_COUNT", opts->config[CONF_SDP_SHARD_COUNT],
+        1, RCHK_MAX_SDP_SHARD_COUNT);
+    range_check(opts, "SDP_SHARD_INDEX", opts->config[CONF_SDP_SHARD_INDEX],
+        0, RCHK_MAX_SDP_SHARD_COUNT - 1);
+    range_check(opts, "CLUSTER_PORT", opts->config[CONF_CLUSTER_PORT],
+        0, RCHK_MAX_CLUSTER_PORT);
+    range_check(opts, "HA_SYNC_PORT", opts->config[CONF_HA_SYNC_PORT],
+        0, RCHK_MAX_HA_SYNC_PORT);
     range_check(opts, "ACC_STANZA_HASH_TABLE_LENGTH", opts->config[CONF_ACC_STANZA_HASH_TABLE_LENGTH],
         MIN_ACC_STANZA_HASH_TABLE_LENGTH, MAX_ACC_STANZA_HASH_TABLE_LENGTH);
     range_check(opts, "MAX_WAIT_ACC_DATA", opts->config[CONF_MAX_WAIT_ACC_DATA],
         1, RCHK_MAX_WAIT_ACC_DATA);
+    range_check(opts, "ACC_SNAPSHOT_MAX_AGE", opts->config[CONF_ACC_SNAPSHOT_MAX_AGE],
+        1, RCHK_MAX_ACC_SNAPSHOT_MAX_AGE);
     range_check(opts, "SERVICE_HASH_TABLE_LENGTH", opts->config[CONF_SERVICE_HASH_TABLE_LENGTH],
         MIN_SERVICE_HASH_TABLE_LENGTH, MAX_SERVICE_HASH_TABLE_LENGTH);
 
@@ -299,8 +461,7 @@ parse_config_file(fko_srv_options_t *opts, const char *config_file)
 {
     FILE           *cfile_ptr;
     unsigned int    numLines = 0;
-    unsigned int    i, good_ent;
-    int             cndx;
+    int             i, cndx;
 
     char            conf_line_buf[MAX_LINE_LEN] = {0};
     char            var[MAX_LINE_LEN]  = {0};
@@ -354,47 +515,41 @@ parse_config_file(fko_srv_options_t *opts, const char *config_file)
             continue;
         }
 
-        good_ent = 0;
-        for(i=0; i<NUMBER_OF_CONFIG_ENTRIES; i++)
+        if((i = conf_keyword_lookup(var)) < 0)
         {
-            if(CONF_VAR_IS(config_map[i], var))
+            log_msg(LOG_ERR,
+                "[*] Ignoring unknown configuration parameter: '%s' in %s",
+                var, config_file
+            );
+            continue;
+        }
+
+        /* First check to see if we need to do a varable expansion
+         * on this value.  Note: this only supports one expansion and
+         * only if the value starts with the variable.
+        */
+        if(*val == '$')
+        {
+            if(sscanf((val+1), "%[A-Z_]%s", tmp1, tmp2))
             {
-                /* First check to see if we need to do a varable expansion
-                 * on this value.  Note: this only supports one expansion and
-                 * only if the value starts with the variable.
-                */
-                if(*val == '$')
+                if((cndx = config_entry_index(opts, tmp1)) >= 0)
                 {
-                    if(sscanf((val+1), "%[A-Z_]%s", tmp1, tmp2))
-                    {
-                        if((cndx = config_entry_index(opts, tmp1)) >= 0)
-                        {
-                            strlcpy(val, opts->config[cndx], sizeof(val));
-                            strlcat(val, tmp2, sizeof(val));
-                        }
-                        else
-                        {
-                            /* We didn't map the embedded variable to a valid
-                             * config parameter
-                            */
-                            log_msg(LOG_ERR,
-                                "[*] Invalid embedded variable in: '%s'", val);
-                            break;
-                        }
-                    }
+                    strlcpy(val, opts->config[cndx], sizeof(val));
+                    strlcat(val, tmp2, sizeof(val));
+                }
+                else
+                {
+                    /* We didn't map the embedded variable to a valid
+                     * config parameter
+                    */
+                    log_msg(LOG_ERR,
+                        "[*] Invalid embedded variable in: '%s'", val);
+                    continue;
                 }
-
-                set_config_entry(opts, i, val);
-                good_ent++;
-                break;
             }
         }
 
-        if(good_ent == 0)
-            log_msg(LOG_ERR,
-                "[*] Ignoring unknown configuration parameter: '%s' in %s",
-                var, config_file
-            );
+        set_config_entry(opts, i, val);
     }
 
     fclose(cfile_ptr);
@@ -402,6 +557,218 @@ parse_config_file(fko_srv_options_t *opts, const char *config_file)
     return;
 }
 
+static int
+conf_is_yes(const char *val)
+{
+    return(val != NULL && strncasecmp(val, "Y", 1) == 0);
+}
+
+/* Sharded instances all capture every SPA packet and each one drops the
+ * SDP IDs it does not own, so nothing may be bound to the SPA port and
+ * only one of them may run the TCP server.
+*/
+static void
+validate_sdp_shard(fko_srv_options_t *opts)
+{
+    int     count, ndx, is_err;
+
+    count = strtol_wrapper(opts->config[CONF_SDP_SHARD_COUNT],
+            1, RCHK_MAX_SDP_SHARD_COUNT, NO_EXIT_UPON_ERR, &is_err);
+    ndx   = strtol_wrapper(opts->config[CONF_SDP_SHARD_INDEX],
+            0, RCHK_MAX_SDP_SHARD_COUNT - 1, NO_EXIT_UPON_ERR, &is_err);
+
+    if(ndx >= count)
+    {
+        log_msg(LOG_ERR,
+            "Invalid configuration: SDP_SHARD_INDEX %d must be less than "
+            "SDP_SHARD_COUNT %d", ndx, count);
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    if(count > 1 && conf_is_yes(opts->config[CONF_DISABLE_SDP_MODE]))
+    {
+        log_msg(LOG_ERR,
+            "Invalid configuration: SDP_SHARD_COUNT requires SDP mode");
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    if(count > 1 && (opts->enable_udp_server
+                || conf_is_yes(opts->config[CONF_ENABLE_UDP_SERVER])))
+    {
+        log_msg(LOG_ERR,
+            "Invalid configuration: SDP_SHARD_COUNT requires pcap capture, "
+            "the UDP server cannot share its port between shards");
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    if(ndx > 0 && conf_is_yes(opts->config[CONF_ENABLE_TCP_SERVER]))
+    {
+        log_msg(LOG_ERR,
+            "Invalid configuration: ENABLE_TCP_SERVER may only be set on "
+            "SDP_SHARD_INDEX 0");
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    if(ndx > 0 && conf_is_yes(opts->config[CONF_ENABLE_HTTP_SERVER]))
+    {
+        log_msg(LOG_ERR,
+            "Invalid configuration: ENABLE_HTTP_SERVER may only be set on "
+            "SDP_SHARD_INDEX 0");
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    return;
+}
+
+/* Parse the config values used on the packet path into a new
+ * fko_srv_runtime_t and set opts->rt.  This runs after the integer
+ * ranges have been checked.  The struct belongs to opts until
+ * free_configs(), unless a reload moves it into the running config.
+*/
+static void
+build_runtime_config(fko_srv_options_t *opts)
+{
+    fko_srv_runtime_t  *rt;
+    int                 is_err;
+
+    if((rt = calloc(1, sizeof(fko_srv_runtime_t))) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] Fatal memory allocation error.");
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    rt->sdp_mode            = ! conf_is_yes(opts->config[CONF_DISABLE_SDP_MODE]);
+    rt->spa_over_http       = conf_is_yes(opts->config[CONF_ENABLE_SPA_OVER_HTTP]);
+    rt->spa_packet_aging    = conf_is_yes(opts->config[CONF_ENABLE_SPA_PACKET_AGING]);
+    rt->digest_persistence  = conf_is_yes(opts->config[CONF_ENABLE_DIGEST_PERSISTENCE]);
+    rt->allow_legacy_access = conf_is_yes(opts->config[CONF_ALLOW_LEGACY_ACCESS_REQUESTS]);
+    rt->exit_at_intf_down   = conf_is_yes(opts->config[CONF_EXIT_AT_INTF_DOWN]);
+#if FIREWALL_FIREWALLD
+    rt->nat_forwarding      = conf_is_yes(opts->config[CONF_ENABLE_FIREWD_FORWARDING]);
+    rt->nat_local           = conf_is_yes(opts->config[CONF_ENABLE_FIREWD_LOCAL_NAT]);
+#elif FIREWALL_IPTABLES
+    rt->nat_forwarding      = conf_is_yes(opts->config[CONF_ENABLE_IPT_FORWARDING]);
+    rt->nat_local           = conf_is_yes(opts->config[CONF_ENABLE_IPT_LOCAL_NAT]);
+#endif
+
+    rt->max_spa_packet_age = strtol_wrapper(opts->config[CONF_MAX_SPA_PACKET_AGE],
+            0, RCHK_MAX_SPA_PACKET_AGE, NO_EXIT_UPON_ERR, &is_err);
+    rt->rules_chk_threshold = strtol_wrapper(opts->config[CONF_RULES_CHECK_THRESHOLD],
+            0, RCHK_MAX_RULES_CHECK_THRESHOLD, NO_EXIT_UPON_ERR, &is_err);
+    rt->sdp_shard_count = strtol_wrapper(opts->config[CONF_SDP_SHARD_COUNT],
+            1, RCHK_MAX_SDP_SHARD_COUNT, NO_EXIT_UPON_ERR, &is_err);
+    rt->sdp_shard_index = strtol_wrapper(opts->config[CONF_SDP_SHARD_INDEX],
+            0, RCHK_MAX_SDP_SHARD_COUNT - 1, NO_EXIT_UPON_ERR, &is_err);
+
+    opts->rt = rt;
+
+    return;
+}
+
+/* Free the runtime configs retired by reloads at exit.
+*/
+void
+free_runtime_config(fko_srv_options_t *opts)
+{
+    retired_rt_t   *r;
+
+    while((r = retired_rts) != NULL)
+    {
+        retired_rts = r->next;
+        free(r->rt);
+        free(r);
+    }
+    opts->rt = NULL;
+    return;
+}
+
+static int
+is_hot_reload_entry(const int ndx)
+{
+    int i;
+
+    for(i=0; i < (int)(sizeof(hot_reload_entries)/sizeof(hot_reload_entries[0])); i++)
+        if(hot_reload_entries[i] == ndx)
+            return 1;
+
+    return 0;
+}
+
+/* Compare the running config with one parsed for a SIGHUP reload and log
+ * what changed.  Returns the number of changed entries that can only be
+ * applied by restarting the main loop.
+*/
+int
+config_reload_diff(const fko_srv_options_t *opts, const fko_srv_options_t *new_opts)
+{
+    int i, restart_needed = 0;
+
+    for(i=0; i<NUMBER_OF_CONFIG_ENTRIES; i++)
+    {
+        if(opts->config[i] == NULL && new_opts->config[i] == NULL)
+            continue;
+
+        if(opts->config[i] != NULL && new_opts->config[i] != NULL
+                && strcmp(opts->config[i], new_opts->config[i]) == 0)
+            continue;
+
+        if(is_hot_reload_entry(i))
+        {
+            log_msg(LOG_INFO, "Reload: %s changed.", config_map[i]);
+        }
+        else
+        {
+            log_msg(LOG_WARNING, "Reload: %s changed, restart required.",
+                config_map[i]);
+            restart_needed++;
+        }
+    }
+
+    return restart_needed;
+}
+
+/* Move the hot reload entries and the runtime config parsed for a SIGHUP
+ * reload into the running config.  The replaced strings end up in
+ * new_opts, to be freed with it once no reader can still hold them.
+*/
+void
+config_reload_apply(fko_srv_options_t *opts, fko_srv_options_t *new_opts)
+{
+    fko_srv_runtime_t  *old_rt = (fko_srv_runtime_t *)opts->rt;
+    retired_rt_t       *r;
+    char               *tmp;
+    int                 i, ndx;
+
+    for(i=0; i < (int)(sizeof(hot_reload_entries)/sizeof(hot_reload_entries[0])); i++)
+    {
+        ndx = hot_reload_entries[i];
+        tmp = opts->config[ndx];
+        rcu_assign_pointer(opts->config[ndx], new_opts->config[ndx]);
+        new_opts->config[ndx] = tmp;
+    }
+
+    rcu_assign_pointer(opts->rt, new_opts->rt);
+    new_opts->rt = NULL;
+
+    if((r = calloc(1, sizeof(retired_rt_t))) == NULL)
+    {
+        /* Leak it rather than free it under a reader.
+        */
+        log_msg(LOG_ERR, "[*] Memory allocation error retiring the runtime config.");
+    }
+    else
+    {
+        r->rt   = old_rt;
+        r->next = retired_rts;
+        retired_rts = r;
+    }
+
+    opts->verbose = new_opts->verbose;
+    log_set_verbosity(LOG_DEFAULT_VERBOSITY + opts->verbose);
+
+    return;
+}
+
 /* Set defaults, and do sanity and bounds checks for the various options.
 */
 static void
@@ -432,6 +799,15 @@ validate_options(fko_srv_options_t *opts)
     if(opts->config[CONF_CONN_REPORT_INTERVAL] == NULL)
         set_config_entry(opts, CONF_CONN_REPORT_INTERVAL, DEF_CONN_REPORT_INTERVAL);
 
+    if(opts->config[CONF_CONN_REPORT_DELTAS] == NULL)
+        set_config_entry(opts, CONF_CONN_REPORT_DELTAS, DEF_CONN_REPORT_DELTAS);
+
+    if(opts->config[CONF_CONN_REPORT_COMPRESS] == NULL)
+        set_config_entry(opts, CONF_CONN_REPORT_COMPRESS, DEF_CONN_REPORT_COMPRESS);
+
+    if(opts->config[CONF_CONN_REPORT_COUNTERS] == NULL)
+        set_config_entry(opts, CONF_CONN_REPORT_COUNTERS, DEF_CONN_REPORT_COUNTERS);
+
     /* If the pid and digest cache files where not set in the config file or
      * via command-line, then grab the defaults. Start with RUN_DIR as the
      * files may depend on that.
@@ -451,6 +827,18 @@ validate_options(fko_srv_options_t *opts)
         set_config_entry(opts, CONF_FWKNOP_PID_FILE, tmp_path);
     }
 
+    if(opts->config[CONF_STATS_FILE] == NULL)
+    {
+        strlcpy(tmp_path, opts->config[CONF_FWKNOP_RUN_DIR], sizeof(tmp_path));
+
+        if(tmp_path[strlen(tmp_path)-1] != '/')
+            strlcat(tmp_path, "/", sizeof(tmp_path));
+
+        strlcat(tmp_path, DEF_STATS_FILENAME, sizeof(tmp_path));
+
+        set_config_entry(opts, CONF_STATS_FILE, tmp_path);
+    }
+
 #if USE_FILE_CACHE
     if(opts->config[CONF_DIGEST_FILE] == NULL)
 #else
@@ -497,6 +885,61 @@ validate_options(fko_srv_options_t *opts)
         set_config_entry(opts, CONF_PCAP_LOOP_SLEEP,
             DEF_PCAP_LOOP_SLEEP);
 
+    /* Poll the capture descriptor when idle and busy-poll while packets
+     * are flowing instead of sleeping PCAP_LOOP_SLEEP between dispatches
+    */
+    if(opts->config[CONF_PCAP_ADAPTIVE_POLL] == NULL)
+        set_config_entry(opts, CONF_PCAP_ADAPTIVE_POLL,
+            DEF_PCAP_ADAPTIVE_POLL);
+
+    /* Use a TPACKET_V3 memory mapped ring instead of pcap_dispatch()
+    */
+    if(opts->config[CONF_ENABLE_PCAP_TPACKET_V3] == NULL)
+        set_config_entry(opts, CONF_ENABLE_PCAP_TPACKET_V3,
+            DEF_ENABLE_PCAP_TPACKET_V3);
+
+    /* Number of blocks in the TPACKET_V3 ring
+    */
+    if(opts->config[CONF_PCAP_TPACKET_V3_BLOCKS] == NULL)
+        set_config_entry(opts, CONF_PCAP_TPACKET_V3_BLOCKS,
+            DEF_PCAP_TPACKET_V3_BLOCKS);
+
+    /* Number of TPACKET_V3 capture threads, and how the kernel spreads
+     * frames across them
+    */
+    if(opts->config[CONF_PCAP_CAPTURE_THREADS] == NULL)
+        set_config_entry(opts, CONF_PCAP_CAPTURE_THREADS,
+            DEF_PCAP_CAPTURE_THREADS);
+
+    if(opts->config[CONF_PCAP_FANOUT_MODE] == NULL)
+        set_config_entry(opts, CONF_PCAP_FANOUT_MODE,
+            DEF_PCAP_FANOUT_MODE);
+
+    /* Add SPA payload checks to the kernel packet filter
+    */
+    if(opts->config[CONF_ENABLE_PCAP_PREFILTER] == NULL)
+        set_config_entry(opts, CONF_ENABLE_PCAP_PREFILTER,
+            DEF_ENABLE_PCAP_PREFILTER);
+
+    /* Generate the pcap filter instead of using PCAP_FILTER
+    */
+    if(opts->config[CONF_ENABLE_PCAP_AUTO_FILTER] == NULL)
+        set_config_entry(opts, CONF_ENABLE_PCAP_AUTO_FILTER,
+            DEF_ENABLE_PCAP_AUTO_FILTER);
+
+    /* Restrict the generated filter to the access stanza destinations
+    */
+    if(opts->config[CONF_PCAP_AUTO_FILTER_DESTINATIONS] == NULL)
+        set_config_entry(opts, CONF_PCAP_AUTO_FILTER_DESTINATIONS,
+            DEF_PCAP_AUTO_FILTER_DESTINATIONS);
+
+    /* Accept SPA packets over IPv6
+    */
+    if(opts->config[CONF_ENABLE_IPV6] == NULL)
+        set_config_entry(opts, CONF_ENABLE_IPV6, DEF_ENABLE_IPV6);
+
+    opts->enable_ipv6 = strncasecmp(opts->config[CONF_ENABLE_IPV6], "Y", 1) == 0;
+
     /* Control whether to exit if the interface where we're sniffing
      * goes down.
     */
@@ -537,6 +980,12 @@ validate_options(fko_srv_options_t *opts)
         set_config_entry(opts, CONF_ENABLE_DIGEST_PERSISTENCE,
             DEF_ENABLE_DIGEST_PERSISTENCE);
 
+    /* How often new digest file records are flushed to disk.
+    */
+    if(opts->config[CONF_DIGEST_FILE_SYNC_INTERVAL] == NULL)
+        set_config_entry(opts, CONF_DIGEST_FILE_SYNC_INTERVAL,
+            DEF_DIGEST_FILE_SYNC_INTERVAL);
+
     /* Set firewall rule "deep" collection interval - this allows
      * fwknopd to remove rules with proper _exp_<time> expiration
      * times even when added by a different program.
@@ -699,6 +1148,11 @@ validate_options(fko_srv_options_t *opts)
         set_config_entry(opts, CONF_ENABLE_FIREWD_COMMENT_CHECK,
             DEF_ENABLE_FIREWD_COMMENT_CHECK);
 
+    /* Talk to firewalld over D-Bus rather than running firewall-cmd
+    */
+    if(opts->config[CONF_FIREWD_USE_DBUS] == NULL)
+        set_config_entry(opts, CONF_FIREWD_USE_DBUS, DEF_FIREWD_USE_DBUS);
+
 #elif FIREWALL_IPTABLES
     /* Enable IPT forwarding.
     */
@@ -842,6 +1296,76 @@ validate_options(fko_srv_options_t *opts)
         set_config_entry(opts, CONF_ENABLE_IPT_COMMENT_CHECK,
             DEF_ENABLE_IPT_COMMENT_CHECK);
 
+    /* Grant access through an ipset.
+    */
+    if(opts->config[CONF_ENABLE_IPT_IPSET] == NULL)
+        set_config_entry(opts, CONF_ENABLE_IPT_IPSET, DEF_ENABLE_IPT_IPSET);
+
+    if(opts->config[CONF_IPT_IPSET_NAME] == NULL)
+        set_config_entry(opts, CONF_IPT_IPSET_NAME, DEF_IPT_IPSET_NAME);
+
+    if(strlen(opts->config[CONF_IPT_IPSET_NAME]) >= MAX_IPSET_NAME_LEN
+            || strlen(opts->config[CONF_IPT_IPSET_NAME]) == 0)
+    {
+        log_msg(LOG_ERR,
+            "Invalid IPT_IPSET_NAME '%s', must be 1 to %d characters",
+            opts->config[CONF_IPT_IPSET_NAME], MAX_IPSET_NAME_LEN-1
+        );
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    /* Commit rule changes through iptables-restore.
+    */
+    if(opts->config[CONF_ENABLE_IPT_RESTORE_BATCH] == NULL)
+        set_config_entry(opts, CONF_ENABLE_IPT_RESTORE_BATCH,
+            DEF_ENABLE_IPT_RESTORE_BATCH);
+
+    /* Spread INPUT grants over 2^n sub-chains.
+    */
+    if(opts->config[CONF_IPT_INPUT_SHARD_BITS] == NULL)
+        set_config_entry(opts, CONF_IPT_INPUT_SHARD_BITS,
+            DEF_IPT_INPUT_SHARD_BITS);
+
+    range_check(opts, "IPT_INPUT_SHARD_BITS",
+        opts->config[CONF_IPT_INPUT_SHARD_BITS],
+        0, RCHK_MAX_IPT_INPUT_SHARD_BITS);
+
+#elif FIREWALL_NFTABLES
+    /* Flush nftables set at init.
+    */
+    if(opts->config[CONF_FLUSH_NFT_AT_INIT] == NULL)
+        set_config_entry(opts, CONF_FLUSH_NFT_AT_INIT, DEF_FLUSH_NFT_AT_INIT);
+
+    /* Flush nftables set at exit.
+    */
+    if(opts->config[CONF_FLUSH_NFT_AT_EXIT] == NULL)
+        set_config_entry(opts, CONF_FLUSH_NFT_AT_EXIT, DEF_FLUSH_NFT_AT_EXIT);
+
+    /* Nftables table family and name.
+    */
+    if(opts->config[CONF_NFT_FAMILY] == NULL)
+        set_config_entry(opts, CONF_NFT_FAMILY, DEF_NFT_FAMILY);
+
+    if(validate_nft_family(opts->config[CONF_NFT_FAMILY]) < 0)
+    {
+        log_msg(LOG_ERR,
+            "Invalid NFT_FAMILY '%s', must be 'ip' or 'inet'",
+            opts->config[CONF_NFT_FAMILY]
+        );
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    if(opts->config[CONF_NFT_TABLE] == NULL)
+        set_config_entry(opts, CONF_NFT_TABLE, DEF_NFT_TABLE);
+
+    /* Nftables input chain and access set.
+    */
+    if(opts->config[CONF_NFT_INPUT_CHAIN] == NULL)
+        set_config_entry(opts, CONF_NFT_INPUT_CHAIN, DEF_NFT_INPUT_CHAIN);
+
+    if(opts->config[CONF_NFT_ACCESS_SET] == NULL)
+        set_config_entry(opts, CONF_NFT_ACCESS_SET, DEF_NFT_ACCESS_SET);
+
 #elif FIREWALL_IPFW
 
     /* Flush ipfw rules at init.
@@ -890,6 +1414,16 @@ validate_options(fko_srv_options_t *opts)
         set_config_entry(opts, CONF_IPFW_ADD_CHECK_STATE,
             DEF_IPFW_ADD_CHECK_STATE);
 
+    /* Set IPFW table-based grants.
+    */
+    if(opts->config[CONF_IPFW_USE_TABLES] == NULL)
+        set_config_entry(opts, CONF_IPFW_USE_TABLES,
+            DEF_IPFW_USE_TABLES);
+
+    if(opts->config[CONF_IPFW_TABLE_NAME] == NULL)
+        set_config_entry(opts, CONF_IPFW_TABLE_NAME,
+            DEF_IPFW_TABLE_NAME);
+
 #elif FIREWALL_PF
     /* Set PF anchor name
     */
@@ -903,6 +1437,12 @@ validate_options(fko_srv_options_t *opts)
         set_config_entry(opts, CONF_PF_EXPIRE_INTERVAL,
             DEF_PF_EXPIRE_INTERVAL);
 
+    /* Set PF table-based grants.
+    */
+    if(opts->config[CONF_PF_USE_TABLES] == NULL)
+        set_config_entry(opts, CONF_PF_USE_TABLES,
+            DEF_PF_USE_TABLES);
+
 #elif FIREWALL_IPF
     /* --DSS Place-holder */
 
@@ -939,6 +1479,16 @@ validate_options(fko_srv_options_t *opts)
     if(opts->config[CONF_TCPSERV_PORT] == NULL)
         set_config_entry(opts, CONF_TCPSERV_PORT, DEF_TCPSERV_PORT);
 
+    /* Enable HTTP server.
+    */
+    if(opts->config[CONF_ENABLE_HTTP_SERVER] == NULL)
+        set_config_entry(opts, CONF_ENABLE_HTTP_SERVER, DEF_ENABLE_HTTP_SERVER);
+
+    /* HTTP Server port.
+    */
+    if(opts->config[CONF_HTTPSERV_PORT] == NULL)
+        set_config_entry(opts, CONF_HTTPSERV_PORT, DEF_HTTPSERV_PORT);
+
     /* Enable UDP server.
     */
     if(opts->config[CONF_ENABLE_UDP_SERVER] == NULL)
@@ -963,6 +1513,110 @@ validate_options(fko_srv_options_t *opts)
         set_config_entry(opts, CONF_UDPSERV_SELECT_TIMEOUT,
             DEF_UDPSERV_SELECT_TIMEOUT);
 
+    /* Max datagrams per UDP server receive call
+    */
+    if(opts->config[CONF_UDPSERV_RECV_BATCH] == NULL)
+        set_config_entry(opts, CONF_UDPSERV_RECV_BATCH,
+            DEF_UDPSERV_RECV_BATCH);
+
+    /* Number of UDP server worker threads
+    */
+    if(opts->config[CONF_UDPSERV_WORKERS] == NULL)
+        set_config_entry(opts, CONF_UDPSERV_WORKERS,
+            DEF_UDPSERV_WORKERS);
+
+    /* NFLOG capture
+    */
+    if(opts->config[CONF_ENABLE_NFLOG_CAPTURE] == NULL)
+        set_config_entry(opts, CONF_ENABLE_NFLOG_CAPTURE,
+            DEF_ENABLE_NFLOG_CAPTURE);
+
+    if(opts->config[CONF_NFLOG_GROUP] == NULL)
+        set_config_entry(opts, CONF_NFLOG_GROUP, DEF_NFLOG_GROUP);
+
+    if(opts->config[CONF_NFLOG_QTHRESHOLD] == NULL)
+        set_config_entry(opts, CONF_NFLOG_QTHRESHOLD,
+            DEF_NFLOG_QTHRESHOLD);
+
+    /* Number of SPA decrypt/authorize worker threads
+    */
+    if(opts->config[CONF_SPA_WORKERS] == NULL)
+        set_config_entry(opts, CONF_SPA_WORKERS, DEF_SPA_WORKERS);
+
+    /* Queue delay (ms) above which queued SPA packets are shed
+    */
+    if(opts->config[CONF_SPA_SHED_TARGET_DELAY] == NULL)
+        set_config_entry(opts, CONF_SPA_SHED_TARGET_DELAY,
+            DEF_SPA_SHED_TARGET_DELAY);
+
+    /* Number of cached service access decisions (SDP mode)
+    */
+    if(opts->config[CONF_AUTHZ_CACHE_SIZE] == NULL)
+        set_config_entry(opts, CONF_AUTHZ_CACHE_SIZE, DEF_AUTHZ_CACHE_SIZE);
+
+    /* Number of SDP access stanzas kept expanded (0 expands them all)
+    */
+    if(opts->config[CONF_ACCESS_EXPAND_LIMIT] == NULL)
+        set_config_entry(opts, CONF_ACCESS_EXPAND_LIMIT, DEF_ACCESS_EXPAND_LIMIT);
+
+    /* Access grants held at once by all clients (0 for no limit)
+    */
+    if(opts->config[CONF_MAX_ACTIVE_GRANTS] == NULL)
+        set_config_entry(opts, CONF_MAX_ACTIVE_GRANTS, DEF_MAX_ACTIVE_GRANTS);
+
+    /* Apply granted requests to the firewall from their own thread
+    */
+    if(opts->config[CONF_ENABLE_FW_COMMIT_THREAD] == NULL)
+        set_config_entry(opts, CONF_ENABLE_FW_COMMIT_THREAD,
+            DEF_ENABLE_FW_COMMIT_THREAD);
+
+    /* Run external commands through a persistent helper process
+    */
+    if(opts->config[CONF_ENABLE_EXTCMD_HELPER] == NULL)
+        set_config_entry(opts, CONF_ENABLE_EXTCMD_HELPER,
+            DEF_ENABLE_EXTCMD_HELPER);
+
+    /* Per-source SPA packet rate limit
+    */
+    if(opts->config[CONF_SPA_RATE_LIMIT] == NULL)
+        set_config_entry(opts, CONF_SPA_RATE_LIMIT, DEF_SPA_RATE_LIMIT);
+
+    if(opts->config[CONF_SPA_RATE_BURST] == NULL)
+        set_config_entry(opts, CONF_SPA_RATE_BURST, DEF_SPA_RATE_BURST);
+
+    /* Replay digest sharing between gateways (off by default)
+    */
+    if(opts->config[CONF_REPLAY_GOSSIP_PORT] == NULL)
+        set_config_entry(opts, CONF_REPLAY_GOSSIP_PORT, DEF_REPLAY_GOSSIP_PORT);
+
+    /* Cluster placement of SDP clients (off by default)
+    */
+    if(opts->config[CONF_CLUSTER_PORT] == NULL)
+        set_config_entry(opts, CONF_CLUSTER_PORT, DEF_CLUSTER_PORT);
+
+    /* Grant replication to a standby gateway (off by default)
+    */
+    if(opts->config[CONF_HA_SYNC_PORT] == NULL)
+        set_config_entry(opts, CONF_HA_SYNC_PORT, DEF_HA_SYNC_PORT);
+
+    /* Metrics endpoint (off by default)
+    */
+    if(opts->config[CONF_METRICS_PORT] == NULL)
+        set_config_entry(opts, CONF_METRICS_PORT, DEF_METRICS_PORT);
+
+    if(opts->config[CONF_METRICS_ADDRESS] == NULL)
+        set_config_entry(opts, CONF_METRICS_ADDRESS, DEF_METRICS_ADDRESS);
+
+    /* Shared memory stats page (off by default)
+    */
+    if(opts->config[CONF_STATS_INTERVAL] == NULL)
+        set_config_entry(opts, CONF_STATS_INTERVAL, DEF_STATS_INTERVAL);
+
+    /* libfko crypto implementations (the fastest by default)
+    */
+    if(opts->config[CONF_CRYPTO_IMPL] == NULL)
+        set_config_entry(opts, CONF_CRYPTO_IMPL, DEF_CRYPTO_IMPL);
+
     /* Syslog identity.
     */
     if(opts->config[CONF_SYSLOG_IDENTITY] == NULL)
@@ -973,6 +1627,31 @@ validate_options(fko_srv_options_t *opts)
     if(opts->config[CONF_SYSLOG_FACILITY] == NULL)
         set_config_entry(opts, CONF_SYSLOG_FACILITY, DEF_SYSLOG_FACILITY);
 
+    /* Direct log file sink (LOG_FILE itself has no default, it is off
+     * unless set).
+    */
+    if(opts->config[CONF_LOG_FILE_MAX_SIZE] == NULL)
+        set_config_entry(opts, CONF_LOG_FILE_MAX_SIZE, DEF_LOG_FILE_MAX_SIZE);
+
+    if(opts->config[CONF_LOG_FILE_ROTATE_INTERVAL] == NULL)
+        set_config_entry(opts, CONF_LOG_FILE_ROTATE_INTERVAL,
+            DEF_LOG_FILE_ROTATE_INTERVAL);
+
+    if(opts->config[CONF_LOG_FILE_KEEP] == NULL)
+        set_config_entry(opts, CONF_LOG_FILE_KEEP, DEF_LOG_FILE_KEEP);
+
+    if(opts->config[CONF_LOG_FILE_JSON] == NULL)
+        set_config_entry(opts, CONF_LOG_FILE_JSON, DEF_LOG_FILE_JSON);
+
+    if(opts->config[CONF_FLIGHT_RECORDER_SIZE] == NULL)
+        set_config_entry(opts, CONF_FLIGHT_RECORDER_SIZE, DEF_FLIGHT_RECORDER_SIZE);
+
+    if(opts->config[CONF_SPA_TRACE] == NULL)
+        set_config_entry(opts, CONF_SPA_TRACE, DEF_SPA_TRACE);
+
+    if(opts->config[CONF_MEM_LIMIT] == NULL)
+        set_config_entry(opts, CONF_MEM_LIMIT, DEF_MEM_LIMIT);
+
     /* SDP Mode
     */
     if(opts->config[CONF_DISABLE_SDP_MODE] == NULL)
@@ -989,6 +1668,17 @@ validate_options(fko_srv_options_t *opts)
         clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
     }
 
+#if SDP_FASTPATH
+    /* The packet path of an --enable-sdp-fastpath build has no legacy mode.
+    */
+    if(strncasecmp(opts->config[CONF_DISABLE_SDP_MODE], "Y", 1) == 0)
+    {
+        log_msg(LOG_ERR,
+            "[*] DISABLE_SDP_MODE cannot be set, fwknopd was built with --enable-sdp-fastpath");
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+    }
+#endif
+
     /* SDP Mode
     */
     if(opts->config[CONF_ALLOW_LEGACY_ACCESS_REQUESTS] == NULL)
@@ -1017,6 +1707,9 @@ validate_options(fko_srv_options_t *opts)
         set_config_entry(opts, CONF_SERVICE_HASH_TABLE_LENGTH, DEF_SERVICE_HASH_TABLE_LENGTH_STR);
     }
 
+    pthread_mutex_init(&(opts->replay_cache_mutex), NULL);
+    pthread_mutex_init(&(opts->spa_grant_mutex), NULL);
+
     if(strncmp(opts->config[CONF_DISABLE_SDP_MODE], "N", 1) == 0)
     {
         // initialize the hash table mutexes
@@ -1052,11 +1745,42 @@ validate_options(fko_srv_options_t *opts)
         }
     }
 
+    if(opts->config[CONF_CONNTRACK_USE_NETLINK] == NULL)
+        set_config_entry(opts, CONF_CONNTRACK_USE_NETLINK,
+            DEF_CONNTRACK_USE_NETLINK);
+
+    if(opts->config[CONF_CONNTRACK_BUF_SIZE] == NULL)
+        set_config_entry(opts, CONF_CONNTRACK_BUF_SIZE,
+            DEF_CONNTRACK_BUF_SIZE);
+
     if(opts->config[CONF_MAX_WAIT_ACC_DATA] == NULL)
     {
         set_config_entry(opts, CONF_MAX_WAIT_ACC_DATA, DEF_MAX_WAIT_ACC_DATA);
     }
 
+    if(opts->config[CONF_ACC_SNAPSHOT_MAX_AGE] == NULL)
+    {
+        set_config_entry(opts, CONF_ACC_SNAPSHOT_MAX_AGE, DEF_ACC_SNAPSHOT_MAX_AGE);
+    }
+
+    if(opts->config[CONF_SDP_SHARD_COUNT] == NULL)
+        set_config_entry(opts, CONF_SDP_SHARD_COUNT, DEF_SDP_SHARD_COUNT);
+
+    if(opts->config[CONF_SDP_SHARD_INDEX] == NULL)
+        set_config_entry(opts, CONF_SDP_SHARD_INDEX, DEF_SDP_SHARD_INDEX);
+
+    // the snapshot holds client keys, so it is never written unencrypted
+    if(opts->config[CONF_ACC_SNAPSHOT_FILE] != NULL
+            && (opts->config[CONF_ACC_SNAPSHOT_KEY] == NULL
+                || strlen(opts->config[CONF_ACC_SNAPSHOT_KEY]) < ACC_SNAPSHOT_MIN_KEY_LEN))
+    {
+        log_msg(LOG_ERR,
+            "Invalid configuration: ACC_SNAPSHOT_KEY must be at least %d "
+            "characters when ACC_SNAPSHOT_FILE is set", ACC_SNAPSHOT_MIN_KEY_LEN
+        );
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+    }
+
     if(strncmp(opts->config[CONF_DISABLE_SDP_CTRL_CLIENT], "N", 1) == 0)
     {
         // config file path must be set, no default
@@ -1075,6 +1799,12 @@ validate_options(fko_srv_options_t *opts)
     */
     validate_int_var_ranges(opts);
 
+    validate_sdp_shard(opts);
+
+    /* Everything the packet path needs is now set and range checked.
+    */
+    build_runtime_config(opts);
+
     /* Some options just trigger some output of information, or trigger an
      * external function, but do not actually start fwknopd.  If any of those
      * are set, we can return here an skip the validation routines as all
@@ -1082,13 +1812,15 @@ validate_options(fko_srv_options_t *opts)
      *
      * These are also mutually exclusive (for now).
     */
-    if((opts->dump_config + opts->kill + opts->restart + opts->status) == 1)
+    if((opts->dump_config + opts->kill + opts->restart + opts->status
+            + opts->stats) == 1)
         return;
 
-    if((opts->dump_config + opts->kill + opts->restart + opts->status) > 1)
+    if((opts->dump_config + opts->kill + opts->restart + opts->status
+            + opts->stats) > 1)
     {
         log_msg(LOG_ERR,
-            "The -D, -K, -R, and -S options are mutually exclusive.  Pick only one."
+            "The -D, -K, -R, -S and --stats options are mutually exclusive.  Pick only one."
         );
         clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
     }
@@ -1131,6 +1863,7 @@ config_init(fko_srv_options_t *opts, int argc, char **argv)
     unsigned char   got_conf_file = 0, got_override_config = 0;
 
     char            override_file[MAX_LINE_LEN] = {0};
+    char            impl_spec[FKO_IMPL_SPEC_LEN];
     char           *ndx, *cmrk;
 
     /* Zero out options and opts_track.
@@ -1157,6 +1890,9 @@ config_init(fko_srv_options_t *opts, int argc, char **argv)
             case 'V':
                 fprintf(stdout, "fwknopd server %s, compiled for firewall bin: %s\n",
                         MY_VERSION, FIREWALL_EXE);
+                if(fko_impl_calibrate() == FKO_SUCCESS
+                        && fko_impl_get_spec(impl_spec, sizeof(impl_spec)) == FKO_SUCCESS)
+                    fprintf(stdout, "crypto implementations: %s\n", impl_spec);
                 clean_exit(opts, NO_FW_CLEANUP, EXIT_SUCCESS);
             case 'k':
                 opts->key_gen = 1;
@@ -1385,7 +2121,7 @@ config_init(fko_srv_options_t *opts, int argc, char **argv)
             case CONN_ID_FILE:
                 set_config_entry(opts, CONF_CONN_ID_FILE, optarg);
                 break;
-            case CONF_CONN_REPORT_INTERVAL:
+            case CONN_REPORT_INTERVAL:
                 set_config_entry(opts, CONF_CONN_REPORT_INTERVAL, optarg);
                 break;
             case MAX_WAIT_ACC_DATA:
@@ -1404,6 +2140,9 @@ config_init(fko_srv_options_t *opts, int argc, char **argv)
                 opts->exit_after_parse_config = 1;
                 opts->foreground = 1;
                 break;
+            case UPGRADE:
+                opts->upgrade = 1;
+                break;
             case 'f':
                 opts->foreground = 1;
                 break;
@@ -1478,6 +2217,45 @@ config_init(fko_srv_options_t *opts, int argc, char **argv)
             case PCAP_FILE:
                 set_config_entry(opts, CONF_PCAP_FILE, optarg);
                 break;
+            case BENCHMARK:
+                opts->benchmark = 1;
+                break;
+            case BENCHMARK_LOOPS:
+                opts->benchmark_loops = strtol_wrapper(optarg,
+                        1, RCHK_MAX_BENCHMARK_LOOPS, NO_EXIT_UPON_ERR, &is_err);
+                if(is_err != FKO_SUCCESS)
+                {
+                    log_msg(LOG_ERR,
+                        "[*] invalid --benchmark-loops value '%s'", optarg);
+                    clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+                }
+                break;
+            case BENCHMARK_SYNTH:
+                opts->benchmark_synth = optarg;
+                break;
+            case BENCHMARK_FW:
+                opts->benchmark_fw = optarg;
+                break;
+            case DUMP_FORMAT:
+                if(strcasecmp(optarg, "json") == 0)
+                    opts->dump_json = 1;
+                else if(strcasecmp(optarg, "text") != 0)
+                {
+                    log_msg(LOG_ERR,
+                        "[*] invalid --dump-format value '%s', must be 'text' or 'json'", optarg);
+                    clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+                }
+                break;
+            case DUMP_SDP_ID:
+            case DUMP_SERVICE_ID:
+                if(config_dump_parse_id(optarg, (cmd_arg == DUMP_SDP_ID)
+                            ? &(opts->dump_sdp_id) : &(opts->dump_service_id)) != 0)
+                {
+                    log_msg(LOG_ERR, "[*] invalid --%s value '%s'",
+                        (cmd_arg == DUMP_SDP_ID) ? "dump-sdp-id" : "dump-service-id", optarg);
+                    clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+                }
+                break;
             case ENABLE_PCAP_ANY_DIRECTION:
                 opts->pcap_any_direction = 1;
                 break;
@@ -1493,6 +2271,9 @@ config_init(fko_srv_options_t *opts, int argc, char **argv)
             case 'S':
                 opts->status = 1;
                 break;
+            case STATS:
+                opts->stats = 1;
+                break;
             case SUDO_EXE_PATH:
                 if (is_valid_exe(optarg))
                 {
@@ -1525,6 +2306,66 @@ config_init(fko_srv_options_t *opts, int argc, char **argv)
         }
     }
 
+    /* Benchmark mode replays a pcap file as fast as possible without
+     * touching the firewall, so it implies --test and --foreground.
+    */
+    if(opts->benchmark)
+    {
+#if USE_LIBPCAP
+        if(opts->config[CONF_PCAP_FILE] == NULL)
+        {
+            log_msg(LOG_ERR, "[*] --benchmark requires --pcap-file");
+            clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+        }
+        opts->test       = 1;
+        opts->foreground = 1;
+        if(opts->benchmark_loops == 0)
+            opts->benchmark_loops = 1;
+#else
+        log_msg(LOG_ERR, "[*] --benchmark requires fwknopd to be compiled with libpcap");
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+#endif
+    }
+
+    /* The synthetic benchmark builds its own SDP access and service
+     * tables in place of the controller's, so it also forces SDP mode
+     * with the control client off.
+    */
+    if(opts->benchmark_synth != NULL)
+    {
+        if(opts->benchmark)
+        {
+            log_msg(LOG_ERR, "[*] --benchmark and --benchmark-synth are mutually exclusive");
+            clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+        }
+        opts->test       = 1;
+        opts->foreground = 1;
+        set_config_entry(opts, CONF_DISABLE_SDP_MODE, "N");
+        set_config_entry(opts, CONF_DISABLE_SDP_CTRL_CLIENT, "Y");
+    }
+
+    /* The firewall benchmark adds its grants straight through the
+     * firewall backend in a network namespace of its own.  Commands have
+     * to run in that namespace, so not through the external command
+     * helper (which is started before it is created).
+    */
+    if(opts->benchmark_fw != NULL)
+    {
+        if(opts->benchmark || opts->benchmark_synth != NULL)
+        {
+            log_msg(LOG_ERR, "[*] --benchmark-fw cannot be combined with the other benchmarks");
+            clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+        }
+        if(opts->test)
+        {
+            log_msg(LOG_ERR, "[*] --benchmark-fw needs the firewall, it cannot be used with --test");
+            clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+        }
+        opts->foreground = 1;
+        set_config_entry(opts, CONF_DISABLE_SDP_CTRL_CLIENT, "Y");
+        set_config_entry(opts, CONF_ENABLE_EXTCMD_HELPER, "N");
+    }
+
     /* Now that we have all of our options set, and we are actually going to
      * start fwknopd, we can validate them.
     */
@@ -1533,6 +2374,23 @@ config_init(fko_srv_options_t *opts, int argc, char **argv)
     return;
 }
 
+/* Whether a config entry is a key that is left out of config dumps.
+*/
+int
+config_entry_is_secret(const int i)
+{
+    return(i == CONF_REPLAY_GOSSIP_KEY || i == CONF_ACC_SNAPSHOT_KEY
+            || i == CONF_CLUSTER_KEY || i == CONF_HA_SYNC_KEY);
+}
+
+/* The config file keyword of a config entry.
+*/
+const char *
+config_entry_name(const int i)
+{
+    return((i < 0 || i >= NUMBER_OF_CONFIG_ENTRIES) ? NULL : config_map[i]);
+}
+
 /* Dump the configuration
 */
 void
@@ -1567,12 +2425,17 @@ dump_config(const fko_srv_options_t *opts)
     fprintf(dest, "\n\n\n%s", asctime(loctime));
     fprintf(dest, "Current fwknopd config settings:\n");
 
+    /* A SIGHUP reload may swap some of the strings meanwhile.
+    */
+    rcu_read_lock();
     for(i=0; i<NUMBER_OF_CONFIG_ENTRIES; i++)
         fprintf(dest, "%3i. %-28s =  '%s'\n",
             i,
             config_map[i],
-            (opts->config[i] == NULL) ? "<not set>" : opts->config[i]
+            (opts->config[i] == NULL) ? "<not set>"
+                : config_entry_is_secret(i) ? "<hidden>" : opts->config[i]
         );
+    rcu_read_unlock();
 
     fprintf(dest, "\n");
     fflush(dest);
@@ -1602,6 +2465,11 @@ usage(void)
       "                           process and exit when this limit is reached.\n"
       " -d, --digest-file       - Specify an alternate digest.cache file.\n"
       " -D, --dump-config       - Dump the current fwknop configuration values.\n"
+      "     --dump-format       - 'text' (default) or 'json' (one JSON object per\n"
+      "                           line) for --dump-config.\n"
+      "     --dump-sdp-id       - Only dump the access stanza for this SDP ID.\n"
+      "     --dump-service-id   - Only dump this service and the access stanzas\n"
+      "                           that include it.\n"
       " -K, --kill              - Kill the currently running fwknopd.\n"
       " -l, --locale            - Provide a locale setting other than the system\n"
       "                           default.\n"
@@ -1618,9 +2486,14 @@ usage(void)
       "                         - Rotate the digest cache file by renaming it to\n"
       "                           '<name>-old', and starting a new one.\n"
       " -S, --status            - Display the status of any running fwknopd process.\n"
+      "     --stats             - Print the stats page (STATS_INTERVAL) of the\n"
+      "                           running fwknopd.\n"
       " -t, --test              - Test mode, process SPA packets but do not make any\n"
       "                           firewall modifications.\n"
       " -U, --udp-server        - Set UDP server mode.\n"
+      "     --upgrade           - Take over from the running fwknopd (e.g. a new\n"
+      "                           binary after a package upgrade), keeping its\n"
+      "                           sockets, replay cache and firewall rules.\n"
       " -v, --verbose           - Set verbose mode.\n"
       "     --syslog-enable     - Allow messages to be sent to syslog even if the\n"
       "                           foreground mode is set.\n"
@@ -1635,6 +2508,21 @@ usage(void)
       "                           test suite).\n"
       " --pcap-file             - Read potential SPA packets from an existing pcap\n"
       "                           file.\n"
+      " --benchmark             - Replay the --pcap-file as fast as possible in test\n"
+      "                           mode and print throughput, per-stage latency and\n"
+      "                           peak memory numbers.\n"
+      " --benchmark-loops       - Number of times to replay the pcap file in\n"
+      "                           --benchmark mode (default 1).\n"
+      " --benchmark-synth       - Build synthetic SDP access and service tables,\n"
+      "                           process generated SPA packets against them in\n"
+      "                           test mode and report as for --benchmark.  Takes\n"
+      "                           one or more comma separated table sizes of the\n"
+      "                           form stanzas[:services[:grants[:packets]]], e.g.\n"
+      "                           '1000,100000:10000:50000'.\n"
+      " --benchmark-fw          - Add, probe and expire the given comma separated\n"
+      "                           numbers of grants through the firewall backend\n"
+      "                           in a new network namespace and print the\n"
+      "                           latencies as JSON, e.g. '1,100,10000,100000'.\n"
       " --pcap-any-direction    - By default fwknopd processes packets that are\n"
       "                           sent to the sniffing interface, but this option\n"
       "                           enables processing of packets that originate from\n"
@@ -38,8 +38,13 @@
 */
 void config_init(fko_srv_options_t *opts, int argc, char **argv);
 void dump_config(const fko_srv_options_t *opts);
+int config_entry_is_secret(const int i);
+const char *config_entry_name(const int i);
 void clear_configs(fko_srv_options_t *opts);
 void free_configs(fko_srv_options_t *opts);
+void free_runtime_config(fko_srv_options_t *opts);
+int config_reload_diff(const fko_srv_options_t *opts, const fko_srv_options_t *new_opts);
+void config_reload_apply(fko_srv_options_t *opts, fko_srv_options_t *new_opts);
 void usage(void);
 
 #endif /* CONFIG_INIT_H */
@@ -14,16 +14,31 @@
 #include "log_msg.h"
 #include "extcmd.h"
 #include "access.h"
-#include "bstrlib.h"
+#include "acc_id_map.h"
+#include "acc_lazy.h"
+#include "rcu.h"
+#include "mem_acct.h"
 #include "hash_table.h"
 #include "sdp_ctrl_client.h"
 #include <json-c/json.h>
 #include <fcntl.h>
 #include "service.h"
 #include "connection_tracker.h"
+#include "conntrack_thread.h"
+#include "fwknop_probes.h"
+#include "fw_util.h"
+#include "metrics.h"
+#include <arpa/inet.h>
+#if FIREWALL_IPTABLES || FIREWALL_FIREWALLD
+  #include "conntrack_nl.h"
+#endif
+#ifdef HAVE_LIBZ
+  #include <zlib.h>
+#endif
 
-//const char *conn_id_key = "connection_id";
+const char *conn_id_key = "connection_id";
 const char *sdp_id_key  = "sdp_id";
+static const char *conn_seq_key = "seq";
 
 //#define DEBUG_CONNECTION_TRACKER
 #ifdef DEBUG_CONNECTION_TRACKER
@@ -32,13 +47,9 @@ static int new_unknown_conn_count_closed;
 static int new_unknown_conn_count_open;
 static int new_unknown_conn_count_before_walk;
 static int known_conn_cnt_before_update;
-static int known_conn_cnt_before_update_closed;
-static int known_conn_cnt_before_update_open;
 static int known_conn_cnt_after_update;
-static int known_conn_cnt_after_update_closed;
-static int known_conn_cnt_after_update_open;
+static int known_conns_closed;
 static int final_known_cnt;
-static int known_conns_deleted_during_comp;
 static int known_conns_deleted;
 #endif
 
@@ -46,13 +57,43 @@ static int known_conns_deleted;
 static int msg_conn_list_count = 0;
 static hash_table_t *connection_hash_tbl = NULL;
 static hash_table_t *latest_connection_hash_tbl = NULL;
-//static uint64_t last_conn_id = 0;
+static uint64_t last_conn_id = 0;
+static uint64_t conn_id_lease_end = 0;
 static connection_t msg_conn_list = NULL;
 static int verbosity = 0;
 static time_t next_ctrl_msg_due = 0;
-static char conntrack_buf[CONNTRACK_CMD_OUT_BUFSIZE] = {0};
+// output of 'conntrack -L', allocated the first time the command is
+// run, so it takes no memory while conntrack is followed over netlink
+static char *conntrack_buf = NULL;
+static int conntrack_buf_size = 0;
+#if FIREWALL_IPTABLES || FIREWALL_FIREWALLD
+static int conntrack_nl_active = 0;
+#endif
+
+// Known connections are also indexed by conn_key_t in a flat
+// open-addressing table (linear probing, backward-shift deletion), so
+// each connection in conntrack is matched with a single lookup.
+// Matched connections are stamped with conn_gen; the ones left with
+// an older stamp after an update are gone.
+static connection_t *conn_index = NULL;
+static uint32_t conn_index_size = 0;
+static uint32_t conn_index_count = 0;
+static uint32_t conn_gen = 0;
+
+// With CONN_REPORT_DELTAS, reports carry a sequence number that the
+// controller acknowledges. A snapshot of all open connections goes out
+// only on request, after a failed send, or when acks fall too far behind.
+static int report_deltas = 0;
+static int report_compress = 0;
+static int report_snapshot_due = 0;
+static uint32_t report_seq = 0;
+static uint32_t report_acked_seq = 0;
+
+// packet and byte counts go in reports
+static int report_counters = 0;
 
 static int close_connections(fko_srv_options_t *opts, char *criteria);
+static uint64_t next_conn_id(const fko_srv_options_t *opts);
 
 
 static void print_connection_item(connection_t this_conn)
@@ -67,7 +108,7 @@ static void print_connection_item(connection_t this_conn)
            100);
 
     log_msg(LOG_WARNING,
-//            "    Conn ID:  %"PRIu64"\n"
+            "     Conn ID:  %"PRIu64"\n"
             "      SDP ID:  %"PRIu32"\n"
             "  service ID:  %"PRIu32"\n"
             "    protocol:  %s\n"
@@ -80,7 +121,7 @@ static void print_connection_item(connection_t this_conn)
             "  start time:  %s"
             "    end time:  %s"
             "        next:  %p\n\n",
-//            this_conn->connection_id,
+            this_conn->connection_id,
             this_conn->sdp_id,
             this_conn->service_id,
             this_conn->protocol,
@@ -111,7 +152,7 @@ static void print_connection_list(connection_t conn)
 
 static void destroy_connection_item(connection_t item)
 {
-    free(item);
+    mem_free(MEM_TAG_CONNTRACK, item);
 }
 
 
@@ -129,47 +170,45 @@ static void destroy_connection_list(connection_t list)
 }
 
 
-static int validate_connection(acc_stanza_t *acc, connection_t conn, int *valid_r)
+// Must be called inside rcu_read_lock(), acc is NULL if the SDP ID
+// has no (unexpired) stanza.
+static int judge_connection(acc_stanza_t *acc, connection_t conn)
 {
-    acc_service_list_t *open_service = NULL;
+    acc_stanza_exp_t *exp = NULL;
     acc_port_list_t *open_port = NULL;
 
-    *valid_r = 0;
-
-    if( !(acc && conn) )
-    {
-        log_msg(LOG_ERR, "validate_connection() ERROR: NULL arg passed");
-        return FWKNOPD_ERROR_CONNTRACK;
-    }
+    if(acc == NULL)
+        return CONN_VERDICT_REVOKED;
 
-    open_service = acc->service_list;
+    // a stanza that cannot be expanded allows nothing
+    if((exp = acc_stanza_expand(acc)) == NULL)
+        return CONN_VERDICT_INVALID;
 
-    while(open_service != NULL)
-    {
-        if(open_service->service_id == conn->service_id)
-        {
-            *valid_r = 1;
-            return FWKNOPD_SUCCESS;
-        }
-        open_service = open_service->next;
-    }
+    if(acc_service_set_test(exp->service_set, conn->service_id))
+        return CONN_VERDICT_VALID;
 
     // that didn't work, look for an open port
-    open_port = acc->oport_list;
-
-    while(open_port != NULL)
+    for(open_port = exp->oport_list; open_port != NULL; open_port = open_port->next)
     {
         if(open_port->port == conn->dst_port)
-        {
-            *valid_r = 1;
-            return FWKNOPD_SUCCESS;
-        }
-        open_port = open_port->next;
+            return CONN_VERDICT_VALID;
     }
 
-    log_msg(LOG_WARNING, "validate_connection() found invalid connection:");
-    print_connection_item(conn);
-    return FWKNOPD_SUCCESS;
+    return CONN_VERDICT_INVALID;
+}
+
+
+// Must be called inside rcu_read_lock().
+static acc_stanza_t *judge_stanza_get(fko_srv_options_t *opts, uint32_t sdp_id)
+{
+    acc_stanza_t *acc = acc_id_map_get(rcu_dereference(opts->acc_stanza_hash_tbl),
+            sdp_id);
+
+    // an expired stanza no longer authorizes anything
+    if(acc != NULL && acc->expired)
+        acc = NULL;
+
+    return acc;
 }
 
 
@@ -199,6 +238,185 @@ static int add_to_connection_list(connection_t *list, connection_t new_guy)
 }
 
 
+static uint32_t conn_key_hash(const conn_key_t *key)
+{
+    uint32_t words[sizeof(conn_key_t) / sizeof(uint32_t)];
+    uint32_t h = 0;
+    size_t i = 0;
+
+    memcpy(words, key, sizeof(words));
+
+    for(i = 0; i < sizeof(words) / sizeof(words[0]); i++)
+    {
+        h = (h ^ words[i]) * 0x9e3779b1;
+        h ^= h >> 16;
+    }
+
+    h ^= h >> 13;
+    h *= 0x85ebca6b;
+    h ^= h >> 16;
+    return h;
+}
+
+
+static int conn_index_grow(void)
+{
+    uint32_t new_size = conn_index_size ? conn_index_size * 2 : CONN_INDEX_MIN_SIZE;
+    connection_t *new_index = NULL;
+    uint32_t i = 0, j = 0;
+
+    if( (new_index = mem_calloc(MEM_TAG_CONNTRACK, new_size, sizeof *new_index)) == NULL)
+    {
+        log_msg(LOG_ERR, "conn_index_grow() FATAL MEMORY ERROR. ABORTING.");
+        return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+    }
+
+    for(i = 0; i < conn_index_size; i++)
+    {
+        if(conn_index[i] == NULL)
+            continue;
+
+        j = conn_key_hash(&(conn_index[i]->key)) & (new_size - 1);
+        while(new_index[j] != NULL)
+            j = (j + 1) & (new_size - 1);
+        new_index[j] = conn_index[i];
+    }
+
+    mem_free(MEM_TAG_CONNTRACK, conn_index);
+    conn_index = new_index;
+    conn_index_size = new_size;
+    return FWKNOPD_SUCCESS;
+}
+
+
+static connection_t conn_index_get(const conn_key_t *key)
+{
+    uint32_t i = 0;
+
+    if(conn_index == NULL)
+        return NULL;
+
+    i = conn_key_hash(key) & (conn_index_size - 1);
+    while(conn_index[i] != NULL)
+    {
+        if(memcmp(&(conn_index[i]->key), key, sizeof(*key)) == 0)
+            return conn_index[i];
+        i = (i + 1) & (conn_index_size - 1);
+    }
+
+    return NULL;
+}
+
+
+static int conn_index_add(connection_t conn)
+{
+    int rv = FWKNOPD_SUCCESS;
+    uint32_t i = 0;
+
+    // keep the load factor at or under one half
+    if((conn_index_count + 1) * 2 > conn_index_size)
+    {
+        if( (rv = conn_index_grow()) != FWKNOPD_SUCCESS)
+            return rv;
+    }
+
+    i = conn_key_hash(&(conn->key)) & (conn_index_size - 1);
+    while(conn_index[i] != NULL)
+    {
+        if(conn_index[i] == conn)
+            return rv;
+        i = (i + 1) & (conn_index_size - 1);
+    }
+
+    conn_index[i] = conn;
+    conn_index_count++;
+    return rv;
+}
+
+
+static void conn_index_del(connection_t conn)
+{
+    uint32_t mask = conn_index_size - 1;
+    uint32_t i = 0, j = 0, home = 0;
+
+    if(conn_index == NULL)
+        return;
+
+    i = conn_key_hash(&(conn->key)) & mask;
+    while(conn_index[i] != conn)
+    {
+        if(conn_index[i] == NULL)
+            return;
+        i = (i + 1) & mask;
+    }
+
+    // close the gap: pull back each following entry of the probe run
+    // that would not be found past the hole
+    for(j = (i + 1) & mask; conn_index[j] != NULL; j = (j + 1) & mask)
+    {
+        home = conn_key_hash(&(conn_index[j]->key)) & mask;
+
+        if( (i <= j) ? (home > i && home <= j) : (home > i || home <= j) )
+            continue;
+
+        conn_index[i] = conn_index[j];
+        i = j;
+    }
+
+    conn_index[i] = NULL;
+    conn_index_count--;
+}
+
+
+// Conntrack counts only go up, but a connection followed over netlink
+// has none until its entry is dumped again, so keep the higher count.
+// Returns whether any count went up.
+static int conn_counters_update(connection_t known, connection_t latest)
+{
+    int dir, moved = 0;
+
+    for(dir = CONN_DIR_ORIG; dir <= CONN_DIR_REPLY; dir++)
+    {
+        if(latest->packets[dir] > known->packets[dir])
+        {
+            known->packets[dir] = latest->packets[dir];
+            moved = 1;
+        }
+        if(latest->bytes[dir] > known->bytes[dir])
+            known->bytes[dir] = latest->bytes[dir];
+    }
+    return moved;
+}
+
+static void conn_counters_mark_reported(connection_t conn)
+{
+    memcpy(conn->reported_packets, conn->packets, sizeof(conn->packets));
+    memcpy(conn->reported_bytes, conn->bytes, sizeof(conn->bytes));
+}
+
+static int conn_counters_changed(connection_t conn)
+{
+    return memcmp(conn->reported_packets, conn->packets, sizeof(conn->packets)) != 0
+        || memcmp(conn->reported_bytes, conn->bytes, sizeof(conn->bytes)) != 0;
+}
+
+static uint64_t counter_delta(uint64_t count, uint64_t reported)
+{
+    // a smaller count belongs to a new flow reusing the same tuple
+    return count >= reported ? count - reported : count;
+}
+
+
+static void conn_index_del_list(connection_t list)
+{
+    while(list != NULL)
+    {
+        conn_index_del(list);
+        list = list->next;
+    }
+}
+
+
 static int create_connection_item( //uint64_t connection_id,
                                    uint32_t sdp_id,
                                    uint32_t service_id,
@@ -214,7 +432,7 @@ static int create_connection_item( //uint64_t connection_id,
                                    connection_t *this_conn_r
                                  )
 {
-    connection_t this_conn = calloc(1, sizeof *this_conn);
+    connection_t this_conn = mem_calloc(MEM_TAG_CONNTRACK, 1, sizeof *this_conn);
 
     if(this_conn == NULL)
     {
@@ -223,7 +441,6 @@ static int create_connection_item( //uint64_t connection_id,
         return FWKNOPD_ERROR_MEMORY_ALLOCATION;
     }
 
-//    this_conn->connection_id = connection_id;
     this_conn->sdp_id     = sdp_id;
     this_conn->service_id = service_id;
     strncpy(this_conn->protocol, protocol, MAX_PROTO_STR_LEN+1);
@@ -233,6 +450,7 @@ static int create_connection_item( //uint64_t connection_id,
     this_conn->dst_port   = dst_port;
     this_conn->start_time = start_time;
     this_conn->end_time   = end_time;
+    this_conn->active_time = time(NULL);
 
     if(nat_dst_ip_str != NULL)
         strncpy(this_conn->nat_dst_ip_str, nat_dst_ip_str, MAX_IPV4_STR_LEN);
@@ -245,15 +463,11 @@ static int create_connection_item( //uint64_t connection_id,
 }
 
 
-static int close_invalid_connection(fko_srv_options_t *opts, connection_t this_conn)
+static int close_invalid_connection_cmd(fko_srv_options_t *opts, connection_t this_conn)
 {
-    int rv = FWKNOPD_SUCCESS;
     char criteria[CRITERIA_BUF_LEN];
     int reply_src_port = 0;
 
-    // set the closing time
-    this_conn->end_time = time(NULL);
-
     // create search criteria to close the connection
     if(this_conn->nat_dst_port != 0)
     {
@@ -270,35 +484,225 @@ static int close_invalid_connection(fko_srv_options_t *opts, connection_t this_c
              reply_src_port);
 
     // close it
-    if( (rv = close_connections(opts, criteria)) != FWKNOPD_SUCCESS)
+    return close_connections(opts, criteria);
+}
+
+
+#if FIREWALL_IPTABLES || FIREWALL_FIREWALLD
+static void conn_to_flow(connection_t this_conn, conntrack_nl_flow_t *flow)
+{
+    memset(flow, 0x0, sizeof(*flow));
+    inet_pton(AF_INET, this_conn->src_ip_str, &flow->src);
+    inet_pton(AF_INET, this_conn->dst_ip_str, &flow->dst);
+    flow->sport = this_conn->src_port;
+    flow->dport = this_conn->dst_port;
+    flow->proto = strncmp(this_conn->protocol, "tcp", 3) == 0 ? IPPROTO_TCP : IPPROTO_UDP;
+    flow->mark  = this_conn->sdp_id;
+}
+
+
+static int flow_matches_conn(const conntrack_nl_flow_t *flow, const conntrack_nl_flow_t *conn_flow)
+{
+    return flow->src   == conn_flow->src   &&
+           flow->dst   == conn_flow->dst   &&
+           flow->sport == conn_flow->sport &&
+           flow->dport == conn_flow->dport &&
+           flow->proto == conn_flow->proto;
+}
+#endif
+
+
+// Close every connection in conn_list, in one netlink batch when
+// available.  Closed connections are reported to the controller, the
+// ones that could not be closed are handed back in *failed_r so the
+// caller can keep tracking them and try again on the next pass.
+static int close_invalid_connections(fko_srv_options_t *opts,
+                                     connection_t conn_list,
+                                     connection_t *failed_r)
+{
+    int rv = FWKNOPD_SUCCESS;
+    int closed = 0;
+    connection_t this_conn = conn_list;
+    connection_t next_conn = NULL;
+    time_t now = time(NULL);
+#if FIREWALL_IPTABLES || FIREWALL_FIREWALLD
+    conntrack_nl_flow_t *flows = NULL;
+    int num_flows = 0;
+    int i = 0;
+
+    if(conntrack_nl_active && conn_list != NULL)
     {
-        return rv;
+        for(this_conn = conn_list; this_conn != NULL; this_conn = this_conn->next)
+            num_flows++;
+
+        if((flows = calloc(num_flows, sizeof(*flows))) == NULL)
+        {
+            log_msg(LOG_ERR, "close_invalid_connections() FATAL MEMORY ERROR. ABORTING.");
+            add_to_connection_list(failed_r, conn_list);
+            return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+        }
+
+        for(this_conn = conn_list; this_conn != NULL; this_conn = this_conn->next)
+            conn_to_flow(this_conn, &flows[i++]);
+
+        if(conntrack_nl_delete(flows, num_flows) != 0)
+            log_msg(LOG_ERR, "close_invalid_connections() Not every conntrack "
+                    "delete was answered: %s", strerror(errno));
+
+        this_conn = conn_list;
+        i = 0;
+    }
+#endif
+
+    while(this_conn != NULL)
+    {
+        next_conn = this_conn->next;
+        this_conn->next = NULL;
+
+#if FIREWALL_IPTABLES || FIREWALL_FIREWALLD
+        if(flows != NULL)
+        {
+            // ENOENT means it ended on its own in the meantime
+            closed = (flows[i].err == 0 || flows[i].err == ENOENT);
+            if(!closed)
+                log_msg(LOG_ERR, "close_invalid_connections() Failed to delete "
+                        "conntrack entry: %s", strerror(flows[i].err));
+            i++;
+        }
+        else
+#endif
+        {
+            rv = close_invalid_connection_cmd(opts, this_conn);
+            closed = (rv == FWKNOPD_SUCCESS);
+        }
+
+        if(!closed)
+        {
+            add_to_connection_list(failed_r, this_conn);
+
+            if(rv == FWKNOPD_ERROR_MEMORY_ALLOCATION)
+            {
+                if(next_conn != NULL)
+                    add_to_connection_list(failed_r, next_conn);
+                break;
+            }
+
+            rv = FWKNOPD_SUCCESS;
+            this_conn = next_conn;
+            continue;
+        }
+
+        // set the closing time
+        this_conn->end_time = now;
+
+        // print closed connection
+        log_msg(LOG_WARNING, "Gateway closed the following invalid connection from SDP ID %"PRIu32":",
+                this_conn->sdp_id);
+        print_connection_list(this_conn);
+
+        // add to the ctrl msg list
+        add_to_connection_list(&msg_conn_list, this_conn);
+        msg_conn_list_count++;
+
+        this_conn = next_conn;
     }
 
-    // print closed connection
-    log_msg(LOG_WARNING, "Gateway closed the following invalid connection from SDP ID %"PRIu32":",
-            this_conn->sdp_id);
-    print_connection_list(this_conn);
+#if FIREWALL_IPTABLES || FIREWALL_FIREWALLD
+    free(flows);
+#endif
+    return rv;
+}
+
+
+static int close_invalid_connection(fko_srv_options_t *opts, connection_t this_conn)
+{
+    int rv = FWKNOPD_SUCCESS;
+    connection_t failed = NULL;
+
+    // function adds the connection item to the msg_conn_list if closed
+    rv = close_invalid_connections(opts, this_conn, &failed);
 
-    // add to the ctrl msg list
-    if( (rv = add_to_connection_list(&msg_conn_list, this_conn)) != FWKNOPD_SUCCESS)
+    if(failed != NULL)
     {
-        return rv;
+        destroy_connection_list(failed);
+        if(rv == FWKNOPD_SUCCESS)
+            rv = FWKNOPD_ERROR_CONNTRACK;
     }
-    msg_conn_list_count++;
 
     return rv;
 }
 
 
+static int finish_connection_item(fko_srv_options_t *opts,
+                                  connection_t this_conn,
+                                  const char *return_src_ip_str,
+                                  unsigned int return_src_port,
+                                  int close_if_invalid,
+                                  connection_t *this_conn_r)
+{
+    int res = FWKNOPD_SUCCESS;
+
+    // if dest address does not match returning source address
+    // then NAT to another machine is in use
+    if(strncmp(this_conn->dst_ip_str, return_src_ip_str, MAX_IPV4_STR_LEN) != 0)
+    {
+        strlcpy(this_conn->nat_dst_ip_str, return_src_ip_str,
+                sizeof(this_conn->nat_dst_ip_str));
+        this_conn->nat_dst_port = return_src_port;
+    }
+    else if(this_conn->dst_port != return_src_port)
+    {
+        // if dest port does not match returning source port
+        // yet dest IP matched returning source IP (previous check)
+        // then it's local NAT
+        this_conn->nat_dst_port = return_src_port;
+    }
+
+    if((res = get_service_id_by_details(opts, this_conn->protocol,
+                                        this_conn->dst_port,
+                                        this_conn->nat_dst_ip_str,
+                                        this_conn->nat_dst_port,
+                                        &(this_conn->service_id))) != FWKNOPD_SUCCESS)
+    {
+        if(res == FWKNOPD_ERROR_MEMORY_ALLOCATION)
+        {
+            log_msg(LOG_ERR, "Fatal memory error. Aborting.");
+            destroy_connection_item(this_conn);
+            *this_conn_r = NULL;
+            return res;
+        }
+
+        // already gone from conntrack, nothing left to close
+        if(!close_if_invalid)
+        {
+            destroy_connection_item(this_conn);
+            *this_conn_r = NULL;
+            return FWKNOPD_SUCCESS;
+        }
+
+        log_msg(LOG_ERR, "Unable to identify service for connection with following details:");
+        print_connection_item(this_conn);
+
+        // function adds the connection item to the msg_conn_list so don't destroy it
+        res = close_invalid_connection(opts, this_conn);
+        *this_conn_r = NULL;
+        return res;
+    }
+
+    *this_conn_r = this_conn;
+    return FWKNOPD_SUCCESS;
+}
+
+
 static int create_connection_item_from_line(fko_srv_options_t *opts,
                                             const char *line,
                                             time_t now,
                                             connection_t *this_conn_r)
 {
-    int res = FWKNOPD_SUCCESS;
     connection_t this_conn = NULL;
     char *ndx = NULL;
+    char *reply_ndx = NULL;
+    char *cnt_ndx = NULL;
     unsigned int id = 0;
     char return_src_ip_str[MAX_IPV4_STR_LEN] = {0};
     char return_dst_ip_str[MAX_IPV4_STR_LEN] = {0};
@@ -327,7 +731,7 @@ static int create_connection_item_from_line(fko_srv_options_t *opts,
     }
 
     // get the connection details
-    if( (this_conn = calloc(1, sizeof *this_conn)) == NULL)
+    if( (this_conn = mem_calloc(MEM_TAG_CONNTRACK, 1, sizeof *this_conn)) == NULL)
     {
         log_msg(LOG_ERR, "create_connection_item_from_line() FATAL MEMORY ERROR. ABORTING.");
         *this_conn_r = NULL;
@@ -362,14 +766,18 @@ static int create_connection_item_from_line(fko_srv_options_t *opts,
         return FWKNOPD_SUCCESS;
     }
 
-    if( (res = sscanf(ndx, "src=%15s dst=%15s sport=%u dport=%u src=%15s dst=%15s sport=%u",
+    // with accounting on, each tuple is followed by its packet and
+    // byte counts, so the reply tuple is found on its own
+    if( (reply_ndx = strstr(ndx + strlen("src="), " src=")) == NULL
+            || sscanf(ndx, "src=%15s dst=%15s sport=%u dport=%u",
                this_conn->src_ip_str,
                this_conn->dst_ip_str,
                &(this_conn->src_port),
-               &(this_conn->dst_port),
+               &(this_conn->dst_port)) != 4
+            || sscanf(reply_ndx, " src=%15s dst=%15s sport=%u",
                return_src_ip_str,
                return_dst_ip_str,
-               &return_src_port)) != 7 )
+               &return_src_port) != 3 )
     {
         log_msg(LOG_ERR, "create_connection_item_from_line() Failed to find "
                 "connection details in line: \n     %s\n", ndx);
@@ -381,20 +789,24 @@ static int create_connection_item_from_line(fko_srv_options_t *opts,
     this_conn->sdp_id = (uint32_t)id;
     this_conn->start_time = now;
 
-    // if dest address does not match returning source address
-    // then NAT to another machine is in use
-    if(strncmp(this_conn->dst_ip_str, return_src_ip_str, MAX_IPV4_STR_LEN) != 0)
-    {
-        strncpy(this_conn->nat_dst_ip_str, return_src_ip_str, MAX_IPV4_STR_LEN);
-        this_conn->nat_dst_port = return_src_port;
-    }
-    else if(this_conn->dst_port != return_src_port)
-    {
-        // if dest port does not match returning source port
-        // yet dest IP matched returning source IP (previous check)
-        // then it's local NAT
-        this_conn->nat_dst_port = return_src_port;
-    }
+    this_conn->key.mark = this_conn->sdp_id;
+    this_conn->key.proto = strncmp(this_conn->protocol, "tcp", 3) == 0 ? IPPROTO_TCP : IPPROTO_UDP;
+    inet_pton(AF_INET, this_conn->src_ip_str, &(this_conn->key.src));
+    inet_pton(AF_INET, this_conn->dst_ip_str, &(this_conn->key.dst));
+    inet_pton(AF_INET, return_src_ip_str, &(this_conn->key.reply_src));
+    this_conn->key.sport = this_conn->src_port;
+    this_conn->key.dport = this_conn->dst_port;
+    this_conn->key.reply_sport = return_src_port;
+
+    if( (cnt_ndx = strstr(ndx, "packets=")) != NULL && cnt_ndx < reply_ndx)
+        sscanf(cnt_ndx, "packets=%"SCNu64" bytes=%"SCNu64,
+               &(this_conn->packets[CONN_DIR_ORIG]),
+               &(this_conn->bytes[CONN_DIR_ORIG]));
+
+    if( (cnt_ndx = strstr(reply_ndx, "packets=")) != NULL)
+        sscanf(cnt_ndx, "packets=%"SCNu64" bytes=%"SCNu64,
+               &(this_conn->packets[CONN_DIR_REPLY]),
+               &(this_conn->bytes[CONN_DIR_REPLY]));
 
     // if TIME_WAIT flag set, connection is closed
     if( (ndx = strstr(line, "TIME_WAIT")) != NULL)
@@ -404,31 +816,8 @@ static int create_connection_item_from_line(fko_srv_options_t *opts,
         this_conn->end_time = now;
     }
 
-    if((res = get_service_id_by_details(opts, this_conn->protocol,
-                                        this_conn->dst_port,
-                                        this_conn->nat_dst_ip_str,
-                                        this_conn->nat_dst_port,
-                                        &(this_conn->service_id))) != FWKNOPD_SUCCESS)
-    {
-        if(res == FWKNOPD_ERROR_MEMORY_ALLOCATION)
-        {
-            log_msg(LOG_ERR, "Fatal memory error. Aborting.");
-            destroy_connection_item(this_conn);
-            *this_conn_r = NULL;
-            return res;
-        }
-
-        log_msg(LOG_ERR, "Unable to identify service for connection with following details:");
-        print_connection_item(this_conn);
-
-        // function adds the connection item to the msg_conn_list so don't destroy it
-        res = close_invalid_connection(opts, this_conn);
-        *this_conn_r = NULL;
-        return res;
-    }
-
-    *this_conn_r = this_conn;
-    return FWKNOPD_SUCCESS;
+    return finish_connection_item(opts, this_conn, return_src_ip_str,
+                                  return_src_port, 1, this_conn_r);
 }
 
 
@@ -485,16 +874,23 @@ static int search_conntrack(fko_srv_options_t *opts,
     time(&now);
 
     memset(cmd_buf, 0x0, CMD_BUFSIZE);
-    memset(conntrack_buf, 0x0, CONNTRACK_CMD_OUT_BUFSIZE);
+
+    if(conntrack_buf == NULL
+            && (conntrack_buf = mem_malloc(MEM_TAG_CONNTRACK, conntrack_buf_size)) == NULL)
+    {
+        log_msg(LOG_ERR, "search_conntrack() Fatal memory allocation error");
+        return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+    }
+    memset(conntrack_buf, 0x0, conntrack_buf_size);
 
     if(criteria != NULL)
         snprintf(cmd_buf, CMD_BUFSIZE, "conntrack -L %s", criteria);
     else
         snprintf(cmd_buf, CMD_BUFSIZE, "conntrack -L");
 
-    res = run_extcmd(cmd_buf, conntrack_buf, CONNTRACK_CMD_OUT_BUFSIZE,
+    res = run_extcmd(cmd_buf, conntrack_buf, conntrack_buf_size,
             WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
-    conntrack_buf[CONNTRACK_CMD_OUT_BUFSIZE - 1] = 0x0;
+    conntrack_buf[conntrack_buf_size - 1] = 0x0;
 
     if(!EXTCMD_IS_SUCCESS(res))
     {
@@ -574,6 +970,128 @@ cleanup:
 }
 
 
+#if FIREWALL_IPTABLES || FIREWALL_FIREWALLD
+static int create_connection_item_from_ct(fko_srv_options_t *opts,
+                                          const conntrack_nl_entry_t *e,
+                                          time_t now,
+                                          connection_t *this_conn_r)
+{
+    connection_t this_conn = NULL;
+    char return_src_ip_str[MAX_IPV4_STR_LEN] = {0};
+
+    if( (this_conn = mem_calloc(MEM_TAG_CONNTRACK, 1, sizeof *this_conn)) == NULL)
+    {
+        log_msg(LOG_ERR, "create_connection_item_from_ct() FATAL MEMORY ERROR. ABORTING.");
+        *this_conn_r = NULL;
+        return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+    }
+
+    strlcpy(this_conn->protocol, e->proto == IPPROTO_TCP ? "tcp" : "udp",
+            sizeof(this_conn->protocol));
+    inet_ntop(AF_INET, &e->src, this_conn->src_ip_str, MAX_IPV4_STR_LEN);
+    inet_ntop(AF_INET, &e->dst, this_conn->dst_ip_str, MAX_IPV4_STR_LEN);
+    inet_ntop(AF_INET, &e->reply_src, return_src_ip_str, MAX_IPV4_STR_LEN);
+    this_conn->src_port = e->sport;
+    this_conn->dst_port = e->dport;
+
+    this_conn->sdp_id = e->mark;
+    this_conn->start_time = e->first_seen;
+
+    this_conn->key.mark = e->mark;
+    this_conn->key.proto = e->proto;
+    this_conn->key.src = e->src;
+    this_conn->key.dst = e->dst;
+    this_conn->key.reply_src = e->reply_src;
+    this_conn->key.sport = e->sport;
+    this_conn->key.dport = e->dport;
+    this_conn->key.reply_sport = e->reply_sport;
+
+    memcpy(this_conn->packets, e->packets, sizeof(this_conn->packets));
+    memcpy(this_conn->bytes, e->bytes, sizeof(this_conn->bytes));
+
+    if(e->closed)
+        this_conn->end_time = now;
+
+    return finish_connection_item(opts, this_conn, return_src_ip_str,
+                                  e->reply_sport, !e->destroyed, this_conn_r);
+}
+
+
+struct ct_walk_arg
+{
+    fko_srv_options_t *opts;
+    time_t now;
+    connection_t conn_list;
+    int conn_count;
+};
+
+static int add_ct_entry_cb(const conntrack_nl_entry_t *e, void *arg)
+{
+    int res = FWKNOPD_SUCCESS;
+    struct ct_walk_arg *wa = (struct ct_walk_arg*)arg;
+    connection_t this_conn = NULL;
+
+    if( (res = create_connection_item_from_ct(wa->opts, e, wa->now, &this_conn)) != FWKNOPD_SUCCESS)
+        return res;
+
+    if(this_conn == NULL)
+        return res;
+
+    if( (res = add_to_connection_list(&(wa->conn_list), this_conn)) != FWKNOPD_SUCCESS)
+    {
+        destroy_connection_item(this_conn);
+        return res;
+    }
+
+    wa->conn_count++;
+    return res;
+}
+
+
+// same as search_conntrack() with no criteria, but built from the
+// connections conntrack_nl.c has followed since the last call
+static int search_conntrack_nl(fko_srv_options_t *opts,
+                               connection_t *conn_list_r,
+                               int *conn_count_r)
+{
+    int res = FWKNOPD_SUCCESS;
+    struct ct_walk_arg wa;
+
+    // bounded, so a burst of events cannot hold up the walk; whatever
+    // is left over is picked up on the next update
+    if(conntrack_nl_poll(CONNTRACK_NL_POLL_BUDGET) < 0)
+    {
+        log_msg(LOG_WARNING, "search_conntrack_nl() Failed to read conntrack events (%s), "
+                "falling back to the conntrack command", strerror(errno));
+        conntrack_nl_close();
+        conntrack_nl_active = 0;
+        return search_conntrack(opts, NULL, conn_list_r, conn_count_r);
+    }
+
+    memset(&wa, 0x0, sizeof(wa));
+    wa.opts = opts;
+    wa.now = time(NULL);
+
+    // events carry no counts for open connections, so pick them up
+    // from a dump ahead of each report
+    if(report_counters && wa.now >= next_ctrl_msg_due && conntrack_nl_refresh() != 0)
+        log_msg(LOG_WARNING, "search_conntrack_nl() Failed to refresh connection "
+                "counters (%s)", strerror(errno));
+
+    if( (res = conntrack_nl_walk(add_ct_entry_cb, &wa)) != FWKNOPD_SUCCESS)
+    {
+        destroy_connection_list(wa.conn_list);
+        return res;
+    }
+
+    *conn_list_r = wa.conn_list;
+    *conn_count_r = wa.conn_count;
+
+    return res;
+}
+#endif
+
+
 static int close_connections(fko_srv_options_t *opts, char *criteria)
 {
     char   cmd_buf[CMD_BUFSIZE];
@@ -626,13 +1144,15 @@ static int close_connections(fko_srv_options_t *opts, char *criteria)
 
 static int duplicate_connection_item(connection_t orig, connection_t *copy)
 {
+    int rv = FWKNOPD_SUCCESS;
+
     if(orig == NULL)
     {
         *copy = NULL;
         return FWKNOPD_SUCCESS;
     }
 
-    return create_connection_item( //orig->connection_id,
+    rv = create_connection_item( //orig->connection_id,
                                    orig->sdp_id,
                                    orig->service_id,
                                    orig->protocol,
@@ -645,6 +1165,23 @@ static int duplicate_connection_item(connection_t orig, connection_t *copy)
                                    orig->start_time,
                                    orig->end_time,
                                    copy );
+
+    if(rv == FWKNOPD_SUCCESS)
+    {
+        (*copy)->connection_id = orig->connection_id;
+        (*copy)->key = orig->key;
+        (*copy)->seen_gen = orig->seen_gen;
+        memcpy((*copy)->packets, orig->packets, sizeof(orig->packets));
+        memcpy((*copy)->bytes, orig->bytes, sizeof(orig->bytes));
+        memcpy((*copy)->reported_packets, orig->reported_packets, sizeof(orig->reported_packets));
+        memcpy((*copy)->reported_bytes, orig->reported_bytes, sizeof(orig->reported_bytes));
+        (*copy)->counters_only = orig->counters_only;
+        (*copy)->active_time = orig->active_time;
+        (*copy)->grant_until = orig->grant_until;
+        (*copy)->grant_check = orig->grant_check;
+    }
+
+    return rv;
 }
 
 
@@ -695,32 +1232,63 @@ cleanup:
 }
 
 
+/* Both connection hash tables are keyed by SDP ID.  The key is a plain
+ * uint32_t, so lookups can pass the address of one on the stack and only
+ * a new table node needs a key of its own.
+*/
+static int compare_sdp_id_cb(void *a, void *b)
+{
+    return *(uint32_t *)a != *(uint32_t *)b;
+}
+
+static uint32_t hash_sdp_id_cb(void *key)
+{
+    uint32_t h = *(uint32_t *)key;
+
+    h ^= h >> 16;
+    h *= 0x7feb352d;
+    h ^= h >> 15;
+    h *= 0x846ca68b;
+    h ^= h >> 16;
+    return h;
+}
+
+static int new_sdp_id_key(uint32_t sdp_id, uint32_t **key)
+{
+    if((*key = mem_calloc(MEM_TAG_CONNTRACK, 1, sizeof **key)) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] Fatal memory allocation error creating connection hash key");
+        return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+    }
+    **key = sdp_id;
+    return FWKNOPD_SUCCESS;
+}
+
+
 static int store_in_connection_hash_tbl(hash_table_t *tbl, connection_t this_conn)
 {
     int res = FWKNOPD_SUCCESS;
-    bstring key = NULL;
-    char id_str[SDP_MAX_CLIENT_ID_STR_LEN] = {0};
+    uint32_t *key = NULL;
     connection_t present_conns = NULL;
 
-    // convert the sdp id integer to a bstring
-    snprintf(id_str, SDP_MAX_CLIENT_ID_STR_LEN, "%"PRIu32, this_conn->sdp_id);
-    key = bfromcstr(id_str);
-    // key is not freed if hash_table_set is called,
-    // because the hash table keeps it
-
     // if a node for this SDP ID doesn't yet exist in the table
-    // gotta make it
-    if( (present_conns = hash_table_get(tbl, key)) == NULL)
+    // gotta make it, the lookup itself needs no allocation
+    if( (present_conns = hash_table_get(tbl, &(this_conn->sdp_id))) == NULL)
     {
         log_msg(LOG_DEBUG, "store_in_connection_hash_tbl() ID %"PRIu32
                 " not yet in table. \n", this_conn->sdp_id);
 
+        // key is not freed if hash_table_set succeeds,
+        // because the hash table keeps it
+        if( (res = new_sdp_id_key(this_conn->sdp_id, &key)) != FWKNOPD_SUCCESS)
+            return res;
+
         if( (res = hash_table_set(tbl, key, this_conn)) != FWKNOPD_SUCCESS)
         {
             log_msg(LOG_ERR,
                 "[*] Fatal memory allocation error updating 'latest' connection tracking hash table"
             );
-            bdestroy(key);
+            mem_free(MEM_TAG_CONNTRACK, key);
         }
     }
     else
@@ -728,9 +1296,6 @@ static int store_in_connection_hash_tbl(hash_table_t *tbl, connection_t this_con
         log_msg(LOG_DEBUG, "store_in_connection_hash_tbl() ID %"PRIu32
                 " already exists in table. \n", this_conn->sdp_id);
 
-        // key is no longer needed in this case, didn't create a new hash node
-        bdestroy(key);
-
         // this one should be impossible to fail, but we will still return the res
         res = add_to_connection_list(&present_conns, this_conn);
 
@@ -747,9 +1312,23 @@ static int check_conntrack(fko_srv_options_t *opts, int *conn_count_r)
     int    conn_count = 0, res = FWKNOPD_SUCCESS;
     connection_t this_conn = NULL;
     connection_t next = NULL;
+    connection_t known_conn = NULL;
+    connection_t closed_conns = NULL;
+    connection_t closed_tail = NULL;
+    connection_t temp_conn = NULL;
+    int closed_conn_count = 0;
+    time_t now = time(NULL);
 
     log_msg(LOG_DEBUG, "check_conntrack() Getting latest connections... \n");
 
+#if FIREWALL_IPTABLES || FIREWALL_FIREWALLD
+    if(conntrack_nl_active)
+    {
+        if( (res = search_conntrack_nl(opts, &this_conn, &conn_count)) != FWKNOPD_SUCCESS)
+            return res;
+    }
+    else
+#endif
     if( (res = search_conntrack(opts, NULL, &this_conn, &conn_count)) != FWKNOPD_SUCCESS)
         return res;
 
@@ -759,18 +1338,63 @@ static int check_conntrack(fko_srv_options_t *opts, int *conn_count_r)
         print_connection_list(this_conn);
     }
 
+    // a new pass over conntrack, anything known that isn't matched
+    // below is gone
+    conn_gen++;
+
     while(this_conn != NULL)
     {
         next = this_conn->next;
         this_conn->next = NULL;
 
+        // already known, just mark it seen
+        if( (known_conn = conn_index_get(&(this_conn->key))) != NULL)
+        {
+            known_conn->seen_gen = conn_gen;
+
+            // without conntrack accounting there are no counts to go
+            // by, and a connection is active for as long as it is there
+            if(conn_counters_update(known_conn, this_conn)
+                    || known_conn->packets[CONN_DIR_ORIG] == 0)
+                known_conn->active_time = now;
+
+            // if end_time was set, means TIME_WAIT flag was set,
+            // report the closing if it's the first time we see it
+            if(this_conn->end_time != 0 && known_conn->end_time == 0)
+            {
+                known_conn->end_time = now;
+
+                if( (res = duplicate_connection_item(known_conn, &temp_conn)) != FWKNOPD_SUCCESS)
+                {
+                    destroy_connection_item(this_conn);
+                    destroy_connection_list(next);
+                    break;
+                }
+
+                temp_conn->next = NULL;
+                if(closed_tail == NULL)
+                    closed_conns = temp_conn;
+                else
+                    closed_tail->next = temp_conn;
+                closed_tail = temp_conn;
+                closed_conn_count++;
+            }
+
+            destroy_connection_item(this_conn);
+            this_conn = next;
+            continue;
+        }
+
+        this_conn->seen_gen = conn_gen;
+
+        // new conns are validated per SDP ID before they become known
         if( (res = store_in_connection_hash_tbl(latest_connection_hash_tbl, this_conn)) != FWKNOPD_SUCCESS)
         {
             // destroy remainder of list,
             // not ones that were successfully stored in the hash table
             destroy_connection_item(this_conn);
             destroy_connection_list(next);
-            return res;
+            break;
         }
 
         log_msg(LOG_DEBUG, "check_conntrack() back from storing a conn in latest_connection_hash_tbl \n");
@@ -778,6 +1402,26 @@ static int check_conntrack(fko_srv_options_t *opts, int *conn_count_r)
         this_conn = next;
     }
 
+    // add closed conns to the ctrl message list
+    if(closed_conns != NULL)
+    {
+        if(verbosity >= LOG_DEBUG)
+        {
+            log_msg(LOG_WARNING, "Following known connections are closing:");
+            print_connection_list(closed_conns);
+        }
+
+        add_to_connection_list(&msg_conn_list, closed_conns);
+        msg_conn_list_count += closed_conn_count;
+
+#ifdef DEBUG_CONNECTION_TRACKER
+        known_conns_closed += closed_conn_count;
+#endif
+    }
+
+    if(res != FWKNOPD_SUCCESS)
+        return res;
+
 #ifdef DEBUG_CONNECTION_TRACKER
     log_msg(LOG_ALERT, "           conntrack connection count: %6d", conn_count);
 #endif
@@ -790,7 +1434,7 @@ static int check_conntrack(fko_srv_options_t *opts, int *conn_count_r)
 
 static void destroy_hash_node_cb(hash_table_node_t *node)
 {
-  if(node->key != NULL) bdestroy((bstring)(node->key));
+  if(node->key != NULL) mem_free(MEM_TAG_CONNTRACK, node->key);
   if(node->data != NULL)
   {
       // this function takes care of all connection nodes (NOT hash table nodes)
@@ -800,440 +1444,240 @@ static void destroy_hash_node_cb(hash_table_node_t *node)
 }
 
 
-static int connection_items_match(connection_t a, connection_t b)
+static int traverse_print_conn_items_cb(hash_table_node_t *node, void *arg)
 {
-    // make sure neither is NULL first
-    if(!(a && b))
-        return 0;
+    print_connection_list((connection_t)(node->data));
+
+    return FWKNOPD_SUCCESS;
+}
+
+
+// One pass over the known connections of an SDP ID, dropping those
+// check_conntrack() didn't see this time.  The ones not already
+// reported as closed are reported now.
+static int traverse_sweep_known_cb(hash_table_node_t *node, void *arg)
+{
+    time_t *end_time = (time_t*)arg;
+    connection_t this_conn = (connection_t)(node->data);
+    connection_t prev_conn = NULL;
+    connection_t next_conn = NULL;
+    connection_t closed_conns = NULL;
+    connection_t closed_tail = NULL;
+    int closed_conn_count = 0;
 
-    if( a->sdp_id   == b->sdp_id     &&
-        a->src_port == b->src_port   &&
-        a->dst_port == b->dst_port   &&
-        a->nat_dst_port == b->nat_dst_port   &&
-        strncmp(a->src_ip_str, b->src_ip_str, MAX_IPV4_STR_LEN) == 0 &&
-        strncmp(a->dst_ip_str, b->dst_ip_str, MAX_IPV4_STR_LEN) == 0 &&
-        strncmp(a->nat_dst_ip_str, b->nat_dst_ip_str, MAX_IPV4_STR_LEN) == 0)
+    while(this_conn != NULL)
     {
-        return 1;
+        next_conn = this_conn->next;
+
+        if(this_conn->seen_gen == conn_gen)
+        {
+            prev_conn = this_conn;
+            this_conn = next_conn;
+            continue;
+        }
+
+        // the conn no longer exists, remove from known conns
+        if(prev_conn == NULL)
+            node->data = (void*)next_conn;
+        else
+            prev_conn->next = next_conn;
+
+        this_conn->next = NULL;
+        conn_index_del(this_conn);
+
+#ifdef DEBUG_CONNECTION_TRACKER
+        known_conns_deleted++;
+#endif
+
+        // if end_time not set, this is first time we saw that it's closed
+        if(this_conn->end_time == 0)
+        {
+            this_conn->end_time = *end_time;
+
+            if(closed_tail == NULL)
+                closed_conns = this_conn;
+            else
+                closed_tail->next = this_conn;
+            closed_tail = this_conn;
+            closed_conn_count++;
+        }
+        else
+        {
+            destroy_connection_item(this_conn);
+        }
+
+        this_conn = next_conn;
     }
-    else
+
+    if(closed_conns != NULL)
     {
-        return 0;
+        if(verbosity >= LOG_DEBUG)
+        {
+            log_msg(LOG_WARNING, "Following connections closed for SDP ID %"PRIu32":",
+                    closed_conns->sdp_id);
+            print_connection_list(closed_conns);
+        }
+
+        // add these closed connections to the ctrl message list
+        add_to_connection_list(&msg_conn_list, closed_conns);
+        msg_conn_list_count += closed_conn_count;
     }
+
+    // this SDP ID no longer has connections, remove entirely from
+    // known connection list, hash table traverser is fine with
+    // deleting random nodes along the way
+    if(node->data == NULL)
+        hash_table_delete(connection_hash_tbl, node->key);
+
+    return FWKNOPD_SUCCESS;
 }
 
 
-static int compare_connection_lists(connection_t *known_conns,
-                                    connection_t *current_conns,
-                                    connection_t *closed_conns)
+#if FIREWALL_IPTABLES || FIREWALL_FIREWALLD
+// Delete every conntrack entry marked with sdp_id in one batch.  Known
+// connections are split by result: the closed ones stay in *conn_list,
+// the ones whose entry could not be deleted move to *failed_r.
+static int close_marked_connections_nl(uint32_t sdp_id,
+                                       connection_t *conn_list,
+                                       connection_t *failed_r)
 {
-    int rv = FWKNOPD_SUCCESS;
-    int match = 0;
-    int conn_closed = 0;
-    connection_t this_known_conn = *known_conns;
-    connection_t prev_known_conn = NULL;
+    conntrack_nl_flow_t *flows = NULL;
+    conntrack_nl_flow_t conn_flow;
+    int num_flows = 0;
+    int deleted = 0;
+    int i = 0;
+    int closed = 0;
+    connection_t this_conn = *conn_list;
     connection_t next_conn = NULL;
-    connection_t this_current_conn = NULL;
-    connection_t prev_current_conn = NULL;
-    time_t now = time(NULL);
+    connection_t closed_conns = NULL;
 
-#ifdef DEBUG_CONNECTION_TRACKER
-    int known_conns_count_pre = 0;
-    int known_conns_count_post = 0;
-    int known_conns_del = 0;
+    if(conntrack_nl_delete_mark(sdp_id, &flows, &num_flows) != 0 && flows == NULL)
+    {
+        log_msg(LOG_ERR, "close_marked_connections_nl() Failed to list conntrack "
+                "entries for SDP ID %"PRIu32": %s", sdp_id, strerror(errno));
+        return FWKNOPD_ERROR_CONNTRACK;
+    }
 
-    while(this_known_conn != NULL)
+    for(i = 0; i < num_flows; i++)
     {
-        known_conns_count_pre++;
-        this_known_conn = this_known_conn->next;
+        if(flows[i].err == 0 || flows[i].err == ENOENT)
+            deleted++;
     }
 
-    this_known_conn = *known_conns;
-#endif
+    if(deleted < num_flows)
+        log_msg(LOG_ERR, "close_marked_connections_nl() Failed to delete %d of %d "
+                "conntrack entries for SDP ID %"PRIu32, num_flows - deleted,
+                num_flows, sdp_id);
 
-    log_msg(LOG_DEBUG, "compare_connection_lists() entered");
+    log_msg(LOG_WARNING, "Gateway closed %d connections marked with SDP ID %"PRIu32,
+            deleted, sdp_id);
 
-    while(this_known_conn != NULL)
+    // a known connection is closed unless its entry was found
+    // and could not be deleted
+    while(this_conn != NULL)
     {
-        match = 0;
-        conn_closed = 0;
-        this_current_conn = *current_conns;
-        prev_current_conn = NULL;
+        next_conn = this_conn->next;
+        this_conn->next = NULL;
+        conn_to_flow(this_conn, &conn_flow);
 
-        while(this_current_conn != NULL)
+        closed = 1;
+        for(i = 0; i < num_flows; i++)
         {
-            if( (match = connection_items_match(this_known_conn, this_current_conn)) == 1 )
+            if(flow_matches_conn(&flows[i], &conn_flow))
             {
-                // got a match, remove from current_conns list
-
-                 // if very first connection item was the match
-                if(prev_current_conn == NULL)
-                {
-                    *current_conns = this_current_conn->next;
-                }
-                else
-                {
-                    prev_current_conn->next = this_current_conn->next;
-                }
-
-                // if end_time was set, means TIME_WAIT flag was set
-                if(this_current_conn->end_time != 0)
-                    conn_closed = 1;
-
-                destroy_connection_item(this_current_conn);
-                this_current_conn = NULL;
+                closed = (flows[i].err == 0 || flows[i].err == ENOENT);
                 break;
             }
+        }
+
+        add_to_connection_list(closed ? &closed_conns : failed_r, this_conn);
+        this_conn = next_conn;
+    }
+
+    free(flows);
+    *conn_list = closed_conns;
+    return FWKNOPD_SUCCESS;
+}
+#endif
 
-            prev_current_conn = this_current_conn;
-            this_current_conn = this_current_conn->next;
 
-        }   // END while(this_current_conn != NULL)
+// Judge every known connection against one consistent view of the
+// access table.  The known connections are all in the flat index, so
+// this is one pass over an array inside a single read-side section,
+// and consecutive connections of an SDP ID share the stanza lookup.
+// Closing the invalid ones (which talks to conntrack) is left to
+// validate_node_connections(), outside of the section.
+static void judge_known_connections(fko_srv_options_t *opts)
+{
+    acc_stanza_t *acc = NULL;
+    connection_t conn = NULL;
+    uint32_t sdp_id = 0;
+    uint32_t i = 0;
+    int have_acc = 0;
 
-        next_conn = this_known_conn->next;
+    rcu_read_lock();
+    for(i = 0; i < conn_index_size; i++)
+    {
+        if((conn = conn_index[i]) == NULL)
+            continue;
 
-        // if a match was found for this known connection
-        if(match && !conn_closed)
+        if(!have_acc || conn->sdp_id != sdp_id)
         {
-            // then it's still live, so
-            // the conn stays in the known conn list
-            // just move to next known conn
-            prev_known_conn = this_known_conn;
-#ifdef DEBUG_CONNECTION_TRACKER
-            known_conn_cnt_before_update_open++;
-            known_conn_cnt_after_update_open++;
-#endif
+            acc = judge_stanza_get(opts, conn->sdp_id);
+            sdp_id = conn->sdp_id;
+            have_acc = 1;
         }
-        else
-        {
-            // if end_time not set, this is first time we saw that it's closed
-            // whether because it's missing from conntrack or TIME_WAIT flag set
-            // so need to add to closed_conns list to report to controller
-            if(this_known_conn->end_time == 0)
-            {
-#ifdef DEBUG_CONNECTION_TRACKER
-                known_conn_cnt_before_update_open++;
-#endif
 
-                this_known_conn->end_time = now;
+        conn->verdict = judge_connection(acc, conn);
+    }
+    rcu_read_unlock();
+}
 
-                log_msg(LOG_DEBUG, "compare_connection_lists() adding previously known conn to closed list");
 
-                if( (rv = duplicate_connection_item(this_known_conn, &this_current_conn))
-                        != FWKNOPD_SUCCESS)
-                {
-                    goto cleanup;
-                }
+static int traverse_judge_new_conns_cb(hash_table_node_t *node, void *arg)
+{
+    fko_srv_options_t *opts = (fko_srv_options_t*)arg;
+    acc_stanza_t *acc = NULL;
+    connection_t conn = (connection_t)(node->data);
 
-                this_current_conn->next = NULL;
+    if(conn == NULL)
+        return FWKNOPD_SUCCESS;
 
-                if( (rv = add_to_connection_list(closed_conns, this_current_conn))
-                        != FWKNOPD_SUCCESS)
-                {
-                    destroy_connection_item(this_current_conn);
-                    goto cleanup;
-                }
-            }
-#ifdef DEBUG_CONNECTION_TRACKER
-            else
-            {
-                known_conn_cnt_before_update_closed++;
-            }
-#endif
+    acc = judge_stanza_get(opts, conn->sdp_id);
+    for(; conn != NULL; conn = conn->next)
+        conn->verdict = judge_connection(acc, conn);
 
-            // if no match was found, connection is truly gone from conntrack so
-            // can now remove from known connections
-            if(!match)
-            {
-                // the conn no longer exists, remove from known conns
-                // when removing a known conn, prev_known_conn should not be updated
-                this_known_conn->next = NULL;
+    return FWKNOPD_SUCCESS;
+}
 
-                // if we're removing the first conn in the known conn list
-                if(prev_known_conn == NULL)
-                {
-                    *known_conns = next_conn;
-                }
-                else
-                {
-                    prev_known_conn->next = next_conn;
-                }
-
-#ifdef DEBUG_CONNECTION_TRACKER
-                known_conns_deleted++;
-                known_conns_deleted_during_comp++;
-                known_conns_del++;
-#endif
-
-                destroy_connection_item(this_known_conn);
-            }
-            else
-            {
-                prev_known_conn = this_known_conn;
-#ifdef DEBUG_CONNECTION_TRACKER
-                if(conn_closed)
-                        known_conn_cnt_after_update_closed++;
-                else
-                        known_conn_cnt_after_update_open++;
-#endif
-            }
-
-        }  // END if(match)
-
-        // move to next known conn
-        this_known_conn = next_conn;
-
-    }  // END while(this_known_conn != NULL)
-
-#ifdef DEBUG_CONNECTION_TRACKER
-    this_known_conn = *known_conns;
-    while(this_known_conn != NULL)
-    {
-        known_conns_count_post++;
-        this_known_conn = this_known_conn->next;
-    }
 
-    log_msg(LOG_ALERT, " Known conns before:  %6d", known_conns_count_pre);
-    log_msg(LOG_ALERT, " Known conns deleted: %6d", known_conns_del);
-    log_msg(LOG_ALERT, " Known conns after:   %6d", known_conns_count_post);
-    if(known_conns_count_post != (known_conns_count_pre - known_conns_del))
-    {
-        log_msg(LOG_ALERT, "ERROR: CONN COUNT DOES NOT ADD UP!");
-        rv = FWKNOPD_ERROR_MEMORY_ALLOCATION;
-    }
-    else
-    {
-        log_msg(LOG_ALERT, "SUCCESS: CONN COUNT CHECKS OUT");
-    }
-    log_msg(LOG_ALERT, "\n\n");
-#endif
-
-    return rv;
-
-cleanup:
-    destroy_connection_list(*closed_conns);
-    *closed_conns = NULL;
-
-    return rv;
-}
-
-
-static int traverse_print_conn_items_cb(hash_table_node_t *node, void *arg)
-{
-    print_connection_list((connection_t)(node->data));
-
-    return FWKNOPD_SUCCESS;
-}
-
-
-static int traverse_compare_latest_cb(hash_table_node_t *node, void *arg)
+// Same as judge_known_connections() for the new connections, which
+// are not indexed yet.
+static int judge_new_connections(fko_srv_options_t *opts)
 {
     int rv = FWKNOPD_SUCCESS;
-    connection_t known_conns = NULL;
-    connection_t current_conns = NULL;
-    connection_t copy_current_conns = NULL;
-    time_t *end_time = (time_t*)arg;
-    connection_t closed_conns = NULL;
-    int closed_conn_count = 0;
-    connection_t temp_conn = NULL;
-    connection_t prev_conn = NULL;
-    connection_t next_conn = NULL;
-    bstring key = NULL;
-
-    // just a safety check, shouldn't be possible
-    if(node->data == NULL)
-    {
-        hash_table_delete(connection_hash_tbl, node->key);
-        return rv;
-    }
-
-    if((key = bstrcpy((bstring)(node->key))) == NULL)
-    {
-        log_msg(LOG_ERR, "traverse_compare_latest_cb() Failed to duplicate key");
-        return FWKNOPD_ERROR_MEMORY_ALLOCATION;
-    }
-
-    // going to manipulate this data directly and reset the data pointer
-    known_conns = (connection_t)(node->data);
 
-    // check whether this SDP ID still has any current connections
-    if( (current_conns = hash_table_get(latest_connection_hash_tbl, key)) == NULL)
-    {
-        // only report those that haven't been reported yet
-        temp_conn = known_conns;
-        while(temp_conn != NULL)
-        {
-#ifdef DEBUG_CONNECTION_TRACKER
-            known_conns_deleted++;
-#endif
-
-            next_conn = temp_conn->next;
+    rcu_read_lock();
+    rv = hash_table_traverse(latest_connection_hash_tbl, traverse_judge_new_conns_cb, opts);
+    rcu_read_unlock();
 
-            // don't report those already reported
-            if(temp_conn->end_time != 0)
-            {
-#ifdef DEBUG_CONNECTION_TRACKER
-                known_conn_cnt_before_update_closed++;
-#endif
-                prev_conn = temp_conn;
-            }
-            else
-            {
-#ifdef DEBUG_CONNECTION_TRACKER
-                known_conn_cnt_before_update_open++;
-#endif
-                temp_conn->end_time = *end_time;
-
-                if(prev_conn != NULL)
-                    prev_conn->next = temp_conn->next;
-                else
-                    node->data = (void*)(temp_conn->next);
-
-                temp_conn->next = NULL;
-
-                // add to closed_conns
-                closed_conn_count++;
-                if( (rv = add_to_connection_list(&closed_conns, temp_conn))
-                        != FWKNOPD_SUCCESS)
-                {
-                    goto cleanup;
-                }
-            }
-
-            temp_conn = next_conn;
-        }
-
-        if(closed_conns != NULL)
-        {
-            if(verbosity >= LOG_DEBUG)
-            {
-                log_msg(LOG_WARNING, "All connections closed for SDP ID %"PRIu32":",
-                        known_conns->sdp_id);
-                print_connection_list(closed_conns);
-            }
-
-
-            // add these closed connections to the ctrl message list
-            if( (rv = add_to_connection_list(&msg_conn_list, closed_conns))
-                    != FWKNOPD_SUCCESS)
-            {
-                goto cleanup;
-            }
-            msg_conn_list_count += closed_conn_count;
-
-            closed_conns = NULL;
-        }
-
-        // set node->data to NULL so the list is not deleted with the node
-        //node->data = NULL;
-
-        // this SDP ID no longer has connections, remove entirely from
-        // known connection list, hash table traverser is fine with
-        // deleting random nodes along the way
-        hash_table_delete(connection_hash_tbl, key);
-        goto cleanup;
-    }
-
-    // at this point, we know this ID has both known and current connections
-    // have to compare each connection in-depth
-
-    // first make a copy of current_conns to avoid data corruption
-    // because we'll be deleting the node from 'latest' conn hash table
-    if((rv = duplicate_connection_list(current_conns, &copy_current_conns)) != FWKNOPD_SUCCESS)
-        return rv;
-
-    // delete the entry in 'latest' conn hash table, we'll take it from here
-    hash_table_delete(latest_connection_hash_tbl, key);
-
-    // following function removes conns from known_conns if no longer in
-    // conntrack - leaving only old, still-open conns and conns flagged as
-    // closed but still in conntrack,
-    // removes previously known conns from copy_current_conns - leaving only
-    // entirely new conns,
-    // puts closed conns in closed_conns
-    if( (rv = compare_connection_lists(&known_conns, &copy_current_conns,
-            &closed_conns)) != FWKNOPD_SUCCESS)
-    {
-        goto cleanup;
-    }
-
-    // any remaining conns in copy_current_conns list are totally new
-    if(copy_current_conns != NULL)
-    {
-        // store the truly new conns back to the 'latest' conn hash table for later
-        if( (rv = hash_table_set(latest_connection_hash_tbl, key, copy_current_conns))
-                != FWKNOPD_SUCCESS)
-        {
-            log_msg(LOG_ERR, "Failed to store revised list of new conns in hash table");
-            goto cleanup;
-        }
-
-        copy_current_conns = NULL;
-        key = NULL;
-    }
-
-    node->data = known_conns;
-
-    if(known_conns == NULL)
-    {
-        hash_table_delete(connection_hash_tbl, node->key);
-    }
-
-    // add closed conns to the ctrl message list
-    if(closed_conns != NULL)
-    {
-        if(verbosity >= LOG_DEBUG)
-        {
-            log_msg(LOG_WARNING, "Following connections closed for SDP ID %"PRIu32":",
-                    closed_conns->sdp_id);
-            print_connection_list(closed_conns);
-        }
-
-        if( (rv = add_to_connection_list(&msg_conn_list, closed_conns))
-                != FWKNOPD_SUCCESS)
-        {
-            goto cleanup;
-        }
-
-        // count them too
-        temp_conn = closed_conns;
-        while(temp_conn != NULL)
-        {
-            msg_conn_list_count++;
-            temp_conn = temp_conn->next;
-        }
-
-    }
-
-    // this was a duplicate of the key from known conns table
-    // if it was used/stored back to latest conns table (new conns still to handle)
-    // then the pointer was set to NULL so that we don't destroy it
-    // if there were no new conns to store, need to destroy it
-    if(key != NULL)
-        bdestroy(key);
-
-    return rv;
-
-cleanup:
-    if(key != NULL)
-        bdestroy(key);
-    destroy_connection_list(copy_current_conns);
-    destroy_connection_list(closed_conns);
     return rv;
 }
 
 
-static int validate_node_connections(fko_srv_options_t *opts, hash_table_node_t *node)
+// Close the connections of a node that the last judge_*() pass found
+// invalid.  known is set for nodes of the known connection table, whose
+// connections are also in the index
+static int validate_node_connections(fko_srv_options_t *opts, hash_table_node_t *node, int known)
 {
     int rv = FWKNOPD_SUCCESS;
-    acc_stanza_t *acc = NULL;
-    bstring key = (bstring)node->key;
     connection_t this_conn = (connection_t)(node->data);
     connection_t prev_conn = NULL;
     connection_t next_conn = NULL;
     connection_t temp_conn = NULL;
+    connection_t invalid_conns = NULL;
+    connection_t failed_conns = NULL;
     int closed_conn_count = 0;
-    int conn_valid = 0;
     char criteria[CRITERIA_BUF_LEN];
     time_t now = time(NULL);
 
@@ -1245,28 +1689,36 @@ static int validate_node_connections(fko_srv_options_t *opts, hash_table_node_t
 
     memset(criteria, 0x0, CRITERIA_BUF_LEN);
 
-    // lock the hash table mutex
-    if(pthread_mutex_lock(&(opts->acc_hash_tbl_mutex)))
-    {
-        log_msg(LOG_ERR, "Mutex lock error.");
-        return 0;
-    }
-
-    acc = hash_table_get(opts->acc_stanza_hash_tbl, key);
-
-    pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
-
-    // see if sdp id still exists in access table
-    if( acc == NULL )
+    // the sdp id no longer exists in the access table (every connection
+    // of the node gets this verdict then)
+    if(this_conn->verdict == CONN_VERDICT_REVOKED)
     {
         // this sdp id is no longer authorized to access anything
         // remove all connections marked with this sdp id
-        snprintf(criteria, CRITERIA_BUF_LEN, "-m %"PRIu32, this_conn->sdp_id);
-
-        if( (rv = close_connections(opts, criteria)) != FWKNOPD_SUCCESS)
+#if FIREWALL_IPTABLES || FIREWALL_FIREWALLD
+        if(conntrack_nl_active)
         {
-            return rv;
+            // leaves the closed ones in this_conn
+            if( (rv = close_marked_connections_nl(this_conn->sdp_id, &this_conn,
+                            &failed_conns)) != FWKNOPD_SUCCESS)
+            {
+                return rv;
+            }
+            node->data = this_conn;
         }
+        else
+#endif
+        {
+            snprintf(criteria, CRITERIA_BUF_LEN, "-m %"PRIu32, this_conn->sdp_id);
+
+            if( (rv = close_connections(opts, criteria)) != FWKNOPD_SUCCESS)
+            {
+                return rv;
+            }
+        }
+
+        if(known)
+            conn_index_del_list(this_conn);
 
         // set the end time for all of the connections
         temp_conn = this_conn;
@@ -1278,38 +1730,40 @@ static int validate_node_connections(fko_srv_options_t *opts, hash_table_node_t
         }
 
 
-        // print the closed conns
-        log_msg(LOG_WARNING, "Gateway closed the following (i.e. all) connections from SDP ID %"PRIu32":",
-                this_conn->sdp_id);
-        print_connection_list(this_conn);
-
-        // pin the whole list onto the ctrl message list
-        if( (rv = add_to_connection_list(&msg_conn_list, node->data)) != FWKNOPD_SUCCESS)
+        if(this_conn != NULL)
         {
-            return rv;
+            // print the closed conns
+            log_msg(LOG_WARNING, "Gateway closed the following (i.e. all) connections from SDP ID %"PRIu32":",
+                    this_conn->sdp_id);
+            print_connection_list(this_conn);
+
+            // pin the whole list onto the ctrl message list
+            if( (rv = add_to_connection_list(&msg_conn_list, node->data)) != FWKNOPD_SUCCESS)
+            {
+                return rv;
+            }
+            msg_conn_list_count += closed_conn_count;
         }
-        msg_conn_list_count += closed_conn_count;
 
         // make sure the hash table node no longer points to the
-        // connection list
-        node->data = NULL;
+        // closed connections, only to any that are still open
+        node->data = failed_conns;
         this_conn = NULL;
     }
 
     while(this_conn != NULL)
     {
-        conn_valid = 0;
-        if( (rv = validate_connection(acc, this_conn, &conn_valid)) != FWKNOPD_SUCCESS)
-            return rv;
-
         next_conn = this_conn->next;
 
-        if(conn_valid == 1)
+        if(this_conn->verdict == CONN_VERDICT_VALID)
         {
             prev_conn = this_conn;
         }
         else
         {
+            log_msg(LOG_WARNING, "validate_node_connections() found invalid connection:");
+            print_connection_item(this_conn);
+
             // remove from node->data list
             if(prev_conn == NULL)
                 node->data = this_conn->next;
@@ -1318,16 +1772,36 @@ static int validate_node_connections(fko_srv_options_t *opts, hash_table_node_t
 
             this_conn->next = NULL;
 
-            if( (rv = close_invalid_connection(opts, this_conn)) != FWKNOPD_SUCCESS)
-            {
-                return rv;
-            }
+            if(known)
+                conn_index_del(this_conn);
+
+            // close them all at once below
+            add_to_connection_list(&invalid_conns, this_conn);
         }
 
         this_conn = next_conn;
     }
 
-    return FWKNOPD_SUCCESS;
+    if(invalid_conns != NULL)
+    {
+        rv = close_invalid_connections(opts, invalid_conns, &failed_conns);
+
+        // keep tracking the ones that are still open
+        if(failed_conns != NULL)
+        {
+            this_conn = (connection_t)(node->data);
+            add_to_connection_list(&this_conn, failed_conns);
+            node->data = this_conn;
+
+            for(temp_conn = failed_conns; known && temp_conn != NULL; temp_conn = temp_conn->next)
+            {
+                if( (rv = conn_index_add(temp_conn)) != FWKNOPD_SUCCESS)
+                    break;
+            }
+        }
+    }
+
+    return rv;
 }
 
 
@@ -1343,7 +1817,7 @@ static int traverse_validate_connections_cb(hash_table_node_t *node, void *arg)
         return rv;
     }
 
-    if( (rv = validate_node_connections(opts, node)) != FWKNOPD_SUCCESS)
+    if( (rv = validate_node_connections(opts, node, 1)) != FWKNOPD_SUCCESS)
     {
         return rv;
     }
@@ -1361,7 +1835,7 @@ static int traverse_handle_new_conns_cb(hash_table_node_t *node, void *arg)
 {
     int rv = FWKNOPD_SUCCESS;
     fko_srv_options_t *opts = (fko_srv_options_t*)arg;
-    bstring key = NULL;
+    uint32_t *key = NULL;
     connection_t temp_conn = NULL;
     connection_t known_conns = NULL;
     connection_t new_conns = NULL;
@@ -1375,15 +1849,6 @@ static int traverse_handle_new_conns_cb(hash_table_node_t *node, void *arg)
         return rv;
     }
 
-//    // assign connection ids
-//    temp_conn = (connection_t)(node->data);
-//    while(temp_conn != NULL)
-//    {
-//        last_conn_id++;
-//        temp_conn->connection_id = last_conn_id;
-//        temp_conn = temp_conn->next;
-//    }
-
     temp_conn = (connection_t)(node->data);
     if(verbosity >= LOG_DEBUG)
     {
@@ -1392,7 +1857,7 @@ static int traverse_handle_new_conns_cb(hash_table_node_t *node, void *arg)
         print_connection_list(temp_conn);
     }
 
-    if( (rv = validate_node_connections(opts, node)) != FWKNOPD_SUCCESS)
+    if( (rv = validate_node_connections(opts, node, 0)) != FWKNOPD_SUCCESS)
     {
         return rv;
     }
@@ -1406,8 +1871,13 @@ static int traverse_handle_new_conns_cb(hash_table_node_t *node, void *arg)
     }
 
 
-    // arriving here means there are new connections which we have validated
-    // so we need to store in known conns list and ctrl message list
+    // arriving here means there are new connections which we have validated,
+    // give them IDs before they are copied to the known conns
+    for(temp_conn = (connection_t)(node->data); temp_conn != NULL; temp_conn = temp_conn->next)
+        temp_conn->connection_id = next_conn_id(opts);
+    temp_conn = NULL;
+
+    // and store them in known conns list and ctrl message list
     if((rv = duplicate_connection_list((connection_t)(node->data), &temp_conn)) != FWKNOPD_SUCCESS)
     {
         goto cleanup;
@@ -1423,21 +1893,27 @@ static int traverse_handle_new_conns_cb(hash_table_node_t *node, void *arg)
     {
         // need to create new hash table entry in known conns
         // make a duplicate key to store in the hash table
-        if((key = bstrcpy((bstring)(node->key))) == NULL)
-        {
-            log_msg(LOG_ERR, "traverse_handle_new_conns_cb() Failed to duplicate key");
-            rv = FWKNOPD_ERROR_MEMORY_ALLOCATION;
+        if((rv = new_sdp_id_key(*(uint32_t *)(node->key), &key)) != FWKNOPD_SUCCESS)
             goto cleanup;
-        }
 
         // copy all new conns to known conns hash table
         if( (rv = hash_table_set(connection_hash_tbl, key, temp_conn)) != FWKNOPD_SUCCESS)
         {
-            bdestroy(key);
+            mem_free(MEM_TAG_CONNTRACK, key);
             goto cleanup;
         }
     }
 
+    // the known conns table owns them now, index them
+    for(new_conns = temp_conn; new_conns != NULL; new_conns = new_conns->next)
+    {
+        if( (rv = conn_index_add(new_conns)) != FWKNOPD_SUCCESS)
+            return rv;
+
+        // the copies going out in the message list carry these counts
+        conn_counters_mark_reported(new_conns);
+    }
+
     log_msg(LOG_DEBUG, "traverse_handle_new_conns_cb() adding new conns to msg list\n");
 
     if( (rv = add_to_connection_list(&msg_conn_list, (connection_t)(node->data))) != FWKNOPD_SUCCESS)
@@ -1468,173 +1944,251 @@ cleanup:
 
 
 
-//static int conn_id_file_check(const char *file, int *exists)
-//{
-//    struct stat st;
-//    uid_t caller_uid = 0;
-//
-//    // if file exists
-//    if((stat(file, &st)) == 0)
-//    {
-//        *exists = 1;
-//
-//        // Make sure it is a regular file
-//        if(S_ISREG(st.st_mode) != 1 && S_ISLNK(st.st_mode) != 1)
-//        {
-//            log_msg(LOG_WARNING,
-//                "[-] file: %s is not a regular file or symbolic link.",
-//                file
-//            );
-//            return FWKNOPD_ERROR_CONNTRACK;
-//        }
-//
-//        if((st.st_mode & (S_IRWXU|S_IRWXG|S_IRWXO)) != (S_IRUSR|S_IWUSR))
-//        {
-//            log_msg(LOG_WARNING,
-//                "[-] file: %s permissions should only be user read/write (0600, -rw-------)",
-//                file
-//            );
-//        }
-//
-//        caller_uid = getuid();
-//        if(st.st_uid != caller_uid)
-//        {
-//            log_msg(LOG_WARNING, "[-] file: %s (owner: %llu) not owned by current effective user id: %llu",
-//                file, (unsigned long long)st.st_uid, (unsigned long long)caller_uid);
-//        }
-//    }
-//    else
-//    {
-//        // if the path doesn't exist, just return, but otherwise something
-//        // went wrong
-//        if(errno != ENOENT)
-//        {
-//            log_msg(LOG_ERR, "[-] stat() against file: %s returned: %s",
-//                file, strerror(errno));
-//            return FWKNOPD_ERROR_CONNTRACK;
-//        }
-//
-//        *exists = 0;
-//    }
-//
-//    return FWKNOPD_SUCCESS;
-//}
-//
-//
-//static void store_last_conn_id(const fko_srv_options_t *opts)
-//{
-//    int     op_fd, num_bytes = 0;
-//    char    buf[CONN_ID_BUF_LEN] = {0};
-//
-//    // Don't store it if it's zero
-//    if(last_conn_id == 0)
-//        return;
-//
-//    // Reset errno (just in case)
-//    errno = 0;
-//
-//    // Open the PID file
-//    op_fd = open(
-//        opts->config[CONF_CONN_ID_FILE], O_WRONLY|O_CREAT, S_IRUSR|S_IWUSR
-//    );
-//
-//    if(op_fd == -1)
-//    {
-//        perror("Error trying to open connection ID file: ");
-//        return;
-//    }
-//
-//    if(fcntl(op_fd, F_SETFD, FD_CLOEXEC) == -1)
-//    {
-//        close(op_fd);
-//        perror("Unexpected error from fcntl: ");
-//        return;
-//    }
-//
-//    // Write last connection ID to the file
-//    snprintf(buf, CONN_ID_BUF_LEN, "%"PRIu64"\n", last_conn_id);
-//
-//    log_msg(LOG_DEBUG, "[+] Writing last connection ID (%"PRIu64") to the lock file: %s",
-//        last_conn_id, opts->config[CONF_CONN_ID_FILE]);
-//
-//    num_bytes = write(op_fd, buf, strlen(buf));
-//
-//    if(errno || num_bytes != strlen(buf))
-//        perror("Connection ID file write error: ");
-//
-//    // Sync/flush regardless...
-//    fsync(op_fd);
-//
-//    close(op_fd);
-//
-//    return;
-//}
-//
-//static int get_set_last_conn_id(const fko_srv_options_t *opts)
-//{
-//    int rv = FWKNOPD_SUCCESS;
-//    int exists = 0;
-//    int     op_fd, bytes_read = 0;
-//    char    buf[CONN_ID_BUF_LEN] = {0};
-//    uint64_t conn_id            = 0;
-//
-//    log_msg(LOG_DEBUG, "get_set_last_conn_id() checking file perms...");
-//    if( (rv = conn_id_file_check(opts->config[CONF_CONN_ID_FILE], &exists)) != FWKNOPD_SUCCESS)
-//    {
-//        log_msg(LOG_ERR, "conn_id_file_check() error\n");
-//        return(rv);
-//    }
-//
-//    if(!exists)
-//    {
-//        log_msg(LOG_WARNING, "get_set_last_conn_id() conn ID file does not yet exist, starting at zero");
-//        last_conn_id = 0;
-//        return FWKNOPD_SUCCESS;
-//    }
-//
-//    log_msg(LOG_DEBUG, "get_set_last_conn_id() opening the file...");
-//    op_fd = open(opts->config[CONF_CONN_ID_FILE], O_RDONLY);
-//
-//    if(op_fd == -1)
-//    {
-//        log_msg(LOG_ERR, "get_set_last_conn_id() ERROR - conn ID file exists but can't open");
-//        last_conn_id = 0;
-//        return FWKNOPD_ERROR_CONNTRACK;
-//    }
-//
-//    log_msg(LOG_DEBUG, "get_set_last_conn_id() reading the file...");
-//    bytes_read = read(op_fd, buf, CONN_ID_BUF_LEN);
-//    if (bytes_read > 0)
-//    {
-//        buf[CONN_ID_BUF_LEN-1] = '\0';
-//
-//        log_msg(LOG_DEBUG, "get_set_last_conn_id() Got following string from the conn ID file: %s\n",
-//                buf);
-//
-//        conn_id = strtoull_wrapper(buf, 0, UINT64_MAX, NO_EXIT_UPON_ERR, &rv);
-//        if(rv != FKO_SUCCESS)
-//        {
-//            log_msg(LOG_ERR, "get_set_last_conn_id() ERROR converting conn ID "
-//                    "string to uint64_t");
-//        }
-//        else
-//        {
-//            last_conn_id = conn_id;
-//            log_msg(LOG_DEBUG, "get_set_last_conn_id() setting conn ID value: %"PRIu64"\n",
-//                    last_conn_id);
-//        }
-//    }
-//    else if (bytes_read < 0)
-//    {
-//        rv = FWKNOPD_ERROR_CONNTRACK;
-//        perror("Error trying to read() PID file: ");
-//    }
-//
-//    close(op_fd);
-//
-//    return rv;
-//}
+static int conn_id_file_check(const char *file, int *exists)
+{
+    struct stat st;
+    uid_t caller_uid = 0;
+
+    // if file exists
+    if((stat(file, &st)) == 0)
+    {
+        *exists = 1;
+
+        // Make sure it is a regular file
+        if(S_ISREG(st.st_mode) != 1 && S_ISLNK(st.st_mode) != 1)
+        {
+            log_msg(LOG_WARNING,
+                "[-] file: %s is not a regular file or symbolic link.",
+                file
+            );
+            return FWKNOPD_ERROR_CONNTRACK;
+        }
+
+        if((st.st_mode & (S_IRWXU|S_IRWXG|S_IRWXO)) != (S_IRUSR|S_IWUSR))
+        {
+            log_msg(LOG_WARNING,
+                "[-] file: %s permissions should only be user read/write (0600, -rw-------)",
+                file
+            );
+        }
+
+        caller_uid = getuid();
+        if(st.st_uid != caller_uid)
+        {
+            log_msg(LOG_WARNING, "[-] file: %s (owner: %llu) not owned by current effective user id: %llu",
+                file, (unsigned long long)st.st_uid, (unsigned long long)caller_uid);
+        }
+    }
+    else
+    {
+        // if the path doesn't exist, just return, but otherwise something
+        // went wrong
+        if(errno != ENOENT)
+        {
+            log_msg(LOG_ERR, "[-] stat() against file: %s returned: %s",
+                file, strerror(errno));
+            return FWKNOPD_ERROR_CONNTRACK;
+        }
+
+        *exists = 0;
+    }
+
+    return FWKNOPD_SUCCESS;
+}
+
+
+// Write a connection ID high-water mark to the conn ID file by way of a
+// temporary file, fsync'ed and renamed over it, so a crash leaves either
+// the old or the new value and never a partial one
+static int write_conn_id_file(const fko_srv_options_t *opts, uint64_t value)
+{
+    const char *file = opts->config[CONF_CONN_ID_FILE];
+    char    tmp_path[MAX_PATH_LEN];
+    char    buf[CONN_ID_BUF_LEN] = {0};
+    int     op_fd, len;
+
+    if(snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", file) >= (int)sizeof(tmp_path))
+    {
+        log_msg(LOG_ERR, "[*] Connection ID file path too long: %s", file);
+        return FWKNOPD_ERROR_CONNTRACK;
+    }
+
+    op_fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+    if(op_fd == -1)
+    {
+        log_msg(LOG_ERR, "[*] Unable to open %s: %s", tmp_path, strerror(errno));
+        return FWKNOPD_ERROR_CONNTRACK;
+    }
+
+    if(fcntl(op_fd, F_SETFD, FD_CLOEXEC) == -1)
+        log_msg(LOG_WARNING, "[*] Unexpected error from fcntl: %s", strerror(errno));
+
+    len = snprintf(buf, CONN_ID_BUF_LEN, "%"PRIu64"\n", value);
+
+    if(write(op_fd, buf, len) != len || fsync(op_fd) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Connection ID file write error (%s): %s",
+            tmp_path, strerror(errno));
+        close(op_fd);
+        unlink(tmp_path);
+        return FWKNOPD_ERROR_CONNTRACK;
+    }
+
+    close(op_fd);
+
+    if(rename(tmp_path, file) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Unable to rename %s to %s: %s",
+            tmp_path, file, strerror(errno));
+        unlink(tmp_path);
+        return FWKNOPD_ERROR_CONNTRACK;
+    }
+
+    return FWKNOPD_SUCCESS;
+}
+
+
+// Connection IDs come from a block leased by recording the end of the
+// block in the conn ID file before any ID in it is handed out. After a
+// crash the next run starts past every ID that may have been used,
+// skipping at most the rest of one block.
+static uint64_t next_conn_id(const fko_srv_options_t *opts)
+{
+    if(last_conn_id >= conn_id_lease_end)
+    {
+        conn_id_lease_end = last_conn_id + CONN_ID_BLOCK_SIZE;
+
+        log_msg(LOG_DEBUG, "[+] Leasing connection IDs up to %"PRIu64,
+            conn_id_lease_end);
+
+        // keep handing out IDs either way, a failure only means they
+        // may be reused after a crash
+        if(write_conn_id_file(opts, conn_id_lease_end) != FWKNOPD_SUCCESS)
+            log_msg(LOG_WARNING, "[*] Unable to record connection ID lease "
+                "in %s, IDs may repeat after a crash",
+                opts->config[CONF_CONN_ID_FILE]);
+    }
+
+    return ++last_conn_id;
+}
+
+
+// On a clean shutdown the file gets the last ID actually used, so the
+// next run does not skip the rest of the block
+static void store_last_conn_id(const fko_srv_options_t *opts)
+{
+    // Don't store it if it's zero
+    if(last_conn_id == 0)
+        return;
+
+    log_msg(LOG_DEBUG, "[+] Writing last connection ID (%"PRIu64") to: %s",
+        last_conn_id, opts->config[CONF_CONN_ID_FILE]);
+
+    write_conn_id_file(opts, last_conn_id);
+}
+
+static int get_set_last_conn_id(const fko_srv_options_t *opts)
+{
+    int rv = FWKNOPD_SUCCESS;
+    int exists = 0;
+    int     op_fd, bytes_read = 0;
+    char    buf[CONN_ID_BUF_LEN] = {0};
+    uint64_t conn_id            = 0;
+
+    last_conn_id = conn_id_lease_end = 0;
+
+    log_msg(LOG_DEBUG, "get_set_last_conn_id() checking file perms...");
+    if( (rv = conn_id_file_check(opts->config[CONF_CONN_ID_FILE], &exists)) != FWKNOPD_SUCCESS)
+    {
+        log_msg(LOG_ERR, "conn_id_file_check() error\n");
+        return(rv);
+    }
+
+    if(!exists)
+    {
+        log_msg(LOG_WARNING, "get_set_last_conn_id() conn ID file does not yet exist, starting at zero");
+        return FWKNOPD_SUCCESS;
+    }
+
+    log_msg(LOG_DEBUG, "get_set_last_conn_id() opening the file...");
+    op_fd = open(opts->config[CONF_CONN_ID_FILE], O_RDONLY);
+
+    if(op_fd == -1)
+    {
+        log_msg(LOG_ERR, "get_set_last_conn_id() ERROR - conn ID file exists but can't open");
+        return FWKNOPD_ERROR_CONNTRACK;
+    }
+
+    log_msg(LOG_DEBUG, "get_set_last_conn_id() reading the file...");
+    bytes_read = read(op_fd, buf, CONN_ID_BUF_LEN - 1);
+    if (bytes_read > 0)
+    {
+        buf[bytes_read] = '\0';
+        buf[strcspn(buf, "\n")] = '\0';
+
+        log_msg(LOG_DEBUG, "get_set_last_conn_id() Got following string from the conn ID file: %s\n",
+                buf);
+
+        conn_id = strtoull_wrapper(buf, 0, UINT64_MAX - CONN_ID_BLOCK_SIZE,
+                NO_EXIT_UPON_ERR, &rv);
+        if(rv != FKO_SUCCESS)
+        {
+            log_msg(LOG_ERR, "get_set_last_conn_id() ERROR converting conn ID "
+                    "string to uint64_t");
+            rv = FWKNOPD_ERROR_CONNTRACK;
+        }
+        else
+        {
+            // the stored value is the end of the last lease (or the last
+            // ID used), every later ID is unused
+            last_conn_id = conn_id_lease_end = conn_id;
+            log_msg(LOG_DEBUG, "get_set_last_conn_id() setting conn ID value: %"PRIu64"\n",
+                    last_conn_id);
+        }
+    }
+    else if (bytes_read < 0)
+    {
+        rv = FWKNOPD_ERROR_CONNTRACK;
+        log_msg(LOG_ERR, "Error trying to read() conn ID file: %s", strerror(errno));
+    }
+
+    close(op_fd);
+
+    return rv;
+}
+
+
+
+// Conntrack only counts packets and bytes with accounting on, and only
+// for connections created after it was turned on.
+static void enable_conntrack_acct(void)
+{
+    FILE *fp = NULL;
+    char val = '0';
+
+    if((fp = fopen(CONNTRACK_ACCT_SYSCTL, "r+")) == NULL)
+    {
+        log_msg(LOG_WARNING, "[*] Unable to open %s (%s), connection "
+                "counters depend on conntrack accounting already being on",
+                CONNTRACK_ACCT_SYSCTL, strerror(errno));
+        return;
+    }
+
+    if(fread(&val, 1, 1, fp) == 1 && val == '1')
+    {
+        fclose(fp);
+        return;
+    }
+
+    rewind(fp);
+    if(fputs("1\n", fp) == EOF || fflush(fp) != 0)
+        log_msg(LOG_WARNING, "[*] Unable to turn on conntrack accounting "
+                "in %s (%s)", CONNTRACK_ACCT_SYSCTL, strerror(errno));
+    else
+        log_msg(LOG_INFO, "Turned on conntrack accounting");
 
+    fclose(fp);
+}
 
 
 int init_connection_tracker(fko_srv_options_t *opts)
@@ -1645,8 +2199,8 @@ int init_connection_tracker(fko_srv_options_t *opts)
     verbosity = LOG_DEFAULT_VERBOSITY + opts->verbose;
 
     // set the global connection ID variable
-//    if( (is_err = get_set_last_conn_id(opts)) != FWKNOPD_SUCCESS)
-//        return is_err;
+    if( (is_err = get_set_last_conn_id(opts)) != FWKNOPD_SUCCESS)
+        return is_err;
 
     // connection table should be same length as access stanza hash table
     hash_table_len = strtol_wrapper(opts->config[CONF_ACC_STANZA_HASH_TABLE_LENGTH],
@@ -1665,8 +2219,24 @@ int init_connection_tracker(fko_srv_options_t *opts)
         clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
     }
 
+    conntrack_buf_size = strtol_wrapper(opts->config[CONF_CONNTRACK_BUF_SIZE],
+                           RCHK_MIN_CONNTRACK_BUF_SIZE,
+                           RCHK_MAX_CONNTRACK_BUF_SIZE,
+                           NO_EXIT_UPON_ERR,
+                           &is_err);
+
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] var %s value '%s' not in the range %d-%d",
+                "CONNTRACK_BUF_SIZE",
+                opts->config[CONF_CONNTRACK_BUF_SIZE],
+                RCHK_MIN_CONNTRACK_BUF_SIZE,
+                RCHK_MAX_CONNTRACK_BUF_SIZE);
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+    }
+
     connection_hash_tbl = hash_table_create(hash_table_len,
-            NULL, NULL, destroy_hash_node_cb);
+            compare_sdp_id_cb, hash_sdp_id_cb, destroy_hash_node_cb);
 
     if(connection_hash_tbl == NULL)
     {
@@ -1677,7 +2247,7 @@ int init_connection_tracker(fko_srv_options_t *opts)
     }
 
     latest_connection_hash_tbl = hash_table_create(hash_table_len,
-            NULL, NULL, destroy_hash_node_cb);
+            compare_sdp_id_cb, hash_sdp_id_cb, destroy_hash_node_cb);
 
     if(latest_connection_hash_tbl == NULL)
     {
@@ -1687,12 +2257,47 @@ int init_connection_tracker(fko_srv_options_t *opts)
         clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
     }
 
+    report_counters = strncasecmp(opts->config[CONF_CONN_REPORT_COUNTERS], "Y", 1) == 0;
+    if(report_counters)
+        enable_conntrack_acct();
+
+#if FIREWALL_IPTABLES || FIREWALL_FIREWALLD
+    if(strncasecmp(opts->config[CONF_CONNTRACK_USE_NETLINK], "Y", 1) == 0)
+    {
+        if(conntrack_nl_open() == 0)
+        {
+            conntrack_nl_active = 1;
+            log_msg(LOG_INFO, "Following conntrack events over netlink");
+        }
+        else
+        {
+            log_msg(LOG_WARNING, "[*] Unable to follow conntrack events over "
+                    "netlink (%s), using the conntrack command", strerror(errno));
+        }
+    }
+#endif
+
+    report_deltas = strncasecmp(opts->config[CONF_CONN_REPORT_DELTAS], "Y", 1) == 0;
+    report_compress = strncasecmp(opts->config[CONF_CONN_REPORT_COMPRESS], "Y", 1) == 0;
+#ifndef HAVE_LIBZ
+    if(report_deltas && report_compress)
+        log_msg(LOG_WARNING, "[*] CONN_REPORT_COMPRESS is set, but "
+                "fwknopd was built without zlib. Reports are sent uncompressed.");
+#endif
+    report_seq = report_acked_seq = 0;
+    report_snapshot_due = 0;
+
     return is_err;
 }
 
 void destroy_connection_tracker(fko_srv_options_t *opts)
 {
-//    store_last_conn_id(opts);
+    store_last_conn_id(opts);
+
+#if FIREWALL_IPTABLES || FIREWALL_FIREWALLD
+    conntrack_nl_close();
+    conntrack_nl_active = 0;
+#endif
 
     if(connection_hash_tbl != NULL)
     {
@@ -1700,6 +2305,14 @@ void destroy_connection_tracker(fko_srv_options_t *opts)
         connection_hash_tbl = NULL;
     }
 
+    mem_free(MEM_TAG_CONNTRACK, conn_index);
+    conn_index = NULL;
+    conn_index_size = 0;
+    conn_index_count = 0;
+
+    mem_free(MEM_TAG_CONNTRACK, conntrack_buf);
+    conntrack_buf = NULL;
+
     if(latest_connection_hash_tbl != NULL)
     {
         hash_table_destroy(latest_connection_hash_tbl);
@@ -1742,6 +2355,132 @@ static int traverse_count_conns(hash_table_node_t *node, void *arg)
 #endif
 
 
+// Must be called inside rcu_read_lock(), the grants point at stanzas.
+static void extend_grants_flush(fko_srv_options_t *opts, fw_grant_t *grants,
+        int num_grants)
+{
+    int failed = 0;
+
+    if(num_grants == 0)
+        return;
+
+    if(pthread_mutex_lock(&(opts->spa_grant_mutex)))
+    {
+        log_msg(LOG_ERR, "extend_grants_flush() Mutex lock error.");
+        return;
+    }
+    failed = fw_install_grants(opts, grants, num_grants);
+    pthread_mutex_unlock(&(opts->spa_grant_mutex));
+
+    METRIC_ADD(METRIC_GRANTS_EXTENDED, num_grants - failed);
+
+    log_msg(LOG_DEBUG, "extend_grants_flush() extended %d of %d grants",
+            num_grants - failed, num_grants);
+}
+
+
+// Keep the grants of stanzas with GRANT_IDLE_TIMEOUT open while their
+// connections are active, so clients with long sessions need not knock
+// again.  A grant is extended once less than half the idle timeout is
+// left, to idle timeout seconds from now rounded up to a quarter of it,
+// so the connections sharing a grant ask for the same expire time and
+// the firewall only moves it once.  When a grant's connections go
+// quiet it runs out as usual.  Connections are only judged to share a
+// grant by their tuple, and NATed ones are left alone.
+static void extend_active_grants(fko_srv_options_t *opts)
+{
+    fw_grant_t grants[CONN_GRANT_BATCH];
+    service_data_t services[CONN_GRANT_BATCH];
+    acc_stanza_t *acc = NULL;
+    connection_t conn = NULL;
+    time_t now = time(NULL), target = 0, quantum = 0;
+    uint32_t i = 0;
+    int num_grants = 0, idle = 0, j = 0;
+
+    if(conn_index == NULL)
+        return;
+
+    rcu_read_lock();
+    for(i = 0; i < conn_index_size; i++)
+    {
+        if((conn = conn_index[i]) == NULL || conn->grant_check > now)
+            continue;
+
+        acc = judge_stanza_get(opts, conn->sdp_id);
+        if(acc == NULL || (idle = acc->cold->grant_idle_timeout) <= 0
+                || conn->verdict != CONN_VERDICT_VALID
+                || conn->end_time != 0 || conn->nat_dst_port != 0)
+        {
+            conn->grant_check = now + CONN_GRANT_RECHECK;
+            continue;
+        }
+
+        if(conn->grant_until == 0)
+            conn->grant_until = conn->start_time + acc->fw_access_timeout;
+
+        // the grant has run out, a new knock makes a new one
+        if(conn->grant_until <= now)
+        {
+            conn->grant_check = now + CONN_GRANT_RECHECK;
+            continue;
+        }
+
+        if(conn->grant_until - now > idle / 2)
+        {
+            conn->grant_check = conn->grant_until - idle / 2;
+            continue;
+        }
+
+        // quiet for now, look again on the next pass
+        if(conn->active_time + idle <= conn->grant_until)
+            continue;
+
+        quantum = idle / 4 > 0 ? idle / 4 : 1;
+        target  = ((now + idle + quantum - 1) / quantum) * quantum;
+
+        conn->grant_until = target;
+        conn->grant_check = target - idle / 2;
+
+        for(j = 0; j < num_grants; j++)
+        {
+            if(grants[j].sdp_id == conn->sdp_id
+                    && services[j].port == conn->dst_port
+                    && services[j].proto == conn->key.proto
+                    && strcmp(grants[j].src_ip, conn->src_ip_str) == 0
+                    && strcmp(grants[j].dst_ip, conn->dst_ip_str) == 0)
+                break;
+        }
+        if(j < num_grants)
+            continue;
+
+        if(num_grants == CONN_GRANT_BATCH)
+        {
+            extend_grants_flush(opts, grants, num_grants);
+            num_grants = 0;
+        }
+
+        memset(&(services[num_grants]), 0x0, sizeof(service_data_t));
+        services[num_grants].service_id = conn->service_id;
+        services[num_grants].proto      = conn->key.proto;
+        services[num_grants].port       = conn->dst_port;
+
+        memset(&(grants[num_grants]), 0x0, sizeof(fw_grant_t));
+        grants[num_grants].acc     = acc;
+        grants[num_grants].service = &(services[num_grants]);
+        grants[num_grants].sdp_id  = conn->sdp_id;
+        grants[num_grants].timeout = (unsigned int)(target - now);
+        strlcpy(grants[num_grants].src_ip, conn->src_ip_str,
+                sizeof(grants[num_grants].src_ip));
+        strlcpy(grants[num_grants].dst_ip, conn->dst_ip_str,
+                sizeof(grants[num_grants].dst_ip));
+        num_grants++;
+    }
+
+    extend_grants_flush(opts, grants, num_grants);
+    rcu_read_unlock();
+}
+
+
 int update_connections(fko_srv_options_t *opts)
 {
     int res = FWKNOPD_SUCCESS;
@@ -1763,13 +2502,9 @@ int update_connections(fko_srv_options_t *opts)
     new_unknown_conn_count_open = 0;
     new_unknown_conn_count_before_walk = 0;
     known_conn_cnt_before_update = 0;
-    known_conn_cnt_before_update_closed = 0;
-    known_conn_cnt_before_update_open = 0;
     known_conn_cnt_after_update = 0;
-    known_conn_cnt_after_update_closed = 0;
-    known_conn_cnt_after_update_open = 0;
+    known_conns_closed = 0;
     final_known_cnt = 0;
-    known_conns_deleted_during_comp = 0;
     known_conns_deleted = 0;
 #endif
 
@@ -1797,8 +2532,8 @@ int update_connections(fko_srv_options_t *opts)
     }
 #endif
 
-    // walk list of known connections
-    if( hash_table_traverse(connection_hash_tbl, traverse_compare_latest_cb, &now)  != FWKNOPD_SUCCESS )
+    // drop known connections that are gone from conntrack
+    if( hash_table_traverse(connection_hash_tbl, traverse_sweep_known_cb, &now)  != FWKNOPD_SUCCESS )
     {
         return FWKNOPD_ERROR_CONNTRACK;
     }
@@ -1817,6 +2552,11 @@ int update_connections(fko_srv_options_t *opts)
 
     // what's left in 'latest' conns are new, unknown conns
     // validate and possibly add to known list and to report for ctrl
+    if( judge_new_connections(opts) != FWKNOPD_SUCCESS )
+    {
+        return FWKNOPD_ERROR_CONNTRACK;
+    }
+
     if( hash_table_traverse(latest_connection_hash_tbl, traverse_handle_new_conns_cb, opts)  != FWKNOPD_SUCCESS )
     {
         return FWKNOPD_ERROR_CONNTRACK;
@@ -1829,13 +2569,10 @@ int update_connections(fko_srv_options_t *opts)
     }
 
     log_msg(LOG_ALERT, "       Known conn count before update: %6d", known_conn_cnt_before_update);
-    log_msg(LOG_ALERT, "  Known conn count before update OPEN: %6d", known_conn_cnt_before_update_open);
-    log_msg(LOG_ALERT, "Known conn count before update CLOSED: %6d", known_conn_cnt_before_update_closed);
+    log_msg(LOG_ALERT, "          Known conns newly TIME_WAIT: %6d", known_conns_closed);
     log_msg(LOG_ALERT, "                  Known conns deleted: %6d", known_conns_deleted);
-    log_msg(LOG_ALERT, "   Known conns deleted during compare: %6d", known_conns_deleted_during_comp);
     log_msg(LOG_ALERT, "        Known conn count after update: %6d", known_conn_cnt_after_update);
-    log_msg(LOG_ALERT, "   Known conn count after update OPEN: %6d", known_conn_cnt_after_update_open);
-    log_msg(LOG_ALERT, " Known conn count after update CLOSED: %6d", known_conn_cnt_after_update_closed);
+    log_msg(LOG_ALERT, "                  Indexed known conns: %6u", conn_index_count);
     log_msg(LOG_ALERT, "   New unknown conn count before walk: %6d", new_unknown_conn_count_before_walk);
     log_msg(LOG_ALERT, "               New unknown conn count: %6d", new_unknown_conn_count);
     log_msg(LOG_ALERT, "          New unknown conn count OPEN: %6d", new_unknown_conn_count_open);
@@ -1860,11 +2597,17 @@ int update_connections(fko_srv_options_t *opts)
         log_msg(LOG_DEBUG, "\n\n");
     }
 
+    extend_active_grants(opts);
+
+    FWKNOP_PROBE1(conntrack_update, conn_index_count);
+
     return FWKNOPD_SUCCESS;
 }
 
 int validate_connections(fko_srv_options_t *opts)
 {
+    judge_known_connections(opts);
+
     return hash_table_traverse(connection_hash_tbl, traverse_validate_connections_cb, opts);
 }
 
@@ -1873,7 +2616,7 @@ static int make_json_from_conn_item(connection_t conn, json_object **jconn_r)
 {
     json_object *jconn = json_object_new_object();
 
-//    json_object_object_add(jconn, "connection_id", json_object_new_int64(conn->connection_id));
+    json_object_object_add(jconn, conn_id_key, json_object_new_int64(conn->connection_id));
     json_object_object_add(jconn, "sdp_id", json_object_new_int(conn->sdp_id));
     json_object_object_add(jconn, "service_id", json_object_new_int(conn->service_id));
     json_object_object_add(jconn, "protocol", json_object_new_string(conn->protocol));
@@ -1886,17 +2629,278 @@ static int make_json_from_conn_item(connection_t conn, json_object **jconn_r)
     json_object_object_add(jconn, "start_timestamp", json_object_new_int64(conn->start_time));
     json_object_object_add(jconn, "end_timestamp", json_object_new_int64(conn->end_time));
 
+    if(report_counters)
+    {
+        json_object_object_add(jconn, "orig_packets", json_object_new_int64(conn->packets[CONN_DIR_ORIG]));
+        json_object_object_add(jconn, "orig_bytes", json_object_new_int64(conn->bytes[CONN_DIR_ORIG]));
+        json_object_object_add(jconn, "reply_packets", json_object_new_int64(conn->packets[CONN_DIR_REPLY]));
+        json_object_object_add(jconn, "reply_bytes", json_object_new_int64(conn->bytes[CONN_DIR_REPLY]));
+    }
+
     *jconn_r = jconn;
     return FWKNOPD_SUCCESS;
 }
 
-static int send_connection_report(fko_srv_options_t *opts, connection_t msg_list)
+static uint32_t ip_str_to_u32(const char *ip_str)
+{
+    struct in_addr addr;
+
+    if(ip_str[0] == '\0' || inet_pton(AF_INET, ip_str, &addr) != 1)
+        return 0;
+
+    return ntohl(addr.s_addr);
+}
+
+/*
+ * Connections in a delta are arrays of integers rather than objects, with
+ * addresses as host-order 32-bit values and times as seconds before the
+ * delta's "time" field:
+ *
+ *   opened: [sdp_id, service_id, proto, src_ip, src_port, dst_ip, dst_port,
+ *            nat_dst_ip, nat_dst_port, age_of_start]
+ *   closed: [sdp_id, proto, src_ip, src_port, dst_ip, dst_port, age_of_end]
+ *
+ * With CONN_REPORT_COUNTERS, opened and closed entries end with the counts
+ * since the connection was last reported:
+ *
+ *            [..., orig_packets, orig_bytes, reply_packets, reply_bytes]
+ *
+ * and open connections with new counts and nothing else to report go in
+ * an "updated" list:
+ *
+ *   updated: [sdp_id, proto, src_ip, src_port, dst_ip, dst_port,
+ *             orig_packets, orig_bytes, reply_packets, reply_bytes]
+ *
+ * Every entry ends with the connection ID, after any counts, so that
+ * consumers reading the fields above by position are unaffected.
+ */
+static void add_delta_counters(json_object *jconn, connection_t conn)
+{
+    int dir;
+
+    for(dir = CONN_DIR_ORIG; dir <= CONN_DIR_REPLY; dir++)
+    {
+        json_object_array_add(jconn, json_object_new_int64(
+                counter_delta(conn->packets[dir], conn->reported_packets[dir])));
+        json_object_array_add(jconn, json_object_new_int64(
+                counter_delta(conn->bytes[dir], conn->reported_bytes[dir])));
+    }
+}
+
+static json_object *make_delta_opened(connection_t conn, time_t now)
+{
+    json_object *jconn = json_object_new_array();
+
+    json_object_array_add(jconn, json_object_new_int64(conn->sdp_id));
+    json_object_array_add(jconn, json_object_new_int64(conn->service_id));
+    json_object_array_add(jconn, json_object_new_int(conn->key.proto));
+    json_object_array_add(jconn, json_object_new_int64(ntohl(conn->key.src)));
+    json_object_array_add(jconn, json_object_new_int(conn->src_port));
+    json_object_array_add(jconn, json_object_new_int64(ntohl(conn->key.dst)));
+    json_object_array_add(jconn, json_object_new_int(conn->dst_port));
+    json_object_array_add(jconn, json_object_new_int64(ip_str_to_u32(conn->nat_dst_ip_str)));
+    json_object_array_add(jconn, json_object_new_int(conn->nat_dst_port));
+    json_object_array_add(jconn, json_object_new_int64(now - conn->start_time));
+
+    if(report_counters)
+        add_delta_counters(jconn, conn);
+
+    json_object_array_add(jconn, json_object_new_int64(conn->connection_id));
+
+    return jconn;
+}
+
+static json_object *make_delta_closed(connection_t conn, time_t now)
+{
+    json_object *jconn = json_object_new_array();
+
+    json_object_array_add(jconn, json_object_new_int64(conn->sdp_id));
+    json_object_array_add(jconn, json_object_new_int(conn->key.proto));
+    json_object_array_add(jconn, json_object_new_int64(ntohl(conn->key.src)));
+    json_object_array_add(jconn, json_object_new_int(conn->src_port));
+    json_object_array_add(jconn, json_object_new_int64(ntohl(conn->key.dst)));
+    json_object_array_add(jconn, json_object_new_int(conn->dst_port));
+    json_object_array_add(jconn, json_object_new_int64(now - conn->end_time));
+
+    if(report_counters)
+        add_delta_counters(jconn, conn);
+
+    json_object_array_add(jconn, json_object_new_int64(conn->connection_id));
+
+    return jconn;
+}
+
+static json_object *make_delta_updated(connection_t conn)
+{
+    json_object *jconn = json_object_new_array();
+
+    json_object_array_add(jconn, json_object_new_int64(conn->sdp_id));
+    json_object_array_add(jconn, json_object_new_int(conn->key.proto));
+    json_object_array_add(jconn, json_object_new_int64(ntohl(conn->key.src)));
+    json_object_array_add(jconn, json_object_new_int(conn->src_port));
+    json_object_array_add(jconn, json_object_new_int64(ntohl(conn->key.dst)));
+    json_object_array_add(jconn, json_object_new_int(conn->dst_port));
+    add_delta_counters(jconn, conn);
+    json_object_array_add(jconn, json_object_new_int64(conn->connection_id));
+
+    return jconn;
+}
+
+#ifdef HAVE_LIBZ
+/*
+ * Deflate a delta into {"encoding": "zlib", "payload": <base64>}. If that
+ * is not smaller than the plain delta, *jmsg_r is left NULL.
+ */
+static int compress_delta(json_object *jdelta, json_object **jmsg_r)
+{
+    const char *json_str = json_object_to_json_string_ext(jdelta, JSON_C_TO_STRING_PLAIN);
+    uLong json_len = strlen(json_str);
+    uLongf z_len = compressBound(json_len);
+    unsigned char *z_buf = NULL;
+    char *b64_buf = NULL;
+    json_object *jmsg = NULL;
+    int b64_len = 0;
+
+    if((z_buf = malloc(z_len)) == NULL)
+        return SDP_ERROR_MEMORY_ALLOCATION;
+
+    if(compress2(z_buf, &z_len, (const Bytef *)json_str, json_len, Z_BEST_SPEED) != Z_OK)
+    {
+        log_msg(LOG_WARNING, "compress_delta() failed to compress connection delta, sending it plain");
+        free(z_buf);
+        return FWKNOPD_SUCCESS;
+    }
+
+    if((b64_buf = malloc((z_len + 2) / 3 * 4 + 1)) == NULL)
+    {
+        free(z_buf);
+        return SDP_ERROR_MEMORY_ALLOCATION;
+    }
+
+    b64_len = fko_base64_encode(z_buf, b64_buf, z_len);
+    free(z_buf);
+
+    if((uLong)b64_len < json_len)
+    {
+        jmsg = json_object_new_object();
+        json_object_object_add(jmsg, "encoding", json_object_new_string("zlib"));
+        json_object_object_add(jmsg, "payload", json_object_new_string_len(b64_buf, b64_len));
+        *jmsg_r = jmsg;
+    }
+
+    free(b64_buf);
+    return FWKNOPD_SUCCESS;
+}
+#endif
+
+// takes ownership of jopened, jclosed and jupdated, which is NULL
+// unless counters are reported
+static int send_delta_msg(fko_srv_options_t *opts, json_object *jopened,
+        json_object *jclosed, json_object *jupdated, int reset, time_t now)
+{
+    int rv = FWKNOPD_SUCCESS;
+    json_object *jdelta = json_object_new_object();
+    json_object *jmsg = NULL;
+
+    json_object_object_add(jdelta, "time", json_object_new_int64(now));
+    if(reset)
+        json_object_object_add(jdelta, "reset", json_object_new_boolean(1));
+    json_object_object_add(jdelta, "opened", jopened);
+    json_object_object_add(jdelta, "closed", jclosed);
+    if(jupdated != NULL)
+        json_object_object_add(jdelta, "updated", jupdated);
+
+#ifdef HAVE_LIBZ
+    if(report_compress && (rv = compress_delta(jdelta, &jmsg)) != FWKNOPD_SUCCESS)
+    {
+        json_object_put(jdelta);
+        return rv;
+    }
+#endif
+
+    if(jmsg == NULL)
+        jmsg = json_object_get(jdelta);
+
+    json_object_object_add(jmsg, conn_seq_key, json_object_new_int64(++report_seq));
+
+    log_msg(LOG_INFO, "Sending connection_delta message %"PRIu32" (%d opened, %d closed, "
+            "%d updated%s) to controller", report_seq, (int)json_object_array_length(jopened),
+            (int)json_object_array_length(jclosed),
+            jupdated != NULL ? (int)json_object_array_length(jupdated) : 0,
+            reset ? ", snapshot" : "");
+
+    rv = conntrack_thread_post_report(sdp_action_connection_delta, jmsg);
+
+    json_object_put(jmsg);
+    json_object_put(jdelta);
+
+    return rv;
+}
+
+/*
+ * Send the opened and closed connections in msg_list as deltas of at most
+ * CONN_DELTA_MAX_ENTRIES each. A snapshot is the same thing with the
+ * "reset" flag on its first message, telling the controller to drop
+ * whatever it holds for this gateway before applying it, so an empty
+ * snapshot is still sent.
+ */
+static int send_connection_delta(fko_srv_options_t *opts, connection_t msg_list, int snapshot)
+{
+    int rv = FWKNOPD_SUCCESS;
+    json_object *jopened = NULL;
+    json_object *jclosed = NULL;
+    json_object *jupdated = NULL;
+    connection_t this_conn = msg_list;
+    time_t now = time(NULL);
+    int conn_count = 0;
+
+    if(msg_list == NULL && snapshot)
+        return send_delta_msg(opts, json_object_new_array(), json_object_new_array(),
+                report_counters ? json_object_new_array() : NULL, 1, now);
+
+    while(this_conn != NULL)
+    {
+        if(jopened == NULL)
+        {
+            jopened = json_object_new_array();
+            jclosed = json_object_new_array();
+            if(report_counters)
+                jupdated = json_object_new_array();
+        }
+
+        if(this_conn->counters_only)
+            json_object_array_add(jupdated, make_delta_updated(this_conn));
+        else if(this_conn->end_time)
+            json_object_array_add(jclosed, make_delta_closed(this_conn, now));
+        else
+            json_object_array_add(jopened, make_delta_opened(this_conn, now));
+
+        conn_count++;
+        this_conn = this_conn->next;
+
+        if(conn_count >= CONN_DELTA_MAX_ENTRIES || this_conn == NULL)
+        {
+            rv = send_delta_msg(opts, jopened, jclosed, jupdated, snapshot, now);
+            jopened = jclosed = jupdated = NULL;
+            snapshot = 0;
+            conn_count = 0;
+
+            if(rv != SDP_SUCCESS)
+                return rv;
+        }
+    }
+
+    return rv;
+}
+
+static int send_connection_report(fko_srv_options_t *opts, connection_t msg_list, int snapshot)
 {
     int rv = FWKNOPD_SUCCESS;
     json_object *jarray = NULL;
     json_object *jconn = NULL;
     connection_t this_conn = msg_list;
     int conn_count = 0;
+    uint32_t seq_before = report_seq;
 
 #ifdef DEBUG_CONNECTION_TRACKER
     const char *json_string = NULL;
@@ -1904,15 +2908,34 @@ static int send_connection_report(fko_srv_options_t *opts, connection_t msg_list
     int msg_len = 0;
 #endif
 
-    if(msg_list == NULL)
-        return rv;
-
     if(verbosity >= LOG_DEBUG)
     {
         log_msg(LOG_DEBUG, "\n\nDumping message list for controller:");
         print_connection_list(msg_list);
     }
 
+    if(report_deltas)
+    {
+        if((rv = send_connection_delta(opts, msg_list, snapshot)) != SDP_SUCCESS)
+        {
+            // whatever part of the list did not get out is lost, so the
+            // controller has to be brought back in sync with a snapshot
+            report_snapshot_due = 1;
+        }
+        else if(snapshot)
+        {
+            // deltas sent before the snapshot no longer need an ack
+            if((int32_t)(seq_before - report_acked_seq) > 0)
+                report_acked_seq = seq_before;
+            report_snapshot_due = 0;
+        }
+
+        return rv;
+    }
+
+    if(msg_list == NULL)
+        return rv;
+
     jarray = json_object_new_array();
 
     // send in blocks of MSG_CONN_LIST_COUNT_THRESHOLD connections max
@@ -1939,7 +2962,7 @@ static int send_connection_report(fko_srv_options_t *opts, connection_t msg_list
             log_msg(LOG_ALERT, "average conn data length in bytes: %10.2f\n", avg);
 #endif
 
-            rv = sdp_ctrl_client_send_message(opts->ctrl_client, "connection_update", jarray);
+            rv = conntrack_thread_post_report(sdp_action_connection_update, jarray);
 
             json_object_put(jarray);
 
@@ -1968,7 +2991,7 @@ static int send_connection_report(fko_srv_options_t *opts, connection_t msg_list
     log_msg(LOG_ALERT, "average conn data length in bytes: %10.2f\n", avg);
 #endif
 
-    rv = sdp_ctrl_client_send_message(opts->ctrl_client, "connection_update", jarray);
+    rv = conntrack_thread_post_report(sdp_action_connection_update, jarray);
 
     json_object_put(jarray);
 
@@ -1976,6 +2999,46 @@ static int send_connection_report(fko_srv_options_t *opts, connection_t msg_list
 }
 
 
+// Copy the open connections of an SDP ID whose counts changed since they
+// were last reported into the message list, as counter updates.
+static int traverse_copy_updated_conns_cb(hash_table_node_t *node, void *arg)
+{
+    int rv = FWKNOPD_SUCCESS;
+    connection_t this_conn = NULL;
+    connection_t temp_conn = NULL;
+    connection_t updated = NULL;
+    connection_t updated_tail = NULL;
+    int updated_count = 0;
+
+    for(this_conn = (connection_t)(node->data); this_conn != NULL; this_conn = this_conn->next)
+    {
+        if(this_conn->end_time != 0 || !conn_counters_changed(this_conn))
+            continue;
+
+        if( (rv = duplicate_connection_item(this_conn, &temp_conn)) != FWKNOPD_SUCCESS)
+            break;
+
+        temp_conn->counters_only = 1;
+        if(updated_tail == NULL)
+            updated = temp_conn;
+        else
+            updated_tail->next = temp_conn;
+        updated_tail = temp_conn;
+        updated_count++;
+
+        conn_counters_mark_reported(this_conn);
+    }
+
+    if(updated != NULL)
+    {
+        add_to_connection_list(&msg_conn_list, updated);
+        msg_conn_list_count += updated_count;
+    }
+
+    return rv;
+}
+
+
 int consider_reporting_connections(fko_srv_options_t *opts)
 {
     int rv = FWKNOPD_SUCCESS;
@@ -1990,10 +3053,31 @@ int consider_reporting_connections(fko_srv_options_t *opts)
         return rv;
     }
 
+    // the controller has lost track of our deltas, start over from a snapshot
+    if(report_deltas && report_snapshot_due && now >= next_ctrl_msg_due)
+    {
+        next_ctrl_msg_due = now + interval;
+        return report_open_connections(opts);
+    }
+
     // if it's not time, just return success
-    if(msg_conn_list_count < MSG_CONN_LIST_COUNT_THRESHOLD && now < next_ctrl_msg_due)
+    if(msg_conn_list_count < (report_deltas ? CONN_DELTA_MAX_ENTRIES : MSG_CONN_LIST_COUNT_THRESHOLD)
+            && now < next_ctrl_msg_due)
         return rv;
 
+    // open connections whose counts moved go out with this report
+    if(report_counters && now >= next_ctrl_msg_due)
+    {
+        if(report_deltas && (rv = hash_table_traverse(connection_hash_tbl,
+                        traverse_copy_updated_conns_cb, NULL)) != FWKNOPD_SUCCESS)
+            return rv;
+
+        // the counters were just refreshed for this report, don't do it
+        // again until the next one even if there is nothing to send
+        if(msg_conn_list == NULL)
+            next_ctrl_msg_due = now + interval;
+    }
+
     // if nothing new to report, just return success
     if(msg_conn_list == NULL)
         return rv;
@@ -2013,8 +3097,18 @@ int consider_reporting_connections(fko_srv_options_t *opts)
         log_msg(LOG_DEBUG, "\n\n");
     }
 
+    if(report_deltas && (int32_t)(report_seq - report_acked_seq) >= CONN_REPORT_MAX_UNACKED)
+    {
+        log_msg(LOG_WARNING, "consider_reporting_connections() controller acknowledged "
+                "connection delta %"PRIu32" of %"PRIu32", sending a snapshot instead",
+                report_acked_seq, report_seq);
+        report_snapshot_due = 1;
+        next_ctrl_msg_due = now + interval;
+        return report_open_connections(opts);
+    }
+
     // send message
-    if( (rv = send_connection_report(opts, msg_conn_list)) != FWKNOPD_SUCCESS)
+    if( (rv = send_connection_report(opts, msg_conn_list, 0)) != FWKNOPD_SUCCESS)
     {
         if(rv == SDP_ERROR_MEMORY_ALLOCATION)
         {
@@ -2052,6 +3146,7 @@ static int traverse_copy_open_conns_cb(hash_table_node_t *node, void *arg)
 {
     int rv = FWKNOPD_SUCCESS;
     connection_t temp_conn = NULL;
+    connection_t this_conn = NULL;
 
     log_msg(LOG_DEBUG, "traverse_copy_open_conns_cb() entered");
 
@@ -2075,6 +3170,11 @@ static int traverse_copy_open_conns_cb(hash_table_node_t *node, void *arg)
 
     if( (rv = add_to_connection_list(&msg_conn_list, temp_conn)) != FWKNOPD_SUCCESS)
         destroy_connection_list(temp_conn);
+    else
+    {
+        for(this_conn = (connection_t)(node->data); this_conn != NULL; this_conn = this_conn->next)
+            conn_counters_mark_reported(this_conn);
+    }
 
     while(temp_conn != NULL)
     {
@@ -2120,14 +3220,15 @@ int report_open_connections(fko_srv_options_t *opts)
         return rv;
     }
 
-    if(msg_conn_list == NULL)
+    // with deltas, even an empty snapshot tells the controller something
+    if(msg_conn_list == NULL && !report_deltas)
     {
         log_msg(LOG_DEBUG, "report_open_connections() found nothing to report.");
         return FWKNOPD_SUCCESS;
     }
 
     // send message
-    rv = send_connection_report(opts, msg_conn_list);
+    rv = send_connection_report(opts, msg_conn_list, 1);
 
     // free message list
     destroy_connection_list(msg_conn_list);
@@ -2152,4 +3253,94 @@ int report_open_connections(fko_srv_options_t *opts)
     return FWKNOPD_SUCCESS;
 }
 
+/*
+ *  Pull the sequence number out of a connection_ack message.
+ */
+int conn_report_ack_seq(json_object *jdata, uint32_t *seq_r)
+{
+    json_object *jseq = NULL;
+
+    if( !json_object_object_get_ex(jdata, conn_seq_key, &jseq)
+            || json_object_get_type(jseq) != json_type_int)
+    {
+        log_msg(LOG_ERR, "conn_report_ack_seq() ack is missing the sequence number");
+        return FWKNOPD_ERROR_CONNTRACK;
+    }
+
+    *seq_r = (uint32_t)json_object_get_int64(jseq);
+    return FWKNOPD_SUCCESS;
+}
+
+/*
+ *  The controller acknowledges connection deltas by sequence number. Acks
+ *  may be cumulative, so only the latest one matters.
+ */
+void conn_report_ack(uint32_t seq)
+{
+    if((int32_t)(seq - report_acked_seq) <= 0 || (int32_t)(report_seq - seq) < 0)
+    {
+        log_msg(LOG_DEBUG, "conn_report_ack() ignoring ack %"PRIu32
+                ", last acked %"PRIu32", last sent %"PRIu32, seq, report_acked_seq, report_seq);
+        return;
+    }
+
+    report_acked_seq = seq;
+}
+
+void request_conn_snapshot(void)
+{
+    report_snapshot_due = 1;
+    next_ctrl_msg_due = 0;
+}
+
+/*
+ *  Number of connections being tracked. The index belongs to the main
+ *  thread, so other threads only get a relaxed snapshot of the count.
+ */
+uint32_t connection_tracker_count(void)
+{
+    return __atomic_load_n(&conn_index_count, __ATOMIC_RELAXED);
+}
+
+/*
+ *  The descriptor to wait on for conntrack events, or -1 if connections
+ *  are found with the conntrack command.
+ */
+int connection_tracker_event_fd(void)
+{
+#if FIREWALL_IPTABLES || FIREWALL_FIREWALLD
+    if(conntrack_nl_active)
+        return conntrack_nl_fd();
+#endif
+    return -1;
+}
+
+/*
+ *  Apply a bounded batch of pending conntrack events. Returns 1 if more
+ *  are waiting, and -1 if netlink failed, in which case the following
+ *  updates use the conntrack command.
+ */
+int connection_tracker_poll_events(void)
+{
+#if FIREWALL_IPTABLES || FIREWALL_FIREWALLD
+    int res = 0;
+
+    if(!conntrack_nl_active)
+        return -1;
+
+    if((res = conntrack_nl_poll(CONNTRACK_NL_POLL_BUDGET)) < 0)
+    {
+        log_msg(LOG_WARNING, "connection_tracker_poll_events() Failed to read conntrack "
+                "events (%s), falling back to the conntrack command", strerror(errno));
+        conntrack_nl_close();
+        conntrack_nl_active = 0;
+    }
+    else
+        FWKNOP_PROBE1(conntrack_update, conn_index_count);
+    return res;
+#else
+    return -1;
+#endif
+}
+
 //#endif
@@ -11,14 +11,57 @@
 #define CMD_BUFSIZE                     256
 #define MAX_CONNTRACK_COMMAND_ARGS_LEN  256
 #define STANDARD_CMD_OUT_BUFSIZE        4096
-#define CONNTRACK_CMD_OUT_BUFSIZE       1024*1024
-//#define CONN_ID_BUF_LEN                 21
+#define CONN_ID_BUF_LEN                 21
 #define CRITERIA_BUF_LEN                CMD_BUFSIZE - 20
 
 #define MSG_CONN_LIST_COUNT_THRESHOLD   100
 
+// connection IDs are leased from CONN_ID_FILE this many at a time, so the
+// file is written once per block rather than once per connection
+#define CONN_ID_BLOCK_SIZE              10000
+
+// with CONN_REPORT_DELTAS, the most connections in one connection_delta
+// message, and how many deltas may go unacknowledged before the next
+// report is sent as a snapshot instead
+#define CONN_DELTA_MAX_ENTRIES          500
+#define CONN_REPORT_MAX_UNACKED         16
+
 #define CONNMARK_SEARCH_ARGS "-m %"PRIu32" -p %s -s %s --sport %d -d %s --dport %d --reply-port-src %d"
 
+// binary identity of a connection, zero padded so it can be hashed
+// and compared as a block of memory
+typedef struct conn_key{
+	uint32_t mark;
+	uint32_t src;
+	uint32_t dst;
+	uint32_t reply_src;
+	uint16_t sport;
+	uint16_t dport;
+	uint16_t reply_sport;
+	uint8_t  proto;
+	uint8_t  pad;
+} conn_key_t;
+
+#define CONN_INDEX_MIN_SIZE             1024
+
+#define CONNTRACK_ACCT_SYSCTL           "/proc/sys/net/netfilter/nf_conntrack_acct"
+
+// counter directions, client to service and back
+#define CONN_DIR_ORIG                   0
+#define CONN_DIR_REPLY                  1
+
+// what the access table said about a connection in the last
+// judge_*() pass, which the close logic then goes by
+#define CONN_VERDICT_VALID              0
+#define CONN_VERDICT_INVALID            1
+#define CONN_VERDICT_REVOKED            2   // SDP ID has no stanza
+
+// activity based grant extension (GRANT_IDLE_TIMEOUT), grants go to
+// the firewall this many at a time, and connections of stanzas that
+// do not use it are looked at again this often (seconds)
+#define CONN_GRANT_BATCH                64
+#define CONN_GRANT_RECHECK              60
+
 struct connection{
 	uint32_t sdp_id;
 	uint32_t service_id;
@@ -31,7 +74,18 @@ struct connection{
 	unsigned int  nat_dst_port;
 	time_t start_time;
 	time_t end_time;
-//	uint64_t connection_id;
+	uint64_t connection_id;
+	conn_key_t key;
+	uint32_t seen_gen;
+	uint64_t packets[2];
+	uint64_t bytes[2];
+	uint64_t reported_packets[2];
+	uint64_t reported_bytes[2];
+	int counters_only;
+	int verdict;
+	time_t active_time;     // last time its counters moved
+	time_t grant_until;     // when we expect its grant to run out
+	time_t grant_check;     // when to look at extending the grant again
 	struct connection *next;
 };
 typedef struct connection *connection_t;
@@ -42,5 +96,11 @@ int update_connections(fko_srv_options_t *opts);
 int validate_connections(fko_srv_options_t *opts);
 int consider_reporting_connections(fko_srv_options_t *opts);
 int report_open_connections(fko_srv_options_t *opts);
+int conn_report_ack_seq(json_object *jdata, uint32_t *seq_r);
+void conn_report_ack(uint32_t seq);
+void request_conn_snapshot(void);
+uint32_t connection_tracker_count(void);
+int connection_tracker_event_fd(void);
+int connection_tracker_poll_events(void);
 
 #endif /* SERVER_CONNECTION_TRACKER_H_ */
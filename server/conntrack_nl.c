@@ -0,0 +1,889 @@
+/*
+ *****************************************************************************
+ *
+ * File:    conntrack_nl.c
+ *
+ * Purpose: Keeps the set of fwknop-marked connections by listening for
+ *          conntrack events over netlink.  The table is read once with a
+ *          dump, and after that only new, updated and destroyed marked
+ *          connections reach us - a socket filter in the kernel drops
+ *          events for connections without a mark.  This replaces parsing
+ *          the full output of 'conntrack -L' on every update.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+
+#if FIREWALL_IPTABLES || FIREWALL_FIREWALLD
+
+#include "conntrack_nl.h"
+
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/filter.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+#include <linux/netfilter/nf_conntrack_tcp.h>
+
+#define CT_GROUPS   ((1 << (NFNLGRP_CONNTRACK_NEW - 1)) \
+                    | (1 << (NFNLGRP_CONNTRACK_UPDATE - 1)) \
+                    | (1 << (NFNLGRP_CONNTRACK_DESTROY - 1)))
+
+#define ATTR_DATA(nla)  ((const char *)(nla) + NLA_HDRLEN)
+#define ATTR_LEN(nla)   ((int)(nla)->nla_len - NLA_HDRLEN)
+
+static int      ct_sock = -1;
+static uint32_t ct_gen  = 0;
+static uint32_t ct_seq  = 0;
+static char     ct_buf[CONNTRACK_NL_BUFSIZE];
+static conntrack_nl_entry_t *ct_tbl[CONNTRACK_NL_HASH_SIZE];
+
+/* Accept only messages that carry a nonzero CTA_MARK.  SKF_AD_NLATTR
+ * finds the attribute after the nfgenmsg header and leaves its offset
+ * in A, or zero when it isn't there.
+*/
+static struct sock_filter ct_filter[] = {
+    BPF_STMT(BPF_LD|BPF_IMM, NLMSG_LENGTH(sizeof(struct nfgenmsg))),
+    BPF_STMT(BPF_LDX|BPF_IMM, CTA_MARK),
+    BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF + SKF_AD_NLATTR),
+    BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0, 3, 0),
+    BPF_STMT(BPF_MISC|BPF_TAX, 0),
+    BPF_STMT(BPF_LD|BPF_W|BPF_IND, NLA_HDRLEN),
+    BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0, 0, 1),
+    BPF_STMT(BPF_RET|BPF_K, 0),
+    BPF_STMT(BPF_RET|BPF_K, 0xffffffff),
+};
+
+/* Index the attributes in a block by type.  Types above max are skipped.
+*/
+static void
+parse_attrs(const struct nlattr *nla, int len, const struct nlattr **tb,
+        const int max)
+{
+    int     type;
+
+    memset(tb, 0x0, (max + 1) * sizeof(*tb));
+
+    while(len >= NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN
+            && nla->nla_len <= len)
+    {
+        type = nla->nla_type & NLA_TYPE_MASK;
+        if(type <= max)
+            tb[type] = nla;
+
+        len -= NLA_ALIGN(nla->nla_len);
+        nla = (const struct nlattr *)((const char *)nla + NLA_ALIGN(nla->nla_len));
+    }
+    return;
+}
+
+static void
+parse_nested(const struct nlattr *nest, const struct nlattr **tb,
+        const int max)
+{
+    parse_attrs((const struct nlattr *)ATTR_DATA(nest), ATTR_LEN(nest),
+        tb, max);
+    return;
+}
+
+static uint32_t
+get_be32(const struct nlattr *nla)
+{
+    uint32_t    val = 0;
+
+    if(ATTR_LEN(nla) >= (int)sizeof(val))
+        memcpy(&val, ATTR_DATA(nla), sizeof(val));
+    return ntohl(val);
+}
+
+static uint64_t
+get_be64(const struct nlattr *nla)
+{
+    uint64_t    val = 0;
+
+    if(ATTR_LEN(nla) >= (int)sizeof(val))
+        memcpy(&val, ATTR_DATA(nla), sizeof(val));
+    return be64toh(val);
+}
+
+static uint16_t
+get_be16(const struct nlattr *nla)
+{
+    uint16_t    val = 0;
+
+    if(nla != NULL && ATTR_LEN(nla) >= (int)sizeof(val))
+        memcpy(&val, ATTR_DATA(nla), sizeof(val));
+    return ntohs(val);
+}
+
+/* Pull the addresses, protocol and ports out of a CTA_TUPLE_* nest.
+*/
+static int
+parse_tuple(const struct nlattr *nest, uint32_t *src, uint32_t *dst,
+        uint8_t *proto, uint16_t *sport, uint16_t *dport)
+{
+    const struct nlattr    *tb[CTA_TUPLE_MAX+1];
+    const struct nlattr    *ip[CTA_IP_MAX+1];
+    const struct nlattr    *pr[CTA_PROTO_MAX+1];
+
+    if(nest == NULL)
+        return -1;
+
+    parse_nested(nest, tb, CTA_TUPLE_MAX);
+    if(tb[CTA_TUPLE_IP] == NULL || tb[CTA_TUPLE_PROTO] == NULL)
+        return -1;
+
+    parse_nested(tb[CTA_TUPLE_IP], ip, CTA_IP_MAX);
+    parse_nested(tb[CTA_TUPLE_PROTO], pr, CTA_PROTO_MAX);
+
+    if(ip[CTA_IP_V4_SRC] == NULL || ATTR_LEN(ip[CTA_IP_V4_SRC]) < 4
+            || ip[CTA_IP_V4_DST] == NULL || ATTR_LEN(ip[CTA_IP_V4_DST]) < 4
+            || pr[CTA_PROTO_NUM] == NULL || ATTR_LEN(pr[CTA_PROTO_NUM]) < 1)
+        return -1;
+
+    memcpy(src, ATTR_DATA(ip[CTA_IP_V4_SRC]), 4);
+    memcpy(dst, ATTR_DATA(ip[CTA_IP_V4_DST]), 4);
+    *proto = *(const uint8_t *)ATTR_DATA(pr[CTA_PROTO_NUM]);
+    *sport = get_be16(pr[CTA_PROTO_SRC_PORT]);
+    *dport = get_be16(pr[CTA_PROTO_DST_PORT]);
+
+    return 0;
+}
+
+static int
+in_time_wait(const struct nlattr *nest)
+{
+    const struct nlattr    *pi[CTA_PROTOINFO_MAX+1];
+    const struct nlattr    *tcp[CTA_PROTOINFO_TCP_MAX+1];
+
+    if(nest == NULL)
+        return 0;
+
+    parse_nested(nest, pi, CTA_PROTOINFO_MAX);
+    if(pi[CTA_PROTOINFO_TCP] == NULL)
+        return 0;
+
+    parse_nested(pi[CTA_PROTOINFO_TCP], tcp, CTA_PROTOINFO_TCP_MAX);
+    if(tcp[CTA_PROTOINFO_TCP_STATE] == NULL
+            || ATTR_LEN(tcp[CTA_PROTOINFO_TCP_STATE]) < 1)
+        return 0;
+
+    return *(const uint8_t *)ATTR_DATA(tcp[CTA_PROTOINFO_TCP_STATE])
+        == TCP_CONNTRACK_TIME_WAIT;
+}
+
+/* Take the packet and byte counts from a CTA_COUNTERS_* nest, if the
+ * message has one.  Old kernels send 32-bit counters.
+*/
+static void
+parse_counters(const struct nlattr *nest, uint64_t *packets, uint64_t *bytes)
+{
+    const struct nlattr    *tb[CTA_COUNTERS_MAX+1];
+
+    if(nest == NULL)
+        return;
+
+    parse_nested(nest, tb, CTA_COUNTERS_MAX);
+
+    if(tb[CTA_COUNTERS_PACKETS] != NULL)
+        *packets = get_be64(tb[CTA_COUNTERS_PACKETS]);
+    else if(tb[CTA_COUNTERS32_PACKETS] != NULL)
+        *packets = get_be32(tb[CTA_COUNTERS32_PACKETS]);
+
+    if(tb[CTA_COUNTERS_BYTES] != NULL)
+        *bytes = get_be64(tb[CTA_COUNTERS_BYTES]);
+    else if(tb[CTA_COUNTERS32_BYTES] != NULL)
+        *bytes = get_be32(tb[CTA_COUNTERS32_BYTES]);
+    return;
+}
+
+static conntrack_nl_entry_t **
+entry_slot(const uint32_t id)
+{
+    conntrack_nl_entry_t  **pp = &ct_tbl[id & (CONNTRACK_NL_HASH_SIZE - 1)];
+
+    while(*pp != NULL && (*pp)->id != id)
+        pp = &(*pp)->next;
+    return pp;
+}
+
+/* Apply one conntrack message - an event or a dump reply - to the table.
+ * Entries are never removed here, only marked closed, so that a
+ * connection that came and went between two walks is still reported.
+ * Returns the mark of the connection.
+*/
+static uint32_t
+handle_msg(const struct nlmsghdr *nlh, const time_t now, void *arg)
+{
+    const struct nfgenmsg  *nfg;
+    const struct nlattr    *tb[CTA_MAX+1];
+    conntrack_nl_entry_t  **pp, *e, c;
+    uint32_t                reply_dst;
+    uint16_t                reply_dport;
+    uint8_t                 reply_proto;
+
+    if(NFNL_SUBSYS_ID(nlh->nlmsg_type) != NFNL_SUBSYS_CTNETLINK
+            || nlh->nlmsg_len < NLMSG_LENGTH(sizeof(struct nfgenmsg)))
+        return 0;
+
+    nfg = NLMSG_DATA(nlh);
+
+    parse_attrs((const struct nlattr *)((const char *)nfg
+            + NLMSG_ALIGN(sizeof(struct nfgenmsg))),
+        nlh->nlmsg_len - NLMSG_LENGTH(sizeof(struct nfgenmsg)), tb, CTA_MAX);
+
+    memset(&c, 0x0, sizeof(c));
+    if(tb[CTA_MARK] != NULL)
+        c.mark = get_be32(tb[CTA_MARK]);
+
+    if(nfg->nfgen_family != AF_INET || tb[CTA_ID] == NULL)
+        return c.mark;
+
+    c.id = get_be32(tb[CTA_ID]);
+
+    pp = entry_slot(c.id);
+
+    if(NFNL_MSG_TYPE(nlh->nlmsg_type) == IPCTNL_MSG_CT_DELETE)
+    {
+        if(*pp != NULL)
+        {
+            (*pp)->closed    = 1;
+            (*pp)->destroyed = 1;
+            parse_counters(tb[CTA_COUNTERS_ORIG],
+                &(*pp)->packets[CONNTRACK_NL_DIR_ORIG],
+                &(*pp)->bytes[CONNTRACK_NL_DIR_ORIG]);
+            parse_counters(tb[CTA_COUNTERS_REPLY],
+                &(*pp)->packets[CONNTRACK_NL_DIR_REPLY],
+                &(*pp)->bytes[CONNTRACK_NL_DIR_REPLY]);
+        }
+        return c.mark;
+    }
+
+    if(NFNL_MSG_TYPE(nlh->nlmsg_type) != IPCTNL_MSG_CT_NEW)
+        return c.mark;
+
+    /* A connection whose mark was cleared is no longer ours.
+    */
+    if(c.mark == 0)
+    {
+        if(*pp != NULL)
+            (*pp)->closed = 1;
+        return c.mark;
+    }
+
+    if(parse_tuple(tb[CTA_TUPLE_ORIG], &c.src, &c.dst, &c.proto,
+                &c.sport, &c.dport) != 0
+            || parse_tuple(tb[CTA_TUPLE_REPLY], &c.reply_src, &reply_dst,
+                &reply_proto, &c.reply_sport, &reply_dport) != 0)
+        return c.mark;
+
+    if(c.proto != IPPROTO_TCP && c.proto != IPPROTO_UDP)
+        return c.mark;
+
+    if((e = *pp) == NULL)
+    {
+        if((e = calloc(1, sizeof(*e))) == NULL)
+            return c.mark;
+        e->id         = c.id;
+        e->first_seen = now;
+        *pp = e;
+    }
+
+    e->mark        = c.mark;
+    e->proto       = c.proto;
+    e->src         = c.src;
+    e->dst         = c.dst;
+    e->sport       = c.sport;
+    e->dport       = c.dport;
+    e->reply_src   = c.reply_src;
+    e->reply_sport = c.reply_sport;
+    e->gen         = ct_gen;
+
+    parse_counters(tb[CTA_COUNTERS_ORIG], &e->packets[CONNTRACK_NL_DIR_ORIG],
+        &e->bytes[CONNTRACK_NL_DIR_ORIG]);
+    parse_counters(tb[CTA_COUNTERS_REPLY], &e->packets[CONNTRACK_NL_DIR_REPLY],
+        &e->bytes[CONNTRACK_NL_DIR_REPLY]);
+
+    /* Protocol info only comes with some updates, so a closed entry
+     * stays closed.
+    */
+    if(in_time_wait(tb[CTA_PROTOINFO]))
+        e->closed = 1;
+
+    return c.mark;
+}
+
+/* A socket for requests, separate from the event socket.
+*/
+static int
+req_socket(void)
+{
+    struct sockaddr_nl  sa;
+    struct timeval      tv;
+    int                 sock, rcvbuf = CONNTRACK_NL_RCVBUF;
+
+    if((sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_NETFILTER)) < 0)
+        return -1;
+
+    memset(&sa, 0x0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+
+    if(bind(sock, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+    {
+        close(sock);
+        return -1;
+    }
+
+    /* Don't let a missing reply hang the daemon, and leave room for
+     * the acks to a batch of deletes.
+    */
+    tv.tv_sec  = CONNTRACK_NL_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if(setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0)
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    return sock;
+}
+
+/* Read the IPv4 conntrack entries whose mark matches mark/mask, passing
+ * each to cb.  The kernel applies the filter, so only matching
+ * connections are copied out.  Returns 1 if the kernel ignored the
+ * filter and sent the whole table.
+*/
+static int
+dump_table(const uint32_t mark, const uint32_t mask,
+        uint32_t (*cb)(const struct nlmsghdr *nlh, const time_t now, void *arg),
+        void *arg)
+{
+    struct nlmsghdr    *rh;
+    struct nlmsgerr    *err;
+    struct {
+        struct nlmsghdr nlh;
+        struct nfgenmsg nfg;
+        struct nlattr   mark_hdr;
+        uint32_t        mark;
+        struct nlattr   mask_hdr;
+        uint32_t        mask;
+    } req;
+    time_t              now = time(NULL);
+    int                 sock, len, done = 0, unfiltered = 0, res = 0;
+
+    if((sock = req_socket()) < 0)
+        return -1;
+
+    memset(&req, 0x0, sizeof(req));
+    req.nlh.nlmsg_len    = sizeof(req);
+    req.nlh.nlmsg_type   = (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_GET;
+    req.nlh.nlmsg_flags  = NLM_F_REQUEST | NLM_F_DUMP;
+    req.nlh.nlmsg_seq    = ++ct_seq;
+    req.nfg.nfgen_family = AF_INET;
+    req.nfg.version      = NFNETLINK_V0;
+    req.mark_hdr.nla_type = CTA_MARK;
+    req.mark_hdr.nla_len  = NLA_HDRLEN + sizeof(req.mark);
+    req.mark              = htonl(mark);
+    req.mask_hdr.nla_type = CTA_MARK_MASK;
+    req.mask_hdr.nla_len  = NLA_HDRLEN + sizeof(req.mask);
+    req.mask              = htonl(mask);
+
+    if(send(sock, &req, req.nlh.nlmsg_len, 0) < 0)
+    {
+        close(sock);
+        return -1;
+    }
+
+    while(!done)
+    {
+        if((len = recv(sock, ct_buf, sizeof(ct_buf), 0)) < 0)
+        {
+            res = -1;
+            break;
+        }
+
+        for(rh = (struct nlmsghdr *)ct_buf; NLMSG_OK(rh, (unsigned int)len);
+                rh = NLMSG_NEXT(rh, len))
+        {
+            if(rh->nlmsg_seq != req.nlh.nlmsg_seq)
+                continue;
+
+            if(rh->nlmsg_type == NLMSG_DONE)
+            {
+                done = 1;
+                break;
+            }
+
+            if(rh->nlmsg_type == NLMSG_ERROR)
+            {
+                err = NLMSG_DATA(rh);
+                if(err->error != 0)
+                {
+                    errno = -err->error;
+                    res = -1;
+                }
+                done = 1;
+                break;
+            }
+
+            if((cb(rh, now, arg) & mask) != mark)
+                unfiltered = 1;
+        }
+    }
+
+    close(sock);
+    return res < 0 ? res : unfiltered;
+}
+
+/* Rebuild the table from fresh dumps.  Anything they didn't return is
+ * gone.
+ *
+ * The kernel can only match mark & mask == value, not a nonzero mark.
+ * But each nonzero mark has exactly one lowest set bit, so dumping once
+ * for each bit position - that bit set and every bit below it clear -
+ * returns each marked connection once and no unmarked ones.  The kernel
+ * walks the table for each dump, but only fwknop's connections are
+ * copied out.
+*/
+static int
+resync(void)
+{
+    conntrack_nl_entry_t   *e;
+    uint32_t                mask;
+    int                     i, res;
+
+    ct_gen++;
+
+    for(i=0; i < 32; i++)
+    {
+        mask = (i == 31) ? 0xffffffff : ((uint32_t)1 << (i+1)) - 1;
+
+        if((res = dump_table((uint32_t)1 << i, mask, handle_msg, NULL)) < 0)
+            return -1;
+
+        /* Without kernel filtering, the first dump had everything.
+        */
+        if(res > 0)
+            break;
+    }
+
+    for(i=0; i < CONNTRACK_NL_HASH_SIZE; i++)
+        for(e = ct_tbl[i]; e != NULL; e = e->next)
+            if(e->gen != ct_gen)
+                e->closed = e->destroyed = 1;
+
+    return 0;
+}
+
+int
+conntrack_nl_open(void)
+{
+    struct sockaddr_nl  sa;
+    struct sock_fprog   prog;
+    int                 rcvbuf = CONNTRACK_NL_RCVBUF, res;
+
+    if(ct_sock >= 0)
+        return 0;
+
+    if((ct_sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_NETFILTER)) < 0)
+        return -1;
+
+    if(fcntl(ct_sock, F_SETFD, FD_CLOEXEC) == -1)
+        goto err;
+
+    /* The filter is only an optimization, unmarked connections are
+     * ignored below anyway.
+    */
+    prog.len    = sizeof(ct_filter) / sizeof(ct_filter[0]);
+    prog.filter = ct_filter;
+    setsockopt(ct_sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+
+    if(setsockopt(ct_sock, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0)
+        setsockopt(ct_sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    memset(&sa, 0x0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+    sa.nl_groups = CT_GROUPS;
+
+    if(bind(ct_sock, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+        goto err;
+
+    ct_seq = time(NULL);
+
+    /* Subscribed first, so nothing between the dump and the first
+     * event is missed.
+    */
+    if(resync() != 0)
+        goto err;
+
+    return 0;
+
+err:
+    res = errno;
+    conntrack_nl_close();
+    errno = res;
+    return -1;
+}
+
+void
+conntrack_nl_close(void)
+{
+    conntrack_nl_entry_t   *e, *next;
+    int                     i;
+
+    if(ct_sock >= 0)
+        close(ct_sock);
+    ct_sock = -1;
+
+    for(i=0; i < CONNTRACK_NL_HASH_SIZE; i++)
+    {
+        for(e = ct_tbl[i]; e != NULL; e = next)
+        {
+            next = e->next;
+            free(e);
+        }
+        ct_tbl[i] = NULL;
+    }
+    return;
+}
+
+/* The event socket, for callers that wait on it.
+*/
+int
+conntrack_nl_fd(void)
+{
+    return ct_sock;
+}
+
+/* Rebuild the table from fresh dumps, as after lost events.  Events
+ * don't carry counters until the connection is destroyed, so this is
+ * how the counters of open connections are brought up to date.
+*/
+int
+conntrack_nl_refresh(void)
+{
+    if(ct_sock < 0)
+        return -1;
+
+    return resync();
+}
+
+/* Apply the events queued since the last call, reading at most budget
+ * buffers of them (0 for no limit).  Returns 1 if events are left over.
+ * If the kernel dropped events because the socket buffer filled up, the
+ * table is rebuilt from a fresh dump.
+*/
+int
+conntrack_nl_poll(const int budget)
+{
+    struct nlmsghdr    *nlh;
+    time_t              now = time(NULL);
+    int                 len, reads = 0;
+
+    if(ct_sock < 0)
+        return -1;
+
+    while(1)
+    {
+        if(budget > 0 && reads++ >= budget)
+            return 1;
+
+        if((len = recv(ct_sock, ct_buf, sizeof(ct_buf), MSG_DONTWAIT)) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if(errno == ENOBUFS && resync() == 0)
+                continue;
+            return -1;
+        }
+
+        for(nlh = (struct nlmsghdr *)ct_buf; NLMSG_OK(nlh, (unsigned int)len);
+                nlh = NLMSG_NEXT(nlh, len))
+            handle_msg(nlh, now, NULL);
+    }
+}
+
+static struct nlattr *
+put_attr(char *buf, int *off, const uint16_t type, const void *data,
+        const int len)
+{
+    struct nlattr  *nla = (struct nlattr *)(buf + *off);
+
+    nla->nla_type = type;
+    nla->nla_len  = NLA_HDRLEN + len;
+    if(len > 0)
+        memcpy((char *)nla + NLA_HDRLEN, data, len);
+    memset((char *)nla + nla->nla_len, 0x0,
+        NLA_ALIGN(nla->nla_len) - nla->nla_len);
+
+    *off += NLA_ALIGN(nla->nla_len);
+    return nla;
+}
+
+static void
+nest_end(char *buf, const int off, struct nlattr *nest)
+{
+    nest->nla_len = buf + off - (char *)nest;
+    return;
+}
+
+/* Append an IPCTNL_MSG_CT_DELETE for the flow's original tuple.
+*/
+static void
+put_delete(char *buf, int *off, const conntrack_nl_flow_t * const flow,
+        const uint32_t seq)
+{
+    struct nlmsghdr    *nlh = (struct nlmsghdr *)(buf + *off);
+    struct nfgenmsg    *nfg;
+    struct nlattr      *tuple, *nest;
+    uint16_t            port;
+    int                 start = *off;
+
+    memset(nlh, 0x0, NLMSG_LENGTH(sizeof(struct nfgenmsg)));
+    nlh->nlmsg_type  = (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_DELETE;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    nlh->nlmsg_seq   = seq;
+
+    nfg = NLMSG_DATA(nlh);
+    nfg->nfgen_family = AF_INET;
+    nfg->version      = NFNETLINK_V0;
+
+    *off += NLMSG_LENGTH(sizeof(struct nfgenmsg));
+
+    tuple = put_attr(buf, off, CTA_TUPLE_ORIG | NLA_F_NESTED, NULL, 0);
+
+    nest = put_attr(buf, off, CTA_TUPLE_IP | NLA_F_NESTED, NULL, 0);
+    put_attr(buf, off, CTA_IP_V4_SRC, &flow->src, sizeof(flow->src));
+    put_attr(buf, off, CTA_IP_V4_DST, &flow->dst, sizeof(flow->dst));
+    nest_end(buf, *off, nest);
+
+    nest = put_attr(buf, off, CTA_TUPLE_PROTO | NLA_F_NESTED, NULL, 0);
+    put_attr(buf, off, CTA_PROTO_NUM, &flow->proto, sizeof(flow->proto));
+    port = htons(flow->sport);
+    put_attr(buf, off, CTA_PROTO_SRC_PORT, &port, sizeof(port));
+    port = htons(flow->dport);
+    put_attr(buf, off, CTA_PROTO_DST_PORT, &port, sizeof(port));
+    nest_end(buf, *off, nest);
+
+    nest_end(buf, *off, tuple);
+
+    nlh->nlmsg_len = *off - start;
+    return;
+}
+
+/* Delete flows, up to CONNTRACK_NL_DEL_BATCH of them with each send(),
+ * and set err in each to 0 or the errno the kernel returned for it -
+ * ENOENT when the flow was already gone.  Returns -1 if some flows got
+ * no answer; their err is left at ETIMEDOUT.
+*/
+int
+conntrack_nl_delete(conntrack_nl_flow_t *flows, const int num_flows)
+{
+    struct nlmsghdr    *rh;
+    struct nlmsgerr    *err;
+    uint32_t            seq0;
+    int                 sock, first, i = 0, off, len, pending, res = 0;
+
+    for(first=0; first < num_flows; first++)
+        flows[first].err = ETIMEDOUT;
+
+    if((sock = req_socket()) < 0)
+        return -1;
+
+    while(i < num_flows)
+    {
+        first = i;
+        seq0  = ct_seq + 1;
+        off   = 0;
+
+        for(; i < num_flows && i - first < CONNTRACK_NL_DEL_BATCH; i++)
+            put_delete(ct_buf, &off, &flows[i], ++ct_seq);
+
+        if(send(sock, ct_buf, off, 0) < 0)
+        {
+            res = -1;
+            break;
+        }
+
+        for(pending = i - first; pending > 0; )
+        {
+            if((len = recv(sock, ct_buf, sizeof(ct_buf), 0)) < 0)
+            {
+                if(errno == EINTR)
+                    continue;
+                break;
+            }
+
+            for(rh = (struct nlmsghdr *)ct_buf; NLMSG_OK(rh, (unsigned int)len);
+                    rh = NLMSG_NEXT(rh, len))
+            {
+                if(rh->nlmsg_type != NLMSG_ERROR
+                        || rh->nlmsg_seq - seq0 >= (uint32_t)(i - first))
+                    continue;
+
+                err = NLMSG_DATA(rh);
+                flows[first + rh->nlmsg_seq - seq0].err = -err->error;
+                pending--;
+            }
+        }
+
+        if(pending > 0)
+        {
+            res = -1;
+            break;
+        }
+    }
+
+    close(sock);
+    return res;
+}
+
+struct flow_vec
+{
+    conntrack_nl_flow_t    *flows;
+    int                     num;
+    int                     size;
+    int                     nomem;
+};
+
+static uint32_t
+collect_flow(const struct nlmsghdr *nlh, const time_t now, void *arg)
+{
+    struct flow_vec        *v = (struct flow_vec *)arg;
+    const struct nfgenmsg  *nfg = NLMSG_DATA(nlh);
+    const struct nlattr    *tb[CTA_MAX+1];
+    conntrack_nl_flow_t    *f;
+
+    if(nlh->nlmsg_len < NLMSG_LENGTH(sizeof(struct nfgenmsg)))
+        return 0;
+
+    parse_attrs((const struct nlattr *)((const char *)nfg
+            + NLMSG_ALIGN(sizeof(struct nfgenmsg))),
+        nlh->nlmsg_len - NLMSG_LENGTH(sizeof(struct nfgenmsg)), tb, CTA_MAX);
+
+    if(tb[CTA_MARK] == NULL)
+        return 0;
+
+    if(v->num == v->size)
+    {
+        if((f = realloc(v->flows, (v->size ? v->size * 2 : 64) * sizeof(*f))) == NULL)
+        {
+            v->nomem = 1;
+            return get_be32(tb[CTA_MARK]);
+        }
+        v->flows = f;
+        v->size  = v->size ? v->size * 2 : 64;
+    }
+
+    f = &v->flows[v->num];
+    memset(f, 0x0, sizeof(*f));
+    f->mark = get_be32(tb[CTA_MARK]);
+
+    if(parse_tuple(tb[CTA_TUPLE_ORIG], &f->src, &f->dst, &f->proto,
+                &f->sport, &f->dport) == 0)
+        v->num++;
+
+    return f->mark;
+}
+
+/* Delete every flow carrying exactly this mark.  The flows are listed
+ * with a mark-filtered dump and deleted by tuple in batches, which is
+ * safe on kernels that would treat a mark-filtered flush as a flush of
+ * the whole table.  The flows and their results are returned in
+ * *flows_r, which the caller frees.
+*/
+int
+conntrack_nl_delete_mark(const uint32_t mark, conntrack_nl_flow_t **flows_r,
+        int *num_flows_r)
+{
+    struct flow_vec     v;
+    int                 i, j, res;
+
+    memset(&v, 0x0, sizeof(v));
+
+    if((res = dump_table(mark, 0xffffffff, collect_flow, &v)) < 0 || v.nomem)
+    {
+        free(v.flows);
+        if(v.nomem)
+            errno = ENOMEM;
+        return -1;
+    }
+
+    /* Without kernel filtering the dump held every flow.
+    */
+    if(res > 0)
+    {
+        for(i=0, j=0; i < v.num; i++)
+            if(v.flows[i].mark == mark)
+                v.flows[j++] = v.flows[i];
+        v.num = j;
+    }
+
+    res = conntrack_nl_delete(v.flows, v.num);
+
+    *flows_r     = v.flows;
+    *num_flows_r = v.num;
+    return res;
+}
+
+/* Visit every entry.  Closed entries are dropped once they have all been
+ * visited; if cb returns nonzero the walk stops and they are kept for
+ * the next one.
+*/
+int
+conntrack_nl_walk(int (*cb)(const conntrack_nl_entry_t *e, void *arg),
+        void *arg)
+{
+    conntrack_nl_entry_t  **pp, *e;
+    int                     i, res;
+
+    for(i=0; i < CONNTRACK_NL_HASH_SIZE; i++)
+        for(e = ct_tbl[i]; e != NULL; e = e->next)
+            if((res = cb(e, arg)) != 0)
+                return res;
+
+    for(i=0; i < CONNTRACK_NL_HASH_SIZE; i++)
+    {
+        pp = &ct_tbl[i];
+        while((e = *pp) != NULL)
+        {
+            if(e->closed)
+            {
+                *pp = e->next;
+                free(e);
+            }
+            else
+                pp = &e->next;
+        }
+    }
+    return 0;
+}
+
+#endif /* FIREWALL_IPTABLES || FIREWALL_FIREWALLD */
+
+/***EOF***/
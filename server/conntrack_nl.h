@@ -0,0 +1,103 @@
+/*
+ *****************************************************************************
+ *
+ * File:    conntrack_nl.h
+ *
+ * Purpose: Header file for conntrack_nl.c - a conntrack event listener.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef CONNTRACK_NL_H
+#define CONNTRACK_NL_H
+
+#include <inttypes.h>
+#include <time.h>
+
+#define CONNTRACK_NL_BUFSIZE    65536
+#define CONNTRACK_NL_RCVBUF     (4*1024*1024)   /* event socket buffer */
+#define CONNTRACK_NL_TIMEOUT    2               /* seconds to wait for a dump reply */
+#define CONNTRACK_NL_HASH_SIZE  4096            /* power of two */
+#define CONNTRACK_NL_DEL_BATCH  128             /* deletes per send() */
+#define CONNTRACK_NL_POLL_BUDGET 64             /* event reads per poll */
+
+#define CONNTRACK_NL_DIR_ORIG   0
+#define CONNTRACK_NL_DIR_REPLY  1
+
+/* One marked connection.  Addresses are in network byte order, ports
+ * in host byte order.  The reply source is where the connection was
+ * actually delivered, which differs from the original destination
+ * when NAT is in use.  Counters are indexed by CONNTRACK_NL_DIR_* and
+ * stay zero unless conntrack accounting is on; the kernel only sends
+ * them in dumps and destroy events.
+*/
+typedef struct conntrack_nl_entry
+{
+    uint32_t    id;
+    uint32_t    mark;
+    uint8_t     proto;
+    uint32_t    src;
+    uint32_t    dst;
+    uint16_t    sport;
+    uint16_t    dport;
+    uint32_t    reply_src;
+    uint16_t    reply_sport;
+    int         closed;         /* destroyed or in TIME_WAIT */
+    int         destroyed;
+    uint64_t    packets[2];
+    uint64_t    bytes[2];
+    time_t      first_seen;
+    uint32_t    gen;
+    struct conntrack_nl_entry *next;
+} conntrack_nl_entry_t;
+
+/* A flow to delete, by its original tuple, and the result of deleting
+ * it.
+*/
+typedef struct conntrack_nl_flow
+{
+    uint32_t    src;
+    uint32_t    dst;
+    uint16_t    sport;
+    uint16_t    dport;
+    uint8_t     proto;
+    uint32_t    mark;
+    int         err;
+} conntrack_nl_flow_t;
+
+/* Prototypes
+*/
+int conntrack_nl_open(void);
+void conntrack_nl_close(void);
+int conntrack_nl_fd(void);
+int conntrack_nl_poll(const int budget);
+int conntrack_nl_refresh(void);
+int conntrack_nl_walk(int (*cb)(const conntrack_nl_entry_t *e, void *arg),
+        void *arg);
+int conntrack_nl_delete(conntrack_nl_flow_t *flows, const int num_flows);
+int conntrack_nl_delete_mark(const uint32_t mark, conntrack_nl_flow_t **flows_r,
+        int *num_flows_r);
+
+#endif /* CONNTRACK_NL_H */
+
+/***EOF***/
@@ -0,0 +1,548 @@
+/*
+ *****************************************************************************
+ *
+ * File:    conntrack_thread.c
+ *
+ * Purpose: Connection tracking runs on its own thread, driven by its own
+ *          event loop: conntrack netlink events as they arrive (bounded
+ *          per wakeup), and a tick that updates the known connections
+ *          and decides when to report them.  A slow conntrack dump or a
+ *          large validation pass therefore never holds up the SDP control
+ *          client.
+ *
+ *          Nothing of the tracker's state is shared.  Other threads talk
+ *          to it through a lock-free request queue, and its reports go
+ *          out through a second queue that the control client thread
+ *          drains, so only that thread ever writes to the controller.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "fwknopd_errors.h"
+#include "log_msg.h"
+#include "sdp_ctrl_client.h"
+#include "connection_tracker.h"
+#include "conntrack_thread.h"
+#include "acc_expire.h"
+#include "event_loop.h"
+#include "cpu_affinity.h"
+#include <fcntl.h>
+#include <signal.h>
+
+/* A queued request or report
+*/
+typedef struct ct_msg
+{
+    ct_req_type_t   type;
+    uint32_t        arg;
+    const char     *action;
+    json_object    *jdata;
+} ct_msg_t;
+
+/* Bounded queue for many producers and one consumer.  Each slot carries
+ * a sequence number that says whether it is free for the producer at
+ * that position or filled for the consumer, so producers only contend on
+ * the tail index and never wait on the consumer.  The pipe wakes the
+ * consumer.
+*/
+typedef struct ct_slot
+{
+    volatile unsigned int   seq;
+    ct_msg_t                msg;
+} ct_slot_t;
+
+typedef struct ct_queue
+{
+    ct_slot_t              *slots;
+    unsigned int            mask;
+    volatile unsigned int   tail;
+    unsigned int            head;
+    int                     wake_fd[2];
+} ct_queue_t;
+
+typedef struct ct_thread_state
+{
+    fko_srv_options_t  *opts;
+    pthread_t           thread;
+    ct_queue_t          requests;
+    ct_queue_t          reports;
+    volatile int        stop;
+    int                 validate;
+    int                 report_open;
+    int                 tick_due;
+} ct_thread_state_t;
+
+static ct_thread_state_t    ct;
+static volatile int         ct_thread_active = 0;
+
+static int
+ct_queue_init(ct_queue_t *q, const unsigned int len)
+{
+    unsigned int    i;
+    int             j;
+
+    memset(q, 0x0, sizeof(*q));
+    q->wake_fd[0] = q->wake_fd[1] = -1;
+
+    if((q->slots = calloc(len, sizeof(ct_slot_t))) == NULL)
+        return -1;
+
+    for(i=0; i < len; i++)
+        q->slots[i].seq = i;
+    q->mask = len - 1;
+
+    if(pipe(q->wake_fd) != 0)
+    {
+        free(q->slots);
+        q->slots = NULL;
+        return -1;
+    }
+
+    for(j=0; j < 2; j++)
+    {
+        fcntl(q->wake_fd[j], F_SETFL, fcntl(q->wake_fd[j], F_GETFL) | O_NONBLOCK);
+        fcntl(q->wake_fd[j], F_SETFD, FD_CLOEXEC);
+    }
+
+    return 0;
+}
+
+static int
+ct_queue_push(ct_queue_t *q, const ct_msg_t *msg)
+{
+    ct_slot_t      *slot;
+    unsigned int    pos, seq;
+    int             dif;
+    char            c = 0;
+
+    if(q->slots == NULL)
+        return -1;
+
+    pos = q->tail;
+    while(1)
+    {
+        slot = &(q->slots[pos & q->mask]);
+        seq  = slot->seq;
+        __sync_synchronize();
+        dif  = (int)(seq - pos);
+
+        if(dif == 0)
+        {
+            if(__sync_bool_compare_and_swap(&(q->tail), pos, pos + 1))
+                break;
+        }
+        else if(dif < 0)
+            return -1;
+
+        pos = q->tail;
+    }
+
+    slot->msg = *msg;
+    __sync_synchronize();
+    slot->seq = pos + 1;
+
+    /* A full pipe already means a wakeup is pending
+    */
+    if(write(q->wake_fd[1], &c, 1) < 0 && errno != EAGAIN)
+        log_msg(LOG_ERR, "ct_queue_push() failed to wake consumer: %s", strerror(errno));
+
+    return 0;
+}
+
+/* Consumer side, returns 1 with the next message or 0 if there is none.
+*/
+static int
+ct_queue_pop(ct_queue_t *q, ct_msg_t *msg)
+{
+    ct_slot_t      *slot = &(q->slots[q->head & q->mask]);
+    unsigned int    seq = slot->seq;
+
+    __sync_synchronize();
+    if((int)(seq - (q->head + 1)) < 0)
+        return 0;
+
+    *msg = slot->msg;
+    __sync_synchronize();
+    slot->seq = q->head + q->mask + 1;
+    q->head++;
+
+    return 1;
+}
+
+static void
+ct_queue_drain_wake(ct_queue_t *q)
+{
+    char    buf[64];
+
+    while(read(q->wake_fd[0], buf, sizeof(buf)) > 0)
+        ;
+    return;
+}
+
+static void
+ct_queue_free(ct_queue_t *q)
+{
+    ct_msg_t    msg;
+    int         j;
+
+    if(q->slots != NULL)
+    {
+        while(ct_queue_pop(q, &msg))
+            if(msg.jdata != NULL)
+                json_object_put(msg.jdata);
+        free(q->slots);
+        q->slots = NULL;
+    }
+
+    for(j=0; j < 2; j++)
+    {
+        if(q->wake_fd[j] >= 0)
+            close(q->wake_fd[j]);
+        q->wake_fd[j] = -1;
+    }
+    return;
+}
+
+static int
+ct_wake_handler(int fd, void *arg)
+{
+    ct_queue_drain_wake(&(ct.requests));
+    return EVENT_LOOP_CONTINUE;
+}
+
+static int
+ct_tick_handler(int fd, void *arg)
+{
+    ct.tick_due = 1;
+    return EVENT_LOOP_CONTINUE;
+}
+
+/* The socket stays readable while events are left over, so the next
+ * pass through the loop picks them up after the other work is done.
+*/
+static int
+ct_events_handler(int fd, void *arg)
+{
+    connection_tracker_poll_events();
+    return EVENT_LOOP_CONTINUE;
+}
+
+/* Take in whatever requests are queued.  Repeated validations and
+ * reconnect reports collapse into one of each for this pass.
+*/
+static void
+ct_take_requests(void)
+{
+    ct_msg_t    msg;
+
+    while(ct_queue_pop(&(ct.requests), &msg))
+    {
+        switch(msg.type)
+        {
+            case CT_REQ_VALIDATE:
+                ct.validate = 1;
+                break;
+
+            case CT_REQ_REPORT_OPEN:
+                ct.report_open = 1;
+                break;
+
+            case CT_REQ_SNAPSHOT:
+                request_conn_snapshot();
+                break;
+
+            case CT_REQ_ACK:
+                conn_report_ack(msg.arg);
+                break;
+        }
+    }
+    return;
+}
+
+/* One pass of tracker work.  Returns a fwknopd error code if tracking
+ * cannot go on.
+*/
+static int
+ct_do_work(void)
+{
+    int     rv = FWKNOPD_SUCCESS;
+
+    ct_take_requests();
+
+    // close the connections of any stanzas that just expired
+    if(acc_expire_revoke_pending())
+        ct.validate = 1;
+
+    if(ct.validate)
+    {
+        ct.validate = 0;
+        if((rv = validate_connections(ct.opts)) != FWKNOPD_SUCCESS)
+            return rv;
+    }
+
+    if(ct.report_open)
+    {
+        ct.report_open = 0;
+        if((rv = report_open_connections(ct.opts)) != FWKNOPD_SUCCESS)
+            return rv;
+    }
+
+    if(ct.tick_due)
+    {
+        ct.tick_due = 0;
+        if((rv = update_connections(ct.opts)) != FWKNOPD_SUCCESS)
+            return rv;
+
+        if((rv = consider_reporting_connections(ct.opts)) != FWKNOPD_SUCCESS)
+            return rv;
+    }
+
+    return rv;
+}
+
+static void *
+conntrack_thread_func(void *arg)
+{
+    event_loop_t   *loop = NULL;
+    int             events_fd = -1;
+
+    cpu_affinity_set(CPU_ROLE_HOUSEKEEPING);
+
+    if(init_connection_tracker(ct.opts) != FWKNOPD_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Failed to initialize connection tracking.");
+        kill(getpid(), SIGTERM);
+        return NULL;
+    }
+
+    if((loop = event_loop_new()) == NULL
+            || event_loop_add_fd(loop, ct.requests.wake_fd[0], ct_wake_handler, NULL) != 0
+            || event_loop_add_timer(loop, CT_THREAD_TICK_MS, ct_tick_handler, NULL) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Failed to create connection tracking event loop.");
+        goto fail;
+    }
+
+    if((events_fd = connection_tracker_event_fd()) >= 0
+            && event_loop_add_fd(loop, events_fd, ct_events_handler, NULL) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Failed to watch conntrack events.");
+        goto fail;
+    }
+
+    // connections that were open before we started
+    ct.tick_due = 1;
+
+    while(! ct.stop)
+    {
+        if(event_loop_run_once(loop, CT_THREAD_TICK_MS) < 0)
+            goto fail;
+
+        if(ct.stop)
+            break;
+
+        if(ct_do_work() != FWKNOPD_SUCCESS)
+            goto fail;
+
+        // netlink failed, updates now run the conntrack command
+        if(events_fd >= 0 && connection_tracker_event_fd() < 0)
+        {
+            event_loop_del_fd(loop, events_fd);
+            events_fd = -1;
+        }
+    }
+
+    event_loop_destroy(loop);
+    destroy_connection_tracker(ct.opts);
+    return NULL;
+
+fail:
+    if(loop != NULL)
+        event_loop_destroy(loop);
+    destroy_connection_tracker(ct.opts);
+
+    // send kill signal for main thread to catch and exit safely
+    kill(getpid(), SIGTERM);
+    return NULL;
+}
+
+/* Start connection tracking on its own thread.  Returns 0 on success
+ * and -1 on error.
+*/
+int
+conntrack_thread_start(fko_srv_options_t *opts)
+{
+    if(ct_thread_active)
+        return 0;
+
+    memset(&ct, 0x0, sizeof(ct));
+    ct.opts = opts;
+
+    if(ct_queue_init(&(ct.requests), CT_THREAD_REQ_QUEUE_LEN) != 0
+            || ct_queue_init(&(ct.reports), CT_THREAD_REPORT_QUEUE_LEN) != 0)
+    {
+        log_msg(LOG_ERR, "conntrack_thread_start: failed to set up queues");
+        ct_queue_free(&(ct.requests));
+        ct_queue_free(&(ct.reports));
+        return -1;
+    }
+
+    if(pthread_create(&(ct.thread), NULL, conntrack_thread_func, NULL) != 0)
+    {
+        log_msg(LOG_ERR, "conntrack_thread_start: failed to start thread");
+        ct_queue_free(&(ct.requests));
+        ct_queue_free(&(ct.reports));
+        return -1;
+    }
+
+    ct_thread_active = 1;
+
+    log_msg(LOG_INFO, "Started connection tracking thread.");
+
+    return 0;
+}
+
+/* Stop the thread and drop anything still queued either way.
+*/
+void
+conntrack_thread_stop(void)
+{
+    char    c = 0;
+
+    if(! ct_thread_active)
+        return;
+
+    ct_thread_active = 0;
+    ct.stop = 1;
+
+    if(write(ct.requests.wake_fd[1], &c, 1) < 0 && errno != EAGAIN)
+        log_msg(LOG_ERR, "conntrack_thread_stop() failed to wake thread: %s", strerror(errno));
+
+    /* clean_exit() may be called from the tracker, which must not wait
+     * on itself.
+    */
+    if(! pthread_equal(ct.thread, pthread_self()))
+        pthread_join(ct.thread, NULL);
+
+    ct_queue_free(&(ct.requests));
+    ct_queue_free(&(ct.reports));
+    return;
+}
+
+/* Queue a request for the tracker, from any thread.  Returns 0 on
+ * success and -1 if the queue was full or the tracker is not running.
+*/
+int
+conntrack_thread_request(const ct_req_type_t type, const uint32_t arg)
+{
+    ct_msg_t    msg;
+
+    if(! ct_thread_active)
+        return -1;
+
+    memset(&msg, 0x0, sizeof(msg));
+    msg.type = type;
+    msg.arg  = arg;
+
+    if(ct_queue_push(&(ct.requests), &msg) != 0)
+    {
+        log_msg(LOG_WARNING, "Connection tracking request queue is full, dropping request");
+        return -1;
+    }
+    return 0;
+}
+
+/* Queue a report for the control client to send, from the tracker.  The
+ * queue takes its own reference to jdata.
+*/
+int
+conntrack_thread_post_report(const char *action, json_object *jdata)
+{
+    ct_msg_t    msg;
+
+    memset(&msg, 0x0, sizeof(msg));
+    msg.action = action;
+    msg.jdata  = json_object_get(jdata);
+
+    if(ct_queue_push(&(ct.reports), &msg) != 0)
+    {
+        log_msg(LOG_WARNING, "Connection report queue is full, dropping report");
+        json_object_put(msg.jdata);
+        return FWKNOPD_ERROR_CONNTRACK;
+    }
+    return FWKNOPD_SUCCESS;
+}
+
+/* Readable when reports are waiting, for the control client's event loop.
+*/
+int
+conntrack_thread_report_fd(void)
+{
+    return ct_thread_active ? ct.reports.wake_fd[0] : -1;
+}
+
+/* Send the queued reports to the controller, from the control client
+ * thread.  Reports that fail to send are dropped and the tracker is asked
+ * for a snapshot.  Only a memory error is returned.
+*/
+int
+conntrack_thread_send_reports(fko_srv_options_t *opts)
+{
+    ct_msg_t    msg;
+    int         rv = SDP_SUCCESS;
+    int         failed = 0;
+
+    if(! ct_thread_active)
+        return SDP_SUCCESS;
+
+    ct_queue_drain_wake(&(ct.reports));
+
+    while(ct_queue_pop(&(ct.reports), &msg))
+    {
+        if(! failed)
+        {
+            rv = sdp_ctrl_client_send_message(opts->ctrl_client, (char*)msg.action, msg.jdata);
+            if(rv != SDP_SUCCESS)
+                failed = 1;
+        }
+        json_object_put(msg.jdata);
+
+        if(rv == SDP_ERROR_MEMORY_ALLOCATION)
+        {
+            log_msg(LOG_ERR, "conntrack_thread_send_reports() experienced a fatal memory error.");
+            return rv;
+        }
+    }
+
+    if(failed)
+    {
+        log_msg(LOG_ERR, "conntrack_thread_send_reports() failed to send a report. "
+                "Dropping the queued reports.");
+        conntrack_thread_request(CT_REQ_SNAPSHOT, 0);
+    }
+
+    return SDP_SUCCESS;
+}
+
+/***EOF***/
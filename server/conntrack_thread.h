@@ -0,0 +1,69 @@
+/*
+ *****************************************************************************
+ *
+ * File:    conntrack_thread.h
+ *
+ * Purpose: Header file for conntrack_thread.c - the thread that runs
+ *          connection tracking apart from the SDP control client.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef CONNTRACK_THREAD_H
+#define CONNTRACK_THREAD_H
+
+#include <inttypes.h>
+#include <json-c/json.h>
+
+/* Queue lengths (powers of two).  A request that finds its queue full is
+ * dropped; a report that does is treated like a failed send, so the next
+ * delta report goes out as a snapshot.
+*/
+#define CT_THREAD_REQ_QUEUE_LEN     1024
+#define CT_THREAD_REPORT_QUEUE_LEN  256
+
+/* How often connections are updated and reports considered.
+*/
+#define CT_THREAD_TICK_MS           1000
+
+/* Requests to the tracker from other threads
+*/
+typedef enum {
+    CT_REQ_VALIDATE,        /* access data changed, check open connections */
+    CT_REQ_REPORT_OPEN,     /* controller reconnected, resend open connections */
+    CT_REQ_SNAPSHOT,        /* controller asked for a connection snapshot */
+    CT_REQ_ACK              /* controller acked connection deltas up to arg */
+} ct_req_type_t;
+
+/* Prototypes
+*/
+int conntrack_thread_start(fko_srv_options_t *opts);
+void conntrack_thread_stop(void);
+int conntrack_thread_request(const ct_req_type_t type, const uint32_t arg);
+int conntrack_thread_post_report(const char *action, json_object *jdata);
+int conntrack_thread_report_fd(void);
+int conntrack_thread_send_reports(fko_srv_options_t *opts);
+
+#endif /* CONNTRACK_THREAD_H */
+
+/***EOF***/
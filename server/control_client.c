@@ -11,10 +11,158 @@
 #include "fwknopd_errors.h"
 #include "service.h"
 #include "access.h"
+#include "acc_snapshot.h"
+#include "acc_lazy.h"
 #include "log_msg.h"
 #include "connection_tracker.h"
+#include "conntrack_thread.h"
 #include "sdp_ctrl_client.h"
 #include "control_client.h"
+#include "event_loop.h"
+#include "fw_util.h"
+#include "spa_arena.h"
+#include "rcu.h"
+#include "cluster.h"
+#include "cpu_affinity.h"
+
+#include <fcntl.h>
+#include <errno.h>
+
+// Fill in one grant from a grant snapshot entry of the form
+//   {"sdp_id": N, "source_ip": "a.b.c.d", "destination_ip": "a.b.c.d",
+//    "service_id": N, "expires": <epoch seconds>}
+// destination_ip is optional.  The grant is only usable if it has not
+// expired and this gateway's own access data still allows it, so a stale
+// snapshot can never open more than a fresh SPA packet would.  Must be
+// called inside an RCU read-side section.
+static int parse_grant(fko_srv_options_t *opts, json_object *jentry, time_t now,
+        spa_arena_t *arena, fw_grant_t *grant)
+{
+    json_object *jobj = NULL;
+    acc_stanza_t *acc = NULL;
+    acc_stanza_exp_t *exp = NULL;
+    int sdp_id = 0, service_id = 0;
+    int64_t expires = 0;
+
+    memset(grant, 0x0, sizeof(*grant));
+
+    if(json_object_get_type(jentry) != json_type_object
+            || sdp_get_json_int_field("sdp_id", jentry, &sdp_id) != SDP_SUCCESS
+            || sdp_get_json_int_field("service_id", jentry, &service_id) != SDP_SUCCESS
+            || !json_object_object_get_ex(jentry, "expires", &jobj)
+            || json_object_get_type(jobj) != json_type_int)
+    {
+        log_msg(LOG_WARNING, "Grant snapshot entry is missing required fields, skipping");
+        return 0;
+    }
+
+    if((expires = json_object_get_int64(jobj)) <= now
+            || !cluster_sdp_id_local(opts, (uint32_t)sdp_id))
+        return 0;
+
+    if(!json_object_object_get_ex(jentry, "source_ip", &jobj)
+            || json_object_get_type(jobj) != json_type_string
+            || !is_valid_ipv4_addr(json_object_get_string(jobj)))
+    {
+        log_msg(LOG_WARNING, "Grant snapshot entry for SDP ID %d has no valid source_ip, skipping",
+                sdp_id);
+        return 0;
+    }
+    strlcpy(grant->src_ip, json_object_get_string(jobj), sizeof(grant->src_ip));
+
+    if(json_object_object_get_ex(jentry, "destination_ip", &jobj)
+            && json_object_get_type(jobj) == json_type_string
+            && is_valid_ipv4_addr(json_object_get_string(jobj)))
+        strlcpy(grant->dst_ip, json_object_get_string(jobj), sizeof(grant->dst_ip));
+    else
+        strlcpy(grant->dst_ip, "0.0.0.0", sizeof(grant->dst_ip));
+
+    if((acc = acc_sdp_id_lookup(opts, (uint32_t)sdp_id)) == NULL)
+    {
+        log_msg(LOG_WARNING, "Grant snapshot names SDP ID %d, which has no access here, skipping",
+                sdp_id);
+        return 0;
+    }
+
+    if((exp = acc_stanza_expand(acc)) == NULL
+            || !acc_service_set_test(exp->service_set, (uint32_t)service_id))
+    {
+        log_msg(LOG_WARNING, "Grant snapshot gives SDP ID %d service %d, which it may not access, skipping",
+                sdp_id, service_id);
+        return 0;
+    }
+
+    if(get_service_data(opts, arena, (uint32_t)service_id, &(grant->service)) != FWKNOPD_SUCCESS)
+        return 0;
+
+    grant->acc = acc;
+    grant->sdp_id = (uint32_t)sdp_id;
+    grant->timeout = (unsigned int)(expires - now);
+
+    return 1;
+}
+
+// Install the grants the controller currently holds for this gateway, so
+// that a restarted or newly added gateway is serving existing clients as
+// soon as it has its access data instead of waiting for each of them to
+// knock again.  Grants that have expired or that the access data no longer
+// allows are skipped.
+static int process_grant_snapshot(fko_srv_options_t *opts, json_object *jdata)
+{
+    int rv = FWKNOPD_SUCCESS;
+    int idx = 0, len = 0, num_grants = 0, failed = 0;
+    fw_grant_t *grants = NULL;
+    spa_arena_t *arena = NULL;
+    time_t now = time(NULL);
+
+    if((len = json_object_array_length(jdata)) == 0)
+        return FWKNOPD_SUCCESS;
+
+    if((grants = calloc(len, sizeof(fw_grant_t))) == NULL)
+        return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+
+    if((arena = spa_arena_get()) == NULL)
+    {
+        free(grants);
+        return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+    }
+
+    // the stanzas and service data the grants point to stay put until
+    // the grants are installed
+    rcu_read_lock();
+
+    for(idx = 0; idx < len; idx++)
+    {
+        if(parse_grant(opts, json_object_array_get_idx(jdata, idx), now,
+                    arena, &(grants[num_grants])))
+            num_grants++;
+    }
+
+    if(num_grants > 0)
+    {
+        if(pthread_mutex_lock(&(opts->spa_grant_mutex)))
+        {
+            log_msg(LOG_ERR, "Mutex lock error.");
+            rv = FWKNOPD_ERROR_MUTEX;
+        }
+        else
+        {
+            failed = fw_install_grants(opts, grants, num_grants);
+            pthread_mutex_unlock(&(opts->spa_grant_mutex));
+        }
+    }
+
+    rcu_read_unlock();
+
+    spa_arena_reset(arena);
+    free(grants);
+
+    if(rv == FWKNOPD_SUCCESS)
+        log_msg(LOG_INFO, "Installed %d of %d access grants from controller (%d failed)",
+                num_grants - failed, len, failed);
+
+    return rv;
+}
 
 static int process_data_msg(fko_srv_options_t *opts, int action, json_object *jdata)
 {
@@ -33,6 +181,7 @@ static int process_data_msg(fko_srv_options_t *opts, int action, json_object *jd
         {
             log_msg(LOG_ERR, "Failed to get access data from controller.");
             sdp_ctrl_client_send_data_error(opts->ctrl_client);
+            sdp_ctrl_client_data_resync(opts->ctrl_client, action);
         }
         else
         {
@@ -41,6 +190,7 @@ static int process_data_msg(fko_srv_options_t *opts, int action, json_object *jd
             else
                 log_msg(LOG_INFO, "Succeeded in modifying access data.");
             sdp_ctrl_client_send_data_ack(opts->ctrl_client, CTRL_ACTION_ACCESS_ACK);
+            acc_snapshot_save(opts);
         }
     }
     else if(
@@ -56,6 +206,7 @@ static int process_data_msg(fko_srv_options_t *opts, int action, json_object *jd
         {
             log_msg(LOG_ERR, "Failed to get service data from controller.");
             sdp_ctrl_client_send_data_error(opts->ctrl_client);
+            sdp_ctrl_client_data_resync(opts->ctrl_client, action);
         }
         else
         {
@@ -64,8 +215,19 @@ static int process_data_msg(fko_srv_options_t *opts, int action, json_object *jd
             else
                 log_msg(LOG_INFO, "Succeeded in modifying service data.");
             sdp_ctrl_client_send_data_ack(opts->ctrl_client, CTRL_ACTION_SERVICE_ACK);
+            acc_snapshot_save(opts);
         }
     }
+    else if(action == CTRL_ACTION_GRANT_SNAPSHOT)
+    {
+        if((rv = process_grant_snapshot(opts, jdata)) != FWKNOPD_SUCCESS)
+            log_msg(LOG_ERR, "Failed to install access grants from controller.");
+    }
+    else if(action == CTRL_ACTION_CLUSTER_UPDATE)
+    {
+        if((rv = cluster_update(opts, jdata)) != FWKNOPD_SUCCESS)
+            log_msg(LOG_ERR, "Failed to install cluster membership from controller.");
+    }
 
     return rv;
 }
@@ -109,6 +271,25 @@ static int handle_data_msg(fko_srv_options_t *opts, int action, json_object *jda
 }
 
 
+static void handle_conn_report_msg(fko_srv_options_t *opts, int action, json_object *jdata)
+{
+    uint32_t seq = 0;
+
+    if(strncmp(opts->config[CONF_DISABLE_CONNECTION_TRACKING], "N", 1) != 0
+            || strncasecmp(opts->config[CONF_CONN_REPORT_DELTAS], "Y", 1) != 0)
+    {
+        log_msg(LOG_WARNING, "Ignoring connection report message from controller, "
+                "connection deltas are not enabled");
+        return;
+    }
+
+    if(action == CTRL_ACTION_CONN_SNAPSHOT_REQUEST)
+        conntrack_thread_request(CT_REQ_SNAPSHOT, 0);
+    else if(jdata != NULL && conn_report_ack_seq(jdata, &seq) == FWKNOPD_SUCCESS)
+        conntrack_thread_request(CT_REQ_ACK, seq);
+}
+
+
 int get_management_data_from_controller(fko_srv_options_t *opts)
 {
     int rv = FWKNOPD_SUCCESS;
@@ -136,6 +317,11 @@ int get_management_data_from_controller(fko_srv_options_t *opts)
         return rv;
     }
 
+    // with a recent snapshot, serve SPA from it right away and let the
+    // control client thread catch up with the controller
+    if(acc_snapshot_load(opts) == FWKNOPD_SUCCESS)
+        return FWKNOPD_SUCCESS;
+
     while(1)
     {
         // connect if necessary
@@ -214,13 +400,86 @@ int get_management_data_from_controller(fko_srv_options_t *opts)
 
 
 
+/* The thread is stopped through a pipe its event loop watches, so it
+ * always leaves between messages rather than wherever it was cancelled.
+*/
+static int ctrl_wake_fd[2] = {-1, -1};
+static volatile int ctrl_stop = 0;
+
+// set by a SIGHUP reload, which wants fresh service and access data
+static int ctrl_refresh = 0;
+
+
+static int ctrl_readable_handler(int fd, void *arg)
+{
+    *(int*)arg = 1;
+    return EVENT_LOOP_CONTINUE;
+}
+
+
+// reports are sent once the controller is ready, this only clears the wakeup
+static int ctrl_reports_handler(int fd, void *arg)
+{
+    char buf[64];
+
+    while(read(fd, buf, sizeof(buf)) > 0)
+        ;
+    return EVENT_LOOP_CONTINUE;
+}
+
+
+static int ctrl_stop_handler(int fd, void *arg)
+{
+    char buf[64];
+
+    while(read(fd, buf, sizeof(buf)) > 0)
+        ;
+    return ctrl_stop ? EVENT_LOOP_STOP : EVENT_LOOP_CONTINUE;
+}
+
+
+// Watch the controller socket, for writability too while a connect or
+// handshake waits on it. The fd changes with every new connection.
+static int ctrl_watch_socket(event_loop_t *loop, sdp_com_t com, int *watched_fd, int *readable)
+{
+    int fd = (com->conn_state == SDP_COM_DISCONNECTED) ? -1 : com->socket_descriptor;
+
+    if(*watched_fd != fd)
+    {
+        if(*watched_fd >= 0)
+            event_loop_del_fd(loop, *watched_fd);
+
+        *watched_fd = fd;
+        if(fd < 0)
+            return FWKNOPD_SUCCESS;
+
+        // the first connection is made in blocking mode before this thread
+        // starts, reads here must never wait on the socket
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        if(event_loop_add_fd(loop, fd, ctrl_readable_handler, readable) != 0)
+            return FWKNOPD_ERROR_CTRL_COM;
+    }
+
+    if(fd >= 0 && event_loop_want_write(loop, fd,
+                com->conn_state == SDP_COM_CONNECTING && com->want_write) != 0)
+        return FWKNOPD_ERROR_CTRL_COM;
+
+    return FWKNOPD_SUCCESS;
+}
+
+
 void *control_client_thread_func(void *arg)
 {
     int rv = FWKNOPD_SUCCESS;
     int action = INVALID_CTRL_ACTION;
     int send_open_conn_report = 0;
+    int readable = 0;
+    int watched_fd = -1;
     json_object *jdata = NULL;
+    event_loop_t *loop = NULL;
     fko_srv_options_t *opts = (fko_srv_options_t*)arg;
+    sdp_com_t com = NULL;
 
     if(opts == NULL ||
        opts->ctrl_client == NULL ||
@@ -234,40 +493,99 @@ void *control_client_thread_func(void *arg)
         return NULL;
     }
 
-    // If connection tracking is enabled, initialize it
-    if(strncmp(opts->config[CONF_DISABLE_CONNECTION_TRACKING], "N", 1) == 0)
+    com = opts->ctrl_client->com;
+
+    // acks, keep-alives and reports made in one pass of the loop share
+    // TLS records, they are flushed below before the loop waits
+    com->coalesce = 1;
+
+    cpu_affinity_set(CPU_ROLE_HOUSEKEEPING);
+
+    // wait on the controller socket instead of sleeping so that
+    // controller messages are handled as soon as they arrive
+    if((loop = event_loop_new()) == NULL
+            || event_loop_add_fd(loop, ctrl_wake_fd[0], ctrl_stop_handler, NULL) != 0)
     {
-		if( (rv = init_connection_tracker(opts)) != FWKNOPD_SUCCESS)
-		{
-			log_msg(LOG_ERR,
-				"[*] Failed to initialize connection tracking."
-			);
-			// send kill signal for main thread to catch and exit safely
-			kill(getpid(), SIGTERM);
-			return NULL;
-		}
+        log_msg(LOG_ERR, "[*] Failed to create control client event loop.");
+        event_loop_destroy(loop);
+        kill(getpid(), SIGTERM);
+        return NULL;
     }
 
-    while(1)
+    // wake up for reports from the connection tracking thread
+    if(conntrack_thread_report_fd() >= 0
+            && event_loop_add_fd(loop, conntrack_thread_report_fd(), ctrl_reports_handler, NULL) != 0)
     {
-        // connect if necessary
-        if(sdp_ctrl_client_connection_status(opts->ctrl_client) == SDP_COM_DISCONNECTED)
+        log_msg(LOG_ERR, "[*] Failed to watch connection reports.");
+        event_loop_destroy(loop);
+        kill(getpid(), SIGTERM);
+        return NULL;
+    }
+
+    while(! ctrl_stop)
+    {
+        // connect if necessary, or carry on connecting, without waiting
+        if(com->conn_state != SDP_COM_CONNECTED)
         {
-            if((rv = sdp_ctrl_client_connect(opts->ctrl_client)) != SDP_SUCCESS)
-            {
+            if((rv = sdp_ctrl_client_connect_step(opts->ctrl_client)) != SDP_SUCCESS)
                 break;
-            }
 
             // after any loss of connection, the controller marks all of the
             // gateway's connections as closed, so we need to resend just
             // the open connections if there are any as soon as possible
-            send_open_conn_report = 1;
+            if(com->conn_state == SDP_COM_CONNECTED)
+                send_open_conn_report = 1;
         }
 
+        if((rv = ctrl_watch_socket(loop, com, &watched_fd, &readable)) != FWKNOPD_SUCCESS)
+            break;
+
+        // wait for controller data (or the next housekeeping tick), unless
+        // OpenSSL already has decrypted data buffered for us
+        readable = (com->conn_state == SDP_COM_CONNECTED && SSL_pending(com->ssl) > 0);
+        if(!readable)
+        {
+            // acknowledge everything applied so far in one go and write
+            // out whatever is queued before idling
+            if(com->conn_state == SDP_COM_CONNECTED
+                    && (sdp_ctrl_client_flush_acks(opts->ctrl_client) != SDP_SUCCESS
+                        || sdp_com_flush(com) != SDP_SUCCESS))
+            {
+                sdp_com_disconnect(com);
+                continue;
+            }
+
+            if((rv = event_loop_run_once(loop, CTRL_CLIENT_LOOP_WAIT_MS)) < 0)
+            {
+                rv = FWKNOPD_ERROR_CTRL_COM;
+                break;
+            }
+            rv = FWKNOPD_SUCCESS;
+        }
+
+        if(ctrl_stop)
+            break;
+
+        // a connect or handshake in progress is picked up at the top
+        if(com->conn_state != SDP_COM_CONNECTED)
+            continue;
+
         // check for incoming messages
-        if((rv = sdp_ctrl_client_check_inbox(opts->ctrl_client, &action, (void**)&jdata)) != SDP_SUCCESS)
+        action = INVALID_CTRL_ACTION;
+        if(readable &&
+           (rv = sdp_ctrl_client_check_inbox(opts->ctrl_client, &action, (void**)&jdata)) != SDP_SUCCESS)
             break;
 
+        // connection report acks and snapshot requests go to the tracker
+        if(action == CTRL_ACTION_CONN_ACK || action == CTRL_ACTION_CONN_SNAPSHOT_REQUEST)
+        {
+            handle_conn_report_msg(opts, action, jdata);
+
+            if(jdata != NULL && json_object_get_type(jdata) != json_type_null)
+                json_object_put(jdata);
+            jdata = NULL;
+        }
+
         // if data was returned, process it
         if(jdata != NULL)
         {
@@ -285,10 +603,7 @@ void *control_client_thread_func(void *arg)
                 break;
 
             if(strncmp(opts->config[CONF_DISABLE_CONNECTION_TRACKING], "N", 1) == 0)
-            {
-                if((rv = validate_connections(opts)) != FWKNOPD_SUCCESS)
-                    break;
-            }
+                conntrack_thread_request(CT_REQ_VALIDATE, 0);
         }
 
         // do not begin sending requests until controller is ready
@@ -302,10 +617,17 @@ void *control_client_thread_func(void *arg)
         {
             send_open_conn_report = 0;
 
-            if((rv = report_open_connections(opts)) != FWKNOPD_SUCCESS)
-            {
-                break;
-            }
+            if(strncmp(opts->config[CONF_DISABLE_CONNECTION_TRACKING], "N", 1) == 0)
+                conntrack_thread_request(CT_REQ_REPORT_OPEN, 0);
+        }
+
+        // a reload asked for the service and access data now, failing that
+        // the regular refresh below gets them eventually
+        if(__sync_lock_test_and_set(&ctrl_refresh, 0))
+        {
+            if(sdp_ctrl_client_request_service_refresh(opts->ctrl_client) != SDP_SUCCESS
+                    || sdp_ctrl_client_request_access_refresh(opts->ctrl_client) != SDP_SUCCESS)
+                log_msg(LOG_WARNING, "Failed to request a refresh from the controller after reload.");
         }
 
         // if new connection or just time, update credentials
@@ -324,23 +646,88 @@ void *control_client_thread_func(void *arg)
         if((rv = sdp_ctrl_client_consider_keep_alive(opts->ctrl_client)) != SDP_SUCCESS)
             break;
 
-        // If connection tracking is enabled
-        if(strncmp(opts->config[CONF_DISABLE_CONNECTION_TRACKING], "N", 1) == 0)
-        {
-            if((rv = update_connections(opts)) != FWKNOPD_SUCCESS)
-                break;
+        // send whatever the connection tracking thread has reported
+        if((rv = conntrack_thread_send_reports(opts)) != SDP_SUCCESS)
+            break;
+    }
 
-            if((rv = consider_reporting_connections(opts)) != FWKNOPD_SUCCESS)
-                break;
-        }
+    event_loop_destroy(loop);
 
-        sleep(1);
+    // unless asked to stop, send kill signal for main thread to catch
+    // and exit safely
+    if(! ctrl_stop)
+        kill(getpid(), SIGTERM);
+
+    return NULL;
+}
+
+
+int control_client_thread_start(fko_srv_options_t *opts)
+{
+    int j;
+
+    ctrl_stop = 0;
+
+    if(pipe(ctrl_wake_fd) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Failed to create control client wakeup pipe: %s",
+                strerror(errno));
+        return FWKNOPD_ERROR_CTRL_COM;
     }
 
-    // send kill signal for main thread to catch and exit safely
-    kill(getpid(), SIGTERM);
+    for(j=0; j < 2; j++)
+    {
+        fcntl(ctrl_wake_fd[j], F_SETFL, fcntl(ctrl_wake_fd[j], F_GETFL) | O_NONBLOCK);
+        fcntl(ctrl_wake_fd[j], F_SETFD, FD_CLOEXEC);
+    }
 
-    return NULL;
+    if(pthread_create(&(opts->ctrl_client_thread), NULL, control_client_thread_func, (void*)opts))
+    {
+        control_client_thread_stop(opts);
+        return FWKNOPD_ERROR_CTRL_COM;
+    }
+
+    return FWKNOPD_SUCCESS;
+}
+
+
+// Have the thread ask the controller for its service and access data,
+// as soon as it is connected and the controller is ready.
+void control_client_request_refresh(void)
+{
+    char c = 0;
+
+    __sync_lock_test_and_set(&ctrl_refresh, 1);
+
+    if(ctrl_wake_fd[1] >= 0 && write(ctrl_wake_fd[1], &c, 1) < 0 && errno != EAGAIN)
+        log_msg(LOG_ERR, "control_client_request_refresh() failed to wake thread: %s",
+                strerror(errno));
+}
+
+
+void control_client_thread_stop(fko_srv_options_t *opts)
+{
+    char c = 0;
+    int j;
+
+    ctrl_stop = 1;
+
+    if(opts->ctrl_client_thread > 0)
+    {
+        if(write(ctrl_wake_fd[1], &c, 1) < 0 && errno != EAGAIN)
+            log_msg(LOG_ERR, "control_client_thread_stop() failed to wake thread: %s",
+                    strerror(errno));
+
+        pthread_join(opts->ctrl_client_thread, NULL);
+        opts->ctrl_client_thread = 0;
+    }
+
+    for(j=0; j < 2; j++)
+    {
+        if(ctrl_wake_fd[j] >= 0)
+            close(ctrl_wake_fd[j]);
+        ctrl_wake_fd[j] = -1;
+    }
 }
 
 
@@ -8,7 +8,14 @@
 #ifndef SERVER_CONTROL_CLIENT_H_
 #define SERVER_CONTROL_CLIENT_H_
 
+// longest the control client thread waits for controller data before
+// running its periodic checks (milliseconds)
+#define CTRL_CLIENT_LOOP_WAIT_MS 1000
+
 int get_management_data_from_controller(fko_srv_options_t *opts);
 void *control_client_thread_func(void *arg);
+int control_client_thread_start(fko_srv_options_t *opts);
+void control_client_thread_stop(fko_srv_options_t *opts);
+void control_client_request_refresh(void);
 
 #endif /* SERVER_CONTROL_CLIENT_H_ */
@@ -0,0 +1,286 @@
+/*
+ *****************************************************************************
+ *
+ * File:    cpu_affinity.c
+ *
+ * Purpose: Pinning of the capture, SPA worker and housekeeping threads to
+ *          the sets of CPUs given by CAPTURE_CPUS, SPA_WORKER_CPUS and
+ *          HOUSEKEEPING_CPUS.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "cpu_affinity.h"
+#include "log_msg.h"
+#include "utils.h"
+
+#if HAVE_PTHREAD_SETAFFINITY_NP
+  #include <sched.h>
+  #include <ctype.h>
+
+/* The sets are only written by cpu_affinity_init(), which runs before the
+ * threads that read them are started.
+*/
+static cpu_set_t    aff_sets[CPU_ROLE_COUNT];
+static int          aff_have[CPU_ROLE_COUNT];
+
+/* The CPUs fwknopd was started on, which threads go back to when their
+ * role is no longer pinned after a reload.
+*/
+static cpu_set_t    aff_orig;
+static int          aff_orig_valid = 0;
+static int          aff_used = 0;
+
+static const char  *aff_role_names[CPU_ROLE_COUNT] = {
+    "CAPTURE_CPUS", "SPA_WORKER_CPUS", "HOUSEKEEPING_CPUS"
+};
+
+/* Parse a CPU list in the format of the kernel's cpulist files, for
+ * example "0-3,8,10-11".  Returns 0 on success and -1 on error.
+*/
+static int
+parse_cpu_list(const char *str, cpu_set_t *set)
+{
+    const char *p = str;
+    char       *end;
+    long        first, last, cpu;
+
+    CPU_ZERO(set);
+
+    while(*p != '\0')
+    {
+        while(isspace((unsigned char)*p))
+            p++;
+
+        if(! isdigit((unsigned char)*p))
+            return -1;
+
+        first = last = strtol(p, &end, 10);
+        p = end;
+
+        if(*p == '-')
+        {
+            p++;
+            if(! isdigit((unsigned char)*p))
+                return -1;
+            last = strtol(p, &end, 10);
+            p = end;
+        }
+
+        if(first > last || last >= CPU_SETSIZE)
+            return -1;
+
+        for(cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+
+        while(isspace((unsigned char)*p))
+            p++;
+
+        if(*p == ',')
+            p++;
+        else if(*p != '\0')
+            return -1;
+    }
+
+    return(CPU_COUNT(set) > 0 ? 0 : -1);
+}
+
+/* Read the CPUs of the NUMA node the capture interface's device is
+ * attached to.  Returns 0 on success and -1 if that is not known.
+*/
+static int
+intf_node_cpus(const char *intf, cpu_set_t *set)
+{
+    char        path[MAX_PATH_LEN];
+    char        buf[MAX_LINE_LEN];
+    FILE       *fp;
+    int         node = -1, rv = -1;
+
+    if(intf == NULL || strchr(intf, '/') != NULL)
+        return -1;
+
+    // the first one if PCAP_INTF lists several
+    snprintf(path, sizeof(path), "/sys/class/net/%.*s/device/numa_node",
+        (int)strcspn(intf, ", \t"), intf);
+    if((fp = fopen(path, "r")) == NULL)
+        return -1;
+    if(fgets(buf, sizeof(buf), fp) != NULL)
+        node = atoi(buf);
+    fclose(fp);
+
+    // -1 on single node machines and for virtual devices
+    if(node < 0)
+        return -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if((fp = fopen(path, "r")) == NULL)
+        return -1;
+    if(fgets(buf, sizeof(buf), fp) != NULL)
+    {
+        buf[strcspn(buf, "\n")] = '\0';
+        rv = parse_cpu_list(buf, set);
+    }
+    fclose(fp);
+
+    return rv;
+}
+
+/* Parse the CPU options.  SPA_WORKER_CPUS may be "auto" for the CPUs on
+ * the capture interface's NUMA node other than CAPTURE_CPUS, and if
+ * HOUSEKEEPING_CPUS is not set, the other threads are kept off the
+ * capture and worker CPUs.  Returns 0 on success and -1 on a bad value.
+*/
+int
+cpu_affinity_init(const fko_srv_options_t *opts)
+{
+    const char *vals[CPU_ROLE_COUNT];
+    cpu_set_t   tmp;
+    int         i;
+
+    vals[CPU_ROLE_CAPTURE]      = opts->config[CONF_CAPTURE_CPUS];
+    vals[CPU_ROLE_WORKER]       = opts->config[CONF_SPA_WORKER_CPUS];
+    vals[CPU_ROLE_HOUSEKEEPING] = opts->config[CONF_HOUSEKEEPING_CPUS];
+
+    if(! aff_orig_valid
+            && sched_getaffinity(0, sizeof(aff_orig), &aff_orig) == 0)
+        aff_orig_valid = 1;
+
+    memset(aff_have, 0x0, sizeof(aff_have));
+
+    for(i=0; i < CPU_ROLE_COUNT; i++)
+    {
+        if(vals[i] == NULL || vals[i][0] == '\0')
+            continue;
+
+        if(i == CPU_ROLE_WORKER && strcasecmp(vals[i], CPU_AFFINITY_AUTO) == 0)
+        {
+            if(intf_node_cpus(opts->config[CONF_PCAP_INTF], &(aff_sets[i])) != 0)
+            {
+                log_msg(LOG_WARNING,
+                    "Unable to find the NUMA node of %s, SPA workers are not pinned.",
+                    opts->config[CONF_PCAP_INTF]);
+                continue;
+            }
+            if(aff_have[CPU_ROLE_CAPTURE])
+            {
+                CPU_XOR(&tmp, &(aff_sets[i]), &(aff_sets[CPU_ROLE_CAPTURE]));
+                CPU_AND(&(aff_sets[i]), &(aff_sets[i]), &tmp);
+            }
+            if(CPU_COUNT(&(aff_sets[i])) == 0)
+            {
+                log_msg(LOG_WARNING,
+                    "No CPUs left for SPA workers on the NUMA node of %s, not pinning them.",
+                    opts->config[CONF_PCAP_INTF]);
+                continue;
+            }
+        }
+        else if(parse_cpu_list(vals[i], &(aff_sets[i])) != 0)
+        {
+            log_msg(LOG_ERR, "[*] Invalid %s value '%s'.", aff_role_names[i], vals[i]);
+            return -1;
+        }
+        aff_have[i] = 1;
+    }
+
+    if(! aff_have[CPU_ROLE_HOUSEKEEPING] && aff_orig_valid
+            && (aff_have[CPU_ROLE_CAPTURE] || aff_have[CPU_ROLE_WORKER]))
+    {
+        CPU_ZERO(&tmp);
+        if(aff_have[CPU_ROLE_CAPTURE])
+            CPU_OR(&tmp, &tmp, &(aff_sets[CPU_ROLE_CAPTURE]));
+        if(aff_have[CPU_ROLE_WORKER])
+            CPU_OR(&tmp, &tmp, &(aff_sets[CPU_ROLE_WORKER]));
+
+        // aff_orig minus the pinned CPUs
+        CPU_AND(&tmp, &tmp, &aff_orig);
+        CPU_XOR(&(aff_sets[CPU_ROLE_HOUSEKEEPING]), &aff_orig, &tmp);
+
+        if(CPU_COUNT(&(aff_sets[CPU_ROLE_HOUSEKEEPING])) > 0)
+            aff_have[CPU_ROLE_HOUSEKEEPING] = 1;
+        else
+            log_msg(LOG_WARNING,
+                "CAPTURE_CPUS and SPA_WORKER_CPUS cover every CPU, housekeeping threads are not pinned.");
+    }
+
+    for(i=0; i < CPU_ROLE_COUNT; i++)
+    {
+        if(! aff_have[i])
+            continue;
+        aff_used = 1;
+        if(opts->verbose)
+            log_msg(LOG_INFO, "%s: pinning to %d CPUs.", aff_role_names[i],
+                CPU_COUNT(&(aff_sets[i])));
+    }
+
+    return 0;
+}
+
+/* Pin the calling thread to the CPUs for its role.
+*/
+void
+cpu_affinity_set(const int role)
+{
+    const cpu_set_t *set = NULL;
+    int              rv;
+
+    if(! aff_used || role < 0 || role >= CPU_ROLE_COUNT)
+        return;
+
+    if(aff_have[role])
+        set = &(aff_sets[role]);
+    else if(aff_orig_valid)
+        set = &aff_orig;
+    else
+        return;
+
+    if((rv = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), set)) != 0)
+        log_msg(LOG_WARNING, "Unable to set %s affinity: %s",
+            aff_role_names[role], strerror(rv));
+
+    return;
+}
+
+#else /* ! HAVE_PTHREAD_SETAFFINITY_NP */
+
+int
+cpu_affinity_init(const fko_srv_options_t *opts)
+{
+    if((opts->config[CONF_CAPTURE_CPUS] != NULL && opts->config[CONF_CAPTURE_CPUS][0] != '\0')
+            || (opts->config[CONF_SPA_WORKER_CPUS] != NULL && opts->config[CONF_SPA_WORKER_CPUS][0] != '\0')
+            || (opts->config[CONF_HOUSEKEEPING_CPUS] != NULL && opts->config[CONF_HOUSEKEEPING_CPUS][0] != '\0'))
+        log_msg(LOG_WARNING,
+            "CPU affinity is not supported on this platform, ignoring the *_CPUS settings.");
+    return 0;
+}
+
+void
+cpu_affinity_set(const int role)
+{
+    (void)role;
+    return;
+}
+
+#endif /* HAVE_PTHREAD_SETAFFINITY_NP */
+
+/***EOF***/
@@ -0,0 +1,57 @@
+/*
+ *****************************************************************************
+ *
+ * File:    cpu_affinity.h
+ *
+ * Purpose: Header file for cpu_affinity.c - pinning of the capture, SPA
+ *          worker and housekeeping threads to sets of CPUs.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef CPU_AFFINITY_H
+#define CPU_AFFINITY_H
+
+/* Thread roles.  Each thread pins itself with cpu_affinity_set() as soon
+ * as it starts, before it allocates anything, so that its memory is
+ * placed on its own NUMA node by the kernel's first-touch policy.
+*/
+enum {
+    CPU_ROLE_CAPTURE = 0,   /* pcap capture loop, UDP server workers */
+    CPU_ROLE_WORKER,        /* SPA worker threads */
+    CPU_ROLE_HOUSEKEEPING,  /* firewall commits, conntrack, controller... */
+    CPU_ROLE_COUNT
+};
+
+/* SPA_WORKER_CPUS value for the CPUs on the capture interface's NUMA node
+*/
+#define CPU_AFFINITY_AUTO   "auto"
+
+/* Prototypes
+*/
+int cpu_affinity_init(const fko_srv_options_t *opts);
+void cpu_affinity_set(const int role);
+
+#endif /* CPU_AFFINITY_H */
+
+/***EOF***/
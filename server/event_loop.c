@@ -0,0 +1,451 @@
+/*
+ *****************************************************************************
+ *
+ * File:    event_loop.c
+ *
+ * Purpose: A small reactor that waits on a set of file descriptors and
+ *          interval timers.  On Linux this uses epoll(7) and timerfds so
+ *          that fwknopd only wakes up for real events.  Elsewhere it falls
+ *          back to poll() with the timeout set from the nearest timer.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "event_loop.h"
+#include "log_msg.h"
+#include <errno.h>
+#include <time.h>
+
+#if HAVE_SYS_EPOLL_H
+  #include <sys/epoll.h>
+  #include <fcntl.h>
+  #define USE_EPOLL 1
+  #if HAVE_SYS_TIMERFD_H
+    #include <sys/timerfd.h>
+    #define USE_TIMERFD 1
+  #endif
+#else
+  #include <poll.h>
+#endif
+
+typedef struct event_fd
+{
+    int             fd;
+    event_handler_t handler;
+    void           *arg;
+    int             timer_ndx;  /* >= 0 if this fd is a timerfd */
+    int             want_write; /* also wake up when fd is writable */
+} event_fd_t;
+
+typedef struct event_timer
+{
+    int             interval_ms;
+    event_handler_t handler;
+    void           *arg;
+#if USE_TIMERFD
+    int             tfd;
+#else
+    struct timespec next;
+#endif
+} event_timer_t;
+
+struct event_loop
+{
+#if USE_EPOLL
+    int             epfd;
+#endif
+    int             nfds;
+    event_fd_t      fds[EVENT_LOOP_MAX_FDS];
+    int             ntimers;
+    event_timer_t   timers[EVENT_LOOP_MAX_TIMERS];
+};
+
+static event_fd_t *
+find_fd(event_loop_t *loop, const int fd)
+{
+    int     i;
+
+    for(i=0; i < loop->nfds; i++)
+        if(loop->fds[i].fd == fd)
+            return(&(loop->fds[i]));
+
+    return(NULL);
+}
+
+static int
+add_fd_entry(event_loop_t *loop, const int fd, event_handler_t handler,
+        void *arg, const int timer_ndx)
+{
+#if USE_EPOLL
+    struct epoll_event  ev;
+#endif
+
+    if(loop->nfds >= EVENT_LOOP_MAX_FDS)
+    {
+        log_msg(LOG_ERR, "event_loop: too many file descriptors (max %i)",
+            EVENT_LOOP_MAX_FDS);
+        return(-1);
+    }
+
+    if(find_fd(loop, fd) != NULL)
+        return(-1);
+
+#if USE_EPOLL
+    memset(&ev, 0x0, sizeof(ev));
+    ev.events  = EPOLLIN;
+    ev.data.fd = fd;
+
+    if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        log_msg(LOG_ERR, "event_loop: epoll_ctl() ADD error: %s",
+            strerror(errno));
+        return(-1);
+    }
+#endif
+
+    loop->fds[loop->nfds].fd        = fd;
+    loop->fds[loop->nfds].handler   = handler;
+    loop->fds[loop->nfds].arg       = arg;
+    loop->fds[loop->nfds].timer_ndx = timer_ndx;
+    loop->fds[loop->nfds].want_write = 0;
+    loop->nfds++;
+
+    return(0);
+}
+
+#if ! USE_TIMERFD
+static long
+ms_until(const struct timespec *now, const struct timespec *then)
+{
+    return((then->tv_sec - now->tv_sec) * 1000
+            + (then->tv_nsec - now->tv_nsec) / 1000000);
+}
+
+static void
+timespec_add_ms(struct timespec *ts, const int ms)
+{
+    ts->tv_sec  += ms / 1000;
+    ts->tv_nsec += (long)(ms % 1000) * 1000000;
+    if(ts->tv_nsec >= 1000000000)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+#endif
+
+event_loop_t *
+event_loop_new(void)
+{
+    event_loop_t   *loop = NULL;
+
+    if((loop = calloc(1, sizeof(event_loop_t))) == NULL)
+    {
+        log_msg(LOG_ERR, "event_loop: calloc() failed");
+        return(NULL);
+    }
+
+#if USE_EPOLL
+    if((loop->epfd = epoll_create(EVENT_LOOP_MAX_FDS)) < 0)
+    {
+        log_msg(LOG_ERR, "event_loop: epoll_create() error: %s",
+            strerror(errno));
+        free(loop);
+        return(NULL);
+    }
+    fcntl(loop->epfd, F_SETFD, FD_CLOEXEC);
+#endif
+
+    return(loop);
+}
+
+/* Free the loop along with any timerfds it created.  File descriptors
+ * added with event_loop_add_fd() belong to the caller and are not closed.
+*/
+void
+event_loop_destroy(event_loop_t *loop)
+{
+#if USE_TIMERFD
+    int     i;
+#endif
+
+    if(loop == NULL)
+        return;
+
+#if USE_TIMERFD
+    for(i=0; i < loop->ntimers; i++)
+        close(loop->timers[i].tfd);
+#endif
+#if USE_EPOLL
+    close(loop->epfd);
+#endif
+
+    free(loop);
+    return;
+}
+
+int
+event_loop_add_fd(event_loop_t *loop, int fd,
+        event_handler_t handler, void *arg)
+{
+    if(loop == NULL || fd < 0 || handler == NULL)
+        return(-1);
+
+    return(add_fd_entry(loop, fd, handler, arg, -1));
+}
+
+int
+event_loop_del_fd(event_loop_t *loop, int fd)
+{
+    int     i;
+
+    if(loop == NULL)
+        return(-1);
+
+    for(i=0; i < loop->nfds; i++)
+    {
+        if(loop->fds[i].fd == fd && loop->fds[i].timer_ndx < 0)
+        {
+#if USE_EPOLL
+            epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+            loop->fds[i] = loop->fds[loop->nfds-1];
+            loop->nfds--;
+            return(0);
+        }
+    }
+
+    return(-1);
+}
+
+/* Also call fd's handler when it turns writable (on) or only when it is
+ * readable again (off), e.g. while a non-blocking connect completes.
+*/
+int
+event_loop_want_write(event_loop_t *loop, int fd, const int on)
+{
+    event_fd_t         *efd;
+#if USE_EPOLL
+    struct epoll_event  ev;
+#endif
+
+    if(loop == NULL || (efd = find_fd(loop, fd)) == NULL)
+        return(-1);
+
+    if(efd->want_write == on)
+        return(0);
+
+#if USE_EPOLL
+    memset(&ev, 0x0, sizeof(ev));
+    ev.events  = on ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    ev.data.fd = fd;
+
+    if(epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+    {
+        log_msg(LOG_ERR, "event_loop: epoll_ctl() MOD error: %s",
+            strerror(errno));
+        return(-1);
+    }
+#endif
+
+    efd->want_write = on;
+    return(0);
+}
+
+/* Register a handler to be called every interval_ms milliseconds.
+*/
+int
+event_loop_add_timer(event_loop_t *loop, int interval_ms,
+        event_handler_t handler, void *arg)
+{
+    event_timer_t      *timer;
+#if USE_TIMERFD
+    struct itimerspec   its;
+#endif
+
+    if(loop == NULL || interval_ms <= 0 || handler == NULL)
+        return(-1);
+
+    if(loop->ntimers >= EVENT_LOOP_MAX_TIMERS)
+    {
+        log_msg(LOG_ERR, "event_loop: too many timers (max %i)",
+            EVENT_LOOP_MAX_TIMERS);
+        return(-1);
+    }
+
+    timer = &(loop->timers[loop->ntimers]);
+    timer->interval_ms = interval_ms;
+    timer->handler     = handler;
+    timer->arg         = arg;
+
+#if USE_TIMERFD
+    if((timer->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC)) < 0)
+    {
+        log_msg(LOG_ERR, "event_loop: timerfd_create() error: %s",
+            strerror(errno));
+        return(-1);
+    }
+
+    memset(&its, 0x0, sizeof(its));
+    its.it_interval.tv_sec  = interval_ms / 1000;
+    its.it_interval.tv_nsec = (long)(interval_ms % 1000) * 1000000;
+    its.it_value            = its.it_interval;
+
+    if(timerfd_settime(timer->tfd, 0, &its, NULL) < 0
+            || add_fd_entry(loop, timer->tfd, handler, arg, loop->ntimers) < 0)
+    {
+        log_msg(LOG_ERR, "event_loop: could not arm timerfd: %s",
+            strerror(errno));
+        close(timer->tfd);
+        return(-1);
+    }
+#else
+    clock_gettime(CLOCK_MONOTONIC, &(timer->next));
+    timespec_add_ms(&(timer->next), interval_ms);
+#endif
+
+    loop->ntimers++;
+
+    return(0);
+}
+
+/* Wait up to max_wait_ms milliseconds (or forever if max_wait_ms is
+ * negative) for an fd to become readable (or writable, if asked for) or
+ * a timer to fire, and dispatch the handlers.  Returns EVENT_LOOP_STOP if any handler asked to stop,
+ * EVENT_LOOP_CONTINUE otherwise (including when interrupted by a signal),
+ * and a negative value on error.
+*/
+int
+event_loop_run_once(event_loop_t *loop, int max_wait_ms)
+{
+    event_fd_t         *efd;
+    int                 i, n, rv, res = EVENT_LOOP_CONTINUE;
+    int                 timeout = max_wait_ms;
+#if USE_EPOLL
+    struct epoll_event  events[EVENT_LOOP_MAX_FDS];
+#else
+    struct pollfd       pfds[EVENT_LOOP_MAX_FDS];
+#endif
+#if USE_TIMERFD
+    uint64_t            expirations;
+#else
+    struct timespec     now;
+    long                ms;
+#endif
+
+    if(loop == NULL)
+        return(-1);
+
+#if ! USE_TIMERFD
+    /* Don't sleep past the next timer deadline.
+    */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for(i=0; i < loop->ntimers; i++)
+    {
+        ms = ms_until(&now, &(loop->timers[i].next));
+        if(ms < 0)
+            ms = 0;
+        if(timeout < 0 || ms < timeout)
+            timeout = (int)ms;
+    }
+#endif
+
+#if USE_EPOLL
+    n = epoll_wait(loop->epfd, events, EVENT_LOOP_MAX_FDS, timeout);
+#else
+    for(i=0; i < loop->nfds; i++)
+    {
+        pfds[i].fd      = loop->fds[i].fd;
+        pfds[i].events  = loop->fds[i].want_write ? (POLLIN | POLLOUT) : POLLIN;
+        pfds[i].revents = 0;
+    }
+    n = poll(pfds, loop->nfds, timeout);
+#endif
+
+    if(n < 0)
+    {
+        if(errno == EINTR)
+            return(EVENT_LOOP_CONTINUE);
+
+        log_msg(LOG_ERR, "event_loop: wait error: %s", strerror(errno));
+        return(-1);
+    }
+
+#if USE_EPOLL
+    for(i=0; i < n; i++)
+    {
+        /* A handler may have removed this fd already.
+        */
+        if((efd = find_fd(loop, events[i].data.fd)) == NULL)
+            continue;
+#else
+    for(i=0; n > 0 && i < loop->nfds; i++)
+    {
+        if(pfds[i].revents == 0)
+            continue;
+        if((efd = find_fd(loop, pfds[i].fd)) == NULL)
+            continue;
+#endif
+
+#if USE_TIMERFD
+        if(efd->timer_ndx >= 0)
+        {
+            if(read(efd->fd, &expirations, sizeof(expirations)) < 0)
+                continue;
+            rv = efd->handler(-1, efd->arg);
+        }
+        else
+#endif
+            rv = efd->handler(efd->fd, efd->arg);
+
+        if(rv < 0)
+            return(rv);
+        if(rv == EVENT_LOOP_STOP)
+            res = EVENT_LOOP_STOP;
+    }
+
+#if ! USE_TIMERFD
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for(i=0; i < loop->ntimers; i++)
+    {
+        if(ms_until(&now, &(loop->timers[i].next)) > 0)
+            continue;
+
+        /* Skip any intervals we missed rather than firing a burst.
+        */
+        loop->timers[i].next = now;
+        timespec_add_ms(&(loop->timers[i].next), loop->timers[i].interval_ms);
+
+        rv = loop->timers[i].handler(-1, loop->timers[i].arg);
+        if(rv < 0)
+            return(rv);
+        if(rv == EVENT_LOOP_STOP)
+            res = EVENT_LOOP_STOP;
+    }
+#endif
+
+    return(res);
+}
+
+/***EOF***/
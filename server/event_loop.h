@@ -0,0 +1,68 @@
+/*
+ *****************************************************************************
+ *
+ * File:    event_loop.h
+ *
+ * Purpose: Header file for event_loop.c - a small fd and timer reactor
+ *          used by the fwknopd servers and the control client thread.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+/* Maximum number of file descriptors and timers a single event loop
+ * will track.
+*/
+#define EVENT_LOOP_MAX_FDS      64
+#define EVENT_LOOP_MAX_TIMERS   8
+
+/* Return values for event handlers.  Anything negative is treated as an
+ * error and is passed back to the caller of event_loop_run_once().
+*/
+#define EVENT_LOOP_CONTINUE     0
+#define EVENT_LOOP_STOP         1
+
+/* Called when fd is readable (or writable, see event_loop_want_write()),
+ * or when a timer fires (fd is -1).
+*/
+typedef int (*event_handler_t)(int fd, void *arg);
+
+typedef struct event_loop event_loop_t;
+
+/* Prototypes
+*/
+event_loop_t *event_loop_new(void);
+void event_loop_destroy(event_loop_t *loop);
+int event_loop_add_fd(event_loop_t *loop, int fd,
+        event_handler_t handler, void *arg);
+int event_loop_del_fd(event_loop_t *loop, int fd);
+int event_loop_want_write(event_loop_t *loop, int fd, const int on);
+int event_loop_add_timer(event_loop_t *loop, int interval_ms,
+        event_handler_t handler, void *arg);
+int event_loop_run_once(event_loop_t *loop, int max_wait_ms);
+
+#endif /* EVENT_LOOP_H */
+
+/***EOF***/
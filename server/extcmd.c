@@ -32,6 +32,7 @@
 #include "extcmd.h"
 #include "log_msg.h"
 #include "utils.h"
+#include "fwknop_probes.h"
 
 #include <errno.h>
 #include <signal.h>
@@ -40,6 +41,56 @@
   #include <sys/wait.h>
 #endif
 
+#if HAVE_EXECVPE && HAVE_POSIX_SPAWNP
+  #include <spawn.h>
+#endif
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifndef MSG_NOSIGNAL
+  #define MSG_NOSIGNAL 0
+#endif
+
+/* Persistent command helper (ENABLE_EXTCMD_HELPER).  fwknopd hands each
+ * command to the helper over helper_fd together with one end of a fresh
+ * socketpair; a worker forked from the (small) helper runs the command and
+ * answers on that socketpair, so requests from different threads never
+ * share a channel.
+*/
+typedef struct extcmd_req
+{
+    uint32_t    cmd_len;
+    uint32_t    search_len;
+    uint32_t    write_len;
+    uint32_t    so_buf_sz;
+    int32_t     uid;
+    int32_t     gid;
+    int32_t     cflag;
+    int32_t     timeout;
+    int32_t     is_write;
+} extcmd_req_t;
+
+typedef struct extcmd_resp
+{
+    int32_t     retval;
+    int32_t     pid_status;
+    uint32_t    out_len;
+} extcmd_resp_t;
+
+static int              helper_fd  = -1;
+static pid_t            helper_pid = 0;
+static int              in_helper  = 0;
+
+/* Deadline handling inside a helper worker.
+*/
+static volatile pid_t           worker_child = 0;
+static volatile sig_atomic_t    worker_timed_out = 0;
+
+static int helper_call(const extcmd_req_t *req, const char *cmd,
+        const char *substr_search, const char *cmd_write, char *so_buf,
+        int *pid_status);
+
 /*
 static sig_atomic_t got_sigalrm; 
 */
@@ -110,6 +161,110 @@ copy_or_search(char *so_read_buf, char *so_buf, const size_t so_buf_sz,
     return;
 }
 
+#if HAVE_EXECVPE
+/* Start argv[0] with an empty environment and "/" as its working directory.
+ * If in_fd/out_fd are not -1 they become the child's stdin/stdout (and
+ * stderr too with WANT_STDERR), and close_fd is closed in the child.
+ *
+ * Commands run as root go through posix_spawnp(), which avoids copying the
+ * page tables of a large fwknopd process the way fork() does.  Changing
+ * uid/gid is not something posix_spawn can do, so those commands still
+ * fork().  Returns the child pid, or -1 with errno set.
+*/
+static pid_t
+spawn_cmd(char **argv, const uid_t uid, const gid_t gid, const int in_fd,
+        const int out_fd, const int close_fd, const int cflag)
+{
+    pid_t   pid;
+
+#if HAVE_POSIX_SPAWNP
+    if(uid == 0 && gid == 0)
+    {
+        posix_spawn_file_actions_t  fa;
+        char                       *envp[] = { NULL };
+        int                         res;
+
+        if((res = posix_spawn_file_actions_init(&fa)) != 0)
+        {
+            errno = res;
+            return -1;
+        }
+
+#if HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP
+        posix_spawn_file_actions_addchdir_np(&fa, "/");
+#endif
+        if(close_fd >= 0)
+            posix_spawn_file_actions_addclose(&fa, close_fd);
+
+        if(in_fd >= 0)
+            posix_spawn_file_actions_adddup2(&fa, in_fd, STDIN_FILENO);
+
+        if(out_fd >= 0)
+        {
+            posix_spawn_file_actions_adddup2(&fa, out_fd, STDOUT_FILENO);
+            if(cflag & WANT_STDERR)
+                posix_spawn_file_actions_adddup2(&fa, out_fd, STDERR_FILENO);
+            else
+                posix_spawn_file_actions_addclose(&fa, STDERR_FILENO);
+        }
+
+        res = posix_spawnp(&pid, argv[0], &fa, NULL, argv, envp);
+        posix_spawn_file_actions_destroy(&fa);
+
+        if(res != 0)
+        {
+            errno = res;
+            return -1;
+        }
+        FWKNOP_PROBE2(extcmd_spawn, pid, argv[0]);
+        return pid;
+    }
+#endif
+
+    pid = fork();
+    if(pid == 0)
+    {
+        if(chdir("/") != 0)
+            exit(EXTCMD_CHDIR_ERROR);
+
+        if(close_fd >= 0)
+            close(close_fd);
+
+        if(in_fd >= 0)
+            dup2(in_fd, STDIN_FILENO);
+
+        if(out_fd >= 0)
+        {
+            dup2(out_fd, STDOUT_FILENO);
+            if(cflag & WANT_STDERR)
+                dup2(out_fd, STDERR_FILENO);
+            else
+                close(STDERR_FILENO);
+        }
+
+        /* Take care of gid/uid settings before running the command.
+        */
+        if(gid > 0)
+            if(setgid(gid) < 0)
+                exit(EXTCMD_SETGID_ERROR);
+
+        if(uid > 0)
+            if(setuid(uid) < 0)
+                exit(EXTCMD_SETUID_ERROR);
+
+        /* don't use env
+        */
+        execvpe(argv[0], argv, (char * const *)NULL);
+        _exit(EXTCMD_EXECUTION_ERROR);
+    }
+
+    if(pid > 0)
+        FWKNOP_PROBE2(extcmd_spawn, pid, argv[0]);
+
+    return pid;
+}
+#endif /* HAVE_EXECVPE */
+
 /* Run an external command returning exit status, and optionally filling
  * provided buffer with STDOUT output up to the size provided.
  *
@@ -143,6 +298,25 @@ _run_extcmd(uid_t uid, gid_t gid, const char *cmd, char *so_buf,
 
     *pid_status = 0;
 
+    if(helper_fd >= 0 && ! in_helper)
+    {
+        extcmd_req_t req;
+
+        memset(&req, 0x0, sizeof(req));
+        req.cmd_len    = strlen(cmd);
+        req.search_len = (substr_search == NULL) ? 0 : strlen(substr_search)+1;
+        req.so_buf_sz  = (so_buf == NULL) ? 0 : so_buf_sz;
+        req.uid        = uid;
+        req.gid        = gid;
+        req.cflag      = cflag;
+        req.timeout    = timeout;
+
+        if((retval = helper_call(&req, cmd, substr_search, NULL,
+                        so_buf, pid_status)) != EXTCMD_FORK_ERROR)
+            return(retval);
+        retval = EXTCMD_SUCCESS_ALL_OUTPUT;
+    }
+
     /* Even without execvpe() we examine the command for basic validity
      * in term of number of args
     */
@@ -176,42 +350,24 @@ _run_extcmd(uid_t uid, gid_t gid, const char *cmd, char *so_buf,
         }
     }
 
-    pid = fork();
-    if (pid == 0)
-    {
-        if(chdir("/") != 0)
-            exit(EXTCMD_CHDIR_ERROR);
+    if(so_buf != NULL || substr_search != NULL)
+        pid = spawn_cmd(argv_new, uid, gid, -1, pipe_fd[1], pipe_fd[0], cflag);
+    else
+        pid = spawn_cmd(argv_new, uid, gid, -1, -1, -1, cflag);
 
+    if(pid == -1)
+    {
+        log_msg(LOG_ERR, "run_extcmd(): could not start '%s': %s",
+                argv_new[0], strerror(errno));
         if(so_buf != NULL || substr_search != NULL)
         {
             close(pipe_fd[0]);
-            dup2(pipe_fd[1], STDOUT_FILENO);
-            if(cflag & WANT_STDERR)
-                dup2(pipe_fd[1], STDERR_FILENO);
-            else
-                close(STDERR_FILENO);
+            close(pipe_fd[1]);
         }
-
-        /* Take care of gid/uid settings before running the command.
-        */
-        if(gid > 0)
-            if(setgid(gid) < 0)
-                exit(EXTCMD_SETGID_ERROR);
-
-        if(uid > 0)
-            if(setuid(uid) < 0)
-                exit(EXTCMD_SETUID_ERROR);
-
-        /* don't use env
-        */
-        execvpe(argv_new[0], argv_new, (char * const *)NULL);
-    }
-    else if(pid == -1)
-    {
-        log_msg(LOG_ERR, "run_extcmd(): fork() failed: %s", strerror(errno));
         free_argv(argv_new, &argc_new);
         return EXTCMD_FORK_ERROR;
     }
+    worker_child = pid;
 
     /* Only the parent process makes it here
     */
@@ -252,6 +408,7 @@ _run_extcmd(uid_t uid, gid_t gid, const char *cmd, char *so_buf,
     free_argv(argv_new, &argc_new);
 
     waitpid(pid, pid_status, 0);
+    FWKNOP_PROBE2(extcmd_exit, pid, *pid_status);
 
 #else
 
@@ -593,6 +750,21 @@ int _run_extcmd_write(const char *cmd, const char *cmd_write, int *pid_status,
 
     *pid_status = 0;
 
+    if(helper_fd >= 0 && ! in_helper)
+    {
+        extcmd_req_t req;
+
+        memset(&req, 0x0, sizeof(req));
+        req.cmd_len   = strlen(cmd);
+        req.write_len = strlen(cmd_write);
+        req.is_write  = 1;
+
+        if((retval = helper_call(&req, cmd, NULL, cmd_write,
+                        NULL, pid_status)) != EXTCMD_FORK_ERROR)
+            return(retval);
+        retval = EXTCMD_SUCCESS_ALL_OUTPUT;
+    }
+
     /* Even without execvpe() we examine the command for basic validity
      * in term of number of args
     */
@@ -624,25 +796,17 @@ int _run_extcmd_write(const char *cmd, const char *cmd_write, int *pid_status,
         return EXTCMD_PIPE_ERROR;
     }
 
-    pid = fork();
-    if (pid == 0)
+    pid = spawn_cmd(argv_new, ROOT_UID, ROOT_GID, pipe_fd[0], -1, pipe_fd[1], 0);
+    if(pid == -1)
     {
-        if(chdir("/") != 0)
-            exit(EXTCMD_CHDIR_ERROR);
-
+        log_msg(LOG_ERR, "run_extcmd_write(): could not start '%s': %s",
+                argv_new[0], strerror(errno));
+        close(pipe_fd[0]);
         close(pipe_fd[1]);
-        dup2(pipe_fd[0], STDIN_FILENO);
-
-        /* don't use env
-        */
-        execvpe(argv_new[0], argv_new, (char * const *)NULL);
-    }
-    else if(pid == -1)
-    {
-        log_msg(LOG_ERR, "run_extcmd_write(): fork() failed: %s", strerror(errno));
         free_argv(argv_new, &argc_new);
         return EXTCMD_FORK_ERROR;
     }
+    worker_child = pid;
 
     close(pipe_fd[0]);
     if(write(pipe_fd[1], cmd_write, strlen(cmd_write)) < 0)
@@ -652,6 +816,7 @@ int _run_extcmd_write(const char *cmd, const char *cmd_write, int *pid_status,
     free_argv(argv_new, &argc_new);
 
     waitpid(pid, pid_status, 0);
+    FWKNOP_PROBE2(extcmd_exit, pid, *pid_status);
 
 #else
     if(opts->verbose > 1)
@@ -729,4 +894,424 @@ int run_extcmd_write(const char *cmd, const char *cmd_write, int *pid_status,
         const fko_srv_options_t * const opts)
 {
     return _run_extcmd_write(cmd, cmd_write, pid_status, opts);
+}/* Helper plumbing - full reads and writes on the per-request socket.
+*/
+static int
+write_all(const int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t     n;
+
+    while(len > 0)
+    {
+        if((n = send(fd, p, len, MSG_NOSIGNAL)) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return 0;
+        }
+        p   += n;
+        len -= n;
+    }
+    return 1;
 }
+
+static int
+read_all(const int fd, void *buf, size_t len)
+{
+    char       *p = buf;
+    ssize_t     n;
+
+    while(len > 0)
+    {
+        if((n = read(fd, p, len)) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return 0;
+        }
+        if(n == 0)
+            return 0;
+        p   += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/* Send one end of a request socket to the helper.
+*/
+static int
+send_fd(const int sock, const int fd)
+{
+    struct msghdr   msg;
+    struct iovec    iov;
+    struct cmsghdr *cmsg;
+    char            ctl[CMSG_SPACE(sizeof(int))];
+    char            c = 'R';
+
+    memset(&msg, 0x0, sizeof(msg));
+    memset(ctl, 0x0, sizeof(ctl));
+
+    iov.iov_base       = &c;
+    iov.iov_len        = 1;
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctl;
+    msg.msg_controllen = sizeof(ctl);
+
+    cmsg             = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1;
+}
+
+/* Returns the received descriptor, -1 for a message without one, or -2
+ * once fwknopd has closed its end.
+*/
+static int
+recv_fd(const int sock)
+{
+    struct msghdr   msg;
+    struct iovec    iov;
+    struct cmsghdr *cmsg;
+    char            ctl[CMSG_SPACE(sizeof(int))];
+    char            c;
+    int             fd = -1;
+    ssize_t         n;
+
+    memset(&msg, 0x0, sizeof(msg));
+
+    iov.iov_base       = &c;
+    iov.iov_len        = 1;
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctl;
+    msg.msg_controllen = sizeof(ctl);
+
+    if((n = recvmsg(sock, &msg, 0)) <= 0)
+        return (n < 0 && errno == EINTR) ? -1 : -2;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET
+            && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+    return fd;
+}
+
+/* Hand one request to the helper and return the socket its reply will
+ * arrive on.  Returns EXTCMD_FORK_ERROR (after disabling the helper) when
+ * the helper cannot be reached, so the caller can run the command itself,
+ * or EXTCMD_PIPE_ERROR if the request could not be sent.
+*/
+static int
+helper_send(const extcmd_req_t *req, const char *cmd,
+        const char *substr_search, const char *cmd_write)
+{
+    int     sv[2];
+
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+        return EXTCMD_FORK_ERROR;
+
+    if(! send_fd(helper_fd, sv[1]))
+    {
+        log_msg(LOG_WARNING,
+            "extcmd helper unavailable (%s), running commands directly",
+            strerror(errno));
+        close(helper_fd);
+        helper_fd = -1;
+        close(sv[0]);
+        close(sv[1]);
+        return EXTCMD_FORK_ERROR;
+    }
+    close(sv[1]);
+
+    if(! (write_all(sv[0], req, sizeof(*req))
+            && write_all(sv[0], cmd, req->cmd_len)
+            && (req->search_len == 0
+                || write_all(sv[0], substr_search, req->search_len))
+            && (req->write_len == 0
+                || write_all(sv[0], cmd_write, req->write_len))))
+    {
+        log_msg(LOG_ERR, "extcmd helper: could not send request for '%s'", cmd);
+        close(sv[0]);
+        return EXTCMD_PIPE_ERROR;
+    }
+    return sv[0];
+}
+
+/* Wait for the reply to a request sent with helper_send() and close its
+ * socket.
+*/
+static int
+helper_recv(const int fd, char *so_buf, const size_t so_buf_sz,
+        int *pid_status)
+{
+    extcmd_resp_t   resp;
+    int             ok;
+
+    ok = read_all(fd, &resp, sizeof(resp))
+        && resp.out_len <= so_buf_sz;
+
+    if(ok && so_buf != NULL && so_buf_sz > 0)
+    {
+        memset(so_buf, 0x0, so_buf_sz);
+        ok = read_all(fd, so_buf, resp.out_len);
+        so_buf[so_buf_sz-1] = '\0';
+    }
+    close(fd);
+
+    if(! ok)
+    {
+        log_msg(LOG_ERR, "extcmd helper: lost reply from worker");
+        return EXTCMD_PIPE_ERROR;
+    }
+
+    *pid_status = resp.pid_status;
+    return resp.retval;
+}
+
+static int
+helper_call(const extcmd_req_t *req, const char *cmd,
+        const char *substr_search, const char *cmd_write, char *so_buf,
+        int *pid_status)
+{
+    int     fd;
+
+    if((fd = helper_send(req, cmd, substr_search, cmd_write)) < 0)
+        return fd;
+
+    return helper_recv(fd, so_buf, req->so_buf_sz, pid_status);
+}
+
+static void
+worker_alarm(int sig)
+{
+    worker_timed_out = 1;
+    if(worker_child > 0)
+        kill(worker_child, SIGKILL);
+}
+
+/* Serve one request in a worker forked from the helper.
+*/
+static void
+helper_worker(const int fd, const fko_srv_options_t * const opts)
+{
+    extcmd_req_t        req;
+    extcmd_resp_t       resp;
+    struct sigaction    sa;
+    char               *cmd = NULL, *search = NULL, *wbuf = NULL, *so_buf = NULL;
+    int                 pid_status = 0;
+
+    memset(&resp, 0x0, sizeof(resp));
+
+    if(! read_all(fd, &req, sizeof(req))
+            || req.cmd_len >= MAX_LINE_LEN * 4
+            || req.search_len >= MAX_LINE_LEN
+            || req.write_len > EXTCMD_HELPER_MAX_WRITE
+            || req.so_buf_sz > EXTCMD_HELPER_MAX_OUTPUT)
+        return;
+
+    if((cmd = calloc(1, req.cmd_len+1)) == NULL
+            || (req.search_len && (search = calloc(1, req.search_len)) == NULL)
+            || (req.write_len && (wbuf = calloc(1, req.write_len+1)) == NULL)
+            || (req.so_buf_sz && (so_buf = calloc(1, req.so_buf_sz)) == NULL))
+        goto done;
+
+    if(! read_all(fd, cmd, req.cmd_len)
+            || (req.search_len && ! read_all(fd, search, req.search_len))
+            || (req.write_len && ! read_all(fd, wbuf, req.write_len)))
+        goto done;
+
+    if(search != NULL)
+        search[req.search_len-1] = '\0';
+
+    if(req.timeout > 0)
+    {
+        memset(&sa, 0x0, sizeof(sa));
+        sa.sa_handler = worker_alarm;
+        sa.sa_flags   = SA_RESTART;
+        sigaction(SIGALRM, &sa, NULL);
+        alarm(req.timeout);
+    }
+
+    if(req.is_write)
+        resp.retval = _run_extcmd_write(cmd, wbuf, &pid_status, opts);
+    else
+        resp.retval = _run_extcmd(req.uid, req.gid, cmd, so_buf,
+                req.so_buf_sz, req.cflag, req.timeout, search,
+                &pid_status, opts);
+
+    alarm(0);
+
+    if(worker_timed_out)
+    {
+        log_msg(LOG_WARNING, "Command '%s' killed after %d second timeout",
+            cmd, req.timeout);
+        resp.retval = EXTCMD_EXECUTION_TIMEOUT;
+    }
+
+    resp.pid_status = pid_status;
+    if(so_buf != NULL)
+        resp.out_len = strnlen(so_buf, req.so_buf_sz);
+
+    if(write_all(fd, &resp, sizeof(resp)) && resp.out_len > 0)
+        write_all(fd, so_buf, resp.out_len);
+
+done:
+    free(cmd);
+    free(search);
+    free(wbuf);
+    free(so_buf);
+    return;
+}
+
+static void
+helper_main(const int sock, const fko_srv_options_t * const opts)
+{
+    struct sigaction    sa;
+    int                 fd;
+    pid_t               pid;
+
+    /* Workers are never waited for by the helper, and the helper only
+     * exits once fwknopd closes its end (so that a signal sent to the
+     * whole process group cannot take it away before fw_cleanup() runs).
+    */
+    memset(&sa, 0x0, sizeof(sa));
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGCHLD, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+    sigaction(SIGPIPE, &sa, NULL);
+
+    while((fd = recv_fd(sock)) != -2)
+    {
+        if(fd < 0)
+            continue;
+
+        pid = fork();
+        if(pid == 0)
+        {
+            close(sock);
+            sa.sa_handler = SIG_DFL;
+            sigaction(SIGCHLD, &sa, NULL);
+            sigaction(SIGHUP, &sa, NULL);
+            sigaction(SIGINT, &sa, NULL);
+            sigaction(SIGTERM, &sa, NULL);
+            sigaction(SIGUSR1, &sa, NULL);
+            sigaction(SIGUSR2, &sa, NULL);
+            sigaction(SIGPIPE, &sa, NULL);
+            helper_worker(fd, opts);
+            _exit(0);
+        }
+        else if(pid < 0)
+            log_msg(LOG_ERR, "extcmd helper: fork() failed: %s",
+                strerror(errno));
+
+        close(fd);
+    }
+    _exit(0);
+}
+
+/* Start cmd (as root) on the helper without waiting for it, so that
+ * several commands can run at once.  Returns a handle for
+ * run_extcmd_finish(), or -1 when there is no helper, in which case the
+ * caller should just use run_extcmd().
+*/
+int
+run_extcmd_start(const char *cmd, const size_t so_buf_sz,
+        const int want_stderr, const int timeout)
+{
+    extcmd_req_t    req;
+    int             fd;
+
+    if(helper_fd < 0 || in_helper)
+        return -1;
+
+    memset(&req, 0x0, sizeof(req));
+    req.cmd_len   = strlen(cmd);
+    req.so_buf_sz = so_buf_sz;
+    req.cflag     = want_stderr;
+    req.timeout   = timeout;
+
+    if((fd = helper_send(&req, cmd, NULL, NULL)) < 0)
+        return -1;
+
+    return fd;
+}
+
+/* Collect the result of a command started with run_extcmd_start().
+ * so_buf_sz must match the size given to run_extcmd_start().
+*/
+int
+run_extcmd_finish(const int handle, char *so_buf, const size_t so_buf_sz,
+        int *pid_status)
+{
+    *pid_status = 0;
+    return helper_recv(handle, so_buf, so_buf_sz, pid_status);
+}
+
+int
+extcmd_helper_start(const fko_srv_options_t * const opts)
+{
+    int     sv[2];
+
+    if(helper_fd >= 0 || opts->test
+            || strncasecmp(opts->config[CONF_ENABLE_EXTCMD_HELPER], "Y", 1) != 0)
+        return 0;
+
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+    {
+        log_msg(LOG_ERR, "extcmd helper: socketpair() failed: %s",
+            strerror(errno));
+        return -1;
+    }
+
+    helper_pid = fork();
+    if(helper_pid == 0)
+    {
+        close(sv[0]);
+        in_helper = 1;
+        helper_main(sv[1], opts);
+    }
+    else if(helper_pid < 0)
+    {
+        log_msg(LOG_ERR, "extcmd helper: fork() failed: %s", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        helper_pid = 0;
+        return -1;
+    }
+
+    close(sv[1]);
+    helper_fd = sv[0];
+
+    log_msg(LOG_INFO, "Started external command helper (pid %d)",
+        (int)helper_pid);
+    return 0;
+}
+
+void
+extcmd_helper_stop(void)
+{
+    if(helper_fd >= 0)
+    {
+        close(helper_fd);
+        helper_fd = -1;
+    }
+
+    if(helper_pid > 0)
+    {
+        waitpid(helper_pid, NULL, 0);
+        helper_pid = 0;
+    }
+    return;
+}
+
+
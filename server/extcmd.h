@@ -41,6 +41,11 @@
 #define ROOT_UID            0
 #define ROOT_GID            0
 
+/* Limits on what one request to the extcmd helper may carry
+*/
+#define EXTCMD_HELPER_MAX_WRITE     (8 * 1024 * 1024)
+#define EXTCMD_HELPER_MAX_OUTPUT    (8 * 1024 * 1024)
+
 /* The various return status states in which an external command result
  * may end up in.
 */
@@ -97,6 +102,12 @@ int search_extcmd_getline(const char *cmd, char *so_buf, const size_t so_buf_sz,
         const fko_srv_options_t * const opts);
 int run_extcmd_write(const char *cmd, const char *cmd_write, int *pid_status,
         const fko_srv_options_t * const opts);
+int run_extcmd_start(const char *cmd, const size_t so_buf_sz,
+        const int want_stderr, const int timeout);
+int run_extcmd_finish(const int handle, char *so_buf, const size_t so_buf_sz,
+        int *pid_status);
+int extcmd_helper_start(const fko_srv_options_t * const opts);
+void extcmd_helper_stop(void);
 #endif /* EXTCMD_H */
 
 /***EOF***/
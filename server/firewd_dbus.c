@@ -0,0 +1,580 @@
+/*
+ *****************************************************************************
+ *
+ * File:    firewd_dbus.c
+ *
+ * Purpose: A minimal D-Bus client for firewalld's direct interface.  It
+ *          keeps one connection to the system bus open, so a firewall
+ *          change is a method call instead of starting firewall-cmd (a
+ *          Python program) each time, and needs no library.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+
+#if FIREWALL_FIREWALLD
+
+#include "firewd_dbus.h"
+#include "log_msg.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+
+/* Message types and header fields from the D-Bus specification.
+*/
+#define DBUS_METHOD_CALL        1
+#define DBUS_METHOD_RETURN      2
+#define DBUS_ERROR              3
+
+#define DBUS_HDR_PATH           1
+#define DBUS_HDR_INTERFACE      2
+#define DBUS_HDR_MEMBER         3
+#define DBUS_HDR_ERROR_NAME     4
+#define DBUS_HDR_REPLY_SERIAL   5
+#define DBUS_HDR_DESTINATION    6
+#define DBUS_HDR_SIGNATURE      8
+
+#define DBUS_FIXED_HDR_LEN      16
+#define DBUS_HDR_BUFSIZE        512
+#define DBUS_BODY_BUFSIZE       4096
+
+static int              dbus_sock   = -1;
+static uint32_t         dbus_serial = 0;
+static pthread_mutex_t  dbus_mutex  = PTHREAD_MUTEX_INITIALIZER;
+
+/* A message being built.  Values are aligned from the start of the
+ * buffer, which is right for the body too since it always starts on an
+ * 8 byte boundary.  Once the buffer is full err is set and nothing more
+ * is added.
+*/
+typedef struct dbus_buf
+{
+    unsigned char  *data;
+    size_t          len;
+    size_t          size;
+    int             err;
+} dbus_buf_t;
+
+/* Messages are sent in host byte order, which the first header byte says.
+*/
+static char
+host_endian(void)
+{
+    const uint16_t  probe = 1;
+
+    return *(const uint8_t *)&probe ? 'l' : 'B';
+}
+
+static void
+buf_put(dbus_buf_t *b, const void *data, const size_t len)
+{
+    if(b->err || b->len + len > b->size)
+    {
+        b->err = 1;
+        return;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return;
+}
+
+static void
+buf_pad(dbus_buf_t *b, const size_t align)
+{
+    const unsigned char zero = 0;
+
+    while(! b->err && b->len % align)
+        buf_put(b, &zero, 1);
+    return;
+}
+
+static void
+put_u8(dbus_buf_t *b, const uint8_t val)
+{
+    buf_put(b, &val, 1);
+    return;
+}
+
+static void
+put_u32(dbus_buf_t *b, const uint32_t val)
+{
+    buf_pad(b, 4);
+    buf_put(b, &val, 4);
+    return;
+}
+
+static void
+put_str(dbus_buf_t *b, const char * const str)
+{
+    put_u32(b, strlen(str));
+    buf_put(b, str, strlen(str)+1);
+    return;
+}
+
+static void
+put_sig(dbus_buf_t *b, const char * const sig)
+{
+    put_u8(b, strlen(sig));
+    buf_put(b, sig, strlen(sig)+1);
+    return;
+}
+
+/* A header field - a (byte, variant) struct holding a string, object
+ * path or signature.
+*/
+static void
+put_field(dbus_buf_t *b, const uint8_t code, const char * const type,
+        const char * const val)
+{
+    buf_pad(b, 8);
+    put_u8(b, code);
+    put_sig(b, type);
+    if(type[0] == 'g')
+        put_sig(b, val);
+    else
+        put_str(b, val);
+    return;
+}
+
+static uint32_t
+get_u32(const unsigned char * const p, const int swap)
+{
+    uint32_t    val;
+
+    memcpy(&val, p, 4);
+    if(swap)
+        val = ((val & 0xff) << 24) | ((val & 0xff00) << 8)
+            | ((val >> 8) & 0xff00) | (val >> 24);
+    return val;
+}
+
+static int
+write_all(const unsigned char *data, size_t len)
+{
+    ssize_t     n;
+
+    while(len > 0)
+    {
+        n = send(dbus_sock, data, len, MSG_NOSIGNAL);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len  -= n;
+    }
+    return 0;
+}
+
+static int
+read_all(unsigned char *data, size_t len)
+{
+    struct pollfd   pfd;
+    ssize_t         n;
+    int             res;
+
+    pfd.fd     = dbus_sock;
+    pfd.events = POLLIN;
+
+    while(len > 0)
+    {
+        res = poll(&pfd, 1, FIREWD_DBUS_TIMEOUT);
+        if(res < 0 && errno == EINTR)
+            continue;
+        if(res <= 0)
+            return -1;
+
+        n = recv(dbus_sock, data, len, 0);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        data += n;
+        len  -= n;
+    }
+    return 0;
+}
+
+/* Send a method call and return its serial, or 0 on error.
+*/
+static uint32_t
+dbus_call(const char * const dest, const char * const path,
+        const char * const iface, const char * const member,
+        const char * const sig, const dbus_buf_t * const body)
+{
+    unsigned char   hdr_data[DBUS_HDR_BUFSIZE];
+    dbus_buf_t      hdr = { hdr_data, 0, sizeof(hdr_data), 0 };
+    uint32_t        fields_len;
+
+    dbus_serial++;
+    if(dbus_serial == 0)
+        dbus_serial = 1;
+
+    put_u8(&hdr, host_endian());
+    put_u8(&hdr, DBUS_METHOD_CALL);
+    put_u8(&hdr, 0);
+    put_u8(&hdr, 1);
+    put_u32(&hdr, body != NULL ? body->len : 0);
+    put_u32(&hdr, dbus_serial);
+    put_u32(&hdr, 0);
+
+    put_field(&hdr, DBUS_HDR_PATH, "o", path);
+    put_field(&hdr, DBUS_HDR_DESTINATION, "s", dest);
+    put_field(&hdr, DBUS_HDR_INTERFACE, "s", iface);
+    put_field(&hdr, DBUS_HDR_MEMBER, "s", member);
+    if(sig != NULL)
+        put_field(&hdr, DBUS_HDR_SIGNATURE, "g", sig);
+
+    /* The header field array length does not include the padding that
+     * ends the header.
+    */
+    fields_len = hdr.len - DBUS_FIXED_HDR_LEN;
+    memcpy(hdr.data + 12, &fields_len, 4);
+    buf_pad(&hdr, 8);
+
+    if(hdr.err || (body != NULL && body->err))
+        return 0;
+
+    if(write_all(hdr.data, hdr.len) != 0
+            || (body != NULL && write_all(body->data, body->len) != 0))
+        return 0;
+
+    return dbus_serial;
+}
+
+/* Wait for the reply to serial, skipping signals and anything else that
+ * arrives first.  Returns DBUS_METHOD_RETURN or DBUS_ERROR with the
+ * reply's string (for an error, the message or else the error name) in
+ * out, or -1 if the connection failed.
+*/
+static int
+dbus_reply(const uint32_t serial, char * const out, const size_t out_len)
+{
+    unsigned char   fixed[DBUS_FIXED_HDR_LEN];
+    unsigned char  *msg;
+    const char     *err_name, *sig, *str;
+    uint32_t        body_len, fields_len, reply_serial, len;
+    size_t          hdr_len, total, off, end;
+    int             swap, type;
+    uint8_t         code, sig_len;
+
+    while(1)
+    {
+        if(read_all(fixed, sizeof(fixed)) != 0)
+            return -1;
+
+        swap       = (fixed[0] != host_endian());
+        type       = fixed[1];
+        body_len   = get_u32(fixed + 4, swap);
+        fields_len = get_u32(fixed + 12, swap);
+
+        hdr_len = (DBUS_FIXED_HDR_LEN + (size_t)fields_len + 7) & ~(size_t)7;
+        total   = hdr_len + body_len;
+        if(fields_len > FIREWD_DBUS_MAX_MSG || total > FIREWD_DBUS_MAX_MSG)
+            return -1;
+
+        if((msg = malloc(total)) == NULL)
+            return -1;
+        memcpy(msg, fixed, sizeof(fixed));
+        if(read_all(msg + sizeof(fixed), total - sizeof(fixed)) != 0)
+        {
+            free(msg);
+            return -1;
+        }
+
+        /* Pick out the header fields we care about.
+        */
+        err_name     = NULL;
+        sig          = "";
+        reply_serial = 0;
+        off          = DBUS_FIXED_HDR_LEN;
+        end          = DBUS_FIXED_HDR_LEN + fields_len;
+
+        while(1)
+        {
+            off = (off + 7) & ~(size_t)7;
+            if(off + 3 > end)
+                break;
+
+            code    = msg[off];
+            sig_len = msg[off+1];
+            if(off + 3 + sig_len > end || sig_len != 1)
+                break;
+            off += 3 + sig_len;
+
+            switch(msg[off - 2])
+            {
+                case 'u':
+                    off = (off + 3) & ~(size_t)3;
+                    if(off + 4 > end)
+                        goto bad_msg;
+                    if(code == DBUS_HDR_REPLY_SERIAL)
+                        reply_serial = get_u32(msg + off, swap);
+                    off += 4;
+                    break;
+                case 's':
+                case 'o':
+                    off = (off + 3) & ~(size_t)3;
+                    if(off + 4 > end)
+                        goto bad_msg;
+                    len = get_u32(msg + off, swap);
+                    if(off + 4 + len + 1 > end)
+                        goto bad_msg;
+                    if(code == DBUS_HDR_ERROR_NAME)
+                        err_name = (const char *)(msg + off + 4);
+                    off += 4 + len + 1;
+                    break;
+                case 'g':
+                    len = msg[off];
+                    if(off + len + 2 > end)
+                        goto bad_msg;
+                    if(code == DBUS_HDR_SIGNATURE)
+                        sig = (const char *)(msg + off + 1);
+                    off += len + 2;
+                    break;
+                default:
+                    goto bad_msg;
+            }
+        }
+
+        if((type == DBUS_METHOD_RETURN || type == DBUS_ERROR)
+                && reply_serial == serial)
+        {
+            out[0] = '\0';
+            if(sig[0] == 's' && body_len >= 4)
+            {
+                len = get_u32(msg + hdr_len, swap);
+                str = (const char *)(msg + hdr_len + 4);
+                if(hdr_len + 4 + (size_t)len < total)
+                    strlcpy(out, str, (len + 1 < out_len) ? len + 1 : out_len);
+            }
+            else if(type == DBUS_ERROR && err_name != NULL)
+                strlcpy(out, err_name, out_len);
+
+            free(msg);
+            return type;
+        }
+
+        free(msg);
+    }
+
+bad_msg:
+    free(msg);
+    return -1;
+}
+
+/* SASL EXTERNAL authentication, as the user we are running as.
+*/
+static int
+dbus_auth(void)
+{
+    char            uid_str[32], auth[128], line[256];
+    unsigned char   c;
+    size_t          i, len = 0;
+
+    snprintf(uid_str, sizeof(uid_str), "%u", (unsigned int)getuid());
+
+    strlcpy(auth, "AUTH EXTERNAL ", sizeof(auth));
+    len = strlen(auth);
+    for(i=0; uid_str[i] != '\0' && len + 3 < sizeof(auth); i++, len += 2)
+        snprintf(auth + len, sizeof(auth) - len, "%02x",
+            (unsigned char)uid_str[i]);
+    strlcat(auth, "\r\n", sizeof(auth));
+
+    /* A single nul byte comes first.
+    */
+    c = '\0';
+    if(write_all(&c, 1) != 0
+            || write_all((unsigned char *)auth, strlen(auth)) != 0)
+        return -1;
+
+    for(len=0; len < sizeof(line)-1; len++)
+    {
+        if(read_all(&c, 1) != 0)
+            return -1;
+        line[len] = c;
+        if(c == '\n')
+            break;
+    }
+    line[len] = '\0';
+
+    if(strncmp(line, "OK ", 3) != 0)
+        return -1;
+
+    return write_all((unsigned char *)"BEGIN\r\n", strlen("BEGIN\r\n"));
+}
+
+static void
+dbus_disconnect(void)
+{
+    if(dbus_sock >= 0)
+        close(dbus_sock);
+    dbus_sock = -1;
+    return;
+}
+
+static int
+dbus_connect(void)
+{
+    struct sockaddr_un  addr;
+    const char         *env;
+    char                reply[256];
+    uint32_t            serial;
+
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strlcpy(addr.sun_path, FIREWD_DBUS_SOCKET, sizeof(addr.sun_path));
+
+    /* Only a plain unix:path= address is understood here.
+    */
+    env = getenv("DBUS_SYSTEM_BUS_ADDRESS");
+    if(env != NULL && strncmp(env, "unix:path=", strlen("unix:path=")) == 0)
+    {
+        strlcpy(addr.sun_path, env + strlen("unix:path="), sizeof(addr.sun_path));
+        addr.sun_path[strcspn(addr.sun_path, ",;")] = '\0';
+    }
+
+    if((dbus_sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+
+    if(connect(dbus_sock, (struct sockaddr *)&addr, sizeof(addr)) != 0
+            || dbus_auth() != 0)
+    {
+        dbus_disconnect();
+        return -1;
+    }
+
+    serial = dbus_call("org.freedesktop.DBus", "/org/freedesktop/DBus",
+            "org.freedesktop.DBus", "Hello", NULL, NULL);
+    if(serial == 0
+            || dbus_reply(serial, reply, sizeof(reply)) != DBUS_METHOD_RETURN)
+    {
+        dbus_disconnect();
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Connect to the system bus.  Returns 0 on success and -1 on error.
+*/
+int
+firewd_dbus_open(void)
+{
+    int res = 0;
+
+    pthread_mutex_lock(&dbus_mutex);
+    if(dbus_sock < 0)
+        res = dbus_connect();
+    pthread_mutex_unlock(&dbus_mutex);
+
+    if(res != 0)
+        log_msg(LOG_WARNING, "firewd_dbus_open() could not connect to the system bus: %s",
+            errno ? strerror(errno) : "authentication failed");
+
+    return res;
+}
+
+void
+firewd_dbus_close(void)
+{
+    pthread_mutex_lock(&dbus_mutex);
+    dbus_disconnect();
+    pthread_mutex_unlock(&dbus_mutex);
+    return;
+}
+
+/* Run iptables arguments through firewalld's direct.passthrough method,
+ * the D-Bus equivalent of 'firewall-cmd --direct --passthrough'.  args
+ * is split on white space.  Returns 0 with the command output in out, 1
+ * if firewalld reported an error (with the error message in out), and -1
+ * if firewalld could not be reached.  A dropped connection is reopened
+ * once.
+*/
+int
+firewd_dbus_passthrough(const char * const ipv, const char * const args,
+        char * const out, const size_t out_len)
+{
+    unsigned char   body_data[DBUS_BODY_BUFSIZE];
+    dbus_buf_t      body = { body_data, 0, sizeof(body_data), 0 };
+    char            arg_buf[DBUS_BODY_BUFSIZE];
+    char           *tok, *save = NULL;
+    size_t          arr_off;
+    uint32_t        arr_len, serial;
+    int             tries, type = -1, num_args = 0;
+
+    strlcpy(arg_buf, args, sizeof(arg_buf));
+
+    put_str(&body, ipv);
+    put_u32(&body, 0);
+    arr_off = body.len;
+
+    for(tok = strtok_r(arg_buf, " \t\n", &save); tok != NULL;
+            tok = strtok_r(NULL, " \t\n", &save))
+    {
+        /* There is no shell to redirect stderr for.
+        */
+        if(strcmp(tok, "2>&1") == 0)
+            continue;
+        if(++num_args > FIREWD_DBUS_MAX_ARGS)
+            return -1;
+        put_str(&body, tok);
+    }
+
+    arr_len = body.len - arr_off;
+    memcpy(body.data + arr_off - 4, &arr_len, 4);
+
+    if(body.err)
+        return -1;
+
+    pthread_mutex_lock(&dbus_mutex);
+
+    for(tries=0; tries < 2 && type < 0; tries++)
+    {
+        if(dbus_sock < 0 && dbus_connect() != 0)
+            break;
+
+        serial = dbus_call(FIREWD_DBUS_NAME, FIREWD_DBUS_PATH,
+                FIREWD_DBUS_DIRECT, "passthrough", "sas", &body);
+        if(serial != 0)
+            type = dbus_reply(serial, out, out_len);
+
+        if(type < 0)
+            dbus_disconnect();
+    }
+
+    pthread_mutex_unlock(&dbus_mutex);
+
+    if(type < 0)
+        return -1;
+
+    return (type == DBUS_METHOD_RETURN) ? 0 : 1;
+}
+
+#endif /* FIREWALL_FIREWALLD */
+
+/***EOF***/
@@ -0,0 +1,52 @@
+/*
+ *****************************************************************************
+ *
+ * File:    firewd_dbus.h
+ *
+ * Purpose: Header file for firewd_dbus.c - a minimal firewalld D-Bus client.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef FIREWD_DBUS_H
+#define FIREWD_DBUS_H
+
+#define FIREWD_DBUS_SOCKET      "/var/run/dbus/system_bus_socket"
+#define FIREWD_DBUS_TIMEOUT     25000   /* ms to wait for a reply */
+#define FIREWD_DBUS_MAX_MSG     (1 << 20)
+#define FIREWD_DBUS_MAX_ARGS    64
+
+#define FIREWD_DBUS_NAME        "org.fedoraproject.FirewallD1"
+#define FIREWD_DBUS_PATH        "/org/fedoraproject/FirewallD1"
+#define FIREWD_DBUS_DIRECT      "org.fedoraproject.FirewallD1.direct"
+
+/* Prototypes
+*/
+int firewd_dbus_open(void);
+void firewd_dbus_close(void);
+int firewd_dbus_passthrough(const char * const ipv, const char * const args,
+        char * const out, const size_t out_len);
+
+#endif /* FIREWD_DBUS_H */
+
+/***EOF***/
@@ -0,0 +1,545 @@
+/*
+ *****************************************************************************
+ *
+ * File:    flight_recorder.c
+ *
+ * Purpose: A record of the last SPA packet verdicts per thread, kept in
+ *          memory so a failed knock can be looked into without LOG_DEBUG.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "flight_recorder.h"
+#include "fwknopd_errors.h"
+#include "mem_acct.h"
+#include "log_msg.h"
+#include "utils.h"
+
+/* One verdict.  seq is odd while the owning thread is writing the entry,
+ * and a reader keeps its copy only if seq was even and unchanged across
+ * the copy (a seqlock), so recording never waits for a dump.
+*/
+typedef struct fr_entry
+{
+    uint32_t            seq;
+    uint8_t             reason;
+    int                 fko_res;
+    uint32_t            sdp_id;
+    uint32_t            latency_us;
+    time_t              when;
+    unsigned long long  mono_ns;
+    spa_addr_t          src;
+    spa_trace_t         trace;      /* id is 0 unless traced */
+} fr_entry_t;
+
+/* The verdicts of one thread.  Only the owning thread writes to a ring.
+ * The ring of a thread that exits is kept (its verdicts stay
+ * dumpable) and handed to the next thread that needs one.
+*/
+typedef struct fr_ring
+{
+    struct fr_ring     *next;
+    int                 exited;
+    unsigned long long  head;
+    fr_entry_t          entries[];
+} fr_ring_t;
+
+typedef struct fr_reason_info
+{
+    const char *name;
+    const char *stage;
+    const char *verdict;
+} fr_reason_info_t;
+
+static const fr_reason_info_t fr_reasons[FR_REASONS] = {
+    { "none",               "done",     "granted" },
+    { "rate_limited",       "precheck", "dropped" },
+    { "malformed",          "precheck", "dropped" },
+    { "other_shard",        "precheck", "dropped" },
+    { "forwarded",          "precheck", "dropped" },
+    { "replay",             "replay",   "replay"  },
+    { "shed",               "queue",    "dropped" },
+    { "unknown_sdp_id",     "access",   "denied"  },
+    { "no_stanza",          "access",   "denied"  },
+    { "stanza_expired",     "access",   "denied"  },
+    { "decrypt_failed",     "decrypt",  "denied"  },
+    { "packet_age",         "validate", "denied"  },
+    { "bad_message",        "validate", "denied"  },
+    { "legacy_denied",      "policy",   "denied"  },
+    { "gpg_signer",         "policy",   "denied"  },
+    { "source_denied",      "policy",   "denied"  },
+    { "username_denied",    "policy",   "denied"  },
+    { "access_denied",      "policy",   "denied"  },
+    { "action_failed",      "action",   "denied"  }
+};
+
+static uint32_t         fr_size = 0;    /* 0 when disabled */
+static fr_ring_t       *fr_rings = NULL;
+static pthread_mutex_t  fr_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t    fr_key;
+static pthread_once_t   fr_key_once = PTHREAD_ONCE_INIT;
+
+static void
+fr_key_destroy(void *ring)
+{
+    __atomic_store_n(&(((fr_ring_t *)ring)->exited), 1, __ATOMIC_RELEASE);
+}
+
+static void
+fr_key_init(void)
+{
+    pthread_key_create(&fr_key, fr_key_destroy);
+}
+
+static fr_ring_t *
+fr_ring_get(void)
+{
+    fr_ring_t  *ring;
+
+    pthread_once(&fr_key_once, fr_key_init);
+
+    if((ring = pthread_getspecific(fr_key)) != NULL)
+        return ring;
+
+    pthread_mutex_lock(&fr_mutex);
+
+    for(ring = fr_rings; ring != NULL; ring = ring->next)
+        if(__atomic_load_n(&(ring->exited), __ATOMIC_ACQUIRE))
+            break;
+
+    if(ring != NULL)
+        ring->exited = 0;
+    else if((ring = mem_calloc(MEM_TAG_FLIGHT_RECORDER, 1,
+            sizeof(fr_ring_t) + fr_size * sizeof(fr_entry_t))) != NULL)
+    {
+        ring->next = fr_rings;
+        fr_rings   = ring;
+    }
+
+    pthread_mutex_unlock(&fr_mutex);
+
+    if(ring != NULL)
+        pthread_setspecific(fr_key, ring);
+
+    return ring;
+}
+
+static unsigned long long
+fr_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return((unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec);
+}
+
+/* Set up the flight recorder if FLIGHT_RECORDER_SIZE is not 0.  The size
+ * is rounded up to a power of two.  Returns 0 on success.
+*/
+int
+flight_recorder_start(fko_srv_options_t *opts)
+{
+    int         size, is_err;
+    uint32_t    n = 1;
+
+    size = strtol_wrapper(opts->config[CONF_FLIGHT_RECORDER_SIZE],
+            0, RCHK_MAX_FLIGHT_RECORDER_SIZE, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid FLIGHT_RECORDER_SIZE value.");
+        return(-1);
+    }
+
+    if(size == 0)
+        return(0);
+
+    while(n < (uint32_t)size)
+        n <<= 1;
+    fr_size = n;
+
+    log_msg(LOG_INFO, "Recording the last %u SPA verdicts per thread.", fr_size);
+    return(0);
+}
+
+int
+flight_recorder_enabled(void)
+{
+    return(fr_size != 0);
+}
+
+/* Note when processing of a packet started, for the latency of its
+ * verdict.
+*/
+void
+flight_recorder_begin(spa_pkt_info_t *spa_pkt)
+{
+    if(fr_size == 0)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &(spa_pkt->accept_ts));
+}
+
+/* Record the verdict on a packet.  fko_res is the error that decided it
+ * (an FKO or fwknopd error code), or 0.
+*/
+void
+flight_recorder_record(const spa_pkt_info_t *spa_pkt,
+        const fr_reason_t reason, const int fko_res)
+{
+    fr_ring_t          *ring;
+    fr_entry_t         *e;
+    unsigned long long  now, start, head;
+    uint32_t            seq;
+
+    if(fr_size == 0 || (ring = fr_ring_get()) == NULL)
+        return;
+
+    now   = fr_now_ns();
+    start = (unsigned long long)spa_pkt->accept_ts.tv_sec * 1000000000ULL
+        + spa_pkt->accept_ts.tv_nsec;
+
+    head = ring->head;
+    e    = &(ring->entries[head & (fr_size - 1)]);
+    seq  = e->seq;
+
+    __atomic_store_n(&(e->seq), seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    e->reason     = reason;
+    e->fko_res    = fko_res;
+    e->sdp_id     = spa_pkt->sdp_id;
+    e->when       = clock_cache_now();
+    e->mono_ns    = now;
+    e->src        = spa_pkt->packet_src_addr;
+    e->latency_us = (now > start && (now - start) / 1000 < UINT32_MAX)
+        ? (uint32_t)((now - start) / 1000) : 0;
+    e->trace      = spa_pkt->trace;
+
+    __atomic_store_n(&(e->seq), seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&(ring->head), head + 1, __ATOMIC_RELEASE);
+}
+
+/* Parse "sdp_id=N&src=ADDR&failed=1&trace=ID&traced=1&limit=N" (any
+ * subset, in any order, ending at a space or the end of the string).
+ * Returns 0 on success.
+*/
+int
+flight_recorder_parse_query(const char *query, flight_recorder_filter_t *filter)
+{
+    char        buf[256], *tok, *val, *end, *save = NULL;
+    size_t      len;
+    int         is_err;
+
+    memset(filter, 0x0, sizeof(*filter));
+    filter->limit = FLIGHT_RECORDER_DEF_LIMIT;
+
+    if(query == NULL || *query != '?')
+        return(0);
+
+    query++;
+    len = strcspn(query, " \r\n");
+    if(len >= sizeof(buf))
+        return(-1);
+    memcpy(buf, query, len);
+    buf[len] = '\0';
+
+    for(tok = strtok_r(buf, "&", &save); tok != NULL;
+            tok = strtok_r(NULL, "&", &save))
+    {
+        if((val = strchr(tok, '=')) == NULL)
+            return(-1);
+        *val++ = '\0';
+
+        if(strcmp(tok, "sdp_id") == 0)
+        {
+            filter->sdp_id = strtol_wrapper(val, 1, INT32_MAX,
+                    NO_EXIT_UPON_ERR, &is_err);
+            if(is_err != FKO_SUCCESS)
+                return(-1);
+        }
+        else if(strcmp(tok, "src") == 0)
+        {
+            if(spa_addr_pton(val, &(filter->src)) != 1)
+                return(-1);
+            filter->have_src = 1;
+        }
+        else if(strcmp(tok, "failed") == 0)
+            filter->failed_only = (strcmp(val, "0") != 0);
+        else if(strcmp(tok, "trace") == 0)
+        {
+            errno = 0;
+            filter->trace_id = strtoull(val, &end, 10);
+            if(errno != 0 || end == val || *end != '\0' || filter->trace_id == 0)
+                return(-1);
+        }
+        else if(strcmp(tok, "traced") == 0)
+            filter->traced_only = (strcmp(val, "0") != 0);
+        else if(strcmp(tok, "limit") == 0)
+        {
+            filter->limit = strtol_wrapper(val, 1, INT32_MAX,
+                    NO_EXIT_UPON_ERR, &is_err);
+            if(is_err != FKO_SUCCESS)
+                return(-1);
+        }
+        else
+            return(-1);
+    }
+
+    return(0);
+}
+
+static int
+fr_wanted(const fr_entry_t *e, const flight_recorder_filter_t *filter)
+{
+    if(filter->sdp_id != 0 && e->sdp_id != filter->sdp_id)
+        return 0;
+    if(filter->failed_only && e->reason == FR_OK)
+        return 0;
+    if(filter->traced_only && e->trace.id == 0)
+        return 0;
+    if(filter->trace_id != 0 && e->trace.id != filter->trace_id)
+        return 0;
+    if(filter->have_src && (e->src.family != filter->src.family
+            || memcmp(e->src.addr, filter->src.addr, sizeof(e->src.addr)) != 0))
+        return 0;
+    return 1;
+}
+
+static int
+fr_newest_first(const void *a, const void *b)
+{
+    const fr_entry_t *ea = a, *eb = b;
+
+    return (ea->mono_ns < eb->mono_ns) - (ea->mono_ns > eb->mono_ns);
+}
+
+/* Copy the wanted verdicts of all threads into a new array, newest
+ * first.  Returns the number of verdicts (the array is NULL when there
+ * are none), or -1 if out of memory.
+*/
+static int
+fr_collect(const flight_recorder_filter_t *filter, fr_entry_t **r_entries)
+{
+    fr_ring_t          *ring;
+    fr_entry_t         *entries = NULL, *e;
+    unsigned long long  head, i;
+    uint32_t            seq;
+    int                 num_rings = 0, n = 0;
+
+    *r_entries = NULL;
+
+    if(fr_size == 0)
+        return 0;
+
+    pthread_mutex_lock(&fr_mutex);
+
+    for(ring = fr_rings; ring != NULL; ring = ring->next)
+        num_rings++;
+
+    if(num_rings > 0 && (entries = calloc((size_t)num_rings * fr_size,
+            sizeof(fr_entry_t))) == NULL)
+    {
+        pthread_mutex_unlock(&fr_mutex);
+        return -1;
+    }
+
+    for(ring = fr_rings; ring != NULL; ring = ring->next)
+    {
+        head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+        for(i = head > fr_size ? head - fr_size : 0; i < head; i++)
+        {
+            e   = &(ring->entries[i & (fr_size - 1)]);
+            seq = __atomic_load_n(&(e->seq), __ATOMIC_ACQUIRE);
+            if(seq == 0 || (seq & 1))
+                continue;
+
+            memcpy(&(entries[n]), e, sizeof(*e));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if(__atomic_load_n(&(e->seq), __ATOMIC_RELAXED) != seq)
+                continue;
+
+            if(fr_wanted(&(entries[n]), filter))
+                n++;
+        }
+    }
+
+    pthread_mutex_unlock(&fr_mutex);
+
+    if(n == 0)
+    {
+        free(entries);
+        return 0;
+    }
+
+    qsort(entries, n, sizeof(fr_entry_t), fr_newest_first);
+    *r_entries = entries;
+    return n;
+}
+
+static void
+fr_format(const fr_entry_t *e, char *buf, const size_t len)
+{
+    const fr_reason_info_t *info = &(fr_reasons[e->reason]);
+    char        src[MAX_IPV46_STR_LEN];
+    char        when[32];
+    struct tm   tm;
+    int         i, n;
+
+    localtime_r(&(e->when), &tm);
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S%z", &tm);
+
+    n = snprintf(buf, len,
+        "%s src=%s sdp_id=%u verdict=%s stage=%s reason=%s latency_us=%u",
+        when, spa_addr_ntop(&(e->src), src, sizeof(src)), e->sdp_id,
+        info->verdict, info->stage, e->reason == FR_OK ? "-" : info->name,
+        e->latency_us);
+
+    if(e->fko_res != 0 && n > 0 && (size_t)n < len)
+        n += snprintf(buf + n, len - n, " error=\"%s\"", get_errstr(e->fko_res));
+
+    /* The stage times of a traced packet, for joining with the client's
+     * --trace-file.  Stages it did not go through are left out.
+    */
+    if(e->trace.id == 0 || n <= 0 || (size_t)n >= len)
+        return;
+
+    n += snprintf(buf + n, len - n, " trace_id=%llu start_ns=%llu",
+        (unsigned long long)e->trace.id,
+        (unsigned long long)e->trace.start_ns);
+
+    for(i=0; i < BENCH_STAGES && n > 0 && (size_t)n < len; i++)
+        if(e->trace.stage_us[i] != 0)
+            n += snprintf(buf + n, len - n, " %s_us=%u",
+                bench_stage_name(i), e->trace.stage_us[i]);
+}
+
+/* Append the wanted verdicts to body, one per line, newest first.
+ * Returns the number written or -1 if out of memory.
+*/
+int
+flight_recorder_write(bstring body, const flight_recorder_filter_t *filter)
+{
+    fr_entry_t *entries;
+    char        line[1024];
+    int         i, n;
+
+    if((n = fr_collect(filter, &entries)) <= 0)
+        return n;
+
+    if(filter->limit > 0 && n > filter->limit)
+        n = filter->limit;
+
+    for(i=0; i < n; i++)
+    {
+        fr_format(&(entries[i]), line, sizeof(line));
+        if(bformata(body, "%s\n", line) != BSTR_OK)
+        {
+            free(entries);
+            return -1;
+        }
+    }
+
+    free(entries);
+    return n;
+}
+
+/* Dump the recorded verdicts (for one SDP ID if sdp_id is not 0) with
+ * the SIGUSR1 config dump.
+*/
+void
+dump_flight_recorder(const fko_srv_options_t *opts, const uint32_t sdp_id)
+{
+    flight_recorder_filter_t    filter;
+    fr_entry_t *entries;
+    char        line[1024];
+    int         i, n, opened = 0;
+    FILE       *dest = NULL;
+
+    if(fr_size == 0)
+        return;
+
+    if(opts->config[CONF_CONFIG_DUMP_OUTPUT_PATH] != NULL &&
+       opts->foreground == 0)
+    {
+        dest = fopen(opts->config[CONF_CONFIG_DUMP_OUTPUT_PATH], "a");
+        if(dest == NULL)
+        {
+            fprintf(stderr, "ERROR opening file for dump_config output: %s\n",
+                    opts->config[CONF_CONFIG_DUMP_OUTPUT_PATH]);
+            dest = stdout;
+        }
+        else
+        {
+            opened = 1;
+        }
+    }
+    else
+    {
+        dest = stdout;
+    }
+
+    memset(&filter, 0x0, sizeof(filter));
+    filter.sdp_id = sdp_id;
+
+    n = fr_collect(&filter, &entries);
+
+    fprintf(dest, "Recent SPA verdicts (newest first):\n");
+    for(i=0; i < n; i++)
+    {
+        fr_format(&(entries[i]), line, sizeof(line));
+        fprintf(dest, "    %s\n", line);
+    }
+    if(n < 0)
+        fprintf(dest, "    (out of memory)\n");
+    fprintf(dest, "\n");
+
+    free(entries);
+
+    fflush(dest);
+    if(opened)
+        fclose(dest);
+}
+
+/* Free the rings.  Called at exit once the threads that record verdicts
+ * and the metrics listener have stopped.
+*/
+void
+flight_recorder_stop(void)
+{
+    fr_ring_t  *ring, *next;
+
+    pthread_mutex_lock(&fr_mutex);
+
+    fr_size = 0;
+    for(ring = fr_rings; ring != NULL; ring = next)
+    {
+        next = ring->next;
+        mem_free(MEM_TAG_FLIGHT_RECORDER, ring);
+    }
+    fr_rings = NULL;
+
+    pthread_mutex_unlock(&fr_mutex);
+}
+
+/***EOF***/
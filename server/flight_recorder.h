@@ -0,0 +1,95 @@
+/*
+ *****************************************************************************
+ *
+ * File:    flight_recorder.h
+ *
+ * Purpose: Header file for flight_recorder.c.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include "bstrlib.h"
+
+/* Why a packet did not get access, in the order of the processing stages
+ * (the stage reached is derived from the reason).  FR_OK is a grant.
+*/
+typedef enum {
+    FR_OK = 0,
+    FR_RATE_LIMITED,
+    FR_MALFORMED,
+    FR_OTHER_SHARD,
+    FR_FORWARDED,
+    FR_REPLAY,
+    FR_SHED,
+    FR_UNKNOWN_ID,
+    FR_NO_STANZA,
+    FR_STANZA_EXPIRED,
+    FR_DECRYPT,
+    FR_PKT_AGE,
+    FR_BAD_MSG,
+    FR_LEGACY_DENIED,
+    FR_GPG_SIGNER,
+    FR_SRC_DENIED,
+    FR_USER_DENIED,
+    FR_ACCESS_DENIED,
+    FR_ACTION_FAILED,
+    FR_REASONS
+} fr_reason_t;
+
+/* What to dump.  Zero values match everything.
+*/
+typedef struct flight_recorder_filter
+{
+    uint32_t    sdp_id;
+    int         have_src;
+    spa_addr_t  src;
+    int         failed_only;
+    uint64_t    trace_id;
+    int         traced_only;
+    int         limit;
+} flight_recorder_filter_t;
+
+/* Largest number of verdicts returned by one /verdicts request unless it
+ * asks for fewer.
+*/
+#define FLIGHT_RECORDER_DEF_LIMIT   1000
+
+/* Prototypes
+*/
+int flight_recorder_start(fko_srv_options_t *opts);
+int flight_recorder_enabled(void);
+void flight_recorder_begin(spa_pkt_info_t *spa_pkt);
+void flight_recorder_record(const spa_pkt_info_t *spa_pkt,
+        const fr_reason_t reason, const int fko_res);
+int flight_recorder_parse_query(const char *query,
+        flight_recorder_filter_t *filter);
+int flight_recorder_write(bstring body, const flight_recorder_filter_t *filter);
+void dump_flight_recorder(const fko_srv_options_t *opts, const uint32_t sdp_id);
+void flight_recorder_stop(void);
+
+#endif /* FLIGHT_RECORDER_H */
+
+/***EOF***/
@@ -0,0 +1,418 @@
+/*
+ *****************************************************************************
+ *
+ * File:    fw_commit.c
+ *
+ * Purpose: A single thread that applies granted SPA requests to the
+ *          firewall.  Adding the rules means waiting on iptables,
+ *          firewall-cmd and friends, so the thread that authorized the
+ *          request only queues it here and goes back to packets.  Requests
+ *          are applied in the order they were granted, one at a time under
+ *          spa_grant_mutex.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "fw_commit.h"
+#include "fw_util.h"
+#include "ha_sync.h"
+#include "access.h"
+#include "benchmark.h"
+#include "rcu.h"
+#include "log_msg.h"
+#include "utils.h"
+#include "cpu_affinity.h"
+
+/* A queued grant.  The SPA data is copied out of the packet's arena and
+ * FKO context, which are both gone by the time the request is applied.
+*/
+typedef struct fw_commit_job
+{
+    acc_stanza_t           *acc;
+    int                     stanza_num;
+    spa_data_t              spadat;
+    char                    nat_access[MAX_SPA_NAT_ACCESS_SIZE];
+    service_data_list_t    *services;
+    time_t                  queued;
+} fw_commit_job_t;
+
+/* Queue state.  Jobs are preallocated and move between the free stack
+ * and the ready queue as in spa_workers.c.
+*/
+typedef struct fw_commit_queue
+{
+    fko_srv_options_t  *opts;
+    pthread_t           thread;
+    fw_commit_job_t    *jobs;
+    fw_commit_job_t   **free_jobs;
+    int                 num_free;
+    fw_commit_job_t   **queue;
+    int                 queue_head;
+    int                 queue_count;
+    int                 busy;           /* A job is being applied */
+    int                 stop;
+    int                 dropping;
+    unsigned long       dropped;
+    unsigned long       applied;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+    pthread_cond_t      idle;           /* Signaled when the queue empties */
+} fw_commit_queue_t;
+
+static fw_commit_queue_t    fw_commit;
+static volatile int         fw_commit_active = 0;
+
+/* Copy the parts of the SPA data the firewall code uses into the job.
+ * Returns 0 on success and -1 if the service list could not be copied.
+*/
+static int
+job_copy_spadat(fw_commit_job_t *job, const spa_data_t * const spadat)
+{
+    const service_data_list_t  *s;
+    service_data_list_t        *nodes;
+    service_data_t             *data;
+    int                         i, n = 0;
+
+    job->spadat = *spadat;
+    job->spadat.username          = NULL;
+    job->spadat.version           = NULL;
+    job->spadat.spa_message       = NULL;
+    job->spadat.server_auth       = NULL;
+    job->spadat.nat_access        = NULL;
+    job->spadat.service_data_list = NULL;
+    job->spadat.arena             = NULL;
+    job->services                 = NULL;
+
+    /* use_src_ip points at one of the address strings in the struct.
+    */
+    if(spadat->use_src_ip == spadat->pkt_source_ip)
+        job->spadat.use_src_ip = job->spadat.pkt_source_ip;
+    else
+        job->spadat.use_src_ip = job->spadat.spa_message_src_ip;
+
+    if(spadat->nat_access != NULL)
+    {
+        strlcpy(job->nat_access, spadat->nat_access, sizeof(job->nat_access));
+        job->spadat.nat_access = job->nat_access;
+    }
+
+    for(s = spadat->service_data_list; s != NULL; s = s->next)
+        n++;
+
+    if(n == 0)
+        return 0;
+
+    nodes = calloc(n, sizeof(service_data_list_t) + sizeof(service_data_t));
+    if(nodes == NULL)
+        return -1;
+    data = (service_data_t *)(nodes + n);
+
+    for(i=0, s = spadat->service_data_list; s != NULL; i++, s = s->next)
+    {
+        data[i] = *(s->service_data);
+        nodes[i].service_data = &(data[i]);
+        nodes[i].next = (i+1 < n) ? &(nodes[i+1]) : NULL;
+    }
+
+    job->services = nodes;
+    job->spadat.service_data_list = nodes;
+    return 0;
+}
+
+static void
+fw_commit_apply(fw_commit_job_t *job)
+{
+    fko_srv_options_t  *opts = fw_commit.opts;
+    acc_stanza_t       *acc  = job->acc;
+    struct timespec     ts;
+
+    rcu_read_lock();
+
+    /* The controller may have changed or revoked the client's access
+     * while the request was queued, so look the stanza up again.
+    */
+    if(opts->rt->sdp_mode)
+        acc = acc_sdp_id_lookup(opts, job->spadat.sdp_id);
+
+    if(acc == NULL)
+    {
+        log_msg(LOG_WARNING,
+            "[%s] SDP Client ID %"PRIu32" no longer has access, dropping queued request.",
+            job->spadat.pkt_source_ip, job->spadat.sdp_id);
+    }
+    else if(pthread_mutex_lock(&(opts->spa_grant_mutex)))
+    {
+        log_msg(LOG_ERR, "Mutex lock error.");
+    }
+    else
+    {
+        bench_stage_start(&ts);
+        if(process_spa_request(opts, acc, &(job->spadat)) == 0)
+            ha_sync_grant(&(job->spadat));
+        bench_stage_end(BENCH_STAGE_FIREWALL, &ts);
+        pthread_mutex_unlock(&(opts->spa_grant_mutex));
+
+        log_msg(LOG_DEBUG,
+            "[%s] (stanza #%d) Firewall access applied %ld second(s) after it was granted.",
+            job->spadat.pkt_source_ip, job->stanza_num,
+            (long)(time(NULL) - job->queued));
+    }
+
+    rcu_read_unlock();
+
+    free(job->services);
+    job->services = NULL;
+    return;
+}
+
+static void *
+fw_commit_thread(void *arg)
+{
+    fw_commit_job_t    *job;
+
+    cpu_affinity_set(CPU_ROLE_HOUSEKEEPING);
+
+    pthread_mutex_lock(&(fw_commit.mutex));
+
+    while(1)
+    {
+        while(fw_commit.queue_count == 0 && ! fw_commit.stop)
+            pthread_cond_wait(&(fw_commit.cond), &(fw_commit.mutex));
+
+        /* Apply whatever is queued before leaving.
+        */
+        if(fw_commit.queue_count == 0)
+            break;
+
+        job = fw_commit.queue[fw_commit.queue_head];
+        fw_commit.queue_head = (fw_commit.queue_head + 1) % FW_COMMIT_QUEUE_LEN;
+        fw_commit.queue_count--;
+        fw_commit.busy = 1;
+
+        pthread_mutex_unlock(&(fw_commit.mutex));
+
+        fw_commit_apply(job);
+
+        pthread_mutex_lock(&(fw_commit.mutex));
+        fw_commit.free_jobs[fw_commit.num_free++] = job;
+        fw_commit.applied++;
+        fw_commit.busy = 0;
+        if(fw_commit.queue_count == 0)
+            pthread_cond_broadcast(&(fw_commit.idle));
+    }
+
+    fw_commit.busy = 0;
+    pthread_cond_broadcast(&(fw_commit.idle));
+    pthread_mutex_unlock(&(fw_commit.mutex));
+
+    return NULL;
+}
+
+static void
+fw_commit_free(void)
+{
+    free(fw_commit.jobs);
+    free(fw_commit.free_jobs);
+    free(fw_commit.queue);
+    fw_commit.jobs      = NULL;
+    fw_commit.free_jobs = NULL;
+    fw_commit.queue     = NULL;
+
+    pthread_cond_destroy(&(fw_commit.cond));
+    pthread_cond_destroy(&(fw_commit.idle));
+    pthread_mutex_destroy(&(fw_commit.mutex));
+    return;
+}
+
+/* Start the firewall commit thread if ENABLE_FW_COMMIT_THREAD is set.
+ * Returns 0 when the thread is running or is not wanted (requests are
+ * then applied on the thread that granted them), and -1 on error.
+*/
+int
+fw_commit_start(fko_srv_options_t *opts)
+{
+    int     i;
+
+    if(fw_commit_active)
+        return 0;
+
+    /* Nothing is applied in --test mode, and benchmark timings are only
+     * meaningful when each packet is handled start to finish on one
+     * thread.
+    */
+    if(opts->test || opts->benchmark
+            || strncasecmp(opts->config[CONF_ENABLE_FW_COMMIT_THREAD], "Y", 1) != 0)
+        return 0;
+
+    memset(&fw_commit, 0x0, sizeof(fw_commit));
+    fw_commit.opts = opts;
+
+    pthread_mutex_init(&(fw_commit.mutex), NULL);
+    pthread_cond_init(&(fw_commit.cond), NULL);
+    pthread_cond_init(&(fw_commit.idle), NULL);
+
+    fw_commit.jobs      = calloc(FW_COMMIT_QUEUE_LEN, sizeof(fw_commit_job_t));
+    fw_commit.free_jobs = calloc(FW_COMMIT_QUEUE_LEN, sizeof(fw_commit_job_t *));
+    fw_commit.queue     = calloc(FW_COMMIT_QUEUE_LEN, sizeof(fw_commit_job_t *));
+    if(fw_commit.jobs == NULL || fw_commit.free_jobs == NULL
+            || fw_commit.queue == NULL)
+    {
+        log_msg(LOG_ERR, "fw_commit_start: calloc() failed");
+        fw_commit_free();
+        return -1;
+    }
+
+    for(i=0; i < FW_COMMIT_QUEUE_LEN; i++)
+        fw_commit.free_jobs[i] = &(fw_commit.jobs[i]);
+    fw_commit.num_free = FW_COMMIT_QUEUE_LEN;
+
+    if(pthread_create(&(fw_commit.thread), NULL, fw_commit_thread, NULL) != 0)
+    {
+        log_msg(LOG_ERR, "fw_commit_start: failed to start firewall commit thread");
+        fw_commit_free();
+        return -1;
+    }
+
+    fw_commit_active = 1;
+
+    log_msg(LOG_INFO, "Started firewall commit thread.");
+
+    return 0;
+}
+
+/* Let the thread apply what is queued, then join it and free the queue.
+*/
+void
+fw_commit_stop(void)
+{
+    if(! fw_commit_active)
+        return;
+
+    fw_commit_active = 0;
+
+    pthread_mutex_lock(&(fw_commit.mutex));
+    fw_commit.stop = 1;
+    pthread_cond_broadcast(&(fw_commit.cond));
+    pthread_mutex_unlock(&(fw_commit.mutex));
+
+    /* clean_exit() may be called from the commit thread itself.
+    */
+    if(! pthread_equal(fw_commit.thread, pthread_self()))
+        pthread_join(fw_commit.thread, NULL);
+
+    log_msg(LOG_DEBUG, "Firewall commit thread applied %lu requests.",
+        fw_commit.applied);
+
+    if(fw_commit.dropped > 0)
+        log_msg(LOG_WARNING,
+            "Firewall commit queue was full, %lu granted requests were dropped.",
+            fw_commit.dropped);
+
+    fw_commit_free();
+    return;
+}
+
+/* Wait until everything queued so far has been applied.  Queued jobs
+ * point to their legacy mode stanza, so a reload calls this (after its
+ * grace period, when no new jobs can refer to the old stanzas) before
+ * freeing them.
+*/
+void
+fw_commit_drain(void)
+{
+    if(! fw_commit_active)
+        return;
+
+    pthread_mutex_lock(&(fw_commit.mutex));
+    while((fw_commit.queue_count > 0 || fw_commit.busy) && ! fw_commit.stop)
+        pthread_cond_wait(&(fw_commit.idle), &(fw_commit.mutex));
+    pthread_mutex_unlock(&(fw_commit.mutex));
+    return;
+}
+
+int
+fw_commit_running(void)
+{
+    return fw_commit_active;
+}
+
+/* Queue a granted request for the commit thread.  The SPA data is
+ * copied, so the caller may release the packet as soon as this returns.
+ * Returns 0 on success and -1 if the request could not be queued.
+*/
+int
+fw_commit_dispatch(const acc_stanza_t * const acc,
+        const spa_data_t * const spadat, const int stanza_num)
+{
+    fw_commit_job_t    *job = NULL;
+    int                 first_drop = 0;
+
+    pthread_mutex_lock(&(fw_commit.mutex));
+    if(fw_commit.num_free > 0)
+    {
+        job = fw_commit.free_jobs[--fw_commit.num_free];
+    }
+    else
+    {
+        fw_commit.dropped++;
+        first_drop = ! fw_commit.dropping;
+        fw_commit.dropping = 1;
+    }
+    pthread_mutex_unlock(&(fw_commit.mutex));
+
+    if(job == NULL)
+    {
+        if(first_drop)
+            log_msg(LOG_WARNING,
+                "Firewall commit queue is full (%i requests), dropping granted requests.",
+                FW_COMMIT_QUEUE_LEN);
+        return -1;
+    }
+
+    job->acc        = (acc_stanza_t *)acc;
+    job->stanza_num = stanza_num;
+    job->queued     = time(NULL);
+
+    if(job_copy_spadat(job, spadat) != 0)
+    {
+        log_msg(LOG_ERR, "[%s] fw_commit_dispatch: calloc() failed",
+            spadat->pkt_source_ip);
+        pthread_mutex_lock(&(fw_commit.mutex));
+        fw_commit.free_jobs[fw_commit.num_free++] = job;
+        pthread_mutex_unlock(&(fw_commit.mutex));
+        return -1;
+    }
+
+    pthread_mutex_lock(&(fw_commit.mutex));
+    fw_commit.queue[(fw_commit.queue_head + fw_commit.queue_count)
+        % FW_COMMIT_QUEUE_LEN] = job;
+    fw_commit.queue_count++;
+    fw_commit.dropping = 0;
+    pthread_cond_signal(&(fw_commit.cond));
+    pthread_mutex_unlock(&(fw_commit.mutex));
+
+    return 0;
+}
+
+/***EOF***/
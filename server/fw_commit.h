@@ -0,0 +1,50 @@
+/*
+ *****************************************************************************
+ *
+ * File:    fw_commit.h
+ *
+ * Purpose: Header file for fw_commit.c.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef FW_COMMIT_H
+#define FW_COMMIT_H
+
+/* Number of granted requests that may be waiting for the firewall.
+ * Requests that are granted while the queue is full are dropped.
+*/
+#define FW_COMMIT_QUEUE_LEN     1024
+
+/* Prototypes
+*/
+int fw_commit_start(fko_srv_options_t *opts);
+void fw_commit_stop(void);
+void fw_commit_drain(void);
+int fw_commit_running(void);
+int fw_commit_dispatch(const acc_stanza_t * const acc,
+        const spa_data_t * const spadat, const int stanza_num);
+
+#endif /* FW_COMMIT_H */
+
+/***EOF***/
@@ -34,9 +34,460 @@
 #include "log_msg.h"
 #include "extcmd.h"
 #include "access.h"
+#include "metrics.h"
+#include "fwknop_probes.h"
 
-/* --DSS This is a place holder for now.  We may put the generalized external
- *       firewall script code here ( or not).
+/* Expiry times of the rules the firewall backends have added, kept in a
+ * hierarchical timing wheel so that the main loops can tell whether any
+ * rule is due without asking the firewall.  Level 0 has one slot per
+ * second, and each higher level has one slot per full turn of the level
+ * below it.  A deadline beyond the top level is parked in its last slot
+ * and re-inserted when that slot comes round.
+ *
+ * Entries may also carry an argument (CMD_CYCLE_CLOSE commands use this).
+ * Those are not counted as rule deadlines; when they come due they move to
+ * the due list and are handed back one at a time by fw_timer_pop_due().
+*/
+typedef struct fw_timer_entry
+{
+    time_t                  deadline;
+    void                   *arg;
+    struct fw_timer_entry  *next;
+} fw_timer_entry_t;
+
+static struct fw_timer_wheel
+{
+    fw_timer_entry_t   *slot[FW_TIMER_LEVELS][FW_TIMER_SLOTS];
+    fw_timer_entry_t   *due;
+    time_t              now;
+    int                 started;
+    int                 num_entries;
+    int                 num_rules;      /* Entries without an argument */
+    int                 overdue;
+    time_t              last_check;
+    time_t              adopted_until;  /* See fw_timer_adopt() */
+} fw_wheel;
+
+static pthread_mutex_t fw_wheel_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define FW_TIMER_LEVEL_SHIFT(l) (FW_TIMER_SLOT_BITS * (l))
+#define FW_TIMER_LEVEL_SPAN(l)  ((time_t)1 << FW_TIMER_LEVEL_SHIFT(l))
+
+/* Retire an entry whose deadline has passed.  Returns 1 for a rule
+ * deadline and 0 for an entry with an argument, which goes on the due list.
+*/
+static int
+wheel_fire(fw_timer_entry_t *entry)
+{
+    fw_wheel.num_entries--;
+
+    if(entry->arg != NULL)
+    {
+        entry->next  = fw_wheel.due;
+        fw_wheel.due = entry;
+        return 0;
+    }
+
+    fw_wheel.num_rules--;
+    METRIC_INC(METRIC_RULES_EXPIRED);
+    FWKNOP_PROBE1(rule_expire, entry->deadline);
+
+    free(entry);
+    return 1;
+}
+
+static void
+wheel_insert(fw_timer_entry_t *entry)
+{
+    time_t  when  = entry->deadline;
+    time_t  delta = when - fw_wheel.now;
+    int     level, idx;
+
+    if(delta <= 0)
+    {
+        fw_wheel.overdue += wheel_fire(entry);
+        return;
+    }
+
+    for(level=0; level < FW_TIMER_LEVELS-1; level++)
+        if(delta < FW_TIMER_LEVEL_SPAN(level+1))
+            break;
+
+    if(delta >= FW_TIMER_LEVEL_SPAN(FW_TIMER_LEVELS))
+        when = fw_wheel.now + FW_TIMER_LEVEL_SPAN(FW_TIMER_LEVELS) - 1;
+
+    idx = (when >> FW_TIMER_LEVEL_SHIFT(level)) & (FW_TIMER_SLOTS-1);
+
+    entry->next = fw_wheel.slot[level][idx];
+    fw_wheel.slot[level][idx] = entry;
+    return;
+}
+
+/* Move the entries of a higher level slot down to where they now belong.
+*/
+static void
+wheel_cascade(const int level, const int idx)
+{
+    fw_timer_entry_t   *entry, *next;
+
+    entry = fw_wheel.slot[level][idx];
+    fw_wheel.slot[level][idx] = NULL;
+
+    for(; entry != NULL; entry = next)
+    {
+        next = entry->next;
+        wheel_insert(entry);
+    }
+    return;
+}
+
+/* Advance the wheel by one second and return the number of deadlines
+ * that passed.
 */
+static int
+wheel_tick(void)
+{
+    fw_timer_entry_t   *entry, *next;
+    int                 level, idx, fired = 0;
+
+    fw_wheel.now++;
+
+    for(level=1; level < FW_TIMER_LEVELS; level++)
+    {
+        if((fw_wheel.now & (FW_TIMER_LEVEL_SPAN(level)-1)) != 0)
+            break;
+        wheel_cascade(level,
+            (fw_wheel.now >> FW_TIMER_LEVEL_SHIFT(level)) & (FW_TIMER_SLOTS-1));
+    }
+
+    idx   = fw_wheel.now & (FW_TIMER_SLOTS-1);
+    entry = fw_wheel.slot[0][idx];
+    fw_wheel.slot[0][idx] = NULL;
+
+    for(; entry != NULL; entry = next)
+    {
+        next = entry->next;
+        if(entry->deadline <= fw_wheel.now)
+            fired += wheel_fire(entry);
+        else
+            wheel_insert(entry);
+    }
+    return fired;
+}
+
+/* Empty the wheel.  With fire_all set every entry is treated as due
+ * (the clock jumped past the whole wheel) and the number of rule
+ * deadlines is returned; otherwise everything, including the due list,
+ * is simply dropped.
+*/
+static int
+wheel_free(const int fire_all)
+{
+    fw_timer_entry_t   *entry, *next;
+    int                 level, idx, fired = 0;
+
+    for(level=0; level < FW_TIMER_LEVELS; level++)
+    {
+        for(idx=0; idx < FW_TIMER_SLOTS; idx++)
+        {
+            for(entry = fw_wheel.slot[level][idx]; entry != NULL; entry = next)
+            {
+                next = entry->next;
+                if(fire_all)
+                    fired += wheel_fire(entry);
+                else
+                    free(entry);
+            }
+            fw_wheel.slot[level][idx] = NULL;
+        }
+    }
+
+    if(! fire_all)
+    {
+        for(entry = fw_wheel.due; entry != NULL; entry = next)
+        {
+            next = entry->next;
+            free(entry);
+        }
+        fw_wheel.due = NULL;
+    }
+
+    fw_wheel.num_entries = 0;
+    fw_wheel.num_rules   = 0;
+    return fired;
+}
+
+/* Bring the wheel up to 'now', adding passed rule deadlines to the
+ * overdue count.  Called with fw_wheel_mutex held.
+*/
+static void
+wheel_advance(const time_t now)
+{
+    if(! fw_wheel.started || fw_wheel.num_entries == 0)
+    {
+        fw_wheel.now = now;
+    }
+    else if(now - fw_wheel.now >= FW_TIMER_LEVEL_SPAN(FW_TIMER_LEVELS))
+    {
+        /* The clock jumped past everything the wheel can hold.
+        */
+        fw_wheel.overdue += wheel_free(1);
+        fw_wheel.now = now;
+    }
+    else
+    {
+        while(fw_wheel.now < now)
+            fw_wheel.overdue += wheel_tick();
+    }
+    return;
+}
+
+static int
+timer_add(const time_t deadline, void *arg)
+{
+    fw_timer_entry_t   *entry;
+
+    if((entry = calloc(1, sizeof(fw_timer_entry_t))) == NULL)
+        return 0;
+
+    entry->deadline = deadline;
+    entry->arg      = arg;
+
+    pthread_mutex_lock(&fw_wheel_mutex);
+
+    if(! fw_wheel.started)
+    {
+        fw_wheel.now     = time(NULL);
+        fw_wheel.started = 1;
+    }
+    fw_wheel.num_entries++;
+    if(arg == NULL)
+        fw_wheel.num_rules++;
+    wheel_insert(entry);
+
+    pthread_mutex_unlock(&fw_wheel_mutex);
+    return 1;
+}
+
+/* Note the expiry time of a rule that has just been added.
+*/
+void
+fw_timer_add(const time_t deadline)
+{
+    METRIC_INC(METRIC_RULES_ADDED);
+    FWKNOP_PROBE2(rule_add, 1, deadline);
+
+    if(! timer_add(deadline, NULL))
+        log_msg(LOG_ERR,
+            "fw_timer_add: calloc() failed, rule expiry is left to the next rules check");
+    return;
+}
+
+/* Schedule arg to be handed back by fw_timer_pop_due() once deadline has
+ * passed.  Returns 0 if the entry could not be allocated.
+*/
+int
+fw_timer_add_arg(const time_t deadline, void *arg)
+{
+    return timer_add(deadline, arg);
+}
+
+/* Bring the wheel up to 'now' and return the argument of one entry that
+ * has come due, or NULL if there are none.
+*/
+void *
+fw_timer_pop_due(const time_t now)
+{
+    fw_timer_entry_t   *entry;
+    void               *arg = NULL;
+
+    pthread_mutex_lock(&fw_wheel_mutex);
+
+    wheel_advance(now);
+
+    if((entry = fw_wheel.due) != NULL)
+    {
+        fw_wheel.due = entry->next;
+        arg = entry->arg;
+        free(entry);
+    }
+
+    pthread_mutex_unlock(&fw_wheel_mutex);
+    return arg;
+}
+
+/* Bring the wheel up to 'now' and return the number of rule deadlines
+ * that have passed since the last call.
+*/
+int
+fw_timer_expired(const time_t now)
+{
+    int     fired;
+
+    pthread_mutex_lock(&fw_wheel_mutex);
+
+    wheel_advance(now);
+
+    fired = fw_wheel.overdue;
+    fw_wheel.overdue = 0;
+
+    pthread_mutex_unlock(&fw_wheel_mutex);
+    return fired;
+}
+
+void
+fw_timer_clear(void)
+{
+    pthread_mutex_lock(&fw_wheel_mutex);
+    wheel_free(0);
+    fw_wheel.started = 0;
+    fw_wheel.overdue = 0;
+    fw_wheel.adopted_until = 0;
+    pthread_mutex_unlock(&fw_wheel_mutex);
+    return;
+}
+
+/* Copy the deadlines of the rules that have not expired yet into a
+ * newly allocated array, which the caller frees.  Returns the number of
+ * deadlines or -1 on error.
+*/
+int
+fw_timer_deadlines(time_t **deadlines)
+{
+    fw_timer_entry_t   *entry;
+    int                 level, idx, n = 0;
+
+    pthread_mutex_lock(&fw_wheel_mutex);
+
+    if((*deadlines = calloc(fw_wheel.num_rules + 1, sizeof(time_t))) == NULL)
+    {
+        pthread_mutex_unlock(&fw_wheel_mutex);
+        return -1;
+    }
+
+    for(level=0; level < FW_TIMER_LEVELS; level++)
+        for(idx=0; idx < FW_TIMER_SLOTS; idx++)
+            for(entry = fw_wheel.slot[level][idx]; entry != NULL; entry = entry->next)
+                if(entry->arg == NULL && n < fw_wheel.num_rules)
+                    (*deadlines)[n++] = entry->deadline;
+
+    pthread_mutex_unlock(&fw_wheel_mutex);
+    return n;
+}
+
+/* Note the deadline of a rule that another fwknopd added (see upgrade.c).
+ * The firewall backends only keep track of the rules they added
+ * themselves, so until the last such deadline has passed every expiry
+ * leads to a full check of the fwknop chains.
+*/
+void
+fw_timer_adopt(const time_t deadline)
+{
+    if(! timer_add(deadline, NULL))
+    {
+        log_msg(LOG_ERR,
+            "fw_timer_adopt: calloc() failed, rule expiry is left to the next rules check");
+        return;
+    }
+
+    if(deadline > fw_wheel.adopted_until)
+        fw_wheel.adopted_until = deadline;
+    return;
+}
+
+/* Number of rules that have not reached their deadline yet.
+*/
+int
+fw_timer_count(void)
+{
+    int     count;
+
+    pthread_mutex_lock(&fw_wheel_mutex);
+    count = fw_wheel.num_rules;
+    pthread_mutex_unlock(&fw_wheel_mutex);
+    return count;
+}
+
+/* Called from the main loops on each timer pass.  The firewall is only
+ * checked when a rule deadline has passed, every FW_TIMER_RECHECK_INTERVAL
+ * seconds in case a rule could not be removed when it expired, and every
+ * rules_chk_threshold passes for the full check of the fwknop chains.
+*/
+void
+fw_check_expired(fko_srv_options_t * const opts, const int rules_chk_threshold)
+{
+    int     chk_rm_all = 0, fired;
+    time_t  now;
+
+    time(&now);
+
+    if(rules_chk_threshold > 0)
+    {
+        opts->check_rules_ctr++;
+        if ((opts->check_rules_ctr % rules_chk_threshold) == 0)
+        {
+            chk_rm_all = 1;
+            opts->check_rules_ctr = 0;
+        }
+    }
+
+    fired = fw_timer_expired(now);
+
+    if(fired > 0 && fw_wheel.adopted_until != 0)
+    {
+        chk_rm_all = 1;
+        if(now >= fw_wheel.adopted_until)
+            fw_wheel.adopted_until = 0;
+    }
+
+    if(fired == 0 && ! chk_rm_all
+            && now - fw_wheel.last_check < FW_TIMER_RECHECK_INTERVAL)
+        return;
+
+    fw_wheel.last_check = now;
+    check_firewall_rules(opts, chk_rm_all);
+    return;
+}
+
+#if ! FIREWALL_NFTABLES
+/* Install a list of controller-pushed grants.  Backends without a way to
+ * add many rules at once apply each grant as if it came from its own SPA
+ * request.  The caller holds spa_grant_mutex.  Returns the number of
+ * grants that could not be installed.
+*/
+int
+fw_install_grants(const fko_srv_options_t * const opts,
+        fw_grant_t * const grants, const int num_grants)
+{
+    spa_data_t          spadat;
+    service_data_list_t service;
+    int                 i, failed = 0;
+
+    for(i=0; i < num_grants; i++)
+    {
+        memset(&spadat, 0x0, sizeof(spadat));
+        memset(&service, 0x0, sizeof(service));
+
+        service.service_data = grants[i].service;
+
+        spadat.sdp_id            = grants[i].sdp_id;
+        spadat.message_type      = FKO_ACCESS_MSG;
+        spadat.fw_access_timeout = grants[i].timeout;
+        spadat.use_src_ip        = grants[i].src_ip;
+        spadat.service_data_list = &service;
+        strlcpy(spadat.pkt_source_ip, grants[i].src_ip,
+            sizeof(spadat.pkt_source_ip));
+        strlcpy(spadat.pkt_destination_ip, grants[i].dst_ip,
+            sizeof(spadat.pkt_destination_ip));
+        snprintf(spadat.spa_message_remain, sizeof(spadat.spa_message_remain),
+            "%"PRIu32, grants[i].service->service_id);
+
+        if(process_spa_request(opts, grants[i].acc, &spadat) != 0)
+            failed++;
+    }
+
+    return failed;
+}
+#endif
 
 /***EOF***/
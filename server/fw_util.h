@@ -37,14 +37,33 @@
 
 #define STANDARD_CMD_OUT_BUFSIZE    4096
 
+/* Storage class for the command buffers of the command line backends.
+ * Each thread that calls into the firewall code builds its commands in
+ * its own buffers, so independent requests (different tables or chains)
+ * can be run from several threads at once.  State that outlives a call,
+ * such as the rule shadow and the iptables-restore batch, is still owned
+ * by whichever thread applies grants (see fw_commit.c).
+*/
+#define FW_THREAD_LOCAL             __thread
+
 #define EXPIRE_COMMENT_PREFIX "_exp_"
 #define TMP_COMMENT "__TMPCOMMENT__"
 #define DUMMY_IP "127.0.0.2"
 
+/* Rule expiry timing wheel - FW_TIMER_LEVELS levels of FW_TIMER_SLOTS
+ * slots each, which covers deadlines up to 2^24 seconds out.
+*/
+#define FW_TIMER_LEVELS             4
+#define FW_TIMER_SLOT_BITS          6
+#define FW_TIMER_SLOTS              (1 << FW_TIMER_SLOT_BITS)
+#define FW_TIMER_RECHECK_INTERVAL   60
+
 #if FIREWALL_FIREWALLD
   #include "fw_util_firewalld.h"
 #elif FIREWALL_IPTABLES
   #include "fw_util_iptables.h"
+#elif FIREWALL_NFTABLES
+  #include "fw_util_nftables.h"
 #elif FIREWALL_IPFW
   #include "fw_util_ipfw.h"
 #elif FIREWALL_PF
@@ -57,6 +76,21 @@
   #include <time.h>
 #endif
 
+/* One access grant pushed by the controller in a grant snapshot (see
+ * control_client.c).  The stanza and service data must stay valid while
+ * the grant is installed, so fw_install_grants() is called inside an RCU
+ * read-side section.
+*/
+typedef struct fw_grant
+{
+    const acc_stanza_t     *acc;
+    service_data_t         *service;
+    uint32_t                sdp_id;
+    char                    src_ip[MAX_IPV4_STR_LEN];
+    char                    dst_ip[MAX_IPV46_STR_LEN];
+    unsigned int            timeout;    /* seconds left */
+} fw_grant_t;
+
 /* Function prototypes.
  *
  * Note: These are the public functions for managing firewall rules.
@@ -71,6 +105,21 @@ void check_firewall_rules(const fko_srv_options_t * const opts,
 int fw_dump_rules(const fko_srv_options_t * const opts);
 int process_spa_request(const fko_srv_options_t * const opts,
         const acc_stanza_t * const acc, spa_data_t * const spadat);
+int fw_install_grants(const fko_srv_options_t * const opts,
+        fw_grant_t * const grants, const int num_grants);
+
+/* Rule expiry tracking shared by all of the firewall backends (fw_util.c).
+*/
+void fw_timer_add(const time_t deadline);
+int fw_timer_add_arg(const time_t deadline, void *arg);
+void *fw_timer_pop_due(const time_t now);
+int fw_timer_expired(const time_t now);
+void fw_timer_clear(void);
+int fw_timer_count(void);
+int fw_timer_deadlines(time_t **deadlines);
+void fw_timer_adopt(const time_t deadline);
+void fw_check_expired(fko_srv_options_t * const opts,
+        const int rules_chk_threshold);
 
 #endif /* FW_UTIL_H */
 
@@ -38,6 +38,7 @@
 #include "log_msg.h"
 #include "extcmd.h"
 #include "access.h"
+#include "firewd_dbus.h"
 
 static struct fw_config fwc;
 static char   cmd_buf[CMD_BUFSIZE];
@@ -59,6 +60,104 @@ zero_cmd_buffers(void)
 
 static int pid_status = 0;
 
+/* Send the passthrough commands to firewalld over D-Bus instead of
+ * running firewall-cmd (see FIREWD_USE_DBUS).
+*/
+static int use_dbus = 0;
+
+/* Run a firewall-cmd passthrough command - as a D-Bus call if use_dbus
+ * is set, or by running firewall-cmd if it is not or firewalld cannot be
+ * reached.  The results are those firewall-cmd would have given: so_buf
+ * gets its output (and error message, with WANT_STDERR) and pid_status
+ * its exit status.
+*/
+static int
+firewd_cmd(const char *cmd, char *so_buf, const size_t so_buf_sz,
+        const int want_stderr, const int timeout, int *pid_status,
+        const fko_srv_options_t * const opts)
+{
+    size_t  prefix_len = strlen(fwc.fw_command);
+    int     res;
+
+    if(use_dbus && so_buf != NULL && so_buf_sz > 0
+            && strncmp(cmd, fwc.fw_command, prefix_len) == 0)
+    {
+        res = firewd_dbus_passthrough("ipv4", cmd + prefix_len,
+                so_buf, so_buf_sz);
+
+        if(res >= 0)
+        {
+            if(res == 0 && so_buf[0] == '\0')
+                strlcpy(so_buf, "success", so_buf_sz);
+            else if(res == 1 && ! (want_stderr & WANT_STDERR))
+                so_buf[0] = '\0';
+
+            /* As if firewall-cmd had exited with 0 or 1.
+            */
+            *pid_status = (res == 0) ? 0 : (1 << 8);
+            return EXTCMD_SUCCESS_ALL_OUTPUT;
+        }
+
+        log_msg(LOG_WARNING,
+            "firewd_cmd() could not reach firewalld over D-Bus, running firewall-cmd");
+    }
+
+    return run_extcmd(cmd, so_buf, so_buf_sz, want_stderr, timeout,
+            pid_status, opts);
+}
+
+/* The firewd_cmd() version of search_extcmd() and (with line_buf set)
+ * search_extcmd_getline() - returns the number of the first line of the
+ * output that contains substr_search, or 0.
+*/
+static int
+firewd_search(const char *cmd, char *line_buf, const size_t line_buf_sz,
+        const int timeout, const char *substr_search, int *pid_status,
+        const fko_srv_options_t * const opts)
+{
+    static char search_buf[STANDARD_CMD_OUT_BUFSIZE * 16];
+    size_t      prefix_len = strlen(fwc.fw_command);
+    char       *line, *eol;
+    int         res, line_num;
+
+    if(use_dbus && strncmp(cmd, fwc.fw_command, prefix_len) == 0)
+    {
+        res = firewd_dbus_passthrough("ipv4", cmd + prefix_len,
+                search_buf, sizeof(search_buf));
+
+        if(res >= 0)
+        {
+            *pid_status = (res == 0) ? 0 : (1 << 8);
+
+            for(line = search_buf, line_num = 1; line != NULL && *line != '\0';
+                    line_num++)
+            {
+                if((eol = strchr(line, '\n')) != NULL)
+                    *eol = '\0';
+
+                if(strstr(line, substr_search) != NULL)
+                {
+                    if(line_buf != NULL)
+                        strlcpy(line_buf, line, line_buf_sz);
+                    return line_num;
+                }
+                line = (eol != NULL) ? eol + 1 : NULL;
+            }
+            return 0;
+        }
+
+        log_msg(LOG_WARNING,
+            "firewd_search() could not reach firewalld over D-Bus, running firewall-cmd");
+    }
+
+    if(line_buf != NULL)
+        return search_extcmd_getline(cmd, line_buf, line_buf_sz, timeout,
+                substr_search, pid_status, opts);
+
+    return search_extcmd(cmd, WANT_STDERR, timeout, substr_search,
+            pid_status, opts);
+}
+
 static int
 rule_exists_no_chk_support(const fko_srv_options_t * const opts,
         const struct fw_chain * const fwc,
@@ -125,7 +224,7 @@ rule_exists_no_chk_support(const fko_srv_options_t * const opts,
     /* search for each of the substrings - the rule expiration time is the
      * primary search method
     */
-    if(search_extcmd_getline(cmd_buf, fw_line_buf,
+    if(firewd_search(cmd_buf, fw_line_buf,
                 CMD_BUFSIZE, NO_TIMEOUT, exp_ts_search, &pid_status, opts))
     {
         chop_newline(fw_line_buf);
@@ -197,7 +296,7 @@ rule_exists_chk_support(const fko_srv_options_t * const opts,
     snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " FIREWD_CHK_RULE_ARGS,
             opts->fw_config->fw_command, chain, rule);
 
-    res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE,
+    res = firewd_cmd(cmd_buf, err_buf, CMD_BUFSIZE,
             WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
     chop_newline(err_buf);
 
@@ -273,7 +372,7 @@ firewd_chk_support(const fko_srv_options_t * const opts)
         in_chain->target
     );
 
-    res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE,
+    res = firewd_cmd(cmd_buf, err_buf, CMD_BUFSIZE,
             WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
     chop_newline(err_buf);
 
@@ -291,7 +390,7 @@ firewd_chk_support(const fko_srv_options_t * const opts)
         in_chain->target
     );
 
-    res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE,
+    res = firewd_cmd(cmd_buf, err_buf, CMD_BUFSIZE,
             WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
     chop_newline(err_buf);
 
@@ -319,7 +418,7 @@ firewd_chk_support(const fko_srv_options_t * const opts)
         in_chain->from_chain,
         1
     );
-    run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE,
+    firewd_cmd(cmd_buf, err_buf, CMD_BUFSIZE,
             WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
 
     return;
@@ -346,7 +445,7 @@ comment_match_exists(const fko_srv_options_t * const opts)
         in_chain->target
     );
 
-    res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE,
+    res = firewd_cmd(cmd_buf, err_buf, CMD_BUFSIZE,
             WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
     chop_newline(err_buf);
 
@@ -361,7 +460,7 @@ comment_match_exists(const fko_srv_options_t * const opts)
         in_chain->from_chain
     );
 
-    res = run_extcmd(cmd_buf, cmd_out, STANDARD_CMD_OUT_BUFSIZE,
+    res = firewd_cmd(cmd_buf, cmd_out, STANDARD_CMD_OUT_BUFSIZE,
             WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
     chop_newline(cmd_out);
 
@@ -387,7 +486,7 @@ comment_match_exists(const fko_srv_options_t * const opts)
             in_chain->from_chain,
             1
         );
-        run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE,
+        firewd_cmd(cmd_buf, err_buf, CMD_BUFSIZE,
                 WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
     }
 
@@ -409,7 +508,7 @@ add_jump_rule(const fko_srv_options_t * const opts, const int chain_num)
         fwc.chain[chain_num].to_chain
     );
 
-    res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE,
+    res = firewd_cmd(cmd_buf, err_buf, CMD_BUFSIZE,
             WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
 
     log_msg(LOG_DEBUG, "add_jump_rule() CMD: '%s' (res: %d, err: %s)",
@@ -442,7 +541,7 @@ chain_exists(const fko_srv_options_t * const opts, const int chain_num)
         fwc.chain[chain_num].to_chain
     );
 
-    res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE,
+    res = firewd_cmd(cmd_buf, err_buf, CMD_BUFSIZE,
             WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
     chop_newline(err_buf);
 
@@ -504,7 +603,7 @@ jump_rule_exists_no_chk_support(const fko_srv_options_t * const opts,
     snprintf(chain_search, CMD_BUFSIZE-1, " %s ",
         fwc.chain[chain_num].to_chain);
 
-    if(search_extcmd(cmd_buf, WANT_STDERR,
+    if(firewd_search(cmd_buf, NULL, 0,
                 NO_TIMEOUT, chain_search, &pid_status, opts) > 0)
         exists = 1;
 
@@ -645,7 +744,7 @@ delete_all_chains(const fko_srv_options_t * const opts)
                 fwc.chain[i].to_chain
             );
 
-            res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE,
+            res = firewd_cmd(cmd_buf, err_buf, CMD_BUFSIZE,
                     WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
             chop_newline(err_buf);
 
@@ -670,7 +769,7 @@ delete_all_chains(const fko_srv_options_t * const opts)
             fwc.chain[i].to_chain
         );
 
-        res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, WANT_STDERR,
+        res = firewd_cmd(cmd_buf, err_buf, CMD_BUFSIZE, WANT_STDERR,
                 NO_TIMEOUT, &pid_status, opts);
         chop_newline(err_buf);
 
@@ -690,7 +789,7 @@ delete_all_chains(const fko_srv_options_t * const opts)
             fwc.chain[i].to_chain
         );
 
-        res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, WANT_STDERR,
+        res = firewd_cmd(cmd_buf, err_buf, CMD_BUFSIZE, WANT_STDERR,
                 NO_TIMEOUT, &pid_status, opts);
         chop_newline(err_buf);
 
@@ -721,7 +820,7 @@ create_chain(const fko_srv_options_t * const opts, const int chain_num)
         fwc.chain[chain_num].to_chain
     );
 
-    res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, WANT_STDERR,
+    res = firewd_cmd(cmd_buf, err_buf, CMD_BUFSIZE, WANT_STDERR,
                 NO_TIMEOUT, &pid_status, opts);
     chop_newline(err_buf);
 
@@ -948,6 +1047,20 @@ fw_initialize(const fko_srv_options_t * const opts)
 {
     int res = 1;
 
+    /* Keep a D-Bus connection to firewalld if we can.
+    */
+    if(strncasecmp(opts->config[CONF_FIREWD_USE_DBUS], "Y", 1) == 0)
+    {
+        if(firewd_dbus_open() == 0)
+        {
+            use_dbus = 1;
+            log_msg(LOG_INFO, "Connected to firewalld over D-Bus");
+        }
+        else
+            log_msg(LOG_WARNING,
+                "Could not connect to firewalld over D-Bus, using firewall-cmd");
+    }
+
     /* See if firewalld offers the '-C' argument (older versions don't).  If not,
      * then switch to parsing firewalld -L output to find rules.
     */
@@ -991,11 +1104,15 @@ fw_initialize(const fko_srv_options_t * const opts)
 int
 fw_cleanup(const fko_srv_options_t * const opts)
 {
-    if(strncasecmp(opts->config[CONF_FLUSH_FIREWD_AT_EXIT], "N", 1) == 0
-            && opts->fw_flush == 0)
-        return(0);
+    if(strncasecmp(opts->config[CONF_FLUSH_FIREWD_AT_EXIT], "N", 1) != 0
+            || opts->fw_flush != 0)
+        delete_all_chains(opts);
 
-    delete_all_chains(opts);
+    if(use_dbus)
+    {
+        firewd_dbus_close();
+        use_dbus = 0;
+    }
     return(0);
 }
 
@@ -1010,7 +1127,7 @@ create_rule(const fko_srv_options_t * const opts,
     snprintf(cmd_buf, CMD_BUFSIZE-1, "%s -A %s %s",
             opts->fw_config->fw_command, fw_chain, fw_rule);
 
-    res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, WANT_STDERR,
+    res = firewd_cmd(cmd_buf, err_buf, CMD_BUFSIZE, WANT_STDERR,
                 NO_TIMEOUT, &pid_status, opts);
     chop_newline(err_buf);
 
@@ -1087,6 +1204,8 @@ firewd_rule(const fko_srv_options_t * const opts,
             */
             if(chain->next_expire < now || exp_ts < chain->next_expire)
                 chain->next_expire = exp_ts;
+
+            fw_timer_add(exp_ts);
         }
     }
 
@@ -1108,9 +1227,9 @@ static void forward_access_rule(const fko_srv_options_t * const opts,
 
     log_msg(LOG_DEBUG,
             "forward_access_rule() forward_all: %d, nat_ip: %s, nat_port: %d",
-            acc->forward_all, nat_ip, nat_port);
+            acc->cold->forward_all, nat_ip, nat_port);
 
-    if(acc->forward_all)
+    if(acc->cold->forward_all)
     {
         memset(rule_buf, 0, CMD_BUFSIZE);
 
@@ -1152,9 +1271,9 @@ static void dnat_rule(const fko_srv_options_t * const opts,
     char   rule_buf[CMD_BUFSIZE] = {0};
 
     log_msg(LOG_DEBUG, "dnat_rule() forward_all: %d, nat_ip: %s, nat_port: %d",
-            acc->forward_all, nat_ip, nat_port);
+            acc->cold->forward_all, nat_ip, nat_port);
 
-    if(acc->forward_all)
+    if(acc->cold->forward_all)
     {
         memset(rule_buf, 0, CMD_BUFSIZE);
 
@@ -1213,11 +1332,11 @@ static void snat_rule(const fko_srv_options_t * const opts,
 
     log_msg(LOG_DEBUG,
             "snat_rule() forward_all: %d, nat_ip: %s, nat_port: %d, force_snat: %d, force_snat_ip: %s, force_masq: %d",
-            acc->forward_all, nat_ip, nat_port, acc->force_snat,
-            (acc->force_snat_ip == NULL) ? "(NONE)" : acc->force_snat_ip,
-            acc->force_masquerade);
+            acc->cold->forward_all, nat_ip, nat_port, acc->cold->force_snat,
+            (acc->cold->force_snat_ip == NULL) ? "(NONE)" : acc->cold->force_snat_ip,
+            acc->cold->force_masquerade);
 
-    if(acc->forward_all)
+    if(acc->cold->forward_all)
     {
         /* Default to MASQUERADE */
         snat_chain = &(opts->fw_config->chain[FIREWD_MASQUERADE_ACCESS]);
@@ -1225,12 +1344,12 @@ static void snat_rule(const fko_srv_options_t * const opts,
 
         /* Add SNAT or MASQUERADE rules.
         */
-        if(acc->force_snat && is_valid_ipv4_addr(acc->force_snat_ip))
+        if(acc->cold->force_snat && acc->cold->force_snat_ip != NULL)
         {
             /* Using static SNAT */
             snat_chain = &(opts->fw_config->chain[FIREWD_SNAT_ACCESS]);
             snprintf(snat_target, SNAT_TARGET_BUFSIZE-1,
-                "--to-source %s", acc->force_snat_ip);
+                "--to-source %s", acc->cold->force_snat_ip);
         }
         else if((opts->config[CONF_SNAT_TRANSLATE_IP] != NULL)
             && is_valid_ipv4_addr(opts->config[CONF_SNAT_TRANSLATE_IP]))
@@ -1259,14 +1378,14 @@ static void snat_rule(const fko_srv_options_t * const opts,
     {
         /* Add SNAT or MASQUERADE rules.
         */
-        if(acc->force_snat && is_valid_ipv4_addr(acc->force_snat_ip))
+        if(acc->cold->force_snat && acc->cold->force_snat_ip != NULL)
         {
             /* Using static SNAT */
             snat_chain = &(opts->fw_config->chain[FIREWD_SNAT_ACCESS]);
             snprintf(snat_target, SNAT_TARGET_BUFSIZE-1,
-                "--to-source %s:%i", acc->force_snat_ip, fst_port);
+                "--to-source %s:%i", acc->cold->force_snat_ip, fst_port);
         }
-        else if(acc->force_snat && acc->force_masquerade)
+        else if(acc->cold->force_snat && acc->cold->force_masquerade)
         {
             /* Using MASQUERADE */
             snat_chain = &(opts->fw_config->chain[FIREWD_MASQUERADE_ACCESS]);
@@ -1318,7 +1437,7 @@ int
 process_spa_request(const fko_srv_options_t * const opts,
         const acc_stanza_t * const acc, spa_data_t * const spadat)
 {
-    char            nat_ip[MAX_IPV4_STR_LEN] = {0};
+    const char     *nat_ip = NULL;
     unsigned int    nat_port = 0;
     unsigned int    fst_proto;
     unsigned int    fst_port;
@@ -1331,8 +1450,7 @@ process_spa_request(const fko_srv_options_t * const opts,
     acc_port_list_t *port_list = NULL;
     acc_port_list_t *ple = NULL;
 
-    char            *ndx = NULL;
-    int             res = 0, is_err;
+    int             res = 0;
     time_t          now;
     unsigned int    exp_ts;
 
@@ -1369,36 +1487,20 @@ process_spa_request(const fko_srv_options_t * const opts,
       || spadat->message_type == FKO_CLIENT_TIMEOUT_LOCAL_NAT_ACCESS_MSG
       || spadat->message_type == FKO_NAT_ACCESS_MSG
       || spadat->message_type == FKO_CLIENT_TIMEOUT_NAT_ACCESS_MSG
-      || acc->force_nat)
+      || acc->cold->force_nat)
     {
-        if(acc->force_nat)
+        /* The client's NAT request was parsed and validated by
+         * check_nat_access_types(), FORCE_NAT when the stanza was loaded.
+        */
+        if(acc->cold->force_nat)
         {
-            strlcpy(nat_ip, acc->force_nat_ip, sizeof(nat_ip));
-            nat_port = acc->force_nat_port;
+            nat_ip   = acc->cold->force_nat_ip;
+            nat_port = acc->cold->force_nat_port;
         }
         else
         {
-            ndx = strchr(spadat->nat_access, ',');
-            if(ndx != NULL)
-            {
-                strlcpy(nat_ip, spadat->nat_access, (ndx-spadat->nat_access)+1);
-                if (! is_valid_ipv4_addr(nat_ip))
-                {
-                    log_msg(LOG_INFO, "Invalid NAT IP in SPA message");
-                    free_acc_port_list(port_list);
-                    return res;
-                }
-
-                nat_port = strtol_wrapper(ndx+1, 0, MAX_PORT,
-                        NO_EXIT_UPON_ERR, &is_err);
-                if(is_err != FKO_SUCCESS)
-                {
-                    log_msg(LOG_INFO, "Invalid NAT port in SPA message");
-                    free_acc_port_list(port_list);
-                    res = is_err;
-                    return res;
-                }
-            }
+            nat_ip   = spadat->nat.ip_str;
+            nat_port = spadat->nat.port;
         }
 
         if(spadat->message_type == FKO_LOCAL_NAT_ACCESS_MSG
@@ -1419,13 +1521,13 @@ process_spa_request(const fko_srv_options_t * const opts,
 
         /* DNAT rule
         */
-        if(strlen(dnat_chain->to_chain) && !acc->disable_dnat)
+        if(strlen(dnat_chain->to_chain) && !acc->cold->disable_dnat)
             dnat_rule(opts, acc, dnat_chain, nat_ip,
                     nat_port, fst_proto, fst_port, spadat, exp_ts, now);
 
         /* SNAT rule
         */
-        if(acc->force_snat || strncasecmp(opts->config[CONF_ENABLE_FIREWD_SNAT], "Y", 1) == 0)
+        if(acc->cold->force_snat || strncasecmp(opts->config[CONF_ENABLE_FIREWD_SNAT], "Y", 1) == 0)
             snat_rule(opts, acc, nat_ip, nat_port,
                     fst_proto, fst_port, spadat, exp_ts, now);
     }
@@ -1566,7 +1668,7 @@ rm_expired_rules(const fko_srv_options_t * const opts,
                                         deleted rule with rn_offset */
             );
 
-            res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE,
+            res = firewd_cmd(cmd_buf, err_buf, CMD_BUFSIZE,
                     WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
             chop_newline(err_buf);
 
@@ -1659,7 +1761,7 @@ check_firewall_rules(const fko_srv_options_t * const opts,
             ch[i].to_chain
         );
 
-        res = run_extcmd(cmd_buf, fw_output_buf, STANDARD_CMD_OUT_BUFSIZE,
+        res = firewd_cmd(cmd_buf, fw_output_buf, STANDARD_CMD_OUT_BUFSIZE,
                 WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
         chop_newline(fw_output_buf);
 
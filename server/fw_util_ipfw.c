@@ -38,10 +38,25 @@
 #include "extcmd.h"
 #include "access.h"
 
+#if HAVE_NETINET_IP_FW_H
+  #include <sys/socket.h>
+  #include <net/if.h>
+  #include <netinet/in.h>
+  #include <netinet/ip_fw.h>
+  #include <arpa/inet.h>
+  #ifdef IP_FW_TABLE_XADD
+    #define IPFW_HAVE_XTABLES 1
+  #endif
+#endif
+
 static struct fw_config fwc;
-static char   cmd_buf[CMD_BUFSIZE];
-static char   err_buf[CMD_BUFSIZE];
-static char   cmd_out[STANDARD_CMD_OUT_BUFSIZE];
+
+/* Command buffers are per thread so that firewall calls may be made from
+ * more than one thread (see fw_util.h).
+*/
+static FW_THREAD_LOCAL char   cmd_buf[CMD_BUFSIZE];
+static FW_THREAD_LOCAL char   err_buf[CMD_BUFSIZE];
+static FW_THREAD_LOCAL char   cmd_out[STANDARD_CMD_OUT_BUFSIZE];
 
 static unsigned short
 get_next_rule_num(void)
@@ -57,15 +72,18 @@ get_next_rule_num(void)
     return(0);
 }
 
+/* Every command is built with snprintf() and run_extcmd() clears the
+ * output buffers it is given, so emptying the strings is enough.
+*/
 static void
 zero_cmd_buffers(void)
 {
-    memset(cmd_buf, 0x0, CMD_BUFSIZE);
-    memset(err_buf, 0x0, CMD_BUFSIZE);
-    memset(cmd_out, 0x0, STANDARD_CMD_OUT_BUFSIZE);
+    cmd_buf[0] = '\0';
+    err_buf[0] = '\0';
+    cmd_out[0] = '\0';
 }
 
-static int pid_status = 0;
+static FW_THREAD_LOCAL int pid_status = 0;
 
 static int
 ipfw_set_exists(const fko_srv_options_t *opts,
@@ -95,6 +113,301 @@ ipfw_set_exists(const fko_srv_options_t *opts,
     return(1);
 }
 
+/* Table mode grants.  Each grant is one flow table entry keyed on source
+ * address, protocol, destination port (and destination address when
+ * destination rules are enabled).  The list below drives expiry, since
+ * table entries carry no timeout of their own.
+*/
+typedef struct ipfw_grant
+{
+    char                src[MAX_IPV46_STR_LEN];
+    char                dst[MAX_IPV46_STR_LEN];
+    unsigned int        proto;
+    unsigned int        port;
+    time_t              expire;
+    struct ipfw_grant  *next;
+} ipfw_grant_t;
+
+static ipfw_grant_t *ipfw_grants = NULL;
+
+#if IPFW_HAVE_XTABLES
+/* Add or delete one flow table entry through the IP_FW3 socket option.
+ * Returns 1 on success and 0 on failure.
+*/
+static int
+ipfw_xtable_entry(const uint16_t opcode, const ipfw_grant_t * const g)
+{
+    struct {
+        ipfw_obj_header     oh;
+        ipfw_obj_ctlv       ctlv;
+        ipfw_obj_tentry     tent;
+    } req;
+    struct tflow_entry     *tfe = &req.tent.k.flow;
+    socklen_t               sz = sizeof(req);
+
+    memset(&req, 0x0, sizeof(req));
+
+    req.oh.opheader.opcode  = opcode;
+    req.oh.idx              = 1;
+    req.oh.ntlv.head.type   = IPFW_TLV_TBL_NAME;
+    req.oh.ntlv.head.length = sizeof(req.oh.ntlv);
+    req.oh.ntlv.idx         = 1;
+    strlcpy(req.oh.ntlv.name, fwc.table_name, sizeof(req.oh.ntlv.name));
+
+    req.ctlv.head.type      = IPFW_TLV_TBLENT_LIST;
+    req.ctlv.head.length    = sizeof(req.ctlv) + sizeof(req.tent);
+    req.ctlv.count          = 1;
+    req.ctlv.objsize        = sizeof(req.tent);
+
+    req.tent.head.type      = IPFW_TLV_TBL_ENT;
+    req.tent.head.length    = sizeof(req.tent);
+    req.tent.idx            = 1;
+
+    tfe->proto = g->proto;
+    tfe->dport = htons(g->port);
+
+    if(inet_pton(AF_INET, g->src, &tfe->a.a4.sip) == 1)
+    {
+        tfe->af              = AF_INET;
+        req.tent.subtype     = AF_INET;
+        req.tent.masklen     = 32;
+        if(fwc.use_destination
+                && inet_pton(AF_INET, g->dst, &tfe->a.a4.dip) != 1)
+            return 0;
+    }
+    else if(inet_pton(AF_INET6, g->src, &tfe->a.a6.sip6) == 1)
+    {
+        tfe->af              = AF_INET6;
+        req.tent.subtype     = AF_INET6;
+        req.tent.masklen     = 128;
+        if(fwc.use_destination
+                && inet_pton(AF_INET6, g->dst, &tfe->a.a6.dip6) != 1)
+            return 0;
+    }
+    else
+        return 0;
+
+    /* Table modifications return per-entry results, so they go through
+     * getsockopt() like ipfw(8) does.
+    */
+    if(getsockopt(fwc.ipfw_sock, IPPROTO_IP, IP_FW3, &req, &sz) != 0)
+    {
+        log_msg(LOG_WARNING, "IP_FW3 table %s failed: %s",
+            (opcode == IP_FW_TABLE_XADD) ? "add" : "delete", strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+#endif /* IPFW_HAVE_XTABLES */
+
+/* Add ("add") or delete ("delete") one flow table entry, preferring the
+ * IP_FW3 socket and falling back to the ipfw command.
+*/
+static int
+ipfw_table_entry(const fko_srv_options_t * const opts,
+        const char * const action, const ipfw_grant_t * const g)
+{
+    char    key[MAX_IPV46_STR_LEN*2 + 16] = {0};
+    int     res;
+
+#if IPFW_HAVE_XTABLES
+    if(fwc.ipfw_sock >= 0)
+        return ipfw_xtable_entry((action[0] == 'a')
+            ? IP_FW_TABLE_XADD : IP_FW_TABLE_XDEL, g);
+#endif
+
+    if(fwc.use_destination)
+        snprintf(key, sizeof(key), "%s,%u,%s,%u",
+            g->src, g->proto, g->dst, g->port);
+    else
+        snprintf(key, sizeof(key), "%s,%u,%u", g->src, g->proto, g->port);
+
+    zero_cmd_buffers();
+
+    snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPFW_TABLE_ENTRY_ARGS,
+        fwc.fw_command,
+        fwc.table_name,
+        action,
+        key
+    );
+
+    res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE,
+                WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
+
+    log_msg(LOG_DEBUG, "ipfw_table_entry() CMD: '%s' (res: %d, err: %s)",
+        cmd_buf, res, err_buf);
+
+    if(! EXTCMD_IS_SUCCESS(res))
+    {
+        log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, err_buf);
+        return 0;
+    }
+    return 1;
+}
+
+/* Create the flow table and the single rule that looks grants up in it.
+*/
+static int
+ipfw_table_init(const fko_srv_options_t * const opts)
+{
+    int     res;
+
+    zero_cmd_buffers();
+
+    snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPFW_TABLE_CREATE_ARGS,
+        fwc.fw_command,
+        fwc.table_name,
+        fwc.use_destination ? IPFW_TABLE_FLOW_DST_TYPE : IPFW_TABLE_FLOW_TYPE
+    );
+
+    res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE,
+                WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
+
+    log_msg(LOG_DEBUG, "ipfw_table_init() CMD: '%s' (res: %d, err: %s)",
+        cmd_buf, res, err_buf);
+
+    if(! EXTCMD_IS_SUCCESS(res))
+    {
+        log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, err_buf);
+        return 0;
+    }
+
+    zero_cmd_buffers();
+
+    snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPFW_ADD_TABLE_RULE_ARGS,
+        fwc.fw_command,
+        fwc.start_rule_num + fwc.total_rules,
+        fwc.active_set_num,
+        fwc.table_name
+    );
+
+    res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE,
+                WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
+
+    log_msg(LOG_DEBUG, "ipfw_table_init() CMD: '%s' (res: %d, err: %s)",
+        cmd_buf, res, err_buf);
+
+    if(! EXTCMD_IS_SUCCESS(res))
+    {
+        log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, err_buf);
+        return 0;
+    }
+
+    log_msg(LOG_INFO, "Added table %s lookup rule %u to set %u",
+        fwc.table_name, fwc.start_rule_num + fwc.total_rules,
+        fwc.active_set_num);
+
+#if IPFW_HAVE_XTABLES
+    if((fwc.ipfw_sock = socket(AF_INET, SOCK_RAW, IPPROTO_RAW)) < 0)
+        log_msg(LOG_WARNING,
+            "Could not open IP_FW3 socket (%s), using %s for table entries",
+            strerror(errno), fwc.fw_command);
+#endif
+
+    return 1;
+}
+
+static int
+ipfw_table_grant(const fko_srv_options_t * const opts,
+        const spa_data_t * const spadat, const unsigned int proto,
+        const unsigned int port, const time_t exp_ts)
+{
+    ipfw_grant_t   *g;
+
+    /* A repeat knock for the same flow only moves its expiry.
+    */
+    for(g = ipfw_grants; g != NULL; g = g->next)
+    {
+        if(g->proto == proto && g->port == port
+                && strcmp(g->src, spadat->use_src_ip) == 0
+                && (! fwc.use_destination
+                    || strcmp(g->dst, spadat->pkt_destination_ip) == 0))
+        {
+            if(exp_ts > g->expire)
+                g->expire = exp_ts;
+            return 1;
+        }
+    }
+
+    if((g = calloc(1, sizeof(*g))) == NULL)
+    {
+        log_msg(LOG_ERR, "Fatal memory allocation error.");
+        return 0;
+    }
+
+    strlcpy(g->src, spadat->use_src_ip, sizeof(g->src));
+    strlcpy(g->dst, spadat->pkt_destination_ip, sizeof(g->dst));
+    g->proto  = proto;
+    g->port   = port;
+    g->expire = exp_ts;
+
+    if(! ipfw_table_entry(opts, "add", g))
+    {
+        free(g);
+        return 0;
+    }
+
+    g->next     = ipfw_grants;
+    ipfw_grants = g;
+
+    fwc.active_rules++;
+    return 1;
+}
+
+static void
+ipfw_table_expire(const fko_srv_options_t * const opts)
+{
+    ipfw_grant_t   *g, **prev = &ipfw_grants;
+    time_t          now, min_exp = 0;
+
+    time(&now);
+
+    while((g = *prev) != NULL)
+    {
+        if(g->expire > now)
+        {
+            if(min_exp == 0 || g->expire < min_exp)
+                min_exp = g->expire;
+            prev = &g->next;
+            continue;
+        }
+
+        log_msg(LOG_INFO, "Removing table %s entry for %s %u/%u with "
+            "expire time of %u.", fwc.table_name, g->src, g->proto,
+            g->port, (unsigned int)g->expire);
+
+        ipfw_table_entry(opts, "delete", g);
+
+        if(fwc.active_rules > 0)
+            fwc.active_rules--;
+
+        *prev = g->next;
+        free(g);
+    }
+
+    fwc.next_expire = min_exp;
+    return;
+}
+
+static void
+ipfw_table_free(void)
+{
+    ipfw_grant_t *g;
+
+    while((g = ipfw_grants) != NULL)
+    {
+        ipfw_grants = g->next;
+        free(g);
+    }
+
+    if(fwc.ipfw_sock >= 0)
+    {
+        close(fwc.ipfw_sock);
+        fwc.ipfw_sock = -1;
+    }
+    return;
+}
+
 /* Print all firewall rules currently instantiated by the running fwknopd
  * daemon to stdout.
 */
@@ -157,6 +470,25 @@ fw_dump_rules(const fko_srv_options_t * const opts)
             got_err++;
         }
 
+        if(fwc.use_tables)
+        {
+            snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPFW_TABLE_LIST_ARGS,
+                opts->fw_config->fw_command,
+                fwc.table_name
+            );
+
+            printf("\nTable %s entries:\n", fwc.table_name);
+            res = run_extcmd(cmd_buf, NULL, 0, NO_STDERR,
+                        NO_TIMEOUT, &pid_status, opts);
+
+            if(! EXTCMD_IS_SUCCESS(res))
+            {
+                log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, err_buf);
+                got_err++;
+            }
+            return(got_err);
+        }
+
         /* Create the list command for expired rules
         */
         snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPFW_LIST_RULES_ARGS,
@@ -244,6 +576,14 @@ fw_config_init(fko_srv_options_t * const opts)
         fwc.use_destination = 1;
     }
 
+    fwc.ipfw_sock = -1;
+    if(strncasecmp(opts->config[CONF_IPFW_USE_TABLES], "Y", 1) == 0)
+    {
+        fwc.use_tables = 1;
+        strlcpy(fwc.table_name, opts->config[CONF_IPFW_TABLE_NAME],
+            sizeof(fwc.table_name));
+    }
+
     /* Let us find it via our opts struct as well.
     */
     opts->fw_config = &fwc;
@@ -310,6 +650,16 @@ fw_initialize(const fko_srv_options_t * const opts)
             log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, err_buf);
     }
 
+    /* Table mode needs only the lookup rule (after any check-state rule),
+     * and has no expire set to track.
+    */
+    if(fwc.use_tables)
+    {
+        if(fwc.rule_map[0] == RULE_ACTIVE)
+            fwc.total_rules++;
+        return ipfw_table_init(opts);
+    }
+
     if(fwc.expire_set_num > 0
             && (strncasecmp(opts->config[CONF_FLUSH_IPFW_AT_INIT], "Y", 1) == 0))
     {
@@ -412,6 +762,7 @@ fw_cleanup(const fko_srv_options_t * const opts)
     {
         if(fwc.rule_map != NULL)
             free(fwc.rule_map);
+        ipfw_table_free();
         return(0);
     }
 
@@ -466,6 +817,24 @@ fw_cleanup(const fko_srv_options_t * const opts)
     }
 #endif
 
+    if(fwc.use_tables)
+    {
+        zero_cmd_buffers();
+
+        snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPFW_TABLE_DESTROY_ARGS,
+            fwc.fw_command,
+            fwc.table_name
+        );
+
+        res = run_extcmd(cmd_buf, NULL, 0, NO_STDERR,
+                    NO_TIMEOUT, &pid_status, opts);
+
+        log_msg(LOG_DEBUG, "fw_cleanup() CMD: '%s' (res: %d)",
+            cmd_buf, res);
+    }
+
+    ipfw_table_free();
+
     /* Free the rule map.
     */
     if(fwc.rule_map != NULL)
@@ -507,7 +876,30 @@ process_spa_request(const fko_srv_options_t * const opts,
     /* For straight access requests, we currently support multiple proto/port
      * request.
     */
-    if(spadat->message_type == FKO_ACCESS_MSG
+    if(fwc.use_tables && (spadat->message_type == FKO_ACCESS_MSG
+      || spadat->message_type == FKO_CLIENT_TIMEOUT_ACCESS_MSG))
+    {
+        while(ple != NULL)
+        {
+            if(ipfw_table_grant(opts, spadat, ple->proto, ple->port, exp_ts))
+            {
+                log_msg(LOG_INFO, "Added table %s entry for %s, %u/%u expires at %u",
+                    fwc.table_name, spadat->use_src_ip,
+                    ple->proto, ple->port, exp_ts
+                );
+
+                if(fwc.next_expire < now || exp_ts < fwc.next_expire)
+                    fwc.next_expire = exp_ts;
+
+                fw_timer_add(exp_ts);
+            }
+            else
+                res = -1;
+
+            ple = ple->next;
+        }
+    }
+    else if(spadat->message_type == FKO_ACCESS_MSG
       || spadat->message_type == FKO_CLIENT_TIMEOUT_ACCESS_MSG)
     {
         /* Pull the next available rule number.
@@ -566,6 +958,8 @@ process_spa_request(const fko_srv_options_t * const opts,
                 */
                 if(fwc.next_expire < now || exp_ts < fwc.next_expire)
                     fwc.next_expire = exp_ts;
+
+                fw_timer_add(exp_ts);
             }
             else
                 log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, err_buf);
@@ -612,6 +1006,12 @@ check_firewall_rules(const fko_srv_options_t * const opts,
     time_t          now, rule_exp, min_exp = 0;
     unsigned short  curr_rule;
 
+    if(fwc.use_tables)
+    {
+        ipfw_table_expire(opts);
+        return;
+    }
+
     /* Just in case we somehow lose track and fall out-of-whack.
     */
     if(fwc.active_rules > fwc.max_rules)
@@ -813,6 +1213,11 @@ ipfw_purge_expired_rules(const fko_srv_options_t *opts)
     int             i, res, is_err;
     unsigned short  curr_rule;
 
+    /* Expired table entries are deleted outright, there is no expire set.
+    */
+    if(fwc.use_tables)
+        return;
+
     /* First, we get the current active dynamic rules for the expired rule
      * set. Then we compare it to the expired rules in the rule_map. Any
      * rules in the map that do not have a dynamic rule, can be deleted.
@@ -49,6 +49,22 @@ enum {
 #define IPFW_DEL_RULE_SET_ARGS       "delete set %u"
 #define IPFW_ANY_IP                  "me"
 
+/* Table mode - one flow table holds every grant and a single lookup rule
+ * references it.
+*/
+#if HAVE_EXECVPE
+  #define IPFW_FLOW_TABLE_ARG        "table(%s)"
+#else
+  #define IPFW_FLOW_TABLE_ARG        "'table(%s)'"
+#endif
+#define IPFW_TABLE_CREATE_ARGS       "table %s create type %s missing"
+#define IPFW_TABLE_DESTROY_ARGS      "table %s destroy"
+#define IPFW_TABLE_LIST_ARGS         "table %s list"
+#define IPFW_TABLE_ENTRY_ARGS        "table %s %s %s"
+#define IPFW_ADD_TABLE_RULE_ARGS     "add %u set %u pass ip from any to any flow " IPFW_FLOW_TABLE_ARG " keep-state"
+#define IPFW_TABLE_FLOW_TYPE         "flow:src-ip,proto,dst-port"
+#define IPFW_TABLE_FLOW_DST_TYPE     "flow:src-ip,proto,dst-ip,dst-port"
+
 #ifdef __APPLE__
     #define IPFW_DEL_RULE_ARGS           "delete %u" //--DSS diff args
     #define IPFW_LIST_RULES_ARGS         "-d -S -T list | grep 'set %u'"
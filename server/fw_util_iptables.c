@@ -39,26 +39,36 @@
 #include "extcmd.h"
 #include "access.h"
 #include "service.h"
+#include "ipset_nl.h"
+
+#include <arpa/inet.h>
 
 static struct fw_config fwc;
-static char   cmd_buf[CMD_BUFSIZE];
-static char   err_buf[CMD_BUFSIZE];
-static char   cmd_out[STANDARD_CMD_OUT_BUFSIZE];
+
+/* Command buffers are per thread so that firewall calls may be made from
+ * more than one thread (see fw_util.h).
+*/
+static FW_THREAD_LOCAL char   cmd_buf[CMD_BUFSIZE];
+static FW_THREAD_LOCAL char   err_buf[CMD_BUFSIZE];
+static FW_THREAD_LOCAL char   cmd_out[STANDARD_CMD_OUT_BUFSIZE];
 
 /* assume 'iptables -C' is offered since only older versions
  * don't have this (see ipt_chk_support()).
 */
 static int have_ipt_chk_support = 1;
 
+/* Every command is built with snprintf() and run_extcmd() clears the
+ * output buffers it is given, so emptying the strings is enough.
+*/
 static void
 zero_cmd_buffers(void)
 {
-    memset(cmd_buf, 0x0, CMD_BUFSIZE);
-    memset(err_buf, 0x0, CMD_BUFSIZE);
-    memset(cmd_out, 0x0, STANDARD_CMD_OUT_BUFSIZE);
+    cmd_buf[0] = '\0';
+    err_buf[0] = '\0';
+    cmd_out[0] = '\0';
 }
 
-static int pid_status = 0;
+static FW_THREAD_LOCAL int pid_status = 0;
 
 static int
 rule_exists_no_chk_support(const fko_srv_options_t * const opts,
@@ -536,13 +546,251 @@ jump_rule_exists(const fko_srv_options_t * const opts, const int chain_num)
     return exists;
 }
 
+/* With IPT_INPUT_SHARD_BITS set to k, INPUT grants are spread over 2^k
+ * sub-chains by the low k bits of the source address, so a packet walks
+ * 2k dispatch rules and one sub-chain instead of every grant.  The chains
+ * form a binary tree numbered like a heap: node 1 is the IPT_INPUT_ACCESS
+ * chain itself, node n at depth d jumps on bit d of the source address to
+ * node 2n (bit clear) or 2n+1 (bit set), and nodes 2^k to 2^(k+1)-1 are
+ * the leaves that hold the grants.  A grant without a plain IPv4 source
+ * stays in the top chain, after the dispatch rules.
+*/
+static int
+shard_enabled(const int chain_type)
+{
+    return (chain_type == IPT_INPUT_ACCESS && fwc.input_shard_bits > 0);
+}
+
+/* Name of a sub-chain node.  Returns 0 if it did not fit in name, so two
+ * nodes can never end up sharing a truncated chain name.
+*/
+static int
+shard_node_name(const int node, char * const name, const size_t len)
+{
+    char    suffix[16] = {0};
+
+    if(strlcpy(name, fwc.chain[IPT_INPUT_ACCESS].to_chain, len) >= len)
+        return 0;
+
+    if(node == 1)
+        return 1;
+
+    snprintf(suffix, sizeof(suffix), "_%i", node);
+    return (strlcat(name, suffix, len) < len);
+}
+
+/* Leaf node for the '-s <ip>' in a rule, or 1 if there isn't one.
+*/
+static int
+shard_leaf(const char * const rule)
+{
+    char            srcip[MAX_IPV4_STR_LEN] = {0};
+    const char     *ndx;
+    struct in_addr  in;
+    uint32_t        addr;
+    size_t          len;
+    int             d, node = 1;
+
+    if((ndx = strstr(rule, "-s ")) == NULL)
+        return 1;
+    ndx += strlen("-s ");
+
+    len = strcspn(ndx, " ");
+    if(len >= sizeof(srcip))
+        return 1;
+    memcpy(srcip, ndx, len);
+
+    if(inet_pton(AF_INET, srcip, &in) != 1)
+        return 1;
+
+    addr = ntohl(in.s_addr);
+    for(d=0; d < fwc.input_shard_bits; d++)
+        node = 2*node + ((addr >> d) & 1);
+
+    return node;
+}
+
+/* Return the chain a rule belongs in - chain itself, or if it is sharded
+ * a copy of it (in shard) naming the rule's sub-chain.
+*/
+static struct fw_chain *
+shard_chain(struct fw_chain * const chain, const char * const rule,
+        struct fw_chain * const shard)
+{
+    if(! shard_enabled(chain->type))
+        return chain;
+
+    *shard = *chain;
+    if(! shard_node_name(shard_leaf(rule), shard->to_chain,
+            sizeof(shard->to_chain)))
+        return chain;
+    return shard;
+}
+
+/* Run one iptables command for the sub-chains.  Returns 1 if it succeeded.
+*/
+static int
+shard_cmd(const fko_srv_options_t * const opts, const char * const args)
+{
+    int     res;
+
+    zero_cmd_buffers();
+
+    if(snprintf(cmd_buf, CMD_BUFSIZE-1, "%s %s", fwc.fw_command, args)
+            >= CMD_BUFSIZE-1)
+    {
+        log_msg(LOG_ERR, "shard_cmd() Command is too long: %s", args);
+        return 0;
+    }
+
+    res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, WANT_STDERR,
+            NO_TIMEOUT, &pid_status, opts);
+    chop_newline(err_buf);
+
+    log_msg(LOG_DEBUG, "shard_cmd() CMD: '%s' (res: %d, err: %s)",
+        cmd_buf, res, err_buf);
+
+    return (EXTCMD_IS_SUCCESS(res) && WIFEXITED(pid_status)
+            && WEXITSTATUS(pid_status) == 0);
+}
+
+/* Add (or delete) the two dispatch rules of an inner node.
+*/
+static int
+shard_dispatch(const fko_srv_options_t * const opts, const int node,
+        const int is_delete)
+{
+    char            args[CMD_BUFSIZE] = {0};
+    char            name[MAX_CHAIN_NAME_LEN] = {0};
+    char            child[MAX_CHAIN_NAME_LEN] = {0};
+    char            mask[MAX_IPV4_STR_LEN] = {0};
+    const char     *table = fwc.chain[IPT_INPUT_ACCESS].table;
+    struct in_addr  in;
+    int             d = 0, n, bit, ok = 1;
+
+    for(n=node; n > 1; n >>= 1)
+        d++;
+
+    in.s_addr = htonl((uint32_t)1 << d);
+    inet_ntop(AF_INET, &in, mask, sizeof(mask));
+
+    if(! shard_node_name(node, name, sizeof(name)))
+        return 0;
+
+    for(bit=1; bit >= 0; bit--)
+    {
+        if(! shard_node_name(2*node + bit, child, sizeof(child)))
+        {
+            ok = 0;
+            continue;
+        }
+
+        if(is_delete)
+            snprintf(args, sizeof(args), IPT_SHARD_DEL_JUMP_ARGS,
+                table, name, bit ? "" : "! ", mask, mask, child);
+        else
+            snprintf(args, sizeof(args), IPT_SHARD_JUMP_ARGS,
+                table, name, 2 - bit, bit ? "" : "! ", mask, mask, child);
+
+        if(! shard_cmd(opts, args))
+            ok = 0;
+    }
+
+    return ok;
+}
+
+/* Create the sub-chains and dispatch rules.  Returns the number of errors.
+*/
+static int
+shard_setup(const fko_srv_options_t * const opts)
+{
+    char    args[CMD_BUFSIZE] = {0};
+    char    name[MAX_CHAIN_NAME_LEN] = {0};
+    char   *table = fwc.chain[IPT_INPUT_ACCESS].table;
+    int     node, tries, got_err = 0;
+    int     leaves = 1 << fwc.input_shard_bits;
+
+    /* The last node has the longest name, don't create any sub-chains
+     * unless they all get a distinct one.
+    */
+    if(! shard_node_name(2*leaves - 1, name, sizeof(name)))
+    {
+        log_msg(LOG_ERR, "shard_setup() chain name '%s' is too long for sub-chains",
+            fwc.chain[IPT_INPUT_ACCESS].to_chain);
+        return 1;
+    }
+
+    /* Creating a chain that is already there fails harmlessly, the inner
+     * ones are then flushed and their dispatch rules put back.
+    */
+    for(node=2; node < 2*leaves; node++)
+    {
+        shard_node_name(node, name, sizeof(name));
+
+        snprintf(args, sizeof(args), IPT_NEW_CHAIN_ARGS, table, name);
+        shard_cmd(opts, args);
+
+        if(node < leaves)
+        {
+            snprintf(args, sizeof(args), IPT_FLUSH_CHAIN_ARGS, table, name);
+            if(! shard_cmd(opts, args))
+                got_err++;
+        }
+    }
+
+    /* The top chain keeps its rules if it wasn't flushed at start up, so
+     * take out any dispatch rules left there before adding them at the top.
+    */
+    tries = 0;
+    while(tries++ < CMD_LOOP_TRIES && shard_dispatch(opts, 1, 1))
+        ;
+
+    for(node=1; node < leaves; node++)
+        if(! shard_dispatch(opts, node, 0))
+            got_err++;
+
+    if(got_err == 0)
+        log_msg(LOG_INFO, "Spread %s grants over %i sub-chains",
+            fwc.chain[IPT_INPUT_ACCESS].to_chain, leaves);
+
+    return got_err;
+}
+
+/* Flush and delete the sub-chains, once nothing jumps to them from the
+ * top chain.
+*/
+static void
+shard_cleanup(const fko_srv_options_t * const opts)
+{
+    char    args[CMD_BUFSIZE] = {0};
+    char    name[MAX_CHAIN_NAME_LEN] = {0};
+    char   *table = fwc.chain[IPT_INPUT_ACCESS].table;
+    int     node, leaves = 1 << fwc.input_shard_bits;
+
+    for(node=2; node < 2*leaves; node++)
+    {
+        shard_node_name(node, name, sizeof(name));
+        snprintf(args, sizeof(args), IPT_FLUSH_CHAIN_ARGS, table, name);
+        shard_cmd(opts, args);
+    }
+
+    for(node=2; node < 2*leaves; node++)
+    {
+        shard_node_name(node, name, sizeof(name));
+        snprintf(args, sizeof(args), IPT_DEL_CHAIN_ARGS, table, name);
+        shard_cmd(opts, args);
+    }
+    return;
+}
+
 /* Print all firewall rules currently instantiated by the running fwknopd
  * daemon to stdout.
 */
 int
 fw_dump_rules(const fko_srv_options_t * const opts)
 {
-    int     i, res, got_err = 0;
+    char    name[MAX_CHAIN_NAME_LEN] = {0};
+    int     i, node, res, got_err = 0;
 
     struct fw_chain *ch = opts->fw_config->chain;
 
@@ -616,12 +864,244 @@ fw_dump_rules(const fko_srv_options_t * const opts)
                         res, cmd_buf, err_buf);
                 got_err++;
             }
+
+            if(! shard_enabled(i))
+                continue;
+
+            for(node=2; node < 2 << fwc.input_shard_bits; node++)
+            {
+                shard_node_name(node, name, sizeof(name));
+
+                zero_cmd_buffers();
+
+                if(snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPT_LIST_RULES_ARGS,
+                        opts->fw_config->fw_command,
+                        ch[i].table,
+                        name
+                    ) >= CMD_BUFSIZE-1)
+                {
+                    log_msg(LOG_ERR, "fw_dump_rules() Command to list %s is too long",
+                        name);
+                    got_err++;
+                    continue;
+                }
+
+                fprintf(stdout, "\n");
+                fflush(stdout);
+
+                res = run_extcmd(cmd_buf, NULL, 0, NO_STDERR,
+                            NO_TIMEOUT, &pid_status, opts);
+
+                log_msg(LOG_DEBUG, "fw_dump_rules() CMD: '%s' (res: %d)",
+                    cmd_buf, res);
+
+                if(! EXTCMD_IS_SUCCESS(res))
+                {
+                    log_msg(LOG_ERR, "fw_dump_rules() Error %i from cmd:'%s': %s",
+                            res, cmd_buf, err_buf);
+                    got_err++;
+                }
+            }
         }
     }
 
     return(got_err);
 }
 
+/* The shadow table holds the rules fwknopd has added to each chain along
+ * with their expire times, so expired rules can be found and deleted (by
+ * rule spec) without listing and parsing the chains.  The chains are only
+ * listed every RULES_CHECK_THRESHOLD checks, or after a failed delete, to
+ * reconcile with what is really in the kernel.
+*/
+typedef struct ipt_shadow_rule
+{
+    time_t  exp_ts;
+    char    spec[CMD_BUFSIZE];
+} ipt_shadow_rule_t;
+
+static struct ipt_shadow
+{
+    ipt_shadow_rule_t  *rules;
+    int                 num_rules;
+    int                 size;
+} ipt_shadow[NUM_FWKNOP_ACCESS_TYPES];
+
+static int ipt_shadow_resync = 0;
+
+/* Turn a rule built from one of the IPT_*_ARGS macros into the bare rule
+ * spec - without the '-t table' part or the shell redirection.
+*/
+static void
+ipt_rule_spec(const struct fw_chain * const chain, const char * const rule_buf,
+        char * const spec, const size_t spec_len)
+{
+    char        prefix[MAX_TABLE_NAME_LEN+5] = {0};
+    const char *rule = rule_buf;
+    size_t      len;
+
+    snprintf(prefix, sizeof(prefix), "-t %s ", chain->table);
+    if(strncmp(rule, prefix, strlen(prefix)) == 0)
+        rule += strlen(prefix);
+
+    strlcpy(spec, rule, spec_len);
+
+    len = strlen(spec);
+    if(strlen(SH_REDIR) > 0 && len >= strlen(SH_REDIR)
+            && strcmp(spec + len - strlen(SH_REDIR), SH_REDIR) == 0)
+        spec[len - strlen(SH_REDIR)] = '\0';
+
+    return;
+}
+
+/* Set the chain's active rule count and next expire time from its shadow
+ * table.
+*/
+static void
+shadow_sync_chain(const int chain_num)
+{
+    struct fw_chain    *ch = &(fwc.chain[chain_num]);
+    int                 i;
+
+    ch->active_rules = ipt_shadow[chain_num].num_rules;
+    ch->next_expire  = 0;
+
+    for(i=0; i < ipt_shadow[chain_num].num_rules; i++)
+        if(ch->next_expire == 0
+                || ipt_shadow[chain_num].rules[i].exp_ts < ch->next_expire)
+            ch->next_expire = ipt_shadow[chain_num].rules[i].exp_ts;
+
+    return;
+}
+
+static void
+shadow_add(const int chain_num, const char * const spec, const time_t exp_ts)
+{
+    struct ipt_shadow  *sh = &(ipt_shadow[chain_num]);
+    ipt_shadow_rule_t  *rules;
+
+    if(sh->num_rules == sh->size)
+    {
+        rules = realloc(sh->rules,
+                (sh->size ? sh->size * 2 : 16) * sizeof(ipt_shadow_rule_t));
+        if(rules == NULL)
+        {
+            /* The rule is in the kernel regardless, so leave it to the
+             * next reconcile.
+            */
+            log_msg(LOG_ERR, "shadow_add() realloc() failed");
+            ipt_shadow_resync = 1;
+            return;
+        }
+        sh->rules = rules;
+        sh->size  = sh->size ? sh->size * 2 : 16;
+    }
+
+    sh->rules[sh->num_rules].exp_ts = exp_ts;
+    strlcpy(sh->rules[sh->num_rules].spec, spec, CMD_BUFSIZE);
+    sh->num_rules++;
+
+    shadow_sync_chain(chain_num);
+    fw_timer_add(exp_ts);
+    return;
+}
+
+/* Is b the same rule as a apart from the expire time in its comment?
+*/
+static int
+same_grant(const char *a, const char *b)
+{
+    const char *ea = strstr(a, EXPIRE_COMMENT_PREFIX);
+    const char *eb = strstr(b, EXPIRE_COMMENT_PREFIX);
+
+    if(ea == NULL || eb == NULL)
+        return strcmp(a, b) == 0;
+
+    if(ea - a != eb - b || strncmp(a, b, ea - a) != 0)
+        return 0;
+
+    ea += strlen(EXPIRE_COMMENT_PREFIX);
+    eb += strlen(EXPIRE_COMMENT_PREFIX);
+    while(isdigit((unsigned char)*ea))
+        ea++;
+    while(isdigit((unsigned char)*eb))
+        eb++;
+
+    return strcmp(ea, eb) == 0;
+}
+
+/* Find the shadow entry for the grant that spec would add, whatever its
+ * expire time.  Returns the entry's index or -1.
+*/
+static int
+shadow_find_grant(const int chain_num, const char * const spec)
+{
+    int i;
+
+    for(i=0; i < ipt_shadow[chain_num].num_rules; i++)
+        if(same_grant(ipt_shadow[chain_num].rules[i].spec, spec))
+            return i;
+
+    return -1;
+}
+
+static void
+shadow_del_index(const int chain_num, const int idx)
+{
+    struct ipt_shadow  *sh = &(ipt_shadow[chain_num]);
+
+    sh->rules[idx] = sh->rules[--sh->num_rules];
+    return;
+}
+
+static void
+shadow_del(const int chain_num, const char * const spec)
+{
+    int i;
+
+    for(i=0; i < ipt_shadow[chain_num].num_rules; i++)
+    {
+        if(strcmp(ipt_shadow[chain_num].rules[i].spec, spec) == 0)
+        {
+            shadow_del_index(chain_num, i);
+            break;
+        }
+    }
+    shadow_sync_chain(chain_num);
+    return;
+}
+
+/* Drop the entries that have expired - after a reconcile they are either
+ * deleted or will be picked up by the next one.
+*/
+static void
+shadow_prune(const int chain_num, const time_t now)
+{
+    int i;
+
+    for(i=ipt_shadow[chain_num].num_rules-1; i >= 0; i--)
+        if(ipt_shadow[chain_num].rules[i].exp_ts <= now)
+            shadow_del_index(chain_num, i);
+
+    shadow_sync_chain(chain_num);
+    return;
+}
+
+static void
+shadow_clear(void)
+{
+    int i;
+
+    for(i=0; i < NUM_FWKNOP_ACCESS_TYPES; i++)
+    {
+        free(ipt_shadow[i].rules);
+        ipt_shadow[i].rules     = NULL;
+        ipt_shadow[i].num_rules = 0;
+        ipt_shadow[i].size      = 0;
+    }
+    return;
+}
+
 /* Quietly flush and delete all fwknop custom chains.
 */
 static void
@@ -629,6 +1109,8 @@ delete_all_chains(const fko_srv_options_t * const opts)
 {
     int     i, res, cmd_ctr = 0;
 
+    shadow_clear();
+
     for(i=0; i < NUM_FWKNOP_ACCESS_TYPES; i++)
     {
         if(fwc.chain[i].target[0] == '\0')
@@ -706,6 +1188,10 @@ delete_all_chains(const fko_srv_options_t * const opts)
             log_msg(LOG_ERR, "delete_all_chains() Error %i from cmd:'%s': %s",
                     res, cmd_buf, err_buf);
     }
+
+    if(fwc.input_shard_bits > 0)
+        shard_cleanup(opts);
+
     return;
 }
 
@@ -875,6 +1361,9 @@ set_fw_chain_conf(const int type, const char * const conf_str)
 int
 fw_config_init(fko_srv_options_t * const opts)
 {
+    char    shard_name[IPT_SHARD_NAME_MAXLEN+1] = {0};
+    int     is_err;
+
     memset(&fwc, 0x0, sizeof(struct fw_config));
 
     /* Set our firewall exe command path (iptables in most cases).
@@ -932,6 +1421,38 @@ fw_config_init(fko_srv_options_t * const opts)
         fwc.use_destination = 1;
     }
 
+    if(strncasecmp(opts->config[CONF_ENABLE_IPT_IPSET], "Y", 1)==0)
+    {
+        fwc.use_ipset = 1;
+        strlcpy(fwc.ipset_name, opts->config[CONF_IPT_IPSET_NAME],
+            sizeof(fwc.ipset_name));
+    }
+
+    fwc.input_shard_bits = strtol_wrapper(opts->config[CONF_IPT_INPUT_SHARD_BITS],
+            0, RCHK_MAX_IPT_INPUT_SHARD_BITS, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+        fwc.input_shard_bits = 0;
+
+    if(fwc.input_shard_bits > 0 && fwc.use_ipset)
+    {
+        log_msg(LOG_WARNING,
+            "IPT_INPUT_SHARD_BITS is not used with ENABLE_IPT_IPSET");
+        fwc.input_shard_bits = 0;
+    }
+
+    /* Room for the "_<node>" suffix on the sub-chain names, the last node
+     * has the longest one.
+    */
+    if(fwc.input_shard_bits > 0
+            && ! shard_node_name((2 << fwc.input_shard_bits) - 1,
+                shard_name, sizeof(shard_name)))
+    {
+        log_msg(LOG_WARNING,
+            "IPT_INPUT_SHARD_BITS not used, chain name '%s' is too long for sub-chains",
+            fwc.chain[IPT_INPUT_ACCESS].to_chain);
+        fwc.input_shard_bits = 0;
+    }
+
     /* Let us find it via our opts struct as well.
     */
     opts->fw_config = &fwc;
@@ -939,49 +1460,475 @@ fw_config_init(fko_srv_options_t * const opts)
     return 1;
 }
 
-int
-fw_initialize(const fko_srv_options_t * const opts)
+/* Rule changes can be gathered into a batch and committed with a single
+ * 'iptables-restore --noflush' run, which is one fork and exec instead of
+ * one or more per rule, and applies the whole batch or none of it.  The
+ * bookkeeping for each change (the shadow table and the log message) is
+ * done once the batch commits.
+*/
+typedef struct ipt_batch_op
 {
-    int res = 1;
+    int                 chain_type;
+    int                 is_delete;
+    unsigned int        exp_ts;
+    char                spec[CMD_BUFSIZE];  /* empty for deletes by number */
+    char                msg[CMD_BUFSIZE];
+} ipt_batch_op_t;
+
+static struct ipt_batch
+{
+    int             enabled;
+    char            restore_cmd[MAX_PATH_LEN];
+    int             num_tables;
+    char            table[IPT_BATCH_MAX_TABLES][MAX_TABLE_NAME_LEN];
+    char            rules[IPT_BATCH_MAX_TABLES][IPT_BATCH_TABLE_BUFSIZE];
+    size_t          rules_len[IPT_BATCH_MAX_TABLES];
+    ipt_batch_op_t  ops[IPT_BATCH_MAX_OPS];
+    int             num_ops;
+    unsigned int    chains_checked;
+} ipt_batch;
+
+static char ipt_batch_buf[IPT_BATCH_MAX_TABLES
+    * (IPT_BATCH_TABLE_BUFSIZE + MAX_TABLE_NAME_LEN + 16)];
 
-    /* See if iptables offers the '-C' argument (older versions don't).  If not,
-     * then switch to parsing iptables -L output to find rules.
-    */
-    if(opts->ipt_disable_check_support)
-        have_ipt_chk_support = 0;
-    else
-        ipt_chk_support(opts);
+static void
+ipt_batch_init(const fko_srv_options_t * const opts)
+{
+    char    restore_path[MAX_PATH_LEN] = {0};
 
-    /* Flush the chains (just in case) so we can start fresh.
-    */
-    if(strncasecmp(opts->config[CONF_FLUSH_IPT_AT_INIT], "Y", 1) == 0)
-        delete_all_chains(opts);
+    memset(&ipt_batch, 0x0, sizeof(ipt_batch));
 
-    /* Now create any configured chains.
-    */
-    if(create_fw_chains(opts) != 0)
+    if(snprintf(restore_path, sizeof(restore_path), "%s" IPT_RESTORE_SUFFIX,
+            fwc.fw_command) >= (int)sizeof(restore_path))
     {
         log_msg(LOG_WARNING,
-                "fw_initialize() Warning: Errors detected during fwknop custom chain creation");
-        res = 0;
+            "Path to %s" IPT_RESTORE_SUFFIX " is too long, iptables rules will be added one at a time",
+            fwc.fw_command);
+        return;
     }
 
-    /* Make sure that the 'comment' match is available
-    */
-    if(strncasecmp(opts->config[CONF_ENABLE_IPT_COMMENT_CHECK], "Y", 1) == 0)
+    if(access(restore_path, X_OK) != 0)
     {
-        if(comment_match_exists(opts) == 1)
-        {
-            log_msg(LOG_INFO, "iptables 'comment' match is available");
-        }
-        else
-        {
-            log_msg(LOG_WARNING, "Warning: Could not use the 'comment' match");
-            res = 0;
-        }
+        log_msg(LOG_WARNING,
+            "Could not find %s, iptables rules will be added one at a time",
+            restore_path);
+        return;
     }
 
-    return(res);
+    if(snprintf(ipt_batch.restore_cmd, sizeof(ipt_batch.restore_cmd),
+            "%s " IPT_RESTORE_ARGS, restore_path)
+            >= (int)sizeof(ipt_batch.restore_cmd))
+    {
+        log_msg(LOG_WARNING,
+            "Command for %s is too long, iptables rules will be added one at a time",
+            restore_path);
+        return;
+    }
+    ipt_batch.enabled = 1;
+
+    return;
+}
+
+static void
+ipt_batch_reset(void)
+{
+    int i;
+
+    for(i=0; i < ipt_batch.num_tables; i++)
+    {
+        ipt_batch.rules[i][0]   = '\0';
+        ipt_batch.rules_len[i]  = 0;
+    }
+    ipt_batch.num_tables     = 0;
+    ipt_batch.num_ops        = 0;
+    ipt_batch.chains_checked = 0;
+    return;
+}
+
+/* Commit the pending batch.  Returns 1 on success (or if there was
+ * nothing to do) and 0 if iptables-restore failed, in which case none of
+ * the changes were made.
+*/
+static int
+ipt_batch_commit(const fko_srv_options_t * const opts)
+{
+    ipt_batch_op_t *op;
+    size_t          len = 0;
+    int             i, res;
+
+    if(ipt_batch.num_ops == 0)
+    {
+        ipt_batch_reset();
+        return 1;
+    }
+
+    for(i=0; i < ipt_batch.num_tables; i++)
+        len += snprintf(ipt_batch_buf + len, sizeof(ipt_batch_buf) - len,
+            "*%s\n%sCOMMIT\n", ipt_batch.table[i], ipt_batch.rules[i]);
+
+    res = run_extcmd_write(ipt_batch.restore_cmd, ipt_batch_buf,
+            &pid_status, opts);
+
+    log_msg(LOG_DEBUG, "ipt_batch_commit() CMD: '%s' (res: %d, status: %d)\n%s",
+        ipt_batch.restore_cmd, res, pid_status, ipt_batch_buf);
+
+    if(! EXTCMD_IS_SUCCESS(res) || ! WIFEXITED(pid_status)
+            || WEXITSTATUS(pid_status) != 0)
+    {
+        log_msg(LOG_ERR,
+            "ipt_batch_commit() Error from cmd:'%s', %d rule changes were not made",
+            ipt_batch.restore_cmd, ipt_batch.num_ops);
+
+        /* One rule that has gone missing fails a whole batch of deletes,
+         * so check the chains themselves next time.
+        */
+        ipt_shadow_resync = 1;
+        ipt_batch_reset();
+        return 0;
+    }
+
+    for(i=0; i < ipt_batch.num_ops; i++)
+    {
+        op = &(ipt_batch.ops[i]);
+
+        if(op->msg[0] != '\0')
+            log_msg(LOG_INFO, "%s", op->msg);
+
+        if(! op->is_delete)
+            shadow_add(op->chain_type, op->spec, op->exp_ts);
+        else if(op->spec[0] != '\0')
+            shadow_del(op->chain_type, op->spec);
+    }
+
+    ipt_batch_reset();
+    return 1;
+}
+
+/* Is this exact rule line already pending?
+*/
+static int
+ipt_batch_has_line(const char * const rules, const char * const line)
+{
+    const char *ndx = rules;
+
+    while((ndx = strstr(ndx, line)) != NULL)
+    {
+        if(ndx == rules || *(ndx-1) == '\n')
+            return 1;
+        ndx++;
+    }
+    return 0;
+}
+
+/* Queue one rule line (without the '-t table' part) for the chain's table.
+ * If the batch is full it is committed first, and 0 is returned without
+ * queueing the line if that commit fails.
+*/
+static int
+ipt_batch_queue(const fko_srv_options_t * const opts,
+        struct fw_chain * const chain, const char * const line,
+        const char * const spec, const int is_delete,
+        const unsigned int exp_ts, const char * const msg)
+{
+    size_t          line_len = strlen(line);
+    int             i;
+
+    for(i=0; i < ipt_batch.num_tables; i++)
+        if(strcmp(ipt_batch.table[i], chain->table) == 0)
+            break;
+
+    if(! is_delete && i < ipt_batch.num_tables
+            && ipt_batch_has_line(ipt_batch.rules[i], line))
+        return 1;
+
+    if(ipt_batch.num_ops == IPT_BATCH_MAX_OPS
+            || (i == ipt_batch.num_tables && i == IPT_BATCH_MAX_TABLES)
+            || (i < ipt_batch.num_tables
+                && ipt_batch.rules_len[i] + line_len >= IPT_BATCH_TABLE_BUFSIZE))
+    {
+        if(ipt_batch_commit(opts) != 1)
+            return 0;
+        i = 0;
+    }
+
+    if(i == ipt_batch.num_tables)
+    {
+        strlcpy(ipt_batch.table[i], chain->table, MAX_TABLE_NAME_LEN);
+        ipt_batch.num_tables++;
+    }
+
+    memcpy(ipt_batch.rules[i] + ipt_batch.rules_len[i], line, line_len + 1);
+    ipt_batch.rules_len[i] += line_len;
+
+    ipt_batch.ops[ipt_batch.num_ops].chain_type = chain->type;
+    ipt_batch.ops[ipt_batch.num_ops].is_delete  = is_delete;
+    ipt_batch.ops[ipt_batch.num_ops].exp_ts     = exp_ts;
+    strlcpy(ipt_batch.ops[ipt_batch.num_ops].spec, spec, CMD_BUFSIZE);
+    strlcpy(ipt_batch.ops[ipt_batch.num_ops].msg, msg, CMD_BUFSIZE);
+    ipt_batch.num_ops++;
+
+    return 1;
+}
+
+/* Queue a rule built from one of the IPT_*_ARGS macros.  The rule_exists()
+ * check is skipped - a rule carries its expire time, so a duplicate could
+ * only come from the same request and is caught within the batch.
+*/
+static void
+ipt_batch_add_rule(const fko_srv_options_t * const opts,
+        struct fw_chain * const chain, const char * const rule_buf,
+        const char * const srcip, const char * const dstip,
+        const unsigned int port, const unsigned int exp_ts,
+        const char * const msg)
+{
+    char        line[IPT_BATCH_LINE_LEN] = {0};
+    char        spec[CMD_BUFSIZE] = {0};
+    char        log_buf[CMD_BUFSIZE] = {0};
+
+    /* Only check the chain and jump rule once per batch.
+    */
+    if(! (ipt_batch.chains_checked & (1 << chain->type)))
+    {
+        mk_chain(opts, chain->type);
+        ipt_batch.chains_checked |= (1 << chain->type);
+    }
+
+    ipt_rule_spec(chain, rule_buf, spec, sizeof(spec));
+    snprintf(line, sizeof(line), "-A %s %s\n", chain->to_chain, spec);
+
+    snprintf(log_buf, CMD_BUFSIZE-1,
+        "Added %s rule to %s for %s -> %s port %d, expires at %u",
+        msg, chain->to_chain, srcip, (dstip == NULL) ? IPT_ANY_IP : dstip,
+        port, exp_ts);
+
+    ipt_batch_queue(opts, chain, line, spec, 0, exp_ts, log_buf);
+    return;
+}
+
+/* Run an iptables command against one of the fixed ipset rules.
+*/
+static int
+ipset_rule_cmd(const fko_srv_options_t * const opts, const char * const action,
+        const char * const chain, const char * const rule)
+{
+    int res = 0;
+
+    zero_cmd_buffers();
+
+    if(snprintf(cmd_buf, CMD_BUFSIZE-1, "%s %s %s %s",
+            fwc.fw_command, action, chain, rule) >= CMD_BUFSIZE-1)
+    {
+        log_msg(LOG_ERR, "ipset_rule_cmd() Command for rule in %s is too long: %s",
+            chain, rule);
+        return 0;
+    }
+
+    res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, WANT_STDERR,
+                NO_TIMEOUT, &pid_status, opts);
+    chop_newline(err_buf);
+
+    log_msg(LOG_DEBUG, "ipset_rule_cmd() CMD: '%s' (res: %d, err: %s)",
+        cmd_buf, res, err_buf);
+
+    return EXTCMD_IS_SUCCESS(res);
+}
+
+/* Replace any copies of a fixed rule with one at the end of the chain, so
+ * the rules end up in the same order whether or not the chains were
+ * flushed.
+*/
+static int
+set_ipset_rule(const fko_srv_options_t * const opts,
+        const char * const chain, const char * const rule)
+{
+    int cmd_ctr = 0;
+
+    while(cmd_ctr < CMD_LOOP_TRIES && ipset_rule_cmd(opts, "-D", chain, rule))
+        cmd_ctr++;
+
+    if(ipset_rule_cmd(opts, "-A", chain, rule))
+        return 1;
+
+    log_msg(LOG_ERR, "Could not add rule '%s' to %s: %s", rule, chain, err_buf);
+    return 0;
+}
+
+static int
+ipset_use_connmark(const fko_srv_options_t * const opts)
+{
+    return strncasecmp(opts->config[CONF_DISABLE_CONNECTION_TRACKING], "N", 1) == 0;
+}
+
+static const char *
+ipset_in_flags(void)
+{
+    return fwc.use_destination ? IPT_IPSET_IN_DST_FLAGS : IPT_IPSET_IN_FLAGS;
+}
+
+/* The mangle table rule that copies the SDP ID stored with a set entry
+ * into the packet mark.  It lives outside of the fwknop chains.
+*/
+static void
+del_ipset_mark_rule(const fko_srv_options_t * const opts)
+{
+    char    rule_buf[CMD_BUFSIZE] = {0};
+    int     cmd_ctr = 0;
+
+    snprintf(rule_buf, CMD_BUFSIZE-1, IPT_IPSET_MAP_MARK_ARGS,
+        fwc.ipset_name, ipset_in_flags(), fwc.ipset_name, ipset_in_flags());
+
+    while(cmd_ctr < CMD_LOOP_TRIES && ipset_rule_cmd(opts, "-D",
+                fwc.chain[IPT_INPUT_ACCESS].from_chain, rule_buf))
+        cmd_ctr++;
+
+    return;
+}
+
+/* Create the access set and the few fixed rules that match against it.
+ * Grants are then set entries with a timeout, which the kernel expires.
+*/
+static int
+ipset_initialize(const fko_srv_options_t * const opts)
+{
+    char    rule_buf[CMD_BUFSIZE] = {0};
+    int     res;
+
+    struct fw_chain * const in_chain  = &(fwc.chain[IPT_INPUT_ACCESS]);
+    struct fw_chain * const out_chain = &(fwc.chain[IPT_OUTPUT_ACCESS]);
+
+    if(ipset_nl_open() != 0)
+    {
+        log_msg(LOG_ERR, "Could not open ipset netlink socket: %s",
+            strerror(errno));
+        return 0;
+    }
+
+    if(strncasecmp(opts->config[CONF_FLUSH_IPT_AT_INIT], "Y", 1) == 0)
+    {
+        del_ipset_mark_rule(opts);
+        if((res = ipset_nl_destroy(fwc.ipset_name)) != 0 && res != ENOENT)
+            log_msg(LOG_WARNING, "Could not destroy ipset '%s': %s",
+                fwc.ipset_name, ipset_nl_strerror(res));
+    }
+
+    if((res = ipset_nl_create(fwc.ipset_name,
+            fwc.use_destination ? "hash:ip,port,ip" : "hash:ip,port",
+            DEF_FW_ACCESS_TIMEOUT, ipset_use_connmark(opts))) != 0)
+    {
+        log_msg(LOG_ERR, "Could not create ipset '%s': %s",
+            fwc.ipset_name, ipset_nl_strerror(res));
+        return 0;
+    }
+
+    if(ipset_use_connmark(opts))
+    {
+        snprintf(rule_buf, CMD_BUFSIZE-1, IPT_IPSET_MAP_MARK_ARGS,
+            fwc.ipset_name, ipset_in_flags(), fwc.ipset_name, ipset_in_flags());
+        if(set_ipset_rule(opts, in_chain->from_chain, rule_buf) != 1)
+            return 0;
+
+        snprintf(rule_buf, CMD_BUFSIZE-1, IPT_IPSET_SAVE_MARK_ARGS,
+            in_chain->table, fwc.ipset_name, ipset_in_flags());
+        if(set_ipset_rule(opts, in_chain->to_chain, rule_buf) != 1)
+            return 0;
+    }
+
+    snprintf(rule_buf, CMD_BUFSIZE-1, IPT_IPSET_RULE_ARGS,
+        in_chain->table, fwc.ipset_name, ipset_in_flags(), in_chain->target);
+    if(set_ipset_rule(opts, in_chain->to_chain, rule_buf) != 1)
+        return 0;
+
+    if(strlen(out_chain->to_chain))
+    {
+        snprintf(rule_buf, CMD_BUFSIZE-1, IPT_IPSET_RULE_ARGS,
+            out_chain->table, fwc.ipset_name,
+            fwc.use_destination ? IPT_IPSET_OUT_DST_FLAGS : IPT_IPSET_OUT_FLAGS,
+            out_chain->target);
+        if(set_ipset_rule(opts, out_chain->to_chain, rule_buf) != 1)
+            return 0;
+    }
+
+    log_msg(LOG_INFO, "Granting access through ipset '%s'", fwc.ipset_name);
+
+    return 1;
+}
+
+static void
+ipset_cleanup(const fko_srv_options_t * const opts)
+{
+    int res;
+
+    del_ipset_mark_rule(opts);
+
+    /* fw_initialize() is not called for --fw-flush.
+    */
+    if(ipset_nl_open() != 0)
+        return;
+
+    if((res = ipset_nl_destroy(fwc.ipset_name)) != 0 && res != ENOENT)
+        log_msg(LOG_WARNING, "Could not destroy ipset '%s': %s",
+            fwc.ipset_name, ipset_nl_strerror(res));
+
+    ipset_nl_close();
+    return;
+}
+
+int
+fw_initialize(const fko_srv_options_t * const opts)
+{
+    int res = 1;
+
+    /* See if iptables offers the '-C' argument (older versions don't).  If not,
+     * then switch to parsing iptables -L output to find rules.
+    */
+    if(opts->ipt_disable_check_support)
+        have_ipt_chk_support = 0;
+    else
+        ipt_chk_support(opts);
+
+    if(strncasecmp(opts->config[CONF_ENABLE_IPT_RESTORE_BATCH], "Y", 1) == 0)
+        ipt_batch_init(opts);
+
+    /* Flush the chains (just in case) so we can start fresh.
+    */
+    if(strncasecmp(opts->config[CONF_FLUSH_IPT_AT_INIT], "Y", 1) == 0)
+        delete_all_chains(opts);
+
+    /* Now create any configured chains.
+    */
+    if(create_fw_chains(opts) != 0)
+    {
+        log_msg(LOG_WARNING,
+                "fw_initialize() Warning: Errors detected during fwknop custom chain creation");
+        res = 0;
+    }
+
+    if(fwc.input_shard_bits > 0 && shard_setup(opts) != 0)
+    {
+        log_msg(LOG_WARNING,
+                "fw_initialize() Warning: Errors detected while setting up the input sub-chains");
+        res = 0;
+    }
+
+    /* Make sure that the 'comment' match is available
+    */
+    if(strncasecmp(opts->config[CONF_ENABLE_IPT_COMMENT_CHECK], "Y", 1) == 0)
+    {
+        if(comment_match_exists(opts) == 1)
+        {
+            log_msg(LOG_INFO, "iptables 'comment' match is available");
+        }
+        else
+        {
+            log_msg(LOG_WARNING, "Warning: Could not use the 'comment' match");
+            res = 0;
+        }
+    }
+
+    if(fwc.use_ipset && ipset_initialize(opts) != 1)
+        res = 0;
+
+    return(res);
 }
 
 int
@@ -989,9 +1936,18 @@ fw_cleanup(const fko_srv_options_t * const opts)
 {
     if(strncasecmp(opts->config[CONF_FLUSH_IPT_AT_EXIT], "N", 1) == 0
             && opts->fw_flush == 0)
+    {
+        ipset_nl_close();
         return(0);
+    }
 
     delete_all_chains(opts);
+
+    /* The set can only go once no rule refers to it.
+    */
+    if(fwc.use_ipset)
+        ipset_cleanup(opts);
+
     return(0);
 }
 
@@ -1026,6 +1982,103 @@ create_rule(const fko_srv_options_t * const opts,
     return res;
 }
 
+/* If the client already holds the grant that rule_buf would add (it
+ * knocked again before the rule expired), move the expire time out
+ * instead of adding a second rule.  The new rule goes in before the old
+ * one is removed, in the same iptables-restore commit when batching, so
+ * access is not interrupted.  Returns 1 if the grant was handled here and
+ * 0 if the rule should be added as usual.
+*/
+static int
+extend_grant(const fko_srv_options_t * const opts,
+        struct fw_chain * const chain, const char * const rule_buf,
+        const char * const srcip, const char * const dstip,
+        const unsigned int port, const unsigned int exp_ts,
+        const char * const msg)
+{
+    char        spec[CMD_BUFSIZE] = {0};
+    char        old_spec[CMD_BUFSIZE] = {0};
+    char        line[IPT_BATCH_LINE_LEN] = {0};
+    char        log_buf[CMD_BUFSIZE] = {0};
+    time_t      old_exp;
+    int         idx, res;
+
+    ipt_rule_spec(chain, rule_buf, spec, sizeof(spec));
+
+    if((idx = shadow_find_grant(chain->type, spec)) < 0)
+        return 0;
+
+    old_exp = ipt_shadow[chain->type].rules[idx].exp_ts;
+    if(old_exp >= exp_ts)
+    {
+        log_msg(LOG_DEBUG,
+            "extend_grant() %s rule in %s for %s -> %s port %d already expires at %u",
+            msg, chain->to_chain, srcip, (dstip == NULL) ? IPT_ANY_IP : dstip,
+            port, (unsigned int)old_exp);
+        return 1;
+    }
+    strlcpy(old_spec, ipt_shadow[chain->type].rules[idx].spec, sizeof(old_spec));
+
+    snprintf(log_buf, CMD_BUFSIZE-1,
+        "Extended %s rule in %s for %s -> %s port %d, expires at %u",
+        msg, chain->to_chain, srcip, (dstip == NULL) ? IPT_ANY_IP : dstip,
+        port, exp_ts);
+
+    if(ipt_batch.enabled)
+    {
+        snprintf(line, sizeof(line), "-A %s %s\n", chain->to_chain, spec);
+        if(ipt_batch_queue(opts, chain, line, spec, 0, exp_ts, log_buf) != 1)
+            return 1;
+
+        snprintf(line, sizeof(line), "-D %s %s\n", chain->to_chain, old_spec);
+        ipt_batch_queue(opts, chain, line, old_spec, 1, old_exp, "");
+        return 1;
+    }
+
+    /* If the new rule cannot be added the old one stays until it expires.
+    */
+    if(! create_rule(opts, chain->to_chain, rule_buf))
+        return 1;
+
+    shadow_add(chain->type, spec, exp_ts);
+
+    zero_cmd_buffers();
+
+    /* Same as a failed delete if the command does not fit - the old rule
+     * is left for the next listing of the chain to remove.
+    */
+    if(snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPT_DEL_RULE_SPEC_ARGS,
+            fwc.fw_command, chain->table, chain->to_chain, old_spec)
+            >= CMD_BUFSIZE-1)
+    {
+        log_msg(LOG_ERR,
+            "extend_grant() Delete command for old rule in %s is too long: %s",
+            chain->to_chain, old_spec);
+        ipt_shadow_resync = 1;
+    }
+    else
+    {
+        res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE,
+                WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
+        chop_newline(err_buf);
+
+        log_msg(LOG_DEBUG, "extend_grant() CMD: '%s' (res: %d, err: %s)",
+            cmd_buf, res, err_buf);
+
+        if(! EXTCMD_IS_SUCCESS(res))
+        {
+            log_msg(LOG_ERR, "extend_grant() Error %i from cmd:'%s': %s",
+                    res, cmd_buf, err_buf);
+            ipt_shadow_resync = 1;
+        }
+    }
+
+    shadow_del(chain->type, old_spec);
+
+    log_msg(LOG_INFO, "%s", log_buf);
+    return 1;
+}
+
 static void
 connmark_rule(const fko_srv_options_t * const opts,
         const char * const complete_rule_buf,
@@ -1044,6 +2097,7 @@ connmark_rule(const fko_srv_options_t * const opts,
         const char * const access_msg)
 {
     char rule_buf[CMD_BUFSIZE] = {0};
+    char spec[CMD_BUFSIZE] = {0};
 
     if(complete_rule_buf != NULL && complete_rule_buf[0] != 0x0)
     {
@@ -1064,6 +2118,16 @@ connmark_rule(const fko_srv_options_t * const opts,
         );
     }
 
+    if(extend_grant(opts, chain, rule_buf, srcip, dstip, port, exp_ts, msg))
+        return;
+
+    if(ipt_batch.enabled)
+    {
+        ipt_batch_add_rule(opts, chain, rule_buf, srcip, dstip, port,
+            exp_ts, msg);
+        return;
+    }
+
     /* Check to make sure that the chain and jump rule exist
     */
     mk_chain(opts, chain->type);
@@ -1078,13 +2142,8 @@ connmark_rule(const fko_srv_options_t * const opts,
                 port, exp_ts
             );
 
-            chain->active_rules++;
-
-            /* Reset the next expected expire time for this chain if it
-            * is warranted.
-            */
-            if(chain->next_expire < now || exp_ts < chain->next_expire)
-                chain->next_expire = exp_ts;
+            ipt_rule_spec(chain, rule_buf, spec, sizeof(spec));
+            shadow_add(chain->type, spec, exp_ts);
         }
     }
 
@@ -1103,13 +2162,15 @@ ipt_rule(const fko_srv_options_t * const opts,
         const unsigned int port,
         const char * const nat_ip,
         const unsigned int nat_port,
-        struct fw_chain * const chain,
+        struct fw_chain *chain,
         const unsigned int exp_ts,
         const time_t now,
         const char * const msg,
         const char * const access_msg)
 {
     char rule_buf[CMD_BUFSIZE] = {0};
+    char spec[CMD_BUFSIZE] = {0};
+    struct fw_chain shard;
 
     if(complete_rule_buf != NULL && complete_rule_buf[0] != 0x0)
     {
@@ -1130,6 +2191,21 @@ ipt_rule(const fko_srv_options_t * const opts,
         );
     }
 
+    /* With IPT_INPUT_SHARD_BITS the rule goes in the sub-chain for its
+     * source address.
+    */
+    chain = shard_chain(chain, rule_buf, &shard);
+
+    if(extend_grant(opts, chain, rule_buf, srcip, dstip, port, exp_ts, msg))
+        return;
+
+    if(ipt_batch.enabled)
+    {
+        ipt_batch_add_rule(opts, chain, rule_buf, srcip, dstip, port,
+            exp_ts, msg);
+        return;
+    }
+
     /* Check to make sure that the chain and jump rule exist
     */
     mk_chain(opts, chain->type);
@@ -1144,13 +2220,8 @@ ipt_rule(const fko_srv_options_t * const opts,
                 port, exp_ts
             );
 
-            chain->active_rules++;
-
-            /* Reset the next expected expire time for this chain if it
-            * is warranted.
-            */
-            if(chain->next_expire < now || exp_ts < chain->next_expire)
-                chain->next_expire = exp_ts;
+            ipt_rule_spec(chain, rule_buf, spec, sizeof(spec));
+            shadow_add(chain->type, spec, exp_ts);
         }
     }
 
@@ -1172,9 +2243,9 @@ static void forward_access_rule(const fko_srv_options_t * const opts,
 
     log_msg(LOG_DEBUG,
             "forward_access_rule() forward_all: %d, nat_ip: %s, nat_port: %d",
-            acc->forward_all, nat_ip, nat_port);
+            acc->cold->forward_all, nat_ip, nat_port);
 
-    if(acc->forward_all)
+    if(acc->cold->forward_all)
     {
         if(strncasecmp(opts->config[CONF_DISABLE_CONNECTION_TRACKING], "N", 1) == 0)
         {
@@ -1245,9 +2316,9 @@ static void dnat_rule(const fko_srv_options_t * const opts,
     char   rule_buf[CMD_BUFSIZE] = {0};
 
     log_msg(LOG_DEBUG, "dnat_rule() forward_all: %d, nat_ip: %s, nat_port: %d",
-            acc->forward_all, nat_ip, nat_port);
+            acc->cold->forward_all, nat_ip, nat_port);
 
-    if(acc->forward_all)
+    if(acc->cold->forward_all)
     {
         memset(rule_buf, 0, CMD_BUFSIZE);
 
@@ -1306,11 +2377,11 @@ static void snat_rule(const fko_srv_options_t * const opts,
 
     log_msg(LOG_DEBUG,
             "snat_rule() forward_all: %d, nat_ip: %s, nat_port: %d, force_snat: %d, force_snat_ip: %s, force_masq: %d",
-            acc->forward_all, nat_ip, nat_port, acc->force_snat,
-            (acc->force_snat_ip == NULL) ? "(NONE)" : acc->force_snat_ip,
-            acc->force_masquerade);
+            acc->cold->forward_all, nat_ip, nat_port, acc->cold->force_snat,
+            (acc->cold->force_snat_ip == NULL) ? "(NONE)" : acc->cold->force_snat_ip,
+            acc->cold->force_masquerade);
 
-    if(acc->forward_all)
+    if(acc->cold->forward_all)
     {
         /* Default to MASQUERADE */
         snat_chain = &(opts->fw_config->chain[IPT_MASQUERADE_ACCESS]);
@@ -1318,12 +2389,12 @@ static void snat_rule(const fko_srv_options_t * const opts,
 
         /* Add SNAT or MASQUERADE rules.
         */
-        if(acc->force_snat && is_valid_ipv4_addr(acc->force_snat_ip))
+        if(acc->cold->force_snat && acc->cold->force_snat_ip != NULL)
         {
             /* Using static SNAT */
             snat_chain = &(opts->fw_config->chain[IPT_SNAT_ACCESS]);
             snprintf(snat_target, SNAT_TARGET_BUFSIZE-1,
-                "--to-source %s", acc->force_snat_ip);
+                "--to-source %s", acc->cold->force_snat_ip);
         }
         else if((opts->config[CONF_SNAT_TRANSLATE_IP] != NULL)
             && is_valid_ipv4_addr(opts->config[CONF_SNAT_TRANSLATE_IP]))
@@ -1352,14 +2423,14 @@ static void snat_rule(const fko_srv_options_t * const opts,
     {
         /* Add SNAT or MASQUERADE rules.
         */
-        if(acc->force_snat && is_valid_ipv4_addr(acc->force_snat_ip))
+        if(acc->cold->force_snat && acc->cold->force_snat_ip != NULL)
         {
             /* Using static SNAT */
             snat_chain = &(opts->fw_config->chain[IPT_SNAT_ACCESS]);
             snprintf(snat_target, SNAT_TARGET_BUFSIZE-1,
-                "--to-source %s:%i", acc->force_snat_ip, fst_port);
+                "--to-source %s:%i", acc->cold->force_snat_ip, fst_port);
         }
-        else if(acc->force_snat && acc->force_masquerade)
+        else if(acc->cold->force_snat && acc->cold->force_masquerade)
         {
             /* Using MASQUERADE */
             snat_chain = &(opts->fw_config->chain[IPT_MASQUERADE_ACCESS]);
@@ -1403,15 +2474,75 @@ static void snat_rule(const fko_srv_options_t * const opts,
     return;
 }
 
+/* Send the queued ipset grants to the kernel in one message.
+*/
+static void
+ipset_send_grants(const fko_srv_options_t * const opts,
+        const spa_data_t * const spadat, const ipset_entry_t * const entries,
+        int * const num_entries, const unsigned int exp_ts)
+{
+    int i, res;
+
+    if(*num_entries == 0)
+        return;
+
+    res = ipset_nl_add(fwc.ipset_name, entries, *num_entries,
+            fwc.use_destination, (spadat->fw_access_timeout > 0)
+                ? spadat->fw_access_timeout : 1, ipset_use_connmark(opts));
+
+    if(res != 0)
+        log_msg(LOG_ERR, "Could not add %d entries to ipset '%s': %s",
+            *num_entries, fwc.ipset_name, ipset_nl_strerror(res));
+    else
+        for(i=0; i < *num_entries; i++)
+            log_msg(LOG_INFO, "Added access entry to ipset %s for %s -> %s %s/%d, expires at %u",
+                fwc.ipset_name, spadat->use_src_ip,
+                (fwc.use_destination ? spadat->pkt_destination_ip : IPT_ANY_IP),
+                (entries[i].proto == PROTO_TCP) ? "tcp" : "udp",
+                entries[i].port, exp_ts);
+
+    *num_entries = 0;
+    return;
+}
+
+static void
+ipset_queue_grant(const fko_srv_options_t * const opts,
+        const spa_data_t * const spadat, ipset_entry_t * const entries,
+        int * const num_entries, const unsigned int proto,
+        const unsigned int port, const unsigned int exp_ts)
+{
+    ipset_entry_t  *e;
+
+    if(*num_entries == IPSET_NL_MAX_ENTRIES)
+        ipset_send_grants(opts, spadat, entries, num_entries, exp_ts);
+
+    e = &(entries[*num_entries]);
+    memset(e, 0x0, sizeof(*e));
+
+    if(inet_pton(AF_INET, spadat->use_src_ip, &(e->ip)) != 1
+            || (fwc.use_destination
+                && inet_pton(AF_INET, spadat->pkt_destination_ip, &(e->ip2)) != 1))
+    {
+        log_msg(LOG_ERR, "ipset_queue_grant() invalid address");
+        return;
+    }
+    e->proto = proto;
+    e->port  = port;
+    e->mark  = spadat->sdp_id;
+
+    (*num_entries)++;
+    return;
+}
+
 /****************************************************************************/
 
 /* Rule Processing - Create an access request...
 */
-int
-process_spa_request(const fko_srv_options_t * const opts,
+static int
+spa_access_rules(const fko_srv_options_t * const opts,
         const acc_stanza_t * const acc, spa_data_t * const spadat)
 {
-    char            nat_ip[MAX_IPV4_STR_LEN] = {0};
+    const char     *nat_ip = NULL;
     unsigned int    nat_port = 0;
     unsigned int    fst_proto;
     unsigned int    fst_port;
@@ -1426,8 +2557,10 @@ process_spa_request(const fko_srv_options_t * const opts,
 
     service_data_list_t *next_service = spadat->service_data_list;
 
-    char            *ndx = NULL;
-    int             res = 0, is_err;
+    ipset_entry_t   ipset_entries[IPSET_NL_MAX_ENTRIES];
+    int             num_ipset_entries = 0;
+
+    int             res = 0;
     time_t          now;
     unsigned int    exp_ts;
 
@@ -1489,7 +2622,7 @@ process_spa_request(const fko_srv_options_t * const opts,
 
                 /* DNAT rule
                 */
-                if(strlen(dnat_chain->to_chain) && !acc->disable_dnat)
+                if(strlen(dnat_chain->to_chain) && !acc->cold->disable_dnat)
                     dnat_rule(opts, acc, dnat_chain,
                             next_service->service_data->nat_ip_str,
                             next_service->service_data->nat_port,
@@ -1499,7 +2632,7 @@ process_spa_request(const fko_srv_options_t * const opts,
 
                 /* SNAT rule
                 */
-                if(acc->force_snat || strncasecmp(opts->config[CONF_ENABLE_IPT_SNAT], "Y", 1) == 0)
+                if(acc->cold->force_snat || strncasecmp(opts->config[CONF_ENABLE_IPT_SNAT], "Y", 1) == 0)
                     snat_rule(opts, acc,
                             next_service->service_data->nat_ip_str,
                             next_service->service_data->nat_port,
@@ -1509,6 +2642,13 @@ process_spa_request(const fko_srv_options_t * const opts,
 
 
             }  // END IF nat_port != 0
+            else if(fwc.use_ipset)
+            {
+                // local access without NAT, granted through the ipset
+                ipset_queue_grant(opts, spadat, ipset_entries,
+                    &num_ipset_entries, next_service->service_data->proto,
+                    next_service->service_data->port, exp_ts);
+            }
             else
             {
                 // local access without NAT
@@ -1549,6 +2689,8 @@ process_spa_request(const fko_srv_options_t * const opts,
 
         }  // END WHILE next_service != NULL
 
+        ipset_send_grants(opts, spadat, ipset_entries, &num_ipset_entries, exp_ts);
+
         return res;
     }
 
@@ -1583,36 +2725,20 @@ process_spa_request(const fko_srv_options_t * const opts,
       || spadat->message_type == FKO_CLIENT_TIMEOUT_LOCAL_NAT_ACCESS_MSG
       || spadat->message_type == FKO_NAT_ACCESS_MSG
       || spadat->message_type == FKO_CLIENT_TIMEOUT_NAT_ACCESS_MSG
-      || acc->force_nat)
+      || acc->cold->force_nat)
     {
-        if(acc->force_nat)
+        /* The client's NAT request was parsed and validated by
+         * check_nat_access_types(), FORCE_NAT when the stanza was loaded.
+        */
+        if(acc->cold->force_nat)
         {
-            strlcpy(nat_ip, acc->force_nat_ip, sizeof(nat_ip));
-            nat_port = acc->force_nat_port;
+            nat_ip   = acc->cold->force_nat_ip;
+            nat_port = acc->cold->force_nat_port;
         }
         else
         {
-            ndx = strchr(spadat->nat_access, ',');
-            if(ndx != NULL)
-            {
-                strlcpy(nat_ip, spadat->nat_access, (ndx-spadat->nat_access)+1);
-                if (! is_valid_ipv4_addr(nat_ip))
-                {
-                    log_msg(LOG_INFO, "Invalid NAT IP in SPA message");
-                    free_acc_port_list(port_list);
-                    return res;
-                }
-
-                nat_port = strtol_wrapper(ndx+1, 0, MAX_PORT,
-                        NO_EXIT_UPON_ERR, &is_err);
-                if(is_err != FKO_SUCCESS)
-                {
-                    log_msg(LOG_INFO, "Invalid NAT port in SPA message");
-                    free_acc_port_list(port_list);
-                    res = is_err;
-                    return res;
-                }
-            }
+            nat_ip   = spadat->nat.ip_str;
+            nat_port = spadat->nat.port;
         }
 
         if(spadat->message_type == FKO_LOCAL_NAT_ACCESS_MSG
@@ -1645,16 +2771,28 @@ process_spa_request(const fko_srv_options_t * const opts,
 
         /* DNAT rule
         */
-        if(strlen(dnat_chain->to_chain) && !acc->disable_dnat)
+        if(strlen(dnat_chain->to_chain) && !acc->cold->disable_dnat)
             dnat_rule(opts, acc, dnat_chain, nat_ip,
                     nat_port, fst_proto, fst_port, spadat, exp_ts, now);
 
         /* SNAT rule
         */
-        if(acc->force_snat || strncasecmp(opts->config[CONF_ENABLE_IPT_SNAT], "Y", 1) == 0)
+        if(acc->cold->force_snat || strncasecmp(opts->config[CONF_ENABLE_IPT_SNAT], "Y", 1) == 0)
             snat_rule(opts, acc, nat_ip, nat_port,
                     fst_proto, fst_port, spadat, exp_ts, now);
     }
+    else if(fwc.use_ipset)
+    {
+        /* Non-NAT request, granted through the ipset.
+        */
+        while(ple != NULL)
+        {
+            ipset_queue_grant(opts, spadat, ipset_entries,
+                &num_ipset_entries, ple->proto, ple->port, exp_ts);
+            ple = ple->next;
+        }
+        ipset_send_grants(opts, spadat, ipset_entries, &num_ipset_entries, exp_ts);
+    }
     else /* Non-NAT request - this is the typical case. */
     {
         /* Create an access command for each proto/port for the source ip.
@@ -1698,6 +2836,20 @@ process_spa_request(const fko_srv_options_t * const opts,
     return(res);
 }
 
+int
+process_spa_request(const fko_srv_options_t * const opts,
+        const acc_stanza_t * const acc, spa_data_t * const spadat)
+{
+    int res = spa_access_rules(opts, acc, spadat);
+
+    /* Commit the rules gathered for this request in one go.
+    */
+    if(ipt_batch.enabled)
+        ipt_batch_commit(opts);
+
+    return res;
+}
+
 static void
 rm_expired_rules(const fko_srv_options_t * const opts,
         const char * const ipt_output_buf,
@@ -1705,6 +2857,8 @@ rm_expired_rules(const fko_srv_options_t * const opts,
 {
     char        exp_str[12]     = {0};
     char        rule_num_str[6] = {0};
+    char        del_line[MAX_CHAIN_NAME_LEN+16] = {0};
+    char        del_msg[CMD_BUFSIZE] = {0};
     char        *rn_start, *rn_end, *tmp_mark;
 
     int         res, is_err, rn_offset=0, rule_num;
@@ -1793,6 +2947,29 @@ rm_expired_rules(const fko_srv_options_t * const opts,
                 break;
             }
 
+            if(ipt_batch.enabled)
+            {
+                /* The deletes are applied in order, so the same rn_offset
+                 * accounting holds within the batch.
+                */
+                snprintf(del_line, sizeof(del_line), "-D %s %i\n",
+                    ch[cpos].to_chain, rule_num - rn_offset);
+                snprintf(del_msg, CMD_BUFSIZE-1,
+                    "Removed rule %s from %s with expire time of %u",
+                    rule_num_str, ch[cpos].to_chain, (unsigned int)rule_exp);
+
+                /* A failed commit of earlier deletes leaves the rule
+                 * numbers unknown, so stop here until the next pass.
+                */
+                if(ipt_batch_queue(opts, &(ch[cpos]), del_line, "", 1,
+                            rule_exp, del_msg) != 1)
+                    break;
+
+                rn_offset++;
+                ndx = strstr(tmp_mark, EXPIRE_COMMENT_PREFIX);
+                continue;
+            }
+
             zero_cmd_buffers();
 
             snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPT_DEL_RULE_ARGS,
@@ -1850,88 +3027,211 @@ rm_expired_rules(const fko_srv_options_t * const opts,
     return;
 }
 
+/* Delete the rules in the shadow table that have expired.
+*/
+static void
+expire_shadow_rules(const fko_srv_options_t * const opts, const time_t now)
+{
+    char                line[IPT_BATCH_LINE_LEN] = {0};
+    char                msg[CMD_BUFSIZE] = {0};
+    struct fw_chain    *ch = fwc.chain;
+    struct fw_chain    *rch, shard;
+    ipt_shadow_rule_t  *r;
+    int                 i, j, res;
+
+    for(i=0; i < NUM_FWKNOP_ACCESS_TYPES; i++)
+    {
+        if(ipt_shadow[i].num_rules == 0 || ch[i].next_expire > now)
+            continue;
+
+        /* Walk backwards - removing an entry moves the last one into its
+         * place, and a batch commit only removes entries already passed.
+        */
+        for(j=ipt_shadow[i].num_rules-1; j >= 0; j--)
+        {
+            r = &(ipt_shadow[i].rules[j]);
+            if(r->exp_ts > now)
+                continue;
+
+            rch = shard_chain(&(ch[i]), r->spec, &shard);
+
+            snprintf(msg, CMD_BUFSIZE-1,
+                "Removed rule from %s with expire time of %u",
+                rch->to_chain, (unsigned int)r->exp_ts);
+
+            if(ipt_batch.enabled)
+            {
+                snprintf(line, sizeof(line), "-D %s %s\n",
+                    rch->to_chain, r->spec);
+                if(ipt_batch_queue(opts, rch, line, r->spec, 1,
+                            r->exp_ts, msg) != 1)
+                    return;
+                continue;
+            }
+
+            zero_cmd_buffers();
+
+            /* A truncated delete would not match the rule, so leave it
+             * for the next listing of the chain to remove.
+            */
+            if(snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPT_DEL_RULE_SPEC_ARGS,
+                    fwc.fw_command,
+                    rch->table,
+                    rch->to_chain,
+                    r->spec
+                ) >= CMD_BUFSIZE-1)
+            {
+                log_msg(LOG_ERR,
+                    "expire_shadow_rules() Delete command for rule in %s is too long: %s",
+                    rch->to_chain, r->spec);
+                ipt_shadow_resync = 1;
+                continue;
+            }
+
+            res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE,
+                    WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
+            chop_newline(err_buf);
+
+            log_msg(LOG_DEBUG, "expire_shadow_rules() CMD: '%s' (res: %d, err: %s)",
+                cmd_buf, res, err_buf);
+
+            if(EXTCMD_IS_SUCCESS(res))
+                log_msg(LOG_INFO, "%s", msg);
+            else
+            {
+                log_msg(LOG_ERR, "expire_shadow_rules() Error %i from cmd:'%s': %s",
+                        res, cmd_buf, err_buf);
+                ipt_shadow_resync = 1;
+            }
+
+            shadow_del_index(i, j);
+        }
+        shadow_sync_chain(i);
+    }
+
+    if(ipt_batch.enabled)
+        ipt_batch_commit(opts);
+
+    return;
+}
+
+/* List chain ch[cpos] and delete the rules in it that have expired.
+*/
+static void
+reconcile_chain(const fko_srv_options_t * const opts,
+        struct fw_chain *ch, const int cpos, const time_t now)
+{
+    char            *ndx;
+    char            ipt_output_buf[STANDARD_CMD_OUT_BUFSIZE] = {0};
+    int             res;
+
+    zero_cmd_buffers();
+
+    /* Get the current list of rules for this chain and delete
+     * any that have expired. Note that chk_rm_all puts us in
+     * garbage collection mode, and allows any rules that have
+     * been manually added (potentially by a program separate
+     * from fwknopd) to take advantage of fwknopd's timeout
+     * mechanism.
+    */
+    snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPT_LIST_RULES_ARGS,
+        opts->fw_config->fw_command,
+        ch[cpos].table,
+        ch[cpos].to_chain
+    );
+
+    res = run_extcmd(cmd_buf, ipt_output_buf, STANDARD_CMD_OUT_BUFSIZE,
+            WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
+    chop_newline(ipt_output_buf);
+
+    log_msg(LOG_DEBUG,
+        "check_firewall_rules() CMD: '%s' (res: %d, ipt_output_buf: %s)",
+        cmd_buf, res, ipt_output_buf);
+
+    if(!EXTCMD_IS_SUCCESS(res))
+    {
+        log_msg(LOG_ERR,
+                "check_firewall_rules() Error %i from cmd:'%s': %s",
+                res, cmd_buf, ipt_output_buf);
+        return;
+    }
+
+    log_msg(LOG_DEBUG, "RES=%i, CMD_BUF: %s\nRULES LIST: %s",
+            res, cmd_buf, ipt_output_buf);
+
+    ndx = strstr(ipt_output_buf, EXPIRE_COMMENT_PREFIX);
+    if(ndx == NULL)
+    {
+        /* we did not find a candidate rule to expire
+        */
+        log_msg(LOG_DEBUG,
+            "Did not find expire comment in rules list %i", cpos);
+
+        if (ch[cpos].active_rules > 0)
+            ch[cpos].active_rules--;
+
+        return;
+    }
+
+    rm_expired_rules(opts, ipt_output_buf, ndx, ch, cpos, now);
+    return;
+}
+
 /* Iterate over the configure firewall access chains and purge expired
- * firewall rules.
+ * firewall rules.  Normally this works from the shadow table, and only
+ * every RULES_CHECK_THRESHOLD checks (chk_rm_all) are the chains listed
+ * to reconcile with the kernel.
 */
 void
 check_firewall_rules(const fko_srv_options_t * const opts,
         const int chk_rm_all)
 {
-    char            *ndx;
-    char            ipt_output_buf[STANDARD_CMD_OUT_BUFSIZE] = {0};
-
-    int             i, res;
+    struct fw_chain shard[NUM_FWKNOP_ACCESS_TYPES];
+    int             i, node;
     time_t          now;
 
     struct fw_chain *ch = opts->fw_config->chain;
 
     time(&now);
 
-    /* Iterate over each chain and look for active rules to delete.
+    if(! chk_rm_all && ! ipt_shadow_resync)
+    {
+        expire_shadow_rules(opts, now);
+        return;
+    }
+    ipt_shadow_resync = 0;
+
+    /* Iterate over each chain and look for rules to delete.
     */
     for(i=0; i < NUM_FWKNOP_ACCESS_TYPES; i++)
     {
-        /* If there are no active rules or we have not yet
-         * reached our expected next expire time, continue.
-        */
-        if(!chk_rm_all && (ch[i].active_rules == 0 || ch[i].next_expire > now))
-            continue;
-
         if(ch[i].table[0] == '\0' || ch[i].to_chain[i] == '\0')
             continue;
 
-        zero_cmd_buffers();
-        memset(ipt_output_buf, 0x0, STANDARD_CMD_OUT_BUFSIZE);
-
-        /* Get the current list of rules for this chain and delete
-         * any that have expired. Note that chk_rm_all puts us in
-         * garbage collection mode, and allows any rules that have
-         * been manually added (potentially by a program separate
-         * from fwknopd) to take advantage of fwknopd's timeout
-         * mechanism.
-        */
-        snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPT_LIST_RULES_ARGS,
-            opts->fw_config->fw_command,
-            ch[i].table,
-            ch[i].to_chain
-        );
-
-        res = run_extcmd(cmd_buf, ipt_output_buf, STANDARD_CMD_OUT_BUFSIZE,
-                WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
-        chop_newline(ipt_output_buf);
-
-        log_msg(LOG_DEBUG,
-            "check_firewall_rules() CMD: '%s' (res: %d, ipt_output_buf: %s)",
-            cmd_buf, res, ipt_output_buf);
+        reconcile_chain(opts, ch, i, now);
 
-        if(!EXTCMD_IS_SUCCESS(res))
-        {
-            log_msg(LOG_ERR,
-                    "check_firewall_rules() Error %i from cmd:'%s': %s",
-                    res, cmd_buf, ipt_output_buf);
+        /* The leaves of a sharded chain are listed through a copy of
+         * the chain config that names them.
+        */
+        if(! shard_enabled(i))
             continue;
-        }
 
-        log_msg(LOG_DEBUG, "RES=%i, CMD_BUF: %s\nRULES LIST: %s",
-                res, cmd_buf, ipt_output_buf);
-
-        ndx = strstr(ipt_output_buf, EXPIRE_COMMENT_PREFIX);
-        if(ndx == NULL)
+        memcpy(shard, ch, sizeof(shard));
+        for(node = 1 << fwc.input_shard_bits;
+                node < 2 << fwc.input_shard_bits; node++)
         {
-            /* we did not find a candidate rule to expire
-            */
-            log_msg(LOG_DEBUG,
-                "Did not find expire comment in rules list %i", i);
-
-            if (ch[i].active_rules > 0)
-                ch[i].active_rules--;
-
-            continue;
+            shard_node_name(node, shard[i].to_chain,
+                sizeof(shard[i].to_chain));
+            reconcile_chain(opts, shard, i, now);
         }
-
-        rm_expired_rules(opts, ipt_output_buf, ndx, ch, i, now);
     }
 
+    if(ipt_batch.enabled)
+        ipt_batch_commit(opts);
+
+    for(i=0; i < NUM_FWKNOP_ACCESS_TYPES; i++)
+        shadow_prune(i, now);
+
     return;
 }
 
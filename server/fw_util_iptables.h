@@ -58,6 +58,7 @@
 #define IPT_TMP_CHK_RULE_ARGS   "-t %s -I %s %i -s " DUMMY_IP " -p udp -j %s" SH_REDIR
 #define IPT_TMP_VERIFY_CHK_ARGS "-t %s -C %s -s " DUMMY_IP " -p udp -j %s" SH_REDIR
 #define IPT_DEL_RULE_ARGS       "-t %s -D %s %i" SH_REDIR
+#define IPT_DEL_RULE_SPEC_ARGS  "-t %s -D %s %s" SH_REDIR
 #define IPT_NEW_CHAIN_ARGS      "-t %s -N %s" SH_REDIR
 #define IPT_FLUSH_CHAIN_ARGS    "-t %s -F %s" SH_REDIR
 #define IPT_CHAIN_EXISTS_ARGS   "-t %s -L %s -n" SH_REDIR
@@ -69,6 +70,32 @@
 #define IPT_LIST_ALL_RULES_ARGS "-t %s -v -n -L --line-numbers" SH_REDIR
 #define IPT_ANY_IP              "0.0.0.0/0"
 
+/* Batched rule changes for ENABLE_IPT_RESTORE_BATCH
+*/
+#define IPT_RESTORE_SUFFIX      "-restore"
+#define IPT_RESTORE_ARGS        "--noflush"
+#define IPT_BATCH_MAX_TABLES    5       /* filter, nat, mangle, raw, security */
+#define IPT_BATCH_TABLE_BUFSIZE 16384
+#define IPT_BATCH_MAX_OPS       128
+#define IPT_BATCH_LINE_LEN      (CMD_BUFSIZE + MAX_CHAIN_NAME_LEN + 8) /* "-D <chain> <spec>\n" */
+
+/* Fixed rules for ENABLE_IPT_IPSET mode, which match grants held in an ipset
+*/
+#define IPT_IPSET_RULE_ARGS     "-t %s -m set --match-set %s %s -j %s" SH_REDIR
+#define IPT_IPSET_SAVE_MARK_ARGS "-t %s -m set --match-set %s %s -j CONNMARK --save-mark" SH_REDIR
+#define IPT_IPSET_MAP_MARK_ARGS "-t mangle -m set --match-set %s %s -j SET --map-set %s %s --map-mark" SH_REDIR
+#define IPT_IPSET_IN_FLAGS      "src,dst"
+#define IPT_IPSET_IN_DST_FLAGS  "src,dst,dst"
+#define IPT_IPSET_OUT_FLAGS     "dst,src"
+#define IPT_IPSET_OUT_DST_FLAGS "dst,src,src"
+
+/* Dispatch rules for IPT_INPUT_SHARD_BITS, each tests one source address
+ * bit (with an optional "! ") and jumps to the sub-chain for its value
+*/
+#define IPT_SHARD_JUMP_ARGS     "-t %s -I %s %i %s-s %s/%s -j %s" SH_REDIR
+#define IPT_SHARD_DEL_JUMP_ARGS "-t %s -D %s %s-s %s/%s -j %s" SH_REDIR
+#define IPT_SHARD_NAME_MAXLEN   28      /* XT_EXTENSION_MAXNAMELEN - 1 */
+
 int validate_ipt_chain_conf(const char * const chain_str);
 
 #endif /* FW_UTIL_IPTABLES_H */
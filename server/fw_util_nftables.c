@@ -0,0 +1,1239 @@
+/*
+ *****************************************************************************
+ *
+ * File:    fw_util_nftables.c
+ *
+ * Purpose: Fwknop routines for managing nftables firewall rules.  Access
+ *          grants are elements of a set with per-element timeouts that a
+ *          single lookup rule matches against, so the kernel expires them
+ *          and no rules have to be listed or deleted from userspace.  All
+ *          changes are made over netlink with libnftnl/libmnl.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+
+#if FIREWALL_NFTABLES
+
+#include "fw_util.h"
+#include "utils.h"
+#include "log_msg.h"
+#include "extcmd.h"
+#include "access.h"
+#include "metrics.h"
+#include "fwknop_probes.h"
+
+#include <arpa/inet.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+#include <libmnl/libmnl.h>
+#include <libnftnl/common.h>
+#include <libnftnl/table.h>
+#include <libnftnl/chain.h>
+#include <libnftnl/rule.h>
+#include <libnftnl/set.h>
+#include <libnftnl/expr.h>
+#include <libnftnl/udata.h>
+
+/* One access grant - a set element key, its timeout and, when connection
+ * tracking is enabled, the SDP ID to set as the conntrack mark.
+*/
+typedef struct nft_grant
+{
+    unsigned char   key[NFT_MAX_KEY_LEN];
+    uint32_t        mark;
+    uint64_t        timeout_ms;
+} nft_grant_t;
+
+/* Rule handles found by find_fwknop_rules()
+*/
+typedef struct nft_rule_handles
+{
+    uint64_t        handle[NFT_MAX_OLD_RULES];
+    int             count;
+} nft_rule_handles_t;
+
+static struct fw_config fwc;
+static char   cmd_buf[CMD_BUFSIZE];
+static char   err_buf[CMD_BUFSIZE];
+static char   nl_buf[NFT_NL_BUFSIZE * 2];
+static char   rule_udata[NFT_USERDATA_MAXLEN];
+static int    rule_udata_len = 0;
+
+static void
+zero_cmd_buffers(void)
+{
+    memset(cmd_buf, 0x0, CMD_BUFSIZE);
+    memset(err_buf, 0x0, CMD_BUFSIZE);
+}
+
+/* Print all firewall rules currently instantiated by the running fwknopd
+ * daemon to stdout.  Set elements are listed with the time they have left.
+*/
+int
+fw_dump_rules(const fko_srv_options_t * const opts)
+{
+    int     res, got_err = 0, pid_status = 0;
+
+    fprintf(stdout, "Listing nftables table '%s %s'...\n",
+        opts->config[CONF_NFT_FAMILY], fwc.table);
+    fflush(stdout);
+
+    zero_cmd_buffers();
+
+    snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " NFT_LIST_TABLE_ARGS,
+        opts->fw_config->fw_command,
+        opts->config[CONF_NFT_FAMILY],
+        fwc.table
+    );
+
+    res = run_extcmd(cmd_buf, NULL, 0, NO_STDERR, NO_TIMEOUT, &pid_status, opts);
+
+    if(! EXTCMD_IS_SUCCESS(res))
+    {
+        log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, err_buf);
+        got_err++;
+    }
+
+    return(got_err);
+}
+
+/* Send a single (non-batched) request and run the replies through cb
+ * until the ack, error, or end of dump.  Returns 0 on success or -1 with
+ * errno set.
+*/
+static int
+nft_talk(const struct nlmsghdr * const nlh, mnl_cb_t cb, void *data)
+{
+    char    buf[MNL_SOCKET_BUFFER_SIZE];
+    int     ret;
+
+    if(mnl_socket_sendto(fwc.nl, nlh, nlh->nlmsg_len) < 0)
+        return -1;
+
+    do
+    {
+        ret = mnl_socket_recvfrom(fwc.nl, buf, sizeof(buf));
+        if(ret < 0)
+            return -1;
+        ret = mnl_cb_run(buf, ret, nlh->nlmsg_seq, fwc.portid, cb, data);
+    } while(ret > MNL_CB_STOP);
+
+    return (ret == MNL_CB_STOP) ? 0 : -1;
+}
+
+/* Send a batch of num_msgs messages (not counting the begin and end
+ * markers), each sent with NLM_F_ACK.  The kernel applies all of them or
+ * none, and answers each one with an ack or an error.  Echoed messages
+ * are handed to cb.  Returns 0 on success or -1 with errno set to the
+ * first error reported.
+*/
+static int
+nft_batch_talk(struct mnl_nlmsg_batch *batch, const int num_msgs,
+        mnl_cb_t cb, void *data)
+{
+    char    buf[MNL_SOCKET_BUFFER_SIZE];
+    int     i = 0, ret, err = 0;
+
+    if(mnl_socket_sendto(fwc.nl, mnl_nlmsg_batch_head(batch),
+            mnl_nlmsg_batch_size(batch)) < 0)
+        return -1;
+
+    while(i < num_msgs)
+    {
+        ret = mnl_socket_recvfrom(fwc.nl, buf, sizeof(buf));
+        if(ret < 0)
+        {
+            if(err == 0)
+                err = errno;
+            break;
+        }
+
+        ret = mnl_cb_run(buf, ret, 0, fwc.portid, cb, data);
+
+        /* MNL_CB_OK means an echoed message - its ack follows
+        */
+        if(ret == MNL_CB_OK)
+            continue;
+
+        if(ret == MNL_CB_ERROR && err == 0)
+            err = errno;
+        i++;
+    }
+
+    if(err != 0)
+    {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static struct mnl_nlmsg_batch *
+batch_start(void)
+{
+    struct mnl_nlmsg_batch *batch;
+
+    batch = mnl_nlmsg_batch_start(nl_buf, NFT_NL_BUFSIZE);
+    if(batch == NULL)
+        return NULL;
+
+    nftnl_batch_begin(mnl_nlmsg_batch_current(batch), ++fwc.seq);
+    mnl_nlmsg_batch_next(batch);
+
+    return batch;
+}
+
+static void
+batch_end(struct mnl_nlmsg_batch *batch)
+{
+    nftnl_batch_end(mnl_nlmsg_batch_current(batch), ++fwc.seq);
+    mnl_nlmsg_batch_next(batch);
+    return;
+}
+
+static struct nlmsghdr *
+batch_msg(struct mnl_nlmsg_batch *batch, const uint16_t type,
+        const uint16_t flags)
+{
+    return nftnl_nlmsg_build_hdr(mnl_nlmsg_batch_current(batch), type,
+        fwc.family, flags | NLM_F_ACK, ++fwc.seq);
+}
+
+/* Map a GET reply to 1 (exists), 0 (ENOENT) or -1 (any other error).
+*/
+static int
+exists_reply(const int ret)
+{
+    if(ret == 0)
+        return 1;
+    if(errno == ENOENT)
+        return 0;
+    return -1;
+}
+
+static int
+table_exists(void)
+{
+    char                buf[MNL_SOCKET_BUFFER_SIZE];
+    struct nlmsghdr    *nlh;
+    struct nftnl_table *t;
+
+    if((t = nftnl_table_alloc()) == NULL)
+        return -1;
+
+    nftnl_table_set_str(t, NFTNL_TABLE_NAME, fwc.table);
+
+    nlh = nftnl_nlmsg_build_hdr(buf, NFT_MSG_GETTABLE, fwc.family,
+        NLM_F_ACK, ++fwc.seq);
+    nftnl_table_nlmsg_build_payload(nlh, t);
+    nftnl_table_free(t);
+
+    return exists_reply(nft_talk(nlh, NULL, NULL));
+}
+
+static int
+chain_exists(void)
+{
+    char                buf[MNL_SOCKET_BUFFER_SIZE];
+    struct nlmsghdr    *nlh;
+    struct nftnl_chain *c;
+
+    if((c = nftnl_chain_alloc()) == NULL)
+        return -1;
+
+    nftnl_chain_set_str(c, NFTNL_CHAIN_TABLE, fwc.table);
+    nftnl_chain_set_str(c, NFTNL_CHAIN_NAME, fwc.chain);
+
+    nlh = nftnl_nlmsg_build_hdr(buf, NFT_MSG_GETCHAIN, fwc.family,
+        NLM_F_ACK, ++fwc.seq);
+    nftnl_chain_nlmsg_build_payload(nlh, c);
+    nftnl_chain_free(c);
+
+    return exists_reply(nft_talk(nlh, NULL, NULL));
+}
+
+static int
+set_info_cb(const struct nlmsghdr *nlh, void *data)
+{
+    struct nftnl_set   *s = data;
+
+    if(nftnl_set_nlmsg_parse(nlh, s) < 0)
+        return MNL_CB_ERROR;
+
+    return MNL_CB_OK;
+}
+
+/* Check for our set, and if it is there whether its key and type match
+ * what this configuration would create.
+*/
+static int
+set_exists(int *matches)
+{
+    char                buf[MNL_SOCKET_BUFFER_SIZE];
+    struct nlmsghdr    *nlh;
+    struct nftnl_set   *s;
+    int                 res, is_map;
+
+    *matches = 0;
+
+    if((s = nftnl_set_alloc()) == NULL)
+        return -1;
+
+    nftnl_set_set_str(s, NFTNL_SET_TABLE, fwc.table);
+    nftnl_set_set_str(s, NFTNL_SET_NAME, fwc.set);
+
+    nlh = nftnl_nlmsg_build_hdr(buf, NFT_MSG_GETSET, fwc.family,
+        NLM_F_ACK, ++fwc.seq);
+    nftnl_set_nlmsg_build_payload(nlh, s);
+
+    res = exists_reply(nft_talk(nlh, set_info_cb, s));
+    if(res == 1)
+    {
+        is_map = (nftnl_set_get_u32(s, NFTNL_SET_FLAGS) & NFT_SET_MAP) != 0;
+
+        *matches = (nftnl_set_get_u32(s, NFTNL_SET_KEY_LEN) == fwc.key_len
+            && is_map == fwc.use_connmark
+            && (nftnl_set_get_u32(s, NFTNL_SET_FLAGS) & NFT_SET_TIMEOUT));
+    }
+
+    nftnl_set_free(s);
+    return res;
+}
+
+static int
+find_rules_cb(const struct nlmsghdr *nlh, void *data)
+{
+    nft_rule_handles_t *found = data;
+    struct nftnl_rule  *r;
+    const void         *udata;
+    const char         *chain;
+    uint32_t            udata_len = 0;
+
+    if((r = nftnl_rule_alloc()) == NULL)
+        return MNL_CB_ERROR;
+
+    if(nftnl_rule_nlmsg_parse(nlh, r) < 0)
+    {
+        nftnl_rule_free(r);
+        return MNL_CB_ERROR;
+    }
+
+    udata = nftnl_rule_get_data(r, NFTNL_RULE_USERDATA, &udata_len);
+    chain = nftnl_rule_get_str(r, NFTNL_RULE_CHAIN);
+
+    if(udata != NULL && udata_len == (uint32_t)rule_udata_len
+            && memcmp(udata, rule_udata, udata_len) == 0
+            && chain != NULL && strcmp(chain, fwc.chain) == 0
+            && found->count < NFT_MAX_OLD_RULES)
+        found->handle[found->count++] = nftnl_rule_get_u64(r, NFTNL_RULE_HANDLE);
+
+    nftnl_rule_free(r);
+    return MNL_CB_OK;
+}
+
+/* Find the lookup rules we (or an earlier fwknopd) added to the chain.
+*/
+static int
+find_fwknop_rules(nft_rule_handles_t *found)
+{
+    char                buf[MNL_SOCKET_BUFFER_SIZE];
+    struct nlmsghdr    *nlh;
+    struct nftnl_rule  *r;
+
+    memset(found, 0x0, sizeof(*found));
+
+    if((r = nftnl_rule_alloc()) == NULL)
+        return -1;
+
+    nftnl_rule_set_str(r, NFTNL_RULE_TABLE, fwc.table);
+    nftnl_rule_set_str(r, NFTNL_RULE_CHAIN, fwc.chain);
+
+    nlh = nftnl_nlmsg_build_hdr(buf, NFT_MSG_GETRULE, fwc.family,
+        NLM_F_DUMP, ++fwc.seq);
+    nftnl_rule_nlmsg_build_payload(nlh, r);
+    nftnl_rule_free(r);
+
+    return nft_talk(nlh, find_rules_cb, found);
+}
+
+static int
+rule_echo_cb(const struct nlmsghdr *nlh, void *data)
+{
+    struct nftnl_rule  *r;
+
+    if(NFNL_MSG_TYPE(nlh->nlmsg_type) != NFT_MSG_NEWRULE)
+        return MNL_CB_OK;
+
+    if((r = nftnl_rule_alloc()) == NULL)
+        return MNL_CB_OK;
+
+    if(nftnl_rule_nlmsg_parse(nlh, r) == 0)
+        fwc.rule_handle = nftnl_rule_get_u64(r, NFTNL_RULE_HANDLE);
+
+    nftnl_rule_free(r);
+    return MNL_CB_OK;
+}
+
+static void
+add_table_msg(struct mnl_nlmsg_batch *batch, const uint16_t type)
+{
+    struct nlmsghdr    *nlh;
+    struct nftnl_table *t;
+
+    if((t = nftnl_table_alloc()) == NULL)
+        return;
+
+    nftnl_table_set_str(t, NFTNL_TABLE_NAME, fwc.table);
+
+    nlh = batch_msg(batch, type, type == NFT_MSG_NEWTABLE ? NLM_F_CREATE : 0);
+    nftnl_table_nlmsg_build_payload(nlh, t);
+    mnl_nlmsg_batch_next(batch);
+
+    nftnl_table_free(t);
+    return;
+}
+
+/* The chain is only created if it does not exist, as a filter chain on
+ * the input hook that accepts by default - much like the FWKNOP_INPUT
+ * chain that the iptables code creates.
+*/
+static void
+add_chain_msg(struct mnl_nlmsg_batch *batch, const uint16_t type)
+{
+    struct nlmsghdr    *nlh;
+    struct nftnl_chain *c;
+
+    if((c = nftnl_chain_alloc()) == NULL)
+        return;
+
+    nftnl_chain_set_str(c, NFTNL_CHAIN_TABLE, fwc.table);
+    nftnl_chain_set_str(c, NFTNL_CHAIN_NAME, fwc.chain);
+
+    if(type == NFT_MSG_NEWCHAIN)
+    {
+        nftnl_chain_set_str(c, NFTNL_CHAIN_TYPE, "filter");
+        nftnl_chain_set_u32(c, NFTNL_CHAIN_HOOKNUM, NF_INET_LOCAL_IN);
+        nftnl_chain_set_s32(c, NFTNL_CHAIN_PRIO, 0);
+        nftnl_chain_set_u32(c, NFTNL_CHAIN_POLICY, NF_ACCEPT);
+    }
+
+    nlh = batch_msg(batch, type, type == NFT_MSG_NEWCHAIN ? NLM_F_CREATE : 0);
+    nftnl_chain_nlmsg_build_payload(nlh, c);
+    mnl_nlmsg_batch_next(batch);
+
+    nftnl_chain_free(c);
+    return;
+}
+
+/* The set key is "ip saddr [. ip daddr] . meta l4proto . th dport", and
+ * with connection tracking it is a map to the conntrack mark.
+*/
+static void
+add_set_msg(struct mnl_nlmsg_batch *batch, const uint16_t type)
+{
+    struct nlmsghdr    *nlh;
+    struct nftnl_set   *s;
+    uint32_t            key_type = NFT_TYPE_IPADDR;
+
+    if((s = nftnl_set_alloc()) == NULL)
+        return;
+
+    nftnl_set_set_str(s, NFTNL_SET_TABLE, fwc.table);
+    nftnl_set_set_str(s, NFTNL_SET_NAME, fwc.set);
+
+    if(type == NFT_MSG_NEWSET)
+    {
+        if(fwc.use_destination)
+            key_type = (key_type << NFT_TYPE_BITS) | NFT_TYPE_IPADDR;
+        key_type = (key_type << NFT_TYPE_BITS) | NFT_TYPE_INET_PROTOCOL;
+        key_type = (key_type << NFT_TYPE_BITS) | NFT_TYPE_INET_SERVICE;
+
+        nftnl_set_set_u32(s, NFTNL_SET_FAMILY, fwc.family);
+        nftnl_set_set_u32(s, NFTNL_SET_ID, NFT_ACCESS_SET_ID);
+        nftnl_set_set_u32(s, NFTNL_SET_KEY_TYPE, key_type);
+        nftnl_set_set_u32(s, NFTNL_SET_KEY_LEN, fwc.key_len);
+
+        if(fwc.use_connmark)
+        {
+            nftnl_set_set_u32(s, NFTNL_SET_FLAGS, NFT_SET_TIMEOUT | NFT_SET_MAP);
+            nftnl_set_set_u32(s, NFTNL_SET_DATA_TYPE, NFT_TYPE_MARK);
+            nftnl_set_set_u32(s, NFTNL_SET_DATA_LEN, sizeof(uint32_t));
+        }
+        else
+            nftnl_set_set_u32(s, NFTNL_SET_FLAGS, NFT_SET_TIMEOUT);
+    }
+
+    nlh = batch_msg(batch, type, type == NFT_MSG_NEWSET ? NLM_F_CREATE : 0);
+    nftnl_set_nlmsg_build_payload(nlh, s);
+    mnl_nlmsg_batch_next(batch);
+
+    nftnl_set_free(s);
+    return;
+}
+
+static void
+add_del_rule_msg(struct mnl_nlmsg_batch *batch, const uint64_t handle)
+{
+    struct nlmsghdr    *nlh;
+    struct nftnl_rule  *r;
+
+    if((r = nftnl_rule_alloc()) == NULL)
+        return;
+
+    nftnl_rule_set_str(r, NFTNL_RULE_TABLE, fwc.table);
+    nftnl_rule_set_str(r, NFTNL_RULE_CHAIN, fwc.chain);
+    nftnl_rule_set_u64(r, NFTNL_RULE_HANDLE, handle);
+
+    nlh = batch_msg(batch, NFT_MSG_DELRULE, 0);
+    nftnl_rule_nlmsg_build_payload(nlh, r);
+    mnl_nlmsg_batch_next(batch);
+
+    nftnl_rule_free(r);
+    return;
+}
+
+static int
+add_expr(struct nftnl_rule *r, const char * const name,
+        const uint16_t a1, const uint32_t v1,
+        const uint16_t a2, const uint32_t v2,
+        const uint16_t a3, const uint32_t v3,
+        const uint16_t a4, const uint32_t v4)
+{
+    struct nftnl_expr  *e;
+
+    if((e = nftnl_expr_alloc(name)) == NULL)
+        return -1;
+
+    nftnl_expr_set_u32(e, a1, v1);
+    nftnl_expr_set_u32(e, a2, v2);
+    if(a3 != NFT_NO_ATTR)
+        nftnl_expr_set_u32(e, a3, v3);
+    if(a4 != NFT_NO_ATTR)
+        nftnl_expr_set_u32(e, a4, v4);
+
+    nftnl_rule_add_expr(r, e);
+    return 0;
+}
+
+/* Build the one rule that does all the work:
+ *
+ *   meta nfproto ipv4 ip saddr [. ip daddr] . meta l4proto . th dport
+ *       [ct mark set (ip saddr ... map @set)] @set accept
+ *
+ * Each part of the key is loaded into its own 32-bit register, so the
+ * registers from NFT_REG32_00 up line up with the set key.
+*/
+static int
+add_rule_msg(struct mnl_nlmsg_batch *batch, const int new_set)
+{
+    struct nlmsghdr    *nlh;
+    struct nftnl_rule  *r;
+    struct nftnl_expr  *e;
+    uint8_t             nfproto = NFPROTO_IPV4;
+    uint32_t            reg = NFT_REG32_00;
+    int                 res = 0;
+
+    if((r = nftnl_rule_alloc()) == NULL)
+        return -1;
+
+    nftnl_rule_set_str(r, NFTNL_RULE_TABLE, fwc.table);
+    nftnl_rule_set_str(r, NFTNL_RULE_CHAIN, fwc.chain);
+    nftnl_rule_set_u32(r, NFTNL_RULE_FAMILY, fwc.family);
+    nftnl_rule_set_data(r, NFTNL_RULE_USERDATA, rule_udata, rule_udata_len);
+
+    /* meta nfproto ipv4 (only IPv4 grants are made)
+    */
+    res |= add_expr(r, "meta", NFTNL_EXPR_META_KEY, NFT_META_NFPROTO,
+        NFTNL_EXPR_META_DREG, reg, NFT_NO_ATTR, 0, NFT_NO_ATTR, 0);
+    if((e = nftnl_expr_alloc("cmp")) == NULL)
+    {
+        nftnl_rule_free(r);
+        return -1;
+    }
+    nftnl_expr_set_u32(e, NFTNL_EXPR_CMP_SREG, reg);
+    nftnl_expr_set_u32(e, NFTNL_EXPR_CMP_OP, NFT_CMP_EQ);
+    nftnl_expr_set(e, NFTNL_EXPR_CMP_DATA, &nfproto, sizeof(nfproto));
+    nftnl_rule_add_expr(r, e);
+
+    /* ip saddr [. ip daddr]
+    */
+    res |= add_expr(r, "payload",
+        NFTNL_EXPR_PAYLOAD_BASE, NFT_PAYLOAD_NETWORK_HEADER,
+        NFTNL_EXPR_PAYLOAD_DREG, reg++,
+        NFTNL_EXPR_PAYLOAD_OFFSET, NFT_IP_SADDR_OFFSET,
+        NFTNL_EXPR_PAYLOAD_LEN, sizeof(uint32_t));
+
+    if(fwc.use_destination)
+        res |= add_expr(r, "payload",
+            NFTNL_EXPR_PAYLOAD_BASE, NFT_PAYLOAD_NETWORK_HEADER,
+            NFTNL_EXPR_PAYLOAD_DREG, reg++,
+            NFTNL_EXPR_PAYLOAD_OFFSET, NFT_IP_DADDR_OFFSET,
+            NFTNL_EXPR_PAYLOAD_LEN, sizeof(uint32_t));
+
+    /* . meta l4proto . th dport
+    */
+    res |= add_expr(r, "meta", NFTNL_EXPR_META_KEY, NFT_META_L4PROTO,
+        NFTNL_EXPR_META_DREG, reg++, NFT_NO_ATTR, 0, NFT_NO_ATTR, 0);
+
+    res |= add_expr(r, "payload",
+        NFTNL_EXPR_PAYLOAD_BASE, NFT_PAYLOAD_TRANSPORT_HEADER,
+        NFTNL_EXPR_PAYLOAD_DREG, reg++,
+        NFTNL_EXPR_PAYLOAD_OFFSET, NFT_TH_DPORT_OFFSET,
+        NFTNL_EXPR_PAYLOAD_LEN, sizeof(uint16_t));
+
+    /* The lookup breaks out of the rule if there is no element.  For a
+     * map the mark lands in the next free register for the ct expression.
+    */
+    if((e = nftnl_expr_alloc("lookup")) == NULL)
+    {
+        nftnl_rule_free(r);
+        return -1;
+    }
+    nftnl_expr_set_u32(e, NFTNL_EXPR_LOOKUP_SREG, NFT_REG32_00);
+    nftnl_expr_set_str(e, NFTNL_EXPR_LOOKUP_SET, fwc.set);
+    if(new_set)
+        nftnl_expr_set_u32(e, NFTNL_EXPR_LOOKUP_SET_ID, NFT_ACCESS_SET_ID);
+    if(fwc.use_connmark)
+        nftnl_expr_set_u32(e, NFTNL_EXPR_LOOKUP_DREG, reg);
+    nftnl_rule_add_expr(r, e);
+
+    if(fwc.use_connmark)
+        res |= add_expr(r, "ct", NFTNL_EXPR_CT_KEY, NFT_CT_MARK,
+            NFTNL_EXPR_CT_SREG, reg, NFT_NO_ATTR, 0, NFT_NO_ATTR, 0);
+
+    res |= add_expr(r, "immediate", NFTNL_EXPR_IMM_DREG, NFT_REG_VERDICT,
+        NFTNL_EXPR_IMM_VERDICT, NF_ACCEPT, NFT_NO_ATTR, 0, NFT_NO_ATTR, 0);
+
+    if(res != 0)
+    {
+        nftnl_rule_free(r);
+        return -1;
+    }
+
+    /* No NLM_F_APPEND, so the rule goes in at the top of the chain.
+    */
+    nlh = batch_msg(batch, NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_ECHO);
+    nftnl_rule_nlmsg_build_payload(nlh, r);
+    mnl_nlmsg_batch_next(batch);
+
+    nftnl_rule_free(r);
+    return 0;
+}
+
+/* Add (or delete, with add == 0) the given grants as set elements in one
+ * message.
+*/
+static int
+add_elems_msg(struct mnl_nlmsg_batch *batch, const uint16_t type,
+        const uint16_t flags, const nft_grant_t * const grants,
+        const int num_grants, const int add)
+{
+    struct nlmsghdr        *nlh;
+    struct nftnl_set       *s;
+    struct nftnl_set_elem  *e;
+    int                     i;
+
+    if((s = nftnl_set_alloc()) == NULL)
+        return -1;
+
+    nftnl_set_set_str(s, NFTNL_SET_TABLE, fwc.table);
+    nftnl_set_set_str(s, NFTNL_SET_NAME, fwc.set);
+
+    for(i=0; i < num_grants; i++)
+    {
+        if((e = nftnl_set_elem_alloc()) == NULL)
+        {
+            nftnl_set_free(s);
+            return -1;
+        }
+
+        nftnl_set_elem_set(e, NFTNL_SET_ELEM_KEY, grants[i].key, fwc.key_len);
+        if(add)
+        {
+            nftnl_set_elem_set_u64(e, NFTNL_SET_ELEM_TIMEOUT,
+                grants[i].timeout_ms);
+            if(fwc.use_connmark)
+                nftnl_set_elem_set_u32(e, NFTNL_SET_ELEM_DATA, grants[i].mark);
+        }
+        nftnl_set_elem_add(s, e);
+    }
+
+    nlh = batch_msg(batch, type, flags);
+    nftnl_set_elems_nlmsg_build_payload(nlh, s);
+    mnl_nlmsg_batch_next(batch);
+
+    nftnl_set_free(s);
+    return 0;
+}
+
+/* Install the grants.  A new grant is a single NEWSETELEM message.  If
+ * any of the elements already exists (the client knocked again before
+ * its access ran out) the kernel rejects the whole batch, and we replace
+ * the elements instead so that the timeout starts over - add any that
+ * are missing, delete them all, then add them with the new timeout, all
+ * in one transaction.
+*/
+static int
+add_grants(const nft_grant_t * const grants, const int num_grants)
+{
+    struct mnl_nlmsg_batch *batch;
+    int                     res;
+
+    if(num_grants == 0)
+        return 0;
+
+    if((batch = batch_start()) == NULL)
+        return -1;
+    res = add_elems_msg(batch, NFT_MSG_NEWSETELEM, NLM_F_CREATE | NLM_F_EXCL,
+        grants, num_grants, 1);
+    batch_end(batch);
+
+    if(res == 0)
+        res = nft_batch_talk(batch, 1, NULL, NULL);
+    mnl_nlmsg_batch_stop(batch);
+
+    if(res == 0)
+    {
+        METRIC_ADD(METRIC_RULES_ADDED, num_grants);
+        FWKNOP_PROBE2(rule_add, num_grants, 0);
+    }
+
+    if(res == 0 || errno != EEXIST)
+        return res;
+
+    if((batch = batch_start()) == NULL)
+        return -1;
+    res  = add_elems_msg(batch, NFT_MSG_NEWSETELEM, NLM_F_CREATE,
+        grants, num_grants, 1);
+    res |= add_elems_msg(batch, NFT_MSG_DELSETELEM, 0,
+        grants, num_grants, 0);
+    res |= add_elems_msg(batch, NFT_MSG_NEWSETELEM, NLM_F_CREATE,
+        grants, num_grants, 1);
+    batch_end(batch);
+
+    if(res == 0)
+        res = nft_batch_talk(batch, 3, NULL, NULL);
+    mnl_nlmsg_batch_stop(batch);
+
+    if(res == 0)
+    {
+        METRIC_ADD(METRIC_RULES_ADDED, num_grants);
+        FWKNOP_PROBE2(rule_add, num_grants, 0);
+    }
+
+    return res;
+}
+
+static int
+nft_open(void)
+{
+    struct timeval  tv;
+
+    if(fwc.nl != NULL)
+        return 0;
+
+    if((fwc.nl = mnl_socket_open(NETLINK_NETFILTER)) == NULL)
+        return -1;
+
+    if(mnl_socket_bind(fwc.nl, 0, MNL_SOCKET_AUTOPID) < 0)
+    {
+        mnl_socket_close(fwc.nl);
+        fwc.nl = NULL;
+        return -1;
+    }
+    fwc.portid = mnl_socket_get_portid(fwc.nl);
+    fwc.seq    = time(NULL);
+
+    /* Don't let a missing reply hang the daemon.
+    */
+    tv.tv_sec  = NFT_NL_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(mnl_socket_get_fd(fwc.nl), SOL_SOCKET, SO_RCVTIMEO,
+        &tv, sizeof(tv));
+
+    return 0;
+}
+
+static void
+nft_close(void)
+{
+    if(fwc.nl != NULL)
+        mnl_socket_close(fwc.nl);
+    fwc.nl = NULL;
+    return;
+}
+
+int
+fw_config_init(fko_srv_options_t * const opts)
+{
+    struct nftnl_udata_buf *udbuf;
+
+    memset(&fwc, 0x0, sizeof(struct fw_config));
+
+    /* Set our firewall exe command path (nft, only used for listing)
+    */
+    strlcpy(fwc.fw_command, opts->config[CONF_FIREWALL_EXE], sizeof(fwc.fw_command));
+
+    if((fwc.family = validate_nft_family(opts->config[CONF_NFT_FAMILY])) < 0)
+    {
+        log_msg(LOG_ERR, "Invalid NFT_FAMILY '%s', must be 'ip' or 'inet'",
+            opts->config[CONF_NFT_FAMILY]);
+        return 0;
+    }
+
+    strlcpy(fwc.table, opts->config[CONF_NFT_TABLE], sizeof(fwc.table));
+    strlcpy(fwc.chain, opts->config[CONF_NFT_INPUT_CHAIN], sizeof(fwc.chain));
+    strlcpy(fwc.set, opts->config[CONF_NFT_ACCESS_SET], sizeof(fwc.set));
+
+    if(strncasecmp(opts->config[CONF_ENABLE_DESTINATION_RULE], "Y", 1)==0)
+    {
+        fwc.use_destination = 1;
+    }
+
+    if(strncasecmp(opts->config[CONF_DISABLE_CONNECTION_TRACKING], "N", 1)==0)
+    {
+        fwc.use_connmark = 1;
+    }
+
+    fwc.key_len = (fwc.use_destination ? 4 : 3) * NFT_KEY_FIELD_LEN;
+
+    /* The rule comment, as nft writes it, so 'nft list' shows it
+    */
+    if((udbuf = nftnl_udata_buf_alloc(NFT_USERDATA_MAXLEN)) == NULL)
+        return 0;
+    nftnl_udata_put_strz(udbuf, NFTNL_UDATA_RULE_COMMENT, NFT_RULE_COMMENT);
+    rule_udata_len = nftnl_udata_buf_len(udbuf);
+    memcpy(rule_udata, nftnl_udata_buf_data(udbuf), rule_udata_len);
+    nftnl_udata_buf_free(udbuf);
+
+    /* Let us find it via our opts struct as well.
+    */
+    opts->fw_config = &fwc;
+
+    return 1;
+}
+
+/* Set up the table, chain, set and lookup rule.  Any lookup rules left by
+ * an earlier run are replaced.  The set itself is kept (along with the
+ * grants in it, which the kernel is still timing out) unless
+ * FLUSH_NFT_AT_INIT is set or it no longer matches our configuration.
+ * Everything after the lookups is done in one transaction.
+*/
+int
+fw_initialize(const fko_srv_options_t * const opts)
+{
+    struct mnl_nlmsg_batch *batch;
+    nft_rule_handles_t      old_rules;
+    int                     i, res = 0, num_msgs = 0, matches = 0;
+    int                     have_table, have_chain = 0, have_set = 0;
+    int                     keep_set, first_old = 0;
+
+    if(nft_open() != 0)
+    {
+        log_msg(LOG_ERR, "Could not open netlink socket for nftables: %s",
+            strerror(errno));
+        return 0;
+    }
+
+    memset(&old_rules, 0x0, sizeof(old_rules));
+
+    if((have_table = table_exists()) == 1)
+    {
+        if((have_chain = chain_exists()) == 1
+                && find_fwknop_rules(&old_rules) != 0)
+            have_chain = -1;
+        have_set = set_exists(&matches);
+    }
+
+    if(have_table < 0 || have_chain < 0 || have_set < 0)
+    {
+        log_msg(LOG_ERR, "Could not query nftables table '%s': %s",
+            fwc.table, strerror(errno));
+        return 0;
+    }
+
+    if(have_set && ! matches)
+        log_msg(LOG_WARNING,
+            "nftables set '%s' does not match the current configuration, recreating it",
+            fwc.set);
+
+    keep_set = have_set && matches
+        && strncasecmp(opts->config[CONF_FLUSH_NFT_AT_INIT], "N", 1) == 0;
+
+    if((batch = batch_start()) == NULL)
+        return 0;
+
+    if(! have_table)
+    {
+        add_table_msg(batch, NFT_MSG_NEWTABLE);
+        num_msgs++;
+        fwc.created_table = 1;
+    }
+
+    if(! have_chain)
+    {
+        add_chain_msg(batch, NFT_MSG_NEWCHAIN);
+        num_msgs++;
+        fwc.created_chain = 1;
+    }
+
+    /* If the set is kept, so is the first rule that uses it.  Any other
+     * old rules go, and they go first since they hold a reference to
+     * the set.
+    */
+    if(keep_set && old_rules.count > 0)
+    {
+        fwc.rule_handle = old_rules.handle[0];
+        first_old = 1;
+    }
+
+    for(i=first_old; i < old_rules.count; i++)
+    {
+        add_del_rule_msg(batch, old_rules.handle[i]);
+        num_msgs++;
+    }
+
+    if(! keep_set)
+    {
+        if(have_set)
+        {
+            add_set_msg(batch, NFT_MSG_DELSET);
+            num_msgs++;
+        }
+        add_set_msg(batch, NFT_MSG_NEWSET);
+        num_msgs++;
+    }
+
+    if(fwc.rule_handle == 0)
+    {
+        res = add_rule_msg(batch, ! keep_set);
+        num_msgs++;
+    }
+
+    batch_end(batch);
+
+    if(res == 0 && num_msgs > 0)
+        res = nft_batch_talk(batch, num_msgs, rule_echo_cb, NULL);
+    mnl_nlmsg_batch_stop(batch);
+
+    if(res != 0)
+    {
+        log_msg(LOG_ERR, "Could not set up nftables table '%s': %s",
+            fwc.table, strerror(errno));
+        return 0;
+    }
+
+    log_msg(LOG_INFO, "Using nftables %s '%s' in table '%s %s' chain '%s'",
+        fwc.use_connmark ? "map" : "set", fwc.set,
+        opts->config[CONF_NFT_FAMILY], fwc.table, fwc.chain);
+
+    return 1;
+}
+
+/* With FLUSH_NFT_AT_EXIT, remove the rule and set (and the chain or table
+ * if we created them).  Otherwise they are left in place and the kernel
+ * keeps expiring grants after we exit.
+*/
+int
+fw_cleanup(const fko_srv_options_t * const opts)
+{
+    struct mnl_nlmsg_batch *batch;
+    int                     num_msgs = 0;
+
+    if(fwc.nl == NULL)
+        return(0);
+
+    if(strncasecmp(opts->config[CONF_FLUSH_NFT_AT_EXIT], "Y", 1) != 0)
+    {
+        nft_close();
+        return(0);
+    }
+
+    if((batch = batch_start()) == NULL)
+    {
+        nft_close();
+        return(0);
+    }
+
+    if(fwc.created_table)
+    {
+        add_table_msg(batch, NFT_MSG_DELTABLE);
+        num_msgs++;
+    }
+    else
+    {
+        if(fwc.rule_handle != 0)
+        {
+            add_del_rule_msg(batch, fwc.rule_handle);
+            num_msgs++;
+        }
+        add_set_msg(batch, NFT_MSG_DELSET);
+        num_msgs++;
+
+        if(fwc.created_chain)
+        {
+            add_chain_msg(batch, NFT_MSG_DELCHAIN);
+            num_msgs++;
+        }
+    }
+
+    batch_end(batch);
+
+    if(nft_batch_talk(batch, num_msgs, NULL, NULL) != 0)
+        log_msg(LOG_ERR, "Could not remove nftables set '%s': %s",
+            fwc.set, strerror(errno));
+    mnl_nlmsg_batch_stop(batch);
+
+    nft_close();
+    return(0);
+}
+
+/****************************************************************************/
+
+/* Append one grant to the list, sending the list first if it is full.
+ * Returns the number of grants that could not be added.
+*/
+static int
+queue_grant(nft_grant_t * const grants, int * const num_grants,
+        const char * const src_ip, const char * const dst_ip,
+        const uint32_t sdp_id, const unsigned int proto,
+        const unsigned int port, const uint64_t timeout_ms)
+{
+    nft_grant_t    *g;
+    uint16_t        nport = htons(port);
+    int             off = 0, failed = 0;
+
+    if(*num_grants == NFT_MAX_GRANT_ELEMS)
+    {
+        if(add_grants(grants, *num_grants) != 0)
+        {
+            log_msg(LOG_WARNING, "Could not add nftables access for %s: %s",
+                src_ip, strerror(errno));
+            failed = *num_grants;
+        }
+        *num_grants = 0;
+    }
+
+    g = &(grants[*num_grants]);
+    memset(g, 0x0, sizeof(*g));
+
+    if(inet_pton(AF_INET, src_ip, g->key + off) != 1)
+    {
+        log_msg(LOG_WARNING, "Not an IPv4 source address: %s", src_ip);
+        return failed + 1;
+    }
+    off += NFT_KEY_FIELD_LEN;
+
+    if(fwc.use_destination)
+    {
+        if(inet_pton(AF_INET, dst_ip, g->key + off) != 1)
+        {
+            log_msg(LOG_WARNING, "Not an IPv4 destination address: %s",
+                dst_ip);
+            return failed + 1;
+        }
+        off += NFT_KEY_FIELD_LEN;
+    }
+
+    g->key[off] = (unsigned char)proto;
+    off += NFT_KEY_FIELD_LEN;
+
+    memcpy(g->key + off, &nport, sizeof(nport));
+
+    g->mark = sdp_id;
+    g->timeout_ms = timeout_ms;
+
+    (*num_grants)++;
+    return failed;
+}
+
+/* Rule Processing - Create an access request...
+*/
+int
+process_spa_request(const fko_srv_options_t * const opts,
+        const acc_stanza_t * const acc, spa_data_t * const spadat)
+{
+    nft_grant_t          grants[NFT_MAX_GRANT_ELEMS];
+    int                  num_grants = 0;
+
+    acc_port_list_t     *port_list = NULL;
+    acc_port_list_t     *ple;
+
+    service_data_list_t *next_service = spadat->service_data_list;
+
+    int                  res = 0;
+    time_t               now;
+    unsigned int         exp_ts;
+    uint64_t             timeout_ms;
+
+    /* NAT and forwarding would need more than a set lookup in the input
+     * chain, and are not supported yet.
+    */
+    if(spadat->message_type == FKO_LOCAL_NAT_ACCESS_MSG
+      || spadat->message_type == FKO_CLIENT_TIMEOUT_LOCAL_NAT_ACCESS_MSG)
+    {
+        log_msg(LOG_WARNING, "Local NAT requests are not currently supported.");
+        return(-1);
+    }
+    else if(spadat->message_type == FKO_NAT_ACCESS_MSG
+      || spadat->message_type == FKO_CLIENT_TIMEOUT_NAT_ACCESS_MSG)
+    {
+        log_msg(LOG_WARNING, "Forwarding/NAT requests are not currently supported.");
+        return(-1);
+    }
+
+    /* Set our expire time value.
+    */
+    time(&now);
+    exp_ts     = now + spadat->fw_access_timeout;
+
+    /* An element without a timeout would never expire.
+    */
+    timeout_ms = (uint64_t)spadat->fw_access_timeout * 1000;
+    if(timeout_ms == 0)
+        timeout_ms = 1000;
+
+    if(spadat->service_data_list != NULL)
+    {
+        /* SPA message requested service IDs
+        */
+        while(next_service != NULL)
+        {
+            if(next_service->service_data->nat_port != 0)
+                log_msg(LOG_WARNING,
+                    "NAT for service %"PRIu32" is not currently supported.",
+                    next_service->service_data->service_id);
+            else
+                queue_grant(grants, &num_grants, spadat->use_src_ip,
+                    spadat->pkt_destination_ip, spadat->sdp_id,
+                    next_service->service_data->proto,
+                    next_service->service_data->port, timeout_ms);
+
+            next_service = next_service->next;
+        }
+    }
+    else
+    {
+        /* Parse and expand our access message.
+        */
+        if(expand_acc_port_list(&port_list, spadat->spa_message_remain) != 1)
+        {
+            log_msg(LOG_WARNING, "Failed to parse port list in SPA message");
+            free_acc_port_list(port_list);
+            return res;
+        }
+
+        for(ple = port_list; ple != NULL; ple = ple->next)
+            queue_grant(grants, &num_grants, spadat->use_src_ip,
+                spadat->pkt_destination_ip, spadat->sdp_id,
+                ple->proto, ple->port, timeout_ms);
+
+        free_acc_port_list(port_list);
+    }
+
+    if(add_grants(grants, num_grants) != 0)
+    {
+        log_msg(LOG_WARNING, "Could not add nftables access for %s: %s",
+            spadat->use_src_ip, strerror(errno));
+        return(-1);
+    }
+
+    log_msg(LOG_INFO, "Added access for %s -> %s (%s), expires at %u",
+        spadat->use_src_ip,
+        (fwc.use_destination ? spadat->pkt_destination_ip : NFT_ANY_IP),
+        spadat->spa_message_remain, exp_ts);
+
+    return(res);
+}
+
+/* Install a list of controller-pushed grants.  Each grant keeps the
+ * timeout it has left, and they go to the kernel NFT_MAX_GRANT_ELEMS at a
+ * time rather than one request at a time.  The caller holds
+ * spa_grant_mutex.  Returns the number of grants that could not be
+ * installed.
+*/
+int
+fw_install_grants(const fko_srv_options_t * const opts,
+        fw_grant_t * const grants, const int num_grants)
+{
+    nft_grant_t          elems[NFT_MAX_GRANT_ELEMS];
+    int                  num_elems = 0;
+    int                  i, failed = 0;
+    uint64_t             timeout_ms;
+
+    for(i=0; i < num_grants; i++)
+    {
+        if(grants[i].service->nat_port != 0)
+        {
+            log_msg(LOG_WARNING,
+                "NAT for service %"PRIu32" is not currently supported.",
+                grants[i].service->service_id);
+            failed++;
+            continue;
+        }
+
+        timeout_ms = (uint64_t)grants[i].timeout * 1000;
+        if(timeout_ms == 0)
+            timeout_ms = 1000;
+
+        failed += queue_grant(elems, &num_elems, grants[i].src_ip,
+            grants[i].dst_ip, grants[i].sdp_id, grants[i].service->proto,
+            grants[i].service->port, timeout_ms);
+    }
+
+    if(add_grants(elems, num_elems) != 0)
+    {
+        log_msg(LOG_WARNING, "Could not add nftables access for %d grant(s): %s",
+            num_elems, strerror(errno));
+        failed += num_elems;
+    }
+
+    return failed;
+}
+
+/* Nothing to do - the kernel removes set elements as their timeouts run
+ * out.
+*/
+void
+check_firewall_rules(const fko_srv_options_t * const opts,
+        const int chk_rm_all)
+{
+    return;
+}
+
+int
+validate_nft_family(const char * const family_str)
+{
+    if(strcasecmp(family_str, "ip") == 0)
+        return NFPROTO_IPV4;
+    if(strcasecmp(family_str, "inet") == 0)
+        return NFPROTO_INET;
+    return -1;
+}
+
+#endif /* FIREWALL_NFTABLES */
+
+/***EOF***/
@@ -0,0 +1,85 @@
+/*
+ *****************************************************************************
+ *
+ * File:    fw_util_nftables.h
+ *
+ * Purpose: Header file for fw_util_nftables.c.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef FW_UTIL_NFTABLES_H
+#define FW_UTIL_NFTABLES_H
+
+#if HAVE_EXECVPE
+  #define SH_REDIR "" /* the shell is not used when execvpe() is available */
+#else
+  #define SH_REDIR " 2>&1"
+#endif
+
+/* nft command args (only used to list rules, everything else goes over
+ * netlink)
+*/
+#define NFT_LIST_TABLE_ARGS     "list table %s %s" SH_REDIR
+#define NFT_ANY_IP              "0.0.0.0"
+
+/* The comment attached to the lookup rule so that fwknopd can find it
+ * again (in this or a later run) to remove it.
+*/
+#define NFT_RULE_COMMENT        "fwknopd"
+
+/* Each field of a concatenated set key takes a full 32-bit register.
+*/
+#define NFT_KEY_FIELD_LEN       4
+#define NFT_MAX_KEY_LEN         (4 * NFT_KEY_FIELD_LEN)
+
+/* Header offsets for the key fields (ip saddr, ip daddr, th dport)
+*/
+#define NFT_IP_SADDR_OFFSET     12
+#define NFT_IP_DADDR_OFFSET     16
+#define NFT_TH_DPORT_OFFSET     2
+
+/* nft data type ids, used so that 'nft list' can print the set.  A
+ * concatenation is the ids of its parts NFT_TYPE_BITS apart.
+*/
+#define NFT_TYPE_BITS           6
+#define NFT_TYPE_IPADDR         7
+#define NFT_TYPE_INET_PROTOCOL  12
+#define NFT_TYPE_INET_SERVICE   13
+#define NFT_TYPE_MARK           19
+
+/* Lets the rule refer to the set when both are created in one batch
+*/
+#define NFT_ACCESS_SET_ID       1
+
+#define NFT_NO_ATTR             0xffff  /* unused add_expr() attribute */
+#define NFT_MAX_OLD_RULES       16      /* old lookup rules removed at init */
+#define NFT_MAX_GRANT_ELEMS     64      /* elements per NEWSETELEM message */
+#define NFT_NL_BUFSIZE          8192
+#define NFT_NL_TIMEOUT          2       /* seconds to wait for a reply */
+
+int validate_nft_family(const char * const family_str);
+
+#endif /* FW_UTIL_NFTABLES_H */
+
+/***EOF***/
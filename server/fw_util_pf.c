@@ -5,6 +5,12 @@
  *
  * Purpose: Fwknop routines for managing pf firewall rules.
  *
+ *          When PF_USE_TABLES is enabled and <net/pfvar.h> is available,
+ *          grants are source addresses in per-proto/port pf tables that
+ *          are added and removed with DIOCRADDADDRS/DIOCRDELADDRS on
+ *          /dev/pf.  The anchor itself only holds one rule per table and
+ *          is rewritten only when a new proto/port is first granted.
+ *
  *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
  *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
  *  list of contributors, see the file 'CREDITS'.
@@ -38,6 +44,14 @@
 #include "extcmd.h"
 #include "access.h"
 
+#if HAVE_NET_PFVAR_H
+  #include <sys/ioctl.h>
+  #include <arpa/inet.h>
+  #include <fcntl.h>
+  #include <net/if.h>
+  #include <net/pfvar.h>
+#endif
+
 static struct fw_config fwc;
 static char   cmd_buf[CMD_BUFSIZE];
 static char   err_buf[CMD_BUFSIZE];
@@ -51,6 +65,261 @@ zero_cmd_buffers(void)
     memset(cmd_out, 0x0, STANDARD_CMD_OUT_BUFSIZE);
 }
 
+#if HAVE_NET_PFVAR_H
+
+/* One anchor rule (and pf table) per granted proto/port.
+*/
+typedef struct pf_grant_table
+{
+    unsigned int    proto;
+    unsigned int    port;
+} pf_grant_table_t;
+
+/* Each address in a grant table along with its expiry time.  pf tables do
+ * not expire entries on their own, so these drive DIOCRDELADDRS calls from
+ * check_firewall_rules().
+*/
+typedef struct pf_grant
+{
+    struct pfr_addr     addr;
+    int                 tbl;
+    time_t              expire;
+    struct pf_grant    *next;
+} pf_grant_t;
+
+static pf_grant_table_t pf_tables[PF_MAX_GRANT_TABLES];
+static int              pf_num_tables = 0;
+static pf_grant_t      *pf_grants = NULL;
+
+static void
+pf_table_name(char *name, const size_t len, const int tbl)
+{
+    snprintf(name, len, PF_TABLE_PREFIX "%u_%u",
+        pf_tables[tbl].proto, pf_tables[tbl].port);
+    return;
+}
+
+/* Add or delete a single address in one of the grant tables.  Returns the
+ * number of addresses changed (0 or 1), or -1 on error.
+*/
+static int
+pf_table_ioctl(const unsigned long req, const int tbl, struct pfr_addr *addr)
+{
+    struct pfioc_table  io;
+
+    memset(&io, 0x0, sizeof(io));
+    strlcpy(io.pfrio_table.pfrt_anchor, fwc.anchor,
+        sizeof(io.pfrio_table.pfrt_anchor));
+    pf_table_name(io.pfrio_table.pfrt_name,
+        sizeof(io.pfrio_table.pfrt_name), tbl);
+
+    io.pfrio_buffer = addr;
+    io.pfrio_esize  = sizeof(*addr);
+    io.pfrio_size   = 1;
+
+    if(ioctl(fwc.pf_dev, req, &io) != 0)
+        return -1;
+
+    return (req == DIOCRADDADDRS) ? io.pfrio_nadd : io.pfrio_ndel;
+}
+
+/* Load one rule per grant table into the anchor.  This is the only time
+ * pfctl is run after startup, and only happens when a proto/port is seen
+ * for the first time.
+*/
+static int
+pf_write_table_rules(const fko_srv_options_t * const opts)
+{
+    char    rules[STANDARD_CMD_OUT_BUFSIZE] = {0};
+    char    rule[MAX_PF_NEW_RULE_LEN];
+    char    write_cmd[CMD_BUFSIZE] = {0};
+    int     i, res, pid_status = 0;
+
+    for(i=0; i < pf_num_tables; i++)
+    {
+        snprintf(rule, sizeof(rule), PF_ADD_TABLE_RULE_ARGS,
+            pf_tables[i].proto, pf_tables[i].proto,
+            pf_tables[i].port, pf_tables[i].port);
+        strlcat(rules, rule, sizeof(rules));
+    }
+
+    snprintf(write_cmd, CMD_BUFSIZE-1, "%s " PF_WRITE_ANCHOR_RULES_ARGS,
+        fwc.fw_command,
+        fwc.anchor
+    );
+
+    res = run_extcmd_write(write_cmd, rules, &pid_status, opts);
+    if(! EXTCMD_IS_SUCCESS(res))
+    {
+        log_msg(LOG_WARNING, "Could not write table rules to pf anchor");
+        return 0;
+    }
+    return 1;
+}
+
+/* Return the grant table for proto/port, loading a rule for it into the
+ * anchor first if needed.
+*/
+static int
+pf_grant_table(const fko_srv_options_t * const opts,
+        const unsigned int proto, const unsigned int port)
+{
+    int     i;
+
+    for(i=0; i < pf_num_tables; i++)
+        if(pf_tables[i].proto == proto && pf_tables[i].port == port)
+            return i;
+
+    if(pf_num_tables >= PF_MAX_GRANT_TABLES)
+    {
+        log_msg(LOG_WARNING, "Max pf grant tables reached, try again later.");
+        return -1;
+    }
+
+    pf_tables[pf_num_tables].proto = proto;
+    pf_tables[pf_num_tables].port  = port;
+    pf_num_tables++;
+
+    if(! pf_write_table_rules(opts))
+    {
+        pf_num_tables--;
+        return -1;
+    }
+
+    return pf_num_tables-1;
+}
+
+static int
+pf_make_addr(struct pfr_addr *addr, const char * const ip)
+{
+    memset(addr, 0x0, sizeof(*addr));
+
+    if(inet_pton(AF_INET, ip, &addr->pfra_ip4addr) == 1)
+    {
+        addr->pfra_af  = AF_INET;
+        addr->pfra_net = 32;
+        return 1;
+    }
+    if(inet_pton(AF_INET6, ip, &addr->pfra_ip6addr) == 1)
+    {
+        addr->pfra_af  = AF_INET6;
+        addr->pfra_net = 128;
+        return 1;
+    }
+    return 0;
+}
+
+/* Grant access for ip to proto/port until exp_ts.  A repeat grant for an
+ * address that is already in the table just moves its expiry.
+*/
+static int
+pf_table_grant(const fko_srv_options_t * const opts, const char * const ip,
+        const unsigned int proto, const unsigned int port, const time_t exp_ts)
+{
+    struct pfr_addr     addr;
+    pf_grant_t         *g;
+    int                 tbl;
+
+    if(! pf_make_addr(&addr, ip))
+    {
+        log_msg(LOG_WARNING, "Could not parse source address: %s", ip);
+        return -1;
+    }
+
+    if((tbl = pf_grant_table(opts, proto, port)) < 0)
+        return -1;
+
+    for(g = pf_grants; g != NULL; g = g->next)
+    {
+        if(g->tbl == tbl && g->addr.pfra_af == addr.pfra_af
+                && memcmp(&g->addr.pfra_u, &addr.pfra_u,
+                    sizeof(addr.pfra_u)) == 0)
+        {
+            if(exp_ts > g->expire)
+                g->expire = exp_ts;
+            return 0;
+        }
+    }
+
+    if(pf_table_ioctl(DIOCRADDADDRS, tbl, &addr) < 0)
+    {
+        log_msg(LOG_WARNING, "DIOCRADDADDRS failed for table "
+            PF_TABLE_PREFIX "%u_%u: %s", proto, port, strerror(errno));
+        return -1;
+    }
+
+    if((g = calloc(1, sizeof(*g))) == NULL)
+    {
+        log_msg(LOG_ERR, "Fatal memory allocation error.");
+        pf_table_ioctl(DIOCRDELADDRS, tbl, &addr);
+        return -1;
+    }
+
+    g->addr   = addr;
+    g->tbl    = tbl;
+    g->expire = exp_ts;
+    g->next   = pf_grants;
+    pf_grants = g;
+
+    fwc.active_rules++;
+    return 0;
+}
+
+/* Remove expired addresses from the grant tables.  The grant list is
+ * always walked in full, so chk_rm_all needs no special handling here.
+*/
+static void
+pf_table_expire(void)
+{
+    pf_grant_t     *g, **prev = &pf_grants;
+    time_t          now, min_exp = 0;
+
+    time(&now);
+
+    while((g = *prev) != NULL)
+    {
+        if(g->expire > now)
+        {
+            if(min_exp == 0 || g->expire < min_exp)
+                min_exp = g->expire;
+            prev = &g->next;
+            continue;
+        }
+
+        log_msg(LOG_INFO, "Removing " PF_TABLE_PREFIX "%u_%u entry with "
+            "expire time of %u.", pf_tables[g->tbl].proto,
+            pf_tables[g->tbl].port, (unsigned int)g->expire);
+
+        if(pf_table_ioctl(DIOCRDELADDRS, g->tbl, &g->addr) < 0)
+            log_msg(LOG_WARNING, "DIOCRDELADDRS failed: %s", strerror(errno));
+
+        if(fwc.active_rules > 0)
+            fwc.active_rules--;
+
+        *prev = g->next;
+        free(g);
+    }
+
+    fwc.next_expire = min_exp;
+    return;
+}
+
+static void
+pf_table_free(void)
+{
+    pf_grant_t *g;
+
+    while((g = pf_grants) != NULL)
+    {
+        pf_grants = g->next;
+        free(g);
+    }
+    pf_num_tables = 0;
+    return;
+}
+
+#endif /* HAVE_NET_PFVAR_H */
+
 /* Print all firewall rules currently instantiated by the running fwknopd
  * daemon to stdout.
 */
@@ -85,6 +354,26 @@ fw_dump_rules(const fko_srv_options_t * const opts)
         got_err++;
     }
 
+#if HAVE_NET_PFVAR_H
+    if(fwc.use_tables)
+    {
+        pf_grant_t *g;
+        char        ip[INET6_ADDRSTRLEN];
+
+        fprintf(stdout, "\nActive grants in PF anchor '%s' tables:\n",
+            opts->fw_config->anchor);
+
+        for(g = pf_grants; g != NULL; g = g->next)
+        {
+            inet_ntop(g->addr.pfra_af, &g->addr.pfra_u, ip, sizeof(ip));
+            fprintf(stdout, "    <" PF_TABLE_PREFIX "%u_%u> %s expires at %u\n",
+                pf_tables[g->tbl].proto, pf_tables[g->tbl].port, ip,
+                (unsigned int)g->expire);
+        }
+        fflush(stdout);
+    }
+#endif
+
     return(got_err);
 }
 
@@ -157,6 +446,16 @@ fw_config_init(fko_srv_options_t * const opts)
         fwc.use_destination = 1;
     }
 
+    fwc.pf_dev = -1;
+#if HAVE_NET_PFVAR_H
+    /* Table rules have no per-grant destination, so fall back to rewriting
+     * the anchor when destination rules are wanted.
+    */
+    if(strncasecmp(opts->config[CONF_PF_USE_TABLES], "Y", 1) == 0
+            && ! fwc.use_destination)
+        fwc.use_tables = 1;
+#endif
+
     /* Let us find it via our opts struct as well.
     */
     opts->fw_config = &fwc;
@@ -179,6 +478,19 @@ fw_initialize(const fko_srv_options_t * const opts)
     */
     delete_all_anchor_rules(opts);
 
+#if HAVE_NET_PFVAR_H
+    if(fwc.use_tables)
+    {
+        if((fwc.pf_dev = open(PF_DEV_PATH, O_RDWR)) < 0)
+        {
+            log_msg(LOG_WARNING,
+                "Could not open %s (%s), falling back to anchor rewrites",
+                PF_DEV_PATH, strerror(errno));
+            fwc.use_tables = 0;
+        }
+    }
+#endif
+
     return 1;
 }
 
@@ -186,6 +498,15 @@ int
 fw_cleanup(const fko_srv_options_t * const opts)
 {
     delete_all_anchor_rules(opts);
+
+#if HAVE_NET_PFVAR_H
+    pf_table_free();
+    if(fwc.pf_dev >= 0)
+    {
+        close(fwc.pf_dev);
+        fwc.pf_dev = -1;
+    }
+#endif
     return(0);
 }
 
@@ -230,6 +551,28 @@ process_spa_request(const fko_srv_options_t * const opts,
         */
         while(ple != NULL)
         {
+#if HAVE_NET_PFVAR_H
+            if(fwc.use_tables)
+            {
+                if(pf_table_grant(opts, spadat->use_src_ip,
+                        ple->proto, ple->port, exp_ts) != 0)
+                {
+                    free_acc_port_list(port_list);
+                    return(-1);
+                }
+
+                log_msg(LOG_INFO, "Added grant for %s, %u/%u expires at %u",
+                    spadat->use_src_ip, ple->proto, ple->port, exp_ts);
+
+                if(fwc.next_expire < now || exp_ts < fwc.next_expire)
+                    fwc.next_expire = exp_ts;
+
+                fw_timer_add(exp_ts);
+
+                ple = ple->next;
+                continue;
+            }
+#endif
             zero_cmd_buffers();
 
             snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " PF_LIST_ANCHOR_RULES_ARGS,
@@ -283,6 +626,8 @@ process_spa_request(const fko_srv_options_t * const opts,
                     */
                     if(fwc.next_expire < now || exp_ts < fwc.next_expire)
                         fwc.next_expire = exp_ts;
+
+                    fw_timer_add(exp_ts);
                 }
                 else
                 {
@@ -347,6 +692,14 @@ check_firewall_rules(const fko_srv_options_t * const opts,
     time_t          now, rule_exp, min_exp=0;
     int             i=0, res=0, anchor_ndx=0, is_delete=0, pid_status=0;
 
+#if HAVE_NET_PFVAR_H
+    if(fwc.use_tables)
+    {
+        pf_table_expire();
+        return;
+    }
+#endif
+
     /* If we have not yet reached our expected next expire
        time, continue.
     */
@@ -53,6 +53,14 @@
 #define PF_DEL_ALL_ANCHOR_RULES       "-a %s -F all" SH_REDIR
 #define PF_ANY_IP                     "any"
 
+/* Table-based grants - one anchor rule per proto/port references a table
+ * that source addresses are added to and removed from via /dev/pf.
+*/
+#define PF_DEV_PATH                   "/dev/pf"
+#define PF_TABLE_PREFIX               "fwknop_"
+#define PF_MAX_GRANT_TABLES           256
+#define PF_ADD_TABLE_RULE_ARGS        "pass in quick proto %u from <" PF_TABLE_PREFIX "%u_%u> to any port %u keep state\n"
+
 #endif /* FW_UTIL_PF_H */
 
 /***EOF***/
@@ -36,16 +36,39 @@
 #include "fw_util.h"
 #include "sig_handler.h"
 #include "replay_cache.h"
-#include "tcp_server.h"
 #include "udp_server.h"
+#include "nflog_capture.h"
+#include "spa_workers.h"
+#include "fw_commit.h"
+#include "extcmd.h"
+#include "rate_limit.h"
+#include "grant_quota.h"
+#include "authz_cache.h"
+#include "acc_lazy.h"
+#include "replay_gossip.h"
+#include "cluster.h"
+#include "ha_sync.h"
+#include "cpu_affinity.h"
+#include "config_dump.h"
+#include "metrics.h"
+#include "stats_page.h"
+#include "startup.h"
+#include "flight_recorder.h"
+#include "spa_trace.h"
+#include "reload.h"
+#include "upgrade.h"
+#include "bench_synth.h"
+#include "bench_fw.h"
 #include <json-c/json.h>
 #include "fwknopd_errors.h"
 #include "sdp_ctrl_client.h"
 #include "sdp_message.h"
 #include "dbg.h"
 #include "connection_tracker.h"
+#include "conntrack_thread.h"
 #include "control_client.h"
 #include "service.h"
+#include "mem_acct.h"
 #include <pthread.h>
 
 #if USE_LIBPCAP
@@ -66,6 +89,7 @@ static int handle_signals(fko_srv_options_t *opts);
 static int signal_to_dump_config(fko_srv_options_t * const opts);
 static void setup_pid(fko_srv_options_t *opts);
 static void init_digest_cache(fko_srv_options_t *opts);
+static void init_crypto_impl(fko_srv_options_t *opts);
 static void set_locale(fko_srv_options_t *opts);
 static pid_t get_running_pid(const fko_srv_options_t *opts);
 #if AFL_FUZZING
@@ -86,8 +110,11 @@ int
 main(int argc, char **argv)
 {
     fko_srv_options_t   opts;
+    config_dump_filter_t dump_filter;
     int restarted = 0;
 
+    reload_init(argc, argv);
+
     while(1)
     {
 
@@ -114,6 +141,11 @@ main(int argc, char **argv)
         if(opts.status == 1)
             clean_exit(&opts, NO_FW_CLEANUP, status_fwknopd(&opts));
 
+        /* Print the stats page of the currently running fwknopd?
+        */
+        if(opts.stats == 1)
+            clean_exit(&opts, NO_FW_CLEANUP, stats_page_print(&opts));
+
         /* Restart the currently running fwknopd process?
         */
         if(opts.restart == 1)
@@ -133,6 +165,11 @@ main(int argc, char **argv)
         set_locale(&opts);
 #endif
 
+        /* Pick the libfko crypto implementations before any threads use
+         * them.
+        */
+        init_crypto_impl(&opts);
+
         /* Make sure we have a valid run dir and path leading to digest file
          * in case it configured to be somewhere other than the run dir.
         */
@@ -171,14 +208,32 @@ main(int argc, char **argv)
             clean_exit(&opts, FW_CLEANUP, signal_to_dump_config(&opts));
         }
 
+        // cap what the tables built from here on may hold
+        if(mem_acct_start(&opts) != 0)
+            clean_exit(&opts, NO_FW_CLEANUP, EXIT_FAILURE);
+
+        // before any SDP access data arrives, whether new stanzas are
+        // to be expanded up front or on first use
+        if(acc_lazy_start(&opts) != 0)
+            clean_exit(&opts, NO_FW_CLEANUP, EXIT_FAILURE);
+
+        // the synthetic benchmark builds its own tables, otherwise
         // if SDP control client is disabled
         // read the access data from the access.conf file
-        if(strncasecmp(opts.config[CONF_DISABLE_SDP_CTRL_CLIENT], "Y", 1) == 0)
+        if(opts.benchmark_synth != NULL || opts.benchmark_fw != NULL)
+        {
+            log_msg(LOG_DEBUG, "fwknopd main: benchmark, not loading access data.");
+        }
+        else if(strncasecmp(opts.config[CONF_DISABLE_SDP_CTRL_CLIENT], "Y", 1) == 0)
         {
             /* Process the access.conf file.
             */
             parse_access_file(&opts);
         }
+        else if(opts.exit_after_parse_config)
+        {
+            log_msg(LOG_DEBUG, "fwknopd main: config check only, not contacting the controller.");
+        }
         else
         {
             // connect to controller and get service and access lists
@@ -191,9 +246,19 @@ main(int argc, char **argv)
         */
         if(opts.dump_config == 1)
         {
-            dump_config(&opts);
-            dump_service_list(&opts);
-            dump_access_list(&opts);
+            dump_filter.json       = opts.dump_json;
+            dump_filter.sdp_id     = opts.dump_sdp_id;
+            dump_filter.service_id = opts.dump_service_id;
+            config_dump_run(&opts, &dump_filter);
+            clean_exit(&opts, NO_FW_CLEANUP, EXIT_SUCCESS);
+        }
+
+        /* Stop here when only checking the config, which is also how a
+         * SIGHUP reload vets the new files alongside the running server.
+        */
+        if(opts.exit_after_parse_config)
+        {
+            log_msg(LOG_INFO, RELOAD_CHECK_DONE_MSG);
             clean_exit(&opts, NO_FW_CLEANUP, EXIT_SUCCESS);
         }
 
@@ -218,12 +283,44 @@ main(int argc, char **argv)
             setup_pid(&opts);
         }
 
+        /* Start the external command helper now that we have daemonized
+         * and before the process grows.
+        */
+        if(extcmd_helper_start(&opts) != 0)
+            clean_exit(&opts, NO_FW_CLEANUP, EXIT_FAILURE);
+
+        /* From here on messages go through the log ring (this is a no-op
+         * after a restart, the thread is already running).
+        */
+        if(log_ring_start() != 0)
+            clean_exit(&opts, NO_FW_CLEANUP, EXIT_FAILURE);
+
+        /* Every thread started from here on pins itself to the CPUs for
+         * its role (CAPTURE_CPUS etc.).
+        */
+        if(cpu_affinity_init(&opts) != 0)
+            clean_exit(&opts, NO_FW_CLEANUP, EXIT_FAILURE);
+
+        /* Start preparing the firewall - i.e. flush any old rules and (for
+         * iptables) create fwknop chains - while the replay cache loads.
+        */
+        startup_fw_begin(&opts);
+
         if(strncasecmp(opts.config[CONF_DISABLE_SDP_CTRL_CLIENT], "N", 1) == 0)
         {
+            // the control client thread sends the tracker's reports,
+            // so the tracker has to be running first
+            if(strncmp(opts.config[CONF_DISABLE_CONNECTION_TRACKING], "N", 1) == 0
+                    && conntrack_thread_start(&opts) != 0)
+            {
+                log_msg(LOG_ERR, "Failed to start connection tracking thread. Aborting.");
+                clean_exit(&opts, FW_CLEANUP, EXIT_FAILURE);
+            }
+
             // arriving here means the server received access data
             // from the controller, they are still connected so go
             // ahead and start the thread to continue listening
-            if(pthread_create( &(opts.ctrl_client_thread), NULL, control_client_thread_func, (void*)&opts))
+            if(control_client_thread_start(&opts) != FWKNOPD_SUCCESS)
             {
                 log_msg(LOG_ERR, "Failed to start SDP Control Client Thread. Aborting.");
                 clean_exit(&opts, FW_CLEANUP, EXIT_FAILURE);
@@ -247,11 +344,8 @@ main(int argc, char **argv)
         */
         init_digest_cache(&opts);
 
-        if(opts.exit_after_parse_config)
-        {
-            log_msg(LOG_INFO, "Configs parsed, exiting.");
-            clean_exit(&opts, NO_FW_CLEANUP, EXIT_SUCCESS);
-        }
+        if(authz_cache_start(&opts) != 0)
+            clean_exit(&opts, NO_FW_CLEANUP, EXIT_FAILURE);
 
 #if AFL_FUZZING
         /* SPA data from STDIN. */
@@ -268,13 +362,100 @@ main(int argc, char **argv)
         }
 #endif
 
-        /* Prepare the firewall - i.e. flush any old rules and (for iptables)
-         * create fwknop chains.
+#if USE_LIBPCAP
+        /* Benchmark mode replays the pcap file (with --test set, so the
+         * firewall is never touched) and exits.
+        */
+        if(opts.benchmark)
+        {
+            if(pcap_benchmark(&opts) != 0)
+                clean_exit(&opts, NO_FW_CLEANUP, EXIT_FAILURE);
+            clean_exit(&opts, NO_FW_CLEANUP, EXIT_SUCCESS);
+        }
+#endif
+
+        if(opts.benchmark_synth != NULL)
+        {
+            if(bench_synth_run(&opts) != 0)
+                clean_exit(&opts, NO_FW_CLEANUP, EXIT_FAILURE);
+            clean_exit(&opts, NO_FW_CLEANUP, EXIT_SUCCESS);
+        }
+
+        /* The firewall benchmark moves into a network namespace of its
+         * own, so everything it does to the firewall is gone when it
+         * exits.
         */
-        if(!opts.test && opts.enable_fw && (fw_initialize(&opts) != 1))
+        if(opts.benchmark_fw != NULL)
+        {
+            if(bench_fw_run(&opts) != 0)
+                clean_exit(&opts, NO_FW_CLEANUP, EXIT_FAILURE);
+            clean_exit(&opts, NO_FW_CLEANUP, EXIT_SUCCESS);
+        }
+
+        /* The firewall has to be ready before any packets can arrive.  The
+         * rules of a fwknopd we are taking over from are kept.
+        */
+        if(startup_fw_finish(&opts) != 1)
+            clean_exit(&opts, FW_CLEANUP, EXIT_FAILURE);
+
+        /* Set up the flight recorder, the per-source rate limiter and the
+         * grant quotas, and start the SPA worker threads (if SPA_WORKERS is
+         * set) before any packets can arrive.
+        */
+        if(flight_recorder_start(&opts) != 0)
+            clean_exit(&opts, FW_CLEANUP, EXIT_FAILURE);
+
+        if(spa_trace_start(&opts) != 0)
+            clean_exit(&opts, FW_CLEANUP, EXIT_FAILURE);
+
+        if(rate_limit_start(&opts) != 0)
+            clean_exit(&opts, FW_CLEANUP, EXIT_FAILURE);
+
+        if(grant_quota_start(&opts) != 0)
+            clean_exit(&opts, FW_CLEANUP, EXIT_FAILURE);
+
+        if(fw_commit_start(&opts) != 0)
+            clean_exit(&opts, FW_CLEANUP, EXIT_FAILURE);
+
+        if(spa_workers_start(&opts) != 0)
+            clean_exit(&opts, FW_CLEANUP, EXIT_FAILURE);
+
+        if(replay_gossip_start(&opts) != 0)
+            clean_exit(&opts, FW_CLEANUP, EXIT_FAILURE);
+
+        if(cluster_start(&opts) != 0)
+            clean_exit(&opts, FW_CLEANUP, EXIT_FAILURE);
+
+        if(ha_sync_start(&opts) != 0)
+            clean_exit(&opts, FW_CLEANUP, EXIT_FAILURE);
+
+        if(metrics_start(&opts) != 0)
             clean_exit(&opts, FW_CLEANUP, EXIT_FAILURE);
 
+        if(stats_page_start(&opts) != 0)
+            clean_exit(&opts, FW_CLEANUP, EXIT_FAILURE);
+
+        /* Everything is set up, so the fwknopd we are taking over from
+         * can stop serving now.  Its PID file lock goes with it.
+        */
+        if(upgrade_in_progress())
+        {
+            upgrade_complete(&opts);
+            if(write_pid_file(&opts) != 0)
+                log_msg(LOG_WARNING, "[*] Could not take over the PID file %s.",
+                    opts.config[CONF_FWKNOP_PID_FILE]);
+        }
+
+        cpu_affinity_set(CPU_ROLE_CAPTURE);
+
+        /* Access data, replay cache and firewall are all in place, the
+         * capture below is what is left to start.
+        */
+        startup_notify("READY=1");
+
         /* If we are to acquire SPA data via a UDP socket, start it up here.
+         * The TCP server (if enabled) runs inside the UDP, NFLOG or pcap
+         * capture loop, so there is nothing more to start for it here.
         */
         if(opts.enable_udp_server ||
                 strncasecmp(opts.config[CONF_ENABLE_UDP_SERVER], "Y", 1) == 0)
@@ -284,66 +465,73 @@ main(int argc, char **argv)
                 log_msg(LOG_ERR, "Fatal run_udp_server() error");
                 clean_exit(&opts, FW_CLEANUP, EXIT_FAILURE);
             }
-            else
-            {
-                break;
-            }
         }
 
-        /* If the TCP server option was set, fire it up here. Note that in
-         * this mode, fwknopd still acquires SPA packets via libpcap. If you
-         * want to use UDP only without the libpcap dependency, then fwknop
-         * needs to be compiled with --enable-udp-server. Note that the UDP
-         * server can be run even when fwknopd links against libpcap as well,
-         * but there is no reason to link against it if SPA packets are
-         * always going to be acquired via a UDP socket.
+        /* Take SPA packets from an NFLOG group instead of sniffing them
+         * (the UDP server takes precedence).
         */
-        if(strncasecmp(opts.config[CONF_ENABLE_TCP_SERVER], "Y", 1) == 0)
+        else if(strncasecmp(opts.config[CONF_ENABLE_NFLOG_CAPTURE], "Y", 1) == 0)
         {
-            if(run_tcp_server(&opts) < 0)
+#if HAVE_NFLOG_CAPTURE
+            if(run_nflog_capture(&opts) < 0)
             {
-                log_msg(LOG_ERR, "Fatal run_tcp_server() error");
+                log_msg(LOG_ERR, "Fatal run_nflog_capture() error");
                 clean_exit(&opts, FW_CLEANUP, EXIT_FAILURE);
             }
+#else
+            log_msg(LOG_ERR,
+                "NFLOG capture requires a netfilter firewall (iptables, firewalld or nftables)");
+            clean_exit(&opts, FW_CLEANUP, EXIT_FAILURE);
+#endif
         }
 
 #if USE_LIBPCAP
         /* Intiate pcap capture mode...
         */
-        if(!opts.enable_udp_server
+        else if(!opts.enable_udp_server
                 && strncasecmp(opts.config[CONF_ENABLE_UDP_SERVER], "N", 1) == 0)
         {
             pcap_capture(&opts);
         }
 #endif
 
+        /* Finish any queued packets before re-reading the config or
+         * shutting down.
+        */
+        cluster_stop();
+        ha_sync_stop();
+        spa_workers_stop();
+        fw_commit_stop();
+        rate_limit_stop();
+        replay_gossip_stop();
+        metrics_stop();
+        stats_page_stop();
+        spa_trace_stop();
+        reload_stop();
+        config_dump_stop();
+
+        /* A new fwknopd is taking over, it gets our state and the firewall
+         * rules stay as they are.
+        */
+        if(upgrade_handoff_pending())
+        {
+            upgrade_send_state(&opts);
+            log_msg(LOG_WARNING, "Handed over to the new fwknopd. Exiting.");
+            clean_exit(&opts, NO_FW_CLEANUP, EXIT_SUCCESS);
+        }
+
         /* Deal with any signals that we've received and break out
          * of the loop for any terminating signals
         */
         if(handle_signals(&opts) == 1)
             break;
 
+        startup_notify("RELOADING=1");
         restarted = 1;
     }
 
     log_msg(LOG_INFO, "Shutting Down fwknopd.");
-
-    /* Kill the TCP server (if we have one running).
-    */
-    if(opts.tcp_server_pid > 0)
-    {
-        log_msg(LOG_INFO, "Killing the TCP server (pid=%i)",
-            opts.tcp_server_pid);
-
-        kill(opts.tcp_server_pid, SIGTERM);
-
-        /* --DSS XXX: This seems to be necessary if the tcp server
-         *            was restarted by this program. We need to
-         *            investigate and fix this. For now, this works
-         *            (it is kludgy, but does no harm afaik).
-        */
-        kill(opts.tcp_server_pid, SIGKILL);
-    }
+    startup_notify("STOPPING=1");
 
     clean_exit(&opts, FW_CLEANUP, EXIT_SUCCESS);
 
@@ -525,6 +713,37 @@ static void init_digest_cache(fko_srv_options_t *opts)
     return;
 }
 
+/* Time the libfko SHA-256, AES and base64 implementations the CPU
+ * supports (once, a restart keeps the results) and apply CRYPTO_IMPL on
+ * top of the fastest.
+*/
+static void init_crypto_impl(fko_srv_options_t *opts)
+{
+    static int  calibrated = 0;
+    char        spec[FKO_IMPL_SPEC_LEN];
+    int         res;
+
+    if(! calibrated)
+    {
+        if((res = fko_impl_calibrate()) != FKO_SUCCESS)
+            log_msg(LOG_WARNING, "Crypto implementation benchmark failed: %s",
+                fko_errstr(res));
+        calibrated = 1;
+    }
+
+    if((res = fko_impl_select(opts->config[CONF_CRYPTO_IMPL])) != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid CRYPTO_IMPL '%s': %s",
+            opts->config[CONF_CRYPTO_IMPL], fko_errstr(res));
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    if(fko_impl_get_spec(spec, sizeof(spec)) == FKO_SUCCESS)
+        log_msg(LOG_INFO, "Crypto implementations: %s", spec);
+
+    return;
+}
+
 static void setup_pid(fko_srv_options_t *opts)
 {
     pid_t    old_pid;
@@ -542,6 +761,27 @@ static void setup_pid(fko_srv_options_t *opts)
     if(get_running_pid(opts) != getpid())
     {
         log_msg(LOG_DEBUG, "setup_pid: I am NOT the restarted process.");
+
+        /* With --upgrade, get the running fwknopd to hand over before we
+         * go any further.  If that fails it simply keeps running.
+        */
+        if(opts->upgrade)
+        {
+            old_pid = get_running_pid(opts);
+            if(old_pid > 0 && kill(old_pid, 0) == 0)
+            {
+                if(upgrade_connect(opts, old_pid) != 0)
+                {
+                    fprintf(stderr,
+                        "[*] Could not take over from fwknopd (PID=%i), leaving it running.\n",
+                        old_pid);
+                    clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+                }
+            }
+            else
+                log_msg(LOG_WARNING, "No running fwknopd to upgrade, starting normally.");
+        }
+
         /* If foreground mode is not set, then fork off and become a daemon.
         * Otherwise, attempt to get the pid file lock and go on.
         */
@@ -550,7 +790,7 @@ static void setup_pid(fko_srv_options_t *opts)
             log_msg(LOG_DEBUG, "setup_pid: about to daemonize...");
             daemonize_process(opts);
         }
-        else
+        else if(! upgrade_in_progress())
         {
             log_msg(LOG_DEBUG, "setup_pid: writing to PID file...");
             old_pid = write_pid_file(opts);
@@ -637,21 +877,16 @@ static int handle_signals(fko_srv_options_t *opts)
             {
                 if(opts->ctrl_client_thread > 0)
                 {
-                    log_msg(LOG_WARNING, "Canceling ctrl client thread...");
-                    pthread_cancel(opts->ctrl_client_thread);
-                    log_msg(LOG_WARNING, "Joining ctrl client thread...");
-                    pthread_join(opts->ctrl_client_thread, NULL);
+                    log_msg(LOG_WARNING, "Stopping ctrl client thread...");
+                    control_client_thread_stop(opts);
                     log_msg(LOG_WARNING, "Ctrl client thread joined.");
-                    opts->ctrl_client_thread = 0;
                 }
+                conntrack_thread_stop();
                 sdp_ctrl_client_disconnect(opts->ctrl_client);
                 sdp_ctrl_client_destroy(opts->ctrl_client);
                 opts->ctrl_client = NULL;
             }
             free_configs(opts);
-            if(opts->tcp_server_pid > 0)
-                kill(opts->tcp_server_pid, SIGTERM);
-            usleep(1000000);
             got_sighup = 0;
             rv = 0;  /* this means fwknopd will not exit */
         }
@@ -670,9 +905,7 @@ static int handle_signals(fko_srv_options_t *opts)
             log_msg(LOG_INFO, "Got SIGUSR1. Dumping config...");
             rv = 0;
             got_sigusr1 = 0;
-            dump_config(opts);
-            dump_service_list(opts);
-            dump_access_list(opts);
+            config_dump_run(opts, NULL);
         }
         else
         {
@@ -704,6 +937,12 @@ static int signal_to_dump_config(fko_srv_options_t * const opts)
 
     if(old_pid > 0)
     {
+        if(config_dump_write_request(opts) != 0)
+        {
+            fprintf(stdout, "FAILED to pass the dump options to fwknopd.\n");
+            return EXIT_FAILURE;
+        }
+
         res    = kill(old_pid, SIGUSR1);
 
         if(res == 0)
@@ -964,9 +1203,10 @@ daemonize_process(fko_srv_options_t * const opts)
     */
     setsid();
 
-    /* Create the PID file (or be blocked by an existing one).
+    /* Create the PID file (or be blocked by an existing one).  When
+     * taking over from another fwknopd that waits until it has exited.
     */
-    old_pid = write_pid_file(opts);
+    old_pid = upgrade_in_progress() ? 0 : write_pid_file(opts);
     if(old_pid > 0)
     {
         fprintf(stderr,
@@ -33,6 +33,7 @@
 
 #include "common.h"
 #include "hash_table.h"
+#include "benchmark.h"
 #include "sdp_ctrl_client.h"
 #include <pthread.h>
 
@@ -70,6 +71,9 @@
 #define DEF_ACCESS_FILE     DEF_CONF_DIR"/access.conf"
 #define DEF_CONN_ID_FILE    DEF_CONF_DIR"/last_conn_id.conf"
 #define DEF_CONN_REPORT_INTERVAL   "30"
+#define DEF_CONN_REPORT_DELTAS     "N"
+#define DEF_CONN_REPORT_COMPRESS   "N"
+#define DEF_CONN_REPORT_COUNTERS   "N"
 
 #ifndef DEF_RUN_DIR
   /* Our default run directory is based on LOCALSTATEDIR as set by the
@@ -81,6 +85,7 @@
 /* More Conf defaults
 */
 #define DEF_PID_FILENAME                MY_NAME".pid"
+#define DEF_STATS_FILENAME              MY_NAME".stats"
 #if USE_FILE_CACHE
   #define DEF_DIGEST_CACHE_FILENAME       "digest.cache"
 #else
@@ -92,11 +97,21 @@
 #define DEF_PCAP_FILTER                 "udp port 62201"
 #define DEF_PCAP_DISPATCH_COUNT         "100"
 #define DEF_PCAP_LOOP_SLEEP             "100000" /* a tenth of a second (in microseconds) */
+#define DEF_PCAP_ADAPTIVE_POLL          "Y"
 #define DEF_ENABLE_PCAP_ANY_DIRECTION   "N"
+#define DEF_ENABLE_PCAP_TPACKET_V3      "N"
+#define DEF_PCAP_TPACKET_V3_BLOCKS      "64"
+#define DEF_PCAP_CAPTURE_THREADS        "1"
+#define DEF_PCAP_FANOUT_MODE            "hash"
+#define DEF_ENABLE_PCAP_PREFILTER       "N"
+#define DEF_ENABLE_PCAP_AUTO_FILTER     "N"
+#define DEF_PCAP_AUTO_FILTER_DESTINATIONS "N"
+#define DEF_ENABLE_IPV6                 "N"
 #define DEF_EXIT_AT_INTF_DOWN           "Y"
 #define DEF_ENABLE_SPA_PACKET_AGING     "Y"
 #define DEF_MAX_SPA_PACKET_AGE          "120"
 #define DEF_ENABLE_DIGEST_PERSISTENCE   "Y"
+#define DEF_DIGEST_FILE_SYNC_INTERVAL   "1"
 #define DEF_RULES_CHECK_THRESHOLD       "20"
 #define DEF_MAX_SNIFF_BYTES             "1500"
 #define DEF_GPG_HOME_DIR                "/root/.gnupg"
@@ -113,6 +128,8 @@
 #define DEF_ENABLE_SPA_OVER_HTTP        "N"
 #define DEF_ENABLE_TCP_SERVER           "N"
 #define DEF_TCPSERV_PORT                "62201"
+#define DEF_ENABLE_HTTP_SERVER          "N"
+#define DEF_HTTPSERV_PORT               "80"
 #if USE_LIBPCAP
   #define DEF_ENABLE_UDP_SERVER           "N"
 #else
@@ -120,14 +137,56 @@
 #endif
 #define DEF_UDPSERV_PORT                "62201"
 #define DEF_UDPSERV_SELECT_TIMEOUT      "500000" /* half a second (in microseconds) */
+#define DEF_UDPSERV_RECV_BATCH          "32"
+#define DEF_UDPSERV_WORKERS             "1"
+#define DEF_ENABLE_NFLOG_CAPTURE        "N"
+#define DEF_NFLOG_GROUP                 "0"
+#define DEF_NFLOG_QTHRESHOLD            "1"
+#define DEF_SPA_WORKERS                 "0"
+#define DEF_SPA_SHED_TARGET_DELAY       "5"
+#if LOW_MEMORY
+  #define DEF_AUTHZ_CACHE_SIZE            "256"
+#else
+  #define DEF_AUTHZ_CACHE_SIZE            "4096"
+#endif
+#define DEF_ACCESS_EXPAND_LIMIT         "0"
+#define DEF_MAX_ACTIVE_GRANTS           "0"
+#define DEF_ENABLE_FW_COMMIT_THREAD     "Y"
+#define DEF_ENABLE_EXTCMD_HELPER        "N"
+#define DEF_SPA_RATE_LIMIT              "0"
+#define DEF_SPA_RATE_BURST              "10"
+#define DEF_REPLAY_GOSSIP_PORT          "0"
+#define DEF_METRICS_PORT                "0"
+#define DEF_METRICS_ADDRESS             "127.0.0.1"
+#define DEF_STATS_INTERVAL              "0"
+#define DEF_CRYPTO_IMPL                 "auto"
 #define DEF_SYSLOG_IDENTITY             MY_NAME
 #define DEF_SYSLOG_FACILITY             "LOG_DAEMON"
+#define DEF_LOG_FILE_MAX_SIZE           "104857600"
+#define DEF_LOG_FILE_ROTATE_INTERVAL    "0"
+#define DEF_LOG_FILE_KEEP               "5"
+#define DEF_LOG_FILE_JSON               "N"
+#define DEF_FLIGHT_RECORDER_SIZE        "0"
+#define DEF_SPA_TRACE                   "N"
+#if LOW_MEMORY
+  #define DEF_MEM_LIMIT                   "33554432"
+  #define DEF_CONNTRACK_BUF_SIZE          "131072"
+#else
+  #define DEF_MEM_LIMIT                   "0"
+  #define DEF_CONNTRACK_BUF_SIZE          "1048576"
+#endif
 #define DEF_ENABLE_DESTINATION_RULE     "N"
 #define DEF_DISABLE_SDP_MODE            "N"
 #define DEF_ALLOW_LEGACY_ACCESS_REQUESTS "N"
 #define DEF_DISABLE_SDP_CTRL_CLIENT     "N"
 #define DEF_DISABLE_CONNECTION_TRACKING "N"
+#define DEF_CONNTRACK_USE_NETLINK       "Y"
 #define DEF_MAX_WAIT_ACC_DATA           "30"
+#define DEF_ACC_SNAPSHOT_MAX_AGE        "86400"
+#define DEF_SDP_SHARD_COUNT             "1"
+#define DEF_SDP_SHARD_INDEX             "0"
+#define DEF_CLUSTER_PORT                "0"
+#define DEF_HA_SYNC_PORT                "0"
 
 
 #define DEF_FW_ACCESS_TIMEOUT           30
@@ -136,16 +195,51 @@
 */
 #define RCHK_MAX_PCAP_LOOP_SLEEP        (2 << 22)
 #define RCHK_MAX_SPA_PACKET_AGE         100000  /* seconds, can disable */
+#define RCHK_MAX_DIGEST_FILE_SYNC_INTERVAL 3600 /* seconds */
 #define RCHK_MAX_SNIFF_BYTES            (2 << 14)
 #define RCHK_MAX_TCPSERV_PORT           ((2 << 16) - 1)
+#define RCHK_MAX_HTTPSERV_PORT          ((2 << 16) - 1)
 #define RCHK_MAX_UDPSERV_PORT           ((2 << 16) - 1)
 #define RCHK_MAX_UDPSERV_SELECT_TIMEOUT (2 << 22)
+#define RCHK_MAX_UDPSERV_RECV_BATCH     1024
+#define RCHK_MAX_UDPSERV_WORKERS        64
+#define RCHK_MAX_NFLOG_GROUP            65535
+#define RCHK_MAX_NFLOG_QTHRESHOLD       64
+#define RCHK_MAX_SPA_WORKERS            64
+#define RCHK_MAX_SPA_SHED_TARGET_DELAY  1000 /* milliseconds */
+#define RCHK_MAX_AUTHZ_CACHE_SIZE       1048576
+#define RCHK_MAX_ACCESS_EXPAND_LIMIT    16777216
+#define RCHK_MAX_ACTIVE_GRANTS          16777216
+#define RCHK_MAX_SPA_RATE_LIMIT         100000 /* packets per second */
+#define RCHK_MAX_SPA_RATE_BURST         4095
+#define RCHK_MAX_REPLAY_GOSSIP_PORT     ((2 << 16) - 1)
+#define RCHK_MAX_METRICS_PORT           ((2 << 16) - 1)
+#define RCHK_MAX_STATS_INTERVAL         60000   /* milliseconds */
 #define RCHK_MAX_PCAP_DISPATCH_COUNT    (2 << 22)
+#define RCHK_MAX_PCAP_TPACKET_V3_BLOCKS 4096
+#define RCHK_MAX_PCAP_CAPTURE_THREADS   64
 #define RCHK_MAX_FW_TIMEOUT             (2 << 22) /* seconds */
 #define RCHK_MAX_CMD_CYCLE_TIMER        (2 << 22) /* seconds */
 #define RCHK_MIN_CMD_CYCLE_TIMER        1
 #define RCHK_MAX_RULES_CHECK_THRESHOLD  ((2 << 16) - 1)
 #define RCHK_MAX_WAIT_ACC_DATA          60
+#define RCHK_MAX_ACC_SNAPSHOT_MAX_AGE   (2 << 22) /* seconds */
+#define RCHK_MAX_LOG_FILE_MAX_SIZE      2147483647 /* bytes */
+#define RCHK_MAX_LOG_FILE_ROTATE_INTERVAL (2 << 22) /* seconds */
+#define RCHK_MAX_LOG_FILE_KEEP          99
+#define RCHK_MAX_FLIGHT_RECORDER_SIZE   65536
+#define RCHK_MAX_MEM_LIMIT              2147483647 /* bytes */
+#define RCHK_MIN_CONNTRACK_BUF_SIZE     4096
+#define RCHK_MAX_CONNTRACK_BUF_SIZE     67108864 /* bytes */
+#define RCHK_MAX_SDP_SHARD_COUNT        64
+#define RCHK_MAX_CLUSTER_PORT           ((2 << 16) - 1)
+#define RCHK_MAX_HA_SYNC_PORT           ((2 << 16) - 1)
+#define RCHK_MAX_BENCHMARK_LOOPS        1000000
+#define RCHK_MAX_SYNTH_STANZAS          1000000
+#define RCHK_MAX_SYNTH_SERVICES         1000000
+#define RCHK_MAX_SYNTH_GRANTS           1000000
+#define RCHK_MAX_SYNTH_PACKETS          10000000
+#define RCHK_MAX_BENCH_FW_GRANTS        1000000
 
 #define MIN_ACC_STANZA_HASH_TABLE_LENGTH  10
 #define MAX_ACC_STANZA_HASH_TABLE_LENGTH  10000
@@ -167,6 +261,7 @@
   #define DEF_ENABLE_FIREWD_SNAT           "N"
   #define DEF_ENABLE_FIREWD_OUTPUT         "N"
   #define DEF_ENABLE_FIREWD_COMMENT_CHECK  "Y"
+  #define DEF_FIREWD_USE_DBUS              "Y"
   #define DEF_FIREWD_INPUT_ACCESS          "ACCEPT, filter, INPUT, 1, FWKNOP_INPUT, 1"
   #define DEF_FIREWD_OUTPUT_ACCESS         "ACCEPT, filter, OUTPUT, 1, FWKNOP_OUTPUT, 1"
   #define DEF_FIREWD_FORWARD_ACCESS        "ACCEPT, filter, FORWARD, 1, FWKNOP_FORWARD, 1"
@@ -187,6 +282,10 @@
   #define DEF_ENABLE_IPT_SNAT           "N"
   #define DEF_ENABLE_IPT_OUTPUT         "N"
   #define DEF_ENABLE_IPT_COMMENT_CHECK  "Y"
+  #define DEF_ENABLE_IPT_IPSET          "N"
+  #define DEF_IPT_IPSET_NAME            "fwknop_access"
+  #define DEF_ENABLE_IPT_RESTORE_BATCH  "Y"
+  #define DEF_IPT_INPUT_SHARD_BITS      "0"
   #define DEF_IPT_INPUT_ACCESS          "ACCEPT, filter, INPUT, 1, FWKNOP_INPUT, 1"
   #define DEF_IPT_OUTPUT_ACCESS         "ACCEPT, filter, OUTPUT, 1, FWKNOP_OUTPUT, 1"
   #define DEF_IPT_FORWARD_ACCESS        "ACCEPT, filter, FORWARD, 1, FWKNOP_FORWARD, 1"
@@ -195,6 +294,18 @@
   #define DEF_IPT_MASQUERADE_ACCESS     "MASQUERADE, nat, POSTROUTING, 1, FWKNOP_MASQUERADE, 1"
 
   #define RCHK_MAX_IPT_RULE_NUM         (2 << 15)
+  #define RCHK_MAX_IPT_INPUT_SHARD_BITS 8
+
+/* Nftables-specific defines
+*/
+#elif FIREWALL_NFTABLES
+
+  #define DEF_FLUSH_NFT_AT_INIT         "Y"
+  #define DEF_FLUSH_NFT_AT_EXIT         "Y"
+  #define DEF_NFT_FAMILY                "inet"
+  #define DEF_NFT_TABLE                 "filter"
+  #define DEF_NFT_INPUT_CHAIN           "input"
+  #define DEF_NFT_ACCESS_SET            "fwknop_access"
 
 /* Ipfw-specific defines
 */
@@ -208,6 +319,8 @@
   #define DEF_IPFW_EXPIRE_SET_NUM        "2"
   #define DEF_IPFW_EXPIRE_PURGE_INTERVAL "30"
   #define DEF_IPFW_ADD_CHECK_STATE       "N"
+  #define DEF_IPFW_USE_TABLES            "N"
+  #define DEF_IPFW_TABLE_NAME            "fwknop"
 
   #define RCHK_MAX_IPFW_START_RULE_NUM   ((2 << 16) - 1)
   #define RCHK_MAX_IPFW_MAX_RULES        ((2 << 16) - 1)
@@ -218,6 +331,7 @@
 
   #define DEF_PF_ANCHOR_NAME             "fwknop"
   #define DEF_PF_EXPIRE_INTERVAL         "30"
+  #define DEF_PF_USE_TABLES              "Y"
 
   #define RCHK_MAX_PF_EXPIRE_INTERVAL    ((2 << 16) - 1)
 
@@ -234,7 +348,6 @@
 #define MAX_SPA_PACKET_LEN      1500 /* --DSS check this? */
 #define MAX_HOSTNAME_LEN        64
 #define MAX_DECRYPTED_SPA_LEN   1024
-#define MAX_SDP_ID_STR_LEN 11
 
 /* The minimum possible valid SPA data size.
 */
@@ -257,24 +370,69 @@ enum {
     CONF_PCAP_FILTER,
     CONF_PCAP_DISPATCH_COUNT,
     CONF_PCAP_LOOP_SLEEP,
+    CONF_PCAP_ADAPTIVE_POLL,
     CONF_ENABLE_PCAP_ANY_DIRECTION,
+    CONF_ENABLE_PCAP_TPACKET_V3,
+    CONF_PCAP_TPACKET_V3_BLOCKS,
+    CONF_PCAP_CAPTURE_THREADS,
+    CONF_PCAP_FANOUT_MODE,
+    CONF_ENABLE_PCAP_PREFILTER,
+    CONF_ENABLE_PCAP_AUTO_FILTER,
+    CONF_PCAP_AUTO_FILTER_DESTINATIONS,
     CONF_EXIT_AT_INTF_DOWN,
     CONF_MAX_SNIFF_BYTES,
     CONF_ENABLE_SPA_PACKET_AGING,
     CONF_MAX_SPA_PACKET_AGE,
     CONF_ENABLE_DIGEST_PERSISTENCE,
+    CONF_DIGEST_FILE_SYNC_INTERVAL,
     CONF_RULES_CHECK_THRESHOLD,
     CONF_CMD_EXEC_TIMEOUT,
     //CONF_BLACKLIST,
     CONF_ENABLE_SPA_OVER_HTTP,
     CONF_ENABLE_TCP_SERVER,
     CONF_TCPSERV_PORT,
+    CONF_ENABLE_HTTP_SERVER,
+    CONF_HTTPSERV_PORT,
     CONF_ENABLE_UDP_SERVER,
     CONF_UDPSERV_PORT,
     CONF_UDPSERV_SELECT_TIMEOUT,
+    CONF_UDPSERV_RECV_BATCH,
+    CONF_UDPSERV_WORKERS,
+    CONF_ENABLE_NFLOG_CAPTURE,
+    CONF_NFLOG_GROUP,
+    CONF_NFLOG_QTHRESHOLD,
+    CONF_SPA_WORKERS,
+    CONF_SPA_SHED_TARGET_DELAY,
+    CONF_AUTHZ_CACHE_SIZE,
+    CONF_ACCESS_EXPAND_LIMIT,
+    CONF_MAX_ACTIVE_GRANTS,
+    CONF_CAPTURE_CPUS,
+    CONF_SPA_WORKER_CPUS,
+    CONF_HOUSEKEEPING_CPUS,
+    CONF_CRYPTO_IMPL,
+    CONF_ENABLE_FW_COMMIT_THREAD,
+    CONF_ENABLE_EXTCMD_HELPER,
+    CONF_SPA_RATE_LIMIT,
+    CONF_SPA_RATE_BURST,
+    CONF_REPLAY_GOSSIP_PORT,
+    CONF_REPLAY_GOSSIP_PEERS,
+    CONF_REPLAY_GOSSIP_KEY,
+    CONF_METRICS_PORT,
+    CONF_METRICS_ADDRESS,
+    CONF_STATS_INTERVAL,
+    CONF_STATS_FILE,
+    CONF_ENABLE_IPV6,
     CONF_LOCALE,
     CONF_SYSLOG_IDENTITY,
     CONF_SYSLOG_FACILITY,
+    CONF_LOG_FILE,
+    CONF_LOG_FILE_MAX_SIZE,
+    CONF_LOG_FILE_ROTATE_INTERVAL,
+    CONF_LOG_FILE_KEEP,
+    CONF_LOG_FILE_JSON,
+    CONF_FLIGHT_RECORDER_SIZE,
+    CONF_SPA_TRACE,
+    CONF_MEM_LIMIT,
     //CONF_IPT_EXEC_TRIES,
     //CONF_ENABLE_EXTERNAL_CMDS,
     //CONF_EXTERNAL_CMD_OPEN,
@@ -298,6 +456,7 @@ enum {
     CONF_FIREWD_SNAT_ACCESS,
     CONF_FIREWD_MASQUERADE_ACCESS,
     CONF_ENABLE_FIREWD_COMMENT_CHECK,
+    CONF_FIREWD_USE_DBUS,
 #elif FIREWALL_IPTABLES
     CONF_ENABLE_IPT_FORWARDING,
     CONF_ENABLE_IPT_LOCAL_NAT,
@@ -313,6 +472,17 @@ enum {
     CONF_IPT_SNAT_ACCESS,
     CONF_IPT_MASQUERADE_ACCESS,
     CONF_ENABLE_IPT_COMMENT_CHECK,
+    CONF_ENABLE_IPT_IPSET,
+    CONF_IPT_IPSET_NAME,
+    CONF_ENABLE_IPT_RESTORE_BATCH,
+    CONF_IPT_INPUT_SHARD_BITS,
+#elif FIREWALL_NFTABLES
+    CONF_FLUSH_NFT_AT_INIT,
+    CONF_FLUSH_NFT_AT_EXIT,
+    CONF_NFT_FAMILY,
+    CONF_NFT_TABLE,
+    CONF_NFT_INPUT_CHAIN,
+    CONF_NFT_ACCESS_SET,
 #elif FIREWALL_IPFW
     CONF_FLUSH_IPFW_AT_INIT,
     CONF_FLUSH_IPFW_AT_EXIT,
@@ -322,9 +492,12 @@ enum {
     CONF_IPFW_EXPIRE_SET_NUM,
     CONF_IPFW_EXPIRE_PURGE_INTERVAL,
     CONF_IPFW_ADD_CHECK_STATE,
+    CONF_IPFW_USE_TABLES,
+    CONF_IPFW_TABLE_NAME,
 #elif FIREWALL_PF
     CONF_PF_ANCHOR_NAME,
     CONF_PF_EXPIRE_INTERVAL,
+    CONF_PF_USE_TABLES,
 #elif FIREWALL_IPF
     /* --DSS Place-holder */
 #endif /* FIREWALL type */
@@ -350,11 +523,26 @@ enum {
     CONF_ALLOW_LEGACY_ACCESS_REQUESTS,
     CONF_ACC_STANZA_HASH_TABLE_LENGTH,
     CONF_SERVICE_HASH_TABLE_LENGTH,
+    CONF_SDP_SHARD_COUNT,
+    CONF_SDP_SHARD_INDEX,
+    CONF_CLUSTER_PORT,
+    CONF_CLUSTER_KEY,
+    CONF_HA_SYNC_PORT,
+    CONF_HA_SYNC_PEER,
+    CONF_HA_SYNC_KEY,
     CONF_DISABLE_SDP_CTRL_CLIENT,
     CONF_DISABLE_CONNECTION_TRACKING,
+    CONF_CONNTRACK_USE_NETLINK,
+    CONF_CONNTRACK_BUF_SIZE,
     CONF_CONN_ID_FILE,
     CONF_CONN_REPORT_INTERVAL,
+    CONF_CONN_REPORT_DELTAS,
+    CONF_CONN_REPORT_COMPRESS,
+    CONF_CONN_REPORT_COUNTERS,
     CONF_MAX_WAIT_ACC_DATA,
+    CONF_ACC_SNAPSHOT_FILE,
+    CONF_ACC_SNAPSHOT_KEY,
+    CONF_ACC_SNAPSHOT_MAX_AGE,
     CONF_SDP_CTRL_CLIENT_CONF,
     CONF_FWKNOP_CLIENT_CONF,
     CONF_CONFIG_DUMP_OUTPUT_PATH,
@@ -382,6 +570,19 @@ typedef struct acc_port_list
     struct acc_port_list    *next;
 } acc_port_list_t;
 
+/* OPEN_PORTS and RESTRICT_PORTS compiled to a two-level bitmap per
+ * protocol (TCP and UDP): the high byte of the port picks a 256-bit block,
+ * which is only allocated if one of its ports is in the list.
+*/
+#define ACC_PORT_MAP_PROTOS     2
+#define ACC_PORT_MAP_BLOCKS     256
+#define ACC_PORT_MAP_BLOCK_LEN  32
+
+typedef struct acc_port_map
+{
+    unsigned char  *blocks[ACC_PORT_MAP_PROTOS][ACC_PORT_MAP_BLOCKS];
+} acc_port_map_t;
+
 /* A simple linked list of strings for the access stanza items that
  * allow multiple comma-separated entries.
 */
@@ -391,39 +592,55 @@ typedef struct acc_string_list
     struct acc_string_list  *next;
 } acc_string_list_t;
 
-/* A list of service IDs that a client has access to
+/* GPG_REMOTE_ID and GPG_FINGERPRINT_ID compiled to an open addressed hash
+ * set of upper case strings with the white space taken out, so a signer is
+ * found with a single probe sequence.  There are at least twice as many
+ * slots as strings.
+*/
+#define ACC_STRING_SET_MAX_LEN  128
+
+typedef struct acc_string_set_slot
+{
+    uint32_t             hash;
+    char                *str;       /* NULL for an empty slot */
+} acc_string_set_slot_t;
+
+typedef struct acc_string_set
+{
+    uint32_t                mask;
+    acc_string_set_slot_t   slots[];
+} acc_string_set_t;
+
+/* The service IDs that a client has access to, sorted and without
+ * duplicates
  */
-typedef struct acc_service_list
+typedef struct acc_service_set
 {
-    uint32_t             service_id;
-    struct acc_service_list *next;
-} acc_service_list_t;
+    uint32_t             count;
+    uint32_t             ids[];
+} acc_service_set_t;
 
-/* Access stanza list struct.
+/* Length of the digest kept of a controller supplied stanza's JSON, used
+ * to spot stanzas that a refresh or update did not change.
 */
-typedef struct acc_stanza
+#define ACC_JSON_DIGEST_LEN     32
+
+/* The access stanza settings that are only needed once a packet has been
+ * authorized, or not at all after startup.  These are kept apart from
+ * the acc_stanza_t fields an incoming SPA packet is checked against.
+*/
+typedef struct acc_stanza_cold
 {
-    uint32_t             sdp_id;
+    unsigned char        json_digest[ACC_JSON_DIGEST_LEN];
+    char                *json_str;      /* kept for acc_snapshot.c */
     char                *service_list_str;
-    acc_service_list_t  *service_list;
     char                *source;
-    acc_int_list_t      *source_list;
     char                *destination;
     acc_int_list_t      *destination_list;
     char                *open_ports;
-    acc_port_list_t     *oport_list;
     char                *restrict_ports;
-    acc_port_list_t     *rport_list;
-    char                *key;
-    int                  key_len;
     char                *key_base64;
-    char                *hmac_key;
-    int                  hmac_key_len;
     char                *hmac_key_base64;
-    int                  hmac_type;
-    unsigned char        use_rijndael;
-    int                  fw_access_timeout;
-    unsigned char        enable_cmd_exec;
     unsigned char        enable_cmd_sudo_exec;
     char                *cmd_sudo_exec_user;
     char                *cmd_sudo_exec_group;
@@ -435,10 +652,11 @@ typedef struct acc_stanza
     char                *cmd_cycle_close;
     unsigned char        cmd_cycle_do_close;
     int                  cmd_cycle_timer;
+    int                  max_active_grants; /* 0 for no limit */
+    int                  grant_idle_timeout; /* 0 for fixed FW_ACCESS_TIMEOUT */
     uid_t                cmd_exec_uid;
     gid_t                cmd_exec_gid;
     char                *require_username;
-    unsigned char        require_source_address;
     char                *gpg_home_dir;
     char                *gpg_exe;
     char                *gpg_decrypt_id;
@@ -446,15 +664,8 @@ typedef struct acc_stanza
     unsigned char        gpg_require_sig;
     unsigned char        gpg_disable_sig;
     unsigned char        gpg_ignore_sig_error;
-    unsigned char        use_gpg;
-    unsigned char        gpg_allow_no_pw;
     char                *gpg_remote_id;
-    acc_string_list_t   *gpg_remote_id_list;
     char                *gpg_remote_fpr;
-    acc_string_list_t   *gpg_remote_fpr_list;
-    time_t               access_expire_time;
-    int                  expired;
-    int                  encryption_mode;
 
     /* NAT parameters
     */
@@ -468,9 +679,107 @@ typedef struct acc_stanza
     char                *force_snat_ip;
     unsigned char        force_masquerade;
 
+    /* On the acc_lazy.c list of expanded stanzas.
+    */
+    unsigned char        lazy_linked;
+    unsigned char        lazy_failed;
+    struct acc_stanza   *lazy_prev;
+    struct acc_stanza   *lazy_next;
+} acc_stanza_cold_t;
+
+/* The lists and maps compiled from an access stanza's SOURCE,
+ * OPEN_PORTS, RESTRICT_PORTS, SERVICE_LIST and GPG id strings.  They are
+ * reached through acc_stanza_expand(), which builds them on first use
+ * when ACCESS_EXPAND_LIMIT is set (see acc_lazy.h).
+*/
+typedef struct acc_stanza_exp
+{
+    struct addr_trie    *source_trie;       /* compiled source_list */
+    acc_port_map_t      *oport_map;     /* compiled oport_list */
+    acc_port_map_t      *rport_map;     /* compiled rport_list */
+    acc_service_set_t   *service_set;   /* compiled service_list_str */
+    acc_int_list_t      *source_list;
+    acc_port_list_t     *oport_list;
+    acc_port_list_t     *rport_list;
+    acc_string_set_t    *gpg_remote_id_set;
+    acc_string_set_t    *gpg_remote_fpr_set;
+} acc_stanza_exp_t;
+
+/* Access stanza list struct.  The fields a packet is checked against come
+ * first, so that for most packets only the first cache lines of the
+ * stanza are read, and the keys are held in the stanza itself rather
+ * than behind another pointer.  Everything else is in *cold.
+*/
+typedef struct acc_stanza
+{
+    uint32_t             sdp_id;
+    int                  expired;
+    unsigned char        use_rijndael;
+    unsigned char        use_gpg;
+    unsigned char        gpg_allow_no_pw;
+    unsigned char        enable_cmd_exec;
+    unsigned char        require_source_address;
+    int                  encryption_mode;
+    int                  hmac_type;
+    int                  key_len;
+    int                  hmac_key_len;
+    int                  fw_access_timeout;
+    time_t               access_expire_time;
+    time_t               last_used;     /* set by acc_stanza_expand() */
+    fko_hmac_state_t     hmac_state;    /* precomputed from hmac_key */
+    struct addr_trie    *destination_trie;  /* compiled destination_list */
+    acc_stanza_exp_t    *exp;
+    acc_stanza_cold_t   *cold;
     struct acc_stanza   *next;
+    char                 key[MAX_KEY_LEN+1];
+    char                 hmac_key[MAX_KEY_LEN+1];
 } acc_stanza_t;
 
+/* Index of the legacy mode access stanzas by SOURCE network.  There is
+ * one group per distinct SOURCE mask, holding the masked networks in
+ * sorted order so that the stanzas that could match a packet are found
+ * with one binary search per group instead of trying each stanza's key.
+*/
+typedef struct acc_index_ent
+{
+    uint32_t            net;
+    int                 stanza_num;
+    acc_stanza_t       *acc;
+} acc_index_ent_t;
+
+typedef struct acc_index_group
+{
+    uint32_t            mask;
+    int                 num_ents;
+    acc_index_ent_t    *ents;
+} acc_index_group_t;
+
+typedef struct acc_stanza_index
+{
+    int                 num_stanzas;
+    int                 num_groups;
+    acc_index_group_t  *groups;
+} acc_stanza_index_t;
+
+/* SDP mode access stanzas keyed by SDP ID (see acc_id_map.c).  A slot is
+ * empty when acc is NULL.
+*/
+typedef struct acc_id_map_slot
+{
+    uint32_t            sdp_id;
+    acc_stanza_t       *acc;
+} acc_id_map_slot_t;
+
+typedef struct acc_id_map
+{
+    acc_id_map_slot_t  *slots;
+    uint32_t            size;
+    uint32_t            mask;
+    uint32_t            count;
+    int                 bits;
+    void              (*delete_cb)(acc_stanza_t *acc);
+} acc_id_map_t;
+
 /* A simple linked list of strings for command open/close cycles
 */
 typedef struct cmd_cycle_list
@@ -479,6 +788,7 @@ typedef struct cmd_cycle_list
     char                   *close_cmd;
     time_t                  expire;
     int                     stanza_num;
+    struct cmd_cycle_list  *prev;
     struct cmd_cycle_list  *next;
 } cmd_cycle_list_t;
 
@@ -569,6 +879,8 @@ typedef struct cmd_cycle_list
   */
   #define FW_NUM_CHAIN_FIELDS 6
 
+  #define MAX_IPSET_NAME_LEN  32    /* IPSET_MAXNAMELEN in the kernel */
+
   struct fw_config {
       struct fw_chain chain[NUM_FWKNOP_ACCESS_TYPES];
       char            fw_command[MAX_PATH_LEN];
@@ -576,10 +888,45 @@ typedef struct cmd_cycle_list
       /* Flag for setting destination field in rule
       */
       unsigned char   use_destination;
+
+      /* Grant access through an ipset instead of per-grant rules
+      */
+      unsigned char   use_ipset;
+      char            ipset_name[MAX_IPSET_NAME_LEN];
+
+      /* Number of source address bits used to spread INPUT grants over
+       * 2^bits leaf chains (0 keeps them all in the one chain)
+      */
+      int             input_shard_bits;
+  };
+
+#elif FIREWALL_NFTABLES
+
+  #define MAX_NFT_NAME_LEN  256     /* NFT_NAME_MAXLEN in the kernel */
+
+  struct mnl_socket;
+
+  struct fw_config {
+      int                 family;
+      char                table[MAX_NFT_NAME_LEN];
+      char                chain[MAX_NFT_NAME_LEN];
+      char                set[MAX_NFT_NAME_LEN];
+      unsigned int        key_len;
+      uint64_t            rule_handle;
+      unsigned char       created_table;
+      unsigned char       created_chain;
+      struct mnl_socket  *nl;
+      unsigned int        portid;
+      uint32_t            seq;
+      char                fw_command[MAX_PATH_LEN];
+      unsigned char       use_destination;
+      unsigned char       use_connmark;
   };
 
 #elif FIREWALL_IPFW
 
+  #define MAX_IPFW_TABLE_NAME_LEN 64
+
   struct fw_config {
       unsigned short    start_rule_num;
       unsigned short    max_rules;
@@ -593,6 +940,9 @@ typedef struct cmd_cycle_list
       time_t            last_purge;
       char              fw_command[MAX_PATH_LEN];
       unsigned char     use_destination;
+      unsigned char     use_tables;
+      int               ipfw_sock;
+      char              table_name[MAX_IPFW_TABLE_NAME_LEN];
   };
 
 #elif FIREWALL_PF
@@ -605,6 +955,8 @@ typedef struct cmd_cycle_list
       char              anchor[MAX_PF_ANCHOR_LEN];
       char              fw_command[MAX_PATH_LEN];
       unsigned char     use_destination;
+      unsigned char     use_tables;
+      int               pf_dev;
   };
 
 #elif FIREWALL_IPF
@@ -620,6 +972,7 @@ typedef struct service_data
     unsigned int  proto;
     unsigned int  port;
     char nat_ip_str[MAX_IPV4_STR_LEN];
+    uint32_t nat_ip;        // nat_ip_str in network byte order, 0 if not set
     unsigned int  nat_port;
 } service_data_t;
 
@@ -631,21 +984,97 @@ typedef struct service_data_list
 
 
 
+/* Longest IPv4 or IPv6 address string (INET6_ADDRSTRLEN).
+*/
+#define MAX_IPV46_STR_LEN   46
+
+/* A packet address in a compact form: the address family plus the address
+ * bytes in network byte order (IPv4 only uses the first four).
+*/
+typedef struct spa_addr
+{
+    unsigned char   family;
+    unsigned char   addr[16];
+} spa_addr_t;
+
 /* SPA Packet info struct.
 */
+/* The replay cache key is the binary SHA-256 digest of the SPA packet
+ * data (the same value as the base64 FKO_DEFAULT_DIGEST raw digest).
+*/
+#define REPLAY_DIGEST_LEN   32
+
+/* Per-stage timings of one SPA packet for SPA_TRACE (spa_trace.c)
+*/
+typedef struct spa_trace
+{
+    uint64_t        id;         /* The SPA rand_val, 0 until decrypted */
+    uint64_t        start_ns;   /* Wall clock time processing started */
+    uint32_t        stage_us[BENCH_STAGES];
+} spa_trace_t;
+
 typedef struct spa_pkt_info
 {
     unsigned int    packet_data_len;
     unsigned int    packet_proto;
-    unsigned int    packet_src_ip;
+    unsigned int    packet_src_ip;      /* IPv4 only, 0 for IPv6 packets */
     unsigned int    packet_dst_ip;
+    spa_addr_t      packet_src_addr;
+    spa_addr_t      packet_dst_addr;
     unsigned short  packet_src_port;
     unsigned short  packet_dst_port;
     uint32_t        sdp_id;
-    char            sdp_id_str[MAX_SDP_ID_STR_LEN];
-    unsigned char   packet_data[MAX_SPA_PACKET_LEN+1];
+
+    /* When the packet arrived: the capture or socket receive timestamp
+     * where there is one, otherwise the cached clock at receive time.
+     * The packet age is measured from this.
+    */
+    time_t          arrival_time;
+
+    /* When processing started, set by flight_recorder_begin() for the
+     * latency of the packet's verdict.
+    */
+    struct timespec accept_ts;
+
+    /* Filled in along the way while SPA_TRACE is on
+    */
+    spa_trace_t     trace;
+
+    /* The packet data is borrowed from the capture or receive buffer, is
+     * only valid for the duration of incoming_spa(), and is not NUL
+     * terminated.  packet_buf is only used when the data has to be
+     * rewritten (SPA over HTTP).
+    */
+    const unsigned char *packet_data;
+    unsigned char   packet_buf[MAX_SPA_PACKET_LEN+1];
+
+    /* Set by the replay check when digest persistence is enabled
+    */
+    int             replay_digest_set;
+    unsigned char   replay_digest[REPLAY_DIGEST_LEN];
+
+    /* Set for packets forwarded by another cluster member (cluster.c):
+     * the member's ring index + 1 and the token to answer with.
+    */
+    int             cluster_origin;
+    uint64_t        cluster_token;
+
+    /* How processing of the packet ended (FWKNOP_VERDICT_*), once
+     * incoming_spa() returns.  Packets handed to a SPA worker are left
+     * at FWKNOP_VERDICT_QUEUED.
+    */
+    int             verdict;
 } spa_pkt_info_t;
 
+/* The NAT target a client asked for in its SPA message ("ip,port"),
+ * parsed and validated once by check_nat_access_types().
+*/
+typedef struct spa_nat_target
+{
+    char            ip_str[MAX_IPV4_STR_LEN];
+    unsigned int    port;
+} spa_nat_target_t;
+
 /* Struct for (processed and verified) SPA data used by the server.
 */
 typedef struct spa_data
@@ -653,22 +1082,56 @@ typedef struct spa_data
     uint32_t        sdp_id;
     char           *username;
     time_t          timestamp;
+    time_t          arrival_time;   /* See spa_pkt_info_t */
     char           *version;
     short           message_type;
     char           *spa_message;
     char            spa_message_src_ip[MAX_IPV4_STR_LEN];
     uint32_t        spa_message_service_id;
-    char            pkt_source_ip[MAX_IPV4_STR_LEN];
-    char            pkt_destination_ip[MAX_IPV4_STR_LEN];
+    char            pkt_source_ip[MAX_IPV46_STR_LEN];
+    char            pkt_destination_ip[MAX_IPV46_STR_LEN];
     char            spa_message_remain[1024]; /* --DSS FIXME: arbitrary bounds */
     char           *nat_access;
+    spa_nat_target_t nat;       /* nat_access, parsed */
     char           *server_auth;
     unsigned int    client_timeout;
     unsigned int    fw_access_timeout;
     char            *use_src_ip;
     service_data_list_t *service_data_list;
+    struct spa_arena *arena;    /* Per-packet allocations (spa_arena.c) */
+    uint32_t        authz_gen;  /* authz_cache_gen() before the stanza lookup */
+    int             granted;    /* Set once a stanza grants the request */
+    int             cluster_origin; /* See spa_pkt_info_t */
+    uint64_t        cluster_token;
+    int             fr_reason;  /* Last failure, for the flight recorder */
+    int             fr_res;
 } spa_data_t;
 
+/* Config values that are read for every SPA packet, parsed once from
+ * the strings in opts->config[] by config_init() so the packet path does
+ * no string comparisons or number parsing.
+*/
+typedef struct fko_srv_runtime
+{
+    unsigned char   sdp_mode;               /* DISABLE_SDP_MODE is N */
+    unsigned char   spa_over_http;
+    unsigned char   spa_packet_aging;
+    int             max_spa_packet_age;
+    unsigned char   digest_persistence;
+    unsigned char   allow_legacy_access;
+    unsigned char   nat_forwarding;         /* ENABLE_{IPT,FIREWD}_FORWARDING */
+    unsigned char   nat_local;              /* ENABLE_{IPT,FIREWD}_LOCAL_NAT */
+    unsigned char   exit_at_intf_down;
+    int             rules_chk_threshold;
+    uint32_t        sdp_shard_count;        /* SDP_SHARD_COUNT */
+    uint32_t        sdp_shard_index;        /* SDP_SHARD_INDEX */
+} fko_srv_runtime_t;
+
+/* Whether an SDP ID belongs to this instance's shard (see SDP_SHARD_COUNT).
+*/
+#define SDP_SHARD_OWNS(rt, id) \
+    ((rt)->sdp_shard_count <= 1 || (id) % (rt)->sdp_shard_count == (rt)->sdp_shard_index)
+
 /* fwknopd server configuration parameters and values
 */
 typedef struct fko_srv_options
@@ -677,21 +1140,30 @@ typedef struct fko_srv_options
      * then exit.
     */
     unsigned char   dump_config;        /* Dump current configuration flag */
+    unsigned char   dump_json;          /* --dump-format json */
+    uint32_t        dump_sdp_id;        /* --dump-sdp-id, 0 for all */
+    uint32_t        dump_service_id;    /* --dump-service-id, 0 for all */
     unsigned char   foreground;         /* Run in foreground flag */
     unsigned char   kill;               /* flag to initiate kill of fwknopd */
     unsigned char   rotate_digest_cache;/* flag to force rotation of digest */
     unsigned char   restart;            /* Restart fwknopd flag */
     unsigned char   status;             /* Get fwknopd status flag */
+    unsigned char   stats;              /* Print the running fwknopd's stats page */
     unsigned char   fw_list;            /* List current firewall rules */
     unsigned char   fw_list_all;        /* List all current firewall rules */
     unsigned char   fw_flush;           /* Flush current firewall rules */
     unsigned char   key_gen;            /* Generate keys and exit */
     unsigned char   exit_after_parse_config; /* Parse config and exit */
+    unsigned char   upgrade;            /* Take over from the running fwknopd */
 
     /* Operational flags
     */
     unsigned char   test;               /* Test mode flag */
     unsigned char   afl_fuzzing;        /* SPA pkts from stdin for AFL fuzzing */
+    unsigned char   benchmark;          /* Replay --pcap-file and report timings */
+    int             benchmark_loops;    /* Number of times to replay the file */
+    char           *benchmark_synth;    /* Table sizes for --benchmark-synth */
+    char           *benchmark_fw;       /* Grant counts for --benchmark-fw */
     unsigned char   verbose;            /* Verbose mode flag */
     unsigned char   enable_udp_server;  /* Enable UDP server mode */
     unsigned char   enable_fw;          /* Command modes by themselves don't
@@ -707,8 +1179,24 @@ typedef struct fko_srv_options
     */
     unsigned char   pcap_any_direction;
 
+    /* Set from ENABLE_IPV6 - accept SPA packets sent over IPv6.
+    */
+    unsigned char   enable_ipv6;
+
+    /* Typed copy of the config values used on the packet path.
+    */
+    const fko_srv_runtime_t *rt;
+
     int             data_link_offset;
-    int             tcp_server_pid;
+    /* Port of the in-process TCP server (0 when it is not running).
+    */
+    unsigned short  tcp_server_port;
+    unsigned short  http_server_port;
+
+    /* Set when the capture filter has to be regenerated (the access data
+     * it was built from changed).
+    */
+    volatile int    pcap_filter_refresh;
     int             lock_fd;
 
     /* Values used in --key-gen mode only
@@ -718,9 +1206,13 @@ typedef struct fko_srv_options
     int  hmac_key_len;
     int  hmac_type;
 
-#if USE_FILE_CACHE
-    struct digest_cache_list *digest_cache;   /* In-memory digest cache list */
-#endif
+    struct replay_cache *digest_cache;   /* In-memory digest cache */
+    pthread_mutex_t replay_cache_mutex;
+
+    /* Serializes firewall rule and command cycle changes when more than
+     * one UDP server worker is processing SPA packets.
+    */
+    pthread_mutex_t spa_grant_mutex;
 
     spa_pkt_info_t  spa_pkt;            /* The current SPA packet */
 
@@ -736,7 +1228,8 @@ typedef struct fko_srv_options
     char           *config[NUMBER_OF_CONFIG_ENTRIES];
 
     acc_stanza_t   *acc_stanzas;       /* List of access stanzas for legacy mode */
-    hash_table_t   *acc_stanza_hash_tbl;  /* List of access stanzas for sdp mode */
+    acc_stanza_index_t *acc_index;     /* SOURCE index of acc_stanzas */
+    acc_id_map_t   *acc_stanza_hash_tbl;  /* Access stanzas by SDP ID for sdp mode */
     pthread_mutex_t acc_hash_tbl_mutex;
 
     hash_table_t   *service_hash_tbl;
@@ -2,6 +2,8 @@
 
 #include "fwknopd_common.h"
 #include "access.h"
+#include "hash_table.h"
+#include "replay_cache.h"
 
 /**
  * Register test suites from FKO files.
@@ -12,6 +14,8 @@
 static void register_test_suites(void)
 {
     register_ts_access();
+    register_ts_hash_table();
+    register_ts_replay_cache();
 }
 
 /* The main() function for setting up and running the tests.
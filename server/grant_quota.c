@@ -0,0 +1,388 @@
+/*
+ *****************************************************************************
+ *
+ * File:    grant_quota.c
+ *
+ * Purpose: Per-client and global limits on the number of access grants
+ *          held at once, so that the firewall rule tables (and the cost
+ *          of matching a packet against them) stay bounded.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "grant_quota.h"
+#include "mem_acct.h"
+#include "metrics.h"
+#include "log_msg.h"
+#include "utils.h"
+
+#define FNV_OFFSET_BASIS    0x811c9dc5U
+#define FNV_PRIME           0x01000193U
+
+typedef struct gq_grant
+{
+    time_t              expires;
+    uint32_t            access;     /* hash of the requested access */
+} gq_grant_t;
+
+typedef struct gq_client
+{
+    uint32_t            hash;
+    uint32_t            sdp_id;
+    char                src_ip[MAX_IPV46_STR_LEN];
+    int                 num_grants;
+    int                 size;
+    gq_grant_t         *grants;
+    struct gq_client   *next;
+} gq_client_t;
+
+static gq_client_t         *gq_buckets[GRANT_QUOTA_TABLE_LEN];
+static pthread_mutex_t      gq_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int                  gq_max_grants = 0;  /* 0 for no global limit */
+static unsigned long        gq_grants = 0;
+static unsigned int         gq_clients = 0;
+static time_t               gq_last_sweep = 0;
+
+static uint32_t
+gq_hash_str(uint32_t h, const char *str)
+{
+    if(str == NULL)
+        return h;
+
+    for(; *str != '\0'; str++)
+    {
+        h ^= (unsigned char)*str;
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+static uint32_t
+gq_hash_id(uint32_t h, const uint32_t id)
+{
+    int     i;
+
+    for(i=0; i < 4; i++)
+    {
+        h ^= (id >> (i * 8)) & 0xff;
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+/* Grants are counted by SDP ID in SDP mode and by the address being
+ * allowed in otherwise.
+*/
+static const char *
+gq_client_ip(const spa_data_t * const spadat)
+{
+    if(spadat->sdp_id != 0)
+        return "";
+    return (spadat->use_src_ip != NULL)
+        ? spadat->use_src_ip : spadat->pkt_source_ip;
+}
+
+/* Find the client's entry, adding it if create is set.  Called with
+ * gq_mutex held.
+*/
+static gq_client_t *
+gq_find(const uint32_t sdp_id, const char * const src_ip, const int create)
+{
+    gq_client_t    *c;
+    uint32_t        hash;
+
+    hash = gq_hash_str(gq_hash_id(FNV_OFFSET_BASIS, sdp_id), src_ip);
+
+    for(c = gq_buckets[hash & (GRANT_QUOTA_TABLE_LEN-1)]; c != NULL; c = c->next)
+        if(c->hash == hash && c->sdp_id == sdp_id
+                && strcmp(c->src_ip, src_ip) == 0)
+            return c;
+
+    if(! create
+            || (c = mem_calloc(MEM_TAG_GRANT_QUOTA, 1, sizeof(*c))) == NULL)
+        return NULL;
+
+    c->hash   = hash;
+    c->sdp_id = sdp_id;
+    strlcpy(c->src_ip, src_ip, sizeof(c->src_ip));
+    c->next   = gq_buckets[hash & (GRANT_QUOTA_TABLE_LEN-1)];
+    gq_buckets[hash & (GRANT_QUOTA_TABLE_LEN-1)] = c;
+    gq_clients++;
+
+    return c;
+}
+
+static void
+gq_free(gq_client_t *c)
+{
+    gq_client_t   **p;
+
+    for(p = &(gq_buckets[c->hash & (GRANT_QUOTA_TABLE_LEN-1)]); *p != NULL;
+            p = &((*p)->next))
+    {
+        if(*p == c)
+        {
+            *p = c->next;
+            break;
+        }
+    }
+
+    gq_grants -= c->num_grants;
+    gq_clients--;
+    mem_free(MEM_TAG_GRANT_QUOTA, c->grants);
+    mem_free(MEM_TAG_GRANT_QUOTA, c);
+    return;
+}
+
+/* Drop the client's expired grants.  Called with gq_mutex held.
+*/
+static void
+gq_prune(gq_client_t *c, const time_t now)
+{
+    int     i;
+
+    for(i=c->num_grants-1; i >= 0; i--)
+    {
+        if(c->grants[i].expires <= now)
+        {
+            c->grants[i] = c->grants[--c->num_grants];
+            gq_grants--;
+        }
+    }
+    return;
+}
+
+/* Drop every expired grant and every client left without any.  Called
+ * with gq_mutex held.
+*/
+static void
+gq_sweep(const time_t now)
+{
+    gq_client_t    *c, *next;
+    int             i;
+
+    for(i=0; i < GRANT_QUOTA_TABLE_LEN; i++)
+    {
+        for(c = gq_buckets[i]; c != NULL; c = next)
+        {
+            next = c->next;
+            gq_prune(c, now);
+            if(c->num_grants == 0)
+                gq_free(c);
+        }
+    }
+    gq_last_sweep = now;
+    return;
+}
+
+static void
+gq_clear(void)
+{
+    int     i;
+
+    for(i=0; i < GRANT_QUOTA_TABLE_LEN; i++)
+        while(gq_buckets[i] != NULL)
+            gq_free(gq_buckets[i]);
+
+    return;
+}
+
+/* Read the global MAX_ACTIVE_GRANTS and start counting from nothing (the
+ * firewall has just been set up afresh).  Returns 0 on success and -1 on
+ * error.
+*/
+int
+grant_quota_start(fko_srv_options_t *opts)
+{
+    int     is_err, max_grants;
+
+    max_grants = strtol_wrapper(opts->config[CONF_MAX_ACTIVE_GRANTS],
+            0, RCHK_MAX_ACTIVE_GRANTS, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid MAX_ACTIVE_GRANTS value.");
+        return -1;
+    }
+
+    pthread_mutex_lock(&gq_mutex);
+    gq_clear();
+    gq_max_grants = max_grants;
+    gq_last_sweep = time(NULL);
+    pthread_mutex_unlock(&gq_mutex);
+
+    if(max_grants > 0)
+        log_msg(LOG_INFO, "Limiting active access grants to %i.", max_grants);
+
+    return 0;
+}
+
+void
+grant_quota_stop(void)
+{
+    pthread_mutex_lock(&gq_mutex);
+    gq_clear();
+    pthread_mutex_unlock(&gq_mutex);
+    return;
+}
+
+/* Count the grant about to be made for spadat against its client and the
+ * global limit.  Returns 1 if it may go ahead and 0 if it would take the
+ * client or the server over its limit.  Nothing is counted when neither
+ * the stanza nor the server sets a limit.
+*/
+int
+grant_quota_check(const acc_stanza_t * const acc,
+        const spa_data_t * const spadat)
+{
+    const char     *src_ip = gq_client_ip(spadat);
+    gq_client_t    *c;
+    gq_grant_t     *grants;
+    uint32_t        access;
+    time_t          now, expires;
+    int             i, limit = acc->cold->max_active_grants;
+
+    if(limit == 0 && gq_max_grants == 0)
+        return 1;
+
+    now     = clock_cache_now();
+    expires = now + spadat->fw_access_timeout;
+    access  = gq_hash_str(gq_hash_str(FNV_OFFSET_BASIS, spadat->spa_message),
+                spadat->nat_access);
+
+    pthread_mutex_lock(&gq_mutex);
+
+    if((c = gq_find(spadat->sdp_id, src_ip, 1)) == NULL)
+    {
+        /* Better to grant without counting than to refuse a client we
+         * could not make room to track.
+        */
+        pthread_mutex_unlock(&gq_mutex);
+        log_msg(LOG_ERR, "grant_quota_check() calloc() failed");
+        return 1;
+    }
+    gq_prune(c, now);
+
+    /* A repeat of a request the client already holds adds no rules.
+    */
+    for(i=0; i < c->num_grants; i++)
+    {
+        if(c->grants[i].access == access)
+        {
+            if(c->grants[i].expires < expires)
+                c->grants[i].expires = expires;
+            pthread_mutex_unlock(&gq_mutex);
+            METRIC_INC(METRIC_GRANTS_COALESCED);
+            return 1;
+        }
+    }
+
+    if(limit > 0 && c->num_grants >= limit)
+    {
+        pthread_mutex_unlock(&gq_mutex);
+        METRIC_INC(METRIC_GRANT_QUOTA_DENIED);
+        log_msg(LOG_WARNING,
+            "[%s] Client already holds %i access grants (MAX_ACTIVE_GRANTS), request denied.",
+            spadat->pkt_source_ip, limit);
+        return 0;
+    }
+
+    if(gq_max_grants > 0 && gq_grants >= (unsigned long)gq_max_grants)
+    {
+        gq_sweep(now);
+
+        if(gq_grants >= (unsigned long)gq_max_grants)
+        {
+            if(c->num_grants == 0)
+                gq_free(c);
+            pthread_mutex_unlock(&gq_mutex);
+            METRIC_INC(METRIC_GRANT_QUOTA_DENIED);
+            log_msg(LOG_WARNING,
+                "[%s] Server already holds %i access grants (MAX_ACTIVE_GRANTS), request denied.",
+                spadat->pkt_source_ip, gq_max_grants);
+            return 0;
+        }
+
+        /* The sweep may have dropped this client's entry.
+        */
+        if((c = gq_find(spadat->sdp_id, src_ip, 1)) == NULL)
+        {
+            pthread_mutex_unlock(&gq_mutex);
+            return 1;
+        }
+    }
+
+    if(c->num_grants == c->size)
+    {
+        grants = mem_realloc(MEM_TAG_GRANT_QUOTA, c->grants,
+                (c->size ? c->size * 2 : 4) * sizeof(gq_grant_t));
+        if(grants == NULL)
+        {
+            pthread_mutex_unlock(&gq_mutex);
+            log_msg(LOG_ERR, "grant_quota_check() realloc() failed");
+            return 1;
+        }
+        c->grants = grants;
+        c->size   = c->size ? c->size * 2 : 4;
+    }
+
+    c->grants[c->num_grants].expires = expires;
+    c->grants[c->num_grants].access  = access;
+    c->num_grants++;
+    gq_grants++;
+
+    pthread_mutex_unlock(&gq_mutex);
+    return 1;
+}
+
+/* Called from the periodic timer path.  Sweeps out expired grants every
+ * GRANT_QUOTA_SWEEP_INTERVAL seconds.
+*/
+void
+grant_quota_run(void)
+{
+    time_t  now = clock_cache_now();
+
+    if(now - gq_last_sweep < GRANT_QUOTA_SWEEP_INTERVAL)
+        return;
+
+    pthread_mutex_lock(&gq_mutex);
+    gq_sweep(now);
+    pthread_mutex_unlock(&gq_mutex);
+    return;
+}
+
+/* Number of clients holding counted grants, and of the grants themselves
+ * (some of which may have expired since the last sweep).
+*/
+void
+grant_quota_stats(unsigned int *clients, unsigned long *grants)
+{
+    pthread_mutex_lock(&gq_mutex);
+    *clients = gq_clients;
+    *grants  = gq_grants;
+    pthread_mutex_unlock(&gq_mutex);
+    return;
+}
+
+/***EOF***/
@@ -0,0 +1,60 @@
+/*
+ *****************************************************************************
+ *
+ * File:    grant_quota.h
+ *
+ * Purpose: Header file for grant_quota.c - limits on the number of access
+ *          grants held at once.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef GRANT_QUOTA_H
+#define GRANT_QUOTA_H
+
+/* Every grant made for an SPA request is counted against its client (the
+ * SDP ID, or the allowed source address in legacy mode) until its
+ * firewall timeout passes.  A client may hold at most its stanza's
+ * MAX_ACTIVE_GRANTS, and all clients together at most the global
+ * MAX_ACTIVE_GRANTS.  A request for the same access as a grant the client
+ * already holds only moves that grant's expire time out.
+ *
+ * Expired grants are dropped when their client is next seen, and by a
+ * sweep of the whole table every GRANT_QUOTA_SWEEP_INTERVAL seconds (or
+ * when the global limit is reached).
+*/
+#define GRANT_QUOTA_TABLE_LEN       4096    /* must be a power of two */
+#define GRANT_QUOTA_SWEEP_INTERVAL  10
+
+/* Prototypes
+*/
+int grant_quota_start(fko_srv_options_t *opts);
+void grant_quota_stop(void);
+int grant_quota_check(const acc_stanza_t * const acc,
+        const spa_data_t * const spadat);
+void grant_quota_run(void);
+void grant_quota_stats(unsigned int *clients, unsigned long *grants);
+
+#endif /* GRANT_QUOTA_H */
+
+/***EOF***/
@@ -0,0 +1,802 @@
+/*
+ *****************************************************************************
+ *
+ * File:    ha_sync.c
+ *
+ * Purpose: Replication of firewall grants to the other gateway of an
+ *          active/standby pair (HA_SYNC_PORT, HA_SYNC_PEER).
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "ha_sync.h"
+#include "access.h"
+#include "service.h"
+#include "fw_util.h"
+#include "spa_arena.h"
+#include "fwknopd_errors.h"
+#include "log_msg.h"
+#include "utils.h"
+#include "rcu.h"
+#include "cpu_affinity.h"
+
+#if HAVE_SYS_SOCKET_H
+  #include <sys/socket.h>
+#endif
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+/* One service granted to one client, as kept for syncing the peer.
+*/
+typedef struct ha_grant
+{
+    uint32_t                sdp_id;
+    uint32_t                service_id;
+    time_t                  expires;
+    char                    src_ip[MAX_IPV4_STR_LEN];
+    char                    dst_ip[MAX_IPV46_STR_LEN];
+    struct ha_grant        *next;
+} ha_grant_t;
+
+static int                      ha_active = 0;
+static volatile int             ha_stop = 0;
+static int                      ha_sock = -1;
+static pthread_t                ha_thread;
+static fko_srv_options_t       *ha_opts = NULL;
+static char                    *ha_key = NULL;
+static int                      ha_key_len = 0;
+static struct sockaddr_storage  ha_peer;
+static socklen_t                ha_peer_len = 0;
+
+/* Only the receive thread touches these.
+*/
+static int                      ha_synced = 0;
+static int                      ha_sync_tries = 0;
+static time_t                   ha_next_sync = 0;
+
+static ha_grant_t              *ha_grants[HA_SYNC_BUCKETS];
+static int                      ha_num_grants = 0;
+static pthread_mutex_t          ha_grants_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+ha_put_u16(unsigned char *p, const uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+    return;
+}
+
+static uint16_t
+ha_get_u16(const unsigned char *p)
+{
+    return((p[0] << 8) | p[1]);
+}
+
+static void
+ha_put_u32(unsigned char *p, const uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+    return;
+}
+
+static uint32_t
+ha_get_u32(const unsigned char *p)
+{
+    return(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+            | ((uint32_t)p[2] << 8) | p[3]);
+}
+
+static void
+ha_put_u64(unsigned char *p, uint64_t v)
+{
+    int i;
+
+    for(i=7; i >= 0; i--)
+    {
+        p[i] = v & 0xff;
+        v >>= 8;
+    }
+    return;
+}
+
+static uint64_t
+ha_get_u64(const unsigned char *p)
+{
+    uint64_t    v = 0;
+    int         i;
+
+    for(i=0; i < 8; i++)
+        v = (v << 8) | p[i];
+    return(v);
+}
+
+static int
+ha_mac(const unsigned char *msg, const size_t len, unsigned char *mac)
+{
+    unsigned int    mac_len = 0;
+
+    if(HMAC(EVP_sha256(), ha_key, ha_key_len, msg, len, mac, &mac_len) == NULL
+            || mac_len != HA_SYNC_MAC_LEN)
+        return(-1);
+
+    return(0);
+}
+
+/* Fill in the header and MAC of a message whose body is already in
+ * place, and send it to the peer.
+*/
+static int
+ha_send_msg(unsigned char *msg, const size_t body_len, const unsigned char type)
+{
+    size_t  len = HA_SYNC_HDR_LEN + body_len;
+
+    memcpy(msg, HA_SYNC_MAGIC, 4);
+    msg[4] = HA_SYNC_VERSION;
+    msg[5] = type;
+    msg[6] = 0;
+    msg[7] = 0;
+    ha_put_u64(msg + 8, (uint64_t)time(NULL));
+
+    if(ha_mac(msg, len, msg + len) != 0)
+        return(-1);
+
+    if(sendto(ha_sock, msg, len + HA_SYNC_MAC_LEN, 0,
+            (const struct sockaddr *)&ha_peer, ha_peer_len) < 0)
+        return(-1);
+
+    return(0);
+}
+
+static int
+ha_send_grant(const uint32_t sdp_id, const time_t expires, const char *src_ip,
+        const char *dst_ip, const uint32_t *service_ids, const int num_svcs)
+{
+    unsigned char   msg[HA_SYNC_MAX_MSG_LEN];
+    int             i;
+
+    memset(msg, 0x0, sizeof(msg));
+    ha_put_u32(msg + 16, sdp_id);
+    ha_put_u16(msg + 20, num_svcs);
+    ha_put_u64(msg + 24, (uint64_t)expires);
+    strlcpy((char *)msg + 32, src_ip, MAX_IPV4_STR_LEN);
+    strlcpy((char *)msg + 48, dst_ip, 48);
+
+    for(i=0; i < num_svcs; i++)
+        ha_put_u32(msg + HA_SYNC_HDR_LEN + HA_SYNC_GRANT_HDR_LEN + 4 * i,
+            service_ids[i]);
+
+    return(ha_send_msg(msg, HA_SYNC_GRANT_HDR_LEN + 4 * num_svcs,
+        HA_SYNC_MSG_GRANT));
+}
+
+static unsigned int
+ha_bucket(const uint32_t sdp_id, const uint32_t service_id, const char *src_ip)
+{
+    uint32_t    h = 2166136261u ^ sdp_id;
+
+    h = (h ^ service_id) * 16777619u;
+    while(*src_ip != '\0')
+        h = (h ^ (unsigned char)*src_ip++) * 16777619u;
+
+    return(h % HA_SYNC_BUCKETS);
+}
+
+/* Drop every expired grant.  The caller holds ha_grants_mutex.
+*/
+static void
+ha_journal_prune(const time_t now)
+{
+    ha_grant_t    **pp, *g;
+    int             i;
+
+    for(i=0; i < HA_SYNC_BUCKETS; i++)
+    {
+        pp = &(ha_grants[i]);
+        while((g = *pp) != NULL)
+        {
+            if(g->expires <= now)
+            {
+                *pp = g->next;
+                free(g);
+                ha_num_grants--;
+            }
+            else
+                pp = &(g->next);
+        }
+    }
+    return;
+}
+
+/* Record a grant for later syncs, or move its expire time.  Expired
+ * entries in the same bucket are dropped on the way.
+*/
+static void
+ha_journal_add(const uint32_t sdp_id, const uint32_t service_id,
+        const char *src_ip, const char *dst_ip, const time_t expires)
+{
+    ha_grant_t    **pp, *g;
+    time_t          now = time(NULL);
+
+    pthread_mutex_lock(&ha_grants_mutex);
+
+    pp = &(ha_grants[ha_bucket(sdp_id, service_id, src_ip)]);
+    while((g = *pp) != NULL)
+    {
+        if(g->sdp_id == sdp_id && g->service_id == service_id
+                && strcmp(g->src_ip, src_ip) == 0 && strcmp(g->dst_ip, dst_ip) == 0)
+        {
+            if(expires > g->expires)
+                g->expires = expires;
+            pthread_mutex_unlock(&ha_grants_mutex);
+            return;
+        }
+        if(g->expires <= now)
+        {
+            *pp = g->next;
+            free(g);
+            ha_num_grants--;
+            continue;
+        }
+        pp = &(g->next);
+    }
+
+    if(ha_num_grants >= HA_SYNC_MAX_GRANTS)
+        ha_journal_prune(now);
+
+    if(ha_num_grants >= HA_SYNC_MAX_GRANTS || (g = calloc(1, sizeof(*g))) == NULL)
+    {
+        pthread_mutex_unlock(&ha_grants_mutex);
+        log_msg(LOG_WARNING | LOG_RATE_LIMIT,
+            "HA sync: grant table full, a restarted peer will not get every grant.");
+        return;
+    }
+
+    g->sdp_id     = sdp_id;
+    g->service_id = service_id;
+    g->expires    = expires;
+    strlcpy(g->src_ip, src_ip, sizeof(g->src_ip));
+    strlcpy(g->dst_ip, dst_ip, sizeof(g->dst_ip));
+    *pp = g;
+    ha_num_grants++;
+
+    pthread_mutex_unlock(&ha_grants_mutex);
+    return;
+}
+
+static void
+ha_journal_clear(void)
+{
+    ha_grant_t *g, *next;
+    int         i;
+
+    pthread_mutex_lock(&ha_grants_mutex);
+    for(i=0; i < HA_SYNC_BUCKETS; i++)
+    {
+        for(g = ha_grants[i]; g != NULL; g = next)
+        {
+            next = g->next;
+            free(g);
+        }
+        ha_grants[i] = NULL;
+    }
+    ha_num_grants = 0;
+    pthread_mutex_unlock(&ha_grants_mutex);
+    return;
+}
+
+/* Answer a sync request with every grant that has not expired.  The
+ * grants are copied out first so nothing waits on the sends.
+*/
+static void
+ha_send_sync(void)
+{
+    unsigned char   msg[HA_SYNC_HDR_LEN + 4 + HA_SYNC_MAC_LEN];
+    ha_grant_t     *copy = NULL, *g;
+    time_t          now = time(NULL);
+    int             n = 0, sent = 0, i;
+
+    pthread_mutex_lock(&ha_grants_mutex);
+    if(ha_num_grants > 0)
+        copy = calloc(ha_num_grants, sizeof(ha_grant_t));
+    if(copy != NULL)
+        for(i=0; i < HA_SYNC_BUCKETS; i++)
+            for(g = ha_grants[i]; g != NULL; g = g->next)
+                if(g->expires > now)
+                    copy[n++] = *g;
+    pthread_mutex_unlock(&ha_grants_mutex);
+
+    for(i=0; i < n; i++)
+    {
+        if(ha_send_grant(copy[i].sdp_id, copy[i].expires, copy[i].src_ip,
+                copy[i].dst_ip, &(copy[i].service_id), 1) == 0)
+            sent++;
+
+        // don't overrun the peer's socket buffer
+        if((i + 1) % 64 == 0)
+            usleep(1000);
+    }
+    free(copy);
+
+    memset(msg, 0x0, sizeof(msg));
+    ha_put_u32(msg + 16, sent);
+    ha_send_msg(msg, 4, HA_SYNC_MSG_SYNC_END);
+
+    log_msg(LOG_INFO, "HA sync: sent %i grants to the peer.", sent);
+    return;
+}
+
+/* Install a grant made by the peer.  Only clients that have a stanza
+ * here too are granted, and with that stanza's settings.
+*/
+static void
+ha_handle_grant(const unsigned char *msg, const ssize_t len)
+{
+    fw_grant_t      grants[HA_SYNC_MAX_SERVICES];
+    spa_arena_t    *arena;
+    acc_stanza_t   *acc;
+    char            src_ip[MAX_IPV4_STR_LEN];
+    char            dst_ip[MAX_IPV46_STR_LEN];
+    uint32_t        sdp_id;
+    time_t          expires, now = time(NULL);
+    int             num_svcs, num_grants = 0, failed = 0, i;
+
+    if(len < HA_SYNC_HDR_LEN + HA_SYNC_GRANT_HDR_LEN + HA_SYNC_MAC_LEN)
+        return;
+
+    num_svcs = ha_get_u16(msg + 20);
+    if(num_svcs < 1 || num_svcs > HA_SYNC_MAX_SERVICES
+            || len != HA_SYNC_HDR_LEN + HA_SYNC_GRANT_HDR_LEN + num_svcs * 4 + HA_SYNC_MAC_LEN)
+        return;
+
+    sdp_id  = ha_get_u32(msg + 16);
+    expires = (time_t)ha_get_u64(msg + 24);
+
+    memcpy(src_ip, msg + 32, sizeof(src_ip));
+    src_ip[sizeof(src_ip)-1] = '\0';
+    memcpy(dst_ip, msg + 48, sizeof(dst_ip));
+    dst_ip[sizeof(dst_ip)-1] = '\0';
+
+    if(! is_valid_ipv4_addr(src_ip) || expires <= now
+            || expires - now > RCHK_MAX_FW_TIMEOUT)
+        return;
+
+    if((arena = spa_arena_get()) == NULL)
+        return;
+
+    // the stanza and service data stay put until the grants are installed
+    rcu_read_lock();
+
+    if((acc = acc_sdp_id_lookup(ha_opts, sdp_id)) == NULL)
+    {
+        rcu_read_unlock();
+        spa_arena_reset(arena);
+        if(ha_opts->verbose)
+            log_msg(LOG_DEBUG, "HA sync: no stanza for SDP ID %"PRIu32", grant ignored.",
+                sdp_id);
+        return;
+    }
+
+    for(i=0; i < num_svcs; i++)
+    {
+        memset(&(grants[num_grants]), 0x0, sizeof(fw_grant_t));
+        if(get_service_data(ha_opts, arena,
+                    ha_get_u32(msg + HA_SYNC_HDR_LEN + HA_SYNC_GRANT_HDR_LEN + i * 4),
+                    &(grants[num_grants].service)) != FWKNOPD_SUCCESS)
+            continue;
+
+        grants[num_grants].acc     = acc;
+        grants[num_grants].sdp_id  = sdp_id;
+        grants[num_grants].timeout = expires - now;
+        strlcpy(grants[num_grants].src_ip, src_ip, sizeof(grants[num_grants].src_ip));
+        strlcpy(grants[num_grants].dst_ip, dst_ip, sizeof(grants[num_grants].dst_ip));
+        num_grants++;
+    }
+
+    if(num_grants > 0)
+    {
+        if(pthread_mutex_lock(&(ha_opts->spa_grant_mutex)))
+            log_msg(LOG_ERR, "Mutex lock error.");
+        else
+        {
+            failed = fw_install_grants(ha_opts, grants, num_grants);
+            pthread_mutex_unlock(&(ha_opts->spa_grant_mutex));
+        }
+
+        for(i=0; i < num_grants; i++)
+            ha_journal_add(sdp_id, grants[i].service->service_id, src_ip, dst_ip, expires);
+
+        if(ha_opts->verbose)
+            log_msg(LOG_DEBUG, "HA sync: installed %d of %d services granted to SDP ID %"PRIu32
+                " by the peer", num_grants - failed, num_svcs, sdp_id);
+    }
+
+    rcu_read_unlock();
+    spa_arena_reset(arena);
+    return;
+}
+
+static int
+ha_from_peer(const struct sockaddr_storage *from)
+{
+    if(from->ss_family != ha_peer.ss_family)
+        return(0);
+
+    if(from->ss_family == AF_INET)
+        return(((const struct sockaddr_in *)from)->sin_addr.s_addr
+            == ((const struct sockaddr_in *)&ha_peer)->sin_addr.s_addr);
+
+    if(from->ss_family == AF_INET6)
+        return(memcmp(&(((const struct sockaddr_in6 *)from)->sin6_addr),
+            &(((const struct sockaddr_in6 *)&ha_peer)->sin6_addr),
+            sizeof(struct in6_addr)) == 0);
+
+    return(0);
+}
+
+static void
+ha_handle_msg(const unsigned char *msg, const ssize_t len,
+        const struct sockaddr_storage *from)
+{
+    unsigned char   mac[HA_SYNC_MAC_LEN];
+    int64_t         skew;
+
+    if(len < HA_SYNC_HDR_LEN + HA_SYNC_MAC_LEN
+            || memcmp(msg, HA_SYNC_MAGIC, 4) != 0
+            || msg[4] != HA_SYNC_VERSION
+            || msg[5] > HA_SYNC_MSG_SYNC_END)
+        return;
+
+    if(! ha_from_peer(from))
+    {
+        if(ha_opts->verbose)
+            log_msg(LOG_DEBUG, "Ignoring an HA sync message from a host other than HA_SYNC_PEER");
+        return;
+    }
+
+    if(ha_mac(msg, len - HA_SYNC_MAC_LEN, mac) != 0
+            || constant_runtime_cmp((char *)mac,
+                (char *)msg + len - HA_SYNC_MAC_LEN, HA_SYNC_MAC_LEN) != 0)
+    {
+        log_msg(LOG_WARNING, "HA sync message failed authentication");
+        return;
+    }
+
+    skew = (int64_t)ha_get_u64(msg + 8) - (int64_t)time(NULL);
+    if(skew > HA_SYNC_MAX_SKEW || skew < -HA_SYNC_MAX_SKEW)
+    {
+        log_msg(LOG_WARNING | LOG_RATE_LIMIT,
+            "Ignoring an HA sync message sent %"PRId64" seconds away from our clock", skew);
+        return;
+    }
+
+    if(msg[5] == HA_SYNC_MSG_GRANT)
+        ha_handle_grant(msg, len);
+    else if(msg[5] == HA_SYNC_MSG_SYNC && len == HA_SYNC_HDR_LEN + HA_SYNC_MAC_LEN)
+        ha_send_sync();
+    else if(msg[5] == HA_SYNC_MSG_SYNC_END && len == HA_SYNC_HDR_LEN + 4 + HA_SYNC_MAC_LEN)
+    {
+        if(! ha_synced)
+            log_msg(LOG_INFO, "HA sync: got %"PRIu32" grants from the peer.",
+                ha_get_u32(msg + 16));
+        ha_synced = 1;
+    }
+
+    return;
+}
+
+/* Ask the peer for its grants until it answers.
+*/
+static void
+ha_request_sync(void)
+{
+    unsigned char   msg[HA_SYNC_HDR_LEN + HA_SYNC_MAC_LEN];
+    time_t          now = time(NULL);
+
+    if(ha_synced || ha_sync_tries >= HA_SYNC_TRIES || now < ha_next_sync)
+        return;
+
+    ha_sync_tries++;
+    ha_next_sync = now + HA_SYNC_RETRY_INTERVAL;
+
+    memset(msg, 0x0, sizeof(msg));
+    if(ha_send_msg(msg, 0, HA_SYNC_MSG_SYNC) != 0 && ha_opts->verbose)
+        log_msg(LOG_DEBUG, "HA sync: unable to send sync request: %s", strerror(errno));
+
+    if(ha_sync_tries == HA_SYNC_TRIES)
+        log_msg(LOG_WARNING, "HA sync: no answer from the peer, starting without its grants.");
+    return;
+}
+
+static void *
+ha_recv_thread(void *arg)
+{
+    unsigned char           msg[HA_SYNC_MAX_MSG_LEN];
+    struct sockaddr_storage from;
+    socklen_t               from_len;
+    sigset_t                mask;
+    ssize_t                 len;
+
+    (void)arg;
+
+    /* Leave signal handling to the main thread.
+    */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    cpu_affinity_set(CPU_ROLE_HOUSEKEEPING);
+
+    while(! ha_stop)
+    {
+        ha_request_sync();
+
+        from_len = sizeof(from);
+        len = recvfrom(ha_sock, msg, sizeof(msg), 0,
+                (struct sockaddr *)&from, &from_len);
+        if(len < 0)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                log_msg(LOG_WARNING, "HA sync recvfrom() error: %s",
+                    strerror(errno));
+            continue;
+        }
+        ha_handle_msg(msg, len, &from);
+    }
+    return(NULL);
+}
+
+static void
+ha_free(void)
+{
+    if(ha_sock != -1)
+        close(ha_sock);
+    ha_sock = -1;
+
+    if(ha_key != NULL)
+    {
+        memset(ha_key, 0x0, ha_key_len);
+        free(ha_key);
+    }
+    ha_key     = NULL;
+    ha_key_len = 0;
+
+    ha_journal_clear();
+    return;
+}
+
+/* HA_SYNC_PEER is "<address>" or "<address>:<port>", the port defaulting
+ * to HA_SYNC_PORT.  IPv6 addresses with a port go in brackets.
+*/
+static int
+ha_peer_addr(const fko_srv_options_t *opts, const int family)
+{
+    struct addrinfo     hints, *res = NULL;
+    char                host[MAX_HOSTNAME_LEN];
+    const char         *spec = opts->config[CONF_HA_SYNC_PEER];
+    const char         *port = opts->config[CONF_HA_SYNC_PORT];
+    char               *p;
+    int                 rv;
+
+    if(spec == NULL || spec[0] == '\0')
+    {
+        log_msg(LOG_ERR, "[*] HA_SYNC_PORT is set but HA_SYNC_PEER is not.");
+        return(-1);
+    }
+
+    strlcpy(host, spec, sizeof(host));
+    if(host[0] == '[' && (p = strchr(host, ']')) != NULL)
+    {
+        *p = '\0';
+        if(p[1] == ':')
+            port = spec + (p - host) + 2;
+        memmove(host, host + 1, strlen(host + 1) + 1);
+    }
+    else if((p = strchr(host, ':')) != NULL && strchr(p + 1, ':') == NULL)
+    {
+        *p = '\0';
+        port = spec + (p - host) + 1;
+    }
+
+    memset(&hints, 0x0, sizeof(hints));
+    hints.ai_family   = family;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags    = AI_NUMERICHOST | AI_NUMERICSERV;
+    if(family == AF_INET6)
+        hints.ai_flags |= AI_V4MAPPED;
+
+    if((rv = getaddrinfo(host, port, &hints, &res)) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Invalid HA_SYNC_PEER '%s': %s", spec, gai_strerror(rv));
+        return(-1);
+    }
+
+    memcpy(&ha_peer, res->ai_addr, res->ai_addrlen);
+    ha_peer_len = res->ai_addrlen;
+
+    freeaddrinfo(res);
+    return(0);
+}
+
+/* Start the HA sync socket if HA_SYNC_PORT is set.  Returns 0 on success
+ * (including when HA sync is disabled) and -1 on error.
+*/
+int
+ha_sync_start(fko_srv_options_t *opts)
+{
+    struct sockaddr_storage addr;
+    struct timeval          tv;
+    int                     port, is_err, family, on = 1, off = 0;
+
+    ha_active = 0;
+
+    port = strtol_wrapper(opts->config[CONF_HA_SYNC_PORT],
+            0, RCHK_MAX_HA_SYNC_PORT, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid HA_SYNC_PORT value.");
+        return(-1);
+    }
+
+    if(port == 0)
+        return(0);
+
+    if(! opts->rt->sdp_mode)
+    {
+        log_msg(LOG_ERR, "[*] HA_SYNC_PORT requires SDP mode.");
+        return(-1);
+    }
+
+    if(opts->config[CONF_HA_SYNC_KEY] == NULL
+            || strlen(opts->config[CONF_HA_SYNC_KEY]) < HA_SYNC_MIN_KEY_LEN)
+    {
+        log_msg(LOG_ERR, "[*] HA_SYNC_KEY must be at least %i characters.",
+            HA_SYNC_MIN_KEY_LEN);
+        return(-1);
+    }
+
+    family = opts->enable_ipv6 ? AF_INET6 : AF_INET;
+
+    if(ha_peer_addr(opts, family) != 0)
+        return(-1);
+
+    if((ha_key = strdup(opts->config[CONF_HA_SYNC_KEY])) == NULL)
+    {
+        log_msg(LOG_ERR, "ha_sync_start: strdup() failed");
+        return(-1);
+    }
+    ha_key_len = strlen(ha_key);
+
+    memset(&addr, 0x0, sizeof(addr));
+    if(family == AF_INET6)
+    {
+        ((struct sockaddr_in6 *)&addr)->sin6_family = AF_INET6;
+        ((struct sockaddr_in6 *)&addr)->sin6_addr   = in6addr_any;
+        ((struct sockaddr_in6 *)&addr)->sin6_port   = htons(port);
+    }
+    else
+    {
+        ((struct sockaddr_in *)&addr)->sin_family      = AF_INET;
+        ((struct sockaddr_in *)&addr)->sin_addr.s_addr = htonl(INADDR_ANY);
+        ((struct sockaddr_in *)&addr)->sin_port        = htons(port);
+    }
+
+    /* Wake up once a second to see if we should stop, or retry the sync.
+    */
+    tv.tv_sec  = 1;
+    tv.tv_usec = 0;
+
+    if((ha_sock = socket(family, SOCK_DGRAM, 0)) < 0
+            || setsockopt(ha_sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0
+            || (family == AF_INET6
+                && setsockopt(ha_sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) != 0)
+            || setsockopt(ha_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0
+            || bind(ha_sock, (struct sockaddr *)&addr,
+                family == AF_INET6 ? sizeof(struct sockaddr_in6)
+                    : sizeof(struct sockaddr_in)) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Unable to set up HA sync socket on port %i: %s",
+            port, strerror(errno));
+        ha_free();
+        return(-1);
+    }
+
+    ha_opts       = opts;
+    ha_stop       = 0;
+    ha_synced     = 0;
+    ha_sync_tries = 0;
+    ha_next_sync  = 0;
+
+    if(pthread_create(&ha_thread, NULL, ha_recv_thread, NULL) != 0)
+    {
+        log_msg(LOG_ERR, "ha_sync_start: failed to start receive thread");
+        ha_free();
+        return(-1);
+    }
+
+    ha_active = 1;
+
+    log_msg(LOG_INFO, "Replicating firewall grants with %s on UDP port %i.",
+        opts->config[CONF_HA_SYNC_PEER], port);
+
+    return(0);
+}
+
+void
+ha_sync_stop(void)
+{
+    if(! ha_active)
+        return;
+
+    ha_active = 0;
+    ha_stop   = 1;
+
+    if(! pthread_equal(ha_thread, pthread_self()))
+        pthread_join(ha_thread, NULL);
+
+    ha_free();
+    return;
+}
+
+/* Send the peer a grant just installed for an SPA packet.
+*/
+void
+ha_sync_grant(const spa_data_t *spadat)
+{
+    const service_data_list_t  *svc;
+    uint32_t                    ids[HA_SYNC_MAX_SERVICES];
+    time_t                      expires;
+    int                         n = 0;
+
+    if(! ha_active || spadat->use_src_ip == NULL
+            || strlen(spadat->use_src_ip) >= MAX_IPV4_STR_LEN)
+        return;
+
+    expires = time(NULL) + spadat->fw_access_timeout;
+
+    for(svc = spadat->service_data_list; svc != NULL && n < HA_SYNC_MAX_SERVICES; svc = svc->next)
+    {
+        ids[n++] = svc->service_data->service_id;
+        ha_journal_add(spadat->sdp_id, svc->service_data->service_id,
+            spadat->use_src_ip, spadat->pkt_destination_ip, expires);
+    }
+
+    if(n == 0)
+        return;
+
+    if(ha_send_grant(spadat->sdp_id, expires, spadat->use_src_ip,
+            spadat->pkt_destination_ip, ids, n) != 0)
+        log_msg(LOG_WARNING | LOG_RATE_LIMIT,
+            "HA sync: unable to send grant for SDP ID %"PRIu32": %s",
+            spadat->sdp_id, strerror(errno));
+    return;
+}
+
+/***EOF***/
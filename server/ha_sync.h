@@ -0,0 +1,107 @@
+/*
+ *****************************************************************************
+ *
+ * File:    ha_sync.h
+ *
+ * Purpose: Header file for ha_sync.c - replication of firewall grants
+ *          between the two gateways of an active/standby pair.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef HA_SYNC_H
+#define HA_SYNC_H
+
+/* Every grant this gateway installs for an SPA packet is sent to
+ * HA_SYNC_PEER, which installs the same grant with the same expire time,
+ * so that after a VRRP failover the clients keep their access.  Grants
+ * are never removed explicitly, both sides expire them on their own.
+ * Replay digests are shared by replay gossip (REPLAY_GOSSIP_PEERS).
+ *
+ * A gateway that starts up asks its peer for a sync, and the peer sends
+ * every grant it still holds followed by a sync end message.
+ *
+ * Message layout (multi-byte fields in network byte order):
+ *
+ *   0   magic "FKHA"
+ *   4   version
+ *   5   message type (HA_SYNC_MSG_*)
+ *   6   reserved (2 bytes)
+ *   8   time the message was sent (64 bits)
+ *   16  message body
+ *   end HMAC-SHA256 over everything before it
+ *
+ * Grant body:
+ *
+ *   16  SDP ID (32 bits)
+ *   20  number of services
+ *   22  reserved (2 bytes)
+ *   24  expire time (64 bits)
+ *   32  address to allow (NUL padded string, MAX_IPV4_STR_LEN bytes)
+ *   48  destination address (NUL padded string, 48 bytes)
+ *   96  service IDs (32 bits each)
+ *
+ * Sync end body:
+ *
+ *   16  number of grants sent (32 bits)
+ *
+ * Sync requests have no body.  Messages sent more than HA_SYNC_MAX_SKEW
+ * seconds ago (or ahead) are ignored, and a replayed grant can only put
+ * back access that has not expired yet.
+*/
+#define HA_SYNC_MAGIC               "FKHA"
+#define HA_SYNC_VERSION             1
+#define HA_SYNC_HDR_LEN             16
+#define HA_SYNC_GRANT_HDR_LEN       80
+#define HA_SYNC_MAC_LEN             32
+#define HA_SYNC_MAX_SERVICES        64
+#define HA_SYNC_MAX_MSG_LEN         (HA_SYNC_HDR_LEN + HA_SYNC_GRANT_HDR_LEN \
+                                        + HA_SYNC_MAX_SERVICES * 4 + HA_SYNC_MAC_LEN)
+
+#define HA_SYNC_MSG_GRANT           0
+#define HA_SYNC_MSG_SYNC            1
+#define HA_SYNC_MSG_SYNC_END        2
+
+#define HA_SYNC_MIN_KEY_LEN         16
+#define HA_SYNC_MAX_SKEW            300
+
+/* Sync requests are sent every HA_SYNC_RETRY_INTERVAL seconds until the
+ * peer answers, at most HA_SYNC_TRIES times.
+*/
+#define HA_SYNC_RETRY_INTERVAL      5
+#define HA_SYNC_TRIES               12
+
+/* Live grants kept for syncing a peer that restarts.
+*/
+#define HA_SYNC_BUCKETS             4096
+#define HA_SYNC_MAX_GRANTS          65536
+
+/* Prototypes
+*/
+int ha_sync_start(fko_srv_options_t *opts);
+void ha_sync_stop(void);
+void ha_sync_grant(const spa_data_t *spadat);
+
+#endif /* HA_SYNC_H */
+
+/***EOF***/
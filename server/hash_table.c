@@ -9,8 +9,14 @@
 
 #include "hash_table.h"
 #include "bstrlib.h"
+#include "mem_acct.h"
 #include "dbg.h"
 
+#ifdef HAVE_C_UNIT_TESTS
+  #include "cunit_common.h"
+  DECLARE_TEST_SUITE(hash_table, "Hash table test suite");
+#endif
+
 /*
  * Func: default_compare
  * Args: void *a, void *b
@@ -56,11 +62,248 @@ static uint32_t default_hash(void *a)
 }
 
 
+/*
+ * Func: home_slot
+ * Args: uint32_t hash - the key's hash value.
+ *
+ *       uint32_t bits - log2 of the number of slots.
+ *
+ * Expl: Returns the slot a hash value belongs in. The hash is spread with a
+ *       multiplicative (Fibonacci) step first since only its low bits would
+ *       otherwise be used.
+ */
+static inline uint32_t home_slot(uint32_t hash, uint32_t bits)
+{
+    return (hash * 2654435761U) >> (32 - bits);
+}
+
+/*
+ * Func: slots_find
+ * Args: hash_table_t *tbl - pointer to the hash table, for its compare function.
+ *
+ *       hash_table_node_t *slots, uint32_t bits - the slot array to search.
+ *
+ *       uint32_t hash, void *key - the key and its hash value.
+ *
+ * Expl: Non-public function for finding a key in one slot array. The probe
+ *       stops at an empty slot or at a node closer to its home slot than the
+ *       key would be, since Robin Hood insertion would have placed the key
+ *       ahead of it. Returns the node or NULL.
+ */
+static hash_table_node_t *slots_find(hash_table_t *tbl, hash_table_node_t *slots,
+        uint32_t bits, uint32_t hash, void *key)
+{
+    uint32_t mask = (1U << bits) - 1;
+    uint32_t i = home_slot(hash, bits);
+    uint32_t dist = 1;
+    hash_table_node_t *node = NULL;
+
+    while(1)
+    {
+        node = &slots[i];
+
+        if(node->dist < dist)
+            return NULL;
+
+        if(node->key != NULL && node->hash == hash && tbl->compare(node->key, key) == 0)
+            return node;
+
+        i = (i + 1) & mask;
+        dist++;
+    }
+}
+
+/*
+ * Func: slots_insert
+ * Args: hash_table_node_t *slots, uint32_t bits - the slot array.
+ *
+ *       const hash_table_node_t *entry - key, data and hash to insert.
+ *
+ * Expl: Non-public function for the Robin Hood insert of a key that is not in
+ *       the array yet. Whenever the entry being placed is further from its
+ *       home slot than the node in the way, they swap and the displaced node
+ *       carries on down the array. The array must have an empty slot.
+ */
+static void slots_insert(hash_table_node_t *slots, uint32_t bits, const hash_table_node_t *entry)
+{
+    uint32_t mask = (1U << bits) - 1;
+    uint32_t i = home_slot(entry->hash, bits);
+    hash_table_node_t cur = *entry;
+    hash_table_node_t tmp;
+
+    cur.dist = 1;
+
+    while(1)
+    {
+        if(slots[i].dist == 0)
+        {
+            slots[i] = cur;
+            return;
+        }
+
+        if(slots[i].dist < cur.dist)
+        {
+            tmp = slots[i];
+            slots[i] = cur;
+            cur = tmp;
+        }
+
+        i = (i + 1) & mask;
+        cur.dist++;
+    }
+}
+
+/*
+ * Func: slots_remove
+ * Args: hash_table_node_t *slots, uint32_t bits - the slot array.
+ *
+ *       hash_table_node_t *node - the node to remove.
+ *
+ * Expl: Non-public function that removes a node by shifting the nodes after
+ *       it back one slot, up to the next empty slot or node that is already
+ *       in its home slot. No tombstone is left behind.
+ */
+static void slots_remove(hash_table_node_t *slots, uint32_t bits, hash_table_node_t *node)
+{
+    uint32_t mask = (1U << bits) - 1;
+    uint32_t i = node - slots;
+    uint32_t next = (i + 1) & mask;
+
+    while(slots[next].dist > 1)
+    {
+        slots[i] = slots[next];
+        slots[i].dist--;
+        i = next;
+        next = (next + 1) & mask;
+    }
+
+    memset(&slots[i], 0x0, sizeof(hash_table_node_t));
+}
+
+/*
+ * Func: hash_table_migrate
+ * Args: hash_table_t *tbl - pointer to the hash table.
+ *
+ *       uint32_t steps - the number of old slots to move.
+ *
+ * Expl: Non-public function that moves the next 'steps' slots of the table
+ *       being grown out of into the current one, and frees the old array once
+ *       it is empty. Nothing moves while the table is being traversed.
+ */
+static void hash_table_migrate(hash_table_t *tbl, uint32_t steps)
+{
+    hash_table_node_t *node = NULL;
+
+    if(tbl->old_slots == NULL || tbl->traversing)
+        return;
+
+    while(steps-- > 0 && tbl->migrate_pos < tbl->old_size)
+    {
+        node = &tbl->old_slots[tbl->migrate_pos++];
+        if(node->dist != 0 && node->key != NULL)
+        {
+            slots_insert(tbl->slots, tbl->bits, node);
+            tbl->count++;
+            tbl->old_count--;
+
+            // keys not moved yet may still probe past this slot
+            node->key = NULL;
+            node->data = NULL;
+        }
+    }
+
+    if(tbl->migrate_pos == tbl->old_size)
+    {
+        debug("Finished growing table to %" PRIu32 " slots.", tbl->size);
+        mem_free(MEM_TAG_HASH_TABLE, tbl->old_slots);
+        tbl->old_slots = NULL;
+        tbl->old_size = 0;
+        tbl->old_bits = 0;
+        tbl->old_count = 0;
+        tbl->migrate_pos = 0;
+    }
+}
+
+/*
+ * Func: hash_table_grow
+ * Args: hash_table_t *tbl - pointer to the hash table.
+ *
+ * Expl: Non-public function called before adding a key. If the table would be
+ *       more than 7/8 full, finishes any move still in progress and starts
+ *       moving to an array twice the size. Returns 0, or -1 if the new array
+ *       could not be allocated and the table is full.
+ */
+static int hash_table_grow(hash_table_t *tbl)
+{
+    hash_table_node_t *slots = NULL;
+
+    if(tbl->count + tbl->old_count + tbl->deleted + 1 <= tbl->size - tbl->size / 8)
+        return 0;
+
+    if(tbl->old_slots != NULL)
+    {
+        hash_table_migrate(tbl, tbl->old_size);
+        if(tbl->count + tbl->deleted + 1 <= tbl->size - tbl->size / 8)
+            return 0;
+    }
+
+    slots = mem_calloc(MEM_TAG_HASH_TABLE, (size_t)tbl->size * 2, sizeof(hash_table_node_t));
+    if(slots == NULL)
+    {
+        // carry on at a higher load while there is room
+        return (tbl->count + tbl->deleted + 1 < tbl->size) ? 0 : -1;
+    }
+
+    debug("Growing table from %" PRIu32 " slots.", tbl->size);
+
+    tbl->old_slots = tbl->slots;
+    tbl->old_size = tbl->size;
+    tbl->old_bits = tbl->bits;
+    tbl->old_count = tbl->count;
+    tbl->migrate_pos = 0;
+
+    tbl->slots = slots;
+    tbl->size *= 2;
+    tbl->bits++;
+    tbl->count = 0;
+
+    // the old array keeps any traversal tombstones until it is freed
+    tbl->deleted = 0;
+
+    return 0;
+}
+
+/*
+ * Func: hash_table_purge
+ * Args: hash_table_t *tbl - pointer to the hash table.
+ *
+ * Expl: Non-public function that rebuilds the slot array without the nodes
+ *       deleted during a traversal. If memory is short the deleted nodes are
+ *       left in place, which is still correct.
+ */
+static void hash_table_purge(hash_table_t *tbl)
+{
+    hash_table_node_t *slots = NULL;
+    uint32_t i;
+
+    if((slots = mem_calloc(MEM_TAG_HASH_TABLE, tbl->size, sizeof(hash_table_node_t))) == NULL)
+        return;
+
+    for(i = 0; i < tbl->size; i++)
+        if(tbl->slots[i].dist != 0 && tbl->slots[i].key != NULL)
+            slots_insert(slots, tbl->bits, &tbl->slots[i]);
+
+    mem_free(MEM_TAG_HASH_TABLE, tbl->slots);
+    tbl->slots = slots;
+    tbl->deleted = 0;
+}
+
+
 /**
  * Func: hash_table_create
- * Args: const uint32_t length - Number of buckets in the hash table. Accepts any value
- *              between 0 and MAX_NUMBER_OF_BUCKETS, inclusive. 0 results in a length of
- *              DEFAULT_NUMBER_OF_BUCKETS.
+ * Args: const uint32_t length - Expected number of entries, used to size the table
+ *              up front. Accepts any value between 0 and MAX_NUMBER_OF_BUCKETS, inclusive.
+ *              0 results in DEFAULT_NUMBER_OF_BUCKETS. The table grows as needed either way.
  *
  *       hash_table_compare compare - Pointer to a function for comparing two keys. Accepts
  *           NULL, resulting in selecting the default compare function.
@@ -72,12 +315,13 @@ static uint32_t default_hash(void *a)
  *           node during hash_table_destroy in order to deallocate all memory. This can be NULL.
  *
  * Expl: Function for creating hash table. It's important to note that this implementation
- *       allows for keys and data of any type.
+ *       allows for keys and data of any type, but keys must not be NULL.
  */
 hash_table_t *hash_table_create(const uint32_t length, hash_table_compare compare, hash_table_hash_func hash_func, hash_table_delete_cb delete_cb)
 {
     hash_table_t *tbl = NULL;
-    uint32_t i;
+    uint32_t size = HASH_TABLE_MIN_SLOTS;
+    uint32_t bits = 3;
 
     // Check that the desired table length is valid
     check( ((length >= 0) && (length < MAX_NUMBER_OF_BUCKETS)), "Table length must be between 0 and %i, inclusive.", MAX_NUMBER_OF_BUCKETS);
@@ -89,23 +333,27 @@ hash_table_t *hash_table_create(const uint32_t length, hash_table_compare compar
     // Otherwise, use their desired value
     uint32_t final_length = length == 0 ? DEFAULT_NUMBER_OF_BUCKETS : length;
 
+    // smallest power of two that holds that many entries below 7/8 full
+    while(size - size / 8 < final_length)
+    {
+        size *= 2;
+        bits++;
+    }
+
     // Allocate memory for the table and verify the allocation was successful
-    tbl = calloc(1, sizeof(hash_table_t));
+    tbl = mem_calloc(MEM_TAG_HASH_TABLE, 1, sizeof(hash_table_t));
     check_mem(tbl);
 
-    // Allocate memory for the array of pointers to buckets, i.e. first node in each bucket
-    tbl->buckets = calloc(final_length, sizeof(hash_table_node_t *));
-    check_mem(tbl->buckets);
+    // Allocate the slot array, all slots start out empty
+    tbl->slots = mem_calloc(MEM_TAG_HASH_TABLE, size, sizeof(hash_table_node_t));
+    check_mem(tbl->slots);
 
-    tbl->length = final_length;
+    tbl->size = size;
+    tbl->bits = bits;
     tbl->compare = compare == NULL ? default_compare : compare;
     tbl->hash_func = hash_func == NULL ? default_hash : hash_func;
     tbl->delete_cb = delete_cb;
 
-    debug("Initializing buckets entries to NULL.");
-    for (i = 0; i < final_length; i++)
-        tbl->buckets[i] = NULL;
-
     debug("Done.");
     return tbl;
 
@@ -126,127 +374,39 @@ error:
  */
 void hash_table_destroy(hash_table_t *tbl)
 {
-    int i = 0;
+    uint32_t i = 0;
 
     // if the table exists
     if(tbl) {
-        // if the array of buckets exists
-        if(tbl->buckets)
-        {
-            debug("HASH_TABLE_DESTROY: buckets is not null.");
-            debug("HASH_TABLE_DESTROY: table length: %" PRIu32 ".", tbl->length);
-
-            // step through the array of buckets
-            for(i = 0; i < tbl->length; i++)
-            {
-                hash_table_node_t *node = tbl->buckets[i];
-
-                if(node != NULL) debug("HASH_TABLE_DESTROY: bucket %d was initialized.", i);
-
-                // if a bucket is not null, walk through the linked list
-                // deleting all nodes
-                while(node != NULL)
-                {
-                    debug("HASH_TABLE_DESTROY: KEY: %s", bdata((bstring)node->key));
-                    if(node->next != NULL)
-                        debug("HASH_TABLE_DESTROY: Next node is not null.");
-                    else
-                        debug("HASH_TABLE_DESTROY: Next node is null.");
-
-                    // hold the next node in the list
-                    hash_table_node_t *next = node->next;
+        debug("HASH_TABLE_DESTROY: table size: %" PRIu32 ".", tbl->size);
 
-                    // if a callback was provided for deleting data, run it
-                    if(tbl->delete_cb) tbl->delete_cb(node);
-
-                    // free the node itself
-                    free(node);
-                    debug("HASH_TABLE_DESTROY: Node structures freed.");
+        // run the delete callback on every populated node of both arrays
+        if(tbl->slots)
+        {
+            for(i = 0; i < tbl->size; i++)
+                if(tbl->slots[i].dist != 0 && tbl->slots[i].key != NULL && tbl->delete_cb)
+                    tbl->delete_cb(&tbl->slots[i]);
 
-                    // move to the next node in this bucket
-                    node = next;
-                }
-            }
+            mem_free(MEM_TAG_HASH_TABLE, tbl->slots);
+        }
 
-            debug("HASH_TABLE_DESTROY: Done deleting nodes.");
+        if(tbl->old_slots)
+        {
+            for(i = 0; i < tbl->old_size; i++)
+                if(tbl->old_slots[i].dist != 0 && tbl->old_slots[i].key != NULL && tbl->delete_cb)
+                    tbl->delete_cb(&tbl->old_slots[i]);
 
-            // free the buckets array
-            free(tbl->buckets);
+            mem_free(MEM_TAG_HASH_TABLE, tbl->old_slots);
         }
 
         debug("HASH_TABLE_DESTROY: Freeing the table itself.");
 
         // free the table structure
-        free(tbl);
+        mem_free(MEM_TAG_HASH_TABLE, tbl);
     }
     debug("HASH_TABLE_DESTROY: Exiting function.");
 }
 
-/**
- * Func: hash_table_node_create
- * Args: const uint32_t hash - calculated hash value based on the key.
- *
- *       void *key - pointer to the key.
- *
- *       void *data - pointer to the data.
- *
- * Expl: Non-public function for creating a hash table node. It's important to note that this
- *       implementation allows for keys and data of any type. Returns a pointer to the node or
- *       NULL on failure
- */
-static inline hash_table_node_t *hash_table_node_create(const uint32_t hash, void *key, void *data)
-{
-    hash_table_node_t *node = calloc(1, sizeof(hash_table_node_t));
-    check_mem(node);
-
-    node->key = key;
-    node->data = data;
-    node->hash = hash;
-    node->next = NULL;
-
-    return node;
-
-error:
-    return NULL;
-}
-
-/*
-static inline hash_table_node_t *hash_table_bucket_get(hash_table_t *tbl, void *key,
-        int create, uint32_t *hash_out)
-{
-    check((tbl->length), "Invalid table length: %" PRIu32 " ", (tbl->length));
-
-    debug("Returned from table length check.");
-
-    uint32_t hash = tbl->hash_func(key);
-    debug("Got hash.");
-
-    int bucket_n = hash % (tbl->length);
-    debug("Bucket number: %d", bucket_n);
-
-    check(bucket_n >= 0, "Invalid bucket found: %d", bucket_n);
-    *hash_out = hash; // store it for the return so the caller can use it
-
-    hash_table_node_t *bucket = tbl->buckets[bucket_n];
-    debug("Set bucket.");
-
-    if(!bucket && create)
-    {
-        debug("Entered bucket create clause.");
-        // new bucket, set it up
-        bucket = hash_table_node_create(hash, key, NULL);
-        check_mem(bucket);
-        tbl->buckets[bucket_n] = bucket;
-    }
-
-    debug("Returning a bucket.");
-    return bucket;
-
-error:
-    return NULL;
-}
-*/
-
 /**
  * Func: hash_table_node_get
  * Args: hash_table_t *tbl - pointer to the hash table.
@@ -255,72 +415,32 @@ error:
  *
  *       uint32_t *hash - sets/returns the calculated hash value.
  *
- *       int *bucket_num - set/returns the calculated bucket number.
- *
- *       hash_table_node_t **prev - this is set to null if the desired node is the first
- *           in the bucket.
+ *       int *in_old - set to 1 if the node is in the array being grown out of.
  *
- * Expl: Non-public function for finding a hash table node.
+ * Expl: Non-public function for finding a hash table node. This does not
+ *       modify the table, so any number of threads may look up keys in a table
+ *       that nothing is changing.
  */
 static inline hash_table_node_t * hash_table_node_get(hash_table_t *tbl, void *key,
-        uint32_t *hash, int *bucket_num, hash_table_node_t **prev)
+        uint32_t *hash, int *in_old)
 {
-    int i = 0;
-    *prev = NULL;
-
-    // ensure the table's length is nonzero
-    check((tbl->length) > 0, "Invalid table length: %" PRIu32 " ", (tbl->length));
+    hash_table_node_t *node = NULL;
 
-    debug("Returned from table length check.");
+    *in_old = 0;
 
     // calculate the hash value from the key
-    if((*hash = tbl->hash_func(key)) < 0)
-        goto error;
+    *hash = tbl->hash_func(key);
     debug("Got hash.");
 
-    // get the bucket number from the hash value
-    *bucket_num = *hash % (tbl->length);
-    debug("Bucket number: %d", *bucket_num);
-
-    // ensure we got a logical bucket number
-    check(*bucket_num >= 0, "Invalid bucket number found: %d", *bucket_num);
+    if((node = slots_find(tbl, tbl->slots, tbl->bits, *hash, key)) != NULL)
+        return node;
 
-    // retrieve the first node in the bucket
-    hash_table_node_t *node = tbl->buckets[*bucket_num];
-    debug("Set node.");
-
-    // if there is a first node, begin walking the list
-    while(node != NULL)
-    {
-        debug("TRY: %d", i);
-        // make sure the hash and the key both match what's in the node
-        if(node->hash == *hash && tbl->compare(node->key, key) == 0)
-        {
-            // found a match so return it
-            debug("Entered if clause.");
-            return node;
-        }
+    if(tbl->old_slots != NULL
+            && (node = slots_find(tbl, tbl->old_slots, tbl->old_bits, *hash, key)) != NULL)
+        *in_old = 1;
 
-        debug("Skipped if clause.");
-        i++;
-
-        // keep track of the previous node
-        *prev = node;
-
-        // step to the next node in the list
-        debug("Assigning 'node'");
-        node = node->next;
-        debug("Finished assignments.");
-    }
-
-    // return the node
-    // if a match was not found this should return NULL
+    // if a match was not found this returns NULL
     return node;
-
-error:
-    return NULL;
-
-
 }
 
 /**
@@ -332,49 +452,47 @@ error:
  *       void *data - pointer to the data.
  *
  * Expl: Function for setting a hash table node. If a node with the same key
- *          is found, it is completely destroyed and replaced by an entirely new node,
- *          including making sure the old key and data memory are freed.
+ *          is found, its old key and data are freed through the delete callback
+ *          and replaced in place. A new key may not be added to a table while
+ *          it is being traversed.
  */
 int hash_table_set(hash_table_t *tbl, void *key, void *data)
 {
     uint32_t hash = 0;
-    int bucket_num = 0;
+    int in_old = 0;
     hash_table_node_t *old_node = NULL;
-    hash_table_node_t *prev_node = NULL;
-    hash_table_node_t *new_node = NULL;
+    hash_table_node_t new_node;
 
     debug("Entered hash_table_set.");
 
     // look for the old node first
     // even if it doesn't exist, we want the hash value back
-    old_node = hash_table_node_get(tbl, key, &hash, &bucket_num, &prev_node);
+    old_node = hash_table_node_get(tbl, key, &hash, &in_old);
 
-    // create the new node
-    new_node = hash_table_node_create(hash, key, data);
-    check_mem(new_node);
-
-    // if prev_node was set, this node takes the old one's place in the list
-    if(prev_node)
-    {
-        (prev_node)->next = new_node;
-    }
-    else
-    {
-        // this is the first node in the bucket
-        tbl->buckets[bucket_num] = new_node;
-    }
-
-    // if we did find a node with this key
+    // if we did find a node with this key, replace it where it is
     if(old_node)
     {
-        // grab the pointer to the next node in the list
-        new_node->next = old_node->next;
-
-        // destroy the old node
         tbl->delete_cb(old_node);
-        free(old_node);
+        old_node->key = key;
+        old_node->data = data;
+        return 0;
     }
 
+    // adding a key could move nodes under the traversal
+    check(tbl->traversing == 0, "Cannot add a key to a hash table during its traversal.");
+
+    check_mem(hash_table_grow(tbl) == 0);
+
+    memset(&new_node, 0x0, sizeof(new_node));
+    new_node.key = key;
+    new_node.data = data;
+    new_node.hash = hash;
+
+    slots_insert(tbl->slots, tbl->bits, &new_node);
+    tbl->count++;
+
+    hash_table_migrate(tbl, HASH_TABLE_MIGRATE_STEP);
+
     return 0;
 
 error:
@@ -393,10 +511,9 @@ error:
 void *hash_table_get(hash_table_t *tbl, void *key)
 {
     uint32_t hash = 0;
-    int bucket_num = 0;
-    hash_table_node_t *prev_node = NULL;
+    int in_old = 0;
 
-    hash_table_node_t *node = hash_table_node_get(tbl, key, &hash, &bucket_num, &prev_node);
+    hash_table_node_t *node = hash_table_node_get(tbl, key, &hash, &in_old);
     if(!node) return NULL;
 
     debug("Found desired node.");
@@ -413,28 +530,37 @@ void *hash_table_get(hash_table_t *tbl, void *key)
  *
  * Expl: Function for traversing the hash table and calling the callback function
  *          for each populated node that's found. This returns 0 or prints an error
- *          and returns the value returned by the callback function.
+ *          and returns the value returned by the callback function. The callback
+ *          may delete any node, but must not add keys to this table.
  */
 int hash_table_traverse(hash_table_t *tbl, hash_table_traverse_cb traverse_cb, void *cb_arg)
 {
-    int i = 0;
+    uint32_t i = 0;
     int rc = 0;
     hash_table_node_t *node = NULL;
-    hash_table_node_t *next = NULL;
 
-    for(i = 0; i < (tbl->length); i++) {
-        node = tbl->buckets[i];
-        while(node)
-        {
-            // in case the callback is deleting nodes
-            next = node->next;
+    // several threads may traverse a table that nothing is changing
+    __sync_fetch_and_add(&(tbl->traversing), 1);
+
+    for(i = 0; rc == 0 && i < tbl->size; i++)
+    {
+        node = &tbl->slots[i];
+        if(node->dist != 0 && node->key != NULL)
             rc = traverse_cb(node, cb_arg);
-            if(rc != 0) return rc;
-            node = next;
-        }
     }
 
-    return 0;
+    for(i = 0; rc == 0 && tbl->old_slots != NULL && i < tbl->old_size; i++)
+    {
+        node = &tbl->old_slots[i];
+        if(node->dist != 0 && node->key != NULL)
+            rc = traverse_cb(node, cb_arg);
+    }
+
+    // clear out whatever the callback deleted
+    if(__sync_sub_and_fetch(&(tbl->traversing), 1) == 0 && tbl->deleted > 0)
+        hash_table_purge(tbl);
+
+    return rc;
 }
 
 /**
@@ -445,39 +571,390 @@ int hash_table_traverse(hash_table_t *tbl, hash_table_traverse_cb traverse_cb, v
  *
  * Expl: Function for deleting a hash table node. This calls the previously
  *       registered callback function for deleting the key and data stored
- *       in the node and then destroys the node itself.
+ *       in the node and then empties the slot.
  */
 int hash_table_delete(hash_table_t *tbl, void *key)
 {
     uint32_t hash = 0;
-    int bucket_num = 0;
-    hash_table_node_t *prev = NULL;
+    int in_old = 0;
 
     debug("HASH_TABLE_DELETE: entered.");
 
-    hash_table_node_t *node = hash_table_node_get(tbl, key, &hash, &bucket_num, &prev);
+    hash_table_node_t *node = hash_table_node_get(tbl, key, &hash, &in_old);
     if(!node) return -1;
 
     debug("HASH_TABLE_DELETE: Found node.");
 
-    if(prev == NULL)
+    tbl->delete_cb(node);
+
+    if(in_old)
     {
-        // node was the first in this bucket
-        debug("HASH_TABLE_DELETE: Node was first in bucket.");
-        tbl->buckets[bucket_num] = node->next;
+        // the old array is only read until it is freed, so a
+        // tombstone is all it needs
+        node->key = NULL;
+        node->data = NULL;
+        tbl->old_count--;
+    }
+    else if(tbl->traversing)
+    {
+        // leave the slot occupied so nothing moves under the traversal
+        node->key = NULL;
+        node->data = NULL;
+        tbl->count--;
+        tbl->deleted++;
     }
     else
     {
-        // node was anything other than first in this slot
-        debug("HASH_TABLE_DELETE: Node was not first in bucket.");
-        prev->next = node->next;
+        slots_remove(tbl->slots, tbl->bits, node);
+        tbl->count--;
     }
 
-    debug("HASH_TABLE_DELETE: Free memory.");
+    hash_table_migrate(tbl, HASH_TABLE_MIGRATE_STEP);
 
-    tbl->delete_cb(node);
-    free(node);
+    return 0;
+}
+
+#ifdef HAVE_C_UNIT_TESTS
+
+#define UT_HT_KEYS  2048
+
+/* Keys are indexes into ut_ht_keys[] and data is a version number, so
+ * ut_ht_ref[] (the version each key should have, 0 if it is not in the
+ * table) is the reference map the table is checked against.
+*/
+static uint32_t ut_ht_keys[UT_HT_KEYS];
+static uintptr_t ut_ht_ref[UT_HT_KEYS];
+static uint32_t ut_ht_live;
+static uint32_t ut_ht_freed;
+static uint32_t ut_ht_rand_state;
+
+static uint32_t ut_ht_rand(void)
+{
+    ut_ht_rand_state = ut_ht_rand_state * 1103515245U + 12345U;
+    return ut_ht_rand_state >> 8;
+}
+
+static int ut_ht_compare(void *a, void *b)
+{
+    return *(uint32_t *)a != *(uint32_t *)b;
+}
+
+// four keys to each hash value, so probes have to compare keys
+static uint32_t ut_ht_hash(void *key)
+{
+    return *(uint32_t *)key / 4;
+}
+
+// every node deleted or replaced must still hold the current version
+static void ut_ht_delete_cb(hash_table_node_t *node)
+{
+    uint32_t k = *(uint32_t *)node->key;
+
+    CU_ASSERT((uintptr_t)node->data == ut_ht_ref[k]);
+    ut_ht_freed++;
+}
+
+static hash_table_t *ut_ht_create(const uint32_t length)
+{
+    uint32_t i;
+
+    for(i = 0; i < UT_HT_KEYS; i++)
+    {
+        ut_ht_keys[i] = i;
+        ut_ht_ref[i] = 0;
+    }
+    ut_ht_live = 0;
+    ut_ht_freed = 0;
+    ut_ht_rand_state = 1;
+
+    return hash_table_create(length, ut_ht_compare, ut_ht_hash, ut_ht_delete_cb);
+}
 
+static int ut_ht_set(hash_table_t *tbl, const uint32_t k)
+{
+    uint32_t freed = ut_ht_freed;
+    uintptr_t version = ut_ht_ref[k] + 1;
+
+    if(hash_table_set(tbl, &ut_ht_keys[k], (void *)version) != 0)
+        return -1;
+
+    // the old node is freed through the delete callback
+    CU_ASSERT(ut_ht_freed == freed + (ut_ht_ref[k] != 0));
+    if(ut_ht_ref[k] == 0)
+        ut_ht_live++;
+    ut_ht_ref[k] = version;
+    return 0;
+}
+
+static int ut_ht_del(hash_table_t *tbl, const uint32_t k)
+{
+    int res = hash_table_delete(tbl, &ut_ht_keys[k]);
+
+    CU_ASSERT(res == (ut_ht_ref[k] != 0 ? 0 : -1));
+    if(res == 0)
+    {
+        ut_ht_ref[k] = 0;
+        ut_ht_live--;
+    }
+    return res;
+}
+
+// the table holds exactly what the reference map does
+static int ut_ht_matches(hash_table_t *tbl)
+{
+    uint32_t i;
+
+    if(tbl->count + tbl->old_count != ut_ht_live)
+        return 0;
+
+    for(i = 0; i < UT_HT_KEYS; i++)
+        if((uintptr_t)hash_table_get(tbl, &ut_ht_keys[i]) != ut_ht_ref[i])
+            return 0;
+
+    return 1;
+}
+
+// true if the key is still waiting to be moved out of the old array
+static int ut_ht_in_old(hash_table_t *tbl, const uint32_t k)
+{
+    uint32_t i;
+
+    for(i = 0; tbl->old_slots != NULL && i < tbl->old_size; i++)
+        if(tbl->old_slots[i].key == &ut_ht_keys[k])
+            return 1;
     return 0;
 }
 
+// add keys from start until the table starts growing
+static uint32_t ut_ht_fill_to_grow(hash_table_t *tbl, uint32_t start)
+{
+    while(tbl->old_slots == NULL && start < UT_HT_KEYS)
+        CU_ASSERT(ut_ht_set(tbl, start++) == 0);
+    return start;
+}
+
+struct ut_ht_walk {
+    hash_table_t *tbl;
+    uint32_t present[UT_HT_KEYS];
+    uint32_t visited[UT_HT_KEYS];
+    uint32_t deleted;
+};
+
+// visit each node once, deleting every key divisible by 3 (wherever
+// it lives) and replacing every key divisible by 5 in place
+static int ut_ht_walk_cb(hash_table_node_t *node, void *cb_arg)
+{
+    struct ut_ht_walk *walk = cb_arg;
+    uint32_t k = *(uint32_t *)node->key;
+
+    walk->visited[k]++;
+
+    if(k % 3 == 0)
+    {
+        CU_ASSERT(ut_ht_del(walk->tbl, k) == 0);
+        walk->deleted++;
+    }
+    else if(k % 5 == 0)
+        CU_ASSERT(ut_ht_set(walk->tbl, k) == 0);
+
+    // no new keys while nodes must stay put
+    if(k == 7)
+        CU_ASSERT(hash_table_set(walk->tbl, &ut_ht_keys[UT_HT_KEYS - 1], (void *)1) == -1);
+
+    return 0;
+}
+
+static void ut_ht_mem_limit(char *limit)
+{
+    fko_srv_options_t *opts = calloc(1, sizeof(*opts));
+
+    if(opts == NULL)
+        return;
+    opts->config[CONF_MEM_LIMIT] = limit;
+    mem_acct_start(opts);
+    free(opts);
+}
+
+DECLARE_UTEST(ht_reference_map, "hash table matches a reference map through growth")
+{
+    hash_table_t *tbl = ut_ht_create(1);
+    uint32_t i, k, grows = 0, had_old = 0;
+
+    CU_ASSERT_FATAL(tbl != NULL);
+    CU_ASSERT(tbl->size == HASH_TABLE_MIN_SLOTS);
+
+    // mostly adds, so the table keeps growing with deletes and
+    // replacements landing in the middle of each move
+    for(i = 0; i < 20000; i++)
+    {
+        k = ut_ht_rand() % (UT_HT_KEYS - 1);
+
+        if(ut_ht_rand() % 3 == 0)
+            ut_ht_del(tbl, k);
+        else
+            CU_ASSERT(ut_ht_set(tbl, k) == 0);
+
+        if(tbl->old_slots != NULL && ! had_old)
+            grows++;
+        had_old = tbl->old_slots != NULL;
+
+        CU_ASSERT(tbl->count + tbl->deleted <= tbl->size - tbl->size / 8);
+        if(i % 97 == 0)
+            CU_ASSERT(ut_ht_matches(tbl));
+    }
+    CU_ASSERT(grows >= 6);
+    CU_ASSERT(ut_ht_matches(tbl));
+
+    // and back down to nothing
+    for(k = 0; k < UT_HT_KEYS; k++)
+        if(ut_ht_ref[k] != 0)
+            ut_ht_del(tbl, k);
+    CU_ASSERT(ut_ht_live == 0);
+    CU_ASSERT(ut_ht_matches(tbl));
+
+    hash_table_destroy(tbl);
+}
+
+DECLARE_UTEST(ht_set_in_old, "hash table replaces and deletes keys not moved yet")
+{
+    hash_table_t *tbl = ut_ht_create(1);
+    uint32_t k, next, freed;
+
+    CU_ASSERT_FATAL(tbl != NULL);
+
+    next = ut_ht_fill_to_grow(tbl, 0);
+    CU_ASSERT_FATAL(tbl->old_slots != NULL);
+
+    for(k = 0; k < next && ! ut_ht_in_old(tbl, k); k++)
+        ;
+    CU_ASSERT_FATAL(k < next);
+
+    // replacing it leaves it where it is
+    CU_ASSERT(ut_ht_set(tbl, k) == 0);
+    CU_ASSERT(ut_ht_in_old(tbl, k));
+    CU_ASSERT(ut_ht_ref[k] == 2);
+    CU_ASSERT(ut_ht_matches(tbl));
+
+    // deleting the next one still there must stick once it would
+    // have been moved
+    for(k = k + 1; k < next && ! ut_ht_in_old(tbl, k); k++)
+        ;
+    CU_ASSERT_FATAL(k < next);
+    CU_ASSERT(ut_ht_del(tbl, k) == 0);
+    CU_ASSERT(ut_ht_matches(tbl));
+
+    while(tbl->old_slots != NULL)
+        CU_ASSERT(ut_ht_set(tbl, next++) == 0);
+    CU_ASSERT(ut_ht_matches(tbl));
+    CU_ASSERT(hash_table_get(tbl, &ut_ht_keys[k]) == NULL);
+
+    // destroy frees everything still in the table
+    freed = ut_ht_freed;
+    hash_table_destroy(tbl);
+    CU_ASSERT(ut_ht_freed == freed + ut_ht_live);
+}
+
+DECLARE_UTEST(ht_traverse_delete, "hash table traversal may delete while a move is in progress")
+{
+    hash_table_t *tbl = ut_ht_create(1);
+    struct ut_ht_walk *walk = calloc(1, sizeof(*walk));
+    uint32_t k, live;
+
+    CU_ASSERT_FATAL(tbl != NULL && walk != NULL);
+
+    // grow a few times, then stop partway into the next move
+    ut_ht_fill_to_grow(tbl, ut_ht_fill_to_grow(tbl, 0) + 200);
+    CU_ASSERT_FATAL(tbl->old_slots != NULL && tbl->old_count > 0);
+
+    live = ut_ht_live;
+    for(k = 0; k < UT_HT_KEYS; k++)
+        walk->present[k] = ut_ht_ref[k] != 0;
+
+    walk->tbl = tbl;
+    CU_ASSERT(hash_table_traverse(tbl, ut_ht_walk_cb, walk) == 0);
+
+    // every key seen exactly once, wherever it was
+    for(k = 0; k < UT_HT_KEYS; k++)
+        CU_ASSERT(walk->visited[k] == walk->present[k]);
+    CU_ASSERT(walk->deleted > 0 && ut_ht_live == live - walk->deleted);
+
+    // the traversal's tombstones are gone
+    CU_ASSERT(tbl->deleted == 0);
+    CU_ASSERT(ut_ht_matches(tbl));
+
+    // and the move carries on from where it was
+    while(tbl->old_slots != NULL)
+        CU_ASSERT(ut_ht_set(tbl, (ut_ht_rand() % 500) * 3 + 1) == 0);
+    CU_ASSERT(ut_ht_matches(tbl));
+
+    hash_table_destroy(tbl);
+    free(walk);
+}
+
+DECLARE_UTEST(ht_purge_nomem, "hash table works on when a purge or grow cannot allocate")
+{
+    hash_table_t *tbl = ut_ht_create(1);
+    struct ut_ht_walk *walk = calloc(1, sizeof(*walk));
+    char no_mem[] = "1", mem[] = "0";
+    uint32_t k;
+
+    CU_ASSERT_FATAL(tbl != NULL && walk != NULL);
+
+    // finish any move so that the deletes below leave tombstones in
+    // the current array
+    k = ut_ht_fill_to_grow(tbl, ut_ht_fill_to_grow(tbl, 0) + 1);
+    while(tbl->old_slots != NULL)
+        CU_ASSERT(ut_ht_set(tbl, k++) == 0);
+
+    ut_ht_mem_limit(no_mem);
+
+    walk->tbl = tbl;
+    CU_ASSERT(hash_table_traverse(tbl, ut_ht_walk_cb, walk) == 0);
+    CU_ASSERT(tbl->deleted == walk->deleted);
+    CU_ASSERT(ut_ht_matches(tbl));
+
+    // the tombstones are stepped over and shifted like any node
+    for(k = 1; k < 60; k += 3)
+        ut_ht_del(tbl, k);
+    CU_ASSERT(ut_ht_matches(tbl));
+
+    // without memory to grow into, adds carry on until the table is
+    // full and then fail
+    for(k = 0; k < UT_HT_KEYS - 1; k++)
+    {
+        if(ut_ht_ref[k] != 0)
+            continue;
+        if(ut_ht_set(tbl, k) != 0)
+            break;
+    }
+    CU_ASSERT(k < UT_HT_KEYS - 1);
+    CU_ASSERT(tbl->old_slots == NULL);
+    CU_ASSERT(tbl->count + tbl->deleted == tbl->size - 1);
+    CU_ASSERT(ut_ht_matches(tbl));
+
+    // with memory back, the next traversal purges them
+    ut_ht_mem_limit(mem);
+    memset(walk, 0x0, sizeof(*walk));
+    walk->tbl = tbl;
+    CU_ASSERT(hash_table_traverse(tbl, ut_ht_walk_cb, walk) == 0);
+    CU_ASSERT(tbl->deleted == 0);
+    CU_ASSERT(ut_ht_matches(tbl));
+
+    CU_ASSERT(ut_ht_set(tbl, UT_HT_KEYS - 2) == 0 || ut_ht_ref[UT_HT_KEYS - 2] != 0);
+    CU_ASSERT(ut_ht_matches(tbl));
+
+    hash_table_destroy(tbl);
+    free(walk);
+}
+
+int register_ts_hash_table(void)
+{
+    ts_init(&TEST_SUITE(hash_table), TEST_SUITE_DESCR(hash_table), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(hash_table), UTEST_FCT(ht_reference_map), UTEST_DESCR(ht_reference_map));
+    ts_add_utest(&TEST_SUITE(hash_table), UTEST_FCT(ht_set_in_old), UTEST_DESCR(ht_set_in_old));
+    ts_add_utest(&TEST_SUITE(hash_table), UTEST_FCT(ht_traverse_delete), UTEST_DESCR(ht_traverse_delete));
+    ts_add_utest(&TEST_SUITE(hash_table), UTEST_FCT(ht_purge_nomem), UTEST_DESCR(ht_purge_nomem));
+
+    return register_ts(&TEST_SUITE(hash_table));
+}
+#endif /* HAVE_C_UNIT_TESTS */
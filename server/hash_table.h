@@ -21,21 +21,45 @@
 #define DEFAULT_NUMBER_OF_BUCKETS 100
 #define MAX_NUMBER_OF_BUCKETS 100000
 
+/* The table is an open addressing (Robin Hood, linear probing) array of
+ * nodes whose size is a power of two.  It grows when more than 7/8 full:
+ * a table twice the size is allocated and every insert or delete moves
+ * HASH_TABLE_MIGRATE_STEP slots of the old table into it, so no single
+ * call pays for the whole rehash.  Lookups check both tables until the
+ * move is done.
+ */
+#define HASH_TABLE_MIN_SLOTS      8
+#define HASH_TABLE_MIGRATE_STEP   16
+
 typedef int (*hash_table_compare)(void *a, void *b);
 typedef uint32_t (*hash_table_hash_func)(void *key);
 
+/* A slot in the table.  dist is the distance from the slot the hash
+ * points to plus one, 0 marks an empty slot.  A node deleted during a
+ * traversal keeps its dist with a NULL key until the traversal ends, so
+ * nothing moves under the traversal.
+ */
 typedef struct hash_table_node {
     void *key;
     void *data;
     uint32_t hash;
-    struct hash_table_node *next;
+    uint32_t dist;
 } hash_table_node_t;
 
 typedef void (*hash_table_delete_cb)(hash_table_node_t *node);
 
 typedef struct hash_table {
-	hash_table_node_t **buckets;
-    uint32_t length;
+    hash_table_node_t *slots;
+    uint32_t size;
+    uint32_t bits;
+    uint32_t count;
+    uint32_t deleted;
+    hash_table_node_t *old_slots;
+    uint32_t old_size;
+    uint32_t old_bits;
+    uint32_t old_count;
+    uint32_t migrate_pos;
+    int traversing;
     hash_table_compare compare;
     hash_table_hash_func hash_func;
     hash_table_delete_cb delete_cb;
@@ -54,4 +78,8 @@ int hash_table_traverse(hash_table_t *tbl, hash_table_traverse_cb traverse_cb, v
 
 int hash_table_delete(hash_table_t *tbl, void *key);
 
+#ifdef HAVE_C_UNIT_TESTS
+int register_ts_hash_table(void);
+#endif
+
 #endif /* HASH_TABLE_H_ */
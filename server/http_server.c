@@ -0,0 +1,706 @@
+/*
+ *****************************************************************************
+ *
+ * File:    http_server.c
+ *
+ * Purpose: In-process HTTP/1.1 server for fwknopd.  It takes SPA packets
+ *          sent as "GET /<spa>" or as a POST carrying one SPA packet per
+ *          line, on keep-alive connections, and answers each request with
+ *          the verdict for every packet in it.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "http_server.h"
+#include "incoming_spa.h"
+#include "log_msg.h"
+#include "utils.h"
+#include "fko_util.h"
+#include "fwknop_probes.h"
+#include "upgrade.h"
+#include <errno.h>
+#include <time.h>
+
+#if HAVE_SYS_SOCKET_H
+  #include <sys/socket.h>
+#endif
+#if HAVE_ARPA_INET_H
+  #include <arpa/inet.h>
+#endif
+#if HAVE_NETDB
+  #include <netdb.h>
+#endif
+
+#include <fcntl.h>
+
+#ifndef MSG_NOSIGNAL
+  #define MSG_NOSIGNAL 0
+#endif
+
+/* Room for the status line, headers and one verdict line per payload.
+*/
+#define HTTPSERV_RESP_LEN   (256 + HTTPSERV_MAX_BATCH * 10)
+
+/* One accepted connection.  buf holds whatever has been read and not yet
+ * answered, which may be the start of the next (pipelined) request.
+*/
+typedef struct http_conn
+{
+    int                 c_sock;     /* -1 if this slot is free */
+    struct sockaddr_in  caddr;
+    struct sockaddr_in  laddr;
+    struct timespec     deadline;
+    int                 requests;
+    int                 len;
+    char                buf[HTTPSERV_BUF_LEN+1];
+} http_conn_t;
+
+/* The listener state.  There is only ever one HTTP server and it is only
+ * driven from the thread that owns the event loop it is attached to.
+*/
+static int              http_listen_sock = -1;
+static event_loop_t    *http_loop = NULL;
+static fko_srv_options_t *http_opts = NULL;
+static http_conn_t      http_conns[HTTPSERV_MAX_CONNS];
+static spa_pkt_info_t   http_spa_pkts[HTTPSERV_MAX_BATCH];
+
+static int
+set_nonblock(const int sock)
+{
+    int     sfd_flags;
+
+    if((sfd_flags = fcntl(sock, F_GETFL, 0)) < 0)
+        return -1;
+
+    return fcntl(sock, F_SETFL, sfd_flags | O_NONBLOCK);
+}
+
+static void
+http_set_deadline(http_conn_t *conn, const int ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, &(conn->deadline));
+    conn->deadline.tv_sec  += ms / 1000;
+    conn->deadline.tv_nsec += (long)(ms % 1000) * 1000000;
+    if(conn->deadline.tv_nsec >= 1000000000)
+    {
+        conn->deadline.tv_sec++;
+        conn->deadline.tv_nsec -= 1000000000;
+    }
+    return;
+}
+
+static void
+http_conn_close(http_conn_t *conn)
+{
+    event_loop_del_fd(http_loop, conn->c_sock);
+    shutdown(conn->c_sock, SHUT_RDWR);
+    close(conn->c_sock);
+    conn->c_sock = -1;
+    return;
+}
+
+/* Send a complete response.  Responses are small enough to fit in the
+ * socket buffer, so one that cannot be sent in full right away means the
+ * client is not reading and the connection is given up on.  Returns 0 on
+ * success and -1 if the connection should be closed.
+*/
+static int
+http_respond(http_conn_t *conn, const int status, const char *reason,
+        const char *extra_hdrs, const char *body, const int keep_alive)
+{
+    char        resp[HTTPSERV_RESP_LEN];
+    int         len;
+    ssize_t     n;
+
+    len = snprintf(resp, sizeof(resp),
+            "HTTP/1.1 %i %s\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: %i\r\n"
+            "Cache-Control: no-store\r\n"
+            "Connection: %s\r\n"
+            "%s"
+            "\r\n"
+            "%s",
+            status, reason, (int)strlen(body),
+            keep_alive ? "keep-alive" : "close",
+            extra_hdrs, body);
+
+    if(len < 0 || len >= (int)sizeof(resp))
+        return -1;
+
+    n = send(conn->c_sock, resp, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if(n != len)
+        return -1;
+
+    return keep_alive ? 0 : -1;
+}
+
+/* Find a header in the NUL terminated header block and return its value
+ * (with leading blanks skipped) and length, or NULL if it is not there.
+*/
+static const char *
+http_header(const char *hdrs, const char *name, int *val_len)
+{
+    const char *line, *end;
+    size_t      name_len = strlen(name);
+
+    for(line = hdrs; line != NULL && *line != '\0'; line = end)
+    {
+        if((end = strstr(line, "\r\n")) != NULL)
+            end += 2;
+
+        if(strncasecmp(line, name, name_len) != 0 || line[name_len] != ':')
+            continue;
+
+        line += name_len + 1;
+        while(*line == ' ' || *line == '\t')
+            line++;
+
+        *val_len = end != NULL ? (int)(end - 2 - line) : (int)strlen(line);
+        while(*val_len > 0 && (line[*val_len-1] == ' ' || line[*val_len-1] == '\t'))
+            (*val_len)--;
+        return line;
+    }
+
+    return NULL;
+}
+
+/* Queue one SPA payload (standard or URL-safe base64, ending at the first
+ * whitespace or at data_len) for processing.  Returns its index in
+ * http_spa_pkts, or -1 if it cannot be SPA data.
+*/
+static int
+http_add_payload(http_conn_t *conn, const char *data, const int data_len,
+        int *num_pkts)
+{
+    spa_pkt_info_t *spa_pkt = &(http_spa_pkts[*num_pkts]);
+    int             len, valid = 1;
+
+    if(data_len < MIN_SPA_DATA_SIZE || data_len > MAX_SPA_PACKET_LEN)
+        return -1;
+
+    memcpy(spa_pkt->packet_buf, data, data_len);
+    len = b64_url_scan(spa_pkt->packet_buf, data_len, &valid);
+    spa_pkt->packet_buf[len] = '\0';
+
+    if(! valid || len < MIN_SPA_DATA_SIZE)
+        return -1;
+
+    spa_pkt->packet_data     = spa_pkt->packet_buf;
+    spa_pkt->packet_data_len = len;
+    spa_pkt->packet_proto    = IPPROTO_TCP;
+    spa_pkt->packet_src_ip   = conn->caddr.sin_addr.s_addr;
+    spa_pkt->packet_dst_ip   = conn->laddr.sin_addr.s_addr;
+    spa_addr_set_ipv4(&spa_pkt->packet_src_addr, spa_pkt->packet_src_ip);
+    spa_addr_set_ipv4(&spa_pkt->packet_dst_addr, spa_pkt->packet_dst_ip);
+    spa_pkt->packet_src_port = ntohs(conn->caddr.sin_port);
+    spa_pkt->packet_dst_port = ntohs(conn->laddr.sin_port);
+    spa_pkt->sdp_id          = 0;
+    spa_pkt->cluster_origin  = 0;
+    spa_pkt->cluster_token   = 0;
+    spa_pkt->arrival_time    = clock_cache_update();
+    spa_pkt->verdict         = FWKNOP_VERDICT_DROPPED;
+
+    FWKNOP_PROBE2(pkt_receive, spa_pkt, len);
+
+    return (*num_pkts)++;
+}
+
+static const char *
+http_verdict_str(const int verdict)
+{
+    switch(verdict)
+    {
+        case FWKNOP_VERDICT_GRANTED:
+            return "granted";
+        case FWKNOP_VERDICT_DENIED:
+            return "denied";
+        case FWKNOP_VERDICT_REPLAY:
+            return "replay";
+        case FWKNOP_VERDICT_QUEUED:
+            return "queued";
+        default:
+            return "invalid";
+    }
+}
+
+/* Answer the request at the front of conn->buf if all of it is there.
+ * Returns the number of bytes it took up, 0 if more has to be read first,
+ * and -1 if the connection should be closed.
+*/
+static int
+http_handle_request(http_conn_t *conn)
+{
+    char           *hdr_end, *hdrs, *method, *target, *version;
+    char           *body, *line, *line_end;
+    const char     *val;
+    char            resp_body[HTTPSERV_RESP_LEN];
+    int             idx[HTTPSERV_MAX_BATCH];
+    int             val_len, hdr_len, body_len = 0, keep_alive;
+    int             num_payloads = 0, num_pkts = 0, status, i, verdict;
+    char            sipbuf[MAX_IPV4_STR_LEN] = {0};
+
+    conn->buf[conn->len] = '\0';
+
+    /* Wait for the header block and then for the body it announces.  A
+     * NUL byte ends the search early, and is not valid in a request.
+    */
+    if((hdr_end = strstr(conn->buf, "\r\n\r\n")) == NULL)
+    {
+        if(conn->len >= HTTPSERV_BUF_LEN || (int)strlen(conn->buf) < conn->len)
+            return http_respond(conn, 400, "Bad Request", "", "", 0);
+        return 0;
+    }
+    *hdr_end = '\0';
+    hdr_len  = hdr_end - conn->buf + 4;
+    body     = hdr_end + 4;
+
+    if(http_header(conn->buf, "Transfer-Encoding", &val_len) != NULL)
+        return http_respond(conn, 411, "Length Required", "", "", 0);
+
+    if((val = http_header(conn->buf, "Content-Length", &val_len)) != NULL)
+    {
+        if(val_len == 0)
+            return http_respond(conn, 400, "Bad Request", "", "", 0);
+
+        for(i=0; i < val_len; i++)
+        {
+            if(val[i] < '0' || val[i] > '9' || body_len > HTTPSERV_BUF_LEN)
+                return http_respond(conn, 400, "Bad Request", "", "", 0);
+            body_len = body_len * 10 + (val[i] - '0');
+        }
+    }
+
+    if(hdr_len + body_len > HTTPSERV_BUF_LEN)
+        return http_respond(conn, 413, "Payload Too Large", "", "", 0);
+
+    if(conn->len < hdr_len + body_len)
+    {
+        *hdr_end = '\r';
+        return 0;
+    }
+
+    /* The request line
+    */
+    method = conn->buf;
+    if((hdrs = strstr(method, "\r\n")) != NULL)
+    {
+        *hdrs = '\0';
+        hdrs += 2;
+    }
+    else
+        hdrs = hdr_end;
+
+    if((target = strchr(method, ' ')) == NULL)
+        return http_respond(conn, 400, "Bad Request", "", "", 0);
+    *target++ = '\0';
+    if((version = strchr(target, ' ')) == NULL)
+        return http_respond(conn, 400, "Bad Request", "", "", 0);
+    *version++ = '\0';
+
+    if(strcmp(version, "HTTP/1.1") == 0)
+        keep_alive = 1;
+    else if(strcmp(version, "HTTP/1.0") == 0)
+        keep_alive = 0;
+    else
+        return http_respond(conn, 505, "HTTP Version Not Supported", "", "", 0);
+
+    if((val = http_header(hdrs, "Connection", &val_len)) != NULL)
+    {
+        if(val_len == 5 && strncasecmp(val, "close", 5) == 0)
+            keep_alive = 0;
+        else if(val_len == 10 && strncasecmp(val, "keep-alive", 10) == 0)
+            keep_alive = 1;
+    }
+
+    if(++conn->requests >= HTTPSERV_MAX_REQUESTS)
+        keep_alive = 0;
+
+    /* Pick out the SPA payloads: the path of a GET, or each line of the
+     * body of a POST.
+    */
+    if(strcmp(method, "GET") == 0)
+    {
+        if(*target != '/')
+            return http_respond(conn, 400, "Bad Request", "", "", 0);
+        target++;
+        idx[num_payloads++] = http_add_payload(conn, target,
+                strcspn(target, "?#"), &num_pkts);
+    }
+    else if(strcmp(method, "POST") == 0)
+    {
+        for(line = body; line < body + body_len; line = line_end + 1)
+        {
+            if((line_end = memchr(line, '\n', body + body_len - line)) == NULL)
+                line_end = body + body_len;
+
+            while(line < line_end && isspace((unsigned char)*line))
+                line++;
+            if(line == line_end)
+                continue;
+
+            if(num_payloads == HTTPSERV_MAX_BATCH)
+                return http_respond(conn, 413, "Payload Too Large", "", "", 0);
+
+            idx[num_payloads++] = http_add_payload(conn, line,
+                    line_end - line, &num_pkts);
+        }
+        if(num_payloads == 0)
+            return http_respond(conn, 400, "Bad Request", "", "", 0);
+    }
+    else
+        return http_respond(conn, 405, "Method Not Allowed",
+                "Allow: GET, POST\r\n", "", 0);
+
+    if(http_opts->verbose)
+    {
+        inet_ntop(AF_INET, &(conn->caddr.sin_addr.s_addr), sipbuf, MAX_IPV4_STR_LEN);
+        log_msg(LOG_INFO, "http_server: Got %i SPA packet(s) in a %s from: %s",
+                num_payloads, method, sipbuf);
+    }
+
+    if(num_pkts > 0)
+        incoming_spa_batch(http_opts, http_spa_pkts, num_pkts);
+
+    /* One verdict per payload, in request order.  A GET also carries its
+     * verdict in the status code.
+    */
+    resp_body[0] = '\0';
+    verdict = FWKNOP_VERDICT_DROPPED;
+    for(i=0; i < num_payloads; i++)
+    {
+        verdict = idx[i] < 0 ? FWKNOP_VERDICT_DROPPED
+                             : http_spa_pkts[idx[i]].verdict;
+        strlcat(resp_body, http_verdict_str(verdict), sizeof(resp_body));
+        strlcat(resp_body, "\n", sizeof(resp_body));
+    }
+
+    if(strcmp(method, "POST") == 0)
+        status = 200;
+    else if(verdict == FWKNOP_VERDICT_GRANTED)
+        status = 200;
+    else if(verdict == FWKNOP_VERDICT_QUEUED)
+        status = 202;
+    else if(verdict == FWKNOP_VERDICT_DROPPED)
+        status = 400;
+    else
+        status = 403;
+
+    if(http_respond(conn, status,
+            status == 200 ? "OK" : status == 202 ? "Accepted"
+                : status == 400 ? "Bad Request" : "Forbidden",
+            "", resp_body, keep_alive) != 0)
+        return -1;
+
+    return hdr_len + body_len;
+}
+
+/* Read what the client has sent so far and answer every complete request
+ * in it.
+*/
+static int
+http_conn_read_handler(int c_sock, void *arg)
+{
+    http_conn_t    *conn = (http_conn_t *)arg;
+    ssize_t         n;
+    int             used;
+
+    n = recv(c_sock, conn->buf + conn->len, HTTPSERV_BUF_LEN - conn->len, 0);
+
+    if(n < 0)
+    {
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return EVENT_LOOP_CONTINUE;
+
+        http_conn_close(conn);
+        return EVENT_LOOP_CONTINUE;
+    }
+
+    if(n == 0)
+    {
+        http_conn_close(conn);
+        return EVENT_LOOP_CONTINUE;
+    }
+
+    /* The clock for a request starts with its first byte.
+    */
+    if(conn->len == 0)
+        http_set_deadline(conn, HTTPSERV_READ_TIMEOUT);
+    conn->len += n;
+
+    while(conn->len > 0 && (used = http_handle_request(conn)) != 0)
+    {
+        if(used < 0)
+        {
+            http_conn_close(conn);
+            return EVENT_LOOP_CONTINUE;
+        }
+
+        conn->len -= used;
+        memmove(conn->buf, conn->buf + used, conn->len);
+        http_set_deadline(conn, conn->len > 0
+                ? HTTPSERV_READ_TIMEOUT : HTTPSERV_IDLE_TIMEOUT);
+    }
+
+    return EVENT_LOOP_CONTINUE;
+}
+
+/* Accept every pending connection and start reading from each of them.
+*/
+static int
+http_accept_handler(int s_sock, void *arg)
+{
+    struct sockaddr_in  caddr;
+    socklen_t           clen;
+    http_conn_t        *conn;
+    int                 c_sock, i;
+
+    while(1)
+    {
+        clen = sizeof(caddr);
+
+        if((c_sock = accept(s_sock, (struct sockaddr *) &caddr, &clen)) < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR
+                    || errno == ECONNABORTED)
+                return EVENT_LOOP_CONTINUE;
+
+            log_msg(LOG_ERR, "http_server: accept() failed: %s",
+                strerror(errno));
+            return EVENT_LOOP_CONTINUE;
+        }
+
+        conn = NULL;
+        for(i=0; i < HTTPSERV_MAX_CONNS; i++)
+        {
+            if(http_conns[i].c_sock < 0)
+            {
+                conn = &(http_conns[i]);
+                break;
+            }
+        }
+
+        if(conn == NULL)
+        {
+            log_msg(LOG_WARNING,
+                "http_server: too many open connections (max %i), dropping one",
+                HTTPSERV_MAX_CONNS);
+            close(c_sock);
+            continue;
+        }
+
+        conn->caddr    = caddr;
+        conn->requests = 0;
+        conn->len      = 0;
+        clen = sizeof(conn->laddr);
+        getsockname(c_sock, (struct sockaddr *) &(conn->laddr), &clen);
+
+        http_set_deadline(conn, HTTPSERV_READ_TIMEOUT);
+
+        if(set_nonblock(c_sock) < 0
+                || event_loop_add_fd(http_loop, c_sock,
+                    http_conn_read_handler, conn) != 0)
+        {
+            close(c_sock);
+            continue;
+        }
+        conn->c_sock = c_sock;
+    }
+
+    return EVENT_LOOP_CONTINUE;
+}
+
+/* Close connections whose request did not arrive in time, or that have
+ * been idle for longer than HTTPSERV_IDLE_TIMEOUT.
+*/
+static int
+http_deadline_timer(int fd, void *arg)
+{
+    struct timespec     now;
+    int                 i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for(i=0; i < HTTPSERV_MAX_CONNS; i++)
+    {
+        if(http_conns[i].c_sock < 0)
+            continue;
+
+        if(now.tv_sec > http_conns[i].deadline.tv_sec
+                || (now.tv_sec == http_conns[i].deadline.tv_sec
+                    && now.tv_nsec >= http_conns[i].deadline.tv_nsec))
+        {
+            if(http_conns[i].len > 0)
+                http_respond(&(http_conns[i]), 408, "Request Timeout", "", "", 0);
+            http_conn_close(&(http_conns[i]));
+        }
+    }
+
+    return EVENT_LOOP_CONTINUE;
+}
+
+/* Create the listening socket.
+*/
+static int
+http_listen_socket(const unsigned short port)
+{
+    int                 s_sock, reuse_addr = 1;
+    struct sockaddr_in  saddr;
+
+    if ((s_sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+    {
+        log_msg(LOG_ERR, "start_http_server: socket() failed: %s",
+            strerror(errno));
+        return -1;
+    }
+
+    /* So that we can re-bind to it without TIME_WAIT problems
+    */
+    if(setsockopt(s_sock, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof(reuse_addr)) == -1)
+    {
+        log_msg(LOG_ERR, "start_http_server: setsockopt error: %s",
+            strerror(errno));
+        close(s_sock);
+        return -1;
+    }
+
+    /* Make our main socket non-blocking so we don't have to be stuck on
+     * listening for incoming connections.
+    */
+    if(set_nonblock(s_sock) < 0)
+    {
+        log_msg(LOG_ERR, "start_http_server: fcntl error setting O_NONBLOCK: %s",
+            strerror(errno));
+        close(s_sock);
+        return -1;
+    }
+
+    /* Construct local address structure */
+    memset(&saddr, 0, sizeof(saddr));
+    saddr.sin_family      = AF_INET;           /* Internet address family */
+    saddr.sin_addr.s_addr = htonl(INADDR_ANY); /* Any incoming interface */
+    saddr.sin_port        = htons(port);       /* Local port */
+
+    /* Bind to the local address */
+    if (bind(s_sock, (struct sockaddr *) &saddr, sizeof(saddr)) < 0)
+    {
+        log_msg(LOG_ERR, "start_http_server: bind() failed: %s",
+            strerror(errno));
+        close(s_sock);
+        return -1;
+    }
+
+    /* Mark the socket so it will listen for incoming connections
+    */
+    if (listen(s_sock, HTTPSERV_MAX_CONNS) < 0)
+    {
+        log_msg(LOG_ERR, "start_http_server: listen() failed: %s",
+            strerror(errno));
+        close(s_sock);
+        return -1;
+    }
+
+    return s_sock;
+}
+
+/* Start the HTTP server and attach it to the given event loop.  Returns 0
+ * on success and -1 on error.
+*/
+int
+start_http_server(fko_srv_options_t *opts, event_loop_t *loop)
+{
+    int                 s_sock, i, is_err;
+    unsigned short      port;
+
+    port = strtol_wrapper(opts->config[CONF_HTTPSERV_PORT],
+            1, MAX_PORT, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid HTTPSERV_PORT value.");
+        return -1;
+    }
+    log_msg(LOG_INFO, "Kicking off HTTP server to listen on port %i.", port);
+
+    /* Now, let's make an HTTP server, or carry on with the listener handed
+     * over by the fwknopd we are upgrading.
+    */
+    if((s_sock = upgrade_take_socket(SOCK_STREAM, port, NULL)) < 0
+            && (s_sock = http_listen_socket(port)) < 0)
+        return -1;
+
+    for(i=0; i < HTTPSERV_MAX_CONNS; i++)
+        http_conns[i].c_sock = -1;
+
+    if(event_loop_add_fd(loop, s_sock, http_accept_handler, NULL) != 0
+            || event_loop_add_timer(loop, HTTPSERV_DEADLINE_CHECK_INTERVAL,
+                http_deadline_timer, NULL) != 0)
+    {
+        event_loop_del_fd(loop, s_sock);
+        close(s_sock);
+        return -1;
+    }
+
+    upgrade_add_socket(s_sock);
+
+    http_listen_sock = s_sock;
+    http_loop        = loop;
+    http_opts        = opts;
+
+    /* Let the pcap path know that SPA packets to this port are already
+     * taken care of.
+    */
+    opts->http_server_port = port;
+
+    return 0;
+}
+
+/* Close the listener and any connections still open.  The caller still
+ * owns (and destroys) the event loop.
+*/
+void
+stop_http_server(fko_srv_options_t *opts)
+{
+    int     i;
+
+    if(http_listen_sock < 0)
+        return;
+
+    for(i=0; i < HTTPSERV_MAX_CONNS; i++)
+        if(http_conns[i].c_sock >= 0)
+            http_conn_close(&(http_conns[i]));
+
+    event_loop_del_fd(http_loop, http_listen_sock);
+    upgrade_del_socket(http_listen_sock);
+    close(http_listen_sock);
+
+    http_listen_sock = -1;
+    http_loop        = NULL;
+    http_opts        = NULL;
+
+    opts->http_server_port = 0;
+
+    return;
+}
+
+/***EOF***/
@@ -0,0 +1,65 @@
+/*
+ *****************************************************************************
+ *
+ * File:    http_server.h
+ *
+ * Purpose: Header file for http_server.c.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef HTTP_SERVER_H
+#define HTTP_SERVER_H
+
+#include "event_loop.h"
+
+/* Maximum number of connections served at the same time (they share the
+ * event loop's EVENT_LOOP_MAX_FDS with the other listeners), and the most
+ * a single request may take up, headers and body.
+*/
+#define HTTPSERV_MAX_CONNS              16
+#define HTTPSERV_BUF_LEN                16384
+
+/* How long (in milliseconds) a client has to send a complete request,
+ * how long an idle keep-alive connection is kept open, and how often
+ * those deadlines are checked.
+*/
+#define HTTPSERV_READ_TIMEOUT           2000
+#define HTTPSERV_IDLE_TIMEOUT           15000
+#define HTTPSERV_DEADLINE_CHECK_INTERVAL 100
+
+/* The most requests served on one connection before it is closed, and
+ * the most SPA payloads one POST may carry (one per line).  A POST is
+ * processed as a single incoming_spa_batch().
+*/
+#define HTTPSERV_MAX_REQUESTS           1000
+#define HTTPSERV_MAX_BATCH              64
+
+/* Function prototypes
+*/
+int start_http_server(fko_srv_options_t *opts, event_loop_t *loop);
+void stop_http_server(fko_srv_options_t *opts);
+
+#endif /* HTTP_SERVER_H */
+
+/***EOF***/
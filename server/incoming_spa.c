@@ -35,9 +35,12 @@
   #include <sys/wait.h>
 #endif
 
+#include <openssl/sha.h>
+
 #include "incoming_spa.h"
 #include "service.h"
 #include "access.h"
+#include "acc_lazy.h"
 #include "extcmd.h"
 #include "cmd_cycle.h"
 #include "log_msg.h"
@@ -45,12 +48,46 @@
 #include "fw_util.h"
 #include "fwknopd_errors.h"
 #include "replay_cache.h"
+#include "replay_gossip.h"
+#include "cluster.h"
+#include "ha_sync.h"
 #include "bstrlib.h"
+#include "benchmark.h"
+#include "metrics.h"
+#include "flight_recorder.h"
+#include "spa_trace.h"
+#include "spa_shed.h"
+#include "authz_cache.h"
+#include "spa_workers.h"
+#include "fw_commit.h"
+#include "rate_limit.h"
+#include "grant_quota.h"
+#include "spa_arena.h"
+#include "rcu.h"
+#include "fwknop_probes.h"
 
 #define CTX_DUMP_BUFSIZE            4096                /*!< Maximum size allocated to a FKO context dump */
 #define KEEP_SEARCHING 1
 #define STOP_SEARCHING 0
 
+/* A fwknopd configured with --enable-sdp-fastpath only serves SDP mode
+ * clients using Rijndael with HMAC-SHA256 (config_init.c and access.c
+ * refuse anything else), so for it these are constants and the compiler
+ * drops the legacy stanza loop, GPG handling and other HMAC types from
+ * the packet path.
+*/
+#if SDP_FASTPATH
+  #define SPA_SDP_MODE(opts)        1
+  #define SPA_USE_GPG(acc)          0
+  #define SPA_HMAC_TYPE(acc)        FKO_HMAC_SHA256
+  #define SPA_ENC_MODE(acc)         FKO_ENC_MODE_CBC
+#else
+  #define SPA_SDP_MODE(opts)        ((opts)->rt->sdp_mode)
+  #define SPA_USE_GPG(acc)          ((acc)->use_gpg)
+  #define SPA_HMAC_TYPE(acc)        ((acc)->hmac_type)
+  #define SPA_ENC_MODE(acc)         ((acc)->encryption_mode)
+#endif
+
 /* Validate and in some cases preprocess/reformat the SPA data.  Return an
  * error code value if there is any indication the data is not valid spa data.
 */
@@ -58,20 +95,12 @@ static int
 preprocess_spa_data(const fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt)
 {
 
-    char    *ndx = (char *)&(spa_pkt->packet_data);
-    char    *decoded_sdp_id = NULL;
-    char    *encoded_sdp_id = NULL;
-    int      i, pkt_data_len = 0;
+    const char *pkt_data = (const char *)spa_pkt->packet_data;
+    int      i, valid = 1, pkt_data_len = 0;
     uint32_t sdp_id = 0;
 
     pkt_data_len = spa_pkt->packet_data_len;
 
-    /* At this point, we can reset the packet data length to 0.  This is our
-     * indicator to the rest of the program that we do not have a current
-     * spa packet to process (after this one that is).
-    */
-    spa_pkt->packet_data_len = 0;
-
     /* These two checks are already done in process_packet(), but this is a
      * defensive measure to run them again here
     */
@@ -88,56 +117,50 @@ preprocess_spa_data(const fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt)
      * a prefix after the outer one is stripped off won't decrypt properly
      * anyway because libfko would not add a new one.
     */
-    if(constant_runtime_cmp(ndx, B64_RIJNDAEL_SALT, B64_RIJNDAEL_SALT_STR_LEN) == 0)
+    if(constant_runtime_cmp(pkt_data, B64_RIJNDAEL_SALT, B64_RIJNDAEL_SALT_STR_LEN) == 0)
         return(SPA_MSG_BAD_DATA);
 
     if(pkt_data_len > MIN_GNUPG_MSG_SIZE
-            && constant_runtime_cmp(ndx, B64_GPG_PREFIX, B64_GPG_PREFIX_STR_LEN) == 0)
+            && constant_runtime_cmp(pkt_data, B64_GPG_PREFIX, B64_GPG_PREFIX_STR_LEN) == 0)
         return(SPA_MSG_BAD_DATA);
 
     /* Detect and parse out SPA data from an HTTP request. If the SPA data
      * starts with "GET /" and the user agent starts with "Fwknop", then
-     * assume it is a SPA over HTTP request.
+     * assume it is a SPA over HTTP request.  The packet data is borrowed
+     * from the capture buffer and is not NUL terminated, so this is the
+     * one case where it is copied (into packet_buf) before being looked at
+     * as a string and rewritten.
     */
-    if(strncasecmp(opts->config[CONF_ENABLE_SPA_OVER_HTTP], "Y", 1) == 0
-      && strncasecmp(ndx, "GET /", 5) == 0
-      && strstr(ndx, "User-Agent: Fwknop") != NULL)
+    if(opts->rt->spa_over_http
+      && strncasecmp(pkt_data, "GET /", 5) == 0)
     {
-        /* This looks like an HTTP request, so let's see if we are
-         * configured to accept such request and if so, find the SPA
-         * data.
-        */
+        memcpy(spa_pkt->packet_buf, pkt_data, pkt_data_len);
+        spa_pkt->packet_buf[pkt_data_len] = '\0';
+
+        if(strstr((char *)spa_pkt->packet_buf, "User-Agent: Fwknop") == NULL)
+            return(SPA_MSG_NOT_SPA_DATA);
 
         /* Now extract, adjust (convert characters translated by the fwknop
-         * client), and reset the SPA message itself.
+         * client), and reset the SPA message itself.  The first space
+         * marks the end of the request, and the base64 check is done in
+         * the same pass.
         */
-        strlcpy((char *)spa_pkt->packet_data, ndx+5, pkt_data_len);
         pkt_data_len -= 5;
-
-        for(i=0; i<pkt_data_len; i++)
-        {
-            if(isspace(*ndx)) /* The first space marks the end of the req */
-            {
-                *ndx = '\0';
-                break;
-            }
-            else if(*ndx == '-') /* Convert '-' to '+' */
-                *ndx = '+';
-            else if(*ndx == '_') /* Convert '_' to '/' */
-                *ndx = '/';
-
-            ndx++;
-        }
+        i = b64_url_scan(spa_pkt->packet_buf + 5, pkt_data_len, &valid);
+        spa_pkt->packet_buf[5 + i] = '\0';
 
         if(i < MIN_SPA_DATA_SIZE)
             return(SPA_MSG_BAD_DATA);
 
+        spa_pkt->packet_data     = spa_pkt->packet_buf + 5;
         spa_pkt->packet_data_len = pkt_data_len = i;
     }
+    else
+        valid = is_base64(spa_pkt->packet_data, pkt_data_len);
 
     /* Require base64-encoded data
     */
-    if(! is_base64(spa_pkt->packet_data, pkt_data_len))
+    if(! valid)
         return(SPA_MSG_NOT_SPA_DATA);
 
 
@@ -148,39 +171,19 @@ preprocess_spa_data(const fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt)
 
     /* If this is SDP mode
      */
-    if(strncasecmp(opts->config[CONF_DISABLE_SDP_MODE], "N", 1) == 0)
+    if(SPA_SDP_MODE(opts))
     {
-        // make space for the decoded string, really need 5 bytes, but 8 will work
-        decoded_sdp_id = calloc(1, FKO_SDP_ID_SIZE*2);
-        if(decoded_sdp_id == NULL)
-            return(FKO_ERROR_MEMORY_ALLOCATION);
-
-        // Copy out the SDP client ID, NOT extracting yet
-        encoded_sdp_id = strndup((char *)(spa_pkt->packet_data), B64_SDP_ID_STR_LEN);
-
-        // decode from b64 to original data
-        if(1 > fko_base64_decode(encoded_sdp_id, (unsigned char*)decoded_sdp_id))
-        {
-            // decode returned error or at least a zero-length string
-            free(encoded_sdp_id);
-            free(decoded_sdp_id);
+        // The client ID is the fixed width field at the front of the
+        // packet; decode it in place, NOT extracting yet
+        if(fko_decode_sdp_id((const char *)spa_pkt->packet_data, &sdp_id) != FKO_SUCCESS)
             return(SPA_MSG_NOT_SPA_DATA);
-        }
-        free(encoded_sdp_id);
 
-        // copy to a proper uint32_t
-        memcpy((void*)(&sdp_id), decoded_sdp_id, FKO_SDP_ID_SIZE);
         if(sdp_id == 0)
         {
             // client ID must not be zero
-            free(decoded_sdp_id);
             return(SPA_MSG_NOT_SPA_DATA);
         }
         spa_pkt->sdp_id = sdp_id;
-        free(decoded_sdp_id);
-
-        // make a string version too
-        snprintf(spa_pkt->sdp_id_str, MAX_SDP_ID_STR_LEN, "%"PRIu32, sdp_id);
     }
 
     return(FKO_SUCCESS);
@@ -188,89 +191,18 @@ preprocess_spa_data(const fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt)
 
 /* For replay attack detection
 */
-static int
-get_raw_digest(char **digest, char *pkt_data)
+static void
+get_raw_digest(spa_pkt_info_t *spa_pkt)
 {
-    fko_ctx_t    ctx = NULL;
-    char        *tmp_digest = NULL;
-    int          res = FKO_SUCCESS;
-    short        raw_digest_type = -1;
-
-    /* initialize an FKO context with no decryption key just so
-     * we can get the outer message digest
-    */
-    res = fko_new_with_data(&ctx, (char *)pkt_data, NULL, 0,
-            FKO_DEFAULT_ENC_MODE, NULL, 0, 0, 0);
-
-    if(res != FKO_SUCCESS)
-    {
-        log_msg(LOG_WARNING, "Error initializing FKO context from SPA data: %s",
-            fko_errstr(res));
-        fko_destroy(ctx);
-        ctx = NULL;
-        return(SPA_MSG_FKO_CTX_ERROR);
-    }
-
-    res = fko_set_raw_spa_digest_type(ctx, FKO_DEFAULT_DIGEST);
-    if(res != FKO_SUCCESS)
-    {
-        log_msg(LOG_WARNING, "Error setting digest type for SPA data: %s",
-            fko_errstr(res));
-        fko_destroy(ctx);
-        ctx = NULL;
-        return(SPA_MSG_DIGEST_ERROR);
-    }
-
-    res = fko_get_raw_spa_digest_type(ctx, &raw_digest_type);
-    if(res != FKO_SUCCESS)
-    {
-        log_msg(LOG_WARNING, "Error getting digest type for SPA data: %s",
-            fko_errstr(res));
-        fko_destroy(ctx);
-        ctx = NULL;
-        return(SPA_MSG_DIGEST_ERROR);
-    }
-
-    /* Make sure the digest type is what we expect
+    /* Hash the outer message straight out of the packet buffer into the
+     * binary replay key.  This is the same SHA-256 as the base64 raw SPA
+     * digest, without a heap copy or the base64 round trip.
     */
-    if(raw_digest_type != FKO_DEFAULT_DIGEST)
-    {
-        log_msg(LOG_WARNING, "Error setting digest type for SPA data: %s",
-            fko_errstr(res));
-        fko_destroy(ctx);
-        ctx = NULL;
-        return(SPA_MSG_DIGEST_ERROR);
-    }
-
-    res = fko_set_raw_spa_digest(ctx);
-    if(res != FKO_SUCCESS)
-    {
-        log_msg(LOG_WARNING, "Error setting digest for SPA data: %s",
-            fko_errstr(res));
-        fko_destroy(ctx);
-        ctx = NULL;
-        return(SPA_MSG_DIGEST_ERROR);
-    }
-
-    res = fko_get_raw_spa_digest(ctx, &tmp_digest);
-    if(res != FKO_SUCCESS)
-    {
-        log_msg(LOG_WARNING, "Error getting digest from SPA data: %s",
-            fko_errstr(res));
-        fko_destroy(ctx);
-        ctx = NULL;
-        return(SPA_MSG_DIGEST_ERROR);
-    }
+    SHA256(spa_pkt->packet_data, spa_pkt->packet_data_len,
+        spa_pkt->replay_digest);
+    spa_pkt->replay_digest_set = 1;
 
-    *digest = strdup(tmp_digest);
-
-    if (*digest == NULL)
-        res = SPA_MSG_ERROR;  /* really a strdup() memory allocation problem */
-
-    fko_destroy(ctx);
-    ctx = NULL;
-
-    return res;
+    return;
 }
 
 /* Popluate a spa_data struct from an initialized (and populated) FKO context.
@@ -329,17 +261,15 @@ check_pkt_age(const fko_srv_options_t *opts, spa_data_t *spadat,
         const int stanza_num, const int conf_pkt_age)
 {
     int         ts_diff;
-    time_t      now_ts;
 
-    if(strncasecmp(opts->config[CONF_ENABLE_SPA_PACKET_AGING], "Y", 1) == 0)
+    if(opts->rt->spa_packet_aging)
     {
-        time(&now_ts);
-
-        ts_diff = labs(now_ts - spadat->timestamp);
+        ts_diff = labs(spadat->arrival_time - spadat->timestamp);
 
         if(ts_diff > conf_pkt_age)
         {
-            log_msg(LOG_WARNING, "[%s] (stanza #%d) SPA data time difference is too great (%i seconds).",
+            log_msg(LOG_WARNING | LOG_RATE_LIMIT,
+                "[%s] (stanza #%d) SPA data time difference is too great (%i seconds).",
                 spadat->pkt_source_ip, stanza_num, ts_diff);
             return 0;
         }
@@ -347,47 +277,62 @@ check_pkt_age(const fko_srv_options_t *opts, spa_data_t *spadat,
     return 1;
 }
 
+/* The expiration schedule (see acc_expire.c) flags a stanza once its
+ * ACCESS_EXPIRE time has passed, so only the flag is checked here.
+*/
 static int
 check_stanza_expiration(acc_stanza_t *acc, spa_data_t *spadat,
         const int stanza_num)
 {
-    if(acc->access_expire_time > 0)
+    if(acc->expired)
     {
-        if(acc->expired)
-        {
-            return 0;
-        }
-        else
-        {
-            if(time(NULL) > acc->access_expire_time)
-            {
-                log_msg(LOG_INFO, "[%s] (stanza #%d) Access stanza has expired",
-                    spadat->pkt_source_ip, stanza_num);
-                acc->expired = 1;
-                return 0;
-            }
-        }
+        log_msg(LOG_DEBUG, "[%s] (stanza #%d) Access stanza has expired",
+            spadat->pkt_source_ip, stanza_num);
+        return 0;
     }
     return 1;
 }
 
 /* Check for access.conf stanza SOURCE match based on SPA packet
- * source IP
+ * source IP.  The matching stanzas are looked up in the SOURCE index and
+ * returned in *cands (see acc_stanza_candidates()).
 */
 static int
-src_check(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt, spa_data_t *spadat)
+src_check(const acc_stanza_index_t *idx, spa_pkt_info_t *spa_pkt,
+        spa_data_t *spadat, acc_stanza_t ***cands)
 {
-    acc_stanza_t *acc = opts->acc_stanzas;
+    if(idx == NULL || idx->num_stanzas == 0)
+        return 0;
 
-    while (acc)
+    if((*cands = spa_arena_alloc(spadat->arena,
+            idx->num_stanzas * sizeof(acc_stanza_t *))) == NULL)
     {
-        if(compare_addr_list(acc->source_list, ntohl(spa_pkt->packet_src_ip)))
-            return 1;
-
-        acc = acc->next;
+        log_msg(LOG_ERR, "[%s] src_check: spa_arena_alloc() failed", spadat->pkt_source_ip);
+        return 0;
     }
 
-    log_msg(LOG_WARNING, "No access data found for source IP: %s", spadat->pkt_source_ip);
+    if(acc_stanza_candidates(idx, &(spa_pkt->packet_src_addr), *cands) > 0)
+        return 1;
+
+    log_msg(LOG_WARNING | LOG_RATE_LIMIT, "No access data found for source IP: %s",
+        spadat->pkt_source_ip);
+    return 0;
+}
+
+/* Return true if this stanza has a key that process_spa_data() would try
+ * for a packet of the given encryption type.
+*/
+static int
+stanza_enc_match(const acc_stanza_t *acc, const int enc_type)
+{
+    if(acc->use_rijndael
+            && (enc_type == FKO_ENCRYPTION_RIJNDAEL || acc->enable_cmd_exec))
+        return 1;
+
+    if(SPA_USE_GPG(acc) && enc_type == FKO_ENCRYPTION_GPG
+            && (acc->cold->gpg_decrypt_pw != NULL || acc->gpg_allow_no_pw))
+        return 1;
+
     return 0;
 }
 
@@ -396,60 +341,48 @@ src_check(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt, spa_data_t *spadat)
 static int
 sdp_id_check(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt, acc_stanza_t **acc)
 {
-    bstring sdp_id = NULL;
-
     if(spa_pkt->sdp_id == 0)
     {
-        log_msg(LOG_WARNING,
+        log_msg(LOG_WARNING | LOG_RATE_LIMIT,
                 "No access data found for SDP Client ID: %"PRIu32"...obviously",
                 spa_pkt->sdp_id);
         return 0;
     }
 
-    sdp_id = bfromcstr(spa_pkt->sdp_id_str);
-    if(sdp_id == NULL)
-    {
-        log_msg(LOG_ERR, "Failed to convert sdp_id_str to bstring. Value: %s", spa_pkt->sdp_id_str);
-        return 0;
-    }
-
-    // lock the hash table mutex
-    if(pthread_mutex_lock(&(opts->acc_hash_tbl_mutex)))
-    {
-        log_msg(LOG_ERR, "Mutex lock error.");
-        return 0;
-    }
-
-    *acc = hash_table_get(opts->acc_stanza_hash_tbl, sdp_id);
-    pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
-
-    bdestroy(sdp_id);
+    *acc = acc_sdp_id_lookup(opts, spa_pkt->sdp_id);
     if(*acc)
         return 1;  //found what we were looking for
 
-    log_msg(LOG_WARNING,
-        "No access data found for SDP Client ID: %"PRIu32,
-        spa_pkt->sdp_id);
+    log_msg(LOG_WARNING | LOG_RATE_LIMIT,
+        "No access data found for SDP Client ID: %"PRIu32, spa_pkt->sdp_id);
     return 0;
 }
 
 
 static int
-replay_check(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt, char **raw_digest)
+replay_check(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt)
 {
-    if(strncasecmp(opts->config[CONF_ENABLE_DIGEST_PERSISTENCE], "Y", 1) == 0)
+    int     res;
+
+    spa_pkt->replay_digest_set = 0;
+
+    if(opts->rt->digest_persistence)
     {
         /* Check for a replay attack
         */
-        if(get_raw_digest(raw_digest, (char *)spa_pkt->packet_data) != FKO_SUCCESS)
-        {
-            return 0;
-        }
-        if (*raw_digest == NULL)
-            return 0;
+        get_raw_digest(spa_pkt);
 
-        if (is_replay(opts, *raw_digest) != SPA_MSG_SUCCESS)
+        /* Claim the digest so that a copy of this packet arriving
+         * while we are still authorizing it is treated as a replay.
+         * The claim is released in incoming_spa_authorize().
+        */
+        if ((res = replay_claim(opts, spa_pkt, spa_pkt->replay_digest)) != SPA_MSG_SUCCESS)
         {
+            if(res == SPA_MSG_REPLAY)
+            {
+                METRIC_INC(METRIC_REPLAYS);
+                FWKNOP_PROBE1(replay_hit, spa_pkt);
+            }
             return 0;
         }
     }
@@ -457,26 +390,68 @@ replay_check(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt, char **raw_digest
     return 1;
 }
 
+/* Note why a packet is being turned down for the flight recorder, and
+ * return rv.
+*/
+static int
+spa_fail(spa_data_t *spadat, const fr_reason_t reason, const int res,
+        const int rv)
+{
+    spadat->fr_reason = reason;
+    spadat->fr_res    = res;
+    return rv;
+}
+
 static int
 precheck_pkt(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt,
         spa_data_t *spadat)
 {
-    int res = 0, packet_data_len = 0;
+    int res = 0, owner;
 
-    packet_data_len = spa_pkt->packet_data_len;
+    /* Drop packets from sources that are over their rate limit before
+     * doing any other work on them.
+    */
+    if(! rate_limit_check(&(spa_pkt->packet_src_addr)))
+    {
+        log_msg(LOG_DEBUG | LOG_RATE_LIMIT, "[%s] SPA packet dropped by rate limiter.",
+            spadat->pkt_source_ip);
+        return spa_fail(spadat, FR_RATE_LIMITED, 0, 0);
+    }
 
     res = preprocess_spa_data(opts, spa_pkt);
     if(res != FKO_SUCCESS)
     {
-        log_msg(LOG_DEBUG, "[%s] preprocess_spa_data() returned error %i: '%s' for incoming packet.",
+        log_msg(LOG_DEBUG | LOG_RATE_LIMIT,
+            "[%s] preprocess_spa_data() returned error %i: '%s' for incoming packet.",
             spadat->pkt_source_ip, res, get_errstr(res));
-        return 0;
+        return spa_fail(spadat, FR_MALFORMED, res, 0);
+    }
+
+    /* Another instance on this host serves this SDP ID.
+    */
+    if(! SDP_SHARD_OWNS(opts->rt, spa_pkt->sdp_id))
+    {
+        METRIC_INC(METRIC_PKTS_OTHER_SHARD);
+        return spa_fail(spadat, FR_OTHER_SHARD, 0, 0);
+    }
+
+    /* Another gateway in the cluster serves this SDP ID.  A packet that
+     * was forwarded to us is never forwarded again.
+    */
+    if(SPA_SDP_MODE(opts) && (owner = cluster_owner(spa_pkt->sdp_id)) >= 0)
+    {
+        if(spa_pkt->cluster_origin == 0)
+        {
+            METRIC_INC(METRIC_PKTS_CLUSTER_FORWARDED);
+            cluster_forward(spa_pkt, owner);
+        }
+        return spa_fail(spadat, FR_FORWARDED, 0, 0);
     }
 
     if(opts->foreground == 1 && opts->verbose > 2)
     {
         printf("[+] candidate SPA packet payload:\n");
-        hex_dump(spa_pkt->packet_data, packet_data_len);
+        hex_dump(spa_pkt->packet_data, spa_pkt->packet_data_len);
     }
 
     return 1;
@@ -486,9 +461,16 @@ static int
 src_dst_check(acc_stanza_t *acc, spa_pkt_info_t *spa_pkt,
         spa_data_t *spadat, const int stanza_num)
 {
-    if(! compare_addr_list(acc->source_list, ntohl(spa_pkt->packet_src_ip)) ||
-       (acc->destination_list != NULL
-        && ! compare_addr_list(acc->destination_list, ntohl(spa_pkt->packet_dst_ip))))
+    acc_stanza_exp_t   *exp;
+
+    if((exp = acc_stanza_expand(acc)) == NULL)
+        return 0;
+
+    if(! compare_acc_addr(exp->source_list, exp->source_trie,
+                &(spa_pkt->packet_src_addr)) ||
+       (acc->cold->destination_list != NULL
+        && ! compare_acc_addr(acc->cold->destination_list, acc->destination_trie,
+                &(spa_pkt->packet_dst_addr))))
     {
         log_msg(LOG_DEBUG,
                 "(stanza #%d) SPA packet (%s -> %s) filtered by SOURCE and/or DESTINATION criteria",
@@ -531,25 +513,25 @@ process_cmd_msg(fko_srv_options_t *opts, acc_stanza_t *acc,
         );
 
         memset(cmd_buf, 0x0, sizeof(cmd_buf));
-        if(acc->enable_cmd_sudo_exec)
+        if(acc->cold->enable_cmd_sudo_exec)
         {
             /* Run the command via sudo - this allows sudo filtering
              * to apply to the incoming command
             */
             strlcpy(cmd_buf, opts->config[CONF_SUDO_EXE],
                     sizeof(cmd_buf));
-            if(acc->cmd_sudo_exec_user != NULL
-                    && strncasecmp(acc->cmd_sudo_exec_user, "root", 4) != 0)
+            if(acc->cold->cmd_sudo_exec_user != NULL
+                    && strncasecmp(acc->cold->cmd_sudo_exec_user, "root", 4) != 0)
             {
                 strlcat(cmd_buf, " -u ", sizeof(cmd_buf));
-                strlcat(cmd_buf, acc->cmd_sudo_exec_user, sizeof(cmd_buf));
+                strlcat(cmd_buf, acc->cold->cmd_sudo_exec_user, sizeof(cmd_buf));
             }
-            if(acc->cmd_exec_group != NULL
-                    && strncasecmp(acc->cmd_sudo_exec_group, "root", 4) != 0)
+            if(acc->cold->cmd_exec_group != NULL
+                    && strncasecmp(acc->cold->cmd_sudo_exec_group, "root", 4) != 0)
             {
                 strlcat(cmd_buf, " -g ", sizeof(cmd_buf));
                 strlcat(cmd_buf,
-                        acc->cmd_sudo_exec_group, sizeof(cmd_buf));
+                        acc->cold->cmd_sudo_exec_group, sizeof(cmd_buf));
             }
             strlcat(cmd_buf, " ",  sizeof(cmd_buf));
             strlcat(cmd_buf, spadat->spa_message_remain, sizeof(cmd_buf));
@@ -557,16 +539,16 @@ process_cmd_msg(fko_srv_options_t *opts, acc_stanza_t *acc,
         else
             strlcpy(cmd_buf, spadat->spa_message_remain, sizeof(cmd_buf));
 
-        if(acc->cmd_exec_user != NULL
-                && strncasecmp(acc->cmd_exec_user, "root", 4) != 0)
+        if(acc->cold->cmd_exec_user != NULL
+                && strncasecmp(acc->cold->cmd_exec_user, "root", 4) != 0)
         {
             log_msg(LOG_INFO,
                     "[%s] (stanza #%d) Running command '%s' setuid/setgid user/group to %s/%s (UID=%i,GID=%i)",
-                spadat->pkt_source_ip, stanza_num, cmd_buf, acc->cmd_exec_user,
-                acc->cmd_exec_group == NULL ? acc->cmd_exec_user : acc->cmd_exec_group,
-                acc->cmd_exec_uid, acc->cmd_exec_gid);
+                spadat->pkt_source_ip, stanza_num, cmd_buf, acc->cold->cmd_exec_user,
+                acc->cold->cmd_exec_group == NULL ? acc->cold->cmd_exec_user : acc->cold->cmd_exec_group,
+                acc->cold->cmd_exec_uid, acc->cold->cmd_exec_gid);
 
-            *res = run_extcmd_as(acc->cmd_exec_uid, acc->cmd_exec_gid,
+            *res = run_extcmd_as(acc->cold->cmd_exec_uid, acc->cold->cmd_exec_gid,
                     cmd_buf, NULL, 0, WANT_STDERR, NO_TIMEOUT,
                     &pid_status, opts);
         }
@@ -603,7 +585,7 @@ check_mode_ctx(spa_data_t *spadat, fko_ctx_t *ctx, int attempted_decrypt,
 {
     if(attempted_decrypt == 0)
     {
-        log_msg(LOG_ERR,
+        log_msg(LOG_ERR | LOG_RATE_LIMIT,
             "[%s] (stanza #%d) No stanza encryption mode match for encryption type: %i.",
             spadat->pkt_source_ip, stanza_num, enc_type);
         return 0;
@@ -613,11 +595,11 @@ check_mode_ctx(spa_data_t *spadat, fko_ctx_t *ctx, int attempted_decrypt,
     */
     if(res != FKO_SUCCESS)
     {
-        log_msg(LOG_WARNING, "[%s] (stanza #%d) Error creating fko context: %s",
+        log_msg(LOG_WARNING | LOG_RATE_LIMIT, "[%s] (stanza #%d) Error creating fko context: %s",
             spadat->pkt_source_ip, stanza_num, fko_errstr(res));
 
         if(IS_GPG_ERROR(res))
-            log_msg(LOG_WARNING, "[%s] (stanza #%d) - GPG ERROR: %s",
+            log_msg(LOG_WARNING | LOG_RATE_LIMIT, "[%s] (stanza #%d) - GPG ERROR: %s",
                 spadat->pkt_source_ip, stanza_num, fko_gpg_errstr(*ctx));
         return 0;
     }
@@ -625,18 +607,138 @@ check_mode_ctx(spa_data_t *spadat, fko_ctx_t *ctx, int attempted_decrypt,
     return 1;
 }
 
+/* Each thread that processes SPA packets keeps one fko context between
+ * packets.  It is wiped with fko_reset() when a packet is done with it and
+ * loaded again with fko_reset_with_data_len(), so its buffers are not
+ * freed and reallocated for every packet.
+*/
+static pthread_key_t    spa_ctx_key;
+static pthread_once_t   spa_ctx_key_once = PTHREAD_ONCE_INIT;
+
+static void
+spa_ctx_key_destroy(void *ctx)
+{
+    fko_destroy((fko_ctx_t)ctx);
+}
+
+static void
+spa_ctx_key_init(void)
+{
+    pthread_key_create(&spa_ctx_key, spa_ctx_key_destroy);
+}
+
+static int
+spa_ctx_load(fko_ctx_t *ctx, const char * const data, const int data_len,
+        const int encryption_mode, const char * const hmac_key,
+        const int hmac_key_len, const int hmac_type, const uint32_t sdp_id)
+{
+    fko_ctx_t   spare;
+    int         res;
+
+    pthread_once(&spa_ctx_key_once, spa_ctx_key_init);
+
+    if((spare = pthread_getspecific(spa_ctx_key)) == NULL)
+        return(fko_new_with_data_len(ctx, data, data_len, NULL, 0,
+                encryption_mode, hmac_key, hmac_key_len, hmac_type, sdp_id));
+
+    pthread_setspecific(spa_ctx_key, NULL);
+
+    res = fko_reset_with_data_len(spare, data, data_len, NULL, 0,
+            encryption_mode, hmac_key, hmac_key_len, hmac_type, sdp_id);
+    if(res == FKO_SUCCESS)
+        *ctx = spare;
+    else
+        pthread_setspecific(spa_ctx_key, spare);
+
+    return(res);
+}
+
+/* Wipe a context and keep it for this thread's next packet.  Returns the
+ * fko_reset() (or fko_destroy()) result.
+*/
+static int
+spa_ctx_release(fko_ctx_t ctx)
+{
+    int     res;
+
+    pthread_once(&spa_ctx_key_once, spa_ctx_key_init);
+
+    if(pthread_getspecific(spa_ctx_key) != NULL)
+        return(fko_destroy(ctx));
+
+    res = fko_reset(ctx);
+    pthread_setspecific(spa_ctx_key, ctx);
+
+    return(res);
+}
+
+/* Create the fko context for a packet against one stanza, checking the
+ * HMAC first.  When the stanza has a precomputed HMAC key state the HMAC
+ * is checked straight from the packet buffer, so a forged packet is
+ * rejected before any context is allocated.
+*/
+static int
+stanza_new_ctx(fko_ctx_t *ctx, acc_stanza_t *acc, spa_pkt_info_t *spa_pkt,
+        const int encryption_mode)
+{
+    int     res, data_len;
+
+    if(acc->hmac_state == NULL)
+        return(spa_ctx_load(ctx, (const char *)spa_pkt->packet_data,
+                spa_pkt->packet_data_len, encryption_mode, acc->hmac_key,
+                acc->hmac_key_len, SPA_HMAC_TYPE(acc), spa_pkt->sdp_id));
+
+    res = fko_verify_hmac_raw(acc->hmac_state, (const char *)spa_pkt->packet_data,
+            spa_pkt->packet_data_len, &data_len);
+    if(res != FKO_SUCCESS)
+        return(res);
+
+    /* The HMAC is good, so hand over the data without it.
+    */
+    return(spa_ctx_load(ctx, (const char *)spa_pkt->packet_data,
+            data_len, encryption_mode, NULL, 0, SPA_HMAC_TYPE(acc),
+            spa_pkt->sdp_id));
+}
+
 static void
 handle_rijndael_enc(acc_stanza_t *acc, spa_pkt_info_t *spa_pkt,
         spa_data_t *spadat, fko_ctx_t *ctx, int *attempted_decrypt,
         int *cmd_exec_success, const int enc_type, const int stanza_num,
         int *res)
 {
+    struct timespec     ts;
+
     if(enc_type == FKO_ENCRYPTION_RIJNDAEL || acc->enable_cmd_exec)
     {
-        *res = fko_new_with_data(ctx, (char *)spa_pkt->packet_data,
-            acc->key, acc->key_len, acc->encryption_mode, acc->hmac_key,
-            acc->hmac_key_len, acc->hmac_type, spa_pkt->sdp_id);
+        /* Create the context (verifying the HMAC) and decrypt as two steps
+         * so that benchmark mode can time them separately.
+        */
+        bench_stage_start(&ts);
+        *res = stanza_new_ctx(ctx, acc, spa_pkt, SPA_ENC_MODE(acc));
+        bench_stage_end(BENCH_STAGE_HMAC, &ts);
+
         *attempted_decrypt = 1;
+
+        if(*res != FKO_SUCCESS)
+        {
+            METRIC_INC(METRIC_HMAC_FAILURES);
+            spa_shed_note(spa_pkt, 0);
+        }
+        else
+        {
+            bench_stage_start(&ts);
+            *res = fko_decrypt_spa_data(*ctx, acc->key, acc->key_len);
+            bench_stage_end(BENCH_STAGE_DECRYPT, &ts);
+
+            if(*res != FKO_SUCCESS)
+            {
+                METRIC_INC(METRIC_DECRYPT_FAILURES);
+                spa_shed_note(spa_pkt, 0);
+                spa_ctx_release(*ctx);
+                *ctx = NULL;
+            }
+        }
+
         if(*res == FKO_SUCCESS)
             *cmd_exec_success = 1;
     }
@@ -649,19 +751,23 @@ handle_gpg_enc(acc_stanza_t *acc, spa_pkt_info_t *spa_pkt,
         const int cmd_exec_success, const int enc_type,
         const int stanza_num, int *res)
 {
-    if(acc->use_gpg && enc_type == FKO_ENCRYPTION_GPG && cmd_exec_success == 0)
+    struct timespec     ts;
+
+    if(SPA_USE_GPG(acc) && enc_type == FKO_ENCRYPTION_GPG && cmd_exec_success == 0)
     {
         /* For GPG we create the new context without decrypting on the fly
          * so we can set some GPG parameters first.
         */
-        if(acc->gpg_decrypt_pw != NULL || acc->gpg_allow_no_pw)
+        if(acc->cold->gpg_decrypt_pw != NULL || acc->gpg_allow_no_pw)
         {
-            *res = fko_new_with_data(ctx, (char *)spa_pkt->packet_data, NULL,
-                    0, FKO_ENC_MODE_ASYMMETRIC, acc->hmac_key,
-                    acc->hmac_key_len, acc->hmac_type, spa_pkt->sdp_id);
+            bench_stage_start(&ts);
+            *res = stanza_new_ctx(ctx, acc, spa_pkt, FKO_ENC_MODE_ASYMMETRIC);
+            bench_stage_end(BENCH_STAGE_HMAC, &ts);
 
             if(*res != FKO_SUCCESS)
             {
+                METRIC_INC(METRIC_HMAC_FAILURES);
+                spa_shed_note(spa_pkt, 0);
                 log_msg(LOG_WARNING,
                     "[%s] (stanza #%d) Error creating fko context (before decryption): %s",
                     spadat->pkt_source_ip, stanza_num, fko_errstr(*res)
@@ -671,49 +777,49 @@ handle_gpg_enc(acc_stanza_t *acc, spa_pkt_info_t *spa_pkt,
 
             /* Set whatever GPG parameters we have.
             */
-            if(acc->gpg_exe != NULL)
+            if(acc->cold->gpg_exe != NULL)
             {
-                *res = fko_set_gpg_exe(*ctx, acc->gpg_exe);
+                *res = fko_set_gpg_exe(*ctx, acc->cold->gpg_exe);
                 if(*res != FKO_SUCCESS)
                 {
                     log_msg(LOG_WARNING,
                         "[%s] (stanza #%d) Error setting GPG path %s: %s",
-                        spadat->pkt_source_ip, stanza_num, acc->gpg_exe,
+                        spadat->pkt_source_ip, stanza_num, acc->cold->gpg_exe,
                         fko_errstr(*res)
                     );
                     return 0;
                 }
             }
 
-            if(acc->gpg_home_dir != NULL)
+            if(acc->cold->gpg_home_dir != NULL)
             {
-                *res = fko_set_gpg_home_dir(*ctx, acc->gpg_home_dir);
+                *res = fko_set_gpg_home_dir(*ctx, acc->cold->gpg_home_dir);
                 if(*res != FKO_SUCCESS)
                 {
                     log_msg(LOG_WARNING,
                         "[%s] (stanza #%d) Error setting GPG keyring path to %s: %s",
-                        spadat->pkt_source_ip, stanza_num, acc->gpg_home_dir,
+                        spadat->pkt_source_ip, stanza_num, acc->cold->gpg_home_dir,
                         fko_errstr(*res)
                     );
                     return 0;
                 }
             }
 
-            if(acc->gpg_decrypt_id != NULL)
-                fko_set_gpg_recipient(*ctx, acc->gpg_decrypt_id);
+            if(acc->cold->gpg_decrypt_id != NULL)
+                fko_set_gpg_recipient(*ctx, acc->cold->gpg_decrypt_id);
 
             /* If GPG_REQUIRE_SIG is set for this acc stanza, then set
              * the FKO context accordingly and check the other GPG Sig-
              * related parameters. This also applies when REMOTE_ID is
              * set.
             */
-            if(acc->gpg_require_sig)
+            if(acc->cold->gpg_require_sig)
             {
                 fko_set_gpg_signature_verify(*ctx, 1);
 
                 /* Set whether or not to ignore signature verification errors.
                 */
-                fko_set_gpg_ignore_verify_error(*ctx, acc->gpg_ignore_sig_error);
+                fko_set_gpg_ignore_verify_error(*ctx, acc->cold->gpg_ignore_sig_error);
             }
             else
             {
@@ -723,8 +829,16 @@ handle_gpg_enc(acc_stanza_t *acc, spa_pkt_info_t *spa_pkt,
 
             /* Now decrypt the data.
             */
-            *res = fko_decrypt_spa_data(*ctx, acc->gpg_decrypt_pw, 0);
+            bench_stage_start(&ts);
+            *res = fko_decrypt_spa_data(*ctx, acc->cold->gpg_decrypt_pw, 0);
+            bench_stage_end(BENCH_STAGE_DECRYPT, &ts);
             *attempted_decrypt = 1;
+
+            if(*res != FKO_SUCCESS)
+            {
+                METRIC_INC(METRIC_DECRYPT_FAILURES);
+                spa_shed_note(spa_pkt, 0);
+            }
         }
     }
     return 1;
@@ -735,12 +849,15 @@ handle_gpg_sigs(acc_stanza_t *acc, spa_data_t *spadat,
         fko_ctx_t *ctx, const int enc_type, const int stanza_num, int *res)
 {
     char                *gpg_id, *gpg_fpr;
-    acc_string_list_t   *gpg_id_ndx;
-    acc_string_list_t   *gpg_fpr_ndx;
+    acc_stanza_exp_t    *exp;
     unsigned char        is_gpg_match = 0;
 
-    if(enc_type == FKO_ENCRYPTION_GPG && acc->gpg_require_sig)
+    if(SPA_USE_GPG(acc) && enc_type == FKO_ENCRYPTION_GPG
+            && acc->cold->gpg_require_sig)
     {
+        if((exp = acc_stanza_expand(acc)) == NULL)
+            return 0;
+
         *res = fko_get_gpg_signature_id(*ctx, &gpg_id);
         if(*res != FKO_SUCCESS)
         {
@@ -765,24 +882,9 @@ handle_gpg_sigs(acc_stanza_t *acc, spa_data_t *spadat,
 
         /* prefer GnuPG fingerprint match if so configured
         */
-        if(acc->gpg_remote_fpr != NULL)
+        if(acc->cold->gpg_remote_fpr != NULL)
         {
-            is_gpg_match = 0;
-            for(gpg_fpr_ndx = acc->gpg_remote_fpr_list;
-                    gpg_fpr_ndx != NULL; gpg_fpr_ndx=gpg_fpr_ndx->next)
-            {
-                *res = fko_gpg_signature_fpr_match(*ctx,
-                        gpg_fpr_ndx->str, &is_gpg_match);
-                if(*res != FKO_SUCCESS)
-                {
-                    log_msg(LOG_WARNING,
-                        "[%s] (stanza #%d) Error in GPG signature comparision: %s",
-                        spadat->pkt_source_ip, stanza_num, fko_gpg_errstr(*ctx));
-                    return 0;
-                }
-                if(is_gpg_match)
-                    break;
-            }
+            is_gpg_match = acc_string_set_test(exp->gpg_remote_fpr_set, gpg_fpr);
             if(! is_gpg_match)
             {
                 log_msg(LOG_WARNING,
@@ -792,24 +894,9 @@ handle_gpg_sigs(acc_stanza_t *acc, spa_data_t *spadat,
             }
         }
 
-        if(acc->gpg_remote_id != NULL)
+        if(acc->cold->gpg_remote_id != NULL)
         {
-            is_gpg_match = 0;
-            for(gpg_id_ndx = acc->gpg_remote_id_list;
-                    gpg_id_ndx != NULL; gpg_id_ndx=gpg_id_ndx->next)
-            {
-                *res = fko_gpg_signature_id_match(*ctx,
-                        gpg_id_ndx->str, &is_gpg_match);
-                if(*res != FKO_SUCCESS)
-                {
-                    log_msg(LOG_WARNING,
-                        "[%s] (stanza #%d) Error in GPG signature comparision: %s",
-                        spadat->pkt_source_ip, stanza_num, fko_gpg_errstr(*ctx));
-                    return 0;
-                }
-                if(is_gpg_match)
-                    break;
-            }
+            is_gpg_match = acc_string_set_test(exp->gpg_remote_id_set, gpg_id);
 
             if(! is_gpg_match)
             {
@@ -824,10 +911,22 @@ handle_gpg_sigs(acc_stanza_t *acc, spa_data_t *spadat,
 }
 
 static int
-check_src_access(acc_stanza_t *acc, spa_data_t *spadat, const int stanza_num)
+check_src_access(acc_stanza_t *acc, spa_pkt_info_t *spa_pkt,
+        spa_data_t *spadat, const int stanza_num)
 {
     if(strcmp(spadat->spa_message_src_ip, "0.0.0.0") == 0)
     {
+        /* Firewall rules are IPv4 only, so an IPv6 client has to tell us
+         * which IPv4 address to allow.
+        */
+        if(spa_pkt->packet_src_addr.family == AF_INET6)
+        {
+            log_msg(LOG_WARNING,
+                "[%s] (stanza #%d) Got 0.0.0.0 from an IPv6 source, an IPv4 allow address is required.",
+                spadat->pkt_source_ip, stanza_num
+            );
+            return 0;
+        }
         if(acc->require_source_address)
         {
             log_msg(LOG_WARNING,
@@ -847,13 +946,13 @@ check_src_access(acc_stanza_t *acc, spa_data_t *spadat, const int stanza_num)
 static int
 check_username(acc_stanza_t *acc, spa_data_t *spadat, const int stanza_num)
 {
-    if(acc->require_username != NULL)
+    if(acc->cold->require_username != NULL)
     {
-        if(strcmp(spadat->username, acc->require_username) != 0)
+        if(strcmp(spadat->username, acc->cold->require_username) != 0)
         {
             log_msg(LOG_WARNING,
                 "[%s] (stanza #%d) Username in SPA data (%s) does not match required username: %s",
-                spadat->pkt_source_ip, stanza_num, spadat->username, acc->require_username
+                spadat->pkt_source_ip, stanza_num, spadat->username, acc->cold->require_username
             );
             return 0;
         }
@@ -861,6 +960,44 @@ check_username(acc_stanza_t *acc, spa_data_t *spadat, const int stanza_num)
     return 1;
 }
 
+static int
+is_nat_msg_type(const short message_type)
+{
+    return(message_type == FKO_NAT_ACCESS_MSG
+        || message_type == FKO_CLIENT_TIMEOUT_NAT_ACCESS_MSG
+        || message_type == FKO_LOCAL_NAT_ACCESS_MSG
+        || message_type == FKO_CLIENT_TIMEOUT_LOCAL_NAT_ACCESS_MSG);
+}
+
+/* Parse the "ip,port" NAT access string from the SPA message into
+ * spadat->nat, so the firewall code gets a validated address and port.
+*/
+static int
+parse_nat_access(spa_data_t *spadat)
+{
+    const char *ndx;
+    int         is_err;
+
+    memset(&spadat->nat, 0x0, sizeof(spadat->nat));
+
+    if(spadat->nat_access == NULL
+            || (ndx = strchr(spadat->nat_access, ',')) == NULL
+            || (ndx - spadat->nat_access) >= MAX_IPV4_STR_LEN)
+        return 0;
+
+    strlcpy(spadat->nat.ip_str, spadat->nat_access,
+            (ndx - spadat->nat_access) + 1);
+    if(! is_valid_ipv4_addr(spadat->nat.ip_str))
+        return 0;
+
+    spadat->nat.port = strtol_wrapper(ndx+1, 0, MAX_PORT,
+            NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+        return 0;
+
+    return 1;
+}
+
 static int
 check_nat_access_types(fko_srv_options_t *opts, acc_stanza_t *acc,
         spa_data_t *spadat, const int stanza_num)
@@ -870,11 +1007,8 @@ check_nat_access_types(fko_srv_options_t *opts, acc_stanza_t *acc,
     if(spadat->message_type == FKO_NAT_ACCESS_MSG
           || spadat->message_type == FKO_CLIENT_TIMEOUT_NAT_ACCESS_MSG)
     {
-#if FIREWALL_FIREWALLD
-        if(strncasecmp(opts->config[CONF_ENABLE_FIREWD_FORWARDING], "Y", 1)!=0)
-            not_enabled = 1;
-#elif FIREWALL_IPTABLES
-        if(strncasecmp(opts->config[CONF_ENABLE_IPT_FORWARDING], "Y", 1)!=0)
+#if FIREWALL_FIREWALLD || FIREWALL_IPTABLES
+        if(! opts->rt->nat_forwarding)
             not_enabled = 1;
 #else
         unsupported = 1;
@@ -883,11 +1017,8 @@ check_nat_access_types(fko_srv_options_t *opts, acc_stanza_t *acc,
     else if(spadat->message_type == FKO_LOCAL_NAT_ACCESS_MSG
           || spadat->message_type == FKO_CLIENT_TIMEOUT_LOCAL_NAT_ACCESS_MSG)
     {
-#if FIREWALL_FIREWALLD
-        if(strncasecmp(opts->config[CONF_ENABLE_FIREWD_LOCAL_NAT], "Y", 1)!=0)
-            not_enabled = 1;
-#elif FIREWALL_IPTABLES
-        if(strncasecmp(opts->config[CONF_ENABLE_IPT_LOCAL_NAT], "Y", 1)!=0)
+#if FIREWALL_FIREWALLD || FIREWALL_IPTABLES
+        if(! opts->rt->nat_local)
             not_enabled = 1;
 #else
         unsupported = 1;
@@ -911,19 +1042,35 @@ check_nat_access_types(fko_srv_options_t *opts, acc_stanza_t *acc,
         return 0;
     }
 
+    /* FORCE_NAT overrides whatever the client asked for, and that target
+     * was validated when the stanza was loaded.
+    */
+    if(is_nat_msg_type(spadat->message_type) && ! acc->cold->force_nat)
+    {
+        if(! parse_nat_access(spadat))
+        {
+            log_msg(LOG_WARNING,
+                "(stanza #%d) SPA packet from %s has an invalid NAT access request",
+                stanza_num, spadat->pkt_source_ip
+            );
+            return 0;
+        }
+    }
+
     return 1;
 }
 
 static int
 add_replay_cache(fko_srv_options_t *opts, acc_stanza_t *acc,
-        spa_data_t *spadat, char *raw_digest, int *added_replay_digest,
+        spa_pkt_info_t *spa_pkt, spa_data_t *spadat,
+        int *added_replay_digest,
         const int stanza_num, int *res)
 {
     if (!opts->test && *added_replay_digest == 0
-            && strncasecmp(opts->config[CONF_ENABLE_DIGEST_PERSISTENCE], "Y", 1) == 0)
+            && spa_pkt->replay_digest_set)
     {
 
-        *res = add_replay(opts, raw_digest);
+        *res = add_replay(opts, spa_pkt, spa_pkt->replay_digest);
         if (*res != SPA_MSG_SUCCESS)
         {
             log_msg(LOG_WARNING, "[%s] (stanza #%d) Could not add digest to replay cache",
@@ -931,6 +1078,8 @@ add_replay_cache(fko_srv_options_t *opts, acc_stanza_t *acc,
             return 0;
         }
         *added_replay_digest = 1;
+
+        replay_gossip_send(spa_pkt, spa_pkt->replay_digest);
     }
 
     return 1;
@@ -972,7 +1121,8 @@ gather_service_information(fko_srv_options_t *opts, spa_data_t *spadat)
     service_data_list_t *service_data_list = NULL;
 
     // walk through list of requested service IDs to gather service data
-    if((rv = get_service_data_list(opts, spadat->spa_message_remain, &service_data_list)) != FWKNOPD_SUCCESS)
+    if((rv = get_service_data_list(opts, spadat->arena,
+            spadat->spa_message_remain, &service_data_list)) != FWKNOPD_SUCCESS)
     {
         log_msg(LOG_ERR, "Failed to gather necessary data for requested services.");
         return 0;
@@ -997,69 +1147,265 @@ check_port_proto(acc_stanza_t *acc, spa_data_t *spadat, const int stanza_num)
     return 1;
 }
 
-/* Handle grant request
+/* Act on an authenticated SPA packet that matched the access criteria
+ * (command message, command cycle, or firewall access).
  */
 static int
-process_spa_data(fko_srv_options_t *opts, fko_ctx_t *ctx, acc_stanza_t *acc, spa_pkt_info_t *spa_pkt, spa_data_t *spadat,
-                    int stanza_num, char *raw_digest, int conf_pkt_age)
+take_spa_action(fko_srv_options_t *opts, acc_stanza_t *acc,
+        spa_data_t *spadat, const int stanza_num, const short msg_type,
+        int *res)
 {
-    int res                 = FKO_SUCCESS;
-    int added_replay_digest = 0;
-    int cmd_exec_success    = 0;
-    int attempted_decrypt   = 0;
-    int enc_type            = 0;
-    char *spa_ip_demark     = NULL;
-    char dump_buf[CTX_DUMP_BUFSIZE];
-    short msg_type          = 0;
+    struct timespec     ts;
+    int                 ok;
+
+    FWKNOP_PROBE3(stanza_match, spadat->pkt_source_ip, spadat->sdp_id, stanza_num);
+
+    /* A packet forwarded by another cluster member can only be answered
+     * with a plain service grant, which the member installs without this
+     * stanza's NAT settings.
+    */
+    if(spadat->cluster_origin
+            && (acc->cold->cmd_cycle_open != NULL
+                || (msg_type != FKO_SERVICE_ACCESS_MSG
+                    && msg_type != FKO_CLIENT_TIMEOUT_SERVICE_ACCESS_MSG)
+                || acc->cold->force_nat || acc->cold->force_snat
+                || acc->cold->force_masquerade || acc->cold->forward_all
+                || acc->cold->disable_dnat))
+    {
+        log_msg(LOG_WARNING,
+            "[%s] (stanza #%d) Request forwarded by a cluster member cannot be granted remotely",
+            spadat->pkt_source_ip, stanza_num);
+        return STOP_SEARCHING;
+    }
+
+    /* Command messages.
+    */
+    if(acc->cold->cmd_cycle_open != NULL)
+    {
+        bench_stage_start(&ts);
+        ok = cmd_cycle_open(opts, acc, spadat, stanza_num, res);
+        bench_stage_end(BENCH_STAGE_CMD_CYCLE, &ts);
+
+        if(ok)
+        {
+            METRIC_INC(METRIC_AUTHORIZED);
+            spadat->granted = 1;
+            return STOP_SEARCHING; /* successfully processed a matching access stanza */
+        }
+        else
+        {
+            return KEEP_SEARCHING;
+        }
+    }
+    else if(spadat->message_type == FKO_COMMAND_MSG)
+    {
+        if(process_cmd_msg(opts, acc, spadat, stanza_num, res))
+        {
+            /* we processed the command on a matching access stanza, so we
+             * don't look for anything else to do with this SPA packet
+            */
+            return STOP_SEARCHING;
+        }
+        else
+        {
+            return KEEP_SEARCHING;
+        }
+    }
+
+    /* From this point forward, we have some kind of access message. So
+     * we first see if access is allowed by checking access against
+     * permitted services if applicable or else restrict_ports and
+     * open_ports.
+     *
+    */
+    if(msg_type == FKO_SERVICE_ACCESS_MSG ||
+       msg_type == FKO_CLIENT_TIMEOUT_SERVICE_ACCESS_MSG)
+    {
+    	log_msg(LOG_DEBUG,
+    			"[%s] --SPA message is a service access request, checking if SDP ID has necessary permissions",
+				spadat->pkt_source_ip
+		);
+        bench_stage_start(&ts);
+        if(authz_cache_get(spadat, spadat->authz_gen, &ok,
+                &(spadat->service_data_list)))
+        {
+            bench_stage_end(BENCH_STAGE_SERVICE, &ts);
+
+            if(! ok)
+            {
+                log_msg(LOG_WARNING,
+                    "[%s] One or more requested services was denied.",
+                    spadat->pkt_source_ip
+                );
+                return STOP_SEARCHING;
+            }
+        }
+        else
+        {
+            ok = check_service_access(acc, spadat);
+            bench_stage_end(BENCH_STAGE_SERVICE, &ts);
+
+            if(! ok)
+            {
+                authz_cache_put(spadat, spadat->authz_gen, 0, NULL);
+                return STOP_SEARCHING;
+            }
+
+            if(! gather_service_information(opts, spadat))
+                return STOP_SEARCHING;
+
+            authz_cache_put(spadat, spadat->authz_gen, 1,
+                spadat->service_data_list);
+        }
+    }
+    else
+    {
+        bench_stage_start(&ts);
+        ok = check_port_proto(acc, spadat, stanza_num);
+        bench_stage_end(BENCH_STAGE_SERVICE, &ts);
+
+        if(! ok)
+            return KEEP_SEARCHING;
+    }
+
+    /* At this point, we process the SPA request and break out of the
+     * access stanza loop (first valid access stanza stops us looking
+     * for others).
+    */
+    if(opts->test)  /* no firewall changes in --test mode */
+    {
+        log_msg(LOG_WARNING,
+            "[%s] (stanza #%d) --test mode enabled, skipping firewall manipulation.",
+            spadat->pkt_source_ip, stanza_num
+        );
+        return KEEP_SEARCHING;
+    }
+    else
+    {
+        /* Refuse a grant that would take the client or the server past
+         * MAX_ACTIVE_GRANTS.
+        */
+        if(! grant_quota_check(acc, spadat))
+            return STOP_SEARCHING;
+
+        if(acc->cold->cmd_cycle_open != NULL)
+        {
+            if(cmd_cycle_open(opts, acc, spadat, stanza_num, res))
+            {
+                METRIC_INC(METRIC_AUTHORIZED);
+                spadat->granted = 1;
+                return STOP_SEARCHING; /* successfully processed a matching access stanza */
+            }
+            else
+            {
+                return KEEP_SEARCHING;
+            }
+        }
+        else if(spadat->cluster_origin)
+        {
+            if(cluster_send_grant(spadat) != 0)
+                return STOP_SEARCHING;
+        }
+        else if(fw_commit_running())
+        {
+            fw_commit_dispatch(acc, spadat, stanza_num);
+        }
+        else
+        {
+            bench_stage_start(&ts);
+            if(process_spa_request(opts, acc, spadat) == 0)
+                ha_sync_grant(spadat);
+            bench_stage_end(BENCH_STAGE_FIREWALL, &ts);
+        }
+        METRIC_INC(METRIC_AUTHORIZED);
+        spadat->granted = 1;
+    }
+
+    return STOP_SEARCHING;
+}
+
+/* Handle grant request
+ */
+static int
+process_spa_data(fko_srv_options_t *opts, fko_ctx_t *ctx, acc_stanza_t *acc, spa_pkt_info_t *spa_pkt, spa_data_t *spadat,
+                    int stanza_num, int conf_pkt_age, int *trial_decrypts)
+{
+    int res                 = FKO_SUCCESS;
+    int rv                  = STOP_SEARCHING;
+    int added_replay_digest = 0;
+    int cmd_exec_success    = 0;
+    int attempted_decrypt   = 0;
+    int enc_type            = 0;
+    char *spa_ip_demark     = NULL;
+    char dump_buf[CTX_DUMP_BUFSIZE];
+    short msg_type          = 0;
 
     /* Check for a match for the SPA source and destination IP and the access stanza
     */
     if(! src_dst_check(acc, spa_pkt, spadat, stanza_num))
     {
-        return KEEP_SEARCHING;
+        return spa_fail(spadat, FR_NO_STANZA, 0, KEEP_SEARCHING);
     }
 
     log_msg(LOG_INFO,
         "(stanza #%d) SPA Packet from IP: %s received with access source match",
         stanza_num, spadat->pkt_source_ip);
 
-    log_msg(LOG_DEBUG, "SPA Packet: '%s'", spa_pkt->packet_data);
+    log_msg(LOG_DEBUG, "SPA Packet: '%.*s'",
+        (int)spa_pkt->packet_data_len, spa_pkt->packet_data);
 
     /* Make sure this access stanza has not expired
     */
     if(! check_stanza_expiration(acc, spadat, stanza_num))
     {
-        return KEEP_SEARCHING;
+        return spa_fail(spadat, FR_STANZA_EXPIRED, 0, KEEP_SEARCHING);
     }
 
     /* Get encryption type and try its decoding routine first (if the key
      * for that type is set)
     */
-    enc_type = fko_encryption_type((char *)spa_pkt->packet_data);
+    enc_type = fko_encryption_type_len((const char *)spa_pkt->packet_data,
+            spa_pkt->packet_data_len);
 
     if(acc->use_rijndael)
         handle_rijndael_enc(acc, spa_pkt, spadat, ctx,
                     &attempted_decrypt, &cmd_exec_success, enc_type,
                     stanza_num, &res);
 
-    if(! handle_gpg_enc(acc, spa_pkt, spadat, ctx, &attempted_decrypt,
-                cmd_exec_success, enc_type, stanza_num, &res))
+    rv = handle_gpg_enc(acc, spa_pkt, spadat, ctx, &attempted_decrypt,
+                cmd_exec_success, enc_type, stanza_num, &res);
+
+    *trial_decrypts += attempted_decrypt;
+
+    if(! rv)
     {
-        return KEEP_SEARCHING;
+        return spa_fail(spadat, FR_DECRYPT, res, KEEP_SEARCHING);
     }
 
     if(! check_mode_ctx(spadat, ctx, attempted_decrypt,
                 enc_type, stanza_num, res))
     {
-        return KEEP_SEARCHING;
+        return spa_fail(spadat, FR_DECRYPT, res, KEEP_SEARCHING);
+    }
+
+    spa_trace_set_id(spa_pkt, *ctx);
+
+    /* Check packet age if so configured.  This is done as soon as the
+     * timestamp is available so a stale packet costs no replay cache
+     * write or access checks.
+    */
+    if(fko_get_timestamp(*ctx, &(spadat->timestamp)) != FKO_SUCCESS
+            || ! check_pkt_age(opts, spadat, stanza_num, conf_pkt_age))
+    {
+        return spa_fail(spadat, FR_PKT_AGE, 0, KEEP_SEARCHING);
     }
 
     /* Add this SPA packet into the replay detection cache
     */
-    if(! add_replay_cache(opts, acc, spadat, raw_digest,
+    if(! add_replay_cache(opts, acc, spa_pkt, spadat,
                 &added_replay_digest, stanza_num, &res))
     {
-        return KEEP_SEARCHING;
+        return spa_fail(spadat, FR_REPLAY, res, KEEP_SEARCHING);
     }
 
     /* At this point the SPA data is authenticated via the HMAC (if used
@@ -1078,17 +1424,17 @@ process_spa_data(fko_srv_options_t *opts, fko_ctx_t *ctx, acc_stanza_t *acc, spa
     /* First, check if the SPA message type is currently permitted.
      */
     if((res = fko_get_spa_message_type(*ctx, &msg_type)) != FKO_SUCCESS)
-    	return STOP_SEARCHING;
+    	return spa_fail(spadat, FR_BAD_MSG, res, STOP_SEARCHING);
 
     if(msg_type != FKO_SERVICE_ACCESS_MSG &&
        msg_type != FKO_CLIENT_TIMEOUT_SERVICE_ACCESS_MSG &&
        msg_type != FKO_COMMAND_MSG &&
-       strncasecmp(opts->config[CONF_ALLOW_LEGACY_ACCESS_REQUESTS], "N", 1) == 0)
+       ! opts->rt->allow_legacy_access)
     {
         log_msg(LOG_ERR,
                 "[%s] SPA packet made legacy access request, server configured to deny.",
                 spadat->pkt_source_ip);
-        return STOP_SEARCHING;
+        return spa_fail(spadat, FR_LEGACY_DENIED, 0, STOP_SEARCHING);
     }
 
     /* Next, if this is a GPG message, and GPG_REMOTE_ID list is not empty,
@@ -1098,7 +1444,7 @@ process_spa_data(fko_srv_options_t *opts, fko_ctx_t *ctx, acc_stanza_t *acc, spa
 
     if(! handle_gpg_sigs(acc, spadat, ctx, enc_type, stanza_num, &res))
     {
-        return KEEP_SEARCHING;
+        return spa_fail(spadat, FR_GPG_SIGNER, 0, KEEP_SEARCHING);
     }
 
     /* Populate our spa data struct for future reference.
@@ -1111,7 +1457,7 @@ process_spa_data(fko_srv_options_t *opts, fko_ctx_t *ctx, acc_stanza_t *acc, spa
             "[%s] (stanza #%d) Unexpected error pulling SPA data from the context: %s",
             spadat->pkt_source_ip, stanza_num, fko_errstr(res));
 
-        return KEEP_SEARCHING;
+        return spa_fail(spadat, FR_BAD_MSG, res, KEEP_SEARCHING);
     }
 
     /* Figure out what our timeout will be. If it is specified in the SPA
@@ -1120,13 +1466,6 @@ process_spa_data(fko_srv_options_t *opts, fko_ctx_t *ctx, acc_stanza_t *acc, spa
     */
     set_timeout(acc, spadat);
 
-    /* Check packet age if so configured.
-    */
-    if(! check_pkt_age(opts, spadat, stanza_num, conf_pkt_age))
-    {
-        return KEEP_SEARCHING;
-    }
-
     /* At this point, we have enough to check the embedded (or packet source)
      * IP address against the defined access rights.  We start by splitting
      * the spa msg source IP from the remainder of the message.
@@ -1138,7 +1477,7 @@ process_spa_data(fko_srv_options_t *opts, fko_ctx_t *ctx, acc_stanza_t *acc, spa
             "[%s] (stanza #%d) Error parsing SPA message string: %s",
             spadat->pkt_source_ip, stanza_num, fko_errstr(res));
 
-        return KEEP_SEARCHING;
+        return spa_fail(spadat, FR_BAD_MSG, 0, KEEP_SEARCHING);
     }
 
     if((spa_ip_demark-spadat->spa_message) < MIN_IPV4_STR_LEN-1
@@ -1147,7 +1486,7 @@ process_spa_data(fko_srv_options_t *opts, fko_ctx_t *ctx, acc_stanza_t *acc, spa
         log_msg(LOG_WARNING,
             "[%s] (stanza #%d) Invalid source IP in SPA message, ignoring SPA packet",
             spadat->pkt_source_ip, stanza_num);
-        return STOP_SEARCHING;
+        return spa_fail(spadat, FR_BAD_MSG, 0, STOP_SEARCHING);
     }
 
     strlcpy(spadat->spa_message_src_ip,
@@ -1158,7 +1497,7 @@ process_spa_data(fko_srv_options_t *opts, fko_ctx_t *ctx, acc_stanza_t *acc, spa
         log_msg(LOG_WARNING,
             "[%s] (stanza #%d) Invalid source IP in SPA message, ignoring SPA packet",
             spadat->pkt_source_ip, stanza_num, fko_errstr(res));
-        return STOP_SEARCHING;
+        return spa_fail(spadat, FR_BAD_MSG, 0, STOP_SEARCHING);
     }
 
     strlcpy(spadat->spa_message_remain, spa_ip_demark+1, MAX_DECRYPTED_SPA_LEN);
@@ -1166,19 +1505,19 @@ process_spa_data(fko_srv_options_t *opts, fko_ctx_t *ctx, acc_stanza_t *acc, spa
     /* If use source IP was requested (embedded IP of 0.0.0.0), make sure it
      * is allowed.
     */
-    if(! check_src_access(acc, spadat, stanza_num))
+    if(! check_src_access(acc, spa_pkt, spadat, stanza_num))
     {
-        return KEEP_SEARCHING;
+        return spa_fail(spadat, FR_SRC_DENIED, 0, KEEP_SEARCHING);
     }
 
     /* If SDP Mode is disabled and REQUIRE_USERNAME is set,
      * make sure the username in this SPA data matches.
     */
-    if(strncasecmp(opts->config[CONF_DISABLE_SDP_MODE], "Y", 1) == 0)
+    if(! SPA_SDP_MODE(opts))
     {
         if(! check_username(acc, spadat, stanza_num))
         {
-            return KEEP_SEARCHING;
+            return spa_fail(spadat, FR_USER_DENIED, 0, KEEP_SEARCHING);
         }
     }
 
@@ -1186,185 +1525,141 @@ process_spa_data(fko_srv_options_t *opts, fko_ctx_t *ctx, acc_stanza_t *acc, spa
     */
     if(! check_nat_access_types(opts, acc, spadat, stanza_num))
     {
-        return KEEP_SEARCHING;
+        return spa_fail(spadat, FR_ACCESS_DENIED, 0, KEEP_SEARCHING);
     }
 
-    /* Command messages.
+    /* Everything from here on may touch the firewall rule and command
+     * cycle state, which is shared between UDP server workers.
     */
-    if(acc->cmd_cycle_open != NULL)
+    if(pthread_mutex_lock(&(opts->spa_grant_mutex)))
     {
-        if(cmd_cycle_open(opts, acc, spadat, stanza_num, &res))
-            return STOP_SEARCHING; /* successfully processed a matching access stanza */
-        else
-        {
-            return KEEP_SEARCHING;
-        }
-    }
-    else if(spadat->message_type == FKO_COMMAND_MSG)
-    {
-        if(process_cmd_msg(opts, acc, spadat, stanza_num, &res))
-        {
-            /* we processed the command on a matching access stanza, so we
-             * don't look for anything else to do with this SPA packet
-            */
-            return STOP_SEARCHING;
-        }
-        else
-        {
-            return KEEP_SEARCHING;
-        }
+        log_msg(LOG_ERR, "Mutex lock error.");
+        return spa_fail(spadat, FR_ACTION_FAILED, 0, STOP_SEARCHING);
     }
 
-    /* From this point forward, we have some kind of access message. So
-     * we first see if access is allowed by checking access against
-     * permitted services if applicable or else restrict_ports and
-     * open_ports.
-     *
-    */
-    if(msg_type == FKO_SERVICE_ACCESS_MSG ||
-       msg_type == FKO_CLIENT_TIMEOUT_SERVICE_ACCESS_MSG)
-    {
-    	log_msg(LOG_DEBUG,
-    			"[%s] --SPA message is a service access request, checking if SDP ID has necessary permissions",
-				spadat->pkt_source_ip
-		);
-        if(! check_service_access(acc, spadat))
-            return STOP_SEARCHING;
+    rv = take_spa_action(opts, acc, spadat, stanza_num, msg_type, &res);
 
-        if(! gather_service_information(opts, spadat))
-        	return STOP_SEARCHING;
-    }
-    else if(! check_port_proto(acc, spadat, stanza_num))
-    {
-        return KEEP_SEARCHING;
-    }
+    pthread_mutex_unlock(&(opts->spa_grant_mutex));
 
-    /* At this point, we process the SPA request and break out of the
-     * access stanza loop (first valid access stanza stops us looking
-     * for others).
-    */
-    if(opts->test)  /* no firewall changes in --test mode */
-    {
-        log_msg(LOG_WARNING,
-            "[%s] (stanza #%d) --test mode enabled, skipping firewall manipulation.",
-            spadat->pkt_source_ip, stanza_num
-        );
-        return KEEP_SEARCHING;
-    }
-    else
-    {
-        if(acc->cmd_cycle_open != NULL)
-        {
-            if(cmd_cycle_open(opts, acc, spadat, stanza_num, &res))
-                return STOP_SEARCHING; /* successfully processed a matching access stanza */
-            else
-            {
-                return KEEP_SEARCHING;
-            }
-        }
-        else
-        {
-            process_spa_request(opts, acc, spadat);
-        }
-    }
+    if(! spadat->granted)
+        spa_fail(spadat, rv == KEEP_SEARCHING ? FR_ACCESS_DENIED : FR_ACTION_FAILED,
+            res, rv);
 
-    return STOP_SEARCHING;
+    return rv;
 }
 
 
-/* Process the SPA packet data
+/* Decrypt, verify and authorize a SPA packet that has already passed
+ * precheck_pkt() and replay_check().  This runs on a SPA worker thread
+ * when they are enabled, otherwise directly from incoming_spa().  The
+ * packet's replay digest (if any) is released from the replay claims
+ * here.
 */
 void
-incoming_spa(fko_srv_options_t *opts)
+incoming_spa_authorize(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt)
 {
     /* Always a good idea to initialize ctx to null if it will be used
      * repeatedly (especially when using fko_new_with_data()).
     */
     fko_ctx_t       ctx = NULL;
 
-    char            *raw_digest = NULL;
     int             stanza_num=0;
-    int             is_err;
+    int             rv, i, enc_type;
     int             conf_pkt_age = 0;
-
-    spa_pkt_info_t *spa_pkt = &(opts->spa_pkt);
+    int             trial_decrypts = 0;
+    struct timespec ts;
 
     /* This will hold our pertinent SPA data.
     */
     spa_data_t spadat;
 
     acc_stanza_t        *acc = NULL;
-
-    log_msg(LOG_DEBUG, "incoming_spa() : just arrived, stay tuned");
+    acc_stanza_t       **cands = NULL;
+    acc_stanza_index_t  *idx = NULL;
 
     spadat.service_data_list = NULL;
+    spadat.granted = 0;
+    spadat.authz_gen = authz_cache_gen();
+    spadat.arrival_time   = spa_pkt->arrival_time;
+    spadat.cluster_origin = spa_pkt->cluster_origin;
+    spadat.cluster_token  = spa_pkt->cluster_token;
+    spadat.fr_reason      = SPA_SDP_MODE(opts) ? FR_UNKNOWN_ID : FR_NO_STANZA;
+    spadat.fr_res         = 0;
+
+    spa_trace_attach(spa_pkt);
 
-    inet_ntop(AF_INET, &(spa_pkt->packet_src_ip),
+    spa_addr_ntop(&(spa_pkt->packet_src_addr),
         spadat.pkt_source_ip, sizeof(spadat.pkt_source_ip));
 
-    inet_ntop(AF_INET, &(spa_pkt->packet_dst_ip),
+    spa_addr_ntop(&(spa_pkt->packet_dst_addr),
         spadat.pkt_destination_ip, sizeof(spadat.pkt_destination_ip));
 
-    /* At this point, we want to validate and (if needed) preprocess the
-     * SPA data and/or to be reasonably sure we have a SPA packet (i.e
-     * try to eliminate obvious non-spa packets).
+    /* Anything allocated for this packet comes from here and is wiped in
+     * one go at cleanup.
     */
-    if(! precheck_pkt(opts, spa_pkt, &spadat))
-        goto cleanup;
+    if((spadat.arena = spa_arena_get()) == NULL)
+    {
+        log_msg(LOG_ERR, "[%s] Unable to allocate the SPA packet arena.",
+            spadat.pkt_source_ip);
+        if(spa_pkt->replay_digest_set)
+            replay_release(spa_pkt->replay_digest);
+        spa_trace_detach();
+        return;
+    }
 
-    if(! replay_check(opts, spa_pkt, &raw_digest))
-        goto cleanup;
+    /* Stanzas stay valid until the read-side section ends, even if the
+     * controller (SDP mode) or a SIGHUP reload (legacy mode) replaces
+     * them meanwhile.
+    */
+    rcu_read_lock();
 
-    if(strncasecmp(opts->config[CONF_DISABLE_SDP_MODE], "Y", 1) == 0)
+    bench_stage_start(&ts);
+    if(! SPA_SDP_MODE(opts))
     {
-        if(! src_check(opts, spa_pkt, &spadat))
-            goto cleanup;
+        idx = rcu_dereference(opts->acc_index);
+        rv  = src_check(idx, spa_pkt, &spadat, &cands);
     }
     else
-    {
-        if(! sdp_id_check(opts, spa_pkt, &acc))
-            goto cleanup;
-    }
+        rv = sdp_id_check(opts, spa_pkt, &acc);
+    bench_stage_end(BENCH_STAGE_ACCESS, &ts);
+    if(! rv)
+        goto cleanup;
 
-    if(strncasecmp(opts->config[CONF_ENABLE_SPA_PACKET_AGING], "Y", 1) == 0)
-    {
-        conf_pkt_age = strtol_wrapper(opts->config[CONF_MAX_SPA_PACKET_AGE],
-                0, RCHK_MAX_SPA_PACKET_AGE, NO_EXIT_UPON_ERR, &is_err);
-        if(is_err != FKO_SUCCESS)
-        {
-            log_msg(LOG_ERR, "[*] [%s] invalid MAX_SPA_PACKET_AGE", spadat.pkt_source_ip);
-            goto cleanup;
-        }
-    }
+    if(opts->rt->spa_packet_aging)
+        conf_pkt_age = opts->rt->max_spa_packet_age;
 
     /* Now that we know there is a matching access.conf stanza and the
      * incoming SPA packet is not a replay, see if we should grant any
      * access
     */
 
-    if(strncasecmp(opts->config[CONF_DISABLE_SDP_MODE], "Y", 1) == 0)
+    if(! SPA_SDP_MODE(opts))
     {
-        acc = opts->acc_stanzas;
-        /* Loop through all access stanzas looking for a match
+        enc_type = fko_encryption_type_len((const char *)spa_pkt->packet_data,
+                spa_pkt->packet_data_len);
+
+        /* Loop through the stanzas whose SOURCE matched, in access.conf
+         * order, skipping any without a key for this encryption type.
         */
-        while(acc)
+        for(i=0; i < idx->num_stanzas; i++)
         {
-            stanza_num++;
+            if(cands[i] == NULL || ! stanza_enc_match(cands[i], enc_type))
+                continue;
 
-            if( process_spa_data(opts, &ctx, acc, spa_pkt, &spadat, stanza_num,
-                    raw_digest, conf_pkt_age) == KEEP_SEARCHING )
+            stanza_num = i+1;
+
+            if( process_spa_data(opts, &ctx, cands[i], spa_pkt, &spadat, stanza_num,
+                    conf_pkt_age, &trial_decrypts) == KEEP_SEARCHING )
             {
                 if(ctx != NULL)
                 {
-                    if(fko_destroy(ctx) == FKO_ERROR_ZERO_OUT_DATA)
+                    if(spa_ctx_release(ctx) == FKO_ERROR_ZERO_OUT_DATA)
                         log_msg(LOG_WARNING,
-                            "[%s] (stanza #%d) fko_destroy() could not zero out sensitive data buffer.",
+                            "[%s] (stanza #%d) fko_reset() could not zero out sensitive data buffer.",
                             spadat.pkt_source_ip, stanza_num
                         );
                     ctx = NULL;
                 }
-
-                acc = acc->next;
             }
             else
             {
@@ -1374,27 +1669,187 @@ incoming_spa(fko_srv_options_t *opts)
     }
     else
     {
-        process_spa_data(opts, &ctx, acc, spa_pkt, &spadat, stanza_num, raw_digest, conf_pkt_age);
+        process_spa_data(opts, &ctx, acc, spa_pkt, &spadat, stanza_num,
+                conf_pkt_age, &trial_decrypts);
     }
 
+    log_msg(LOG_DEBUG, "[%s] SPA packet cost %d trial decryption(s)",
+        spadat.pkt_source_ip, trial_decrypts);
+    bench_trial_decrypts(trial_decrypts);
+
 cleanup:
-    if (raw_digest != NULL)
-        free(raw_digest);
+    if (spa_pkt->replay_digest_set)
+        replay_release(spa_pkt->replay_digest);
+
+    if(spadat.granted)
+        spa_shed_note(spa_pkt, 1);
 
     if(ctx != NULL)
     {
-        if(fko_destroy(ctx) == FKO_ERROR_ZERO_OUT_DATA)
+        if(spa_ctx_release(ctx) == FKO_ERROR_ZERO_OUT_DATA)
             log_msg(LOG_WARNING,
-                "[%s] (stanza #%d) fko_destroy() could not zero out sensitive data buffer.",
+                "[%s] (stanza #%d) fko_reset() could not zero out sensitive data buffer.",
                 spadat.pkt_source_ip, stanza_num
             );
         ctx = NULL;
     }
 
-	if(spadat.service_data_list != NULL)
-	{
-		free_service_data_list(spadat.service_data_list);
-	}
+    rcu_read_unlock();
+
+    spa_arena_reset(spadat.arena);
+
+    if(spadat.granted)
+        flight_recorder_record(spa_pkt, FR_OK, 0);
+    else
+        flight_recorder_record(spa_pkt, spadat.fr_reason, spadat.fr_res);
+
+    spa_pkt->verdict = spadat.granted ? FWKNOP_VERDICT_GRANTED
+                                      : FWKNOP_VERDICT_DENIED;
+    FWKNOP_PROBE2(spa_exit, spa_pkt, spa_pkt->verdict);
+
+    spa_trace_detach();
+    return;
+}
+
+
+/* The cheap receive-side part of SPA processing - the precheck and the
+ * replay lookup.  Returns 1 (with the packet's replay digest set if
+ * digest persistence is on) when the packet should go on to
+ * incoming_spa_authorize(), and 0 if it has been dropped.
+*/
+static int
+incoming_spa_accept(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt)
+{
+    int             rv;
+    struct timespec ts;
+
+    /* This will hold our pertinent SPA data.
+    */
+    spa_data_t spadat;
+
+    spa_pkt->replay_digest_set = 0;
+    flight_recorder_begin(spa_pkt);
+    spa_trace_begin(spa_pkt);
+
+    METRIC_INC(METRIC_PKTS_CAPTURED);
+    FWKNOP_PROBE2(spa_entry, spa_pkt, spa_pkt->packet_data_len);
+
+    log_msg(LOG_DEBUG, "incoming_spa() : just arrived, stay tuned");
+
+    spa_addr_ntop(&(spa_pkt->packet_src_addr),
+        spadat.pkt_source_ip, sizeof(spadat.pkt_source_ip));
+
+    /* At this point, we want to validate and (if needed) preprocess the
+     * SPA data and/or to be reasonably sure we have a SPA packet (i.e
+     * try to eliminate obvious non-spa packets).
+    */
+    bench_stage_start(&ts);
+    rv = precheck_pkt(opts, spa_pkt, &spadat);
+    bench_stage_end(BENCH_STAGE_PRECHECK, &ts);
+    if(! rv)
+    {
+        spa_trace_detach();
+        flight_recorder_record(spa_pkt, spadat.fr_reason, spadat.fr_res);
+        spa_pkt->verdict = FWKNOP_VERDICT_DROPPED;
+        FWKNOP_PROBE2(spa_exit, spa_pkt, FWKNOP_VERDICT_DROPPED);
+        return 0;
+    }
+
+    METRIC_INC(METRIC_PKTS_PRECHECKED);
+
+    bench_stage_start(&ts);
+    rv = replay_check(opts, spa_pkt);
+    bench_stage_end(BENCH_STAGE_REPLAY, &ts);
+    spa_trace_detach();
+    if(! rv)
+    {
+        flight_recorder_record(spa_pkt, FR_REPLAY, 0);
+        spa_pkt->verdict = FWKNOP_VERDICT_REPLAY;
+        FWKNOP_PROBE2(spa_exit, spa_pkt, FWKNOP_VERDICT_REPLAY);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Everything from here on is the expensive part, so hand it to a SPA
+ * worker if there are any and get back to receiving packets.
+*/
+static void
+incoming_spa_handoff(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt)
+{
+    if(spa_workers_running())
+        spa_pkt->verdict = spa_workers_dispatch(spa_pkt) == 0
+            ? FWKNOP_VERDICT_QUEUED : FWKNOP_VERDICT_DROPPED;
+    else
+        incoming_spa_authorize(opts, spa_pkt);
+
+    return;
+}
+
+/* Process the SPA packet data
+*/
+void
+incoming_spa(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt)
+{
+    if(incoming_spa_accept(opts, spa_pkt))
+        incoming_spa_handoff(opts, spa_pkt);
+
+    return;
+}
+
+/* Ordering used to group the packets of a batch - by SDP client ID in
+ * SDP mode, and by source address (which decides the candidate access
+ * stanzas) otherwise.
+*/
+static int
+spa_batch_cmp(const fko_srv_options_t *opts, const spa_pkt_info_t *a,
+        const spa_pkt_info_t *b)
+{
+    if(SPA_SDP_MODE(opts))
+        return (a->sdp_id > b->sdp_id) - (a->sdp_id < b->sdp_id);
+
+    if(a->packet_src_addr.family != b->packet_src_addr.family)
+        return a->packet_src_addr.family - b->packet_src_addr.family;
+
+    return memcmp(a->packet_src_addr.addr, b->packet_src_addr.addr,
+            sizeof(a->packet_src_addr.addr));
+}
+
+/* Process a batch of packets, e.g. everything one recvmmsg() call
+ * returned.  All of the prechecks and replay lookups are done first, then
+ * the surviving packets are authorized grouped by SDP client ID or source
+ * address, so that packets for the same access stanza are decrypted and
+ * HMAC checked back to back while its key state is warm.  Packets from
+ * the same group keep their arrival order.
+*/
+void
+incoming_spa_batch(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkts,
+        const int num_pkts)
+{
+    spa_pkt_info_t *pkts[SPA_BATCH_LEN];
+    int             start, i, j, n;
+
+    for(start=0; start < num_pkts; start += SPA_BATCH_LEN)
+    {
+        n = 0;
+        for(i=start; i < num_pkts && i < start + SPA_BATCH_LEN; i++)
+        {
+            if(! incoming_spa_accept(opts, &(spa_pkts[i])))
+                continue;
+
+            /* Insertion sort - batches are small and mostly arrive
+             * already grouped.
+            */
+            for(j=n; j > 0 && spa_batch_cmp(opts, pkts[j-1], &(spa_pkts[i])) > 0; j--)
+                pkts[j] = pkts[j-1];
+            pkts[j] = &(spa_pkts[i]);
+            n++;
+        }
+
+        for(i=0; i < n; i++)
+            incoming_spa_handoff(opts, pkts[i]);
+    }
 
     return;
 }
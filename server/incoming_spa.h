@@ -31,8 +31,16 @@
 #ifndef INCOMING_SPA_H
 #define INCOMING_SPA_H
 
+/* Largest number of packets incoming_spa_batch() groups together; longer
+ * batches are processed in chunks of this size.
+*/
+#define SPA_BATCH_LEN   64
+
 /* Prototypes
 */
-void incoming_spa(fko_srv_options_t *opts);
+void incoming_spa(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt);
+void incoming_spa_batch(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkts,
+        const int num_pkts);
+void incoming_spa_authorize(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt);
 
 #endif  /* INCOMING_SPA_H */
@@ -0,0 +1,383 @@
+/*
+ *****************************************************************************
+ *
+ * File:    ipset_nl.c
+ *
+ * Purpose: A minimal ipset client that talks to the kernel over netlink,
+ *          enough to create and destroy a set and add entries with a
+ *          timeout.  Adding an entry is one message instead of a fork and
+ *          exec of ipset, and needs no library.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+
+#if FIREWALL_IPTABLES
+
+#include "ipset_nl.h"
+
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/ipset/ip_set.h>
+
+static int      ipset_sock = -1;
+static uint32_t ipset_seq  = 0;
+static char     ipset_buf[IPSET_NL_BUFSIZE];
+
+/* Message building.  Attributes are appended to the message in buf, and
+ * put_attr() returns NULL once the buffer is full.
+*/
+static struct nlmsghdr *
+msg_start(const uint8_t cmd, const uint16_t flags)
+{
+    struct nlmsghdr    *nlh = (struct nlmsghdr *)ipset_buf;
+    struct nfgenmsg    *nfg;
+
+    memset(ipset_buf, 0x0, NLMSG_LENGTH(sizeof(struct nfgenmsg)));
+
+    nlh->nlmsg_len   = NLMSG_LENGTH(sizeof(struct nfgenmsg));
+    nlh->nlmsg_type  = (NFNL_SUBSYS_IPSET << 8) | cmd;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    nlh->nlmsg_seq   = ++ipset_seq;
+
+    nfg = NLMSG_DATA(nlh);
+    nfg->nfgen_family = NFPROTO_IPV4;
+    nfg->version      = NFNETLINK_V0;
+    nfg->res_id       = 0;
+
+    return nlh;
+}
+
+static struct nlattr *
+put_attr(struct nlmsghdr *nlh, const uint16_t type, const void *data,
+        const size_t len)
+{
+    struct nlattr  *nla;
+    size_t          off;
+
+    off = NLMSG_ALIGN(nlh->nlmsg_len);
+    if(off + NLA_ALIGN(NLA_HDRLEN + len) > IPSET_NL_BUFSIZE)
+        return NULL;
+
+    nla = (struct nlattr *)(ipset_buf + off);
+    nla->nla_type = type;
+    nla->nla_len  = NLA_HDRLEN + len;
+    if(len > 0)
+        memcpy((char *)nla + NLA_HDRLEN, data, len);
+    memset((char *)nla + nla->nla_len, 0x0,
+        NLA_ALIGN(nla->nla_len) - nla->nla_len);
+
+    nlh->nlmsg_len = off + NLA_ALIGN(nla->nla_len);
+    return nla;
+}
+
+static struct nlattr *
+put_u8(struct nlmsghdr *nlh, const uint16_t type, const uint8_t val)
+{
+    return put_attr(nlh, type, &val, sizeof(val));
+}
+
+static struct nlattr *
+put_be16(struct nlmsghdr *nlh, const uint16_t type, const uint16_t val)
+{
+    uint16_t    be = htons(val);
+
+    return put_attr(nlh, type | NLA_F_NET_BYTEORDER, &be, sizeof(be));
+}
+
+static struct nlattr *
+put_be32(struct nlmsghdr *nlh, const uint16_t type, const uint32_t val)
+{
+    uint32_t    be = htonl(val);
+
+    return put_attr(nlh, type | NLA_F_NET_BYTEORDER, &be, sizeof(be));
+}
+
+static struct nlattr *
+put_str(struct nlmsghdr *nlh, const uint16_t type, const char * const str)
+{
+    return put_attr(nlh, type, str, strlen(str) + 1);
+}
+
+static struct nlattr *
+nest_start(struct nlmsghdr *nlh, const uint16_t type)
+{
+    return put_attr(nlh, type | NLA_F_NESTED, NULL, 0);
+}
+
+static void
+nest_end(struct nlmsghdr *nlh, struct nlattr *nest)
+{
+    nest->nla_len = (char *)nlh + nlh->nlmsg_len - (char *)nest;
+    return;
+}
+
+/* Send the message and read replies until the ack or error.  Any other
+ * reply is passed to cb.  Returns 0 or a positive errno (which may be one
+ * of the IPSET_ERR_* codes).
+*/
+static int
+msg_talk(struct nlmsghdr *nlh,
+        void (*cb)(const struct nlmsghdr *nlh, void *data), void *data)
+{
+    char                buf[IPSET_NL_BUFSIZE];
+    struct nlmsghdr    *rh;
+    struct nlmsgerr    *err;
+    int                 len;
+
+    if(send(ipset_sock, nlh, nlh->nlmsg_len, 0) < 0)
+        return errno;
+
+    while(1)
+    {
+        if((len = recv(ipset_sock, buf, sizeof(buf), 0)) < 0)
+            return errno;
+
+        for(rh = (struct nlmsghdr *)buf; NLMSG_OK(rh, (unsigned int)len);
+                rh = NLMSG_NEXT(rh, len))
+        {
+            if(rh->nlmsg_seq != nlh->nlmsg_seq)
+                continue;
+
+            if(rh->nlmsg_type == NLMSG_ERROR)
+            {
+                err = NLMSG_DATA(rh);
+                return -err->error;
+            }
+
+            if(cb != NULL)
+                cb(rh, data);
+        }
+    }
+}
+
+int
+ipset_nl_open(void)
+{
+    struct sockaddr_nl  sa;
+    struct timeval      tv;
+
+    if(ipset_sock >= 0)
+        return 0;
+
+    if((ipset_sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_NETFILTER)) < 0)
+        return -1;
+
+    memset(&sa, 0x0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+
+    if(bind(ipset_sock, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+    {
+        close(ipset_sock);
+        ipset_sock = -1;
+        return -1;
+    }
+
+    /* Don't let a missing reply hang the daemon.
+    */
+    tv.tv_sec  = IPSET_NL_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(ipset_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    ipset_seq = time(NULL);
+
+    return 0;
+}
+
+void
+ipset_nl_close(void)
+{
+    if(ipset_sock >= 0)
+        close(ipset_sock);
+    ipset_sock = -1;
+    return;
+}
+
+static void
+type_revision_cb(const struct nlmsghdr *nlh, void *data)
+{
+    const struct nlattr    *nla;
+    int                     len;
+
+    nla = (const struct nlattr *)((const char *)NLMSG_DATA(nlh)
+        + NLMSG_ALIGN(sizeof(struct nfgenmsg)));
+    len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(struct nfgenmsg));
+
+    while(len >= NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN
+            && nla->nla_len <= len)
+    {
+        if((nla->nla_type & NLA_TYPE_MASK) == IPSET_ATTR_REVISION)
+            *(uint8_t *)data = *((const uint8_t *)nla + NLA_HDRLEN);
+
+        len -= NLA_ALIGN(nla->nla_len);
+        nla = (const struct nlattr *)((const char *)nla + NLA_ALIGN(nla->nla_len));
+    }
+    return;
+}
+
+/* Create the set, or keep it if a compatible one already exists.
+*/
+int
+ipset_nl_create(const char * const name, const char * const type,
+        const uint32_t timeout, const int with_mark)
+{
+    struct nlmsghdr    *nlh;
+    struct nlattr      *nest;
+    uint8_t             revision = 0;
+    int                 res;
+
+    /* Ask the kernel for the newest revision of the set type it has.
+    */
+    nlh = msg_start(IPSET_CMD_TYPE, 0);
+    put_u8(nlh, IPSET_ATTR_PROTOCOL, IPSET_PROTOCOL);
+    put_str(nlh, IPSET_ATTR_TYPENAME, type);
+    put_u8(nlh, IPSET_ATTR_FAMILY, NFPROTO_IPV4);
+
+    if((res = msg_talk(nlh, type_revision_cb, &revision)) != 0)
+        return res;
+
+    nlh = msg_start(IPSET_CMD_CREATE, 0);
+    put_u8(nlh, IPSET_ATTR_PROTOCOL, IPSET_PROTOCOL);
+    put_str(nlh, IPSET_ATTR_SETNAME, name);
+    put_str(nlh, IPSET_ATTR_TYPENAME, type);
+    put_u8(nlh, IPSET_ATTR_REVISION, revision);
+    put_u8(nlh, IPSET_ATTR_FAMILY, NFPROTO_IPV4);
+
+    if((nest = nest_start(nlh, IPSET_ATTR_DATA)) == NULL)
+        return ENOBUFS;
+    put_be32(nlh, IPSET_ATTR_TIMEOUT, timeout);
+    if(with_mark)
+        put_be32(nlh, IPSET_ATTR_CADT_FLAGS, IPSET_FLAG_WITH_SKBINFO);
+    nest_end(nlh, nest);
+
+    return msg_talk(nlh, NULL, NULL);
+}
+
+int
+ipset_nl_destroy(const char * const name)
+{
+    struct nlmsghdr    *nlh;
+
+    nlh = msg_start(IPSET_CMD_DESTROY, 0);
+    put_u8(nlh, IPSET_ATTR_PROTOCOL, IPSET_PROTOCOL);
+    put_str(nlh, IPSET_ATTR_SETNAME, name);
+
+    return msg_talk(nlh, NULL, NULL);
+}
+
+static int
+put_ipaddr(struct nlmsghdr *nlh, const uint16_t type, const uint32_t addr)
+{
+    struct nlattr  *nest;
+
+    if((nest = nest_start(nlh, type)) == NULL)
+        return -1;
+    if(put_attr(nlh, IPSET_ATTR_IPADDR_IPV4 | NLA_F_NET_BYTEORDER,
+            &addr, sizeof(addr)) == NULL)
+        return -1;
+    nest_end(nlh, nest);
+    return 0;
+}
+
+/* Add entries to the set in one message, each with the given timeout.
+ * Entries that are already in the set have their timeout (and mark)
+ * replaced.
+*/
+int
+ipset_nl_add(const char * const name, const ipset_entry_t * const entries,
+        const int num_entries, const int with_ip2, const uint32_t timeout,
+        const int with_mark)
+{
+    struct nlmsghdr    *nlh;
+    struct nlattr      *adt, *data;
+    unsigned char       skbmark[8];
+    int                 i;
+
+    nlh = msg_start(IPSET_CMD_ADD, 0);
+    put_u8(nlh, IPSET_ATTR_PROTOCOL, IPSET_PROTOCOL);
+    put_str(nlh, IPSET_ATTR_SETNAME, name);
+    put_be32(nlh, IPSET_ATTR_LINENO, 0);
+
+    if((adt = nest_start(nlh, IPSET_ATTR_ADT)) == NULL)
+        return ENOBUFS;
+
+    for(i=0; i < num_entries; i++)
+    {
+        if((data = nest_start(nlh, IPSET_ATTR_DATA)) == NULL
+                || put_ipaddr(nlh, IPSET_ATTR_IP, entries[i].ip) != 0
+                || put_be16(nlh, IPSET_ATTR_PORT, entries[i].port) == NULL
+                || put_u8(nlh, IPSET_ATTR_PROTO, entries[i].proto) == NULL
+                || (with_ip2 && put_ipaddr(nlh, IPSET_ATTR_IP2, entries[i].ip2) != 0)
+                || put_be32(nlh, IPSET_ATTR_TIMEOUT, timeout) == NULL)
+            return ENOBUFS;
+
+        /* A big endian 64-bit value, the mark followed by its mask.
+        */
+        if(with_mark)
+        {
+            skbmark[0] = entries[i].mark >> 24;
+            skbmark[1] = entries[i].mark >> 16;
+            skbmark[2] = entries[i].mark >> 8;
+            skbmark[3] = entries[i].mark;
+            memset(skbmark+4, 0xff, 4);
+            if(put_attr(nlh, IPSET_ATTR_SKBMARK | NLA_F_NET_BYTEORDER,
+                    skbmark, sizeof(skbmark)) == NULL)
+                return ENOBUFS;
+        }
+        nest_end(nlh, data);
+    }
+    nest_end(nlh, adt);
+
+    return msg_talk(nlh, NULL, NULL);
+}
+
+const char *
+ipset_nl_strerror(const int err)
+{
+    switch(err)
+    {
+        case IPSET_ERR_PROTOCOL:
+            return "kernel ipset protocol error";
+        case IPSET_ERR_FIND_TYPE:
+            return "set type not supported by the kernel";
+        case IPSET_ERR_EXIST_SETNAME2:
+        case IPSET_ERR_EXIST:
+            return "set exists with a different type or options";
+        case IPSET_ERR_REFERENCED:
+            return "set is referenced by a rule";
+        case IPSET_ERR_SKBINFO:
+            return "set does not support skb marks";
+        case IPSET_ERR_TYPE_SPECIFIC:
+            return "set is full";
+    }
+    if(err == ENOENT)
+        return "set does not exist";
+    return strerror(err);
+}
+
+#endif /* FIREWALL_IPTABLES */
+
+/***EOF***/
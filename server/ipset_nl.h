@@ -0,0 +1,66 @@
+/*
+ *****************************************************************************
+ *
+ * File:    ipset_nl.h
+ *
+ * Purpose: Header file for ipset_nl.c - a minimal ipset netlink client.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef IPSET_NL_H
+#define IPSET_NL_H
+
+#include <inttypes.h>
+
+#define IPSET_NL_BUFSIZE        8192
+#define IPSET_NL_TIMEOUT        2       /* seconds to wait for a reply */
+#define IPSET_NL_MAX_ENTRIES    64      /* entries per add message */
+
+/* One set entry - ip,proto:port[,ip2] and an optional skb mark.
+ * Addresses are in network byte order, the port in host byte order.
+*/
+typedef struct ipset_entry
+{
+    uint32_t    ip;
+    uint32_t    ip2;
+    uint16_t    port;
+    uint8_t     proto;
+    uint32_t    mark;
+} ipset_entry_t;
+
+/* Prototypes
+*/
+int ipset_nl_open(void);
+void ipset_nl_close(void);
+int ipset_nl_create(const char * const name, const char * const type,
+        const uint32_t timeout, const int with_mark);
+int ipset_nl_destroy(const char * const name);
+int ipset_nl_add(const char * const name, const ipset_entry_t * const entries,
+        const int num_entries, const int with_ip2, const uint32_t timeout,
+        const int with_mark);
+const char *ipset_nl_strerror(const int err);
+
+#endif /* IPSET_NL_H */
+
+/***EOF***/
@@ -4,7 +4,10 @@
  * File:    log_msg.c
  *
  * Purpose: General logging routine that can write to syslog and/or stderr
- *          and can take varibale number of args.
+ *          and can take varibale number of args.  Once the server is
+ *          running, messages are formatted into a ring and written out by
+ *          a logging thread, so a slow syslog daemon never holds up the
+ *          packet path.
  *
  *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
  *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
@@ -32,6 +35,8 @@
 #include "fwknopd_common.h"
 #include "utils.h"
 #include "log_msg.h"
+#include <fcntl.h>
+#include <errno.h>
 
 /* The default log facility (can be overridden via config file directive).
 */
@@ -50,13 +55,638 @@ static char *log_name = NULL;
 /* The value of the default verbosity used by the log module */
 static int verbosity = LOG_DEFAULT_VERBOSITY;
 
+/* Set once openlog() has been called for the current log_name.
+*/
+static int syslog_open = 0;
+
+/* Per call site rate limiting for LOG_RATE_LIMIT messages.  Each slot
+ * has its own spinlock; it is only held to update the counters.
+*/
+typedef struct log_rate_slot
+{
+    const char     *fmt;
+    time_t          start;
+    unsigned int    count;
+    unsigned long   suppressed;
+    char            lock;
+} log_rate_slot_t;
+
+static log_rate_slot_t log_rate[LOG_RATE_SLOTS];
+
+/* Decide whether a rate limited message may be written.  Returns 1 if it
+ * may, 0 if it is suppressed.  If the slot's last interval ended with
+ * messages suppressed, their number, format and the length of the
+ * interval are returned for a summary line.
+*/
+static int
+log_rate_check(const char *fmt, unsigned long *r_suppressed,
+        const char **r_fmt, int *r_secs)
+{
+    log_rate_slot_t    *slot;
+    uintptr_t           h = (uintptr_t)fmt;
+    time_t              now = time(NULL);
+    int                 allow = 1;
+
+    h ^= h >> 11;
+    slot = &(log_rate[(h >> 2) & (LOG_RATE_SLOTS - 1)]);
+
+    while(__atomic_test_and_set(&(slot->lock), __ATOMIC_ACQUIRE))
+        ;
+
+    *r_suppressed = 0;
+    if(slot->fmt != fmt || now - slot->start >= LOG_RATE_INTERVAL)
+    {
+        if(slot->suppressed > 0)
+        {
+            *r_suppressed = slot->suppressed;
+            *r_fmt        = slot->fmt;
+            *r_secs       = (int)(now - slot->start);
+        }
+        slot->fmt        = fmt;
+        slot->start      = now;
+        slot->count      = 0;
+        slot->suppressed = 0;
+    }
+
+    if(slot->count < LOG_RATE_BURST)
+        slot->count++;
+    else
+    {
+        slot->suppressed++;
+        allow = 0;
+    }
+
+    __atomic_clear(&(slot->lock), __ATOMIC_RELEASE);
+    return allow;
+}
+
+/* Log ring.  Any thread may add a record; only the logging thread takes
+ * them off.  Each slot carries a sequence number (as in Vyukov's bounded
+ * queue): a slot is free for the producer at position pos when its
+ * sequence is pos, and holds a record for the consumer when it is pos+1.
+ * Producers claim a position with a compare-and-swap on head and never
+ * wait - if the ring is full the message is counted as dropped.
+*/
+typedef struct log_rec
+{
+    unsigned int    seq;
+    int             level;
+    time_t          ts;
+    char            text[LOG_RING_MSG_LEN];
+} log_rec_t;
+
+static struct log_ring
+{
+    log_rec_t          *recs;
+    unsigned int        head;
+    unsigned int        tail;
+    unsigned long       dropped;
+    unsigned long       reported;
+    int                 running;
+    int                 stopping;
+    int                 waiting;
+    int                 atfork_set;
+    pthread_t           thread;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+} log_ring = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond  = PTHREAD_COND_INITIALIZER
+};
+
+/* Direct log file sink (LOG_FILE).  Lines are collected in buf and
+ * appended to the file with one write() when the logging thread has
+ * drained the ring or the buffer is full; without the logging thread
+ * each line is written at once.  The file is rotated in process once it
+ * reaches max_size bytes or has been open rotate_interval seconds:
+ * path.N-1 is renamed to path.N and so on down to path, which becomes
+ * path.1, and path is opened afresh.  There is no need to signal the
+ * daemon after moving the file away.  The mutex is only contended when
+ * logging does not go through the ring, or while logging is set up.
+*/
+static struct log_file
+{
+    char               *path;
+    char               *ident;
+    int                 fd;
+    int                 json;
+    int                 keep;
+    int                 rotate_interval;
+    off_t               max_size;
+    off_t               size;
+    time_t              opened;
+    time_t              ts_sec;
+    pid_t               pid;
+    char                ts_str[32];
+    char               *buf;
+    size_t              len;
+    pthread_mutex_t     mutex;
+} log_file = {
+    .fd    = -1,
+    .mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+static const char *log_level_names[] = {
+    "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"
+};
+
+/* Write out the buffered lines.  A failed write drops them, there is
+ * nowhere else to report it.
+*/
+static void
+log_file_flush(void)
+{
+    size_t      off = 0;
+    ssize_t     n;
+
+    while(off < log_file.len)
+    {
+        if((n = write(log_file.fd, log_file.buf + off, log_file.len - off)) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+        off += n;
+    }
+    log_file.len = 0;
+}
+
+static int
+log_file_open(void)
+{
+    struct stat st;
+
+    if((log_file.fd = open(log_file.path,
+                    O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR)) < 0)
+        return -1;
+
+    log_file.size   = (fstat(log_file.fd, &st) == 0) ? st.st_size : 0;
+    log_file.opened = time(NULL);
+    return 0;
+}
+
+static void
+log_file_rotate(void)
+{
+    char    from[MAX_PATH_LEN], to[MAX_PATH_LEN];
+    int     i;
+
+    log_file_flush();
+    close(log_file.fd);
+    log_file.fd = -1;
+
+    if(log_file.keep == 0)
+        unlink(log_file.path);
+
+    for(i = log_file.keep; i > 0; i--)
+    {
+        if(i > 1)
+            snprintf(from, sizeof(from), "%s.%d", log_file.path, i-1);
+        else
+            strlcpy(from, log_file.path, sizeof(from));
+        snprintf(to, sizeof(to), "%s.%d", log_file.path, i);
+        rename(from, to);
+    }
+
+    log_file_open();
+}
+
+/* Append one line, as plain text or a compact JSON object.
+*/
+static void
+log_file_line(int level, time_t ts, const char *text)
+{
+    struct tm   tm;
+    const char *ident = log_file.ident;
+    char       *p;
+    size_t      room;
+    int         n;
+
+    if(ts != log_file.ts_sec)
+    {
+        localtime_r(&ts, &tm);
+        strftime(log_file.ts_str, sizeof(log_file.ts_str), "%Y-%m-%dT%H:%M:%S%z", &tm);
+        log_file.ts_sec = ts;
+        log_file.pid    = getpid();
+    }
+
+    level &= LOG_VERBOSITY_MASK;
+    if(level > LOG_DEBUG)
+        level = LOG_DEBUG;
+
+    /* Escaping can at most sextuple the text, plus the other fields.
+    */
+    if(log_file.len + strlen(text) * 6 + strlen(ident) + 128 > LOG_FILE_BUF_LEN)
+        log_file_flush();
+
+    p    = log_file.buf + log_file.len;
+    room = LOG_FILE_BUF_LEN - log_file.len;
+
+    if(! log_file.json)
+    {
+        n = snprintf(p, room, "%s %s[%d]: %s\n", log_file.ts_str,
+                ident, (int)log_file.pid, text);
+        if(n < 0)
+            return;
+        if((size_t)n >= room)
+        {
+            n = room - 1;
+            p[n-1] = '\n';
+        }
+    }
+    else
+    {
+        n = snprintf(p, room, "{\"time\":\"%s\",\"ident\":\"%s\",\"pid\":%d,"
+                "\"level\":\"%s\",\"msg\":\"", log_file.ts_str,
+                ident, (int)log_file.pid,
+                log_level_names[level]);
+        if(n < 0 || (size_t)n >= room)
+            return;
+
+        for(; *text != '\0'; text++)
+        {
+            if(*text == '"' || *text == '\\')
+            {
+                p[n++] = '\\';
+                p[n++] = *text;
+            }
+            else if((unsigned char)*text < 0x20)
+                n += sprintf(p + n, "\\u%04x", (unsigned char)*text);
+            else
+                p[n++] = *text;
+        }
+        p[n++] = '"';
+        p[n++] = '}';
+        p[n++] = '\n';
+    }
+
+    log_file.len  += n;
+    log_file.size += n;
+}
+
+/* Add a message to the log file, if there is one.  With buffered set the
+ * line may wait for log_file_sync().
+*/
+static void
+log_file_write(int level, time_t ts, const char *text, int buffered)
+{
+    pthread_mutex_lock(&(log_file.mutex));
+
+    /* A file that could not be reopened after rotating is tried again.
+    */
+    if(log_file.path != NULL && (log_file.fd >= 0 || log_file_open() == 0))
+    {
+        if((log_file.max_size > 0 && log_file.size >= log_file.max_size)
+                || (log_file.rotate_interval > 0
+                    && ts - log_file.opened >= log_file.rotate_interval))
+            log_file_rotate();
+
+        if(log_file.fd >= 0)
+        {
+            log_file_line(level, ts, text);
+            if(! buffered)
+                log_file_flush();
+        }
+    }
+
+    pthread_mutex_unlock(&(log_file.mutex));
+}
+
+static void
+log_file_sync(void)
+{
+    pthread_mutex_lock(&(log_file.mutex));
+    if(log_file.fd >= 0 && log_file.len > 0)
+        log_file_flush();
+    pthread_mutex_unlock(&(log_file.mutex));
+}
+
+static void
+log_file_close(void)
+{
+    pthread_mutex_lock(&(log_file.mutex));
+
+    if(log_file.fd >= 0)
+    {
+        log_file_flush();
+        close(log_file.fd);
+        log_file.fd = -1;
+    }
+
+    free(log_file.path);
+    log_file.path = NULL;
+    free(log_file.ident);
+    log_file.ident = NULL;
+    free(log_file.buf);
+    log_file.buf = NULL;
+    log_file.len = 0;
+
+    pthread_mutex_unlock(&(log_file.mutex));
+}
+
+/* Open the LOG_FILE sink.  Returns 0 on success (or when none is set)
+ * and -1 if the file could not be opened.
+*/
+static int
+log_file_init(fko_srv_options_t *opts)
+{
+    int     is_err, rv = 0;
+
+    log_file_close();
+
+    if(opts->config[CONF_LOG_FILE] == NULL || opts->config[CONF_LOG_FILE][0] == '\0')
+        return 0;
+
+    pthread_mutex_lock(&(log_file.mutex));
+
+    log_file.json = strncasecmp(opts->config[CONF_LOG_FILE_JSON], "Y", 1) == 0;
+    log_file.keep = strtol_wrapper(opts->config[CONF_LOG_FILE_KEEP],
+            0, RCHK_MAX_LOG_FILE_KEEP, NO_EXIT_UPON_ERR, &is_err);
+    log_file.rotate_interval = strtol_wrapper(opts->config[CONF_LOG_FILE_ROTATE_INTERVAL],
+            0, RCHK_MAX_LOG_FILE_ROTATE_INTERVAL, NO_EXIT_UPON_ERR, &is_err);
+    log_file.max_size = strtol_wrapper(opts->config[CONF_LOG_FILE_MAX_SIZE],
+            0, RCHK_MAX_LOG_FILE_MAX_SIZE, NO_EXIT_UPON_ERR, &is_err);
+    log_file.ts_sec = 0;
+
+    /* The name is copied, log_name is replaced on a restart while the
+     * logging thread may be writing.
+    */
+    if((log_file.path = strdup(opts->config[CONF_LOG_FILE])) == NULL
+            || (log_file.ident = strdup(log_name)) == NULL
+            || (log_file.buf = malloc(LOG_FILE_BUF_LEN)) == NULL
+            || log_file_open() != 0)
+    {
+        free(log_file.path);
+        log_file.path = NULL;
+        free(log_file.ident);
+        log_file.ident = NULL;
+        free(log_file.buf);
+        log_file.buf = NULL;
+        rv = -1;
+    }
+
+    pthread_mutex_unlock(&(log_file.mutex));
+    return rv;
+}
+
+/* Write one formatted message to stderr, the log file and/or syslog
+ * according to the flags in level.
+*/
+static void
+log_write(int level, time_t ts, const char *text, int buffered)
+{
+    if(LOG_STDERR & level)
+    {
+        fprintf(stderr, "%s\n", text);
+        fflush(stderr);
+    }
+
+    if(log_file.path != NULL)
+        log_file_write(level, ts, text, buffered);
+
+    if(!(LOG_WITHOUT_SYSLOG & level))
+        syslog(level & LOG_VERBOSITY_MASK, "%s", text);
+}
+
+/* Write out every record in the ring.  Only the logging thread (or
+ * log_ring_stop() once it is gone) calls this.
+*/
+static void
+log_ring_drain(void)
+{
+    log_rec_t      *rec;
+    unsigned long   dropped;
+    char            buf[64];
+
+    for(;;)
+    {
+        rec = &(log_ring.recs[log_ring.tail & (LOG_RING_LEN - 1)]);
+
+        if((int)(__atomic_load_n(&(rec->seq), __ATOMIC_ACQUIRE)
+                    - (log_ring.tail + 1)) < 0)
+            break;
+
+        log_write(rec->level, rec->ts, rec->text, 1);
+
+        __atomic_store_n(&(rec->seq), log_ring.tail + LOG_RING_LEN,
+                __ATOMIC_RELEASE);
+        log_ring.tail++;
+    }
+
+    dropped = __atomic_load_n(&(log_ring.dropped), __ATOMIC_RELAXED);
+    if(dropped != log_ring.reported)
+    {
+        snprintf(buf, sizeof(buf), "Log ring full, dropped %lu message(s)",
+                dropped - log_ring.reported);
+        log_write(LOG_WARNING | static_log_flag, time(NULL), buf, 1);
+        log_ring.reported = dropped;
+    }
+
+    log_file_sync();
+}
+
+static void *
+log_ring_thread(void *arg)
+{
+    struct timespec ts;
+
+    (void)arg;
+
+    for(;;)
+    {
+        log_ring_drain();
+
+        pthread_mutex_lock(&(log_ring.mutex));
+
+        if(log_ring.stopping)
+        {
+            pthread_mutex_unlock(&(log_ring.mutex));
+            break;
+        }
+
+        /* Producers only signal when they see waiting set, so check the
+         * ring again after setting it.  The timeout covers a wakeup that
+         * is missed anyway.
+        */
+        __atomic_store_n(&(log_ring.waiting), 1, __ATOMIC_SEQ_CST);
+
+        if((int)(__atomic_load_n(&(log_ring.recs[log_ring.tail & (LOG_RING_LEN - 1)].seq),
+                    __ATOMIC_ACQUIRE) - (log_ring.tail + 1)) < 0)
+        {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += LOG_RING_WAIT_MS * 1000000L;
+            if(ts.tv_nsec >= 1000000000L)
+            {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&(log_ring.cond), &(log_ring.mutex), &ts);
+        }
+
+        __atomic_store_n(&(log_ring.waiting), 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&(log_ring.mutex));
+    }
+
+    log_ring_drain();
+    return NULL;
+}
+
+/* Format a message into the ring.  Returns 0 if it was queued, 1 if it
+ * was dropped because the ring is full.
+*/
+static int
+log_ring_put(int level, const char *msg, va_list ap)
+{
+    log_rec_t      *rec;
+    unsigned int    pos, seq;
+
+    pos = __atomic_load_n(&(log_ring.head), __ATOMIC_RELAXED);
+
+    for(;;)
+    {
+        rec = &(log_ring.recs[pos & (LOG_RING_LEN - 1)]);
+        seq = __atomic_load_n(&(rec->seq), __ATOMIC_ACQUIRE);
+
+        if((int)(seq - pos) == 0)
+        {
+            if(__atomic_compare_exchange_n(&(log_ring.head), &pos, pos + 1,
+                        0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if((int)(seq - pos) < 0)
+        {
+            __atomic_add_fetch(&(log_ring.dropped), 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+        else
+            pos = __atomic_load_n(&(log_ring.head), __ATOMIC_RELAXED);
+    }
+
+    /* Messages longer than a slot are cut short.
+    */
+    vsnprintf(rec->text, sizeof(rec->text), msg, ap);
+    rec->level = level;
+    rec->ts    = time(NULL);
+
+    __atomic_store_n(&(rec->seq), pos + 1, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&(log_ring.waiting), __ATOMIC_RELAXED))
+    {
+        pthread_mutex_lock(&(log_ring.mutex));
+        pthread_cond_signal(&(log_ring.cond));
+        pthread_mutex_unlock(&(log_ring.mutex));
+    }
+
+    return 0;
+}
+
+/* A forked child has no logging thread, so it logs directly.
+*/
+static void
+log_ring_atfork_child(void)
+{
+    log_ring.running = 0;
+
+    /* The lock may have been held by the logging thread, and the lines
+     * buffered so far are the parent's to write.
+    */
+    pthread_mutex_init(&(log_file.mutex), NULL);
+    log_file.len = 0;
+}
+
+/* Start the logging thread.  Until this is called (and after
+ * log_ring_stop()) log_msg() writes messages out itself.  This must be
+ * called after daemonizing, as the thread does not survive a fork().
+*/
+int
+log_ring_start(void)
+{
+    unsigned int    i;
+
+    if(log_ring.running)
+        return 0;
+
+    if(log_ring.recs == NULL)
+    {
+        if((log_ring.recs = calloc(LOG_RING_LEN, sizeof(log_rec_t))) == NULL)
+        {
+            log_msg(LOG_ERR, "Memory allocation error setting up the log ring");
+            return -1;
+        }
+    }
+
+    for(i=0; i < LOG_RING_LEN; i++)
+        log_ring.recs[i].seq = i;
+
+    log_ring.head     = 0;
+    log_ring.tail     = 0;
+    log_ring.dropped  = 0;
+    log_ring.reported = 0;
+    log_ring.stopping = 0;
+    log_ring.waiting  = 0;
+
+    if(!log_ring.atfork_set)
+    {
+        pthread_atfork(NULL, NULL, log_ring_atfork_child);
+        log_ring.atfork_set = 1;
+    }
+
+    if(pthread_create(&(log_ring.thread), NULL, log_ring_thread, NULL) != 0)
+    {
+        log_msg(LOG_ERR, "Unable to start the logging thread");
+        return -1;
+    }
+
+    __atomic_store_n(&(log_ring.running), 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Stop the logging thread once it has written out everything queued so
+ * far.  Later messages are written out directly again.
+*/
+void
+log_ring_stop(void)
+{
+    if(!log_ring.running)
+        return;
+
+    __atomic_store_n(&(log_ring.running), 0, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&(log_ring.mutex));
+    log_ring.stopping = 1;
+    pthread_cond_signal(&(log_ring.cond));
+    pthread_mutex_unlock(&(log_ring.mutex));
+
+    pthread_join(log_ring.thread, NULL);
+
+    /* Catch anything added by a thread that saw the ring running just
+     * before it stopped.
+    */
+    log_ring_drain();
+    return;
+}
+
 /* Free resources allocated for logging.
 */
 void
 free_logging(void)
 {
+    log_ring_stop();
+    log_file_close();
+
+    if(syslog_open)
+    {
+        closelog();
+        syslog_open = 0;
+    }
+
     if(log_name != NULL)
+    {
         free(log_name);
+        log_name = NULL;
+    }
 }
 
 /* Initialize logging sets the name used for syslog.
@@ -66,9 +696,20 @@ init_logging(fko_srv_options_t *opts) {
     char       *my_name = NULL;
     int         is_syslog = 0;
 
-    /* In case this is a re-init.
+    /* In case this is a re-init.  The ring (if running) is left alone,
+     * only the syslog connection is replaced.
     */
-    free_logging();
+    if(syslog_open)
+    {
+        closelog();
+        syslog_open = 0;
+    }
+
+    if(log_name != NULL)
+    {
+        free(log_name);
+        log_name = NULL;
+    }
 
     /* Allocate memory for the log_name and set the my_name to point to the
      * appropriate name. The name should already be set in the config struct
@@ -116,6 +757,22 @@ init_logging(fko_srv_options_t *opts) {
     if (opts->syslog_enable != 0)
         static_log_flag &= ~LOG_WITHOUT_SYSLOG;
 
+    /* A LOG_FILE takes the place of syslog unless --syslog-enable asks
+     * for both.  Firewall operations from the command line leave it be.
+    */
+    if(opts->fw_flush == 0 && opts->fw_list == 0 && opts->fw_list_all == 0)
+    {
+        if(log_file_init(opts) != 0)
+        {
+            fprintf(stderr, "Unable to open LOG_FILE '%s': %s\n",
+                    opts->config[CONF_LOG_FILE], strerror(errno));
+            clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+        }
+
+        if(log_file.path != NULL && opts->syslog_enable == 0)
+            static_log_flag |= LOG_WITHOUT_SYSLOG;
+    }
+
     /* Parse the log facility as specified in the config struct. If, for some
      * reason, it is not, fac will already be set to LOG_DAEMON.
     */
@@ -149,6 +806,11 @@ init_logging(fko_srv_options_t *opts) {
     }
 
     verbosity = LOG_DEFAULT_VERBOSITY + opts->verbose;
+
+    /* Open the syslog connection once, rather than for each message.
+    */
+    openlog(log_name, LOG_PID, syslog_fac);
+    syslog_open = 1;
 }
 
 /* Syslog message function.  It uses default set at intialization, and also
@@ -157,16 +819,42 @@ init_logging(fko_srv_options_t *opts) {
 void
 log_msg(int level, char* msg, ...)
 {
-    va_list ap, apse;
+    va_list         ap, apse;
+    char            text[LOG_RING_MSG_LEN];
+    unsigned long   suppressed;
+    const char     *sup_fmt = NULL;
+    int             sup_secs = 0;
 
     /* Make sure the level is in the right range */
     if ((level & LOG_VERBOSITY_MASK) > verbosity)
         return;
 
+    /* Messages that can be triggered remotely are rate limited.
+    */
+    if(level & LOG_RATE_LIMIT)
+    {
+        if(! log_rate_check(msg, &suppressed, &sup_fmt, &sup_secs))
+            return;
+
+        if(suppressed > 0)
+            log_msg(level & LOG_VERBOSITY_MASK,
+                "Suppressed %lu similar message(s) in the last %d second(s): %s",
+                suppressed, sup_secs, sup_fmt);
+    }
+
     va_start(ap, msg);
 
     level |= static_log_flag;
 
+    /* Hand the message to the logging thread if it is running.
+    */
+    if(__atomic_load_n(&(log_ring.running), __ATOMIC_ACQUIRE))
+    {
+        log_ring_put(level, msg, ap);
+        va_end(ap);
+        return;
+    }
+
     /* Print msg to stderr if the level was or'ed with LOG_STDERR
     */
     if(LOG_STDERR & level)
@@ -183,6 +871,17 @@ log_msg(int level, char* msg, ...)
         va_end(apse);
     }
 
+    /* Append it to the LOG_FILE, if there is one.
+    */
+    if(log_file.path != NULL)
+    {
+        va_copy(apse, ap);
+        vsnprintf(text, sizeof(text), msg, apse);
+        va_end(apse);
+
+        log_file_write(level, time(NULL), text, 0);
+    }
+
     /* If the message has not to be printed to the syslog, we return */
     if (LOG_WITHOUT_SYSLOG & level)
     {
@@ -195,7 +894,11 @@ log_msg(int level, char* msg, ...)
 
     /* Send the message to syslog.
     */
-    openlog(log_name, LOG_PID, syslog_fac);
+    if(!syslog_open)
+    {
+        openlog(log_name, LOG_PID, syslog_fac);
+        syslog_open = 1;
+    }
 
     vsyslog(level, msg, ap);
 
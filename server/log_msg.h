@@ -45,10 +45,38 @@
 #define LOG_STDERR_ONLY         (LOG_STDERR | LOG_WITHOUT_SYSLOG)
 #define LOG_VERBOSITY_MASK      0x0FFF
 
+/* LOG_RATE_LIMIT is or'ed with the level of messages that a remote peer
+ * can trigger at will (a scan, a flood of bad packets).  At most
+ * LOG_RATE_BURST such messages from the same call site are written every
+ * LOG_RATE_INTERVAL seconds, the rest are counted and summarized in one
+ * line once the interval is over.  Call sites are told apart by their
+ * format string, hashed into LOG_RATE_SLOTS slots (a power of two).
+*/
+#define LOG_RATE_LIMIT          0x4000
+#define LOG_RATE_INTERVAL       10
+#define LOG_RATE_BURST          5
+#define LOG_RATE_SLOTS          256
+
 #define LOG_DEFAULT_VERBOSITY   LOG_INFO     /*!< Default verbosity to use */
 
+/* Log ring - number of records (must be a power of two), the longest
+ * message kept (longer ones are cut short), and how long the logging
+ * thread sleeps between checks when it is not woken.
+*/
+#define LOG_RING_LEN            1024
+#define LOG_RING_MSG_LEN        1024
+#define LOG_RING_WAIT_MS        200
+
+/* Direct log file sink (LOG_FILE) - lines are collected in a buffer of
+ * this size and written out together, once per pass of the logging
+ * thread or when the buffer fills.
+*/
+#define LOG_FILE_BUF_LEN        65536
+
 void init_logging(fko_srv_options_t *opts);
 void free_logging(void);
+int log_ring_start(void);
+void log_ring_stop(void);
 void set_log_facility(int fac);
 void log_msg(int, char*, ...);
 void log_set_verbosity(int level);
@@ -0,0 +1,357 @@
+/*
+ *****************************************************************************
+ *
+ * File:    mem_acct.c
+ *
+ * Purpose: Tagged allocation wrappers.  Each subsystem that holds on to
+ *          memory (stanzas, services, the replay cache, the connection
+ *          tracker, ...) allocates through mem_*() with its own tag, and
+ *          the live byte and allocation counts per tag are exported in
+ *          the metrics and in the SIGUSR1 dump, along with the
+ *          allocator's own per-arena statistics.
+ *
+ *          Sizes come from malloc_usable_size(), so no header is added
+ *          to the allocations and a tagged pointer may still be passed
+ *          to plain free() (it is just no longer accounted for).  Where
+ *          malloc_usable_size() is not available only the counts are
+ *          kept.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "mem_acct.h"
+#include "log_msg.h"
+#include "utils.h"
+
+#if HAVE_MALLOC_H
+  #include <malloc.h>
+#endif
+#if HAVE_JEMALLOC
+  #include <jemalloc/jemalloc.h>
+#elif HAVE_MIMALLOC
+  #include <mimalloc.h>
+#endif
+
+typedef struct mem_acct_ent {
+    long    bytes;
+    long    count;
+} mem_acct_ent_t;
+
+static mem_acct_ent_t mem_acct[MEM_TAGS];
+
+/* With MEM_LIMIT set, allocations that would take the accounted total
+ * past it are refused as though the heap were exhausted, and counted.
+*/
+static long mem_total   = 0;
+static long mem_limit   = 0;
+static long mem_refused = 0;
+
+static const char *mem_tag_names[MEM_TAGS] = {
+    "access_stanzas",
+    "access_index",
+    "services",
+    "replay_cache",
+    "connection_tracker",
+    "hash_tables",
+    "bstrings",
+    "spa_arenas",
+    "authz_cache",
+    "grant_quota",
+    "flight_recorder"
+};
+
+static size_t
+mem_size(void *ptr)
+{
+#if HAVE_MALLOC_USABLE_SIZE
+    return ptr == NULL ? 0 : malloc_usable_size(ptr);
+#else
+    return 0;
+#endif
+}
+
+static void
+mem_account(const mem_tag_t tag, const long bytes, const long count)
+{
+    if(tag >= MEM_TAGS)
+        return;
+
+    __atomic_add_fetch(&(mem_acct[tag].bytes), bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(mem_acct[tag].count), count, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mem_total, bytes, __ATOMIC_RELAXED);
+    return;
+}
+
+static int
+mem_over_limit(const mem_tag_t tag, const size_t size)
+{
+    long    limit = __atomic_load_n(&mem_limit, __ATOMIC_RELAXED);
+
+    if(limit == 0)
+        return 0;
+
+    if(__atomic_load_n(&mem_total, __ATOMIC_RELAXED) + (long)size <= limit)
+        return 0;
+
+    if(__atomic_fetch_add(&mem_refused, 1, __ATOMIC_RELAXED) == 0)
+        log_msg(LOG_WARNING, "[*] MEM_LIMIT of %li bytes reached, refusing "
+                "%lu bytes for %s", limit, (unsigned long)size,
+                mem_tag_name(tag));
+    return 1;
+}
+
+void *
+mem_malloc(const mem_tag_t tag, const size_t size)
+{
+    void   *ptr = NULL;
+
+    if(mem_over_limit(tag, size))
+        return NULL;
+
+    ptr = malloc(size);
+
+    if(ptr != NULL)
+        mem_account(tag, (long)mem_size(ptr), 1);
+    return ptr;
+}
+
+void *
+mem_calloc(const mem_tag_t tag, const size_t nmemb, const size_t size)
+{
+    void   *ptr = NULL;
+
+    if(mem_over_limit(tag, nmemb * size))
+        return NULL;
+
+    ptr = calloc(nmemb, size);
+
+    if(ptr != NULL)
+        mem_account(tag, (long)mem_size(ptr), 1);
+    return ptr;
+}
+
+/* On failure the original block is left alone and still accounted for,
+ * just as realloc() leaves it allocated.
+*/
+void *
+mem_realloc(const mem_tag_t tag, void *ptr, const size_t size)
+{
+    size_t  old_size = mem_size(ptr);
+    void   *new_ptr  = NULL;
+
+    if(size > old_size && mem_over_limit(tag, size - old_size))
+        return NULL;
+
+    new_ptr = realloc(ptr, size);
+
+    if(new_ptr != NULL)
+        mem_account(tag, (long)mem_size(new_ptr) - (long)old_size,
+            ptr == NULL ? 1 : 0);
+    return new_ptr;
+}
+
+char *
+mem_strdup(const mem_tag_t tag, const char *str)
+{
+    char   *ptr = NULL;
+
+    if(mem_over_limit(tag, strlen(str) + 1))
+        return NULL;
+
+    ptr = strdup(str);
+
+    if(ptr != NULL)
+        mem_account(tag, (long)mem_size(ptr), 1);
+    return ptr;
+}
+
+char *
+mem_strndup(const mem_tag_t tag, const char *str, const size_t n)
+{
+    char   *ptr = NULL;
+
+    if(mem_over_limit(tag, strnlen(str, n) + 1))
+        return NULL;
+
+    ptr = strndup(str, n);
+
+    if(ptr != NULL)
+        mem_account(tag, (long)mem_size(ptr), 1);
+    return ptr;
+}
+
+void
+mem_free(const mem_tag_t tag, void *ptr)
+{
+    if(ptr == NULL)
+        return;
+
+    mem_account(tag, -(long)mem_size(ptr), -1);
+    free(ptr);
+    return;
+}
+
+/* Take over the accounting for a block that was allocated elsewhere
+ * (e.g. a string handed back by the SDP control client library) and
+ * will be released with mem_free().
+*/
+void
+mem_adopt(const mem_tag_t tag, void *ptr)
+{
+    if(ptr != NULL)
+        mem_account(tag, (long)mem_size(ptr), 1);
+    return;
+}
+
+void
+mem_acct_get(const mem_tag_t tag, long *bytes, long *count)
+{
+    *bytes = __atomic_load_n(&(mem_acct[tag].bytes), __ATOMIC_RELAXED);
+    *count = __atomic_load_n(&(mem_acct[tag].count), __ATOMIC_RELAXED);
+    return;
+}
+
+/* Apply MEM_LIMIT.  Allocations made before this are counted toward it,
+ * but never refused.
+*/
+int
+mem_acct_start(const fko_srv_options_t *opts)
+{
+    int     is_err = 0;
+    long    limit;
+
+    limit = strtol_wrapper(opts->config[CONF_MEM_LIMIT],
+            0, RCHK_MAX_MEM_LIMIT, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid MEM_LIMIT value.");
+        return -1;
+    }
+
+#if ! HAVE_MALLOC_USABLE_SIZE
+    if(limit > 0)
+        log_msg(LOG_WARNING, "[*] MEM_LIMIT needs malloc_usable_size(), "
+                "only single allocations larger than it are refused.");
+#endif
+
+    __atomic_store_n(&mem_limit, limit, __ATOMIC_RELAXED);
+    if(limit > 0)
+        log_msg(LOG_INFO, "Accounted memory limited to %li bytes (%li in use)",
+                limit, __atomic_load_n(&mem_total, __ATOMIC_RELAXED));
+    return 0;
+}
+
+long
+mem_acct_refused(void)
+{
+    return __atomic_load_n(&mem_refused, __ATOMIC_RELAXED);
+}
+
+const char *
+mem_tag_name(const mem_tag_t tag)
+{
+    return tag < MEM_TAGS ? mem_tag_names[tag] : "unknown";
+}
+
+#if HAVE_JEMALLOC || HAVE_MIMALLOC
+#if HAVE_JEMALLOC
+static void
+mem_stats_write(void *arg, const char *msg)
+#else
+static void
+mem_stats_write(const char *msg, void *arg)
+#endif
+{
+    fputs(msg, (FILE *)arg);
+    return;
+}
+#endif
+
+/* Dump the per-subsystem totals followed by the allocator's statistics
+*/
+void
+dump_mem_stats(const fko_srv_options_t *opts)
+{
+    int     i, opened = 0;
+    long    bytes, count, total_bytes = 0, total_count = 0;
+    FILE   *dest = NULL;
+
+    if(opts->config[CONF_CONFIG_DUMP_OUTPUT_PATH] != NULL &&
+       opts->foreground == 0)
+    {
+        dest = fopen(opts->config[CONF_CONFIG_DUMP_OUTPUT_PATH], "a");
+        if(dest == NULL)
+        {
+            fprintf(stderr, "ERROR opening file for dump_config output: %s\n",
+                    opts->config[CONF_CONFIG_DUMP_OUTPUT_PATH]);
+            dest = stdout;
+        }
+        else
+        {
+            opened = 1;
+        }
+    }
+    else
+    {
+        dest = stdout;
+    }
+
+    fprintf(dest, "Memory by subsystem:\n");
+    for(i=0; i < MEM_TAGS; i++)
+    {
+        mem_acct_get(i, &bytes, &count);
+        fprintf(dest, "    %-20s %12li bytes in %li allocations\n",
+            mem_tag_name(i), bytes, count);
+        total_bytes += bytes;
+        total_count += count;
+    }
+    fprintf(dest, "    %-20s %12li bytes in %li allocations\n",
+        "total", total_bytes, total_count);
+    if(mem_limit > 0)
+        fprintf(dest, "    %-20s %12li bytes, %li allocations refused\n",
+            "MEM_LIMIT", mem_limit, mem_acct_refused());
+#if ! HAVE_MALLOC_USABLE_SIZE
+    fprintf(dest, "    (byte counts need malloc_usable_size())\n");
+#endif
+
+#if HAVE_JEMALLOC
+    fprintf(dest, "\njemalloc statistics:\n");
+    malloc_stats_print(mem_stats_write, dest, NULL);
+#elif HAVE_MIMALLOC
+    fprintf(dest, "\nmimalloc statistics:\n");
+    mi_stats_print_out(mem_stats_write, dest);
+#elif HAVE_MALLOC_INFO
+    fprintf(dest, "\nmalloc arenas:\n");
+    malloc_info(0, dest);
+#endif
+
+    fprintf(dest, "\n");
+    fflush(dest);
+
+    if(opened)
+        fclose(dest);
+
+    return;
+}
+
+/***EOF***/
@@ -0,0 +1,72 @@
+/*
+ *****************************************************************************
+ *
+ * File:    mem_acct.h
+ *
+ * Purpose: Header file for mem_acct.c - per-subsystem allocation accounting.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef MEM_ACCT_H
+#define MEM_ACCT_H
+
+#include "fwknopd_common.h"
+
+/* Subsystems whose long-lived allocations are accounted for.  Each one
+ * should allocate and free its memory through the mem_*() wrappers with
+ * its own tag, so that the totals net out.
+*/
+typedef enum {
+    MEM_TAG_STANZA = 0,
+    MEM_TAG_ACC_INDEX,
+    MEM_TAG_SERVICE,
+    MEM_TAG_REPLAY,
+    MEM_TAG_CONNTRACK,
+    MEM_TAG_HASH_TABLE,
+    MEM_TAG_BSTRING,
+    MEM_TAG_ARENA,
+    MEM_TAG_AUTHZ,
+    MEM_TAG_GRANT_QUOTA,
+    MEM_TAG_FLIGHT_RECORDER,
+    MEM_TAGS
+} mem_tag_t;
+
+/* Prototypes
+*/
+void *mem_malloc(const mem_tag_t tag, const size_t size);
+void *mem_calloc(const mem_tag_t tag, const size_t nmemb, const size_t size);
+void *mem_realloc(const mem_tag_t tag, void *ptr, const size_t size);
+char *mem_strdup(const mem_tag_t tag, const char *str);
+char *mem_strndup(const mem_tag_t tag, const char *str, const size_t n);
+void mem_free(const mem_tag_t tag, void *ptr);
+void mem_adopt(const mem_tag_t tag, void *ptr);
+int mem_acct_start(const fko_srv_options_t *opts);
+long mem_acct_refused(void);
+void mem_acct_get(const mem_tag_t tag, long *bytes, long *count);
+const char *mem_tag_name(const mem_tag_t tag);
+void dump_mem_stats(const fko_srv_options_t *opts);
+
+#endif /* MEM_ACCT_H */
+
+/***EOF***/
@@ -0,0 +1,912 @@
+/*
+ *****************************************************************************
+ *
+ * File:    metrics.c
+ *
+ * Purpose: Serve fwknopd's runtime counters, gauges and per-stage SPA
+ *          latency histograms in the Prometheus text exposition format.
+ *          The counters are updated on the packet path with relaxed
+ *          atomic adds; everything else is only gathered when a scrape
+ *          comes in, by a single thread that answers GET /metrics on
+ *          METRICS_ADDRESS:METRICS_PORT.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "metrics.h"
+#include "fw_util.h"
+#include "replay_cache.h"
+#include "connection_tracker.h"
+#include "hash_table.h"
+#include "mem_acct.h"
+#include "bstrlib.h"
+#include "rcu.h"
+#include "log_msg.h"
+#include "utils.h"
+#include "cpu_affinity.h"
+#include "spa_workers.h"
+#include "spa_shed.h"
+#include "acc_lazy.h"
+#include "grant_quota.h"
+#include "flight_recorder.h"
+
+#if HAVE_SYS_SOCKET_H
+  #include <sys/socket.h>
+#endif
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+
+#ifndef MSG_NOSIGNAL
+  #define MSG_NOSIGNAL 0
+#endif
+
+#if FIREWALL_FIREWALLD
+  #define METRICS_FW_BACKEND    "firewalld"
+#elif FIREWALL_IPTABLES
+  #define METRICS_FW_BACKEND    "iptables"
+#elif FIREWALL_NFTABLES
+  #define METRICS_FW_BACKEND    "nftables"
+#elif FIREWALL_IPFW
+  #define METRICS_FW_BACKEND    "ipfw"
+#elif FIREWALL_PF
+  #define METRICS_FW_BACKEND    "pf"
+#elif FIREWALL_IPF
+  #define METRICS_FW_BACKEND    "ipf"
+#else
+  #define METRICS_FW_BACKEND    "none"
+#endif
+
+unsigned long metric_counters[METRIC_COUNTERS];
+
+static const struct {
+    const char *name;
+    const char *help;
+    int         per_backend;
+} metric_counter_info[METRIC_COUNTERS] = {
+    { "fwknopd_packets_captured_total",
+        "Packets handed to SPA processing.", 0 },
+    { "fwknopd_packets_prechecked_total",
+        "Packets that passed the SPA precheck.", 0 },
+    { "fwknopd_packets_other_shard_total",
+        "SDP packets left to the instance that owns their SDP ID.", 0 },
+    { "fwknopd_packets_cluster_forwarded_total",
+        "SDP packets forwarded to the cluster member that owns their SDP ID.", 0 },
+    { "fwknopd_replays_total",
+        "SPA packets rejected as replays.", 0 },
+    { "fwknopd_hmac_failures_total",
+        "HMAC checks that failed (one per access stanza tried).", 0 },
+    { "fwknopd_decrypt_failures_total",
+        "Decryptions that failed (one per access stanza tried).", 0 },
+    { "fwknopd_authorized_total",
+        "SPA requests that were granted access.", 0 },
+    { "fwknopd_rules_added_total",
+        "Firewall rules added for granted access.", 1 },
+    { "fwknopd_rules_expired_total",
+        "Firewall rules whose timeout has passed.", 1 },
+    { "fwknopd_spa_queue_drops_total",
+        "SPA packets dropped because the worker queue was full.", 0 },
+    { "fwknopd_spa_queue_flow_drops_total",
+        "SPA packets dropped because their client had too many queued.", 0 },
+    { "fwknopd_shed_episodes_total",
+        "Times the SPA workers became overloaded and started shedding.", 0 },
+    { "fwknopd_shed_suspect_total",
+        "Queued packets shed for an unknown SDP ID or a recent failure.", 0 },
+    { "fwknopd_shed_unproven_total",
+        "Queued packets shed from clients without a recent success.", 0 },
+    { "fwknopd_authz_cache_hits_total",
+        "Service requests decided from the authorization cache.", 0 },
+    { "fwknopd_authz_cache_misses_total",
+        "Service requests that were not in the authorization cache.", 0 },
+    { "fwknopd_access_expansions_total",
+        "SDP access stanzas expanded on first use.", 0 },
+    { "fwknopd_access_expansion_evictions_total",
+        "Expanded SDP access stanzas dropped as least recently used or idle.", 0 },
+    { "fwknopd_grant_quota_denied_total",
+        "SPA requests refused because of MAX_ACTIVE_GRANTS.", 0 },
+    { "fwknopd_grants_coalesced_total",
+        "SPA requests for access the client already held.", 0 },
+    { "fwknopd_grants_extended_total",
+        "Grants kept open by activity on their connections (GRANT_IDLE_TIMEOUT).", 0 },
+    { "fwknopd_spa_traced_total",
+        "SPA packets traced with their random value as the ID (SPA_TRACE).", 0 }
+};
+
+/* Stage latencies go into the benchmark's log-linear buckets, in a
+ * block of histograms owned by the recording thread, so that the packet
+ * path never writes to a cache line another thread writes to.  A scrape
+ * merges the blocks and folds the buckets into METRICS_HIST_BOUNDS.
+ * Blocks are never freed: when a thread exits its block (counts and
+ * all) goes to the next thread that needs one.
+*/
+typedef struct mx_hist_block
+{
+    unsigned long long      sum_ns[BENCH_STAGES];
+    unsigned long           buckets[BENCH_STAGES][BENCH_HIST_BUCKETS];
+    volatile int            used;
+    struct mx_hist_block   *next;
+} mx_hist_block_t;
+
+static mx_hist_block_t     *mx_blocks = NULL;
+static pthread_mutex_t      mx_blocks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t        mx_block_key;
+static pthread_once_t       mx_block_key_once = PTHREAD_ONCE_INIT;
+
+static const unsigned long long mx_hist_bounds[METRICS_HIST_BUCKETS] =
+    METRICS_HIST_BOUNDS;
+
+static int                  mx_active = 0;
+static int                  mx_timing = 0;
+static volatile int         mx_stop = 0;
+static int                  mx_sock = -1;
+static pthread_t            mx_thread;
+static fko_srv_options_t   *mx_opts = NULL;
+
+/* Stage timings are recorded while anything that reports them (the
+ * endpoint or the stats page) holds them on.
+*/
+int
+metrics_running(void)
+{
+    return(__atomic_load_n(&mx_timing, __ATOMIC_RELAXED) > 0);
+}
+
+void
+metrics_timing_hold(void)
+{
+    __atomic_add_fetch(&mx_timing, 1, __ATOMIC_RELAXED);
+    return;
+}
+
+void
+metrics_timing_release(void)
+{
+    __atomic_sub_fetch(&mx_timing, 1, __ATOMIC_RELAXED);
+    return;
+}
+
+const char *
+metrics_counter_name(const int counter)
+{
+    return(counter >= 0 && counter < METRIC_COUNTERS
+            ? metric_counter_info[counter].name : "unknown");
+}
+
+static void
+mx_block_release(void *arg)
+{
+    mx_hist_block_t    *blk = arg;
+
+    __sync_lock_release(&(blk->used));
+    return;
+}
+
+static void
+mx_block_key_init(void)
+{
+    pthread_key_create(&mx_block_key, mx_block_release);
+    return;
+}
+
+/* Return the calling thread's histogram block, taking a free one (or
+ * allocating a new one) on first use.
+*/
+static mx_hist_block_t *
+mx_block_get(void)
+{
+    mx_hist_block_t    *blk;
+
+    pthread_once(&mx_block_key_once, mx_block_key_init);
+
+    if((blk = pthread_getspecific(mx_block_key)) != NULL)
+        return blk;
+
+    pthread_mutex_lock(&mx_blocks_mutex);
+
+    for(blk = mx_blocks; blk != NULL; blk = blk->next)
+        if(__sync_lock_test_and_set(&(blk->used), 1) == 0)
+            break;
+
+    if(blk == NULL && (blk = calloc(1, sizeof(*blk))) != NULL)
+    {
+        blk->used = 1;
+        blk->next = mx_blocks;
+        mx_blocks = blk;
+    }
+
+    pthread_mutex_unlock(&mx_blocks_mutex);
+
+    if(blk != NULL)
+        pthread_setspecific(mx_block_key, blk);
+    return blk;
+}
+
+/* Add to a counter in the calling thread's block.  Only this thread
+ * writes it, so a relaxed load and store are enough for the scrape to
+ * see a whole value.
+*/
+#define MX_BLOCK_ADD(field, n)  __atomic_store_n(&(field), \
+        __atomic_load_n(&(field), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+/* Record the time one SPA processing stage took.
+*/
+void
+metrics_observe(const bench_stage_t stage, const unsigned long long ns)
+{
+    mx_hist_block_t    *blk;
+
+    if(! metrics_running() || stage >= BENCH_STAGES
+            || (blk = mx_block_get()) == NULL)
+        return;
+
+    MX_BLOCK_ADD(blk->buckets[stage][bench_hist_bucket(ns)], 1);
+    MX_BLOCK_ADD(blk->sum_ns[stage], ns);
+    return;
+}
+
+static void
+mx_header(bstring b, const char *name, const char *type, const char *help)
+{
+    bformata(b, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    return;
+}
+
+static void
+mx_write_counters(bstring b)
+{
+    int     i;
+
+    for(i=0; i < METRIC_COUNTERS; i++)
+    {
+        mx_header(b, metric_counter_info[i].name, "counter",
+            metric_counter_info[i].help);
+
+        if(metric_counter_info[i].per_backend)
+            bformata(b, "%s{backend=\"%s\"} %lu\n", metric_counter_info[i].name,
+                METRICS_FW_BACKEND,
+                __atomic_load_n(&(metric_counters[i]), __ATOMIC_RELAXED));
+        else
+            bformata(b, "%s %lu\n", metric_counter_info[i].name,
+                __atomic_load_n(&(metric_counters[i]), __ATOMIC_RELAXED));
+    }
+    return;
+}
+
+void
+metrics_gauges_get(fko_srv_options_t *opts, metrics_gauges_t *g)
+{
+    acc_id_map_t   *acc_tbl;
+    acc_stanza_index_t *acc_idx;
+    hash_table_t   *service_tbl;
+    spa_workers_stats_t spa_stats;
+    int             i;
+
+    memset(g, 0x0, sizeof(*g));
+
+    if(strncasecmp(opts->config[CONF_DISABLE_SDP_MODE], "Y", 1) == 0)
+    {
+        /* Legacy mode stanzas are swapped in by a SIGHUP reload.
+        */
+        rcu_read_lock();
+        if((acc_idx = rcu_dereference(opts->acc_index)) != NULL)
+            g->stanzas = acc_idx->num_stanzas;
+        rcu_read_unlock();
+    }
+    else
+    {
+        rcu_read_lock();
+        if((acc_tbl = rcu_dereference(opts->acc_stanza_hash_tbl)) != NULL)
+            g->stanzas = acc_tbl->count;
+        if((service_tbl = rcu_dereference(opts->service_hash_tbl)) != NULL)
+            g->services = service_tbl->count + service_tbl->old_count;
+        rcu_read_unlock();
+    }
+
+    g->stanzas_expanded = acc_lazy_count();
+    g->tracked_conns    = connection_tracker_count();
+    g->replay_entries   = replay_cache_entries(opts);
+
+    if(spa_workers_stats(&spa_stats) == 0)
+    {
+        g->have_spa_queue     = 1;
+        g->spa_queued         = spa_stats.queued;
+        g->spa_active_flows   = spa_stats.active_flows;
+        g->spa_max_flow_depth = spa_stats.max_flow_depth;
+        g->spa_overloaded     = spa_shed_overloaded();
+    }
+
+    for(i=0; i < MEM_TAGS; i++)
+        mem_acct_get(i, &(g->mem_bytes[i]), &(g->mem_count[i]));
+    g->mem_refused = mem_acct_refused();
+
+    grant_quota_stats(&(g->quota_clients), &(g->quota_grants));
+
+#if FIREWALL_NFTABLES
+    /* With nftables the kernel expires grants on its own, so there is
+     * nothing here to count.
+    */
+    g->active_grants = -1;
+#else
+    g->active_grants = fw_timer_count();
+#endif
+
+    return;
+}
+
+static void
+mx_write_gauges(bstring b, fko_srv_options_t *opts)
+{
+    metrics_gauges_t    g;
+    const char         *kernel, *impl;
+    int                 i;
+
+    metrics_gauges_get(opts, &g);
+
+    mx_header(b, "fwknopd_access_stanzas", "gauge",
+        "Access stanzas currently loaded.");
+    bformata(b, "fwknopd_access_stanzas %lu\n", g.stanzas);
+
+    mx_header(b, "fwknopd_access_stanzas_expanded", "gauge",
+        "SDP access stanzas currently expanded on demand.");
+    bformata(b, "fwknopd_access_stanzas_expanded %u\n", g.stanzas_expanded);
+
+    mx_header(b, "fwknopd_services", "gauge",
+        "Services currently known from the controller.");
+    bformata(b, "fwknopd_services %lu\n", g.services);
+
+    mx_header(b, "fwknopd_tracked_connections", "gauge",
+        "Connections followed by the connection tracker.");
+    bformata(b, "fwknopd_tracked_connections %u\n", g.tracked_conns);
+
+    mx_header(b, "fwknopd_replay_cache_entries", "gauge",
+        "SPA digests in the replay cache.");
+    bformata(b, "fwknopd_replay_cache_entries %lu\n", g.replay_entries);
+
+    if(g.have_spa_queue)
+    {
+        mx_header(b, "fwknopd_spa_queue_depth", "gauge",
+            "SPA packets waiting for a worker.");
+        bformata(b, "fwknopd_spa_queue_depth %u\n", g.spa_queued);
+
+        mx_header(b, "fwknopd_spa_queue_active_flows", "gauge",
+            "Clients with SPA packets waiting for a worker.");
+        bformata(b, "fwknopd_spa_queue_active_flows %u\n", g.spa_active_flows);
+
+        mx_header(b, "fwknopd_spa_queue_max_flow_depth", "gauge",
+            "SPA packets waiting from the client with the most queued.");
+        bformata(b, "fwknopd_spa_queue_max_flow_depth %u\n",
+            g.spa_max_flow_depth);
+
+        mx_header(b, "fwknopd_spa_overloaded", "gauge",
+            "Whether queued SPA packets are being shed.");
+        bformata(b, "fwknopd_spa_overloaded %i\n", g.spa_overloaded);
+    }
+
+    mx_header(b, "fwknopd_memory_bytes", "gauge",
+        "Heap bytes held by each subsystem.");
+    for(i=0; i < MEM_TAGS; i++)
+        bformata(b, "fwknopd_memory_bytes{subsystem=\"%s\"} %li\n",
+            mem_tag_name(i), g.mem_bytes[i]);
+
+    mx_header(b, "fwknopd_memory_allocations", "gauge",
+        "Live heap allocations held by each subsystem.");
+    for(i=0; i < MEM_TAGS; i++)
+        bformata(b, "fwknopd_memory_allocations{subsystem=\"%s\"} %li\n",
+            mem_tag_name(i), g.mem_count[i]);
+
+    mx_header(b, "fwknopd_memory_refused_total", "counter",
+        "Heap allocations refused for going over MEM_LIMIT.");
+    bformata(b, "fwknopd_memory_refused_total %li\n", g.mem_refused);
+
+    mx_header(b, "fwknopd_quota_grants", "gauge",
+        "Access grants counted against MAX_ACTIVE_GRANTS.");
+    bformata(b, "fwknopd_quota_grants %lu\n", g.quota_grants);
+
+    mx_header(b, "fwknopd_quota_clients", "gauge",
+        "Clients holding access grants counted against MAX_ACTIVE_GRANTS.");
+    bformata(b, "fwknopd_quota_clients %u\n", g.quota_clients);
+
+    if(g.active_grants >= 0)
+    {
+        mx_header(b, "fwknopd_active_grants", "gauge",
+            "Firewall rules waiting for their timeout.");
+        bformata(b, "fwknopd_active_grants{backend=\"%s\"} %i\n",
+            METRICS_FW_BACKEND, g.active_grants);
+    }
+
+    mx_header(b, "fwknopd_crypto_impl", "gauge",
+        "libfko implementation in use for each crypto kernel (CRYPTO_IMPL).");
+    for(i=0; i < FKO_LAST_IMPL; i++)
+        if(fko_impl_get(i, &kernel, &impl) == FKO_SUCCESS)
+            bformata(b, "fwknopd_crypto_impl{kernel=\"%s\",impl=\"%s\"} 1\n",
+                kernel, impl);
+
+    return;
+}
+
+/* Merge every thread's histograms for one stage into the exported
+ * buckets.  A fine bucket is counted under the first bound its lower
+ * edge does not exceed, which is good to the fine buckets' ~3%.  The
+ * +Inf bucket is the sum of the fine buckets rather than the separate
+ * count, so the exported buckets always add up.
+*/
+static void
+mx_merge_stage(const int stage, unsigned long *le_counts,
+        unsigned long *total, unsigned long long *sum_ns)
+{
+    mx_hist_block_t    *blk;
+    unsigned long       n;
+    int                 i, le;
+
+    memset(le_counts, 0x0, METRICS_HIST_BUCKETS * sizeof(*le_counts));
+    *total  = 0;
+    *sum_ns = 0;
+
+    pthread_mutex_lock(&mx_blocks_mutex);
+
+    for(blk = mx_blocks; blk != NULL; blk = blk->next)
+    {
+        *sum_ns += __atomic_load_n(&(blk->sum_ns[stage]), __ATOMIC_RELAXED);
+
+        le = 0;
+        for(i=0; i < BENCH_HIST_BUCKETS; i++)
+        {
+            if((n = __atomic_load_n(&(blk->buckets[stage][i]), __ATOMIC_RELAXED)) == 0)
+                continue;
+
+            while(le < METRICS_HIST_BUCKETS
+                    && bench_hist_bucket_low(i) > mx_hist_bounds[le])
+                le++;
+
+            if(le < METRICS_HIST_BUCKETS)
+                le_counts[le] += n;
+            *total += n;
+        }
+    }
+
+    pthread_mutex_unlock(&mx_blocks_mutex);
+    return;
+}
+
+/* Merge every thread's fine buckets for one stage and find its median
+ * and 99th percentile.
+*/
+void
+metrics_stage_summary(const int stage, metrics_stage_summary_t *sum)
+{
+    mx_hist_block_t    *blk;
+    unsigned long      *counts;
+    unsigned long       p50_rank, p99_rank, seen = 0;
+    int                 i;
+
+    memset(sum, 0x0, sizeof(*sum));
+
+    if(stage < 0 || stage >= BENCH_STAGES
+            || (counts = calloc(BENCH_HIST_BUCKETS, sizeof(*counts))) == NULL)
+        return;
+
+    pthread_mutex_lock(&mx_blocks_mutex);
+
+    for(blk = mx_blocks; blk != NULL; blk = blk->next)
+    {
+        sum->sum_ns += __atomic_load_n(&(blk->sum_ns[stage]), __ATOMIC_RELAXED);
+
+        for(i=0; i < BENCH_HIST_BUCKETS; i++)
+            counts[i] += __atomic_load_n(&(blk->buckets[stage][i]), __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&mx_blocks_mutex);
+
+    for(i=0; i < BENCH_HIST_BUCKETS; i++)
+        sum->count += counts[i];
+
+    if(sum->count > 0)
+    {
+        p50_rank = sum->count / 2;
+        p99_rank = (unsigned long)(sum->count * 0.99);
+        if(p99_rank >= sum->count)
+            p99_rank = sum->count - 1;
+
+        for(i=0; i < BENCH_HIST_BUCKETS; i++)
+        {
+            if(counts[i] == 0)
+                continue;
+
+            seen += counts[i];
+            if(seen > p50_rank && sum->p50_ns == 0)
+                sum->p50_ns = bench_hist_bucket_low(i);
+            if(seen > p99_rank)
+            {
+                sum->p99_ns = bench_hist_bucket_low(i);
+                break;
+            }
+        }
+    }
+
+    free(counts);
+    return;
+}
+
+static void
+mx_write_histograms(bstring b)
+{
+    unsigned long       le_counts[METRICS_HIST_BUCKETS];
+    unsigned long       cumulative, total;
+    unsigned long long  sum_ns;
+    int                 stage, i;
+
+    mx_header(b, "fwknopd_stage_duration_seconds", "histogram",
+        "Time spent in each SPA processing stage.");
+
+    for(stage=0; stage < BENCH_STAGES; stage++)
+    {
+        mx_merge_stage(stage, le_counts, &total, &sum_ns);
+
+        cumulative = 0;
+        for(i=0; i < METRICS_HIST_BUCKETS; i++)
+        {
+            cumulative += le_counts[i];
+            bformata(b, "fwknopd_stage_duration_seconds_bucket"
+                "{stage=\"%s\",le=\"%g\"} %lu\n",
+                bench_stage_name(stage), mx_hist_bounds[i] / 1e9, cumulative);
+        }
+        bformata(b, "fwknopd_stage_duration_seconds_bucket"
+            "{stage=\"%s\",le=\"+Inf\"} %lu\n", bench_stage_name(stage), total);
+        bformata(b, "fwknopd_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n",
+            bench_stage_name(stage), sum_ns / 1e9);
+        bformata(b, "fwknopd_stage_duration_seconds_count{stage=\"%s\"} %lu\n",
+            bench_stage_name(stage), total);
+    }
+    return;
+}
+
+static void
+mx_write_controller(bstring b, fko_srv_options_t *opts)
+{
+    sdp_com_t   com;
+
+    if(opts->ctrl_client == NULL || (com = opts->ctrl_client->com) == NULL)
+        return;
+
+    mx_header(b, "fwknopd_controller_connected", "gauge",
+        "Whether the link to the SDP controller is up.");
+    bformata(b, "fwknopd_controller_connected %i\n",
+        __atomic_load_n(&(com->conn_state), __ATOMIC_RELAXED) == SDP_COM_CONNECTED);
+
+    mx_header(b, "fwknopd_controller_connects_total", "counter",
+        "Connections made to the SDP controller.");
+    bformata(b, "fwknopd_controller_connects_total %lu\n",
+        __atomic_load_n(&(com->connects), __ATOMIC_RELAXED));
+
+    mx_header(b, "fwknopd_controller_messages_sent_total", "counter",
+        "Messages sent to the SDP controller.");
+    bformata(b, "fwknopd_controller_messages_sent_total %lu\n",
+        __atomic_load_n(&(com->msgs_sent), __ATOMIC_RELAXED));
+
+    mx_header(b, "fwknopd_controller_messages_received_total", "counter",
+        "Messages received from the SDP controller.");
+    bformata(b, "fwknopd_controller_messages_received_total %lu\n",
+        __atomic_load_n(&(com->msgs_received), __ATOMIC_RELAXED));
+
+    return;
+}
+
+static int
+mx_send_all(const int fd, const char *buf, size_t len)
+{
+    ssize_t     n;
+
+    while(len > 0)
+    {
+        if((n = send(fd, buf, len, MSG_NOSIGNAL)) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return(-1);
+        }
+        buf += n;
+        len -= n;
+    }
+    return(0);
+}
+
+static void
+mx_respond(const int fd, const char *status, const char *body, const int body_len)
+{
+    char    hdr[256];
+    int     hdr_len;
+
+    hdr_len = snprintf(hdr, sizeof(hdr),
+        "HTTP/1.0 %s\r\n"
+        "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+        "Content-Length: %i\r\n"
+        "Connection: close\r\n\r\n", status, body_len);
+
+    if(mx_send_all(fd, hdr, hdr_len) == 0 && body_len > 0)
+        mx_send_all(fd, body, body_len);
+    return;
+}
+
+/* Answer GET /verdicts with the flight recorder's verdicts, filtered by
+ * the query string.
+*/
+static void
+mx_serve_verdicts(const int fd, const char *query)
+{
+    flight_recorder_filter_t    filter;
+    bstring                     body;
+
+    if(! flight_recorder_enabled())
+    {
+        mx_respond(fd, "404 Not Found", "Not found\n", 10);
+        return;
+    }
+
+    if(flight_recorder_parse_query(query, &filter) != 0)
+    {
+        mx_respond(fd, "400 Bad Request", "Bad request\n", 12);
+        return;
+    }
+
+    if((body = bfromcstralloc(8192, "")) == NULL
+            || flight_recorder_write(body, &filter) < 0)
+    {
+        mx_respond(fd, "500 Internal Server Error", "", 0);
+        bdestroy(body);
+        return;
+    }
+
+    mx_respond(fd, "200 OK", (const char *)body->data, body->slen);
+
+    bdestroy(body);
+    return;
+}
+
+/* Read one request and answer it.  GET /metrics and (with the flight
+ * recorder on) GET /verdicts are served.
+*/
+static void
+mx_serve(const int fd)
+{
+    char        req[METRICS_MAX_REQ_LEN+1];
+    size_t      len = 0;
+    ssize_t     n;
+    bstring     body;
+
+    while(1)
+    {
+        if(len >= METRICS_MAX_REQ_LEN)
+        {
+            mx_respond(fd, "400 Bad Request", "Bad request\n", 12);
+            return;
+        }
+
+        if((n = recv(fd, req + len, METRICS_MAX_REQ_LEN - len, 0)) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return;
+        }
+        if(n == 0)
+            return;
+
+        len += n;
+        req[len] = '\0';
+
+        if(strstr(req, "\r\n\r\n") != NULL || strstr(req, "\n\n") != NULL)
+            break;
+    }
+
+    if(strncmp(req, "GET ", 4) != 0)
+    {
+        mx_respond(fd, "405 Method Not Allowed", "Method not allowed\n", 19);
+        return;
+    }
+
+    if(strncmp(req + 4, "/verdicts", 9) == 0
+            && (req[13] == ' ' || req[13] == '?'))
+    {
+        mx_serve_verdicts(fd, req + 13);
+        return;
+    }
+
+    if(strncmp(req + 4, "/metrics", 8) != 0
+            || (req[12] != ' ' && req[12] != '?'))
+    {
+        mx_respond(fd, "404 Not Found", "Not found\n", 10);
+        return;
+    }
+
+    if((body = bfromcstralloc(8192, "")) == NULL)
+    {
+        mx_respond(fd, "500 Internal Server Error", "", 0);
+        return;
+    }
+
+    mx_write_counters(body);
+    mx_write_gauges(body, mx_opts);
+    mx_write_histograms(body);
+    mx_write_controller(body, mx_opts);
+
+    mx_respond(fd, "200 OK", (const char *)body->data, body->slen);
+
+    bdestroy(body);
+    return;
+}
+
+static void *
+mx_accept_thread(void *arg)
+{
+    struct timeval  tv;
+    sigset_t        mask;
+    int             fd;
+
+    (void)arg;
+
+    /* Leave signal handling to the main thread.
+    */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    cpu_affinity_set(CPU_ROLE_HOUSEKEEPING);
+
+    tv.tv_sec  = METRICS_CLIENT_TIMEOUT;
+    tv.tv_usec = 0;
+
+    while(! mx_stop)
+    {
+        if((fd = accept(mx_sock, NULL, NULL)) < 0)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR
+                    && errno != ECONNABORTED)
+            {
+                log_msg(LOG_WARNING, "metrics: accept() failed: %s",
+                    strerror(errno));
+                sleep(1);
+            }
+            continue;
+        }
+
+        /* One slow client must not hold up the next scrape for long.
+        */
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        mx_serve(fd);
+        close(fd);
+    }
+    return(NULL);
+}
+
+/* Start serving metrics if METRICS_PORT is set.  Returns 0 on success
+ * or when disabled.
+*/
+int
+metrics_start(fko_srv_options_t *opts)
+{
+    struct sockaddr_storage addr;
+    struct timeval          tv;
+    socklen_t               addr_len;
+    int                     port, is_err, on = 1;
+
+    mx_active = 0;
+
+    port = strtol_wrapper(opts->config[CONF_METRICS_PORT],
+            0, RCHK_MAX_METRICS_PORT, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid METRICS_PORT value.");
+        return(-1);
+    }
+
+    if(port == 0)
+        return(0);
+
+    memset(&addr, 0x0, sizeof(addr));
+    if(inet_pton(AF_INET, opts->config[CONF_METRICS_ADDRESS],
+            &(((struct sockaddr_in *)&addr)->sin_addr)) == 1)
+    {
+        ((struct sockaddr_in *)&addr)->sin_family = AF_INET;
+        ((struct sockaddr_in *)&addr)->sin_port   = htons(port);
+        addr_len = sizeof(struct sockaddr_in);
+    }
+    else if(inet_pton(AF_INET6, opts->config[CONF_METRICS_ADDRESS],
+            &(((struct sockaddr_in6 *)&addr)->sin6_addr)) == 1)
+    {
+        ((struct sockaddr_in6 *)&addr)->sin6_family = AF_INET6;
+        ((struct sockaddr_in6 *)&addr)->sin6_port   = htons(port);
+        addr_len = sizeof(struct sockaddr_in6);
+    }
+    else
+    {
+        log_msg(LOG_ERR, "[*] Invalid METRICS_ADDRESS value: %s",
+            opts->config[CONF_METRICS_ADDRESS]);
+        return(-1);
+    }
+
+    /* Wake up once a second to see if we should stop.
+    */
+    tv.tv_sec  = 1;
+    tv.tv_usec = 0;
+
+    if((mx_sock = socket(addr.ss_family, SOCK_STREAM, 0)) < 0
+            || setsockopt(mx_sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0
+            || setsockopt(mx_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0
+            || bind(mx_sock, (struct sockaddr *)&addr, addr_len) != 0
+            || listen(mx_sock, METRICS_LISTEN_BACKLOG) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Unable to set up metrics socket on %s port %i: %s",
+            opts->config[CONF_METRICS_ADDRESS], port, strerror(errno));
+        if(mx_sock >= 0)
+            close(mx_sock);
+        mx_sock = -1;
+        return(-1);
+    }
+
+    mx_opts = opts;
+    mx_stop = 0;
+
+    /* Set before the thread starts so that stage timings begin with it.
+    */
+    mx_active = 1;
+    metrics_timing_hold();
+
+    if(pthread_create(&mx_thread, NULL, mx_accept_thread, NULL) != 0)
+    {
+        log_msg(LOG_ERR, "metrics_start: failed to start metrics thread");
+        metrics_timing_release();
+        mx_active = 0;
+        close(mx_sock);
+        mx_sock = -1;
+        return(-1);
+    }
+
+    log_msg(LOG_INFO, "Serving metrics on http://%s:%i/metrics",
+        opts->config[CONF_METRICS_ADDRESS], port);
+
+    return(0);
+}
+
+/* Stop the metrics thread and close its socket.
+*/
+void
+metrics_stop(void)
+{
+    if(! mx_active)
+        return;
+
+    mx_active = 0;
+    metrics_timing_release();
+    mx_stop = 1;
+
+    if(! pthread_equal(mx_thread, pthread_self()))
+        pthread_join(mx_thread, NULL);
+
+    close(mx_sock);
+    mx_sock = -1;
+    mx_opts = NULL;
+    return;
+}
+
+/***EOF***/
@@ -0,0 +1,139 @@
+/*
+ *****************************************************************************
+ *
+ * File:    metrics.h
+ *
+ * Purpose: Header file for metrics.c - runtime counters and latency
+ *          histograms served over HTTP in the Prometheus text format.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "benchmark.h"
+#include "mem_acct.h"
+
+/* Counters kept whether or not the endpoint is enabled.  They are only
+ * ever added to, from any thread, with relaxed atomics.
+*/
+typedef enum {
+    METRIC_PKTS_CAPTURED = 0,
+    METRIC_PKTS_PRECHECKED,
+    METRIC_PKTS_OTHER_SHARD,
+    METRIC_PKTS_CLUSTER_FORWARDED,
+    METRIC_REPLAYS,
+    METRIC_HMAC_FAILURES,
+    METRIC_DECRYPT_FAILURES,
+    METRIC_AUTHORIZED,
+    METRIC_RULES_ADDED,
+    METRIC_RULES_EXPIRED,
+    METRIC_SPA_QUEUE_DROPS,
+    METRIC_SPA_QUEUE_FLOW_DROPS,
+    METRIC_SHED_EPISODES,
+    METRIC_SHED_SUSPECT,
+    METRIC_SHED_UNPROVEN,
+    METRIC_AUTHZ_CACHE_HITS,
+    METRIC_AUTHZ_CACHE_MISSES,
+    METRIC_ACC_EXPANSIONS,
+    METRIC_ACC_EVICTIONS,
+    METRIC_GRANT_QUOTA_DENIED,
+    METRIC_GRANTS_COALESCED,
+    METRIC_GRANTS_EXTENDED,
+    METRIC_SPA_TRACED,
+    METRIC_COUNTERS
+} metric_counter_t;
+
+extern unsigned long metric_counters[METRIC_COUNTERS];
+
+#define METRIC_ADD(c, n)    __atomic_add_fetch(&(metric_counters[(c)]), \
+                                (unsigned long)(n), __ATOMIC_RELAXED)
+#define METRIC_INC(c)       METRIC_ADD((c), 1)
+
+/* Upper bounds of the latency histogram buckets, in nanoseconds
+ * (1us to 1s).  Samples above the last one only show up in the +Inf
+ * bucket.
+*/
+#define METRICS_HIST_BOUNDS     { 1000ULL, 5000ULL, 10000ULL, 50000ULL, \
+                                  100000ULL, 500000ULL, 1000000ULL, \
+                                  5000000ULL, 10000000ULL, 50000000ULL, \
+                                  100000000ULL, 500000000ULL, 1000000000ULL }
+#define METRICS_HIST_BUCKETS    13
+
+/* Requests larger than this are answered with 400, and a client gets
+ * this many seconds to send its request before it is dropped.
+*/
+#define METRICS_MAX_REQ_LEN     2048
+#define METRICS_CLIENT_TIMEOUT  2
+#define METRICS_LISTEN_BACKLOG  8
+
+/* The gauges the endpoint exports, for the stats page to publish too.
+ * active_grants is -1 where the firewall expires grants on its own.
+*/
+typedef struct metrics_gauges
+{
+    unsigned long   stanzas;
+    unsigned long   services;
+    unsigned long   replay_entries;
+    unsigned long   quota_grants;
+    unsigned int    stanzas_expanded;
+    unsigned int    tracked_conns;
+    unsigned int    quota_clients;
+    int             have_spa_queue;
+    unsigned int    spa_queued;
+    unsigned int    spa_active_flows;
+    unsigned int    spa_max_flow_depth;
+    int             spa_overloaded;
+    int             active_grants;
+    long            mem_bytes[MEM_TAGS];
+    long            mem_count[MEM_TAGS];
+    long            mem_refused;
+} metrics_gauges_t;
+
+/* Latency summary of one stage from the fine buckets.  The quantiles
+ * are the lower edges of the buckets they fall in.
+*/
+typedef struct metrics_stage_summary
+{
+    unsigned long       count;
+    unsigned long long  sum_ns;
+    unsigned long long  p50_ns;
+    unsigned long long  p99_ns;
+} metrics_stage_summary_t;
+
+/* Prototypes
+*/
+int metrics_start(fko_srv_options_t *opts);
+void metrics_stop(void);
+int metrics_running(void);
+void metrics_timing_hold(void);
+void metrics_timing_release(void);
+void metrics_observe(const bench_stage_t stage, const unsigned long long ns);
+const char *metrics_counter_name(const int counter);
+void metrics_gauges_get(fko_srv_options_t *opts, metrics_gauges_t *g);
+void metrics_stage_summary(const int stage, metrics_stage_summary_t *sum);
+
+#endif /* METRICS_H */
+
+/***EOF***/
@@ -0,0 +1,551 @@
+/*
+ *****************************************************************************
+ *
+ * File:    nflog_capture.c
+ *
+ * Purpose: Collect SPA packets from a netfilter NFLOG group.  A firewall
+ *          rule logs the SPA candidates to the group (for example
+ *          '-p udp --dport 62201 -j NFLOG --nflog-group 0'), and the
+ *          kernel sends them to us over netlink starting at the IP
+ *          header.  There is no promiscuous mode or link layer to deal
+ *          with, and the rule can rate limit before anything is copied.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "nflog_capture.h"
+
+#if HAVE_NFLOG_CAPTURE
+
+#include "tcp_server.h"
+#include "http_server.h"
+#include "sig_handler.h"
+#include "incoming_spa.h"
+#include "process_packet.h"
+#include "log_msg.h"
+#include "replay_cache.h"
+#include "fw_util.h"
+#include "cmd_cycle.h"
+#include "utils.h"
+#include "event_loop.h"
+#include "rate_limit.h"
+#include "grant_quota.h"
+#include "acc_expire.h"
+#include "acc_lazy.h"
+#include "fwknop_probes.h"
+#include <errno.h>
+
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_log.h>
+
+/* Enough of each logged packet for the largest SPA payload behind IP
+ * options or IPv6 extension headers and a TCP header with options.
+*/
+#define NFLOG_COPY_RANGE    (MAX_SPA_PACKET_LEN + 256)
+
+#define NFLOG_MSG_TYPE(t)   ((NFNL_SUBSYS_ULOG << 8) | (t))
+
+#define ATTR_DATA(nla)      ((const char *)(nla) + NLA_HDRLEN)
+#define ATTR_LEN(nla)       ((int)(nla)->nla_len - NLA_HDRLEN)
+
+/* State for the capture loop.
+*/
+typedef struct nflog_ctx
+{
+    fko_srv_options_t  *opts;
+    int                 sock;
+    int                 rules_chk_threshold;
+    int                 overruns;
+    spa_pkt_info_t     *spa_pkts;
+} nflog_ctx_t;
+
+static uint32_t         nflog_seq  = 0;
+static volatile int     nflog_stop = 0;
+static char             nflog_buf[NFLOG_BUFSIZE];
+
+/* Index the attributes in a block by type.  Types above max are skipped.
+*/
+static void
+parse_attrs(const struct nlattr *nla, int len, const struct nlattr **tb,
+        const int max)
+{
+    int     type;
+
+    memset(tb, 0x0, (max + 1) * sizeof(*tb));
+
+    while(len >= NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN
+            && nla->nla_len <= len)
+    {
+        type = nla->nla_type & NLA_TYPE_MASK;
+        if(type <= max)
+            tb[type] = nla;
+
+        len -= NLA_ALIGN(nla->nla_len);
+        nla = (const struct nlattr *)((const char *)nla + NLA_ALIGN(nla->nla_len));
+    }
+    return;
+}
+
+static void
+put_attr(struct nlmsghdr *nlh, const uint16_t type, const void *data,
+        const size_t len)
+{
+    struct nlattr  *nla;
+
+    nla = (struct nlattr *)((char *)nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+    nla->nla_type = type;
+    nla->nla_len  = NLA_HDRLEN + len;
+    memcpy((char *)nla + NLA_HDRLEN, data, len);
+    memset((char *)nla + nla->nla_len, 0x0,
+        NLA_ALIGN(nla->nla_len) - nla->nla_len);
+
+    nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + NLA_ALIGN(nla->nla_len);
+    return;
+}
+
+/* Send one NFULNL_MSG_CONFIG message and wait for the ack.  A command of
+ * NFULNL_CFG_CMD_NONE sends only the mode (and batching) settings.
+ * Returns 0 or a positive errno.
+*/
+static int
+nflog_config(const int sock, const uint8_t family, const uint16_t group,
+        const uint8_t cmd, const int qthresh)
+{
+    char                    buf[256];
+    char                    rbuf[NFLOG_BUFSIZE];
+    struct nlmsghdr        *nlh = (struct nlmsghdr *)buf;
+    struct nlmsghdr        *rh;
+    struct nlmsgerr        *err;
+    struct nfgenmsg        *nfg;
+    struct nfulnl_msg_config_cmd    cfg_cmd;
+    struct nfulnl_msg_config_mode   cfg_mode;
+    uint32_t                val;
+    int                     len;
+
+    memset(buf, 0x0, sizeof(buf));
+
+    nlh->nlmsg_len   = NLMSG_LENGTH(sizeof(struct nfgenmsg));
+    nlh->nlmsg_type  = NFLOG_MSG_TYPE(NFULNL_MSG_CONFIG);
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    nlh->nlmsg_seq   = ++nflog_seq;
+
+    nfg = NLMSG_DATA(nlh);
+    nfg->nfgen_family = family;
+    nfg->version      = NFNETLINK_V0;
+    nfg->res_id       = htons(group);
+
+    if(cmd != NFULNL_CFG_CMD_NONE)
+    {
+        cfg_cmd.command = cmd;
+        put_attr(nlh, NFULA_CFG_CMD, &cfg_cmd, sizeof(cfg_cmd));
+    }
+    else
+    {
+        memset(&cfg_mode, 0x0, sizeof(cfg_mode));
+        cfg_mode.copy_mode  = NFULNL_COPY_PACKET;
+        cfg_mode.copy_range = htonl(NFLOG_COPY_RANGE);
+        put_attr(nlh, NFULA_CFG_MODE, &cfg_mode, sizeof(cfg_mode));
+
+        /* Let the kernel batch as much as we read with one recv().
+        */
+        val = htonl(NFLOG_BUFSIZE);
+        put_attr(nlh, NFULA_CFG_NLBUFSIZ, &val, sizeof(val));
+
+        val = htonl(qthresh);
+        put_attr(nlh, NFULA_CFG_QTHRESH, &val, sizeof(val));
+
+        if(qthresh > 1)
+        {
+            val = htonl(NFLOG_FLUSH_TIMEOUT);
+            put_attr(nlh, NFULA_CFG_TIMEOUT, &val, sizeof(val));
+        }
+    }
+
+    if(send(sock, nlh, nlh->nlmsg_len, 0) < 0)
+        return errno;
+
+    /* Packets logged to the group while we are still configuring it are
+     * skipped here, they have no sequence number.
+    */
+    while(1)
+    {
+        if((len = recv(sock, rbuf, sizeof(rbuf), 0)) < 0)
+        {
+            if(errno == EINTR || errno == ENOBUFS)
+                continue;
+            return errno;
+        }
+
+        for(rh = (struct nlmsghdr *)rbuf; NLMSG_OK(rh, (unsigned int)len);
+                rh = NLMSG_NEXT(rh, len))
+        {
+            if(rh->nlmsg_seq != nlh->nlmsg_seq
+                    || rh->nlmsg_type != NLMSG_ERROR)
+                continue;
+
+            err = NLMSG_DATA(rh);
+            return -err->error;
+        }
+    }
+}
+
+static int
+nflog_open(fko_srv_options_t *opts, const uint16_t group, const int qthresh)
+{
+    struct sockaddr_nl  sa;
+    struct timeval      tv;
+    int                 sock, res, rcvbuf = NFLOG_RCVBUF;
+
+    if((sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_NETFILTER)) < 0)
+    {
+        log_msg(LOG_ERR, "[*] Could not open the NFLOG netlink socket: %s",
+            strerror(errno));
+        return -1;
+    }
+
+    if(fcntl(sock, F_SETFD, FD_CLOEXEC) == -1)
+        goto err;
+
+    if(setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0)
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    memset(&sa, 0x0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+
+    if(bind(sock, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+        goto err;
+
+    /* Don't let a missing ack hang the daemon while configuring.
+    */
+    tv.tv_sec  = 2;
+    tv.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    nflog_seq = time(NULL);
+
+    /* Kernels before 3.17 need the nfnetlink_log handler bound to each
+     * protocol family.  Newer ones ignore this, so errors don't matter.
+    */
+    nflog_config(sock, AF_INET, 0, NFULNL_CFG_CMD_PF_UNBIND, 0);
+    nflog_config(sock, AF_INET, 0, NFULNL_CFG_CMD_PF_BIND, 0);
+    if(opts->enable_ipv6)
+    {
+        nflog_config(sock, AF_INET6, 0, NFULNL_CFG_CMD_PF_UNBIND, 0);
+        nflog_config(sock, AF_INET6, 0, NFULNL_CFG_CMD_PF_BIND, 0);
+    }
+
+    if((res = nflog_config(sock, AF_UNSPEC, group, NFULNL_CFG_CMD_BIND, 0)) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Could not bind to NFLOG group %i: %s",
+            group, strerror(res));
+        close(sock);
+        return -1;
+    }
+
+    if((res = nflog_config(sock, AF_UNSPEC, group, NFULNL_CFG_CMD_NONE, qthresh)) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Could not configure NFLOG group %i: %s",
+            group, strerror(res));
+        nflog_config(sock, AF_UNSPEC, group, NFULNL_CFG_CMD_UNBIND, 0);
+        close(sock);
+        return -1;
+    }
+
+    /* From here on the socket is only read when poll() says so.
+    */
+    if(fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) == -1)
+        goto err;
+
+    return sock;
+
+err:
+    log_msg(LOG_ERR, "[*] Could not set up the NFLOG netlink socket: %s",
+        strerror(errno));
+    close(sock);
+    return -1;
+}
+
+/* Event handler for the NFLOG socket - every read returns one or more
+ * logged packets, which are processed as one batch.
+*/
+static int
+nflog_recv(int fd, void *arg)
+{
+    nflog_ctx_t            *ctx = (nflog_ctx_t *)arg;
+    fko_srv_options_t      *opts = ctx->opts;
+    const struct nlattr    *tb[NFULA_MAX+1];
+    const struct nlattr    *payload;
+    struct nlmsghdr        *nlh;
+    struct nfulnl_msg_packet_timestamp ts;
+    spa_pkt_info_t         *spa_pkt;
+    unsigned char          *ip_p;
+    int                     len, num_pkts = 0, limit_reached = 0;
+    time_t                  now;
+
+    if((len = recv(fd, nflog_buf, sizeof(nflog_buf), 0)) < 0)
+    {
+        /* The socket buffer overflowed and the kernel dropped logged
+         * packets.  Only say so once in a while.
+        */
+        if(errno == ENOBUFS)
+        {
+            if((ctx->overruns++ % 1000) == 0)
+                log_msg(LOG_WARNING,
+                    "[*] NFLOG receive buffer overrun, packets were dropped (%i times)",
+                    ctx->overruns);
+        }
+        else if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            log_msg(LOG_ERR, "run_nflog_capture: receive error on socket: %s",
+                strerror(errno));
+        return EVENT_LOOP_CONTINUE;
+    }
+
+    /* One clock read for the whole batch
+    */
+    now = clock_cache_update();
+
+    for(nlh = (struct nlmsghdr *)nflog_buf; NLMSG_OK(nlh, (unsigned int)len);
+            nlh = NLMSG_NEXT(nlh, len))
+    {
+        if(nlh->nlmsg_type != NFLOG_MSG_TYPE(NFULNL_MSG_PACKET)
+                || nlh->nlmsg_len < NLMSG_LENGTH(sizeof(struct nfgenmsg)))
+            continue;
+
+        parse_attrs((const struct nlattr *)((char *)NLMSG_DATA(nlh)
+                + NLMSG_ALIGN(sizeof(struct nfgenmsg))),
+            nlh->nlmsg_len - NLMSG_LENGTH(NLMSG_ALIGN(sizeof(struct nfgenmsg))),
+            tb, NFULA_MAX);
+
+        if((payload = tb[NFULA_PAYLOAD]) == NULL)
+            continue;
+
+        spa_pkt = &(ctx->spa_pkts[num_pkts]);
+        ip_p    = (unsigned char *)ATTR_DATA(payload);
+
+        if(process_ip_packet(opts, ip_p, ip_p + ATTR_LEN(payload), spa_pkt))
+        {
+            /* The kernel timestamp, when the packet has one, so that the
+             * packet age doesn't include time spent in the socket buffer.
+            */
+            spa_pkt->arrival_time = now;
+            if(tb[NFULA_TIMESTAMP] != NULL
+                    && ATTR_LEN(tb[NFULA_TIMESTAMP]) >= (int)sizeof(ts))
+            {
+                memcpy(&ts, ATTR_DATA(tb[NFULA_TIMESTAMP]), sizeof(ts));
+                if(be64toh(ts.sec) != 0)
+                    spa_pkt->arrival_time = be64toh(ts.sec);
+            }
+
+            FWKNOP_PROBE2(pkt_receive, spa_pkt, spa_pkt->packet_data_len);
+
+            if(++num_pkts == NFLOG_BATCH_LEN)
+            {
+                incoming_spa_batch(opts, ctx->spa_pkts, num_pkts);
+                num_pkts = 0;
+            }
+        }
+
+        /* Count every logged packet against --packet-limit regardless of
+         * SPA packet validity.
+        */
+        opts->packet_ctr += 1;
+        if (opts->packet_ctr_limit && opts->packet_ctr >= opts->packet_ctr_limit)
+        {
+            limit_reached = 1;
+            break;
+        }
+    }
+
+    incoming_spa_batch(opts, ctx->spa_pkts, num_pkts);
+
+    if(opts->foreground == 1 && opts->verbose > 2)
+        log_msg(LOG_DEBUG, "run_nflog_capture() processed: %d packets",
+                opts->packet_ctr);
+
+    if (limit_reached)
+    {
+        log_msg(LOG_WARNING,
+            "* Incoming packet count limit of %i reached",
+            opts->packet_ctr_limit
+        );
+        nflog_stop = 1;
+        return EVENT_LOOP_STOP;
+    }
+
+    return EVENT_LOOP_CONTINUE;
+}
+
+/* Rule expiration and the other periodic work, as in the UDP server.
+*/
+static int
+nflog_timer_handler(int fd, void *arg)
+{
+    nflog_ctx_t        *ctx = (nflog_ctx_t *)arg;
+    fko_srv_options_t  *opts = ctx->opts;
+
+    clock_cache_update();
+
+    replay_cache_sync(opts);
+    acc_expire_run(opts);
+    acc_lazy_run();
+    grant_quota_run();
+
+    if(opts->test)
+        return(nflog_stop ? EVENT_LOOP_STOP : EVENT_LOOP_CONTINUE);
+
+    if(pthread_mutex_lock(&(opts->spa_grant_mutex)))
+    {
+        log_msg(LOG_ERR, "Mutex lock error.");
+        return EVENT_LOOP_CONTINUE;
+    }
+
+    if(opts->enable_fw)
+        fw_check_expired(opts, ctx->rules_chk_threshold);
+
+    cmd_cycle_close(opts);
+
+    rate_limit_report();
+
+    pthread_mutex_unlock(&(opts->spa_grant_mutex));
+
+    return(nflog_stop ? EVENT_LOOP_STOP : EVENT_LOOP_CONTINUE);
+}
+
+int
+run_nflog_capture(fko_srv_options_t *opts)
+{
+    int                 is_err, rv = 0, group, qthresh;
+    nflog_ctx_t         ctx;
+    event_loop_t       *loop = NULL;
+
+    group = strtol_wrapper(opts->config[CONF_NFLOG_GROUP],
+            0, RCHK_MAX_NFLOG_GROUP, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid NFLOG_GROUP value.");
+        return -1;
+    }
+    qthresh = strtol_wrapper(opts->config[CONF_NFLOG_QTHRESHOLD],
+            1, RCHK_MAX_NFLOG_QTHRESHOLD, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid NFLOG_QTHRESHOLD value.");
+        return -1;
+    }
+
+    memset(&ctx, 0x0, sizeof(ctx));
+    ctx.opts                = opts;
+    ctx.rules_chk_threshold = opts->rt->rules_chk_threshold;
+
+    if((ctx.spa_pkts = calloc(NFLOG_BATCH_LEN, sizeof(spa_pkt_info_t))) == NULL)
+    {
+        log_msg(LOG_ERR, "run_nflog_capture: calloc() failed for the packet batch");
+        return -1;
+    }
+
+    if((ctx.sock = nflog_open(opts, group, qthresh)) < 0)
+    {
+        free(ctx.spa_pkts);
+        return -1;
+    }
+
+    log_msg(LOG_INFO, "Kicking off NFLOG capture on group %i.", group);
+
+    if(set_sig_handlers() > 0)
+        log_msg(LOG_ERR, "Errors encountered when setting signal handlers.");
+
+    nflog_stop = 0;
+
+    if((loop = event_loop_new()) == NULL
+            || event_loop_add_fd(loop, ctx.sock, nflog_recv, &ctx) != 0
+            || event_loop_add_timer(loop, NFLOG_TIMER_INTERVAL * 1000,
+                nflog_timer_handler, &ctx) != 0)
+    {
+        nflog_stop = 1;
+        rv = -1;
+    }
+
+    /* SPA over TCP connections are accepted and read in the same loop.
+    */
+    if(! nflog_stop
+            && strncasecmp(opts->config[CONF_ENABLE_TCP_SERVER], "Y", 1) == 0
+            && start_tcp_server(opts, loop) != 0)
+    {
+        log_msg(LOG_ERR, "run_nflog_capture: could not start the TCP server");
+        nflog_stop = 1;
+        rv = -1;
+    }
+
+    /* and so are SPA over HTTP requests.
+    */
+    if(! nflog_stop
+            && strncasecmp(opts->config[CONF_ENABLE_HTTP_SERVER], "Y", 1) == 0
+            && start_http_server(opts, loop) != 0)
+    {
+        log_msg(LOG_ERR, "run_nflog_capture: could not start the HTTP server");
+        nflog_stop = 1;
+        rv = -1;
+    }
+
+    while(! nflog_stop)
+    {
+        if(sig_do_stop(opts))
+        {
+            if(opts->verbose)
+                log_msg(LOG_INFO,
+                        "nflog_capture: terminating signal received, will stop.");
+            break;
+        }
+
+        if((is_err = event_loop_run_once(loop, -1)) != EVENT_LOOP_CONTINUE)
+        {
+            if(is_err < 0)
+                rv = -1;
+            break;
+        }
+    }
+
+    nflog_stop = 1;
+
+    stop_tcp_server(opts);
+    stop_http_server(opts);
+    event_loop_destroy(loop);
+
+    /* Give the group back, so a restarted fwknopd can bind to it.
+    */
+    nflog_config(ctx.sock, AF_UNSPEC, group, NFULNL_CFG_CMD_UNBIND, 0);
+    close(ctx.sock);
+
+    free(ctx.spa_pkts);
+    return rv;
+}
+
+#endif /* HAVE_NFLOG_CAPTURE */
+
+/***EOF***/
@@ -0,0 +1,67 @@
+/*
+ *****************************************************************************
+ *
+ * File:    nflog_capture.h
+ *
+ * Purpose: Header file for nflog_capture.c.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef NFLOG_CAPTURE_H
+#define NFLOG_CAPTURE_H
+
+/* NFLOG is part of Linux netfilter, so it is only built along with one of
+ * the netfilter firewall backends.
+*/
+#if FIREWALL_IPTABLES || FIREWALL_FIREWALLD || FIREWALL_NFTABLES
+  #define HAVE_NFLOG_CAPTURE 1
+#endif
+
+/* Receive buffer for the NFLOG socket, and the largest number of logged
+ * packets handed to incoming_spa_batch() at a time.  NFLOG_QTHRESHOLD
+ * may not be larger than NFLOG_BATCH_LEN.
+*/
+#define NFLOG_BUFSIZE           65536
+#define NFLOG_RCVBUF            (4*1024*1024)
+#define NFLOG_BATCH_LEN         64
+
+/* With NFLOG_QTHRESHOLD above one the kernel holds packets back until
+ * that many are queued, or for at most this long (in 1/100 seconds).
+*/
+#define NFLOG_FLUSH_TIMEOUT     5
+
+/* Number of seconds between checks for expired firewall rules and
+ * CMD_CYCLE_CLOSE commands.
+*/
+#define NFLOG_TIMER_INTERVAL    1
+
+/* Prototypes
+*/
+#if HAVE_NFLOG_CAPTURE
+int run_nflog_capture(fko_srv_options_t *opts);
+#endif
+
+#endif /* NFLOG_CAPTURE_H */
+
+/***EOF***/
@@ -32,6 +32,7 @@
 #if USE_LIBPCAP
   #include <pcap.h>
   #include <errno.h>
+  #include <poll.h>
 #endif
 
 #include "fwknopd_common.h"
@@ -43,39 +44,1218 @@
 #include "fwknopd_errors.h"
 #include "sig_handler.h"
 #include "tcp_server.h"
+#include "http_server.h"
+#include "pcap_filter.h"
+#include "benchmark.h"
+#include "rate_limit.h"
+#include "grant_quota.h"
+#include "replay_cache.h"
+#include "acc_expire.h"
+#include "acc_lazy.h"
+#include "utils.h"
+#include "cpu_affinity.h"
 
 #if HAVE_SYS_WAIT_H
   #include <sys/wait.h>
 #endif
 
+#if USE_LIBPCAP && defined(__linux__) && HAVE_LINUX_IF_PACKET_H
+  #include <sys/mman.h>
+  #include <sys/socket.h>
+  #include <sys/ioctl.h>
+  #include <poll.h>
+  #include <signal.h>
+  #include <net/if.h>
+  #include <net/if_arp.h>
+  #include <linux/if_packet.h>
+  #include <linux/if_ether.h>
+  #include <linux/filter.h>
+  #ifdef TPACKET3_HDRLEN
+    #define HAVE_TPACKET_V3 1
+  #endif
+#endif
+
 #if USE_LIBPCAP
 
+/* Sleep for the capture loop interval.  If the TCP or HTTP server is running,
+ * wait on its sockets instead so connections are serviced while we would
+ * otherwise be idle.
+*/
+static void
+capture_loop_sleep(event_loop_t *tcp_loop, const int useconds)
+{
+    if(tcp_loop != NULL && useconds >= 1000)
+    {
+        event_loop_run_once(tcp_loop, useconds / 1000);
+        return;
+    }
+
+    usleep(useconds);
+
+    if(tcp_loop != NULL)
+        event_loop_run_once(tcp_loop, 0);
+
+    return;
+}
+
+static void
+capture_tcp_server_stop(fko_srv_options_t *opts, event_loop_t *tcp_loop)
+{
+    if(tcp_loop == NULL)
+        return;
+
+    stop_tcp_server(opts);
+    stop_http_server(opts);
+    event_loop_destroy(tcp_loop);
+    return;
+}
+
+/* Handle the access stanza and firewall rule expiration and command cycle
+ * timers that are run on each pass through the capture loop.
+*/
+static void
+capture_loop_timers(fko_srv_options_t *opts, const int rules_chk_threshold)
+{
+#if FIREWALL_IPFW
+    time_t  now;
+#endif
+
+    clock_cache_update();
+
+    acc_expire_run(opts);
+    acc_lazy_run();
+    grant_quota_run();
+
+    if(!opts->test)
+    {
+        if(opts->enable_fw)
+        {
+            /* Check for any expired firewall rules and deal with them.
+            */
+            fw_check_expired(opts, rules_chk_threshold);
+        }
+
+        /* See if any CMD_CYCLE_CLOSE commands need to be executed.
+        */
+        cmd_cycle_close(opts);
+
+        rate_limit_report();
+    }
+
+    replay_cache_sync(opts);
+
+#if FIREWALL_IPFW
+    /* Purge expired rules that no longer have any corresponding
+     * dynamic rules.
+    */
+    if(opts->fw_config->total_rules > 0)
+    {
+        time(&now);
+        if(opts->fw_config->last_purge < (now - opts->fw_config->purge_interval))
+        {
+            ipfw_purge_expired_rules(opts);
+            opts->fw_config->last_purge = now;
+        }
+    }
+#endif
+
+    return;
+}
+
+/* One capture lane: a capture handle on one interface, and the SPA packet
+ * buffer for the frames read from it.  There is a lane for each capture
+ * interface in PCAP_INTF (times PCAP_CAPTURE_THREADS with the TPACKET_V3
+ * ring).  Lane 0 is run by the main thread along with the timers and the
+ * TCP server, every other lane has a thread of its own.
+*/
+typedef struct capture_lane
+{
+    fko_srv_options_t  *opts;
+    const char         *intf;
+    int                 data_link_offset;
+    int                 max_sniff_bytes;
+    int                 errcnt;
+    pthread_t           thread;
+
+    /* libpcap handle
+    */
+    pcap_t             *pcap;
+    int                 dispatch_count;
+    int                 useconds;
+    int                 filter_gen;
+
+    /* Adaptive scheduling (PCAP_ADAPTIVE_POLL), sel_fd is -1 when the
+     * lane sleeps PCAP_LOOP_SLEEP between dispatches instead.
+    */
+    int                 adaptive;
+    int                 sel_fd;
+    int                 rate;
+    struct timespec     last_pkt;
+    struct timespec     last_timers;
+
+#if HAVE_TPACKET_V3
+    /* TPACKET_V3 ring
+    */
+    int                 sock;
+    unsigned char      *ring;
+    size_t              ring_len;
+    int                 block_nr;
+    int                 blk_idx;
+    int                 poll_timeout;
+#endif
+
+    spa_pkt_info_t      spa_pkt;
+} capture_lane_t;
+
+/* Set when the capture threads should leave their loops, and when one of
+ * them gave up because of capture errors.  The main thread bumps the
+ * filter generation when the capture filter has to be rebuilt.
+*/
+static volatile int     capture_lanes_stop = 0;
+static volatile int     capture_lanes_failed = 0;
+static volatile int     capture_filter_gen = 0;
+
+/* Split the PCAP_INTF list (names separated by commas or spaces) into
+ * intfs, using buf for the names.  Returns the number of interfaces, or
+ * -1 if there are none or too many.
+*/
+static int
+capture_intf_list(const char *val, char *buf, const size_t buf_len,
+        char **intfs)
+{
+    char   *tok, *saveptr = NULL;
+    int     num_intfs = 0;
+
+    strlcpy(buf, val, buf_len);
+
+    for(tok = strtok_r(buf, ", \t", &saveptr); tok != NULL;
+            tok = strtok_r(NULL, ", \t", &saveptr))
+    {
+        if(num_intfs >= MAX_CAPTURE_INTFS)
+            return(-1);
+        intfs[num_intfs++] = tok;
+    }
+
+    return(num_intfs > 0 ? num_intfs : -1);
+}
+
+/* Count processed frames against --packet-limit.  Returns 1 once the
+ * limit has been reached.
+*/
+static int
+capture_count_packets(fko_srv_options_t *opts, const int count)
+{
+    unsigned int    total;
+
+    total = __atomic_add_fetch(&(opts->packet_ctr), count, __ATOMIC_RELAXED);
+
+    if (opts->packet_ctr_limit && total >= (unsigned int)opts->packet_ctr_limit)
+    {
+        if(! __atomic_exchange_n(&capture_lanes_stop, 1, __ATOMIC_RELAXED))
+            log_msg(LOG_WARNING,
+                "* Incoming packet count limit of %i reached",
+                opts->packet_ctr_limit
+            );
+        return(1);
+    }
+    return(0);
+}
+
+/* pcap_dispatch() callback for a lane.
+*/
+static void
+capture_lane_packet(unsigned char *args, const struct pcap_pkthdr *packet_header,
+    const unsigned char *packet)
+{
+    capture_lane_t *lane = (capture_lane_t *)args;
+
+    process_packet_lane(lane->opts, lane->data_link_offset, packet_header,
+        packet, &(lane->spa_pkt));
+    return;
+}
+
+/* Block signals (the main thread handles them) and pin a capture thread.
+*/
+static void
+capture_thread_init(void)
+{
+    sigset_t        mask;
+
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    cpu_affinity_set(CPU_ROLE_CAPTURE);
+    return;
+}
+
+#if HAVE_TPACKET_V3
+
+/* Compile the capture filter with libpcap and attach it directly to the
+ * socket so that the kernel only places matching frames in the ring.  The
+ * classic BPF instruction layout is identical for both.  Attaching a new
+ * filter atomically replaces the old one, so this is also used to refresh
+ * the filter while capturing.
+*/
+static int
+tpacket_v3_set_filter(fko_srv_options_t *opts, const int sock,
+        const int max_sniff_bytes)
+{
+    pcap_t                 *pcap_dead;
+    struct bpf_program      fp;
+    struct sock_fprog       fprog;
+    char                   *filter_expr;
+    int                     rv = -1;
+
+    if((filter_expr = pcap_filter_expr(opts)) == NULL)
+        return(-1);
+
+    if(filter_expr[0] == '\0')
+    {
+        free(filter_expr);
+        return(0);
+    }
+
+    if((pcap_dead = pcap_open_dead(DLT_EN10MB, max_sniff_bytes)) == NULL)
+    {
+        free(filter_expr);
+        return(-1);
+    }
+
+    if(pcap_compile(pcap_dead, &fp, filter_expr, 1, 0) == -1)
+    {
+        log_msg(LOG_ERR, "[*] Error compiling pcap filter: %s",
+            pcap_geterr(pcap_dead)
+        );
+    }
+    else
+    {
+        fprog.len    = fp.bf_len;
+        fprog.filter = (struct sock_filter *)fp.bf_insns;
+
+        if(setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER,
+                &fprog, sizeof(fprog)) < 0)
+            log_msg(LOG_ERR, "[*] TPACKET_V3: SO_ATTACH_FILTER error: %s",
+                strerror(errno));
+        else
+        {
+            log_msg(LOG_INFO, "PCAP filter is: '%s'", filter_expr);
+            rv = 0;
+        }
+
+        pcap_freecode(&fp);
+    }
+
+    pcap_close(pcap_dead);
+    free(filter_expr);
+
+    return(rv);
+}
+
+/* Set up an AF_PACKET socket with a TPACKET_V3 block ring mapped into
+ * our address space, and join it to the PACKET_FANOUT group described by
+ * fanout unless that is zero.  Returns the socket descriptor, or -1 if the
+ * ring could not be set up (in which case the caller falls back to
+ * libpcap).
+*/
+static int
+tpacket_v3_open(fko_srv_options_t *opts, const char *intf, const int promisc,
+        const int max_sniff_bytes, const int block_nr, const int fanout,
+        unsigned char **ring, size_t *ring_len)
+{
+    struct tpacket_req3     req;
+    struct sockaddr_ll      sll;
+    struct packet_mreq      mreq;
+    struct ifreq            ifr;
+    int                     sock;
+    int                     version = TPACKET_V3;
+    unsigned int            ifindex;
+
+    ifindex = if_nametoindex(intf);
+    if(ifindex == 0)
+    {
+        log_msg(LOG_ERR, "[*] TPACKET_V3: unknown interface '%s'", intf);
+        return(-1);
+    }
+
+    sock = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if(sock < 0)
+    {
+        log_msg(LOG_ERR, "[*] TPACKET_V3: socket() error: %s",
+            strerror(errno));
+        return(-1);
+    }
+
+    /* process_packet() expects Ethernet framing, which is what the kernel
+     * hands us for both Ethernet and loopback devices.
+    */
+    memset(&ifr, 0x0, sizeof(ifr));
+    strlcpy(ifr.ifr_name, intf, sizeof(ifr.ifr_name));
+    if(ioctl(sock, SIOCGIFHWADDR, &ifr) < 0
+            || (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER
+                && ifr.ifr_hwaddr.sa_family != ARPHRD_LOOPBACK))
+    {
+        log_msg(LOG_ERR,
+            "[*] TPACKET_V3: interface '%s' does not use Ethernet framing",
+            intf);
+        close(sock);
+        return(-1);
+    }
+
+    if(setsockopt(sock, SOL_PACKET, PACKET_VERSION,
+            &version, sizeof(version)) < 0)
+    {
+        log_msg(LOG_ERR, "[*] TPACKET_V3: PACKET_VERSION error: %s",
+            strerror(errno));
+        close(sock);
+        return(-1);
+    }
+
+    if(tpacket_v3_set_filter(opts, sock, max_sniff_bytes) != 0)
+    {
+        close(sock);
+        return(-1);
+    }
+
+    memset(&req, 0x0, sizeof(req));
+    req.tp_block_size       = TPACKET_V3_BLOCK_SIZE;
+    req.tp_block_nr         = block_nr;
+    req.tp_frame_size       = TPACKET_V3_FRAME_SIZE;
+    req.tp_frame_nr         = (TPACKET_V3_BLOCK_SIZE / TPACKET_V3_FRAME_SIZE) * block_nr;
+    req.tp_retire_blk_tov   = TPACKET_V3_BLOCK_TIMEOUT;
+
+    if(setsockopt(sock, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+    {
+        log_msg(LOG_ERR, "[*] TPACKET_V3: PACKET_RX_RING error: %s",
+            strerror(errno));
+        close(sock);
+        return(-1);
+    }
+
+    *ring_len = (size_t)req.tp_block_size * req.tp_block_nr;
+    *ring = mmap(NULL, *ring_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_LOCKED, sock, 0);
+    if(*ring == MAP_FAILED)
+    {
+        /* MAP_LOCKED may be refused by RLIMIT_MEMLOCK, so try once more
+         * without it.
+        */
+        *ring = mmap(NULL, *ring_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED, sock, 0);
+        if(*ring == MAP_FAILED)
+        {
+            log_msg(LOG_ERR, "[*] TPACKET_V3: mmap() error: %s",
+                strerror(errno));
+            close(sock);
+            return(-1);
+        }
+    }
+
+    memset(&sll, 0x0, sizeof(sll));
+    sll.sll_family   = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex  = ifindex;
+
+    if(bind(sock, (struct sockaddr *)&sll, sizeof(sll)) < 0)
+    {
+        log_msg(LOG_ERR, "[*] TPACKET_V3: bind() error: %s",
+            strerror(errno));
+        munmap(*ring, *ring_len);
+        close(sock);
+        return(-1);
+    }
+
+    if(fanout != 0 && setsockopt(sock, SOL_PACKET, PACKET_FANOUT,
+                &fanout, sizeof(fanout)) < 0)
+    {
+        log_msg(LOG_ERR, "[*] TPACKET_V3: PACKET_FANOUT error: %s",
+            strerror(errno));
+        munmap(*ring, *ring_len);
+        close(sock);
+        return(-1);
+    }
+
+    if(promisc)
+    {
+        memset(&mreq, 0x0, sizeof(mreq));
+        mreq.mr_ifindex = ifindex;
+        mreq.mr_type    = PACKET_MR_PROMISC;
+
+        if(setsockopt(sock, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                &mreq, sizeof(mreq)) < 0)
+            log_msg(LOG_WARNING, "[*] TPACKET_V3: could not set promiscuous mode: %s",
+                strerror(errno));
+    }
+
+    return(sock);
+}
+
+/* Walk every frame in a retired ring block and hand it to process_packet()
+ * in place.  Returns the number of frames that were passed along.
+*/
+static int
+tpacket_v3_walk_block(capture_lane_t *lane, struct tpacket_block_desc *pbd)
+{
+    fko_srv_options_t      *opts = lane->opts;
+    struct tpacket3_hdr    *ppd;
+    struct sockaddr_ll     *sll;
+    struct pcap_pkthdr      hdr;
+    unsigned int            i;
+    int                     processed = 0;
+
+    ppd = (struct tpacket3_hdr *)((unsigned char *)pbd
+            + pbd->hdr.bh1.offset_to_first_pkt);
+
+    for(i=0; i < pbd->hdr.bh1.num_pkts; i++)
+    {
+        sll = (struct sockaddr_ll *)((unsigned char *)ppd
+                + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+
+        /* We are only interested on seeing packets coming into the
+         * interface (see the pcap_setdirection() call for the libpcap
+         * path).
+        */
+        if(opts->pcap_any_direction || sll->sll_pkttype != PACKET_OUTGOING)
+        {
+            hdr.ts.tv_sec   = ppd->tp_sec;
+            hdr.ts.tv_usec  = ppd->tp_nsec / 1000;
+            hdr.len         = ppd->tp_len;
+            hdr.caplen      = ppd->tp_snaplen < (unsigned int)lane->max_sniff_bytes
+                                ? ppd->tp_snaplen : (unsigned int)lane->max_sniff_bytes;
+
+            process_packet_lane(opts, lane->data_link_offset, &hdr,
+                (unsigned char *)ppd + ppd->tp_mac, &(lane->spa_pkt));
+
+            processed++;
+        }
+
+        ppd = (struct tpacket3_hdr *)((unsigned char *)ppd + ppd->tp_next_offset);
+    }
+
+    return(processed);
+}
+
+/* Wait for the next block of a lane (for at most its poll timeout) and
+ * process it.  Returns the number of frames processed, or -1 after a
+ * fatal capture error.
+*/
+static int
+tpacket_v3_lane_run_once(capture_lane_t *lane)
+{
+    fko_srv_options_t          *opts = lane->opts;
+    struct tpacket_block_desc  *pbd;
+    struct pollfd               pfd;
+    int                         res, sock_err;
+    socklen_t                   sock_err_len;
+
+    pbd = (struct tpacket_block_desc *)(lane->ring
+            + ((size_t)lane->blk_idx * TPACKET_V3_BLOCK_SIZE));
+
+    if((pbd->hdr.bh1.block_status & TP_STATUS_USER) == 0)
+    {
+        pfd.fd      = lane->sock;
+        pfd.events  = POLLIN | POLLERR;
+        pfd.revents = 0;
+
+        res = poll(&pfd, 1, lane->poll_timeout);
+
+        if(res < 0 && errno != EINTR)
+        {
+            log_msg(LOG_ERR, "[*] Error from poll(): %s", strerror(errno));
+            if(lane->errcnt++ > MAX_PCAP_ERRORS_BEFORE_BAIL)
+            {
+                log_msg(LOG_ERR, "[*] %i consecutive capture errors.  Giving up",
+                    lane->errcnt
+                );
+                return(-1);
+            }
+        }
+        else if(res > 0 && (pfd.revents & POLLERR))
+        {
+            sock_err = 0;
+            sock_err_len = sizeof(sock_err);
+            getsockopt(lane->sock, SOL_SOCKET, SO_ERROR, &sock_err, &sock_err_len);
+
+            if(opts->rt->exit_at_intf_down
+                    && sock_err == ENETDOWN)
+            {
+                log_msg(LOG_ERR, "[*] Fatal error on capture socket: %s",
+                    strerror(sock_err)
+                );
+                return(-1);
+            }
+            else if(sock_err != 0)
+                log_msg(LOG_ERR, "[*] Error on capture socket: %s",
+                    strerror(sock_err)
+                );
+        }
+        else
+            lane->errcnt = 0;
+
+        return(0);
+    }
+
+    res = tpacket_v3_walk_block(lane, pbd);
+
+    /* Hand the block back to the kernel.
+    */
+    __sync_synchronize();
+    pbd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+    lane->blk_idx = (lane->blk_idx + 1) % lane->block_nr;
+
+    if(res > 0 && opts->foreground == 1 && opts->verbose > 2)
+        log_msg(LOG_DEBUG, "TPACKET_V3 block processed: %d packets", res);
+
+    return(res);
+}
+
+/* Loop of the extra TPACKET_V3 capture threads.
+*/
+static void *
+tpacket_v3_lane_thread(void *arg)
+{
+    capture_lane_t *lane = (capture_lane_t *)arg;
+    int             res;
+
+    capture_thread_init();
+
+    while(! capture_lanes_stop)
+    {
+        if((res = tpacket_v3_lane_run_once(lane)) < 0)
+        {
+            capture_lanes_failed = 1;
+            capture_lanes_stop   = 1;
+            break;
+        }
+
+        if(res > 0 && capture_count_packets(lane->opts, res))
+            break;
+    }
+
+    return NULL;
+}
+
+static void
+tpacket_v3_lanes_free(capture_lane_t *lanes, const int num_lanes)
+{
+    int     i;
+
+    for(i=0; i < num_lanes; i++)
+    {
+        if(lanes[i].sock < 0)
+            continue;
+        munmap(lanes[i].ring, lanes[i].ring_len);
+        close(lanes[i].sock);
+    }
+    free(lanes);
+    return;
+}
+
+/* The TPACKET_V3 capture loop.  Returns -1 if the ring could not be set
+ * up so that pcap_capture() can fall back to pcap_open_live().
+*/
+static int
+tpacket_v3_capture(fko_srv_options_t *opts, char **intfs, const int num_intfs,
+        const int promisc, const int max_sniff_bytes, const int useconds,
+        const int rules_chk_threshold, event_loop_t *tcp_loop)
+{
+    capture_lane_t     *lanes = NULL;
+    int                 block_nr, num_threads, num_lanes, res, is_err, i;
+    int                 fanout = 0, started = 0, fatal = 0;
+    int                 poll_timeout;
+
+    block_nr = strtol_wrapper(opts->config[CONF_PCAP_TPACKET_V3_BLOCKS],
+            1, RCHK_MAX_PCAP_TPACKET_V3_BLOCKS, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] invalid PCAP_TPACKET_V3_BLOCKS value");
+        clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    num_threads = strtol_wrapper(opts->config[CONF_PCAP_CAPTURE_THREADS],
+            1, RCHK_MAX_PCAP_CAPTURE_THREADS, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] invalid PCAP_CAPTURE_THREADS value");
+        clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    /* The fanout group ID only has to be unique among the sockets on this
+     * host, so derive it from our PID (plus the interface index below).
+    */
+    if(num_threads > 1)
+    {
+        if(strcasecmp(opts->config[CONF_PCAP_FANOUT_MODE], "cpu") == 0)
+            fanout = PACKET_FANOUT_CPU << 16;
+        else if(strcasecmp(opts->config[CONF_PCAP_FANOUT_MODE], "hash") == 0)
+            fanout = PACKET_FANOUT_HASH << 16;
+        else
+        {
+            log_msg(LOG_ERR, "[*] invalid PCAP_FANOUT_MODE '%s' (hash or cpu)",
+                opts->config[CONF_PCAP_FANOUT_MODE]);
+            clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+        }
+    }
+
+    for(i=0; i < num_intfs; i++)
+    {
+        if(num_threads > 1)
+            log_msg(LOG_INFO, "Sniffing interface: %s (TPACKET_V3 ring, %i blocks, %i %s fanout threads)",
+                intfs[i], block_nr, num_threads,
+                opts->config[CONF_PCAP_FANOUT_MODE]);
+        else
+            log_msg(LOG_INFO, "Sniffing interface: %s (TPACKET_V3 ring, %i blocks)",
+                intfs[i], block_nr);
+    }
+
+    num_lanes = num_intfs * num_threads;
+
+    if((lanes = calloc(num_lanes, sizeof(capture_lane_t))) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] TPACKET_V3: calloc() failed for %i capture lanes",
+            num_lanes);
+        return(-1);
+    }
+
+    /* The poll() timeout takes the place of the PCAP_LOOP_SLEEP usleep()
+     * so that rule expiration still runs when there is no traffic.
+    */
+    poll_timeout = useconds / 1000;
+    if(poll_timeout < 1)
+        poll_timeout = 1;
+
+    for(i=0; i < num_lanes; i++)
+        lanes[i].sock = -1;
+
+    for(i=0; i < num_lanes; i++)
+    {
+        lanes[i].opts             = opts;
+        lanes[i].intf             = intfs[i / num_threads];
+        lanes[i].data_link_offset = ETHER_HDR_LEN;
+        lanes[i].block_nr         = block_nr;
+        lanes[i].max_sniff_bytes  = max_sniff_bytes;
+        lanes[i].poll_timeout     = poll_timeout;
+
+        /* One fanout group per interface.
+        */
+        lanes[i].sock = tpacket_v3_open(opts, lanes[i].intf, promisc,
+                max_sniff_bytes, block_nr,
+                fanout == 0 ? 0 : fanout | ((getpid() + i / num_threads) & 0xffff),
+                &(lanes[i].ring), &(lanes[i].ring_len));
+        if(lanes[i].sock < 0)
+        {
+            tpacket_v3_lanes_free(lanes, num_lanes);
+            return(-1);
+        }
+    }
+
+    if(set_sig_handlers() > 0)
+        log_msg(LOG_ERR, "Errors encountered when setting signal handlers.");
+
+    log_msg(LOG_INFO, "Starting fwknopd main event loop.");
+
+    capture_lanes_stop   = 0;
+    capture_lanes_failed = 0;
+
+    for(started=1; started < num_lanes; started++)
+    {
+        if(pthread_create(&(lanes[started].thread), NULL,
+                tpacket_v3_lane_thread, &(lanes[started])) != 0)
+        {
+            log_msg(LOG_ERR, "[*] TPACKET_V3: failed to start capture thread %i",
+                started);
+            capture_lanes_stop = 1;
+            fatal = 1;
+            break;
+        }
+    }
+
+    while(! capture_lanes_stop)
+    {
+        if(sig_do_stop(opts))
+        {
+            log_msg(LOG_INFO, "Gracefully leaving the fwknopd event loop.");
+            break;
+        }
+
+        /* Attaching the new filter to every capture socket replaces the
+         * old one on each.
+        */
+        if(opts->pcap_filter_refresh)
+        {
+            opts->pcap_filter_refresh = 0;
+            for(i=0; i < num_lanes; i++)
+                if(tpacket_v3_set_filter(opts, lanes[i].sock, max_sniff_bytes) != 0)
+                    log_msg(LOG_ERR, "[*] Could not refresh the capture filter, keeping the old one");
+        }
+
+        if((res = tpacket_v3_lane_run_once(&(lanes[0]))) < 0)
+        {
+            fatal = 1;
+            break;
+        }
+
+        if(res == 0 && tcp_loop != NULL)
+            event_loop_run_once(tcp_loop, 0);
+
+        if(res > 0 && capture_count_packets(opts, res))
+        {
+            log_msg(LOG_INFO, "Gracefully leaving the fwknopd event loop.");
+            break;
+        }
+
+        capture_loop_timers(opts, rules_chk_threshold);
+    }
+
+    /* A capture thread that gave up also stops the main loop.
+    */
+    if(capture_lanes_failed)
+        fatal = 1;
+
+    capture_lanes_stop = 1;
+
+    for(i=1; i < started; i++)
+        pthread_join(lanes[i].thread, NULL);
+
+    tpacket_v3_lanes_free(lanes, num_lanes);
+
+    if(fatal)
+        clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+
+    return(0);
+}
+
+#endif /* HAVE_TPACKET_V3 */
+
+/* Build, compile and set the capture filter on a libpcap handle.
+*/
+static int
+pcap_set_capture_filter(fko_srv_options_t *opts, pcap_t *pcap)
+{
+    struct bpf_program  fp;
+    char               *filter_expr;
+    int                 rv = -1;
+
+    if((filter_expr = pcap_filter_expr(opts)) == NULL)
+        return(-1);
+
+    if(filter_expr[0] == '\0')
+    {
+        free(filter_expr);
+        return(0);
+    }
+
+    if(pcap_compile(pcap, &fp, filter_expr, 1, 0) == -1)
+    {
+        log_msg(LOG_ERR, "[*] Error compiling pcap filter: %s",
+            pcap_geterr(pcap)
+        );
+    }
+    else
+    {
+        if(pcap_setfilter(pcap, &fp) == -1)
+            log_msg(LOG_ERR, "[*] Error setting pcap filter: %s",
+                pcap_geterr(pcap)
+            );
+        else
+        {
+            log_msg(LOG_INFO, "PCAP filter is: '%s'", filter_expr);
+            rv = 0;
+        }
+
+        pcap_freecode(&fp);
+    }
+
+    free(filter_expr);
+    return(rv);
+}
+
+/* Determine the data link encapsulation offset.  Returns 0 for link
+ * types where the capture direction can't be set.
+*/
+static int
+pcap_set_data_link_offset(pcap_t *pcap, int *offset)
+{
+    int     set_direction = 1;
+
+    switch(pcap_datalink(pcap)) {
+        case DLT_EN10MB:
+            *offset = 14;
+            break;
+#if defined(__linux__)
+        case DLT_LINUX_SLL:
+            *offset = 16;
+            break;
+#elif defined(__OpenBSD__)
+        case DLT_LOOP:
+            set_direction = 0;
+            *offset = 4;
+            break;
+#endif
+        case DLT_NULL:
+            set_direction = 0;
+            *offset = 4;
+            break;
+        default:
+            *offset = 0;
+            break;
+    }
+
+    return(set_direction);
+}
+
+/* Open the libpcap handle of a lane (on lane->intf, or on the pcap file)
+ * and set its filter, data link offset, direction and blocking mode.
+ * Exits on errors.
+*/
+#if HAVE_PCAP_SET_IMMEDIATE_MODE
+/* pcap_open_live() with immediate mode turned on.
+*/
+static pcap_t *
+pcap_open_immediate(const char *intf, const int snaplen, const int promisc,
+        char *errstr)
+{
+    pcap_t     *pcap;
+    int         res;
+
+    if((pcap = pcap_create(intf, errstr)) == NULL)
+        return(NULL);
+
+    if(pcap_set_snaplen(pcap, snaplen) != 0
+            || pcap_set_promisc(pcap, promisc) != 0
+            || pcap_set_timeout(pcap, 100) != 0
+            || pcap_set_immediate_mode(pcap, 1) != 0)
+    {
+        snprintf(errstr, PCAP_ERRBUF_SIZE, "%s: could not set capture options",
+            intf);
+        pcap_close(pcap);
+        return(NULL);
+    }
+
+    if((res = pcap_activate(pcap)) < 0)
+    {
+        snprintf(errstr, PCAP_ERRBUF_SIZE, "%s: %s", intf,
+            res == PCAP_ERROR ? pcap_geterr(pcap) : pcap_statustostr(res));
+        pcap_close(pcap);
+        return(NULL);
+    }
+
+    return(pcap);
+}
+#endif
+
+static void
+pcap_lane_open(fko_srv_options_t *opts, capture_lane_t *lane,
+        const int promisc, const int pcap_file_mode)
+{
+    char    errstr[PCAP_ERRBUF_SIZE] = {0};
+    int     set_direction;
+
+    if(pcap_file_mode == 1) {
+        log_msg(LOG_INFO, "Reading pcap file: %s",
+            opts->config[CONF_PCAP_FILE]);
+
+        lane->pcap = pcap_open_offline(opts->config[CONF_PCAP_FILE], errstr);
+
+        if(lane->pcap == NULL)
+        {
+            log_msg(LOG_ERR, "[*] pcap_open_offline() error: %s",
+                    errstr);
+            clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+        }
+    }
+    else
+    {
+        log_msg(LOG_INFO, "Sniffing interface: %s", lane->intf);
+
+#if HAVE_PCAP_SET_IMMEDIATE_MODE
+        /* With adaptive scheduling packets should be handed over as soon
+         * as they arrive rather than when the capture buffer times out.
+        */
+        if(lane->adaptive)
+            lane->pcap = pcap_open_immediate(lane->intf,
+                lane->max_sniff_bytes, promisc, errstr);
+        else
+#endif
+        lane->pcap = pcap_open_live(lane->intf,
+            lane->max_sniff_bytes, promisc, 100, errstr
+        );
+
+        if(lane->pcap == NULL)
+        {
+            log_msg(LOG_ERR, "[*] pcap_open_live() error: %s", errstr);
+            clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+        }
+    }
+
+    /* Set pcap filters, if any.
+    */
+    if(pcap_set_capture_filter(opts, lane->pcap) != 0)
+        clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+
+    /* Determine and set the data link encapsulation offset.
+    */
+    set_direction = pcap_set_data_link_offset(lane->pcap,
+            &(lane->data_link_offset));
+
+    /* We are only interested on seeing packets coming into the interface.
+    */
+    if ((opts->pcap_any_direction == 0)
+            && (set_direction == 1) && (pcap_file_mode == 0)
+            && (pcap_setdirection(lane->pcap, PCAP_D_IN) < 0))
+        if(opts->verbose)
+            log_msg(LOG_WARNING, "[*] Warning: pcap error on setdirection: %s.",
+                pcap_geterr(lane->pcap));
+
+    /* Set our pcap handle nonblocking mode.
+     *
+     * NOTE: This is simply set to 0 for now until we find a need
+     *       to actually use this mode (which when set on a FreeBSD
+     *       system, it silently breaks the packet capture).
+    */
+    if((pcap_file_mode == 0)
+            && (pcap_setnonblock(lane->pcap, DEF_PCAP_NONBLOCK, errstr)) == -1)
+    {
+        log_msg(LOG_ERR, "[*] Error setting pcap nonblocking to %i: %s",
+            0, errstr
+        );
+        clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    return;
+}
+
+static long
+usec_between(const struct timespec *then, const struct timespec *now)
+{
+    return((now->tv_sec - then->tv_sec) * 1000000L
+        + (now->tv_nsec - then->tv_nsec) / 1000L);
+}
+
+/* Switch a libpcap lane to adaptive scheduling if PCAP_ADAPTIVE_POLL is
+ * set.  This needs a capture descriptor that poll() works on, and a
+ * nonblocking handle so that the busy-poll dispatches return right away.
+*/
+static void
+capture_sched_init(capture_lane_t *lane, const int pcap_file_mode)
+{
+    lane->sel_fd = -1;
+
+    if(! lane->adaptive || pcap_file_mode == 1 || DEF_PCAP_NONBLOCK == 0)
+        return;
+
+    if((lane->sel_fd = pcap_get_selectable_fd(lane->pcap)) < 0)
+    {
+        log_msg(LOG_WARNING,
+            "[*] No pollable capture descriptor on %s, sleeping PCAP_LOOP_SLEEP between dispatches",
+            lane->intf);
+        return;
+    }
+
+    lane->rate = PCAP_ADAPTIVE_MIN_BATCH * PCAP_ADAPTIVE_RATE_SCALE / 2;
+    clock_gettime(CLOCK_MONOTONIC, &(lane->last_timers));
+    lane->last_pkt = lane->last_timers;
+    lane->last_pkt.tv_sec -= 1;
+
+    return;
+}
+
+/* The count to hand to the next pcap_dispatch() call on a lane.
+*/
+static int
+capture_sched_batch(const capture_lane_t *lane)
+{
+    int     batch;
+
+    if(lane->sel_fd < 0 || lane->dispatch_count <= 0)
+        return(lane->dispatch_count);
+
+    batch = lane->rate * 2 / PCAP_ADAPTIVE_RATE_SCALE;
+    if(batch < PCAP_ADAPTIVE_MIN_BATCH)
+        batch = PCAP_ADAPTIVE_MIN_BATCH;
+    if(batch > lane->dispatch_count)
+        batch = lane->dispatch_count;
+
+    return(batch);
+}
+
+/* Fold the result of a dispatch into the lane's arrival rate.  Only the
+ * dispatches that returned packets count, since the busy-poll ones that
+ * come up empty say nothing about the size of a burst.
+*/
+static void
+capture_sched_update(capture_lane_t *lane, const int res)
+{
+    if(lane->sel_fd < 0 || res <= 0)
+        return;
+
+    lane->rate += (res * PCAP_ADAPTIVE_RATE_SCALE - lane->rate) / 4;
+    clock_gettime(CLOCK_MONOTONIC, &(lane->last_pkt));
+
+    return;
+}
+
+/* Whether the main loop should run its timers on this pass.  While the
+ * lane is busy-polling, that is only once every PCAP_LOOP_SLEEP.
+*/
+static int
+capture_sched_timers_due(capture_lane_t *lane)
+{
+    struct timespec now;
+
+    if(lane->sel_fd < 0)
+        return(1);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if(usec_between(&(lane->last_pkt), &now) < PCAP_ADAPTIVE_SPIN_USEC
+            && usec_between(&(lane->last_timers), &now) < lane->useconds)
+        return(0);
+
+    lane->last_timers = now;
+    return(1);
+}
+
+static int
+capture_sched_wakeup(int fd, void *arg)
+{
+    (void)fd;
+    (void)arg;
+
+    /* The capture loop reads the packets once event_loop_run_once()
+     * returns.
+    */
+    return(EVENT_LOOP_CONTINUE);
+}
+
+/* Wait for the next pass through a lane's capture loop.  Right after
+ * packets came in this returns at once (after servicing any TCP and HTTP
+ * connections), otherwise it blocks until the capture descriptor is
+ * readable or PCAP_LOOP_SLEEP has passed, whichever is first.  When the
+ * TCP or HTTP server is running the capture descriptor is part of its
+ * event loop.
+*/
+static void
+capture_sched_wait(capture_lane_t *lane, event_loop_t *tcp_loop)
+{
+    struct timespec now;
+    struct pollfd   pfd;
+    int             timeout;
+
+    if(lane->sel_fd < 0)
+    {
+        capture_loop_sleep(tcp_loop, lane->useconds);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(usec_between(&(lane->last_pkt), &now) < PCAP_ADAPTIVE_SPIN_USEC)
+    {
+        if(tcp_loop != NULL)
+            event_loop_run_once(tcp_loop, 0);
+        return;
+    }
+
+    timeout = lane->useconds / 1000;
+    if(timeout < 1)
+        timeout = 1;
+
+    if(tcp_loop != NULL)
+    {
+        event_loop_run_once(tcp_loop, timeout);
+        return;
+    }
+
+    pfd.fd      = lane->sel_fd;
+    pfd.events  = POLLIN;
+    pfd.revents = 0;
+
+    poll(&pfd, 1, timeout);
+
+    return;
+}
+
+/* Loop of the threads that capture on the second and later interfaces
+ * with libpcap.  Each one refreshes its own filter, since a libpcap
+ * handle may only be used by one thread at a time.
+*/
+static void *
+pcap_lane_thread(void *arg)
+{
+    capture_lane_t     *lane = (capture_lane_t *)arg;
+    fko_srv_options_t  *opts = lane->opts;
+    int                 res, gen;
+
+    capture_thread_init();
+
+    while(! capture_lanes_stop)
+    {
+        if((gen = capture_filter_gen) != lane->filter_gen)
+        {
+            lane->filter_gen = gen;
+            if(pcap_set_capture_filter(opts, lane->pcap) != 0)
+                log_msg(LOG_ERR, "[*] Could not refresh the capture filter on %s, keeping the old one",
+                    lane->intf);
+        }
+
+        res = pcap_dispatch(lane->pcap, capture_sched_batch(lane),
+            capture_lane_packet, (unsigned char *)lane);
+
+        capture_sched_update(lane, res);
+
+        if(res > 0)
+        {
+            if(opts->foreground == 1 && opts->verbose > 2)
+                log_msg(LOG_DEBUG, "pcap_dispatch() processed: %d packets on %s",
+                    res, lane->intf);
+
+            if(capture_count_packets(opts, res))
+                break;
+        }
+        else if(res == -1)
+        {
+            log_msg(LOG_ERR, "[*] Error from pcap_dispatch on %s: %s",
+                lane->intf, pcap_geterr(lane->pcap)
+            );
+
+            if((opts->rt->exit_at_intf_down && errno == ENETDOWN)
+                    || lane->errcnt++ > MAX_PCAP_ERRORS_BEFORE_BAIL)
+            {
+                log_msg(LOG_ERR, "[*] Giving up capture on %s", lane->intf);
+                capture_lanes_failed = 1;
+                capture_lanes_stop   = 1;
+                break;
+            }
+        }
+        else
+            lane->errcnt = 0;
+
+        capture_sched_wait(lane, NULL);
+    }
+
+    return NULL;
+}
+
 /* The pcap capture routine.
 */
 int
 pcap_capture(fko_srv_options_t *opts)
 {
-    pcap_t              *pcap;
-    char                errstr[PCAP_ERRBUF_SIZE] = {0};
-    struct bpf_program  fp;
-    int                 res;
-    int                 pcap_errcnt = 0;
+    capture_lane_t      *lanes = NULL;
+    char                intf_buf[MAX_LINE_LEN];
+    char                *intfs[MAX_CAPTURE_INTFS];
+    int                 num_intfs;
+    int                 res, i;
     int                 pending_break = 0;
     int                 promisc = 0;
-    int                 set_direction = 1;
     int                 pcap_file_mode = 0;
-    int                 status;
     int                 useconds;
+    int                 adaptive = 0;
     int                 rules_chk_threshold;
     int                 pcap_dispatch_count;
     int                 max_sniff_bytes;
     int                 is_err;
-    int                 chk_rm_all = 0;
-    pid_t               child_pid;
-
-#if FIREWALL_IPFW
-    time_t              now;
-#endif
+    int                 started = 0;
+    event_loop_t       *tcp_loop = NULL;
 
     useconds = strtol_wrapper(opts->config[CONF_PCAP_LOOP_SLEEP],
             0, RCHK_MAX_PCAP_LOOP_SLEEP, NO_EXIT_UPON_ERR, &is_err);
@@ -93,13 +1273,10 @@ pcap_capture(fko_srv_options_t *opts)
         clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
     }
 
-    rules_chk_threshold = strtol_wrapper(opts->config[CONF_RULES_CHECK_THRESHOLD],
-            0, RCHK_MAX_RULES_CHECK_THRESHOLD, NO_EXIT_UPON_ERR, &is_err);
-    if(is_err != FKO_SUCCESS)
-    {
-        log_msg(LOG_ERR, "[*] invalid RULES_CHECK_THRESHOLD");
-        clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
-    }
+    rules_chk_threshold = opts->rt->rules_chk_threshold;
+
+    if(strncasecmp(opts->config[CONF_PCAP_ADAPTIVE_POLL], "Y", 1) == 0)
+        adaptive = 1;
 
     /* Set promiscuous mode if ENABLE_PCAP_PROMISC is set to 'Y'.
     */
@@ -110,107 +1287,70 @@ pcap_capture(fko_srv_options_t *opts)
             && opts->config[CONF_PCAP_FILE][0] != '\0')
         pcap_file_mode = 1;
 
-    if(pcap_file_mode == 1) {
-        log_msg(LOG_INFO, "Reading pcap file: %s",
-            opts->config[CONF_PCAP_FILE]);
-
-        pcap = pcap_open_offline(opts->config[CONF_PCAP_FILE], errstr);
-
-        if(pcap == NULL)
-        {
-            log_msg(LOG_ERR, "[*] pcap_open_offline() error: %s",
-                    errstr);
-            clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
-        }
+    /* PCAP_INTF may list several interfaces, each captured by its own
+     * thread (a pcap file is always read by just one).
+    */
+    if(pcap_file_mode == 1)
+    {
+        intfs[0]  = opts->config[CONF_PCAP_FILE];
+        num_intfs = 1;
     }
-    else
+    else if((num_intfs = capture_intf_list(opts->config[CONF_PCAP_INTF],
+            intf_buf, sizeof(intf_buf), intfs)) < 0)
     {
-        log_msg(LOG_INFO, "Sniffing interface: %s",
-            opts->config[CONF_PCAP_INTF]);
-
-        pcap = pcap_open_live(opts->config[CONF_PCAP_INTF],
-            max_sniff_bytes, promisc, 100, errstr
-        );
-
-        if(pcap == NULL)
-        {
-            log_msg(LOG_ERR, "[*] pcap_open_live() error: %s", errstr);
-            clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
-        }
+        log_msg(LOG_ERR, "[*] invalid PCAP_INTF '%s' (at most %i interfaces)",
+            opts->config[CONF_PCAP_INTF], MAX_CAPTURE_INTFS);
+        clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
     }
 
-    /* Set pcap filters, if any.
+    /* SPA over TCP and HTTP is read directly off of accepted connections
+     * by the TCP and HTTP servers, which are driven from the capture loop
+     * below.
     */
-    if (opts->config[CONF_PCAP_FILTER][0] != '\0')
+    if(strncasecmp(opts->config[CONF_ENABLE_TCP_SERVER], "Y", 1) == 0
+            || strncasecmp(opts->config[CONF_ENABLE_HTTP_SERVER], "Y", 1) == 0)
     {
-        if(pcap_compile(pcap, &fp, opts->config[CONF_PCAP_FILTER], 1, 0) == -1)
+        if((tcp_loop = event_loop_new()) == NULL)
         {
-            log_msg(LOG_ERR, "[*] Error compiling pcap filter: %s",
-                pcap_geterr(pcap)
-            );
+            log_msg(LOG_ERR, "Fatal event_loop_new() error");
             clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
         }
 
-        if(pcap_setfilter(pcap, &fp) == -1)
+        if(strncasecmp(opts->config[CONF_ENABLE_TCP_SERVER], "Y", 1) == 0
+                && start_tcp_server(opts, tcp_loop) != 0)
         {
-            log_msg(LOG_ERR, "[*] Error setting pcap filter: %s",
-                pcap_geterr(pcap)
-            );
+            log_msg(LOG_ERR, "Fatal start_tcp_server() error");
             clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
         }
 
-        log_msg(LOG_INFO, "PCAP filter is: '%s'", opts->config[CONF_PCAP_FILTER]);
-
-        pcap_freecode(&fp);
-    }
-
-    /* Determine and set the data link encapsulation offset.
-    */
-    switch(pcap_datalink(pcap)) {
-        case DLT_EN10MB:
-            opts->data_link_offset = 14;
-            break;
-#if defined(__linux__)
-        case DLT_LINUX_SLL:
-            opts->data_link_offset = 16;
-            break;
-#elif defined(__OpenBSD__)
-        case DLT_LOOP:
-            set_direction = 0;
-            opts->data_link_offset = 4;
-            break;
-#endif
-        case DLT_NULL:
-            set_direction = 0;
-            opts->data_link_offset = 4;
-            break;
-        default:
-            opts->data_link_offset = 0;
-            break;
+        if(strncasecmp(opts->config[CONF_ENABLE_HTTP_SERVER], "Y", 1) == 0
+                && start_http_server(opts, tcp_loop) != 0)
+        {
+            log_msg(LOG_ERR, "Fatal start_http_server() error");
+            clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+        }
     }
 
-    /* We are only interested on seeing packets coming into the interface.
-    */
-    if ((opts->pcap_any_direction == 0)
-            && (set_direction == 1) && (pcap_file_mode == 0)
-            && (pcap_setdirection(pcap, PCAP_D_IN) < 0))
-        if(opts->verbose)
-            log_msg(LOG_WARNING, "[*] Warning: pcap error on setdirection: %s.",
-                pcap_geterr(pcap));
-
-    /* Set our pcap handle nonblocking mode.
-     *
-     * NOTE: This is simply set to 0 for now until we find a need
-     *       to actually use this mode (which when set on a FreeBSD
-     *       system, it silently breaks the packet capture).
+    /* Use the TPACKET_V3 ring if requested and we are not reading packet
+     * data from a file.
     */
-    if((pcap_file_mode == 0)
-            && (pcap_setnonblock(pcap, DEF_PCAP_NONBLOCK, errstr)) == -1)
+    if(pcap_file_mode == 0
+            && strncasecmp(opts->config[CONF_ENABLE_PCAP_TPACKET_V3], "Y", 1) == 0)
     {
-        log_msg(LOG_ERR, "[*] Error setting pcap nonblocking to %i: %s",
-            0, errstr
-        );
-        clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+#if HAVE_TPACKET_V3
+        if(tpacket_v3_capture(opts, intfs, num_intfs, promisc,
+                max_sniff_bytes, useconds, rules_chk_threshold, tcp_loop) == 0)
+        {
+            capture_tcp_server_stop(opts, tcp_loop);
+            return(0);
+        }
+
+        log_msg(LOG_WARNING,
+            "[*] Could not set up TPACKET_V3 ring, falling back to libpcap");
+#else
+        log_msg(LOG_WARNING,
+            "[*] TPACKET_V3 capture is not supported on this system, using libpcap");
+#endif
     }
 
     pcap_dispatch_count = strtol_wrapper(opts->config[CONF_PCAP_DISPATCH_COUNT],
@@ -221,6 +1361,39 @@ pcap_capture(fko_srv_options_t *opts)
         clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
     }
 
+    if((lanes = calloc(num_intfs, sizeof(capture_lane_t))) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] calloc() failed for %i capture interfaces",
+            num_intfs);
+        clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    for(i=0; i < num_intfs; i++)
+    {
+        lanes[i].opts            = opts;
+        lanes[i].intf            = intfs[i];
+        lanes[i].max_sniff_bytes = max_sniff_bytes;
+        lanes[i].dispatch_count  = pcap_dispatch_count;
+        lanes[i].useconds        = useconds;
+        lanes[i].adaptive        = adaptive;
+
+        pcap_lane_open(opts, &(lanes[i]), promisc, pcap_file_mode);
+        capture_sched_init(&(lanes[i]), pcap_file_mode);
+    }
+
+    if(tcp_loop != NULL && lanes[0].sel_fd >= 0
+            && event_loop_add_fd(tcp_loop, lanes[0].sel_fd,
+                capture_sched_wakeup, NULL) != 0)
+    {
+        log_msg(LOG_WARNING,
+            "[*] Could not add the capture descriptor to the TCP server event loop, sleeping PCAP_LOOP_SLEEP between dispatches");
+        lanes[0].sel_fd = -1;
+    }
+
+    /* process_packet() (as used by --benchmark) goes by the first one.
+    */
+    opts->data_link_offset = lanes[0].data_link_offset;
+
     /* Initialize our signal handlers. You can check the return value for
      * the number of signals that were *not* set.  Those that were not set
      * will be listed in the log/stderr output.
@@ -230,47 +1403,46 @@ pcap_capture(fko_srv_options_t *opts)
 
     log_msg(LOG_INFO, "Starting fwknopd main event loop.");
 
+    capture_lanes_stop   = 0;
+    capture_lanes_failed = 0;
+
+    for(started=1; started < num_intfs; started++)
+    {
+        if(pthread_create(&(lanes[started].thread), NULL,
+                pcap_lane_thread, &(lanes[started])) != 0)
+        {
+            log_msg(LOG_ERR, "[*] Failed to start the capture thread for %s",
+                lanes[started].intf);
+            capture_lanes_failed = 1;
+            break;
+        }
+    }
+
     /* Jump into our home-grown packet cature loop.
     */
     while(1)
     {
-        /* If we got a SIGCHLD and it was the tcp server, then handle it here.
-        */
-        if(got_sigchld)
+        if(sig_do_stop(opts) || capture_lanes_failed
+                || (capture_lanes_stop && pending_break == 0))
         {
-            if(opts->tcp_server_pid > 0)
-            {
-                child_pid = waitpid(0, &status, WNOHANG);
-
-                if(child_pid == opts->tcp_server_pid)
-                {
-                    if(WIFSIGNALED(status))
-                        log_msg(LOG_WARNING, "TCP server got signal: %i",  WTERMSIG(status));
-
-                    log_msg(LOG_WARNING,
-                        "TCP server exited with status of %i. Attempting restart.",
-                        WEXITSTATUS(status)
-                    );
-
-                    opts->tcp_server_pid = 0;
-
-                    /* Attempt to restart tcp server ? */
-                    usleep(1000000);
-                    run_tcp_server(opts);
-                }
-            }
-
-            got_sigchld = 0;
+            pcap_breakloop(lanes[0].pcap);
+            pending_break = 1;
         }
 
-        if(sig_do_stop(opts))
+        /* The access data changed and the filter depends on it.
+        */
+        if(opts->pcap_filter_refresh)
         {
-            pcap_breakloop(pcap);
-            pending_break = 1;
+            opts->pcap_filter_refresh = 0;
+            capture_filter_gen++;
+            if(pcap_set_capture_filter(opts, lanes[0].pcap) != 0)
+                log_msg(LOG_ERR, "[*] Could not refresh the capture filter, keeping the old one");
         }
 
-        res = pcap_dispatch(pcap, pcap_dispatch_count,
-            (pcap_handler)&process_packet, (unsigned char *)opts);
+        res = pcap_dispatch(lanes[0].pcap, capture_sched_batch(&(lanes[0])),
+            capture_lane_packet, (unsigned char *)&(lanes[0]));
+
+        capture_sched_update(&(lanes[0]), res);
 
         /* Count processed packets
         */
@@ -283,15 +1455,9 @@ pcap_capture(fko_srv_options_t *opts)
              * value) - we use this as a comparison for --packet-limit regardless
              * of SPA packet validity at this point.
             */
-            opts->packet_ctr += res;
-            if (opts->packet_ctr_limit && opts->packet_ctr >= opts->packet_ctr_limit)
+            if(capture_count_packets(opts, res))
             {
-                log_msg(LOG_WARNING,
-                    "* Incoming packet count limit of %i reached",
-                    opts->packet_ctr_limit
-                );
-
-                pcap_breakloop(pcap);
+                pcap_breakloop(lanes[0].pcap);
                 pending_break = 1;
             }
         }
@@ -300,27 +1466,29 @@ pcap_capture(fko_srv_options_t *opts)
         */
         else if(res == -1)
         {
-            if((strncasecmp(opts->config[CONF_EXIT_AT_INTF_DOWN], "Y", 1) == 0)
+            if(opts->rt->exit_at_intf_down
                     && errno == ENETDOWN)
             {
                 log_msg(LOG_ERR, "[*] Fatal error from pcap_dispatch: %s",
-                    pcap_geterr(pcap)
+                    pcap_geterr(lanes[0].pcap)
                 );
-                clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+                capture_lanes_failed = 1;
+                break;
             }
             else
             {
                 log_msg(LOG_ERR, "[*] Error from pcap_dispatch: %s",
-                    pcap_geterr(pcap)
+                    pcap_geterr(lanes[0].pcap)
                 );
             }
 
-            if(pcap_errcnt++ > MAX_PCAP_ERRORS_BEFORE_BAIL)
+            if(lanes[0].errcnt++ > MAX_PCAP_ERRORS_BEFORE_BAIL)
             {
                 log_msg(LOG_ERR, "[*] %i consecutive pcap errors.  Giving up",
-                    pcap_errcnt
+                    lanes[0].errcnt
                 );
-                clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+                capture_lanes_failed = 1;
+                break;
             }
         }
         else if(pending_break == 1 || res == -2)
@@ -330,53 +1498,132 @@ pcap_capture(fko_srv_options_t *opts)
             break;
         }
         else
-            pcap_errcnt = 0;
+            lanes[0].errcnt = 0;
+
+        if(capture_sched_timers_due(&(lanes[0])))
+            capture_loop_timers(opts, rules_chk_threshold);
+
+        capture_sched_wait(&(lanes[0]), tcp_loop);
+    }
+
+    capture_lanes_stop = 1;
+
+    for(i=1; i < started; i++)
+        pthread_join(lanes[i].thread, NULL);
+
+    if(tcp_loop != NULL && lanes[0].sel_fd >= 0)
+        event_loop_del_fd(tcp_loop, lanes[0].sel_fd);
+
+    for(i=0; i < num_intfs; i++)
+        pcap_close(lanes[i].pcap);
+    free(lanes);
+
+    if(capture_lanes_failed)
+        clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+
+    capture_tcp_server_stop(opts, tcp_loop);
+
+    return(0);
+}
+
+/* A packet read in from the pcap file for --benchmark mode.
+*/
+typedef struct bench_pkt
+{
+    struct pcap_pkthdr  hdr;
+    unsigned char      *data;
+} bench_pkt_t;
 
-        if(!opts->test)
+/* Replay the --pcap-file --benchmark-loops times as fast as possible and
+ * print the throughput and per-stage SPA processing latencies.  The
+ * packets that pass the capture filter are read into memory first so
+ * that file I/O is not part of the measurement.
+*/
+int
+pcap_benchmark(fko_srv_options_t *opts)
+{
+    pcap_t              *pcap;
+    char                errstr[PCAP_ERRBUF_SIZE] = {0};
+    struct pcap_pkthdr  *hdr;
+    const unsigned char *data;
+    bench_pkt_t         *pkts = NULL, *tmp_pkts;
+    int                 npkts = 0, pkts_size = 0;
+    int                 i, loop, res;
+    int                 rv = -1;
+    unsigned long       processed = 0;
+    struct timespec     ts;
+
+    if((pcap = pcap_open_offline(opts->config[CONF_PCAP_FILE], errstr)) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] pcap_open_offline() error: %s", errstr);
+        return(-1);
+    }
+
+    if(pcap_set_capture_filter(opts, pcap) != 0)
+    {
+        pcap_close(pcap);
+        return(-1);
+    }
+
+    pcap_set_data_link_offset(pcap, &(opts->data_link_offset));
+
+    while((res = pcap_next_ex(pcap, &hdr, &data)) == 1)
+    {
+        if(npkts >= pkts_size)
         {
-            if(opts->enable_fw)
+            pkts_size = pkts_size ? pkts_size * 2 : 1024;
+            if((tmp_pkts = realloc(pkts, pkts_size * sizeof(bench_pkt_t))) == NULL)
             {
-                /* Check for any expired firewall rules and deal with them.
-                */
-                if(rules_chk_threshold > 0)
-                {
-                    opts->check_rules_ctr++;
-                    if ((opts->check_rules_ctr % rules_chk_threshold) == 0)
-                    {
-                        chk_rm_all = 1;
-                        opts->check_rules_ctr = 0;
-                    }
-                }
-                check_firewall_rules(opts, chk_rm_all);
-                chk_rm_all = 0;
+                log_msg(LOG_ERR, "[*] realloc() failed reading the pcap file");
+                goto cleanup;
             }
-
-            /* See if any CMD_CYCLE_CLOSE commands need to be executed.
-            */
-            cmd_cycle_close(opts);
+            pkts = tmp_pkts;
         }
 
-#if FIREWALL_IPFW
-        /* Purge expired rules that no longer have any corresponding
-         * dynamic rules.
-        */
-        if(opts->fw_config->total_rules > 0)
+        pkts[npkts].hdr = *hdr;
+        if((pkts[npkts].data = malloc(hdr->caplen)) == NULL)
         {
-            time(&now);
-            if(opts->fw_config->last_purge < (now - opts->fw_config->purge_interval))
-            {
-                ipfw_purge_expired_rules(opts);
-                opts->fw_config->last_purge = now;
-            }
+            log_msg(LOG_ERR, "[*] malloc() failed reading the pcap file");
+            goto cleanup;
         }
-#endif
+        memcpy(pkts[npkts].data, data, hdr->caplen);
+        npkts++;
+    }
+
+    if(res == -1)
+    {
+        log_msg(LOG_ERR, "[*] Error reading pcap file: %s", pcap_geterr(pcap));
+        goto cleanup;
+    }
+
+    log_msg(LOG_INFO, "Benchmark: replaying %d packets from %s %d time(s).",
+        npkts, opts->config[CONF_PCAP_FILE], opts->benchmark_loops);
 
-        usleep(useconds);
+    bench_enable();
+    bench_run_start();
+
+    for(loop=0; loop < opts->benchmark_loops; loop++)
+    {
+        for(i=0; i < npkts; i++)
+        {
+            bench_stage_start(&ts);
+            process_packet((unsigned char *)opts, &(pkts[i].hdr), pkts[i].data);
+            bench_packet_end(&ts);
+            processed++;
+        }
     }
 
+    bench_run_end(processed);
+    bench_report(opts->config[CONF_PCAP_FILE], opts->benchmark_loops);
+    rv = 0;
+
+cleanup:
+    for(i=0; i < npkts; i++)
+        free(pkts[i].data);
+    free(pkts);
     pcap_close(pcap);
 
-    return(0);
+    return(rv);
 }
 
 #endif /* USE_LIBPCAP */
@@ -47,8 +47,33 @@
     #define DEF_PCAP_NONBLOCK 1
 #endif
 
+/* Adaptive capture scheduling (PCAP_ADAPTIVE_POLL).  For this long after
+ * a dispatch that returned packets the capture loop keeps calling
+ * pcap_dispatch() without waiting, and after that it blocks in poll() on
+ * the capture descriptor.  Dispatch batches are twice the average number
+ * of packets per busy dispatch (the average is kept times
+ * PCAP_ADAPTIVE_RATE_SCALE), but never fewer than PCAP_ADAPTIVE_MIN_BATCH
+ * or more than PCAP_DISPATCH_COUNT.
+*/
+#define PCAP_ADAPTIVE_SPIN_USEC     200
+#define PCAP_ADAPTIVE_MIN_BATCH     8
+#define PCAP_ADAPTIVE_RATE_SCALE    8
+
+/* TPACKET_V3 ring geometry (Linux only).  Each block is handed to
+ * fwknopd when it fills up or when TPACKET_V3_BLOCK_TIMEOUT milliseconds
+ * have passed since the first frame was placed in it.
+*/
+#define TPACKET_V3_BLOCK_SIZE       (1 << 17)
+#define TPACKET_V3_FRAME_SIZE       2048
+#define TPACKET_V3_BLOCK_TIMEOUT    10
+
+/* Most interfaces PCAP_INTF may list.
+*/
+#define MAX_CAPTURE_INTFS           16
+
 /* Prototypes
 */
 int pcap_capture(fko_srv_options_t *opts);
+int pcap_benchmark(fko_srv_options_t *opts);
 
 #endif  /* PCAP_CAPTURE_H */
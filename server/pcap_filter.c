@@ -0,0 +1,370 @@
+/*
+ *****************************************************************************
+ *
+ * File:    pcap_filter.c
+ *
+ * Purpose: Builds the packet filter expression that fwknopd hands to
+ *          libpcap.  This is either the PCAP_FILTER from fwknopd.conf or a
+ *          filter generated from the effective config and access data, and
+ *          can include checks on the SPA payload itself so that the kernel
+ *          drops packets that could never be SPA data.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "pcap_filter.h"
+#include "acc_id_map.h"
+#include "rcu.h"
+#include "log_msg.h"
+#include "utils.h"
+#include <stdarg.h>
+
+#if HAVE_ARPA_INET_H
+  #include <arpa/inet.h>
+#endif
+
+/* Payload length and payload byte offset expressions for each protocol
+ * that process_packet() looks at.  BPF can't index into IPv6 transport
+ * headers, so the IPv6 entries use fixed offsets from the IPv6 header and
+ * only match packets without extension headers.
+*/
+typedef struct prefilter_proto
+{
+    const char *proto;
+    const char *len_expr;
+    const char *data_fmt;   /* takes the byte index as its only argument */
+    int         ip_proto;
+    int         hdr_len;    /* bytes before the payload in data_fmt */
+    int         ipv6;
+} prefilter_proto_t;
+
+static const prefilter_proto_t prefilter_protos[] = {
+    { "udp",
+      "(udp[4:2] - 8)",
+      "udp[%d]", IPPROTO_UDP, 8, 0 },
+    { "tcp",
+      "(ip[2:2] - ((ip[0]&0xf)<<2) - ((tcp[12]&0xf0)>>2))",
+      "tcp[((tcp[12]&0xf0)>>2)+%d]", IPPROTO_TCP, 0, 0 },
+    { "icmp",
+      "(ip[2:2] - ((ip[0]&0xf)<<2) - 8)",
+      "icmp[%d]", IPPROTO_ICMP, 8, 0 },
+    { "ip6 and ip6[6] = 17",
+      "(ip6[4:2] - 8)",
+      "ip6[40+%d]", IPPROTO_UDP, 8, 1 },
+    { "ip6 and ip6[6] = 6",
+      "(ip6[4:2] - ((ip6[52]&0xf0)>>2))",
+      "ip6[40+((ip6[52]&0xf0)>>2)+%d]", IPPROTO_TCP, 0, 1 },
+    { "ip6 and ip6[6] = 58",
+      "(ip6[4:2] - 8)",
+      "ip6[40+%d]", IPPROTO_ICMP, 8, 1 }
+};
+
+static int
+expr_append(char *buf, const size_t buf_size, const char *fmt, ...)
+{
+    va_list     ap;
+    size_t      len = strlen(buf);
+    int         rv;
+
+    va_start(ap, fmt);
+    rv = vsnprintf(buf + len, buf_size - len, fmt, ap);
+    va_end(ap);
+
+    if(rv < 0 || (size_t)rv >= buf_size - len)
+        return(-1);
+
+    return(0);
+}
+
+/* Append a test that the payload byte at data_off is in the base64
+ * alphabet.
+*/
+static int
+append_b64_check(char *buf, const size_t buf_size,
+        const char *data_fmt, const int data_off)
+{
+    char    byte[64] = {0};
+
+    snprintf(byte, sizeof(byte), data_fmt, data_off);
+
+    return(expr_append(buf, buf_size,
+        " and ((%s >= 0x41 and %s <= 0x5a) or (%s >= 0x61 and %s <= 0x7a)"
+        " or (%s >= 0x30 and %s <= 0x39) or %s = 0x2b or %s = 0x2f)",
+        byte, byte, byte, byte, byte, byte, byte, byte));
+}
+
+/* Build the SPA payload prefilter: the payload length must be within the
+ * bounds that process_packet() accepts and, if want_b64 is set, the first
+ * few bytes must be base64.
+*/
+static int
+build_prefilter(const fko_srv_options_t *opts, char *buf, const size_t buf_size,
+        const int want_b64)
+{
+    const prefilter_proto_t *pp;
+    int                      i, j, check_b64;
+
+    for(i=0; i < (int)(sizeof(prefilter_protos)/sizeof(prefilter_protos[0])); i++)
+    {
+        pp = &(prefilter_protos[i]);
+
+        if(pp->ipv6 && ! opts->enable_ipv6)
+            continue;
+
+        if(expr_append(buf, buf_size, "%s(%s and %s >= %d and %s <= %d",
+                i > 0 ? " or " : "", pp->proto,
+                pp->len_expr, MIN_SPA_DATA_SIZE,
+                pp->len_expr, MAX_SPA_PACKET_LEN) != 0)
+            return(-1);
+
+        /* SPA over HTTP starts with "GET /", so there is nothing useful
+         * to check in the leading TCP payload bytes.
+        */
+        check_b64 = want_b64;
+        if(pp->ip_proto == IPPROTO_TCP
+                && strncasecmp(opts->config[CONF_ENABLE_SPA_OVER_HTTP], "Y", 1) == 0)
+            check_b64 = 0;
+
+        for(j=0; check_b64 && j < PCAP_PREFILTER_B64_BYTES; j++)
+            if(append_b64_check(buf, buf_size, pp->data_fmt, pp->hdr_len + j) != 0)
+                return(-1);
+
+        if(expr_append(buf, buf_size, ")") != 0)
+            return(-1);
+    }
+
+    return(0);
+}
+
+/* State for collecting the access stanza destinations.
+*/
+typedef struct dest_filter
+{
+    char   *buf;
+    size_t  buf_size;
+    int     count;
+    int     any;        /* set if some stanza accepts any destination */
+} dest_filter_t;
+
+static void
+add_dest_list(dest_filter_t *df, acc_int_list_t *dlist)
+{
+    char            addr[MAX_IPV4_STR_LEN] = {0};
+    char            mask[MAX_IPV4_STR_LEN] = {0};
+    struct in_addr  in;
+    int             res;
+
+    /* No DESTINATION means any destination is fine.
+    */
+    if(dlist == NULL)
+        df->any = 1;
+
+    for(; dlist != NULL && ! df->any; dlist = dlist->next)
+    {
+        if(dlist->mask == 0 || df->count >= PCAP_AUTO_FILTER_MAX_DESTS)
+        {
+            df->any = 1;
+            break;
+        }
+
+        in.s_addr = htonl(dlist->maddr);
+        inet_ntop(AF_INET, &in, addr, sizeof(addr));
+
+        if(dlist->mask == 0xFFFFFFFF)
+            res = expr_append(df->buf, df->buf_size, "%sdst host %s",
+                    df->count > 0 ? " or " : "", addr);
+        else
+        {
+            in.s_addr = htonl(dlist->mask);
+            inet_ntop(AF_INET, &in, mask, sizeof(mask));
+            res = expr_append(df->buf, df->buf_size, "%sdst net %s mask %s",
+                    df->count > 0 ? " or " : "", addr, mask);
+        }
+
+        if(res != 0)
+            df->any = 1;
+        else
+            df->count++;
+    }
+
+    return;
+}
+
+static int
+traverse_dest_filter_cb(acc_stanza_t *acc, void *arg)
+{
+    add_dest_list((dest_filter_t *)arg, acc->cold->destination_list);
+    return(0);
+}
+
+/* Build a "dst host/net" expression covering every access stanza
+ * DESTINATION.  Leaves buf empty if any destination has to be accepted.
+*/
+static void
+build_dest_filter(fko_srv_options_t *opts, char *buf, const size_t buf_size)
+{
+    dest_filter_t   df;
+    acc_stanza_t   *acc;
+    acc_id_map_t   *map;
+
+    memset(&df, 0x0, sizeof(df));
+    df.buf      = buf;
+    df.buf_size = buf_size;
+
+    if(strncasecmp(opts->config[CONF_DISABLE_SDP_MODE], "N", 1) == 0)
+    {
+        rcu_read_lock();
+        if((map = rcu_dereference(opts->acc_stanza_hash_tbl)) != NULL)
+            acc_id_map_traverse(map, traverse_dest_filter_cb, &df);
+        rcu_read_unlock();
+    }
+    else
+    {
+        rcu_read_lock();
+        for(acc = rcu_dereference(opts->acc_stanzas); acc != NULL; acc = acc->next)
+            add_dest_list(&df, acc->cold->destination_list);
+        rcu_read_unlock();
+    }
+
+    /* With no destinations at all (no access data yet) there is nothing
+     * to restrict on either.
+    */
+    if(df.any || df.count == 0)
+        buf[0] = '\0';
+
+    return;
+}
+
+/* Generate the filter from the effective config: the SPA ports, the SPA
+ * payload size bounds and, optionally, the access stanza destinations.
+*/
+static int
+build_auto_filter(fko_srv_options_t *opts, char *buf, const size_t buf_size)
+{
+    char           *dests = NULL;
+    int             port, is_err;
+
+    port = strtol_wrapper(opts->config[CONF_UDPSERV_PORT],
+            1, MAX_PORT, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+        return(-1);
+
+    /* SPA over TCP is read by the TCP server itself, so only SPA over
+     * HTTP needs TCP packets from the capture.
+    */
+    if(expr_append(buf, buf_size, "(udp dst port %d%s) and (", port,
+            strncasecmp(opts->config[CONF_ENABLE_SPA_OVER_HTTP], "Y", 1) == 0
+                ? " or tcp dst port 80" : "") != 0)
+        return(-1);
+
+    if(build_prefilter(opts, buf, buf_size,
+            strncasecmp(opts->config[CONF_ENABLE_PCAP_PREFILTER], "Y", 1) == 0) != 0
+            || expr_append(buf, buf_size, ")") != 0)
+        return(-1);
+
+    if(strncasecmp(opts->config[CONF_PCAP_AUTO_FILTER_DESTINATIONS], "Y", 1) == 0)
+    {
+        if((dests = calloc(1, PCAP_PREFILTER_MAX_LEN)) == NULL)
+            return(-1);
+
+        build_dest_filter(opts, dests, PCAP_PREFILTER_MAX_LEN);
+
+        if(dests[0] != '\0'
+                && expr_append(buf, buf_size, " and (%s)", dests) != 0)
+        {
+            free(dests);
+            return(-1);
+        }
+        free(dests);
+    }
+
+    return(0);
+}
+
+/* Returns 1 if the capture filter is built from the access stanzas and
+ * has to be refreshed when they change.
+*/
+int
+pcap_filter_uses_access_data(const fko_srv_options_t *opts)
+{
+    return(strncasecmp(opts->config[CONF_ENABLE_PCAP_AUTO_FILTER], "Y", 1) == 0
+        && strncasecmp(opts->config[CONF_PCAP_AUTO_FILTER_DESTINATIONS], "Y", 1) == 0);
+}
+
+/* Return the filter expression to compile for the capture handle.  With
+ * ENABLE_PCAP_AUTO_FILTER this is generated from the config, otherwise it
+ * is the PCAP_FILTER, combined with the SPA payload prefilter when
+ * ENABLE_PCAP_PREFILTER is set.  The caller must free the returned
+ * string.  An empty string means no filter, and NULL is returned on error.
+*/
+char *
+pcap_filter_expr(fko_srv_options_t *opts)
+{
+    const char *conf_filter = opts->config[CONF_PCAP_FILTER];
+    char       *prefilter   = NULL;
+    char       *expr        = NULL;
+    size_t      expr_len;
+
+    if(strncasecmp(opts->config[CONF_ENABLE_PCAP_AUTO_FILTER], "Y", 1) == 0)
+    {
+        if((expr = calloc(1, PCAP_AUTO_FILTER_MAX_LEN)) == NULL)
+            return(NULL);
+
+        if(build_auto_filter(opts, expr, PCAP_AUTO_FILTER_MAX_LEN) != 0)
+        {
+            log_msg(LOG_ERR, "[*] Could not generate the pcap filter");
+            free(expr);
+            return(NULL);
+        }
+        return(expr);
+    }
+
+    if(strncasecmp(opts->config[CONF_ENABLE_PCAP_PREFILTER], "Y", 1) != 0)
+        return(strdup(conf_filter));
+
+    if((prefilter = calloc(1, PCAP_PREFILTER_MAX_LEN)) == NULL)
+        return(NULL);
+
+    if(build_prefilter(opts, prefilter, PCAP_PREFILTER_MAX_LEN, 1) != 0)
+    {
+        log_msg(LOG_ERR, "[*] SPA prefilter expression is too long");
+        free(prefilter);
+        return(NULL);
+    }
+
+    expr_len = strlen(conf_filter) + strlen(prefilter) + 16;
+
+    if((expr = calloc(1, expr_len)) != NULL)
+    {
+        if(conf_filter[0] != '\0')
+            snprintf(expr, expr_len, "(%s) and (%s)", conf_filter, prefilter);
+        else
+            strlcpy(expr, prefilter, expr_len);
+    }
+
+    free(prefilter);
+    return(expr);
+}
+
+/***EOF***/
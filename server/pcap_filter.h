@@ -0,0 +1,56 @@
+/*
+ *****************************************************************************
+ *
+ * File:    pcap_filter.h
+ *
+ * Purpose: Header file for pcap_filter.c.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef PCAP_FILTER_H
+#define PCAP_FILTER_H
+
+/* Number of leading payload bytes the SPA prefilter checks against the
+ * base64 alphabet.  BPF has no loops, so each byte adds its own test.
+*/
+#define PCAP_PREFILTER_B64_BYTES    4
+
+/* Room for the generated parts of the filter expression.
+*/
+#define PCAP_PREFILTER_MAX_LEN      4096
+#define PCAP_AUTO_FILTER_MAX_LEN    (2 * PCAP_PREFILTER_MAX_LEN + 256)
+
+/* Beyond this many access stanza destinations the generated filter does
+ * not restrict on destination address at all.
+*/
+#define PCAP_AUTO_FILTER_MAX_DESTS  64
+
+/* Function prototypes
+*/
+char *pcap_filter_expr(fko_srv_options_t *opts);
+int pcap_filter_uses_access_data(const fko_srv_options_t *opts);
+
+#endif /* PCAP_FILTER_H */
+
+/***EOF***/
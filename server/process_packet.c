@@ -42,15 +42,19 @@
 #include "incoming_spa.h"
 #include "utils.h"
 #include "log_msg.h"
+#include "fwknop_probes.h"
 
-#if USE_LIBPCAP
-
-void
-process_packet(unsigned char *args, const struct pcap_pkthdr *packet_header,
-    const unsigned char *packet)
+/* Find the SPA payload in an IPv4 or IPv6 packet that starts at ip_p and
+ * ends (at the latest) at fr_end, and fill in everything in spa_pkt except
+ * the arrival time.  Returns 1 if the packet carries SPA sized data, 0 if
+ * it should be ignored.
+*/
+int
+process_ip_packet(const fko_srv_options_t *opts, unsigned char *ip_p,
+    const unsigned char *fr_end, spa_pkt_info_t *spa_pkt)
 {
-    struct ether_header *eth_p;
     struct iphdr        *iph_p;
+    struct ip6hdr       *ip6h_p;
     struct tcphdr       *tcph_p;
     struct udphdr       *udph_p;
     struct icmphdr      *icmph_p;
@@ -58,150 +62,176 @@ process_packet(unsigned char *args, const struct pcap_pkthdr *packet_header,
     unsigned char       *pkt_data;
     unsigned short      pkt_data_len;
     unsigned char       *pkt_end;
-    unsigned char       *fr_end;
+
+    unsigned char       *l4_p;
 
     unsigned int        ip_hdr_words;
+    unsigned char       ip_ver;
 
     unsigned char       proto;
     unsigned int        src_ip;
     unsigned int        dst_ip;
+    spa_addr_t          src_addr;
+    spa_addr_t          dst_addr;
 
     unsigned short      src_port = 0;
     unsigned short      dst_port = 0;
 
-    unsigned short      eth_type;
+    /* Gotta have at least the IP version nibble.
+    */
+    if (ip_p >= fr_end)
+        return 0;
 
-    fko_srv_options_t   *opts = (fko_srv_options_t *)args;
+    ip_ver = *ip_p >> 4;
 
-    int                 offset = opts->data_link_offset;
+    if (ip_ver == 6)
+    {
+        if (! opts->enable_ipv6)
+            return 0;
 
-    unsigned short      pkt_len = packet_header->len;
+        /* Pull the IPv6 header.
+        */
+        ip6h_p = (struct ip6hdr*)ip_p;
 
-    /* This is a hack to determine if we are using the linux cooked
-     * interface.  We base it on the offset being 16 which is the
-     * value it would be if the datalink is DLT_LINUX_SLL.  I don't
-     * know if this is the correct way to do this, but it seems to work.
-    */
-    unsigned char       assume_cooked = (offset == 16 ? 1 : 0);
+        if ((unsigned char*)(ip6h_p + 1) > fr_end)
+            return 0;
 
-    /* Determine packet end.
-    */
-    fr_end = (unsigned char *) packet + packet_header->caplen;
+        /* As with IPv4, use the length from the IP header so that any
+         * trailing frame bytes are ignored.
+        */
+        pkt_end = ((unsigned char*)(ip6h_p + 1))+ntohs(ip6h_p->payload_len);
+        if(pkt_end > fr_end)
+            return 0;
 
-    /* The ethernet header.
-    */
-    eth_p = (struct ether_header*) packet;
+        spa_addr_set_ipv6(&src_addr, ip6h_p->saddr);
+        spa_addr_set_ipv6(&dst_addr, ip6h_p->daddr);
+        src_ip = dst_ip = 0;
 
-    /* Gotta have a complete ethernet header.
-    */
-    if (packet_header->caplen < ETHER_HDR_LEN)
-        return;
+        /* Walk past any options and routing extension headers.  Fragments
+         * are not reassembled, so anything else that is not a transport
+         * header we know about is dropped below.
+        */
+        proto = ip6h_p->nexthdr;
+        l4_p  = (unsigned char*)(ip6h_p + 1);
 
-    eth_type = ntohs(*((unsigned short*)&eth_p->ether_type));
+        while (proto == IPPROTO_HOPOPTS || proto == IPPROTO_ROUTING
+                || proto == IPPROTO_DSTOPTS)
+        {
+            if (l4_p + 8 > pkt_end)
+                return 0;
 
-    if(eth_type == 0x8100) /* 802.1q encapsulated */
-    {
-        offset += 4;
-        eth_type = ntohs(*(((unsigned short*)&eth_p->ether_type)+2));
-    }
+            proto = l4_p[0];
+            l4_p += (l4_p[1] + 1) << 3;
+        }
 
-    /* When using libpcap, pkthdr->len for 802.3 frames include CRC_LEN,
-     * but Ethenet_II frames do not.
-    */
-    if (eth_type > 1500 || assume_cooked == 1)
+        if (proto == IPPROTO_ICMPV6)
+            proto = IPPROTO_ICMP;
+    }
+    else if (ip_ver == 4)
     {
-        pkt_len += ETHER_CRC_LEN;
+        /* Pull the IP header.
+        */
+        iph_p = (struct iphdr*)ip_p;
 
-        if(eth_type == 0xAAAA)      /* 802.2 SNAP */
-            offset += 5;
-    }
-    else /* 802.3 Frame */
-        offset += 3;
+        /* If IP header is past calculated packet end, bail.
+        */
+        if ((unsigned char*)(iph_p + 1) > fr_end)
+            return 0;
 
-    /* Make sure the packet length is still valid.
-    */
-    if (! ETHER_IS_VALID_LEN(pkt_len) )
-        return;
+        /* ip_hdr_words is the number of 32 bit words in the IP header. After
+         * masking of the IPV4 version bits, the number *must* be at least
+         * 5, even without options.
+        */
+        ip_hdr_words = iph_p->ihl & IPV4_VER_MASK;
 
-    /* Pull the IP header.
-    */
-    iph_p = (struct iphdr*)(packet + offset);
+        if (ip_hdr_words < MIN_IPV4_WORDS)
+            return 0;
 
-    /* If IP header is past calculated packet end, bail.
-    */
-    if ((unsigned char*)(iph_p + 1) > fr_end)
-        return;
+        /* Make sure to calculate the packet end based on the length in the
+         * IP header. This allows additional bytes that may be added to the
+         * frame (such as a 4-byte Ethernet Frame Check Sequence) to not
+         * interfere with SPA operations.
+        */
+        pkt_end = ((unsigned char*)iph_p)+ntohs(iph_p->tot_len);
+        if(pkt_end > fr_end)
+            return 0;
 
-    /* ip_hdr_words is the number of 32 bit words in the IP header. After
-     * masking of the IPV4 version bits, the number *must* be at least
-     * 5, even without options.
-    */
-    ip_hdr_words = iph_p->ihl & IPV4_VER_MASK;
+        src_ip = iph_p->saddr;
+        dst_ip = iph_p->daddr;
 
-    if (ip_hdr_words < MIN_IPV4_WORDS)
-        return;
+        spa_addr_set_ipv4(&src_addr, src_ip);
+        spa_addr_set_ipv4(&dst_addr, dst_ip);
 
-    /* Make sure to calculate the packet end based on the length in the
-     * IP header. This allows additional bytes that may be added to the
-     * frame (such as a 4-byte Ethernet Frame Check Sequence) to not
-     * interfere with SPA operations.
-    */
-    pkt_end = ((unsigned char*)iph_p)+ntohs(iph_p->tot_len);
-    if(pkt_end > fr_end)
-        return;
+        proto = iph_p->protocol;
+        l4_p  = (unsigned char*)iph_p + (ip_hdr_words << 2);
+    }
+    else
+    {
+        return 0;
+    }
 
     /* Now, find the packet data payload (depending on IPPROTO).
     */
-    src_ip = iph_p->saddr;
-    dst_ip = iph_p->daddr;
-
-    proto = iph_p->protocol;
-
     if (proto == IPPROTO_TCP)
     {
         /* Process TCP packet
         */
-        tcph_p = (struct tcphdr*)((unsigned char*)iph_p + (ip_hdr_words << 2));
+        tcph_p = (struct tcphdr*)l4_p;
+
+        if ((unsigned char*)(tcph_p + 1) > pkt_end)
+            return 0;
 
         src_port = ntohs(tcph_p->source);
         dst_port = ntohs(tcph_p->dest);
 
-        pkt_data = ((unsigned char*)(tcph_p+1))+((tcph_p->doff)<<2)-sizeof(struct tcphdr);
+        /* The TCP server reads these off of the connection itself, so
+         * don't process the same SPA packet a second time.
+        */
+        if(opts->tcp_server_port != 0 && dst_port == opts->tcp_server_port)
+            return 0;
 
-        pkt_data_len = (pkt_end-(unsigned char*)iph_p)-(pkt_data-(unsigned char*)iph_p);
+        if(opts->http_server_port != 0 && dst_port == opts->http_server_port)
+            return 0;
+
+        pkt_data = ((unsigned char*)(tcph_p+1))+((tcph_p->doff)<<2)-sizeof(struct tcphdr);
     }
     else if (proto == IPPROTO_UDP)
     {
         /* Process UDP packet
         */
-        udph_p = (struct udphdr*)((unsigned char*)iph_p + (ip_hdr_words << 2));
+        udph_p = (struct udphdr*)l4_p;
+
+        if ((unsigned char*)(udph_p + 1) > pkt_end)
+            return 0;
 
         src_port = ntohs(udph_p->source);
         dst_port = ntohs(udph_p->dest);
 
         pkt_data = ((unsigned char*)(udph_p + 1));
-        pkt_data_len = (pkt_end-(unsigned char*)iph_p)-(pkt_data-(unsigned char*)iph_p);
     }
     else if (proto == IPPROTO_ICMP)
     {
-        /* Process ICMP packet
+        /* Process ICMP (or ICMPv6 - same header layout) packet
         */
-        icmph_p = (struct icmphdr*)((unsigned char*)iph_p + (ip_hdr_words << 2));
+        icmph_p = (struct icmphdr*)l4_p;
 
         pkt_data = ((unsigned char*)(icmph_p + 1));
-        pkt_data_len = (pkt_end-(unsigned char*)iph_p)-(pkt_data-(unsigned char*)iph_p);
     }
-
     else
     {
-        return;
+        return 0;
     }
 
+    if (pkt_data > pkt_end)
+        return 0;
+
+    pkt_data_len = pkt_end - pkt_data;
+
     /*
      * Now we have data. For now, we are not checking IP or port values. We
-     * are relying on the pcap filter. This may change so we do retain the IP
-     * addresses and ports just in case. We just go ahead and queue the
-     * data.
+     * are relying on the pcap filter (or the NFLOG rule). This may change
+     * so we do retain the IP addresses and ports just in case. We just go
+     * ahead and queue the data.
     */
 
     /* Expect the data to be at least the minimum required size.  This check
@@ -209,26 +239,126 @@ process_packet(unsigned char *args, const struct pcap_pkthdr *packet_header,
      * permissive pcap filter
     */
     if(pkt_data_len < MIN_SPA_DATA_SIZE)
-        return;
+        return 0;
 
     /* Expect the data to not be too large
     */
     if(pkt_data_len > MAX_SPA_PACKET_LEN)
+        return 0;
+
+    /* The payload is handed to SPA processing straight out of the capture
+     * buffer.
+    */
+    spa_pkt->packet_data     = pkt_data;
+    spa_pkt->packet_data_len = pkt_data_len;
+    spa_pkt->packet_proto    = proto;
+    spa_pkt->packet_src_ip   = src_ip;
+    spa_pkt->packet_dst_ip   = dst_ip;
+    spa_pkt->packet_src_addr = src_addr;
+    spa_pkt->packet_dst_addr = dst_addr;
+    spa_pkt->packet_src_port = src_port;
+    spa_pkt->packet_dst_port = dst_port;
+    spa_pkt->sdp_id = 0;
+
+    return 1;
+}
+
+#if USE_LIBPCAP
+
+/* Process one captured frame with the given data link offset, using
+ * spa_pkt for the SPA packet data, so that several capture threads (on
+ * different interfaces) can each have their own.
+*/
+void
+process_packet_lane(fko_srv_options_t *opts, const int data_link_offset,
+    const struct pcap_pkthdr *packet_header, const unsigned char *packet,
+    spa_pkt_info_t *spa_pkt)
+{
+    struct ether_header *eth_p;
+    unsigned char       *fr_end;
+    unsigned short      eth_type;
+
+    int                 offset = data_link_offset;
+
+    unsigned short      pkt_len = packet_header->len;
+
+    /* This is a hack to determine if we are using the linux cooked
+     * interface.  We base it on the offset being 16 which is the
+     * value it would be if the datalink is DLT_LINUX_SLL.  I don't
+     * know if this is the correct way to do this, but it seems to work.
+    */
+    unsigned char       assume_cooked = (offset == 16 ? 1 : 0);
+
+    /* Determine packet end.
+    */
+    fr_end = (unsigned char *) packet + packet_header->caplen;
+
+    /* The ethernet header.
+    */
+    eth_p = (struct ether_header*) packet;
+
+    /* Gotta have a complete ethernet header.
+    */
+    if (packet_header->caplen < ETHER_HDR_LEN)
         return;
 
-    /* Copy the packet for SPA processing
+    eth_type = ntohs(*((unsigned short*)&eth_p->ether_type));
+
+    if(eth_type == 0x8100) /* 802.1q encapsulated */
+    {
+        offset += 4;
+        eth_type = ntohs(*(((unsigned short*)&eth_p->ether_type)+2));
+    }
+
+    /* When using libpcap, pkthdr->len for 802.3 frames include CRC_LEN,
+     * but Ethenet_II frames do not.
+    */
+    if (eth_type > 1500 || assume_cooked == 1)
+    {
+        pkt_len += ETHER_CRC_LEN;
+
+        if(eth_type == 0xAAAA)      /* 802.2 SNAP */
+            offset += 5;
+    }
+    else /* 802.3 Frame */
+        offset += 3;
+
+    /* Make sure the packet length is still valid.
+    */
+    if (! ETHER_IS_VALID_LEN(pkt_len) )
+        return;
+
+    if(! process_ip_packet(opts, (unsigned char *)packet + offset, fr_end,
+            spa_pkt))
+        return;
+
+    /* Capture timestamp, so the packet age doesn't include time spent
+     * queued in the ring or capture buffer.  The timestamps in a pcap
+     * file are when it was recorded, so packets read from one are aged
+     * (and their replay cache entries dated) by the clock instead.
     */
-    strlcpy((char *)opts->spa_pkt.packet_data, (char *)pkt_data, pkt_data_len+1);
-    opts->spa_pkt.packet_data_len = pkt_data_len;
-    opts->spa_pkt.packet_proto    = proto;
-    opts->spa_pkt.packet_src_ip   = src_ip;
-    opts->spa_pkt.packet_dst_ip   = dst_ip;
-    opts->spa_pkt.packet_src_port = src_port;
-    opts->spa_pkt.packet_dst_port = dst_port;
-    opts->spa_pkt.sdp_id = 0;
+    if(packet_header->ts.tv_sec != 0
+            && (opts->config[CONF_PCAP_FILE] == NULL
+                || opts->config[CONF_PCAP_FILE][0] == '\0'))
+        spa_pkt->arrival_time = packet_header->ts.tv_sec;
+    else
+        spa_pkt->arrival_time = clock_cache_now();
+
+    FWKNOP_PROBE2(pkt_receive, spa_pkt, spa_pkt->packet_data_len);
 
-    incoming_spa(opts);
+    incoming_spa(opts, spa_pkt);
+
+    return;
+}
+
+void
+process_packet(unsigned char *args, const struct pcap_pkthdr *packet_header,
+    const unsigned char *packet)
+{
+    fko_srv_options_t   *opts = (fko_srv_options_t *)args;
 
+    process_packet_lane(opts, opts->data_link_offset, packet_header, packet,
+        &(opts->spa_pkt));
     return;
 }
 
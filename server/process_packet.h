@@ -45,9 +45,14 @@
 
 /* Prototypes
 */
+int process_ip_packet(const fko_srv_options_t *opts, unsigned char *ip_p,
+        const unsigned char *fr_end, spa_pkt_info_t *spa_pkt);
 #if USE_LIBPCAP
 void process_packet(unsigned char *args,
         const struct pcap_pkthdr *packet_header, const unsigned char *packet);
+void process_packet_lane(fko_srv_options_t *opts, const int data_link_offset,
+        const struct pcap_pkthdr *packet_header, const unsigned char *packet,
+        spa_pkt_info_t *spa_pkt);
 #endif
 
 #endif  /* PROCESS_PACKET_H */
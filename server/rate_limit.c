@@ -0,0 +1,276 @@
+/*
+ *****************************************************************************
+ *
+ * File:    rate_limit.c
+ *
+ * Purpose: Per-source token bucket rate limiting for incoming SPA packets.
+ *          Each source address hashes to one slot in a fixed-size table
+ *          and the bucket state for that slot is packed into a single
+ *          64-bit word that is updated with compare-and-swap, so the
+ *          receive threads never take a lock or allocate anything here.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "rate_limit.h"
+#include "log_msg.h"
+#include "utils.h"
+
+/* Bucket state layout:
+ *
+ *   bits 63-48: source tag (the top bit is always set so that an unused
+ *               slot, which is all zeros, never matches)
+ *   bits 47-32: tokens, in 1/RL_TOKEN_UNIT of a packet
+ *   bits 31-0:  time of the last refill in milliseconds (wraps)
+*/
+#define RL_TOKEN_UNIT           16
+#define RL_TAG(s)               ((uint16_t)((s) >> 48))
+#define RL_TOKENS(s)            ((uint32_t)(((s) >> 32) & 0xffff))
+#define RL_TIME(s)              ((uint32_t)((s) & 0xffffffff))
+#define RL_PACK(tag, tok, t)    (((uint64_t)(tag) << 48) \
+                                    | ((uint64_t)(tok) << 32) | (uint64_t)(t))
+
+#define FNV_OFFSET_BASIS        0xcbf29ce484222325ULL
+#define FNV_PRIME               0x100000001b3ULL
+
+static volatile uint64_t    rl_table[RATE_LIMIT_TABLE_LEN];
+static int                  rl_enabled = 0;
+static uint64_t             rl_rate;        /* packets per second */
+static uint32_t             rl_burst_units;
+static uint64_t             rl_seed;
+static volatile unsigned long   rl_dropped = 0;
+static unsigned long        rl_reported = 0;
+static time_t               rl_last_report = 0;
+
+static uint32_t
+rl_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((uint32_t)((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000));
+}
+
+/* FNV-1a over the address, starting from a per-run seed so that the
+ * slot a given source lands in cannot be predicted.
+*/
+static uint64_t
+rl_hash(const spa_addr_t *addr)
+{
+    uint64_t    h = rl_seed;
+    int         i, len;
+
+    len = (addr->family == AF_INET6) ? 16 : 4;
+
+    h ^= addr->family;
+    h *= FNV_PRIME;
+    for(i=0; i < len; i++)
+    {
+        h ^= addr->addr[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+/* Enable the rate limiter if SPA_RATE_LIMIT is set.  Returns 0 on
+ * success (including when rate limiting is disabled) and -1 on error.
+*/
+int
+rate_limit_start(fko_srv_options_t *opts)
+{
+    int     is_err, rate, burst;
+
+    rl_enabled = 0;
+
+    rate = strtol_wrapper(opts->config[CONF_SPA_RATE_LIMIT],
+            0, RCHK_MAX_SPA_RATE_LIMIT, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid SPA_RATE_LIMIT value.");
+        return -1;
+    }
+
+    burst = strtol_wrapper(opts->config[CONF_SPA_RATE_BURST],
+            1, RCHK_MAX_SPA_RATE_BURST, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid SPA_RATE_BURST value.");
+        return -1;
+    }
+
+    if(rate == 0)
+        return 0;
+
+    memset((void *)rl_table, 0x0, sizeof(rl_table));
+    rl_rate        = rate;
+    rl_burst_units = burst * RL_TOKEN_UNIT;
+    rl_seed        = FNV_OFFSET_BASIS ^ (uint64_t)time(NULL)
+                        ^ ((uint64_t)getpid() << 32);
+    rl_dropped     = 0;
+    rl_reported    = 0;
+    rl_last_report = time(NULL);
+    rl_enabled     = 1;
+
+    log_msg(LOG_INFO,
+        "Rate limiting SPA packets to %i per second per source (burst %i).",
+        rate, burst);
+
+    return 0;
+}
+
+/* Log the total number of packets dropped by the rate limiter and
+ * disable it.
+*/
+void
+rate_limit_stop(void)
+{
+    if(! rl_enabled)
+        return;
+
+    rl_enabled = 0;
+
+    if(rl_dropped > 0)
+        log_msg(LOG_WARNING,
+            "Rate limiter dropped %lu SPA packets.", rl_dropped);
+
+    return;
+}
+
+/* Charge one packet from addr against its bucket.  Returns 1 if the
+ * packet should be processed and 0 if it should be dropped.
+ *
+ * A source whose slot is held by a different source shares that bucket
+ * until it has refilled completely, at which point it takes the slot
+ * over.  This keeps a flooding source from resetting its own bucket by
+ * spoofing colliding addresses, at the cost of occasionally charging an
+ * unrelated client for a busy neighbour.
+*/
+int
+rate_limit_check(const spa_addr_t *addr)
+{
+    volatile uint64_t  *slot;
+    uint64_t            h, old_state, new_state, gained;
+    uint32_t            now, t, tokens;
+    uint16_t            tag;
+    int                 allowed;
+
+    if(! rl_enabled)
+        return 1;
+
+    h    = rl_hash(addr);
+    tag  = (uint16_t)(h >> 48) | 0x8000;
+    slot = &(rl_table[h & (RATE_LIMIT_TABLE_LEN - 1)]);
+    now  = rl_now_ms();
+
+    do
+    {
+        old_state = *slot;
+
+        if(old_state == 0)
+        {
+            tokens = rl_burst_units;
+            t      = now;
+        }
+        else
+        {
+            tokens = RL_TOKENS(old_state);
+            t      = RL_TIME(old_state);
+
+            /* Another thread may have stored a slightly later time than
+             * the one we read.
+            */
+            if((int32_t)(now - t) > 0)
+            {
+                gained = (uint64_t)(now - t) * rl_rate * RL_TOKEN_UNIT / 1000;
+                if(tokens + gained >= rl_burst_units)
+                {
+                    tokens = rl_burst_units;
+                    t      = now;
+                }
+                else if(gained > 0)
+                {
+                    /* Only move the clock forward by the time the new
+                     * tokens account for, so that fractions carry over.
+                    */
+                    tokens += (uint32_t)gained;
+                    t += (uint32_t)(gained * 1000 / (rl_rate * RL_TOKEN_UNIT));
+                }
+            }
+        }
+
+        if(tokens == rl_burst_units)
+            new_state = RL_PACK(tag, tokens, t);
+        else
+            new_state = RL_PACK(RL_TAG(old_state), tokens, t);
+
+        allowed = (tokens >= RL_TOKEN_UNIT);
+        if(allowed)
+            new_state -= ((uint64_t)RL_TOKEN_UNIT << 32);
+
+    } while(! __sync_bool_compare_and_swap(slot, old_state, new_state));
+
+    if(! allowed)
+        __sync_fetch_and_add(&rl_dropped, 1);
+
+    return allowed;
+}
+
+/* Total number of packets dropped since the rate limiter was started.
+*/
+unsigned long
+rate_limit_dropped(void)
+{
+    return rl_dropped;
+}
+
+/* Called from the periodic timer path.  Logs how many packets were rate
+ * limited, at most once every RATE_LIMIT_REPORT_INTERVAL seconds.
+*/
+void
+rate_limit_report(void)
+{
+    unsigned long   dropped;
+    time_t          now;
+
+    if(! rl_enabled)
+        return;
+
+    now = clock_cache_now();
+    if(now - rl_last_report < RATE_LIMIT_REPORT_INTERVAL)
+        return;
+
+    dropped = rl_dropped;
+    if(dropped != rl_reported)
+    {
+        log_msg(LOG_WARNING,
+            "Rate limiter dropped %lu SPA packets in the last %li seconds (%lu total).",
+            dropped - rl_reported, (long)(now - rl_last_report), dropped);
+        rl_reported = dropped;
+    }
+    rl_last_report = now;
+
+    return;
+}
+
+/***EOF***/
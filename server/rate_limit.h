@@ -0,0 +1,54 @@
+/*
+ *****************************************************************************
+ *
+ * File:    rate_limit.h
+ *
+ * Purpose: Header file for rate_limit.c - per-source token bucket rate
+ *          limiting of incoming SPA packets.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+/* Number of bucket slots (must be a power of two).  Sources that hash to
+ * the same slot share a bucket.
+*/
+#define RATE_LIMIT_TABLE_LEN        16384
+
+/* Minimum number of seconds between "packets dropped" log messages.
+*/
+#define RATE_LIMIT_REPORT_INTERVAL  60
+
+/* Prototypes
+*/
+int rate_limit_start(fko_srv_options_t *opts);
+void rate_limit_stop(void);
+int rate_limit_check(const spa_addr_t *addr);
+unsigned long rate_limit_dropped(void);
+void rate_limit_report(void);
+
+#endif /* RATE_LIMIT_H */
+
+/***EOF***/
@@ -0,0 +1,163 @@
+/*
+ *****************************************************************************
+ *
+ * File:    rcu.c
+ *
+ * Purpose: A small epoch based read-copy-update scheme.  Readers mark the
+ *          global epoch in a per-thread slot on entry to a read-side
+ *          section and clear it on exit, with no locks.  A writer builds
+ *          a new copy of the data, publishes it with one pointer store,
+ *          then calls rcu_synchronize() to wait until every reader that
+ *          could still see the old copy has left its section before
+ *          freeing it.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "rcu.h"
+
+typedef struct rcu_reader
+{
+    volatile uint64_t   epoch;      /* epoch at section entry, 0 if idle */
+    int                 nest;
+    volatile int        used;
+} rcu_reader_t;
+
+static volatile uint64_t    rcu_epoch = 1;
+static rcu_reader_t         rcu_readers[RCU_MAX_READERS];
+
+static pthread_key_t        rcu_reader_key;
+static pthread_once_t       rcu_reader_key_once = PTHREAD_ONCE_INIT;
+
+static void
+rcu_reader_release(void *arg)
+{
+    rcu_reader_t   *r = arg;
+
+    r->epoch = 0;
+    r->nest  = 0;
+    __sync_lock_release(&(r->used));
+    return;
+}
+
+static void
+rcu_reader_key_init(void)
+{
+    pthread_key_create(&rcu_reader_key, rcu_reader_release);
+    return;
+}
+
+/* Return the calling thread's reader slot, claiming a free one on first
+ * use.  The slot goes back to the pool when the thread exits.
+*/
+static rcu_reader_t *
+rcu_reader_get(void)
+{
+    struct timespec ts;
+    rcu_reader_t   *r;
+    int             i;
+
+    pthread_once(&rcu_reader_key_once, rcu_reader_key_init);
+
+    if((r = pthread_getspecific(rcu_reader_key)) != NULL)
+        return r;
+
+    ts.tv_sec  = 0;
+    ts.tv_nsec = RCU_SYNC_POLL_USEC * 1000;
+
+    /* There are far more slots than fwknopd has threads, so this only
+     * waits if threads are being leaked.
+    */
+    while(1)
+    {
+        for(i=0; i < RCU_MAX_READERS; i++)
+        {
+            if(__sync_lock_test_and_set(&(rcu_readers[i].used), 1) == 0)
+            {
+                r = &(rcu_readers[i]);
+                pthread_setspecific(rcu_reader_key, r);
+                return r;
+            }
+        }
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* Enter a read-side section.  Sections may nest.
+*/
+void
+rcu_read_lock(void)
+{
+    rcu_reader_t   *r = rcu_reader_get();
+
+    if(r->nest++ > 0)
+        return;
+
+    r->epoch = rcu_epoch;
+    __sync_synchronize();
+    return;
+}
+
+void
+rcu_read_unlock(void)
+{
+    rcu_reader_t   *r = pthread_getspecific(rcu_reader_key);
+
+    if(--r->nest > 0)
+        return;
+
+    __sync_synchronize();
+    r->epoch = 0;
+    return;
+}
+
+/* Wait for a grace period: every read-side section that was running when
+ * this was called has ended.  Must not be called from inside a read-side
+ * section.
+*/
+void
+rcu_synchronize(void)
+{
+    struct timespec     ts;
+    uint64_t            target, e;
+    int                 i;
+
+    ts.tv_sec  = 0;
+    ts.tv_nsec = RCU_SYNC_POLL_USEC * 1000;
+
+    /* Readers that enter from here on see the new epoch, and so the
+     * pointers published before this call.
+    */
+    target = __sync_add_and_fetch(&rcu_epoch, 1);
+
+    for(i=0; i < RCU_MAX_READERS; i++)
+    {
+        while((e = rcu_readers[i].epoch) != 0 && e < target)
+            nanosleep(&ts, NULL);
+    }
+
+    return;
+}
+
+/***EOF***/
@@ -0,0 +1,70 @@
+/*
+ *****************************************************************************
+ *
+ * File:    rcu.h
+ *
+ * Purpose: Header file for rcu.c - epoch based read-copy-update used to
+ *          publish new versions of the SDP access and service tables
+ *          without blocking the threads that read them.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef RCU_H
+#define RCU_H
+
+/* Number of threads that can use read-side sections at once (each holds
+ * a slot from its first section until it exits).  Comfortably more than
+ * RCHK_MAX_SPA_WORKERS plus fwknopd's other threads.
+*/
+#define RCU_MAX_READERS         256
+
+/* How long rcu_synchronize() sleeps between checks of the readers (and a
+ * thread waits between looks for a free reader slot).
+*/
+#define RCU_SYNC_POLL_USEC      200
+
+/* Load a pointer published with rcu_assign_pointer().  Only valid inside
+ * a read-side section, and what it points to must not be used after the
+ * section ends.
+*/
+#define rcu_dereference(p)      __sync_fetch_and_add(&(p), 0)
+
+/* Publish a fully built object.  Anything it replaces may be freed only
+ * after rcu_synchronize().
+*/
+#define rcu_assign_pointer(p, v)    do {    \
+        __sync_synchronize();               \
+        (p) = (v);                          \
+        __sync_synchronize();               \
+    } while(0)
+
+/* Prototypes
+*/
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+void rcu_synchronize(void);
+
+#endif /* RCU_H */
+
+/***EOF***/
@@ -0,0 +1,373 @@
+/*
+ *****************************************************************************
+ *
+ * File:    reload.c
+ *
+ * Purpose: Re-read the config files on SIGHUP while packets keep being
+ *          processed.  A thread first has a fresh "fwknopd
+ *          --exit-parse-config" check the new files, so a broken config
+ *          is reported and the running one kept.  It then parses them
+ *          into a scratch fko_srv_options_t and moves the parts that can
+ *          change under a running server into the live one: the runtime
+ *          config, the verbosity and the legacy mode access stanzas (or,
+ *          with an SDP controller, asks it for the access data again).
+ *          If anything else changed, the main loop is restarted the way
+ *          it always was on SIGHUP.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "reload.h"
+#include "config_init.h"
+#include "access.h"
+#include "control_client.h"
+#include "rcu.h"
+#include "log_msg.h"
+#include "utils.h"
+#include "cpu_affinity.h"
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#if HAVE_SYS_WAIT_H
+  #include <sys/wait.h>
+#endif
+
+static int                  rl_argc = 0;
+static char               **rl_argv = NULL;
+
+static pthread_mutex_t      rl_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t            rl_thread;
+static int                  rl_started = 0; /* rl_thread not joined yet */
+static int                  rl_busy = 0;    /* rl_thread still reloading */
+static int                  rl_again = 0;   /* SIGHUP during a reload */
+static volatile int         rl_stop = 0;
+static int                  rl_restart = 0;
+
+/* Log the output of a failed config check, line by line.
+*/
+static void
+rl_log_output(char *buf)
+{
+    char   *line, *next;
+
+    for(line = buf; line != NULL && *line != '\0'; line = next)
+    {
+        if((next = strchr(line, '\n')) != NULL)
+            *next++ = '\0';
+        if(*line != '\0')
+            log_msg(LOG_ERR, "Reload: %s", line);
+    }
+    return;
+}
+
+/* Run this binary with the original arguments plus --exit-parse-config
+ * (and --foreground, so it logs to its stderr).  Returns 1 if the new
+ * config files parsed.
+*/
+static int
+rl_check_config(void)
+{
+    char            exe[MAX_PATH_LEN] = {0};
+    char            out[RELOAD_CHECK_OUTPUT_LEN] = {0};
+    char            buf[512];
+    char          **args = NULL;
+    struct pollfd   pfd;
+    sigset_t        mask;
+    time_t          deadline;
+    size_t          out_len = 0;
+    ssize_t         n;
+    pid_t           pid;
+    int             fds[2], i, status = 0, ok = 0, done = 0;
+
+    n = readlink("/proc/self/exe", exe, sizeof(exe)-1);
+    if(n > 0)
+        exe[n] = '\0';
+    else
+        strlcpy(exe, rl_argv[0], sizeof(exe));
+
+    if((args = calloc(rl_argc + 3, sizeof(char *))) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] Reload: memory allocation error.");
+        return 0;
+    }
+    for(i=0; i < rl_argc; i++)
+        args[i] = rl_argv[i];
+    args[i++] = "--exit-parse-config";
+    args[i++] = "--foreground";
+
+    if(pipe(fds) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Reload: pipe() failed: %s", strerror(errno));
+        free(args);
+        return 0;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+
+    if((pid = fork()) < 0)
+    {
+        log_msg(LOG_ERR, "[*] Reload: fork() failed: %s", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        free(args);
+        return 0;
+    }
+
+    if(pid == 0)
+    {
+        /* Only async-signal-safe calls between fork() and exec.
+        */
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[1]);
+        execv(exe, args);
+        _exit(127);
+    }
+
+    close(fds[1]);
+    free(args);
+
+    deadline = time(NULL) + RELOAD_CHECK_TIMEOUT;
+    pfd.fd     = fds[0];
+    pfd.events = POLLIN;
+
+    while(! done && ! rl_stop && time(NULL) < deadline)
+    {
+        if(poll(&pfd, 1, 1000) <= 0)
+            continue;
+
+        if((n = read(fds[0], buf, sizeof(buf))) > 0)
+        {
+            if(out_len + n >= sizeof(out))
+                n = sizeof(out) - out_len - 1;
+            memcpy(out + out_len, buf, n);
+            out_len += n;
+        }
+        else if(n == 0 || errno != EINTR)
+            done = 1;
+    }
+    close(fds[0]);
+
+    if(! done)
+    {
+        log_msg(LOG_ERR, "[*] Reload: the config check did not finish, killing it.");
+        kill(pid, SIGKILL);
+    }
+
+    /* The SIGCHLD handler may reap the check first, then only its output
+     * tells whether it got through.
+    */
+    while((n = waitpid(pid, &status, 0)) < 0 && errno == EINTR)
+        ;
+    if(done)
+    {
+        if(n == pid)
+            ok = (WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        else
+            ok = (strstr(out, RELOAD_CHECK_DONE_MSG) != NULL);
+    }
+
+    if(done && ! ok)
+        rl_log_output(out);
+
+    return ok;
+}
+
+static void
+rl_reload(fko_srv_options_t *opts)
+{
+    fko_srv_options_t  *new_opts;
+    int                 legacy;
+
+    log_msg(LOG_WARNING, "Got SIGHUP. Reloading configs...");
+
+    if(! rl_check_config())
+    {
+        if(! rl_stop)
+            log_msg(LOG_ERR, "Reload: the new config has errors, keeping the running one.");
+        return;
+    }
+
+    if((new_opts = calloc(1, sizeof(fko_srv_options_t))) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] Reload: memory allocation error.");
+        return;
+    }
+
+    config_init(new_opts, rl_argc, rl_argv);
+
+    if(config_reload_diff(opts, new_opts) > 0)
+    {
+        free_configs(new_opts);
+        free(new_opts);
+
+        log_msg(LOG_WARNING, "Reload: restarting to apply the new config.");
+        __atomic_store_n(&rl_restart, 1, __ATOMIC_SEQ_CST);
+        kill(getpid(), SIGHUP);
+        return;
+    }
+
+    legacy = (strncasecmp(opts->config[CONF_DISABLE_SDP_CTRL_CLIENT], "Y", 1) == 0);
+
+    /* Parse access.conf before config_reload_apply() hands new_opts the
+     * old ACCESS_FILE.
+    */
+    if(legacy)
+        parse_access_file(new_opts);
+
+    config_reload_apply(opts, new_opts);
+
+    if(legacy)
+        replace_acc_stanzas(opts, new_opts);
+    else
+        control_client_request_refresh();
+
+    /* Nothing can still be reading what was swapped out.
+    */
+    rcu_synchronize();
+    free_configs(new_opts);
+    free(new_opts);
+
+    log_msg(LOG_INFO, "Reload done.");
+    return;
+}
+
+static void *
+rl_thread_func(void *arg)
+{
+    fko_srv_options_t  *opts = (fko_srv_options_t *)arg;
+    sigset_t            mask;
+
+    /* Leave signal handling to the main thread.
+    */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    cpu_affinity_set(CPU_ROLE_HOUSEKEEPING);
+
+    for(;;)
+    {
+        rl_reload(opts);
+
+        pthread_mutex_lock(&rl_mutex);
+        if(rl_again && ! rl_stop && ! rl_restart)
+        {
+            rl_again = 0;
+            pthread_mutex_unlock(&rl_mutex);
+            continue;
+        }
+        rl_busy = 0;
+        pthread_mutex_unlock(&rl_mutex);
+        break;
+    }
+
+    return NULL;
+}
+
+/* Remember the command line, which the reload parses again.
+*/
+void
+reload_init(int argc, char **argv)
+{
+    rl_argc = argc;
+    rl_argv = argv;
+    return;
+}
+
+/* Called from the main thread on SIGHUP.  Starts a reload, or has the one
+ * under way run again once it is done.
+*/
+void
+reload_request(fko_srv_options_t *opts)
+{
+    pthread_mutex_lock(&rl_mutex);
+
+    if(rl_busy)
+    {
+        rl_again = 1;
+        pthread_mutex_unlock(&rl_mutex);
+        return;
+    }
+
+    if(rl_started)
+    {
+        pthread_join(rl_thread, NULL);
+        rl_started = 0;
+    }
+
+    rl_busy = 1;
+    if(pthread_create(&rl_thread, NULL, rl_thread_func, opts) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Unable to start the reload thread, restarting instead.");
+        rl_busy = 0;
+        __atomic_store_n(&rl_restart, 1, __ATOMIC_SEQ_CST);
+        kill(getpid(), SIGHUP);
+    }
+    else
+        rl_started = 1;
+
+    pthread_mutex_unlock(&rl_mutex);
+    return;
+}
+
+/* Whether a SIGHUP should restart the main loop (a reload found changes
+ * it cannot apply in place).
+*/
+int
+reload_restart_pending(void)
+{
+    return __atomic_load_n(&rl_restart, __ATOMIC_SEQ_CST);
+}
+
+/* Wait for any reload under way, before the main loop or the process
+ * stops.
+*/
+void
+reload_stop(void)
+{
+    pthread_mutex_lock(&rl_mutex);
+    rl_stop = 1;
+    pthread_mutex_unlock(&rl_mutex);
+
+    if(rl_started && ! pthread_equal(rl_thread, pthread_self()))
+    {
+        pthread_join(rl_thread, NULL);
+        rl_started = 0;
+    }
+
+    pthread_mutex_lock(&rl_mutex);
+    rl_busy  = 0;
+    rl_again = 0;
+    rl_stop  = 0;
+    __atomic_store_n(&rl_restart, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&rl_mutex);
+    return;
+}
+
+/***EOF***/
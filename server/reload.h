@@ -0,0 +1,56 @@
+/*
+ *****************************************************************************
+ *
+ * File:    reload.h
+ *
+ * Purpose: Header file for reload.c - applying a new config on SIGHUP
+ *          without stopping packet processing.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef RELOAD_H
+#define RELOAD_H
+
+/* Logged by "fwknopd --exit-parse-config" once everything parsed, which
+ * is how a reload recognizes a good config when it cannot get at the
+ * exit status of the check.
+*/
+#define RELOAD_CHECK_DONE_MSG   "Configs parsed, exiting."
+
+/* How long the config check may take (seconds), and how much of its
+ * output is kept for the log.
+*/
+#define RELOAD_CHECK_TIMEOUT    30
+#define RELOAD_CHECK_OUTPUT_LEN 4096
+
+/* Prototypes
+*/
+void reload_init(int argc, char **argv);
+void reload_request(fko_srv_options_t *opts);
+int reload_restart_pending(void);
+void reload_stop(void);
+
+#endif /* RELOAD_H */
+
+/***EOF***/
@@ -36,14 +36,19 @@
 #include "log_msg.h"
 #include "fwknopd_errors.h"
 #include "utils.h"
+#include "mem_acct.h"
 
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <time.h>
 
-#if HAVE_LIBGDBM
+#if HAVE_LIBLMDB
+  /* lmdb.h comes in through replay_cache.h */
+#elif HAVE_LIBGDBM
   #include <gdbm.h>
 
+  #define MY_DBM_T                  GDBM_FILE
   #define MY_DBM_FETCH(d, k)        gdbm_fetch(d, k)
   #define MY_DBM_STORE(d, k, v, m)  gdbm_store(d, k, v, m)
   #define MY_DBM_STRERROR(x)        gdbm_strerror(x)
@@ -55,6 +60,7 @@
 #elif HAVE_LIBNDBM
   #include <ndbm.h>
 
+  #define MY_DBM_T                  DBM *
   #define MY_DBM_FETCH(d, k)        dbm_fetch(d, k)
   #define MY_DBM_STORE(d, k, v, m)  dbm_store(d, k, v, m)
   #define MY_DBM_STRERROR(x)        strerror(x)
@@ -76,696 +82,2880 @@
 
 #include <fcntl.h>
 
+#ifdef HAVE_C_UNIT_TESTS
+  #include "cunit_common.h"
+  DECLARE_TEST_SUITE(replay_cache, "Replay cache test suite");
+#endif
+
 #define DATE_LEN 18
 #define MAX_DIGEST_SIZE 64
 
-/* Rotate the digest file by simply renaming it.
+#if USE_FILE_CACHE || ! HAVE_LIBLMDB
+/* FNV-1a over the key, finished with the splitmix64 mixer since dbm keys
+ * are base64 text and FNV alone leaves the bits we use poorly mixed.
+*/
+static uint64_t
+replay_bloom_hash(const unsigned char *key, const size_t len)
+{
+    uint64_t    h = 0xcbf29ce484222325ULL;
+    size_t      i;
+
+    for(i=0; i < len; i++)
+    {
+        h ^= key[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+
+    return(h);
+}
+
+static void
+replay_bloom_free(struct replay_bloom *bf)
+{
+    mem_free(MEM_TAG_REPLAY, bf->bits);
+    memset(bf, 0x0, sizeof(*bf));
+    return;
+}
+
+/* (Re)allocate an empty filter sized for capacity keys.  On failure the
+ * filter is left unavailable (bits == NULL) and -1 is returned.
+*/
+static int
+replay_bloom_alloc(struct replay_bloom *bf, unsigned int capacity)
+{
+    unsigned int    blocks = 1, want;
+
+    replay_bloom_free(bf);
+
+    if(capacity < REPLAY_BLOOM_MIN_ENTRIES)
+        capacity = REPLAY_BLOOM_MIN_ENTRIES;
+
+    want = (unsigned int)(((uint64_t)capacity * REPLAY_BLOOM_BITS_PER_ENTRY
+            + REPLAY_BLOOM_BLOCK_WORDS * 64 - 1) / (REPLAY_BLOOM_BLOCK_WORDS * 64));
+    while(blocks < want)
+        blocks <<= 1;
+
+    if((bf->bits = mem_calloc(MEM_TAG_REPLAY,
+            (size_t)blocks * REPLAY_BLOOM_BLOCK_WORDS, sizeof(uint64_t))) == NULL)
+        return(-1);
+
+    bf->blocks   = blocks;
+    bf->capacity = capacity;
+
+    return(0);
+}
+
+/* Visit the bits for a key: the block comes from the high half of the
+ * hash and the bit positions within it from double hashing on the low
+ * half.  Sets them if set is non-zero.  Returns 0 if any of them was
+ * clear, i.e. the key is definitely not in the filter.
+*/
+static int
+replay_bloom_bits(struct replay_bloom *bf, const unsigned char *key,
+        const size_t len, const int set)
+{
+    uint64_t        h = replay_bloom_hash(key, len);
+    uint64_t       *block, mask;
+    uint32_t        pos = (uint32_t)h;
+    uint32_t        step = ((uint32_t)(h >> 16) & 0xffff) | 1;
+    int             i, found = 1;
+
+    block = bf->bits + (size_t)((uint32_t)(h >> 32) & (bf->blocks - 1))
+        * REPLAY_BLOOM_BLOCK_WORDS;
+
+    for(i=0; i < REPLAY_BLOOM_HASHES; i++)
+    {
+        mask = (uint64_t)1 << (pos & 63);
+        if(! (block[(pos >> 6) % REPLAY_BLOOM_BLOCK_WORDS] & mask))
+            found = 0;
+        if(set)
+            block[(pos >> 6) % REPLAY_BLOOM_BLOCK_WORDS] |= mask;
+        pos += step;
+    }
+    return(found);
+}
+
+static void
+replay_bloom_add(struct replay_bloom *bf, const unsigned char *key,
+        const size_t len)
+{
+    if(bf->bits == NULL)
+        return;
+
+    replay_bloom_bits(bf, key, len, 1);
+    bf->count++;
+    return;
+}
+
+/* Returns 0 only if the key was never added.
+*/
+static int
+replay_bloom_maybe(struct replay_bloom *bf, const unsigned char *key,
+        const size_t len)
+{
+    if(bf->bits == NULL)
+        return(1);
+
+    return(replay_bloom_bits(bf, key, len, 0));
+}
+#endif /* USE_FILE_CACHE || ! HAVE_LIBLMDB */
+
+#if USE_FILE_CACHE
+/* A packet is only accepted within MAX_SPA_PACKET_AGE of its timestamp,
+ * and it was first seen within that long of the timestamp too, so with
+ * SPA packet aging enabled a replay of anything seen more than twice the
+ * age ago is refused by the age check anyway.  Such entries do not need
+ * to stay in the in-memory cache.  Returns 0 if nothing can be dropped.
+*/
+static time_t
+replay_cache_cutoff(const fko_srv_options_t *opts, const time_t now)
+{
+    if(! opts->rt->spa_packet_aging || opts->rt->max_spa_packet_age <= 0)
+        return(0);
+
+    return(now - 2 * (time_t)opts->rt->max_spa_packet_age);
+}
+
+/* Decode a base64 SPA digest into the binary form kept in the cache.
+ * Returns 1 on success, or 0 if the string is not a base64 digest of
+ * REPLAY_DIGEST_LEN bytes (e.g. an entry written with another digest
+ * type, which can never match a packet seen now).
+*/
+static int
+replay_digest_decode(const char *digest, unsigned char *bin)
+{
+    unsigned char   tmp[MAX_DIGEST_SIZE+1];
+
+    if(strnlen(digest, MAX_DIGEST_SIZE+1) > MAX_DIGEST_SIZE)
+        return(0);
+
+    if(fko_base64_decode(digest, tmp) != REPLAY_DIGEST_LEN)
+        return(0);
+
+    memcpy(bin, tmp, REPLAY_DIGEST_LEN);
+    return(1);
+}
+
+/* Digests are SHA-256 output (and only authenticated packets are added),
+ * so the leading bytes already make a good hash.
+*/
+static unsigned int
+replay_slice_hash(const struct replay_slice *rs, const unsigned char *bin)
+{
+    uint32_t    h;
+
+    memcpy(&h, bin, sizeof(h));
+    return(h & (rs->slots - 1));
+}
+
+/* Return the slot holding bin, or the empty slot where it belongs.
+*/
+static unsigned int
+replay_slice_probe(const struct replay_slice *rs, const unsigned char *bin)
+{
+    unsigned int    slot = replay_slice_hash(rs, bin);
+
+    while(rs->used[slot])
+    {
+        if(constant_runtime_cmp((char *)rs->digests + slot * REPLAY_DIGEST_LEN,
+                    (char *)bin, REPLAY_DIGEST_LEN) == 0)
+            break;
+        slot = (slot + 1) & (rs->slots - 1);
+    }
+    return(slot);
+}
+
+static void
+replay_slice_free(struct replay_slice *rs)
+{
+    mem_free(MEM_TAG_REPLAY, rs->digests);
+    mem_free(MEM_TAG_REPLAY, rs->info);
+    mem_free(MEM_TAG_REPLAY, rs->used);
+    memset(rs, 0x0, sizeof(*rs));
+    return;
+}
+
+static int
+replay_slice_alloc(struct replay_slice *rs, const unsigned int slots,
+        const time_t start)
+{
+    memset(rs, 0x0, sizeof(*rs));
+
+    rs->digests = mem_calloc(MEM_TAG_REPLAY, slots, REPLAY_DIGEST_LEN);
+    rs->info    = mem_calloc(MEM_TAG_REPLAY, slots, sizeof(digest_cache_info_t));
+    rs->used    = mem_calloc(MEM_TAG_REPLAY, slots, 1);
+
+    if(rs->digests == NULL || rs->info == NULL || rs->used == NULL)
+    {
+        replay_slice_free(rs);
+        return(-1);
+    }
+
+    rs->slots = slots;
+    rs->start = start;
+
+    return(0);
+}
+
+/* Double the number of slots in a slice.  Returns 0 on success, or -1
+ * (leaving the slice as it was) if memory ran out.
+*/
+static int
+replay_slice_grow(struct replay_slice *rs)
+{
+    struct replay_slice new_rs;
+    unsigned int        i, slot;
+
+    if(replay_slice_alloc(&new_rs, rs->slots * 2, rs->start) != 0)
+        return(-1);
+
+    for(i=0; i < rs->slots; i++)
+    {
+        if(! rs->used[i])
+            continue;
+
+        slot = replay_slice_probe(&new_rs, rs->digests + i * REPLAY_DIGEST_LEN);
+        memcpy(new_rs.digests + slot * REPLAY_DIGEST_LEN,
+                rs->digests + i * REPLAY_DIGEST_LEN, REPLAY_DIGEST_LEN);
+        new_rs.info[slot] = rs->info[i];
+        new_rs.used[slot] = 1;
+    }
+    new_rs.count = rs->count;
+
+    replay_slice_free(rs);
+    *rs = new_rs;
+
+    return(0);
+}
+
+/* Convert between cache entries and digest file records.
+*/
+static void
+replay_log_rec_fill(replay_log_rec_t *rec, const unsigned char *bin,
+        const digest_cache_info_t *info)
+{
+    memset(rec, 0x0, sizeof(*rec));
+
+    rec->created    = (int64_t)info->created;
+    memcpy(rec->digest, bin, REPLAY_DIGEST_LEN);
+    memcpy(rec->src_ip, info->src_ip.addr, sizeof(rec->src_ip));
+    memcpy(rec->dst_ip, info->dst_ip.addr, sizeof(rec->dst_ip));
+    rec->src_port   = info->src_port;
+    rec->dst_port   = info->dst_port;
+    rec->proto      = info->proto;
+    rec->src_family = info->src_ip.family;
+    rec->dst_family = info->dst_ip.family;
+
+    return;
+}
+
+static void
+replay_log_rec_info(const replay_log_rec_t *rec, digest_cache_info_t *info)
+{
+    memset(info, 0x0, sizeof(*info));
+
+    info->created       = (time_t)rec->created;
+    memcpy(info->src_ip.addr, rec->src_ip, sizeof(info->src_ip.addr));
+    memcpy(info->dst_ip.addr, rec->dst_ip, sizeof(info->dst_ip.addr));
+    info->src_ip.family = rec->src_family;
+    info->dst_ip.family = rec->dst_family;
+    info->src_port      = rec->src_port;
+    info->dst_port      = rec->dst_port;
+    info->proto         = rec->proto;
+
+    return;
+}
+
+/* Flush the records appended since the last fsync() once the sync
+ * interval has passed (or right away if force is set), so that a burst
+ * of SPA packets shares a single flush.
+*/
+static void
+replay_log_sync(struct replay_cache *rc, const time_t now, const int force)
+{
+    if(rc->log_fd == -1 || rc->unsynced == 0)
+        return;
+
+    if(! force && rc->sync_interval > 0
+            && now - rc->last_sync < rc->sync_interval)
+        return;
+
+    if(fsync(rc->log_fd) != 0)
+        log_msg(LOG_WARNING, "Unable to sync digest cache: %s", strerror(errno));
+
+    rc->unsynced  = 0;
+    rc->last_sync = now;
+
+    return;
+}
+
+static void
+replay_log_close(struct replay_cache *rc)
+{
+    if(rc->log_fd == -1)
+        return;
+
+    replay_log_sync(rc, time(NULL), 1);
+    close(rc->log_fd);
+    rc->log_fd = -1;
+
+    return;
+}
+
+static int
+replay_log_open(fko_srv_options_t *opts)
+{
+    struct replay_cache *rc = opts->digest_cache;
+
+    replay_log_close(rc);
+
+    if((rc->log_fd = open(opts->config[CONF_DIGEST_FILE], O_WRONLY|O_APPEND)) == -1)
+    {
+        log_msg(LOG_WARNING, "Could not open digest cache: %s: %s",
+            opts->config[CONF_DIGEST_FILE], strerror(errno));
+        return(-1);
+    }
+    return(0);
+}
+
+static void
+replay_cache_free(struct replay_cache *rc)
+{
+    int     i;
+
+    if(rc == NULL)
+        return;
+
+    replay_log_close(rc);
+
+    for(i=0; i <= REPLAY_CACHE_SLICES; i++)
+        replay_slice_free(&(rc->slice[i]));
+    replay_bloom_free(&(rc->bloom));
+    mem_free(MEM_TAG_REPLAY, rc);
+    return;
+}
+
+/* Rebuild the Bloom filter from the live slices, with room for as many
+ * again.  Bloom filters cannot drop keys, so this is how entries in
+ * expired slices leave it.
+*/
+static void
+replay_cache_bloom_rebuild(struct replay_cache *rc)
+{
+    struct replay_slice *rs;
+    unsigned int        live = 0, slot;
+    int                 i;
+
+    for(i=0; i <= REPLAY_CACHE_SLICES; i++)
+        live += rc->slice[i].count;
+
+    if(replay_bloom_alloc(&(rc->bloom), 2 * live) != 0)
+    {
+        log_msg(LOG_WARNING, "Could not allocate digest cache Bloom filter");
+        return;
+    }
+
+    for(i=0; i <= REPLAY_CACHE_SLICES; i++)
+    {
+        rs = &(rc->slice[i]);
+        for(slot=0; slot < rs->slots; slot++)
+            if(rs->used[slot])
+                replay_bloom_add(&(rc->bloom),
+                        rs->digests + slot * REPLAY_DIGEST_LEN, REPLAY_DIGEST_LEN);
+    }
+    return;
+}
+
+static struct replay_cache *
+replay_cache_new(const fko_srv_options_t *opts)
+{
+    struct replay_cache *rc = NULL;
+    time_t              window;
+    int                 is_err;
+
+    if((rc = mem_calloc(MEM_TAG_REPLAY, 1, sizeof(*rc))) == NULL)
+        return(NULL);
+
+    rc->log_fd = -1;
+    rc->sync_interval = strtol_wrapper(opts->config[CONF_DIGEST_FILE_SYNC_INTERVAL],
+            0, RCHK_MAX_DIGEST_FILE_SYNC_INTERVAL, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+        rc->sync_interval = 0;
+
+    /* The window is the one replay_cache_cutoff() uses
+    */
+    if(opts->rt->spa_packet_aging && opts->rt->max_spa_packet_age > 0)
+    {
+        window = 2 * (time_t)opts->rt->max_spa_packet_age;
+        rc->window    = window;
+        rc->slice_len = (window + REPLAY_CACHE_SLICES - 1) / REPLAY_CACHE_SLICES;
+    }
+
+    if(replay_bloom_alloc(&(rc->bloom), REPLAY_BLOOM_MIN_ENTRIES) != 0)
+    {
+        mem_free(MEM_TAG_REPLAY, rc);
+        return(NULL);
+    }
+
+    return(rc);
+}
+
+/* Return the start of the time slice that t falls in.
+*/
+static time_t
+replay_slice_start(const struct replay_cache *rc, const time_t t)
+{
+    if(rc->slice_len == 0 || t <= 0)
+        return(0);
+
+    return(t - t % rc->slice_len);
+}
+
+/* Drop every slice that is entirely older than cutoff, and rebuild the
+ * Bloom filter without them.  Returns the number of slices dropped.
+*/
+static int
+replay_cache_expire(struct replay_cache *rc, const time_t cutoff)
+{
+    int     i, dropped = 0;
+
+    if(rc->slice_len == 0)
+        return(0);
+
+    for(i=0; i <= REPLAY_CACHE_SLICES; i++)
+    {
+        if(rc->slice[i].slots > 0
+                && rc->slice[i].start + rc->slice_len <= cutoff)
+        {
+            replay_slice_free(&(rc->slice[i]));
+            dropped++;
+        }
+    }
+
+    if(dropped > 0)
+        replay_cache_bloom_rebuild(rc);
+
+    return(dropped);
+}
+
+/* Return the cache entry for bin, ignoring anything older than cutoff,
+ * or NULL if there is none.
+*/
+static digest_cache_info_t *
+replay_cache_find(struct replay_cache *rc, const unsigned char *bin,
+        const time_t cutoff)
+{
+    struct replay_slice *rs;
+    unsigned int        slot;
+    int                 i;
+
+    if(! replay_bloom_maybe(&(rc->bloom), bin, REPLAY_DIGEST_LEN))
+        return(NULL);
+
+    for(i=0; i <= REPLAY_CACHE_SLICES; i++)
+    {
+        rs = &(rc->slice[i]);
+        if(rs->slots == 0)
+            continue;
+
+        slot = replay_slice_probe(rs, bin);
+        if(rs->used[slot] && rs->info[slot].created >= cutoff)
+            return(&(rs->info[slot]));
+    }
+    return(NULL);
+}
+
+/* Add (or refresh) a digest in the slice for info->created.  An entry
+ * dated outside the window as of now is moved to the nearest end of it
+ * (and info->created updated to match), so that it lands in a slice the
+ * ring can hold and is kept until it ages out like any other.  Slices
+ * are grown before they get more than half full.  Returns 0 on success
+ * and -1 if memory ran out.
+*/
+static int
+replay_cache_insert(struct replay_cache *rc, const unsigned char *bin,
+        digest_cache_info_t *info, const time_t now)
+{
+    struct replay_slice *rs;
+    time_t              start;
+    unsigned int        slot;
+
+    if(rc->window > 0)
+    {
+        if(info->created > now)
+            info->created = now;
+        else if(info->created < now - rc->window)
+            info->created = now - rc->window;
+    }
+    start = replay_slice_start(rc, info->created);
+
+    if(rc->slice_len == 0)
+        rs = &(rc->slice[0]);
+    else
+        rs = &(rc->slice[(start / rc->slice_len) % (REPLAY_CACHE_SLICES + 1)]);
+
+    /* The ring entry may still hold a slice from a full turn of the ring
+     * away.  An older one has aged out entirely, but a newer one (left
+     * from before the clock went back) is still live, so the digest goes
+     * in with it and is kept at least as long as it needs to be.
+    */
+    if(rs->slots > 0 && rs->start < start)
+        replay_slice_free(rs);
+
+    if(rs->slots == 0
+            && replay_slice_alloc(rs, REPLAY_CACHE_MIN_SLOTS, start) != 0)
+        return(-1);
+
+    if(2 * (rs->count + 1) > rs->slots && replay_slice_grow(rs) != 0)
+        return(-1);
+
+    slot = replay_slice_probe(rs, bin);
+    if(! rs->used[slot])
+    {
+        memcpy(rs->digests + slot * REPLAY_DIGEST_LEN, bin, REPLAY_DIGEST_LEN);
+        rs->used[slot] = 1;
+        rs->count++;
+
+        if(rc->bloom.bits != NULL && rc->bloom.count >= rc->bloom.capacity)
+            replay_cache_bloom_rebuild(rc);
+        else
+            replay_bloom_add(&(rc->bloom), bin, REPLAY_DIGEST_LEN);
+    }
+    rs->info[slot] = *info;
+
+    return(0);
+}
+
+/* Rewrite the digest file with just the entries still in the in-memory
+ * cache, oldest slice first, so that the file drops the same slices the
+ * cache does.  The new file is written and synced next to the old one,
+ * renamed over it, and then reopened for appending.  Returns 0 on
+ * success and -1 on error.
+*/
+static int
+replay_file_cache_compact(fko_srv_options_t *opts)
+{
+    struct replay_cache *rc = opts->digest_cache;
+    struct replay_slice *rs;
+    FILE               *digest_file_ptr = NULL;
+    char               *tmp_file = NULL;
+    size_t              tmp_len;
+    time_t              last_start = -1, start;
+    int                 fd, i, next, err = 0;
+    unsigned int        slot;
+
+    replay_log_hdr_t    hdr;
+    replay_log_rec_t    rec;
+
+    tmp_len = strlen(opts->config[CONF_DIGEST_FILE]) + 5;
+    if((tmp_file = calloc(1, tmp_len)) == NULL)
+    {
+        log_msg(LOG_WARNING, "replay_file_cache_compact: Memory allocation error.");
+        return(-1);
+    }
+    snprintf(tmp_file, tmp_len, "%s.tmp", opts->config[CONF_DIGEST_FILE]);
+
+    fd = open(tmp_file, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+    if(fd == -1 || (digest_file_ptr = fdopen(fd, "w")) == NULL)
+    {
+        log_msg(LOG_WARNING, "Could not create digest cache: %s: %s",
+            tmp_file, strerror(errno));
+        if(fd != -1)
+            close(fd);
+        free(tmp_file);
+        return(-1);
+    }
+
+    memset(&hdr, 0x0, sizeof(hdr));
+    memcpy(hdr.magic, REPLAY_LOG_MAGIC, REPLAY_LOG_MAGIC_LEN);
+    hdr.rec_len = sizeof(replay_log_rec_t);
+    fwrite(&hdr, sizeof(hdr), 1, digest_file_ptr);
+
+    /* There are only a handful of slices, so just pick the next oldest
+     * one each time around.
+    */
+    for(;;)
+    {
+        next = -1;
+        for(i=0; i <= REPLAY_CACHE_SLICES; i++)
+        {
+            start = rc->slice[i].start;
+            if(rc->slice[i].slots > 0 && start > last_start
+                    && (next < 0 || start < rc->slice[next].start))
+                next = i;
+        }
+        if(next < 0)
+            break;
+
+        rs = &(rc->slice[next]);
+        last_start = rs->start;
+
+        for(slot=0; slot < rs->slots; slot++)
+        {
+            if(! rs->used[slot])
+                continue;
+
+            replay_log_rec_fill(&rec, rs->digests + slot * REPLAY_DIGEST_LEN,
+                    &(rs->info[slot]));
+            fwrite(&rec, sizeof(rec), 1, digest_file_ptr);
+        }
+    }
+
+    if(fflush(digest_file_ptr) != 0 || ferror(digest_file_ptr)
+            || fsync(fileno(digest_file_ptr)) != 0)
+        err = 1;
+    if(fclose(digest_file_ptr) != 0)
+        err = 1;
+
+    if(err || rename(tmp_file, opts->config[CONF_DIGEST_FILE]) != 0)
+    {
+        log_msg(LOG_WARNING, "Unable to replace digest file: %s: %s",
+            opts->config[CONF_DIGEST_FILE], strerror(errno));
+        unlink(tmp_file);
+        free(tmp_file);
+        return(-1);
+    }
+    free(tmp_file);
+
+    /* Anything appended to the old file is in the new one, and synced
+    */
+    rc->unsynced  = 0;
+    rc->last_sync = time(NULL);
+
+    return(replay_log_open(opts));
+}
+#endif
+
+/* Rotate the digest file by simply renaming it.
+*/
+static void
+rotate_digest_cache_file(fko_srv_options_t *opts)
+{
+#ifdef NO_DIGEST_CACHE
+    log_msg(LOG_WARNING, "Digest cache not supported. Nothing to rotate.");
+#else
+    int         res;
+    char       *new_file = NULL;
+
+    log_msg(LOG_INFO, "Rotating digest cache file.");
+
+#if USE_FILE_CACHE
+    new_file = calloc(1, strlen(opts->config[CONF_DIGEST_FILE])+5);
+#else
+    new_file = calloc(1, strlen(opts->config[CONF_DIGEST_DB_FILE])+5);
+#endif
+
+    if(new_file == NULL)
+    {
+        log_msg(LOG_ERR, "rotate_digest_cache_file: Memory allocation error.");
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    /* The new filename is just the original with a trailing '-old'.
+    */
+#if USE_FILE_CACHE
+    strlcpy(new_file, opts->config[CONF_DIGEST_FILE],
+        strlen(opts->config[CONF_DIGEST_FILE])+5);
+    strlcat(new_file, "-old",
+            strlen(opts->config[CONF_DIGEST_FILE])+5);
+#else
+    strlcpy(new_file, opts->config[CONF_DIGEST_DB_FILE],
+        strlen(opts->config[CONF_DIGEST_DB_FILE])+5);
+    strlcat(new_file, "-old",
+            strlen(opts->config[CONF_DIGEST_DB_FILE])+5);
+#endif
+
+#if USE_FILE_CACHE
+    res = rename(opts->config[CONF_DIGEST_FILE], new_file);
+#else
+    res = rename(opts->config[CONF_DIGEST_DB_FILE], new_file);
+#endif
+
+    if(res < 0)
+        log_msg(LOG_ERR, "Unable to rename digest file: %s to %s: %s",
+#if USE_FILE_CACHE
+            opts->config[CONF_DIGEST_FILE], new_file, strerror(errno)
+#else
+            opts->config[CONF_DIGEST_DB_FILE], new_file, strerror(errno)
+#endif
+        );
+#endif /* NO_DIGEST_CACHE */
+
+    free(new_file);
+    return;
+}
+
+static void
+replay_warning(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt,
+        digest_cache_info_t *digest_info)
+{
+    char        src_ip[MAX_IPV46_STR_LEN] = {0};
+    char        orig_src_ip[MAX_IPV46_STR_LEN] = {0};
+    char        created[DATE_LEN] = {0};
+
+#if ! USE_FILE_CACHE
+    char        first[DATE_LEN] = {0}, last[DATE_LEN] = {0};
+#endif
+
+    /* Convert the IPs to a human readable form
+    */
+    spa_addr_ntop(&(spa_pkt->packet_src_addr), src_ip, sizeof(src_ip));
+    spa_addr_ntop(&(digest_info->src_ip), orig_src_ip, sizeof(orig_src_ip));
+
+#if ! USE_FILE_CACHE
+    /* Mark the last_replay time.
+    */
+    digest_info->last_replay = spa_pkt->arrival_time;
+
+    /* Increment the replay count and check to see if it is the first one.
+    */
+    if(++(digest_info->replay_count) == 1)
+    {
+        /* This is the first replay so make it the same as last_replay
+        */
+        digest_info->first_replay = digest_info->last_replay;
+    }
+
+    strftime(first, DATE_LEN, "%D %H:%M:%S", localtime(&(digest_info->first_replay)));
+    strftime(last, DATE_LEN, "%D %H:%M:%S", localtime(&(digest_info->last_replay)));
+#endif
+
+    strftime(created, DATE_LEN, "%D %H:%M:%S", localtime(&(digest_info->created)));
+
+    log_msg(LOG_WARNING | LOG_RATE_LIMIT,
+        "Replay detected from source IP: %s, "
+        "Destination proto/port: %d/%d, "
+        "Original source IP: %s, "
+        "Original dst proto/port: %d/%d, "
+#if USE_FILE_CACHE
+        "Entry created: %s",
+#else
+        "Entry created: %s, "
+        "First replay: %s, "
+        "Last replay: %s, "
+        "Replay count: %i",
+#endif
+        src_ip,
+        spa_pkt->packet_proto,
+        spa_pkt->packet_dst_port,
+        orig_src_ip,
+        digest_info->proto,
+        digest_info->dst_port,
+#if USE_FILE_CACHE
+        created
+#else
+        created,
+        first,
+        last,
+        digest_info->replay_count
+#endif
+    );
+
+    return;
+}
+
+#if USE_FILE_CACHE
+/* Load a digest file in the text format used by older versions of
+ * fwknopd.  Returns the number of entries loaded or -1 on error.
+*/
+static int
+replay_file_cache_load_text(fko_srv_options_t *opts, const time_t now)
+{
+    time_t          cutoff = replay_cache_cutoff(opts, now);
+    FILE           *digest_file_ptr = NULL;
+    unsigned int    num_lines = 0, digest_ctr = 0;
+    char            line_buf[MAX_LINE_LEN]    = {0};
+    char            src_ip[MAX_IPV46_STR_LEN+1] = {0};
+    char            dst_ip[MAX_IPV46_STR_LEN+1] = {0};
+    char            digest[MAX_DIGEST_SIZE+1] = {0};
+    long int        time_tmp;
+    unsigned char   digest_bin[REPLAY_DIGEST_LEN];
+
+    digest_cache_info_t cache_info;
+
+    if ((digest_file_ptr = fopen(opts->config[CONF_DIGEST_FILE], "r")) == NULL)
+    {
+        log_msg(LOG_WARNING, "Could not open digest cache: %s",
+            opts->config[CONF_DIGEST_FILE]);
+        return(-1);
+    }
+
+    /* Line format:
+     * <digest> <proto> <src_ip> <src_port> <dst_ip> <dst_port> <time>
+     * Example:
+     * 7XgadOyqv0tF5xG8uhg2iIrheeNKglCWKmxQDgYP1dY 17 127.0.0.1 40305 127.0.0.1 62201 1313283481
+    */
+    while ((fgets(line_buf, MAX_LINE_LEN, digest_file_ptr)) != NULL)
+    {
+        num_lines++;
+        line_buf[MAX_LINE_LEN-1] = '\0';
+
+        if(IS_EMPTY_LINE(line_buf[0]))
+            continue;
+
+        memset(&cache_info, 0x0, sizeof(cache_info));
+        digest[0] = '\0';
+        src_ip[0] = '\0';
+        dst_ip[0] = '\0';
+
+        if(sscanf(line_buf, "%64s %hhu %46s %hu %46s %hu %ld",
+            digest,  /* %64s, buffer size is MAX_DIGEST_SIZE+1 */
+            &(cache_info.proto),
+            src_ip,  /* %46s, buffer size is MAX_IPV46_STR_LEN+1 */
+            &(cache_info.src_port),
+            dst_ip,  /* %46s, buffer size is MAX_IPV46_STR_LEN+1 */
+            &(cache_info.dst_port),
+            &time_tmp) != 7)
+        {
+            log_msg(LOG_INFO,
+                "*Skipping invalid digest file entry in %s at line %i.\n - %s",
+                opts->config[CONF_DIGEST_FILE], num_lines, line_buf
+            );
+            continue;
+        }
+        cache_info.created = time_tmp;
+
+        /* Too old to matter, see replay_cache_cutoff().
+        */
+        if (cache_info.created < cutoff)
+            continue;
+
+        if (! replay_digest_decode(digest, digest_bin))
+            continue;
+
+        if (spa_addr_pton(src_ip, &(cache_info.src_ip)) != 1)
+            continue;
+
+        if (spa_addr_pton(dst_ip, &(cache_info.dst_ip)) != 1)
+            continue;
+
+        if (replay_cache_insert(opts->digest_cache, digest_bin, &cache_info, now) != 0)
+        {
+            log_msg(LOG_ERR, "[*] Could not allocate digest cache");
+            break;
+        }
+        digest_ctr++;
+
+        if(opts->verbose > 3)
+            log_msg(LOG_DEBUG,
+                "DIGEST FILE: %s, VALID LINE: %s",
+                opts->config[CONF_DIGEST_FILE], line_buf
+            );
+
+    }
+
+    fclose(digest_file_ptr);
+
+    return(digest_ctr);
+}
+
+/* Load a binary digest file by mapping it and walking the records.
+ * Records that are too old to keep, an unknown header or a partial
+ * record at the end are counted in *stale so that the caller rewrites
+ * the file.  Returns the number of entries loaded or -1 on error.
+*/
+static int
+replay_file_cache_load(fko_srv_options_t *opts, const int fd,
+        const size_t size, const time_t now, unsigned int *stale)
+{
+    time_t                  cutoff = replay_cache_cutoff(opts, now);
+    unsigned char          *map;
+    const replay_log_hdr_t *hdr;
+    replay_log_rec_t        rec;
+    size_t                  num_recs, i;
+    int                     digest_ctr = 0;
+
+    digest_cache_info_t cache_info;
+
+    if(size < sizeof(replay_log_hdr_t))
+    {
+        (*stale)++;
+        return(0);
+    }
+
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED)
+    {
+        log_msg(LOG_WARNING, "Could not map digest cache: %s: %s",
+            opts->config[CONF_DIGEST_FILE], strerror(errno));
+        return(-1);
+    }
+
+    hdr = (const replay_log_hdr_t *)map;
+    if(memcmp(hdr->magic, REPLAY_LOG_MAGIC, REPLAY_LOG_MAGIC_LEN) != 0
+            || hdr->rec_len != sizeof(replay_log_rec_t))
+    {
+        log_msg(LOG_WARNING, "Digest cache %s has an unknown format, starting over",
+            opts->config[CONF_DIGEST_FILE]);
+        munmap(map, size);
+        (*stale)++;
+        return(0);
+    }
+
+    num_recs = (size - sizeof(replay_log_hdr_t)) / sizeof(replay_log_rec_t);
+    if((size - sizeof(replay_log_hdr_t)) % sizeof(replay_log_rec_t) != 0)
+        (*stale)++;
+
+    for(i=0; i < num_recs; i++)
+    {
+        memcpy(&rec, map + sizeof(replay_log_hdr_t)
+                + i * sizeof(replay_log_rec_t), sizeof(rec));
+
+        /* Too old to matter, see replay_cache_cutoff().
+        */
+        if(rec.created < cutoff)
+        {
+            (*stale)++;
+            continue;
+        }
+
+        replay_log_rec_info(&rec, &cache_info);
+
+        if(replay_cache_insert(opts->digest_cache, rec.digest, &cache_info, now) != 0)
+        {
+            log_msg(LOG_ERR, "[*] Could not allocate digest cache");
+            break;
+        }
+        digest_ctr++;
+    }
+
+    munmap(map, size);
+
+    return(digest_ctr);
+}
+
+static int
+replay_file_cache_init(fko_srv_options_t *opts)
+{
+    struct stat     st;
+    char            first = '\0';
+    int             fd, digest_ctr;
+    unsigned int    stale = 0;
+    time_t          now = time(NULL);
+    time_t          cutoff = replay_cache_cutoff(opts, now);
+
+    if(opts->digest_cache == NULL
+            && (opts->digest_cache = replay_cache_new(opts)) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] Could not allocate digest cache");
+        return(-1);
+    }
+
+    /* if the file exists, import the previous SPA digests into
+     * the cache
+    */
+    if (access(opts->config[CONF_DIGEST_FILE], F_OK) == 0)
+    {
+        /* Check permissions
+        */
+        if (access(opts->config[CONF_DIGEST_FILE], R_OK|W_OK) != 0)
+        {
+            log_msg(LOG_WARNING, "Digest file '%s' exists but: '%s'",
+                opts->config[CONF_DIGEST_FILE], strerror(errno));
+            return(-1);
+        }
+    }
+    else
+    {
+        /* the file does not exist yet, so create it with just the header
+        */
+        return(replay_file_cache_compact(opts) == 0 ? 0 : -1);
+    }
+
+    if(verify_file_perms_ownership(opts->config[CONF_DIGEST_FILE]) != 1)
+        return(-1);
+
+    /* File exists, and we have access - create in-memory digest cache
+    */
+    if ((fd = open(opts->config[CONF_DIGEST_FILE], O_RDONLY)) == -1
+            || fstat(fd, &st) != 0)
+    {
+        log_msg(LOG_WARNING, "Could not open digest cache: %s",
+            opts->config[CONF_DIGEST_FILE]);
+        if(fd != -1)
+            close(fd);
+        return(-1);
+    }
+
+    if(st.st_size > 0 && read(fd, &first, 1) != 1)
+        first = '\0';
+
+    if(first == '#')
+    {
+        /* Text file from an older fwknopd, which is converted below
+        */
+        close(fd);
+        digest_ctr = replay_file_cache_load_text(opts, now);
+        stale++;
+    }
+    else
+    {
+        digest_ctr = replay_file_cache_load(opts, fd, st.st_size, now, &stale);
+        close(fd);
+    }
+
+    if(digest_ctr < 0)
+        return(-1);
+
+    /* Drop whatever has aged out since the file was last written
+    */
+    if(replay_cache_expire(opts->digest_cache, cutoff) > 0 || stale > 0)
+        replay_file_cache_compact(opts);
+    else
+        replay_log_open(opts);
+
+    return(digest_ctr);
+}
+
+#elif HAVE_LIBLMDB
+
+/* Sync the LMDB commits made since the last sync once the sync interval
+ * has passed (or right away if force is set).
+*/
+static void
+replay_lmdb_sync(struct replay_cache *rc, const time_t now, const int force)
+{
+    int     rv;
+
+    if(rc->unsynced == 0)
+        return;
+
+    if(! force && rc->sync_interval > 0
+            && now - rc->last_sync < rc->sync_interval)
+        return;
+
+    if((rv = mdb_env_sync(rc->env, 1)) != 0)
+        log_msg(LOG_WARNING, "Unable to sync digest cache: %s", mdb_strerror(rv));
+
+    rc->unsynced  = 0;
+    rc->last_sync = now;
+
+    return;
+}
+
+static void
+replay_lmdb_free(struct replay_cache *rc)
+{
+    if(rc == NULL)
+        return;
+
+    if(rc->env != NULL)
+    {
+        replay_lmdb_sync(rc, time(NULL), 1);
+        mdb_dbi_close(rc->env, rc->dbi);
+        mdb_env_close(rc->env);
+    }
+    mem_free(MEM_TAG_REPLAY, rc);
+    return;
+}
+
+/* Store an entry in its own write transaction.  Returns the LMDB error
+ * code.
+*/
+static int
+replay_lmdb_put(struct replay_cache *rc, MDB_val *key,
+        digest_cache_info_t *dc_info, const unsigned int flags)
+{
+    MDB_txn    *txn = NULL;
+    MDB_val     val;
+    int         rv;
+
+    val.mv_size = sizeof(*dc_info);
+    val.mv_data = dc_info;
+
+    if((rv = mdb_txn_begin(rc->env, NULL, 0, &txn)) != 0)
+        return(rv);
+
+    if((rv = mdb_put(txn, rc->dbi, key, &val, flags)) != 0)
+    {
+        mdb_txn_abort(txn);
+        return(rv);
+    }
+
+    if((rv = mdb_txn_commit(txn)) == 0)
+        rc->unsynced++;
+
+    return(rv);
+}
+
+/* Open the LMDB environment the first time through.  Returns the number
+ * of entries in the db or -1 on error.
+*/
+static int
+replay_lmdb_cache_init(fko_srv_options_t *opts)
+{
+    struct replay_cache *rc = opts->digest_cache;
+    MDB_txn            *txn = NULL;
+    MDB_stat            db_stat;
+    int                 rv, is_err;
+
+    if(rc == NULL)
+    {
+        if((rc = mem_calloc(MEM_TAG_REPLAY, 1, sizeof(*rc))) == NULL)
+        {
+            log_msg(LOG_ERR, "[*] Could not allocate digest cache");
+            return(-1);
+        }
+
+        rc->sync_interval = strtol_wrapper(opts->config[CONF_DIGEST_FILE_SYNC_INTERVAL],
+                0, RCHK_MAX_DIGEST_FILE_SYNC_INTERVAL, NO_EXIT_UPON_ERR, &is_err);
+        if(is_err != FKO_SUCCESS)
+            rc->sync_interval = 0;
+
+        rv = mdb_env_create(&(rc->env));
+        if(rv == 0)
+            rv = mdb_env_set_mapsize(rc->env, REPLAY_LMDB_MAP_SIZE);
+        if(rv == 0)
+            rv = mdb_env_open(rc->env, opts->config[CONF_DIGEST_DB_FILE],
+                    MDB_NOSUBDIR|MDB_NOSYNC, S_IRUSR|S_IWUSR);
+        if(rv == 0 && (rv = mdb_txn_begin(rc->env, NULL, 0, &txn)) == 0)
+        {
+            if((rv = mdb_dbi_open(txn, NULL, 0, &(rc->dbi))) == 0)
+                rv = mdb_txn_commit(txn);
+            else
+                mdb_txn_abort(txn);
+        }
+
+        if(rv != 0)
+        {
+            log_msg(LOG_ERR,
+                "Unable to open digest cache file: '%s': %s",
+                opts->config[CONF_DIGEST_DB_FILE],
+                mdb_strerror(rv)
+            );
+            if(rc->env != NULL)
+                mdb_env_close(rc->env);
+            mem_free(MEM_TAG_REPLAY, rc);
+            return(-1);
+        }
+
+        opts->digest_cache = rc;
+    }
+
+    if((rv = mdb_txn_begin(rc->env, NULL, MDB_RDONLY, &txn)) != 0)
+    {
+        log_msg(LOG_ERR, "Unable to read digest cache file: '%s': %s",
+            opts->config[CONF_DIGEST_DB_FILE], mdb_strerror(rv));
+        return(-1);
+    }
+    rv = mdb_stat(txn, rc->dbi, &db_stat);
+    mdb_txn_abort(txn);
+
+    return(rv == 0 ? (int)db_stat.ms_entries : -1);
+}
+
+/* Look the digest up in a read-only transaction, which works on its own
+ * snapshot of the db.  This does not need the replay cache mutex, so
+ * lookups in several workers never wait on each other or on a writer.
+*/
+static int
+is_replay_lmdb_cache(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt,
+        const unsigned char *digest)
+{
+    struct replay_cache *rc = opts->digest_cache;
+    MDB_txn            *txn = NULL;
+    MDB_val             key, val;
+    int                 rv;
+
+    digest_cache_info_t dc_info;
+
+    if(rc == NULL)
+        return(SPA_MSG_SUCCESS);
+
+    key.mv_size = REPLAY_DIGEST_LEN;
+    key.mv_data = (void *)digest;
+
+    if((rv = mdb_txn_begin(rc->env, NULL, MDB_RDONLY, &txn)) != 0)
+    {
+        log_msg(LOG_WARNING, "Error opening digest_cache: '%s': %s",
+            opts->config[CONF_DIGEST_DB_FILE], mdb_strerror(rv));
+        return(SPA_MSG_DIGEST_CACHE_ERROR);
+    }
+
+    memset(&dc_info, 0x0, sizeof(dc_info));
+    rv = mdb_get(txn, rc->dbi, &key, &val);
+    if(rv == 0)
+        memcpy(&dc_info, val.mv_data,
+            val.mv_size < sizeof(dc_info) ? val.mv_size : sizeof(dc_info));
+    mdb_txn_abort(txn);
+
+    if(rv == MDB_NOTFOUND)
+        return(SPA_MSG_SUCCESS);
+
+    if(rv != 0)
+    {
+        log_msg(LOG_WARNING, "Error reading digest_cache: '%s': %s",
+            opts->config[CONF_DIGEST_DB_FILE], mdb_strerror(rv));
+        return(SPA_MSG_DIGEST_CACHE_ERROR);
+    }
+
+    /* Replays are rare, so saving the updated replay count can take the
+     * writer's lock.
+    */
+    if(pthread_mutex_lock(&(opts->replay_cache_mutex)))
+    {
+        log_msg(LOG_ERR, "Mutex lock error.");
+        return(SPA_MSG_REPLAY);
+    }
+
+    replay_warning(opts, spa_pkt, &dc_info);
+
+    if((rv = replay_lmdb_put(rc, &key, &dc_info, 0)) != 0)
+        log_msg(LOG_WARNING, "Error updating entry in digest_cache: '%s': %s",
+            opts->config[CONF_DIGEST_DB_FILE], mdb_strerror(rv));
+
+    pthread_mutex_unlock(&(opts->replay_cache_mutex));
+
+    return(SPA_MSG_REPLAY);
+}
+
+/* Called with the replay cache mutex held.
+*/
+static int
+add_replay_lmdb_cache(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt,
+        const unsigned char *digest)
+{
+    struct replay_cache *rc = opts->digest_cache;
+    MDB_val             key;
+    int                 rv;
+
+    digest_cache_info_t dc_info;
+
+    if(rc == NULL)
+        return(SPA_MSG_DIGEST_CACHE_ERROR);
+
+    key.mv_size = REPLAY_DIGEST_LEN;
+    key.mv_data = (void *)digest;
+
+    memset(&dc_info, 0x0, sizeof(dc_info));
+    dc_info.src_ip   = spa_pkt->packet_src_addr;
+    dc_info.dst_ip   = spa_pkt->packet_dst_addr;
+    dc_info.src_port = spa_pkt->packet_src_port;
+    dc_info.dst_port = spa_pkt->packet_dst_port;
+    dc_info.proto    = spa_pkt->packet_proto;
+    dc_info.created  = spa_pkt->arrival_time;
+
+    /* MDB_NOOVERWRITE also catches the same packet having been added by
+     * another worker since it passed is_replay().
+    */
+    rv = replay_lmdb_put(rc, &key, &dc_info, MDB_NOOVERWRITE);
+    if(rv == MDB_KEYEXIST)
+        return(SPA_MSG_REPLAY);
+
+    if(rv != 0)
+    {
+        log_msg(LOG_WARNING, "Error adding entry digest_cache: %s",
+            mdb_strerror(rv));
+        return(SPA_MSG_DIGEST_CACHE_ERROR);
+    }
+
+    replay_lmdb_sync(rc, dc_info.created, 0);
+
+    return(SPA_MSG_SUCCESS);
+}
+
+#else /* USE_FILE_CACHE */
+
+#ifndef NO_DIGEST_CACHE
+/* Add every key in the db to an (empty) Bloom filter.  Returns the number
+ * of keys.
+*/
+static int
+replay_db_bloom_load(struct replay_bloom *bf, MY_DBM_T rpdb)
+{
+    datum       db_key;
+    int         db_count = 0;
+
+#ifdef HAVE_LIBGDBM
+    datum       db_next_key;
+
+    db_key = gdbm_firstkey(rpdb);
+
+    while (db_key.dptr != NULL)
+    {
+        db_count++;
+        replay_bloom_add(bf, (unsigned char *)db_key.dptr, db_key.dsize);
+        db_next_key = gdbm_nextkey(rpdb, db_key);
+        free(db_key.dptr);
+        db_key = db_next_key;
+    }
+#elif HAVE_LIBNDBM
+    for (db_key = dbm_firstkey(rpdb); db_key.dptr != NULL; db_key = dbm_nextkey(rpdb))
+    {
+        db_count++;
+        replay_bloom_add(bf, (unsigned char *)db_key.dptr, db_key.dsize);
+    }
+#endif
+
+    return(db_count);
+}
+
+/* Fill a new Bloom filter from the db, leaving room for at least as many
+ * keys again.  Returns the number of keys in the db.
+*/
+static int
+replay_db_bloom_rebuild(struct replay_bloom *bf, MY_DBM_T rpdb,
+        const unsigned int capacity)
+{
+    int         db_count;
+
+    if(replay_bloom_alloc(bf, capacity) != 0)
+        log_msg(LOG_WARNING, "Could not allocate digest cache Bloom filter");
+
+    db_count = replay_db_bloom_load(bf, rpdb);
+
+    if(bf->bits != NULL && (unsigned int)db_count > bf->capacity / 2)
+    {
+        if(replay_bloom_alloc(bf, 2 * db_count) == 0)
+            replay_db_bloom_load(bf, rpdb);
+        else
+            log_msg(LOG_WARNING, "Could not allocate digest cache Bloom filter");
+    }
+
+    return(db_count);
+}
+#endif /* NO_DIGEST_CACHE */
+
+/* Check for the existence of the replay dbm file, and create it if it does
+ * not exist.  Returns the number of db entries or -1 on error.
+*/
+static int
+replay_db_cache_init(fko_srv_options_t *opts)
+{
+#ifdef NO_DIGEST_CACHE
+    return(-1);
+#else
+
+    MY_DBM_T    rpdb;
+    int         db_count = 0;
+
+    if(opts->digest_cache == NULL
+            && (opts->digest_cache = mem_calloc(MEM_TAG_REPLAY, 1,
+                    sizeof(struct replay_cache))) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] Could not allocate digest cache");
+        return(-1);
+    }
+
+#ifdef HAVE_LIBGDBM
+    rpdb = gdbm_open(
+        opts->config[CONF_DIGEST_DB_FILE], 512, GDBM_WRCREAT, S_IRUSR|S_IWUSR, 0
+    );
+#elif HAVE_LIBNDBM
+    rpdb = dbm_open(
+        opts->config[CONF_DIGEST_DB_FILE], O_RDWR|O_CREAT, S_IRUSR|S_IWUSR
+    );
+#endif
+
+    if(!rpdb)
+    {
+        log_msg(LOG_ERR,
+            "Unable to open digest cache file: '%s': %s",
+            opts->config[CONF_DIGEST_DB_FILE],
+            MY_DBM_STRERROR(errno)
+        );
+
+        return(-1);
+    }
+
+    /* Load every digest into the Bloom filter, which also counts them
+    */
+    db_count = replay_db_bloom_rebuild(&(opts->digest_cache->bloom), rpdb,
+            REPLAY_BLOOM_MIN_ENTRIES);
+
+    MY_DBM_CLOSE(rpdb);
+
+    return(db_count);
+#endif /* NO_DIGEST_CACHE */
+}
+#endif /* USE_FILE_CACHE */
+
+#if USE_FILE_CACHE
+static int
+is_replay_file_cache(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt,
+        const unsigned char *digest)
+{
+    time_t          cutoff = replay_cache_cutoff(opts, clock_cache_now());
+
+    digest_cache_info_t *info;
+
+    if(opts->digest_cache == NULL)
+        return(SPA_MSG_SUCCESS);
+
+    /* Entries that are too old to matter (see replay_cache_cutoff()) are
+     * ignored here and dropped with their slice on the next add.
+    */
+    if((info = replay_cache_find(opts->digest_cache, digest, cutoff)) != NULL)
+    {
+        replay_warning(opts, spa_pkt, info);
+
+        return(SPA_MSG_REPLAY);
+    }
+    return(SPA_MSG_SUCCESS);
+}
+
+static int
+add_replay_file_cache(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt,
+        const unsigned char *digest)
+{
+    time_t      now = clock_cache_now();
+
+    struct replay_cache *rc = opts->digest_cache;
+    digest_cache_info_t cache_info;
+    replay_log_rec_t    rec;
+
+    memset(&cache_info, 0x0, sizeof(cache_info));
+    cache_info.proto    = spa_pkt->packet_proto;
+    cache_info.src_ip   = spa_pkt->packet_src_addr;
+    cache_info.dst_ip   = spa_pkt->packet_dst_addr;
+    cache_info.src_port = spa_pkt->packet_src_port;
+    cache_info.dst_port = spa_pkt->packet_dst_port;
+    cache_info.created  = spa_pkt->arrival_time;
+
+    /* First, add the digest to the in-memory cache
+    */
+    if (rc == NULL || replay_cache_insert(rc, digest, &cache_info, now) != 0)
+    {
+        log_msg(LOG_WARNING, "Error adding SPA digest to the in-memory cache");
+        return(SPA_MSG_ERROR);
+    }
+
+    /* Now, append the record to the digest file.  If any slices have aged
+     * out, the whole file is rewritten from the cache instead.
+    */
+    if (replay_cache_expire(rc, replay_cache_cutoff(opts, now)) > 0)
+    {
+        replay_file_cache_compact(opts);
+        return(SPA_MSG_SUCCESS);
+    }
+
+    if (rc->log_fd == -1 && replay_log_open(opts) != 0)
+        return(SPA_MSG_DIGEST_CACHE_ERROR);
+
+    replay_log_rec_fill(&rec, digest, &cache_info);
+
+    if (write(rc->log_fd, &rec, sizeof(rec)) != (ssize_t)sizeof(rec))
+    {
+        /* Don't leave a partial record for later ones to follow
+        */
+        log_msg(LOG_WARNING,
+            "Did not write expected number of bytes to digest cache: %s",
+            opts->config[CONF_DIGEST_FILE]);
+        if (replay_file_cache_compact(opts) != 0)
+            return(SPA_MSG_DIGEST_CACHE_ERROR);
+        return(SPA_MSG_SUCCESS);
+    }
+
+    rc->unsynced++;
+    replay_log_sync(rc, now, 0);
+
+    return(SPA_MSG_SUCCESS);
+}
+#endif /* USE_FILE_CACHE */
+
+#if !USE_FILE_CACHE && !HAVE_LIBLMDB
+/* The db is keyed by the base64 digest without its '=' padding, as it
+ * always has been, so existing digest.db files still work.  Returns the
+ * key length.
+*/
+static int
+replay_db_key(const unsigned char *digest, char *key)
+{
+    char   *ndx;
+
+    fko_base64_encode((unsigned char *)digest, key, REPLAY_DIGEST_LEN);
+    if((ndx = strchr(key, '=')) != NULL)
+        *ndx = '\0';
+
+    return(strlen(key));
+}
+
+static int
+is_replay_dbm_cache(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt,
+        const unsigned char *digest)
+{
+#ifdef NO_DIGEST_CACHE
+    return 0;
+#else
+
+#ifdef HAVE_LIBGDBM
+    GDBM_FILE   rpdb;
+#elif HAVE_LIBNDBM
+    DBM        *rpdb;
+#endif
+    datum       db_key, db_ent;
+
+    int         digest_len, res = SPA_MSG_SUCCESS;
+    char        key[MAX_DIGEST_SIZE+1];
+
+    digest_len = replay_db_key(digest, key);
+
+    /* A digest the Bloom filter has never seen is not in the db either,
+     * so there is no need to open it.
+    */
+    if(opts->digest_cache != NULL
+            && ! replay_bloom_maybe(&(opts->digest_cache->bloom),
+                (unsigned char *)key, digest_len))
+        return(SPA_MSG_SUCCESS);
+
+    db_key.dptr = key;
+    db_key.dsize = digest_len;
+
+    /* Check the db for the key
+    */
+#ifdef HAVE_LIBGDBM
+    rpdb = gdbm_open(
+         opts->config[CONF_DIGEST_DB_FILE], 512, GDBM_WRCREAT, S_IRUSR|S_IWUSR, 0
+    );
+#elif HAVE_LIBNDBM
+    rpdb = dbm_open(opts->config[CONF_DIGEST_DB_FILE], O_RDWR, 0);
+#endif
+
+    if(!rpdb)
+    {
+        log_msg(LOG_WARNING, "Error opening digest_cache: '%s': %s",
+            opts->config[CONF_DIGEST_DB_FILE],
+            MY_DBM_STRERROR(errno)
+        );
+
+        return(SPA_MSG_DIGEST_CACHE_ERROR);
+    }
+
+    db_ent = MY_DBM_FETCH(rpdb, db_key);
+
+    /* If the datum is not null, we have a match.  Otherwise, we add
+    * this entry to the cache.
+    */
+    if(db_ent.dptr != NULL)
+    {
+        replay_warning(opts, spa_pkt, (digest_cache_info_t *)db_ent.dptr);
+
+        /* Save it back to the digest cache
+        */
+        if(MY_DBM_STORE(rpdb, db_key, db_ent, MY_DBM_REPLACE) != 0)
+            log_msg(LOG_WARNING, "Error updating entry in digest_cache: '%s': %s",
+                opts->config[CONF_DIGEST_DB_FILE],
+                MY_DBM_STRERROR(errno)
+            );
+
+#ifdef HAVE_LIBGDBM
+        free(db_ent.dptr);
+#endif
+        res = SPA_MSG_REPLAY;
+    }
+
+    MY_DBM_CLOSE(rpdb);
+
+    return(res);
+#endif /* NO_DIGEST_CACHE */
+}
+
+static int
+add_replay_dbm_cache(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt,
+        const unsigned char *digest)
+{
+#ifdef NO_DIGEST_CACHE
+    return 0;
+#else
+
+#ifdef HAVE_LIBGDBM
+    GDBM_FILE   rpdb;
+#elif HAVE_LIBNDBM
+    DBM        *rpdb;
+#endif
+    datum       db_key, db_ent;
+
+    int         digest_len, res = SPA_MSG_SUCCESS;
+    char        key[MAX_DIGEST_SIZE+1];
+
+    digest_cache_info_t dc_info;
+    struct replay_bloom *bf;
+
+    digest_len = replay_db_key(digest, key);
+
+    db_key.dptr = key;
+    db_key.dsize = digest_len;
+
+    /* Check the db for the key
+    */
+#ifdef HAVE_LIBGDBM
+    rpdb = gdbm_open(
+         opts->config[CONF_DIGEST_DB_FILE], 512, GDBM_WRCREAT, S_IRUSR|S_IWUSR, 0
+    );
+#elif HAVE_LIBNDBM
+    rpdb = dbm_open(opts->config[CONF_DIGEST_DB_FILE], O_RDWR, 0);
+#endif
+
+    if(!rpdb)
+    {
+        log_msg(LOG_WARNING, "Error opening digest_cache: '%s': %s",
+            opts->config[CONF_DIGEST_DB_FILE],
+            MY_DBM_STRERROR(errno)
+        );
+
+        return(SPA_MSG_DIGEST_CACHE_ERROR);
+    }
+
+    db_ent = MY_DBM_FETCH(rpdb, db_key);
+
+    /* If the datum is null, we have a new entry.
+    */
+    if(db_ent.dptr == NULL)
+    {
+        /* This is a new SPA packet that needs to be added to the cache.
+        */
+        dc_info.src_ip   = spa_pkt->packet_src_addr;
+        dc_info.dst_ip   = spa_pkt->packet_dst_addr;
+        dc_info.src_port = spa_pkt->packet_src_port;
+        dc_info.dst_port = spa_pkt->packet_dst_port;
+        dc_info.proto    = spa_pkt->packet_proto;
+        dc_info.created  = spa_pkt->arrival_time;
+        dc_info.first_replay = dc_info.last_replay = dc_info.replay_count = 0;
+
+        db_ent.dsize    = sizeof(digest_cache_info_t);
+        db_ent.dptr     = (char*)&(dc_info);
+
+        if(MY_DBM_STORE(rpdb, db_key, db_ent, MY_DBM_INSERT) != 0)
+        {
+            log_msg(LOG_WARNING, "Error adding entry digest_cache: %s",
+                MY_DBM_STRERROR(errno)
+            );
+
+            res = SPA_MSG_DIGEST_CACHE_ERROR;
+        }
+        else if(opts->digest_cache != NULL)
+        {
+            bf = &(opts->digest_cache->bloom);
+            if(bf->bits != NULL && bf->count >= bf->capacity)
+                replay_db_bloom_rebuild(bf, rpdb, 2 * bf->count);
+            else
+                replay_bloom_add(bf, (unsigned char *)key, digest_len);
+        }
+
+        res = SPA_MSG_SUCCESS;
+    }
+    else
+        res = SPA_MSG_DIGEST_CACHE_ERROR;
+
+    MY_DBM_CLOSE(rpdb);
+
+    return(res);
+#endif /* NO_DIGEST_CACHE */
+}
+#endif /* USE_FILE_CACHE */
+
+/* Append an entry to a snapshot array, growing it as needed
 */
-static void
-rotate_digest_cache_file(fko_srv_options_t *opts)
+static int
+replay_snapshot_add(replay_snapshot_ent_t **ents, int *count, int *size,
+        const unsigned char *digest, const digest_cache_info_t *info)
+{
+    replay_snapshot_ent_t  *new_ents;
+    int                     new_size;
+
+    if(*count == *size)
+    {
+        new_size = (*size == 0) ? 1024 : 2 * *size;
+        if((new_ents = realloc(*ents, new_size * sizeof(**ents))) == NULL)
+            return(-1);
+        *ents = new_ents;
+        *size = new_size;
+    }
+
+    memcpy((*ents)[*count].digest, digest, REPLAY_DIGEST_LEN);
+    (*ents)[*count].info = *info;
+    (*count)++;
+
+    return(0);
+}
+
+#if USE_FILE_CACHE
+static int
+replay_cache_snapshot_entries(fko_srv_options_t *opts, const time_t cutoff,
+        replay_snapshot_ent_t **ents, int *count, int *size)
+{
+    struct replay_cache *rc = opts->digest_cache;
+    struct replay_slice *rs;
+    unsigned int         slot;
+    int                  i;
+
+    if(rc == NULL)
+        return(0);
+
+    for(i=0; i <= REPLAY_CACHE_SLICES; i++)
+    {
+        rs = &(rc->slice[i]);
+        for(slot=0; slot < rs->slots; slot++)
+        {
+            if(! rs->used[slot] || rs->info[slot].created < cutoff)
+                continue;
+
+            if(replay_snapshot_add(ents, count, size,
+                    rs->digests + slot * REPLAY_DIGEST_LEN, &(rs->info[slot])) != 0)
+                return(-1);
+        }
+    }
+    return(0);
+}
+#elif HAVE_LIBLMDB
+static int
+replay_cache_snapshot_entries(fko_srv_options_t *opts, const time_t cutoff,
+        replay_snapshot_ent_t **ents, int *count, int *size)
+{
+    struct replay_cache *rc = opts->digest_cache;
+    MDB_txn            *txn = NULL;
+    MDB_cursor         *cur = NULL;
+    MDB_val             key, val;
+    digest_cache_info_t info;
+    int                 rv, res = 0;
+
+    if(rc == NULL)
+        return(0);
+
+    if(mdb_txn_begin(rc->env, NULL, MDB_RDONLY, &txn) != 0)
+        return(-1);
+
+    if(mdb_cursor_open(txn, rc->dbi, &cur) != 0)
+    {
+        mdb_txn_abort(txn);
+        return(-1);
+    }
+
+    for(rv = mdb_cursor_get(cur, &key, &val, MDB_FIRST); rv == 0;
+            rv = mdb_cursor_get(cur, &key, &val, MDB_NEXT))
+    {
+        if(key.mv_size != REPLAY_DIGEST_LEN)
+            continue;
+
+        memset(&info, 0x0, sizeof(info));
+        memcpy(&info, val.mv_data,
+            val.mv_size < sizeof(info) ? val.mv_size : sizeof(info));
+        if(info.created < cutoff)
+            continue;
+
+        if(replay_snapshot_add(ents, count, size, key.mv_data, &info) != 0)
+        {
+            res = -1;
+            break;
+        }
+    }
+
+    mdb_cursor_close(cur);
+    mdb_txn_abort(txn);
+
+    return(res);
+}
+#elif !defined(NO_DIGEST_CACHE)
+/* Only called for keys the db returned, so the key fits in a datum
+*/
+static int
+replay_db_snapshot_key(fko_srv_options_t *opts, MY_DBM_T rpdb, datum db_key,
+        const time_t cutoff, replay_snapshot_ent_t **ents, int *count, int *size)
+{
+    char                key[MAX_DIGEST_SIZE+1];
+    unsigned char       digest[MAX_DIGEST_SIZE+1];
+    digest_cache_info_t info;
+    datum               db_ent;
+    int                 res = 0;
+
+    if(db_key.dsize > MAX_DIGEST_SIZE)
+        return(0);
+
+    memcpy(key, db_key.dptr, db_key.dsize);
+    key[db_key.dsize] = '\0';
+
+    if(fko_base64_decode(key, digest) != REPLAY_DIGEST_LEN)
+        return(0);
+
+    db_ent = MY_DBM_FETCH(rpdb, db_key);
+    if(db_ent.dptr == NULL)
+        return(0);
+
+    memset(&info, 0x0, sizeof(info));
+    memcpy(&info, db_ent.dptr,
+        (size_t)db_ent.dsize < sizeof(info) ? (size_t)db_ent.dsize : sizeof(info));
+#ifdef HAVE_LIBGDBM
+    free(db_ent.dptr);
+#endif
+
+    if(info.created >= cutoff)
+        res = replay_snapshot_add(ents, count, size, digest, &info);
+
+    return(res);
+}
+
+static int
+replay_cache_snapshot_entries(fko_srv_options_t *opts, const time_t cutoff,
+        replay_snapshot_ent_t **ents, int *count, int *size)
+{
+    MY_DBM_T    rpdb;
+    datum       db_key;
+    int         res = 0;
+
+#ifdef HAVE_LIBGDBM
+    datum       db_next_key;
+
+    rpdb = gdbm_open(opts->config[CONF_DIGEST_DB_FILE], 512, GDBM_READER,
+            S_IRUSR|S_IWUSR, 0);
+#elif HAVE_LIBNDBM
+    rpdb = dbm_open(opts->config[CONF_DIGEST_DB_FILE], O_RDONLY, 0);
+#endif
+
+    if(!rpdb)
+        return(-1);
+
+#ifdef HAVE_LIBGDBM
+    db_key = gdbm_firstkey(rpdb);
+    while (db_key.dptr != NULL)
+    {
+        if(res == 0)
+            res = replay_db_snapshot_key(opts, rpdb, db_key, cutoff,
+                    ents, count, size);
+        db_next_key = gdbm_nextkey(rpdb, db_key);
+        free(db_key.dptr);
+        db_key = db_next_key;
+    }
+#elif HAVE_LIBNDBM
+    for (db_key = dbm_firstkey(rpdb); db_key.dptr != NULL && res == 0;
+            db_key = dbm_nextkey(rpdb))
+        res = replay_db_snapshot_key(opts, rpdb, db_key, cutoff,
+                ents, count, size);
+#endif
+
+    MY_DBM_CLOSE(rpdb);
+
+    return(res);
+}
+#endif
+
+/* Copy every entry that is still inside the replay window into a new
+ * array, for sending to a standby (see replay_gossip.c).  Returns the
+ * number of entries, with *ents to be freed by the caller, or -1 on
+ * error.
+*/
+int
+replay_cache_snapshot(fko_srv_options_t *opts, replay_snapshot_ent_t **ents)
 {
 #ifdef NO_DIGEST_CACHE
-    log_msg(LOG_WARNING, "Digest cache not supported. Nothing to rotate.");
+    return(-1);
 #else
-    int         res;
-    char       *new_file = NULL;
+    time_t      cutoff = 0;
+    int         count = 0, size = 0, res;
 
-    log_msg(LOG_INFO, "Rotating digest cache file.");
+    *ents = NULL;
 
-#if USE_FILE_CACHE
-    new_file = calloc(1, strlen(opts->config[CONF_DIGEST_FILE])+5);
+    if(opts->rt->spa_packet_aging && opts->rt->max_spa_packet_age > 0)
+        cutoff = time(NULL) - 2 * (time_t)opts->rt->max_spa_packet_age;
+
+    if(pthread_mutex_lock(&(opts->replay_cache_mutex)))
+    {
+        log_msg(LOG_ERR, "Mutex lock error.");
+        return(-1);
+    }
+
+    res = replay_cache_snapshot_entries(opts, cutoff, ents, &count, &size);
+
+    pthread_mutex_unlock(&(opts->replay_cache_mutex));
+
+    if(res != 0)
+    {
+        log_msg(LOG_WARNING, "Unable to take a snapshot of the digest cache");
+        free(*ents);
+        *ents = NULL;
+        return(-1);
+    }
+
+    return(count);
+#endif /* NO_DIGEST_CACHE */
+}
+
+/* Add a digest learned from another server.  Unlike add_replay() a
+ * digest that is already cached is not reported as a replay.  Returns
+ * SPA_MSG_SUCCESS if the digest was added and SPA_MSG_REPLAY if it was
+ * already there.
+*/
+int
+import_replay(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt,
+        const unsigned char *digest)
+{
+#ifdef NO_DIGEST_CACHE
+    return(-1);
 #else
-    new_file = calloc(1, strlen(opts->config[CONF_DIGEST_DB_FILE])+5);
-#endif
+    int     res;
 
-    if(new_file == NULL)
+    if(pthread_mutex_lock(&(opts->replay_cache_mutex)))
     {
-        log_msg(LOG_ERR, "rotate_digest_cache_file: Memory allocation error.");
-        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+        log_msg(LOG_ERR, "Mutex lock error.");
+        return(SPA_MSG_DIGEST_CACHE_ERROR);
     }
 
-    /* The new filename is just the original with a trailing '-old'.
-    */
 #if USE_FILE_CACHE
-    strlcpy(new_file, opts->config[CONF_DIGEST_FILE],
-        strlen(opts->config[CONF_DIGEST_FILE])+5);
-    strlcat(new_file, "-old",
-            strlen(opts->config[CONF_DIGEST_FILE])+5);
+    if(opts->digest_cache != NULL && replay_cache_find(opts->digest_cache,
+            digest, replay_cache_cutoff(opts, clock_cache_now())) != NULL)
+        res = SPA_MSG_REPLAY;
+    else
+        res = add_replay_file_cache(opts, spa_pkt, digest);
+#elif HAVE_LIBLMDB
+    res = add_replay_lmdb_cache(opts, spa_pkt, digest);
 #else
-    strlcpy(new_file, opts->config[CONF_DIGEST_DB_FILE],
-        strlen(opts->config[CONF_DIGEST_DB_FILE])+5);
-    strlcat(new_file, "-old",
-            strlen(opts->config[CONF_DIGEST_DB_FILE])+5);
+    /* Adding a key that is already there fails without a replay warning
+    */
+    res = add_replay_dbm_cache(opts, spa_pkt, digest);
+    if(res == SPA_MSG_DIGEST_CACHE_ERROR)
+        res = SPA_MSG_REPLAY;
 #endif
 
+    pthread_mutex_unlock(&(opts->replay_cache_mutex));
+
+    return(res);
+#endif /* NO_DIGEST_CACHE */
+}
+
+/* Counters for dump_replay_cache_stats().  They are updated from any
+ * thread without the replay cache lock, so only atomic adds are used.
+*/
+static struct {
+    unsigned long       hits;
+    unsigned long       misses;
+    unsigned long       errors;
+    unsigned long       in_flight;      /* Copies caught by replay_claim() */
+    unsigned long       adds;
+    unsigned long       add_errors;
+    unsigned long long  lookup_ns;
+    unsigned long       lookup_hist[REPLAY_STATS_HIST_BUCKETS];
+    time_t              since;
+} replay_stats;
+
+static void
+replay_stats_reset(void)
+{
+    memset(&replay_stats, 0x0, sizeof(replay_stats));
+    replay_stats.since = time(NULL);
+    return;
+}
+
+/* Lookup latencies go into power of two buckets: bucket i counts
+ * lookups that took less than 2^(i+1) ns, and the last bucket also
+ * takes anything slower.
+*/
+static void
+replay_stats_lookup(const int res, const struct timespec *start,
+        const struct timespec *end)
+{
+    unsigned long long  ns;
+    int                 bucket = 0;
+
+    ns = (unsigned long long)(end->tv_sec - start->tv_sec) * 1000000000ULL
+        + end->tv_nsec - start->tv_nsec;
+
+    while(bucket < REPLAY_STATS_HIST_BUCKETS - 1 && (ns >> (bucket + 1)) != 0)
+        bucket++;
+
+    __sync_fetch_and_add(&(replay_stats.lookup_hist[bucket]), 1);
+    __sync_fetch_and_add(&(replay_stats.lookup_ns), ns);
+
+    if(res == SPA_MSG_SUCCESS)
+        __sync_fetch_and_add(&(replay_stats.misses), 1);
+    else if(res == SPA_MSG_REPLAY)
+        __sync_fetch_and_add(&(replay_stats.hits), 1);
+    else
+        __sync_fetch_and_add(&(replay_stats.errors), 1);
+
+    return;
+}
+
+/* Number of digests in the cache.  Called with the replay cache mutex
+ * held.
+*/
 #if USE_FILE_CACHE
-    res = rename(opts->config[CONF_DIGEST_FILE], new_file);
+static unsigned long
+replay_cache_count(fko_srv_options_t *opts)
+{
+    unsigned long   entries = 0;
+    int             i;
+
+    if(opts->digest_cache == NULL)
+        return(0);
+
+    for(i=0; i <= REPLAY_CACHE_SLICES; i++)
+        entries += opts->digest_cache->slice[i].count;
+
+    return(entries);
+}
+#elif HAVE_LIBLMDB
+static unsigned long
+replay_cache_count(fko_srv_options_t *opts)
+{
+    MDB_stat        st;
+    MDB_txn        *txn = NULL;
+
+    if(opts->digest_cache == NULL
+            || mdb_txn_begin(opts->digest_cache->env, NULL, MDB_RDONLY, &txn) != 0)
+        return(0);
+    if(mdb_stat(txn, opts->digest_cache->dbi, &st) != 0)
+        st.ms_entries = 0;
+    mdb_txn_abort(txn);
+
+    return((unsigned long)st.ms_entries);
+}
 #else
-    res = rename(opts->config[CONF_DIGEST_DB_FILE], new_file);
+static unsigned long
+replay_cache_count(fko_srv_options_t *opts)
+{
+    /* The Bloom filter has seen every key in the db
+    */
+    return(opts->digest_cache == NULL ? 0 : opts->digest_cache->bloom.count);
+}
 #endif
 
-    if(res < 0)
-        log_msg(LOG_ERR, "Unable to rename digest file: %s to %s: %s",
-#if USE_FILE_CACHE
-            opts->config[CONF_DIGEST_FILE], new_file, strerror(errno)
+/* Number of digests in the cache, for the metrics endpoint.
+*/
+unsigned long
+replay_cache_entries(fko_srv_options_t *opts)
+{
+#ifdef NO_DIGEST_CACHE
+    (void)opts;
+    return(0);
 #else
-            opts->config[CONF_DIGEST_DB_FILE], new_file, strerror(errno)
-#endif
-        );
+    unsigned long   entries;
+
+    if(! opts->rt->digest_persistence
+            || pthread_mutex_lock(&(opts->replay_cache_mutex)) != 0)
+        return(0);
+
+    entries = replay_cache_count(opts);
+
+    pthread_mutex_unlock(&(opts->replay_cache_mutex));
+
+    return(entries);
 #endif /* NO_DIGEST_CACHE */
+}
+
+/* Print the size of the cache.  Called with the replay cache mutex held.
+*/
+#if USE_FILE_CACHE
+static void
+replay_cache_usage(fko_srv_options_t *opts, FILE *dest)
+{
+    struct replay_cache *rc = opts->digest_cache;
+    struct replay_slice *rs;
+    unsigned long        entries = 0, bytes;
+    char                 start[DATE_LEN] = {0};
+    int                  i;
+
+    if(rc == NULL)
+    {
+        fprintf(dest, "    Cache not loaded\n");
+        return;
+    }
+
+    bytes = sizeof(*rc)
+        + (unsigned long)rc->bloom.blocks * REPLAY_BLOOM_BLOCK_WORDS * sizeof(uint64_t);
+
+    for(i=0; i <= REPLAY_CACHE_SLICES; i++)
+    {
+        rs = &(rc->slice[i]);
+        if(rs->slots == 0)
+            continue;
+
+        entries += rs->count;
+        bytes   += (unsigned long)rs->slots
+            * (REPLAY_DIGEST_LEN + sizeof(digest_cache_info_t) + 1);
+
+        strftime(start, DATE_LEN, "%D %H:%M:%S", localtime(&(rs->start)));
+        fprintf(dest, "    Slice %i: %u/%u slots used (%u%%), started %s\n",
+            i, rs->count, rs->slots, rs->count * 100 / rs->slots, start);
+    }
+
+    fprintf(dest, "    Slice length: %lis%s\n", (long)rc->slice_len,
+        rc->slice_len == 0 ? " (no expiry)" : "");
+    fprintf(dest, "    Bloom filter: %u/%u entries\n",
+        rc->bloom.count, rc->bloom.capacity);
+    fprintf(dest, "    Entries: %lu, memory: %lu bytes\n", entries, bytes);
 
-    free(new_file);
     return;
 }
-
+#elif HAVE_LIBLMDB
 static void
-replay_warning(fko_srv_options_t *opts, digest_cache_info_t *digest_info)
+replay_cache_usage(fko_srv_options_t *opts, FILE *dest)
 {
-    char        src_ip[INET_ADDRSTRLEN+1] = {0};
-    char        orig_src_ip[INET_ADDRSTRLEN+1] = {0};
-    char        created[DATE_LEN] = {0};
-
-#if ! USE_FILE_CACHE
-    char        first[DATE_LEN] = {0}, last[DATE_LEN] = {0};
-#endif
-
-    /* Convert the IPs to a human readable form
-    */
-    inet_ntop(AF_INET, &(opts->spa_pkt.packet_src_ip),
-        src_ip, INET_ADDRSTRLEN);
-    inet_ntop(AF_INET, &(digest_info->src_ip), orig_src_ip, INET_ADDRSTRLEN);
-
-#if ! USE_FILE_CACHE
-    /* Mark the last_replay time.
-    */
-    digest_info->last_replay = time(NULL);
+    struct replay_cache *rc = opts->digest_cache;
+    MDB_stat            st;
+    MDB_envinfo         info;
+    MDB_txn            *txn = NULL;
 
-    /* Increment the replay count and check to see if it is the first one.
-    */
-    if(++(digest_info->replay_count) == 1)
+    if(rc == NULL)
     {
-        /* This is the first replay so make it the same as last_replay
-        */
-        digest_info->first_replay = digest_info->last_replay;
+        fprintf(dest, "    Cache not loaded\n");
+        return;
     }
 
-    strftime(first, DATE_LEN, "%D %H:%M:%S", localtime(&(digest_info->first_replay)));
-    strftime(last, DATE_LEN, "%D %H:%M:%S", localtime(&(digest_info->last_replay)));
-#endif
+    if(mdb_txn_begin(rc->env, NULL, MDB_RDONLY, &txn) != 0)
+        return;
+    if(mdb_stat(txn, rc->dbi, &st) != 0)
+        memset(&st, 0x0, sizeof(st));
+    mdb_txn_abort(txn);
 
-    strftime(created, DATE_LEN, "%D %H:%M:%S", localtime(&(digest_info->created)));
+    if(mdb_env_info(rc->env, &info) != 0)
+        memset(&info, 0x0, sizeof(info));
 
-    log_msg(LOG_WARNING,
-        "Replay detected from source IP: %s, "
-        "Destination proto/port: %d/%d, "
-        "Original source IP: %s, "
-        "Original dst proto/port: %d/%d, "
-#if USE_FILE_CACHE
-        "Entry created: %s",
-#else
-        "Entry created: %s, "
-        "First replay: %s, "
-        "Last replay: %s, "
-        "Replay count: %i",
-#endif
-        src_ip,
-        opts->spa_pkt.packet_proto,
-        opts->spa_pkt.packet_dst_port,
-        orig_src_ip,
-        digest_info->proto,
-        digest_info->dst_port,
-#if USE_FILE_CACHE
-        created
+    fprintf(dest, "    Entries: %lu, db size: %lu bytes (map %lu bytes)\n",
+        (unsigned long)st.ms_entries,
+        (unsigned long)(info.me_last_pgno + 1) * st.ms_psize,
+        (unsigned long)info.me_mapsize);
+
+    return;
+}
 #else
-        created,
-        first,
-        last,
-        digest_info->replay_count
-#endif
-    );
+static void
+replay_cache_usage(fko_srv_options_t *opts, FILE *dest)
+{
+    struct stat     st;
+
+    /* The Bloom filter has seen every key in the db
+    */
+    if(opts->digest_cache != NULL)
+        fprintf(dest, "    Entries: %u, Bloom filter memory: %lu bytes\n",
+            opts->digest_cache->bloom.count,
+            (unsigned long)opts->digest_cache->bloom.blocks
+                * REPLAY_BLOOM_BLOCK_WORDS * sizeof(uint64_t));
+
+    if(stat(opts->config[CONF_DIGEST_DB_FILE], &st) == 0)
+        fprintf(dest, "    db size: %lu bytes\n", (unsigned long)st.st_size);
 
     return;
 }
+#endif
 
-#if USE_FILE_CACHE
-static int
-replay_file_cache_init(fko_srv_options_t *opts)
+/* Dump the replay cache counters and size along with the config (on
+ * SIGUSR1).
+*/
+void
+dump_replay_cache_stats(fko_srv_options_t *opts)
 {
-    FILE           *digest_file_ptr = NULL;
-    unsigned int    num_lines = 0, digest_ctr = 0;
-    char            line_buf[MAX_LINE_LEN]    = {0};
-    char            src_ip[INET_ADDRSTRLEN+1] = {0};
-    char            dst_ip[INET_ADDRSTRLEN+1] = {0};
-    long int        time_tmp;
-    int             digest_file_fd = -1;
-    char            digest_header[] = "# <digest> <proto> <src_ip> <src_port> <dst_ip> <dst_port> <time>\n";
+    int             i, opened = 0;
+    unsigned long   lookups;
+    time_t          elapsed;
+    FILE           *dest = NULL;
 
-    struct digest_cache_list *digest_elm = NULL;
+    if(! opts->rt->digest_persistence)
+        return;
 
-    /* if the file exists, import the previous SPA digests into
-     * the cache list
-    */
-    if (access(opts->config[CONF_DIGEST_FILE], F_OK) == 0)
-    {
-        /* Check permissions
-        */
-        if (access(opts->config[CONF_DIGEST_FILE], R_OK|W_OK) != 0)
-        {
-            log_msg(LOG_WARNING, "Digest file '%s' exists but: '%s'",
-                opts->config[CONF_DIGEST_FILE], strerror(errno));
-            return(-1);
-        }
-    }
-    else
+    if(opts->config[CONF_CONFIG_DUMP_OUTPUT_PATH] != NULL &&
+       opts->foreground == 0)
     {
-        /* the file does not exist yet, so it will be created when the first
-         * successful SPA packet digest is written to disk
-        */
-        digest_file_fd = open(opts->config[CONF_DIGEST_FILE],
-                O_WRONLY|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR);
-
-        if (digest_file_fd == -1)
+        dest = fopen(opts->config[CONF_CONFIG_DUMP_OUTPUT_PATH], "a");
+        if(dest == NULL)
         {
-            log_msg(LOG_WARNING, "Could not create digest cache: %s: %s",
-                opts->config[CONF_DIGEST_FILE], strerror(errno));
-            return(-1);
+            fprintf(stderr, "ERROR opening file for dump_config output: %s\n",
+                    opts->config[CONF_CONFIG_DUMP_OUTPUT_PATH]);
+            dest = stdout;
         }
         else
         {
-            if(write(digest_file_fd, digest_header, strlen(digest_header))
-                    != strlen(digest_header)) {
-                log_msg(LOG_WARNING,
-                    "Did not write expected number of bytes to digest cache: %s",
-                    opts->config[CONF_DIGEST_FILE]);
-            }
-            close(digest_file_fd);
-
-            return(0);
+            opened = 1;
         }
     }
+    else
+    {
+        dest = stdout;
+    }
 
-    if(verify_file_perms_ownership(opts->config[CONF_DIGEST_FILE]) != 1)
-        return(-1);
+    elapsed = time(NULL) - replay_stats.since;
+    lookups = replay_stats.hits + replay_stats.misses + replay_stats.errors;
 
-    /* File exists, and we have access - create in-memory digest cache
-    */
-    if ((digest_file_ptr = fopen(opts->config[CONF_DIGEST_FILE], "r")) == NULL)
+    fprintf(dest, "Replay cache statistics (last %li seconds):\n", (long)elapsed);
+
+#ifndef NO_DIGEST_CACHE
+    if(pthread_mutex_lock(&(opts->replay_cache_mutex)) == 0)
     {
-        log_msg(LOG_WARNING, "Could not open digest cache: %s",
-            opts->config[CONF_DIGEST_FILE]);
-        return(-1);
+        replay_cache_usage(opts, dest);
+        pthread_mutex_unlock(&(opts->replay_cache_mutex));
     }
+#endif
 
-    /* Line format:
-     * <digest> <proto> <src_ip> <src_port> <dst_ip> <dst_port> <time>
-     * Example:
-     * 7XgadOyqv0tF5xG8uhg2iIrheeNKglCWKmxQDgYP1dY 17 127.0.0.1 40305 127.0.0.1 62201 1313283481
-    */
-    while ((fgets(line_buf, MAX_LINE_LEN, digest_file_ptr)) != NULL)
-    {
-        num_lines++;
-        line_buf[MAX_LINE_LEN-1] = '\0';
+    fprintf(dest, "    Lookups: %lu (%lu hits, %lu misses, %lu errors), "
+        "in-flight copies: %lu\n",
+        lookups, replay_stats.hits, replay_stats.misses, replay_stats.errors,
+        replay_stats.in_flight);
+    fprintf(dest, "    Adds: %lu (%lu errors), %.2f/s\n",
+        replay_stats.adds, replay_stats.add_errors,
+        elapsed > 0 ? (double)replay_stats.adds / elapsed : 0.0);
 
-        if(IS_EMPTY_LINE(line_buf[0]))
-            continue;
+    if(lookups > 0)
+    {
+        fprintf(dest, "    Lookup latency: mean %lluns\n",
+            replay_stats.lookup_ns / lookups);
+        for(i=0; i < REPLAY_STATS_HIST_BUCKETS; i++)
+            if(replay_stats.lookup_hist[i] > 0)
+                fprintf(dest, "      %s%12lluns: %lu\n",
+                    i == REPLAY_STATS_HIST_BUCKETS - 1 ? ">=" : " <",
+                    i == REPLAY_STATS_HIST_BUCKETS - 1
+                        ? 1ULL << i : 1ULL << (i + 1),
+                    replay_stats.lookup_hist[i]);
+    }
 
-        /* Initialize a digest cache list element, and add it into the list if
-         * valid.
-        */
-        if ((digest_elm = calloc(1, sizeof(struct digest_cache_list))) == NULL)
-        {
-            log_msg(LOG_ERR, "[*] Could not allocate digest list element");
-            continue;
-        }
-        if ((digest_elm->cache_info.digest = calloc(1, MAX_DIGEST_SIZE+1)) == NULL)
-        {
-            free(digest_elm);
-            log_msg(LOG_ERR, "[*] Could not allocate digest string");
-            continue;
-        }
-        src_ip[0] = '\0';
-        dst_ip[0] = '\0';
+    fprintf(dest, "\n");
+    fflush(dest);
 
-        if(sscanf(line_buf, "%64s %hhu %16s %hu %16s %hu %ld",
-            digest_elm->cache_info.digest,  /* %64s, buffer size is MAX_DIGEST_SIZE+1 */
-            &(digest_elm->cache_info.proto),
-            src_ip,  /* %16s, buffer size is INET_ADDRSTRLEN+1 */
-            &(digest_elm->cache_info.src_port),
-            dst_ip,  /* %16s, buffer size is INET_ADDRSTRLEN+1 */
-            &(digest_elm->cache_info.dst_port),
-            &time_tmp) != 7)
-        {
-            log_msg(LOG_INFO,
-                "*Skipping invalid digest file entry in %s at line %i.\n - %s",
-                opts->config[CONF_DIGEST_FILE], num_lines, line_buf
-            );
-            free(digest_elm->cache_info.digest);
-            free(digest_elm);
-            continue;
-        }
-        digest_elm->cache_info.created = time_tmp;
+    if(opened)
+        fclose(dest);
 
+    return;
+}
 
-        if (inet_pton(AF_INET, src_ip, &(digest_elm->cache_info.src_ip)) != 1)
-        {
-            free(digest_elm->cache_info.digest);
-            free(digest_elm);
-            continue;
-        }
+/* Free replay cache memory
+*/
+void
+free_replay_list(fko_srv_options_t *opts)
+{
+#ifdef NO_DIGEST_CACHE
+    return;
+#endif
 
-        if (inet_pton(AF_INET, dst_ip, &(digest_elm->cache_info.dst_ip)) != 1)
-        {
-            free(digest_elm->cache_info.digest);
-            free(digest_elm);
-            continue;
-        }
+#if AFL_FUZZING
+    if(opts->afl_fuzzing)
+        return;
+#endif
 
-        digest_elm->next   = opts->digest_cache;
-        opts->digest_cache = digest_elm;
-        digest_ctr++;
+#if USE_FILE_CACHE
+    replay_cache_free(opts->digest_cache);
+#elif HAVE_LIBLMDB
+    replay_lmdb_free(opts->digest_cache);
+#else
+    if(opts->digest_cache != NULL)
+        replay_bloom_free(&(opts->digest_cache->bloom));
+    mem_free(MEM_TAG_REPLAY, opts->digest_cache);
+#endif
+    opts->digest_cache = NULL;
 
-        if(opts->verbose > 3)
-            log_msg(LOG_DEBUG,
-                "DIGEST FILE: %s, VALID LINE: %s",
-                opts->config[CONF_DIGEST_FILE], line_buf
-            );
+    return;
+}
 
+/* Flush digest cache writes that are still waiting for the sync
+ * interval.  This is called from the server timers so that the last
+ * records of a burst do not wait for another packet to be flushed.
+*/
+void
+replay_cache_sync(fko_srv_options_t *opts)
+{
+#if (USE_FILE_CACHE || HAVE_LIBLMDB) && !defined(NO_DIGEST_CACHE)
+    if(pthread_mutex_lock(&(opts->replay_cache_mutex)))
+    {
+        log_msg(LOG_ERR, "Mutex lock error.");
+        return;
     }
 
-    fclose(digest_file_ptr);
+    if(opts->digest_cache != NULL)
+  #if USE_FILE_CACHE
+        replay_log_sync(opts->digest_cache, clock_cache_now(), 0);
+  #else
+        replay_lmdb_sync(opts->digest_cache, clock_cache_now(), 0);
+  #endif
 
-    return(digest_ctr);
+    pthread_mutex_unlock(&(opts->replay_cache_mutex));
+#endif
+    return;
 }
 
-#else /* USE_FILE_CACHE */
-
-/* Check for the existence of the replay dbm file, and create it if it does
- * not exist.  Returns the number of db entries or -1 on error.
-*/
-static int
-replay_db_cache_init(fko_srv_options_t *opts)
+int
+replay_cache_init(fko_srv_options_t *opts)
 {
 #ifdef NO_DIGEST_CACHE
     return(-1);
 #else
 
-#ifdef HAVE_LIBGDBM
-    GDBM_FILE   rpdb;
-#elif HAVE_LIBNDBM
-    DBM        *rpdb;
-    datum       db_ent;
-#endif
+    /* If rotation was specified, do it.
+    */
+    if(opts->rotate_digest_cache)
+        rotate_digest_cache_file(opts);
 
-    datum       db_key, db_next_key;
-    int         db_count = 0;
+    replay_stats_reset();
 
-#ifdef HAVE_LIBGDBM
-    rpdb = gdbm_open(
-        opts->config[CONF_DIGEST_DB_FILE], 512, GDBM_WRCREAT, S_IRUSR|S_IWUSR, 0
-    );
-#elif HAVE_LIBNDBM
-    rpdb = dbm_open(
-        opts->config[CONF_DIGEST_DB_FILE], O_RDWR|O_CREAT, S_IRUSR|S_IWUSR
-    );
+#if USE_FILE_CACHE
+    return replay_file_cache_init(opts);
+#elif HAVE_LIBLMDB
+    return replay_lmdb_cache_init(opts);
+#else
+    return replay_db_cache_init(opts);
 #endif
 
-    if(!rpdb)
-    {
-        log_msg(LOG_ERR,
-            "Unable to open digest cache file: '%s': %s",
-            opts->config[CONF_DIGEST_DB_FILE],
-            MY_DBM_STRERROR(errno)
-        );
+#endif /* NO_DIGEST_CACHE */
+}
 
-        return(-1);
-    }
+int
+add_replay(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt,
+        const unsigned char *digest)
+{
+#ifdef NO_DIGEST_CACHE
+    return(-1);
+#else
+    int     res;
 
-#ifdef HAVE_LIBGDBM
-    db_key = gdbm_firstkey(rpdb);
+    if(digest == NULL)
+    {
+        log_msg(LOG_WARNING, "NULL digest passed into add_replay()");
+        return(SPA_MSG_DIGEST_CACHE_ERROR);
+    }
 
-    while (db_key.dptr != NULL)
+    if(pthread_mutex_lock(&(opts->replay_cache_mutex)))
     {
-        db_count++;
-        db_next_key = gdbm_nextkey(rpdb, db_key);
-        free(db_key.dptr);
-        db_key = db_next_key;
+        log_msg(LOG_ERR, "Mutex lock error.");
+        return(SPA_MSG_DIGEST_CACHE_ERROR);
     }
-#elif HAVE_LIBNDBM
-    for (db_key = dbm_firstkey(rpdb); db_ent.dptr != NULL; db_key = dbm_nextkey(rpdb))
-        db_count++;
+
+#if USE_FILE_CACHE
+    /* With more than one UDP server worker, the same SPA packet could
+     * have passed is_replay() in two workers at once, so check again
+     * while we hold the lock.
+    */
+    res = is_replay_file_cache(opts, spa_pkt, digest);
+    if(res == SPA_MSG_SUCCESS)
+        res = add_replay_file_cache(opts, spa_pkt, digest);
+#elif HAVE_LIBLMDB
+    res = add_replay_lmdb_cache(opts, spa_pkt, digest);
+#else
+    res = add_replay_dbm_cache(opts, spa_pkt, digest);
 #endif
 
-    MY_DBM_CLOSE(rpdb);
+    pthread_mutex_unlock(&(opts->replay_cache_mutex));
 
-    return(db_count);
+    if(res == SPA_MSG_SUCCESS)
+        __sync_fetch_and_add(&(replay_stats.adds), 1);
+    else
+        __sync_fetch_and_add(&(replay_stats.add_errors), 1);
+
+    return(res);
 #endif /* NO_DIGEST_CACHE */
 }
-#endif /* USE_FILE_CACHE */
 
-#if USE_FILE_CACHE
 static int
-is_replay_file_cache(fko_srv_options_t *opts, char *digest)
+replay_cache_lookup(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt,
+        const unsigned char *digest)
 {
-    int         digest_len = 0;
-
-    struct digest_cache_list *digest_list_ptr = NULL;
-
-    digest_len = strlen(digest);
-
-    /* Check the cache for the SPA packet digest
+#ifdef NO_DIGEST_CACHE
+    return(-1);
+#elif HAVE_LIBLMDB && ! USE_FILE_CACHE
+    /* LMDB readers do not need the lock
     */
-    for (digest_list_ptr = opts->digest_cache;
-            digest_list_ptr != NULL;
-            digest_list_ptr = digest_list_ptr->next) {
+    return(is_replay_lmdb_cache(opts, spa_pkt, digest));
+#else
+    int     res;
+
+    if(pthread_mutex_lock(&(opts->replay_cache_mutex)))
+    {
+        log_msg(LOG_ERR, "Mutex lock error.");
+        return(SPA_MSG_DIGEST_CACHE_ERROR);
+    }
 
-        if (constant_runtime_cmp(digest_list_ptr->cache_info.digest,
-                    digest, digest_len) == 0) {
+#if USE_FILE_CACHE
+    res = is_replay_file_cache(opts, spa_pkt, digest);
+#else
+    res = is_replay_dbm_cache(opts, spa_pkt, digest);
+#endif
 
-            replay_warning(opts, &(digest_list_ptr->cache_info));
+    pthread_mutex_unlock(&(opts->replay_cache_mutex));
 
-            return(SPA_MSG_REPLAY);
-        }
-    }
-    return(SPA_MSG_SUCCESS);
+    return(res);
+#endif /* NO_DIGEST_CACHE */
 }
 
-static int
-add_replay_file_cache(fko_srv_options_t *opts, char *digest)
+/* Check the digest of a SPA packet against the replay cache.
+*/
+int
+is_replay(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt,
+        const unsigned char *digest)
 {
-    FILE       *digest_file_ptr = NULL;
-    int         digest_len = 0;
-    char        src_ip[INET_ADDRSTRLEN+1] = {0};
-    char        dst_ip[INET_ADDRSTRLEN+1] = {0};
+    struct timespec start, end;
+    int             res;
 
-    struct digest_cache_list *digest_elm = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    res = replay_cache_lookup(opts, spa_pkt, digest);
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
-    digest_len = strlen(digest);
+    replay_stats_lookup(res, &start, &end);
 
-    if ((digest_elm = calloc(1, sizeof(struct digest_cache_list))) == NULL)
-    {
-        log_msg(LOG_WARNING, "Error calloc() returned NULL for digest cache element",
-            fko_errstr(SPA_MSG_ERROR));
+    return(res);
+}
 
-        return(SPA_MSG_ERROR);
-    }
-    if ((digest_elm->cache_info.digest = calloc(1, digest_len+1)) == NULL)
-    {
-        log_msg(LOG_WARNING, "Error calloc() returned NULL for digest cache string",
-            fko_errstr(SPA_MSG_ERROR));
-        free(digest_elm);
-        return(SPA_MSG_ERROR);
-    }
+/* Digests of packets that passed the replay check and are still being
+ * authorized.  Each digest maps to exactly one slot, so a CAS on that
+ * slot decides which of two copies of a packet seen at the same time
+ * goes on.  A digest whose slot is held by a different one proceeds
+ * unclaimed, and add_replay() still rejects the second copy under the
+ * lock.
+*/
+static uint64_t replay_claims[REPLAY_CLAIM_SLOTS];
 
-    strlcpy(digest_elm->cache_info.digest, digest, digest_len+1);
-    digest_elm->cache_info.proto    = opts->spa_pkt.packet_proto;
-    digest_elm->cache_info.src_ip   = opts->spa_pkt.packet_src_ip;
-    digest_elm->cache_info.dst_ip   = opts->spa_pkt.packet_dst_ip;
-    digest_elm->cache_info.src_port = opts->spa_pkt.packet_src_port;
-    digest_elm->cache_info.dst_port = opts->spa_pkt.packet_dst_port;
-    digest_elm->cache_info.created = time(NULL);
+static uint64_t *
+replay_claim_slot(const unsigned char *digest, uint64_t *key)
+{
+    uint64_t    h;
 
-    /* First, add the digest at the head of the in-memory list
+    /* The digest is already uniformly distributed
     */
-    digest_elm->next = opts->digest_cache;
-    opts->digest_cache = digest_elm;
+    memcpy(&h, digest, sizeof(h));
 
-    /* Now, write the digest to disk
+    /* Zero marks a free slot
     */
-    if ((digest_file_ptr = fopen(opts->config[CONF_DIGEST_FILE], "a")) == NULL)
+    *key = (h == 0) ? 1 : h;
+
+    return(&(replay_claims[(h >> 32) & (REPLAY_CLAIM_SLOTS - 1)]));
+}
+
+/* Atomically check the digest against the replay cache and the packets
+ * currently in flight, and claim it if it is new.  The claim is held
+ * until replay_release(), which must come after add_replay() so that a
+ * later copy finds the digest in the cache.
+*/
+int
+replay_claim(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt,
+        const unsigned char *digest)
+{
+    uint64_t   *slot, key;
+    char        src_ip[INET6_ADDRSTRLEN] = {0};
+    int         res;
+
+    if(digest == NULL)
     {
-        log_msg(LOG_WARNING, "Could not open digest cache: %s",
-            opts->config[CONF_DIGEST_FILE]);
+        log_msg(LOG_WARNING, "NULL digest passed into replay_claim()");
         return(SPA_MSG_DIGEST_CACHE_ERROR);
     }
 
-    inet_ntop(AF_INET, &(digest_elm->cache_info.src_ip),
-        src_ip, INET_ADDRSTRLEN);
-    inet_ntop(AF_INET, &(digest_elm->cache_info.dst_ip),
-        dst_ip, INET_ADDRSTRLEN);
-    fprintf(digest_file_ptr, "%s %d %s %d %s %d %d\n",
-        digest,
-        digest_elm->cache_info.proto,
-        src_ip,
-        (int) digest_elm->cache_info.src_port,
-        dst_ip,
-        digest_elm->cache_info.dst_port,
-        (int) digest_elm->cache_info.created);
+    slot = replay_claim_slot(digest, &key);
 
-    fclose(digest_file_ptr);
+    if(! __sync_bool_compare_and_swap(slot, 0, key) && *slot == key)
+    {
+        spa_addr_ntop(&(spa_pkt->packet_src_addr), src_ip, sizeof(src_ip));
+        log_msg(LOG_WARNING | LOG_RATE_LIMIT,
+            "Replay detected from source IP: %s (copy of a packet still being processed)",
+            src_ip);
+        __sync_fetch_and_add(&(replay_stats.in_flight), 1);
+        return(SPA_MSG_REPLAY);
+    }
 
-    return(SPA_MSG_SUCCESS);
+    res = is_replay(opts, spa_pkt, digest);
+    if(res != SPA_MSG_SUCCESS)
+        replay_release(digest);
+
+    return(res);
 }
-#endif /* USE_FILE_CACHE */
 
-#if !USE_FILE_CACHE
-static int
-is_replay_dbm_cache(fko_srv_options_t *opts, char *digest)
+void
+replay_release(const unsigned char *digest)
 {
-#ifdef NO_DIGEST_CACHE
-    return 0;
-#else
-
-#ifdef HAVE_LIBGDBM
-    GDBM_FILE   rpdb;
-#elif HAVE_LIBNDBM
-    DBM        *rpdb;
-#endif
-    datum       db_key, db_ent;
+    uint64_t   *slot, key;
 
-    int         digest_len, res = SPA_MSG_SUCCESS;
+    if(digest == NULL)
+        return;
 
-    digest_len = strlen(digest);
+    slot = replay_claim_slot(digest, &key);
+    __sync_bool_compare_and_swap(slot, key, 0);
 
-    db_key.dptr = digest;
-    db_key.dsize = digest_len;
+    return;
+}
 
-    /* Check the db for the key
-    */
-#ifdef HAVE_LIBGDBM
-    rpdb = gdbm_open(
-         opts->config[CONF_DIGEST_DB_FILE], 512, GDBM_WRCREAT, S_IRUSR|S_IWUSR, 0
-    );
-#elif HAVE_LIBNDBM
-    rpdb = dbm_open(opts->config[CONF_DIGEST_DB_FILE], O_RDWR, 0);
-#endif
+#ifdef HAVE_C_UNIT_TESTS
+#if USE_FILE_CACHE
 
-    if(!rpdb)
-    {
-        log_msg(LOG_WARNING, "Error opening digest_cache: '%s': %s",
-            opts->config[CONF_DIGEST_DB_FILE],
-            MY_DBM_STRERROR(errno)
-        );
+/* A cache as replay_file_cache_init() sets it up, for a
+ * MAX_SPA_PACKET_AGE of age (0 turns packet aging off).
+*/
+static struct replay_cache *
+ut_replay_cache_new(fko_srv_options_t *opts, fko_srv_runtime_t *rt,
+        const int age)
+{
+    static char sync_interval[] = "0";
 
-        return(SPA_MSG_DIGEST_CACHE_ERROR);
-    }
+    memset(opts, 0x0, sizeof(*opts));
+    memset(rt, 0x0, sizeof(*rt));
 
-    db_ent = MY_DBM_FETCH(rpdb, db_key);
+    rt->spa_packet_aging   = age > 0;
+    rt->max_spa_packet_age = age;
+    opts->rt = rt;
+    opts->config[CONF_DIGEST_FILE_SYNC_INTERVAL] = sync_interval;
 
-    /* If the datum is not null, we have a match.  Otherwise, we add
-    * this entry to the cache.
-    */
-    if(db_ent.dptr != NULL)
-    {
-        replay_warning(opts, (digest_cache_info_t *)db_ent.dptr);
+    return(replay_cache_new(opts));
+}
 
-        /* Save it back to the digest cache
-        */
-        if(MY_DBM_STORE(rpdb, db_key, db_ent, MY_DBM_REPLACE) != 0)
-            log_msg(LOG_WARNING, "Error updating entry in digest_cache: '%s': %s",
-                opts->config[CONF_DIGEST_DB_FILE],
-                MY_DBM_STRERROR(errno)
-            );
+/* The n'th of a series of distinct test digests
+*/
+static void
+ut_replay_digest(unsigned char *bin, const unsigned int n)
+{
+    uint64_t    x = 0x9e3779b97f4a7c15ULL * (n + 1);
+    int         i;
 
-#ifdef HAVE_LIBGDBM
-        free(db_ent.dptr);
-#endif
-        res = SPA_MSG_REPLAY;
+    for(i=0; i < REPLAY_DIGEST_LEN; i++)
+    {
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        bin[i] = (unsigned char)((x * 0x2545f4914f6cdd1dULL) >> 56);
     }
-
-    MY_DBM_CLOSE(rpdb);
-
-    return(res);
-#endif /* NO_DIGEST_CACHE */
+    return;
 }
 
 static int
-add_replay_dbm_cache(fko_srv_options_t *opts, char *digest)
+ut_replay_insert(struct replay_cache *rc, const unsigned int n,
+        const time_t created, const time_t now)
 {
-#ifdef NO_DIGEST_CACHE
-    return 0;
-#else
-
-#ifdef HAVE_LIBGDBM
-    GDBM_FILE   rpdb;
-#elif HAVE_LIBNDBM
-    DBM        *rpdb;
-#endif
-    datum       db_key, db_ent;
-
-    int         digest_len, res = SPA_MSG_SUCCESS;
+    unsigned char       bin[REPLAY_DIGEST_LEN];
+    digest_cache_info_t info;
 
-    digest_cache_info_t dc_info;
+    ut_replay_digest(bin, n);
+    memset(&info, 0x0, sizeof(info));
+    info.created  = created;
+    info.src_port = (unsigned short)n;
 
-    digest_len = strlen(digest);
+    return(replay_cache_insert(rc, bin, &info, now));
+}
 
-    db_key.dptr = digest;
-    db_key.dsize = digest_len;
+static digest_cache_info_t *
+ut_replay_find(struct replay_cache *rc, const unsigned int n,
+        const time_t cutoff)
+{
+    unsigned char   bin[REPLAY_DIGEST_LEN];
 
-    /* Check the db for the key
-    */
-#ifdef HAVE_LIBGDBM
-    rpdb = gdbm_open(
-         opts->config[CONF_DIGEST_DB_FILE], 512, GDBM_WRCREAT, S_IRUSR|S_IWUSR, 0
-    );
-#elif HAVE_LIBNDBM
-    rpdb = dbm_open(opts->config[CONF_DIGEST_DB_FILE], O_RDWR, 0);
-#endif
+    ut_replay_digest(bin, n);
+    return(replay_cache_find(rc, bin, cutoff));
+}
 
-    if(!rpdb)
+DECLARE_UTEST(replay_insert_find, "replay cache finds what was inserted and nothing else")
+{
+    fko_srv_options_t      *opts = calloc(1, sizeof(*opts));
+    fko_srv_runtime_t       rt;
+    struct replay_cache    *rc;
+    digest_cache_info_t    *info, ent;
+    unsigned char           bin[REPLAY_DIGEST_LEN];
+    uint32_t                last_slot = REPLAY_CACHE_MIN_SLOTS - 1;
+    unsigned int            n;
+
+    CU_ASSERT_FATAL(opts != NULL);
+    rc = ut_replay_cache_new(opts, &rt, 0);
+    CU_ASSERT_FATAL(rc != NULL);
+    CU_ASSERT(ut_replay_find(rc, 0, 0) == NULL);
+
+    for(n=0; n < 300; n++)
+        CU_ASSERT(ut_replay_insert(rc, n, 1000 + n, 1000 + n) == 0);
+    CU_ASSERT(rc->slice[0].count == 300);
+
+    for(n=0; n < 300; n++)
     {
-        log_msg(LOG_WARNING, "Error opening digest_cache: '%s': %s",
-            opts->config[CONF_DIGEST_DB_FILE],
-            MY_DBM_STRERROR(errno)
-        );
-
-        return(SPA_MSG_DIGEST_CACHE_ERROR);
+        info = ut_replay_find(rc, n, 0);
+        CU_ASSERT(info != NULL && info->created == 1000 + n && info->src_port == n);
     }
+    for(n=300; n < 600; n++)
+        CU_ASSERT(ut_replay_find(rc, n, 0) == NULL);
 
-    db_ent = MY_DBM_FETCH(rpdb, db_key);
+    /* Without packet aging nothing is too old
+    */
+    CU_ASSERT(ut_replay_find(rc, 0, 2000) == NULL);
+    CU_ASSERT(ut_replay_find(rc, 299, 1299) != NULL);
 
-    /* If the datum is null, we have a new entry.
+    /* Inserting a digest again refreshes it
     */
-    if(db_ent.dptr == NULL)
-    {
-        /* This is a new SPA packet that needs to be added to the cache.
-        */
-        dc_info.src_ip   = opts->spa_pkt.packet_src_ip;
-        dc_info.dst_ip   = opts->spa_pkt.packet_dst_ip;
-        dc_info.src_port = opts->spa_pkt.packet_src_port;
-        dc_info.dst_port = opts->spa_pkt.packet_dst_port;
-        dc_info.proto    = opts->spa_pkt.packet_proto;
-        dc_info.created  = time(NULL);
-        dc_info.first_replay = dc_info.last_replay = dc_info.replay_count = 0;
+    CU_ASSERT(ut_replay_insert(rc, 5, 5000, 5000) == 0);
+    CU_ASSERT(rc->slice[0].count == 300);
+    info = ut_replay_find(rc, 5, 0);
+    CU_ASSERT(info != NULL && info->created == 5000);
 
-        db_ent.dsize    = sizeof(digest_cache_info_t);
-        db_ent.dptr     = (char*)&(dc_info);
+    /* Digests that all hash to the last slot wrap around to the start
+     * of the table
+    */
+    memset(&ent, 0x0, sizeof(ent));
+    for(n=600; n < 620; n++)
+    {
+        ut_replay_digest(bin, n);
+        memcpy(bin, &last_slot, sizeof(last_slot));
+        ent.created = n;
+        CU_ASSERT(replay_cache_insert(rc, bin, &ent, n) == 0);
+    }
+    for(n=600; n < 621; n++)
+    {
+        ut_replay_digest(bin, n);
+        memcpy(bin, &last_slot, sizeof(last_slot));
+        info = replay_cache_find(rc, bin, 0);
+        if(n < 620)
+            CU_ASSERT(info != NULL && info->created == n);
+        else
+            CU_ASSERT(info == NULL);
+    }
+    CU_ASSERT(rc->slice[0].count == 320);
 
-        if(MY_DBM_STORE(rpdb, db_key, db_ent, MY_DBM_INSERT) != 0)
-        {
-            log_msg(LOG_WARNING, "Error adding entry digest_cache: %s",
-                MY_DBM_STRERROR(errno)
-            );
+    replay_cache_free(rc);
+    free(opts);
+}
 
-            res = SPA_MSG_DIGEST_CACHE_ERROR;
-        }
+DECLARE_UTEST(replay_slice_grow, "replay cache slices grow at half load and keep every entry")
+{
+    fko_srv_options_t      *opts = calloc(1, sizeof(*opts));
+    fko_srv_runtime_t       rt;
+    struct replay_cache    *rc;
+    struct replay_slice    *rs;
+    unsigned int            n, total = 4 * REPLAY_CACHE_MIN_SLOTS;
+
+    CU_ASSERT_FATAL(opts != NULL);
+    rc = ut_replay_cache_new(opts, &rt, 0);
+    CU_ASSERT_FATAL(rc != NULL);
+    rs = &(rc->slice[0]);
+
+    for(n=0; n < total; n++)
+    {
+        CU_ASSERT(ut_replay_insert(rc, n, 1000, 1000) == 0);
+        CU_ASSERT(2 * rs->count <= rs->slots);
 
-        res = SPA_MSG_SUCCESS;
+        if(n + 1 == REPLAY_CACHE_MIN_SLOTS / 2)
+            CU_ASSERT(rs->slots == REPLAY_CACHE_MIN_SLOTS);
+        if(n + 1 == REPLAY_CACHE_MIN_SLOTS / 2 + 1)
+            CU_ASSERT(rs->slots == 2 * REPLAY_CACHE_MIN_SLOTS);
     }
-    else
-        res = SPA_MSG_DIGEST_CACHE_ERROR;
+    CU_ASSERT(rs->count == total);
+    CU_ASSERT(rs->slots == 2 * total);
 
-    MY_DBM_CLOSE(rpdb);
+    /* Everything survived the rebuilds
+    */
+    for(n=0; n < total; n++)
+        CU_ASSERT(ut_replay_find(rc, n, 0) != NULL);
+    for(n=total; n < 2 * total; n++)
+        CU_ASSERT(ut_replay_find(rc, n, 0) == NULL);
 
-    return(res);
-#endif /* NO_DIGEST_CACHE */
+    replay_cache_free(rc);
+    free(opts);
 }
-#endif /* USE_FILE_CACHE */
 
-#if USE_FILE_CACHE
-/* Free replay list memory
-*/
-void
-free_replay_list(fko_srv_options_t *opts)
+DECLARE_UTEST(replay_slice_expire, "replay cache slices expire across the window")
 {
-    struct digest_cache_list *digest_list_ptr = NULL, *digest_tmp = NULL;
-
-#ifdef NO_DIGEST_CACHE
-    return;
-#endif
+    fko_srv_options_t      *opts = calloc(1, sizeof(*opts));
+    fko_srv_runtime_t       rt;
+    struct replay_cache    *rc;
+    time_t                  t0 = 1200000, now, cutoff, created;
+    unsigned int            n, k, live;
+    int                     i;
+
+    CU_ASSERT_FATAL(opts != NULL);
+    rc = ut_replay_cache_new(opts, &rt, 120);
+    CU_ASSERT_FATAL(rc != NULL);
+    CU_ASSERT(rc->window == 240);
+    CU_ASSERT(rc->slice_len == 240 / REPLAY_CACHE_SLICES);
+
+    /* One digest every 30 seconds for five windows' worth.  Everything
+     * since the cutoff has to be found, and nothing before it.
+    */
+    for(n=0; n < 40; n++)
+    {
+        now    = t0 + 30 * n;
+        cutoff = replay_cache_cutoff(opts, now);
+        CU_ASSERT(cutoff == now - 240);
 
-#if AFL_FUZZING
-    if(opts->afl_fuzzing)
-        return;
-#endif
+        CU_ASSERT(ut_replay_insert(rc, n, now, now) == 0);
+        replay_cache_expire(rc, cutoff);
 
-    if (opts->digest_cache == NULL)
-        return;
+        for(k=0; k <= n; k++)
+        {
+            created = t0 + 30 * k;
+            if(created >= cutoff)
+                CU_ASSERT(ut_replay_find(rc, k, cutoff) != NULL);
+            else
+                CU_ASSERT(ut_replay_find(rc, k, cutoff) == NULL);
+        }
 
-    digest_list_ptr = opts->digest_cache;
-    while (digest_list_ptr != NULL)
-    {
-        digest_tmp = digest_list_ptr->next;
-        if (digest_list_ptr->cache_info.digest != NULL
-                && digest_list_ptr->cache_info.digest[0] != '\0')
+        /* Only slices that reach into the window are kept
+        */
+        live = 0;
+        for(i=0; i <= REPLAY_CACHE_SLICES; i++)
         {
-            free(digest_list_ptr->cache_info.digest);
+            if(rc->slice[i].slots == 0)
+                continue;
+            CU_ASSERT(rc->slice[i].start + rc->slice_len > cutoff);
+            live += rc->slice[i].count;
         }
-        free(digest_list_ptr);
-        digest_list_ptr = digest_tmp;
+        CU_ASSERT(live <= 240 / 30 + 2);
     }
 
-    return;
+    /* A slice only goes once all of it is older than the cutoff
+    */
+    replay_cache_free(rc);
+    rc = ut_replay_cache_new(opts, &rt, 120);
+    CU_ASSERT_FATAL(rc != NULL);
+
+    CU_ASSERT(ut_replay_insert(rc, 1, t0 + 10, t0 + 10) == 0);
+    CU_ASSERT(ut_replay_insert(rc, 2, t0 + 50, t0 + 50) == 0);
+    CU_ASSERT(replay_cache_expire(rc, t0 + 59) == 0);
+    CU_ASSERT(ut_replay_find(rc, 1, t0 + 59) == NULL);
+    CU_ASSERT(ut_replay_find(rc, 2, t0 + 50) != NULL);
+    CU_ASSERT(replay_cache_expire(rc, t0 + 60) == 1);
+    CU_ASSERT(ut_replay_find(rc, 2, 0) == NULL);
+
+    /* Without expire(), a full turn of the ring later the old slice is
+     * replaced by the new one
+    */
+    CU_ASSERT(ut_replay_insert(rc, 3, t0 + 30, t0 + 30) == 0);
+    now = t0 + 30 + (REPLAY_CACHE_SLICES + 1) * rc->slice_len;
+    CU_ASSERT(ut_replay_insert(rc, 4, now, now) == 0);
+    CU_ASSERT(ut_replay_find(rc, 3, 0) == NULL);
+    CU_ASSERT(ut_replay_find(rc, 4, replay_cache_cutoff(opts, now)) != NULL);
+
+    replay_cache_free(rc);
+    free(opts);
 }
-#endif
 
-int
-replay_cache_init(fko_srv_options_t *opts)
+DECLARE_UTEST(replay_insert_window, "replay cache keeps inserts dated outside the window")
 {
-#ifdef NO_DIGEST_CACHE
-    return(-1);
-#else
-
-    /* If rotation was specified, do it.
+    fko_srv_options_t      *opts = calloc(1, sizeof(*opts));
+    fko_srv_runtime_t       rt;
+    struct replay_cache    *rc;
+    digest_cache_info_t    *info;
+    time_t                  t0 = 1200000, now, back;
+
+    CU_ASSERT_FATAL(opts != NULL);
+    rc = ut_replay_cache_new(opts, &rt, 120);
+    CU_ASSERT_FATAL(rc != NULL);
+
+    /* Older than the cutoff, or later than now, is moved to that end
+     * of the window
     */
-    if(opts->rotate_digest_cache)
-        rotate_digest_cache_file(opts);
+    now = t0 + 600;
+    CU_ASSERT(ut_replay_insert(rc, 1, now - 1000, now) == 0);
+    info = ut_replay_find(rc, 1, replay_cache_cutoff(opts, now));
+    CU_ASSERT(info != NULL && info->created == now - 240);
 
-#if USE_FILE_CACHE
-    return replay_file_cache_init(opts);
-#else
-    return replay_db_cache_init(opts);
-#endif
+    CU_ASSERT(ut_replay_insert(rc, 2, 1, now) == 0);
+    info = ut_replay_find(rc, 2, replay_cache_cutoff(opts, now));
+    CU_ASSERT(info != NULL && info->created == now - 240);
 
-#endif /* NO_DIGEST_CACHE */
+    CU_ASSERT(ut_replay_insert(rc, 3, now + 500, now) == 0);
+    info = ut_replay_find(rc, 3, replay_cache_cutoff(opts, now));
+    CU_ASSERT(info != NULL && info->created == now);
+
+    /* Nothing inserted here is dropped by the expiry right after
+    */
+    CU_ASSERT(replay_cache_expire(rc, replay_cache_cutoff(opts, now)) == 0);
+    CU_ASSERT(ut_replay_find(rc, 1, replay_cache_cutoff(opts, now)) != NULL);
+
+    /* The clock goes back a full turn of the ring, so the slice for now
+     * is in the ring entry still held by a newer one.  The digest has to
+     * be stored anyway, and the newer slice kept.
+    */
+    back = now - (REPLAY_CACHE_SLICES + 1) * rc->slice_len;
+    CU_ASSERT(ut_replay_insert(rc, 4, back, back) == 0);
+    CU_ASSERT(ut_replay_find(rc, 4, replay_cache_cutoff(opts, back)) != NULL);
+    CU_ASSERT(ut_replay_find(rc, 3, replay_cache_cutoff(opts, back)) != NULL);
+    CU_ASSERT(replay_cache_expire(rc, replay_cache_cutoff(opts, back)) == 0);
+    CU_ASSERT(ut_replay_find(rc, 4, replay_cache_cutoff(opts, back)) != NULL);
+
+    /* Without packet aging the time is kept as it is
+    */
+    replay_cache_free(rc);
+    rc = ut_replay_cache_new(opts, &rt, 0);
+    CU_ASSERT_FATAL(rc != NULL);
+    CU_ASSERT(ut_replay_insert(rc, 5, 1, now) == 0);
+    info = ut_replay_find(rc, 5, 0);
+    CU_ASSERT(info != NULL && info->created == 1);
+
+    replay_cache_free(rc);
+    free(opts);
 }
 
-int
-add_replay(fko_srv_options_t *opts, char *digest)
+DECLARE_UTEST(replay_bloom_rebuild, "replay cache Bloom filter has no false negatives after a rebuild")
 {
-#ifdef NO_DIGEST_CACHE
-    return(-1);
-#else
+    fko_srv_options_t      *opts = calloc(1, sizeof(*opts));
+    fko_srv_runtime_t       rt;
+    struct replay_cache    *rc;
+    unsigned char           bin[REPLAY_DIGEST_LEN];
+    unsigned int            n, total = 3 * REPLAY_BLOOM_MIN_ENTRIES, fp = 0;
+    unsigned int            per_slice = total / REPLAY_CACHE_SLICES;
+    time_t                  t0 = 1200000, now, cutoff;
+
+    CU_ASSERT_FATAL(opts != NULL);
+    rc = ut_replay_cache_new(opts, &rt, 120);
+    CU_ASSERT_FATAL(rc != NULL);
+    CU_ASSERT(rc->bloom.capacity == REPLAY_BLOOM_MIN_ENTRIES);
+
+    /* Enough digests, spread over the slices of one window, that the
+     * filter is rebuilt larger as they go in
+    */
+    for(n=0; n < total; n++)
+    {
+        now = t0 + (n / per_slice) * rc->slice_len;
+        CU_ASSERT(ut_replay_insert(rc, n, now, now) == 0);
+    }
+    CU_ASSERT(rc->bloom.capacity > REPLAY_BLOOM_MIN_ENTRIES);
 
-    if(digest == NULL)
+    for(n=0; n < total; n++)
     {
-        log_msg(LOG_WARNING, "NULL digest passed into add_replay()");
-        return(SPA_MSG_DIGEST_CACHE_ERROR);
+        ut_replay_digest(bin, n);
+        CU_ASSERT(replay_bloom_maybe(&(rc->bloom), bin, REPLAY_DIGEST_LEN) == 1);
+        CU_ASSERT(replay_cache_find(rc, bin, 0) != NULL);
     }
 
-#if USE_FILE_CACHE
-    return add_replay_file_cache(opts, digest);
-#else
-    return add_replay_dbm_cache(opts, digest);
-#endif
-#endif /* NO_DIGEST_CACHE */
+    /* Expiring the oldest slices rebuilds the filter from the rest
+    */
+    now    = t0 + (REPLAY_CACHE_SLICES + 1) * rc->slice_len;
+    cutoff = replay_cache_cutoff(opts, now);
+    CU_ASSERT(replay_cache_expire(rc, cutoff) > 0);
+
+    for(n=0; n < total; n++)
+    {
+        ut_replay_digest(bin, n);
+        if(t0 + (time_t)(n / per_slice) * rc->slice_len + rc->slice_len > cutoff)
+        {
+            CU_ASSERT(replay_bloom_maybe(&(rc->bloom), bin, REPLAY_DIGEST_LEN) == 1);
+            CU_ASSERT(replay_cache_find(rc, bin, cutoff) != NULL);
+        }
+        else
+        {
+            CU_ASSERT(replay_cache_find(rc, bin, 0) == NULL);
+            fp += replay_bloom_maybe(&(rc->bloom), bin, REPLAY_DIGEST_LEN);
+        }
+    }
+
+    /* The dropped digests are gone from the filter too, give or take
+     * the odd false positive
+    */
+    CU_ASSERT(fp < per_slice / 20);
+
+    /* Without a filter every lookup goes to the slices, and the next
+     * rebuild brings it back
+    */
+    replay_bloom_free(&(rc->bloom));
+    CU_ASSERT(ut_replay_insert(rc, total, now, now) == 0);
+    CU_ASSERT(ut_replay_find(rc, total, cutoff) != NULL);
+    CU_ASSERT(ut_replay_find(rc, total - 1, cutoff) != NULL);
+
+    now   += rc->slice_len;
+    cutoff = replay_cache_cutoff(opts, now);
+    CU_ASSERT(replay_cache_expire(rc, cutoff) > 0);
+    CU_ASSERT(rc->bloom.bits != NULL);
+    ut_replay_digest(bin, total);
+    CU_ASSERT(replay_bloom_maybe(&(rc->bloom), bin, REPLAY_DIGEST_LEN) == 1);
+    CU_ASSERT(ut_replay_find(rc, total, cutoff) != NULL);
+
+    replay_cache_free(rc);
+    free(opts);
 }
 
-/* Take an fko context, pull the digest and use it as the key to check the
- * replay db (digest cache).
-*/
-int
-is_replay(fko_srv_options_t *opts, char *digest)
-{
-#ifdef NO_DIGEST_CACHE
-    return(-1);
-#else
+#endif /* USE_FILE_CACHE */
 
+int register_ts_replay_cache(void)
+{
+    ts_init(&TEST_SUITE(replay_cache), TEST_SUITE_DESCR(replay_cache), NULL, NULL);
 #if USE_FILE_CACHE
-    return is_replay_file_cache(opts, digest);
-#else
-    return is_replay_dbm_cache(opts, digest);
+    ts_add_utest(&TEST_SUITE(replay_cache), UTEST_FCT(replay_insert_find), UTEST_DESCR(replay_insert_find));
+    ts_add_utest(&TEST_SUITE(replay_cache), UTEST_FCT(replay_slice_grow), UTEST_DESCR(replay_slice_grow));
+    ts_add_utest(&TEST_SUITE(replay_cache), UTEST_FCT(replay_slice_expire), UTEST_DESCR(replay_slice_expire));
+    ts_add_utest(&TEST_SUITE(replay_cache), UTEST_FCT(replay_insert_window), UTEST_DESCR(replay_insert_window));
+    ts_add_utest(&TEST_SUITE(replay_cache), UTEST_FCT(replay_bloom_rebuild), UTEST_DESCR(replay_bloom_rebuild));
 #endif
-#endif /* NO_DIGEST_CACHE */
+
+    return register_ts(&TEST_SUITE(replay_cache));
 }
+#endif /* HAVE_C_UNIT_TESTS */
 
 /***EOF***/
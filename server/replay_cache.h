@@ -34,35 +34,172 @@
 #include "fwknopd_common.h"
 #include "fko.h"
 
+#if HAVE_LIBLMDB
+  #include <lmdb.h>
+#endif
+
+/* Lookup latency histogram buckets (powers of two nanoseconds) reported
+ * by dump_replay_cache_stats()
+*/
+#define REPLAY_STATS_HIST_BUCKETS   28
+
+/* Slots in the table of digests claimed by packets still being
+ * processed (must be a power of two).  This only needs to be large
+ * compared to the SPA worker queue.
+*/
+#define REPLAY_CLAIM_SLOTS  4096
+
 typedef struct digest_cache_info {
-    unsigned int    src_ip;
-    unsigned int    dst_ip;
+    spa_addr_t      src_ip;
+    spa_addr_t      dst_ip;
     unsigned short  src_port;
     unsigned short  dst_port;
     unsigned char   proto;
     time_t          created;
-    char           *digest;
 #if ! USE_FILE_CACHE
+    char           *digest;
     time_t          first_replay;
     time_t          last_replay;
     int             replay_count;
 #endif
 } digest_cache_info_t;
 
+/* Blocked Bloom filter kept in front of the digest store.  Each key sets
+ * REPLAY_BLOOM_HASHES bits within a single 64 byte block, so a lookup
+ * that misses (the normal case, since legitimate packets are never
+ * replays) touches one cache line and never reaches the store itself.
+*/
+#define REPLAY_BLOOM_BLOCK_WORDS    8   /* 8 * 64 bits = 64 bytes */
+#define REPLAY_BLOOM_BITS_PER_ENTRY 16
+#define REPLAY_BLOOM_HASHES         6
+#define REPLAY_BLOOM_MIN_ENTRIES    4096
+
+struct replay_bloom {
+    uint64_t       *bits;       /* NULL if unavailable, so every lookup
+                                 * goes to the store */
+    unsigned int    blocks;     /* Power of two */
+    unsigned int    count;
+    unsigned int    capacity;   /* Rebuilt larger beyond this many keys */
+};
+
 #if USE_FILE_CACHE
-struct digest_cache_list {
-    digest_cache_info_t cache_info;
-    struct digest_cache_list *next;
+/* Initial number of slots in each time slice's table.  Must be a power of
+ * two.
+*/
+#define REPLAY_CACHE_MIN_SLOTS  1024
+
+/* With SPA packet aging enabled, the replay window (twice
+ * MAX_SPA_PACKET_AGE) is split into this many time slices, and each slice
+ * is dropped as a whole once it has aged out of the window.
+*/
+#define REPLAY_CACHE_SLICES     4
+
+/* One time slice of the in-memory digest cache: an open addressing hash
+ * set of binary digests, with the details of each entry in a parallel
+ * array.  Entries are never removed one at a time, so there are no
+ * tombstones.
+*/
+struct replay_slice {
+    unsigned char          *digests;    /* slots * REPLAY_DIGEST_LEN bytes */
+    digest_cache_info_t    *info;
+    unsigned char          *used;
+    unsigned int            slots;      /* 0 if the slice is not in use */
+    unsigned int            count;
+    time_t                  start;      /* Start of the slice's time range */
+};
+
+/* The slices form a ring indexed by slice number.  The oldest slice is
+ * usually only partly inside the window, hence the extra one.  Without
+ * packet aging nothing expires: slice_len is 0 and only slice[0] is used.
+*/
+struct replay_cache {
+    struct replay_slice     slice[REPLAY_CACHE_SLICES + 1];
+    time_t                  window;     /* 0 without packet aging */
+    time_t                  slice_len;
+    struct replay_bloom     bloom;      /* Covers every live slice */
+    int                     log_fd;     /* Digest file, open for appending */
+    unsigned int            unsynced;   /* Records written since the last fsync */
+    time_t                  last_sync;
+    int                     sync_interval;
+};
+
+/* The digest file is a header followed by fixed size records in host
+ * byte order, so it can be mapped and loaded without any parsing.  A
+ * file that starts with '#' is the older text format.
+*/
+#define REPLAY_LOG_MAGIC        "FKODGST1"
+#define REPLAY_LOG_MAGIC_LEN    8
+
+typedef struct replay_log_hdr {
+    char            magic[REPLAY_LOG_MAGIC_LEN];
+    uint32_t        rec_len;            /* sizeof(replay_log_rec_t) */
+    uint32_t        reserved;
+} replay_log_hdr_t;
+
+typedef struct replay_log_rec {
+    int64_t         created;
+    unsigned char   digest[REPLAY_DIGEST_LEN];
+    unsigned char   src_ip[16];
+    unsigned char   dst_ip[16];
+    uint16_t        src_port;
+    uint16_t        dst_port;
+    unsigned char   proto;
+    unsigned char   src_family;
+    unsigned char   dst_family;
+    unsigned char   reserved[9];
+} replay_log_rec_t;
+#elif HAVE_LIBLMDB
+/* Address space reserved for the LMDB digest db.  The file itself only
+ * grows as entries are added.
+*/
+#define REPLAY_LMDB_MAP_SIZE    ((size_t)256 << 20)
+
+/* The LMDB environment stays open for the life of the server.  Readers
+ * use their own snapshot and never take the replay cache mutex, and
+ * commits skip fsync() so that mdb_env_sync() can be batched.
+*/
+struct replay_cache {
+    MDB_env                *env;
+    MDB_dbi                 dbi;
+    unsigned int            unsynced;   /* Commits since the last sync */
+    time_t                  last_sync;
+    int                     sync_interval;
+};
+#else
+/* The dbm cache keeps only the Bloom filter in memory.
+*/
+struct replay_cache {
+    struct replay_bloom     bloom;
 };
 #endif
 
+/* One entry of a replay cache snapshot (see replay_cache_snapshot())
+*/
+typedef struct replay_snapshot_ent {
+    unsigned char           digest[REPLAY_DIGEST_LEN];
+    digest_cache_info_t     info;
+} replay_snapshot_ent_t;
+
 /* Prototypes
 */
 int replay_cache_init(fko_srv_options_t *opts);
-int is_replay(fko_srv_options_t *opts, char *digest);
-int add_replay(fko_srv_options_t *opts, char *digest);
-#ifdef USE_FILE_CACHE
+int is_replay(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt,
+        const unsigned char *digest);
+int add_replay(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt,
+        const unsigned char *digest);
+int replay_claim(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt,
+        const unsigned char *digest);
+void replay_release(const unsigned char *digest);
+int import_replay(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt,
+        const unsigned char *digest);
+int replay_cache_snapshot(fko_srv_options_t *opts, replay_snapshot_ent_t **ents);
 void free_replay_list(fko_srv_options_t *opts);
+void replay_cache_sync(fko_srv_options_t *opts);
+unsigned long replay_cache_entries(fko_srv_options_t *opts);
+void dump_replay_cache_stats(fko_srv_options_t *opts);
+
+#ifdef HAVE_C_UNIT_TESTS
+int register_ts_replay_cache(void);
 #endif
 
 #endif  /* REPLAY_CACHE_H */
@@ -0,0 +1,656 @@
+/*
+ *****************************************************************************
+ *
+ * File:    replay_gossip.c
+ *
+ * Purpose: Share replay cache digests between fwknopd gateways that sit
+ *          behind the same anycast/ECMP address.  Each accepted SPA
+ *          packet's digest is sent to the configured peers in a small
+ *          HMAC-SHA256 authenticated UDP message, and digests received
+ *          from peers are added to the local replay cache.  Lookups
+ *          always stay in the local cache, so nothing here is on the
+ *          packet path except for one sendto() per peer for each
+ *          accepted packet.  A server that starts up asks its peers for
+ *          a snapshot of their caches so that it starts warm.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "replay_gossip.h"
+#include "replay_cache.h"
+#include "fwknopd_errors.h"
+#include "log_msg.h"
+#include "utils.h"
+#include "cpu_affinity.h"
+
+#if HAVE_SYS_SOCKET_H
+  #include <sys/socket.h>
+#endif
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+static int                      rg_active = 0;
+static volatile int             rg_stop = 0;
+static int                      rg_sock = -1;
+static pthread_t                rg_thread;
+static fko_srv_options_t       *rg_opts = NULL;
+static char                    *rg_key = NULL;
+static int                      rg_key_len = 0;
+static struct sockaddr_storage  rg_peers[REPLAY_GOSSIP_MAX_PEERS];
+static socklen_t                rg_peer_lens[REPLAY_GOSSIP_MAX_PEERS];
+static int                      rg_num_peers = 0;
+static time_t                   rg_last_sync[REPLAY_GOSSIP_MAX_PEERS];
+
+static void
+rg_put_u64(unsigned char *p, uint64_t v)
+{
+    int     i;
+
+    for(i=7; i >= 0; i--)
+    {
+        p[i] = v & 0xff;
+        v >>= 8;
+    }
+    return;
+}
+
+static uint64_t
+rg_get_u64(const unsigned char *p)
+{
+    uint64_t    v = 0;
+    int         i;
+
+    for(i=0; i < 8; i++)
+        v = (v << 8) | p[i];
+    return(v);
+}
+
+/* The address family goes on the wire as the IP version, since the AF_*
+ * values differ between platforms.
+*/
+static unsigned char
+rg_family_to_ver(const unsigned char family)
+{
+    return(family == AF_INET6 ? 6 : 4);
+}
+
+static int
+rg_ver_to_family(const unsigned char ver)
+{
+    if(ver == 4)
+        return(AF_INET);
+    if(ver == 6)
+        return(AF_INET6);
+    return(-1);
+}
+
+static int
+rg_mac(const unsigned char *msg, const size_t len, unsigned char *mac)
+{
+    unsigned int    mac_len = 0;
+
+    if(HMAC(EVP_sha256(), rg_key, rg_key_len, msg, len, mac, &mac_len) == NULL
+            || mac_len != REPLAY_GOSSIP_MAC_LEN)
+        return(-1);
+
+    return(0);
+}
+
+/* Returns the index of the peer the message came from, or -1 if it is
+ * not one of the configured peers.
+*/
+static int
+rg_peer_index(const struct sockaddr_storage *from)
+{
+    const struct sockaddr_in   *a4, *b4;
+    const struct sockaddr_in6  *a6, *b6;
+    int                         i;
+
+    for(i=0; i < rg_num_peers; i++)
+    {
+        if(rg_peers[i].ss_family != from->ss_family)
+            continue;
+
+        if(from->ss_family == AF_INET)
+        {
+            a4 = (const struct sockaddr_in *)from;
+            b4 = (const struct sockaddr_in *)&(rg_peers[i]);
+            if(a4->sin_addr.s_addr == b4->sin_addr.s_addr)
+                return(i);
+        }
+        else if(from->ss_family == AF_INET6)
+        {
+            a6 = (const struct sockaddr_in6 *)from;
+            b6 = (const struct sockaddr_in6 *)&(rg_peers[i]);
+            if(memcmp(&(a6->sin6_addr), &(b6->sin6_addr),
+                    sizeof(a6->sin6_addr)) == 0)
+                return(i);
+        }
+    }
+    return(-1);
+}
+
+static void
+rg_fill_rec(unsigned char *rec, const unsigned char *digest,
+        const digest_cache_info_t *info)
+{
+    memset(rec, 0x0, REPLAY_GOSSIP_REC_LEN);
+    memcpy(rec, digest, REPLAY_DIGEST_LEN);
+    rg_put_u64(rec + 32, (uint64_t)info->created);
+    memcpy(rec + 40, info->src_ip.addr, 16);
+    memcpy(rec + 56, info->dst_ip.addr, 16);
+    rec[72] = rg_family_to_ver(info->src_ip.family);
+    rec[73] = rg_family_to_ver(info->dst_ip.family);
+    rec[74] = info->proto;
+    rec[76] = info->src_port >> 8;
+    rec[77] = info->src_port & 0xff;
+    rec[78] = info->dst_port >> 8;
+    rec[79] = info->dst_port & 0xff;
+    return;
+}
+
+/* Fill in the header and MAC of a message whose records are already in
+ * place, and send it.
+*/
+static int
+rg_send_msg(unsigned char *msg, const int num_recs, const unsigned char type,
+        const struct sockaddr_storage *to, const socklen_t to_len)
+{
+    size_t  len = REPLAY_GOSSIP_HDR_LEN + num_recs * REPLAY_GOSSIP_REC_LEN;
+
+    memcpy(msg, REPLAY_GOSSIP_MAGIC, 4);
+    msg[4] = REPLAY_GOSSIP_VERSION;
+    msg[5] = num_recs;
+    msg[6] = type;
+    msg[7] = 0;
+
+    if(rg_mac(msg, len, msg + len) != 0)
+        return(-1);
+
+    if(sendto(rg_sock, msg, len + REPLAY_GOSSIP_MAC_LEN, 0,
+            (const struct sockaddr *)to, to_len) < 0)
+        return(-1);
+
+    return(0);
+}
+
+/* Send every digest inside the replay window to a peer that has just
+ * started.
+*/
+static void
+rg_send_snapshot(const int peer, const struct sockaddr_storage *to,
+        const socklen_t to_len)
+{
+    unsigned char           msg[REPLAY_GOSSIP_MAX_MSG_LEN];
+    replay_snapshot_ent_t  *ents = NULL;
+    time_t                  now = time(NULL);
+    int                     count, i, n = 0, sent = 0;
+
+    /* A replayed sync request could otherwise be used to make us flood
+     * the peer.
+    */
+    if(rg_last_sync[peer] != 0
+            && now - rg_last_sync[peer] < REPLAY_GOSSIP_SYNC_INTERVAL)
+        return;
+    rg_last_sync[peer] = now;
+
+    if((count = replay_cache_snapshot(rg_opts, &ents)) <= 0)
+    {
+        free(ents);
+        return;
+    }
+
+    for(i=0; i < count; i++)
+    {
+        rg_fill_rec(msg + REPLAY_GOSSIP_HDR_LEN + n * REPLAY_GOSSIP_REC_LEN,
+            ents[i].digest, &(ents[i].info));
+
+        if(++n < REPLAY_GOSSIP_MAX_RECS && i < count - 1)
+            continue;
+
+        if(rg_send_msg(msg, n, REPLAY_GOSSIP_MSG_DIGESTS, to, to_len) != 0)
+        {
+            log_msg(LOG_WARNING, "Unable to send replay cache snapshot to peer %i: %s",
+                peer, strerror(errno));
+            break;
+        }
+        n = 0;
+
+        if(++sent % REPLAY_GOSSIP_SYNC_BURST == 0)
+            usleep(REPLAY_GOSSIP_SYNC_PAUSE);
+    }
+
+    log_msg(LOG_INFO, "Sent %i replay cache digests to gossip peer %i.",
+        i, peer);
+
+    free(ents);
+    return;
+}
+
+/* Add the digests in a peer's message to the local replay cache.
+*/
+static void
+rg_handle_msg(const unsigned char *msg, const ssize_t len,
+        const struct sockaddr_storage *from, const socklen_t from_len)
+{
+    unsigned char       mac[REPLAY_GOSSIP_MAC_LEN];
+    const unsigned char *rec;
+    spa_pkt_info_t      spa_pkt;
+    time_t              now = time(NULL), created, cutoff = 0;
+    int                 num_recs, i, src_family, dst_family, peer;
+
+    if(len < REPLAY_GOSSIP_HDR_LEN + REPLAY_GOSSIP_MAC_LEN
+            || memcmp(msg, REPLAY_GOSSIP_MAGIC, 4) != 0
+            || msg[4] != REPLAY_GOSSIP_VERSION)
+        return;
+
+    num_recs = msg[5];
+    if(num_recs > REPLAY_GOSSIP_MAX_RECS
+            || (msg[6] == REPLAY_GOSSIP_MSG_DIGESTS && num_recs < 1)
+            || (msg[6] == REPLAY_GOSSIP_MSG_SYNC && num_recs != 0)
+            || msg[6] > REPLAY_GOSSIP_MSG_SYNC
+            || len != REPLAY_GOSSIP_HDR_LEN + num_recs * REPLAY_GOSSIP_REC_LEN
+                + REPLAY_GOSSIP_MAC_LEN)
+        return;
+
+    if((peer = rg_peer_index(from)) < 0)
+    {
+        if(rg_opts->verbose)
+            log_msg(LOG_DEBUG, "Ignoring replay gossip from an unknown peer");
+        return;
+    }
+
+    if(rg_mac(msg, len - REPLAY_GOSSIP_MAC_LEN, mac) != 0
+            || constant_runtime_cmp((char *)mac,
+                (char *)msg + len - REPLAY_GOSSIP_MAC_LEN,
+                REPLAY_GOSSIP_MAC_LEN) != 0)
+    {
+        log_msg(LOG_WARNING, "Replay gossip message failed authentication");
+        return;
+    }
+
+    if(msg[6] == REPLAY_GOSSIP_MSG_SYNC)
+    {
+        rg_send_snapshot(peer, from, from_len);
+        return;
+    }
+
+    /* Anything old enough to fail the SPA packet age check is of no use
+    */
+    if(rg_opts->rt->spa_packet_aging && rg_opts->rt->max_spa_packet_age > 0)
+        cutoff = now - 2 * (time_t)rg_opts->rt->max_spa_packet_age;
+
+    for(i=0; i < num_recs; i++)
+    {
+        rec = msg + REPLAY_GOSSIP_HDR_LEN + i * REPLAY_GOSSIP_REC_LEN;
+
+        created = (time_t)rg_get_u64(rec + 32);
+        if(created < cutoff || created > now + REPLAY_GOSSIP_MAX_SKEW)
+            continue;
+
+        src_family = rg_ver_to_family(rec[72]);
+        dst_family = rg_ver_to_family(rec[73]);
+        if(src_family < 0 || dst_family < 0)
+            continue;
+
+        memset(&spa_pkt, 0x0, sizeof(spa_pkt));
+        spa_pkt.packet_src_addr.family = src_family;
+        memcpy(spa_pkt.packet_src_addr.addr, rec + 40, 16);
+        spa_pkt.packet_dst_addr.family = dst_family;
+        memcpy(spa_pkt.packet_dst_addr.addr, rec + 56, 16);
+        spa_pkt.packet_proto    = rec[74];
+        spa_pkt.packet_src_port = (rec[76] << 8) | rec[77];
+        spa_pkt.packet_dst_port = (rec[78] << 8) | rec[79];
+        spa_pkt.arrival_time    = created;
+
+        if(import_replay(rg_opts, &spa_pkt, rec) == SPA_MSG_SUCCESS
+                && rg_opts->verbose)
+            log_msg(LOG_DEBUG, "Added replay digest from gossip peer");
+    }
+    return;
+}
+
+static void *
+rg_recv_thread(void *arg)
+{
+    unsigned char           msg[REPLAY_GOSSIP_MAX_MSG_LEN];
+    struct sockaddr_storage from;
+    socklen_t               from_len;
+    sigset_t                mask;
+    ssize_t                 len;
+
+    (void)arg;
+
+    /* Leave signal handling to the main thread.
+    */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    cpu_affinity_set(CPU_ROLE_HOUSEKEEPING);
+
+    while(! rg_stop)
+    {
+        from_len = sizeof(from);
+        len = recvfrom(rg_sock, msg, sizeof(msg), 0,
+                (struct sockaddr *)&from, &from_len);
+        if(len < 0)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                log_msg(LOG_WARNING, "Replay gossip recvfrom() error: %s",
+                    strerror(errno));
+            continue;
+        }
+        rg_handle_msg(msg, len, &from, from_len);
+    }
+    return(NULL);
+}
+
+/* Resolve one "host", "host:port" or "[v6addr]:port" peer.
+*/
+static int
+rg_add_peer(char *spec, const int family, const char *def_port)
+{
+    struct addrinfo     hints, *res = NULL;
+    const char         *port = def_port;
+    char               *host = spec, *ndx;
+    int                 rv;
+
+    if(rg_num_peers >= REPLAY_GOSSIP_MAX_PEERS)
+    {
+        log_msg(LOG_ERR, "[*] Too many REPLAY_GOSSIP_PEERS (max %i)",
+            REPLAY_GOSSIP_MAX_PEERS);
+        return(-1);
+    }
+
+    if(spec[0] == '[')
+    {
+        host = spec + 1;
+        if((ndx = strchr(host, ']')) == NULL
+                || (ndx[1] != '\0' && ndx[1] != ':'))
+        {
+            log_msg(LOG_ERR, "[*] Invalid REPLAY_GOSSIP_PEERS entry: %s", spec);
+            return(-1);
+        }
+        if(ndx[1] == ':')
+            port = ndx + 2;
+        *ndx = '\0';
+    }
+    else if((ndx = strchr(spec, ':')) != NULL && strchr(ndx + 1, ':') == NULL)
+    {
+        *ndx = '\0';
+        port = ndx + 1;
+    }
+
+    memset(&hints, 0x0, sizeof(hints));
+    hints.ai_family   = family;
+    hints.ai_socktype = SOCK_DGRAM;
+    if(family == AF_INET6)
+        hints.ai_flags = AI_V4MAPPED;
+
+    if((rv = getaddrinfo(host, port, &hints, &res)) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Unable to resolve replay gossip peer %s: %s",
+            host, gai_strerror(rv));
+        return(-1);
+    }
+
+    memcpy(&(rg_peers[rg_num_peers]), res->ai_addr, res->ai_addrlen);
+    rg_peer_lens[rg_num_peers] = res->ai_addrlen;
+    rg_num_peers++;
+
+    freeaddrinfo(res);
+    return(0);
+}
+
+static int
+rg_parse_peers(const char *peers, const int family, const char *def_port)
+{
+    char    buf[MAX_LINE_LEN];
+    char   *tok, *save = NULL, *end;
+
+    strlcpy(buf, peers, sizeof(buf));
+
+    for(tok = strtok_r(buf, ",", &save); tok != NULL;
+            tok = strtok_r(NULL, ",", &save))
+    {
+        while(isspace((int)(unsigned char)*tok))
+            tok++;
+        end = tok + strlen(tok);
+        while(end > tok && isspace((int)(unsigned char)end[-1]))
+            *--end = '\0';
+        if(*tok == '\0')
+            continue;
+
+        if(rg_add_peer(tok, family, def_port) != 0)
+            return(-1);
+    }
+
+    if(rg_num_peers == 0)
+    {
+        log_msg(LOG_ERR, "[*] REPLAY_GOSSIP_PEERS does not list any peers");
+        return(-1);
+    }
+    return(0);
+}
+
+static void
+rg_free(void)
+{
+    if(rg_sock != -1)
+        close(rg_sock);
+    rg_sock = -1;
+
+    if(rg_key != NULL)
+    {
+        memset(rg_key, 0x0, rg_key_len);
+        free(rg_key);
+    }
+    rg_key     = NULL;
+    rg_key_len = 0;
+
+    rg_num_peers = 0;
+    memset(rg_last_sync, 0x0, sizeof(rg_last_sync));
+    return;
+}
+
+/* Start sharing digests if REPLAY_GOSSIP_PORT is set.  Returns 0 on
+ * success (including when gossip is disabled) and -1 on error.
+*/
+int
+replay_gossip_start(fko_srv_options_t *opts)
+{
+    struct sockaddr_storage addr;
+    struct timeval          tv;
+    unsigned char           msg[REPLAY_GOSSIP_HDR_LEN + REPLAY_GOSSIP_MAC_LEN];
+    char                    port_str[8];
+    int                     port, is_err, family, i, on = 1, off = 0;
+
+    rg_active = 0;
+
+    port = strtol_wrapper(opts->config[CONF_REPLAY_GOSSIP_PORT],
+            0, RCHK_MAX_REPLAY_GOSSIP_PORT, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid REPLAY_GOSSIP_PORT value.");
+        return(-1);
+    }
+
+    if(port == 0)
+        return(0);
+
+    if(opts->config[CONF_REPLAY_GOSSIP_PEERS] == NULL)
+    {
+        log_msg(LOG_ERR, "[*] REPLAY_GOSSIP_PORT is set but REPLAY_GOSSIP_PEERS is not.");
+        return(-1);
+    }
+
+    if(opts->config[CONF_REPLAY_GOSSIP_KEY] == NULL
+            || strlen(opts->config[CONF_REPLAY_GOSSIP_KEY]) < REPLAY_GOSSIP_MIN_KEY_LEN)
+    {
+        log_msg(LOG_ERR, "[*] REPLAY_GOSSIP_KEY must be at least %i characters.",
+            REPLAY_GOSSIP_MIN_KEY_LEN);
+        return(-1);
+    }
+
+    if(! opts->rt->digest_persistence)
+    {
+        log_msg(LOG_WARNING,
+            "ENABLE_DIGEST_PERSISTENCE is off, not sharing replay digests.");
+        return(0);
+    }
+
+    if((rg_key = strdup(opts->config[CONF_REPLAY_GOSSIP_KEY])) == NULL)
+    {
+        log_msg(LOG_ERR, "replay_gossip_start: strdup() failed");
+        return(-1);
+    }
+    rg_key_len = strlen(rg_key);
+
+    family = opts->enable_ipv6 ? AF_INET6 : AF_INET;
+    snprintf(port_str, sizeof(port_str), "%i", port);
+
+    if(rg_parse_peers(opts->config[CONF_REPLAY_GOSSIP_PEERS], family, port_str) != 0)
+    {
+        rg_free();
+        return(-1);
+    }
+
+    memset(&addr, 0x0, sizeof(addr));
+    if(family == AF_INET6)
+    {
+        ((struct sockaddr_in6 *)&addr)->sin6_family = AF_INET6;
+        ((struct sockaddr_in6 *)&addr)->sin6_addr   = in6addr_any;
+        ((struct sockaddr_in6 *)&addr)->sin6_port   = htons(port);
+    }
+    else
+    {
+        ((struct sockaddr_in *)&addr)->sin_family      = AF_INET;
+        ((struct sockaddr_in *)&addr)->sin_addr.s_addr = htonl(INADDR_ANY);
+        ((struct sockaddr_in *)&addr)->sin_port        = htons(port);
+    }
+
+    /* Wake up once a second to see if we should stop.
+    */
+    tv.tv_sec  = 1;
+    tv.tv_usec = 0;
+
+    if((rg_sock = socket(family, SOCK_DGRAM, 0)) < 0
+            || setsockopt(rg_sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0
+            || (family == AF_INET6
+                && setsockopt(rg_sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) != 0)
+            || setsockopt(rg_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0
+            || bind(rg_sock, (struct sockaddr *)&addr,
+                family == AF_INET6 ? sizeof(struct sockaddr_in6)
+                    : sizeof(struct sockaddr_in)) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Unable to set up replay gossip socket on port %i: %s",
+            port, strerror(errno));
+        rg_free();
+        return(-1);
+    }
+
+    rg_opts = opts;
+    rg_stop = 0;
+
+    if(pthread_create(&rg_thread, NULL, rg_recv_thread, NULL) != 0)
+    {
+        log_msg(LOG_ERR, "replay_gossip_start: failed to start receive thread");
+        rg_free();
+        return(-1);
+    }
+
+    rg_active = 1;
+
+    log_msg(LOG_INFO, "Sharing replay digests with %i peers on UDP port %i.",
+        rg_num_peers, port);
+
+    /* Ask the peers for what they have, in case we are taking over from
+     * one of them.
+    */
+    for(i=0; i < rg_num_peers; i++)
+        if(rg_send_msg(msg, 0, REPLAY_GOSSIP_MSG_SYNC,
+                &(rg_peers[i]), rg_peer_lens[i]) != 0)
+            log_msg(LOG_WARNING, "Unable to request replay cache sync from peer %i: %s",
+                i, strerror(errno));
+
+    return(0);
+}
+
+/* Stop the receive thread and close the socket.
+*/
+void
+replay_gossip_stop(void)
+{
+    if(! rg_active)
+        return;
+
+    rg_active = 0;
+    rg_stop   = 1;
+
+    if(! pthread_equal(rg_thread, pthread_self()))
+        pthread_join(rg_thread, NULL);
+
+    rg_free();
+    return;
+}
+
+/* Send the digest of an SPA packet that was just added to the local
+ * replay cache to every peer.
+*/
+void
+replay_gossip_send(const spa_pkt_info_t *spa_pkt, const unsigned char *digest)
+{
+    unsigned char       msg[REPLAY_GOSSIP_HDR_LEN + REPLAY_GOSSIP_REC_LEN
+                            + REPLAY_GOSSIP_MAC_LEN];
+    digest_cache_info_t info;
+    int                 i;
+
+    if(! rg_active || digest == NULL)
+        return;
+
+    memset(&info, 0x0, sizeof(info));
+    info.src_ip   = spa_pkt->packet_src_addr;
+    info.dst_ip   = spa_pkt->packet_dst_addr;
+    info.src_port = spa_pkt->packet_src_port;
+    info.dst_port = spa_pkt->packet_dst_port;
+    info.proto    = spa_pkt->packet_proto;
+    info.created  = time(NULL);
+
+    rg_fill_rec(msg + REPLAY_GOSSIP_HDR_LEN, digest, &info);
+
+    for(i=0; i < rg_num_peers; i++)
+        if(rg_send_msg(msg, 1, REPLAY_GOSSIP_MSG_DIGESTS,
+                &(rg_peers[i]), rg_peer_lens[i]) != 0)
+            log_msg(LOG_WARNING, "Unable to send replay gossip to peer %i: %s",
+                i, strerror(errno));
+
+    return;
+}
+
+/***EOF***/
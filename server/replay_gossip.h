@@ -0,0 +1,98 @@
+/*
+ *****************************************************************************
+ *
+ * File:    replay_gossip.h
+ *
+ * Purpose: Header file for replay_gossip.c - sharing replay cache digests
+ *          between fwknopd gateways.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef REPLAY_GOSSIP_H
+#define REPLAY_GOSSIP_H
+
+/* Message layout (multi-byte fields in network byte order):
+ *
+ *   0   magic "FKRG"
+ *   4   version
+ *   5   number of records
+ *   6   message type (REPLAY_GOSSIP_MSG_*)
+ *   7   reserved
+ *   8   records, REPLAY_GOSSIP_REC_LEN bytes each
+ *   end HMAC-SHA256 over everything before it
+ *
+ * A server that starts up sends a sync request (with no records) to each
+ * peer, and the peers answer with every digest still inside the replay
+ * window, so the new server does not start with an empty cache.
+ *
+ * Record layout:
+ *
+ *   0   binary SPA digest (REPLAY_DIGEST_LEN bytes)
+ *   32  time the digest was added (64 bits)
+ *   40  source address (16 bytes)
+ *   56  destination address (16 bytes)
+ *   72  source and destination address versions (4 or 6)
+ *   74  protocol
+ *   75  reserved
+ *   76  source port
+ *   78  destination port
+*/
+#define REPLAY_GOSSIP_MAGIC         "FKRG"
+#define REPLAY_GOSSIP_VERSION       1
+#define REPLAY_GOSSIP_HDR_LEN       8
+#define REPLAY_GOSSIP_REC_LEN       80
+#define REPLAY_GOSSIP_MAC_LEN       32
+#define REPLAY_GOSSIP_MAX_RECS      16
+#define REPLAY_GOSSIP_MAX_MSG_LEN   (REPLAY_GOSSIP_HDR_LEN \
+                                        + REPLAY_GOSSIP_MAX_RECS * REPLAY_GOSSIP_REC_LEN \
+                                        + REPLAY_GOSSIP_MAC_LEN)
+
+#define REPLAY_GOSSIP_MSG_DIGESTS   0
+#define REPLAY_GOSSIP_MSG_SYNC      1
+
+#define REPLAY_GOSSIP_MAX_PEERS     32
+#define REPLAY_GOSSIP_MIN_KEY_LEN   16
+
+/* Digests whose timestamp is this far ahead of our clock are ignored.
+*/
+#define REPLAY_GOSSIP_MAX_SKEW      300
+
+/* A peer gets at most one snapshot per this many seconds, and snapshots
+ * are sent in bursts of REPLAY_GOSSIP_SYNC_BURST messages with a short
+ * pause in between so that the receiver's socket buffer can keep up.
+*/
+#define REPLAY_GOSSIP_SYNC_INTERVAL 10
+#define REPLAY_GOSSIP_SYNC_BURST    32
+#define REPLAY_GOSSIP_SYNC_PAUSE    2000    /* microseconds */
+
+/* Prototypes
+*/
+int replay_gossip_start(fko_srv_options_t *opts);
+void replay_gossip_stop(void);
+void replay_gossip_send(const spa_pkt_info_t *spa_pkt,
+        const unsigned char *digest);
+
+#endif /* REPLAY_GOSSIP_H */
+
+/***EOF***/
@@ -11,45 +11,81 @@
 #include "hash_table.h"
 #include "fwknopd_errors.h"
 #include "sdp_ctrl_client.h"
-#include "bstrlib.h"
 #include "service.h"
+#include "spa_arena.h"
+#include "authz_cache.h"
+#include "rcu.h"
+#include "mem_acct.h"
 
+#include <errno.h>
+#include <arpa/inet.h>
 
-#define MAX_REVERSE_SERVICE_KEY_LEN  MAX_PORT_STR_LEN + MAX_IPV4_STR_LEN + MAX_PORT_STR_LEN + 2
 
-
-//static void free_service_data(service_data_t *data)
-//{
-//
-//}
+/* Key of the reverse table: a service's details packed in binary, so a
+ * lookup needs neither formatting nor an allocation.  Always zeroed
+ * before it is filled in, since keys are compared as raw bytes.
+*/
+typedef struct service_rev_key
+{
+    uint32_t    nat_ip;         // network byte order, 0 when not set
+    uint16_t    port;
+    uint16_t    nat_port;
+    uint8_t     proto;
+    uint8_t     pad[3];
+} service_rev_key_t;
+
+typedef struct service_rev_node
+{
+    service_rev_key_t   key;
+    uint32_t            service_id;
+} service_rev_node_t;
 
 
+/* Both tables key each node by a field of the node's own data, the
+ * service ID for the forward table, so the data is all there is to free.
+*/
 static void destroy_service_hash_node_cb(hash_table_node_t *node)
 {
-    if(node->key != NULL) bdestroy((bstring)(node->key));
-    if(node->data != NULL)
-    {
-        //free_service_data((service_data_t*)(node->data));
-        free(node->data);
-    }
+    mem_free(MEM_TAG_SERVICE, node->data);
 }
 
+static int compare_service_id_cb(void *a, void *b)
+{
+    return *(uint32_t *)a != *(uint32_t *)b;
+}
 
-static void destroy_reverse_service_hash_node_cb(hash_table_node_t *node)
+static uint32_t hash_u32(uint32_t h)
 {
-    if(node->key != NULL) bdestroy((bstring)(node->key));
-    if(node->data != NULL)
-    {
-        free(node->data);
-    }
+    h ^= h >> 16;
+    h *= 0x7feb352d;
+    h ^= h >> 15;
+    h *= 0x846ca68b;
+    h ^= h >> 16;
+    return h;
 }
 
+static uint32_t hash_service_id_cb(void *key)
+{
+    return hash_u32(*(uint32_t *)key);
+}
 
-static int traverse_dump_service_cb(hash_table_node_t *node, void *dest)
+static int compare_rev_key_cb(void *a, void *b)
+{
+    return memcmp(a, b, sizeof(service_rev_key_t));
+}
+
+static uint32_t hash_rev_key_cb(void *key)
 {
-    service_data_t *service_data = (service_data_t *)(node->data);
+    service_rev_key_t *k = (service_rev_key_t *)key;
+
+    return hash_u32(k->nat_ip
+            ^ hash_u32(((uint32_t)k->port << 16 | k->nat_port) ^ ((uint32_t)k->proto << 8)));
+}
 
-    fprintf((FILE*)dest,
+
+void dump_service_data(const service_data_t *service_data, FILE *dest)
+{
+    fprintf(dest,
         "SERVICE ID:  %"PRIu32"\n"
         "==============================================================\n"
         "             PROTO:  %s\n"
@@ -63,15 +99,30 @@ static int traverse_dump_service_cb(hash_table_node_t *node, void *dest)
         service_data->nat_port
     );
 
-    fprintf((FILE*)dest, "\n");
+    fprintf(dest, "\n");
+    return;
+}
 
+static int traverse_dump_service_cb(hash_table_node_t *node, void *dest)
+{
+    dump_service_data((service_data_t *)(node->data), (FILE*)dest);
     return 0;
 }
 
 
 
+/* The forward and reverse service tables of one published version.
+ * Readers only ever see complete versions; a controller message builds a
+ * new pair and swaps it in.
+*/
+typedef struct service_tables
+{
+    hash_table_t   *fwd;
+    hash_table_t   *rev;
+} service_tables_t;
+
 // create table
-int create_service_table(fko_srv_options_t *opts)
+static int create_service_tables(fko_srv_options_t *opts, service_tables_t *tbls)
 {
     int is_err = 0;
     int hash_table_len = 0;
@@ -96,10 +147,11 @@ int create_service_table(fko_srv_options_t *opts)
         return FWKNOPD_ERROR_BAD_CONFIG;
     }
 
-    opts->service_hash_tbl = hash_table_create(hash_table_len,
-            NULL, NULL, destroy_service_hash_node_cb);
+    tbls->rev = NULL;
+    tbls->fwd = hash_table_create(hash_table_len,
+            compare_service_id_cb, hash_service_id_cb, destroy_service_hash_node_cb);
 
-    if(opts->service_hash_tbl == NULL)
+    if(tbls->fwd == NULL)
     {
         log_msg(LOG_ERR,
             "[*] Fatal memory allocation error creating service hash table"
@@ -107,14 +159,79 @@ int create_service_table(fko_srv_options_t *opts)
         return FWKNOPD_ERROR_MEMORY_ALLOCATION;
     }
 
-    opts->reverse_service_hash_tbl = hash_table_create(hash_table_len,
-            NULL, NULL, destroy_reverse_service_hash_node_cb);
+    tbls->rev = hash_table_create(hash_table_len,
+            compare_rev_key_cb, hash_rev_key_cb, destroy_service_hash_node_cb);
 
-    if(opts->reverse_service_hash_tbl == NULL)
+    if(tbls->rev == NULL)
     {
         log_msg(LOG_ERR,
             "[*] Fatal memory allocation error creating reverse service hash table"
         );
+        hash_table_destroy(tbls->fwd);
+        tbls->fwd = NULL;
+        return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+    }
+
+    return FWKNOPD_SUCCESS;
+}
+
+static void destroy_service_tables(service_tables_t *tbls)
+{
+    if(tbls->fwd != NULL)
+        hash_table_destroy(tbls->fwd);
+    if(tbls->rev != NULL)
+        hash_table_destroy(tbls->rev);
+    tbls->fwd = NULL;
+    tbls->rev = NULL;
+}
+
+typedef struct service_copy_arg
+{
+    hash_table_t   *dst;
+    size_t          data_len;
+} service_copy_arg_t;
+
+// the key lives inside the data, at the same offset in the copy
+static int copy_service_node_cb(hash_table_node_t *node, void *arg)
+{
+    service_copy_arg_t *copy = (service_copy_arg_t *)arg;
+    char *data = NULL;
+
+    if((data = mem_malloc(MEM_TAG_SERVICE, copy->data_len)) == NULL)
+        return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+
+    memcpy(data, node->data, copy->data_len);
+
+    if(hash_table_set(copy->dst, data + ((char *)node->key - (char *)node->data), data) != FKO_SUCCESS)
+    {
+        mem_free(MEM_TAG_SERVICE, data);
+        return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+    }
+
+    return 0;
+}
+
+/* Deep copy the published tables so a controller update can edit the
+ * copy while readers keep using the original.
+*/
+static int copy_service_tables(fko_srv_options_t *opts, service_tables_t *dst)
+{
+    service_copy_arg_t fwd_arg, rev_arg;
+    int rv;
+
+    if((rv = create_service_tables(opts, dst)) != FWKNOPD_SUCCESS)
+        return rv;
+
+    fwd_arg.dst      = dst->fwd;
+    fwd_arg.data_len = sizeof(service_data_t);
+    rev_arg.dst      = dst->rev;
+    rev_arg.data_len = sizeof(service_rev_node_t);
+
+    if(hash_table_traverse(opts->service_hash_tbl, copy_service_node_cb, &fwd_arg) != 0
+            || hash_table_traverse(opts->reverse_service_hash_tbl, copy_service_node_cb, &rev_arg) != 0)
+    {
+        log_msg(LOG_ERR, "Fatal memory error copying service tables");
+        destroy_service_tables(dst);
         return FWKNOPD_ERROR_MEMORY_ALLOCATION;
     }
 
@@ -145,94 +262,62 @@ void destroy_service_table(fko_srv_options_t *opts)
 }
 
 
-static bstring make_reverse_lookup_key(char *protocol, unsigned int port, char *nat_ip, unsigned int nat_port)
+static int make_reverse_lookup_key(unsigned int proto, unsigned int port,
+        uint32_t nat_ip, unsigned int nat_port, service_rev_key_t *key)
 {
-    char key[MAX_REVERSE_SERVICE_KEY_LEN + 1] = {0};
-
-    // convert the service id integer to a bstring
-    if(nat_ip != NULL) // && nat_ip[0] != 0 && nat_port != 0)
-    {
-        snprintf(key,
-                 MAX_REVERSE_SERVICE_KEY_LEN+1,
-                 "%s_%u_%s_%u",
-                 protocol,
-                 port,
-                 nat_ip,
-                 nat_port);
-    }
-    else
-    {
-        snprintf(key,
-                 MAX_REVERSE_SERVICE_KEY_LEN+1,
-                 "%s_%u",
-                 protocol,
-                 port);
-    }
+    if(proto != PROTO_TCP && proto != PROTO_UDP)
+        return FWKNOPD_ERROR_BAD_SERVICE_DATA;
 
-    log_msg(LOG_DEBUG, "Created reverse service lookup key: %s", key);
+    memset(key, 0, sizeof(*key));
+    key->proto    = proto;
+    key->port     = port;
+    key->nat_ip   = nat_ip;
+    key->nat_port = nat_port;
 
-    return bfromcstr(key);
+    return FWKNOPD_SUCCESS;
 }
 
-static int modify_reverse_service_table(fko_srv_options_t *opts, int delete, service_data_t *service_data)
+static int modify_reverse_service_table(hash_table_t *rev_tbl, int delete, service_data_t *service_data)
 {
-    bstring key = NULL;
-    uint32_t *service_id = NULL;
-    char *proto = NULL;
-
-    if(service_data->proto == PROTO_TCP)
-        proto = "tcp";
-    else if(service_data->proto == PROTO_UDP)
-        proto = "udp";
-    else
-        return FWKNOPD_ERROR_BAD_SERVICE_DATA;
-
+    service_rev_key_t key;
+    service_rev_node_t *node = NULL;
 
-    if((key = make_reverse_lookup_key(proto,
-                                      service_data->port,
-                                      service_data->nat_ip_str,
-                                      service_data->nat_port)) == NULL)
-    {
-        log_msg(LOG_ERR,
-            "Fatal error creating reverse service lookup key"
-        );
-        return FWKNOPD_ERROR_MEMORY_ALLOCATION;
-    }
+    if(make_reverse_lookup_key(service_data->proto, service_data->port,
+                service_data->nat_ip, service_data->nat_port, &key) != FWKNOPD_SUCCESS)
+        return FWKNOPD_ERROR_BAD_SERVICE_DATA;
 
     if(delete)
     {
-        hash_table_delete(opts->reverse_service_hash_tbl, key);
-        bdestroy(key);
+        hash_table_delete(rev_tbl, &key);
         return FWKNOPD_SUCCESS;
     }
 
-    if((service_id = calloc(1, sizeof(uint32_t))) == NULL)
+    if((node = mem_calloc(MEM_TAG_SERVICE, 1, sizeof(service_rev_node_t))) == NULL)
     {
         log_msg(LOG_ERR,
             "Fatal memory error creating reverse lookup data"
         );
-        bdestroy(key);
         return FWKNOPD_ERROR_MEMORY_ALLOCATION;
     }
 
-    //memcpy(service_id, service_data->service_id, sizeof(uint32_t));
-    *service_id = service_data->service_id;
+    node->key = key;
+    node->service_id = service_data->service_id;
 
-    if( hash_table_set(opts->reverse_service_hash_tbl, key, service_id) != FKO_SUCCESS )
+    if( hash_table_set(rev_tbl, &(node->key), node) != FKO_SUCCESS )
     {
         log_msg(LOG_ERR,
             "Fatal error creating reverse service lookup hash table node"
         );
-        bdestroy(key);
-        free(service_id);
+        mem_free(MEM_TAG_SERVICE, node);
         return FWKNOPD_ERROR_MEMORY_ALLOCATION;
     }
 
     log_msg(LOG_DEBUG,
             "Created reverse service lookup node: \n"
-            "\tKEY: %s \n"
+            "\tKEY: %u_%u_%s_%u \n"
             "\tSERVICE ID: %"PRIu32,
-            bdata(key), *service_id);
+            service_data->proto, service_data->port, service_data->nat_ip_str,
+            service_data->nat_port, node->service_id);
 
     return FWKNOPD_SUCCESS;
 }
@@ -246,7 +331,7 @@ static int make_service_data_from_json(fko_srv_options_t *opts, json_object *jda
     int rv = FWKNOPD_SUCCESS;
     char *tmp = NULL;
     int str_len = 0;
-    service_data_t *service_data = calloc(1, sizeof(service_data_t));
+    service_data_t *service_data = mem_calloc(MEM_TAG_SERVICE, 1, sizeof(service_data_t));
 
     if(service_data == NULL)
     {
@@ -306,6 +391,7 @@ static int make_service_data_from_json(fko_srv_options_t *opts, json_object *jda
     {
         str_len = strnlen(tmp, MAX_IPV4_STR_LEN);
         memcpy(service_data->nat_ip_str, tmp, str_len);
+        inet_pton(AF_INET, service_data->nat_ip_str, &(service_data->nat_ip));
     }
 
     free(tmp);
@@ -327,7 +413,7 @@ cleanup:
     if(rv != SDP_SUCCESS)
     {
         //free_service_data(service_data);
-        free(service_data);
+        mem_free(MEM_TAG_SERVICE, service_data);
         *r_service_data = NULL;
     }
     else
@@ -340,15 +426,14 @@ cleanup:
 
 
 // modify table
-static int modify_service_table(fko_srv_options_t *opts, int service_array_len, json_object *jdata)
+static int modify_service_table(fko_srv_options_t *opts, service_tables_t *tbls, int service_array_len, json_object *jdata)
 {
     int rv = FWKNOPD_SUCCESS;
     int idx = 0;
     int nodes = 0;
     json_object *jservice = NULL;
-    bstring key = NULL;
     service_data_t *new_service = NULL;
-    char id[SDP_MAX_SERVICE_ID_STR_LEN + 1] = {0};
+    service_data_t *old_service = NULL;
 
     // walk through the access array
     for(idx = 0; idx < service_array_len; idx++)
@@ -366,21 +451,20 @@ static int modify_service_table(fko_srv_options_t *opts, int service_array_len,
             continue;
         }
 
-        // convert the service id integer to a bstring
-        snprintf(id, SDP_MAX_SERVICE_ID_STR_LEN, "%"PRIu32, new_service->service_id);
-        key = bfromcstr(id);
+        // an updated service may have moved, drop its old reverse entry
+        if((old_service = hash_table_get(tbls->fwd, &(new_service->service_id))) != NULL)
+            modify_reverse_service_table(tbls->rev, 1, old_service);
 
-        if( hash_table_set(opts->service_hash_tbl, key, new_service) != FKO_SUCCESS )
+        if( hash_table_set(tbls->fwd, &(new_service->service_id), new_service) != FKO_SUCCESS )
         {
             log_msg(LOG_ERR,
                 "Fatal error creating service hash table node"
             );
-            bdestroy(key);
-            free(new_service);
+            mem_free(MEM_TAG_SERVICE, new_service);
             return FWKNOPD_ERROR_MEMORY_ALLOCATION;
         }
 
-        if( modify_reverse_service_table(opts, 0, new_service) != FWKNOPD_SUCCESS )
+        if( modify_reverse_service_table(tbls->rev, 0, new_service) != FWKNOPD_SUCCESS )
         {
             return FWKNOPD_ERROR_MEMORY_ALLOCATION;
         }
@@ -402,14 +486,13 @@ static int modify_service_table(fko_srv_options_t *opts, int service_array_len,
 }
 
 
-static void remove_service_data_nodes(fko_srv_options_t *opts, int service_array_len, json_object *jdata)
+static void remove_service_data_nodes(service_tables_t *tbls, int service_array_len, json_object *jdata)
 {
     int rv = FKO_SUCCESS;
     int idx;
     int service_id = 0;
     json_object *jentry = NULL;
-    bstring key = NULL;
-    char id[SDP_MAX_SERVICE_ID_STR_LEN + 1] = {0};
+    uint32_t key = 0;
     service_data_t *service_data = NULL;
 
     // walk through the access array
@@ -422,22 +505,20 @@ static void remove_service_data_nodes(fko_srv_options_t *opts, int service_array
             continue;
         }
 
-        // convert the service id integer to a bstring
-        snprintf(id, SDP_MAX_SERVICE_ID_STR_LEN, "%d", service_id);
-        key = bfromcstr(id);
+        key = (uint32_t)service_id;
 
         // first get the data in order to find and delete the reverse lookup node
-        if((service_data = hash_table_get(opts->service_hash_tbl, key)) == NULL)
+        if((service_data = hash_table_get(tbls->fwd, &key)) == NULL)
         {
             log_msg(LOG_WARNING, "Did not find hash table node with service ID %d to remove. Continuing.", service_id);
             continue;
         }
         else
         {
-            modify_reverse_service_table(opts, 1, service_data);
+            modify_reverse_service_table(tbls->rev, 1, service_data);
         }
 
-        if( hash_table_delete(opts->service_hash_tbl, key) != FKO_SUCCESS )
+        if( hash_table_delete(tbls->fwd, &key) != FKO_SUCCESS )
         {
             log_msg(LOG_WARNING, "Did not find hash table node with service ID %d to remove. Continuing.", service_id);
         }
@@ -445,19 +526,22 @@ static void remove_service_data_nodes(fko_srv_options_t *opts, int service_array
         {
             log_msg(LOG_NOTICE, "Removed access stanza for service ID %d from service list.", service_id);
         }
-
-        bdestroy(key);
     }
 }
 
 
 /* Take a json data array from a controller message
  * Alter/recreate the hash table based on the action
+ *
+ * The published tables are never edited.  The update is applied to a
+ * copy (or to new tables for a refresh), the copy is swapped in, and the
+ * old tables are freed once no reader can still be using them.
  */
 int process_service_msg(fko_srv_options_t *opts, int action, json_object *jdata)
 {
     int rv = FWKNOPD_SUCCESS;
     int service_array_len = 0;
+    service_tables_t old_tbls, new_tbls;
 
     if(jdata == NULL || json_object_get_type(jdata) == json_type_null)
     {
@@ -476,58 +560,57 @@ int process_service_msg(fko_srv_options_t *opts, int action, json_object *jdata)
         log_msg(LOG_DEBUG, "jdata contains %d objects", service_array_len);
     }
 
-    // lock the hash table mutex
+    // the mutex only serializes writers, readers never take it
     if(pthread_mutex_lock(&(opts->service_hash_tbl_mutex)))
     {
         log_msg(LOG_ERR, "Service table mutex lock error.");
         return FWKNOPD_ERROR_MUTEX;
     }
 
-    if(action == CTRL_ACTION_SERVICE_REMOVE)
-    {
-        if(opts->service_hash_tbl == NULL)
-        {
-            //table is not initialized, nothing to do
-            log_msg(LOG_WARNING, "Received service remove message, but service table not "
-                    "initialized. Nothing to do.");
-            pthread_mutex_unlock(&(opts->service_hash_tbl_mutex));
-            return FWKNOPD_ERROR_UNTIMELY_MSG;
-        }
+    old_tbls.fwd = opts->service_hash_tbl;
+    old_tbls.rev = opts->reverse_service_hash_tbl;
 
-        remove_service_data_nodes(opts, service_array_len, jdata);
+    if(action == CTRL_ACTION_SERVICE_REMOVE && old_tbls.fwd == NULL)
+    {
+        //table is not initialized, nothing to do
+        log_msg(LOG_WARNING, "Received service remove message, but service table not "
+                "initialized. Nothing to do.");
         pthread_mutex_unlock(&(opts->service_hash_tbl_mutex));
-
-        return FWKNOPD_SUCCESS;
+        return FWKNOPD_ERROR_UNTIMELY_MSG;
     }
 
-    // if this is service data refresh, destroy the hash table
-    if(action == CTRL_ACTION_SERVICE_REFRESH)
+    // a refresh starts from empty tables, anything else from a copy
+    if(action == CTRL_ACTION_SERVICE_REFRESH || old_tbls.fwd == NULL)
+        rv = create_service_tables(opts, &new_tbls);
+    else
+        rv = copy_service_tables(opts, &new_tbls);
+
+    if(rv != FWKNOPD_SUCCESS)
     {
-        if(opts->service_hash_tbl != NULL)
-        {
-            // destroy the table
-            hash_table_destroy(opts->service_hash_tbl);
-            opts->service_hash_tbl = NULL;
-        }
+        pthread_mutex_unlock(&(opts->service_hash_tbl_mutex));
+        return rv;
     }
 
-    // create the hash table if necessary
-    if(opts->service_hash_tbl == NULL)
+    if(action == CTRL_ACTION_SERVICE_REMOVE)
+    {
+        remove_service_data_nodes(&new_tbls, service_array_len, jdata);
+    }
+    else
     {
-        //need to initialize hash table
-        if((rv = create_service_table(opts)) != FWKNOPD_SUCCESS)
+        // control message is either REFRESH or UPDATE
+        // in either case, use data array to modify the table
+        if((rv = modify_service_table(opts, &new_tbls, service_array_len, jdata)) != FWKNOPD_SUCCESS)
         {
-            pthread_mutex_unlock(&(opts->service_hash_tbl_mutex));
-            return rv;
+            log_msg(LOG_ERR, "modify_service_table was unsuccessful");
         }
     }
 
-    // control message is either REFRESH or UPDATE
-    // in either case, use data array to modify the table
-    if((rv = modify_service_table(opts, service_array_len, jdata)) != FWKNOPD_SUCCESS)
-    {
-        log_msg(LOG_ERR, "modify_service_table was unsuccessful");
-    }
+    rcu_assign_pointer(opts->service_hash_tbl, new_tbls.fwd);
+    rcu_assign_pointer(opts->reverse_service_hash_tbl, new_tbls.rev);
+    authz_cache_flush();
+
+    rcu_synchronize();
+    destroy_service_tables(&old_tbls);
 
     // release lock on the table
     pthread_mutex_unlock(&(opts->service_hash_tbl_mutex));
@@ -536,249 +619,177 @@ int process_service_msg(fko_srv_options_t *opts, int action, json_object *jdata)
 }
 
 
-// look up service info
-int get_service_data(fko_srv_options_t *opts, uint32_t service_id, service_data_t**r_service_data)
+static service_data_t *copy_service_data_to_arena(spa_arena_t *arena, const service_data_t *service_data)
 {
-    int rv = FWKNOPD_SUCCESS;
-    bstring key = NULL;
-    service_data_t *service_data = NULL;
     service_data_t *copy_service_data = NULL;
-    char id[SDP_MAX_SERVICE_ID_STR_LEN + 1] = {0};
 
-    // convert the service id integer to a bstring
-    snprintf(id, SDP_MAX_SERVICE_ID_STR_LEN, "%"PRIu32, service_id);
-    key = bfromcstr(id);
-
-    // lock the hash table mutex
-    if(pthread_mutex_lock(&(opts->service_hash_tbl_mutex)))
+    if((copy_service_data = spa_arena_alloc(arena, sizeof(service_data_t))) == NULL)
     {
-        log_msg(LOG_ERR, "Service table mutex lock error.");
-        bdestroy(key);
-        *r_service_data = NULL;
-        return FWKNOPD_ERROR_BAD_SERVICE_DATA;
+        log_msg(LOG_ERR, "Fatal memory error creating service_data_t object");
+        return NULL;
     }
 
-    service_data = hash_table_get(opts->service_hash_tbl, key);
+    memcpy(copy_service_data, service_data, sizeof(service_data_t));
+    return copy_service_data;
+}
+
 
-    pthread_mutex_unlock(&(opts->service_hash_tbl_mutex));
-    bdestroy(key);
+// look up service info
+int get_service_data(fko_srv_options_t *opts, spa_arena_t *arena, uint32_t service_id, service_data_t**r_service_data)
+{
+    hash_table_t *tbl = NULL;
+    service_data_t *service_data = NULL;
+
+    *r_service_data = NULL;
+
+    // the entry is copied out before leaving the read-side section
+    rcu_read_lock();
+
+    if((tbl = rcu_dereference(opts->service_hash_tbl)) != NULL)
+        service_data = hash_table_get(tbl, &service_id);
 
     if( service_data == NULL )
     {
+        rcu_read_unlock();
         log_msg(LOG_WARNING,
             "Did not find service hash table node for service id %"PRIu32,
             service_id
         );
-        *r_service_data = NULL;
         return FWKNOPD_ERROR_BAD_SERVICE_DATA;
     }
-    else
-    {
-        if((copy_service_data = calloc(1, sizeof(service_data_t))) == NULL)
-        {
-            log_msg(LOG_ERR, "Fatal memory error creating service_data_t object");
-            return FWKNOPD_ERROR_MEMORY_ALLOCATION;
-        }
-
-        copy_service_data->service_id = service_data->service_id;
-        copy_service_data->proto      = service_data->proto;
-        copy_service_data->port       = service_data->port;
-        copy_service_data->nat_port   = service_data->nat_port;
-        strncpy(copy_service_data->nat_ip_str, service_data->nat_ip_str, MAX_IPV4_STR_LEN);
-
-        *r_service_data = copy_service_data;
-    }
 
-    return rv;
-}
+    *r_service_data = copy_service_data_to_arena(arena, service_data);
+    rcu_read_unlock();
 
-void free_service_data_list(service_data_list_t *service_data_list)
-{
-    service_data_list_t *next = NULL;
-
-    while(service_data_list != NULL)
-    {
-        next = service_data_list->next;
-        if(service_data_list->service_data != NULL)
-            free(service_data_list->service_data);
-
-        free(service_data_list);
-        service_data_list = next;
-    }
+    return *r_service_data != NULL ? FWKNOPD_SUCCESS : FWKNOPD_ERROR_MEMORY_ALLOCATION;
 }
 
-
-int get_service_data_list(fko_srv_options_t *opts, char *service_str, service_data_list_t **r_service_data_list)
+/* Build the list of service data for a comma separated list of service
+ * IDs.  The IDs are read in place and all looked up in one read-side
+ * section.  The list is allocated from the packet's arena and goes away
+ * with it, so there is nothing to free.
+*/
+int get_service_data_list(fko_srv_options_t *opts, spa_arena_t *arena, char *service_str, service_data_list_t **r_service_data_list)
 {
-    int rv = FWKNOPD_SUCCESS, ctr = 0;
-    const int buf_len = SDP_MAX_SERVICE_ID_STR_LEN + 1;
-    char  buf[SDP_MAX_SERVICE_ID_STR_LEN + 1] = {0};
-    char *ndx, *start;
+    int rv = FWKNOPD_SUCCESS;
+    char *ndx = service_str, *end = NULL;
+    unsigned long id = 0;
+    hash_table_t *tbl = NULL;
     service_data_list_t *service_data_list = NULL;
     service_data_list_t *new_guy = NULL;
     service_data_list_t *last_guy = NULL;
     service_data_t *service_data = NULL;
-    int id = 0, is_err = 0;
+    uint32_t key = 0;
 
-    start = service_str;
+    *r_service_data_list = NULL;
+
+    rcu_read_lock();
+    tbl = rcu_dereference(opts->service_hash_tbl);
 
-    for(ndx = start; *ndx != '\0'; ndx++)
+    while(1)
     {
-        if(*ndx == ',')
+        // plain decimal digits only, no sign or white space
+        errno = 0;
+        id = 0;
+        if(*ndx >= '0' && *ndx <= '9')
+            id = strtoul(ndx, &end, 10);
+
+        if(id == 0 || id > UINT32_MAX || errno != 0
+                || (end - ndx) > SDP_MAX_SERVICE_ID_STR_LEN
+                || (*end != ',' && *end != '\0'))
         {
-            if((ctr >= buf_len)
-                    || (((ndx-start)+1) >= buf_len))
-            {
-                log_msg(LOG_ERR,
-                        "[*] Unable to create service_data_list from incoming data: %s",
-                        service_str);
-                rv = FWKNOPD_ERROR_BAD_SERVICE_DATA;
-                goto cleanup;
-            }
-            strlcpy(buf, start, (ndx-start)+1);
+            rcu_read_unlock();
+            log_msg(LOG_ERR,
+                    "get_service_data_list() did not find valid service id number in %s",
+                    service_str);
+            return FWKNOPD_ERROR_BAD_SERVICE_DATA;
+        }
 
-            if((id = strtoul_wrapper(buf, 0, UINT32_MAX, NO_EXIT_UPON_ERR, &is_err)) == 0)
-            {
-                log_msg(LOG_ERR,
-                        "get_service_data_list() did not find valid service id number in buf %s",
-                        buf);
-                rv = FWKNOPD_ERROR_BAD_SERVICE_DATA;
-                goto cleanup;
-            }
-            else if((rv = get_service_data(opts, id, &service_data)) == FWKNOPD_ERROR_MEMORY_ALLOCATION)
-            {
-                goto cleanup;
-            }
-            else if(rv == FWKNOPD_SUCCESS && service_data != NULL)
+        key = (uint32_t)id;
+        if(tbl == NULL || (service_data = hash_table_get(tbl, &key)) == NULL)
+        {
+            log_msg(LOG_WARNING,
+                "Did not find service hash table node for service id %"PRIu32,
+                key
+            );
+        }
+        else
+        {
+            if((new_guy = spa_arena_alloc(arena, sizeof(service_data_list_t))) == NULL
+                    || (new_guy->service_data = copy_service_data_to_arena(arena, service_data)) == NULL)
             {
-            	if((new_guy = calloc(1, sizeof(service_data_list_t))) == NULL)
-            	{
-            		free(service_data);
-                    rv = FWKNOPD_ERROR_MEMORY_ALLOCATION;
-                    goto cleanup;
-            	}
-
-            	new_guy->service_data = service_data;
-
-                if(service_data_list == NULL)
-                {
-                    service_data_list = new_guy;
-                }
-                else
-                {
-                    last_guy->next = new_guy;
-                }
-
-                last_guy = new_guy;
-                new_guy = NULL;
+                rv = FWKNOPD_ERROR_MEMORY_ALLOCATION;
+                break;
             }
 
-            start = ndx+1;
-            ctr = 0;
+            new_guy->next = NULL;
+
+            if(service_data_list == NULL)
+                service_data_list = new_guy;
+            else
+                last_guy->next = new_guy;
+
+            last_guy = new_guy;
         }
-        ctr++;
-    }
 
-    if((ctr >= buf_len)
-            || (((ndx-start)+1) >= buf_len))
-    {
-        log_msg(LOG_ERR,
-                "[*] Unable to create service_data_list from incoming data: %s",
-                service_str);
-        rv = FWKNOPD_ERROR_BAD_SERVICE_DATA;
-        goto cleanup;
-    }
-    strlcpy(buf, start, (ndx-start)+1);
+        if(*end == '\0')
+            break;
 
-    if((id = strtoul_wrapper(buf, 0, UINT32_MAX, NO_EXIT_UPON_ERR, &is_err)) == 0)
-    {
-        log_msg(LOG_ERR,
-                "get_service_data_list() did not find valid service id number in buf %s",
-                buf);
-        rv = FWKNOPD_ERROR_BAD_SERVICE_DATA;
-        goto cleanup;
+        ndx = end + 1;
     }
-    else if((rv = get_service_data(opts, id, &service_data)) == FWKNOPD_ERROR_MEMORY_ALLOCATION)
-    {
-        goto cleanup;
-    }
-    else if(rv == FWKNOPD_SUCCESS && service_data != NULL)
-    {
-    	if((new_guy = calloc(1, sizeof(service_data_list_t))) == NULL)
-    	{
-    		free(service_data);
-            rv = FWKNOPD_ERROR_MEMORY_ALLOCATION;
-            goto cleanup;
-    	}
 
-    	new_guy->service_data = service_data;
+    rcu_read_unlock();
 
-        if(service_data_list == NULL)
-        {
-            service_data_list = new_guy;
-        }
-        else
-        {
-            last_guy->next = new_guy;
-        }
-    }
+    if(rv != FWKNOPD_SUCCESS)
+        return rv;
 
     if(service_data_list == NULL)
-    {
-        *r_service_data_list = NULL;
         return FWKNOPD_ERROR_BAD_SERVICE_DATA;
-    }
 
     *r_service_data_list = service_data_list;
     return FWKNOPD_SUCCESS;
-
-cleanup:
-    free_service_data_list(service_data_list);
-    *r_service_data_list = NULL;
-    return rv;
 }
 
 
 int get_service_id_by_details(fko_srv_options_t *opts, char *protocol, int port, char *nat_ip, int nat_port, uint32_t *r_id)
 {
-    int rv = FWKNOPD_SUCCESS;
-    uint32_t *id = NULL;
-    bstring key = NULL;
+    service_rev_key_t key;
+    service_rev_node_t *node = NULL;
+    hash_table_t *tbl = NULL;
+    unsigned int proto = 0;
+    uint32_t nat_addr = 0;
 
-    if((key = make_reverse_lookup_key(protocol, port, nat_ip, nat_port)) == NULL)
-    {
-        log_msg(LOG_ERR,
-            "Fatal error creating reverse service lookup key"
-        );
-        return FWKNOPD_ERROR_MEMORY_ALLOCATION;
-    }
+    *r_id = 0;
 
-    // lock the hash table mutex
-    if(pthread_mutex_lock(&(opts->service_hash_tbl_mutex)))
+    if(strcasecmp(protocol, "tcp") == 0)
+        proto = PROTO_TCP;
+    else if(strcasecmp(protocol, "udp") == 0)
+        proto = PROTO_UDP;
+
+    // an empty or missing NAT address is stored as 0, as for services
+    if(nat_ip != NULL && nat_ip[0] != '\0' && inet_pton(AF_INET, nat_ip, &nat_addr) != 1)
+        nat_addr = 0;
+
+    if(make_reverse_lookup_key(proto, port, nat_addr, nat_port, &key) != FWKNOPD_SUCCESS)
     {
-        log_msg(LOG_ERR, "Service table mutex lock error.");
-        rv = FWKNOPD_ERROR_MUTEX;
-        goto cleanup;
+        log_msg(LOG_WARNING, "Could not identify service using provided data");
+        return FWKNOPD_ERROR_BAD_SERVICE_DATA;
     }
 
-    if((id = hash_table_get(opts->reverse_service_hash_tbl, key)) == NULL)
+    rcu_read_lock();
+
+    if((tbl = rcu_dereference(opts->reverse_service_hash_tbl)) == NULL
+            || (node = hash_table_get(tbl, &key)) == NULL)
     {
-        pthread_mutex_unlock(&(opts->service_hash_tbl_mutex));
+        rcu_read_unlock();
         log_msg(LOG_WARNING, "Could not identify service using provided data");
-        rv = FWKNOPD_ERROR_BAD_SERVICE_DATA;
-        goto cleanup;
+        return FWKNOPD_ERROR_BAD_SERVICE_DATA;
     }
 
-    pthread_mutex_unlock(&(opts->service_hash_tbl_mutex));
-
-    *r_id = *id;
-    bdestroy(key);
-    return rv;
+    *r_id = node->service_id;
+    rcu_read_unlock();
 
-cleanup:
-    bdestroy(key);
-    *r_id = 0;
-    return rv;
+    return FWKNOPD_SUCCESS;
 }
 
 
@@ -818,16 +829,10 @@ void dump_service_list(fko_srv_options_t *opts)
             return;
         }
 
-        // lock the hash table mutex
-        if(pthread_mutex_lock(&(opts->service_hash_tbl_mutex)))
-        {
-            fprintf(dest, "Mutex lock error.");
-            return;
-        }
-
-        hash_table_traverse(opts->service_hash_tbl, traverse_dump_service_cb, dest);
-
-        pthread_mutex_unlock(&(opts->service_hash_tbl_mutex));
+        rcu_read_lock();
+        hash_table_traverse(rcu_dereference(opts->service_hash_tbl),
+                traverse_dump_service_cb, dest);
+        rcu_read_unlock();
     }
 
     fprintf(dest, "\n");
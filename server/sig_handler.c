@@ -29,11 +29,16 @@
  *****************************************************************************
 */
 #include "fwknopd_common.h"
+#include "replay_cache.h"
+#include "mem_acct.h"
 #include "log_msg.h"
 #include "sig_handler.h"
 #include "service.h"
 #include "access.h"
 #include "config_init.h"
+#include "config_dump.h"
+#include "reload.h"
+#include "upgrade.h"
 
 #if HAVE_SYS_WAIT_H
   #include <sys/wait.h>
@@ -158,25 +163,41 @@ sig_do_stop(fko_srv_options_t * const opts)
     */
     if(got_signal != 0)
     {
-        if(got_sigint || got_sigterm || got_sighup)
+        if(got_sigint || got_sigterm)
         {
             return 1;
         }
+        else if(got_sighup)
+        {
+            /* Re-read the configs in the background, unless that reload
+             * sent this SIGHUP to restart the main loop.
+            */
+            if(reload_restart_pending())
+                return 1;
+
+            got_sighup = 0;
+            got_signal = 0;
+            reload_request(opts);
+        }
         else if(got_sigusr1)
         {
-            log_msg(LOG_INFO, "Got SIGUSR1. Dumping config...");
+            /* The dump is written from its own thread.
+            */
             got_sigusr1 = 0;
             got_signal = 0;
-            dump_config(opts);
-            dump_service_list(opts);
-            dump_access_list(opts);
+            config_dump_request(opts);
         }
         else if(got_sigusr2)
         {
-            /* Not doing anything with this yet.
+            /* A new fwknopd wants to take over (fwknopd --upgrade).  The
+             * upgrade thread raises SIGUSR2 again once it is ready, which
+             * stops the loop.
             */
             got_sigusr2 = 0;
             got_signal = 0;
+            if(upgrade_handoff_pending())
+                return 1;
+            upgrade_request(opts);
         }
         else
             got_signal = 0;
@@ -0,0 +1,183 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_arena.c
+ *
+ * Purpose: A per-packet bump allocator.  Everything fwknopd allocates
+ *          while authorizing one SPA packet (the stanza candidate list,
+ *          the requested service list) comes out of the calling thread's
+ *          arena, and it is all wiped and released together by a single
+ *          spa_arena_reset() once the packet has been handled.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "mem_acct.h"
+#include "spa_arena.h"
+#include "log_msg.h"
+
+static pthread_key_t    spa_arena_key;
+static pthread_once_t   spa_arena_key_once = PTHREAD_ONCE_INIT;
+
+static spa_arena_chunk_t *
+chunk_new(const size_t len)
+{
+    spa_arena_chunk_t  *chunk;
+    size_t              size = SPA_ARENA_CHUNK_SIZE;
+
+    if(len > size)
+        size = len;
+
+    if((chunk = mem_calloc(MEM_TAG_ARENA, 1, sizeof(spa_arena_chunk_t))) == NULL)
+        return NULL;
+
+    if((chunk->data = mem_calloc(MEM_TAG_ARENA, 1, size)) == NULL)
+    {
+        mem_free(MEM_TAG_ARENA, chunk);
+        return NULL;
+    }
+    chunk->size = size;
+
+    return chunk;
+}
+
+static void
+spa_arena_destroy(void *arg)
+{
+    spa_arena_t        *arena = arg;
+    spa_arena_chunk_t  *chunk, *next;
+
+    spa_arena_reset(arena);
+
+    for(chunk = arena->head; chunk != NULL; chunk = next)
+    {
+        next = chunk->next;
+        mem_free(MEM_TAG_ARENA, chunk->data);
+        mem_free(MEM_TAG_ARENA, chunk);
+    }
+    mem_free(MEM_TAG_ARENA, arena);
+    return;
+}
+
+static void
+spa_arena_key_init(void)
+{
+    pthread_key_create(&spa_arena_key, spa_arena_destroy);
+    return;
+}
+
+/* Return the calling thread's arena, creating it on first use.  Returns
+ * NULL if it could not be allocated.
+*/
+spa_arena_t *
+spa_arena_get(void)
+{
+    spa_arena_t    *arena;
+
+    pthread_once(&spa_arena_key_once, spa_arena_key_init);
+
+    if((arena = pthread_getspecific(spa_arena_key)) != NULL)
+        return arena;
+
+    if((arena = mem_calloc(MEM_TAG_ARENA, 1, sizeof(spa_arena_t))) == NULL)
+        return NULL;
+
+    if((arena->head = chunk_new(0)) == NULL)
+    {
+        mem_free(MEM_TAG_ARENA, arena);
+        return NULL;
+    }
+    arena->cur = arena->head;
+
+    if(pthread_setspecific(spa_arena_key, arena) != 0)
+    {
+        spa_arena_destroy(arena);
+        return NULL;
+    }
+
+    return arena;
+}
+
+/* Allocate len bytes of zeroed memory from the arena.  The memory stays
+ * valid until the next spa_arena_reset() and must not be passed to free().
+*/
+void *
+spa_arena_alloc(spa_arena_t *arena, const size_t len)
+{
+    spa_arena_chunk_t  *chunk, *last = NULL;
+    size_t              need;
+    void               *p;
+
+    need = (len + SPA_ARENA_ALIGN - 1) & ~((size_t)SPA_ARENA_ALIGN - 1);
+    if(need < len)
+        return NULL;
+
+    /* Chunks after the current one are empty since the last reset.
+    */
+    for(chunk = arena->cur; chunk != NULL; chunk = chunk->next)
+    {
+        if(chunk->size - chunk->used >= need)
+            break;
+        last = chunk;
+    }
+
+    if(chunk == NULL)
+    {
+        if((chunk = chunk_new(need)) == NULL)
+        {
+            log_msg(LOG_ERR, "spa_arena_alloc: calloc() failed");
+            return NULL;
+        }
+        last->next = chunk;
+    }
+
+    arena->cur   = chunk;
+    p            = chunk->data + chunk->used;
+    chunk->used += need;
+
+    return p;
+}
+
+/* Zero everything handed out since the last reset and make it available
+ * again.  Chunks are kept for the next packet.
+*/
+void
+spa_arena_reset(spa_arena_t *arena)
+{
+    spa_arena_chunk_t  *chunk;
+
+    if(arena == NULL)
+        return;
+
+    for(chunk = arena->head; chunk != NULL; chunk = chunk->next)
+    {
+        if(chunk->used > 0)
+            memset(chunk->data, 0x0, chunk->used);
+        chunk->used = 0;
+    }
+    arena->cur = arena->head;
+    return;
+}
+
+/***EOF***/
@@ -0,0 +1,66 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_arena.h
+ *
+ * Purpose: Header file for spa_arena.c - a per-packet bump allocator for
+ *          the data fwknopd builds while authorizing a SPA packet.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef SPA_ARENA_H
+#define SPA_ARENA_H
+
+/* Size of each arena chunk.  One chunk covers a typical packet; more are
+ * added (and kept) if a packet needs them.
+*/
+#define SPA_ARENA_CHUNK_SIZE    4096
+
+/* Alignment of every allocation.
+*/
+#define SPA_ARENA_ALIGN         16
+
+typedef struct spa_arena_chunk
+{
+    unsigned char           *data;
+    size_t                   size;
+    size_t                   used;
+    struct spa_arena_chunk  *next;
+} spa_arena_chunk_t;
+
+typedef struct spa_arena
+{
+    spa_arena_chunk_t   *head;
+    spa_arena_chunk_t   *cur;
+} spa_arena_t;
+
+/* Prototypes
+*/
+spa_arena_t *spa_arena_get(void);
+void *spa_arena_alloc(spa_arena_t *arena, const size_t len);
+void spa_arena_reset(spa_arena_t *arena);
+
+#endif /* SPA_ARENA_H */
+
+/***EOF***/
@@ -0,0 +1,353 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_shed.c
+ *
+ * Purpose: Shedding of queued SPA packets when the SPA workers fall
+ *          behind, keeping the clients that recently got access served.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "spa_shed.h"
+#include "access.h"
+#include "metrics.h"
+#include "rcu.h"
+#include "log_msg.h"
+#include "utils.h"
+
+/* Result slot layout:
+ *
+ *   bits 63-48: client tag (the top bit is always set so that an unused
+ *               slot, which is all zeros, never matches)
+ *   bits 47-24: time of the last success
+ *   bits 23-0:  time of the last failure
+ *
+ * Times are seconds since spa_shed_start() plus one (wrapping after about
+ * 194 days), and 0 means never.
+*/
+#define SHED_TIME_MASK          0xffffff
+#define SHED_TAG(s)             ((uint16_t)((s) >> 48))
+#define SHED_OK(s)              ((uint32_t)(((s) >> 24) & SHED_TIME_MASK))
+#define SHED_FAIL(s)            ((uint32_t)((s) & SHED_TIME_MASK))
+#define SHED_PACK(tag, ok, f)   (((uint64_t)(tag) << 48) \
+                                    | ((uint64_t)(ok) << 24) | (uint64_t)(f))
+
+#define FNV_OFFSET_BASIS        0xcbf29ce484222325ULL
+#define FNV_PRIME               0x100000001b3ULL
+
+static volatile uint64_t    shed_table[SPA_SHED_TABLE_LEN];
+static int                  shed_enabled = 0;
+static uint64_t             shed_seed;
+static struct timespec      shed_epoch;
+static unsigned long long   shed_target_ns;
+
+/* CoDel state, only touched by spa_shed_update() (under the worker pool
+ * mutex).  shed_overloaded is also read by the workers and the metrics
+ * endpoint.
+*/
+static unsigned long long   shed_first_above_ns = 0;
+static unsigned long        shed_episode_start = 0;
+static volatile int         shed_overloaded = 0;
+
+/* How a queued packet is treated while overloaded
+*/
+typedef enum {
+    SHED_TRUSTED = 0,   /* recent success - never shed */
+    SHED_UNPROVEN,      /* nothing recent - shed under heavy delay */
+    SHED_SUSPECT        /* unknown SDP ID or recent failure - always shed */
+} shed_class_t;
+
+static unsigned long
+shed_count(void)
+{
+    return(__atomic_load_n(&(metric_counters[METRIC_SHED_SUSPECT]), __ATOMIC_RELAXED)
+        + __atomic_load_n(&(metric_counters[METRIC_SHED_UNPROVEN]), __ATOMIC_RELAXED));
+}
+
+static unsigned long long
+shed_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((unsigned long long)(ts.tv_sec - shed_epoch.tv_sec) * 1000000000ULL
+            + ts.tv_nsec);
+}
+
+static uint32_t
+shed_now_secs(void)
+{
+    return((uint32_t)((shed_now_ns() / 1000000000ULL + 1) & SHED_TIME_MASK));
+}
+
+/* Whether a result time is set and at most SPA_SHED_MEMORY seconds old
+*/
+static int
+shed_recent(const uint32_t t, const uint32_t now)
+{
+    return(t != 0 && ((now - t) & SHED_TIME_MASK) <= SPA_SHED_MEMORY);
+}
+
+/* FNV-1a over the SDP ID, or over the source address for packets
+ * without one, starting from a per-run seed.
+*/
+static uint64_t
+shed_hash(const spa_pkt_info_t *spa_pkt)
+{
+    uint64_t    h = shed_seed;
+    int         i, len;
+
+    if(spa_pkt->sdp_id != 0)
+    {
+        for(i=0; i < 4; i++)
+        {
+            h ^= (spa_pkt->sdp_id >> (i * 8)) & 0xff;
+            h *= FNV_PRIME;
+        }
+        return h;
+    }
+
+    len = (spa_pkt->packet_src_addr.family == AF_INET6) ? 16 : 4;
+
+    h ^= spa_pkt->packet_src_addr.family;
+    h *= FNV_PRIME;
+    for(i=0; i < len; i++)
+    {
+        h ^= spa_pkt->packet_src_addr.addr[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+/* Enable shedding if SPA_SHED_TARGET_DELAY is set.  Only useful with
+ * SPA_WORKERS, since otherwise nothing waits anywhere we can see it.
+ * Returns 0 on success (including when shedding is disabled) and -1 on
+ * error.
+*/
+int
+spa_shed_start(fko_srv_options_t *opts)
+{
+    int     is_err, target_ms;
+
+    shed_enabled = 0;
+
+    target_ms = strtol_wrapper(opts->config[CONF_SPA_SHED_TARGET_DELAY],
+            0, RCHK_MAX_SPA_SHED_TARGET_DELAY, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid SPA_SHED_TARGET_DELAY value.");
+        return -1;
+    }
+
+    if(target_ms == 0)
+        return 0;
+
+    memset((void *)shed_table, 0x0, sizeof(shed_table));
+    clock_gettime(CLOCK_MONOTONIC, &shed_epoch);
+    shed_seed           = FNV_OFFSET_BASIS ^ (uint64_t)time(NULL)
+                            ^ ((uint64_t)getpid() << 32);
+    shed_target_ns      = (unsigned long long)target_ms * 1000000ULL;
+    shed_first_above_ns = 0;
+    shed_overloaded     = 0;
+    shed_enabled        = 1;
+
+    return 0;
+}
+
+int
+spa_shed_overloaded(void)
+{
+    return __atomic_load_n(&shed_overloaded, __ATOMIC_RELAXED);
+}
+
+/* Feed in how long the packet a worker just took had waited.  Returns 1
+ * while the pool is overloaded.  Must be called with the worker pool
+ * mutex held.
+*/
+int
+spa_shed_update(const unsigned long long sojourn_ns)
+{
+    unsigned long long  now;
+    unsigned long       shed;
+
+    if(! shed_enabled)
+        return 0;
+
+    if(sojourn_ns < shed_target_ns)
+    {
+        shed_first_above_ns = 0;
+        if(shed_overloaded)
+        {
+            __atomic_store_n(&shed_overloaded, 0, __ATOMIC_RELAXED);
+            shed = shed_count() - shed_episode_start;
+            log_msg(LOG_INFO,
+                "SPA workers caught up, %lu queued packets were shed.", shed);
+        }
+        return 0;
+    }
+
+    if(shed_overloaded)
+        return 1;
+
+    now = shed_now_ns();
+    if(shed_first_above_ns == 0)
+    {
+        shed_first_above_ns = now + SPA_SHED_INTERVAL_MS * 1000000ULL;
+        return 0;
+    }
+
+    if(now < shed_first_above_ns)
+        return 0;
+
+    shed_episode_start = shed_count();
+    __atomic_store_n(&shed_overloaded, 1, __ATOMIC_RELAXED);
+    METRIC_INC(METRIC_SHED_EPISODES);
+
+    log_msg(LOG_WARNING,
+        "SPA workers are overloaded (packets waiting %llu ms), shedding packets from unknown clients.",
+        sojourn_ns / 1000000ULL);
+
+    return 1;
+}
+
+static shed_class_t
+shed_classify(fko_srv_options_t *opts, const spa_pkt_info_t *spa_pkt)
+{
+    uint64_t    h, state;
+    uint32_t    now;
+    uint16_t    tag;
+    int         known = 1;
+
+    if(opts->rt->sdp_mode)
+    {
+        rcu_read_lock();
+        known = (spa_pkt->sdp_id != 0
+            && acc_sdp_id_lookup(opts, spa_pkt->sdp_id) != NULL);
+        rcu_read_unlock();
+
+        if(! known)
+            return SHED_SUSPECT;
+    }
+
+    h     = shed_hash(spa_pkt);
+    tag   = (uint16_t)(h >> 48) | 0x8000;
+    state = shed_table[h & (SPA_SHED_TABLE_LEN - 1)];
+
+    if(SHED_TAG(state) != tag)
+        return SHED_UNPROVEN;
+
+    now = shed_now_secs();
+
+    /* A recent success wins over failures, so that forged packets
+     * carrying a client's SDP ID cannot get the client itself shed.
+     * Fair queueing keeps such a flood to its own share of the workers.
+    */
+    if(shed_recent(SHED_OK(state), now))
+        return SHED_TRUSTED;
+
+    if(shed_recent(SHED_FAIL(state), now))
+        return SHED_SUSPECT;
+
+    return SHED_UNPROVEN;
+}
+
+/* Decide whether a packet a worker just took should be dropped instead of
+ * processed.  Returns 1 to drop it.
+*/
+int
+spa_shed_check(fko_srv_options_t *opts, const spa_pkt_info_t *spa_pkt,
+        const unsigned long long sojourn_ns)
+{
+    if(! shed_enabled || ! spa_shed_overloaded())
+        return 0;
+
+    switch(shed_classify(opts, spa_pkt))
+    {
+        case SHED_SUSPECT:
+            METRIC_INC(METRIC_SHED_SUSPECT);
+            return 1;
+
+        case SHED_UNPROVEN:
+            if(sojourn_ns < shed_target_ns * SPA_SHED_UNPROVEN_FACTOR)
+                return 0;
+            METRIC_INC(METRIC_SHED_UNPROVEN);
+            return 1;
+
+        default:
+            return 0;
+    }
+}
+
+/* Record the outcome of processing a packet: success when access was
+ * granted, failure when the HMAC or decryption failed.
+ *
+ * A client whose slot is held by a different client takes it over, so a
+ * flood of spoofed sources can push out what we know about a real
+ * client, which then only loses its preference until its next success.
+*/
+void
+spa_shed_note(const spa_pkt_info_t *spa_pkt, const int success)
+{
+    volatile uint64_t  *slot;
+    uint64_t            h, old_state, new_state;
+    uint32_t            now, ok, fail;
+    uint16_t            tag;
+
+    if(! shed_enabled)
+        return;
+
+    h    = shed_hash(spa_pkt);
+    tag  = (uint16_t)(h >> 48) | 0x8000;
+    slot = &(shed_table[h & (SPA_SHED_TABLE_LEN - 1)]);
+    now  = shed_now_secs();
+
+    do
+    {
+        old_state = *slot;
+
+        if(SHED_TAG(old_state) == tag)
+        {
+            ok   = SHED_OK(old_state);
+            fail = SHED_FAIL(old_state);
+        }
+        else
+            ok = fail = 0;
+
+        if(success)
+            ok = now;
+        else
+            fail = now;
+
+        new_state = SHED_PACK(tag, ok, fail);
+
+        if(new_state == old_state)
+            break;
+
+    } while(! __sync_bool_compare_and_swap(slot, old_state, new_state));
+
+    return;
+}
+
+/***EOF***/
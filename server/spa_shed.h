@@ -0,0 +1,63 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_shed.h
+ *
+ * Purpose: Header file for spa_shed.c - shedding of queued SPA packets
+ *          when the SPA workers fall behind.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef SPA_SHED_H
+#define SPA_SHED_H
+
+/* The pool is overloaded once the time packets wait for a worker has
+ * stayed above SPA_SHED_TARGET_DELAY for SPA_SHED_INTERVAL_MS, and stops
+ * being overloaded as soon as a packet gets through in less (CoDel's
+ * notion of a standing queue).  While overloaded, packets from clients
+ * without a recent success are shed once their wait passes
+ * SPA_SHED_UNPROVEN_FACTOR times the target.
+*/
+#define SPA_SHED_INTERVAL_MS        100
+#define SPA_SHED_UNPROVEN_FACTOR    4
+
+/* Recent results per SDP ID (or source address in legacy mode), in a
+ * fixed-size table (must be a power of two).  A result counts as recent
+ * for SPA_SHED_MEMORY seconds.
+*/
+#define SPA_SHED_TABLE_LEN          16384
+#define SPA_SHED_MEMORY             600
+
+/* Prototypes
+*/
+int spa_shed_start(fko_srv_options_t *opts);
+int spa_shed_update(const unsigned long long sojourn_ns);
+int spa_shed_check(fko_srv_options_t *opts, const spa_pkt_info_t *spa_pkt,
+        const unsigned long long sojourn_ns);
+void spa_shed_note(const spa_pkt_info_t *spa_pkt, const int success);
+int spa_shed_overloaded(void);
+
+#endif /* SPA_SHED_H */
+
+/***EOF***/
@@ -0,0 +1,175 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_trace.c
+ *
+ * Purpose: Per-packet stage timings for tracing a knock end to end
+ *          (SPA_TRACE), tagged with the SPA random value so they can be
+ *          joined with the client's timestamps (fwknop --trace-file).
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "spa_trace.h"
+#include "metrics.h"
+#include "log_msg.h"
+#include "flight_recorder.h"
+
+#include <time.h>
+
+static int              st_enabled = 0;
+
+/* The packet whose stages bench_stage_end() is timing on this thread.
+*/
+static pthread_key_t    st_key;
+static pthread_once_t   st_key_once = PTHREAD_ONCE_INIT;
+
+static void
+st_key_init(void)
+{
+    pthread_key_create(&st_key, NULL);
+}
+
+/* Turn tracing on if SPA_TRACE is set.  Stage timing is held on for as
+ * long as tracing is.  Returns 0 on success.
+*/
+int
+spa_trace_start(fko_srv_options_t *opts)
+{
+    if(st_enabled || strncasecmp(opts->config[CONF_SPA_TRACE], "Y", 1) != 0)
+        return(0);
+
+    pthread_once(&st_key_once, st_key_init);
+
+    metrics_timing_hold();
+    __atomic_store_n(&st_enabled, 1, __ATOMIC_RELEASE);
+
+    if(! flight_recorder_enabled())
+        log_msg(LOG_WARNING,
+            "SPA_TRACE is set but FLIGHT_RECORDER_SIZE is 0, traces can only be seen in the stage metrics.");
+    else
+        log_msg(LOG_INFO, "Tracing SPA packet stage timings.");
+
+    return(0);
+}
+
+int
+spa_trace_enabled(void)
+{
+    return(__atomic_load_n(&st_enabled, __ATOMIC_ACQUIRE));
+}
+
+/* Start the trace of a packet that just arrived and make it this
+ * thread's current one.
+*/
+void
+spa_trace_begin(spa_pkt_info_t *spa_pkt)
+{
+    struct timespec now;
+
+    if(! spa_trace_enabled())
+        return;
+
+    memset(&(spa_pkt->trace), 0x0, sizeof(spa_pkt->trace));
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    spa_pkt->trace.start_ns = (uint64_t)now.tv_sec * 1000000000ULL
+        + now.tv_nsec;
+
+    pthread_setspecific(st_key, spa_pkt);
+}
+
+/* Make spa_pkt this thread's current packet again, e.g. when a SPA
+ * worker picks it up or a batch gets to authorizing it.
+*/
+void
+spa_trace_attach(spa_pkt_info_t *spa_pkt)
+{
+    if(spa_trace_enabled())
+        pthread_setspecific(st_key, spa_pkt);
+}
+
+void
+spa_trace_detach(void)
+{
+    if(spa_trace_enabled())
+        pthread_setspecific(st_key, NULL);
+}
+
+void
+spa_trace_add(spa_pkt_info_t *spa_pkt, const bench_stage_t stage,
+        const unsigned long long ns)
+{
+    unsigned long long  us;
+
+    if(! spa_trace_enabled() || spa_pkt == NULL || stage >= BENCH_STAGES)
+        return;
+
+    /* A stage can run more than once per packet (e.g. one decrypt per
+     * candidate stanza), so the times add up.
+    */
+    us = spa_pkt->trace.stage_us[stage] + ns / 1000;
+    spa_pkt->trace.stage_us[stage] = us < UINT32_MAX ? (uint32_t)us : UINT32_MAX;
+}
+
+/* Called by bench_stage_end() for the current packet's stages.
+*/
+void
+spa_trace_stage(const bench_stage_t stage, const unsigned long long ns)
+{
+    if(spa_trace_enabled())
+        spa_trace_add(pthread_getspecific(st_key), stage, ns);
+}
+
+/* Tag the trace with the packet's random value once it has been
+ * decrypted.  The client logs the same value with --trace-file.
+*/
+void
+spa_trace_set_id(spa_pkt_info_t *spa_pkt, fko_ctx_t ctx)
+{
+    char   *rand_val = NULL;
+
+    if(! spa_trace_enabled())
+        return;
+
+    if(fko_get_rand_value(ctx, &rand_val) != FKO_SUCCESS || rand_val == NULL)
+        return;
+
+    spa_pkt->trace.id = strtoull(rand_val, NULL, 10);
+
+    if(spa_pkt->trace.id != 0)
+        METRIC_INC(METRIC_SPA_TRACED);
+}
+
+void
+spa_trace_stop(void)
+{
+    if(! spa_trace_enabled())
+        return;
+
+    __atomic_store_n(&st_enabled, 0, __ATOMIC_RELEASE);
+    metrics_timing_release();
+}
+
+/***EOF***/
@@ -0,0 +1,49 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_trace.h
+ *
+ * Purpose: Header file for spa_trace.c.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef SPA_TRACE_H
+#define SPA_TRACE_H
+
+/* Prototypes
+*/
+int spa_trace_start(fko_srv_options_t *opts);
+int spa_trace_enabled(void);
+void spa_trace_begin(spa_pkt_info_t *spa_pkt);
+void spa_trace_attach(spa_pkt_info_t *spa_pkt);
+void spa_trace_detach(void);
+void spa_trace_add(spa_pkt_info_t *spa_pkt, const bench_stage_t stage,
+        const unsigned long long ns);
+void spa_trace_stage(const bench_stage_t stage, const unsigned long long ns);
+void spa_trace_set_id(spa_pkt_info_t *spa_pkt, fko_ctx_t ctx);
+void spa_trace_stop(void);
+
+#endif /* SPA_TRACE_H */
+
+/***EOF***/
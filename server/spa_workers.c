@@ -0,0 +1,491 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_workers.c
+ *
+ * Purpose: A fixed-size pool of threads that take SPA packets which have
+ *          passed the cheap receive-side checks (precheck and replay) and
+ *          run the expensive part - decryption, HMAC verification, decoding
+ *          and the access checks.  This keeps the capture or receive thread
+ *          free to pull packets while the crypto runs on other cores.
+ *          Firewall changes are still made one at a time under
+ *          spa_grant_mutex.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "spa_workers.h"
+#include "incoming_spa.h"
+#include "replay_cache.h"
+#include "log_msg.h"
+#include "utils.h"
+#include "cpu_affinity.h"
+#include "spa_shed.h"
+#include "metrics.h"
+#include "flight_recorder.h"
+#include "spa_trace.h"
+
+/* A queued packet.  The packet data is copied into spa_pkt.packet_buf
+ * since the receive buffer it came from is reused as soon as we return.
+*/
+typedef struct spa_job
+{
+    spa_pkt_info_t      spa_pkt;
+    struct timespec     queued;
+    struct spa_job     *next;
+} spa_job_t;
+
+/* The packets waiting from one client (or from the clients that hash to
+ * the same bucket).  A flow with packets is on the active list, and
+ * in_turn is set while it is at the head of the list and has had its
+ * quantum for this round.
+*/
+typedef struct spa_flow
+{
+    spa_job_t          *head;
+    spa_job_t          *tail;
+    int                 count;
+    int                 deficit;
+    int                 in_turn;
+    struct spa_flow    *next_active;
+} spa_flow_t;
+
+/* Pool state.  Jobs are preallocated and move between the free stack and
+ * the flows, so nothing is allocated per packet.
+*/
+typedef struct spa_worker_pool
+{
+    fko_srv_options_t  *opts;
+    pthread_t          *threads;
+    int                 num_threads;
+    spa_job_t          *jobs;
+    spa_job_t         **free_jobs;
+    int                 num_free;
+    spa_flow_t         *flows;
+    spa_flow_t         *active_head;
+    spa_flow_t         *active_tail;
+    int                 active_flows;
+    int                 queue_count;
+    int                 stop;
+    int                 dropping;
+    unsigned long       dropped;
+    unsigned long       flow_dropped;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+} spa_worker_pool_t;
+
+static spa_worker_pool_t    spa_pool;
+static volatile int         spa_workers_active = 0;
+
+/* Pick the flow for a packet.  Packets without an SDP ID (legacy mode)
+ * are grouped by source address instead.
+*/
+static spa_flow_t *
+spa_flow_for(const spa_pkt_info_t *spa_pkt)
+{
+    uint32_t    h;
+    int         i, len;
+
+    if(spa_pkt->sdp_id != 0)
+    {
+        h = spa_pkt->sdp_id;
+    }
+    else
+    {
+        /* FNV-1a over the address bytes
+        */
+        len = spa_pkt->packet_src_addr.family == AF_INET6 ? 16 : 4;
+        h = 2166136261u;
+        for(i=0; i < len; i++)
+            h = (h ^ spa_pkt->packet_src_addr.addr[i]) * 16777619u;
+    }
+
+    h ^= h >> 16;
+    h *= 0x7feb352d;
+    h ^= h >> 15;
+
+    return &(spa_pool.flows[h % SPA_WORKER_FLOWS]);
+}
+
+/* Take the next job by deficit round robin.  The flow at the head of the
+ * active list gets its quantum once per round and is served while its
+ * deficit covers the next packet, then goes to the back of the list.
+ * Since the quantum is at least the largest packet, this always finds a
+ * job within one pass.  Called with the pool mutex held and the queue
+ * not empty.
+*/
+static spa_job_t *
+spa_next_job(void)
+{
+    spa_flow_t *flow;
+    spa_job_t  *job;
+
+    while(1)
+    {
+        flow = spa_pool.active_head;
+
+        if(! flow->in_turn)
+        {
+            flow->deficit += SPA_WORKER_QUANTUM;
+            flow->in_turn  = 1;
+        }
+
+        job = flow->head;
+        if((int)job->spa_pkt.packet_data_len <= flow->deficit)
+            break;
+
+        /* Out of credit for this round
+        */
+        flow->in_turn = 0;
+        if(flow->next_active != NULL)
+        {
+            spa_pool.active_head = flow->next_active;
+            flow->next_active = NULL;
+            spa_pool.active_tail->next_active = flow;
+            spa_pool.active_tail = flow;
+        }
+    }
+
+    flow->head = job->next;
+    if(flow->head == NULL)
+        flow->tail = NULL;
+    flow->count--;
+    flow->deficit -= job->spa_pkt.packet_data_len;
+    spa_pool.queue_count--;
+
+    /* An emptied flow leaves the list and keeps no credit, so it cannot
+     * save up for a burst.
+    */
+    if(flow->count == 0)
+    {
+        spa_pool.active_head = flow->next_active;
+        if(spa_pool.active_head == NULL)
+            spa_pool.active_tail = NULL;
+        flow->next_active = NULL;
+        flow->deficit = 0;
+        flow->in_turn = 0;
+        spa_pool.active_flows--;
+    }
+
+    return job;
+}
+
+/* Nanoseconds since a job was queued
+*/
+static unsigned long long
+spa_job_wait_ns(const spa_job_t *job)
+{
+    struct timespec     now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return((unsigned long long)(now.tv_sec - job->queued.tv_sec) * 1000000000ULL
+        + now.tv_nsec - job->queued.tv_nsec);
+}
+
+static void *
+spa_worker_thread(void *arg)
+{
+    spa_job_t          *job;
+    unsigned long long  wait_ns;
+
+    cpu_affinity_set(CPU_ROLE_WORKER);
+
+    pthread_mutex_lock(&(spa_pool.mutex));
+
+    while(1)
+    {
+        while(spa_pool.queue_count == 0 && ! spa_pool.stop)
+            pthread_cond_wait(&(spa_pool.cond), &(spa_pool.mutex));
+
+        /* Finish whatever is queued before leaving.
+        */
+        if(spa_pool.queue_count == 0)
+            break;
+
+        job = spa_next_job();
+        wait_ns = spa_job_wait_ns(job);
+        spa_shed_update(wait_ns);
+
+        pthread_mutex_unlock(&(spa_pool.mutex));
+
+        metrics_observe(BENCH_STAGE_QUEUE, wait_ns);
+        spa_trace_add(&(job->spa_pkt), BENCH_STAGE_QUEUE, wait_ns);
+
+        /* Packets are shed as they come off the queue (like CoDel), so
+         * the decision is made on the delay they actually saw.
+        */
+        if(spa_shed_check(spa_pool.opts, &(job->spa_pkt), wait_ns))
+        {
+            flight_recorder_record(&(job->spa_pkt), FR_SHED, 0);
+            if(job->spa_pkt.replay_digest_set)
+                replay_release(job->spa_pkt.replay_digest);
+        }
+        else
+            incoming_spa_authorize(spa_pool.opts, &(job->spa_pkt));
+
+        pthread_mutex_lock(&(spa_pool.mutex));
+        spa_pool.free_jobs[spa_pool.num_free++] = job;
+    }
+
+    pthread_mutex_unlock(&(spa_pool.mutex));
+
+    return NULL;
+}
+
+static void
+spa_pool_free(void)
+{
+    free(spa_pool.threads);
+    free(spa_pool.jobs);
+    free(spa_pool.free_jobs);
+    free(spa_pool.flows);
+    spa_pool.threads   = NULL;
+    spa_pool.jobs      = NULL;
+    spa_pool.free_jobs = NULL;
+    spa_pool.flows     = NULL;
+
+    pthread_cond_destroy(&(spa_pool.cond));
+    pthread_mutex_destroy(&(spa_pool.mutex));
+    return;
+}
+
+/* Start the SPA worker threads if SPA_WORKERS is set.  Returns 0 when
+ * the pool is running or is not wanted (SPA packets are then processed
+ * on the thread that received them), and -1 on error.
+*/
+int
+spa_workers_start(fko_srv_options_t *opts)
+{
+    int     i, is_err, num_threads;
+
+    if(spa_workers_active)
+        return 0;
+
+    num_threads = strtol_wrapper(opts->config[CONF_SPA_WORKERS],
+            0, RCHK_MAX_SPA_WORKERS, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid SPA_WORKERS value.");
+        return -1;
+    }
+
+    /* Benchmark timings are per packet and are only meaningful when each
+     * packet is processed start to finish on one thread.
+    */
+    if(num_threads == 0 || opts->benchmark)
+        return 0;
+
+    if(spa_shed_start(opts) != 0)
+        return -1;
+
+    memset(&spa_pool, 0x0, sizeof(spa_pool));
+    spa_pool.opts = opts;
+
+    pthread_mutex_init(&(spa_pool.mutex), NULL);
+    pthread_cond_init(&(spa_pool.cond), NULL);
+
+    spa_pool.threads   = calloc(num_threads, sizeof(pthread_t));
+    spa_pool.jobs      = calloc(SPA_WORKER_QUEUE_LEN, sizeof(spa_job_t));
+    spa_pool.free_jobs = calloc(SPA_WORKER_QUEUE_LEN, sizeof(spa_job_t *));
+    spa_pool.flows     = calloc(SPA_WORKER_FLOWS, sizeof(spa_flow_t));
+    if(spa_pool.threads == NULL || spa_pool.jobs == NULL
+            || spa_pool.free_jobs == NULL || spa_pool.flows == NULL)
+    {
+        log_msg(LOG_ERR, "spa_workers_start: calloc() failed");
+        spa_pool_free();
+        return -1;
+    }
+
+    for(i=0; i < SPA_WORKER_QUEUE_LEN; i++)
+        spa_pool.free_jobs[i] = &(spa_pool.jobs[i]);
+    spa_pool.num_free = SPA_WORKER_QUEUE_LEN;
+
+    for(i=0; i < num_threads; i++)
+    {
+        if(pthread_create(&(spa_pool.threads[i]), NULL,
+                spa_worker_thread, NULL) != 0)
+        {
+            log_msg(LOG_ERR, "spa_workers_start: failed to start worker thread %i", i);
+            spa_workers_active = 1;
+            spa_workers_stop();
+            return -1;
+        }
+        spa_pool.num_threads++;
+    }
+
+    spa_workers_active = 1;
+
+    log_msg(LOG_INFO, "Started %i SPA worker threads.", num_threads);
+
+    return 0;
+}
+
+/* Let the workers drain the queue, then join them and free the pool.
+*/
+void
+spa_workers_stop(void)
+{
+    int     i;
+
+    if(! spa_workers_active)
+        return;
+
+    spa_workers_active = 0;
+
+    pthread_mutex_lock(&(spa_pool.mutex));
+    spa_pool.stop = 1;
+    pthread_cond_broadcast(&(spa_pool.cond));
+    pthread_mutex_unlock(&(spa_pool.mutex));
+
+    /* clean_exit() may be called from a worker, which must not wait on
+     * itself.
+    */
+    for(i=0; i < spa_pool.num_threads; i++)
+        if(! pthread_equal(spa_pool.threads[i], pthread_self()))
+            pthread_join(spa_pool.threads[i], NULL);
+
+    if(spa_pool.dropped > 0)
+        log_msg(LOG_WARNING,
+            "SPA worker queue was full, %lu packets were dropped.",
+            spa_pool.dropped);
+
+    if(spa_pool.flow_dropped > 0)
+        log_msg(LOG_WARNING,
+            "%lu SPA packets were dropped from clients with %i packets already queued.",
+            spa_pool.flow_dropped, SPA_WORKER_FLOW_QUEUE_LEN);
+
+    spa_pool_free();
+    return;
+}
+
+int
+spa_workers_running(void)
+{
+    return spa_workers_active;
+}
+
+/* Queue a packet for a worker.  The packet data is copied, and its replay
+ * claim passes to the pool whether or not the packet is queued.
+ * Returns 0 on success and -1 if the queue or the packet's flow was full.
+*/
+int
+spa_workers_dispatch(const spa_pkt_info_t *spa_pkt)
+{
+    spa_job_t  *job = NULL;
+    spa_flow_t *flow;
+    int         first_drop = 0, flow_full = 0;
+
+    pthread_mutex_lock(&(spa_pool.mutex));
+    flow = spa_flow_for(spa_pkt);
+    if(flow->count >= SPA_WORKER_FLOW_QUEUE_LEN)
+    {
+        /* Only this client's packets are dropped, the others still get
+         * their share of the queue.
+        */
+        spa_pool.flow_dropped++;
+        flow_full = 1;
+    }
+    else if(spa_pool.num_free > 0)
+    {
+        job = spa_pool.free_jobs[--spa_pool.num_free];
+    }
+    else
+    {
+        spa_pool.dropped++;
+        first_drop = ! spa_pool.dropping;
+        spa_pool.dropping = 1;
+    }
+    pthread_mutex_unlock(&(spa_pool.mutex));
+
+    if(job == NULL)
+    {
+        if(first_drop)
+            log_msg(LOG_WARNING,
+                "SPA worker queue is full (%i packets), dropping packets.",
+                SPA_WORKER_QUEUE_LEN);
+        METRIC_INC(flow_full ? METRIC_SPA_QUEUE_FLOW_DROPS : METRIC_SPA_QUEUE_DROPS);
+        if(spa_pkt->replay_digest_set)
+            replay_release(spa_pkt->replay_digest);
+        return -1;
+    }
+
+    job->spa_pkt = *spa_pkt;
+    memcpy(job->spa_pkt.packet_buf, spa_pkt->packet_data,
+        spa_pkt->packet_data_len);
+    job->spa_pkt.packet_buf[spa_pkt->packet_data_len] = '\0';
+    job->spa_pkt.packet_data = job->spa_pkt.packet_buf;
+    job->next = NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &(job->queued));
+
+    pthread_mutex_lock(&(spa_pool.mutex));
+    if(flow->tail != NULL)
+        flow->tail->next = job;
+    else
+        flow->head = job;
+    flow->tail = job;
+
+    if(flow->count++ == 0)
+    {
+        if(spa_pool.active_tail != NULL)
+            spa_pool.active_tail->next_active = flow;
+        else
+            spa_pool.active_head = flow;
+        spa_pool.active_tail = flow;
+        spa_pool.active_flows++;
+    }
+
+    spa_pool.queue_count++;
+    spa_pool.dropping = 0;
+    pthread_cond_signal(&(spa_pool.cond));
+    pthread_mutex_unlock(&(spa_pool.mutex));
+
+    return 0;
+}
+
+/* Fill in a snapshot of the queue.  Returns -1 when the pool is not
+ * running.
+*/
+int
+spa_workers_stats(spa_workers_stats_t *stats)
+{
+    spa_flow_t *flow;
+
+    memset(stats, 0x0, sizeof(*stats));
+
+    if(! spa_workers_active)
+        return -1;
+
+    pthread_mutex_lock(&(spa_pool.mutex));
+    stats->queued       = spa_pool.queue_count;
+    stats->active_flows = spa_pool.active_flows;
+    for(flow = spa_pool.active_head; flow != NULL; flow = flow->next_active)
+        if(flow->count > (int)stats->max_flow_depth)
+            stats->max_flow_depth = flow->count;
+    pthread_mutex_unlock(&(spa_pool.mutex));
+
+    return 0;
+}
+
+/***EOF***/
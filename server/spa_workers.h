@@ -0,0 +1,70 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_workers.h
+ *
+ * Purpose: Header file for spa_workers.c - the thread pool that decrypts,
+ *          verifies and authorizes SPA packets off the receive thread.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef SPA_WORKERS_H
+#define SPA_WORKERS_H
+
+/* Number of packets that may be waiting for a worker.  Packets that
+ * arrive while the queue is full are dropped.
+*/
+#define SPA_WORKER_QUEUE_LEN    1024
+
+/* Waiting packets are kept in per-client flows, keyed by SDP ID (or by
+ * source address for packets without one) and hashed into
+ * SPA_WORKER_FLOWS buckets.  The workers serve the flows by deficit
+ * round robin, each flow getting SPA_WORKER_QUANTUM bytes of packet data
+ * per round, so one busy client cannot starve the others.  A flow may
+ * hold at most SPA_WORKER_FLOW_QUEUE_LEN packets; more are dropped.
+*/
+#define SPA_WORKER_FLOWS            256
+#define SPA_WORKER_FLOW_QUEUE_LEN   64
+#define SPA_WORKER_QUANTUM          MAX_SPA_PACKET_LEN
+
+/* A snapshot of the queue for the metrics endpoint.
+*/
+typedef struct spa_workers_stats
+{
+    unsigned int    queued;
+    unsigned int    active_flows;
+    unsigned int    max_flow_depth;
+} spa_workers_stats_t;
+
+/* Prototypes
+*/
+int spa_workers_start(fko_srv_options_t *opts);
+void spa_workers_stop(void);
+int spa_workers_running(void);
+int spa_workers_dispatch(const spa_pkt_info_t *spa_pkt);
+int spa_workers_stats(spa_workers_stats_t *stats);
+
+#endif /* SPA_WORKERS_H */
+
+/***EOF***/
@@ -0,0 +1,225 @@
+/*
+ *****************************************************************************
+ *
+ * File:    startup.c
+ *
+ * Purpose: Overlap the slow daemon startup phases and tell a service
+ *          manager when fwknopd is ready.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "startup.h"
+#include "fw_util.h"
+#include "upgrade.h"
+#include "log_msg.h"
+#include "cpu_affinity.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <time.h>
+
+static int          st_fw_active = 0;
+static int          st_fw_res = 1;
+static pthread_t    st_fw_thread;
+
+static int64_t
+st_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/* Flush old rules and create the fwknop chains (or tables, etc.) - the
+ * rules of a fwknopd we are taking over from are kept.
+*/
+static int
+st_fw_setup(fko_srv_options_t *opts)
+{
+    int64_t     start = st_now_ms();
+    int         res;
+
+    upgrade_keep_fw_state(opts);
+    res = fw_initialize(opts);
+
+    log_msg(LOG_DEBUG, "startup: firewall set up in %lld ms",
+        (long long)(st_now_ms() - start));
+
+    return(res);
+}
+
+static void *
+st_fw_thread_main(void *arg)
+{
+    fko_srv_options_t  *opts = (fko_srv_options_t *)arg;
+    sigset_t            mask;
+
+    /* Leave signal handling to the main thread.
+    */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    cpu_affinity_set(CPU_ROLE_HOUSEKEEPING);
+
+    st_fw_res = st_fw_setup(opts);
+
+    return(NULL);
+}
+
+/* Start setting up the firewall in the background, so that the external
+ * commands it runs overlap with loading the replay cache and the rest of
+ * startup.  This has to come after setup_pid(), threads do not survive
+ * the fork when becoming a daemon, and after the external command helper
+ * is up.  The benchmark and fuzzing modes never touch the firewall this
+ * way (and the test mode not at all), they set it up inline if at all.
+*/
+int
+startup_fw_begin(fko_srv_options_t *opts)
+{
+    st_fw_active = 0;
+    st_fw_res    = 1;
+
+    if(opts->test || ! opts->enable_fw)
+        return(0);
+
+    if(opts->afl_fuzzing || opts->benchmark
+            || opts->benchmark_synth != NULL || opts->benchmark_fw != NULL)
+        return(0);
+
+    if(pthread_create(&st_fw_thread, NULL, st_fw_thread_main, opts) != 0)
+    {
+        log_msg(LOG_WARNING,
+            "startup_fw_begin: failed to start thread, setting up the firewall inline");
+        return(0);
+    }
+
+    st_fw_active = 1;
+    return(0);
+}
+
+/* Wait for the firewall set up by startup_fw_begin(), or set it up now
+ * if that did not start a thread.  Returns the fw_initialize() result
+ * (1 is success).
+*/
+int
+startup_fw_finish(fko_srv_options_t *opts)
+{
+    int64_t     start;
+
+    if(! st_fw_active)
+    {
+        if(opts->test || ! opts->enable_fw)
+            return(1);
+        return(st_fw_setup(opts));
+    }
+
+    start = st_now_ms();
+    pthread_join(st_fw_thread, NULL);
+    st_fw_active = 0;
+
+    log_msg(LOG_DEBUG, "startup: waited %lld ms for the firewall",
+        (long long)(st_now_ms() - start));
+
+    return(st_fw_res);
+}
+
+/* Make sure the firewall is no longer being set up, for exiting before
+ * startup_fw_finish() was reached.
+*/
+void
+startup_stop(void)
+{
+    if(! st_fw_active)
+        return;
+
+    pthread_join(st_fw_thread, NULL);
+    st_fw_active = 0;
+    return;
+}
+
+/* Send a state line ("READY=1", "STOPPING=1", ...) to the service manager
+ * that started us with Type=notify, the same as sd_notify(3) would but
+ * without linking against libsystemd.  A no-op unless NOTIFY_SOCKET is
+ * set.
+*/
+void
+startup_notify(const char *state)
+{
+    struct sockaddr_un  sa;
+    const char         *path = getenv("NOTIFY_SOCKET");
+    char                msg[64];
+    socklen_t           sa_len;
+    size_t              path_len;
+    int                 sock, len;
+
+    if(path == NULL || (path[0] != '/' && path[0] != '@'))
+        return;
+
+    path_len = strlen(path);
+    if(path_len >= sizeof(sa.sun_path))
+    {
+        log_msg(LOG_WARNING, "startup_notify: NOTIFY_SOCKET path too long");
+        return;
+    }
+
+    memset(&sa, 0x0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    memcpy(sa.sun_path, path, path_len);
+
+    /* A leading '@' is the abstract namespace.
+    */
+    if(sa.sun_path[0] == '@')
+        sa.sun_path[0] = '\0';
+
+    sa_len = offsetof(struct sockaddr_un, sun_path) + path_len;
+
+    /* Once daemonized we are not the process the service manager
+     * started, so name the one it should watch.
+    */
+    len = snprintf(msg, sizeof(msg), "%s\nMAINPID=%ld", state, (long)getpid());
+    if(len < 0 || (size_t)len >= sizeof(msg))
+        return;
+
+    sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if(sock < 0)
+    {
+        log_msg(LOG_WARNING, "startup_notify: socket() failed: %s", strerror(errno));
+        return;
+    }
+
+    if(sendto(sock, msg, len, MSG_NOSIGNAL,
+            (struct sockaddr *)&sa, sa_len) < 0)
+        log_msg(LOG_WARNING, "startup_notify: could not send '%s': %s",
+            state, strerror(errno));
+
+    close(sock);
+    return;
+}
+
+/***EOF***/
@@ -0,0 +1,537 @@
+/*
+ *****************************************************************************
+ *
+ * File:    stats_page.c
+ *
+ * Purpose: Publish uptime, controller state, counters, gauges and stage
+ *          latencies in a shared memory page that tools (and fwknopd
+ *          --stats) can read without asking the daemon anything.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "stats_page.h"
+#include "metrics.h"
+#include "authz_cache.h"
+#include "log_msg.h"
+#include "utils.h"
+#include "cpu_affinity.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+
+#define SP_MIN(a, b)    ((a) < (b) ? (a) : (b))
+
+static int                  sp_active = 0;
+static volatile int         sp_stop = 0;
+static pthread_t            sp_thread;
+static pthread_mutex_t      sp_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t       sp_cond  = PTHREAD_COND_INITIALIZER;
+static stats_page_t        *sp_page = NULL;
+static ino_t                sp_ino;
+static dev_t                sp_dev;
+static int                  sp_interval_ms = 0;
+static fko_srv_options_t   *sp_opts = NULL;
+
+static int64_t
+sp_now_ms(void)
+{
+    struct timeval  tv;
+
+    gettimeofday(&tv, NULL);
+    return((int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000);
+}
+
+/* Gather everything for one update.  This takes the locks the gauges
+ * need, so it is done before the page is marked as being written.
+*/
+static void
+sp_fill(stats_page_body_t *body, fko_srv_options_t *opts)
+{
+    metrics_gauges_t        g;
+    metrics_stage_summary_t sum;
+    sdp_com_t               com;
+    int                     i;
+
+    memset(body, 0x0, sizeof(*body));
+
+    body->update_ms = sp_now_ms();
+    body->authz_gen = authz_cache_gen();
+
+    body->ctrl_state = STATS_PAGE_CTRL_NONE;
+    if(opts->ctrl_client != NULL)
+    {
+        body->ctrl_access_version  = __atomic_load_n(
+                &(opts->ctrl_client->access_version), __ATOMIC_RELAXED);
+        body->ctrl_service_version = __atomic_load_n(
+                &(opts->ctrl_client->service_version), __ATOMIC_RELAXED);
+
+        if((com = opts->ctrl_client->com) != NULL)
+        {
+            body->ctrl_state = __atomic_load_n(&(com->conn_state),
+                    __ATOMIC_RELAXED) == SDP_COM_CONNECTED
+                ? STATS_PAGE_CTRL_UP : STATS_PAGE_CTRL_DOWN;
+            body->ctrl_connects      = __atomic_load_n(&(com->connects),
+                    __ATOMIC_RELAXED);
+            body->ctrl_msgs_sent     = __atomic_load_n(&(com->msgs_sent),
+                    __ATOMIC_RELAXED);
+            body->ctrl_msgs_received = __atomic_load_n(&(com->msgs_received),
+                    __ATOMIC_RELAXED);
+        }
+    }
+
+    body->n_counters = SP_MIN(METRIC_COUNTERS, STATS_PAGE_MAX_COUNTERS);
+    for(i=0; i < (int)body->n_counters; i++)
+        body->counters[i] = __atomic_load_n(&(metric_counters[i]),
+                __ATOMIC_RELAXED);
+
+    metrics_gauges_get(opts, &g);
+
+    body->stanzas            = g.stanzas;
+    body->stanzas_expanded   = g.stanzas_expanded;
+    body->services           = g.services;
+    body->tracked_conns      = g.tracked_conns;
+    body->replay_entries     = g.replay_entries;
+    body->quota_grants       = g.quota_grants;
+    body->quota_clients      = g.quota_clients;
+    body->have_spa_queue     = g.have_spa_queue;
+    body->spa_overloaded     = g.spa_overloaded;
+    body->spa_queued         = g.spa_queued;
+    body->spa_active_flows   = g.spa_active_flows;
+    body->spa_max_flow_depth = g.spa_max_flow_depth;
+    body->active_grants      = g.active_grants;
+    body->mem_refused        = g.mem_refused;
+
+    body->n_mem_tags = SP_MIN(MEM_TAGS, STATS_PAGE_MAX_MEM_TAGS);
+    for(i=0; i < (int)body->n_mem_tags; i++)
+    {
+        body->mem_bytes[i] = g.mem_bytes[i];
+        body->mem_count[i] = g.mem_count[i];
+    }
+
+    body->n_stages = SP_MIN(BENCH_STAGES, STATS_PAGE_MAX_STAGES);
+    for(i=0; i < (int)body->n_stages; i++)
+    {
+        metrics_stage_summary(i, &sum);
+        body->stages[i].count  = sum.count;
+        body->stages[i].sum_ns = sum.sum_ns;
+        body->stages[i].p50_ns = sum.p50_ns;
+        body->stages[i].p99_ns = sum.p99_ns;
+    }
+    return;
+}
+
+/* Copy a new body into the page.  The release fence keeps the body
+ * stores after the odd seq, and the release store of the even seq
+ * keeps them before it.
+*/
+static void
+sp_publish(const stats_page_body_t *body, const uint64_t updates)
+{
+    uint32_t    seq = sp_page->seq;
+
+    __atomic_store_n(&(sp_page->seq), seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy(&(sp_page->body), body, sizeof(*body));
+    sp_page->body.updates = updates;
+
+    __atomic_store_n(&(sp_page->seq), seq + 2, __ATOMIC_RELEASE);
+    return;
+}
+
+static void *
+sp_update_thread(void *arg)
+{
+    stats_page_body_t   body;
+    struct timespec     ts;
+    sigset_t            mask;
+    uint64_t            updates = 0;
+
+    (void)arg;
+
+    /* Leave signal handling to the main thread.
+    */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    cpu_affinity_set(CPU_ROLE_HOUSEKEEPING);
+
+    pthread_mutex_lock(&sp_mutex);
+    while(! sp_stop)
+    {
+        pthread_mutex_unlock(&sp_mutex);
+
+        sp_fill(&body, sp_opts);
+        sp_publish(&body, ++updates);
+
+        pthread_mutex_lock(&sp_mutex);
+        if(sp_stop)
+            break;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec  += sp_interval_ms / 1000;
+        ts.tv_nsec += (sp_interval_ms % 1000) * 1000000L;
+        if(ts.tv_nsec >= 1000000000L)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&sp_cond, &sp_mutex, &ts);
+    }
+    pthread_mutex_unlock(&sp_mutex);
+
+    return(NULL);
+}
+
+/* Create the page under a temporary name and move it into place once
+ * the header is set, so a reader never maps a page that is not ours
+ * yet.  A fwknopd we are taking over from keeps writing to its own
+ * (now unlinked) page until it stops.
+*/
+static int
+sp_create(const char *path)
+{
+    char            tmp_path[MAX_PATH_LEN];
+    struct stat     st;
+    void           *map;
+    int             fd;
+
+    if(snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path)
+            >= (int)sizeof(tmp_path))
+    {
+        log_msg(LOG_ERR, "[*] STATS_FILE path is too long: %s", path);
+        return(-1);
+    }
+
+    unlink(tmp_path);
+
+    if((fd = open(tmp_path, O_RDWR|O_CREAT|O_EXCL|O_NOFOLLOW,
+                    S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH)) < 0)
+    {
+        log_msg(LOG_ERR, "[*] Could not create stats page %s: %s",
+            tmp_path, strerror(errno));
+        return(-1);
+    }
+
+    if(ftruncate(fd, sizeof(stats_page_t)) != 0
+            || fstat(fd, &st) != 0
+            || (map = mmap(NULL, sizeof(stats_page_t), PROT_READ|PROT_WRITE,
+                    MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        log_msg(LOG_ERR, "[*] Could not map stats page %s: %s",
+            tmp_path, strerror(errno));
+        close(fd);
+        unlink(tmp_path);
+        return(-1);
+    }
+    close(fd);
+
+    sp_page = map;
+    sp_page->magic       = STATS_PAGE_MAGIC;
+    sp_page->version     = STATS_PAGE_VERSION;
+    sp_page->size        = sizeof(stats_page_t);
+    sp_page->pid         = (uint32_t)getpid();
+    sp_page->start_time  = (int64_t)time(NULL);
+    sp_page->interval_ms = (uint32_t)sp_interval_ms;
+
+    if(rename(tmp_path, path) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Could not rename %s to %s: %s",
+            tmp_path, path, strerror(errno));
+        munmap(sp_page, sizeof(stats_page_t));
+        sp_page = NULL;
+        unlink(tmp_path);
+        return(-1);
+    }
+
+    sp_ino = st.st_ino;
+    sp_dev = st.st_dev;
+    return(0);
+}
+
+/* Start publishing the stats page if STATS_INTERVAL is set.  Returns 0
+ * on success or when disabled.
+*/
+int
+stats_page_start(fko_srv_options_t *opts)
+{
+    int     is_err;
+
+    sp_active = 0;
+
+    sp_interval_ms = strtol_wrapper(opts->config[CONF_STATS_INTERVAL],
+            0, RCHK_MAX_STATS_INTERVAL, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid STATS_INTERVAL value.");
+        return(-1);
+    }
+
+    if(sp_interval_ms == 0)
+        return(0);
+
+    if(sp_create(opts->config[CONF_STATS_FILE]) != 0)
+        return(-1);
+
+    sp_opts = opts;
+    sp_stop = 0;
+
+    /* Stage latencies are only recorded while someone reports them.
+    */
+    metrics_timing_hold();
+
+    if(pthread_create(&sp_thread, NULL, sp_update_thread, NULL) != 0)
+    {
+        log_msg(LOG_ERR, "stats_page_start: failed to start stats page thread");
+        metrics_timing_release();
+        munmap(sp_page, sizeof(stats_page_t));
+        sp_page = NULL;
+        unlink(opts->config[CONF_STATS_FILE]);
+        return(-1);
+    }
+
+    sp_active = 1;
+
+    log_msg(LOG_INFO, "Publishing stats every %i ms in %s",
+        sp_interval_ms, opts->config[CONF_STATS_FILE]);
+
+    return(0);
+}
+
+/* Stop the update thread and remove the page, unless a newer fwknopd
+ * has put its own in its place.
+*/
+void
+stats_page_stop(void)
+{
+    struct stat     st;
+
+    if(! sp_active)
+        return;
+
+    sp_active = 0;
+
+    pthread_mutex_lock(&sp_mutex);
+    sp_stop = 1;
+    pthread_cond_signal(&sp_cond);
+    pthread_mutex_unlock(&sp_mutex);
+
+    if(! pthread_equal(sp_thread, pthread_self()))
+        pthread_join(sp_thread, NULL);
+
+    metrics_timing_release();
+
+    if(stat(sp_opts->config[CONF_STATS_FILE], &st) == 0
+            && st.st_ino == sp_ino && st.st_dev == sp_dev)
+        unlink(sp_opts->config[CONF_STATS_FILE]);
+
+    munmap(sp_page, sizeof(stats_page_t));
+    sp_page = NULL;
+    sp_opts = NULL;
+    return;
+}
+
+/* Take a consistent copy of the body, see the sequence lock in
+ * stats_page.h.
+*/
+static int
+sp_read(const stats_page_t *page, stats_page_body_t *body)
+{
+    uint32_t    seq1, seq2;
+    int         tries;
+
+    for(tries=0; tries < STATS_PAGE_READ_TRIES; tries++)
+    {
+        seq1 = __atomic_load_n(&(page->seq), __ATOMIC_ACQUIRE);
+        if((seq1 & 1) == 0)
+        {
+            memcpy(body, (const void *)&(page->body), sizeof(*body));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            seq2 = __atomic_load_n(&(page->seq), __ATOMIC_RELAXED);
+            if(seq1 == seq2)
+                return(seq1 == 0 ? -1 : 0);
+        }
+        usleep(STATS_PAGE_READ_WAIT_US);
+    }
+    return(-1);
+}
+
+static void
+sp_print_uptime(const long secs)
+{
+    if(secs >= 86400)
+        fprintf(stdout, "%lid ", secs / 86400);
+    fprintf(stdout, "%02li:%02li:%02li", (secs % 86400) / 3600,
+        (secs % 3600) / 60, secs % 60);
+    return;
+}
+
+static void
+sp_print(const stats_page_t *hdr, const stats_page_body_t *body)
+{
+    const stats_page_stage_t *stage;
+    int64_t     now_ms = sp_now_ms();
+    int         i;
+
+    fprintf(stdout, "fwknopd (pid=%u) up ", hdr->pid);
+    sp_print_uptime((long)(now_ms / 1000 - hdr->start_time));
+    fprintf(stdout, ", stats updated %.1f seconds ago (every %u ms)\n",
+        (now_ms - body->update_ms) / 1000.0, hdr->interval_ms);
+
+    if(body->ctrl_state == STATS_PAGE_CTRL_NONE)
+        fprintf(stdout, "Controller:            none\n");
+    else
+    {
+        fprintf(stdout, "Controller:            %s (%lu connects, %lu sent, %lu received)\n",
+            body->ctrl_state == STATS_PAGE_CTRL_UP ? "connected" : "disconnected",
+            (unsigned long)body->ctrl_connects,
+            (unsigned long)body->ctrl_msgs_sent,
+            (unsigned long)body->ctrl_msgs_received);
+        fprintf(stdout, "Controller data:       access version %li, service version %li\n",
+            (long)body->ctrl_access_version, (long)body->ctrl_service_version);
+    }
+    fprintf(stdout, "Table generation:      %u\n", body->authz_gen);
+
+    fprintf(stdout, "\nCounters:\n");
+    for(i=0; i < (int)SP_MIN(body->n_counters, STATS_PAGE_MAX_COUNTERS); i++)
+    {
+        if(i < METRIC_COUNTERS)
+            fprintf(stdout, "  %-48s %lu\n", metrics_counter_name(i),
+                (unsigned long)body->counters[i]);
+        else
+            fprintf(stdout, "  counter_%-40i %lu\n", i,
+                (unsigned long)body->counters[i]);
+    }
+
+    fprintf(stdout, "\nGauges:\n");
+    fprintf(stdout, "  %-48s %lu\n", "access_stanzas", (unsigned long)body->stanzas);
+    fprintf(stdout, "  %-48s %lu\n", "access_stanzas_expanded",
+        (unsigned long)body->stanzas_expanded);
+    fprintf(stdout, "  %-48s %lu\n", "services", (unsigned long)body->services);
+    fprintf(stdout, "  %-48s %lu\n", "tracked_connections",
+        (unsigned long)body->tracked_conns);
+    fprintf(stdout, "  %-48s %lu\n", "replay_cache_entries",
+        (unsigned long)body->replay_entries);
+    fprintf(stdout, "  %-48s %lu\n", "quota_grants", (unsigned long)body->quota_grants);
+    fprintf(stdout, "  %-48s %lu\n", "quota_clients", (unsigned long)body->quota_clients);
+    if(body->have_spa_queue)
+    {
+        fprintf(stdout, "  %-48s %lu\n", "spa_queue_depth",
+            (unsigned long)body->spa_queued);
+        fprintf(stdout, "  %-48s %lu\n", "spa_queue_active_flows",
+            (unsigned long)body->spa_active_flows);
+        fprintf(stdout, "  %-48s %lu\n", "spa_queue_max_flow_depth",
+            (unsigned long)body->spa_max_flow_depth);
+        fprintf(stdout, "  %-48s %i\n", "spa_overloaded", body->spa_overloaded);
+    }
+    if(body->active_grants >= 0)
+        fprintf(stdout, "  %-48s %li\n", "active_grants", (long)body->active_grants);
+    fprintf(stdout, "  %-48s %li\n", "memory_refused", (long)body->mem_refused);
+
+    fprintf(stdout, "\nMemory:                %16s %16s\n", "bytes", "allocations");
+    for(i=0; i < (int)SP_MIN(body->n_mem_tags, STATS_PAGE_MAX_MEM_TAGS); i++)
+        fprintf(stdout, "  %-20s %16li %16li\n",
+            i < MEM_TAGS ? mem_tag_name(i) : "unknown",
+            (long)body->mem_bytes[i], (long)body->mem_count[i]);
+
+    fprintf(stdout, "\nStage latency (us):    %12s %12s %12s %12s\n",
+        "count", "mean", "p50", "p99");
+    for(i=0; i < (int)SP_MIN(body->n_stages, STATS_PAGE_MAX_STAGES); i++)
+    {
+        stage = &(body->stages[i]);
+        fprintf(stdout, "  %-20s %12lu %12.1f %12.1f %12.1f\n",
+            i < BENCH_STAGES ? bench_stage_name(i) : "unknown",
+            (unsigned long)stage->count,
+            stage->count ? stage->sum_ns / (double)stage->count / 1000.0 : 0.0,
+            stage->p50_ns / 1000.0, stage->p99_ns / 1000.0);
+    }
+    return;
+}
+
+/* fwknopd --stats: map the running fwknopd's page read-only and print
+ * one consistent copy of it.
+*/
+int
+stats_page_print(const fko_srv_options_t *opts)
+{
+    const char         *path = opts->config[CONF_STATS_FILE];
+    stats_page_t        hdr;
+    stats_page_body_t   body;
+    struct stat         st;
+    void               *map;
+    int                 fd, res = EXIT_FAILURE;
+
+    if((fd = open(path, O_RDONLY)) < 0)
+    {
+        if(errno == ENOENT)
+            fprintf(stdout, "No stats page at %s (is STATS_INTERVAL set and fwknopd running?)\n",
+                path);
+        else
+            fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return(EXIT_FAILURE);
+    }
+
+    if(fstat(fd, &st) != 0 || st.st_size < (off_t)offsetof(stats_page_t, body))
+    {
+        fprintf(stderr, "%s is not a fwknopd stats page.\n", path);
+        close(fd);
+        return(EXIT_FAILURE);
+    }
+
+    if((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        fprintf(stderr, "Could not map %s: %s\n", path, strerror(errno));
+        close(fd);
+        return(EXIT_FAILURE);
+    }
+    close(fd);
+
+    memcpy(&hdr, map, offsetof(stats_page_t, body));
+
+    if(hdr.magic != STATS_PAGE_MAGIC || hdr.version != STATS_PAGE_VERSION
+            || hdr.size < sizeof(stats_page_t) || st.st_size < (off_t)sizeof(stats_page_t))
+        fprintf(stderr, "%s is not a version %i fwknopd stats page.\n",
+            path, STATS_PAGE_VERSION);
+    else if(kill((pid_t)hdr.pid, 0) != 0 && errno == ESRCH)
+        fprintf(stdout, "Stale stats page at %s (fwknopd pid=%u is gone).\n",
+            path, hdr.pid);
+    else if(sp_read(map, &body) != 0)
+        fprintf(stderr, "Could not get a consistent copy of %s.\n", path);
+    else
+    {
+        sp_print(&hdr, &body);
+        res = EXIT_SUCCESS;
+    }
+
+    munmap(map, st.st_size);
+    return(res);
+}
+
+/***EOF***/
@@ -0,0 +1,129 @@
+/*
+ *****************************************************************************
+ *
+ * File:    stats_page.h
+ *
+ * Purpose: Header file for stats_page.c - a read-only shared memory page
+ *          of runtime stats for external tools and fwknopd --stats.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef STATS_PAGE_H
+#define STATS_PAGE_H
+
+/* The page is STATS_FILE mapped shared.  The header is written once
+ * before the file appears under its name, the body is rewritten every
+ * STATS_INTERVAL milliseconds under a sequence lock: seq is odd while
+ * the body is being written, so a reader copies the body and retries
+ * until seq was even and unchanged across the copy.  The layout only
+ * grows at the end of the body, and version goes up when it changes
+ * in any other way.  All fields are in host byte order.
+*/
+#define STATS_PAGE_MAGIC            0x5453464bU     /* "KFST" */
+#define STATS_PAGE_VERSION          1
+
+#define STATS_PAGE_MAX_COUNTERS     64
+#define STATS_PAGE_MAX_MEM_TAGS     32
+#define STATS_PAGE_MAX_STAGES       16
+
+/* How many times a reader retries a copy torn by an update, and how
+ * long it waits between tries.
+*/
+#define STATS_PAGE_READ_TRIES       1000
+#define STATS_PAGE_READ_WAIT_US     100
+
+/* Controller link state.
+*/
+#define STATS_PAGE_CTRL_NONE        -1
+#define STATS_PAGE_CTRL_DOWN        0
+#define STATS_PAGE_CTRL_UP          1
+
+typedef struct stats_page_stage
+{
+    uint64_t    count;
+    uint64_t    sum_ns;
+    uint64_t    p50_ns;
+    uint64_t    p99_ns;
+} stats_page_stage_t;
+
+typedef struct stats_page_body
+{
+    int64_t     update_ms;          /* wall clock time of this update */
+    uint64_t    updates;
+
+    int32_t     ctrl_state;         /* STATS_PAGE_CTRL_* */
+    uint32_t    authz_gen;          /* access/service table generation */
+    int64_t     ctrl_access_version;
+    int64_t     ctrl_service_version;
+    uint64_t    ctrl_connects;
+    uint64_t    ctrl_msgs_sent;
+    uint64_t    ctrl_msgs_received;
+
+    uint32_t    n_counters;
+    uint32_t    n_mem_tags;
+    uint32_t    n_stages;
+    uint32_t    reserved;
+    uint64_t    counters[STATS_PAGE_MAX_COUNTERS];
+
+    uint64_t    stanzas;
+    uint64_t    stanzas_expanded;
+    uint64_t    services;
+    uint64_t    tracked_conns;
+    uint64_t    replay_entries;
+    uint64_t    quota_grants;
+    uint64_t    quota_clients;
+    int32_t     have_spa_queue;
+    int32_t     spa_overloaded;
+    uint64_t    spa_queued;
+    uint64_t    spa_active_flows;
+    uint64_t    spa_max_flow_depth;
+    int64_t     active_grants;      /* -1 when not counted */
+    int64_t     mem_refused;
+    int64_t     mem_bytes[STATS_PAGE_MAX_MEM_TAGS];
+    int64_t     mem_count[STATS_PAGE_MAX_MEM_TAGS];
+
+    stats_page_stage_t  stages[STATS_PAGE_MAX_STAGES];
+} stats_page_body_t;
+
+typedef struct stats_page
+{
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    size;               /* sizeof(stats_page_t) */
+    uint32_t    pid;
+    int64_t     start_time;
+    uint32_t    interval_ms;
+    uint32_t    seq;
+    stats_page_body_t   body;
+} stats_page_t;
+
+/* Prototypes
+*/
+int stats_page_start(fko_srv_options_t *opts);
+void stats_page_stop(void);
+int stats_page_print(const fko_srv_options_t *opts);
+
+#endif /* STATS_PAGE_H */
+
+/***EOF***/
@@ -3,8 +3,9 @@
  *
  * File:    tcp_server.c
  *
- * Purpose: Spawns off a dummy tcp server for fwknopd.  Its purpose is
- *          to accept a tcp connection, then drop it after the first packet.
+ * Purpose: In-process TCP server for fwknopd.  It accepts SPA over TCP
+ *          connections, reads the SPA payload from each one within a
+ *          bounded deadline, and hands it straight to incoming_spa().
  *
  *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
  *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
@@ -31,9 +32,13 @@
 */
 #include "fwknopd_common.h"
 #include "tcp_server.h"
+#include "incoming_spa.h"
 #include "log_msg.h"
 #include "utils.h"
+#include "fwknop_probes.h"
+#include "upgrade.h"
 #include <errno.h>
+#include <time.h>
 
 #if HAVE_SYS_SOCKET_H
   #include <sys/socket.h>
@@ -46,66 +51,224 @@
 #endif
 
 #include <fcntl.h>
-#include <sys/select.h>
 
-/* Fork off and run a "dummy" TCP server. The return value is the PID of
- * the child process or -1 if there is a fork error.
+/* One accepted connection that we are reading an SPA payload from.
 */
-int
-run_tcp_server(fko_srv_options_t *opts)
+typedef struct tcp_conn
 {
-#if !CODE_COVERAGE
-    pid_t               pid, ppid;
-#endif
-    int                 s_sock, c_sock, sfd_flags, clen, selval;
-    int                 reuse_addr = 1, is_err, rv=1;
-    fd_set              sfd_set;
-    struct sockaddr_in  saddr, caddr;
-    struct timeval      tv;
-    char                sipbuf[MAX_IPV4_STR_LEN] = {0};
+    int                 c_sock;     /* -1 if this slot is free */
+    struct sockaddr_in  caddr;
+    struct sockaddr_in  laddr;
+    struct timespec     deadline;
+    int                 len;
+    char                buf[MAX_SPA_PACKET_LEN+1];
+} tcp_conn_t;
 
-    unsigned short      port;
+/* The listener state.  There is only ever one TCP server and it is only
+ * driven from the thread that owns the event loop it is attached to.
+*/
+static int              tcp_listen_sock = -1;
+static event_loop_t    *tcp_loop = NULL;
+static fko_srv_options_t *tcp_opts = NULL;
+static tcp_conn_t       tcp_conns[TCPSERV_MAX_CONNS];
+static spa_pkt_info_t   tcp_spa_pkt;
 
-    port = strtol_wrapper(opts->config[CONF_TCPSERV_PORT],
-            1, MAX_PORT, NO_EXIT_UPON_ERR, &is_err);
-    if(is_err != FKO_SUCCESS)
-    {
-        log_msg(LOG_ERR, "[*] Invalid max TCPSERV_PORT value.");
+static int
+set_nonblock(const int sock)
+{
+    int     sfd_flags;
+
+    if((sfd_flags = fcntl(sock, F_GETFL, 0)) < 0)
         return -1;
-    }
-    log_msg(LOG_INFO, "Kicking off TCP server to listen on port %i.", port);
 
-#if !CODE_COVERAGE
-    /* Fork off a child process to run the command and provide its outputs.
-    */
-    pid = fork();
+    return fcntl(sock, F_SETFL, sfd_flags | O_NONBLOCK);
+}
+
+/* Close a connection and, if asked to, pass along whatever it sent us
+ * as an SPA packet.
+*/
+static void
+tcp_conn_finish(tcp_conn_t *conn, const int process)
+{
+    char    sipbuf[MAX_IPV4_STR_LEN] = {0};
 
-    /* Non-zero pid means we are the parent or there was a fork error.
-     * in either case we simply return that value to the caller.
+    event_loop_del_fd(tcp_loop, conn->c_sock);
+    shutdown(conn->c_sock, SHUT_RDWR);
+    close(conn->c_sock);
+    conn->c_sock = -1;
+
+    if(! process)
+        return;
+
+    /* Same sanity checks as for sniffed packets.
     */
-    if (pid != 0)
+    if(conn->len < MIN_SPA_DATA_SIZE || conn->len > MAX_SPA_PACKET_LEN)
+        return;
+
+    conn->buf[conn->len] = 0x0;
+
+    if(tcp_opts->verbose)
     {
-        opts->tcp_server_pid = pid;
-        return(pid);
+        inet_ntop(AF_INET, &(conn->caddr.sin_addr.s_addr), sipbuf, MAX_IPV4_STR_LEN);
+        log_msg(LOG_INFO, "tcp_server: Got SPA data (%d bytes) from: %s",
+                conn->len, sipbuf);
     }
 
-    /* Get our parent PID so we can periodically check for it. We want to
-     * know when it goes away so we can too.
-    */
-    ppid = getppid();
+    tcp_spa_pkt.packet_data     = (unsigned char *)conn->buf;
+    tcp_spa_pkt.packet_data_len = conn->len;
+    tcp_spa_pkt.packet_proto    = IPPROTO_TCP;
+    tcp_spa_pkt.packet_src_ip   = conn->caddr.sin_addr.s_addr;
+    tcp_spa_pkt.packet_dst_ip   = conn->laddr.sin_addr.s_addr;
+    spa_addr_set_ipv4(&tcp_spa_pkt.packet_src_addr, tcp_spa_pkt.packet_src_ip);
+    spa_addr_set_ipv4(&tcp_spa_pkt.packet_dst_addr, tcp_spa_pkt.packet_dst_ip);
+    tcp_spa_pkt.packet_src_port = ntohs(conn->caddr.sin_port);
+    tcp_spa_pkt.packet_dst_port = ntohs(conn->laddr.sin_port);
+    tcp_spa_pkt.sdp_id          = 0;
+    tcp_spa_pkt.arrival_time    = clock_cache_update();
 
-    /* We are the child.  The first thing to do is close our copy of the
-     * parent PID file so we don't end up holding the lock if the parent
-     * suffers a sudden death that doesn't take us out too.
-    */
-    close(opts->lock_fd);
-#endif
+    FWKNOP_PROBE2(pkt_receive, &tcp_spa_pkt, conn->len);
+
+    incoming_spa(tcp_opts, &tcp_spa_pkt);
+
+    return;
+}
+
+/* Read what the client has sent so far.  The payload is complete once the
+ * client closes its side of the connection or the buffer is full.
+*/
+static int
+tcp_conn_read_handler(int c_sock, void *arg)
+{
+    tcp_conn_t     *conn = (tcp_conn_t *)arg;
+    ssize_t         n;
+
+    n = recv(c_sock, conn->buf + conn->len, MAX_SPA_PACKET_LEN - conn->len, 0);
+
+    if(n < 0)
+    {
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return EVENT_LOOP_CONTINUE;
+
+        tcp_conn_finish(conn, 0);
+        return EVENT_LOOP_CONTINUE;
+    }
+
+    conn->len += n;
+
+    if(n == 0 || conn->len >= MAX_SPA_PACKET_LEN)
+        tcp_conn_finish(conn, 1);
+
+    return EVENT_LOOP_CONTINUE;
+}
+
+/* Accept every pending connection and start reading from each of them.
+*/
+static int
+tcp_accept_handler(int s_sock, void *arg)
+{
+    struct sockaddr_in  caddr;
+    socklen_t           clen;
+    tcp_conn_t         *conn;
+    int                 c_sock, i;
+
+    while(1)
+    {
+        clen = sizeof(caddr);
+
+        if((c_sock = accept(s_sock, (struct sockaddr *) &caddr, &clen)) < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR
+                    || errno == ECONNABORTED)
+                return EVENT_LOOP_CONTINUE;
+
+            log_msg(LOG_ERR, "tcp_server: accept() failed: %s",
+                strerror(errno));
+            return EVENT_LOOP_CONTINUE;
+        }
+
+        conn = NULL;
+        for(i=0; i < TCPSERV_MAX_CONNS; i++)
+        {
+            if(tcp_conns[i].c_sock < 0)
+            {
+                conn = &(tcp_conns[i]);
+                break;
+            }
+        }
+
+        if(conn == NULL)
+        {
+            log_msg(LOG_WARNING,
+                "tcp_server: too many open connections (max %i), dropping one",
+                TCPSERV_MAX_CONNS);
+            close(c_sock);
+            continue;
+        }
+
+        memset(conn, 0x0, sizeof(*conn));
+        conn->caddr = caddr;
+        clen = sizeof(conn->laddr);
+        getsockname(c_sock, (struct sockaddr *) &(conn->laddr), &clen);
+
+        clock_gettime(CLOCK_MONOTONIC, &(conn->deadline));
+        conn->deadline.tv_sec  += TCPSERV_READ_TIMEOUT / 1000;
+        conn->deadline.tv_nsec += (long)(TCPSERV_READ_TIMEOUT % 1000) * 1000000;
+        if(conn->deadline.tv_nsec >= 1000000000)
+        {
+            conn->deadline.tv_sec++;
+            conn->deadline.tv_nsec -= 1000000000;
+        }
+
+        if(set_nonblock(c_sock) < 0
+                || event_loop_add_fd(tcp_loop, c_sock,
+                    tcp_conn_read_handler, conn) != 0)
+        {
+            close(c_sock);
+            continue;
+        }
+        conn->c_sock = c_sock;
+    }
+
+    return EVENT_LOOP_CONTINUE;
+}
+
+/* Give up on connections that have been open longer than
+ * TCPSERV_READ_TIMEOUT.  Whatever they managed to send is still handed
+ * over since SPA clients do not always close their side first.
+*/
+static int
+tcp_deadline_timer(int fd, void *arg)
+{
+    struct timespec     now;
+    int                 i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for(i=0; i < TCPSERV_MAX_CONNS; i++)
+    {
+        if(tcp_conns[i].c_sock < 0)
+            continue;
+
+        if(now.tv_sec > tcp_conns[i].deadline.tv_sec
+                || (now.tv_sec == tcp_conns[i].deadline.tv_sec
+                    && now.tv_nsec >= tcp_conns[i].deadline.tv_nsec))
+            tcp_conn_finish(&(tcp_conns[i]), tcp_conns[i].len > 0);
+    }
+
+    return EVENT_LOOP_CONTINUE;
+}
+
+/* Create the listening socket.
+*/
+static int
+tcp_listen_socket(const unsigned short port)
+{
+    int                 s_sock, reuse_addr = 1;
+    struct sockaddr_in  saddr;
 
-    /* Now, let's make a TCP server
-    */
     if ((s_sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
     {
-        log_msg(LOG_ERR, "run_tcp_server: socket() failed: %s",
+        log_msg(LOG_ERR, "start_tcp_server: socket() failed: %s",
             strerror(errno));
         return -1;
     }
@@ -114,7 +277,7 @@ run_tcp_server(fko_srv_options_t *opts)
     */
     if(setsockopt(s_sock, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof(reuse_addr)) == -1)
     {
-        log_msg(LOG_ERR, "run_tcp_server: setsockopt error: %s",
+        log_msg(LOG_ERR, "start_tcp_server: setsockopt error: %s",
             strerror(errno));
         close(s_sock);
         return -1;
@@ -123,26 +286,14 @@ run_tcp_server(fko_srv_options_t *opts)
     /* Make our main socket non-blocking so we don't have to be stuck on
      * listening for incoming connections.
     */
-    if((sfd_flags = fcntl(s_sock, F_GETFL, 0)) < 0)
+    if(set_nonblock(s_sock) < 0)
     {
-        log_msg(LOG_ERR, "run_tcp_server: fcntl F_GETFL error: %s",
+        log_msg(LOG_ERR, "start_tcp_server: fcntl error setting O_NONBLOCK: %s",
             strerror(errno));
         close(s_sock);
         return -1;
     }
 
-#if !CODE_COVERAGE
-    sfd_flags |= O_NONBLOCK;
-
-    if(fcntl(s_sock, F_SETFL, sfd_flags) < 0)
-    {
-        log_msg(LOG_ERR, "run_tcp_server: fcntl F_SETFL error setting O_NONBLOCK: %s",
-            strerror(errno));
-        close(s_sock);
-        return -1;
-    }
-#endif
-
     /* Construct local address structure */
     memset(&saddr, 0, sizeof(saddr));
     saddr.sin_family      = AF_INET;           /* Internet address family */
@@ -152,105 +303,102 @@ run_tcp_server(fko_srv_options_t *opts)
     /* Bind to the local address */
     if (bind(s_sock, (struct sockaddr *) &saddr, sizeof(saddr)) < 0)
     {
-        log_msg(LOG_ERR, "run_tcp_server: bind() failed: %s",
+        log_msg(LOG_ERR, "start_tcp_server: bind() failed: %s",
             strerror(errno));
         close(s_sock);
         return -1;
     }
 
     /* Mark the socket so it will listen for incoming connections
-     * (but only one at a time)
     */
-    if (listen(s_sock, 1) < 0)
+    if (listen(s_sock, TCPSERV_MAX_CONNS) < 0)
     {
-        log_msg(LOG_ERR, "run_tcp_server: listen() failed: %s",
+        log_msg(LOG_ERR, "start_tcp_server: listen() failed: %s",
             strerror(errno));
         close(s_sock);
         return -1;
     }
 
-    FD_ZERO(&sfd_set);
+    return s_sock;
+}
+
+/* Start the TCP server and attach it to the given event loop.  Returns 0
+ * on success and -1 on error.
+*/
+int
+start_tcp_server(fko_srv_options_t *opts, event_loop_t *loop)
+{
+    int                 s_sock, i, is_err;
+    unsigned short      port;
+
+    port = strtol_wrapper(opts->config[CONF_TCPSERV_PORT],
+            1, MAX_PORT, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid max TCPSERV_PORT value.");
+        return -1;
+    }
+    log_msg(LOG_INFO, "Kicking off TCP server to listen on port %i.", port);
 
-    /* Now loop and accept and drop connections after the first packet or a
-     * short timeout.
+    /* Now, let's make a TCP server, or carry on with the listener handed
+     * over by the fwknopd we are upgrading.
     */
-    while(1)
+    if((s_sock = upgrade_take_socket(SOCK_STREAM, port, NULL)) < 0
+            && (s_sock = tcp_listen_socket(port)) < 0)
+        return -1;
+
+    for(i=0; i < TCPSERV_MAX_CONNS; i++)
+        tcp_conns[i].c_sock = -1;
+
+    if(event_loop_add_fd(loop, s_sock, tcp_accept_handler, NULL) != 0
+            || event_loop_add_timer(loop, TCPSERV_DEADLINE_CHECK_INTERVAL,
+                tcp_deadline_timer, NULL) != 0)
     {
-        clen = sizeof(caddr);
+        event_loop_del_fd(loop, s_sock);
+        close(s_sock);
+        return -1;
+    }
 
-        /* Initialize and setup the socket for select.
-        */
-        FD_SET(s_sock, &sfd_set);
+    upgrade_add_socket(s_sock);
 
-        /* Set our select timeout to 200 ms.
-        */
-        tv.tv_sec = 0;
-        tv.tv_usec = 200000;
+    tcp_listen_sock = s_sock;
+    tcp_loop        = loop;
+    tcp_opts        = opts;
 
-        selval = select(s_sock+1, &sfd_set, NULL, NULL, &tv);
+    /* Let the pcap path know that SPA packets to this port are already
+     * taken care of.
+    */
+    opts->tcp_server_port = port;
 
-        if(selval == -1)
-        {
-            /* Select error - so kill the child and bail.
-            */
-            log_msg(LOG_ERR, "run_tcp_server: select error socket: %s",
-                strerror(errno));
-            rv = -1;
-            break;
-        }
+    return 0;
+}
 
-#if !CODE_COVERAGE
-        if(selval == 0)
-        {
-            /* Timeout - So we check to make sure our parent is still there by simply
-             *           using kill(ppid, 0) and checking the return value.
-            */
-            if(kill(ppid, 0) != 0 && errno == ESRCH)
-            {
-                rv = -1;
-                break;
-            }
-            continue;
-        }
-#endif
+/* Close the listener and any connections still open.  The caller still
+ * owns (and destroys) the event loop.
+*/
+void
+stop_tcp_server(fko_srv_options_t *opts)
+{
+    int     i;
 
-        if(! FD_ISSET(s_sock, &sfd_set))
-            continue;
+    if(tcp_listen_sock < 0)
+        return;
 
-        /* Wait for a client to connect
-        */
-        if((c_sock = accept(s_sock, (struct sockaddr *) &caddr, (socklen_t *)&clen)) < 0)
-        {
-            log_msg(LOG_ERR, "run_tcp_server: accept() failed: %s",
-                strerror(errno));
-            rv = -1;
-            break;
-        }
+    for(i=0; i < TCPSERV_MAX_CONNS; i++)
+        if(tcp_conns[i].c_sock >= 0)
+            tcp_conn_finish(&(tcp_conns[i]), 0);
 
-        if(opts->verbose)
-        {
-            memset(sipbuf, 0x0, MAX_IPV4_STR_LEN);
-            inet_ntop(AF_INET, &(caddr.sin_addr.s_addr), sipbuf, MAX_IPV4_STR_LEN);
-            log_msg(LOG_INFO, "tcp_server: Got TCP connection from %s.", sipbuf);
-        }
+    event_loop_del_fd(tcp_loop, tcp_listen_sock);
+    upgrade_del_socket(tcp_listen_sock);
+    close(tcp_listen_sock);
 
-        /* Though hacky and clunky, we just sleep for a second then
-         * close the socket.  No need to read or write anything.  This
-         * just gives the client a sufficient window to send their
-         * request on this socket. In any case the socket is closed
-         * after that time.
-        */
-        usleep(1000000);
-        shutdown(c_sock, SHUT_RDWR);
-        close(c_sock);
-
-#if CODE_COVERAGE
-        break;
-#endif
-    } /* infinite while loop */
+    tcp_listen_sock = -1;
+    tcp_loop        = NULL;
+    tcp_opts        = NULL;
+
+    opts->tcp_server_port = 0;
 
-    close(s_sock);
-    return rv;
+    return;
 }
 
 /***EOF***/
@@ -31,9 +31,20 @@
 #ifndef TCP_SERVER_H
 #define TCP_SERVER_H
 
+#include "event_loop.h"
+
+/* Maximum number of connections read from at the same time, how long
+ * (in milliseconds) a client has to send its SPA payload, and how often
+ * that deadline is checked.
+*/
+#define TCPSERV_MAX_CONNS               32
+#define TCPSERV_READ_TIMEOUT            1000
+#define TCPSERV_DEADLINE_CHECK_INTERVAL 100
+
 /* Function prototypes
 */
-int run_tcp_server(fko_srv_options_t *opts);
+int start_tcp_server(fko_srv_options_t *opts, event_loop_t *loop);
+void stop_tcp_server(fko_srv_options_t *opts);
 
 #endif /* TCP_SERVER_H */
 
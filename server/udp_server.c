@@ -29,12 +29,24 @@
  *****************************************************************************
 */
 #include "fwknopd_common.h"
+#include "udp_server.h"
+#include "tcp_server.h"
+#include "http_server.h"
 #include "sig_handler.h"
 #include "incoming_spa.h"
 #include "log_msg.h"
+#include "replay_cache.h"
 #include "fw_util.h"
 #include "cmd_cycle.h"
 #include "utils.h"
+#include "event_loop.h"
+#include "rate_limit.h"
+#include "grant_quota.h"
+#include "acc_expire.h"
+#include "acc_lazy.h"
+#include "fwknop_probes.h"
+#include "upgrade.h"
+#include "cpu_affinity.h"
 #include <errno.h>
 
 #if HAVE_SYS_SOCKET_H
@@ -48,49 +60,300 @@
 #endif
 
 #include <fcntl.h>
-#include <sys/select.h>
+#include <signal.h>
 
-int
-run_udp_server(fko_srv_options_t *opts)
+/* One received datagram slot in the batch receive arrays.
+*/
+typedef struct udp_dgram
 {
-    int                 s_sock, sfd_flags, selval, pkt_len;
-    int                 is_err, s_timeout, rv=1, chk_rm_all=0;
-    int                 rules_chk_threshold;
-    fd_set              sfd_set;
-    struct sockaddr_in  saddr, caddr;
-    struct timeval      tv;
-    char                sipbuf[MAX_IPV4_STR_LEN] = {0};
-    char                dgram_msg[MAX_SPA_PACKET_LEN+1] = {0};
+    char                msg[MAX_SPA_PACKET_LEN+1];
+    struct sockaddr_storage caddr;
+    int                 len;
+    time_t              arrival;    /* 0 if the kernel gave no timestamp */
+#if HAVE_RECVMMSG && defined(SO_TIMESTAMPNS)
+    char                cmsg[CMSG_SPACE(sizeof(struct timespec))];
+#endif
+} udp_dgram_t;
+
+/* Per-worker UDP server state.  Each worker owns its socket, receive
+ * slots and the SPA packet buffers handed to incoming_spa_batch().
+*/
+typedef struct udp_worker
+{
+    fko_srv_options_t  *opts;
+    int                 s_sock;
+    int                 s_timeout;
+    int                 batch_len;
+    int                 family;
     unsigned short      port;
-    socklen_t           clen;
+    udp_dgram_t        *dgrams;
+#if HAVE_RECVMMSG
+    struct mmsghdr     *msgs;
+    struct iovec       *iovs;
+#endif
+    spa_pkt_info_t     *spa_pkts;
+    event_loop_t       *loop;
+    pthread_t           thread;
+} udp_worker_t;
 
-    port = strtol_wrapper(opts->config[CONF_UDPSERV_PORT],
-            1, MAX_PORT, NO_EXIT_UPON_ERR, &is_err);
-    if(is_err != FKO_SUCCESS)
+/* Context for the rule expiration timer.
+*/
+typedef struct udp_timer_ctx
+{
+    fko_srv_options_t  *opts;
+    int                 rules_chk_threshold;
+} udp_timer_ctx_t;
+
+/* Set when the workers should leave their receive loops, and protects
+ * the shared packet counter.
+*/
+static volatile int      udp_workers_stop = 0;
+static pthread_mutex_t   udp_ctr_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Convert a datagram source address to the compact form used by SPA
+ * processing.  IPv4-mapped IPv6 addresses from a dual-stack socket are
+ * reported as plain IPv4 so that access checks and firewall rules see the
+ * same thing they would on an IPv4 socket.
+*/
+static void
+udp_sockaddr_to_spa_addr(const struct sockaddr_storage *ss,
+        spa_addr_t *sa, unsigned int *ip, unsigned short *port)
+{
+    const struct sockaddr_in   *sin;
+    const struct sockaddr_in6  *sin6;
+
+    if(ss->ss_family == AF_INET6)
     {
-        log_msg(LOG_ERR, "[*] Invalid max UDPSERV_PORT value.");
-        return -1;
+        sin6  = (const struct sockaddr_in6 *)ss;
+        *port = ntohs(sin6->sin6_port);
+
+        if(IN6_IS_ADDR_V4MAPPED(&(sin6->sin6_addr)))
+        {
+            memcpy(ip, &(sin6->sin6_addr.s6_addr[12]), sizeof(*ip));
+            spa_addr_set_ipv4(sa, *ip);
+        }
+        else
+        {
+            *ip = 0;
+            spa_addr_set_ipv6(sa, sin6->sin6_addr.s6_addr);
+        }
     }
-    s_timeout = strtol_wrapper(opts->config[CONF_UDPSERV_SELECT_TIMEOUT],
-            1, RCHK_MAX_UDPSERV_SELECT_TIMEOUT, NO_EXIT_UPON_ERR, &is_err);
-    if(is_err != FKO_SUCCESS)
+    else
     {
-        log_msg(LOG_ERR, "[*] Invalid max UDPSERV_SELECT_TIMEOUT value.");
-        return -1;
+        sin   = (const struct sockaddr_in *)ss;
+        *port = ntohs(sin->sin_port);
+        *ip   = sin->sin_addr.s_addr;
+        spa_addr_set_ipv4(sa, *ip);
     }
-    rules_chk_threshold = strtol_wrapper(opts->config[CONF_RULES_CHECK_THRESHOLD],
-            0, RCHK_MAX_RULES_CHECK_THRESHOLD, NO_EXIT_UPON_ERR, &is_err);
-    if(is_err != FKO_SUCCESS)
+    return;
+}
+
+#if HAVE_RECVMMSG
+/* The kernel receive timestamp of a datagram (SO_TIMESTAMPNS), in
+ * seconds, or 0 if there is none.
+*/
+static time_t
+udp_dgram_arrival(struct msghdr *mh)
+{
+#ifdef SO_TIMESTAMPNS
+    struct cmsghdr     *cm;
+    struct timespec     ts;
+
+    for(cm = CMSG_FIRSTHDR(mh); cm != NULL; cm = CMSG_NXTHDR(mh, cm))
+    {
+        if(cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS)
+        {
+            memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+            return(ts.tv_sec);
+        }
+    }
+#endif
+    return(0);
+}
+#endif
+
+/* Pull up to batch_len datagrams off of the socket.  With recvmmsg() this
+ * is a single system call, otherwise we keep calling recvfrom() on the
+ * non-blocking socket until it runs dry.  Returns the number of datagrams
+ * received, or -1 on error.
+*/
+static int
+udp_recv_batch(int s_sock, udp_dgram_t *dgrams, const int batch_len
+#if HAVE_RECVMMSG
+        , struct mmsghdr *msgs, struct iovec *iovs
+#endif
+        )
+{
+    int         i, n = 0;
+#if ! HAVE_RECVMMSG
+    int         pkt_len;
+    socklen_t   clen;
+#endif
+
+#if HAVE_RECVMMSG
+    for(i=0; i < batch_len; i++)
+    {
+        iovs[i].iov_base = dgrams[i].msg;
+        iovs[i].iov_len  = MAX_SPA_PACKET_LEN;
+        memset(&msgs[i], 0x0, sizeof(struct mmsghdr));
+        msgs[i].msg_hdr.msg_iov     = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen  = 1;
+        msgs[i].msg_hdr.msg_name    = &dgrams[i].caddr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(dgrams[i].caddr);
+#ifdef SO_TIMESTAMPNS
+        msgs[i].msg_hdr.msg_control    = dgrams[i].cmsg;
+        msgs[i].msg_hdr.msg_controllen = sizeof(dgrams[i].cmsg);
+#endif
+    }
+
+    n = recvmmsg(s_sock, msgs, batch_len, MSG_DONTWAIT, NULL);
+
+    if(n < 0)
+        return((errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1);
+
+    for(i=0; i < n; i++)
+    {
+        dgrams[i].len     = msgs[i].msg_len;
+        dgrams[i].arrival = udp_dgram_arrival(&(msgs[i].msg_hdr));
+    }
+#else
+    for(i=0; i < batch_len; i++)
+    {
+        clen = sizeof(dgrams[i].caddr);
+        pkt_len = recvfrom(s_sock, dgrams[i].msg, MAX_SPA_PACKET_LEN,
+                0, (struct sockaddr *)&dgrams[i].caddr, &clen);
+
+        if(pkt_len < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return(n > 0 ? n : -1);
+        }
+
+        dgrams[i].len     = pkt_len;
+        dgrams[i].arrival = 0;
+        n++;
+    }
+#endif
+
+    return(n);
+}
+
+/* Check for expired access stanzas and firewall rules and pending
+ * CMD_CYCLE_CLOSE commands.
+*/
+static void
+udp_server_timers(fko_srv_options_t *opts, const int rules_chk_threshold)
+{
+    clock_cache_update();
+
+    replay_cache_sync(opts);
+    acc_expire_run(opts);
+    acc_lazy_run();
+    grant_quota_run();
+
+    if(opts->test)
+        return;
+
+    if(pthread_mutex_lock(&(opts->spa_grant_mutex)))
     {
-        log_msg(LOG_ERR, "[*] invalid RULES_CHECK_THRESHOLD");
-        clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+        log_msg(LOG_ERR, "Mutex lock error.");
+        return;
     }
 
-    log_msg(LOG_INFO, "Kicking off UDP server to listen on port %i.", port);
+    if(opts->enable_fw)
+        fw_check_expired(opts, rules_chk_threshold);
 
-    /* Now, let's make a UDP server
+    /* See if any CMD_CYCLE_CLOSE commands need to be executed.
     */
-    if ((s_sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    cmd_cycle_close(opts);
+
+    rate_limit_report();
+
+    pthread_mutex_unlock(&(opts->spa_grant_mutex));
+
+    return;
+}
+
+static int
+udp_timer_handler(int fd, void *arg)
+{
+    udp_timer_ctx_t    *ctx = (udp_timer_ctx_t *)arg;
+
+    udp_server_timers(ctx->opts, ctx->rules_chk_threshold);
+
+    return(udp_workers_stop ? EVENT_LOOP_STOP : EVENT_LOOP_CONTINUE);
+}
+
+static void
+udp_worker_free(udp_worker_t *worker)
+{
+    event_loop_destroy(worker->loop);
+    worker->loop = NULL;
+
+    if(worker->s_sock >= 0)
+    {
+        upgrade_del_socket(worker->s_sock);
+        close(worker->s_sock);
+    }
+    worker->s_sock = -1;
+
+#if HAVE_RECVMMSG
+    free(worker->msgs);
+    free(worker->iovs);
+    worker->msgs = NULL;
+    worker->iovs = NULL;
+#endif
+    free(worker->dgrams);
+    free(worker->spa_pkts);
+    worker->dgrams   = NULL;
+    worker->spa_pkts = NULL;
+
+    return;
+}
+
+static int udp_worker_recv(int fd, void *arg);
+
+/* Create and bind a worker's socket.  On error the caller frees the worker
+ * along with anything opened here.
+*/
+static int
+udp_worker_socket(fko_srv_options_t *opts, udp_worker_t *worker,
+        const unsigned short port, const int reuse_port)
+{
+    int     sfd_flags, one = 1;
+#ifdef IPV6_V6ONLY
+    int     zero = 0;
+#endif
+    struct sockaddr_in   saddr;
+    struct sockaddr_in6  saddr6;
+    struct sockaddr     *bind_addr;
+    socklen_t            bind_len;
+
+    /* With ENABLE_IPV6 we try for a dual-stack socket first, and fall
+     * back to IPv4 only if the system has no IPv6 support.
+    */
+    if(opts->enable_ipv6)
+    {
+        if((worker->s_sock = socket(AF_INET6, SOCK_DGRAM, 0)) >= 0)
+        {
+            worker->family = AF_INET6;
+#ifdef IPV6_V6ONLY
+            if(setsockopt(worker->s_sock, IPPROTO_IPV6, IPV6_V6ONLY,
+                    &zero, sizeof(zero)) < 0)
+                log_msg(LOG_WARNING,
+                    "run_udp_server: could not clear IPV6_V6ONLY, IPv4 SPA packets may not be received: %s",
+                    strerror(errno));
+#endif
+        }
+        else
+            log_msg(LOG_WARNING,
+                "run_udp_server: IPv6 socket() failed, using IPv4 only: %s",
+                strerror(errno));
+    }
+
+    if (worker->s_sock < 0
+            && (worker->s_sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
     {
         log_msg(LOG_ERR, "run_udp_server: socket() failed: %s",
             strerror(errno));
@@ -100,171 +363,473 @@ run_udp_server(fko_srv_options_t *opts)
     /* Make our main socket non-blocking so we don't have to be stuck on
      * listening for incoming datagrams.
     */
-    if((sfd_flags = fcntl(s_sock, F_GETFL, 0)) < 0)
+    if((sfd_flags = fcntl(worker->s_sock, F_GETFL, 0)) < 0)
     {
         log_msg(LOG_ERR, "run_udp_server: fcntl F_GETFL error: %s",
             strerror(errno));
-        close(s_sock);
         return -1;
     }
 
     sfd_flags |= O_NONBLOCK;
 
-    if(fcntl(s_sock, F_SETFL, sfd_flags) < 0)
+    if(fcntl(worker->s_sock, F_SETFL, sfd_flags) < 0)
     {
         log_msg(LOG_ERR, "run_udp_server: fcntl F_SETFL error setting O_NONBLOCK: %s",
             strerror(errno));
-        close(s_sock);
         return -1;
     }
 
+    if(reuse_port)
+    {
+#ifdef SO_REUSEPORT
+        if(setsockopt(worker->s_sock, SOL_SOCKET, SO_REUSEPORT,
+                &one, sizeof(one)) < 0)
+        {
+            log_msg(LOG_ERR, "run_udp_server: setsockopt SO_REUSEPORT failed: %s",
+                strerror(errno));
+            return -1;
+        }
+#else
+        log_msg(LOG_ERR, "run_udp_server: SO_REUSEPORT is not supported on this system");
+        return -1;
+#endif
+    }
+
     /* Construct local address structure */
     memset(&saddr, 0x0, sizeof(saddr));
-    saddr.sin_family      = AF_INET;           /* Internet address family */
-    saddr.sin_addr.s_addr = htonl(INADDR_ANY); /* Any incoming interface */
-    saddr.sin_port        = htons(port);       /* Local port */
+    memset(&saddr6, 0x0, sizeof(saddr6));
+    if(worker->family == AF_INET6)
+    {
+        saddr6.sin6_family = AF_INET6;
+        saddr6.sin6_addr   = in6addr_any;
+        saddr6.sin6_port   = htons(port);
+        bind_addr          = (struct sockaddr *) &saddr6;
+        bind_len           = sizeof(saddr6);
+    }
+    else
+    {
+        saddr.sin_family      = AF_INET;           /* Internet address family */
+        saddr.sin_addr.s_addr = htonl(INADDR_ANY); /* Any incoming interface */
+        saddr.sin_port        = htons(port);       /* Local port */
+        bind_addr             = (struct sockaddr *) &saddr;
+        bind_len              = sizeof(saddr);
+    }
 
     /* Bind to the local address */
-    if (bind(s_sock, (struct sockaddr *) &saddr, sizeof(saddr)) < 0)
+    if (bind(worker->s_sock, bind_addr, bind_len) < 0)
     {
         log_msg(LOG_ERR, "run_udp_server: bind() failed: %s",
             strerror(errno));
-        close(s_sock);
         return -1;
     }
 
-    /* Initialize our signal handlers. You can check the return value for
-     * the number of signals that were *not* set.  Those that were not set
-     * will be listed in the log/stderr output.
+    return 0;
+}
+
+/* Allocate the receive slots for a worker and bind its socket.  When
+ * there is more than one worker every socket is bound to the same port
+ * with SO_REUSEPORT so that the kernel spreads incoming flows across them.
+*/
+static int
+udp_worker_init(fko_srv_options_t *opts, udp_worker_t *worker,
+        const unsigned short port, const int s_timeout, const int batch_len,
+        const int reuse_port)
+{
+#if HAVE_RECVMMSG && defined(SO_TIMESTAMPNS)
+    int     one = 1;
+#endif
+
+    memset(worker, 0x0, sizeof(udp_worker_t));
+    worker->opts      = opts;
+    worker->s_sock    = -1;
+    worker->s_timeout = s_timeout;
+    worker->batch_len = batch_len;
+
+    /* Allocate the receive slots once up front.
     */
-    if(set_sig_handlers() > 0)
-        log_msg(LOG_ERR, "Errors encountered when setting signal handlers.");
+    worker->dgrams   = calloc(batch_len, sizeof(udp_dgram_t));
+    worker->spa_pkts = calloc(batch_len, sizeof(spa_pkt_info_t));
+    if(worker->dgrams == NULL || worker->spa_pkts == NULL)
+    {
+        log_msg(LOG_ERR, "run_udp_server: calloc() failed for %i datagram slots",
+            batch_len);
+        udp_worker_free(worker);
+        return -1;
+    }
+#if HAVE_RECVMMSG
+    worker->msgs = calloc(batch_len, sizeof(struct mmsghdr));
+    worker->iovs = calloc(batch_len, sizeof(struct iovec));
+    if(worker->msgs == NULL || worker->iovs == NULL)
+    {
+        log_msg(LOG_ERR, "run_udp_server: calloc() failed for recvmmsg() headers");
+        udp_worker_free(worker);
+        return -1;
+    }
+#endif
 
-    FD_ZERO(&sfd_set);
+    /* Now, let's make a UDP server, or carry on with the socket handed
+     * over by the fwknopd we are upgrading.
+    */
+    worker->port   = port;
+    worker->family = AF_INET;
 
-    /* Now loop and receive SPA packets
+    if((worker->s_sock = upgrade_take_socket(SOCK_DGRAM, port, &(worker->family))) < 0
+            && udp_worker_socket(opts, worker, port, reuse_port) != 0)
+    {
+        udp_worker_free(worker);
+        return -1;
+    }
+
+#if HAVE_RECVMMSG && defined(SO_TIMESTAMPNS)
+    /* Have the kernel stamp each datagram with its arrival time so the
+     * SPA packet age is measured from there.  This is also done for a
+     * socket taken over from an upgrade.
     */
-    while(1)
+    if(setsockopt(worker->s_sock, SOL_SOCKET, SO_TIMESTAMPNS,
+            &one, sizeof(one)) < 0)
+        log_msg(LOG_WARNING, "run_udp_server: setsockopt SO_TIMESTAMPNS failed: %s",
+            strerror(errno));
+#endif
+
+    if((worker->loop = event_loop_new()) == NULL
+            || event_loop_add_fd(worker->loop, worker->s_sock,
+                udp_worker_recv, worker) != 0)
     {
-        if(sig_do_stop(opts))
-        {
-            if(opts->verbose)
-                log_msg(LOG_INFO,
-                        "udp_server: terminating signal received, will stop.");
-            break;
-        }
+        udp_worker_free(worker);
+        return -1;
+    }
+
+    upgrade_add_socket(worker->s_sock);
+
+    return 0;
+}
+
+/* Event handler for a readable worker socket - pull a batch of datagrams
+ * and process them.  Returns EVENT_LOOP_STOP once the packet count limit
+ * has been reached.
+*/
+static int
+udp_worker_recv(int fd, void *arg)
+{
+    udp_worker_t       *worker = (udp_worker_t *)arg;
+    fko_srv_options_t  *opts = worker->opts;
+    spa_pkt_info_t     *spa_pkt;
+    char                sipbuf[MAX_IPV46_STR_LEN] = {0};
+    int                 pkt_len, i, n, num_pkts = 0;
+    int                 limit_reached = 0;
+    time_t              now;
+
+    /* If we make it here then there is at least one datagram to process
+    */
+    n = udp_recv_batch(worker->s_sock, worker->dgrams, worker->batch_len
+#if HAVE_RECVMMSG
+            , worker->msgs, worker->iovs
+#endif
+            );
+
+    if(n < 0)
+    {
+        log_msg(LOG_ERR, "run_udp_server: receive error on socket: %s",
+            strerror(errno));
+        return EVENT_LOOP_CONTINUE;
+    }
+
+    /* One clock read for the whole batch
+    */
+    now = clock_cache_update();
 
-        if(!opts->test)
+    for(i=0; i < n; i++)
+    {
+        pkt_len = worker->dgrams[i].len;
+
+        if(pkt_len > 0 && pkt_len <= MAX_SPA_PACKET_LEN)
         {
-            /* Check for any expired firewall rules and deal with them.
-            */
-            if(opts->enable_fw)
+            spa_pkt = &(worker->spa_pkts[num_pkts++]);
+
+            worker->dgrams[i].msg[pkt_len] = 0x0;
+
+            udp_sockaddr_to_spa_addr(&(worker->dgrams[i].caddr),
+                    &(spa_pkt->packet_src_addr),
+                    &(spa_pkt->packet_src_ip),
+                    &(spa_pkt->packet_src_port));
+
+            if(opts->verbose)
             {
-                if(rules_chk_threshold > 0)
-                {
-                    opts->check_rules_ctr++;
-                    if ((opts->check_rules_ctr % rules_chk_threshold) == 0)
-                    {
-                        chk_rm_all = 1;
-                        opts->check_rules_ctr = 0;
-                    }
-                }
-                check_firewall_rules(opts, chk_rm_all);
-                chk_rm_all = 0;
+                spa_addr_ntop(&(spa_pkt->packet_src_addr),
+                        sipbuf, sizeof(sipbuf));
+                log_msg(LOG_INFO, "udp_server: Got UDP datagram (%d bytes) from: %s",
+                        pkt_len, sipbuf);
             }
 
-            /* See if any CMD_CYCLE_CLOSE commands need to be executed.
+            /* The datagram is handed to SPA processing straight out of
+             * the receive slot.
             */
-            cmd_cycle_close(opts);
+            spa_pkt->packet_data     = (unsigned char *)worker->dgrams[i].msg;
+            spa_pkt->packet_data_len = pkt_len;
+            spa_pkt->packet_proto    = IPPROTO_UDP;
+            spa_pkt->packet_dst_ip   = 0;
+            spa_pkt->packet_dst_port = worker->port;
+            spa_pkt->arrival_time    = worker->dgrams[i].arrival != 0
+                                        ? worker->dgrams[i].arrival : now;
+
+            /* The socket is bound to the wildcard address, so the
+             * destination is reported as unspecified in the same family
+             * as the source.
+            */
+            memset(&(spa_pkt->packet_dst_addr), 0x0, sizeof(spa_addr_t));
+            spa_pkt->packet_dst_addr.family = spa_pkt->packet_src_addr.family;
+            spa_pkt->sdp_id = 0;
+
+            FWKNOP_PROBE2(pkt_receive, spa_pkt, pkt_len);
         }
 
-        /* Initialize and setup the socket for select.
+        /* Count every datagram against --packet-limit regardless of
+         * SPA packet validity.
         */
-        FD_SET(s_sock, &sfd_set);
+        pthread_mutex_lock(&udp_ctr_mutex);
+        opts->packet_ctr += 1;
+        if (opts->packet_ctr_limit && opts->packet_ctr >= opts->packet_ctr_limit)
+            limit_reached = 1;
+        pthread_mutex_unlock(&udp_ctr_mutex);
 
-        /* Set our select timeout to (500ms by default).
-        */
-        tv.tv_sec = 0;
-        tv.tv_usec = s_timeout;
+        if(limit_reached)
+            break;
+    }
+
+    /* Process the whole batch in one go.
+    */
+    incoming_spa_batch(opts, worker->spa_pkts, num_pkts);
 
-        selval = select(s_sock+1, &sfd_set, NULL, NULL, &tv);
+    if(opts->foreground == 1 && opts->verbose > 2)
+        log_msg(LOG_DEBUG, "run_udp_server() processed: %d packets",
+                opts->packet_ctr);
 
-        if(selval == -1)
+    if (limit_reached)
+    {
+        log_msg(LOG_WARNING,
+            "* Incoming packet count limit of %i reached",
+            opts->packet_ctr_limit
+        );
+        udp_workers_stop = 1;
+        return EVENT_LOOP_STOP;
+    }
+
+    return EVENT_LOOP_CONTINUE;
+}
+
+static void *
+udp_worker_thread(void *arg)
+{
+    udp_worker_t   *worker = (udp_worker_t *)arg;
+    sigset_t        mask;
+    int             wait_ms;
+
+    /* Leave signal handling to the main thread.
+    */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    cpu_affinity_set(CPU_ROLE_CAPTURE);
+
+    /* Wake up at least every UDPSERV_SELECT_TIMEOUT to see if the main
+     * thread wants us to stop.
+    */
+    wait_ms = worker->s_timeout / 1000;
+    if(wait_ms < 1)
+        wait_ms = 1;
+
+    while(! udp_workers_stop)
+    {
+        if(event_loop_run_once(worker->loop, wait_ms) != EVENT_LOOP_CONTINUE)
+            udp_workers_stop = 1;
+    }
+
+    return NULL;
+}
+
+int
+run_udp_server(fko_srv_options_t *opts)
+{
+    int                 is_err, s_timeout, rv=1, i;
+    int                 rules_chk_threshold, batch_len, num_workers;
+    int                 started = 0;
+    udp_worker_t       *workers = NULL;
+    udp_timer_ctx_t     timer_ctx;
+    event_loop_t       *main_loop = NULL;
+    unsigned short      port;
+
+    port = strtol_wrapper(opts->config[CONF_UDPSERV_PORT],
+            1, MAX_PORT, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid max UDPSERV_PORT value.");
+        return -1;
+    }
+    s_timeout = strtol_wrapper(opts->config[CONF_UDPSERV_SELECT_TIMEOUT],
+            1, RCHK_MAX_UDPSERV_SELECT_TIMEOUT, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid max UDPSERV_SELECT_TIMEOUT value.");
+        return -1;
+    }
+    batch_len = strtol_wrapper(opts->config[CONF_UDPSERV_RECV_BATCH],
+            1, RCHK_MAX_UDPSERV_RECV_BATCH, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid UDPSERV_RECV_BATCH value.");
+        return -1;
+    }
+    num_workers = strtol_wrapper(opts->config[CONF_UDPSERV_WORKERS],
+            1, RCHK_MAX_UDPSERV_WORKERS, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid UDPSERV_WORKERS value.");
+        return -1;
+    }
+
+    /* The sockets of the fwknopd being upgraded share one SO_REUSEPORT
+     * group, so take all of them over rather than rebinding or dropping
+     * any.
+    */
+    if((i = upgrade_socket_count(SOCK_DGRAM, port)) > 0 && i != num_workers)
+    {
+        log_msg(LOG_WARNING,
+            "Taking over %i UDP sockets, ignoring UDPSERV_WORKERS %i until the next restart.",
+            i, num_workers);
+        num_workers = i;
+    }
+    rules_chk_threshold = opts->rt->rules_chk_threshold;
+
+    if((workers = calloc(num_workers, sizeof(udp_worker_t))) == NULL)
+    {
+        log_msg(LOG_ERR, "run_udp_server: calloc() failed for %i workers",
+            num_workers);
+        return -1;
+    }
+
+    if(num_workers > 1)
+        log_msg(LOG_INFO, "Kicking off UDP server to listen on port %i (%i workers).",
+            port, num_workers);
+    else
+        log_msg(LOG_INFO, "Kicking off UDP server to listen on port %i.", port);
+
+    for(i=0; i < num_workers; i++)
+    {
+        if(udp_worker_init(opts, &(workers[i]), port, s_timeout,
+                batch_len, num_workers > 1) != 0)
         {
-            if(errno == EINTR)
-            {
-                /* restart loop but only after we check for a terminating
-                 * signal above in sig_do_stop()
-                */
-                continue;
-            }
-            else
-            {
-                log_msg(LOG_ERR, "run_udp_server: select error socket: %s",
-                    strerror(errno));
-                rv = -1;
-                break;
-            }
+            while(--i >= 0)
+                udp_worker_free(&(workers[i]));
+            free(workers);
+            return -1;
         }
+    }
 
-        if(selval == 0)
-            continue;
+    /* Initialize our signal handlers. You can check the return value for
+     * the number of signals that were *not* set.  Those that were not set
+     * will be listed in the log/stderr output.
+    */
+    if(set_sig_handlers() > 0)
+        log_msg(LOG_ERR, "Errors encountered when setting signal handlers.");
 
-        if(! FD_ISSET(s_sock, &sfd_set))
-            continue;
+    udp_workers_stop = 0;
 
-        /* If we make it here then there is a datagram to process
-        */
-        clen = sizeof(caddr);
+    /* The main thread owns the rule expiration timer.  With a single
+     * worker it also owns the worker socket, otherwise it only handles
+     * signals and timers while the worker threads receive.  Rule expiration
+     * is driven by the clock rather than by how often we wake up, so a busy
+     * socket does not mean extra firewall checks.
+    */
+    timer_ctx.opts                = opts;
+    timer_ctx.rules_chk_threshold = rules_chk_threshold;
 
-        pkt_len = recvfrom(s_sock, dgram_msg, MAX_SPA_PACKET_LEN,
-                0, (struct sockaddr *)&caddr, &clen);
+    if(num_workers > 1)
+        main_loop = event_loop_new();
+    else
+        main_loop = workers[0].loop;
 
-        if(pkt_len > 0 && pkt_len <= MAX_SPA_PACKET_LEN)
-        {
-            dgram_msg[pkt_len] = 0x0;
+    if(main_loop == NULL
+            || event_loop_add_timer(main_loop, UDPSERV_TIMER_INTERVAL * 1000,
+                udp_timer_handler, &timer_ctx) != 0)
+    {
+        udp_workers_stop = 1;
+        rv = -1;
+    }
 
-            if(opts->verbose)
+    /* SPA over TCP connections are accepted and read by the main thread.
+    */
+    if(! udp_workers_stop
+            && strncasecmp(opts->config[CONF_ENABLE_TCP_SERVER], "Y", 1) == 0
+            && start_tcp_server(opts, main_loop) != 0)
+    {
+        log_msg(LOG_ERR, "run_udp_server: could not start the TCP server");
+        udp_workers_stop = 1;
+        rv = -1;
+    }
+
+    /* and so are SPA over HTTP requests.
+    */
+    if(! udp_workers_stop
+            && strncasecmp(opts->config[CONF_ENABLE_HTTP_SERVER], "Y", 1) == 0
+            && start_http_server(opts, main_loop) != 0)
+    {
+        log_msg(LOG_ERR, "run_udp_server: could not start the HTTP server");
+        udp_workers_stop = 1;
+        rv = -1;
+    }
+
+    if(num_workers > 1 && ! udp_workers_stop)
+    {
+        for(started=0; started < num_workers; started++)
+        {
+            if(pthread_create(&(workers[started].thread), NULL,
+                    udp_worker_thread, &(workers[started])) != 0)
             {
-                memset(sipbuf, 0x0, MAX_IPV4_STR_LEN);
-                inet_ntop(AF_INET, &(caddr.sin_addr.s_addr), sipbuf, MAX_IPV4_STR_LEN);
-                log_msg(LOG_INFO, "udp_server: Got UDP datagram (%d bytes) from: %s",
-                        pkt_len, sipbuf);
+                log_msg(LOG_ERR, "run_udp_server: failed to start worker thread %i",
+                    started);
+                udp_workers_stop = 1;
+                rv = -1;
+                break;
             }
-
-            /* Copy the packet for SPA processing
-            */
-            strlcpy((char *)opts->spa_pkt.packet_data, dgram_msg, pkt_len+1);
-            opts->spa_pkt.packet_data_len = pkt_len;
-            opts->spa_pkt.packet_proto    = IPPROTO_UDP;
-            opts->spa_pkt.packet_src_ip   = caddr.sin_addr.s_addr;
-            opts->spa_pkt.packet_dst_ip   = saddr.sin_addr.s_addr;
-            opts->spa_pkt.packet_src_port = ntohs(caddr.sin_port);
-            opts->spa_pkt.packet_dst_port = ntohs(saddr.sin_port);
-            opts->spa_pkt.sdp_id   = 0;
-
-            incoming_spa(opts);
         }
+    }
 
-        memset(dgram_msg, 0x0, sizeof(dgram_msg));
-
-        opts->packet_ctr += 1;
-        if(opts->foreground == 1 && opts->verbose > 2)
-            log_msg(LOG_DEBUG, "run_udp_server() processed: %d packets",
-                    opts->packet_ctr);
+    /* Now loop and receive SPA packets.
+    */
+    while(! udp_workers_stop)
+    {
+        if(sig_do_stop(opts))
+        {
+            if(opts->verbose)
+                log_msg(LOG_INFO,
+                        "udp_server: terminating signal received, will stop.");
+            break;
+        }
 
-        if (opts->packet_ctr_limit && opts->packet_ctr >= opts->packet_ctr_limit)
+        if((is_err = event_loop_run_once(main_loop, -1)) != EVENT_LOOP_CONTINUE)
         {
-            log_msg(LOG_WARNING,
-                "* Incoming packet count limit of %i reached",
-                opts->packet_ctr_limit
-            );
+            if(is_err < 0)
+                rv = -1;
             break;
         }
 
     } /* infinite while loop */
 
-    close(s_sock);
+    udp_workers_stop = 1;
+
+    for(i=0; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    stop_tcp_server(opts);
+    stop_http_server(opts);
+
+    if(num_workers > 1)
+        event_loop_destroy(main_loop);
+
+    for(i=0; i < num_workers; i++)
+        udp_worker_free(&(workers[i]));
+
+    free(workers);
     return rv;
 }
 
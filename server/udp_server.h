@@ -31,6 +31,11 @@
 #ifndef UDP_SERVER_H
 #define UDP_SERVER_H
 
+/* Number of seconds between checks for expired firewall rules and
+ * CMD_CYCLE_CLOSE commands in the UDP server loop.
+*/
+#define UDPSERV_TIMER_INTERVAL  1
+
 /* Function prototypes
 */
 int run_udp_server(fko_srv_options_t *opts);
@@ -0,0 +1,851 @@
+/*
+ *****************************************************************************
+ *
+ * File:    upgrade.c
+ *
+ * Purpose: Hand a running fwknopd over to a newly started binary
+ *          ("fwknopd --upgrade") without closing the SPA ports or flushing
+ *          the firewall.  The new process signals the old one with
+ *          SIGUSR2 and connects to a unix socket in the run dir, where it
+ *          is passed the UDP and TCP server sockets (SCM_RIGHTS).  Once it
+ *          has loaded its config and set up the firewall without flushing
+ *          it, the old process stops serving, sends over its replay cache
+ *          and the deadlines of the rules it added, and exits without
+ *          touching the firewall.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "upgrade.h"
+#include "replay_cache.h"
+#include "fwknopd_errors.h"
+#include "fw_util.h"
+#include "log_msg.h"
+#include "utils.h"
+#include "cpu_affinity.h"
+#include <pthread.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Listening sockets of the running server, which are what a new fwknopd
+ * takes over.  The servers add and remove them as they open and close.
+*/
+static pthread_mutex_t      up_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int                  up_socks[UPGRADE_MAX_FDS];
+static int                  up_num_socks = 0;
+
+/* Old side
+*/
+static pthread_t            up_thread;
+static int                  up_started = 0;     /* up_thread not joined yet */
+static int                  up_busy = 0;        /* up_thread still waiting */
+static int                  up_handoff = 0;     /* Stop serving and hand over */
+static volatile int         up_stop = 0;
+static char                 up_path[MAX_PATH_LEN];
+
+/* New side
+*/
+static int                  up_new = 0;
+static pid_t                up_old_pid = 0;
+static int                  up_fds[UPGRADE_MAX_FDS];
+static int                  up_num_fds = 0;
+
+/* The connection to the other fwknopd, on either side
+*/
+static int                  up_conn = -1;
+
+void
+upgrade_add_socket(const int fd)
+{
+    pthread_mutex_lock(&up_mutex);
+    if(up_num_socks < UPGRADE_MAX_FDS)
+        up_socks[up_num_socks++] = fd;
+    pthread_mutex_unlock(&up_mutex);
+    return;
+}
+
+/* Called before the socket is closed, so that a handover under way
+ * cannot send a descriptor that has been reused for something else.
+*/
+void
+upgrade_del_socket(const int fd)
+{
+    int     i;
+
+    pthread_mutex_lock(&up_mutex);
+    for(i=0; i < up_num_socks; i++)
+    {
+        if(up_socks[i] == fd)
+        {
+            up_socks[i] = up_socks[--up_num_socks];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&up_mutex);
+    return;
+}
+
+static int
+up_sock_path(const fko_srv_options_t *opts, struct sockaddr_un *addr)
+{
+    memset(addr, 0x0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+
+    if(snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%s",
+            opts->config[CONF_FWKNOP_RUN_DIR], UPGRADE_SOCK_NAME)
+            >= (int)sizeof(addr->sun_path))
+    {
+        log_msg(LOG_ERR, "[*] Upgrade: run dir path too long for a unix socket: %s",
+            opts->config[CONF_FWKNOP_RUN_DIR]);
+        return -1;
+    }
+    return 0;
+}
+
+/* Wait up to timeout seconds for the socket to become ready.  Returns 1
+ * when it is, 0 on timeout (or upgrade_stop()) and -1 on error.
+*/
+static int
+up_wait(const int fd, const short events, const int timeout)
+{
+    struct pollfd   pfd;
+    time_t          deadline = time(NULL) + timeout;
+    int             res;
+
+    pfd.fd     = fd;
+    pfd.events = events;
+
+    while(! up_stop && time(NULL) < deadline)
+    {
+        if((res = poll(&pfd, 1, 1000)) > 0)
+            return 1;
+        if(res < 0 && errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+static int
+up_write_all(const int fd, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    ssize_t              n;
+
+    while(len > 0)
+    {
+        if((n = send(fd, p, len, MSG_NOSIGNAL)) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        p   += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int
+up_read_all(const int fd, void *buf, size_t len, const int timeout)
+{
+    unsigned char  *p = buf;
+    ssize_t         n;
+
+    while(len > 0)
+    {
+        if(up_wait(fd, POLLIN, timeout) != 1)
+            return -1;
+
+        if((n = recv(fd, p, len, 0)) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        if(n == 0)
+            return -1;
+        p   += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int
+up_read_hdr(const int fd, upgrade_msg_hdr_t *hdr, const uint32_t type,
+        const int timeout)
+{
+    if(up_read_all(fd, hdr, sizeof(upgrade_msg_hdr_t), timeout) != 0)
+        return -1;
+
+    if(hdr->magic != UPGRADE_MAGIC || hdr->type != type)
+    {
+        log_msg(LOG_ERR, "[*] Upgrade: unexpected message from the other fwknopd.");
+        return -1;
+    }
+    return 0;
+}
+
+/* Only a process of the same user may take over.  The socket is mode
+ * 0600 in the run dir as well, this also covers a group writable run dir.
+*/
+static int
+up_check_peer(const int fd, const pid_t pid)
+{
+#ifdef SO_PEERCRED
+    struct ucred    cred;
+    socklen_t       len = sizeof(cred);
+
+    if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Upgrade: could not get the peer credentials: %s",
+            strerror(errno));
+        return -1;
+    }
+
+    if(cred.uid != geteuid() || (pid > 0 && cred.pid != pid))
+    {
+        log_msg(LOG_ERR, "[*] Upgrade: rejecting connection from PID %i (uid %i).",
+            (int)cred.pid, (int)cred.uid);
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+/* Send the listening sockets.  The lock keeps the servers from closing
+ * any of them until they are on their way.
+*/
+static int
+up_send_sockets(const int fd)
+{
+    upgrade_msg_hdr_t   hdr;
+    struct msghdr       msg;
+    struct iovec        iov;
+    struct cmsghdr     *cmsg;
+    char                ctl[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+    ssize_t             n;
+
+    memset(&hdr, 0x0, sizeof(hdr));
+    memset(&msg, 0x0, sizeof(msg));
+    memset(ctl, 0x0, sizeof(ctl));
+
+    pthread_mutex_lock(&up_mutex);
+
+    hdr.magic   = UPGRADE_MAGIC;
+    hdr.type    = UPGRADE_MSG_HELLO;
+    hdr.num_fds = up_num_socks;
+    hdr.rec_len = sizeof(upgrade_digest_rec_t);
+
+    iov.iov_base   = &hdr;
+    iov.iov_len    = sizeof(hdr);
+    msg.msg_iov    = &iov;
+    msg.msg_iovlen = 1;
+
+    if(up_num_socks > 0)
+    {
+        msg.msg_control    = ctl;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * up_num_socks);
+
+        cmsg             = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type  = SCM_RIGHTS;
+        cmsg->cmsg_len   = CMSG_LEN(sizeof(int) * up_num_socks);
+        memcpy(CMSG_DATA(cmsg), up_socks, sizeof(int) * up_num_socks);
+    }
+
+    while((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+
+    pthread_mutex_unlock(&up_mutex);
+
+    if(n != sizeof(hdr))
+    {
+        log_msg(LOG_ERR, "[*] Upgrade: could not send the sockets: %s",
+            strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void *
+up_thread_func(void *arg)
+{
+    struct sockaddr_un  addr;
+    upgrade_msg_hdr_t   hdr;
+    sigset_t            mask;
+    int                 lsock = -1, conn = -1;
+
+    /* Leave signal handling to the main thread.
+    */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    cpu_affinity_set(CPU_ROLE_HOUSEKEEPING);
+
+    if(up_sock_path((fko_srv_options_t *)arg, &addr) != 0)
+        goto done;
+
+    if((lsock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        log_msg(LOG_ERR, "[*] Upgrade: socket() failed: %s", strerror(errno));
+        goto done;
+    }
+
+    unlink(addr.sun_path);
+    if(bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) != 0
+            || chmod(addr.sun_path, S_IRUSR|S_IWUSR) != 0
+            || listen(lsock, 1) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Upgrade: could not listen on %s: %s",
+            addr.sun_path, strerror(errno));
+        goto done;
+    }
+    strlcpy(up_path, addr.sun_path, sizeof(up_path));
+
+    if(up_wait(lsock, POLLIN, UPGRADE_TIMEOUT) != 1
+            || (conn = accept(lsock, NULL, NULL)) < 0)
+    {
+        if(! up_stop)
+            log_msg(LOG_WARNING, "Upgrade: no new fwknopd connected, carrying on.");
+        goto done;
+    }
+
+    if(up_check_peer(conn, 0) != 0 || up_send_sockets(conn) != 0)
+        goto done;
+
+    /* The new fwknopd reports back once it is ready to serve.
+    */
+    if(up_read_hdr(conn, &hdr, UPGRADE_MSG_READY, UPGRADE_READY_TIMEOUT) != 0)
+    {
+        if(! up_stop)
+            log_msg(LOG_WARNING, "Upgrade: the new fwknopd gave up, carrying on.");
+        goto done;
+    }
+
+    log_msg(LOG_WARNING, "Upgrade: handing over to the new fwknopd.");
+
+    pthread_mutex_lock(&up_mutex);
+    up_conn    = conn;
+    up_handoff = 1;
+    conn       = -1;
+    pthread_mutex_unlock(&up_mutex);
+
+    kill(getpid(), SIGUSR2);
+
+done:
+    if(conn >= 0)
+        close(conn);
+    if(lsock >= 0)
+    {
+        close(lsock);
+        if(up_path[0] != '\0')
+            unlink(up_path);
+    }
+    up_path[0] = '\0';
+
+    pthread_mutex_lock(&up_mutex);
+    up_busy = 0;
+    pthread_mutex_unlock(&up_mutex);
+
+    return NULL;
+}
+
+/* Called from the main thread on SIGUSR2 - a new fwknopd wants to take
+ * over.
+*/
+void
+upgrade_request(fko_srv_options_t *opts)
+{
+    pthread_mutex_lock(&up_mutex);
+
+    if(up_busy || up_handoff)
+    {
+        pthread_mutex_unlock(&up_mutex);
+        return;
+    }
+
+    if(up_started)
+    {
+        pthread_join(up_thread, NULL);
+        up_started = 0;
+    }
+
+    log_msg(LOG_WARNING, "Got SIGUSR2. Waiting for the new fwknopd to take over...");
+
+    up_busy = 1;
+    if(pthread_create(&up_thread, NULL, up_thread_func, opts) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Unable to start the upgrade thread.");
+        up_busy = 0;
+    }
+    else
+        up_started = 1;
+
+    pthread_mutex_unlock(&up_mutex);
+    return;
+}
+
+/* Whether the main loop should stop and hand over to the new fwknopd.
+*/
+int
+upgrade_handoff_pending(void)
+{
+    int     res;
+
+    pthread_mutex_lock(&up_mutex);
+    res = up_handoff;
+    pthread_mutex_unlock(&up_mutex);
+
+    return res;
+}
+
+/* Called once the main loop has stopped: send the replay cache and the
+ * rule deadlines, after which the old fwknopd exits.
+*/
+void
+upgrade_send_state(fko_srv_options_t *opts)
+{
+    upgrade_msg_hdr_t       hdr;
+    upgrade_digest_rec_t   *recs = NULL;
+    replay_snapshot_ent_t  *ents = NULL;
+    time_t                 *deadlines = NULL;
+    int64_t                *wire_deadlines = NULL;
+    int                     num_ents, num_deadlines, i;
+
+    if(up_started)
+    {
+        pthread_join(up_thread, NULL);
+        up_started = 0;
+    }
+
+    if(up_conn < 0)
+        return;
+
+    if((num_ents = replay_cache_snapshot(opts, &ents)) < 0)
+        num_ents = 0;
+    if((num_deadlines = fw_timer_deadlines(&deadlines)) < 0)
+        num_deadlines = 0;
+
+    if((num_ents > 0
+                && (recs = calloc(num_ents, sizeof(upgrade_digest_rec_t))) == NULL)
+            || (num_deadlines > 0
+                && (wire_deadlines = calloc(num_deadlines, sizeof(int64_t))) == NULL))
+    {
+        log_msg(LOG_ERR, "[*] Upgrade: memory allocation error, not sending the replay cache.");
+        num_ents = num_deadlines = 0;
+    }
+
+    for(i=0; i < num_ents; i++)
+    {
+        memcpy(recs[i].digest, ents[i].digest, REPLAY_DIGEST_LEN);
+        recs[i].created  = ents[i].info.created;
+        recs[i].src_ip   = ents[i].info.src_ip;
+        recs[i].dst_ip   = ents[i].info.dst_ip;
+        recs[i].src_port = ents[i].info.src_port;
+        recs[i].dst_port = ents[i].info.dst_port;
+        recs[i].proto    = ents[i].info.proto;
+    }
+    for(i=0; i < num_deadlines; i++)
+        wire_deadlines[i] = deadlines[i];
+
+    memset(&hdr, 0x0, sizeof(hdr));
+    hdr.magic         = UPGRADE_MAGIC;
+    hdr.type          = UPGRADE_MSG_STATE;
+    hdr.num_digests   = num_ents;
+    hdr.num_deadlines = num_deadlines;
+    hdr.rec_len       = sizeof(upgrade_digest_rec_t);
+
+    if(up_write_all(up_conn, &hdr, sizeof(hdr)) != 0
+            || up_write_all(up_conn, recs, num_ents * sizeof(upgrade_digest_rec_t)) != 0
+            || up_write_all(up_conn, wire_deadlines, num_deadlines * sizeof(int64_t)) != 0)
+        log_msg(LOG_ERR, "[*] Upgrade: could not send the replay cache: %s",
+            strerror(errno));
+    else
+        log_msg(LOG_INFO, "Upgrade: handed over %i replay digests and %i rule deadlines.",
+            num_ents, num_deadlines);
+
+    close(up_conn);
+    up_conn = -1;
+
+    free(ents);
+    free(recs);
+    free(deadlines);
+    free(wire_deadlines);
+    return;
+}
+
+/* Give up on any upgrade under way, on either side.  On the new side
+ * this lets the old fwknopd carry on.
+*/
+void
+upgrade_stop(void)
+{
+    int     i;
+
+    up_stop = 1;
+
+    if(up_started && ! pthread_equal(up_thread, pthread_self()))
+    {
+        pthread_join(up_thread, NULL);
+        up_started = 0;
+    }
+
+    if(up_conn >= 0)
+        close(up_conn);
+    up_conn = -1;
+
+    for(i=0; i < up_num_fds; i++)
+        if(up_fds[i] >= 0)
+            close(up_fds[i]);
+    up_num_fds = 0;
+
+    up_busy    = 0;
+    up_handoff = 0;
+    up_new     = 0;
+    up_stop    = 0;
+    return;
+}
+
+/* New side: ask the fwknopd with the given PID to hand over, and receive
+ * its sockets.  Returns 0 on success.
+*/
+int
+upgrade_connect(fko_srv_options_t *opts, const pid_t old_pid)
+{
+    struct sockaddr_un  addr;
+    upgrade_msg_hdr_t   hdr;
+    struct msghdr       msg;
+    struct iovec        iov;
+    struct cmsghdr     *cmsg;
+    char                ctl[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+    time_t              deadline;
+    ssize_t             n;
+    int                 sock, i;
+
+    if(up_sock_path(opts, &addr) != 0)
+        return -1;
+
+    if(kill(old_pid, SIGUSR2) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Upgrade: could not signal PID %i: %s",
+            old_pid, strerror(errno));
+        return -1;
+    }
+
+    if((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        log_msg(LOG_ERR, "[*] Upgrade: socket() failed: %s", strerror(errno));
+        return -1;
+    }
+
+    /* The old fwknopd creates the socket once it sees the signal (and an
+     * earlier attempt may have left a stale one behind).
+    */
+    deadline = time(NULL) + UPGRADE_TIMEOUT;
+    while(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        if(time(NULL) >= deadline)
+        {
+            log_msg(LOG_ERR, "[*] Upgrade: could not reach the running fwknopd on %s: %s",
+                addr.sun_path, strerror(errno));
+            close(sock);
+            return -1;
+        }
+        usleep(100000);
+    }
+
+    if(up_check_peer(sock, old_pid) != 0
+            || up_wait(sock, POLLIN, UPGRADE_TIMEOUT) != 1)
+    {
+        close(sock);
+        return -1;
+    }
+
+    memset(&msg, 0x0, sizeof(msg));
+    iov.iov_base       = &hdr;
+    iov.iov_len        = sizeof(hdr);
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctl;
+    msg.msg_controllen = sizeof(ctl);
+
+    while((n = recvmsg(sock, &msg, 0)) < 0 && errno == EINTR)
+        ;
+
+    up_num_fds = 0;
+    for(cmsg = CMSG_FIRSTHDR(&msg); n > 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        up_num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(up_fds, CMSG_DATA(cmsg), sizeof(int) * up_num_fds);
+    }
+
+    if(n != sizeof(hdr) || hdr.magic != UPGRADE_MAGIC
+            || hdr.type != UPGRADE_MSG_HELLO || hdr.num_fds != up_num_fds
+            || hdr.rec_len != sizeof(upgrade_digest_rec_t))
+    {
+        log_msg(LOG_ERR, "[*] Upgrade: unexpected answer from PID %i.", old_pid);
+        for(i=0; i < up_num_fds; i++)
+            close(up_fds[i]);
+        up_num_fds = 0;
+        close(sock);
+        return -1;
+    }
+
+    up_conn    = sock;
+    up_old_pid = old_pid;
+    up_new     = 1;
+
+    log_msg(LOG_INFO, "Upgrade: took over %i sockets from PID %i.",
+        up_num_fds, old_pid);
+    return 0;
+}
+
+/* Whether this fwknopd is taking over and has not finished doing so.
+ * Until then the old one is still in charge of the firewall.
+*/
+int
+upgrade_in_progress(void)
+{
+    return up_new;
+}
+
+static int
+up_socket_matches(const int fd, const int type, const unsigned short port,
+        int *family)
+{
+    struct sockaddr_storage ss;
+    socklen_t               len = sizeof(int);
+    int                     sock_type = 0;
+
+    if(getsockopt(fd, SOL_SOCKET, SO_TYPE, &sock_type, &len) != 0
+            || sock_type != type)
+        return 0;
+
+    len = sizeof(ss);
+    if(getsockname(fd, (struct sockaddr *)&ss, &len) != 0)
+        return 0;
+
+    if(family != NULL)
+        *family = ss.ss_family;
+
+    if(ss.ss_family == AF_INET)
+        return ntohs(((struct sockaddr_in *)&ss)->sin_port) == port;
+    else if(ss.ss_family == AF_INET6)
+        return ntohs(((struct sockaddr_in6 *)&ss)->sin6_port) == port;
+
+    return 0;
+}
+
+/* Hand out an inherited socket of the given type bound to port, or -1
+ * if there is none (left).
+*/
+int
+upgrade_take_socket(const int type, const unsigned short port, int *family)
+{
+    int     i, fd;
+
+    for(i=0; i < up_num_fds; i++)
+    {
+        if(up_fds[i] >= 0 && up_socket_matches(up_fds[i], type, port, family))
+        {
+            fd = up_fds[i];
+            up_fds[i] = -1;
+            return fd;
+        }
+    }
+    return -1;
+}
+
+int
+upgrade_socket_count(const int type, const unsigned short port)
+{
+    int     i, count = 0;
+
+    for(i=0; i < up_num_fds; i++)
+        if(up_fds[i] >= 0 && up_socket_matches(up_fds[i], type, port, NULL))
+            count++;
+
+    return count;
+}
+
+/* Keep the rules the old fwknopd added when setting up the firewall.
+*/
+void
+upgrade_keep_fw_state(fko_srv_options_t *opts)
+{
+    if(! up_new)
+        return;
+
+#if FIREWALL_FIREWALLD
+    strlcpy(opts->config[CONF_FLUSH_FIREWD_AT_INIT], "N", 2);
+#elif FIREWALL_IPTABLES
+    strlcpy(opts->config[CONF_FLUSH_IPT_AT_INIT], "N", 2);
+#elif FIREWALL_NFTABLES
+    strlcpy(opts->config[CONF_FLUSH_NFT_AT_INIT], "N", 2);
+#elif FIREWALL_IPFW
+    strlcpy(opts->config[CONF_FLUSH_IPFW_AT_INIT], "N", 2);
+#endif
+    return;
+}
+
+static void
+up_import_state(fko_srv_options_t *opts, const upgrade_msg_hdr_t *hdr)
+{
+    upgrade_digest_rec_t    rec;
+    spa_pkt_info_t          spa_pkt;
+    int64_t                 deadline;
+    uint32_t                i;
+    int                     imported = 0;
+
+    for(i=0; i < hdr->num_digests; i++)
+    {
+        if(up_read_all(up_conn, &rec, sizeof(rec), UPGRADE_TIMEOUT) != 0)
+            return;
+
+        if(! opts->rt->digest_persistence)
+            continue;
+
+        memset(&spa_pkt, 0x0, sizeof(spa_pkt));
+        spa_pkt.packet_src_addr = rec.src_ip;
+        spa_pkt.packet_dst_addr = rec.dst_ip;
+        spa_pkt.packet_src_port = rec.src_port;
+        spa_pkt.packet_dst_port = rec.dst_port;
+        spa_pkt.packet_proto    = rec.proto;
+
+        if(import_replay(opts, &spa_pkt, rec.digest) == SPA_MSG_SUCCESS)
+            imported++;
+    }
+
+    for(i=0; i < hdr->num_deadlines; i++)
+    {
+        if(up_read_all(up_conn, &deadline, sizeof(deadline), UPGRADE_TIMEOUT) != 0)
+            return;
+        fw_timer_adopt((time_t)deadline);
+    }
+
+    log_msg(LOG_INFO, "Upgrade: took over %i replay digests and %u rule deadlines.",
+        imported, hdr->num_deadlines);
+    return;
+}
+
+/* Whether the UDP or TCP server is going to take over this socket.
+*/
+static int
+up_config_uses(const fko_srv_options_t *opts, const int fd)
+{
+    unsigned short  port;
+    int             is_err;
+
+    if(opts->enable_udp_server
+            || strncasecmp(opts->config[CONF_ENABLE_UDP_SERVER], "Y", 1) == 0)
+    {
+        port = strtol_wrapper(opts->config[CONF_UDPSERV_PORT],
+                1, MAX_PORT, NO_EXIT_UPON_ERR, &is_err);
+        if(is_err == FKO_SUCCESS && up_socket_matches(fd, SOCK_DGRAM, port, NULL))
+            return 1;
+    }
+
+    if(strncasecmp(opts->config[CONF_ENABLE_TCP_SERVER], "Y", 1) == 0)
+    {
+        port = strtol_wrapper(opts->config[CONF_TCPSERV_PORT],
+                1, MAX_PORT, NO_EXIT_UPON_ERR, &is_err);
+        if(is_err == FKO_SUCCESS && up_socket_matches(fd, SOCK_STREAM, port, NULL))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* New side, ready to serve: have the old fwknopd stop, take its state
+ * and wait for it to exit.  Problems are logged, we carry on regardless
+ * since the old process stops serving once told we are ready.
+*/
+void
+upgrade_complete(fko_srv_options_t *opts)
+{
+    upgrade_msg_hdr_t   hdr;
+    time_t              deadline;
+    char                c;
+    int                 i;
+
+    if(! up_new)
+        return;
+
+    /* Sockets the servers will not take over are of no further use.
+    */
+    for(i=0; i < up_num_fds; i++)
+    {
+        if(up_fds[i] >= 0 && ! up_config_uses(opts, up_fds[i]))
+        {
+            log_msg(LOG_INFO, "Upgrade: closing an inherited socket this config does not use.");
+            close(up_fds[i]);
+            up_fds[i] = -1;
+        }
+    }
+
+    memset(&hdr, 0x0, sizeof(hdr));
+    hdr.magic   = UPGRADE_MAGIC;
+    hdr.type    = UPGRADE_MSG_READY;
+    hdr.rec_len = sizeof(upgrade_digest_rec_t);
+
+    if(up_write_all(up_conn, &hdr, sizeof(hdr)) != 0)
+        log_msg(LOG_ERR, "[*] Upgrade: lost the connection to PID %i: %s",
+            up_old_pid, strerror(errno));
+    else if(up_read_hdr(up_conn, &hdr, UPGRADE_MSG_STATE, UPGRADE_READY_TIMEOUT) != 0)
+        log_msg(LOG_ERR, "[*] Upgrade: PID %i did not send its replay cache.",
+            up_old_pid);
+    else
+    {
+        up_import_state(opts, &hdr);
+
+        /* The old fwknopd closes the connection on its way out.
+        */
+        while(up_wait(up_conn, POLLIN, UPGRADE_TIMEOUT) == 1
+                && recv(up_conn, &c, 1, 0) > 0)
+            ;
+    }
+
+    close(up_conn);
+    up_conn = -1;
+
+    deadline = time(NULL) + UPGRADE_TIMEOUT;
+    while(kill(up_old_pid, 0) == 0 && time(NULL) < deadline)
+        usleep(100000);
+
+    if(kill(up_old_pid, 0) == 0)
+        log_msg(LOG_WARNING, "Upgrade: PID %i has not exited yet.", up_old_pid);
+    else
+        log_msg(LOG_WARNING, "Upgrade: took over from PID %i.", up_old_pid);
+
+    up_new = 0;
+    return;
+}
+
+/***EOF***/
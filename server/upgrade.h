@@ -0,0 +1,98 @@
+/*
+ *****************************************************************************
+ *
+ * File:    upgrade.h
+ *
+ * Purpose: Header file for upgrade.c - handing a running fwknopd over to a
+ *          newly started one (fwknopd --upgrade).
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+/* The old fwknopd listens for the new one on this unix socket in the run
+ * dir while an upgrade is under way.
+*/
+#define UPGRADE_SOCK_NAME       "fwknopd.upgrade"
+#define UPGRADE_MAGIC           0x666b7570  /* "fkup" */
+
+/* How long (seconds) either side waits for the other to connect or to
+ * answer, and how long the old fwknopd gives the new one to get through
+ * its startup before giving up on it.
+*/
+#define UPGRADE_TIMEOUT         10
+#define UPGRADE_READY_TIMEOUT   60
+
+/* The UDP server sockets plus the TCP server listener.
+*/
+#define UPGRADE_MAX_FDS         (RCHK_MAX_UDPSERV_WORKERS + 1)
+
+enum {
+    UPGRADE_MSG_HELLO = 1,  /* old -> new, carries the sockets */
+    UPGRADE_MSG_READY,      /* new -> old, stop serving now */
+    UPGRADE_MSG_STATE       /* old -> new, replay digests and rule deadlines */
+};
+
+typedef struct upgrade_msg_hdr {
+    uint32_t        magic;
+    uint32_t        type;
+    uint32_t        num_fds;
+    uint32_t        num_digests;
+    uint32_t        num_deadlines;
+    uint32_t        rec_len;    /* sizeof(upgrade_digest_rec_t) */
+} upgrade_msg_hdr_t;
+
+/* A replay cache digest as it goes over the upgrade socket.
+*/
+typedef struct upgrade_digest_rec {
+    unsigned char   digest[REPLAY_DIGEST_LEN];
+    int64_t         created;
+    spa_addr_t      src_ip;
+    spa_addr_t      dst_ip;
+    uint16_t        src_port;
+    uint16_t        dst_port;
+    uint8_t         proto;
+} upgrade_digest_rec_t;
+
+/* Prototypes
+*/
+void upgrade_add_socket(const int fd);
+void upgrade_del_socket(const int fd);
+
+void upgrade_request(fko_srv_options_t *opts);
+int upgrade_handoff_pending(void);
+void upgrade_send_state(fko_srv_options_t *opts);
+void upgrade_stop(void);
+
+int upgrade_connect(fko_srv_options_t *opts, const pid_t old_pid);
+int upgrade_in_progress(void);
+int upgrade_take_socket(const int type, const unsigned short port, int *family);
+int upgrade_socket_count(const int type, const unsigned short port);
+void upgrade_keep_fw_state(fko_srv_options_t *opts);
+void upgrade_complete(fko_srv_options_t *opts);
+
+#endif /* UPGRADE_H */
+
+/***EOF***/
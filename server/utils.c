@@ -32,10 +32,33 @@
 #include "config_init.h"
 #include "fw_util.h"
 #include "cmd_cycle.h"
+#include "extcmd.h"
 #include "connection_tracker.h"
+#include "conntrack_thread.h"
+#include "spa_workers.h"
+#include "fw_commit.h"
+#include "rate_limit.h"
+#include "grant_quota.h"
+#include "authz_cache.h"
+#include "replay_gossip.h"
+#include "cluster.h"
+#include "ha_sync.h"
+#include "reload.h"
+#include "metrics.h"
+#include "stats_page.h"
+#include "startup.h"
+#include "flight_recorder.h"
+#include "spa_trace.h"
+#include "config_dump.h"
+#include "upgrade.h"
+#include "control_client.h"
 
 #include <stdarg.h>
 
+#if HAVE_ARPA_INET_H
+  #include <arpa/inet.h>
+#endif
+
 #define ASCII_LEN 16
 
 /* Generic hex dump function.
@@ -270,6 +293,126 @@ is_digits(const char * const str)
     return 1;
 }
 
+/* Fill in a compact packet address from an IPv4 address (network byte
+ * order) or the 16 bytes of an IPv6 address.
+*/
+void
+spa_addr_set_ipv4(spa_addr_t *sa, const unsigned int ip)
+{
+    memset(sa, 0x0, sizeof(*sa));
+    sa->family = AF_INET;
+    memcpy(sa->addr, &ip, sizeof(ip));
+    return;
+}
+
+void
+spa_addr_set_ipv6(spa_addr_t *sa, const unsigned char *ip6)
+{
+    sa->family = AF_INET6;
+    memcpy(sa->addr, ip6, sizeof(sa->addr));
+    return;
+}
+
+/* Format a packet address for logging.  buf should be at least
+ * MAX_IPV46_STR_LEN bytes.
+*/
+char *
+spa_addr_ntop(const spa_addr_t *sa, char *buf, const size_t buf_len)
+{
+    if(inet_ntop(sa->family == AF_INET6 ? AF_INET6 : AF_INET,
+            sa->addr, buf, buf_len) == NULL && buf_len > 0)
+        buf[0] = '\0';
+
+    return(buf);
+}
+
+typedef struct parallel_job
+{
+    int               (*fn)(void *arg, const int idx);
+    void               *arg;
+    int                 count;
+    volatile int        next;
+    volatile int        failed;
+} parallel_job_t;
+
+static void *
+parallel_worker(void *arg)
+{
+    parallel_job_t *job = (parallel_job_t *)arg;
+    int             idx;
+
+    while((idx = __sync_fetch_and_add(&(job->next), 1)) < job->count)
+        if(job->fn(job->arg, idx) != 0)
+            __sync_fetch_and_add(&(job->failed), 1);
+
+    return NULL;
+}
+
+/* Call fn(arg, idx) for each idx from 0 to count-1, spread over up to
+ * PARALLEL_MAX_THREADS threads (one per online CPU) with the calling
+ * thread taking part.  Small jobs run on the calling thread alone.  fn
+ * must only touch state that belongs to its idx.  Returns the number of
+ * calls that returned non-zero.
+*/
+int
+run_parallel(const int count, int (*fn)(void *arg, const int idx), void *arg)
+{
+    parallel_job_t  job;
+    pthread_t       threads[PARALLEL_MAX_THREADS];
+    long            num_cpus;
+    int             i, num_threads, started = 0;
+
+    memset(&job, 0x0, sizeof(job));
+    job.fn    = fn;
+    job.arg   = arg;
+    job.count = count;
+
+    num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = count / PARALLEL_MIN_ITEMS;
+    if(num_threads > num_cpus)
+        num_threads = num_cpus;
+    if(num_threads > PARALLEL_MAX_THREADS)
+        num_threads = PARALLEL_MAX_THREADS;
+
+    /* If a thread cannot be started its share is picked up by the
+     * others.
+    */
+    for(i=1; i < num_threads; i++)
+        if(pthread_create(&(threads[started]), NULL, parallel_worker, &job) == 0)
+            started++;
+
+    parallel_worker(&job);
+
+    for(i=0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    return(job.failed);
+}
+
+/* Parse an IPv4 or IPv6 address string.  Returns 1 on success like
+ * inet_pton().
+*/
+int
+spa_addr_pton(const char *str, spa_addr_t *sa)
+{
+    unsigned int    ip;
+
+    if(inet_pton(AF_INET, str, &ip) == 1)
+    {
+        spa_addr_set_ipv4(sa, ip);
+        return(1);
+    }
+
+    memset(sa, 0x0, sizeof(*sa));
+    if(inet_pton(AF_INET6, str, sa->addr) == 1)
+    {
+        sa->family = AF_INET6;
+        return(1);
+    }
+
+    return(0);
+}
+
 static int
 add_argv(char **argv_new, int *argc_new,
         const char *new_arg, const fko_srv_options_t * const opts)
@@ -363,6 +506,38 @@ free_argv(char **argv_new, int *argc_new)
     return;
 }
 
+/* The wall clock in seconds as of the last clock_cache_update().  The
+ * packet paths update it once per batch (or per packet where there are no
+ * batches) and the timers once per pass, and everything in between reads
+ * it instead of calling time().
+*/
+static time_t clock_cache;
+
+time_t
+clock_cache_update(void)
+{
+    time_t          now;
+#ifdef CLOCK_REALTIME_COARSE
+    struct timespec ts;
+
+    if(clock_gettime(CLOCK_REALTIME_COARSE, &ts) == 0)
+        now = ts.tv_sec;
+    else
+#endif
+        now = time(NULL);
+
+    __atomic_store_n(&clock_cache, now, __ATOMIC_RELAXED);
+    return now;
+}
+
+time_t
+clock_cache_now(void)
+{
+    time_t  now = __atomic_load_n(&clock_cache, __ATOMIC_RELAXED);
+
+    return(now != 0 ? now : clock_cache_update());
+}
+
 void
 clean_exit(fko_srv_options_t *opts, unsigned int fw_cleanup_flag, unsigned int exit_status)
 {
@@ -373,30 +548,57 @@ clean_exit(fko_srv_options_t *opts, unsigned int fw_cleanup_flag, unsigned int e
     }
 #endif
 
+    /* The workers use the config and access data freed below, and so
+     * do a reload, a config dump and a firewall still being set up.
+    */
+    startup_stop();
+    reload_stop();
+    config_dump_stop();
+    cluster_stop();
+    ha_sync_stop();
+    spa_workers_stop();
+    fw_commit_stop();
+    rate_limit_stop();
+    authz_cache_stop();
+    grant_quota_stop();
+    replay_gossip_stop();
+    metrics_stop();
+    stats_page_stop();
+    spa_trace_stop();
+    flight_recorder_stop();
+
+    /* The control client thread sends the connection tracker's reports,
+     * so it is stopped first.
+    */
+    if(opts->ctrl_client != NULL && opts->ctrl_client_thread > 0)
+        control_client_thread_stop(opts);
+    cluster_ring_free();
+
+    conntrack_thread_stop();
     destroy_connection_tracker(opts);
 
+    /* Until an upgrade is complete the firewall belongs to the fwknopd
+     * we were taking over from.
+    */
+    if(upgrade_in_progress())
+        fw_cleanup_flag = NO_FW_CLEANUP;
+    upgrade_stop();
+
     if(!opts->test && opts->enable_fw && (fw_cleanup_flag == FW_CLEANUP))
         fw_cleanup(opts);
 
-#if USE_FILE_CACHE
+    fw_timer_clear();
+
     free_replay_list(opts);
-#endif
 
     if(opts->ctrl_client != NULL)
-    {
-        if(opts->ctrl_client_thread > 0)
-        {
-            pthread_cancel(opts->ctrl_client_thread);
-            pthread_join(opts->ctrl_client_thread, NULL);
-            opts->ctrl_client_thread = 0;
-        }
-
         sdp_ctrl_client_destroy(opts->ctrl_client);
-    }
 
     free_logging();
     free_cmd_cycle_list(opts);
+    extcmd_helper_stop();
     free_configs(opts);
+    free_runtime_config(opts);
     exit(exit_status);
 }
 
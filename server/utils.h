@@ -57,6 +57,12 @@
 #define IS_DIR 1
 #define IS_EXE 2
 
+/* run_parallel() uses at most this many threads, and only starts another
+ * one for each PARALLEL_MIN_ITEMS items.
+*/
+#define PARALLEL_MAX_THREADS    16
+#define PARALLEL_MIN_ITEMS      64
+
 /* Prototypes
 */
 void  hex_dump(const unsigned char *data, const int size);
@@ -72,5 +78,13 @@ int   is_digits(const char * const str);
 int   strtoargv(const char * const args_str, char **argv_new, int *argc_new,
         const fko_srv_options_t * const opts);
 void  free_argv(char **argv_new, int *argc_new);
+void  spa_addr_set_ipv4(spa_addr_t *sa, const unsigned int ip);
+void  spa_addr_set_ipv6(spa_addr_t *sa, const unsigned char *ip6);
+char *spa_addr_ntop(const spa_addr_t *sa, char *buf, const size_t buf_len);
+int   spa_addr_pton(const char *str, spa_addr_t *sa);
+time_t clock_cache_update(void);
+time_t clock_cache_now(void);
+int   run_parallel(const int count, int (*fn)(void *arg, const int idx),
+        void *arg);
 
 #endif  /* UTILS_H */
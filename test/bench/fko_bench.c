@@ -0,0 +1,392 @@
+/*
+ *****************************************************************************
+ *
+ * File:    fko_bench.c
+ *
+ * Purpose: Micro-benchmarks for the libfko hot paths - context setup,
+ *          SPA packet creation, the server side decode (HMAC check plus
+ *          decrypt) for each digest, HMAC and encryption mode, and the
+ *          base64, SHA-256, HMAC-SHA256 and Rijndael primitives over a
+ *          range of payload sizes.  Results are written to stdout as a
+ *          JSON array so runs can be compared by scripts.
+ *
+ *          Usage: fko_bench [-t seconds] [filter]
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../../config.h"
+#include "fko.h"
+#include "base64.h"
+#include "digest.h"
+#include "hmac.h"
+#include "cipher_funcs.h"
+
+#define ENC_KEY         "fwknopbenchmarkencryptionkey0123"
+#define HMAC_KEY        "fwknopbenchmarkhmackey0123456789"
+#define SPA_MSG         "127.0.0.2,tcp/22"
+
+/* Each benchmark runs in batches, doubling the batch size until the
+ * whole batch takes at least MIN_BATCH_NS, and keeps going until the
+ * total run time reaches the -t limit.
+*/
+#define DEF_RUN_SECS    0.5
+#define MIN_BATCH_NS    10000000ULL
+#define MAX_PAYLOAD     16384
+
+typedef struct bench_arg {
+    int             digest_type;
+    int             hmac_type;
+    int             enc_mode;
+    size_t          len;
+    char           *spa_data;
+} bench_arg_t;
+
+typedef int (*bench_fn_t)(bench_arg_t *arg);
+
+static double           run_secs = DEF_RUN_SECS;
+static const char      *filter   = NULL;
+static int              results  = 0;
+
+/* rij_encrypt() pads its input in place and rij_decrypt() consumes
+ * the salt block in place, hence the slack and the work copy.
+*/
+static unsigned char    plain[MAX_PAYLOAD + 64];
+static unsigned char    cipher[MAX_PAYLOAD + 64];
+static unsigned char    cipher_work[MAX_PAYLOAD + 64];
+static size_t           cipher_len;
+static unsigned char    scratch[MAX_PAYLOAD * 2 + 64];
+static char             b64_buf[MAX_PAYLOAD * 2];
+
+static const size_t     payload_sizes[] = { 64, 256, 1024, 4096, 16384 };
+#define NUM_PAYLOAD_SIZES   (sizeof(payload_sizes) / sizeof(payload_sizes[0]))
+
+static unsigned long long
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Run one benchmark and print its JSON record.  When bytes is non-zero
+ * the throughput is included as well.
+*/
+static void
+run_bench(const char *name, bench_fn_t fn, bench_arg_t *arg, size_t bytes)
+{
+    unsigned long long  start, elapsed, total = 0, iters = 0, batch = 1, i;
+    unsigned long long  limit = (unsigned long long)(run_secs * 1e9);
+    double              ns_op;
+
+    if(filter != NULL && strstr(name, filter) == NULL)
+        return;
+
+    /* One untimed call so lazy initialisation and a failing setup do
+     * not end up in the numbers.
+    */
+    if(fn(arg) != 0)
+    {
+        fprintf(stderr, "[-] %s: setup failed, skipped\n", name);
+        return;
+    }
+
+    while(total < limit)
+    {
+        start = now_ns();
+        for(i=0; i < batch; i++)
+            fn(arg);
+        elapsed = now_ns() - start;
+
+        total += elapsed;
+        iters += batch;
+
+        if(elapsed < MIN_BATCH_NS)
+            batch *= 2;
+    }
+
+    ns_op = (double)total / (double)iters;
+
+    printf("%s\n  {\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.1f",
+            results++ ? "," : "", name, iters, ns_op);
+    if(bytes > 0)
+        printf(", \"bytes\": %lu, \"mb_per_sec\": %.2f", (unsigned long)bytes,
+                (double)bytes * 1e3 / ns_op);
+    printf("}");
+    fflush(stdout);
+}
+
+/* Benchmarked operations
+*/
+static int
+op_new_destroy(bench_arg_t *arg)
+{
+    fko_ctx_t ctx = NULL;
+    int       res;
+
+    (void)arg;
+    res = fko_new(&ctx);
+    fko_destroy(ctx);
+    return res != FKO_SUCCESS;
+}
+
+static int
+make_ctx(fko_ctx_t *ctx, bench_arg_t *arg)
+{
+    int res;
+
+    if((res = fko_new(ctx)) != FKO_SUCCESS)
+        return res;
+    if((res = fko_set_disable_sdp_mode(*ctx, 1)) != FKO_SUCCESS
+            || (res = fko_set_spa_message(*ctx, SPA_MSG)) != FKO_SUCCESS
+            || (res = fko_set_spa_digest_type(*ctx, arg->digest_type)) != FKO_SUCCESS
+            || (res = fko_set_spa_encryption_mode(*ctx, arg->enc_mode)) != FKO_SUCCESS
+            || (res = fko_set_spa_hmac_type(*ctx, arg->hmac_type)) != FKO_SUCCESS)
+    {
+        fko_destroy(*ctx);
+        *ctx = NULL;
+    }
+    return res;
+}
+
+static int
+op_spa_data_final(bench_arg_t *arg)
+{
+    fko_ctx_t ctx = NULL;
+    int       res;
+
+    if((res = make_ctx(&ctx, arg)) != FKO_SUCCESS)
+        return res;
+    res = fko_spa_data_final(ctx, ENC_KEY, strlen(ENC_KEY),
+            HMAC_KEY, strlen(HMAC_KEY));
+    fko_destroy(ctx);
+    return res != FKO_SUCCESS;
+}
+
+/* The server side of an SPA packet: fko_new_with_data() verifies the
+ * HMAC, then decrypts and decodes the payload.
+*/
+static int
+op_spa_decode(bench_arg_t *arg)
+{
+    fko_ctx_t ctx = NULL;
+    int       res;
+
+    res = fko_new_with_data(&ctx, arg->spa_data, ENC_KEY, strlen(ENC_KEY),
+            arg->enc_mode, HMAC_KEY, strlen(HMAC_KEY), arg->hmac_type, 0);
+    fko_destroy(ctx);
+    return res != FKO_SUCCESS;
+}
+
+static int
+op_b64_encode(bench_arg_t *arg)
+{
+    return b64_encode(plain, b64_buf, arg->len) <= 0;
+}
+
+static int
+op_b64_decode(bench_arg_t *arg)
+{
+    (void)arg;
+    return b64_decode(b64_buf, scratch) <= 0;
+}
+
+static int
+op_sha256(bench_arg_t *arg)
+{
+    sha256(scratch, plain, arg->len);
+    return 0;
+}
+
+static int
+op_hmac_sha256(bench_arg_t *arg)
+{
+    hmac_sha256((char *)plain, arg->len, scratch, HMAC_KEY, strlen(HMAC_KEY));
+    return 0;
+}
+
+static int
+op_rij_decrypt(bench_arg_t *arg)
+{
+    memcpy(cipher_work, cipher, cipher_len);
+    return rij_decrypt(cipher_work, cipher_len, ENC_KEY, strlen(ENC_KEY),
+            scratch, arg->enc_mode) == 0;
+}
+
+/* Build an SPA packet for the decode benchmark.  Returns NULL when the
+ * combination is not supported.
+*/
+static char *
+make_spa_data(bench_arg_t *arg)
+{
+    fko_ctx_t  ctx = NULL;
+    char      *spa_data = NULL, *copy = NULL;
+
+    if(make_ctx(&ctx, arg) != FKO_SUCCESS)
+        return NULL;
+    if(fko_spa_data_final(ctx, ENC_KEY, strlen(ENC_KEY),
+                HMAC_KEY, strlen(HMAC_KEY)) == FKO_SUCCESS
+            && fko_get_spa_data(ctx, &spa_data) == FKO_SUCCESS)
+        copy = strdup(spa_data);
+    fko_destroy(ctx);
+    return copy;
+}
+
+static void
+bench_spa(const char *label, bench_arg_t *arg)
+{
+    char name[128];
+
+    snprintf(name, sizeof(name), "fko_spa_data_final/%s", label);
+    run_bench(name, op_spa_data_final, arg, 0);
+
+    if((arg->spa_data = make_spa_data(arg)) == NULL)
+    {
+        fprintf(stderr, "[-] %s: cannot build SPA data, skipped\n", label);
+        return;
+    }
+    snprintf(name, sizeof(name), "fko_spa_decode/%s", label);
+    run_bench(name, op_spa_decode, arg, strlen(arg->spa_data));
+
+    free(arg->spa_data);
+    arg->spa_data = NULL;
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-t seconds] [filter]\n", prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    static const struct { const char *name; int type; } digests[] = {
+        { "md5",    FKO_DIGEST_MD5 },
+        { "sha1",   FKO_DIGEST_SHA1 },
+        { "sha256", FKO_DIGEST_SHA256 },
+        { "sha384", FKO_DIGEST_SHA384 },
+        { "sha512", FKO_DIGEST_SHA512 },
+    }, hmacs[] = {
+        { "md5",    FKO_HMAC_MD5 },
+        { "sha1",   FKO_HMAC_SHA1 },
+        { "sha256", FKO_HMAC_SHA256 },
+        { "sha384", FKO_HMAC_SHA384 },
+        { "sha512", FKO_HMAC_SHA512 },
+    }, modes[] = {
+        { "ecb",    FKO_ENC_MODE_ECB },
+        { "cbc",    FKO_ENC_MODE_CBC },
+        { "cfb",    FKO_ENC_MODE_CFB },
+        { "ofb",    FKO_ENC_MODE_OFB },
+        { "ctr",    FKO_ENC_MODE_CTR },
+    };
+    bench_arg_t arg;
+    char        name[128];
+    size_t      i;
+    int         opt;
+
+    while((opt = getopt(argc, argv, "t:h")) != -1)
+    {
+        if(opt == 't' && (run_secs = atof(optarg)) > 0)
+            continue;
+        usage(argv[0]);
+    }
+    if(optind < argc)
+        filter = argv[optind];
+
+    for(i=0; i < MAX_PAYLOAD; i++)
+        plain[i] = (unsigned char)(i * 131 + 7);
+
+    memset(&arg, 0, sizeof(arg));
+    arg.digest_type = FKO_DEFAULT_DIGEST;
+    arg.hmac_type   = FKO_DEFAULT_HMAC_MODE;
+    arg.enc_mode    = FKO_DEFAULT_ENC_MODE;
+
+    printf("[");
+
+    run_bench("fko_new_destroy", op_new_destroy, &arg, 0);
+
+    /* Vary one of digest, HMAC and encryption mode at a time, with the
+     * defaults for the other two.
+    */
+    for(i=0; i < sizeof(digests)/sizeof(digests[0]); i++)
+    {
+        arg.digest_type = digests[i].type;
+        snprintf(name, sizeof(name), "digest=%s", digests[i].name);
+        bench_spa(name, &arg);
+    }
+    arg.digest_type = FKO_DEFAULT_DIGEST;
+
+    for(i=0; i < sizeof(hmacs)/sizeof(hmacs[0]); i++)
+    {
+        arg.hmac_type = hmacs[i].type;
+        snprintf(name, sizeof(name), "hmac=%s", hmacs[i].name);
+        bench_spa(name, &arg);
+    }
+    arg.hmac_type = FKO_DEFAULT_HMAC_MODE;
+
+    for(i=0; i < sizeof(modes)/sizeof(modes[0]); i++)
+    {
+        arg.enc_mode = modes[i].type;
+        snprintf(name, sizeof(name), "mode=%s", modes[i].name);
+        bench_spa(name, &arg);
+    }
+    arg.enc_mode = FKO_DEFAULT_ENC_MODE;
+
+    /* Primitives by payload size
+    */
+    for(i=0; i < NUM_PAYLOAD_SIZES; i++)
+    {
+        arg.len = payload_sizes[i];
+
+        snprintf(name, sizeof(name), "b64_encode/%lu", (unsigned long)arg.len);
+        run_bench(name, op_b64_encode, &arg, arg.len);
+
+        b64_encode(plain, b64_buf, arg.len);
+        snprintf(name, sizeof(name), "b64_decode/%lu", (unsigned long)arg.len);
+        run_bench(name, op_b64_decode, &arg, strlen(b64_buf));
+
+        snprintf(name, sizeof(name), "sha256/%lu", (unsigned long)arg.len);
+        run_bench(name, op_sha256, &arg, arg.len);
+
+        snprintf(name, sizeof(name), "hmac_sha256/%lu", (unsigned long)arg.len);
+        run_bench(name, op_hmac_sha256, &arg, arg.len);
+
+        cipher_len = rij_encrypt(plain, arg.len, ENC_KEY, strlen(ENC_KEY),
+                cipher, arg.enc_mode, NULL);
+        snprintf(name, sizeof(name), "rij_decrypt/%lu", (unsigned long)arg.len);
+        run_bench(name, op_rij_decrypt, &arg, cipher_len);
+    }
+
+    printf("\n]\n");
+    return 0;
+}
+
+/***EOF***/
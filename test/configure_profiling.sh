@@ -0,0 +1,15 @@
+#!/bin/sh -x
+
+#
+# This is a convenience script to run ./configure with the command line args
+# that build fwknop for profiling with perf and similar sampling profilers
+# (frame pointers, -g1 line tables, and build IDs).  Extra args are passed
+# through, e.g. --with-profiler-agent=profiler to link gperftools.
+#
+
+if [ -x ./configure ]; then
+    ./configure --prefix=/usr --sysconfdir=/etc --localstatedir=/var \
+        --enable-profiling $@
+else
+    echo "[*] Execute from the fwknop top level sources directory"
+fi
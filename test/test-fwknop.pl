@@ -44,6 +44,7 @@ our $replay_pcap_file     = "$conf_dir/spa_replay.pcap";
 our $multi_pkts_pcap_file = "$conf_dir/multi_pkts.pcap";
 our $fcs_pcap_file        = "$conf_dir/fcs_spa.pcap";
 our $spa_over_http_pcap_file = "$conf_dir/spa_over_http.pcap";
+our $spa_dup_pcap_file  = "$output_dir/spa_dup.pcap";
 
 our $lib_dir = '../lib/.libs';
 
@@ -593,6 +594,8 @@ our %cf = (
     'ctr_mode_access'              => "$conf_dir/ctr_mode_access.conf",
     'cfb_mode_access'              => "$conf_dir/cfb_mode_access.conf",
     'ofb_mode_access'              => "$conf_dir/ofb_mode_access.conf",
+    'gcm_mode_access'              => "$conf_dir/gcm_mode_access.conf",
+    'gcm_binary_mode_access'       => "$conf_dir/gcm_binary_mode_access.conf",
     'open_ports_mismatch'          => "$conf_dir/mismatch_open_ports_access.conf",
     'require_user_access'          => "$conf_dir/require_user_access.conf",
     'user_mismatch_access'         => "$conf_dir/mismatch_user_access.conf",
@@ -1070,7 +1073,8 @@ my %test_keys = (
     'wait_for_conn_close' => $OPTIONAL,
     'disable_sdp_id' => $OPTIONAL,
     'remove_service_access' => $OPTIONAL,
-    'remove_service_access_first' => $OPTIONAL
+    'remove_service_access_first' => $OPTIONAL,
+    'pcap_ts_offset' => $OPTIONAL_NUMERIC
 );
 
 &validate_test_hashes();
@@ -2025,6 +2029,24 @@ sub configure_args_disable_execvpe() {
     return $rv;
 }
 
+sub configure_args_disable_openssl_aes() {
+    my $rv = 1;
+
+    my $curr_pwd = cwd() or die $!;
+
+    chdir '..' or die $!;
+
+    unless (&config_recompile('./extras/apparmor/configure_args.sh --disable-openssl-aes')) {
+        &write_test_file("[-] configure/recompile failure.\n",
+            "test/$curr_test_file");
+        $rv = 0;
+    }
+
+    chdir $curr_pwd or die $!;
+
+    return $rv;
+}
+
 sub configure_args_udp_server_no_libpcap() {
     my $rv = 1;
 
@@ -5926,6 +5948,72 @@ sub process_pcap_file_directly() {
     return $rv;
 }
 
+### send an SPA packet from the client to nowhere, then have fwknopd read
+### it twice from a pcap file recorded 'pcap_ts_offset' seconds ago
+sub pcap_file_replay_spa_data() {
+    my $test_hr = shift;
+
+    my $rv = 1;
+    my $server_was_stopped = 0;
+    my $fw_rule_created = 0;
+    my $fw_rule_removed = 0;
+
+    unless (&_client_send_spa_packet($test_hr, 1, $NO_SERVER_RECEIVE_CHECK)) {
+        &write_test_file("[-] fwknop client execution error.\n",
+            $curr_test_file);
+        return 0;
+    }
+
+    my $spa_pkt = &get_spa_packet_from_file($curr_test_file);
+
+    unless ($spa_pkt) {
+        &write_test_file("[-] could not get SPA packet " .
+            "from file: $curr_test_file\n", $curr_test_file);
+        return 0;
+    }
+
+    &write_spa_pcap($spa_dup_pcap_file, time() - $test_hr->{'pcap_ts_offset'},
+        [$spa_pkt, $spa_pkt]);
+
+    ($rv, $server_was_stopped, $fw_rule_created, $fw_rule_removed)
+        = &client_server_interaction($test_hr, [], $USE_PCAP_FILE);
+
+    return $rv;
+}
+
+### write a pcap file (Ethernet link type) with one UDP packet to the
+### default SPA port per payload, starting at $pcap_ts
+sub write_spa_pcap() {
+    my ($file, $pcap_ts, $payloads_ar) = @_;
+
+    open my $fh, '>', $file or die "[*] Could not open $file: $!";
+    binmode $fh;
+
+    ### magic, v2.4, GMT, sigfigs, snaplen, DLT_EN10MB
+    print $fh pack('LSSlLLL', 0xa1b2c3d4, 2, 4, 0, 0, 65535, 1);
+
+    my $ctr = 0;
+    for my $data (@$payloads_ar) {
+        my $udp = pack('nnnn', 32768 + $ctr, $default_spa_port,
+            8 + length($data), 0) . $data;
+        my $ip  = pack('CCnnnCCna4a4', 0x45, 0, 20 + length($udp),
+            $ctr + 1, 0x4000, 64, 17, 0,
+            inet_aton($loopback_ip), inet_aton($loopback_ip));
+
+        my $sum = 0;
+        $sum += $_ for unpack('n10', $ip);
+        $sum = ($sum & 0xffff) + ($sum >> 16) while $sum >> 16;
+        substr($ip, 10, 2) = pack('n', ~$sum & 0xffff);
+
+        my $frame = ("\x00" x 12) . pack('n', 0x0800) . $ip . $udp;
+        print $fh pack('LLLL', $pcap_ts + $ctr, 0,
+            length($frame), length($frame)), $frame;
+        $ctr++;
+    }
+    close $fh;
+    return;
+}
+
 sub fuzzer() {
     my $test_hr = shift;
 
@@ -6133,6 +6221,62 @@ sub altered_hmac_spa_data() {
     return $rv;
 }
 
+sub altered_gcm_tag_spa_data() {
+    my $test_hr = shift;
+
+    my $rv = 1;
+    my $server_was_stopped = 0;
+    my $fw_rule_created = 0;
+    my $fw_rule_removed = 0;
+
+    unless (&_client_send_spa_packet($test_hr, 1, $NO_SERVER_RECEIVE_CHECK)) {
+        &write_test_file("[-] fwknop client execution error.\n",
+            $curr_test_file);
+        $rv = 0;
+    }
+
+    my $spa_pkt = &get_spa_packet_from_file($curr_test_file);
+
+    unless ($spa_pkt) {
+        &write_test_file("[-] could not get SPA packet " .
+            "from file: $curr_test_file\n", $curr_test_file);
+        return 0;
+    }
+
+    ### the GCM tag is at the end of the packet - change one base64 char
+    ### in it (not the last one, which may only carry padding bits)
+    my $tag_char = substr($spa_pkt, -6, 1);
+    substr($spa_pkt, -6, 1) = ($tag_char eq 'A') ? 'B' : 'A';
+
+    my @packets = (
+        {
+            'proto'  => 'udp',
+            'port'   => $default_spa_port,
+            'dst_ip' => $loopback_ip,
+            'data'   => $spa_pkt,
+        },
+    );
+
+    ($rv, $server_was_stopped, $fw_rule_created, $fw_rule_removed)
+        = &client_server_interaction($test_hr, \@packets, $USE_PREDEF_PKTS);
+
+    $rv = 0 unless $server_was_stopped;
+
+    if ($fw_rule_created) {
+        &write_test_file("[-] new fw rule created.\n", $curr_test_file);
+        $rv = 0;
+    } else {
+        &write_test_file("[+] new fw rule not created.\n", $curr_test_file);
+    }
+
+    unless (&file_find_regex([qr/Decryption\sfailed/i],
+            $MATCH_ALL, $APPEND_RESULTS, $server_test_file)) {
+        $rv = 0;
+    }
+
+    return $rv;
+}
+
 sub altered_pkt_hmac_spa_data() {
     my $test_hr = shift;
 
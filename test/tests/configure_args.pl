@@ -95,6 +95,69 @@
         'server_positive_output_matches' => [qr/without execvpe/],
     },
 
+    ### without the OpenSSL AES code the GCM modes must be refused
+    ### up front rather than failing at encrypt/decrypt time
+    {
+        'category' => 'configure args',
+        'subcategory' => 'compile',
+        'detail'   => '--disable-openssl-aes check',
+        'function' => \&configure_args_disable_openssl_aes,
+    },
+    {
+        'category' => 'configure args',
+        'subcategory' => 'server',
+        'detail'   => 'GCM mode not supported',
+        'function' => \&server_conf_files,
+        'fwknopd_cmdline' => "$server_rewrite_conf_files --exit-parse-config",
+        'exec_err' => $YES,
+        'server_access_file' => [
+            "SDP_ID     $sdp_client_id",
+            'SOURCE     any',
+            'KEY        testtest',
+            'ENCRYPTION_MODE    GCM'
+        ],
+        'server_conf_file' => [
+            '### comment'
+        ],
+        'positive_output_matches' => [qr/ENCRYPTION_MODE\s'GCM'\sis\snot\ssupported/],
+    },
+    {
+        'category' => 'configure args',
+        'subcategory' => 'client',
+        'detail'   => 'GCM mode not supported',
+        'function' => \&generic_exec,
+        'cmdline'  => "$default_client_args -M gcm",
+        'exec_err' => $YES,
+        'positive_output_matches' => [qr/mode\sgcm\sis\snot\ssupported/],
+    },
+    {
+        'category' => 'configure args',
+        'subcategory' => 'server',
+        'detail'   => 'GCM_BINARY mode not supported',
+        'function' => \&server_conf_files,
+        'fwknopd_cmdline' => "$server_rewrite_conf_files --exit-parse-config",
+        'exec_err' => $YES,
+        'server_access_file' => [
+            "SDP_ID     $sdp_client_id",
+            'SOURCE     any',
+            'KEY        testtest',
+            'ENCRYPTION_MODE    GCM_BINARY'
+        ],
+        'server_conf_file' => [
+            '### comment'
+        ],
+        'positive_output_matches' => [qr/ENCRYPTION_MODE\s'GCM_BINARY'\sis\snot\ssupported/],
+    },
+    {
+        'category' => 'configure args',
+        'subcategory' => 'client',
+        'detail'   => 'GCM_BINARY mode not supported',
+        'function' => \&generic_exec,
+        'cmdline'  => "$default_client_args -M gcm_binary",
+        'exec_err' => $YES,
+        'positive_output_matches' => [qr/mode\sgcm_binary\sis\snot\ssupported/],
+    },
+
     ### restore original ./configure args to be prepared to run
     ### through the remainder of the tests
     {
@@ -495,6 +495,38 @@
         'fw_rule_created' => $NEW_RULE_REQUIRED,
         'fw_rule_removed' => $NEW_RULE_REMOVED,
     },
+    {
+        'category' => 'Rijndael+HMAC',
+        'subcategory' => 'server',
+        'detail'   => '--pcap-file replayed SPA packet',
+        'function' => \&pcap_file_replay_spa_data,
+        'cmdline'  => $default_client_hmac_args,
+        'fwknopd_cmdline' => "$fwknopdCmd $srv_sdp_options -c $cf{'def'} -a $cf{'hmac_access'} " .
+            "-d $default_digest_file -p $default_pid_file " .
+            "--pcap-file $spa_dup_pcap_file --foreground $verbose_str --verbose",
+        'pcap_ts_offset' => 3600,
+        'server_positive_num_matches' => [
+            { 're' => qr/Replay\sdetected/i, 'num' => 1 },
+        ],
+        'server_negative_output_matches' => [qr/time\sdifference\sis\stoo\sgreat/],
+        'fw_rule_created' => $NEW_RULE_REQUIRED,
+        'fw_rule_removed' => $NEW_RULE_REMOVED,
+        'key_file' => $cf{'rc_hmac_b64_key'},
+    },
+    {
+        'category' => 'Rijndael+HMAC',
+        'subcategory' => 'server',
+        'detail'   => '--pcap-file old SPA packet',
+        'function' => \&pcap_file_replay_spa_data,
+        'cmdline'  => "$default_client_hmac_args --time-offset-minus 3600s",
+        'fwknopd_cmdline' => "$fwknopdCmd $srv_sdp_options -c $cf{'def'} -a $cf{'hmac_access'} " .
+            "-d $default_digest_file -p $default_pid_file " .
+            "--pcap-file $spa_dup_pcap_file --foreground $verbose_str --verbose",
+        'pcap_ts_offset' => 3600,
+        'server_positive_output_matches' => [qr/time\sdifference\sis\stoo\sgreat/],
+        'fw_rule_created' => $REQUIRE_NO_NEW_RULE,
+        'key_file' => $cf{'rc_hmac_b64_key'},
+    },
 
     {
         'category' => 'Rijndael+HMAC',